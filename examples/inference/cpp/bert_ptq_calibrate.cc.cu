@@ -0,0 +1,129 @@
+#include <fstream>
+#include <sstream>
+
+#include "bert_encoder.h"
+#include "quant_calibrator.h"
+#include "util.h"
+
+/**
+@file
+Post-training quantization of a float Bert hdf5 into a QuantBert hdf5 ready
+to serve: the float model runs over the calibration set twice, for the
+absmax and then the histogram of the activations of every layer which
+QuantBert quantizes, both collected on the gpu, see quant_calibrator.h.
+
+Usage:
+  bert_ptq_calibrate bert.hdf5 calib.txt quant_bert.hdf5
+      [entropy|percentile|mse|max] [percentile 99.99] [num_bins 2048]
+
+Every line of calib.txt is one sentence of space separated token ids, run
+alone so that no padding gets into the histograms.
+*/
+
+// Appoint precision.
+const lightseq::cuda::OperationType optype =
+    lightseq::cuda::OperationType::FP32;
+
+int main(int argc, char *argv[]) {
+  if (argc < 4) {
+    std::cout << "Usage: bert_ptq_calibrate bert.hdf5 calib.txt "
+                 "quant_bert.hdf5 [method] [percentile] [num_bins]"
+              << std::endl;
+    return 1;
+  }
+  std::string model_weights_path = argv[1];
+  std::string calib_path = argv[2];
+  std::string quant_weights_path = argv[3];
+  lightseq::cuda::CalibMethod method = lightseq::cuda::calib_method_from_name(
+      argc > 4 ? argv[4] : "entropy");
+  float percentile = argc > 5 ? atof(argv[5]) : 99.99f;
+  int num_bins = argc > 6 ? atoi(argv[6]) : 2048;
+  if (!lightseq::cuda::endswith(model_weights_path, ".hdf5")) {
+    std::cout << "the float model should be a .hdf5" << std::endl;
+    return 1;
+  }
+
+  /* ---step1. init environment--- */
+  cudaStream_t stream_;
+  cublasHandle_t hd_;
+  cudaSetDevice(0);
+  cudaStreamCreate(&stream_);
+  cublasCreate(&hd_);
+  cublasSetStream(hd_, stream_);
+  typedef lightseq::cuda::OperationTypeTraits<optype> optraits;
+
+  /* ---step2. load the float model and the calibration set--- */
+  lightseq::cuda::BertWeight<optype> tw_;
+  std::string res = tw_.initializing(model_weights_path);
+  if (!res.empty()) {
+    std::cout << res << std::endl;
+    return 1;
+  }
+
+  std::vector<std::vector<int>> calib_set;
+  std::ifstream calib_file(calib_path);
+  std::string line;
+  while (std::getline(calib_file, line)) {
+    std::istringstream tokens(line);
+    std::vector<int> sentence;
+    int token;
+    while (tokens >> token && sentence.size() < tw_._max_step) {
+      sentence.push_back(token);
+    }
+    if (!sentence.empty()) calib_set.push_back(sentence);
+  }
+  if (calib_set.empty()) {
+    std::cout << "no sentence in " << calib_path << std::endl;
+    return 1;
+  }
+  std::cout << "calibrating with " << calib_set.size() << " sentences"
+            << std::endl;
+
+  /* ---step3. instantiate the encoder with the activation observer--- */
+  thrust::device_vector<int> d_input_ = std::vector<int>(tw_._max_step, 0);
+  thrust::device_vector<int> d_padding_mask_ =
+      std::vector<int>(tw_._max_step, 0);
+  thrust::device_vector<optraits::DataType> d_encoder_output_ =
+      std::vector<optraits::DataType>(tw_._max_step * tw_._hidden_size,
+                                      (optraits::DataType)0.0);
+  lightseq::cuda::BertEncoder<optype> encoder_(
+      1, thrust::raw_pointer_cast(d_input_.data()),
+      thrust::raw_pointer_cast(d_padding_mask_.data()),
+      thrust::raw_pointer_cast(d_encoder_output_.data()), tw_, stream_, hd_);
+  res = encoder_.check();
+  if (!res.empty()) {
+    std::cout << res << std::endl;
+    return 1;
+  }
+  thrust::device_vector<int> d_buf_ =
+      std::vector<int>(encoder_.compute_buffer_bytesize() / sizeof(int), 0);
+  encoder_.init_buffer(thrust::raw_pointer_cast(d_buf_.data()));
+
+  // the 7 activations of every layer, from multihead_ln_clip_max on
+  lightseq::cuda::HistogramCalibrator calibrator(tw_._n_enc_layer * 7, stream_,
+                                                 num_bins);
+  encoder_.set_activation_observer([&](int layer_id, int clip_id,
+                                      const optraits::DataType *act,
+                                      int size) {
+    calibrator.collect(layer_id * 7 + clip_id - 4, act, size);
+  });
+
+  /* ---step4. the absmax pass, then the histogram pass--- */
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1 && method == lightseq::cuda::CalibMethod::kMax) break;
+    if (pass == 1) calibrator.start_histogram();
+    for (const std::vector<int> &sentence : calib_set) {
+      thrust::copy(sentence.begin(), sentence.end(), d_input_.begin());
+      encoder_.run_one_infer(1, sentence.size());
+    }
+    cudaStreamSynchronize(stream_);
+  }
+
+  /* ---step5. pick the clip max and write the quant model--- */
+  std::vector<float> act_clip_max =
+      calibrator.compute_amax(method, percentile);
+  lightseq::cuda::write_quant_bert_hdf5(model_weights_path, quant_weights_path,
+                                        act_clip_max);
+  std::cout << "quant model written into " << quant_weights_path << std::endl;
+  return 0;
+}
@@ -11,6 +11,7 @@ import torch
 from lightseq.training.ops.pytorch.export_quant import (
     export_ls_quant_encoder,
     fill_quant_hdf5_layer,
+    pack_ls_quant_encoder,
     quantize,
 )
 from export.util import parse_args
@@ -47,6 +48,7 @@ def extract_gpt_weights(
     pad_id=50257,
     max_step=50,
     extra_decode_length=0,
+    pack_sm=0,
 ):
     # load var names
     with open(os.path.join(os.path.dirname(model_dir), "config.json")) as f:
@@ -68,6 +70,8 @@ def extract_gpt_weights(
             layer_nums += 1
 
     export_ls_quant_encoder(hdf5_file, state_dict, emb_dim, emb_dim * 4, False, True)
+    if pack_sm > 0:
+        pack_ls_quant_encoder(hdf5_file, layer_nums, pack_sm)
 
     # fill src_embedding - except for position embedding
     fill_quant_hdf5_layer(
@@ -132,7 +136,7 @@ def extract_gpt_weights(
     hdf5_file = h5py.File(output_file, "r")
 
     def _print_pair(key, value):
-        if key == "sampling_method":
+        if key in ("sampling_method", "int8_weight_layout"):
             value = "".join(map(chr, value[()]))
         else:
             value = value[()]
@@ -166,4 +170,5 @@ if __name__ == "__main__":
         pad_id=pad_id,
         max_step=max_step,
         extra_decode_length=extra_decode_length,
+        pack_sm=args.pack_sm,
     )
@@ -30,6 +30,13 @@ def parse_args():
         choices=["beam_search", "topk_greedy", "topk", "topp", "ppl"],
         help="generation method",
     )
+    parser.add_argument(
+        "--pack_sm",
+        type=int,
+        default=0,
+        help="prepack the int8 kernels of quant models for gpus of this sm "
+        "version, eg. 75 or 80, instead of transforming them at every load",
+    )
     args = parser.parse_args()
     return args
 
@@ -1,6 +1,7 @@
 import time
 import argparse
 
+import numpy as np
 import torch
 import lightseq.inference as lsi
 from transformers import GPT2Tokenizer, GPT2LMHeadModel
@@ -91,6 +92,25 @@ def ls_ppl(model, tokenizer, inputs):
     print(ls_ppl)
 
 
+def ls_ppl_packed(model, tokenizer, sentences):
+    print("=========lightseq packed=========")
+    print("lightseq calculating ppl of packed inputs...")
+    seqs = [tokenizer(sent)["input_ids"] for sent in sentences]
+    tokens = np.concatenate(seqs).astype(np.int32)
+    offsets = np.cumsum([0] + [len(seq) for seq in seqs]).astype(np.int32)
+    torch.cuda.synchronize()
+    start_time = time.perf_counter()
+    ls_ppl, token_log_probs = model.ppl_packed(
+        tokens, offsets, return_token_log_probs=True
+    )
+    torch.cuda.synchronize()
+    ls_time = time.perf_counter() - start_time
+    print(f"lightseq time: {ls_time}s")
+    print("lightseq results:")
+    print(ls_ppl)
+    print(f"token log probs of the first sentence: {token_log_probs[:offsets[1]]}")
+
+
 def hf_ppl(model, tokenizer, inputs):
     print("=========huggingface=========")
     print("huggingface calculating ppl...")
@@ -111,6 +131,7 @@ def warmup(
         hf_generate(hf_model, hf_tokenizer, hf_inputs)
     elif generation_method == "ppl":
         ls_ppl(ls_model, ls_tokenizer, ls_inputs)
+        ls_ppl_packed(ls_model, ls_tokenizer, sentences)
         hf_ppl(hf_model, hf_tokenizer, hf_inputs)
 
 
@@ -185,6 +206,7 @@ def main():
             hf_generate(hf_model, hf_tokenizer, hf_inputs)
         elif args.generation_method == "ppl":
             ls_ppl(ls_model, ls_tokenizer, ls_inputs)
+            ls_ppl_packed(ls_model, ls_tokenizer, sentences)
             hf_ppl(hf_model, hf_tokenizer, hf_inputs)
 
         if not args.user_input:
@@ -31,7 +31,8 @@ int main(int argc, char* argv[]) {
   }
 
   auto model = lightseq::cuda::LSModelFactory::GetInstance().CreateModel(
-      "Bert", model_weights_path, max_batch_size);
+      "Bert", model_weights_path, max_batch_size, lightseq::cuda::kNotSupported,
+      lightseq::cuda::model_options_from_env());
 
   void* d_input;
   CHECK_GPU_ERROR(
@@ -29,7 +29,8 @@ int main(int argc, char* argv[]) {
   }
 
   auto model = lightseq::cuda::LSModelFactory::GetInstance().CreateModel(
-      "Gpt", model_weights_path, max_batch_size);
+      "Gpt", model_weights_path, max_batch_size, lightseq::cuda::kNotSupported,
+      lightseq::cuda::model_options_from_env());
 
   void* d_input;
   CHECK_GPU_ERROR(
@@ -30,7 +30,8 @@ int main(int argc, char* argv[]) {
   }
 
   auto model = lightseq::cuda::LSModelFactory::GetInstance().CreateModel(
-      "Llama", model_weights_path, 1);
+      "Llama", model_weights_path, 1, lightseq::cuda::kNotSupported,
+      lightseq::cuda::model_options_from_env());
 
   void* d_input;
   CHECK_GPU_ERROR(
@@ -0,0 +1,452 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "model_base.h"
+#include "gpt.h"
+#include "llama.h"
+
+/**
+@file
+Serving benchmark of the generative models of LSModelFactory.
+
+Requests arrive with a poisson or burst process at --rate requests per
+second, with the lengths of the (prompt_len, output_len) lines of --trace or
+the fixed --prompt_len and --output_len, at most --concurrency in flight. They
+are served either by dynamic batching, the waiting requests are batched into
+one Infer, or by continuous batching, the requests join and leave the running
+batch at every step(), see LSModel::add_request.
+
+Reports the throughput, the time to first token, the inter-token latency, the
+end to end latency and the peak gpu memory, and writes them to --json.
+
+Usage:
+  serving_benchmark --weights model.hdf5 [--model Llama]
+      [--mode continuous|dynamic] [--max_batch_size 8] [--num_requests 100]
+      [--arrival poisson|burst] [--rate 4] [--burst_size 8] [--concurrency 0]
+      [--trace lengths.txt] [--prompt_len 128] [--output_len 128]
+      [--batch_wait_ms 0] [--pad_id 0] [--seed 1] [--json result.json]
+
+--rate 0 sends all the requests at once. Continuous batching needs the paged
+kv cache, e.g. LIGHTSEQ_KV_PAGE_SIZE=16.
+*/
+
+namespace {
+
+struct Options {
+  std::string model = "Llama";
+  std::string weights;
+  std::string mode = "continuous";
+  std::string arrival = "poisson";
+  std::string trace;
+  std::string json;
+  int max_batch_size = 8;
+  int num_requests = 100;
+  int burst_size = 8;
+  int concurrency = 0;
+  int prompt_len = 128;
+  int output_len = 128;
+  int pad_id = 0;
+  int seed = 1;
+  double rate = 4;
+  double batch_wait_ms = 0;
+};
+
+Options parse_options(int argc, char* argv[]) {
+  Options opt;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string key = argv[i], value = argv[i + 1];
+    if (key == "--model") {
+      opt.model = value;
+    } else if (key == "--weights") {
+      opt.weights = value;
+    } else if (key == "--mode") {
+      opt.mode = value;
+    } else if (key == "--arrival") {
+      opt.arrival = value;
+    } else if (key == "--trace") {
+      opt.trace = value;
+    } else if (key == "--json") {
+      opt.json = value;
+    } else if (key == "--max_batch_size") {
+      opt.max_batch_size = std::stoi(value);
+    } else if (key == "--num_requests") {
+      opt.num_requests = std::stoi(value);
+    } else if (key == "--burst_size") {
+      opt.burst_size = std::max(1, std::stoi(value));
+    } else if (key == "--concurrency") {
+      opt.concurrency = std::stoi(value);
+    } else if (key == "--prompt_len") {
+      opt.prompt_len = std::stoi(value);
+    } else if (key == "--output_len") {
+      opt.output_len = std::stoi(value);
+    } else if (key == "--pad_id") {
+      opt.pad_id = std::stoi(value);
+    } else if (key == "--seed") {
+      opt.seed = std::stoi(value);
+    } else if (key == "--rate") {
+      opt.rate = std::stod(value);
+    } else if (key == "--batch_wait_ms") {
+      opt.batch_wait_ms = std::stod(value);
+    } else {
+      throw std::runtime_error("unknown option " + key);
+    }
+  }
+  if (opt.weights.empty()) {
+    throw std::runtime_error("--weights is required");
+  }
+  if (opt.mode != "continuous" && opt.mode != "dynamic") {
+    throw std::runtime_error("--mode must be continuous or dynamic");
+  }
+  if (opt.arrival != "poisson" && opt.arrival != "burst") {
+    throw std::runtime_error("--arrival must be poisson or burst");
+  }
+  return opt;
+}
+
+struct Request {
+  double arrival = 0;  // the time it is sent, in seconds since the start
+  std::vector<int> prompt;
+  int output_len = 0;
+  std::vector<double> token_times;
+  double finish = -1;
+};
+
+using Clock = std::chrono::steady_clock;
+const Clock::time_point kStart = Clock::now();
+
+double now() {
+  return std::chrono::duration<double>(Clock::now() - kStart).count();
+}
+
+void sleep_until(double t) {
+  double wait = t - now();
+  if (wait > 0) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+  }
+}
+
+// the arrival times and the lengths of the requests, the prompts are random
+// tokens out of the special ones.
+std::vector<Request> make_requests(const Options& opt) {
+  std::vector<std::pair<int, int>> lengths;
+  if (!opt.trace.empty()) {
+    std::ifstream fin(opt.trace);
+    if (!fin.is_open()) {
+      throw std::runtime_error("failed to open trace " + opt.trace);
+    }
+    int prompt_len, output_len;
+    while (fin >> prompt_len >> output_len) {
+      lengths.emplace_back(std::max(1, prompt_len), std::max(1, output_len));
+    }
+    if (lengths.empty()) {
+      throw std::runtime_error("no (prompt_len, output_len) in " + opt.trace);
+    }
+  } else {
+    lengths.emplace_back(opt.prompt_len, opt.output_len);
+  }
+
+  std::mt19937 gen(opt.seed);
+  std::exponential_distribution<double> gap(opt.rate > 0 ? opt.rate : 1);
+  std::uniform_int_distribution<int> pick(0, lengths.size() - 1);
+  std::uniform_int_distribution<int> token(100, 30000);
+  std::vector<Request> requests(opt.num_requests);
+  double t = 0;
+  for (int i = 0; i < opt.num_requests; i++) {
+    if (opt.rate > 0) {
+      if (opt.arrival == "poisson") {
+        t += gap(gen);
+      } else if (i % opt.burst_size == 0 && i > 0) {
+        // the bursts keep the mean rate.
+        t += opt.burst_size / opt.rate;
+      }
+    }
+    const std::pair<int, int>& len = lengths[pick(gen)];
+    requests[i].arrival = t;
+    requests[i].output_len = len.second;
+    for (int j = 0; j < len.first; j++) {
+      requests[i].prompt.push_back(token(gen));
+    }
+  }
+  return requests;
+}
+
+size_t gpu_memory_used() {
+  size_t free_bytes, total_bytes;
+  CHECK_GPU_ERROR(cudaMemGetInfo(&free_bytes, &total_bytes));
+  return total_bytes - free_bytes;
+}
+
+/*
+Sends the requests at their arrival times, at most concurrency of them in
+flight. A request held back by the concurrency is sent, and its latencies
+counted, once an earlier one finishes.
+*/
+class LoadGenerator {
+ public:
+  LoadGenerator(std::vector<Request>& requests, int concurrency)
+      : _requests(requests), _concurrency(concurrency) {}
+
+  // the requests sent until now.
+  std::vector<int> send() {
+    std::vector<int> sent;
+    double t = now();
+    while (_next < _requests.size() && _requests[_next].arrival <= t &&
+           (_concurrency <= 0 || _in_flight < _concurrency)) {
+      _requests[_next].arrival = std::max(_requests[_next].arrival,
+                                          _last_finish);
+      sent.push_back(_next++);
+      _in_flight++;
+    }
+    return sent;
+  }
+
+  void finish(int idx, double t) {
+    _requests[idx].finish = t;
+    _last_finish = t;
+    _in_flight--;
+    _done++;
+  }
+
+  // wait for the next request when nothing is in flight.
+  void wait() {
+    if (_next < _requests.size()) sleep_until(_requests[_next].arrival);
+  }
+
+  bool done() const { return _done == _requests.size(); }
+
+ private:
+  std::vector<Request>& _requests;
+  int _concurrency;
+  size_t _next = 0;
+  size_t _done = 0;
+  int _in_flight = 0;
+  double _last_finish = 0;
+};
+
+// Continuous batching, the requests join the running batch as they arrive.
+size_t serve_continuous(lightseq::cuda::LSModel* model,
+                        std::vector<Request>& requests, int concurrency) {
+  LoadGenerator load(requests, concurrency);
+  std::map<int, int> request_of_id;
+  size_t peak_memory = 0;
+  while (!load.done()) {
+    for (int idx : load.send()) {
+      int id = model->add_request(requests[idx].prompt,
+                                  requests[idx].output_len);
+      request_of_id[id] = idx;
+    }
+    if (!model->has_pending_requests()) {
+      load.wait();
+      continue;
+    }
+    std::vector<std::pair<int, std::vector<int>>> finished = model->step();
+    double t = now();
+    for (const std::pair<int, int>& id_token : model->last_step_tokens()) {
+      requests[request_of_id.at(id_token.first)].token_times.push_back(t);
+    }
+    for (const auto& id_tokens : finished) {
+      load.finish(request_of_id.at(id_tokens.first), t);
+      request_of_id.erase(id_tokens.first);
+    }
+    peak_memory = std::max(peak_memory, gpu_memory_used());
+  }
+  return peak_memory;
+}
+
+// Dynamic batching, the waiting requests are left padded into one Infer,
+// which returns when its longest sequence ends.
+size_t serve_dynamic(lightseq::cuda::LSModel* model,
+                     std::vector<Request>& requests, const Options& opt) {
+  std::vector<int> input_max_shape = model->get_input_max_shape(0);
+  int max_batch_size = std::min(opt.max_batch_size, input_max_shape[0]);
+  void* d_input;
+  CHECK_GPU_ERROR(cudaMalloc(
+      &d_input, sizeof(int) * input_max_shape[0] * input_max_shape[1]));
+  model->set_input_ptr(0, d_input);
+  std::vector<void*> d_outputs;
+  for (int i = 0; i < model->get_output_size(); i++) {
+    std::vector<int> shape = model->get_output_max_shape(i);
+    size_t total_size = 1;
+    for (int dim : shape) total_size *= dim;
+    void* d_output;
+    CHECK_GPU_ERROR(cudaMalloc(&d_output, total_size * sizeof(int)));
+    model->set_output_ptr(i, d_output);
+    d_outputs.push_back(d_output);
+  }
+
+  // the tokens of every step are streamed to the requests of the batch.
+  std::vector<int> batch;
+  bool streaming = true;
+  try {
+    model->set_token_callback([&](int step, const std::vector<int>& tokens) {
+      double t = now();
+      for (size_t row = 0; row < batch.size() && row < tokens.size(); row++) {
+        Request& request = requests[batch[row]];
+        if (step < request.output_len) request.token_times.push_back(t);
+      }
+    });
+  } catch (std::exception& e) {
+    printf("%s, only the end to end latency is reported\n", e.what());
+    streaming = false;
+  }
+
+  LoadGenerator load(requests, opt.concurrency);
+  std::vector<int> waiting;
+  size_t peak_memory = 0;
+  while (!load.done()) {
+    for (int idx : load.send()) waiting.push_back(idx);
+    if (waiting.empty()) {
+      load.wait();
+      continue;
+    }
+    // the batch waits up to batch_wait_ms for more requests.
+    if (int(waiting.size()) < max_batch_size &&
+        now() < requests[waiting[0]].arrival + opt.batch_wait_ms * 1e-3) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+      continue;
+    }
+    int batch_size = std::min(int(waiting.size()), max_batch_size);
+    batch.assign(waiting.begin(), waiting.begin() + batch_size);
+    waiting.erase(waiting.begin(), waiting.begin() + batch_size);
+
+    int seq_len = 0;
+    for (int idx : batch) {
+      seq_len = std::max(seq_len, int(requests[idx].prompt.size()));
+    }
+    std::vector<int> host_input(batch_size * seq_len, opt.pad_id);
+    for (int row = 0; row < batch_size; row++) {
+      const std::vector<int>& prompt = requests[batch[row]].prompt;
+      std::copy(prompt.begin(), prompt.end(),
+                host_input.begin() + (row + 1) * seq_len - prompt.size());
+    }
+    CHECK_GPU_ERROR(cudaMemcpy(d_input, host_input.data(),
+                               sizeof(int) * host_input.size(),
+                               cudaMemcpyHostToDevice));
+    model->set_input_shape(0, {batch_size, seq_len});
+    model->Infer();
+    double t = now();
+    for (int idx : batch) {
+      if (!streaming) requests[idx].token_times.push_back(t);
+      load.finish(idx, t);
+    }
+    batch.clear();
+    peak_memory = std::max(peak_memory, gpu_memory_used());
+  }
+
+  if (streaming) model->set_token_callback(nullptr);
+  CHECK_GPU_ERROR(cudaFree(d_input));
+  for (void* d_output : d_outputs) CHECK_GPU_ERROR(cudaFree(d_output));
+  return peak_memory;
+}
+
+double percentile(std::vector<double> values, double p) {
+  if (values.empty()) return 0;
+  std::sort(values.begin(), values.end());
+  size_t rank = std::min(values.size() - 1, size_t(p * values.size()));
+  return values[rank];
+}
+
+struct Metric {
+  const char* name;
+  std::vector<double> values_ms;
+};
+
+void report(const Options& opt, const std::vector<Request>& requests,
+            double duration, size_t model_memory, size_t peak_memory) {
+  Metric ttft{"ttft", {}}, itl{"itl", {}}, e2e{"e2e", {}};
+  size_t output_tokens = 0;
+  for (const Request& request : requests) {
+    output_tokens += request.token_times.size();
+    e2e.values_ms.push_back((request.finish - request.arrival) * 1e3);
+    if (request.token_times.empty()) continue;
+    ttft.values_ms.push_back((request.token_times[0] - request.arrival) * 1e3);
+    for (size_t i = 1; i < request.token_times.size(); i++) {
+      itl.values_ms.push_back(
+          (request.token_times[i] - request.token_times[i - 1]) * 1e3);
+    }
+  }
+  double req_per_s = requests.size() / duration;
+  double tokens_per_s = output_tokens / duration;
+  double mib = 1.0 / (1 << 20);
+
+  printf("%s batching, %zu requests in %.2f s\n", opt.mode.c_str(),
+         requests.size(), duration);
+  printf("throughput: %.2f requests/s, %.1f output tokens/s\n", req_per_s,
+         tokens_per_s);
+  for (const Metric* metric : {&ttft, &itl, &e2e}) {
+    printf("%-4s p50 %10.2f ms, p99 %10.2f ms\n", metric->name,
+           percentile(metric->values_ms, 0.5),
+           percentile(metric->values_ms, 0.99));
+  }
+  printf("gpu memory: %.0f MiB after loading, %.0f MiB peak\n",
+         model_memory * mib, peak_memory * mib);
+
+  if (opt.json.empty()) return;
+  FILE* fp = fopen(opt.json.c_str(), "w");
+  if (fp == nullptr) {
+    throw std::runtime_error("failed to open " + opt.json);
+  }
+  fprintf(fp, "{\n  \"model\": \"%s\",\n  \"mode\": \"%s\",\n",
+          opt.model.c_str(), opt.mode.c_str());
+  fprintf(fp, "  \"arrival\": \"%s\",\n  \"rate\": %g,\n",
+          opt.arrival.c_str(), opt.rate);
+  fprintf(fp, "  \"concurrency\": %d,\n  \"max_batch_size\": %d,\n",
+          opt.concurrency, opt.max_batch_size);
+  fprintf(fp, "  \"num_requests\": %zu,\n  \"duration_s\": %.3f,\n",
+          requests.size(), duration);
+  fprintf(fp, "  \"requests_per_s\": %.3f,\n  \"tokens_per_s\": %.2f,\n",
+          req_per_s, tokens_per_s);
+  for (const Metric* metric : {&ttft, &itl, &e2e}) {
+    fprintf(fp, "  \"%s_p50_ms\": %.3f,\n  \"%s_p99_ms\": %.3f,\n",
+            metric->name, percentile(metric->values_ms, 0.5), metric->name,
+            percentile(metric->values_ms, 0.99));
+  }
+  fprintf(fp, "  \"model_memory_mib\": %.1f,\n  \"peak_memory_mib\": %.1f\n}\n",
+          model_memory * mib, peak_memory * mib);
+  fclose(fp);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  try {
+    Options opt = parse_options(argc, argv);
+    std::vector<Request> requests = make_requests(opt);
+    auto model = lightseq::cuda::LSModelFactory::GetInstance().CreateModel(
+        opt.model, opt.weights, opt.max_batch_size,
+        lightseq::cuda::kNotSupported,
+        lightseq::cuda::model_options_from_env());
+    size_t model_memory = gpu_memory_used();
+
+    // one request warms up the kernels and the memory plan, then the clock
+    // restarts with the first arrival.
+    std::vector<Request> warmup(1, requests[0]);
+    warmup[0].arrival = 0;
+    double start;
+    size_t peak_memory;
+    if (opt.mode == "continuous") {
+      serve_continuous(model, warmup, 0);
+      start = now();
+      for (Request& request : requests) request.arrival += start;
+      peak_memory = serve_continuous(model, requests, opt.concurrency);
+    } else {
+      serve_dynamic(model, warmup, opt);
+      start = now();
+      for (Request& request : requests) request.arrival += start;
+      peak_memory = serve_dynamic(model, requests, opt);
+    }
+    report(opt, requests, now() - start, model_memory, peak_memory);
+    delete model;
+  } catch (std::exception& e) {
+    printf("Error! %s\n", e.what());
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,406 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cuda_util.h"
+#include "model_base.h"
+#include "traffic_capture.h"
+
+/**
+@file
+Deterministic replay of a traffic log captured in production, see
+CaptureModel: every recorded Infer, add_request and encode_packed is sent to
+the model at its recorded arrival time, scaled by --speed, with its recorded
+inputs. The Infer and encode_packed calls run in the order of arrival, the
+add_request ones join the continuous batch stepped in between, so a request
+waits for the ones before it as it did in production.
+
+Reports the throughput and the latency percentiles of the replay, from the
+arrival to the return, or to the step() which finished the request, next to
+the recorded ones of the same requests and their deltas, and writes them to
+--json. With --baseline, the json of an earlier replay, eg. before a kernel
+or scheduler change, the deltas to it are reported too.
+
+Usage:
+  traffic_replay --weights model.hdf5 --log traffic.bin [--model Bert]
+      [--max_batch_size 8] [--speed 1] [--json result.json]
+      [--baseline before.json]
+*/
+
+namespace {
+
+using lightseq::cuda::LSModel;
+using lightseq::cuda::TrafficKind;
+using lightseq::cuda::TrafficRecord;
+
+struct Options {
+  std::string model = "Bert";
+  std::string weights;
+  std::string log;
+  std::string json;
+  std::string baseline;
+  int max_batch_size = 8;
+  double speed = 1;
+};
+
+Options parse_options(int argc, char* argv[]) {
+  Options opt;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string key = argv[i], value = argv[i + 1];
+    if (key == "--model") {
+      opt.model = value;
+    } else if (key == "--weights") {
+      opt.weights = value;
+    } else if (key == "--log") {
+      opt.log = value;
+    } else if (key == "--json") {
+      opt.json = value;
+    } else if (key == "--baseline") {
+      opt.baseline = value;
+    } else if (key == "--max_batch_size") {
+      opt.max_batch_size = std::stoi(value);
+    } else if (key == "--speed") {
+      opt.speed = std::stod(value);
+    } else {
+      throw std::runtime_error("unknown option " + key);
+    }
+  }
+  if (opt.weights.empty() || opt.log.empty()) {
+    throw std::runtime_error("--weights and --log are required");
+  }
+  if (opt.speed <= 0) {
+    throw std::runtime_error("--speed must be positive");
+  }
+  return opt;
+}
+
+using Clock = std::chrono::steady_clock;
+const Clock::time_point kStart = Clock::now();
+
+double now() {
+  return std::chrono::duration<double>(Clock::now() - kStart).count();
+}
+
+void sleep_until(double t) {
+  double wait = t - now();
+  if (wait > 0) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+  }
+}
+
+size_t data_type_size(lightseq::cuda::DataType dtype) {
+  switch (dtype) {
+    case lightseq::cuda::kInt8:
+    case lightseq::cuda::kByte:
+    case lightseq::cuda::kUInt8:
+      return 1;
+    case lightseq::cuda::kFloat16:
+    case lightseq::cuda::kBFloat16:
+    case lightseq::cuda::kInt16:
+    case lightseq::cuda::kUInt16:
+      return 2;
+    case lightseq::cuda::kInt64:
+    case lightseq::cuda::kUInt64:
+    case lightseq::cuda::kFloat64:
+      return 8;
+    default:
+      return 4;
+  }
+}
+
+size_t shape_size(const std::vector<int>& shape) {
+  size_t res = 1;
+  for (int dim : shape) res *= dim;
+  return res;
+}
+
+// The device buffers of the inputs and the outputs of model, of their max
+// shapes.
+class ModelBuffers {
+ public:
+  explicit ModelBuffers(LSModel* model) : _model(model) {
+    for (int i = 0; i < model->get_input_size(); i++) {
+      _input_bytes.push_back(shape_size(model->get_input_max_shape(i)) *
+                             data_type_size(model->get_input_dtype(i)));
+      _inputs.push_back(malloc_device(_input_bytes.back()));
+      model->set_input_ptr(i, _inputs.back());
+    }
+    for (int i = 0; i < model->get_output_size(); i++) {
+      _outputs.push_back(
+          malloc_device(shape_size(model->get_output_max_shape(i)) *
+                        data_type_size(model->get_output_dtype(i))));
+      model->set_output_ptr(i, _outputs.back());
+    }
+  }
+  ~ModelBuffers() {
+    for (void* buffer : _inputs) CHECK_GPU_ERROR(cudaFree(buffer));
+    for (void* buffer : _outputs) CHECK_GPU_ERROR(cudaFree(buffer));
+  }
+
+  // false if the inputs of the record do not fit the model.
+  bool set_inputs(const TrafficRecord& record) {
+    if (record.tensors.size() != _inputs.size()) return false;
+    for (size_t i = 0; i < _inputs.size(); i++) {
+      if (record.tensors[i].data.size() > _input_bytes[i]) return false;
+    }
+    for (size_t i = 0; i < _inputs.size(); i++) {
+      const std::vector<char>& data = record.tensors[i].data;
+      CHECK_GPU_ERROR(cudaMemcpy(_inputs[i], data.data(), data.size(),
+                                 cudaMemcpyHostToDevice));
+      _model->set_input_shape(i, record.tensors[i].shape);
+    }
+    return true;
+  }
+
+  void* output(int index) { return _outputs[index]; }
+
+ private:
+  void* malloc_device(size_t bytes) {
+    void* buffer;
+    CHECK_GPU_ERROR(cudaMalloc(&buffer, std::max(bytes, size_t(1))));
+    return buffer;
+  }
+
+  LSModel* _model;
+  std::vector<void*> _inputs;
+  std::vector<size_t> _input_bytes;
+  std::vector<void*> _outputs;
+};
+
+struct Request {
+  const TrafficRecord* record;
+  double arrival = 0;  // the scheduled arrival, in seconds since the start
+  double finish = -1;
+};
+
+int num_tokens(const TrafficRecord& record) {
+  if (record.tensors.empty()) return 0;
+  return shape_size(record.tensors[0].shape);
+}
+
+// Run a blocking record, false if it does not fit the model.
+bool run_blocking(LSModel* model, ModelBuffers& buffers,
+                  const TrafficRecord& record) {
+  if (record.kind == TrafficKind::kInfer) {
+    if (!buffers.set_inputs(record)) return false;
+    model->Infer();
+    return true;
+  }
+  if (record.tensors.size() != 2) return false;
+  const int* tokens = (const int*)record.tensors[0].data.data();
+  const int* offsets = (const int*)record.tensors[1].data.data();
+  int num_seqs = record.tensors[1].shape[0] - 1;
+  model->encode_packed(tokens, offsets, num_seqs, buffers.output(0));
+  return true;
+}
+
+int add_request(LSModel* model, const TrafficRecord& record) {
+  const int* prompt = (const int*)record.tensors[0].data.data();
+  std::vector<int> tokens(prompt, prompt + num_tokens(record));
+  const std::vector<int>& params = record.params;
+  return model->add_request(tokens, params.at(0), params.at(1), params.at(2),
+                            params.at(3));
+}
+
+/*
+Sends the requests at their arrival times; a blocking call runs once the
+earlier ones returned, the continuous batch is stepped whenever no blocking
+call is waiting. Returns the requests skipped as they do not fit the model.
+*/
+size_t replay(LSModel* model, ModelBuffers& buffers,
+              std::vector<Request>& requests) {
+  std::vector<size_t> waiting;
+  std::map<int, size_t> request_of_id;
+  size_t next = 0, done = 0, skipped = 0;
+  while (done + skipped < requests.size()) {
+    double t = now();
+    for (; next < requests.size() && requests[next].arrival <= t; next++) {
+      if (requests[next].record->kind == TrafficKind::kAddRequest) {
+        request_of_id[add_request(model, *requests[next].record)] = next;
+      } else {
+        waiting.push_back(next);
+      }
+    }
+    if (!waiting.empty()) {
+      Request& request = requests[waiting.front()];
+      waiting.erase(waiting.begin());
+      if (run_blocking(model, buffers, *request.record)) {
+        request.finish = now();
+        done++;
+      } else {
+        skipped++;
+      }
+      continue;
+    }
+    if (model->has_pending_requests()) {
+      std::vector<std::pair<int, std::vector<int>>> finished = model->step();
+      double t = now();
+      for (const auto& id_tokens : finished) {
+        requests[request_of_id.at(id_tokens.first)].finish = t;
+        request_of_id.erase(id_tokens.first);
+        done++;
+      }
+      for (int request_id : model->last_step_evicted()) {
+        request_of_id.erase(request_id);
+        done++;
+      }
+      continue;
+    }
+    if (next < requests.size()) {
+      sleep_until(requests[next].arrival);
+    } else if (!request_of_id.empty()) {
+      throw std::runtime_error("requests left without pending steps");
+    }
+  }
+  return skipped;
+}
+
+double percentile(std::vector<double> values, double p) {
+  if (values.empty()) return 0;
+  std::sort(values.begin(), values.end());
+  size_t rank = std::min(values.size() - 1, size_t(p * values.size()));
+  return values[rank];
+}
+
+// the numbers of a flat json object, eg. an earlier replay.
+std::map<std::string, double> read_json_numbers(const std::string& path) {
+  std::ifstream fin(path);
+  if (!fin.is_open()) {
+    throw std::runtime_error("failed to open " + path);
+  }
+  std::stringstream buffer;
+  buffer << fin.rdbuf();
+  std::string text = buffer.str();
+  std::map<std::string, double> numbers;
+  size_t pos = 0;
+  while ((pos = text.find('"', pos)) != std::string::npos) {
+    size_t end = text.find('"', pos + 1);
+    if (end == std::string::npos) break;
+    std::string key = text.substr(pos + 1, end - pos - 1);
+    size_t colon = text.find_first_not_of(" \t\n", end + 1);
+    pos = end + 1;
+    if (colon == std::string::npos || text[colon] != ':') continue;
+    const char* value = text.c_str() + colon + 1;
+    char* value_end;
+    double number = strtod(value, &value_end);
+    if (value_end != value) numbers[key] = number;
+  }
+  return numbers;
+}
+
+struct Metric {
+  const char* name;
+  double value;
+  double recorded;  // negative if not recorded
+};
+
+void report(const Options& opt, const std::vector<Request>& requests,
+            size_t skipped, double duration) {
+  std::vector<double> replay_ms, recorded_ms;
+  size_t tokens = 0;
+  for (const Request& request : requests) {
+    if (request.finish < 0) continue;
+    tokens += num_tokens(*request.record);
+    replay_ms.push_back((request.finish - request.arrival) * 1e3);
+    if (request.record->latency_ms >= 0) {
+      recorded_ms.push_back(request.record->latency_ms);
+    }
+  }
+  size_t served = replay_ms.size();
+  double recorded_span =
+      requests.empty() ? 0
+                       : requests.back().record->arrival_s -
+                             requests.front().record->arrival_s;
+  std::vector<Metric> metrics = {
+      {"requests_per_s", served / duration,
+       recorded_span > 0 ? served / recorded_span : -1},
+      {"input_tokens_per_s", tokens / duration,
+       recorded_span > 0 ? tokens / recorded_span : -1},
+      {"latency_p50_ms", percentile(replay_ms, 0.5),
+       recorded_ms.empty() ? -1 : percentile(recorded_ms, 0.5)},
+      {"latency_p90_ms", percentile(replay_ms, 0.9),
+       recorded_ms.empty() ? -1 : percentile(recorded_ms, 0.9)},
+      {"latency_p99_ms", percentile(replay_ms, 0.99),
+       recorded_ms.empty() ? -1 : percentile(recorded_ms, 0.99)}};
+  std::map<std::string, double> baseline;
+  if (!opt.baseline.empty()) baseline = read_json_numbers(opt.baseline);
+
+  printf("replayed %zu requests of %s in %.2f s at speed %g, %zu skipped\n",
+         served, opt.log.c_str(), duration, opt.speed, skipped);
+  for (const Metric& metric : metrics) {
+    printf("%-18s %10.2f", metric.name, metric.value);
+    if (metric.recorded > 0) {
+      printf(", recorded %10.2f, delta %+7.1f%%", metric.recorded,
+             (metric.value / metric.recorded - 1) * 100);
+    }
+    auto base = baseline.find(metric.name);
+    if (base != baseline.end() && base->second > 0) {
+      printf(", baseline %10.2f, delta %+7.1f%%", base->second,
+             (metric.value / base->second - 1) * 100);
+    }
+    printf("\n");
+  }
+
+  if (opt.json.empty()) return;
+  FILE* fp = fopen(opt.json.c_str(), "w");
+  if (fp == nullptr) {
+    throw std::runtime_error("failed to open " + opt.json);
+  }
+  fprintf(fp, "{\n  \"model\": \"%s\",\n  \"log\": \"%s\",\n",
+          opt.model.c_str(), opt.log.c_str());
+  fprintf(fp, "  \"speed\": %g,\n  \"num_requests\": %zu,\n", opt.speed,
+          served);
+  fprintf(fp, "  \"skipped\": %zu,\n  \"duration_s\": %.3f,\n", skipped,
+          duration);
+  for (const Metric& metric : metrics) {
+    fprintf(fp, "  \"%s\": %.3f,\n  \"recorded_%s\": %.3f,\n", metric.name,
+            metric.value, metric.name, metric.recorded);
+  }
+  fprintf(fp, "  \"max_batch_size\": %d\n}\n", opt.max_batch_size);
+  fclose(fp);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  try {
+    Options opt = parse_options(argc, argv);
+    std::vector<TrafficRecord> records =
+        lightseq::cuda::read_traffic_log(opt.log);
+    if (records.empty()) {
+      throw std::runtime_error("no requests in " + opt.log);
+    }
+    auto model = lightseq::cuda::LSModelFactory::GetInstance().CreateModel(
+        opt.model, opt.weights, opt.max_batch_size,
+        lightseq::cuda::kNotSupported,
+        lightseq::cuda::model_options_from_env());
+    {
+      ModelBuffers buffers(model);
+
+      // the first request warms up the kernels and the memory plan, then
+      // the clock restarts with the first arrival.
+      std::vector<Request> warmup = {{&records[0], 0, -1}};
+      replay(model, buffers, warmup);
+
+      double start = now();
+      std::vector<Request> requests;
+      for (const TrafficRecord& record : records) {
+        double arrival = (record.arrival_s - records[0].arrival_s) / opt.speed;
+        requests.push_back({&record, start + arrival, -1});
+      }
+      size_t skipped = replay(model, buffers, requests);
+      report(opt, requests, skipped, now() - start);
+    }
+    delete model;
+  } catch (std::exception& e) {
+    printf("Error! %s\n", e.what());
+    return -1;
+  }
+  return 0;
+}
@@ -27,7 +27,8 @@ int main(int argc, char* argv[]) {
   }
 
   auto model = lightseq::cuda::LSModelFactory::GetInstance().CreateModel(
-      "Transformer", model_weights_path, max_batch_size);
+      "Transformer", model_weights_path, max_batch_size,
+      lightseq::cuda::kNotSupported, lightseq::cuda::model_options_from_env());
 
   void* d_input;
   CHECK_GPU_ERROR(
@@ -7,7 +7,13 @@ import os
 import h5py
 import numpy as np
 from collections import OrderedDict
-from util import parse_args, check_arguements, ModelArguements, fill_hdf5_layer
+from util import (
+    parse_args,
+    check_arguements,
+    ModelArguements,
+    apply_rule,
+    fill_hdf5_layer,
+)
 import torch
 
 os.environ["CUDA_VISIBLE_DEVICES"] = "-1"
@@ -38,6 +44,59 @@ dec_layer_mapping_dict = OrderedDict(
     }
 )
 
+# the decoder layers of mixtral, whose experts are written by
+# fill_hdf5_moe_layer.
+moe_layer_mapping_dict = OrderedDict(list(dec_layer_mapping_dict.items())[:4])
+
+# the kernels stored quantized with --weight_quant_bits.
+quant_kernel_names = (
+    "attention_project_qkv",
+    "attention_output",
+    "gate_up_project_weight",
+    "down_project_weight",
+)
+
+
+def quantize_kernel(kernel, bits, group_size):
+    """
+    The name_qweight and name_qscale of the row-major [rows, cols] kernel,
+    which LlamaWeight uploads as is instead of quantizing the fp32 kernel at
+    every load, see quantize_kernel of llama_weight.cc: symmetric
+    round-to-nearest with one scale per group_size rows of every column, int4
+    packs the rows 2i and 2i + 1 into the low and high nibble of one byte.
+    """
+    rows, cols = kernel.shape
+    if group_size <= 0:
+        group_size = 128 if bits == 4 else rows
+    if rows % group_size != 0 or cols % 4 != 0 or (bits == 4 and group_size % 2):
+        raise Exception(
+            f"kernel of {kernel.shape} can not be quantized to {bits} bits "
+            f"with group size {group_size}"
+        )
+    qmax = (1 << (bits - 1)) - 1
+    grouped = kernel.astype(np.float32).reshape(rows // group_size, group_size, cols)
+    scale = np.abs(grouped).max(axis=1)
+    scale = np.where(scale > 0, scale / qmax, 1.0).astype(np.float32)
+    # rounds half away from zero, as std::lround
+    q = grouped / scale[:, None, :]
+    q = np.sign(q) * np.floor(np.abs(q) + 0.5)
+    q = np.clip(q, -qmax - 1, qmax).astype(np.int8).reshape(rows, cols)
+    if bits == 4:
+        q = q.view(np.uint8) & 0xF
+        q = (q[0::2] | (q[1::2] << 4)).view(np.int8)
+    return q.flatten(), scale.flatten()
+
+
+def create_kernel_dataset(hdf5_file, dataset_name, kernel, arguments):
+    if arguments.weight_quant_bits == 0:
+        hdf5_file.create_dataset(dataset_name, data=kernel.flatten().tolist())
+        return
+    qweight, qscale = quantize_kernel(
+        kernel, arguments.weight_quant_bits, arguments.weight_quant_group_size
+    )
+    hdf5_file.create_dataset(dataset_name + "_qweight", data=qweight, dtype="i1")
+    hdf5_file.create_dataset(dataset_name + "_qscale", data=qscale, dtype="f4")
+
 src_emb_mapping_dict = OrderedDict(
     {
         "post_norm_scale": "norm weight",
@@ -47,6 +106,59 @@ src_emb_mapping_dict = OrderedDict(
 )
 
 
+def fill_hdf5_quant_layer(tensor_names, state_dict, hdf5_file, layer_id, arguments):
+    """
+    The kernels of quant_kernel_names of decoder layer layer_id, stored
+    quantized, the rest of its mapping goes through fill_hdf5_layer.
+    """
+    mapping_dict = dec_layer_mapping_dict
+    if arguments.expert_num > 0:
+        mapping_dict = moe_layer_mapping_dict
+    dataset_prefix = f"decoder_layers/{layer_id}/"
+    fill_hdf5_layer(
+        tensor_names,
+        state_dict,
+        hdf5_file,
+        dataset_prefix,
+        OrderedDict(
+            (k, v) for k, v in mapping_dict.items() if k not in quant_kernel_names
+        ),
+    )
+    for name in quant_kernel_names:
+        if name not in mapping_dict:
+            continue
+        kernel = apply_rule(name, mapping_dict[name], tensor_names, state_dict)
+        create_kernel_dataset(hdf5_file, dataset_prefix + name, kernel, arguments)
+
+
+def fill_hdf5_moe_layer(state_dict, hdf5_file, layer_id, arguments):
+    """
+    The [hidden, expert_num] gate, the [expert_num, hidden, 2 * inner] gate up
+    and the [expert_num, inner, hidden] down kernels of all the experts of a
+    block_sparse_moe, see MoEFeedForwardLayer.
+    """
+    prefix = f"model.layers.{layer_id}.block_sparse_moe."
+    gate = state_dict[prefix + "gate.weight"].float().transpose(0, 1)
+    gate_up, down = [], []
+    for e in range(arguments.expert_num):
+        expert = f"{prefix}experts.{e}."
+        w1 = state_dict[expert + "w1.weight"].float()
+        w3 = state_dict[expert + "w3.weight"].float()
+        gate_up.append(torch.cat([w1, w3], dim=0).transpose(0, 1))
+        down.append(state_dict[expert + "w2.weight"].float().transpose(0, 1))
+    dataset_prefix = f"decoder_layers/{layer_id}/"
+    hdf5_file.create_dataset(
+        dataset_prefix + "moe_gate_weight", data=gate.flatten().tolist()
+    )
+    # the kernels of all the experts are quantized as [expert_num * rows, cols]
+    for name, tensor in (
+        ("gate_up_project_weight", torch.stack(gate_up)),
+        ("down_project_weight", torch.stack(down)),
+    ):
+        kernel = tensor.reshape(-1, tensor.shape[-1]).numpy()
+        create_kernel_dataset(hdf5_file, dataset_prefix + name, kernel, arguments)
+
+
 def extract_llama_weights(
     output_file: str,
     arguments: ModelArguements,
@@ -75,14 +187,28 @@ def extract_llama_weights(
         enc_tensor_names.setdefault(layer_id, []).append(name)
 
     # fill encoder_stack
+    mapping_dict = dec_layer_mapping_dict
+    if arguments.expert_num > 0:
+        mapping_dict = moe_layer_mapping_dict
     for layer_id in sorted(enc_tensor_names.keys()):
-        fill_hdf5_layer(
-            enc_tensor_names[layer_id],
-            state_dict,
-            hdf5_file,
-            f"decoder_layers/{layer_id}/",
-            dec_layer_mapping_dict,
-        )
+        if arguments.weight_quant_bits > 0:
+            fill_hdf5_quant_layer(
+                enc_tensor_names[layer_id],
+                state_dict,
+                hdf5_file,
+                layer_id,
+                arguments,
+            )
+        else:
+            fill_hdf5_layer(
+                enc_tensor_names[layer_id],
+                state_dict,
+                hdf5_file,
+                f"decoder_layers/{layer_id}/",
+                mapping_dict,
+            )
+        if arguments.expert_num > 0:
+            fill_hdf5_moe_layer(state_dict, hdf5_file, layer_id, arguments)
 
     # fill src_embedding - except for position embedding
     fill_hdf5_layer(
@@ -102,6 +228,9 @@ def extract_llama_weights(
     )
     hdf5_file.create_dataset("model_conf/max_step", data=arguments.max_step, dtype="i4")
     hdf5_file.create_dataset("model_conf/head_num", data=arguments.head_num, dtype="i4")
+    hdf5_file.create_dataset(
+        "model_conf/num_kv_heads", data=arguments.kv_head_num, dtype="i4"
+    )
     hdf5_file.create_dataset(
         "model_conf/layer_num", data=arguments.layer_num, dtype="i4"
     )
@@ -122,13 +251,52 @@ def extract_llama_weights(
     hdf5_file.create_dataset(
         "model_conf/src_vocab_size", data=arguments.vocab_size, dtype="i4"
     )
+    hdf5_file.create_dataset(
+        "model_conf/rope_theta", data=arguments.rope_theta, dtype="f4"
+    )
+    if arguments.expert_num > 0:
+        hdf5_file.create_dataset(
+            "model_conf/expert_num", data=arguments.expert_num, dtype="i4"
+        )
+        hdf5_file.create_dataset(
+            "model_conf/moe_topk", data=arguments.moe_topk, dtype="i4"
+        )
+    if arguments.weight_quant_bits > 0:
+        hdf5_file.create_dataset(
+            "model_conf/weight_quant_bits",
+            data=arguments.weight_quant_bits,
+            dtype="i4",
+        )
+        hdf5_file.create_dataset(
+            "model_conf/weight_quant_group_size",
+            data=arguments.weight_quant_group_size,
+            dtype="i4",
+        )
+    if arguments.rope_scaling_type:
+        hdf5_file.create_dataset(
+            "model_conf/rope_scaling_type",
+            data=np.array([ord(c) for c in arguments.rope_scaling_type]).astype(
+                np.int8
+            ),
+            dtype="i1",
+        )
+        hdf5_file.create_dataset(
+            "model_conf/rope_scaling_factor",
+            data=arguments.rope_scaling_factor,
+            dtype="f4",
+        )
+        hdf5_file.create_dataset(
+            "model_conf/rope_original_max_step",
+            data=arguments.rope_original_max_step,
+            dtype="i4",
+        )
 
     hdf5_file.close()
     # read-in again to double check
     hdf5_file = h5py.File(output_file, "r")
 
     def _print_pair(key, value):
-        if key == "generate_method":
+        if key in ("generate_method", "rope_scaling_type"):
             value = "".join(map(chr, value[()]))
         else:
             value = value[()]
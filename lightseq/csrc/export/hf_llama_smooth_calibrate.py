@@ -0,0 +1,156 @@
+"""
+Calibrate the SmoothQuant smoothing factors of a Hugging Face Llama model and
+write them into its LightSeq hdf5 file, see hf_llama_export.py.
+
+The inputs of the qkv and the gate up projections have a few outlier channels
+which per-token int8 quantization handles badly. For every input channel j of
+them the smoothing factor is
+
+    s_j = max|X_j| ** alpha / max|W_j| ** (1 - alpha)
+
+with max|X_j| the absmax of the channel over the calibration samples and
+max|W_j| the absmax of the weights reading it. LightSeq divides the norm
+scale by s and multiplies the kernel rows by s at load when LIGHTSEQ_INT8=1,
+which moves the outliers from the activations into the weights.
+"""
+
+import argparse
+import h5py
+import numpy as np
+import torch
+from transformers import AutoTokenizer, LlamaForCausalLM
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description="calibrate the int8 smoothing factors of a llama model",
+        usage="",
+    )
+    parser.add_argument(
+        "--model_repo",
+        "-m",
+        type=str,
+        required=True,
+        help="path of the hugging face model repo",
+    )
+    parser.add_argument(
+        "--hdf5_file",
+        "-o",
+        type=str,
+        required=True,
+        help="path of the lightseq hdf5 file of the model, updated in place",
+    )
+    parser.add_argument(
+        "--calib_file",
+        "-c",
+        type=str,
+        required=True,
+        help="text file of the calibration samples, one per line",
+    )
+    parser.add_argument("--num_samples", type=int, default=128)
+    parser.add_argument("--max_seq_len", type=int, default=512)
+    parser.add_argument(
+        "--alpha",
+        type=float,
+        default=0.5,
+        help="migration strength, 0 keeps the activations, 1 the weights",
+    )
+    return parser.parse_args()
+
+
+def collect_act_absmax(model, tokenizer, samples, max_seq_len):
+    """
+    The per channel absmax of the inputs of the q and the gate projections of
+    every layer, which are the outputs of the two norms of the layer.
+    """
+    act_absmax = {}
+
+    def record(name):
+        def hook(module, inputs, output):
+            x = inputs[0].detach().reshape(-1, inputs[0].shape[-1])
+            absmax = x.abs().amax(dim=0).float().cpu()
+            if name in act_absmax:
+                act_absmax[name] = torch.maximum(act_absmax[name], absmax)
+            else:
+                act_absmax[name] = absmax
+
+        return hook
+
+    handles = []
+    for layer_id, layer in enumerate(model.model.layers):
+        handles.append(
+            layer.self_attn.q_proj.register_forward_hook(
+                record(f"{layer_id}/attention")
+            )
+        )
+        handles.append(
+            layer.mlp.gate_proj.register_forward_hook(record(f"{layer_id}/ffn"))
+        )
+
+    device = next(model.parameters()).device
+    with torch.no_grad():
+        for i, text in enumerate(samples):
+            inputs = tokenizer(
+                text, return_tensors="pt", truncation=True, max_length=max_seq_len
+            )
+            model(inputs.input_ids.to(device))
+            if (i + 1) % 16 == 0:
+                print(f"calibrated {i + 1} / {len(samples)} samples")
+
+    for handle in handles:
+        handle.remove()
+    return act_absmax
+
+
+def smooth_scale(act_absmax, weights, alpha):
+    # weights are [out, in] as torch.nn.Linear, the absmax is over the out.
+    weight_absmax = torch.cat(weights, dim=0).abs().amax(dim=0).float().cpu()
+    scale = act_absmax.pow(alpha) / weight_absmax.pow(1 - alpha)
+    # dead channels keep a factor of 1 rather than collapsing to 0.
+    scale = torch.where(
+        (act_absmax > 0) & (weight_absmax > 0), scale, torch.ones_like(scale)
+    )
+    return scale.clamp(min=1e-5).numpy().astype(np.float32)
+
+
+def write_smooth_scales(model, act_absmax, hdf5_path, alpha):
+    hdf5_file = h5py.File(hdf5_path, "a")
+    for layer_id, layer in enumerate(model.model.layers):
+        attn = layer.self_attn
+        mlp = layer.mlp
+        scales = {
+            "attention_smooth_scale": smooth_scale(
+                act_absmax[f"{layer_id}/attention"],
+                [attn.q_proj.weight, attn.k_proj.weight, attn.v_proj.weight],
+                alpha,
+            ),
+            "ffn_smooth_scale": smooth_scale(
+                act_absmax[f"{layer_id}/ffn"],
+                [mlp.gate_proj.weight, mlp.up_proj.weight],
+                alpha,
+            ),
+        }
+        for name, scale in scales.items():
+            dataset = f"decoder_layers/{layer_id}/{name}"
+            if dataset in hdf5_file:
+                del hdf5_file[dataset]
+            hdf5_file.create_dataset(dataset, data=scale, dtype="f4")
+    hdf5_file.close()
+    print(f"wrote the smoothing factors of {len(model.model.layers)} layers")
+
+
+if __name__ == "__main__":
+    args = parse_args()
+
+    tokenizer = AutoTokenizer.from_pretrained(args.model_repo)
+    model = LlamaForCausalLM.from_pretrained(
+        args.model_repo, torch_dtype=torch.float16, device_map="auto"
+    )
+    model.eval()
+
+    with open(args.calib_file, "r") as f:
+        samples = [line.strip() for line in f if line.strip()]
+    samples = samples[: args.num_samples]
+
+    act_absmax = collect_act_absmax(model, tokenizer, samples, args.max_seq_len)
+    write_smooth_scales(model, act_absmax, args.hdf5_file, args.alpha)
@@ -47,6 +47,22 @@ def parse_args():
         required=False,
         default=None,
     )
+    parser.add_argument(
+        "--weight_quant_bits",
+        type=int,
+        required=False,
+        default=0,
+        choices=[0, 4, 8],
+        help="store the linear kernels quantized to int8 or int4",
+    )
+    parser.add_argument(
+        "--weight_quant_group_size",
+        type=int,
+        required=False,
+        default=0,
+        help="rows of every scale of the quantized kernels, 0 for the default "
+        "of the loader, 128 for int4 and the whole column for int8",
+    )
     args = parser.parse_args()
     return args
 
@@ -92,6 +108,8 @@ class ModelArguements(object):
         self.beam_size = args.beam_size
         self.topk = args.topk
         self.topp = args.topp
+        self.weight_quant_bits = args.weight_quant_bits
+        self.weight_quant_group_size = args.weight_quant_group_size
         self.eos_id = None
         self.bos_id = None
         self.config_path = os.path.join(self.model_repo, "config.json")
@@ -108,8 +126,28 @@ class ModelArguements(object):
         self.hidden_size = config.get("hidden_size")
         self.inner_size = config.get("intermediate_size")
         self.head_num = config.get("num_attention_heads")
+        # grouped-query attention checkpoints have fewer key/value heads
+        self.kv_head_num = config.get("num_key_value_heads", self.head_num)
         self.vocab_size = config.get("vocab_size")
         self.layer_num = config.get("num_hidden_layers")
+        self.rope_theta = config.get("rope_theta", 10000.0)
+        # mixtral, every token runs num_experts_per_tok of the experts
+        self.expert_num = config.get("num_local_experts", 0)
+        self.moe_topk = config.get("num_experts_per_tok", 2)
+        # llama 2 long-context checkpoints, "dynamic" ntk scaling runs as the
+        # static ntk scaling of its factor
+        rope_scaling = config.get("rope_scaling") or {}
+        self.rope_scaling_type = rope_scaling.get(
+            "rope_type", rope_scaling.get("type", "")
+        )
+        if self.rope_scaling_type == "dynamic":
+            self.rope_scaling_type = "ntk"
+        if self.rope_scaling_type not in ("", "linear", "ntk", "yarn"):
+            raise Exception(f"unsupported rope scaling {self.rope_scaling_type}")
+        self.rope_scaling_factor = rope_scaling.get("factor", 1.0)
+        self.rope_original_max_step = rope_scaling.get(
+            "original_max_position_embeddings", 0
+        )
         self.extra_decode_length = (
             self.max_step
             if args.extra_decode_length is None
@@ -1,5 +1,224 @@
+#include <cstring>
+#include <vector>
+
 #include "kernel_headers.h"
 
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LS_ARM_SIMD
+#endif
+
 namespace lightseq {
-namespace arm {}  // namespace arm
+namespace arm {
+
+namespace {
+
+// The fp32 gemm packs op(A) into panels of kMr rows and op(B) into panels of
+// kNr columns, both interleaved along k, so that the micro kernel streams
+// them with contiguous loads. A kMr x kNr tile of C lives in 16 registers.
+constexpr int kMr = 8;
+constexpr int kNr = 8;
+// the k and the n of a packed block of op(B), which stays in the L2 cache.
+constexpr int kKc = 256;
+constexpr int kNc = 512;
+
+// dst[p * kMr + r] = op(A)(i0 + r, p0 + p), zeros beyond m.
+void pack_a_panel(float* dst, const float* a, bool transpose_a, int lda,
+                  int m, int i0, int p0, int kc) {
+  for (int p = 0; p < kc; p++) {
+    for (int r = 0; r < kMr; r++) {
+      int i = i0 + r;
+      float v = 0.f;
+      if (i < m) {
+        v = transpose_a ? a[(p0 + p) + size_t(i) * lda]
+                        : a[i + size_t(p0 + p) * lda];
+      }
+      dst[p * kMr + r] = v;
+    }
+  }
+}
+
+// dst[p * kNr + c] = op(B)(p0 + p, j0 + c), zeros beyond n.
+void pack_b_panel(float* dst, const float* b, bool transpose_b, int ldb,
+                  int n, int j0, int p0, int kc) {
+  for (int p = 0; p < kc; p++) {
+    for (int c = 0; c < kNr; c++) {
+      int j = j0 + c;
+      float v = 0.f;
+      if (j < n) {
+        v = transpose_b ? b[j + size_t(p0 + p) * ldb]
+                        : b[(p0 + p) + size_t(j) * ldb];
+      }
+      dst[p * kNr + c] = v;
+    }
+  }
+}
+
+// C(i0 : i0 + mr, j0 : j0 + nr) += alpha * Ap * Bp
+void micro_kernel(const float* ap, const float* bp, int kc, float alpha,
+                  float* c, int ldc, int mr, int nr) {
+  float tile[kNr][kMr];
+#ifdef LS_ARM_SIMD
+  float32x4_t acc[kNr][2];
+  for (int j = 0; j < kNr; j++) {
+    acc[j][0] = vdupq_n_f32(0.f);
+    acc[j][1] = vdupq_n_f32(0.f);
+  }
+  for (int p = 0; p < kc; p++) {
+    float32x4_t a_lo = vld1q_f32(ap + p * kMr);
+    float32x4_t a_hi = vld1q_f32(ap + p * kMr + 4);
+    float32x4_t b_lo = vld1q_f32(bp + p * kNr);
+    float32x4_t b_hi = vld1q_f32(bp + p * kNr + 4);
+    acc[0][0] = vfmaq_laneq_f32(acc[0][0], a_lo, b_lo, 0);
+    acc[0][1] = vfmaq_laneq_f32(acc[0][1], a_hi, b_lo, 0);
+    acc[1][0] = vfmaq_laneq_f32(acc[1][0], a_lo, b_lo, 1);
+    acc[1][1] = vfmaq_laneq_f32(acc[1][1], a_hi, b_lo, 1);
+    acc[2][0] = vfmaq_laneq_f32(acc[2][0], a_lo, b_lo, 2);
+    acc[2][1] = vfmaq_laneq_f32(acc[2][1], a_hi, b_lo, 2);
+    acc[3][0] = vfmaq_laneq_f32(acc[3][0], a_lo, b_lo, 3);
+    acc[3][1] = vfmaq_laneq_f32(acc[3][1], a_hi, b_lo, 3);
+    acc[4][0] = vfmaq_laneq_f32(acc[4][0], a_lo, b_hi, 0);
+    acc[4][1] = vfmaq_laneq_f32(acc[4][1], a_hi, b_hi, 0);
+    acc[5][0] = vfmaq_laneq_f32(acc[5][0], a_lo, b_hi, 1);
+    acc[5][1] = vfmaq_laneq_f32(acc[5][1], a_hi, b_hi, 1);
+    acc[6][0] = vfmaq_laneq_f32(acc[6][0], a_lo, b_hi, 2);
+    acc[6][1] = vfmaq_laneq_f32(acc[6][1], a_hi, b_hi, 2);
+    acc[7][0] = vfmaq_laneq_f32(acc[7][0], a_lo, b_hi, 3);
+    acc[7][1] = vfmaq_laneq_f32(acc[7][1], a_hi, b_hi, 3);
+  }
+  for (int j = 0; j < kNr; j++) {
+    vst1q_f32(tile[j], acc[j][0]);
+    vst1q_f32(tile[j] + 4, acc[j][1]);
+  }
+#else
+  std::memset(tile, 0, sizeof(tile));
+  for (int p = 0; p < kc; p++) {
+    for (int j = 0; j < kNr; j++) {
+      for (int r = 0; r < kMr; r++) {
+        tile[j][r] += ap[p * kMr + r] * bp[p * kNr + j];
+      }
+    }
+  }
+#endif
+  // C is column major, a column of the tile is contiguous.
+  for (int j = 0; j < nr; j++) {
+    float* c_col = c + size_t(j) * ldc;
+    for (int r = 0; r < mr; r++) {
+      c_col[r] += alpha * tile[j][r];
+    }
+  }
+}
+
+void sgemm(bool transpose_a, bool transpose_b, int m, int n, int k,
+           float alpha, float beta, const float* a, int lda, const float* b,
+           int ldb, float* c, int ldc) {
+  for (int j = 0; j < n; j++) {
+    float* c_col = c + size_t(j) * ldc;
+    if (beta == 0.f) {
+      std::memset(c_col, 0, m * sizeof(float));
+    } else if (beta != 1.f) {
+      for (int i = 0; i < m; i++) c_col[i] *= beta;
+    }
+  }
+  if (k == 0 || alpha == 0.f) return;
+
+  const int m_panels = (m + kMr - 1) / kMr;
+  std::vector<float> a_pack(size_t(m_panels) * kMr * kKc);
+  std::vector<float> b_pack(size_t(kNc) * kKc);
+  for (int p0 = 0; p0 < k; p0 += kKc) {
+    int kc = std::min(kKc, k - p0);
+    for (int i = 0; i < m_panels; i++) {
+      pack_a_panel(a_pack.data() + size_t(i) * kMr * kc, a, transpose_a, lda,
+                   m, i * kMr, p0, kc);
+    }
+    for (int j0 = 0; j0 < n; j0 += kNc) {
+      int nc = std::min(kNc, n - j0);
+      int n_panels = (nc + kNr - 1) / kNr;
+      for (int j = 0; j < n_panels; j++) {
+        pack_b_panel(b_pack.data() + size_t(j) * kNr * kc, b, transpose_b,
+                     ldb, n, j0 + j * kNr, p0, kc);
+      }
+      for (int j = 0; j < n_panels; j++) {
+        int jj = j0 + j * kNr;
+        for (int i = 0; i < m_panels; i++) {
+          int ii = i * kMr;
+          micro_kernel(a_pack.data() + size_t(i) * kMr * kc,
+                       b_pack.data() + size_t(j) * kNr * kc, kc, alpha,
+                       c + ii + size_t(jj) * ldc, ldc, std::min(kMr, m - ii),
+                       std::min(kNr, n - jj));
+        }
+      }
+    }
+  }
+}
+
+#ifdef LS_ARM_SIMD
+// acc += the int8 dot products of the 4 lanes of 4 bytes
+inline int32x4_t vdot_s8(int32x4_t acc, int8x16_t a, int8x16_t b) {
+#ifdef __ARM_FEATURE_DOTPROD
+  return vdotq_s32(acc, a, b);
+#else
+  acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(a), vget_low_s8(b)));
+  return vpadalq_s16(acc, vmull_high_s8(a, b));
+#endif
+}
+#endif
+
+inline int32_t dot_s8(const int8_t* a, const int8_t* b, int k) {
+  int32_t sum = 0;
+  int p = 0;
+#ifdef LS_ARM_SIMD
+  int32x4_t acc = vdupq_n_s32(0);
+  for (; p + 16 <= k; p += 16) {
+    acc = vdot_s8(acc, vld1q_s8(a + p), vld1q_s8(b + p));
+  }
+  sum = vaddvq_s32(acc);
+#endif
+  for (; p < k; p++) {
+    sum += int32_t(a[p]) * b[p];
+  }
+  return sum;
+}
+
+}  // namespace
+
+template <>
+void strided_batch_gemm(bool transpose_a, bool transpose_b, int m, int n,
+                        int k, float alpha, float beta, const float* a,
+                        const float* b, float* c, int stride_a, int stride_b,
+                        int stride_c, int batch) {
+  const int lda = transpose_a ? k : m;
+  const int ldb = transpose_b ? n : k;
+  const int ldc = m;
+  if (batch == 1) {
+    // one large gemm, split over the columns of C.
+    parallel_for(0, n, kNc, [&](int64_t begin, int64_t end) {
+      sgemm(transpose_a, transpose_b, m, end - begin, k, alpha, beta, a, lda,
+            b + (transpose_b ? begin : begin * ldb), ldb, c + begin * ldc,
+            ldc);
+    });
+    return;
+  }
+  parallel_for(0, batch, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t i = begin; i < end; i++) {
+      sgemm(transpose_a, transpose_b, m, n, k, alpha, beta, a + i * stride_a,
+            lda, b + i * stride_b, ldb, c + i * stride_c, ldc);
+    }
+  });
+}
+
+void gemm_s8s8s32_nt(const int8_t* a, const int8_t* b, int32_t* c, int m,
+                     int n, int k) {
+  // a row of b is reused by all the rows of a, split over the columns.
+  parallel_for(0, n, GRAIN_SIZE / k, [&](int64_t begin, int64_t end) {
+    for (int64_t j = begin; j < end; j++) {
+      const int8_t* b_row = b + j * k;
+      for (int i = 0; i < m; i++) {
+        c[size_t(i) * n + j] = dot_s8(a + size_t(i) * k, b_row, k);
+      }
+    }
+  });
+}
+
+}  // namespace arm
 }  // namespace lightseq
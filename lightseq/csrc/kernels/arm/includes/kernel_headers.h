@@ -1,6 +1,5 @@
 #pragma once
 
-#include <math_constants.h>
 #include <type_traits>
 #include <chrono>
 #include <fstream>
@@ -11,3 +10,4 @@
 #include <functional>
 
 #include "utils.h"
+#include "kernels.h"
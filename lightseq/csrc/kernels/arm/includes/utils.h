@@ -1,9 +1,61 @@
+#pragma once
 #include "cstdio"
 #include "iostream"
+#include <algorithm>
+#include <array>
+#include <string>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace lightseq {
+namespace arm {
+
+// Array smaller than this size will not be parallelized, as in the x86
+// kernels.
+constexpr int64_t GRAIN_SIZE = 32768;
 
 template <typename T>
-void print_vec(const T *outv, std::string outn, int num_output_ele);
+inline T ceil_divide(const T& x, const T& y) {
+  return (x + y - 1) / y;
+}
+
+template <typename Function>
+inline void parallel_for(const int64_t begin, const int64_t end,
+                         const int64_t grain_size, const Function& f) {
+  if (begin >= end) {
+    return;
+  }
+#ifdef _OPENMP
+  const int64_t size = end - begin;
+  if (omp_get_max_threads() == 1 || omp_in_parallel() || size <= grain_size) {
+    f(begin, end);
+    return;
+  }
+#pragma omp parallel
+  {
+    int64_t num_threads = omp_get_num_threads();
+    if (grain_size > 0) {
+      num_threads = std::min(num_threads, ceil_divide(size, grain_size));
+    }
 
+    const int64_t tid = omp_get_thread_num();
+    const int64_t chunk_size = ceil_divide(size, num_threads);
+    const int64_t begin_tid = begin + tid * chunk_size;
+    if (begin_tid < end) {
+      f(begin_tid, std::min(end, chunk_size + begin_tid));
+    }
+  }
+#else
+  (void)grain_size;
+  f(begin, end);
+#endif
 }
+
+}  // namespace arm
+
+template <typename T>
+void print_vec(const T *outv, std::string outn, int num_output_ele);
+
+}  // namespace lightseq
@@ -0,0 +1,893 @@
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "kernels.h"
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LS_ARM_SIMD
+#endif
+
+namespace lightseq {
+namespace arm {
+
+namespace {
+
+#ifdef LS_ARM_SIMD
+typedef float32x4_t vec_t;
+constexpr int kVecSize = 4;
+
+inline vec_t vload(const float* p) { return vld1q_f32(p); }
+inline void vstore(float* p, vec_t v) { vst1q_f32(p, v); }
+inline vec_t vset1(float x) { return vdupq_n_f32(x); }
+inline vec_t vadd(vec_t a, vec_t b) { return vaddq_f32(a, b); }
+inline vec_t vsub(vec_t a, vec_t b) { return vsubq_f32(a, b); }
+inline vec_t vmul(vec_t a, vec_t b) { return vmulq_f32(a, b); }
+inline vec_t vdiv(vec_t a, vec_t b) { return vdivq_f32(a, b); }
+inline vec_t vmax(vec_t a, vec_t b) { return vmaxq_f32(a, b); }
+inline vec_t vmin(vec_t a, vec_t b) { return vminq_f32(a, b); }
+// a * b + c
+inline vec_t vfma(vec_t a, vec_t b, vec_t c) { return vfmaq_f32(c, a, b); }
+inline float vreduce_sum(vec_t v) { return vaddvq_f32(v); }
+inline float vreduce_max(vec_t v) { return vmaxvq_f32(v); }
+inline vec_t vfloor(vec_t v) { return vrndmq_f32(v); }
+// 2^n of the integral n
+inline vec_t vpow2n(vec_t n) {
+  int32x4_t e = vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127));
+  return vreinterpretq_f32_s32(vshlq_n_s32(e, 23));
+}
+inline vec_t vabs(vec_t v) { return vabsq_f32(v); }
+inline bool vany_gt(vec_t a, vec_t b) {
+  return vmaxvq_u32(vcgtq_f32(a, b)) != 0;
+}
+inline vec_t vload_i32(const int32_t* p) { return vcvtq_f32_s32(vld1q_s32(p)); }
+// round(v) saturated to [-127, 127]
+inline void vstore_s8(int8_t* p, vec_t v) {
+  int32x4_t i32 = vcvtnq_s32_f32(v);
+  i32 = vmaxq_s32(vminq_s32(i32, vdupq_n_s32(127)), vdupq_n_s32(-127));
+  int16x4_t i16 = vmovn_s32(i32);
+  int8x8_t i8 = vmovn_s16(vcombine_s16(i16, i16));
+  vst1_lane_s32((int32_t*)p, vreinterpret_s32_s8(i8), 0);
+}
+#endif
+
+#ifdef LS_ARM_SIMD
+// the cephes expf, exp(x) = 2^n * exp(r) with |r| <= ln(2) / 2, a relative
+// error of about 1e-7 over the clamped range.
+inline vec_t vexp(vec_t x) {
+  x = vmin(vmax(x, vset1(-87.3365f)), vset1(88.3762f));
+  vec_t n = vfloor(vfma(x, vset1(1.44269504088896341f), vset1(0.5f)));
+  x = vfma(n, vset1(-0.693359375f), x);
+  x = vfma(n, vset1(2.12194440e-4f), x);
+
+  vec_t y = vset1(1.9875691500e-4f);
+  y = vfma(y, x, vset1(1.3981999507e-3f));
+  y = vfma(y, x, vset1(8.3334519073e-3f));
+  y = vfma(y, x, vset1(4.1665795894e-2f));
+  y = vfma(y, x, vset1(1.6666665459e-1f));
+  y = vfma(y, x, vset1(5.0000001201e-1f));
+  y = vfma(y, vmul(x, x), vadd(x, vset1(1.f)));
+  return vmul(y, vpow2n(n));
+}
+
+// the tanh approximation of gelu as on cuda, tanh(z) = 1 - 2 / (exp(2z) + 1)
+inline vec_t vgelu(vec_t x) {
+  vec_t z = vmul(vmul(x, x), vset1(0.044715f));
+  z = vmul(vfma(z, x, x), vset1(2.f * 0.7978845608028654f));
+  vec_t tanh_z = vsub(vset1(1.f), vdiv(vset1(2.f), vadd(vexp(z), vset1(1.f))));
+  return vmul(vmul(x, vset1(0.5f)), vadd(tanh_z, vset1(1.f)));
+}
+#endif
+
+inline float gelu(float x) {
+  float cdf =
+      0.5f *
+      (1.0f + tanhf((0.7978845608028654f * (x + 0.044715f * x * x * x))));
+  return x * cdf;
+}
+
+// out = a + b, or a + b + c
+inline void add_row(float* out, const float* a, const float* b, const float* c,
+                    int n) {
+  int i = 0;
+#ifdef LS_ARM_SIMD
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vec_t v = vadd(vload(a + i), vload(b + i));
+    if (c) v = vadd(v, vload(c + i));
+    vstore(out + i, v);
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = a[i] + b[i] + (c ? c[i] : 0.f);
+  }
+}
+
+}  // namespace
+
+template <>
+void launch_enc_emb<float>(const float* token_emb, const float* pos_emb,
+                           const int* tokens, float* output, float* pad_mask,
+                           int pad_id, int batch_size, int seq_len,
+                           int hidden_dim, const float* lang_emb,
+                           const int* lang_id, int multilg_type) {
+  parallel_for(
+      0, batch_size * seq_len, GRAIN_SIZE / hidden_dim,
+      [&](int64_t begin, int64_t end) {
+        for (int64_t idx = begin; idx < end; idx++) {
+          int batch_idx = idx / seq_len, seq_idx = idx % seq_len;
+          const float* emb = token_emb;
+          const float* lemb = nullptr;
+          int token;
+          bool is_pad;
+          if (multilg_type == 2 && seq_idx == 0) {
+            // the language of the sentence as its first token.
+            emb = lang_emb;
+            token = lang_id[batch_idx];
+            is_pad = false;
+          } else {
+            token = multilg_type == 2
+                        ? tokens[batch_idx * (seq_len - 1) + seq_idx - 1]
+                        : tokens[idx];
+            is_pad = token == pad_id;
+            if (multilg_type == 1) {
+              lemb = lang_emb + size_t(lang_id[batch_idx]) * hidden_dim;
+            }
+          }
+
+          float* out = output + idx * hidden_dim;
+          if (is_pad) {
+            pad_mask[idx] = kFloatInfNeg;
+            std::memset(out, 0, hidden_dim * sizeof(float));
+            continue;
+          }
+          pad_mask[idx] = 0.f;
+          add_row(out, emb + size_t(token) * hidden_dim,
+                  pos_emb + size_t(seq_idx) * hidden_dim, lemb, hidden_dim);
+        }
+      });
+}
+
+template <>
+void launch_layer_norm<float>(float* ln_res, float* vars, float* means,
+                              const float* inp, const float* scale,
+                              const float* bias, int batch_size,
+                              int hidden_dim) {
+  parallel_for(
+      0, batch_size, GRAIN_SIZE / hidden_dim, [&](int64_t begin, int64_t end) {
+        for (int64_t row = begin; row < end; row++) {
+          const float* x = inp + row * hidden_dim;
+          float* y = ln_res + row * hidden_dim;
+
+          float sum = 0.f, square_sum = 0.f;
+          int i = 0;
+#ifdef LS_ARM_SIMD
+          vec_t v_sum = vset1(0.f), v_square_sum = vset1(0.f);
+          for (; i + kVecSize <= hidden_dim; i += kVecSize) {
+            vec_t v = vload(x + i);
+            v_sum = vadd(v_sum, v);
+            v_square_sum = vfma(v, v, v_square_sum);
+          }
+          sum = vreduce_sum(v_sum);
+          square_sum = vreduce_sum(v_square_sum);
+#endif
+          for (; i < hidden_dim; i++) {
+            sum += x[i];
+            square_sum += x[i] * x[i];
+          }
+
+          float mean = sum / hidden_dim;
+          float var = square_sum / hidden_dim - mean * mean + kLnEpsilon;
+          if (means != nullptr) means[row] = mean;
+          vars[row] = var;
+          float rstd = 1.f / sqrtf(var);
+
+          i = 0;
+#ifdef LS_ARM_SIMD
+          vec_t v_mean = vset1(mean), v_rstd = vset1(rstd);
+          for (; i + kVecSize <= hidden_dim; i += kVecSize) {
+            vec_t v = vmul(vsub(vload(x + i), v_mean), v_rstd);
+            vstore(y + i, vfma(v, vload(scale + i), vload(bias + i)));
+          }
+#endif
+          for (; i < hidden_dim; i++) {
+            y[i] = (x[i] - mean) * rstd * scale[i] + bias[i];
+          }
+        }
+      });
+}
+
+template <>
+void launch_attn_softmax<float>(float* out, const float* inp,
+                                const float* attn_mask, int batch_size,
+                                int nhead, int from_len, int to_len,
+                                int kv_size, bool mask_future) {
+  parallel_for(
+      0, int64_t(batch_size) * nhead * from_len, GRAIN_SIZE / to_len,
+      [&](int64_t begin, int64_t end) {
+        for (int64_t row = begin; row < end; row++) {
+          int batch_idx = row / (nhead * from_len);
+          int token_idx = row % from_len;
+          const float* x = inp + row * to_len;
+          float* y = out + row * to_len;
+          const float* mask =
+              attn_mask ? attn_mask + size_t(batch_idx) * kv_size : nullptr;
+          // query i attends to the keys [0, i + to_len - from_len]
+          int valid_len =
+              mask_future ? std::min(to_len, token_idx + to_len - from_len + 1)
+                          : to_len;
+
+          // step 1. the masked scores and their max, into y
+          float max_val = kFloatInfNeg;
+          int i = 0;
+#ifdef LS_ARM_SIMD
+          vec_t v_max = vset1(kFloatInfNeg);
+          for (; i + kVecSize <= valid_len; i += kVecSize) {
+            vec_t v = vload(x + i);
+            if (mask) v = vadd(v, vload(mask + i));
+            vstore(y + i, v);
+            v_max = vmax(v_max, v);
+          }
+          max_val = vreduce_max(v_max);
+#endif
+          for (; i < valid_len; i++) {
+            y[i] = x[i] + (mask ? mask[i] : 0.f);
+            max_val = std::max(max_val, y[i]);
+          }
+
+          // step 2. exp and sum
+          float sum = 0.f;
+          i = 0;
+#ifdef LS_ARM_SIMD
+          vec_t v_sum = vset1(0.f);
+          vec_t v_row_max = vset1(max_val);
+          for (; i + kVecSize <= valid_len; i += kVecSize) {
+            vec_t v = vexp(vsub(vload(y + i), v_row_max));
+            vstore(y + i, v);
+            v_sum = vadd(v_sum, v);
+          }
+          sum = vreduce_sum(v_sum);
+#endif
+          for (; i < valid_len; i++) {
+            y[i] = expf(y[i] - max_val);
+            sum += y[i];
+          }
+
+          // step 3. normalize, the future keys are zeros
+          float inv_sum = 1.f / (sum + 1e-8f);
+          i = 0;
+#ifdef LS_ARM_SIMD
+          vec_t v_inv_sum = vset1(inv_sum);
+          for (; i + kVecSize <= valid_len; i += kVecSize) {
+            vstore(y + i, vmul(vload(y + i), v_inv_sum));
+          }
+#endif
+          for (; i < valid_len; i++) {
+            y[i] *= inv_sum;
+          }
+          for (i = valid_len; i < to_len; i++) {
+            y[i] = 0.f;
+          }
+        }
+      });
+}
+
+template <ActivationType act_type, typename T>
+void launch_bias_act(T* out, const T* inp, const T* bias, int total_count,
+                     int dim) {
+  int rows = total_count / dim;
+  parallel_for(0, rows, GRAIN_SIZE / dim, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      const float* x = inp + row * dim;
+      float* y = out + row * dim;
+      int i = 0;
+#ifdef LS_ARM_SIMD
+      for (; i + kVecSize <= dim; i += kVecSize) {
+        vec_t v = vadd(vload(x + i), vload(bias + i));
+        if (act_type == ActivationType::kRelu) {
+          v = vmax(v, vset1(0.f));
+        } else {
+          v = vgelu(v);
+        }
+        vstore(y + i, v);
+      }
+#endif
+      for (; i < dim; i++) {
+        float v = x[i] + bias[i];
+        y[i] = act_type == ActivationType::kRelu ? std::max(v, 0.f) : gelu(v);
+      }
+    }
+  });
+}
+
+template void launch_bias_act<ActivationType::kRelu, float>(
+    float* out, const float* inp, const float* bias, int total_count, int dim);
+template void launch_bias_act<ActivationType::kGelu, float>(
+    float* out, const float* inp, const float* bias, int total_count, int dim);
+
+template <>
+void launch_bias_res<float>(float* out, const float* inp, const float* bias,
+                            const float* residual, int total_count, int dim) {
+  int rows = total_count / dim;
+  parallel_for(0, rows, GRAIN_SIZE / dim, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      add_row(out + row * dim, inp + row * dim, bias, residual + row * dim,
+              dim);
+    }
+  });
+}
+
+template <>
+void launch_bias_add_transform_20314<float>(float* output, const float* input,
+                                            const float* bias, int dim_0,
+                                            int dim_1, int dim_2, int dim_3,
+                                            int dim_4) {
+  // a row of dim_4 is contiguous in the input and the output.
+  int64_t rows = int64_t(dim_0) * dim_1 * dim_2 * dim_3;
+  parallel_for(0, rows, GRAIN_SIZE / dim_4, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      int64_t id3 = row % dim_3;
+      int64_t id2 = row / dim_3 % dim_2;
+      int64_t id1 = row / (dim_3 * dim_2) % dim_1;
+      int64_t id0 = row / (dim_3 * dim_2 * dim_1);
+      int64_t trg_row = ((id2 * dim_0 + id0) * dim_3 + id3) * dim_1 + id1;
+      add_row(output + trg_row * dim_4, input + row * dim_4,
+              bias + (id2 * dim_3 + id3) * dim_4, nullptr, dim_4);
+    }
+  });
+}
+
+template <typename T>
+void launch_transform_0213(const T* input, T* output, int sz0, int sz1,
+                           int sz2, int sz3) {
+  int64_t rows = int64_t(sz0) * sz1 * sz2;
+  parallel_for(0, rows, GRAIN_SIZE / sz3, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      int64_t id2 = row % sz2;
+      int64_t id1 = row / sz2 % sz1;
+      int64_t id0 = row / (sz2 * sz1);
+      int64_t trg_row = (id0 * sz2 + id2) * sz1 + id1;
+      std::memcpy(output + trg_row * sz3, input + row * sz3,
+                  sz3 * sizeof(T));
+    }
+  });
+}
+
+template void launch_transform_0213<float>(const float* input, float* output,
+                                           int sz0, int sz1, int sz2,
+                                           int sz3);
+
+template <>
+void launch_quantize_rows<float>(int8_t* q, float* scales, const float* inp,
+                                 int rows, int cols) {
+  parallel_for(0, rows, GRAIN_SIZE / cols, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      const float* x = inp + row * cols;
+      int8_t* y = q + row * cols;
+
+      float amax = 0.f;
+      int i = 0;
+#ifdef LS_ARM_SIMD
+      vec_t v_amax = vset1(0.f);
+      for (; i + kVecSize <= cols; i += kVecSize) {
+        v_amax = vmax(v_amax, vabs(vload(x + i)));
+      }
+      amax = vreduce_max(v_amax);
+#endif
+      for (; i < cols; i++) {
+        amax = std::max(amax, std::fabs(x[i]));
+      }
+      float scale = amax > 0.f ? amax / 127.f : 1.f;
+      scales[row] = scale;
+
+      float inv_scale = 1.f / scale;
+      i = 0;
+#ifdef LS_ARM_SIMD
+      vec_t v_inv_scale = vset1(inv_scale);
+      for (; i + kVecSize <= cols; i += kVecSize) {
+        vstore_s8(y + i, vmul(vload(x + i), v_inv_scale));
+      }
+#endif
+      for (; i < cols; i++) {
+        int v = int(std::nearbyint(x[i] * inv_scale));
+        y[i] = int8_t(std::min(std::max(v, -127), 127));
+      }
+    }
+  });
+}
+
+namespace {
+
+// the two epilogues of the int8 gemm, a row of out from a row of c.
+template <bool use_act, ActivationType act_type>
+inline void dequantize_row(float* out, const int32_t* c, float row_scale,
+                           const float* col_scales, const float* bias,
+                           const float* residual, int cols) {
+  int i = 0;
+#ifdef LS_ARM_SIMD
+  vec_t v_row_scale = vset1(row_scale);
+  for (; i + kVecSize <= cols; i += kVecSize) {
+    vec_t v = vmul(vmul(vload_i32(c + i), v_row_scale), vload(col_scales + i));
+    if (bias) v = vadd(v, vload(bias + i));
+    if (use_act) {
+      v = act_type == ActivationType::kRelu ? vmax(v, vset1(0.f)) : vgelu(v);
+    } else if (residual) {
+      v = vadd(v, vload(residual + i));
+    }
+    vstore(out + i, v);
+  }
+#endif
+  for (; i < cols; i++) {
+    float v = c[i] * row_scale * col_scales[i] + (bias ? bias[i] : 0.f);
+    if (use_act) {
+      v = act_type == ActivationType::kRelu ? std::max(v, 0.f) : gelu(v);
+    } else if (residual) {
+      v += residual[i];
+    }
+    out[i] = v;
+  }
+}
+
+}  // namespace
+
+template <ActivationType act_type, typename T>
+void launch_dequantize_bias_act(T* out, const int32_t* c,
+                                const float* row_scales,
+                                const float* col_scales, const T* bias,
+                                int rows, int cols) {
+  parallel_for(0, rows, GRAIN_SIZE / cols, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      dequantize_row<true, act_type>(out + row * cols, c + row * cols,
+                                     row_scales[row], col_scales, bias,
+                                     nullptr, cols);
+    }
+  });
+}
+
+template void launch_dequantize_bias_act<ActivationType::kRelu, float>(
+    float* out, const int32_t* c, const float* row_scales,
+    const float* col_scales, const float* bias, int rows, int cols);
+template void launch_dequantize_bias_act<ActivationType::kGelu, float>(
+    float* out, const int32_t* c, const float* row_scales,
+    const float* col_scales, const float* bias, int rows, int cols);
+
+template <>
+void launch_dequantize_bias_res<float>(float* out, const int32_t* c,
+                                       const float* row_scales,
+                                       const float* col_scales,
+                                       const float* bias,
+                                       const float* residual, int rows,
+                                       int cols) {
+  parallel_for(0, rows, GRAIN_SIZE / cols, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      dequantize_row<false, ActivationType::kRelu>(
+          out + row * cols, c + row * cols, row_scales[row], col_scales, bias,
+          residual ? residual + row * cols : nullptr, cols);
+    }
+  });
+}
+
+namespace {
+
+// the k largest of logits + bias, sorted in descending order, top_val[0] is
+// the max of the row. Returns sum(exp(x - max)) over the row if with_sum.
+float row_topk(const float* logits, const float* bias, int n, int k,
+               float* top_val, int* top_idx, bool with_sum) {
+  for (int j = 0; j < k; j++) {
+    top_val[j] = kFloatInfNeg;
+    top_idx[j] = -1;
+  }
+  auto insert = [&](float v, int i) {
+    if (!(v > top_val[k - 1])) return;
+    int j = k - 1;
+    for (; j > 0 && top_val[j - 1] < v; j--) {
+      top_val[j] = top_val[j - 1];
+      top_idx[j] = top_idx[j - 1];
+    }
+    top_val[j] = v;
+    top_idx[j] = i;
+  };
+
+  int i = 0;
+#ifdef LS_ARM_SIMD
+  // a vector only goes through the scalar insertion if one of its lanes
+  // beats the current k-th value, which is rare after the first vectors.
+  float lanes[kVecSize];
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vec_t v = vadd(vload(logits + i), vload(bias + i));
+    if (!vany_gt(v, vset1(top_val[k - 1]))) continue;
+    vstore(lanes, v);
+    for (int l = 0; l < kVecSize; l++) insert(lanes[l], i + l);
+  }
+#endif
+  for (; i < n; i++) insert(logits[i] + bias[i], i);
+  if (!with_sum) return 0.f;
+
+  const float max_val = top_val[0];
+  float sum = 0.f;
+  i = 0;
+#ifdef LS_ARM_SIMD
+  vec_t v_sum = vset1(0.f);
+  vec_t v_max = vset1(max_val);
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vec_t v = vadd(vload(logits + i), vload(bias + i));
+    v_sum = vadd(v_sum, vexp(vsub(v, v_max)));
+  }
+  sum = vreduce_sum(v_sum);
+#endif
+  for (; i < n; i++) sum += expf(logits[i] + bias[i] - max_val);
+  return sum;
+}
+
+// the first of the n indices whose prefix sum of weight(i) exceeds r times
+// their sum
+template <typename Weight>
+inline int sample_index(const Weight& weight, int n, float r) {
+  float total = 0.f;
+  for (int i = 0; i < n; i++) total += weight(i);
+  float threshold = r * total, prefix = 0.f;
+  for (int i = 0; i < n; i++) {
+    prefix += weight(i);
+    if (prefix > threshold) return i;
+  }
+  return n - 1;
+}
+
+}  // namespace
+
+template <>
+void launch_dec_emb<float>(const float* token_emb, const float* pos_emb,
+                           int* tokens, const float* lang_emb,
+                           const int* lang_id, float* output, int batch_size,
+                           int beam_size, int hidden_dim, int vocab_size,
+                           int step, int max_step, int multilg_type) {
+  if (step >= max_step) {
+    throw std::runtime_error("violate step < max_step");
+  }
+  parallel_for(
+      0, batch_size * beam_size, GRAIN_SIZE / hidden_dim,
+      [&](int64_t begin, int64_t end) {
+        for (int64_t row = begin; row < end; row++) {
+          int batch_idx = row / beam_size;
+          float* out = output + row * hidden_dim;
+          const float* pos = pos_emb + size_t(step) * hidden_dim;
+          if ((multilg_type == 2 || multilg_type == 3) && step == 0) {
+            // the bos of sentence level multilg is the target language.
+            int lid = lang_id[batch_idx];
+            tokens[row * max_step] = lid;
+            add_row(out, lang_emb + size_t(lid) * hidden_dim, pos, nullptr,
+                    hidden_dim);
+          } else {
+            // token_emb is [hidden_dim, vocab_size] for the decoder.
+            int token = tokens[row * max_step + step];
+            for (int i = 0; i < hidden_dim; i++) {
+              out[i] = token_emb[size_t(i) * vocab_size + token] + pos[i];
+            }
+          }
+          if (multilg_type == 1) {
+            const float* lemb =
+                lang_emb + size_t(lang_id[batch_idx]) * hidden_dim;
+            add_row(out, out, lemb, nullptr, hidden_dim);
+          }
+        }
+      });
+}
+
+template <typename T>
+void launch_concat3_dim1(const T* inp1, const T* inp2, T* output, int sz0,
+                         int sz2, int sz1_1, int sz1_2) {
+  const size_t len1 = size_t(sz1_1) * sz2, len2 = size_t(sz1_2) * sz2;
+  parallel_for(0, sz0, GRAIN_SIZE / (len1 + len2 + 1),
+               [&](int64_t begin, int64_t end) {
+                 for (int64_t i = begin; i < end; i++) {
+                   T* out = output + i * (len1 + len2);
+                   std::memcpy(out, inp1 + i * len1, len1 * sizeof(T));
+                   std::memcpy(out + len1, inp2 + i * len2, len2 * sizeof(T));
+                 }
+               });
+}
+
+template void launch_concat3_dim1<float>(const float* inp1, const float* inp2,
+                                         float* output, int sz0, int sz2,
+                                         int sz1_1, int sz1_2);
+
+template <typename T>
+void launch_filling_concat3_dim1(T* output, const T* inp, int sz0, int mx_sz1,
+                                 int sz2, int sz1_0, int sz1_1) {
+  const size_t len = size_t(sz1_1) * sz2;
+  parallel_for(0, sz0, GRAIN_SIZE / (len + 1), [&](int64_t begin, int64_t end) {
+    for (int64_t i = begin; i < end; i++) {
+      std::memcpy(output + (i * mx_sz1 + sz1_0) * sz2, inp + i * len,
+                  len * sizeof(T));
+    }
+  });
+}
+
+template void launch_filling_concat3_dim1<float>(float* output,
+                                                 const float* inp, int sz0,
+                                                 int mx_sz1, int sz2,
+                                                 int sz1_0, int sz1_1);
+
+template <>
+void beam_search_topk<float>(const float* logits, const float* logit_bias,
+                             const float* seq_probs, const float* seq_score,
+                             const int* alive_seq, int* can_idx,
+                             float* can_score, int* num_beam_can,
+                             int vocab_size, int max_step, float length_norm,
+                             int cur_step, int batch_size, int beam_size,
+                             int end_id) {
+  parallel_for(0, batch_size, 1, [&](int64_t begin, int64_t end) {
+    const int num_can = beam_size * beam_size;
+    std::vector<float> beam_score(num_can);
+    std::vector<int> beam_idx(num_can);
+    std::vector<int> order(num_can);
+    for (int64_t batch_id = begin; batch_id < end; batch_id++) {
+      // step 1. the top beam_size tokens of every beam, as the candidates
+      for (int beam_id = 0; beam_id < beam_size; beam_id++) {
+        int64_t row = batch_id * beam_size + beam_id;
+        float* top_val = beam_score.data() + beam_id * beam_size;
+        int* top_idx = beam_idx.data() + beam_id * beam_size;
+        int beam_offset = beam_id * vocab_size;
+        if (cur_step != 0 && alive_seq[row * max_step + cur_step] == end_id) {
+          // a finished beam only keeps its eos, with its score unchanged
+          for (int k = 0; k < beam_size; k++) {
+            top_val[k] = k == 0 ? seq_score[row] : kFloatInfNeg;
+            top_idx[k] = end_id + beam_offset;
+          }
+          continue;
+        }
+        float sum_exp = row_topk(logits + row * vocab_size, logit_bias,
+                                 vocab_size, beam_size, top_val, top_idx, true);
+        float log_prob_base = seq_probs[row] - logf(sum_exp) - top_val[0];
+        for (int k = 0; k < beam_size; k++) {
+          if (top_idx[k] < 0) {
+            top_idx[k] = end_id + beam_offset;
+            continue;
+          }
+          top_val[k] = std::max((top_val[k] + log_prob_base) * length_norm,
+                                kMinLogProbability + 1.f) +
+                       batch_id * kMinLogProbability;
+          top_idx[k] += beam_offset;
+        }
+      }
+
+      // step 2. the top beam_size among the candidates of the batch item
+      for (int i = 0; i < num_can; i++) order[i] = i;
+      std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return beam_score[a] > beam_score[b];
+      });
+      for (int k = 0; k < beam_size; k++) {
+        int pos = batch_id * beam_size + k;
+        can_score[pos] = beam_score[order[k]];
+        can_idx[pos] = beam_idx[order[k]];
+        num_beam_can[pos + 1] = pos;
+      }
+    }
+  });
+}
+
+void prune_beams(int* can_idx, float* can_score, const int* num_can_per_beam,
+                 int vocab_size, int batch_size, int beam_size,
+                 float abs_margin, float rel_margin, int end_id) {
+  for (int batch_id = 0; batch_id < batch_size; batch_id++) {
+    int* batch_idx = can_idx + num_can_per_beam[batch_id * beam_size];
+    float* batch_score = can_score + num_can_per_beam[batch_id * beam_size];
+    float offset = batch_id * kMinLogProbability;
+    float best = batch_score[0] - offset;
+    float margin = std::min(abs_margin > 0.f ? abs_margin : INFINITY,
+                            rel_margin > 0.f ? rel_margin * std::fabs(best)
+                                             : INFINITY);
+    for (int k = 1; k < beam_size; k++) {
+      if (batch_score[k] - offset >= best - margin) continue;
+      batch_idx[k] = batch_idx[k] / vocab_size * vocab_size + end_id;
+      batch_score[k] = kMinLogProbability + 0.5f + offset;
+    }
+  }
+}
+
+void refresh_result(const int* can_idx, const float* can_score,
+                    const int* num_can_per_beam, const int* old_alive_seq,
+                    int* new_alive_seq, float* seq_probs, float* seq_score,
+                    int* num_finish_beam, int vocab_size, int cur_step,
+                    float length_norm, int batch_size, int beam_size,
+                    int max_step, int end_id) {
+  int num_finish = 0;
+  for (int batch_id = 0; batch_id < batch_size; batch_id++) {
+    for (int beam_id = 0; beam_id < beam_size; beam_id++) {
+      int row = batch_id * beam_size + beam_id;
+      int can_pos = num_can_per_beam[batch_id * beam_size] + beam_id;
+      int can_beam_id = can_idx[can_pos] / vocab_size;
+      int can_vocab_id = can_idx[can_pos] % vocab_size;
+
+      const int* old_seq =
+          old_alive_seq + size_t(batch_id * beam_size + can_beam_id) * max_step;
+      int* new_seq = new_alive_seq + size_t(row) * max_step;
+      for (int i = 0; i < max_step; i++) {
+        new_seq[i] = i <= cur_step       ? old_seq[i]
+                     : i == cur_step + 1 ? can_vocab_id
+                                         : end_id;
+      }
+
+      seq_score[row] = can_score[can_pos];
+      if (can_vocab_id != end_id) {
+        // the log probability without the length penalty and batch offset
+        seq_probs[row] =
+            (can_score[can_pos] - batch_id * kMinLogProbability) / length_norm;
+      } else {
+        num_finish++;
+      }
+    }
+  }
+  *num_finish_beam = num_finish;
+}
+
+template <typename T>
+void refresh_cache(const int* num_can_per_beam, const int* can_idx,
+                   const T* caches_k, const T* caches_v, T* new_caches_k,
+                   T* new_caches_v, size_t layer_size, int num_layers,
+                   int batch_size, int beam_size, int dim_per_head,
+                   int head_num, int vocab_size, int cur_step, int max_step,
+                   int end_id) {
+  // [num_layers, batch_size, beam_size, head_num, max_step, dim_per_head],
+  // the first cur_step + 1 steps of the beam the candidate extends.
+  const size_t step_len = size_t(cur_step + 1) * dim_per_head;
+  const size_t head_size = size_t(max_step) * dim_per_head;
+  const size_t beam_len = head_size * head_num;
+  parallel_for(
+      0, int64_t(num_layers) * batch_size * beam_size,
+      GRAIN_SIZE / (2 * step_len * head_num), [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+          int layer_id = i / (batch_size * beam_size);
+          int batch_id = i / beam_size % batch_size;
+          int beam_id = i % beam_size;
+          int can_pos = num_can_per_beam[batch_id * beam_size] + beam_id;
+          if (cur_step != 0 && can_idx[can_pos] % vocab_size == end_id) {
+            continue;
+          }
+          int can_beam_id = can_idx[can_pos] / vocab_size;
+          size_t batch_offset =
+              layer_id * layer_size + size_t(batch_id) * beam_size * beam_len;
+          size_t src = batch_offset + can_beam_id * beam_len;
+          size_t dst = batch_offset + beam_id * beam_len;
+          for (int h = 0; h < head_num; h++) {
+            size_t offset = h * head_size;
+            std::memcpy(new_caches_k + dst + offset, caches_k + src + offset,
+                        step_len * sizeof(T));
+            std::memcpy(new_caches_v + dst + offset, caches_v + src + offset,
+                        step_len * sizeof(T));
+          }
+        }
+      });
+}
+
+template void refresh_cache<float>(
+    const int* num_can_per_beam, const int* can_idx, const float* caches_k,
+    const float* caches_v, float* new_caches_k, float* new_caches_v,
+    size_t layer_size, int num_layers, int batch_size, int beam_size,
+    int dim_per_head, int head_num, int vocab_size, int cur_step, int max_step,
+    int end_id);
+
+template <>
+void launch_topk_sample<float>(const float* logits, const float* logit_bias,
+                               int* tokens, int* unfinished,
+                               const float* random_x, int batch_size,
+                               int batch_seq_len, int prompt_len, int max_step,
+                               int logits_seq_len, int vocab_size, int topk,
+                               int eos_id) {
+  topk = std::min(topk, vocab_size);
+  parallel_for(0, batch_size, 1, [&](int64_t begin, int64_t end) {
+    std::vector<float> top_val(topk);
+    std::vector<int> top_idx(topk);
+    for (int64_t batch_id = begin; batch_id < end; batch_id++) {
+      int* last_token = tokens + batch_id * max_step + batch_seq_len - 1;
+      if (batch_seq_len > prompt_len && last_token[0] == eos_id) {
+        last_token[1] = eos_id;
+        continue;
+      }
+      const float* row =
+          logits + ((batch_id + 1) * logits_seq_len - 1) * size_t(vocab_size);
+      row_topk(row, logit_bias, vocab_size, topk, top_val.data(),
+               top_idx.data(), false);
+      // the probabilities of the top k, relative to their sum
+      const float max_val = top_val[0];
+      for (int k = 0; k < topk; k++) {
+        top_val[k] = top_idx[k] < 0 ? 0.f : expf(top_val[k] - max_val);
+      }
+      int pick = sample_index([&](int j) { return top_val[j]; }, topk,
+                              random_x[batch_id]);
+      last_token[1] = top_idx[pick];
+    }
+  });
+  *unfinished = 0;
+  for (int batch_id = 0; batch_id < batch_size; batch_id++) {
+    if (tokens[batch_id * max_step + batch_seq_len] != eos_id) *unfinished = 1;
+  }
+}
+
+template <>
+void launch_topp_sample<float>(const float* logits, const float* logit_bias,
+                               int* tokens, int* unfinished,
+                               const float* random_x, int batch_size,
+                               int batch_seq_len, int prompt_len, int max_step,
+                               int logits_seq_len, int vocab_size, float topp,
+                               int eos_id) {
+  parallel_for(0, batch_size, 1, [&](int64_t begin, int64_t end) {
+    std::vector<float> probs(vocab_size);
+    std::vector<int> order(vocab_size);
+    for (int64_t batch_id = begin; batch_id < end; batch_id++) {
+      int* last_token = tokens + batch_id * max_step + batch_seq_len - 1;
+      if (batch_seq_len > prompt_len && last_token[0] == eos_id) {
+        last_token[1] = eos_id;
+        continue;
+      }
+      const float* row =
+          logits + ((batch_id + 1) * logits_seq_len - 1) * size_t(vocab_size);
+
+      // step 1. the unnormalized probabilities, exp(x - max)
+      float max_val = kFloatInfNeg;
+      int i = 0;
+#ifdef LS_ARM_SIMD
+      vec_t v_max = vset1(kFloatInfNeg);
+      for (; i + kVecSize <= vocab_size; i += kVecSize) {
+        vec_t v = vadd(vload(row + i), vload(logit_bias + i));
+        vstore(probs.data() + i, v);
+        v_max = vmax(v_max, v);
+      }
+      max_val = vreduce_max(v_max);
+#endif
+      for (; i < vocab_size; i++) {
+        probs[i] = row[i] + logit_bias[i];
+        max_val = std::max(max_val, probs[i]);
+      }
+      float sum = 0.f;
+      i = 0;
+#ifdef LS_ARM_SIMD
+      vec_t v_sum = vset1(0.f);
+      for (; i + kVecSize <= vocab_size; i += kVecSize) {
+        vec_t v = vexp(vsub(vload(probs.data() + i), vset1(max_val)));
+        vstore(probs.data() + i, v);
+        v_sum = vadd(v_sum, v);
+      }
+      sum = vreduce_sum(v_sum);
+#endif
+      for (; i < vocab_size; i++) {
+        probs[i] = expf(probs[i] - max_val);
+        sum += probs[i];
+      }
+
+      // step 2. the smallest set of the most probable tokens whose mass
+      // reaches topp, the nucleus is usually small so it is sorted partially
+      // with a growing bound.
+      for (i = 0; i < vocab_size; i++) order[i] = i;
+      auto greater = [&](int a, int b) { return probs[a] > probs[b]; };
+      const float threshold = topp * sum;
+      int num_sorted = 0, nucleus = vocab_size;
+      float prefix = 0.f;
+      for (int bound = std::min(64, vocab_size); num_sorted < vocab_size;
+           bound = std::min(bound * 16, vocab_size)) {
+        std::partial_sort(order.begin() + num_sorted, order.begin() + bound,
+                          order.end(), greater);
+        for (; num_sorted < bound; num_sorted++) {
+          prefix += probs[order[num_sorted]];
+          if (prefix >= threshold) break;
+        }
+        if (num_sorted < bound) {
+          nucleus = num_sorted + 1;
+          break;
+        }
+      }
+
+      // step 3. sample in the nucleus
+      int pick = sample_index([&](int j) { return probs[order[j]]; }, nucleus,
+                              random_x[batch_id]);
+      last_token[1] = order[pick];
+    }
+  });
+  *unfinished = 0;
+  for (int batch_id = 0; batch_id < batch_size; batch_id++) {
+    if (tokens[batch_id * max_step + batch_seq_len] != eos_id) *unfinished = 1;
+  }
+}
+
+}  // namespace arm
+}  // namespace lightseq
@@ -0,0 +1,117 @@
+#include "kernels.h"
+
+namespace lightseq {
+namespace cuda {
+
+/*
+The one-shot all-reduce of tensor parallel inference over buffers mapped
+into the address space of every rank, for the small messages of decode
+where the latency of the nccl ring dominates: every rank copies its input
+into its own buffer, waits for the others to do the same and sums all the
+buffers itself, in one kernel and without any host synchronization.
+
+The workspace of every rank is two data buffers of max_bytes, used in turn,
+then the [kOneShotBlocks, world_size] flags set by the other ranks. Block b
+of every rank copies and reads the same vectors, so it only waits for the
+blocks b of the others, which write their epoch, the number of calls of the
+block, into its flag of every rank. A rank can reuse a data buffer once all
+the others have reached the next epoch, so past every read of it.
+*/
+size_t one_shot_workspace_bytes(size_t max_bytes, int world_size) {
+  return 2 * max_bytes + kOneShotBlocks * world_size * sizeof(unsigned int);
+}
+
+/**
+@brief: ker_one_shot_all_reduce
+
+@thread
+gridDim.x = kOneShotBlocks
+blockDim.x = MAX_THREADS
+
+@param
+out: [num_vec] int4 vectors of T, can be inp
+inp: [num_vec]
+peers: [world_size] the workspaces of all the ranks
+epochs: [kOneShotBlocks] the epoch of every block of this rank
+*/
+template <typename T>
+__global__ void ker_one_shot_all_reduce(int4 *out, const int4 *inp,
+                                        char *const *peers,
+                                        unsigned int *epochs, int rank,
+                                        int world_size, size_t max_bytes,
+                                        int num_vec) {
+  const int kVecEle = sizeof(int4) / sizeof(T);
+  __shared__ unsigned int s_epoch;
+  if (threadIdx.x == 0) s_epoch = epochs[blockIdx.x] + 1;
+  __syncthreads();
+  unsigned int epoch = s_epoch;
+  size_t data_offset = (epoch & 1) * max_bytes;
+  size_t flag_offset = 2 * max_bytes;
+
+  int4 *own = (int4 *)(peers[rank] + data_offset);
+  int stride = gridDim.x * blockDim.x;
+  int begin = blockIdx.x * blockDim.x + threadIdx.x;
+  for (int i = begin; i < num_vec; i += stride) own[i] = inp[i];
+  __syncthreads();
+
+  if (threadIdx.x < world_size) {
+    __threadfence_system();
+    volatile unsigned int *peer_flags =
+        (unsigned int *)(peers[threadIdx.x] + flag_offset);
+    peer_flags[blockIdx.x * world_size + rank] = epoch;
+    // the peer may already be an epoch ahead, see above.
+    volatile unsigned int *own_flags =
+        (unsigned int *)(peers[rank] + flag_offset);
+    while (own_flags[blockIdx.x * world_size + threadIdx.x] < epoch) {
+    }
+    __threadfence_system();
+  }
+  __syncthreads();
+
+  // summed in the order of the ranks, so all of them get the same result.
+  for (int i = begin; i < num_vec; i += stride) {
+    float acc[kVecEle] = {0.f};
+    for (int r = 0; r < world_size; r++) {
+      int4 vec = __ldcv((const int4 *)(peers[r] + data_offset) + i);
+      const T *ele = reinterpret_cast<const T *>(&vec);
+#pragma unroll
+      for (int k = 0; k < kVecEle; k++) acc[k] += float(ele[k]);
+    }
+    int4 res;
+    T *res_ele = reinterpret_cast<T *>(&res);
+#pragma unroll
+    for (int k = 0; k < kVecEle; k++) res_ele[k] = T(acc[k]);
+    out[i] = res;
+  }
+  if (threadIdx.x == 0) epochs[blockIdx.x] = epoch;
+}
+
+template <typename T>
+void launch_one_shot_all_reduce(T *out, const T *inp, char *const *peers,
+                                unsigned int *epochs, int rank, int world_size,
+                                size_t max_bytes, int nele,
+                                cudaStream_t stream) {
+  if (nele * sizeof(T) % sizeof(int4) != 0 || nele * sizeof(T) > max_bytes ||
+      world_size > MAX_THREADS) {
+    throw std::runtime_error(
+        "one-shot all-reduce needs a message of 16 byte vectors which fits "
+        "in its workspace");
+  }
+  ker_one_shot_all_reduce<T><<<kOneShotBlocks, MAX_THREADS, 0, stream>>>(
+      (int4 *)out, (const int4 *)inp, peers, epochs, rank, world_size,
+      max_bytes, nele * sizeof(T) / sizeof(int4));
+}
+
+template void launch_one_shot_all_reduce<float>(
+    float *out, const float *inp, char *const *peers, unsigned int *epochs,
+    int rank, int world_size, size_t max_bytes, int nele, cudaStream_t stream);
+template void launch_one_shot_all_reduce<__half>(
+    __half *out, const __half *inp, char *const *peers, unsigned int *epochs,
+    int rank, int world_size, size_t max_bytes, int nele, cudaStream_t stream);
+template void launch_one_shot_all_reduce<__nv_bfloat16>(
+    __nv_bfloat16 *out, const __nv_bfloat16 *inp, char *const *peers,
+    unsigned int *epochs, int rank, int world_size, size_t max_bytes,
+    int nele, cudaStream_t stream);
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -25,87 +25,126 @@ __device__ void warp_reduce_max(cg::thread_block_tile<WARP_SIZE> g, float* val,
   *index = cur_max_idx;
 }
 
+// The tokens [offset, offset + len) of the sequence of the block, which ends
+// at its first pad of mask, or at cu_seqlens for packed sequences.
+template <typename T>
+__device__ void crf_seq_range(const T* mask, const int* cu_seqlens,
+                              int seq_len, int* offset, int* len) {
+  __shared__ int s_len;
+  if (cu_seqlens) {
+    *offset = cu_seqlens[blockIdx.x];
+    *len = cu_seqlens[blockIdx.x + 1] - *offset;
+    return;
+  }
+  *offset = blockIdx.x * seq_len;
+  if (threadIdx.x == 0) s_len = seq_len;
+  __syncthreads();
+  for (int i = threadIdx.x + 1; i < seq_len; i += blockDim.x) {
+    if (float(mask[*offset + i]) <= CUDA_FLOAT_INF_NEG) {
+      atomicMin(&s_len, i);
+    }
+  }
+  __syncthreads();
+  *len = s_len;
+}
+
 /**
 @brief: ker_viterbi
 Find the best tag sequence using Viterbi algorithm.
-One thread block compute one sequence.
+One thread block compute one sequence, with one thread per tag, so that a
+sequence of at most WARP_SIZE tags is decoded by a single warp and every step
+costs one sync. The transition is tiled in shared memory when it fits,
+transposed so that the threads of a warp read consecutive tags. The scores
+are accumulated in float, and the backtrace runs in the same kernel.
+
+A sequence ends at its first pad of mask, or at cu_seqlens for packed
+sequences, the steps after it are skipped.
 
 @thread
 gridDim.x = batch_size
-blockDim.x = WARP_SIZE
-blockDim.y = WARP_SIZE
+blockDim.x = num_tags rounded up to WARP_SIZE, at most MAX_THREADS
 
 @param
 start_transition: [num_tags]
 end_transition: [num_tags]
 transition: [num_tags, num_tags]
   transition[i, j] means the score of tag_j -> tag_i
-emission: [batch_size, seq_len, num_tags]
+emission: [batch_size, seq_len, num_tags], or [batch_tokens, num_tags] of
+  the packed sequences with cu_seqlens
 mask: [batch_size, seq_len]
-  0 for invalid token
+  0 for invalid token, unused with cu_seqlens
+cu_seqlens: [batch_size + 1] the offsets of the packed sequences, nullptr
+  for padded ones
 bias: [num_tags]
 best_score: [batch_size]
-history: [batch_size, seq_len, num_tags]:
-  i, j, k store the tag of i-th batch, j-th step when
-  the tag of i-th batch, (j+1)-th step is k
-best_tag: [batch_size, seq_len]
+history: [batch_tokens, num_tags]:
+  j, k store the tag of token j when the tag of token j + 1 is k
+best_tag: [batch_size, seq_len], invalid_tag after the end of a sequence
 */
-template <typename T>
+template <typename T, bool kSmemTransition>
 __global__ void ker_viterbi(const T* start_transition, const T* end_transition,
                             const T* transition, const T* emission,
-                            const T* mask, const T* bias, float* best_score,
-                            int* history, int* best_tags, int num_tags,
-                            int seq_len) {
+                            const T* mask, const int* cu_seqlens,
+                            const T* bias, float* best_score, int* history,
+                            int* best_tags, int num_tags, int seq_len) {
   cg::thread_block b = cg::this_thread_block();
   cg::thread_block_tile<WARP_SIZE> g = cg::tiled_partition<WARP_SIZE>(b);
 
   extern __shared__ float smen[];
   float* s_score = smen;
   float* s_next_score = smen + num_tags;
+  // [pre_tag, cur_tag]
+  T* s_transition = (T*)(smen + 2 * num_tags);
+  __shared__ float s_warp_score[WARP_SIZE];
+  __shared__ int s_warp_tag[WARP_SIZE];
+
+  // step 0. find the tokens of the sequence
+  int offset, len;
+  crf_seq_range(mask, cu_seqlens, seq_len, &offset, &len);
+  int* seq_best_tags = best_tags + blockIdx.x * seq_len;
+  for (int i = len + threadIdx.x; i < seq_len; i += blockDim.x) {
+    seq_best_tags[i] = invalid_tag;
+  }
+  if (len == 0) return;
 
   // step 1. compute first step's score
-  if (threadIdx.y == 0) {
-    for (int cur_tag = threadIdx.x; cur_tag < num_tags; cur_tag += blockDim.x) {
-      float linear_bias = bias ? float(bias[cur_tag]) : float(0);
-      s_score[cur_tag] =
-          float(
-              emission[flat_3dim(blockIdx.x, 0, cur_tag, seq_len, num_tags)]) +
-          linear_bias + float(start_transition[cur_tag]);
+  if (kSmemTransition) {
+    for (int i = threadIdx.x; i < num_tags * num_tags; i += blockDim.x) {
+      int cur_tag = i / num_tags;
+      int pre_tag = i - cur_tag * num_tags;
+      s_transition[pre_tag * num_tags + cur_tag] = transition[i];
     }
   }
+  for (int cur_tag = threadIdx.x; cur_tag < num_tags; cur_tag += blockDim.x) {
+    float linear_bias = bias ? float(bias[cur_tag]) : float(0);
+    s_score[cur_tag] = float(emission[offset * num_tags + cur_tag]) +
+                       linear_bias + float(start_transition[cur_tag]);
+  }
   b.sync();
 
   // step 2. compute last step's score
-  int seq_idx;
-  for (seq_idx = 1; seq_idx < seq_len; seq_idx++) {
-    if (mask[flat_2dim(blockIdx.x, seq_idx, seq_len)] == CUDA_FLOAT_INF_NEG) {
-      break;
-    }
-    for (int cur_tag = threadIdx.y; cur_tag < num_tags; cur_tag += blockDim.y) {
+  for (int seq_idx = 1; seq_idx < len; seq_idx++) {
+    const T* step_emission = emission + (offset + seq_idx) * num_tags;
+    int* step_history = history + (offset + seq_idx - 1) * num_tags;
+    for (int cur_tag = threadIdx.x; cur_tag < num_tags;
+         cur_tag += blockDim.x) {
       float max_score = REDUCE_FLOAT_INF_NEG;
       int idx = 0;
-      const T* cur_transition = transition + cur_tag * num_tags;
-      for (int pre_tag = threadIdx.x; pre_tag < num_tags;
-           pre_tag += blockDim.x) {
-        float s = (float)s_score[pre_tag] + (float)cur_transition[pre_tag];
+      for (int pre_tag = 0; pre_tag < num_tags; pre_tag++) {
+        float trans = kSmemTransition
+                          ? float(s_transition[pre_tag * num_tags + cur_tag])
+                          : float(transition[cur_tag * num_tags + pre_tag]);
+        float s = s_score[pre_tag] + trans;
         if (s > max_score) {
           max_score = s;
           idx = pre_tag;
         }
-      }  // col
-      g.sync();
-      warp_reduce_max(g, &max_score, &idx);
-      if (threadIdx.x == 0) {
-        float linear_bias = bias ? float(bias[cur_tag]) : float(0);
-        s_next_score[cur_tag] =
-            max_score +
-            float(emission[flat_3dim(blockIdx.x, seq_idx, cur_tag, seq_len,
-                                     num_tags)]) +
-            linear_bias;
-        history[flat_3dim(blockIdx.x, seq_idx - 1, cur_tag, seq_len,
-                          num_tags)] = idx;
       }
-    }  // row
+      float linear_bias = bias ? float(bias[cur_tag]) : float(0);
+      s_next_score[cur_tag] =
+          max_score + float(step_emission[cur_tag]) + linear_bias;
+      step_history[cur_tag] = idx;
+    }
     float* tmp = s_next_score;
     s_next_score = s_score;
     s_score = tmp;
@@ -113,170 +152,467 @@ __global__ void ker_viterbi(const T* start_transition, const T* end_transition,
   }  // seq_len
 
   // step 3. compute last tag
-  if (threadIdx.y != 0) {
-    return;
-  }
   float max_score = REDUCE_FLOAT_INF_NEG;
   int last_tag = 0;
   for (int cur_tag = threadIdx.x; cur_tag < num_tags; cur_tag += blockDim.x) {
-    float s = (float)s_score[cur_tag] + (float)end_transition[cur_tag];
+    float s = s_score[cur_tag] + float(end_transition[cur_tag]);
     if (s > max_score) {
       max_score = s;
       last_tag = cur_tag;
     }
   }
-  g.sync();
   warp_reduce_max(g, &max_score, &last_tag);
+  if (threadIdx.x % WARP_SIZE == 0) {
+    s_warp_score[threadIdx.x / WARP_SIZE] = max_score;
+    s_warp_tag[threadIdx.x / WARP_SIZE] = last_tag;
+  }
+  b.sync();
 
   // step 4. compute full tag sequence
   if (threadIdx.x != 0) {
     return;
   }
+  for (int w = 1; w < blockDim.x / WARP_SIZE; w++) {
+    if (s_warp_score[w] > max_score) {
+      max_score = s_warp_score[w];
+      last_tag = s_warp_tag[w];
+    }
+  }
   if (best_score) {
     best_score[blockIdx.x] = max_score;  // for debug
   }
-  seq_idx--;
-  best_tags[flat_2dim(blockIdx.x, seq_idx, seq_len)] = last_tag;
-  for (int i = seq_idx - 1; i >= 0; i--) {
-    last_tag = history[flat_3dim(blockIdx.x, i, last_tag, seq_len, num_tags)];
-    best_tags[flat_2dim(blockIdx.x, i, seq_len)] = last_tag;
+  seq_best_tags[len - 1] = last_tag;
+  for (int i = len - 2; i >= 0; i--) {
+    last_tag = history[(offset + i) * num_tags + last_tag];
+    seq_best_tags[i] = last_tag;
   }
-  for (int i = seq_idx + 1; i < seq_len; i++) {
-    best_tags[flat_2dim(blockIdx.x, i, seq_len)] = invalid_tag;
+}
+
+template <typename T>
+void launch_viterbi_kernel(const T* start_transition, const T* end_transition,
+                           const T* transition, const T* emission,
+                           const T* mask, const int* cu_seqlens,
+                           float* best_score, int* history, int* best_tags,
+                           int num_tags, int seq_len, int batch_size,
+                           cudaStream_t stream, const T* bias) {
+  int block_dim = (num_tags + WARP_SIZE - 1) / WARP_SIZE * WARP_SIZE;
+  block_dim = std::min(block_dim, MAX_THREADS);
+  size_t score_bytes = 2 * num_tags * sizeof(float);
+  size_t smem_bytes = score_bytes + size_t(num_tags) * num_tags * sizeof(T);
+
+  int device, max_smem;
+  CHECK_GPU_ERROR(cudaGetDevice(&device));
+  CHECK_GPU_ERROR(cudaDeviceGetAttribute(
+      &max_smem, cudaDevAttrMaxSharedMemoryPerBlockOptin, device));
+  // the static shared memory of the kernel takes the rest.
+  if (smem_bytes + 1024 > max_smem) {
+    ker_viterbi<T, false><<<batch_size, block_dim, score_bytes, stream>>>(
+        start_transition, end_transition, transition, emission, mask,
+        cu_seqlens, bias, best_score, history, best_tags, num_tags, seq_len);
+    return;
   }
+  if (smem_bytes > 48 * 1024) {
+    CHECK_GPU_ERROR(cudaFuncSetAttribute(
+        ker_viterbi<T, true>, cudaFuncAttributeMaxDynamicSharedMemorySize,
+        smem_bytes));
+  }
+  ker_viterbi<T, true><<<batch_size, block_dim, smem_bytes, stream>>>(
+      start_transition, end_transition, transition, emission, mask,
+      cu_seqlens, bias, best_score, history, best_tags, num_tags, seq_len);
 }
 
-template <>
-__global__ void ker_viterbi<__half>(const __half* start_transition,
-                                    const __half* end_transition,
-                                    const __half* transition,
-                                    const __half* emission, const __half* mask,
-                                    const __half* bias, float* best_score,
-                                    int* history, int* best_tags, int num_tags,
-                                    int seq_len) {
-  cg::thread_block b = cg::this_thread_block();
-  cg::thread_block_tile<WARP_SIZE> g = cg::tiled_partition<WARP_SIZE>(b);
+template <typename T>
+void launch_viterbi(const T* start_transition, const T* end_transition,
+                    const T* transition, const T* emission, const T* mask,
+                    float* best_score, int* history, int* best_tags,
+                    int num_tags, int seq_len, int batch_size,
+                    cudaStream_t stream, const T* bias) {
+  launch_viterbi_kernel(start_transition, end_transition, transition,
+                        emission, mask, (const int*)nullptr, best_score,
+                        history, best_tags, num_tags, seq_len, batch_size,
+                        stream, bias);
+}
+
+template <typename T>
+void launch_viterbi_varlen(const T* start_transition, const T* end_transition,
+                           const T* transition, const T* emission,
+                           const int* cu_seqlens, float* best_score,
+                           int* history, int* best_tags, int num_tags,
+                           int seq_len, int batch_size, cudaStream_t stream,
+                           const T* bias) {
+  launch_viterbi_kernel(start_transition, end_transition, transition,
+                        emission, (const T*)nullptr, cu_seqlens, best_score,
+                        history, best_tags, num_tags, seq_len, batch_size,
+                        stream, bias);
+}
+
+template void launch_viterbi<float>(
+    const float* start_transition, const float* end_transition,
+    const float* transition, const float* emission, const float* mask,
+    float* best_score, int* history, int* best_tags, int num_tags,
+    int seq_len, int batch_size, cudaStream_t stream, const float* bias);
+
+template void launch_viterbi<__half>(
+    const __half* start_transition, const __half* end_transition,
+    const __half* transition, const __half* emission, const __half* mask,
+    float* best_score, int* history, int* best_tags, int num_tags,
+    int seq_len, int batch_size, cudaStream_t stream, const __half* bias);
+
+template void launch_viterbi_varlen<float>(
+    const float* start_transition, const float* end_transition,
+    const float* transition, const float* emission, const int* cu_seqlens,
+    float* best_score, int* history, int* best_tags, int num_tags,
+    int seq_len, int batch_size, cudaStream_t stream, const float* bias);
+
+template void launch_viterbi_varlen<__half>(
+    const __half* start_transition, const __half* end_transition,
+    const __half* transition, const __half* emission, const int* cu_seqlens,
+    float* best_score, int* history, int* best_tags, int num_tags,
+    int seq_len, int batch_size, cudaStream_t stream, const __half* bias);
+
+// Adds v to the log-sum-exp of running max m and sum s of exp(x - m).
+__device__ __forceinline__ void crf_lse_add(float v, float* m, float* s) {
+  if (v > *m) {
+    *s = *s * __expf(*m - v) + 1.f;
+    *m = v;
+  } else {
+    *s += __expf(v - *m);
+  }
+}
+
+/**
+@brief: ker_crf_nll
+The negative log likelihood of the gold tags of a linear crf, the log of the
+partition function by the log-sum-exp forward recursion minus the score of
+the tags. One thread block computes one sequence, with one thread per tag,
+like ker_viterbi. The forward scores of every token are kept in alpha for
+ker_crf_nll_bw.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = num_tags rounded up to WARP_SIZE, at most MAX_THREADS
 
+@param
+start_transition, end_transition, transition, emission, mask, cu_seqlens,
+  bias: see ker_viterbi
+tags: [batch_size, seq_len], or [batch_tokens] of the packed sequences
+nll: [batch_size]
+log_z: [batch_size] the log of the partition function
+alpha: fp32 [batch_tokens, num_tags]
+*/
+template <typename T>
+__global__ void ker_crf_nll(const T* start_transition, const T* end_transition,
+                            const T* transition, const T* emission,
+                            const T* mask, const int* cu_seqlens,
+                            const T* bias, const int* tags, float* nll,
+                            float* log_z, float* alpha, int num_tags,
+                            int seq_len) {
   extern __shared__ float smen[];
   float* s_score = smen;
   float* s_next_score = smen + num_tags;
+  __shared__ float s_max;
 
-  // step 1. compute first step's score
-  if (threadIdx.y == 0) {
-    for (int cur_tag = threadIdx.x; cur_tag < num_tags; cur_tag += blockDim.x) {
-      float linear_bias = bias ? float(bias[cur_tag]) : float(0);
-      s_score[cur_tag] =
-          float(
-              emission[flat_3dim(blockIdx.x, 0, cur_tag, seq_len, num_tags)]) +
-          linear_bias + float(start_transition[cur_tag]);
+  int offset, len;
+  crf_seq_range(mask, cu_seqlens, seq_len, &offset, &len);
+  if (len == 0) {
+    if (threadIdx.x == 0) {
+      nll[blockIdx.x] = 0.f;
+      log_z[blockIdx.x] = 0.f;
     }
+    return;
   }
-  b.sync();
 
-  // step 2. compute last step's score
-  int seq_idx;
-  for (seq_idx = 1; seq_idx < seq_len; seq_idx++) {
-    if (mask[flat_2dim(blockIdx.x, seq_idx, seq_len)] ==
-        __float2half(CUDA_FLOAT_INF_NEG)) {
-      break;
-    }
-    for (int cur_tag = threadIdx.y; cur_tag < num_tags; cur_tag += blockDim.y) {
-      float max_score = REDUCE_FLOAT_INF_NEG;
-      int idx = 0;
-      const __half* cur_transition = transition + cur_tag * num_tags;
-      for (int pre_tag = threadIdx.x; pre_tag < num_tags;
-           pre_tag += blockDim.x) {
-        float s = (float)s_score[pre_tag] + (float)cur_transition[pre_tag];
-        if (s > max_score) {
-          max_score = s;
-          idx = pre_tag;
-        }
-      }  // col
-      g.sync();
-      warp_reduce_max(g, &max_score, &idx);
-      if (threadIdx.x == 0) {
-        float linear_bias = bias ? float(bias[cur_tag]) : float(0);
-        s_next_score[cur_tag] =
-            max_score +
-            float(emission[flat_3dim(blockIdx.x, seq_idx, cur_tag, seq_len,
-                                     num_tags)]) +
-            linear_bias;
-        history[flat_3dim(blockIdx.x, seq_idx - 1, cur_tag, seq_len,
-                          num_tags)] = idx;
+  // step 1. the forward recursion
+  for (int cur_tag = threadIdx.x; cur_tag < num_tags; cur_tag += blockDim.x) {
+    float linear_bias = bias ? float(bias[cur_tag]) : float(0);
+    s_score[cur_tag] = float(emission[offset * num_tags + cur_tag]) +
+                       linear_bias + float(start_transition[cur_tag]);
+    alpha[offset * num_tags + cur_tag] = s_score[cur_tag];
+  }
+  __syncthreads();
+  for (int seq_idx = 1; seq_idx < len; seq_idx++) {
+    const T* step_emission = emission + (offset + seq_idx) * num_tags;
+    for (int cur_tag = threadIdx.x; cur_tag < num_tags;
+         cur_tag += blockDim.x) {
+      float m = REDUCE_FLOAT_INF_NEG, s = 0.f;
+      const T* cur_transition = transition + cur_tag * num_tags;
+      for (int pre_tag = 0; pre_tag < num_tags; pre_tag++) {
+        crf_lse_add(s_score[pre_tag] + float(cur_transition[pre_tag]), &m, &s);
       }
-    }  // row
+      float linear_bias = bias ? float(bias[cur_tag]) : float(0);
+      float score = m + __logf(s) + float(step_emission[cur_tag]) + linear_bias;
+      s_next_score[cur_tag] = score;
+      alpha[(offset + seq_idx) * num_tags + cur_tag] = score;
+    }
     float* tmp = s_next_score;
     s_next_score = s_score;
     s_score = tmp;
-    b.sync();
-  }  // seq_len
-
-  // step 3. compute last tag
-  if (threadIdx.y != 0) {
-    return;
+    __syncthreads();
   }
-  float max_score = REDUCE_FLOAT_INF_NEG;
-  int last_tag = 0;
+
+  // step 2. the log of the partition function
+  float m = REDUCE_FLOAT_INF_NEG, s = 0.f;
   for (int cur_tag = threadIdx.x; cur_tag < num_tags; cur_tag += blockDim.x) {
-    float s = (float)s_score[cur_tag] + (float)end_transition[cur_tag];
-    if (s > max_score) {
-      max_score = s;
-      last_tag = cur_tag;
-    }
+    crf_lse_add(s_score[cur_tag] + float(end_transition[cur_tag]), &m, &s);
   }
-  g.sync();
-  warp_reduce_max(g, &max_score, &last_tag);
+  float max_score = m;
+  blockReduce<ReduceType::kMax, 1>(&max_score);
+  if (threadIdx.x == 0) s_max = max_score;
+  __syncthreads();
+  // step 3. the score of the gold tags
+  float sums[2] = {s * __expf(m - s_max), 0.f};
+  const int* seq_tags = tags + offset;
+  for (int i = threadIdx.x; i < len; i += blockDim.x) {
+    int tag = seq_tags[i];
+    sums[1] += float(emission[(offset + i) * num_tags + tag]);
+    if (bias) sums[1] += float(bias[tag]);
+    sums[1] += i ? float(transition[tag * num_tags + seq_tags[i - 1]])
+                 : float(start_transition[tag]);
+    if (i == len - 1) sums[1] += float(end_transition[tag]);
+  }
+  blockReduce<ReduceType::kSum, 2>(sums);
+  if (threadIdx.x == 0) {
+    float z = s_max + __logf(sums[0]);
+    log_z[blockIdx.x] = z;
+    nll[blockIdx.x] = z - sums[1];
+  }
+}
 
-  // step 4. compute full tag sequence
-  if (threadIdx.x != 0) {
-    return;
+/**
+@brief: ker_crf_nll_bw
+The grads of ker_crf_nll, the marginals of the forward-backward algorithm
+minus the indicators of the gold tags. The backward recursion runs in the
+same kernel, against the alpha of the forward. The grads of the emissions
+are written per token, the ones of the transitions and of the bias are
+summed over the batch with atomics in the fp32 workspace, after a block sum
+of the whole sequence in shared memory when it fits (kSmemGrad).
+
+@thread
+gridDim.x = batch_size
+blockDim.x = num_tags rounded up to WARP_SIZE, at most MAX_THREADS
+
+@param
+grad_emission: [batch_tokens, num_tags], 0 after the end of a sequence
+grad_nll: [batch_size], nullptr for ones
+workspace: fp32 [num_tags * num_tags + 3 * num_tags] zeros, the grads of
+  transition, start_transition, end_transition and bias
+*/
+template <typename T, bool kSmemGrad>
+__global__ void ker_crf_nll_bw(T* grad_emission, const float* grad_nll,
+                               const T* start_transition,
+                               const T* end_transition, const T* transition,
+                               const T* emission, const T* mask,
+                               const int* cu_seqlens, const T* bias,
+                               const int* tags, const float* log_z,
+                               const float* alpha, float* workspace,
+                               int num_tags, int seq_len) {
+  extern __shared__ float smen[];
+  float* s_beta = smen;
+  float* s_next_beta = smen + num_tags;
+  // the emission plus beta of the current token, the alpha of the previous
+  float* s_emit_beta = smen + 2 * num_tags;
+  float* s_pre_alpha = smen + 3 * num_tags;
+  // [cur_tag, pre_tag]
+  float* s_grad_transition = smen + 4 * num_tags;
+  float* grad_transition = workspace;
+  float* grad_start = workspace + num_tags * num_tags;
+  float* grad_end = grad_start + num_tags;
+  float* grad_bias = grad_end + num_tags;
+
+  int offset, len;
+  crf_seq_range(mask, cu_seqlens, seq_len, &offset, &len);
+  if (!cu_seqlens) {
+    for (int i = (offset + len) * num_tags + threadIdx.x;
+         i < (offset + seq_len) * num_tags; i += blockDim.x) {
+      grad_emission[i] = T(0);
+    }
   }
-  if (best_score) {
-    best_score[blockIdx.x] = max_score;  // for debug
+  if (len == 0) return;
+  float grad = grad_nll ? grad_nll[blockIdx.x] : 1.f;
+  float z = log_z[blockIdx.x];
+  const int* seq_tags = tags + offset;
+  int num_pairs = num_tags * num_tags;
+  if (kSmemGrad) {
+    for (int i = threadIdx.x; i < num_pairs; i += blockDim.x) {
+      s_grad_transition[i] = 0.f;
+    }
+  }
+  for (int cur_tag = threadIdx.x; cur_tag < num_tags; cur_tag += blockDim.x) {
+    s_beta[cur_tag] = float(end_transition[cur_tag]);
+  }
+  __syncthreads();
+
+  for (int seq_idx = len - 1; seq_idx >= 0; seq_idx--) {
+    int token = offset + seq_idx;
+    int gold_tag = seq_tags[seq_idx];
+    // step 1. the marginals of the token
+    for (int cur_tag = threadIdx.x; cur_tag < num_tags;
+         cur_tag += blockDim.x) {
+      float p = __expf(alpha[token * num_tags + cur_tag] + s_beta[cur_tag] - z);
+      float g = grad * (p - float(cur_tag == gold_tag));
+      grad_emission[token * num_tags + cur_tag] = T(g);
+      if (bias) atomicAdd(grad_bias + cur_tag, g);
+      if (seq_idx == 0) atomicAdd(grad_start + cur_tag, g);
+      if (seq_idx == len - 1) atomicAdd(grad_end + cur_tag, g);
+      if (seq_idx > 0) {
+        float linear_bias = bias ? float(bias[cur_tag]) : float(0);
+        s_emit_beta[cur_tag] = float(emission[token * num_tags + cur_tag]) +
+                               linear_bias + s_beta[cur_tag];
+        s_pre_alpha[cur_tag] = alpha[(token - 1) * num_tags + cur_tag];
+      }
+    }
+    if (seq_idx == 0) break;
+    __syncthreads();
+
+    // step 2. the marginals of the transitions into the token
+    int gold_pair = gold_tag * num_tags + seq_tags[seq_idx - 1];
+    for (int i = threadIdx.x; i < num_pairs; i += blockDim.x) {
+      int cur_tag = i / num_tags;
+      int pre_tag = i - cur_tag * num_tags;
+      float p = __expf(s_pre_alpha[pre_tag] + float(transition[i]) +
+                       s_emit_beta[cur_tag] - z);
+      float g = grad * (p - float(i == gold_pair));
+      if (kSmemGrad) {
+        s_grad_transition[i] += g;
+      } else {
+        atomicAdd(grad_transition + i, g);
+      }
+    }
+
+    // step 3. the backward recursion
+    for (int pre_tag = threadIdx.x; pre_tag < num_tags;
+         pre_tag += blockDim.x) {
+      float m = REDUCE_FLOAT_INF_NEG, s = 0.f;
+      for (int cur_tag = 0; cur_tag < num_tags; cur_tag++) {
+        crf_lse_add(float(transition[cur_tag * num_tags + pre_tag]) +
+                        s_emit_beta[cur_tag],
+                    &m, &s);
+      }
+      s_next_beta[pre_tag] = m + __logf(s);
+    }
+    float* tmp = s_next_beta;
+    s_next_beta = s_beta;
+    s_beta = tmp;
+    __syncthreads();
   }
-  seq_idx--;
-  best_tags[flat_2dim(blockIdx.x, seq_idx, seq_len)] = last_tag;
-  for (int i = seq_idx - 1; i >= 0; i--) {
-    last_tag = history[flat_3dim(blockIdx.x, i, last_tag, seq_len, num_tags)];
-    best_tags[flat_2dim(blockIdx.x, i, seq_len)] = last_tag;
+
+  if (kSmemGrad) {
+    // every thread flushes the pairs it summed, no sync needed.
+    for (int i = threadIdx.x; i < num_pairs; i += blockDim.x) {
+      atomicAdd(grad_transition + i, s_grad_transition[i]);
+    }
   }
-  for (int i = seq_idx + 1; i < seq_len; i++) {
-    best_tags[flat_2dim(blockIdx.x, i, seq_len)] = invalid_tag;
+}
+
+template <typename T>
+__global__ void ker_crf_param_grad(T* grad_start_transition,
+                                   T* grad_end_transition,
+                                   T* grad_transition, T* grad_bias,
+                                   const float* workspace, int num_tags) {
+  int num_pairs = num_tags * num_tags;
+  int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i < num_pairs) {
+    grad_transition[i] = T(workspace[i]);
+  } else if (i < num_pairs + num_tags) {
+    grad_start_transition[i - num_pairs] = T(workspace[i]);
+  } else if (i < num_pairs + 2 * num_tags) {
+    grad_end_transition[i - num_pairs - num_tags] = T(workspace[i]);
+  } else if (i < num_pairs + 3 * num_tags && grad_bias) {
+    grad_bias[i - num_pairs - 2 * num_tags] = T(workspace[i]);
   }
 }
 
-template <>
-void launch_viterbi<__half>(const __half* start_transition,
-                            const __half* end_transition,
-                            const __half* transition, const __half* emission,
-                            const __half* mask, float* best_score, int* history,
-                            int* best_tags, int num_tags, int seq_len,
-                            int batch_size, cudaStream_t stream,
-                            const __half* bias) {
-  dim3 grid_dim(batch_size);
-  dim3 block_dim(WARP_SIZE, WARP_SIZE);
-
-  ker_viterbi<__half>
-      <<<grid_dim, block_dim, 2 * num_tags * sizeof(float), stream>>>(
-          start_transition, end_transition, transition, emission, mask, bias,
-          best_score, history, best_tags, num_tags, seq_len);
+template <typename T>
+void launch_crf_nll(const T* start_transition, const T* end_transition,
+                    const T* transition, const T* emission, const T* mask,
+                    const int* cu_seqlens, const T* bias, const int* tags,
+                    float* nll, float* log_z, float* alpha, int num_tags,
+                    int seq_len, int batch_size, cudaStream_t stream) {
+  int block_dim = (num_tags + WARP_SIZE - 1) / WARP_SIZE * WARP_SIZE;
+  block_dim = std::min(block_dim, MAX_THREADS);
+  size_t smem_bytes = 2 * num_tags * sizeof(float);
+  ker_crf_nll<T><<<batch_size, block_dim, smem_bytes, stream>>>(
+      start_transition, end_transition, transition, emission, mask,
+      cu_seqlens, bias, tags, nll, log_z, alpha, num_tags, seq_len);
 }
 
-template <>
-void launch_viterbi<float>(const float* start_transition,
-                           const float* end_transition, const float* transition,
-                           const float* emission, const float* mask,
-                           float* best_score, int* history, int* best_tags,
-                           int num_tags, int seq_len, int batch_size,
-                           cudaStream_t stream, const float* bias) {
-  dim3 grid_dim(batch_size);
-  dim3 block_dim(WARP_SIZE, WARP_SIZE);
-
-  ker_viterbi<float>
-      <<<grid_dim, block_dim, 2 * num_tags * sizeof(float), stream>>>(
-          start_transition, end_transition, transition, emission, mask, bias,
-          best_score, history, best_tags, num_tags, seq_len);
+template <typename T>
+void launch_crf_nll_bw(T* grad_start_transition, T* grad_end_transition,
+                       T* grad_transition, T* grad_emission, T* grad_bias,
+                       const float* grad_nll, const T* start_transition,
+                       const T* end_transition, const T* transition,
+                       const T* emission, const T* mask,
+                       const int* cu_seqlens, const T* bias, const int* tags,
+                       const float* log_z, const float* alpha,
+                       float* workspace, int num_tags, int seq_len,
+                       int batch_size, cudaStream_t stream) {
+  int block_dim = (num_tags + WARP_SIZE - 1) / WARP_SIZE * WARP_SIZE;
+  block_dim = std::min(block_dim, MAX_THREADS);
+  size_t ws_size = crf_nll_bw_workspace_size(num_tags);
+  CHECK_GPU_ERROR(
+      cudaMemsetAsync(workspace, 0, ws_size * sizeof(float), stream));
+  size_t score_bytes = 4 * num_tags * sizeof(float);
+  size_t smem_bytes = score_bytes + size_t(num_tags) * num_tags * sizeof(float);
+
+  int device, max_smem;
+  CHECK_GPU_ERROR(cudaGetDevice(&device));
+  CHECK_GPU_ERROR(cudaDeviceGetAttribute(
+      &max_smem, cudaDevAttrMaxSharedMemoryPerBlockOptin, device));
+  if (smem_bytes + 1024 > max_smem) {
+    ker_crf_nll_bw<T, false><<<batch_size, block_dim, score_bytes, stream>>>(
+        grad_emission, grad_nll, start_transition, end_transition, transition,
+        emission, mask, cu_seqlens, bias, tags, log_z, alpha, workspace,
+        num_tags, seq_len);
+  } else {
+    if (smem_bytes > 48 * 1024) {
+      CHECK_GPU_ERROR(cudaFuncSetAttribute(
+          ker_crf_nll_bw<T, true>, cudaFuncAttributeMaxDynamicSharedMemorySize,
+          smem_bytes));
+    }
+    ker_crf_nll_bw<T, true><<<batch_size, block_dim, smem_bytes, stream>>>(
+        grad_emission, grad_nll, start_transition, end_transition, transition,
+        emission, mask, cu_seqlens, bias, tags, log_z, alpha, workspace,
+        num_tags, seq_len);
+  }
+  ker_crf_param_grad<T><<<(ws_size + MAX_THREADS - 1) / MAX_THREADS,
+                          MAX_THREADS, 0, stream>>>(
+      grad_start_transition, grad_end_transition, grad_transition, grad_bias,
+      workspace, num_tags);
 }
 
+template void launch_crf_nll<float>(
+    const float* start_transition, const float* end_transition,
+    const float* transition, const float* emission, const float* mask,
+    const int* cu_seqlens, const float* bias, const int* tags, float* nll,
+    float* log_z, float* alpha, int num_tags, int seq_len, int batch_size,
+    cudaStream_t stream);
+
+template void launch_crf_nll<__half>(
+    const __half* start_transition, const __half* end_transition,
+    const __half* transition, const __half* emission, const __half* mask,
+    const int* cu_seqlens, const __half* bias, const int* tags, float* nll,
+    float* log_z, float* alpha, int num_tags, int seq_len, int batch_size,
+    cudaStream_t stream);
+
+template void launch_crf_nll_bw<float>(
+    float* grad_start_transition, float* grad_end_transition,
+    float* grad_transition, float* grad_emission, float* grad_bias,
+    const float* grad_nll, const float* start_transition,
+    const float* end_transition, const float* transition,
+    const float* emission, const float* mask, const int* cu_seqlens,
+    const float* bias, const int* tags, const float* log_z,
+    const float* alpha, float* workspace, int num_tags, int seq_len,
+    int batch_size, cudaStream_t stream);
+
+template void launch_crf_nll_bw<__half>(
+    __half* grad_start_transition, __half* grad_end_transition,
+    __half* grad_transition, __half* grad_emission, __half* grad_bias,
+    const float* grad_nll, const __half* start_transition,
+    const __half* end_transition, const __half* transition,
+    const __half* emission, const __half* mask, const int* cu_seqlens,
+    const __half* bias, const int* tags, const float* log_z,
+    const float* alpha, float* workspace, int num_tags, int seq_len,
+    int batch_size, cudaStream_t stream);
+
 }  // namespace cuda
 }  // namespace lightseq
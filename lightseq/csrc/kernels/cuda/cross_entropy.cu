@@ -1,8 +1,11 @@
 #include "block_reduce.h"
+#include "cublas_wrappers.h"
 #include "cuda_util.h"
 #include "kernels.h"
 #include "ls_cub.cuh"
 
+#include <algorithm>
+
 ls::cub::CachingDeviceAllocator g_allocator(true);
 namespace lightseq {
 namespace cuda {
@@ -125,20 +128,11 @@ __global__ void ls_cross_entropy_bw_kernel(
   }
 }
 
-template <typename T>
-void launch_cross_entropy_fw(const T *inputs_ptr, const int *targets_ptr,
-                             float *outputs_ptr, float *nll_loss_ptr,
-                             float *loss_buffer, const int padding_idx,
-                             const float epsilon, const int batch_size,
-                             const int seq_len, const int vocab_size,
-                             cudaStream_t stream) {
-  int grid_dim = batch_size * seq_len;
-  float *nll_loss_buffer = loss_buffer + grid_dim;
-  ls_cross_entropy_fw_kernel<<<grid_dim, MAX_THREADS, 0, stream>>>(
-      inputs_ptr, targets_ptr, loss_buffer, nll_loss_buffer, padding_idx,
-      epsilon, vocab_size);
-
-  int num_items = grid_dim;
+// Sums the losses and nll losses of every token into outputs_ptr and
+// nll_loss_ptr.
+void sum_token_losses(const float *loss_buffer, const float *nll_loss_buffer,
+                      float *outputs_ptr, float *nll_loss_ptr, int num_items,
+                      cudaStream_t stream) {
   void *d_temp_storage = NULL;
   size_t temp_storage_bytes = 0;
   CHECK_GPU_ERROR(ls::cub::DeviceReduce::Sum(d_temp_storage, temp_storage_bytes,
@@ -155,6 +149,23 @@ void launch_cross_entropy_fw(const T *inputs_ptr, const int *targets_ptr,
   CHECK_GPU_ERROR(g_allocator.DeviceFree(d_temp_storage));
 }
 
+template <typename T>
+void launch_cross_entropy_fw(const T *inputs_ptr, const int *targets_ptr,
+                             float *outputs_ptr, float *nll_loss_ptr,
+                             float *loss_buffer, const int padding_idx,
+                             const float epsilon, const int batch_size,
+                             const int seq_len, const int vocab_size,
+                             cudaStream_t stream) {
+  int grid_dim = batch_size * seq_len;
+  float *nll_loss_buffer = loss_buffer + grid_dim;
+  ls_cross_entropy_fw_kernel<<<grid_dim, MAX_THREADS, 0, stream>>>(
+      inputs_ptr, targets_ptr, loss_buffer, nll_loss_buffer, padding_idx,
+      epsilon, vocab_size);
+
+  sum_token_losses(loss_buffer, nll_loss_buffer, outputs_ptr, nll_loss_ptr,
+                   grid_dim, stream);
+}
+
 template void launch_cross_entropy_fw<float>(
     const float *inputs_ptr, const int *targets_ptr, float *outputs_ptr,
     float *nll_loss_ptr, float *loss_buffer, const int padding_idx,
@@ -190,5 +201,219 @@ template void launch_cross_entropy_bw<__half>(
     const int *targets_ptr, __half *grad_inputs_ptr, const int padding_idx,
     const float epsilon, const int batch_size, const int seq_len,
     const int vocab_size, cudaStream_t stream);
+
+/* The fused output projection and cross entropy, logits = inputs * weight^T
+ * for a chunk of the vocab at a time. The forward keeps the running max, sum
+ * of exp and sum of logits of each token across the chunks, and stores the
+ * logsumexp of each token, from which the backward recomputes the softmax of
+ * a chunk. */
+
+// stats: [num_tokens, 4], {max_logit, sum_exp_logit (of logit - max_logit),
+// sum_logit, target_logit} of the chunks seen so far.
+template <typename T>
+__global__ void ls_fused_cross_entropy_chunk_fw_kernel(
+    const T *__restrict__ logits, const int *__restrict__ targets,
+    float *__restrict__ stats, const int padding_idx, const int chunk_start,
+    const int chunk_len) {
+  int target_tid = targets[blockIdx.x];
+  if (target_tid == padding_idx) {
+    return;
+  }
+  const T *token_logits = logits + blockIdx.x * chunk_len;
+
+  float max_input[1] = {REDUCE_FLOAT_INF_NEG};
+  for (int i = threadIdx.x; i < chunk_len; i += blockDim.x) {
+    max_input[0] = fmaxf(max_input[0], static_cast<float>(token_logits[i]));
+  }
+  blockReduce<ReduceType::kMax, 1>(max_input);
+  __shared__ float s_max_input;
+  if (threadIdx.x == 0) {
+    s_max_input = max_input[0];
+  }
+  __syncthreads();
+
+  float sum_logits[2] = {0.f, 0.f};  // logit and logit exp
+  for (int i = threadIdx.x; i < chunk_len; i += blockDim.x) {
+    float logit = static_cast<float>(token_logits[i]);
+    sum_logits[0] += logit;
+    sum_logits[1] += expf(logit - s_max_input);
+  }
+  blockReduce<ReduceType::kSum, 2>(sum_logits);
+
+  if (threadIdx.x == 0) {
+    float *token_stats = stats + blockIdx.x * 4;
+    if (chunk_start == 0) {
+      token_stats[0] = s_max_input;
+      token_stats[1] = sum_logits[1];
+      token_stats[2] = sum_logits[0];
+      token_stats[3] = 0.f;
+    } else {
+      float max_logit = fmaxf(token_stats[0], s_max_input);
+      token_stats[1] = token_stats[1] * expf(token_stats[0] - max_logit) +
+                       sum_logits[1] * expf(s_max_input - max_logit);
+      token_stats[0] = max_logit;
+      token_stats[2] += sum_logits[0];
+    }
+    if (target_tid >= chunk_start && target_tid < chunk_start + chunk_len) {
+      token_stats[3] =
+          static_cast<float>(token_logits[target_tid - chunk_start]);
+    }
+  }
+}
+
+__global__ void ls_fused_cross_entropy_fw_kernel(
+    const float *__restrict__ stats, const int *__restrict__ targets,
+    float *__restrict__ outputs, float *__restrict__ nll_loss_outputs,
+    float *__restrict__ lse, const int padding_idx, const float epsilon,
+    const int vocab_size, const int num_tokens) {
+  int token_id = blockIdx.x * blockDim.x + threadIdx.x;
+  if (token_id >= num_tokens) {
+    return;
+  }
+  if (targets[token_id] == padding_idx) {
+    nll_loss_outputs[token_id] = 0.f;
+    outputs[token_id] = 0.f;
+    lse[token_id] = 0.f;
+    return;
+  }
+  const float *token_stats = stats + token_id * 4;
+  float token_lse = token_stats[0] + logf(token_stats[1]);
+  float eps_i = epsilon / (vocab_size - 1);
+  float nll_loss = token_lse - token_stats[3];
+  float sum_nll_loss = vocab_size * token_lse - token_stats[2];
+  nll_loss_outputs[token_id] = nll_loss;
+  outputs[token_id] =
+      (1.f - epsilon - eps_i) * nll_loss + eps_i * sum_nll_loss;
+  lse[token_id] = token_lse;
+}
+
+// Overwrites the logits of a chunk with their gradient.
+template <typename T>
+__global__ void ls_fused_cross_entropy_chunk_bw_kernel(
+    const float *__restrict__ grad_outputs, T *__restrict__ logits,
+    const int *__restrict__ targets, const float *__restrict__ lse,
+    const int padding_idx, const float epsilon, const int vocab_size,
+    const int chunk_start, const int chunk_len) {
+  T *token_logits = logits + blockIdx.x * chunk_len;
+  int target_tid = targets[blockIdx.x];
+  if (target_tid == padding_idx) {
+    for (int i = threadIdx.x; i < chunk_len; i += blockDim.x) {
+      token_logits[i] = 0.f;
+    }
+    return;
+  }
+
+  const float grad_out = static_cast<float>(grad_outputs[0]);
+  const float token_lse = lse[blockIdx.x];
+  float eps_i = epsilon / (vocab_size - 1);
+  float nll_weight = 1.0 - epsilon - eps_i;
+  for (int i = threadIdx.x; i < chunk_len; i += blockDim.x) {
+    float prob = expf(static_cast<float>(token_logits[i]) - token_lse);
+    float grad = 0;
+    grad += (vocab_size * prob - 1) * eps_i;
+    grad += prob * nll_weight;
+    if (chunk_start + i == target_tid) {
+      grad -= nll_weight;
+    }
+    token_logits[i] = grad_out * grad;
+  }
+}
+
+template <typename T>
+void launch_fused_linear_cross_entropy_fw(
+    const T *inputs_ptr, const T *weight_ptr, const int *targets_ptr,
+    float *outputs_ptr, float *nll_loss_ptr, float *lse_ptr,
+    float *loss_buffer, float *stats_buffer, T *logits_buffer,
+    const int padding_idx, const float epsilon, const int num_tokens,
+    const int hidden_size, const int vocab_size, const int chunk_size,
+    cublasHandle_t handle, cudaStream_t stream) {
+  float alpha = 1.f, beta = 0.f;
+  for (int chunk_start = 0; chunk_start < vocab_size;
+       chunk_start += chunk_size) {
+    int chunk_len = std::min(chunk_size, vocab_size - chunk_start);
+    // logits: [num_tokens, chunk_len]
+    cublas_gemm_ex(handle, CUBLAS_OP_T, CUBLAS_OP_N, chunk_len, num_tokens,
+                   hidden_size, &alpha, &beta,
+                   weight_ptr + (size_t)chunk_start * hidden_size, inputs_ptr,
+                   logits_buffer);
+    ls_fused_cross_entropy_chunk_fw_kernel<<<num_tokens, MAX_THREADS, 0,
+                                             stream>>>(
+        logits_buffer, targets_ptr, stats_buffer, padding_idx, chunk_start,
+        chunk_len);
+  }
+
+  float *nll_loss_buffer = loss_buffer + num_tokens;
+  int grid_dim = (num_tokens + MAX_THREADS - 1) / MAX_THREADS;
+  ls_fused_cross_entropy_fw_kernel<<<grid_dim, MAX_THREADS, 0, stream>>>(
+      stats_buffer, targets_ptr, loss_buffer, nll_loss_buffer, lse_ptr,
+      padding_idx, epsilon, vocab_size, num_tokens);
+  sum_token_losses(loss_buffer, nll_loss_buffer, outputs_ptr, nll_loss_ptr,
+                   num_tokens, stream);
+}
+
+template void launch_fused_linear_cross_entropy_fw<float>(
+    const float *inputs_ptr, const float *weight_ptr, const int *targets_ptr,
+    float *outputs_ptr, float *nll_loss_ptr, float *lse_ptr,
+    float *loss_buffer, float *stats_buffer, float *logits_buffer,
+    const int padding_idx, const float epsilon, const int num_tokens,
+    const int hidden_size, const int vocab_size, const int chunk_size,
+    cublasHandle_t handle, cudaStream_t stream);
+
+template void launch_fused_linear_cross_entropy_fw<__half>(
+    const __half *inputs_ptr, const __half *weight_ptr, const int *targets_ptr,
+    float *outputs_ptr, float *nll_loss_ptr, float *lse_ptr,
+    float *loss_buffer, float *stats_buffer, __half *logits_buffer,
+    const int padding_idx, const float epsilon, const int num_tokens,
+    const int hidden_size, const int vocab_size, const int chunk_size,
+    cublasHandle_t handle, cudaStream_t stream);
+
+template <typename T>
+void launch_fused_linear_cross_entropy_bw(
+    const float *grad_outputs_ptr, const T *inputs_ptr, const T *weight_ptr,
+    const int *targets_ptr, const float *lse_ptr, T *grad_inputs_ptr,
+    T *grad_weight_ptr, T *logits_buffer, const int padding_idx,
+    const float epsilon, const int num_tokens, const int hidden_size,
+    const int vocab_size, const int chunk_size, cublasHandle_t handle,
+    cudaStream_t stream) {
+  float alpha = 1.f, beta = 0.f;
+  for (int chunk_start = 0; chunk_start < vocab_size;
+       chunk_start += chunk_size) {
+    int chunk_len = std::min(chunk_size, vocab_size - chunk_start);
+    const T *chunk_weight = weight_ptr + (size_t)chunk_start * hidden_size;
+    cublas_gemm_ex(handle, CUBLAS_OP_T, CUBLAS_OP_N, chunk_len, num_tokens,
+                   hidden_size, &alpha, &beta, chunk_weight, inputs_ptr,
+                   logits_buffer);
+    ls_fused_cross_entropy_chunk_bw_kernel<<<num_tokens, MAX_THREADS, 0,
+                                             stream>>>(
+        grad_outputs_ptr, logits_buffer, targets_ptr, lse_ptr, padding_idx,
+        epsilon, vocab_size, chunk_start, chunk_len);
+
+    // grad_inputs (+)= grad_logits * weight, accumulated across the chunks
+    float input_beta = chunk_start == 0 ? 0.f : 1.f;
+    cublas_gemm_ex(handle, CUBLAS_OP_N, CUBLAS_OP_N, hidden_size, num_tokens,
+                   chunk_len, &alpha, &input_beta, chunk_weight, logits_buffer,
+                   grad_inputs_ptr);
+    // grad_weight = grad_logits^T * inputs
+    cublas_gemm_ex(handle, CUBLAS_OP_N, CUBLAS_OP_T, hidden_size, chunk_len,
+                   num_tokens, &alpha, &beta, inputs_ptr, logits_buffer,
+                   grad_weight_ptr + (size_t)chunk_start * hidden_size);
+  }
+}
+
+template void launch_fused_linear_cross_entropy_bw<float>(
+    const float *grad_outputs_ptr, const float *inputs_ptr,
+    const float *weight_ptr, const int *targets_ptr, const float *lse_ptr,
+    float *grad_inputs_ptr, float *grad_weight_ptr, float *logits_buffer,
+    const int padding_idx, const float epsilon, const int num_tokens,
+    const int hidden_size, const int vocab_size, const int chunk_size,
+    cublasHandle_t handle, cudaStream_t stream);
+
+template void launch_fused_linear_cross_entropy_bw<__half>(
+    const float *grad_outputs_ptr, const __half *inputs_ptr,
+    const __half *weight_ptr, const int *targets_ptr, const float *lse_ptr,
+    __half *grad_inputs_ptr, __half *grad_weight_ptr, __half *logits_buffer,
+    const int padding_idx, const float epsilon, const int num_tokens,
+    const int hidden_size, const int vocab_size, const int chunk_size,
+    cublasHandle_t handle, cudaStream_t stream);
 }  // namespace cuda
 }  // namespace lightseq
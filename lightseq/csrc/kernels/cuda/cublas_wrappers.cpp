@@ -49,6 +49,27 @@ int cublas_gemm_ex(cublasHandle_t handle, cublasOperation_t transa,
   return 0;
 }
 
+int cublas_gemm_ex(cublasHandle_t handle, cublasOperation_t transa,
+                   cublasOperation_t transb, int m, int n, int k,
+                   const float *alpha, const float *beta,
+                   const __nv_bfloat16 *A, const __nv_bfloat16 *B,
+                   __nv_bfloat16 *C, cublasGemmAlgo_t algo) {
+  cublasStatus_t status = cublasGemmEx(
+      handle, transa, transb, m, n, k, (const void *)alpha, (const void *)A,
+      CUDA_R_16BF, (transa == CUBLAS_OP_N) ? m : k, (const void *)B,
+      CUDA_R_16BF, (transb == CUBLAS_OP_N) ? k : n, (const void *)beta,
+      (void *)C, CUDA_R_16BF, m, CUDA_R_32F, algo);
+
+  if (status != CUBLAS_STATUS_SUCCESS) {
+    fprintf(stderr,
+            "!!!! kernel cublasGemmEx(__nv_bfloat16*) execution error. (m: %d, "
+            "n: %d, k: %d, error: %d) \n",
+            m, n, k, (int)status);
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
+
 int cublas_strided_batched_gemm(cublasHandle_t handle, int m, int n, int k,
                                 const float *alpha, const float *beta,
                                 const float *A, const float *B, float *C,
@@ -95,6 +116,30 @@ int cublas_strided_batched_gemm(cublasHandle_t handle, int m, int n, int k,
   return 0;
 }
 
+int cublas_strided_batched_gemm(cublasHandle_t handle, int m, int n, int k,
+                                const float *alpha, const float *beta,
+                                const __nv_bfloat16 *A,
+                                const __nv_bfloat16 *B, __nv_bfloat16 *C,
+                                cublasOperation_t op_A, cublasOperation_t op_B,
+                                int stride_A, int stride_B, int stride_C,
+                                int batch, cublasGemmAlgo_t algo) {
+  cublasStatus_t status = cublasGemmStridedBatchedEx(
+      handle, op_A, op_B, m, n, k, alpha, A, CUDA_R_16BF,
+      (op_A == CUBLAS_OP_N) ? m : k, stride_A, B, CUDA_R_16BF,
+      (op_B == CUBLAS_OP_N) ? k : n, stride_B, beta, C, CUDA_R_16BF, m,
+      stride_C, batch, CUDA_R_32F, algo);
+
+  if (status != CUBLAS_STATUS_SUCCESS) {
+    fprintf(stderr,
+            "!!!! kernel cublasGemmStridedBatchedEx(__nv_bfloat16*) execution "
+            "error. (m: %d, n: %d, k: %d, error: %d) \n",
+            m, n, k, (int)status);
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}
+
 template <typename OutType, typename ScaleType>
 void cublaslt_igemm(const int8_t *input_a, const int8_t *input_b,
                     OutType *output_c, int batch_count, int m, int n, int k,
@@ -3,6 +3,11 @@
    This file is adapted from Microsoft DeepSpeed
 */
 #include "cublas_wrappers.h"
+
+#include <stdexcept>
+#include <type_traits>
+
+#include "cuda_util.h"
 namespace lightseq {
 namespace cuda {
 int cublas_gemm_ex(cublasHandle_t handle, cublasOperation_t transa,
@@ -45,6 +50,27 @@ int cublas_gemm_ex(cublasHandle_t handle, cublasOperation_t transa,
   return 0;
 }
 
+int cublas_gemm_ex(cublasHandle_t handle, cublasOperation_t transa,
+                   cublasOperation_t transb, int m, int n, int k,
+                   const float *alpha, const float *beta,
+                   const __nv_bfloat16 *A, const __nv_bfloat16 *B,
+                   __nv_bfloat16 *C, cublasGemmAlgo_t algo) {
+  cublasStatus_t status = cublasGemmEx(
+      handle, transa, transb, m, n, k, (const void *)alpha, (const void *)A,
+      CUDA_R_16BF, (transa == CUBLAS_OP_N) ? m : k, (const void *)B,
+      CUDA_R_16BF, (transb == CUBLAS_OP_N) ? k : n, (const void *)beta,
+      (void *)C, CUDA_R_16BF, m, CUDA_R_32F, algo);
+
+  if (status != CUBLAS_STATUS_SUCCESS) {
+    fprintf(stderr,
+            "!!!! kernel cublasGemmEx(__nv_bfloat16*) execution error. (m: %d, "
+            "n: %d, k: %d, error: %d) \n",
+            m, n, k, (int)status);
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
+
 int cublas_strided_batched_gemm(cublasHandle_t handle, int m, int n, int k,
                                 const float *alpha, const float *beta,
                                 const float *A, const float *B, float *C,
@@ -90,5 +116,175 @@ int cublas_strided_batched_gemm(cublasHandle_t handle, int m, int n, int k,
 
   return 0;
 }
+
+int cublas_strided_batched_gemm(cublasHandle_t handle, int m, int n, int k,
+                                const float *alpha, const float *beta,
+                                const __nv_bfloat16 *A,
+                                const __nv_bfloat16 *B, __nv_bfloat16 *C,
+                                cublasOperation_t op_A, cublasOperation_t op_B,
+                                int stride_A, int stride_B, int stride_C,
+                                int batch, cublasGemmAlgo_t algo) {
+  cublasStatus_t status = cublasGemmStridedBatchedEx(
+      handle, op_A, op_B, m, n, k, alpha, A, CUDA_R_16BF,
+      (op_A == CUBLAS_OP_N) ? m : k, stride_A, B, CUDA_R_16BF,
+      (op_B == CUBLAS_OP_N) ? k : n, stride_B, beta, C, CUDA_R_16BF, m,
+      stride_C, batch, CUDA_R_32F, algo);
+
+  if (status != CUBLAS_STATUS_SUCCESS) {
+    fprintf(stderr,
+            "!!!! kernel cublasGemmStridedBatchedEx(__nv_bfloat16*) execution "
+            "error. (m: %d, n: %d, k: %d, error: %d) \n",
+            m, n, k, (int)status);
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}
+
+template <typename OutType>
+void cublaslt_fp8_gemm(const uint8_t *input_a, const uint8_t *input_b,
+                       OutType *output, int m, int n, int k,
+                       const float *a_scale, const float *b_scale, float beta,
+                       cublasLtHandle_t cublasLt_handle, cudaStream_t stream,
+                       bool b_e5m2) {
+#if defined(CUDA_VERSION) && CUDA_VERSION >= 11080
+  cudaDataType_t out_dtype;
+  if (std::is_same<OutType, float>::value) {
+    out_dtype = CUDA_R_32F;
+  } else if (std::is_same<OutType, __half>::value) {
+    out_dtype = CUDA_R_16F;
+  } else {
+    out_dtype = CUDA_R_16BF;
+  }
+  cublasLtMatmulDesc_t matmul_desc;
+  cublasLtMatrixLayout_t desc_a = NULL;
+  cublasLtMatrixLayout_t desc_b = NULL;
+  cublasLtMatrixLayout_t desc_c = NULL;
+  CHECK_GPU_ERROR(
+      cublasLtMatmulDescCreate(&matmul_desc, CUBLAS_COMPUTE_32F, CUDA_R_32F));
+
+  // fp8 matmuls only support the TN layout.
+  cublasOperation_t transpose = CUBLAS_OP_T;
+  // the backward gemms of the grads keep the full precision accumulation.
+  int8_t fast_accum = b_e5m2 ? 0 : 1;
+  CHECK_GPU_ERROR(cublasLtMatmulDescSetAttribute(
+      matmul_desc, CUBLASLT_MATMUL_DESC_TRANSA, &transpose, sizeof(transpose)));
+  CHECK_GPU_ERROR(cublasLtMatmulDescSetAttribute(
+      matmul_desc, CUBLASLT_MATMUL_DESC_A_SCALE_POINTER, &a_scale,
+      sizeof(a_scale)));
+  CHECK_GPU_ERROR(cublasLtMatmulDescSetAttribute(
+      matmul_desc, CUBLASLT_MATMUL_DESC_B_SCALE_POINTER, &b_scale,
+      sizeof(b_scale)));
+  CHECK_GPU_ERROR(cublasLtMatmulDescSetAttribute(
+      matmul_desc, CUBLASLT_MATMUL_DESC_FAST_ACCUM, &fast_accum,
+      sizeof(fast_accum)));
+
+  CHECK_GPU_ERROR(
+      cublasLtMatrixLayoutCreate(&desc_a, CUDA_R_8F_E4M3, k, m, k));
+  cudaDataType_t b_dtype = b_e5m2 ? CUDA_R_8F_E5M2 : CUDA_R_8F_E4M3;
+  CHECK_GPU_ERROR(cublasLtMatrixLayoutCreate(&desc_b, b_dtype, k, n, k));
+  CHECK_GPU_ERROR(cublasLtMatrixLayoutCreate(&desc_c, out_dtype, m, n, m));
+
+  float alpha = 1.f;
+  CHECK_GPU_ERROR(cublasLtMatmul(
+      cublasLt_handle, matmul_desc, &alpha, input_a, desc_a, input_b, desc_b,
+      &beta, output, desc_c, output, desc_c, NULL, NULL, 0, stream));
+
+  CHECK_GPU_ERROR(cublasLtMatmulDescDestroy(matmul_desc));
+  CHECK_GPU_ERROR(cublasLtMatrixLayoutDestroy(desc_a));
+  CHECK_GPU_ERROR(cublasLtMatrixLayoutDestroy(desc_b));
+  CHECK_GPU_ERROR(cublasLtMatrixLayoutDestroy(desc_c));
+#else
+  throw std::runtime_error("fp8 gemm needs CUDA 11.8 or later");
+#endif
+}
+
+template void cublaslt_fp8_gemm<float>(
+    const uint8_t *input_a, const uint8_t *input_b, float *output, int m,
+    int n, int k, const float *a_scale, const float *b_scale, float beta,
+    cublasLtHandle_t cublasLt_handle, cudaStream_t stream, bool b_e5m2);
+template void cublaslt_fp8_gemm<__half>(
+    const uint8_t *input_a, const uint8_t *input_b, __half *output, int m,
+    int n, int k, const float *a_scale, const float *b_scale, float beta,
+    cublasLtHandle_t cublasLt_handle, cudaStream_t stream, bool b_e5m2);
+template void cublaslt_fp8_gemm<__nv_bfloat16>(
+    const uint8_t *input_a, const uint8_t *input_b, __nv_bfloat16 *output,
+    int m, int n, int k, const float *a_scale, const float *b_scale,
+    float beta, cublasLtHandle_t cublasLt_handle, cudaStream_t stream,
+    bool b_e5m2);
+
+template <typename T>
+void cublaslt_gemm_bias_act(cublasLtHandle_t cublasLt_handle,
+                            cublasOperation_t transa, cublasOperation_t transb,
+                            int m, int n, int k, const T *A, const T *B,
+                            const T *bias, T *C, ActivationType act_type,
+                            cudaStream_t stream) {
+  cudaDataType_t dtype;
+  if (std::is_same<T, float>::value) {
+    dtype = CUDA_R_32F;
+  } else if (std::is_same<T, __half>::value) {
+    dtype = CUDA_R_16F;
+  } else {
+    dtype = CUDA_R_16BF;
+  }
+  cublasLtMatmulDesc_t matmul_desc;
+  cublasLtMatrixLayout_t desc_a = NULL;
+  cublasLtMatrixLayout_t desc_b = NULL;
+  cublasLtMatrixLayout_t desc_c = NULL;
+  CHECK_GPU_ERROR(
+      cublasLtMatmulDescCreate(&matmul_desc, CUBLAS_COMPUTE_32F, CUDA_R_32F));
+
+  // the gelu of the epilogue is the tanh approximation, as the one of
+  // launch_ls_dropout_act_bias.
+  cublasLtEpilogue_t epilogue = CUBLASLT_EPILOGUE_GELU_BIAS;
+  if (act_type == ActivationType::kRelu) {
+    epilogue = CUBLASLT_EPILOGUE_RELU_BIAS;
+  } else if (act_type == ActivationType::kNone) {
+    epilogue = CUBLASLT_EPILOGUE_BIAS;
+  }
+  CHECK_GPU_ERROR(cublasLtMatmulDescSetAttribute(
+      matmul_desc, CUBLASLT_MATMUL_DESC_TRANSA, &transa, sizeof(transa)));
+  CHECK_GPU_ERROR(cublasLtMatmulDescSetAttribute(
+      matmul_desc, CUBLASLT_MATMUL_DESC_TRANSB, &transb, sizeof(transb)));
+  CHECK_GPU_ERROR(cublasLtMatmulDescSetAttribute(
+      matmul_desc, CUBLASLT_MATMUL_DESC_EPILOGUE, &epilogue,
+      sizeof(epilogue)));
+  CHECK_GPU_ERROR(cublasLtMatmulDescSetAttribute(
+      matmul_desc, CUBLASLT_MATMUL_DESC_BIAS_POINTER, &bias, sizeof(bias)));
+
+  int a_rows = transa == CUBLAS_OP_N ? m : k;
+  int b_rows = transb == CUBLAS_OP_N ? k : n;
+  CHECK_GPU_ERROR(cublasLtMatrixLayoutCreate(
+      &desc_a, dtype, a_rows, transa == CUBLAS_OP_N ? k : m, a_rows));
+  CHECK_GPU_ERROR(cublasLtMatrixLayoutCreate(
+      &desc_b, dtype, b_rows, transb == CUBLAS_OP_N ? n : k, b_rows));
+  CHECK_GPU_ERROR(cublasLtMatrixLayoutCreate(&desc_c, dtype, m, n, m));
+
+  float alpha = 1.f, beta = 0.f;
+  CHECK_GPU_ERROR(cublasLtMatmul(cublasLt_handle, matmul_desc, &alpha, A,
+                                 desc_a, B, desc_b, &beta, C, desc_c, C,
+                                 desc_c, NULL, NULL, 0, stream));
+
+  CHECK_GPU_ERROR(cublasLtMatmulDescDestroy(matmul_desc));
+  CHECK_GPU_ERROR(cublasLtMatrixLayoutDestroy(desc_a));
+  CHECK_GPU_ERROR(cublasLtMatrixLayoutDestroy(desc_b));
+  CHECK_GPU_ERROR(cublasLtMatrixLayoutDestroy(desc_c));
+}
+
+template void cublaslt_gemm_bias_act<float>(
+    cublasLtHandle_t cublasLt_handle, cublasOperation_t transa,
+    cublasOperation_t transb, int m, int n, int k, const float *A,
+    const float *B, const float *bias, float *C, ActivationType act_type,
+    cudaStream_t stream);
+template void cublaslt_gemm_bias_act<__half>(
+    cublasLtHandle_t cublasLt_handle, cublasOperation_t transa,
+    cublasOperation_t transb, int m, int n, int k, const __half *A,
+    const __half *B, const __half *bias, __half *C, ActivationType act_type,
+    cudaStream_t stream);
+template void cublaslt_gemm_bias_act<__nv_bfloat16>(
+    cublasLtHandle_t cublasLt_handle, cublasOperation_t transa,
+    cublasOperation_t transb, int m, int n, int k, const __nv_bfloat16 *A,
+    const __nv_bfloat16 *B, const __nv_bfloat16 *bias, __nv_bfloat16 *C,
+    ActivationType act_type, cudaStream_t stream);
 }  // namespace cuda
 }  // namespace lightseq
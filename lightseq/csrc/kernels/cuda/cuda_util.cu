@@ -152,6 +152,25 @@ std::string _cudaGetErrorString(cublasStatus_t error) {
   return "CUBLAS_UNKNOW";
 }
 
+#ifdef LIGHTSEQ_cusparselt
+std::string _cudaGetErrorString(cusparseStatus_t error) {
+  return std::string("cuSPARSELt ") + cusparseGetErrorString(error);
+}
+#endif
+
+std::string _cudaGetErrorString(CUresult error) {
+  const char *error_string = nullptr;
+  cuGetErrorString(error, &error_string);
+  return std::string("CUDA driver ") +
+         (error_string ? error_string : std::to_string(error));
+}
+
+#ifdef LIGHTSEQ_nccl
+std::string _cudaGetErrorString(ncclResult_t error) {
+  return std::string("NCCL ") + ncclGetErrorString(error);
+}
+#endif
+
 template <typename T>
 void check_gpu_error(T result, char const *const func, const char *const file,
                      int const line) {
@@ -170,6 +189,22 @@ template void check_gpu_error<cublasStatus_t>(cublasStatus_t result,
                                               char const *const func,
                                               const char *const file,
                                               int const line);
+template void check_gpu_error<CUresult>(CUresult result,
+                                        char const *const func,
+                                        const char *const file,
+                                        int const line);
+#ifdef LIGHTSEQ_cusparselt
+template void check_gpu_error<cusparseStatus_t>(cusparseStatus_t result,
+                                                char const *const func,
+                                                const char *const file,
+                                                int const line);
+#endif
+#ifdef LIGHTSEQ_nccl
+template void check_gpu_error<ncclResult_t>(ncclResult_t result,
+                                            char const *const func,
+                                            const char *const file,
+                                            int const line);
+#endif
 
 template <typename T>
 T *cuda_malloc(size_t ele_num) {
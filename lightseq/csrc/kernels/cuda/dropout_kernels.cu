@@ -1,6 +1,7 @@
 #include <chrono>
 #include <ctime>
 
+#include "cuda_util.h"
 #include "kernels.h"
 
 #include <cooperative_groups.h>
@@ -144,6 +145,49 @@ void launch_curand_init(int total_count, int dim, cudaStream_t stream) {
                        .count());
 }
 
+int ls_dropout_seed() {
+  // non-negative, a negative seed asks the launchers to draw one.
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+             .count() &
+         0x7fffffff;
+}
+
+unsigned long long *ls_dropout_new_rng_offset() {
+  unsigned long long *rng_offset;
+  CHECK_GPU_ERROR(cudaMalloc(&rng_offset, sizeof(unsigned long long)));
+  CHECK_GPU_ERROR(cudaMemset(rng_offset, 0, sizeof(unsigned long long)));
+  return rng_offset;
+}
+
+__global__ void ls_dropout_step_kernel(unsigned long long *rng_offset) {
+  *rng_offset += 1;
+}
+
+void launch_ls_dropout_step(unsigned long long *rng_offset,
+                            cudaStream_t stream) {
+  ls_dropout_step_kernel<<<1, 1, 0, stream>>>(rng_offset);
+}
+
+/**
+ * @brief the dropout mask of element idx drawn by the forward kernels, whose
+ * thread i draws the elements [i * vec_size, (i + 1) * vec_size) from the
+ * Philox subsequence i, vec_size is 4 for float and 8 for __half. It lets the
+ * backward run without a mask.
+ */
+__forceinline__ __device__ uint8_t ls_dropout_redraw(unsigned long long key,
+                                                     int idx, int vec_size,
+                                                     float ratio) {
+  curandStatePhilox4_32_10_t state;
+  curand_init(key, idx / vec_size, 0, &state);
+  int j = idx % vec_size;
+  float4 rand = curand_uniform4(&state);
+  if (j >= 4) rand = curand_uniform4(&state);
+  j &= 3;
+  float r = j == 0 ? rand.x : (j == 1 ? rand.y : (j == 2 ? rand.z : rand.w));
+  return static_cast<uint8_t>(r > ratio);
+}
+
 /**
  * @brief element-wise dropout, store dropped position in mask, it's not
  * in-place
@@ -156,21 +200,22 @@ void launch_curand_init(int total_count, int dim, cudaStream_t stream) {
  * @param ratio drop ratio
  * @param out any size of float and __half
  * @param in same with out
- * @param mask uint8 type, same size with out
+ * @param mask uint8 type, same size with out, nullptr to store no mask
  * @param seed seed to curand
  * @return void
  */
 __global__ void ls_dropout_kernel(const int total_count, const float ratio,
                                   float *__restrict__ out,
                                   const float *__restrict__ in,
-                                  uint8_t *__restrict__ mask, const int seed) {
+                                  uint8_t *__restrict__ mask, const int seed,
+                                  const unsigned long long *rng_offset) {
   const float scale = 1.f / (1.f - ratio);
   int i = blockIdx.x * blockDim.x + threadIdx.x;
 
   if (i * 4 >= total_count) return;
 
   curandStatePhilox4_32_10_t state;
-  curand_init(seed, i, 0, &state);
+  curand_init(ls_dropout_key(seed, rng_offset), i, 0, &state);
   uint8_t m[4];
 
   float4 *out4 = reinterpret_cast<float4 *>(out);
@@ -184,7 +229,7 @@ __global__ void ls_dropout_kernel(const int total_count, const float ratio,
   m[3] = (uint8_t)(rand.w > ratio);
 
   uint32_t *m4 = reinterpret_cast<uint32_t *>(m);
-  mask4[i] |= m4[0];
+  if (mask) mask4[i] |= m4[0];
 
   float4 input4 = data4[i];
   float4 res4;
@@ -198,7 +243,8 @@ __global__ void ls_dropout_kernel(const int total_count, const float ratio,
 __global__ void ls_dropout_kernel(const int total_count, const float ratio,
                                   __half *__restrict__ out,
                                   const __half *__restrict__ in,
-                                  uint8_t *__restrict__ mask, const int seed) {
+                                  uint8_t *__restrict__ mask, const int seed,
+                                  const unsigned long long *rng_offset) {
   const float scale = 1.f / (1.f - ratio);
 
   int i = blockIdx.x * blockDim.x + threadIdx.x;
@@ -206,7 +252,7 @@ __global__ void ls_dropout_kernel(const int total_count, const float ratio,
   if (i * 8 >= total_count) return;
 
   curandStatePhilox4_32_10_t state;
-  curand_init(seed, i, 0, &state);
+  curand_init(ls_dropout_key(seed, rng_offset), i, 0, &state);
 
   const float4 *vals_float4 = reinterpret_cast<const float4 *>(in);
   float4 *outs_float4 = reinterpret_cast<float4 *>(out);
@@ -224,7 +270,7 @@ __global__ void ls_dropout_kernel(const int total_count, const float ratio,
   m[6] = (uint8_t)(rand.z > ratio);
   m[7] = (uint8_t)(rand.w > ratio);
   uint64_t *m8 = reinterpret_cast<uint64_t *>(m);
-  mask8[i] |= *m8;
+  if (mask) mask8[i] |= *m8;
 
   float4 val_float4 = vals_float4[i];
   float4 out_float4;
@@ -252,12 +298,15 @@ __global__ void ls_dropout_kernel(const int total_count, const float ratio,
  * @param total_count total elements
  * @param ratio drop ratio
  * @param in any size of float and __half
- * @param mask uint8 type, same size with in
+ * @param mask uint8 type, same size with in, nullptr to redraw it from seed
+ * @param seed seed of the forward
  * @return void
  */
 __global__ void ls_dropout_bwd_kernel(const int total_count, const float ratio,
                                       float *out, const float *in,
-                                      const uint8_t *__restrict__ mask) {
+                                      const uint8_t *__restrict__ mask,
+                                      const int seed,
+                                      const unsigned long long *rng_offset) {
   const float scale = 1.f / (1.f - ratio);
   int i = blockIdx.x * blockDim.x + threadIdx.x;
 
@@ -270,7 +319,17 @@ __global__ void ls_dropout_bwd_kernel(const int total_count, const float ratio,
   const uint32_t *mask4 = reinterpret_cast<const uint32_t *>(mask);
 
   uint32_t *m4 = reinterpret_cast<uint32_t *>(m);
-  m4[0] = mask4[i];
+  if (mask) {
+    m4[0] = mask4[i];
+  } else {
+    curandStatePhilox4_32_10_t state;
+    curand_init(ls_dropout_key(seed, rng_offset), i, 0, &state);
+    float4 rand = curand_uniform4(&state);
+    m[0] = (uint8_t)(rand.x > ratio);
+    m[1] = (uint8_t)(rand.y > ratio);
+    m[2] = (uint8_t)(rand.z > ratio);
+    m[3] = (uint8_t)(rand.w > ratio);
+  }
 
   float4 input4 = in4[i];
   float4 res4;
@@ -283,7 +342,9 @@ __global__ void ls_dropout_bwd_kernel(const int total_count, const float ratio,
 
 __global__ void ls_dropout_bwd_kernel(const int total_count, const float ratio,
                                       __half *out, const __half *in,
-                                      const uint8_t *__restrict__ mask) {
+                                      const uint8_t *__restrict__ mask,
+                                      const int seed,
+                                      const unsigned long long *rng_offset) {
   const __half scale = 1.f / (1.f - ratio);
 
   int i = blockIdx.x * blockDim.x + threadIdx.x;
@@ -296,7 +357,22 @@ __global__ void ls_dropout_bwd_kernel(const int total_count, const float ratio,
 
   uint8_t m[8];
   uint64_t *m8 = reinterpret_cast<uint64_t *>(m);
-  m8[0] = mask8[i];
+  if (mask) {
+    m8[0] = mask8[i];
+  } else {
+    curandStatePhilox4_32_10_t state;
+    curand_init(ls_dropout_key(seed, rng_offset), i, 0, &state);
+    float4 rand = curand_uniform4(&state);
+    m[0] = (uint8_t)(rand.x > ratio);
+    m[1] = (uint8_t)(rand.y > ratio);
+    m[2] = (uint8_t)(rand.z > ratio);
+    m[3] = (uint8_t)(rand.w > ratio);
+    rand = curand_uniform4(&state);
+    m[4] = (uint8_t)(rand.x > ratio);
+    m[5] = (uint8_t)(rand.y > ratio);
+    m[6] = (uint8_t)(rand.z > ratio);
+    m[7] = (uint8_t)(rand.w > ratio);
+  }
 
   float4 val_float4 = vals_float4[i];
   float4 out_float4;
@@ -320,34 +396,32 @@ __global__ void ls_dropout_bwd_kernel(const int total_count, const float ratio,
 template <>
 void launch_ls_dropout<float>(float *out, const float *vals, uint8_t *mask,
                               int total_count, float ratio, cudaStream_t stream,
-                              bool backward) {
+                              bool backward, int seed,
+                              const unsigned long long *rng_offset) {
   int grid_dim = total_count >> 12;
   if (!backward) {
     ls_dropout_kernel<<<grid_dim + 1, 1024, 0, stream>>>(
         total_count, ratio, out, vals, mask,
-        std::chrono::duration_cast<std::chrono::microseconds>(
-            std::chrono::system_clock::now().time_since_epoch())
-            .count());
+        seed < 0 ? ls_dropout_seed() : seed, rng_offset);
   } else {
-    ls_dropout_bwd_kernel<<<grid_dim + 1, 1024, 0, stream>>>(total_count, ratio,
-                                                             out, vals, mask);
+    ls_dropout_bwd_kernel<<<grid_dim + 1, 1024, 0, stream>>>(
+        total_count, ratio, out, vals, mask, seed, rng_offset);
   }
 }
 
 template <>
 void launch_ls_dropout<__half>(__half *out, const __half *vals, uint8_t *mask,
                                int total_count, float ratio,
-                               cudaStream_t stream, bool backward) {
+                               cudaStream_t stream, bool backward, int seed,
+                               const unsigned long long *rng_offset) {
   int grid_dim = total_count >> 13;
   if (!backward) {
     ls_dropout_kernel<<<grid_dim + 1, 1024, 0, stream>>>(
         total_count, ratio, out, vals, mask,
-        std::chrono::duration_cast<std::chrono::microseconds>(
-            std::chrono::system_clock::now().time_since_epoch())
-            .count());
+        seed < 0 ? ls_dropout_seed() : seed, rng_offset);
   } else {
-    ls_dropout_bwd_kernel<<<grid_dim + 1, 1024, 0, stream>>>(total_count, ratio,
-                                                             out, vals, mask);
+    ls_dropout_bwd_kernel<<<grid_dim + 1, 1024, 0, stream>>>(
+        total_count, ratio, out, vals, mask, seed, rng_offset);
   }
 }
 
@@ -363,7 +437,8 @@ void launch_ls_dropout<__half>(__half *out, const __half *vals, uint8_t *mask,
  * @param ratio drop ratio
  * @param out [batch_size, seq_len, hidden_size], float and __half
  * @param in [batch_size, seq_len, hidden_size], float and __half
- * @param mask [batch_size, seq_len, hidden_size], uint8 type
+ * @param mask [batch_size, seq_len, hidden_size], uint8 type, nullptr to
+ * store no mask
  * @param bias [hidden_size], ffn bias
  * @param residual [batch_size, seq_len, hidden_size], float and __half
  * @param seed seed to curand
@@ -374,14 +449,15 @@ __global__ void ls_dropout_res_bias_kernel(
     const int total_count, const float ratio, float *__restrict__ out,
     const float *__restrict__ in, uint8_t *__restrict__ mask,
     const float *__restrict__ bias, const float *__restrict__ residual,
-    const int seed, const int hidden_size) {
+    const int seed, const int hidden_size,
+    const unsigned long long *rng_offset) {
   const float scale = 1.f / (1.f - ratio);
   int i = blockIdx.x * blockDim.x + threadIdx.x;
 
   if (i * 4 >= total_count) return;
 
   curandStatePhilox4_32_10_t state;
-  curand_init(seed, i, 0, &state);
+  curand_init(ls_dropout_key(seed, rng_offset), i, 0, &state);
   uint8_t m[4];
 
   float4 *out4 = reinterpret_cast<float4 *>(out);
@@ -398,7 +474,7 @@ __global__ void ls_dropout_res_bias_kernel(
 
   int bias_i = i % (hidden_size >> 2);
   uint32_t *m4 = reinterpret_cast<uint32_t *>(m);
-  mask4[i] = m4[0];
+  if (mask) mask4[i] = m4[0];
   const float4 input4 = data4[i];
   const float4 b4 = __ldg(&bias4[bias_i]);
   const float4 res4 = residual4[i];
@@ -416,7 +492,8 @@ __global__ void ls_dropout_res_bias_kernel(
     const int total_count, const float ratio, __half *__restrict__ out,
     const __half *__restrict__ in, uint8_t *__restrict__ mask,
     const __half *__restrict__ bias, const __half *__restrict__ residual,
-    const int seed, const int hidden_size) {
+    const int seed, const int hidden_size,
+    const unsigned long long *rng_offset) {
   const __half scale = 1. / (1. - ratio);
 
   int i = blockIdx.x * blockDim.x + threadIdx.x;
@@ -424,7 +501,7 @@ __global__ void ls_dropout_res_bias_kernel(
   if (i * 8 >= total_count) return;
 
   curandStatePhilox4_32_10_t state;
-  curand_init(seed, i, 0, &state);
+  curand_init(ls_dropout_key(seed, rng_offset), i, 0, &state);
 
   const float4 *vals_float4 = reinterpret_cast<const float4 *>(in);
   float4 *outs_float4 = reinterpret_cast<float4 *>(out);
@@ -444,7 +521,7 @@ __global__ void ls_dropout_res_bias_kernel(
   m[6] = static_cast<uint8_t>(rand.z > ratio);
   m[7] = static_cast<uint8_t>(rand.w > ratio);
   uint64_t *m8 = reinterpret_cast<uint64_t *>(m);
-  mask8[i] = m8[0];
+  if (mask) mask8[i] = m8[0];
 
   int bias_i = i % (hidden_size >> 3);
   float4 val_float4 = vals_float4[i];
@@ -480,14 +557,12 @@ void launch_ls_dropout_res_bias<float>(float *out, const float *vals,
                                        uint8_t *mask, const float *bias,
                                        const float *residual, int total_count,
                                        int dim, float ratio,
-                                       cudaStream_t stream) {
+                                       cudaStream_t stream, int seed,
+                                       const unsigned long long *rng_offset) {
   int grid_dim = total_count >> 12;
   ls_dropout_res_bias_kernel<<<grid_dim + 1, 1024, 0, stream>>>(
       total_count, ratio, out, vals, mask, bias, residual,
-      std::chrono::duration_cast<std::chrono::microseconds>(
-          std::chrono::system_clock::now().time_since_epoch())
-          .count(),
-      dim);
+      seed < 0 ? ls_dropout_seed() : seed, dim, rng_offset);
 }
 
 template <>
@@ -495,14 +570,12 @@ void launch_ls_dropout_res_bias<__half>(__half *out, const __half *vals,
                                         uint8_t *mask, const __half *bias,
                                         const __half *residual, int total_count,
                                         int dim, float ratio,
-                                        cudaStream_t stream) {
+                                        cudaStream_t stream, int seed,
+                                        const unsigned long long *rng_offset) {
   int grid_dim = total_count >> 13;
   ls_dropout_res_bias_kernel<<<grid_dim + 1, 1024, 0, stream>>>(
       total_count, ratio, out, vals, mask, bias, residual,
-      std::chrono::duration_cast<std::chrono::microseconds>(
-          std::chrono::system_clock::now().time_since_epoch())
-          .count(),
-      dim);
+      seed < 0 ? ls_dropout_seed() : seed, dim, rng_offset);
 }
 
 /**
@@ -518,14 +591,18 @@ void launch_ls_dropout_res_bias<__half>(__half *out, const __half *vals,
  * @param in_grad [batch_size, seq_len, hidden_size], input grad
  * @param bias_grad [hidden_size], bias grad
  * @param out_grad [batch_size, seq_len, hidden_size], output grad
- * @param mask [batch_size, seq_len, hidden_size], dropout mask
+ * @param mask [batch_size, seq_len, hidden_size], dropout mask, nullptr to
+ * redraw it from seed
  * @param hidden_size
+ * @param seed seed of the forward
  * @return void
  */
 __global__ void ls_dropout_bias_bwd_kernel(
     const int row_size, const float ratio, float *__restrict__ in_grad,
     float *__restrict__ bias_grad, const float *__restrict__ out_grad,
-    const uint8_t *__restrict__ mask, const int hidden_size) {
+    const uint8_t *__restrict__ mask, const int hidden_size, const int seed,
+    const unsigned long long *rng_offset) {
+  const unsigned long long key = ls_dropout_key(seed, rng_offset);
   const float scale = 1.f / (1.f - ratio);
   // every block generate 8 bias result
   __shared__ float tile[8][129];
@@ -540,7 +617,8 @@ __global__ void ls_dropout_bias_bwd_kernel(
   int idx = flat_2dim(threadIdx.y, col_idx, hidden_size);
   for (int r = threadIdx.y; r < row_size; r += 128) {
     float val = out_grad[idx];
-    val *= scale * static_cast<float>(mask[idx] & 1);
+    uint8_t m = mask ? mask[idx] & 1 : ls_dropout_redraw(key, idx, 4, ratio);
+    val *= scale * static_cast<float>(m);
     local_sum += val;
     in_grad[idx] = val;
     idx += stride;
@@ -575,7 +653,9 @@ __global__ void ls_dropout_bias_bwd_kernel(
 __global__ void ls_dropout_bias_bwd_kernel(
     const int row_size, const float ratio, __half *__restrict__ in_grad,
     __half *__restrict__ bias_grad, const __half *__restrict__ out_grad,
-    const uint8_t *__restrict__ mask, const int hidden_size) {
+    const uint8_t *__restrict__ mask, const int hidden_size, const int seed,
+    const unsigned long long *rng_offset) {
+  const unsigned long long key = ls_dropout_key(seed, rng_offset);
   const __half2 scale = __float2half2_rn(1.f / (1.f - ratio));
   __shared__ __half2 tile[8][129];
 
@@ -593,7 +673,13 @@ __global__ void ls_dropout_bias_bwd_kernel(
   int idx = flat_2dim(threadIdx.y, col_idx, hidden_size);
   for (int r = threadIdx.y; r < row_size; r += 128) {
     __half2 val = out_grad2[idx];
-    __half2 m2 = __floats2half2_rn(mask[2 * idx] & 1, mask[2 * idx + 1] & 1);
+    __half2 m2;
+    if (mask) {
+      m2 = __floats2half2_rn(mask[2 * idx] & 1, mask[2 * idx + 1] & 1);
+    } else {
+      m2 = __floats2half2_rn(ls_dropout_redraw(key, 2 * idx, 8, ratio),
+                             ls_dropout_redraw(key, 2 * idx + 1, 8, ratio));
+    }
     val *= scale * m2;
     local_sum += val;
     in_grad2[idx] = val;
@@ -629,30 +715,35 @@ __global__ void ls_dropout_bias_bwd_kernel(
 template <typename T>
 void launch_ls_dropout_bias_bwd(T *in_grad, T *bias_grad, const T *out_grad,
                                 const uint8_t *mask, int row_size, int dim,
-                                float ratio, cudaStream_t stream) {
+                                float ratio, cudaStream_t stream, int seed,
+                                const unsigned long long *rng_offset) {
   dim3 grid_dim((dim - 1) / 8 + 1);
   dim3 block_dim(8, 128);
   ls_dropout_bias_bwd_kernel<<<grid_dim, block_dim, 0, stream>>>(
-      row_size, ratio, in_grad, bias_grad, out_grad, mask, dim);
+      row_size, ratio, in_grad, bias_grad, out_grad, mask, dim, seed,
+      rng_offset);
 }
 
 template <>
 void launch_ls_dropout_bias_bwd(__half *in_grad, __half *bias_grad,
                                 const __half *out_grad, const uint8_t *mask,
                                 int row_size, int dim, float ratio,
-                                cudaStream_t stream) {
+                                cudaStream_t stream, int seed,
+                                const unsigned long long *rng_offset) {
   dim >>= 1;
   dim3 grid_dim((dim - 1) / 8 + 1);
   dim3 block_dim(8, 128);
   ls_dropout_bias_bwd_kernel<<<grid_dim, block_dim, 0, stream>>>(
-      row_size, ratio, in_grad, bias_grad, out_grad, mask, dim);
+      row_size, ratio, in_grad, bias_grad, out_grad, mask, dim, seed,
+      rng_offset);
 }
 
 template void launch_ls_dropout_bias_bwd(float *in_grad, float *bias_grad,
                                          const float *out_grad,
                                          const uint8_t *mask, int row_size,
                                          int dim, float ratio,
-                                         cudaStream_t stream);
+                                         cudaStream_t stream, int seed,
+                                         const unsigned long long *rng_offset);
 
 /**
  * @brief fused bias, activation, and dropout at the end of first ffn
@@ -667,7 +758,8 @@ template void launch_ls_dropout_bias_bwd(float *in_grad, float *bias_grad,
  * @param ratio drop ratio
  * @param out [batch_size, seq_len, hidden_size], float and __half
  * @param in [batch_size, seq_len, hidden_size], float and __half
- * @param mask [batch_size, seq_len, hidden_size], uint8 type
+ * @param mask [batch_size, seq_len, hidden_size], uint8 type, nullptr to
+ * store no mask
  * @param bias [hidden_size], ffn bias
  * @param seed seed to curand
  * @param hidden_size
@@ -677,14 +769,15 @@ template <ActivationType act_type>
 __global__ void ls_dropout_act_bias_kernel(
     const int total_count, const float ratio, float *__restrict__ out,
     const float *__restrict__ in, uint8_t *__restrict__ mask,
-    const float *__restrict__ bias, const int seed, const int hidden_size) {
+    const float *__restrict__ bias, const int seed, const int hidden_size,
+    const unsigned long long *rng_offset) {
   const float scale = 1.f / (1.f - ratio);
   int i = blockIdx.x * blockDim.x + threadIdx.x;
 
   if (i * 4 >= total_count) return;
 
   curandStatePhilox4_32_10_t state;
-  curand_init(seed, i, 0, &state);
+  curand_init(ls_dropout_key(seed, rng_offset), i, 0, &state);
   uint8_t m[4];
 
   float4 *out4 = reinterpret_cast<float4 *>(out);
@@ -700,7 +793,7 @@ __global__ void ls_dropout_act_bias_kernel(
 
   int bias_i = i % (hidden_size >> 2);
   uint32_t *m4 = reinterpret_cast<uint32_t *>(m);
-  mask4[i] = m4[0];
+  if (mask) mask4[i] = m4[0];
   const float4 input4 = data4[i];
   const float4 b4 = __ldg(&bias4[bias_i]);
   float4 output4;
@@ -721,7 +814,8 @@ template <ActivationType act_type>
 __global__ void ls_dropout_act_bias_kernel(
     const int total_count, const float ratio, __half *__restrict__ out,
     const __half *__restrict__ in, uint8_t *__restrict__ mask,
-    const __half *__restrict__ bias, const int seed, const int hidden_size) {
+    const __half *__restrict__ bias, const int seed, const int hidden_size,
+    const unsigned long long *rng_offset) {
   const float scale = 1.f / (1.f - ratio);
 
   int i = blockIdx.x * blockDim.x + threadIdx.x;
@@ -729,7 +823,7 @@ __global__ void ls_dropout_act_bias_kernel(
   if (i * 8 >= total_count) return;
 
   curandStatePhilox4_32_10_t state;
-  curand_init(seed, i, 0, &state);
+  curand_init(ls_dropout_key(seed, rng_offset), i, 0, &state);
 
   const float4 *vals_float4 = reinterpret_cast<const float4 *>(in);
   float4 *outs_float4 = reinterpret_cast<float4 *>(out);
@@ -748,7 +842,7 @@ __global__ void ls_dropout_act_bias_kernel(
   m[6] = (uint8_t)(rand.z > ratio);
   m[7] = (uint8_t)(rand.w > ratio);
   uint64_t *m8 = reinterpret_cast<uint64_t *>(m);
-  mask8[i] = *m8;
+  if (mask) mask8[i] = *m8;
 
   int bias_i = i % (hidden_size >> 3);
   float4 val_float4 = vals_float4[i];
@@ -781,57 +875,49 @@ __global__ void ls_dropout_act_bias_kernel(
 template <>
 void launch_ls_dropout_act_bias<ActivationType::kGelu, float>(
     float *out, const float *vals, uint8_t *mask, const float *bias,
-    int total_count, int dim, float ratio, cudaStream_t stream) {
+    int total_count, int dim, float ratio, cudaStream_t stream, int seed,
+    const unsigned long long *rng_offset) {
   int grid_dim = total_count >> 10;
   ls_dropout_act_bias_kernel<ActivationType::kGelu>
       <<<grid_dim + 1, 256, 0, stream>>>(
           total_count, ratio, out, vals, mask, bias,
-          std::chrono::duration_cast<std::chrono::microseconds>(
-              std::chrono::system_clock::now().time_since_epoch())
-              .count(),
-          dim);
+          seed < 0 ? ls_dropout_seed() : seed, dim, rng_offset);
 }
 
 template <>
 void launch_ls_dropout_act_bias<ActivationType::kGelu, __half>(
     __half *out, const __half *vals, uint8_t *mask, const __half *bias,
-    int total_count, int dim, float ratio, cudaStream_t stream) {
+    int total_count, int dim, float ratio, cudaStream_t stream, int seed,
+    const unsigned long long *rng_offset) {
   int grid_dim = total_count >> 11;
   ls_dropout_act_bias_kernel<ActivationType::kGelu>
       <<<grid_dim + 1, 256, 0, stream>>>(
           total_count, ratio, out, vals, mask, bias,
-          std::chrono::duration_cast<std::chrono::microseconds>(
-              std::chrono::system_clock::now().time_since_epoch())
-              .count(),
-          dim);
+          seed < 0 ? ls_dropout_seed() : seed, dim, rng_offset);
 }
 
 template <>
 void launch_ls_dropout_act_bias<ActivationType::kRelu, float>(
     float *out, const float *vals, uint8_t *mask, const float *bias,
-    int total_count, int dim, float ratio, cudaStream_t stream) {
+    int total_count, int dim, float ratio, cudaStream_t stream, int seed,
+    const unsigned long long *rng_offset) {
   int grid_dim = total_count >> 10;
   ls_dropout_act_bias_kernel<ActivationType::kRelu>
       <<<grid_dim + 1, 256, 0, stream>>>(
           total_count, ratio, out, vals, mask, bias,
-          std::chrono::duration_cast<std::chrono::microseconds>(
-              std::chrono::system_clock::now().time_since_epoch())
-              .count(),
-          dim);
+          seed < 0 ? ls_dropout_seed() : seed, dim, rng_offset);
 }
 
 template <>
 void launch_ls_dropout_act_bias<ActivationType::kRelu, __half>(
     __half *out, const __half *vals, uint8_t *mask, const __half *bias,
-    int total_count, int dim, float ratio, cudaStream_t stream) {
+    int total_count, int dim, float ratio, cudaStream_t stream, int seed,
+    const unsigned long long *rng_offset) {
   int grid_dim = total_count >> 11;
   ls_dropout_act_bias_kernel<ActivationType::kRelu>
       <<<grid_dim + 1, 256, 0, stream>>>(
           total_count, ratio, out, vals, mask, bias,
-          std::chrono::duration_cast<std::chrono::microseconds>(
-              std::chrono::system_clock::now().time_since_epoch())
-              .count(),
-          dim);
+          seed < 0 ? ls_dropout_seed() : seed, dim, rng_offset);
 }
 
 /**
@@ -1314,8 +1400,10 @@ void launch_ls_fakequant_dropout_act_bias<ActivationType::kRelu, __half>(
  * @param in_grad [batch_size, seq_len, hidden_size], input grad
  * @param bias_grad [hidden_size], bias grad
  * @param out_grad [batch_size, seq_len, hidden_size], output grad
- * @param mask [batch_size, seq_len, hidden_size], dropout mask
+ * @param mask [batch_size, seq_len, hidden_size], dropout mask, nullptr to
+ * redraw it from seed
  * @param hidden_size
+ * @param seed seed of the forward
  * @return void
  */
 template <ActivationType act_type, typename T>
@@ -1323,7 +1411,9 @@ __global__ void ls_dropout_act_bias_bwd_kernel(
     const int row_size, const float ratio, T *in_grad,
     T *__restrict__ bias_grad, const T *__restrict__ input,
     const T *__restrict__ bias, const T *out_grad,
-    const uint8_t *__restrict__ mask, const int hidden_size) {
+    const uint8_t *__restrict__ mask, const int hidden_size, const int seed,
+    const unsigned long long *rng_offset) {
+  const unsigned long long key = ls_dropout_key(seed, rng_offset);
   const float scale = 1.f / (1.f - ratio);
   __shared__ float tile[WARP_SIZE][WARP_SIZE + 1];
 
@@ -1341,8 +1431,11 @@ __global__ void ls_dropout_act_bias_bwd_kernel(
       float val = out_grad[idx];
       float in = input[idx];
       float b = bias[idx % hidden_size];
+      // the forward draws a float4 of T per thread.
+      uint8_t m = mask ? mask[idx]
+                       : ls_dropout_redraw(key, idx, 16 / sizeof(T), ratio);
       val = activation_bwd_kernel<act_type, float>(
-          val * scale * static_cast<float>(mask[idx]), in + b);
+          val * scale * static_cast<float>(m), in + b);
       local_sum += val;
       in_grad[idx] = val;
       idx += stride;
@@ -1428,11 +1521,14 @@ template <ActivationType act_type, typename T>
 void launch_ls_dropout_act_bias_bwd(T *in_grad, T *bias_grad, const T *input,
                                     const T *bias, const T *out_grad,
                                     const uint8_t *mask, int row_size, int dim,
-                                    float ratio, cudaStream_t stream) {
+                                    float ratio, cudaStream_t stream,
+                                    int seed,
+                                    const unsigned long long *rng_offset) {
   dim3 grid_dim((dim - 1) / WARP_SIZE + 1);
   dim3 block_dim(WARP_SIZE, WARP_SIZE);
   ls_dropout_act_bias_bwd_kernel<act_type><<<grid_dim, block_dim, 0, stream>>>(
-      row_size, ratio, in_grad, bias_grad, input, bias, out_grad, mask, dim);
+      row_size, ratio, in_grad, bias_grad, input, bias, out_grad, mask, dim,
+      seed, rng_offset);
 }
 
 // template <>
@@ -1452,22 +1548,26 @@ void launch_ls_dropout_act_bias_bwd(T *in_grad, T *bias_grad, const T *input,
 template void launch_ls_dropout_act_bias_bwd<ActivationType::kRelu, float>(
     float *in_grad, float *bias_grad, const float *input, const float *bias,
     const float *out_grad, const uint8_t *mask, int row_size, int dim,
-    float ratio, cudaStream_t stream);
+    float ratio, cudaStream_t stream, int seed,
+    const unsigned long long *rng_offset);
 
 template void launch_ls_dropout_act_bias_bwd<ActivationType::kRelu, __half>(
     __half *in_grad, __half *bias_grad, const __half *input, const __half *bias,
     const __half *out_grad, const uint8_t *mask, int row_size, int dim,
-    float ratio, cudaStream_t stream);
+    float ratio, cudaStream_t stream, int seed,
+    const unsigned long long *rng_offset);
 
 template void launch_ls_dropout_act_bias_bwd<ActivationType::kGelu, float>(
     float *in_grad, float *bias_grad, const float *input, const float *bias,
     const float *out_grad, const uint8_t *mask, int row_size, int dim,
-    float ratio, cudaStream_t stream);
+    float ratio, cudaStream_t stream, int seed,
+    const unsigned long long *rng_offset);
 
 template void launch_ls_dropout_act_bias_bwd<ActivationType::kGelu, __half>(
     __half *in_grad, __half *bias_grad, const __half *input, const __half *bias,
     const __half *out_grad, const uint8_t *mask, int row_size, int dim,
-    float ratio, cudaStream_t stream);
+    float ratio, cudaStream_t stream, int seed,
+    const unsigned long long *rng_offset);
 
 /**
  * @brief fused bias, activation, and dropout backward
@@ -1,3 +1,4 @@
+#include "block_reduce.h"
 #include "common.h"
 #include "embKernels.h"
 #include "kernels.h"
@@ -71,7 +72,8 @@ blockDim.x = MAX_THREADS;
 
 @param
 token_emb: [vocab_size, hidden_dim]
-pos_emb: [max_step, hidden_dim]
+pos_emb: [max_step, hidden_dim], or nullptr for the sinusoidal positions
+  computed in the kernel, see pos_emb_chunk
 tokens: input token id, [batch_size, seq_len]
 output: result, [batch_size, seq_len, hidden_dim]
 pad_mask: record the padding token, [batch_size, seq_len]
@@ -105,7 +107,7 @@ __global__ void ker_enc_emb(const T *token_emb, const T *pos_emb,
       pad_mask[tokens_idx] = 0;
     }
     value = ((float4 *)token_emb)[token * hidden_dim + dim_idx];
-    float4 pemb = ((float4 *)pos_emb)[seq_idx * hidden_dim + dim_idx];
+    float4 pemb = pos_emb_chunk(pos_emb, seq_idx, dim_idx, hidden_dim);
     value.x += pemb.x;
     value.y += pemb.y;
     value.z += pemb.z;
@@ -143,7 +145,7 @@ __global__ void ker_enc_emb<__half>(const __half *token_emb,
       pad_mask[tokens_idx] = 0;
     }
     value = ((float4 *)token_emb)[token * hidden_dim + dim_idx];
-    float4 pemb = ((float4 *)pos_emb)[seq_idx * hidden_dim + dim_idx];
+    float4 pemb = pos_emb_chunk(pos_emb, seq_idx, dim_idx, hidden_dim);
     __half2 *value_h2 = (__half2 *)(&value);
     __half2 *pemb_h2 = (__half2 *)(&pemb);
 #pragma unroll
@@ -168,7 +170,8 @@ blockDim.x = MAX_THREADS;
 
 @param
 token_emb: [vocab_size, hidden_dim]
-pos_emb: [max_step, hidden_dim]
+pos_emb: [max_step, hidden_dim], or nullptr for the sinusoidal positions
+  computed in the kernel, see pos_emb_chunk
 tokens: input token id, [batch_size, seq_len]
 lang_emb: language embedding, [num_lang, hidden_dim]
 lang_id: language index, [batch_size]
@@ -208,7 +211,7 @@ __global__ void ker_enc_emb_multilg_token(const T *token_emb, const T *pos_emb,
     value = ((float4 *)token_emb)[token * hidden_dim + dim_idx];
 
     // add pos emb
-    float4 pemb = ((float4 *)pos_emb)[seq_idx * hidden_dim + dim_idx];
+    float4 pemb = pos_emb_chunk(pos_emb, seq_idx, dim_idx, hidden_dim);
     value.x += pemb.x;
     value.y += pemb.y;
     value.z += pemb.z;
@@ -253,7 +256,7 @@ __global__ void ker_enc_emb_multilg_token<__half>(
     value = ((float4 *)token_emb)[token * hidden_dim + dim_idx];
     __half2 *value_h2 = (__half2 *)(&value);
 
-    float4 pemb = ((float4 *)pos_emb)[seq_idx * hidden_dim + dim_idx];
+    float4 pemb = pos_emb_chunk(pos_emb, seq_idx, dim_idx, hidden_dim);
     __half2 *pemb_h2 = (__half2 *)(&pemb);
     float4 lemb =
         ((float4 *)lang_emb)[lang_id[batch_idx] * hidden_dim + dim_idx];
@@ -281,7 +284,8 @@ blockDim.x = MAX_THREADS;
 
 @param
 token_emb: [vocab_size, hidden_dim]
-pos_emb: [max_step, hidden_dim]
+pos_emb: [max_step, hidden_dim], or nullptr for the sinusoidal positions
+  computed in the kernel, see pos_emb_chunk
 tokens: input token id, [batch_size, seq_len]
 lang_emb: language embedding, [num_lang, hidden_dim]
 lang_id: language index, [batch_size]
@@ -327,7 +331,7 @@ __global__ void ker_enc_emb_multilg_sentence(
       pad_mask[tokens_idx] = 0;
     }
     value = ((float4 *)token_emb)[token_emb_idx * hidden_dim + dim_idx];
-    float4 pemb = ((float4 *)pos_emb)[seq_idx * hidden_dim + dim_idx];
+    float4 pemb = pos_emb_chunk(pos_emb, seq_idx, dim_idx, hidden_dim);
     value.x += pemb.x;
     value.y += pemb.y;
     value.z += pemb.z;
@@ -374,7 +378,7 @@ __global__ void ker_enc_emb_multilg_sentence<__half>(
       pad_mask[tokens_idx] = 0;
     }
     value = ((float4 *)token_emb)[token_emb_idx * hidden_dim + dim_idx];
-    float4 pemb = ((float4 *)pos_emb)[seq_idx * hidden_dim + dim_idx];
+    float4 pemb = pos_emb_chunk(pos_emb, seq_idx, dim_idx, hidden_dim);
     __half2 *value_h2 = (__half2 *)(&value);
     __half2 *pemb_h2 = (__half2 *)(&pemb);
 #pragma unroll
@@ -459,6 +463,144 @@ template void launch_enc_emb<__half>(const __half *token_emb,
                                      const __half *lang_emb, const int *lang_id,
                                      int multilg_type);
 
+// the LN_EPSILON of ker_layer_norm.
+const float kEmbLnEpsilon = 1e-8f;
+
+// The float4 chunk idx of the embedding of a token at seq_idx, in fp32.
+// hidden_dim is in chunks.
+template <typename T>
+__device__ __forceinline__ void enc_emb_chunk(const T *token_emb,
+                                              const T *pos_emb, int token,
+                                              int seq_idx, int hidden_dim,
+                                              int idx, bool is_pad,
+                                              float *val) {
+  const int kElems = sizeof(float4) / sizeof(T);
+  if (is_pad) {
+#pragma unroll
+    for (int i = 0; i < kElems; i++) val[i] = 0.f;
+    return;
+  }
+  float4 temb = ((const float4 *)token_emb)[token * hidden_dim + idx];
+  float4 pemb = pos_emb_chunk(pos_emb, seq_idx, idx, hidden_dim);
+  const T *temb_t = (const T *)&temb;
+  const T *pemb_t = (const T *)&pemb;
+#pragma unroll
+  for (int i = 0; i < kElems; i++) {
+    val[i] = float(temb_t[i]) + float(pemb_t[i]);
+  }
+}
+
+/**
+@brief: ker_enc_emb_ln
+ker_enc_emb and the layer normalization of its output in one pass, the
+embedding of a token is summed in fp32 and normalized without being written
+out. The padding tokens get the normalization of zeros, which is bias, as
+the unfused ker_layer_norm.
+
+@thread
+gridDim.x = batch_size * seq_len
+blockDim.x = min(hidden_dim / 4 or 8, MAX_THREADS), a multiple of 32
+
+@param
+token_emb: [vocab_size, hidden_dim]
+pos_emb: [max_step, hidden_dim], or nullptr for the sinusoidal positions
+  computed in the kernel, see pos_emb_chunk
+tokens: input token id, [batch_size, seq_len]
+scale: [hidden_dim], ln scale
+bias: [hidden_dim], ln bias
+output: result, [batch_size, seq_len, hidden_dim]
+pad_mask: record the padding token, [batch_size, seq_len]
+hidden_dim: in float4 chunks
+*/
+template <typename T>
+__global__ void ker_enc_emb_ln(const T *token_emb, const T *pos_emb,
+                               const int *tokens, const T *scale,
+                               const T *bias, T *output, T *pad_mask,
+                               int pad_id, int seq_len, int hidden_dim) {
+  const int kElems = sizeof(float4) / sizeof(T);
+  int tokens_idx = blockIdx.x;
+  int seq_idx = tokens_idx % seq_len;
+  int token = tokens[tokens_idx];
+  bool is_pad = token == pad_id;
+  if (threadIdx.x == 0) {
+    pad_mask[tokens_idx] = is_pad ? T(CUDA_FLOAT_INF_NEG) : T(0.f);
+  }
+
+  // step 0. compute local sum
+  float val[kElems];
+  float l_sum = 0;
+  float l_square_sum = 0;
+  for (int idx = threadIdx.x; idx < hidden_dim; idx += blockDim.x) {
+    enc_emb_chunk(token_emb, pos_emb, token, seq_idx, hidden_dim, idx, is_pad,
+                  val);
+#pragma unroll
+    for (int i = 0; i < kElems; i++) {
+      l_sum += val[i];
+      l_square_sum += val[i] * val[i];
+    }
+  }
+
+  // step 1. compute reduce sum
+  float mean_dim = float(hidden_dim) * kElems;
+  float reduce_val[2] = {l_sum, l_square_sum};
+  blockReduce<ReduceType::kSum, 2>(reduce_val);
+  __shared__ float s_mean, s_var;
+  if (threadIdx.x == 0) {
+    s_mean = reduce_val[0] / mean_dim;
+    s_var = rsqrtf(reduce_val[1] / mean_dim - s_mean * s_mean +
+                   kEmbLnEpsilon);
+  }
+  __syncthreads();
+
+  // step 2. layer norm result, the embedding is looked up again from the
+  // cache rather than kept in registers for any hidden_dim.
+  float4 *output_f4 = (float4 *)output + tokens_idx * hidden_dim;
+  for (int idx = threadIdx.x; idx < hidden_dim; idx += blockDim.x) {
+    enc_emb_chunk(token_emb, pos_emb, token, seq_idx, hidden_dim, idx, is_pad,
+                  val);
+    float4 vscale = __ldg((const float4 *)scale + idx);
+    float4 vbias = __ldg((const float4 *)bias + idx);
+    const T *scale_t = (const T *)&vscale;
+    const T *bias_t = (const T *)&vbias;
+    float4 res;
+    T *res_t = (T *)&res;
+#pragma unroll
+    for (int i = 0; i < kElems; i++) {
+      res_t[i] =
+          T((val[i] - s_mean) * s_var * float(scale_t[i]) + float(bias_t[i]));
+    }
+    output_f4[idx] = res;
+  }
+}
+
+template <typename T>
+void launch_enc_emb_ln(const T *token_emb, const T *pos_emb, const int *tokens,
+                       const T *scale, const T *bias, T *output, T *pad_mask,
+                       int pad_id, int batch_size, int seq_len,
+                       int hidden_dim, cudaStream_t stream) {
+  const int kElems = sizeof(float4) / sizeof(T);
+  if (hidden_dim % kElems != 0) {
+    throw std::runtime_error("violate hidden_dim % " +
+                             std::to_string(kElems) + " = 0");
+  }
+  hidden_dim /= kElems;
+  int nthread = min(((hidden_dim + 31) / 32) * 32, MAX_THREADS);
+  ker_enc_emb_ln<T><<<batch_size * seq_len, nthread, 0, stream>>>(
+      token_emb, pos_emb, tokens, scale, bias, output, pad_mask, pad_id,
+      seq_len, hidden_dim);
+}
+
+template void launch_enc_emb_ln<float>(
+    const float *token_emb, const float *pos_emb, const int *tokens,
+    const float *scale, const float *bias, float *output, float *pad_mask,
+    int pad_id, int batch_size, int seq_len, int hidden_dim,
+    cudaStream_t stream);
+template void launch_enc_emb_ln<__half>(
+    const __half *token_emb, const __half *pos_emb, const int *tokens,
+    const __half *scale, const __half *bias, __half *output,
+    __half *pad_mask, int pad_id, int batch_size, int seq_len,
+    int hidden_dim, cudaStream_t stream);
+
 /**
 @brief: ker_dec_embedding
 for decoder, look up token embedding, add position embedding
@@ -469,7 +611,8 @@ blockDim.x = MAX_THREADS
 
 @param
 token_emb: [hidden_dim, vocab_size], note, it is different with encoder
-pos_emb: [max_step, hidden_dim]
+pos_emb: [max_step, hidden_dim], or nullptr for the sinusoidal positions
+  computed in the kernel, see pos_emb_chunk
 tokens: input token id, [batch_size, beam_size, max_step]
 lang_emb: language embedding, [num_lang, hidden_dim]
 lang_id: language index, [batch_size]
@@ -503,8 +646,9 @@ __global__ void ker_dec_emb(const T *token_emb, const T *pos_emb, int *tokens,
         tokens[flat_3dim(batch_idx, beam_idx, step, beam_size, max_step)];
     emb = token_emb[flat_2dim(dim_idx, token, vocab_size)];
   }
-  float value =
-      float(emb) + float(pos_emb[flat_2dim(step, dim_idx, hidden_dim)]);
+  float value = float(emb) +
+                (pos_emb ? float(pos_emb[flat_2dim(step, dim_idx, hidden_dim)])
+                         : sinusoidal_position(step, dim_idx, hidden_dim));
   if (multilg_type == 1) {
     // token level multilg, add lang_emb
     value +=
@@ -558,7 +702,8 @@ blockDim.x = MAX_THREADS
 @param
 conv_weight: [hidden_dim, channel_input, patch_size, patch_size]
 conv_bias: [hidden_dim]
-pos_emb: [max_step, hidden_dim]
+pos_emb: [max_step, hidden_dim], or nullptr for the sinusoidal positions
+  computed in the kernel, see pos_emb_chunk
 cls_emb: [hidden_dim]
 input: [batch_size, channel_input, image_size, image_size]
 output: result, [batch_size, max_step, hidden_dim]
@@ -2,7 +2,9 @@
 #include <ctime>
 #include <cooperative_groups.h>
 #include <cooperative_groups/reduce.h>
+#include <cub/cub.cuh>
 
+#include "common.h"
 #include "kernels.h"
 
 #include "cuda_util.h"
@@ -71,6 +73,52 @@ __global__ void get_tokens_position(int *output, const int *input,
   }
 }
 
+// The sequence of the flattened token t, cu_seqlens is ascending.
+__forceinline__ __device__ int packed_seq_of(const int *cu_seqlens,
+                                             int num_seqs, int t) {
+  int lo = 0, hi = num_seqs - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) >> 1;
+    if (cu_seqlens[mid] <= t)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/**
+@brief: ker_packed_seq_ids
+the sequence of every token of a packed batch and its position in the sequence,
+see launch_packed_seq_ids.
+
+@thread
+gridDim.x = (batch_tokens + MAX_THREADS - 1) / MAX_THREADS
+blockDim.x = MAX_THREADS
+
+@param
+seq_ids: [batch_tokens], can be nullptr
+positions: [batch_tokens], can be nullptr
+cu_seqlens: [num_seqs + 1]
+*/
+__global__ void ker_packed_seq_ids(int *seq_ids, int *positions,
+                                   const int *cu_seqlens, int num_seqs,
+                                   int batch_tokens) {
+  int t = blockIdx.x * blockDim.x + threadIdx.x;
+  if (t >= batch_tokens) return;
+  int seq = packed_seq_of(cu_seqlens, num_seqs, t);
+  if (seq_ids) seq_ids[t] = seq;
+  if (positions) positions[t] = t - cu_seqlens[seq];
+}
+
+void launch_packed_seq_ids(int *seq_ids, int *positions, const int *cu_seqlens,
+                           int num_seqs, int batch_tokens,
+                           cudaStream_t stream) {
+  int grid_dim = (batch_tokens + MAX_THREADS - 1) / MAX_THREADS;
+  ker_packed_seq_ids<<<grid_dim, MAX_THREADS, 0, stream>>>(
+      seq_ids, positions, cu_seqlens, num_seqs, batch_tokens);
+}
+
 __device__ int get_clip_mask(float value, float clip_max) {
   if (value >= clip_max) {
     return 2;
@@ -98,7 +146,8 @@ output: [batch_size, seq_len, embedding_dim]
 input: [batch_size, seq_len]
 tokens_position: [batch_size, seq_len]
 embeddings: [vocab_size, embedding_dim]
-pos_embeddings: [max_seq_len, embedding_dim]
+pos_embeddings: [max_seq_len, embedding_dim], or nullptr for the sinusoidal
+  positions computed by pos_emb_chunk, of any length
 dropout_mask: [batch_size, seq_len, embedding_dim]
 batch_size: the size of the current batch
 seq_len: the sequence length of the current batch
@@ -133,8 +182,6 @@ __global__ void lookup_scale_pos_dropout<float>(
 
   float4 *output4 = reinterpret_cast<float4 *>(output);
   const float4 *embeddings4 = reinterpret_cast<const float4 *>(embeddings);
-  const float4 *pos_embeddings4 =
-      reinterpret_cast<const float4 *>(pos_embeddings);
   uint32_t *dropout_mask4 = reinterpret_cast<uint32_t *>(dropout_mask);
 
   // no need to calculate dropout_mask
@@ -167,8 +214,8 @@ __global__ void lookup_scale_pos_dropout<float>(
     int offset = i - target_pos * embedding_dim;
     // step is non-zero only in inference
     float4 e4 = embeddings4[tid * embedding_dim + offset];
-    float4 pe4 =
-        pos_embeddings4[(token_pos_id + step) * embedding_dim + offset];
+    float4 pe4 = pos_emb_chunk(pos_embeddings, token_pos_id + step, offset,
+                               embedding_dim);
     float4 res4;
 
     float scale_mask[4];
@@ -218,8 +265,6 @@ __global__ void lookup_scale_pos_dropout<__half>(
 
   float4 *output4 = reinterpret_cast<float4 *>(output);
   const float4 *embeddings4 = reinterpret_cast<const float4 *>(embeddings);
-  const float4 *pos_embeddings4 =
-      reinterpret_cast<const float4 *>(pos_embeddings);
   uint64_t *dropout_mask8 = reinterpret_cast<uint64_t *>(dropout_mask);
 
   // no need to calculate dropout_mask
@@ -257,8 +302,8 @@ __global__ void lookup_scale_pos_dropout<__half>(
     int offset = i - target_pos * embedding_dim;
     float4 e4 = embeddings4[tid * embedding_dim + offset];
     // step is non-zero only in inference
-    float4 pe4 =
-        pos_embeddings4[(token_pos_id + step) * embedding_dim + offset];
+    float4 pe4 = pos_emb_chunk(pos_embeddings, token_pos_id + step, offset,
+                               embedding_dim);
     float4 res4;
 
     __half2 *e_h2 = reinterpret_cast<__half2 *>(&e4);
@@ -301,14 +346,21 @@ void launch_lookup_scale_pos_dropout<float>(
     float *output, const int *input, const float *embeddings,
     const float *pos_embeddings, const float *clip_max, uint8_t *dropout_mask,
     int *tokens_position, int batch_size, int seq_len, int embedding_dim,
-    int padding_idx, float dropout_ratio, int step, cudaStream_t &stream) {
-  int p_threads = min(seq_len, MAX_THREADS);
-  dim3 p_grid_dim(batch_size, 1);
-  dim3 p_block_dim(p_threads, 1);
-  // get the position index of the tokens alone,
-  // because synchronization is required at the sequence level
-  get_tokens_position<<<p_grid_dim, p_block_dim, 0, stream>>>(
-      tokens_position, input, batch_size, seq_len, padding_idx);
+    int padding_idx, float dropout_ratio, int step, cudaStream_t &stream,
+    const int *cu_seqlens, int num_seqs) {
+  if (cu_seqlens) {
+    // packed batch, the positions restart at every sequence
+    launch_packed_seq_ids(nullptr, tokens_position, cu_seqlens, num_seqs,
+                          batch_size * seq_len, stream);
+  } else {
+    int p_threads = min(seq_len, MAX_THREADS);
+    dim3 p_grid_dim(batch_size, 1);
+    dim3 p_block_dim(p_threads, 1);
+    // get the position index of the tokens alone,
+    // because synchronization is required at the sequence level
+    get_tokens_position<<<p_grid_dim, p_block_dim, 0, stream>>>(
+        tokens_position, input, batch_size, seq_len, padding_idx);
+  }
 
   float emb_scale = sqrt(embedding_dim);
   embedding_dim >>= 2;
@@ -333,14 +385,21 @@ void launch_lookup_scale_pos_dropout<__half>(
     __half *output, const int *input, const __half *embeddings,
     const __half *pos_embeddings, const __half *clip_max, uint8_t *dropout_mask,
     int *tokens_position, int batch_size, int seq_len, int embedding_dim,
-    int padding_idx, float dropout_ratio, int step, cudaStream_t &stream) {
-  int p_threads = min(seq_len, MAX_THREADS);
-  dim3 p_grid_dim(batch_size, 1);
-  dim3 p_block_dim(p_threads, 1);
-  // get the position index of the tokens alone,
-  // because synchronization is required at the sequence level
-  get_tokens_position<<<p_grid_dim, p_block_dim, 0, stream>>>(
-      tokens_position, input, batch_size, seq_len, padding_idx);
+    int padding_idx, float dropout_ratio, int step, cudaStream_t &stream,
+    const int *cu_seqlens, int num_seqs) {
+  if (cu_seqlens) {
+    // packed batch, the positions restart at every sequence
+    launch_packed_seq_ids(nullptr, tokens_position, cu_seqlens, num_seqs,
+                          batch_size * seq_len, stream);
+  } else {
+    int p_threads = min(seq_len, MAX_THREADS);
+    dim3 p_grid_dim(batch_size, 1);
+    dim3 p_block_dim(p_threads, 1);
+    // get the position index of the tokens alone,
+    // because synchronization is required at the sequence level
+    get_tokens_position<<<p_grid_dim, p_block_dim, 0, stream>>>(
+        tokens_position, input, batch_size, seq_len, padding_idx);
+  }
 
   float emb_scale = sqrt(embedding_dim);
   embedding_dim >>= 3;
@@ -789,5 +848,153 @@ void launch_d_lookup_scale_pos_dropout<__half>(
         seq_len, embedding_dim, padding_idx, dropout_ratio, emb_scale);
   }
 }
+
+/**
+@brief: sparse_emb_grad_keys
+the sort keys and values of launch_d_lookup_scale_pos_dropout_sparse, the
+token of every position, vocab_size for the padding so that it sorts last.
+*/
+__global__ void sparse_emb_grad_keys(int *keys, int *positions,
+                                     const int *input, int batch_tokens,
+                                     int vocab_size, int padding_idx) {
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= batch_tokens) return;
+  int tid = input[idx];
+  keys[idx] = tid == padding_idx ? vocab_size : tid;
+  positions[idx] = idx;
+}
+
+/**
+@brief: d_lookup_scale_dropout_sparse
+sum the grads of the positions of every unique token, in position order.
+
+@thread
+gridDim.x = batch_tokens, one block per run, the blocks beyond num_runs exit
+blockDim.x = min(embedding_dim, MAX_THREADS)
+
+@param
+grad_rows: [batch_tokens, embedding_dim], the first num_rows are written
+rows: [batch_tokens] the unique tokens, sorted
+num_rows: [1] the runs without the one of the padding
+positions: [batch_tokens] the positions sorted by token
+run_offsets, run_lengths, num_runs: the runs of the sorted tokens
+*/
+template <typename T>
+__global__ void d_lookup_scale_dropout_sparse(
+    T *grad_rows, const int *rows, int *num_rows, const T *grad_output,
+    const uint8_t *dropout_mask, const int *positions, const int *run_offsets,
+    const int *run_lengths, const int *num_runs, int embedding_dim,
+    int vocab_size, float scale) {
+  int runs = num_runs[0];
+  if (blockIdx.x == 0 && threadIdx.x == 0) {
+    num_rows[0] = runs > 0 && rows[runs - 1] == vocab_size ? runs - 1 : runs;
+  }
+  if (blockIdx.x >= runs || rows[blockIdx.x] == vocab_size) return;
+
+  const int *run_positions = positions + run_offsets[blockIdx.x];
+  int length = run_lengths[blockIdx.x];
+  for (int i = threadIdx.x; i < embedding_dim; i += blockDim.x) {
+    float sum = 0.f;
+    for (int j = 0; j < length; j++) {
+      int idx = run_positions[j] * embedding_dim + i;
+      sum += (dropout_mask[idx] & 1) ? float(grad_output[idx]) : 0.f;
+    }
+    grad_rows[blockIdx.x * embedding_dim + i] = T(sum * scale);
+  }
+}
+
+namespace {
+
+// the int buffers of the workspace of launch_d_lookup_scale_pos_dropout_sparse
+// before the temporary storage of cub, aligned to 256 bytes.
+const int kSparseEmbGradBuffers = 7;
+
+size_t sparse_emb_grad_buffer_bytes(int max_batch_tokens) {
+  return (size_t(max_batch_tokens) * sizeof(int) + 255) / 256 * 256;
+}
+
+size_t sparse_emb_grad_cub_bytes(int max_batch_tokens) {
+  size_t sort_bytes = 0, encode_bytes = 0, scan_bytes = 0;
+  cub::DeviceRadixSort::SortPairs(nullptr, sort_bytes, (int *)nullptr,
+                                  (int *)nullptr, (int *)nullptr,
+                                  (int *)nullptr, max_batch_tokens);
+  cub::DeviceRunLengthEncode::Encode(nullptr, encode_bytes, (int *)nullptr,
+                                     (int *)nullptr, (int *)nullptr,
+                                     (int *)nullptr, max_batch_tokens);
+  cub::DeviceScan::ExclusiveSum(nullptr, scan_bytes, (int *)nullptr,
+                                (int *)nullptr, max_batch_tokens);
+  return std::max(sort_bytes, std::max(encode_bytes, scan_bytes));
+}
+
+}  // namespace
+
+size_t sparse_emb_grad_workspace_bytes(int max_batch_tokens) {
+  return kSparseEmbGradBuffers *
+             sparse_emb_grad_buffer_bytes(max_batch_tokens) +
+         sparse_emb_grad_cub_bytes(max_batch_tokens);
+}
+
+template <typename T>
+void launch_d_lookup_scale_pos_dropout_sparse(
+    T *grad_rows, int *rows, int *num_rows, const T *grad_output,
+    const int *input, const uint8_t *dropout_mask, int batch_size,
+    int seq_len, int embedding_dim, int vocab_size, int padding_idx,
+    float dropout_ratio, void *workspace, size_t workspace_bytes,
+    cudaStream_t stream) {
+  int batch_tokens = batch_size * seq_len;
+  size_t buffer_bytes = sparse_emb_grad_buffer_bytes(batch_tokens);
+  size_t cub_bytes = sparse_emb_grad_cub_bytes(batch_tokens);
+  if (kSparseEmbGradBuffers * buffer_bytes + cub_bytes > workspace_bytes) {
+    throw std::runtime_error(
+        "The workspace of the sparse embedding grads is too small");
+  }
+  char *buffer = reinterpret_cast<char *>(workspace);
+  int *ints[kSparseEmbGradBuffers];
+  for (int i = 0; i < kSparseEmbGradBuffers; i++) {
+    ints[i] = reinterpret_cast<int *>(buffer + i * buffer_bytes);
+  }
+  int *keys = ints[0], *sorted_keys = ints[1], *positions = ints[2],
+      *sorted_positions = ints[3], *run_lengths = ints[4],
+      *run_offsets = ints[5], *num_runs = ints[6];
+  void *cub_storage = buffer + kSparseEmbGradBuffers * buffer_bytes;
+
+  sparse_emb_grad_keys<<<(batch_tokens + MAX_THREADS - 1) / MAX_THREADS,
+                         MAX_THREADS, 0, stream>>>(
+      keys, positions, input, batch_tokens, vocab_size, padding_idx);
+  // the radix sort is stable, so the positions of a token stay in order and
+  // the sums are deterministic.
+  int end_bit = 1;
+  while (end_bit < 31 && (1 << end_bit) <= vocab_size) end_bit++;
+  cub::DeviceRadixSort::SortPairs(cub_storage, cub_bytes, keys, sorted_keys,
+                                  positions, sorted_positions, batch_tokens, 0,
+                                  end_bit, stream);
+  cudaMemsetAsync(run_lengths, 0, batch_tokens * sizeof(int), stream);
+  cub::DeviceRunLengthEncode::Encode(cub_storage, cub_bytes, sorted_keys,
+                                     rows, run_lengths, num_runs,
+                                     batch_tokens, stream);
+  cub::DeviceScan::ExclusiveSum(cub_storage, cub_bytes, run_lengths,
+                                run_offsets, batch_tokens, stream);
+
+  float scale = sqrtf(embedding_dim) / (1.f - dropout_ratio);
+  d_lookup_scale_dropout_sparse<T>
+      <<<batch_tokens, min(embedding_dim, MAX_THREADS), 0, stream>>>(
+          grad_rows, rows, num_rows, grad_output, dropout_mask,
+          sorted_positions, run_offsets, run_lengths, num_runs, embedding_dim,
+          vocab_size, scale);
+}
+
+template void launch_d_lookup_scale_pos_dropout_sparse<float>(
+    float *grad_rows, int *rows, int *num_rows, const float *grad_output,
+    const int *input, const uint8_t *dropout_mask, int batch_size,
+    int seq_len, int embedding_dim, int vocab_size, int padding_idx,
+    float dropout_ratio, void *workspace, size_t workspace_bytes,
+    cudaStream_t stream);
+
+template void launch_d_lookup_scale_pos_dropout_sparse<__half>(
+    __half *grad_rows, int *rows, int *num_rows, const __half *grad_output,
+    const int *input, const uint8_t *dropout_mask, int batch_size,
+    int seq_len, int embedding_dim, int vocab_size, int padding_idx,
+    float dropout_ratio, void *workspace, size_t workspace_bytes,
+    cudaStream_t stream);
 }  // namespace cuda
 }  // namespace lightseq
@@ -0,0 +1,1523 @@
+#include "common.h"
+#include "cuda_util.h"
+#include "kernels.h"
+
+namespace lightseq {
+namespace cuda {
+
+// queries of one block in the prefill kernel, one warp per query.
+const int kFlashWarps = 4;
+// keys staged in shared memory at a time by the prefill kernel.
+const int kFlashTile = WARP_SIZE;
+// head_dim elements accumulated by each lane.
+const int kFlashDimPerLane = kFlashAttnMaxHeadDim / WARP_SIZE;
+// fewest keys of one split of the decode kernel.
+const int kFlashMinSplitKeys = 256;
+
+// The staged tiles of the large head dims take more than the default 48 KB
+// of dynamic shared memory, opt the kernel in to smem_size, which must fit
+// the device.
+template <typename Kernel>
+void flash_smem_opt_in(Kernel kernel, size_t smem_size, int head_dim) {
+  if (smem_size <= 48 * 1024) return;
+  int device, max_smem;
+  CHECK_GPU_ERROR(cudaGetDevice(&device));
+  CHECK_GPU_ERROR(cudaDeviceGetAttribute(
+      &max_smem, cudaDevAttrMaxSharedMemoryPerBlockOptin, device));
+  if (smem_size > size_t(max_smem)) {
+    throw std::runtime_error(
+        "flash attention of head_dim " + std::to_string(head_dim) +
+        " needs " + std::to_string(smem_size) +
+        " bytes of shared memory, the device has " + std::to_string(max_smem));
+  }
+  CHECK_GPU_ERROR(cudaFuncSetAttribute(
+      kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size));
+}
+
+// The index of the head vector of key pos of the batch row batch_idx in k, v
+// of [batch_size, kv_head_num, kv_size, head_dim]. With kv_rows the key is
+// read from the row kv_rows[batch_idx, pos], eg. the beam it was computed
+// by, see ker_refresh_kv_rows.
+__device__ __forceinline__ size_t kv_vec_idx(const int *kv_rows,
+                                             int batch_idx, int kv_head,
+                                             int kv_head_num, int kv_size,
+                                             int pos) {
+  int row = kv_rows ? kv_rows[(size_t)batch_idx * kv_size + pos] : batch_idx;
+  return ((size_t)row * kv_head_num + kv_head) * kv_size + pos;
+}
+
+// The position of the key in row slot of a kv ring of kv_size rows holding
+// kv_len positions, see launch_flash_attention. heavy_pos of [kv_size -
+// ring_size] gives the positions of the heavy hitters in place of the sinks,
+// -1 for a row still holding its own position, see
+// launch_evict_heavy_hitters.
+__device__ __forceinline__ int kv_slot_pos(int slot, int kv_len, int kv_size,
+                                           int ring_size,
+                                           const int *heavy_pos = nullptr) {
+  int sink_len = kv_size - ring_size;
+  if (heavy_pos && slot < sink_len && heavy_pos[slot] >= 0) {
+    return heavy_pos[slot];
+  }
+  if (ring_size == 0 || slot < sink_len || kv_len <= kv_size) return slot;
+  int last_slot = sink_len + (kv_len - 1 - sink_len) % ring_size;
+  return kv_len - 1 - (last_slot - slot + ring_size) % ring_size;
+}
+
+// Whether the attention dropout keeps the score idx of [batch_size * nhead,
+// q_len, kv_len]. A counter based hash of the ls_dropout_key and idx, so that
+// the backward redraws the mask of the forward without storing it.
+__device__ __forceinline__ bool flash_dropout_keep(unsigned long long key,
+                                                   size_t idx, float ratio) {
+  uint32_t h = uint32_t(idx) * 0x9e3779b1u ^
+               uint32_t(idx >> 32) * 0x85ebca77u ^ uint32_t(key) * 0xc2b2ae3du ^
+               uint32_t(key >> 32) * 0x27d4eb2fu;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return float(h >> 8) * (1.f / 16777216.f) >= ratio;
+}
+
+// Whether the query at q_pos sees the key at pos in row slot through a
+// sliding window of window positions after the sink_len rows of the
+// attention sinks or of the heavy hitters.
+__device__ __forceinline__ bool in_window(int slot, int pos, int q_pos,
+                                          int sink_len, int window) {
+  return window == 0 || slot < sink_len || q_pos - pos < window;
+}
+
+/**
+@brief: ker_flash_attention
+Fused scaled dot product attention, softmax(q * k^T * scale + mask) * v,
+computed with an online softmax so that the [q_len, kv_len] scores are never
+written to global memory.
+
+Every warp owns one query, the warps of a block share the tiles of
+kFlashTile keys and values staged in shared memory. For each tile, lane j
+scores key j, then the running max, sum and output of the query are rescaled
+and accumulated, each lane holding head_dim / WARP_SIZE output elements.
+
+@thread
+gridDim.x = batch_size * nhead
+gridDim.y = ceil(q_len / kFlashWarps)
+blockDim.x = kFlashWarps * WARP_SIZE
+
+@param
+q: [batch_size, nhead, q_len, head_dim]
+k, v: [batch_size, kv_head_num, kv_size, head_dim], attend to the first
+  kv_len, every kv head serves nhead / kv_head_num query heads
+k_scale, v_scale: [batch_size, kv_head_num, kv_size], the dequantization
+  scales of an int8 k, v, nullptr otherwise
+mask: [batch_size, kv_size], added to the scores, nullptr for none
+out: [batch_size, nhead, q_len, head_dim], or [batch_size, q_len, nhead,
+  head_dim] with out_token_major, the input layout of the output linear
+mask_future: query i attends to the keys [0, i + kv_len - q_len]
+pos_bias: [nhead, 2 * pos_bias_len - 1], the relative position bias added
+  to the score of the key at position j by the query at position i is
+  pos_bias[head, j - i + pos_bias_len - 1], with query i at position
+  i + kv_len - q_len. nullptr for none
+kv_rows: [batch_size, kv_size], the row of k, v holding every key of a batch
+  row, nullptr when it is the batch row itself
+ring_size, window, mask_size: the kv ring and the sliding window, see
+  launch_flash_attention. The keys are iterated by row and everything else
+  by position
+heavy_pos: [batch_size, kv_head_num, kv_size - ring_size], the positions of
+  the heavy hitters in the sink rows of a ring, see kv_slot_pos. nullptr
+  for the sinks
+tree_mask: [batch_size, tree_len, tree_len], whether a query among the last
+  tree_len positions attends to a key among them, see
+  launch_flash_attention. nullptr for none
+lse: [batch_size, nhead, q_len], the log of the softmax denominator of every
+  query for the backward, nullptr for none
+dropout_ratio, seed, rng_offset: the attention dropout of training, see
+  flash_dropout_keep, it drops the probabilities after the normalization
+*/
+template <typename T, typename CacheT>
+__global__ void ker_flash_attention(const T *q, const CacheT *k,
+                                    const CacheT *v, const T *mask, T *out,
+                                    int nhead, int q_len, int kv_len,
+                                    int kv_size, int head_dim, float scale,
+                                    bool mask_future, int kv_head_num,
+                                    const float *k_scale,
+                                    const float *v_scale, const T *pos_bias,
+                                    int pos_bias_len, bool out_token_major,
+                                    const int *kv_rows, int ring_size,
+                                    int window, int mask_size,
+                                    const int *heavy_pos,
+                                    const unsigned char *tree_mask,
+                                    int tree_len, float *lse,
+                                    float dropout_ratio, int seed,
+                                    const unsigned long long *rng_offset) {
+  extern __shared__ float s_flash[];
+  // the key rows are padded by one to avoid bank conflicts in the dot
+  // products, where lane j reads row j.
+  int k_stride = head_dim + 1;
+  float *s_k = s_flash;                        // [kFlashTile, head_dim + 1]
+  float *s_v = s_k + kFlashTile * k_stride;    // [kFlashTile, head_dim]
+  float *s_q = s_v + kFlashTile * head_dim;    // [kFlashWarps, head_dim]
+
+  int batch_head = blockIdx.x;
+  int warp_id = threadIdx.x / WARP_SIZE;
+  int lane_id = threadIdx.x % WARP_SIZE;
+  int q_idx = blockIdx.y * kFlashWarps + warp_id;
+  bool valid = q_idx < q_len;
+
+  int batch_idx = batch_head / nhead;
+  int kv_head = (batch_head % nhead) / (nhead / kv_head_num);
+  if (mask) {
+    mask += batch_idx * (mask_size ? mask_size : kv_size);
+  }
+  // the bias of query q_idx is pos_bias[pos - q_pos], with q_pos below.
+  if (pos_bias) {
+    pos_bias += (batch_head % nhead) * (2 * pos_bias_len - 1) +
+                pos_bias_len - 1;
+  }
+
+  float *q_row = s_q + warp_id * head_dim;
+  for (int d = lane_id; d < head_dim; d += WARP_SIZE) {
+    q_row[d] = valid ? float(q[((size_t)batch_head * q_len + q_idx) * head_dim +
+                                d]) *
+                           scale
+                     : 0.f;
+  }
+
+  // keys after the diagonal of the last query of the block are not loaded,
+  // the rows of a ring are not ordered by position.
+  int diag = kv_len - q_len;
+  int block_last_q = min(q_len, (int)(blockIdx.y + 1) * kFlashWarps) - 1;
+  int kv_rows_len = ring_size ? min(kv_len, kv_size) : kv_len;
+  int block_kv_end = mask_future && !ring_size
+                         ? min(kv_len, block_last_q + diag + 1)
+                         : kv_rows_len;
+  int kv_end = mask_future ? min(kv_len, q_idx + diag + 1) : kv_len;
+  int q_pos = q_idx + diag;
+  int sink_len = kv_size - ring_size;
+  if (heavy_pos) {
+    heavy_pos += ((size_t)batch_idx * kv_head_num + kv_head) * sink_len;
+  }
+  // the row of the query in the tree mask, nullptr before the tree.
+  int tree_start = kv_len - tree_len;
+  if (tree_mask && q_pos >= tree_start) {
+    tree_mask +=
+        ((size_t)batch_idx * tree_len + q_pos - tree_start) * tree_len;
+  } else {
+    tree_mask = nullptr;
+  }
+
+  float acc[kFlashDimPerLane];
+  for (int i = 0; i < kFlashDimPerLane; i++) acc[i] = 0.f;
+  float row_max = CUDA_FLOAT_INF_NEG;
+  float row_sum = 0.f;
+  float dropout_scale = 1.f / (1.f - dropout_ratio);
+  unsigned long long key = ls_dropout_key(seed, rng_offset);
+  size_t score_row = ((size_t)batch_head * q_len + q_idx) * kv_len;
+
+  for (int tile_start = 0; tile_start < block_kv_end;
+       tile_start += kFlashTile) {
+    __syncthreads();
+    for (int i = threadIdx.x; i < kFlashTile * head_dim; i += blockDim.x) {
+      int row = i / head_dim, d = i % head_dim;
+      int pos = tile_start + row;
+      bool in_range = pos < block_kv_end;
+      float k_val = 0.f, v_val = 0.f;
+      if (in_range) {
+        size_t vec_idx =
+            kv_vec_idx(kv_rows, batch_idx, kv_head, kv_head_num, kv_size, pos);
+        k_val = float(k[vec_idx * head_dim + d]);
+        v_val = float(v[vec_idx * head_dim + d]);
+        if (k_scale) {
+          k_val *= k_scale[vec_idx];
+          v_val *= v_scale[vec_idx];
+        }
+      }
+      s_k[row * k_stride + d] = k_val;
+      s_v[row * head_dim + d] = v_val;
+    }
+    __syncthreads();
+    if (!valid) continue;
+
+    int slot = tile_start + lane_id;
+    int pos = kv_slot_pos(slot, kv_len, kv_size, ring_size, heavy_pos);
+    bool attend = slot < block_kv_end && pos < kv_end &&
+                  in_window(slot, pos, q_pos, sink_len, window) &&
+                  (!tree_mask || pos < tree_start ||
+                   tree_mask[pos - tree_start]);
+    float score = CUDA_FLOAT_INF_NEG;
+    if (attend) {
+      score = 0.f;
+      for (int d = 0; d < head_dim; d++) {
+        score += q_row[d] * s_k[lane_id * k_stride + d];
+      }
+      if (mask) score += float(mask[pos]);
+      if (pos_bias) score += float(pos_bias[pos - q_pos]);
+    }
+
+    float new_max = max(row_max, warpReduceMax(score));
+    float prob = attend ? __expf(score - new_max) : 0.f;
+    float correction = __expf(row_max - new_max);
+    row_sum = row_sum * correction + warpReduceSum(prob);
+    if (dropout_ratio > 0.f && attend) {
+      prob = flash_dropout_keep(key, score_row + pos, dropout_ratio)
+                 ? prob * dropout_scale
+                 : 0.f;
+    }
+    for (int i = 0; i < kFlashDimPerLane; i++) acc[i] *= correction;
+    for (int j = 0; j < kFlashTile; j++) {
+      float prob_j = __shfl_sync(WARP_REDUCE_MASK, prob, j);
+      if (prob_j == 0.f) continue;
+      for (int i = 0; i < kFlashDimPerLane; i++) {
+        int d = lane_id + i * WARP_SIZE;
+        if (d < head_dim) acc[i] += prob_j * s_v[j * head_dim + d];
+      }
+    }
+    row_max = new_max;
+  }
+
+  if (!valid) return;
+  float inv_sum = __fdividef(1.f, row_sum + 1e-6f);
+  if (lse && lane_id == 0) {
+    lse[(size_t)batch_head * q_len + q_idx] = row_max + __logf(row_sum);
+  }
+  size_t out_idx =
+      out_token_major
+          ? ((size_t)batch_idx * q_len + q_idx) * nhead + batch_head % nhead
+          : (size_t)batch_head * q_len + q_idx;
+  T *out_row = out + out_idx * head_dim;
+  for (int i = 0; i < kFlashDimPerLane; i++) {
+    int d = lane_id + i * WARP_SIZE;
+    if (d < head_dim) out_row[d] = T(acc[i] * inv_sum);
+  }
+}
+
+// Add the probabilities exp(score - max_score) * inv_sum of the scores of
+// the first kv_rows_len rows of a query to kv_mass of [batch_size *
+// kv_head_num, kv_size], at the row of its kv head, by the threads of the
+// block.
+__device__ __forceinline__ void accumulate_kv_mass(const float *scores,
+                                                   float *kv_mass,
+                                                   int kv_rows_len,
+                                                   float max_score,
+                                                   float inv_sum,
+                                                   int batch_kv_head,
+                                                   int kv_size) {
+  kv_mass += (size_t)batch_kv_head * kv_size;
+  for (int slot = threadIdx.x; slot < kv_rows_len; slot += blockDim.x) {
+    atomicAdd(kv_mass + slot, __expf(scores[slot] - max_score) * inv_sum);
+  }
+}
+
+/**
+@brief: ker_flash_decoding
+The single query case of ker_flash_attention, as in incremental decoding.
+There is only one query per (batch, head), so instead of staging keys the
+warps of the block split the keys among themselves: each warp scores one key
+at a time with its lanes spread over head_dim, which keeps the loads
+coalesced, and the partial softmax states of the warps are merged at the end.
+
+With a small batch, batch_size * nhead blocks leave most SMs idle on long
+contexts, so the keys are further split into num_splits chunks of
+split_size keys, one block each. Such a block writes its unnormalized state
+[max, sum, acc[head_dim]] to partial, which ker_flash_decoding_merge reduces.
+
+With kv_mass, the softmax also adds the attention probability of every key
+to the mass of its row, summed over the query heads of a kv head: the warps
+write the scores of their keys to scores, which are normalized once the
+softmax denominator is known, by this block without splits and by
+ker_flash_decoding_merge otherwise, see accumulate_kv_mass.
+
+@thread
+gridDim.x = batch_size * nhead
+gridDim.y = num_splits
+blockDim.x = kFlashWarps * WARP_SIZE
+
+@param
+the same as ker_flash_attention with q_len = 1
+partial: [batch_size * nhead, num_splits, head_dim + 2], used when
+  num_splits > 1
+scores: [batch_size * nhead, kv_size], the scores of the keys, used with
+  kv_mass
+kv_mass: [batch_size, kv_head_num, kv_size], the accumulated attention mass
+  of every row, nullptr for none
+*/
+template <typename T, typename CacheT>
+__global__ void ker_flash_decoding(const T *q, const CacheT *k,
+                                   const CacheT *v, const T *mask, T *out,
+                                   float *partial, int nhead, int kv_len,
+                                   int kv_size, int head_dim, float scale,
+                                   int split_size, int kv_head_num,
+                                   const float *k_scale, const float *v_scale,
+                                   const T *pos_bias, int pos_bias_len,
+                                   const int *kv_rows, int ring_size,
+                                   int window, int mask_size,
+                                   const int *heavy_pos, float *scores,
+                                   float *kv_mass) {
+  __shared__ float s_max[kFlashWarps];
+  __shared__ float s_sum[kFlashWarps];
+  extern __shared__ float s_flash[];
+  float *s_acc = s_flash;  // [kFlashWarps, head_dim]
+
+  int batch_head = blockIdx.x;
+  int warp_id = threadIdx.x / WARP_SIZE;
+  int lane_id = threadIdx.x % WARP_SIZE;
+  // the splits are of rows, which are the positions without a ring.
+  int kv_rows_len = ring_size ? min(kv_len, kv_size) : kv_len;
+  int kv_begin = blockIdx.y * split_size;
+  int kv_end = min(kv_rows_len, kv_begin + split_size);
+  int sink_len = kv_size - ring_size;
+
+  int batch_idx = batch_head / nhead;
+  int kv_head = (batch_head % nhead) / (nhead / kv_head_num);
+  q += (size_t)batch_head * head_dim;
+  if (mask) {
+    mask += batch_idx * (mask_size ? mask_size : kv_size);
+  }
+  // the query is at position kv_len - 1.
+  if (pos_bias) {
+    pos_bias += (batch_head % nhead) * (2 * pos_bias_len - 1) +
+                pos_bias_len - kv_len;
+  }
+  if (heavy_pos) {
+    heavy_pos += ((size_t)batch_idx * kv_head_num + kv_head) * sink_len;
+  }
+  if (kv_mass) scores += (size_t)batch_head * kv_size;
+
+  float q_val[kFlashDimPerLane];
+  float acc[kFlashDimPerLane];
+  for (int i = 0; i < kFlashDimPerLane; i++) {
+    int d = lane_id + i * WARP_SIZE;
+    q_val[i] = d < head_dim ? float(q[d]) * scale : 0.f;
+    acc[i] = 0.f;
+  }
+  float row_max = CUDA_FLOAT_INF_NEG;
+  float row_sum = 0.f;
+
+  for (int slot = kv_begin + warp_id; slot < kv_end; slot += kFlashWarps) {
+    int pos = kv_slot_pos(slot, kv_len, kv_size, ring_size, heavy_pos);
+    // the whole warp takes the same key.
+    if (!in_window(slot, pos, kv_len - 1, sink_len, window)) {
+      if (kv_mass && lane_id == 0) scores[slot] = CUDA_FLOAT_INF_NEG;
+      continue;
+    }
+    size_t vec_idx =
+        kv_vec_idx(kv_rows, batch_idx, kv_head, kv_head_num, kv_size, slot);
+    const CacheT *k_vec = k + vec_idx * head_dim;
+    const CacheT *v_vec = v + vec_idx * head_dim;
+    float score = 0.f;
+    for (int i = 0; i < kFlashDimPerLane; i++) {
+      int d = lane_id + i * WARP_SIZE;
+      if (d < head_dim) score += q_val[i] * float(k_vec[d]);
+    }
+    score = warpReduceSum(score);
+    if (k_scale) score *= k_scale[vec_idx];
+    if (mask) score += float(mask[pos]);
+    if (pos_bias) score += float(pos_bias[pos]);
+    if (kv_mass && lane_id == 0) scores[slot] = score;
+
+    float new_max = max(row_max, score);
+    float prob = __expf(score - new_max);
+    float correction = __expf(row_max - new_max);
+    row_sum = row_sum * correction + prob;
+    float v_prob = v_scale ? prob * v_scale[vec_idx] : prob;
+    for (int i = 0; i < kFlashDimPerLane; i++) {
+      int d = lane_id + i * WARP_SIZE;
+      acc[i] = acc[i] * correction +
+               (d < head_dim ? v_prob * float(v_vec[d]) : 0.f);
+    }
+    row_max = new_max;
+  }
+
+  // merge the partial states of the warps.
+  if (lane_id == 0) {
+    s_max[warp_id] = row_max;
+    s_sum[warp_id] = row_sum;
+  }
+  __syncthreads();
+  float block_max = CUDA_FLOAT_INF_NEG;
+  for (int w = 0; w < kFlashWarps; w++) block_max = max(block_max, s_max[w]);
+  float correction = s_sum[warp_id] > 0.f ? __expf(row_max - block_max) : 0.f;
+  for (int i = 0; i < kFlashDimPerLane; i++) {
+    int d = lane_id + i * WARP_SIZE;
+    if (d < head_dim) s_acc[warp_id * head_dim + d] = acc[i] * correction;
+  }
+  __syncthreads();
+
+  float block_sum = 0.f;
+  for (int w = 0; w < kFlashWarps; w++) {
+    if (s_sum[w] > 0.f) block_sum += s_sum[w] * __expf(s_max[w] - block_max);
+  }
+
+  if (gridDim.y > 1) {
+    float *partial_row =
+        partial + ((size_t)batch_head * gridDim.y + blockIdx.y) * (head_dim + 2);
+    if (threadIdx.x == 0) {
+      partial_row[0] = block_max;
+      partial_row[1] = block_sum;
+    }
+    for (int d = threadIdx.x; d < head_dim; d += blockDim.x) {
+      float res = 0.f;
+      for (int w = 0; w < kFlashWarps; w++) res += s_acc[w * head_dim + d];
+      partial_row[d + 2] = res;
+    }
+    return;
+  }
+
+  float inv_sum = __fdividef(1.f, block_sum + 1e-6f);
+  T *out_row = out + (size_t)batch_head * head_dim;
+  for (int d = threadIdx.x; d < head_dim; d += blockDim.x) {
+    float res = 0.f;
+    for (int w = 0; w < kFlashWarps; w++) res += s_acc[w * head_dim + d];
+    out_row[d] = T(res * inv_sum);
+  }
+  // the scores of the warps are visible after the __syncthreads above.
+  if (kv_mass) {
+    accumulate_kv_mass(scores, kv_mass, kv_end, block_max, inv_sum,
+                       batch_idx * kv_head_num + kv_head, kv_size);
+  }
+}
+
+/**
+@brief: ker_flash_decoding_merge
+Reduce the partial softmax states of the key splits of ker_flash_decoding,
+and add the attention mass of the kv_rows_len rows to kv_mass with the
+scores of ker_flash_decoding, see accumulate_kv_mass.
+
+@thread
+gridDim.x = batch_size * nhead
+blockDim.x = min(head_dim, MAX_THREADS)
+*/
+template <typename T>
+__global__ void ker_flash_decoding_merge(const float *partial, T *out,
+                                         int num_splits, int head_dim,
+                                         const float *scores, float *kv_mass,
+                                         int kv_rows_len, int kv_size,
+                                         int nhead, int kv_head_num) {
+  int batch_head = blockIdx.x;
+  partial += (size_t)batch_head * num_splits * (head_dim + 2);
+
+  float max_val = CUDA_FLOAT_INF_NEG;
+  for (int split = 0; split < num_splits; split++) {
+    const float *partial_row = partial + split * (head_dim + 2);
+    if (partial_row[1] > 0.f) max_val = max(max_val, partial_row[0]);
+  }
+  float sum_val = 0.f;
+  for (int split = 0; split < num_splits; split++) {
+    const float *partial_row = partial + split * (head_dim + 2);
+    if (partial_row[1] > 0.f) {
+      sum_val += partial_row[1] * __expf(partial_row[0] - max_val);
+    }
+  }
+  float inv_sum = __fdividef(1.f, sum_val + 1e-6f);
+
+  T *out_row = out + (size_t)batch_head * head_dim;
+  for (int d = threadIdx.x; d < head_dim; d += blockDim.x) {
+    float res = 0.f;
+    for (int split = 0; split < num_splits; split++) {
+      const float *partial_row = partial + split * (head_dim + 2);
+      if (partial_row[1] > 0.f) {
+        res += partial_row[d + 2] * __expf(partial_row[0] - max_val);
+      }
+    }
+    out_row[d] = T(res * inv_sum);
+  }
+  if (kv_mass) {
+    int batch_idx = batch_head / nhead;
+    int kv_head = (batch_head % nhead) / (nhead / kv_head_num);
+    accumulate_kv_mass(scores + (size_t)batch_head * kv_size, kv_mass,
+                       kv_rows_len, max_val, inv_sum,
+                       batch_idx * kv_head_num + kv_head, kv_size);
+  }
+}
+
+/**
+@brief: ker_flash_attention_mass
+The attention mass of the queries of a prefill, ker_flash_attention with
+several queries, which keeps the lse of every query rather than scores:
+every warp owns one key row and iterates the queries, recomputing their
+scores, and adds the sum of their probabilities exp(score - lse) to the
+mass of the row, summed over the query heads of a kv head.
+
+@thread
+gridDim.x = batch_size * nhead
+gridDim.y = ceil(min(kv_len, kv_size) / kFlashWarps)
+blockDim.x = kFlashWarps * WARP_SIZE
+
+@param
+the same as ker_flash_attention, without the tree mask and the kv rows
+lse: [batch_size, nhead, q_len], of ker_flash_attention
+kv_mass: [batch_size, kv_head_num, kv_size], see ker_flash_decoding
+*/
+template <typename T, typename CacheT>
+__global__ void ker_flash_attention_mass(const T *q, const CacheT *k,
+                                         const T *mask, const float *lse,
+                                         float *kv_mass, int nhead,
+                                         int q_len, int kv_len, int kv_size,
+                                         int head_dim, float scale,
+                                         bool mask_future, int kv_head_num,
+                                         const float *k_scale,
+                                         const T *pos_bias, int pos_bias_len,
+                                         int ring_size, int window,
+                                         int mask_size,
+                                         const int *heavy_pos) {
+  int batch_head = blockIdx.x;
+  int lane_id = threadIdx.x % WARP_SIZE;
+  int slot = blockIdx.y * kFlashWarps + threadIdx.x / WARP_SIZE;
+  int kv_rows_len = ring_size ? min(kv_len, kv_size) : kv_len;
+  if (slot >= kv_rows_len) return;
+
+  int batch_idx = batch_head / nhead;
+  int kv_head = (batch_head % nhead) / (nhead / kv_head_num);
+  int sink_len = kv_size - ring_size;
+  size_t batch_kv_head = (size_t)batch_idx * kv_head_num + kv_head;
+  if (heavy_pos) heavy_pos += batch_kv_head * sink_len;
+  int pos = kv_slot_pos(slot, kv_len, kv_size, ring_size, heavy_pos);
+  float bias = 0.f;
+  if (mask) {
+    bias = float(mask[batch_idx * (mask_size ? mask_size : kv_size) + pos]);
+  }
+  if (pos_bias) {
+    pos_bias += (batch_head % nhead) * (2 * pos_bias_len - 1) +
+                pos_bias_len - 1;
+  }
+
+  size_t vec_idx = batch_kv_head * kv_size + slot;
+  float k_val[kFlashDimPerLane];
+  for (int i = 0; i < kFlashDimPerLane; i++) {
+    int d = lane_id + i * WARP_SIZE;
+    k_val[i] = d < head_dim ? float(k[vec_idx * head_dim + d]) * scale : 0.f;
+    if (k_scale) k_val[i] *= k_scale[vec_idx];
+  }
+  q += (size_t)batch_head * q_len * head_dim;
+  lse += (size_t)batch_head * q_len;
+
+  int diag = kv_len - q_len;
+  float mass = 0.f;
+  // the whole warp takes the same query.
+  for (int q_idx = 0; q_idx < q_len; q_idx++) {
+    int q_pos = q_idx + diag;
+    if ((mask_future && pos > q_pos) ||
+        !in_window(slot, pos, q_pos, sink_len, window)) {
+      continue;
+    }
+    float score = 0.f;
+    for (int i = 0; i < kFlashDimPerLane; i++) {
+      int d = lane_id + i * WARP_SIZE;
+      if (d < head_dim) score += float(q[q_idx * head_dim + d]) * k_val[i];
+    }
+    score = warpReduceSum(score) + bias;
+    if (pos_bias) score += float(pos_bias[pos - q_pos]);
+    mass += __expf(score - lse[q_idx]);
+  }
+  if (lane_id == 0) atomicAdd(kv_mass + vec_idx, mass);
+}
+
+static int flash_decoding_splits(int batch_heads, int kv_len) {
+  static int num_sms = 0;
+  if (num_sms == 0) {
+    int device;
+    CHECK_GPU_ERROR(cudaGetDevice(&device));
+    CHECK_GPU_ERROR(cudaDeviceGetAttribute(
+        &num_sms, cudaDevAttrMultiProcessorCount, device));
+  }
+  // enough blocks to fill every SM twice, each split keeps at least
+  // kFlashMinSplitKeys keys to amortize the merge.
+  int num_splits = (2 * num_sms + batch_heads - 1) / batch_heads;
+  int max_splits = (kv_len + kFlashMinSplitKeys - 1) / kFlashMinSplitKeys;
+  num_splits = std::min(num_splits, max_splits);
+  num_splits = std::min(num_splits, kFlashMaxPartials / batch_heads);
+  return std::max(num_splits, 1);
+}
+
+template <typename T, typename CacheT>
+void launch_flash_attention(const T *q, const CacheT *k, const CacheT *v,
+                            const T *mask, T *out, int batch_size, int nhead,
+                            int q_len, int kv_len, int kv_size, int head_dim,
+                            bool mask_future, cudaStream_t stream,
+                            float *workspace, int kv_head_num,
+                            const float *k_scale, const float *v_scale,
+                            const T *pos_bias, int pos_bias_len,
+                            bool out_token_major, const int *kv_rows,
+                            int ring_size, int window, int mask_size,
+                            const unsigned char *tree_mask, int tree_len,
+                            const int *heavy_pos, float *kv_mass,
+                            float *mass_workspace) {
+  if (kv_head_num == 0) kv_head_num = nhead;
+  if (head_dim > kFlashAttnMaxHeadDim) {
+    throw std::runtime_error("flash attention supports head_dim <= " +
+                             std::to_string(kFlashAttnMaxHeadDim));
+  }
+  if (pos_bias && kv_len > pos_bias_len) {
+    throw std::runtime_error("flash attention position bias of length " +
+                             std::to_string(pos_bias_len) +
+                             " is too short for " + std::to_string(kv_len) +
+                             " keys");
+  }
+  if (kv_rows && ring_size) {
+    throw std::runtime_error("flash attention does not support kv rows of a "
+                             "kv ring");
+  }
+  if ((heavy_pos || kv_mass) && (ring_size == 0 || kv_rows)) {
+    throw std::runtime_error("flash attention keeps the heavy hitters of a "
+                             "kv ring without kv rows only");
+  }
+  if (tree_mask && (ring_size || tree_len > q_len || tree_len > kv_len)) {
+    throw std::runtime_error("flash attention tree of " +
+                             std::to_string(tree_len) +
+                             " tokens should be among the queries and "
+                             "outside a kv ring");
+  }
+  float scale = 1.f / sqrtf(float(head_dim));
+  if (q_len == 1) {
+    // a single query attends to every key, there is nothing to mask, a
+    // tree of one token included. Both
+    // layouts of out are the same. A ring reads at most kv_size keys, which
+    // keeps the cost of a step constant.
+    int batch_heads = batch_size * nhead;
+    int kv_rows_len = ring_size ? std::min(kv_len, kv_size) : kv_len;
+    int num_splits =
+        workspace ? flash_decoding_splits(batch_heads, kv_rows_len) : 1;
+    int split_size = (kv_rows_len + num_splits - 1) / num_splits;
+    num_splits = (kv_rows_len + split_size - 1) / split_size;
+    size_t smem_size = kFlashWarps * head_dim * sizeof(float);
+    dim3 grid_dim(batch_heads, num_splits);
+    ker_flash_decoding<T, CacheT>
+        <<<grid_dim, kFlashWarps * WARP_SIZE, smem_size, stream>>>(
+            q, k, v, mask, out, workspace, nhead, kv_len, kv_size, head_dim,
+            scale, split_size, kv_head_num, k_scale, v_scale, pos_bias,
+            pos_bias_len, kv_rows, ring_size, window, mask_size, heavy_pos,
+            mass_workspace, kv_mass);
+    if (num_splits > 1) {
+      ker_flash_decoding_merge<T>
+          <<<batch_heads, std::min(head_dim, MAX_THREADS), 0, stream>>>(
+              workspace, out, num_splits, head_dim, mass_workspace, kv_mass,
+              kv_rows_len, kv_size, nhead, kv_head_num);
+    }
+    return;
+  }
+  size_t smem_size =
+      (kFlashTile * (2 * head_dim + 1) + kFlashWarps * head_dim) *
+      sizeof(float);
+  flash_smem_opt_in(ker_flash_attention<T, CacheT>, smem_size, head_dim);
+  dim3 grid_dim(batch_size * nhead, (q_len + kFlashWarps - 1) / kFlashWarps);
+  ker_flash_attention<T, CacheT>
+      <<<grid_dim, kFlashWarps * WARP_SIZE, smem_size, stream>>>(
+          q, k, v, mask, out, nhead, q_len, kv_len, kv_size, head_dim, scale,
+          mask_future, kv_head_num, k_scale, v_scale, pos_bias,
+          pos_bias_len, out_token_major, kv_rows, ring_size, window,
+          mask_size, heavy_pos, tree_mask, tree_len,
+          kv_mass ? mass_workspace : nullptr, 0.f, 0, nullptr);
+  if (kv_mass) {
+    // the lse of every query in mass_workspace.
+    int kv_rows_len = std::min(kv_len, kv_size);
+    dim3 mass_grid_dim(batch_size * nhead,
+                       (kv_rows_len + kFlashWarps - 1) / kFlashWarps);
+    ker_flash_attention_mass<T, CacheT>
+        <<<mass_grid_dim, kFlashWarps * WARP_SIZE, 0, stream>>>(
+            q, k, mask, mass_workspace, kv_mass, nhead, q_len, kv_len,
+            kv_size, head_dim, scale, mask_future, kv_head_num, k_scale,
+            pos_bias, pos_bias_len, ring_size, window, mask_size, heavy_pos);
+  }
+}
+
+template void launch_flash_attention<float, float>(
+    const float *q, const float *k, const float *v, const float *mask,
+    float *out, int batch_size, int nhead, int q_len, int kv_len, int kv_size,
+    int head_dim, bool mask_future, cudaStream_t stream, float *workspace,
+    int kv_head_num, const float *k_scale, const float *v_scale,
+    const float *pos_bias, int pos_bias_len, bool out_token_major,
+    const int *kv_rows, int ring_size, int window, int mask_size,
+    const unsigned char *tree_mask, int tree_len, const int *heavy_pos,
+    float *kv_mass, float *mass_workspace);
+
+template void launch_flash_attention<float, int8_t>(
+    const float *q, const int8_t *k, const int8_t *v, const float *mask,
+    float *out, int batch_size, int nhead, int q_len, int kv_len, int kv_size,
+    int head_dim, bool mask_future, cudaStream_t stream, float *workspace,
+    int kv_head_num, const float *k_scale, const float *v_scale,
+    const float *pos_bias, int pos_bias_len, bool out_token_major,
+    const int *kv_rows, int ring_size, int window, int mask_size,
+    const unsigned char *tree_mask, int tree_len, const int *heavy_pos,
+    float *kv_mass, float *mass_workspace);
+
+template void launch_flash_attention<__half, __half>(
+    const __half *q, const __half *k, const __half *v, const __half *mask,
+    __half *out, int batch_size, int nhead, int q_len, int kv_len, int kv_size,
+    int head_dim, bool mask_future, cudaStream_t stream, float *workspace,
+    int kv_head_num, const float *k_scale, const float *v_scale,
+    const __half *pos_bias, int pos_bias_len, bool out_token_major,
+    const int *kv_rows, int ring_size, int window, int mask_size,
+    const unsigned char *tree_mask, int tree_len, const int *heavy_pos,
+    float *kv_mass, float *mass_workspace);
+
+template void launch_flash_attention<__half, int8_t>(
+    const __half *q, const int8_t *k, const int8_t *v, const __half *mask,
+    __half *out, int batch_size, int nhead, int q_len, int kv_len, int kv_size,
+    int head_dim, bool mask_future, cudaStream_t stream, float *workspace,
+    int kv_head_num, const float *k_scale, const float *v_scale,
+    const __half *pos_bias, int pos_bias_len, bool out_token_major,
+    const int *kv_rows, int ring_size, int window, int mask_size,
+    const unsigned char *tree_mask, int tree_len, const int *heavy_pos,
+    float *kv_mass, float *mass_workspace);
+
+template void launch_flash_attention<__nv_bfloat16, __nv_bfloat16>(
+    const __nv_bfloat16 *q, const __nv_bfloat16 *k, const __nv_bfloat16 *v,
+    const __nv_bfloat16 *mask, __nv_bfloat16 *out, int batch_size, int nhead,
+    int q_len, int kv_len, int kv_size, int head_dim, bool mask_future,
+    cudaStream_t stream, float *workspace, int kv_head_num,
+    const float *k_scale, const float *v_scale, const __nv_bfloat16 *pos_bias,
+    int pos_bias_len, bool out_token_major, const int *kv_rows, int ring_size,
+    int window, int mask_size, const unsigned char *tree_mask, int tree_len,
+    const int *heavy_pos, float *kv_mass, float *mass_workspace);
+
+template void launch_flash_attention<__nv_bfloat16, int8_t>(
+    const __nv_bfloat16 *q, const int8_t *k, const int8_t *v,
+    const __nv_bfloat16 *mask, __nv_bfloat16 *out, int batch_size, int nhead,
+    int q_len, int kv_len, int kv_size, int head_dim, bool mask_future,
+    cudaStream_t stream, float *workspace, int kv_head_num,
+    const float *k_scale, const float *v_scale, const __nv_bfloat16 *pos_bias,
+    int pos_bias_len, bool out_token_major, const int *kv_rows, int ring_size,
+    int window, int mask_size, const unsigned char *tree_mask, int tree_len,
+    const int *heavy_pos, float *kv_mass, float *mass_workspace);
+
+// threads of ker_evict_heavy_hitters, a power of 2.
+const int kEvictThreads = 256;
+
+/**
+@brief: ker_evict_heavy_hitters
+Heavy-hitter retention of a kv ring, after the attention of num_evict
+queries: the keys those queries pushed out of the window are evicted in
+turn, but a key of more attention mass than the least heavy hitter of the
+sink rows first takes its row, with its value, scales, position and mass. The
+heavy hitters thus stay the sink_len keys of the most mass outside the
+window, in place. The mass of the ring row of an evicted key starts over for
+the key which is written there next.
+
+@thread
+gridDim.x = batch_size * kv_head_num
+blockDim.x = kEvictThreads
+
+@param
+k, v: [batch_size, kv_head_num, kv_size, head_dim], the kv ring
+k_scale, v_scale: [batch_size, kv_head_num, kv_size], of an int8 ring,
+  nullptr otherwise
+heavy_pos: [batch_size, kv_head_num, sink_len], see kv_slot_pos
+kv_mass: [batch_size, kv_head_num, kv_size], see ker_flash_decoding
+kv_len: the positions after the attention
+*/
+template <typename CacheT>
+__global__ void ker_evict_heavy_hitters(CacheT *k, CacheT *v, float *k_scale,
+                                        float *v_scale, int *heavy_pos,
+                                        float *kv_mass, int kv_len,
+                                        int num_evict, int kv_size,
+                                        int ring_size, int window,
+                                        int head_dim) {
+  __shared__ float s_mass[kEvictThreads];
+  __shared__ int s_slot[kEvictThreads];
+  int sink_len = kv_size - ring_size;
+  size_t vec_begin = (size_t)blockIdx.x * kv_size;
+  heavy_pos += (size_t)blockIdx.x * sink_len;
+  kv_mass += vec_begin;
+
+  for (int i = 0; i < num_evict; i++) {
+    // the query at kv_len - num_evict + i no longer sees it.
+    int pos = kv_len - num_evict - window + 1 + i;
+    if (pos < sink_len) continue;
+    int slot = sink_len + (pos - sink_len) % ring_size;
+
+    // the least heavy hitter.
+    float min_mass = CUDA_FLOAT_INF_POS;
+    int min_slot = -1;
+    for (int s = threadIdx.x; s < sink_len; s += blockDim.x) {
+      if (kv_mass[s] < min_mass) min_mass = kv_mass[s], min_slot = s;
+    }
+    s_mass[threadIdx.x] = min_mass;
+    s_slot[threadIdx.x] = min_slot;
+    __syncthreads();
+    for (int stride = blockDim.x / 2; stride > 0; stride /= 2) {
+      if (threadIdx.x < stride &&
+          s_mass[threadIdx.x + stride] < s_mass[threadIdx.x]) {
+        s_mass[threadIdx.x] = s_mass[threadIdx.x + stride];
+        s_slot[threadIdx.x] = s_slot[threadIdx.x + stride];
+      }
+      __syncthreads();
+    }
+    int heavy = s_slot[0];
+    float evict_mass = kv_mass[slot];
+    if (heavy >= 0 && evict_mass > s_mass[0]) {
+      size_t src = (vec_begin + slot) * head_dim;
+      size_t dst = (vec_begin + heavy) * head_dim;
+      for (int d = threadIdx.x; d < head_dim; d += blockDim.x) {
+        k[dst + d] = k[src + d];
+        v[dst + d] = v[src + d];
+      }
+      if (threadIdx.x == 0) {
+        if (k_scale) {
+          k_scale[vec_begin + heavy] = k_scale[vec_begin + slot];
+          v_scale[vec_begin + heavy] = v_scale[vec_begin + slot];
+        }
+        heavy_pos[heavy] = pos;
+        kv_mass[heavy] = evict_mass;
+      }
+    }
+    __syncthreads();
+    if (threadIdx.x == 0) kv_mass[slot] = 0.f;
+    __syncthreads();
+  }
+}
+
+template <typename CacheT>
+void launch_evict_heavy_hitters(CacheT *k, CacheT *v, float *k_scale,
+                                float *v_scale, int *heavy_pos,
+                                float *kv_mass, int batch_size,
+                                int kv_head_num, int kv_len, int num_evict,
+                                int kv_size, int ring_size, int window,
+                                int head_dim, cudaStream_t stream) {
+  // nothing left the window past the sinks yet.
+  if (kv_len - window < kv_size - ring_size) return;
+  ker_evict_heavy_hitters<CacheT>
+      <<<batch_size * kv_head_num, kEvictThreads, 0, stream>>>(
+          k, v, k_scale, v_scale, heavy_pos, kv_mass, kv_len, num_evict,
+          kv_size, ring_size, window, head_dim);
+}
+
+template void launch_evict_heavy_hitters<float>(
+    float *k, float *v, float *k_scale, float *v_scale, int *heavy_pos,
+    float *kv_mass, int batch_size, int kv_head_num, int kv_len,
+    int num_evict, int kv_size, int ring_size, int window, int head_dim,
+    cudaStream_t stream);
+template void launch_evict_heavy_hitters<__half>(
+    __half *k, __half *v, float *k_scale, float *v_scale, int *heavy_pos,
+    float *kv_mass, int batch_size, int kv_head_num, int kv_len,
+    int num_evict, int kv_size, int ring_size, int window, int head_dim,
+    cudaStream_t stream);
+template void launch_evict_heavy_hitters<__nv_bfloat16>(
+    __nv_bfloat16 *k, __nv_bfloat16 *v, float *k_scale, float *v_scale,
+    int *heavy_pos, float *kv_mass, int batch_size, int kv_head_num,
+    int kv_len, int num_evict, int kv_size, int ring_size, int window,
+    int head_dim, cudaStream_t stream);
+template void launch_evict_heavy_hitters<int8_t>(
+    int8_t *k, int8_t *v, float *k_scale, float *v_scale, int *heavy_pos,
+    float *kv_mass, int batch_size, int kv_head_num, int kv_len,
+    int num_evict, int kv_size, int ring_size, int window, int head_dim,
+    cudaStream_t stream);
+
+template <typename T>
+void launch_flash_attention_train(const T *q, const T *k, const T *v,
+                                  const T *mask, T *out, float *lse,
+                                  int batch_size, int nhead, int q_len,
+                                  int kv_len, int head_dim, bool mask_future,
+                                  float dropout_ratio, int seed,
+                                  cudaStream_t stream,
+                                  const unsigned long long *rng_offset) {
+  if (head_dim > kFlashAttnBwMaxHeadDim) {
+    throw std::runtime_error("flash attention of training supports head_dim "
+                             "<= " +
+                             std::to_string(kFlashAttnBwMaxHeadDim));
+  }
+  float scale = 1.f / sqrtf(float(head_dim));
+  size_t smem_size =
+      (kFlashTile * (2 * head_dim + 1) + kFlashWarps * head_dim) *
+      sizeof(float);
+  flash_smem_opt_in(ker_flash_attention<T, T>, smem_size, head_dim);
+  dim3 grid_dim(batch_size * nhead, (q_len + kFlashWarps - 1) / kFlashWarps);
+  ker_flash_attention<T, T>
+      <<<grid_dim, kFlashWarps * WARP_SIZE, smem_size, stream>>>(
+          q, k, v, mask, out, nhead, q_len, kv_len, kv_len, head_dim, scale,
+          mask_future, nhead, nullptr, nullptr, nullptr, 0, false, nullptr, 0,
+          0, 0, nullptr, nullptr, 0, lse, dropout_ratio, seed, rng_offset);
+}
+
+template void launch_flash_attention_train<float>(
+    const float *q, const float *k, const float *v, const float *mask,
+    float *out, float *lse, int batch_size, int nhead, int q_len, int kv_len,
+    int head_dim, bool mask_future, float dropout_ratio, int seed,
+    cudaStream_t stream, const unsigned long long *rng_offset);
+template void launch_flash_attention_train<__half>(
+    const __half *q, const __half *k, const __half *v, const __half *mask,
+    __half *out, float *lse, int batch_size, int nhead, int q_len, int kv_len,
+    int head_dim, bool mask_future, float dropout_ratio, int seed,
+    cudaStream_t stream, const unsigned long long *rng_offset);
+template void launch_flash_attention_train<__nv_bfloat16>(
+    const __nv_bfloat16 *q, const __nv_bfloat16 *k, const __nv_bfloat16 *v,
+    const __nv_bfloat16 *mask, __nv_bfloat16 *out, float *lse,
+    int batch_size, int nhead, int q_len, int kv_len, int head_dim,
+    bool mask_future, float dropout_ratio, int seed, cudaStream_t stream,
+    const unsigned long long *rng_offset);
+
+/**
+@brief: ker_flash_attention_bw_dot
+The softmax backward term of every query, dot = sum(dout * out) over
+head_dim, which is sum_j(p_j * dp_j) with the dropout applied.
+
+@thread
+gridDim.x = ceil(rows / kFlashWarps)
+blockDim.x = kFlashWarps * WARP_SIZE
+
+@param
+dot: [rows]
+dout, out: [rows, head_dim], rows = batch_size * nhead * q_len
+*/
+template <typename T>
+__global__ void ker_flash_attention_bw_dot(float *dot, const T *dout,
+                                           const T *out, int rows,
+                                           int head_dim) {
+  int row = blockIdx.x * kFlashWarps + threadIdx.x / WARP_SIZE;
+  int lane_id = threadIdx.x % WARP_SIZE;
+  if (row >= rows) return;
+  float sum = 0.f;
+  for (int d = lane_id; d < head_dim; d += WARP_SIZE) {
+    size_t idx = (size_t)row * head_dim + d;
+    sum += float(dout[idx]) * float(out[idx]);
+  }
+  sum = warpReduceSum(sum);
+  if (lane_id == 0) dot[row] = sum;
+}
+
+/**
+@brief: ker_flash_attention_bw
+The backward of ker_flash_attention, which recomputes the probabilities
+p = exp(q * k^T * scale + mask - lse) tile by tile from the lse of the
+forward instead of reading a stored [q_len, kv_len] matrix, in the two
+passes of the FlashAttention-2 backward without atomics:
+  kTransposed, every warp owns one key j and iterates the queries i,
+    dv_j = sum_i(dropout(p_ij) * dout_i)
+    dk_j = sum_i(ds_ij * q_i) * scale
+  !kTransposed, every warp owns one query i and iterates the keys j,
+    dq_i = sum_j(ds_ij * k_j) * scale
+with ds_ij = p_ij * (dropout(dout_i * v_j) - dot_i). The tiles of kFlashTile
+rows of the other side are staged in shared memory, lane l scores row l.
+
+@thread
+gridDim.x = batch_size * nhead
+gridDim.y = ceil(kv_len / kFlashWarps) if kTransposed else
+  ceil(q_len / kFlashWarps)
+blockDim.x = kFlashWarps * WARP_SIZE
+
+@param
+dq: [batch_size, nhead, q_len, head_dim], !kTransposed only
+dk, dv: [batch_size, nhead, kv_len, head_dim], kTransposed only
+dout, q: [batch_size, nhead, q_len, head_dim]
+k, v: [batch_size, nhead, kv_len, head_dim]
+mask, mask_future, dropout_ratio, seed, rng_offset: the ones of the forward
+lse, dot: [batch_size, nhead, q_len]
+*/
+template <typename T, bool kTransposed>
+__global__ void ker_flash_attention_bw(T *dq, T *dk, T *dv, const T *dout,
+                                       const T *q, const T *k, const T *v,
+                                       const T *mask, const float *lse,
+                                       const float *dot, int nhead, int q_len,
+                                       int kv_len, int head_dim, float scale,
+                                       bool mask_future, float dropout_ratio,
+                                       int seed,
+                                       const unsigned long long *rng_offset) {
+  extern __shared__ float s_flash[];
+  int stride = head_dim + 1;
+  // the tile of the other side, q and dout, or k and v.
+  float *s_a = s_flash;                     // [kFlashTile, head_dim + 1]
+  float *s_b = s_a + kFlashTile * stride;   // [kFlashTile, head_dim + 1]
+  float *s_own = s_b + kFlashTile * stride; // [kFlashWarps, 2, head_dim]
+  float *s_tile = s_own + kFlashWarps * 2 * head_dim;  // [2, kFlashTile]
+
+  int batch_head = blockIdx.x;
+  int warp_id = threadIdx.x / WARP_SIZE;
+  int lane_id = threadIdx.x % WARP_SIZE;
+  int own_len = kTransposed ? kv_len : q_len;
+  int other_len = kTransposed ? q_len : kv_len;
+  int own_idx = blockIdx.y * kFlashWarps + warp_id;
+  bool valid = own_idx < own_len;
+  int diag = kv_len - q_len;
+  if (mask) mask += (batch_head / nhead) * kv_len;
+  float dropout_scale = 1.f / (1.f - dropout_ratio);
+  unsigned long long key = ls_dropout_key(seed, rng_offset);
+  const float *bh_lse = lse + (size_t)batch_head * q_len;
+  const float *bh_dot = dot + (size_t)batch_head * q_len;
+
+  // the own rows, k and v, or q and dout, q is scaled as in the forward.
+  const T *own_a = kTransposed ? k : q;
+  const T *own_b = kTransposed ? v : dout;
+  float *own_row_a = s_own + warp_id * 2 * head_dim;
+  float *own_row_b = own_row_a + head_dim;
+  size_t own_offset = ((size_t)batch_head * own_len + own_idx) * head_dim;
+  for (int d = lane_id; d < head_dim; d += WARP_SIZE) {
+    float a = valid ? float(own_a[own_offset + d]) : 0.f;
+    own_row_a[d] = kTransposed ? a : a * scale;
+    own_row_b[d] = valid ? float(own_b[own_offset + d]) : 0.f;
+  }
+  float own_lse = 0.f, own_dot = 0.f;
+  if (!kTransposed && valid) {
+    own_lse = bh_lse[own_idx];
+    own_dot = bh_dot[own_idx];
+  }
+
+  // with mask_future, query i only sees the keys up to i + diag.
+  int block_first = blockIdx.y * kFlashWarps;
+  int block_last = min(own_len, block_first + kFlashWarps) - 1;
+  int other_start = 0, other_end = other_len;
+  if (mask_future) {
+    if (kTransposed) {
+      other_start = max(0, block_first - diag) / kFlashTile * kFlashTile;
+    } else {
+      other_end = min(kv_len, block_last + diag + 1);
+    }
+  }
+
+  float acc_a[kFlashDimPerLane], acc_b[kFlashDimPerLane];
+  for (int i = 0; i < kFlashDimPerLane; i++) acc_a[i] = acc_b[i] = 0.f;
+
+  const T *other_a = kTransposed ? q : k;
+  const T *other_b = kTransposed ? dout : v;
+  for (int tile_start = other_start; tile_start < other_end;
+       tile_start += kFlashTile) {
+    __syncthreads();
+    for (int i = threadIdx.x; i < kFlashTile * head_dim; i += blockDim.x) {
+      int row = i / head_dim, d = i % head_dim;
+      int pos = tile_start + row;
+      float a = 0.f, b = 0.f;
+      if (pos < other_end) {
+        size_t idx = ((size_t)batch_head * other_len + pos) * head_dim + d;
+        a = float(other_a[idx]);
+        b = float(other_b[idx]);
+      }
+      s_a[row * stride + d] = kTransposed ? a * scale : a;
+      s_b[row * stride + d] = b;
+    }
+    if (kTransposed && threadIdx.x < kFlashTile) {
+      int pos = tile_start + threadIdx.x;
+      s_tile[threadIdx.x] = pos < other_end ? bh_lse[pos] : 0.f;
+      s_tile[kFlashTile + threadIdx.x] = pos < other_end ? bh_dot[pos] : 0.f;
+    }
+    __syncthreads();
+    if (!valid) continue;
+
+    int other_idx = tile_start + lane_id;
+    int q_idx = kTransposed ? other_idx : own_idx;
+    int k_idx = kTransposed ? own_idx : other_idx;
+    bool attend =
+        other_idx < other_end && (!mask_future || k_idx <= q_idx + diag);
+    float prob = 0.f, dprob = 0.f, ds = 0.f;
+    if (attend) {
+      float score = 0.f, dp = 0.f;
+      // q * k and dout * v, whichever side is staged.
+      for (int d = 0; d < head_dim; d++) {
+        score += own_row_a[d] * s_a[lane_id * stride + d];
+        dp += own_row_b[d] * s_b[lane_id * stride + d];
+      }
+      if (mask) score += float(mask[k_idx]);
+      float row_lse = kTransposed ? s_tile[lane_id] : own_lse;
+      float row_dot = kTransposed ? s_tile[kFlashTile + lane_id] : own_dot;
+      prob = __expf(score - row_lse);
+      dprob = prob;
+      if (dropout_ratio > 0.f) {
+        bool keep = flash_dropout_keep(
+            key, ((size_t)batch_head * q_len + q_idx) * kv_len + k_idx,
+            dropout_ratio);
+        dprob = keep ? prob * dropout_scale : 0.f;
+        dp = keep ? dp * dropout_scale : 0.f;
+      }
+      ds = prob * (dp - row_dot);
+    }
+
+    for (int j = 0; j < kFlashTile; j++) {
+      float ds_j = __shfl_sync(WARP_REDUCE_MASK, ds, j);
+      float dprob_j = __shfl_sync(WARP_REDUCE_MASK, dprob, j);
+      for (int i = 0; i < kFlashDimPerLane; i++) {
+        int d = lane_id + i * WARP_SIZE;
+        if (d >= head_dim) continue;
+        // dk from the scaled q and dv from dout, or dq from k.
+        acc_a[i] += ds_j * s_a[j * stride + d];
+        if (kTransposed) acc_b[i] += dprob_j * s_b[j * stride + d];
+      }
+    }
+  }
+
+  if (!valid) return;
+  for (int i = 0; i < kFlashDimPerLane; i++) {
+    int d = lane_id + i * WARP_SIZE;
+    if (d >= head_dim) continue;
+    if (kTransposed) {
+      dk[own_offset + d] = T(acc_a[i]);
+      dv[own_offset + d] = T(acc_b[i]);
+    } else {
+      dq[own_offset + d] = T(acc_a[i] * scale);
+    }
+  }
+}
+
+template <typename T>
+void launch_flash_attention_bw(T *dq, T *dk, T *dv, const T *dout,
+                               const T *q, const T *k, const T *v,
+                               const T *mask, const T *out, const float *lse,
+                               float *workspace, int batch_size, int nhead,
+                               int q_len, int kv_len, int head_dim,
+                               bool mask_future, float dropout_ratio,
+                               int seed, cudaStream_t stream,
+                               const unsigned long long *rng_offset) {
+  if (head_dim > kFlashAttnBwMaxHeadDim) {
+    throw std::runtime_error("flash attention of training supports head_dim "
+                             "<= " +
+                             std::to_string(kFlashAttnBwMaxHeadDim));
+  }
+  float scale = 1.f / sqrtf(float(head_dim));
+  int rows = batch_size * nhead * q_len;
+  ker_flash_attention_bw_dot<T>
+      <<<(rows + kFlashWarps - 1) / kFlashWarps, kFlashWarps * WARP_SIZE, 0,
+         stream>>>(workspace, dout, out, rows, head_dim);
+
+  size_t smem_size = (kFlashTile * 2 * (head_dim + 1) +
+                      kFlashWarps * 2 * head_dim + 2 * kFlashTile) *
+                     sizeof(float);
+  flash_smem_opt_in(ker_flash_attention_bw<T, true>, smem_size, head_dim);
+  flash_smem_opt_in(ker_flash_attention_bw<T, false>, smem_size, head_dim);
+  dim3 kv_grid(batch_size * nhead, (kv_len + kFlashWarps - 1) / kFlashWarps);
+  ker_flash_attention_bw<T, true>
+      <<<kv_grid, kFlashWarps * WARP_SIZE, smem_size, stream>>>(
+          dq, dk, dv, dout, q, k, v, mask, lse, workspace, nhead, q_len,
+          kv_len, head_dim, scale, mask_future, dropout_ratio, seed,
+          rng_offset);
+  dim3 q_grid(batch_size * nhead, (q_len + kFlashWarps - 1) / kFlashWarps);
+  ker_flash_attention_bw<T, false>
+      <<<q_grid, kFlashWarps * WARP_SIZE, smem_size, stream>>>(
+          dq, dk, dv, dout, q, k, v, mask, lse, workspace, nhead, q_len,
+          kv_len, head_dim, scale, mask_future, dropout_ratio, seed,
+          rng_offset);
+}
+
+template void launch_flash_attention_bw<float>(
+    float *dq, float *dk, float *dv, const float *dout, const float *q,
+    const float *k, const float *v, const float *mask, const float *out,
+    const float *lse, float *workspace, int batch_size, int nhead, int q_len,
+    int kv_len, int head_dim, bool mask_future, float dropout_ratio, int seed,
+    cudaStream_t stream, const unsigned long long *rng_offset);
+template void launch_flash_attention_bw<__half>(
+    __half *dq, __half *dk, __half *dv, const __half *dout, const __half *q,
+    const __half *k, const __half *v, const __half *mask, const __half *out,
+    const float *lse, float *workspace, int batch_size, int nhead, int q_len,
+    int kv_len, int head_dim, bool mask_future, float dropout_ratio, int seed,
+    cudaStream_t stream, const unsigned long long *rng_offset);
+template void launch_flash_attention_bw<__nv_bfloat16>(
+    __nv_bfloat16 *dq, __nv_bfloat16 *dk, __nv_bfloat16 *dv,
+    const __nv_bfloat16 *dout, const __nv_bfloat16 *q,
+    const __nv_bfloat16 *k, const __nv_bfloat16 *v,
+    const __nv_bfloat16 *mask, const __nv_bfloat16 *out, const float *lse,
+    float *workspace, int batch_size, int nhead, int q_len, int kv_len,
+    int head_dim, bool mask_future, float dropout_ratio, int seed,
+    cudaStream_t stream, const unsigned long long *rng_offset);
+
+/**
+@brief: ker_varlen_flash_attention
+ker_flash_attention of an encoder over packed sequences without padding.
+The sequence b is the tokens [cu_seqlens[b], cu_seqlens[b + 1]) of qkv, its
+queries attend to its own keys only, so no mask is needed. The qkv bias is
+added and the heads are split while q, k, v are read, and the output is
+written token-major, which leaves nothing to transform around the kernel.
+
+@thread
+gridDim.x = batch_size * nhead
+gridDim.y = ceil(max_seq_len / kFlashWarps)
+blockDim.x = kFlashWarps * WARP_SIZE
+
+@param
+qkv: [valid_tokens, 3, nhead, head_dim]
+qkv_bias: [3, nhead, head_dim]
+out: [valid_tokens, nhead, head_dim]
+cu_seqlens: [batch_size + 1]
+*/
+template <typename T>
+__global__ void ker_varlen_flash_attention(const T *qkv, const T *qkv_bias,
+                                           T *out, const int *cu_seqlens,
+                                           int nhead, int head_dim,
+                                           float scale) {
+  extern __shared__ float s_flash[];
+  int k_stride = head_dim + 1;
+  float *s_k = s_flash;                      // [kFlashTile, head_dim + 1]
+  float *s_v = s_k + kFlashTile * k_stride;  // [kFlashTile, head_dim]
+  float *s_q = s_v + kFlashTile * head_dim;  // [kFlashWarps, head_dim]
+
+  int batch_idx = blockIdx.x / nhead, head_idx = blockIdx.x % nhead;
+  int seq_begin = cu_seqlens[batch_idx];
+  int seq_len = cu_seqlens[batch_idx + 1] - seq_begin;
+  if (blockIdx.y * kFlashWarps >= seq_len) return;
+  int warp_id = threadIdx.x / WARP_SIZE;
+  int lane_id = threadIdx.x % WARP_SIZE;
+  int q_idx = blockIdx.y * kFlashWarps + warp_id;
+  bool valid = q_idx < seq_len;
+
+  int hidden_dim = nhead * head_dim;
+  size_t row_stride = 3 * hidden_dim;
+  const T *seq_qkv =
+      qkv + (size_t)seq_begin * row_stride + head_idx * head_dim;
+  const T *q_bias = qkv_bias + head_idx * head_dim;
+  const T *k_bias = q_bias + hidden_dim;
+  const T *v_bias = k_bias + hidden_dim;
+
+  float *q_row = s_q + warp_id * head_dim;
+  for (int d = lane_id; d < head_dim; d += WARP_SIZE) {
+    q_row[d] =
+        valid ? (float(seq_qkv[q_idx * row_stride + d]) + float(q_bias[d])) *
+                    scale
+              : 0.f;
+  }
+
+  float acc[kFlashDimPerLane];
+  for (int i = 0; i < kFlashDimPerLane; i++) acc[i] = 0.f;
+  float row_max = CUDA_FLOAT_INF_NEG;
+  float row_sum = 0.f;
+
+  for (int tile_start = 0; tile_start < seq_len; tile_start += kFlashTile) {
+    __syncthreads();
+    for (int i = threadIdx.x; i < kFlashTile * head_dim; i += blockDim.x) {
+      int row = i / head_dim, d = i % head_dim;
+      int pos = tile_start + row;
+      float k_val = 0.f, v_val = 0.f;
+      if (pos < seq_len) {
+        const T *kv_row = seq_qkv + pos * row_stride + hidden_dim + d;
+        k_val = float(kv_row[0]) + float(k_bias[d]);
+        v_val = float(kv_row[hidden_dim]) + float(v_bias[d]);
+      }
+      s_k[row * k_stride + d] = k_val;
+      s_v[row * head_dim + d] = v_val;
+    }
+    __syncthreads();
+    if (!valid) continue;
+
+    bool attend = tile_start + lane_id < seq_len;
+    float score = CUDA_FLOAT_INF_NEG;
+    if (attend) {
+      score = 0.f;
+      for (int d = 0; d < head_dim; d++) {
+        score += q_row[d] * s_k[lane_id * k_stride + d];
+      }
+    }
+
+    float new_max = max(row_max, warpReduceMax(score));
+    float prob = attend ? __expf(score - new_max) : 0.f;
+    float correction = __expf(row_max - new_max);
+    row_sum = row_sum * correction + warpReduceSum(prob);
+    for (int i = 0; i < kFlashDimPerLane; i++) acc[i] *= correction;
+    for (int j = 0; j < kFlashTile; j++) {
+      float prob_j = __shfl_sync(WARP_REDUCE_MASK, prob, j);
+      if (prob_j == 0.f) continue;
+      for (int i = 0; i < kFlashDimPerLane; i++) {
+        int d = lane_id + i * WARP_SIZE;
+        if (d < head_dim) acc[i] += prob_j * s_v[j * head_dim + d];
+      }
+    }
+    row_max = new_max;
+  }
+
+  if (!valid) return;
+  float inv_sum = __fdividef(1.f, row_sum + 1e-6f);
+  T *out_row = out + (size_t)(seq_begin + q_idx) * hidden_dim +
+               head_idx * head_dim;
+  for (int i = 0; i < kFlashDimPerLane; i++) {
+    int d = lane_id + i * WARP_SIZE;
+    if (d < head_dim) out_row[d] = T(acc[i] * inv_sum);
+  }
+}
+
+template <typename T>
+void launch_varlen_flash_attention(const T *qkv, const T *qkv_bias, T *out,
+                                   const int *cu_seqlens, int batch_size,
+                                   int nhead, int max_seq_len, int head_dim,
+                                   cudaStream_t stream) {
+  if (head_dim > kFlashAttnMaxHeadDim) {
+    throw std::runtime_error("flash attention supports head_dim <= " +
+                             std::to_string(kFlashAttnMaxHeadDim));
+  }
+  float scale = 1.f / sqrtf(float(head_dim));
+  size_t smem_size =
+      (kFlashTile * (2 * head_dim + 1) + kFlashWarps * head_dim) *
+      sizeof(float);
+  flash_smem_opt_in(ker_varlen_flash_attention<T>, smem_size, head_dim);
+  dim3 grid_dim(batch_size * nhead,
+                (max_seq_len + kFlashWarps - 1) / kFlashWarps);
+  ker_varlen_flash_attention<T>
+      <<<grid_dim, kFlashWarps * WARP_SIZE, smem_size, stream>>>(
+          qkv, qkv_bias, out, cu_seqlens, nhead, head_dim, scale);
+}
+
+template void launch_varlen_flash_attention<float>(
+    const float *qkv, const float *qkv_bias, float *out,
+    const int *cu_seqlens, int batch_size, int nhead, int max_seq_len,
+    int head_dim, cudaStream_t stream);
+template void launch_varlen_flash_attention<__half>(
+    const __half *qkv, const __half *qkv_bias, __half *out,
+    const int *cu_seqlens, int batch_size, int nhead, int max_seq_len,
+    int head_dim, cudaStream_t stream);
+template void launch_varlen_flash_attention<__nv_bfloat16>(
+    const __nv_bfloat16 *qkv, const __nv_bfloat16 *qkv_bias,
+    __nv_bfloat16 *out, const int *cu_seqlens, int batch_size, int nhead,
+    int max_seq_len, int head_dim, cudaStream_t stream);
+
+/**
+@brief: ker_block_sparse_attention
+ker_varlen_flash_attention over a block layout of the keys instead of the
+whole sequence. The queries of a block of block_size tokens attend to the
+keys of the blocks of its layout row only, eg. a local window, the global
+blocks and random ones, which keeps the attention of long sequences linear in
+their length. The 4 queries of a thread block are in one query block since
+block_size is a multiple of kFlashTile.
+
+@thread
+gridDim.x = batch_size * nhead
+gridDim.y = ceil(seq_len / kFlashWarps)
+blockDim.x = kFlashWarps * WARP_SIZE
+
+@param
+qkv: [batch_size, seq_len, 3, nhead, head_dim]
+qkv_bias: [3, nhead, head_dim]
+mask: [batch_size, seq_len], added to the scores, nullptr for none
+out: [batch_size, seq_len, nhead, head_dim]
+layout_offsets: [ceil(seq_len / block_size) + 1]
+layout_blocks: [layout_offsets[ceil(seq_len / block_size)]], the key blocks
+  of every query block
+*/
+template <typename T>
+__global__ void ker_block_sparse_attention(
+    const T *qkv, const T *qkv_bias, const T *mask, T *out,
+    const int *layout_offsets, const int *layout_blocks, int seq_len,
+    int nhead, int head_dim, int block_size, float scale) {
+  extern __shared__ float s_flash[];
+  int k_stride = head_dim + 1;
+  float *s_k = s_flash;                      // [kFlashTile, head_dim + 1]
+  float *s_v = s_k + kFlashTile * k_stride;  // [kFlashTile, head_dim]
+  float *s_q = s_v + kFlashTile * head_dim;  // [kFlashWarps, head_dim]
+  float *s_mask = s_q + kFlashWarps * head_dim;  // [kFlashTile]
+
+  int batch_idx = blockIdx.x / nhead, head_idx = blockIdx.x % nhead;
+  int warp_id = threadIdx.x / WARP_SIZE;
+  int lane_id = threadIdx.x % WARP_SIZE;
+  int q_idx = blockIdx.y * kFlashWarps + warp_id;
+  bool valid = q_idx < seq_len;
+  int q_block = blockIdx.y * kFlashWarps / block_size;
+
+  int hidden_dim = nhead * head_dim;
+  size_t row_stride = 3 * hidden_dim;
+  const T *seq_qkv = qkv + (size_t)batch_idx * seq_len * row_stride +
+                     head_idx * head_dim;
+  const T *seq_mask = mask ? mask + (size_t)batch_idx * seq_len : nullptr;
+  const T *q_bias = qkv_bias + head_idx * head_dim;
+  const T *k_bias = q_bias + hidden_dim;
+  const T *v_bias = k_bias + hidden_dim;
+
+  float *q_row = s_q + warp_id * head_dim;
+  for (int d = lane_id; d < head_dim; d += WARP_SIZE) {
+    q_row[d] =
+        valid ? (float(seq_qkv[q_idx * row_stride + d]) + float(q_bias[d])) *
+                    scale
+              : 0.f;
+  }
+
+  float acc[kFlashDimPerLane];
+  for (int i = 0; i < kFlashDimPerLane; i++) acc[i] = 0.f;
+  float row_max = CUDA_FLOAT_INF_NEG;
+  float row_sum = 0.f;
+
+  for (int b = layout_offsets[q_block]; b < layout_offsets[q_block + 1];
+       b++) {
+    int block_start = layout_blocks[b] * block_size;
+    int block_end = min(block_start + block_size, seq_len);
+    for (int tile_start = block_start; tile_start < block_end;
+         tile_start += kFlashTile) {
+      __syncthreads();
+      for (int i = threadIdx.x; i < kFlashTile * head_dim; i += blockDim.x) {
+        int row = i / head_dim, d = i % head_dim;
+        int pos = tile_start + row;
+        float k_val = 0.f, v_val = 0.f;
+        if (pos < block_end) {
+          const T *kv_row = seq_qkv + pos * row_stride + hidden_dim + d;
+          k_val = float(kv_row[0]) + float(k_bias[d]);
+          v_val = float(kv_row[hidden_dim]) + float(v_bias[d]);
+        }
+        s_k[row * k_stride + d] = k_val;
+        s_v[row * head_dim + d] = v_val;
+      }
+      if (threadIdx.x < kFlashTile) {
+        int pos = tile_start + threadIdx.x;
+        s_mask[threadIdx.x] =
+            seq_mask && pos < block_end ? float(seq_mask[pos]) : 0.f;
+      }
+      __syncthreads();
+      if (!valid) continue;
+
+      bool attend = tile_start + lane_id < block_end;
+      float score = CUDA_FLOAT_INF_NEG;
+      if (attend) {
+        score = s_mask[lane_id];
+        for (int d = 0; d < head_dim; d++) {
+          score += q_row[d] * s_k[lane_id * k_stride + d];
+        }
+      }
+
+      float new_max = max(row_max, warpReduceMax(score));
+      float prob = attend ? __expf(score - new_max) : 0.f;
+      float correction = __expf(row_max - new_max);
+      row_sum = row_sum * correction + warpReduceSum(prob);
+      for (int i = 0; i < kFlashDimPerLane; i++) acc[i] *= correction;
+      for (int j = 0; j < kFlashTile; j++) {
+        float prob_j = __shfl_sync(WARP_REDUCE_MASK, prob, j);
+        if (prob_j == 0.f) continue;
+        for (int i = 0; i < kFlashDimPerLane; i++) {
+          int d = lane_id + i * WARP_SIZE;
+          if (d < head_dim) acc[i] += prob_j * s_v[j * head_dim + d];
+        }
+      }
+      row_max = new_max;
+    }
+  }
+
+  if (!valid) return;
+  float inv_sum = __fdividef(1.f, row_sum + 1e-6f);
+  T *out_row = out + ((size_t)batch_idx * seq_len + q_idx) * hidden_dim +
+               head_idx * head_dim;
+  for (int i = 0; i < kFlashDimPerLane; i++) {
+    int d = lane_id + i * WARP_SIZE;
+    if (d < head_dim) out_row[d] = T(acc[i] * inv_sum);
+  }
+}
+
+template <typename T>
+void launch_block_sparse_attention(const T *qkv, const T *qkv_bias,
+                                   const T *mask, T *out,
+                                   const int *layout_offsets,
+                                   const int *layout_blocks, int batch_size,
+                                   int nhead, int seq_len, int head_dim,
+                                   int block_size, cudaStream_t stream) {
+  if (head_dim > kFlashAttnMaxHeadDim) {
+    throw std::runtime_error("flash attention supports head_dim <= " +
+                             std::to_string(kFlashAttnMaxHeadDim));
+  }
+  if (block_size % kFlashTile != 0) {
+    throw std::runtime_error(
+        "block sparse attention supports block_size of a multiple of " +
+        std::to_string(kFlashTile));
+  }
+  float scale = 1.f / sqrtf(float(head_dim));
+  size_t smem_size =
+      (kFlashTile * (2 * head_dim + 2) + kFlashWarps * head_dim) *
+      sizeof(float);
+  flash_smem_opt_in(ker_block_sparse_attention<T>, smem_size, head_dim);
+  dim3 grid_dim(batch_size * nhead, (seq_len + kFlashWarps - 1) / kFlashWarps);
+  ker_block_sparse_attention<T>
+      <<<grid_dim, kFlashWarps * WARP_SIZE, smem_size, stream>>>(
+          qkv, qkv_bias, mask, out, layout_offsets, layout_blocks, seq_len,
+          nhead, head_dim, block_size, scale);
+}
+
+template void launch_block_sparse_attention<float>(
+    const float *qkv, const float *qkv_bias, const float *mask, float *out,
+    const int *layout_offsets, const int *layout_blocks, int batch_size,
+    int nhead, int seq_len, int head_dim, int block_size, cudaStream_t stream);
+template void launch_block_sparse_attention<__half>(
+    const __half *qkv, const __half *qkv_bias, const __half *mask,
+    __half *out, const int *layout_offsets, const int *layout_blocks,
+    int batch_size, int nhead, int seq_len, int head_dim, int block_size,
+    cudaStream_t stream);
+template void launch_block_sparse_attention<__nv_bfloat16>(
+    const __nv_bfloat16 *qkv, const __nv_bfloat16 *qkv_bias,
+    const __nv_bfloat16 *mask, __nv_bfloat16 *out, const int *layout_offsets,
+    const int *layout_blocks, int batch_size, int nhead, int seq_len,
+    int head_dim, int block_size, cudaStream_t stream);
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -4,6 +4,7 @@
 */
 #include <cuda.h>
 #include <cuda_runtime.h>
+#include <curand_kernel.h>
 #include <stdio.h>
 
 #include <cmath>
@@ -14,6 +15,7 @@
 #include "ATen/cuda/CUDAContext.h"
 #include "ATen/cuda/detail/IndexUtils.cuh"
 #include "ATen/cuda/Exceptions.h"
+#include "block_reduce.h"
 #include "fused_adam_kernel.h"
 #include "multi_tensor_apply.cuh"
 
@@ -254,5 +256,531 @@ void apex_fused_adam_cuda(at::Tensor& p, at::Tensor& p_copy, at::Tensor& m,
   }
   AT_CUDA_CHECK(cudaGetLastError());
 }
+
+/*
+Adam of the sparse rows of launch_d_lookup_scale_pos_dropout_sparse, one
+block per row: only the num_rows rows in rows of the [*, row_dim] params and
+moments are updated. The moments of a row are lazily decayed: when last_step
+is given, a row last updated at step s has its moments multiplied by
+b1^(step - s - 1) and b2^(step - s - 1) first, the decay of the steps it got
+no grad, as in a dense Adam with zero grads but without its updates.
+*/
+template <typename GRAD_T>
+__global__ void sparse_adam_cuda_kernel(
+    float* __restrict__ p, GRAD_T* __restrict__ p_copy, float* __restrict__ m,
+    float* __restrict__ v, const int* __restrict__ rows,
+    const int* __restrict__ num_rows, const GRAD_T* __restrict__ g,
+    int* __restrict__ last_step, const float b1, const float b2,
+    const float eps, const float grad_scale, const float step_size,
+    const int step, const int row_dim, adamMode_t mode, const float decay) {
+  if (blockIdx.x >= num_rows[0]) return;
+  size_t row = rows[blockIdx.x];
+  float m_decay = 1.f, v_decay = 1.f;
+  if (last_step != nullptr) {
+    int skipped = step - last_step[row] - 1;
+    if (skipped > 0) {
+      m_decay = powf(b1, skipped);
+      v_decay = powf(b2, skipped);
+    }
+    __syncthreads();
+    if (threadIdx.x == 0) last_step[row] = step;
+  }
+  const GRAD_T* g_row = g + size_t(blockIdx.x) * row_dim;
+  size_t offset = row * row_dim;
+  for (int i = threadIdx.x; i < row_dim; i += blockDim.x) {
+    size_t j = offset + i;
+    float scaled_grad = static_cast<float>(g_row[i]) / grad_scale;
+    float mj = b1 * m_decay * m[j] + (1 - b1) * scaled_grad;
+    float vj = b2 * v_decay * v[j] + (1 - b2) * scaled_grad * scaled_grad;
+    float denom = mode == ADAM_MODE_0 ? sqrtf(vj + eps) : sqrtf(vj) + eps;
+    float pj = p[j] - step_size * (mj / denom + decay * p[j]);
+    m[j] = mj;
+    v[j] = vj;
+    p[j] = pj;
+    if (p_copy != nullptr) p_copy[j] = static_cast<GRAD_T>(pj);
+  }
+}
+
+void sparse_adam_cuda(at::Tensor& p, at::Tensor& p_copy, at::Tensor& m,
+                      at::Tensor& v, at::Tensor& rows, at::Tensor& num_rows,
+                      at::Tensor& g, at::Tensor& last_step, float lr,
+                      float beta1, float beta2, float eps, float grad_scale,
+                      int step, int mode, int bias_correction, float decay) {
+  float step_size = lr;
+  if (bias_correction == 1) {
+    const float bias_correction1 = 1 - std::pow(beta1, step);
+    const float bias_correction2 = 1 - std::pow(beta2, step);
+    step_size = lr * std::sqrt(bias_correction2) / bias_correction1;
+  }
+  int max_rows = rows.numel();
+  if (max_rows == 0) return;
+  int row_dim = g.size(1);
+  int block_dim = std::min(row_dim, 1024);
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+
+  using namespace at;
+  DISPATCH_FLOAT_AND_HALF(
+      g.scalar_type(), 0, "sparse_adam_cuda_kernel",
+      sparse_adam_cuda_kernel<scalar_t_0><<<max_rows, block_dim, 0, stream>>>(
+          p.DATA_PTR<float>(),
+          p_copy.numel() ? p_copy.DATA_PTR<scalar_t_0>() : nullptr,
+          m.DATA_PTR<float>(), v.DATA_PTR<float>(), rows.DATA_PTR<int>(),
+          num_rows.DATA_PTR<int>(), g.DATA_PTR<scalar_t_0>(),
+          last_step.numel() ? last_step.DATA_PTR<int>() : nullptr, beta1,
+          beta2, eps, grad_scale, step_size, step, row_dim, (adamMode_t)mode,
+          decay););
+  AT_CUDA_CHECK(cudaGetLastError());
+}
+
+/*
+The multi tensor optimizers, every launch updates up to
+depth_to_max_tensors tensors, see multi_tensor_apply.cuh. The tensor lists
+are the grads, the fp32 params, exp_avg, exp_avg_sq and, for mixed precision
+training, the fp16 copy of the params. The grads are divided by grad_scale
+and their global norm, grad_norm computed by multi_tensor_grad_norm_cuda, is
+clipped to max_grad_norm on device, so there is no host sync in the step.
+Nothing is updated once noop_flag is set by inf or nan grads.
+*/
+const int kMultiTensorBlockSize = 512;
+const int kMultiTensorChunkSize = 2048 * 32;
+
+// the same as LSAdam, grad_norm is the norm of the scaled grads.
+__device__ __forceinline__ float combined_grad_scale(const float* grad_norm,
+                                                     float grad_scale,
+                                                     float max_grad_norm) {
+  if (max_grad_norm <= 0.f) return grad_scale;
+  float clip = (*grad_norm / grad_scale + 1e-6f) / max_grad_norm;
+  return clip > 1.f ? clip * grad_scale : grad_scale;
+}
+
+template <typename GRAD_T>
+struct GradNormFunctor {
+  __device__ __forceinline__ void operator()(int chunk_size,
+                                             volatile int* noop_flag,
+                                             TensorListMetadata<1>& tl,
+                                             float* norm_sq) {
+    int tensor_loc = tl.block_to_tensor[blockIdx.x];
+    int offset = tl.block_to_chunk[blockIdx.x] * chunk_size;
+    int n = min(tl.sizes[tensor_loc] - offset, chunk_size);
+    const GRAD_T* g = (const GRAD_T*)tl.addresses[0][tensor_loc] + offset;
+
+    float sum = 0.f;
+    for (int i = threadIdx.x; i < n; i += blockDim.x) {
+      float gi = static_cast<float>(g[i]);
+      sum += gi * gi;
+    }
+    blockReduce<ReduceType::kSum, 1>(&sum);
+    if (threadIdx.x == 0) {
+      // the sum of inf or nan grads is not finite.
+      if (!isfinite(sum)) *noop_flag = 1;
+      atomicAdd(norm_sq, sum);
+    }
+  }
+};
+
+// Adam with the decoupled weight decay of AdamW.
+template <int DEPTH, typename GRAD_T>
+struct AdamWFunctor {
+  __device__ __forceinline__ void operator()(
+      int chunk_size, volatile int* noop_flag, TensorListMetadata<DEPTH>& tl,
+      const float* grad_norm, float b1, float b2, float eps, float grad_scale,
+      float max_grad_norm, float lr, float step_size, adamMode_t mode,
+      float decay) {
+    if (*noop_flag == 1) return;
+    int tensor_loc = tl.block_to_tensor[blockIdx.x];
+    int offset = tl.block_to_chunk[blockIdx.x] * chunk_size;
+    int n = min(tl.sizes[tensor_loc] - offset, chunk_size);
+    const GRAD_T* g = (const GRAD_T*)tl.addresses[0][tensor_loc] + offset;
+    float* p = (float*)tl.addresses[1][tensor_loc] + offset;
+    float* m = (float*)tl.addresses[2][tensor_loc] + offset;
+    float* v = (float*)tl.addresses[3][tensor_loc] + offset;
+    GRAD_T* p_copy =
+        DEPTH == 5 ? (GRAD_T*)tl.addresses[DEPTH - 1][tensor_loc] + offset
+                   : nullptr;
+
+    float scale = combined_grad_scale(grad_norm, grad_scale, max_grad_norm);
+    for (int i = threadIdx.x; i < n; i += blockDim.x) {
+      float scaled_grad = static_cast<float>(g[i]) / scale;
+      float mi = b1 * m[i] + (1 - b1) * scaled_grad;
+      float vi = b2 * v[i] + (1 - b2) * scaled_grad * scaled_grad;
+      float denom = mode == ADAM_MODE_0 ? sqrtf(vi + eps) : sqrtf(vi) + eps;
+      float pi = p[i] * (1 - lr * decay) - step_size * mi / denom;
+      m[i] = mi;
+      v[i] = vi;
+      p[i] = pi;
+      if (DEPTH == 5) p_copy[i] = static_cast<GRAD_T>(pi);
+    }
+  }
+};
+
+// bias corrected adam update with L2 weight decay, the update of LAMB.
+__device__ __forceinline__ float lamb_update(float p, float m, float v,
+                                             float bias_correction1,
+                                             float bias_correction2,
+                                             float eps, adamMode_t mode,
+                                             float decay) {
+  float m_hat = m / bias_correction1;
+  float v_hat = v / bias_correction2;
+  float denom = mode == ADAM_MODE_0 ? sqrtf(v_hat + eps) : sqrtf(v_hat) + eps;
+  return m_hat / denom + decay * p;
+}
+
+// Updates exp_avg and exp_avg_sq, accumulates the squared norms of the params
+// and of their updates, for the trust ratios of every tensor.
+template <int DEPTH, typename GRAD_T>
+struct LambStage1Functor {
+  __device__ __forceinline__ void operator()(
+      int chunk_size, volatile int* noop_flag, TensorListMetadata<DEPTH>& tl,
+      const float* grad_norm, float b1, float b2, float eps, float grad_scale,
+      float max_grad_norm, float bias_correction1, float bias_correction2,
+      adamMode_t mode, float decay, float* param_norm_sq,
+      float* update_norm_sq) {
+    if (*noop_flag == 1) return;
+    int tensor_loc = tl.block_to_tensor[blockIdx.x];
+    int offset = tl.block_to_chunk[blockIdx.x] * chunk_size;
+    int n = min(tl.sizes[tensor_loc] - offset, chunk_size);
+    const GRAD_T* g = (const GRAD_T*)tl.addresses[0][tensor_loc] + offset;
+    const float* p = (const float*)tl.addresses[1][tensor_loc] + offset;
+    float* m = (float*)tl.addresses[2][tensor_loc] + offset;
+    float* v = (float*)tl.addresses[3][tensor_loc] + offset;
+
+    float scale = combined_grad_scale(grad_norm, grad_scale, max_grad_norm);
+    float norms[2] = {0.f, 0.f};
+    for (int i = threadIdx.x; i < n; i += blockDim.x) {
+      float scaled_grad = static_cast<float>(g[i]) / scale;
+      float mi = b1 * m[i] + (1 - b1) * scaled_grad;
+      float vi = b2 * v[i] + (1 - b2) * scaled_grad * scaled_grad;
+      m[i] = mi;
+      v[i] = vi;
+      float update = lamb_update(p[i], mi, vi, bias_correction1,
+                                 bias_correction2, eps, mode, decay);
+      norms[0] += p[i] * p[i];
+      norms[1] += update * update;
+    }
+    blockReduce<ReduceType::kSum, 2>(norms);
+    if (threadIdx.x == 0) {
+      int tensor_idx = tl.start_tensor_this_launch + tensor_loc;
+      atomicAdd(param_norm_sq + tensor_idx, norms[0]);
+      atomicAdd(update_norm_sq + tensor_idx, norms[1]);
+    }
+  }
+};
+
+// Applies the update scaled by the trust ratio ||p|| / ||update||, the update
+// is recomputed from exp_avg and exp_avg_sq instead of being stored.
+template <int DEPTH, typename GRAD_T>
+struct LambStage2Functor {
+  __device__ __forceinline__ void operator()(
+      int chunk_size, volatile int* noop_flag, TensorListMetadata<DEPTH>& tl,
+      float lr, float eps, float bias_correction1, float bias_correction2,
+      adamMode_t mode, float decay, const float* param_norm_sq,
+      const float* update_norm_sq) {
+    if (*noop_flag == 1) return;
+    int tensor_loc = tl.block_to_tensor[blockIdx.x];
+    int offset = tl.block_to_chunk[blockIdx.x] * chunk_size;
+    int n = min(tl.sizes[tensor_loc] - offset, chunk_size);
+    float* p = (float*)tl.addresses[1][tensor_loc] + offset;
+    const float* m = (const float*)tl.addresses[2][tensor_loc] + offset;
+    const float* v = (const float*)tl.addresses[3][tensor_loc] + offset;
+    GRAD_T* p_copy =
+        DEPTH == 5 ? (GRAD_T*)tl.addresses[DEPTH - 1][tensor_loc] + offset
+                   : nullptr;
+
+    int tensor_idx = tl.start_tensor_this_launch + tensor_loc;
+    float param_norm = sqrtf(param_norm_sq[tensor_idx]);
+    float update_norm = sqrtf(update_norm_sq[tensor_idx]);
+    float step_size = (param_norm > 0.f && update_norm > 0.f)
+                          ? lr * param_norm / update_norm
+                          : lr;
+    for (int i = threadIdx.x; i < n; i += blockDim.x) {
+      float update = lamb_update(p[i], m[i], v[i], bias_correction1,
+                                 bias_correction2, eps, mode, decay);
+      float pi = p[i] - step_size * update;
+      p[i] = pi;
+      if (DEPTH == 5) p_copy[i] = static_cast<GRAD_T>(pi);
+    }
+  }
+};
+
+/*
+The bf16 AdamW of multi_tensor_adamw_bf16_cuda, the params are bf16 without
+fp32 master weights and are updated in place with stochastic rounding. The
+moments are fp32, or 8 bit and blockwise quantized: kBf16StateBlock of them
+share the fp32 absmax of the block, and the codes are companded to keep the
+small moments of a block, exp_avg is scale * sign * (q / 127)^2 of an int8 q
+and exp_avg_sq scale * (q / 255)^4 of a uint8 q.
+*/
+const int kBf16StateBlock = 256;
+
+__device__ __forceinline__ float dequant_exp_avg(int8_t q, float scale) {
+  float r = q / 127.f;
+  return scale * r * fabsf(r);
+}
+
+__device__ __forceinline__ int8_t quant_exp_avg(float m, float scale) {
+  if (scale <= 0.f) return 0;
+  float q = fminf(rintf(127.f * sqrtf(fabsf(m) / scale)), 127.f);
+  return int8_t(copysignf(q, m));
+}
+
+__device__ __forceinline__ float dequant_exp_avg_sq(uint8_t q, float scale) {
+  float r = q / 255.f;
+  r *= r;
+  return scale * r * r;
+}
+
+__device__ __forceinline__ uint8_t quant_exp_avg_sq(float v, float scale) {
+  if (scale <= 0.f) return 0;
+  return uint8_t(fminf(rintf(255.f * sqrtf(sqrtf(v / scale))), 255.f));
+}
+
+// The dropped 16 bits round the magnitude up with their probability, so that
+// the updates smaller than the bf16 ulp of a param add up in expectation
+// instead of being rounded away.
+__device__ __forceinline__ uint16_t stochastic_round_bf16(float x,
+                                                          uint32_t rand) {
+  if (isnan(x)) return 0x7fc0;
+  uint32_t bits = __float_as_uint(x) + (rand & 0xffff);
+  return uint16_t(bits >> 16);
+}
+
+__device__ __forceinline__ uint16_t adamw_bf16_param(
+    uint16_t p, float m, float v, float eps, float lr, float step_size,
+    adamMode_t mode, float decay, uint32_t rand) {
+  float denom = mode == ADAM_MODE_0 ? sqrtf(v + eps) : sqrtf(v) + eps;
+  float pi = __uint_as_float(uint32_t(p) << 16) * (1 - lr * decay) -
+             step_size * m / denom;
+  return stochastic_round_bf16(pi, rand);
+}
+
+// blockDim.x is kBf16StateBlock if QUANT, every pass of the block updates one
+// quantization block of the moments.
+template <typename GRAD_T, bool QUANT>
+struct AdamWBf16Functor {
+  __device__ __forceinline__ void operator()(
+      int chunk_size, volatile int* noop_flag, TensorListMetadata<4>& tl,
+      const float* grad_norm, float b1, float b2, float eps, float grad_scale,
+      float max_grad_norm, float lr, float step_size, adamMode_t mode,
+      float decay, uint64_t seed, float* const* exp_avg_scales,
+      float* const* exp_avg_sq_scales) {
+    if (*noop_flag == 1) return;
+    int tensor_loc = tl.block_to_tensor[blockIdx.x];
+    int offset = tl.block_to_chunk[blockIdx.x] * chunk_size;
+    int n = min(tl.sizes[tensor_loc] - offset, chunk_size);
+    int tensor_idx = tl.start_tensor_this_launch + tensor_loc;
+    const GRAD_T* g = (const GRAD_T*)tl.addresses[0][tensor_loc] + offset;
+    uint16_t* p = (uint16_t*)tl.addresses[1][tensor_loc] + offset;
+
+    // one random sequence per element of the first pass of the block.
+    curandStatePhilox4_32_10_t state;
+    curand_init(seed, (uint64_t(tensor_idx) << 32) + offset + threadIdx.x, 0,
+                &state);
+    float scale = combined_grad_scale(grad_norm, grad_scale, max_grad_norm);
+    if (!QUANT) {
+      float* m = (float*)tl.addresses[2][tensor_loc] + offset;
+      float* v = (float*)tl.addresses[3][tensor_loc] + offset;
+      for (int i = threadIdx.x; i < n; i += blockDim.x) {
+        float scaled_grad = static_cast<float>(g[i]) / scale;
+        float mi = b1 * m[i] + (1 - b1) * scaled_grad;
+        float vi = b2 * v[i] + (1 - b2) * scaled_grad * scaled_grad;
+        m[i] = mi;
+        v[i] = vi;
+        p[i] = adamw_bf16_param(p[i], mi, vi, eps, lr, step_size, mode, decay,
+                                curand(&state));
+      }
+      return;
+    }
+
+    int8_t* m = (int8_t*)tl.addresses[2][tensor_loc] + offset;
+    uint8_t* v = (uint8_t*)tl.addresses[3][tensor_loc] + offset;
+    float* m_scales = exp_avg_scales[tensor_idx] + offset / kBf16StateBlock;
+    float* v_scales =
+        exp_avg_sq_scales[tensor_idx] + offset / kBf16StateBlock;
+    __shared__ float s_scales[2];
+    for (int base = 0; base < n; base += blockDim.x) {
+      int i = base + threadIdx.x;
+      int block = base / blockDim.x;
+      float mi = 0.f, vi = 0.f;
+      if (i < n) {
+        float scaled_grad = static_cast<float>(g[i]) / scale;
+        mi = b1 * dequant_exp_avg(m[i], m_scales[block]) +
+             (1 - b1) * scaled_grad;
+        vi = b2 * dequant_exp_avg_sq(v[i], v_scales[block]) +
+             (1 - b2) * scaled_grad * scaled_grad;
+        p[i] = adamw_bf16_param(p[i], mi, vi, eps, lr, step_size, mode, decay,
+                                curand(&state));
+      }
+      // the new scales of the block, both reductions share the shared memory
+      // of blockReduce.
+      float absmax = fabsf(mi);
+      blockReduce<ReduceType::kMax, 1>(&absmax);
+      if (threadIdx.x == 0) s_scales[0] = absmax;
+      __syncthreads();
+      absmax = vi;
+      blockReduce<ReduceType::kMax, 1>(&absmax);
+      if (threadIdx.x == 0) s_scales[1] = absmax;
+      __syncthreads();
+      if (i < n) {
+        m[i] = quant_exp_avg(mi, s_scales[0]);
+        v[i] = quant_exp_avg_sq(vi, s_scales[1]);
+      }
+      if (threadIdx.x == 0) {
+        m_scales[block] = s_scales[0];
+        v_scales[block] = s_scales[1];
+      }
+    }
+  }
+};
+
+at::Tensor multi_tensor_grad_norm_cuda(at::Tensor& noop_flag,
+                                       std::vector<at::Tensor>& grads) {
+  auto norm = at::zeros({1}, grads[0].options().dtype(at::kFloat));
+  using namespace at;
+  DISPATCH_FLOAT_HALF_AND_BFLOAT16(
+      grads[0].scalar_type(), 0, "multi_tensor_grad_norm_cuda",
+      multi_tensor_apply<1>(kMultiTensorBlockSize, kMultiTensorChunkSize,
+                            noop_flag, {grads}, GradNormFunctor<scalar_t_0>(),
+                            norm.DATA_PTR<float>()););
+  AT_CUDA_CHECK(cudaGetLastError());
+  return norm.sqrt_();
+}
+
+void multi_tensor_adamw_cuda(
+    at::Tensor& noop_flag, std::vector<std::vector<at::Tensor>>& tensor_lists,
+    at::Tensor& grad_norm, float lr, float beta1, float beta2, float eps,
+    float grad_scale, float max_grad_norm, int step, int mode,
+    int bias_correction, float decay) {
+  float step_size = lr;
+  if (bias_correction == 1) {
+    const float bias_correction1 = 1 - std::pow(beta1, step);
+    const float bias_correction2 = 1 - std::pow(beta2, step);
+    step_size = lr * std::sqrt(bias_correction2) / bias_correction1;
+  }
+  const float* grad_norm_ptr = grad_norm.DATA_PTR<float>();
+
+  using namespace at;
+  if (tensor_lists.size() == 5) {
+    DISPATCH_FLOAT_AND_HALF(
+        tensor_lists[0][0].scalar_type(), 0, "multi_tensor_adamw_cuda",
+        multi_tensor_apply<5>(kMultiTensorBlockSize, kMultiTensorChunkSize,
+                              noop_flag, tensor_lists,
+                              AdamWFunctor<5, scalar_t_0>(), grad_norm_ptr,
+                              beta1, beta2, eps, grad_scale, max_grad_norm, lr,
+                              step_size, (adamMode_t)mode, decay););
+  } else {
+    DISPATCH_FLOAT_AND_HALF(
+        tensor_lists[0][0].scalar_type(), 0, "multi_tensor_adamw_cuda",
+        multi_tensor_apply<4>(kMultiTensorBlockSize, kMultiTensorChunkSize,
+                              noop_flag, tensor_lists,
+                              AdamWFunctor<4, scalar_t_0>(), grad_norm_ptr,
+                              beta1, beta2, eps, grad_scale, max_grad_norm, lr,
+                              step_size, (adamMode_t)mode, decay););
+  }
+  AT_CUDA_CHECK(cudaGetLastError());
+}
+
+template <int DEPTH>
+void multi_tensor_lamb_launch(
+    at::Tensor& noop_flag, std::vector<std::vector<at::Tensor>>& tensor_lists,
+    const float* grad_norm, float lr, float beta1, float beta2, float eps,
+    float grad_scale, float max_grad_norm, float bias_correction1,
+    float bias_correction2, adamMode_t mode, float decay) {
+  int num_tensors = tensor_lists[0].size();
+  auto norms = at::zeros({2 * num_tensors}, tensor_lists[1][0].options());
+  float* param_norm_sq = norms.DATA_PTR<float>();
+  float* update_norm_sq = param_norm_sq + num_tensors;
+
+  using namespace at;
+  DISPATCH_FLOAT_AND_HALF(
+      tensor_lists[0][0].scalar_type(), 0, "multi_tensor_lamb_cuda",
+      multi_tensor_apply<DEPTH>(
+          kMultiTensorBlockSize, kMultiTensorChunkSize, noop_flag,
+          tensor_lists, LambStage1Functor<DEPTH, scalar_t_0>(), grad_norm,
+          beta1, beta2, eps, grad_scale, max_grad_norm, bias_correction1,
+          bias_correction2, mode, decay, param_norm_sq, update_norm_sq);
+      multi_tensor_apply<DEPTH>(
+          kMultiTensorBlockSize, kMultiTensorChunkSize, noop_flag,
+          tensor_lists, LambStage2Functor<DEPTH, scalar_t_0>(), lr, eps,
+          bias_correction1, bias_correction2, mode, decay, param_norm_sq,
+          update_norm_sq););
+}
+
+void multi_tensor_lamb_cuda(
+    at::Tensor& noop_flag, std::vector<std::vector<at::Tensor>>& tensor_lists,
+    at::Tensor& grad_norm, float lr, float beta1, float beta2, float eps,
+    float grad_scale, float max_grad_norm, int step, int mode,
+    int bias_correction, float decay) {
+  float bias_correction1 = 1.f, bias_correction2 = 1.f;
+  if (bias_correction == 1) {
+    bias_correction1 = 1 - std::pow(beta1, step);
+    bias_correction2 = 1 - std::pow(beta2, step);
+  }
+  const float* grad_norm_ptr = grad_norm.DATA_PTR<float>();
+
+  if (tensor_lists.size() == 5) {
+    multi_tensor_lamb_launch<5>(noop_flag, tensor_lists, grad_norm_ptr, lr,
+                                beta1, beta2, eps, grad_scale, max_grad_norm,
+                                bias_correction1, bias_correction2,
+                                (adamMode_t)mode, decay);
+  } else {
+    multi_tensor_lamb_launch<4>(noop_flag, tensor_lists, grad_norm_ptr, lr,
+                                beta1, beta2, eps, grad_scale, max_grad_norm,
+                                bias_correction1, bias_correction2,
+                                (adamMode_t)mode, decay);
+  }
+  AT_CUDA_CHECK(cudaGetLastError());
+}
+
+void multi_tensor_adamw_bf16_cuda(
+    at::Tensor& noop_flag, std::vector<std::vector<at::Tensor>>& tensor_lists,
+    std::vector<std::vector<at::Tensor>>& scale_lists, at::Tensor& grad_norm,
+    float lr, float beta1, float beta2, float eps, float grad_scale,
+    float max_grad_norm, int step, int mode, int bias_correction, float decay,
+    int64_t seed) {
+  float step_size = lr;
+  if (bias_correction == 1) {
+    const float bias_correction1 = 1 - std::pow(beta1, step);
+    const float bias_correction2 = 1 - std::pow(beta2, step);
+    step_size = lr * std::sqrt(bias_correction2) / bias_correction1;
+  }
+  const float* grad_norm_ptr = grad_norm.DATA_PTR<float>();
+
+  using namespace at;
+  if (scale_lists.empty()) {
+    DISPATCH_FLOAT_AND_BFLOAT16(
+        tensor_lists[0][0].scalar_type(), 0, "multi_tensor_adamw_bf16_cuda",
+        multi_tensor_apply<4>(
+            kMultiTensorBlockSize, kMultiTensorChunkSize, noop_flag,
+            tensor_lists, AdamWBf16Functor<scalar_t_0, false>(),
+            grad_norm_ptr, beta1, beta2, eps, grad_scale, max_grad_norm, lr,
+            step_size, (adamMode_t)mode, decay, uint64_t(seed), nullptr,
+            nullptr););
+    AT_CUDA_CHECK(cudaGetLastError());
+    return;
+  }
+
+  // the device table of the scales of every tensor, copied without a host
+  // sync from pinned memory.
+  int num_tensors = tensor_lists[0].size();
+  auto h_scale_ptrs = at::empty(
+      {2 * num_tensors},
+      at::TensorOptions().dtype(at::kLong).pinned_memory(true));
+  int64_t* h_ptrs = h_scale_ptrs.DATA_PTR<int64_t>();
+  for (int i = 0; i < num_tensors; i++) {
+    h_ptrs[i] = (int64_t)scale_lists[0][i].DATA_PTR<float>();
+    h_ptrs[num_tensors + i] = (int64_t)scale_lists[1][i].DATA_PTR<float>();
+  }
+  auto scale_ptrs = h_scale_ptrs.to(tensor_lists[0][0].device(), true);
+  float* const* exp_avg_scales = (float* const*)scale_ptrs.DATA_PTR<int64_t>();
+  DISPATCH_FLOAT_AND_BFLOAT16(
+      tensor_lists[0][0].scalar_type(), 0, "multi_tensor_adamw_bf16_cuda",
+      multi_tensor_apply<4>(
+          kBf16StateBlock, kMultiTensorChunkSize, noop_flag, tensor_lists,
+          AdamWBf16Functor<scalar_t_0, true>(), grad_norm_ptr, beta1, beta2,
+          eps, grad_scale, max_grad_norm, lr, step_size, (adamMode_t)mode,
+          decay, uint64_t(seed), exp_avg_scales,
+          exp_avg_scales + num_tensors););
+  AT_CUDA_CHECK(cudaGetLastError());
+}
 }  // namespace cuda
 }  // namespace lightseq
@@ -0,0 +1,224 @@
+#include "block_reduce.h"
+#include "kernels.h"
+
+namespace lightseq {
+namespace cuda {
+
+/*
+Gradient Communication Quantization (GCQ), see lightseq/training/gcq. A
+gradient bucket is seen as rows of hidden_dim, the last one may be partial,
+every row is quantized to int8 with its own scale, the topk-th largest |x| of
+the row over kQuantRangeI8.
+*/
+const int kGcqHistBins = 256;
+
+// The row is in shared memory, returns the same scale to all the threads. The
+// topk-th largest |x| is estimated with a histogram of |x| / max|x|, rounded
+// up to the upper edge of its bin, which clips a bit less than the exact one.
+__device__ float gcq_row_scale(const float *s_row, int hidden_dim, int topk) {
+  __shared__ int s_hist[kGcqHistBins];
+  __shared__ float s_val;
+
+  float row_max = 0.f;
+  for (int i = threadIdx.x; i < hidden_dim; i += blockDim.x) {
+    row_max = fmaxf(row_max, fabsf(s_row[i]));
+  }
+  blockReduce<ReduceType::kMax, 1>(&row_max);
+  if (threadIdx.x == 0) s_val = row_max;
+  for (int i = threadIdx.x; i < kGcqHistBins; i += blockDim.x) {
+    s_hist[i] = 0;
+  }
+  __syncthreads();
+  row_max = s_val;
+  if (row_max == 0.f) return 1.f;
+
+  for (int i = threadIdx.x; i < hidden_dim; i += blockDim.x) {
+    int bin = min(int(fabsf(s_row[i]) / row_max * kGcqHistBins),
+                  kGcqHistBins - 1);
+    atomicAdd(s_hist + bin, 1);
+  }
+  __syncthreads();
+
+  if (threadIdx.x == 0) {
+    int bin = kGcqHistBins - 1;
+    for (int cnt = 0; bin > 0; bin--) {
+      cnt += s_hist[bin];
+      if (cnt >= topk) break;
+    }
+    s_val = row_max * (bin + 1) / kGcqHistBins / kQuantRangeI8;
+  }
+  __syncthreads();
+  return s_val;
+}
+
+__forceinline__ __device__ int8_t gcq_quantize(float x, float scale) {
+  float i8 = floorf(x / scale + 0.5f);
+  i8 = fminf(fmaxf(i8, -kQuantRangeI8), kQuantRangeI8);
+  return static_cast<int8_t>(i8);
+}
+
+/**
+@brief: ker_gcq_quantize
+quantize the rows of grad + error, error is updated to the new quantization
+error, the error feedback. The rows beyond numel are zeros.
+
+@thread
+gridDim.x = padded_rows
+blockDim.x = MAX_THREADS
+dynamic shared memory = hidden_dim floats
+
+@param
+q: [padded_rows, hidden_dim]
+scales: [padded_rows]
+grad: [numel]
+error: [numel], nullptr without error feedback
+*/
+template <typename T>
+__global__ void ker_gcq_quantize(int8_t *q, float *scales, const T *grad,
+                                 float *error, int numel, int hidden_dim,
+                                 int topk) {
+  extern __shared__ float s_row[];
+  size_t row_offset = size_t(blockIdx.x) * hidden_dim;
+  for (int i = threadIdx.x; i < hidden_dim; i += blockDim.x) {
+    size_t idx = row_offset + i;
+    float val = 0.f;
+    if (idx < numel) {
+      val = static_cast<float>(grad[idx]);
+      if (error) val += error[idx];
+    }
+    s_row[i] = val;
+  }
+  __syncthreads();
+
+  float scale = gcq_row_scale(s_row, hidden_dim, topk);
+  if (threadIdx.x == 0) scales[blockIdx.x] = scale;
+  for (int i = threadIdx.x; i < hidden_dim; i += blockDim.x) {
+    size_t idx = row_offset + i;
+    int8_t qi = gcq_quantize(s_row[i], scale);
+    q[idx] = qi;
+    if (error && idx < numel) error[idx] = s_row[i] - qi * scale;
+  }
+}
+
+/**
+@brief: ker_gcq_reduce_quantize
+the mean of the shards received from all the ranks, or their sum without
+average, accumulated in fp32, then quantized again for the all-gather.
+
+@thread
+gridDim.x = rows
+blockDim.x = MAX_THREADS
+dynamic shared memory = hidden_dim floats
+
+@param
+q_out: [rows, hidden_dim]
+scales_out: [rows]
+q_in: [world_size, rows, hidden_dim]
+scales_in: [world_size, rows]
+*/
+__global__ void ker_gcq_reduce_quantize(int8_t *q_out, float *scales_out,
+                                        const int8_t *q_in,
+                                        const float *scales_in, int world_size,
+                                        int rows, int hidden_dim, int topk,
+                                        bool average) {
+  extern __shared__ float s_row[];
+  for (int i = threadIdx.x; i < hidden_dim; i += blockDim.x) {
+    float sum = 0.f;
+    for (int r = 0; r < world_size; r++) {
+      size_t row = size_t(r) * rows + blockIdx.x;
+      sum += q_in[row * hidden_dim + i] * scales_in[row];
+    }
+    s_row[i] = average ? sum / world_size : sum;
+  }
+  __syncthreads();
+
+  float scale = gcq_row_scale(s_row, hidden_dim, topk);
+  if (threadIdx.x == 0) scales_out[blockIdx.x] = scale;
+  size_t row_offset = size_t(blockIdx.x) * hidden_dim;
+  for (int i = threadIdx.x; i < hidden_dim; i += blockDim.x) {
+    q_out[row_offset + i] = gcq_quantize(s_row[i], scale);
+  }
+}
+
+/**
+@brief: ker_gcq_dequantize
+
+@thread
+gridDim.x = (numel + MAX_THREADS - 1) / MAX_THREADS
+blockDim.x = MAX_THREADS
+
+@param
+grad: [numel]
+q: [padded_rows, hidden_dim]
+scales: [padded_rows]
+*/
+template <typename T>
+__global__ void ker_gcq_dequantize(T *grad, const int8_t *q,
+                                   const float *scales, int numel,
+                                   int hidden_dim) {
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= numel) return;
+  grad[idx] = static_cast<T>(q[idx] * scales[idx / hidden_dim]);
+}
+
+template <typename T>
+void launch_gcq_quantize(int8_t *q, float *scales, const T *grad, float *error,
+                         int numel, int padded_rows, int hidden_dim, int topk,
+                         cudaStream_t stream) {
+  if (hidden_dim * sizeof(float) > 48 * 1024) {
+    throw std::runtime_error("gcq hidden_dim should be at most 12288");
+  }
+  ker_gcq_quantize<T>
+      <<<padded_rows, MAX_THREADS, hidden_dim * sizeof(float), stream>>>(
+          q, scales, grad, error, numel, hidden_dim, topk);
+}
+
+template void launch_gcq_quantize<float>(int8_t *q, float *scales,
+                                         const float *grad, float *error,
+                                         int numel, int padded_rows,
+                                         int hidden_dim, int topk,
+                                         cudaStream_t stream);
+template void launch_gcq_quantize<__half>(int8_t *q, float *scales,
+                                          const __half *grad, float *error,
+                                          int numel, int padded_rows,
+                                          int hidden_dim, int topk,
+                                          cudaStream_t stream);
+template void launch_gcq_quantize<__nv_bfloat16>(
+    int8_t *q, float *scales, const __nv_bfloat16 *grad, float *error,
+    int numel, int padded_rows, int hidden_dim, int topk, cudaStream_t stream);
+
+void launch_gcq_reduce_quantize(int8_t *q_out, float *scales_out,
+                                const int8_t *q_in, const float *scales_in,
+                                int world_size, int rows, int hidden_dim,
+                                int topk, cudaStream_t stream, bool average) {
+  if (hidden_dim * sizeof(float) > 48 * 1024) {
+    throw std::runtime_error("gcq hidden_dim should be at most 12288");
+  }
+  ker_gcq_reduce_quantize<<<rows, MAX_THREADS, hidden_dim * sizeof(float),
+                            stream>>>(q_out, scales_out, q_in, scales_in,
+                                      world_size, rows, hidden_dim, topk,
+                                      average);
+}
+
+template <typename T>
+void launch_gcq_dequantize(T *grad, const int8_t *q, const float *scales,
+                           int numel, int hidden_dim, cudaStream_t stream) {
+  int grid_dim = (numel + MAX_THREADS - 1) / MAX_THREADS;
+  ker_gcq_dequantize<T><<<grid_dim, MAX_THREADS, 0, stream>>>(
+      grad, q, scales, numel, hidden_dim);
+}
+
+template void launch_gcq_dequantize<float>(float *grad, const int8_t *q,
+                                           const float *scales, int numel,
+                                           int hidden_dim,
+                                           cudaStream_t stream);
+template void launch_gcq_dequantize<__half>(__half *grad, const int8_t *q,
+                                            const float *scales, int numel,
+                                            int hidden_dim,
+                                            cudaStream_t stream);
+template void launch_gcq_dequantize<__nv_bfloat16>(
+    __nv_bfloat16 *grad, const int8_t *q, const float *scales, int numel,
+    int hidden_dim, cudaStream_t stream);
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -0,0 +1,483 @@
+#include "gemm_tuner.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cctype>
+#include <memory>
+
+#include "cuda_util.h"
+#include "skinny_gemm.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+// algos asked from the cublasLt heuristics, and the timed runs of each.
+const int kTunerHeuristics = 8;
+const int kTunerRepeat = 5;
+const int kTunerSplitK[] = {2, 4, 8, 16};
+// split-K is not tried when a split would be shorter than this.
+const int kTunerMinSplitKLength = 256;
+// the backend of the cublasLt algos in the config files.
+const char *kCublasLtBackend = "cublasLt";
+
+template <typename T>
+cudaDataType_t tuner_dtype();
+template <>
+cudaDataType_t tuner_dtype<float>() {
+  return CUDA_R_32F;
+}
+template <>
+cudaDataType_t tuner_dtype<__half>() {
+  return CUDA_R_16F;
+}
+template <>
+cudaDataType_t tuner_dtype<__nv_bfloat16>() {
+  return CUDA_R_16BF;
+}
+
+// The descriptors of a gemm laid out as cublas_strided_batched_gemm.
+struct GemmDescs {
+  cublasLtMatmulDesc_t matmul = nullptr;
+  cublasLtMatrixLayout_t a = nullptr;
+  cublasLtMatrixLayout_t b = nullptr;
+  cublasLtMatrixLayout_t c = nullptr;
+
+  GemmDescs(cudaDataType_t dtype, cublasOperation_t transa,
+            cublasOperation_t transb, int m, int n, int k, int batch,
+            int64_t stride_a, int64_t stride_b, int64_t stride_c) {
+    CHECK_GPU_ERROR(
+        cublasLtMatmulDescCreate(&matmul, CUBLAS_COMPUTE_32F, CUDA_R_32F));
+    CHECK_GPU_ERROR(cublasLtMatmulDescSetAttribute(
+        matmul, CUBLASLT_MATMUL_DESC_TRANSA, &transa, sizeof(transa)));
+    CHECK_GPU_ERROR(cublasLtMatmulDescSetAttribute(
+        matmul, CUBLASLT_MATMUL_DESC_TRANSB, &transb, sizeof(transb)));
+    int a_rows = transa == CUBLAS_OP_N ? m : k;
+    int b_rows = transb == CUBLAS_OP_N ? k : n;
+    CHECK_GPU_ERROR(cublasLtMatrixLayoutCreate(
+        &a, dtype, a_rows, transa == CUBLAS_OP_N ? k : m, a_rows));
+    CHECK_GPU_ERROR(cublasLtMatrixLayoutCreate(
+        &b, dtype, b_rows, transb == CUBLAS_OP_N ? n : k, b_rows));
+    CHECK_GPU_ERROR(cublasLtMatrixLayoutCreate(&c, dtype, m, n, m));
+    if (batch > 1) {
+      set_batch(a, batch, stride_a);
+      set_batch(b, batch, stride_b);
+      set_batch(c, batch, stride_c);
+    }
+  }
+
+  ~GemmDescs() {
+    cublasLtMatmulDescDestroy(matmul);
+    cublasLtMatrixLayoutDestroy(a);
+    cublasLtMatrixLayoutDestroy(b);
+    cublasLtMatrixLayoutDestroy(c);
+  }
+
+  static void set_batch(cublasLtMatrixLayout_t layout, int batch,
+                        int64_t stride) {
+    CHECK_GPU_ERROR(cublasLtMatrixLayoutSetAttribute(
+        layout, CUBLASLT_MATRIX_LAYOUT_BATCH_COUNT, &batch, sizeof(batch)));
+    CHECK_GPU_ERROR(cublasLtMatrixLayoutSetAttribute(
+        layout, CUBLASLT_MATRIX_LAYOUT_STRIDED_BATCH_OFFSET, &stride,
+        sizeof(stride)));
+  }
+};
+
+int get_algo_attr(const cublasLtMatmulAlgo_t &algo,
+                  cublasLtMatmulAlgoConfigAttributes_t attr) {
+  uint32_t value = 0;
+  size_t written;
+  cublasLtMatmulAlgoConfigGetAttribute(&algo, attr, &value, sizeof(value),
+                                       &written);
+  return value;
+}
+
+void set_algo_attr(cublasLtMatmulAlgo_t *algo,
+                   cublasLtMatmulAlgoConfigAttributes_t attr, int value) {
+  uint32_t v = value;
+  cublasLtMatmulAlgoConfigSetAttribute(algo, attr, &v, sizeof(v));
+}
+
+GemmAlgoConfig algo_to_config(const cublasLtMatmulAlgo_t &algo,
+                              size_t workspace_size, float time_us) {
+  GemmAlgoConfig config;
+  int32_t algo_id = 0;
+  size_t written;
+  cublasLtMatmulAlgoConfigGetAttribute(&algo, CUBLASLT_ALGO_CONFIG_ID,
+                                       &algo_id, sizeof(algo_id), &written);
+  config.algo_id = algo_id;
+  config.tile = get_algo_attr(algo, CUBLASLT_ALGO_CONFIG_TILE_ID);
+  config.stages = get_algo_attr(algo, CUBLASLT_ALGO_CONFIG_STAGES_ID);
+  config.splitk = get_algo_attr(algo, CUBLASLT_ALGO_CONFIG_SPLITK_NUM);
+  config.reduction_scheme =
+      get_algo_attr(algo, CUBLASLT_ALGO_CONFIG_REDUCTION_SCHEME);
+  config.swizzle = get_algo_attr(algo, CUBLASLT_ALGO_CONFIG_CTA_SWIZZLING);
+  config.custom_option =
+      get_algo_attr(algo, CUBLASLT_ALGO_CONFIG_CUSTOM_OPTION);
+  config.workspace_size = workspace_size;
+  config.time_us = time_us;
+  return config;
+}
+
+cublasLtMatmulAlgo_t config_to_algo(cublasLtHandle_t handle,
+                                    cudaDataType_t dtype,
+                                    const GemmAlgoConfig &config) {
+  cublasLtMatmulAlgo_t algo;
+  CHECK_GPU_ERROR(cublasLtMatmulAlgoInit(handle, CUBLAS_COMPUTE_32F,
+                                         CUDA_R_32F, dtype, dtype, dtype,
+                                         dtype, config.algo_id, &algo));
+  set_algo_attr(&algo, CUBLASLT_ALGO_CONFIG_TILE_ID, config.tile);
+  set_algo_attr(&algo, CUBLASLT_ALGO_CONFIG_STAGES_ID, config.stages);
+  set_algo_attr(&algo, CUBLASLT_ALGO_CONFIG_SPLITK_NUM, config.splitk);
+  set_algo_attr(&algo, CUBLASLT_ALGO_CONFIG_REDUCTION_SCHEME,
+                config.reduction_scheme);
+  set_algo_attr(&algo, CUBLASLT_ALGO_CONFIG_CTA_SWIZZLING, config.swizzle);
+  set_algo_attr(&algo, CUBLASLT_ALGO_CONFIG_CUSTOM_OPTION,
+                config.custom_option);
+  return algo;
+}
+
+// The split-K variants of algo, which must not be split already.
+void add_splitk_algos(cublasLtHandle_t handle, const GemmDescs &descs,
+                      const cublasLtMatmulAlgo_t &algo, int k,
+                      std::vector<cublasLtMatmulAlgo_t> *algos) {
+  int splitk_support = 0;
+  uint32_t reduction_mask = 0;
+  size_t written;
+  cublasLtMatmulAlgoCapGetAttribute(&algo, CUBLASLT_ALGO_CAP_SPLITK_SUPPORT,
+                                    &splitk_support, sizeof(splitk_support),
+                                    &written);
+  cublasLtMatmulAlgoCapGetAttribute(
+      &algo, CUBLASLT_ALGO_CAP_REDUCTION_SCHEME_MASK, &reduction_mask,
+      sizeof(reduction_mask), &written);
+  if (!splitk_support ||
+      get_algo_attr(algo, CUBLASLT_ALGO_CONFIG_SPLITK_NUM) > 1) {
+    return;
+  }
+  // in place reductions need no workspace.
+  int reduction = CUBLASLT_REDUCTION_SCHEME_OUT_OF_PLACE;
+  if (reduction_mask & CUBLASLT_REDUCTION_SCHEME_INPLACE) {
+    reduction = CUBLASLT_REDUCTION_SCHEME_INPLACE;
+  } else if (reduction_mask & CUBLASLT_REDUCTION_SCHEME_COMPUTE_TYPE) {
+    reduction = CUBLASLT_REDUCTION_SCHEME_COMPUTE_TYPE;
+  }
+  for (int splitk : kTunerSplitK) {
+    if (k / splitk < kTunerMinSplitKLength) break;
+    cublasLtMatmulAlgo_t split_algo = algo;
+    set_algo_attr(&split_algo, CUBLASLT_ALGO_CONFIG_SPLITK_NUM, splitk);
+    set_algo_attr(&split_algo, CUBLASLT_ALGO_CONFIG_REDUCTION_SCHEME,
+                  reduction);
+    cublasLtMatmulHeuristicResult_t result;
+    if (cublasLtMatmulAlgoCheck(handle, descs.matmul, descs.a, descs.b,
+                                descs.c, descs.c, &split_algo,
+                                &result) == CUBLAS_STATUS_SUCCESS &&
+        result.workspaceSize <= kGemmTunerWorkspaceSize) {
+      algos->push_back(split_algo);
+    }
+  }
+}
+
+std::string config_dir() {
+  const char *dir_env = std::getenv("LIGHTSEQ_GEMM_CONFIG_DIR");
+  if (dir_env) return std::string(dir_env) + "/";
+  const char *home_env = std::getenv("HOME");
+  return std::string(home_env ? home_env : ".") + "/.lightseq/gemm_configs/";
+}
+
+// The name of the GPU SKU, e.g. NVIDIA_H100_80GB_HBM3_sm90.
+std::string sku_name(int device) {
+  cudaDeviceProp props;
+  CHECK_GPU_ERROR(cudaGetDeviceProperties(&props, device));
+  std::string name(props.name);
+  for (char &c : name) {
+    if (!isalnum(c)) c = '_';
+  }
+  return name + "_sm" + std::to_string(props.major * 10 + props.minor);
+}
+
+}  // namespace
+
+GemmTuner::GemmTuner(int device) : _device(device) {
+  _config_path = config_dir() + "gemm_" + sku_name(device) + ".cfg";
+  _backends.emplace_back(new SkinnyGemmBackend());
+  load_config();
+}
+
+void GemmTuner::add_backend(std::unique_ptr<GemmBackend> backend) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _backends.push_back(std::move(backend));
+}
+
+GemmTuner::~GemmTuner() {
+  for (auto &iter : _workspaces) cudaFree(iter.second);
+}
+
+bool GemmTuner::enabled() {
+  static bool tune = [] {
+    const char *tune_env = std::getenv("LIGHTSEQ_GEMM_TUNE");
+    return tune_env && std::atoi(tune_env) > 0;
+  }();
+  return tune;
+}
+
+GemmTuner &GemmTuner::instance() {
+  static std::mutex mutex;
+  static std::map<int, std::unique_ptr<GemmTuner>> tuners;
+  int device;
+  CHECK_GPU_ERROR(cudaGetDevice(&device));
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<GemmTuner> &tuner = tuners[device];
+  if (!tuner) tuner.reset(new GemmTuner(device));
+  return *tuner;
+}
+
+/* The first line holds the cublasLt version, the configs of another version
+are dropped. Every other line is
+transa transb m n k batch dtype | backend algo_id tile stages splitk
+reduction_scheme swizzle custom_option workspace_size | time_us
+with the backend cublasLt or the name of a GemmBackend, whose variant is the
+algo_id. The lines of the backends the tuner does not have are skipped.
+*/
+void GemmTuner::load_config() {
+  FILE *fd = fopen(_config_path.c_str(), "r");
+  if (fd == NULL) {
+    std::cout << "[WARNING] " << _config_path
+              << " is not found; tuning the GEMM algos" << std::endl;
+    return;
+  }
+  size_t version = 0;
+  if (fscanf(fd, "# cublasLt %zu backends\n", &version) != 1 ||
+      version != cublasLtGetVersion()) {
+    std::cout << "[WARNING] " << _config_path
+              << " is of another cuBLAS version or format; tuning the GEMM "
+                 "algos"
+              << std::endl;
+    fclose(fd);
+    remove(_config_path.c_str());
+    return;
+  }
+  std::vector<int> key(7);
+  GemmAlgoConfig config;
+  char backend[64];
+  while (fscanf(fd,
+                "%d %d %d %d %d %d %d | %63s %d %d %d %d %d %d %d %zu | %f\n",
+                &key[0], &key[1], &key[2], &key[3], &key[4], &key[5],
+                &key[6], backend, &config.algo_id, &config.tile,
+                &config.stages, &config.splitk, &config.reduction_scheme,
+                &config.swizzle, &config.custom_option,
+                &config.workspace_size, &config.time_us) == 17) {
+    config.backend = -1;
+    for (size_t b = 0; b < _backends.size(); b++) {
+      if (_backends[b]->name() == backend) config.backend = b;
+    }
+    if (config.backend < 0 && std::string(backend) != kCublasLtBackend) {
+      continue;
+    }
+    _algo_map[key] = config;
+  }
+  fclose(fd);
+  std::cout << "Load " << _algo_map.size() << " GEMM configs from "
+            << _config_path << std::endl;
+}
+
+void GemmTuner::save_config(const std::vector<int> &key,
+                            const GemmAlgoConfig &config) {
+  std::string command = "mkdir -p " + config_dir();
+  system(command.c_str());
+  FILE *fd = fopen(_config_path.c_str(), "a");
+  if (fd == NULL) {
+    std::cout << "[WARNING] can not write " << _config_path << std::endl;
+    return;
+  }
+  if (ftell(fd) == 0) {
+    fprintf(fd, "# cublasLt %zu backends\n", cublasLtGetVersion());
+  }
+  std::string backend = config.backend < 0
+                            ? kCublasLtBackend
+                            : _backends[config.backend]->name();
+  fprintf(fd, "%d %d %d %d %d %d %d | %s %d %d %d %d %d %d %d %zu | %f\n",
+          key[0], key[1], key[2], key[3], key[4], key[5], key[6],
+          backend.c_str(), config.algo_id, config.tile, config.stages,
+          config.splitk, config.reduction_scheme, config.swizzle,
+          config.custom_option, config.workspace_size, config.time_us);
+  fclose(fd);
+}
+
+void *GemmTuner::workspace(cudaStream_t stream) {
+  // the streams of the scheduler run gemms at the same time, so each has
+  // its own workspace.
+  void *&ws = _workspaces[stream];
+  if (ws == nullptr) {
+    CHECK_GPU_ERROR(cudaMalloc(&ws, kGemmTunerWorkspaceSize));
+  }
+  return ws;
+}
+
+template <typename T>
+bool GemmTuner::gemm(cublasLtHandle_t handle, cublasOperation_t transa,
+                     cublasOperation_t transb, int m, int n, int k,
+                     const float *alpha, const float *beta, const T *A,
+                     const T *B, T *C, int batch, int64_t stride_a,
+                     int64_t stride_b, int64_t stride_c, cudaStream_t stream) {
+  cudaDataType_t dtype = tuner_dtype<T>();
+  std::vector<int> key = {transa, transb, m, n, k, batch, dtype};
+  GemmShape shape = {transa,   transb,   m,        n,    k, batch,
+                     stride_a, stride_b, stride_c, dtype};
+  GemmDescs descs(dtype, transa, transb, m, n, k, batch, stride_a, stride_b,
+                  stride_c);
+
+  cudaStreamCaptureStatus capture_status;
+  CHECK_GPU_ERROR(cudaStreamIsCapturing(stream, &capture_status));
+  bool capturing = capture_status != cudaStreamCaptureStatusNone;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto iter = _algo_map.find(key);
+  if (capturing &&
+      (iter == _algo_map.end() || _workspaces.count(stream) == 0)) {
+    // tuning or allocating can not be captured.
+    return false;
+  }
+  void *ws = workspace(stream);
+
+  if (iter == _algo_map.end()) {
+    cublasLtMatmulPreference_t preference;
+    CHECK_GPU_ERROR(cublasLtMatmulPreferenceCreate(&preference));
+    uint64_t max_workspace = kGemmTunerWorkspaceSize;
+    CHECK_GPU_ERROR(cublasLtMatmulPreferenceSetAttribute(
+        preference, CUBLASLT_MATMUL_PREF_MAX_WORKSPACE_BYTES, &max_workspace,
+        sizeof(max_workspace)));
+    cublasLtMatmulHeuristicResult_t results[kTunerHeuristics];
+    int num_results = 0;
+    cublasLtMatmulAlgoGetHeuristic(handle, descs.matmul, descs.a, descs.b,
+                                   descs.c, descs.c, preference,
+                                   kTunerHeuristics, results, &num_results);
+    CHECK_GPU_ERROR(cublasLtMatmulPreferenceDestroy(preference));
+    std::vector<cublasLtMatmulAlgo_t> algos;
+    for (int i = 0; i < num_results; i++) {
+      if (results[i].state == CUBLAS_STATUS_SUCCESS) {
+        algos.push_back(results[i].algo);
+      }
+    }
+    size_t num_heuristic_algos = algos.size();
+    for (size_t i = 0; i < num_heuristic_algos; i++) {
+      // a copy, algos grows.
+      cublasLtMatmulAlgo_t algo = algos[i];
+      add_splitk_algos(handle, descs, algo, k, &algos);
+    }
+
+    // time on a copy of C, the runs must not accumulate into it.
+    size_t c_size = batch > 1 ? stride_c * (batch - 1) + size_t(m) * n
+                              : size_t(m) * n;
+    T *c_buffer;
+    CHECK_GPU_ERROR(cudaMalloc(&c_buffer, c_size * sizeof(T)));
+    CHECK_GPU_ERROR(
+        cudaMemsetAsync(c_buffer, 0, c_size * sizeof(T), stream));
+    cudaEvent_t start, stop;
+    CHECK_GPU_ERROR(cudaEventCreate(&start));
+    CHECK_GPU_ERROR(cudaEventCreate(&stop));
+    bool found = false;
+    GemmAlgoConfig best{};
+    for (const cublasLtMatmulAlgo_t &algo : algos) {
+      cublasLtMatmulHeuristicResult_t result;
+      if (cublasLtMatmulAlgoCheck(handle, descs.matmul, descs.a, descs.b,
+                                  descs.c, descs.c, &algo,
+                                  &result) != CUBLAS_STATUS_SUCCESS ||
+          result.workspaceSize > kGemmTunerWorkspaceSize) {
+        continue;
+      }
+      // the warm up run, which also filters the algos failing to launch.
+      if (cublasLtMatmul(handle, descs.matmul, alpha, A, descs.a, B, descs.b,
+                         beta, c_buffer, descs.c, c_buffer, descs.c, &algo,
+                         ws, kGemmTunerWorkspaceSize,
+                         stream) != CUBLAS_STATUS_SUCCESS) {
+        continue;
+      }
+      CHECK_GPU_ERROR(cudaEventRecord(start, stream));
+      for (int r = 0; r < kTunerRepeat; r++) {
+        cublasLtMatmul(handle, descs.matmul, alpha, A, descs.a, B, descs.b,
+                       beta, c_buffer, descs.c, c_buffer, descs.c, &algo, ws,
+                       kGemmTunerWorkspaceSize, stream);
+      }
+      CHECK_GPU_ERROR(cudaEventRecord(stop, stream));
+      CHECK_GPU_ERROR(cudaEventSynchronize(stop));
+      float time_ms;
+      CHECK_GPU_ERROR(cudaEventElapsedTime(&time_ms, start, stop));
+      float time_us = time_ms * 1000.f / kTunerRepeat;
+      if (!found || time_us < best.time_us) {
+        best = algo_to_config(algo, result.workspaceSize, time_us);
+        found = true;
+      }
+    }
+    for (size_t b = 0; b < _backends.size(); b++) {
+      GemmBackend &backend = *_backends[b];
+      for (int variant : backend.variants(shape)) {
+        if (!backend.run(shape, variant, alpha, beta, A, B, c_buffer, ws,
+                         stream)) {
+          continue;
+        }
+        CHECK_GPU_ERROR(cudaEventRecord(start, stream));
+        for (int r = 0; r < kTunerRepeat; r++) {
+          backend.run(shape, variant, alpha, beta, A, B, c_buffer, ws,
+                      stream);
+        }
+        CHECK_GPU_ERROR(cudaEventRecord(stop, stream));
+        CHECK_GPU_ERROR(cudaEventSynchronize(stop));
+        float time_ms;
+        CHECK_GPU_ERROR(cudaEventElapsedTime(&time_ms, start, stop));
+        float time_us = time_ms * 1000.f / kTunerRepeat;
+        if (!found || time_us < best.time_us) {
+          best = GemmAlgoConfig();
+          best.algo_id = variant;
+          best.time_us = time_us;
+          best.backend = b;
+          found = true;
+        }
+      }
+    }
+    CHECK_GPU_ERROR(cudaEventDestroy(start));
+    CHECK_GPU_ERROR(cudaEventDestroy(stop));
+    CHECK_GPU_ERROR(cudaFree(c_buffer));
+    if (!found) {
+      // no algo of this shape, keep the cublas wrappers.
+      printf("[WARNING] no tuned algo of gemm m: %d, n: %d, k: %d\n", m, n,
+             k);
+      best.algo_id = -1;
+      best.backend = -1;
+    }
+    iter = _algo_map.emplace(key, best).first;
+    if (found) save_config(key, best);
+  }
+  if (iter->second.backend >= 0) {
+    return _backends[iter->second.backend]->run(
+        shape, iter->second.algo_id, alpha, beta, A, B, C, ws, stream);
+  }
+  if (iter->second.algo_id < 0) return false;
+
+  cublasLtMatmulAlgo_t algo = config_to_algo(handle, dtype, iter->second);
+  CHECK_GPU_ERROR(cublasLtMatmul(handle, descs.matmul, alpha, A, descs.a, B,
+                                 descs.b, beta, C, descs.c, C, descs.c, &algo,
+                                 ws, kGemmTunerWorkspaceSize, stream));
+  return true;
+}
+
+template bool GemmTuner::gemm<float>(
+    cublasLtHandle_t handle, cublasOperation_t transa,
+    cublasOperation_t transb, int m, int n, int k, const float *alpha,
+    const float *beta, const float *A, const float *B, float *C, int batch,
+    int64_t stride_a, int64_t stride_b, int64_t stride_c, cudaStream_t stream);
+template bool GemmTuner::gemm<__half>(
+    cublasLtHandle_t handle, cublasOperation_t transa,
+    cublasOperation_t transb, int m, int n, int k, const float *alpha,
+    const float *beta, const __half *A, const __half *B, __half *C, int batch,
+    int64_t stride_a, int64_t stride_b, int64_t stride_c, cudaStream_t stream);
+template bool GemmTuner::gemm<__nv_bfloat16>(
+    cublasLtHandle_t handle, cublasOperation_t transa,
+    cublasOperation_t transb, int m, int n, int k, const float *alpha,
+    const float *beta, const __nv_bfloat16 *A, const __nv_bfloat16 *B,
+    __nv_bfloat16 *C, int batch, int64_t stride_a, int64_t stride_b,
+    int64_t stride_c, cudaStream_t stream);
+
+}  // namespace cuda
+}  // namespace lightseq
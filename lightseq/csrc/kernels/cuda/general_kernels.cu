@@ -184,6 +184,25 @@ void launch_fused_add2<__half>(__half *out, const __half *inp1,
                                                         hidden_dim);
 }
 
+template <typename T>
+__global__ void kernel_accumulate(T *out, const T *inp, int nele) {
+  int idx = flat_2dim(blockIdx.x, threadIdx.x, blockDim.x);
+  if (idx < nele) {
+    out[idx] = T(float(out[idx]) + float(inp[idx]));
+  }
+}
+
+template <typename T>
+void launch_accumulate(T *out, const T *inp, int nele, cudaStream_t stream) {
+  int nblock = (nele + MAX_THREADS - 1) / MAX_THREADS;
+  kernel_accumulate<<<nblock, MAX_THREADS, 0, stream>>>(out, inp, nele);
+}
+
+template void launch_accumulate<float>(float *out, const float *inp, int nele,
+                                       cudaStream_t stream);
+template void launch_accumulate<__half>(__half *out, const __half *inp,
+                                        int nele, cudaStream_t stream);
+
 template <typename T>
 __global__ void kernel_concat3_dim1(const T *inp1, const T *inp2, T *output,
                                     int sz0, int sz2, int sz1_1, int sz1_2) {
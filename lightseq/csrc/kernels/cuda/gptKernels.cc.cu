@@ -157,7 +157,8 @@ __global__ void kernel_gpt_embedding(const T* token_emb, const T* pos_emb,
                                      T* pad_mask_ptr, int* left_pad_len_ptr,
                                      int batch_size, int beam_size, int seq_len,
                                      int hidden_dim, int padding_id,
-                                     int max_step, int step_offset) {
+                                     int max_step, int step_offset,
+                                     const int* positions) {
   int idx = blockIdx.x * blockDim.x + threadIdx.x;
   if (idx >= batch_size * beam_size * seq_len * hidden_dim) {
     return;
@@ -177,10 +178,10 @@ __global__ void kernel_gpt_embedding(const T* token_emb, const T* pos_emb,
     }
     float4 token_emb_val =
         ((float4*)token_emb)[token_id * hidden_dim + state_idx];
-    float4 pos_emb_val = ((float4*)pos_emb)[(seq_idx + step_offset -
-                                             left_pad_len_ptr[batch_beam_idx]) *
-                                                hidden_dim +
-                                            state_idx];
+    int pos = positions ? positions[token_idx]
+                        : seq_idx + step_offset -
+                              left_pad_len_ptr[batch_beam_idx];
+    float4 pos_emb_val = ((float4*)pos_emb)[pos * hidden_dim + state_idx];
 
     output_val.x = token_emb_val.x + pos_emb_val.x;
     output_val.y = token_emb_val.y + pos_emb_val.y;
@@ -225,7 +226,7 @@ __global__ void kernel_gpt_embedding<__half>(
     const __half* token_emb, const __half* pos_emb, const int* token_ids,
     __half* output, __half* pad_mask_ptr, int* left_pad_len_ptr, int batch_size,
     int beam_size, int seq_len, int hidden_dim, int padding_id, int max_step,
-    int step_offset) {
+    int step_offset, const int* positions) {
   int idx = blockIdx.x * blockDim.x + threadIdx.x;
   if (idx >= batch_size * beam_size * seq_len * hidden_dim) {
     return;
@@ -246,10 +247,10 @@ __global__ void kernel_gpt_embedding<__half>(
     }
     float4 token_emb_val =
         ((float4*)token_emb)[token_id * hidden_dim + state_idx];
-    float4 pos_emb_val = ((float4*)pos_emb)[(seq_idx + step_offset -
-                                             left_pad_len_ptr[batch_beam_idx]) *
-                                                hidden_dim +
-                                            state_idx];
+    int pos = positions ? positions[token_idx]
+                        : seq_idx + step_offset -
+                              left_pad_len_ptr[batch_beam_idx];
+    float4 pos_emb_val = ((float4*)pos_emb)[pos * hidden_dim + state_idx];
     __half2* value_h2 = (__half2*)(&token_emb_val);
     __half2* pemb_h2 = (__half2*)(&pos_emb_val);
 #pragma unroll
@@ -270,7 +271,8 @@ void launch_gpt_embedding<float>(const float* token_emb, const float* pos_emb,
                                  float* pad_mask_ptr, int* left_pad_len_ptr,
                                  int batch_size, int beam_size, int hidden_dim,
                                  int step_offset, int seq_len, int max_step,
-                                 int padding_id, cudaStream_t stream) {
+                                 int padding_id, cudaStream_t stream,
+                                 const int* positions) {
   if (seq_len + step_offset >= max_step) {
     throw std::runtime_error("violate seq_len + step_offset < max_step");
   }
@@ -288,7 +290,7 @@ void launch_gpt_embedding<float>(const float* token_emb, const float* pos_emb,
   kernel_gpt_embedding<float><<<nblock, MAX_THREADS, 0, stream>>>(
       token_emb, pos_emb, tokens, output, pad_mask_ptr, left_pad_len_ptr,
       batch_size, beam_size, seq_len, hidden_dim, padding_id, max_step,
-      step_offset);
+      step_offset, positions);
 }
 
 template <>
@@ -298,7 +300,8 @@ void launch_gpt_embedding<__half>(const __half* token_emb,
                                   int* left_pad_len_ptr, int batch_size,
                                   int beam_size, int hidden_dim,
                                   int step_offset, int seq_len, int max_step,
-                                  int padding_id, cudaStream_t stream) {
+                                  int padding_id, cudaStream_t stream,
+                                  const int* positions) {
   if (seq_len + step_offset >= max_step) {
     throw std::runtime_error("violate seq_len + step_offset < max_step");
   }
@@ -315,20 +318,20 @@ void launch_gpt_embedding<__half>(const __half* token_emb,
   kernel_gpt_embedding<__half><<<nblock, MAX_THREADS, 0, stream>>>(
       token_emb, pos_emb, tokens, output, pad_mask_ptr, left_pad_len_ptr,
       batch_size, beam_size, seq_len, hidden_dim, padding_id, max_step,
-      step_offset);
+      step_offset, positions);
 }
 
 template void launch_gpt_embedding<float>(
     const float* token_emb, const float* pos_emb, const int* tokens,
     float* output, float* pad_mask_ptr, int* left_pad_len_ptr, int batch_size,
     int beam_size, int hidden_dim, int step_offset, int seq_len, int max_step,
-    int padding_id, cudaStream_t stream);
+    int padding_id, cudaStream_t stream, const int* positions);
 
 template void launch_gpt_embedding<__half>(
     const __half* token_emb, const __half* pos_emb, const int* tokens,
     __half* output, __half* pad_mask_ptr, int* left_pad_len_ptr, int batch_size,
     int beam_size, int hidden_dim, int step_offset, int seq_len, int max_step,
-    int padding_id, cudaStream_t stream);
+    int padding_id, cudaStream_t stream, const int* positions);
 
 /**
 @brief: ker_correlation_softmax_gpt
@@ -680,6 +683,123 @@ template void ker_ppl_launcher<__half>(
     cudaStream_t stream, const __half* logits, const int* input_ids,
     const int* real_seq_len, float* ppl, int vocab_size);
 
+/**
+@brief: ker_gather_rows
+gather rows of a matrix, eg. the hidden states of the tokens to score out of
+a padded batch
+
+@thread
+gridDim.x = rows
+blockDim.x = max_thread_per_block
+
+@param
+input: [input_rows, hidden_size]
+row_idx: [rows], the input row of every output row
+output: [rows, hidden_size]
+*/
+template <typename T>
+__global__ void ker_gather_rows(const T* input, const int* row_idx, T* output,
+                                int hidden_size) {
+  const T* src = input + (size_t)row_idx[blockIdx.x] * hidden_size;
+  T* dst = output + (size_t)blockIdx.x * hidden_size;
+  for (int idx = threadIdx.x; idx < hidden_size; idx += blockDim.x) {
+    dst[idx] = src[idx];
+  }
+}
+
+template <typename T>
+void ker_gather_rows_launcher(int rows, int hidden_size,
+                              int max_thread_per_block, cudaStream_t stream,
+                              const T* input, const int* row_idx, T* output) {
+  ker_gather_rows<T><<<rows, max_thread_per_block, 0, stream>>>(
+      input, row_idx, output, hidden_size);
+}
+
+template void ker_gather_rows_launcher<float>(int rows, int hidden_size,
+                                              int max_thread_per_block,
+                                              cudaStream_t stream,
+                                              const float* input,
+                                              const int* row_idx,
+                                              float* output);
+
+template void ker_gather_rows_launcher<__half>(int rows, int hidden_size,
+                                               int max_thread_per_block,
+                                               cudaStream_t stream,
+                                               const __half* input,
+                                               const int* row_idx,
+                                               __half* output);
+
+/**
+@brief: ker_target_log_prob
+log softmax of every row of logits, gathered at the target token of the row.
+Unlike ker_ppl, the logits are read only once: every thread keeps a running
+max and the sum of exp(logit - max) rescaled when the max grows, the partial
+sums are rescaled to the block max before the block reduce.
+
+@thread
+gridDim.x = rows
+blockDim.x = max_thread_per_block
+
+@param
+logits: [rows, vocab_size]
+target_ids: [rows]
+log_probs: [rows], log(softmax(logits)[target_id])
+*/
+template <typename T>
+__global__ void ker_target_log_prob(const T* logits, const int* target_ids,
+                                    float* log_probs, int vocab_size) {
+  const T* row_logits = logits + (size_t)blockIdx.x * vocab_size;
+  float max_logit = CUDA_FLOAT_INF_NEG;
+  float sum_exp_logit = 0.f;
+  for (int idx = threadIdx.x; idx < vocab_size; idx += blockDim.x) {
+    float lgt = (float)row_logits[idx];
+    if (lgt > max_logit) {
+      sum_exp_logit = sum_exp_logit * expf(max_logit - lgt) + 1.f;
+      max_logit = lgt;
+    } else {
+      sum_exp_logit += expf(lgt - max_logit);
+    }
+  }
+
+  __shared__ float s_max_logit;
+  float block_max_logit = blockReduceMax(max_logit);
+  if (threadIdx.x == 0) {
+    s_max_logit = block_max_logit;
+  }
+  __syncthreads();
+
+  // threads without any logit have sum_exp_logit = 0
+  if (sum_exp_logit > 0.f) {
+    sum_exp_logit *= expf(max_logit - s_max_logit);
+  }
+  sum_exp_logit = blockReduceSum(sum_exp_logit);
+
+  if (threadIdx.x == 0) {
+    int token_id = target_ids[blockIdx.x];
+    log_probs[blockIdx.x] =
+        (float)row_logits[token_id] - s_max_logit - logf(sum_exp_logit);
+  }
+}
+
+template <typename T>
+void ker_target_log_prob_launcher(int rows, int max_thread_per_block,
+                                  cudaStream_t stream, const T* logits,
+                                  const int* target_ids, float* log_probs,
+                                  int vocab_size) {
+  ker_target_log_prob<T><<<rows, max_thread_per_block, 0, stream>>>(
+      logits, target_ids, log_probs, vocab_size);
+}
+
+template void ker_target_log_prob_launcher<float>(
+    int rows, int max_thread_per_block, cudaStream_t stream,
+    const float* logits, const int* target_ids, float* log_probs,
+    int vocab_size);
+
+template void ker_target_log_prob_launcher<__half>(
+    int rows, int max_thread_per_block, cudaStream_t stream,
+    const __half* logits, const int* target_ids, float* log_probs,
+    int vocab_size);
+
 /**
 @brief: ker_topk_sample
 
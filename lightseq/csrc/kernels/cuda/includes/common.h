@@ -4,6 +4,7 @@
 #include "cuda_util.h"
 #include <cuda.h>
 #include <cuda_fp16.h>
+#include <cuda_bf16.h>
 
 #include <curand_kernel.h>
 #include <stdio.h>
@@ -234,5 +235,43 @@ __forceinline__ __host__ __device__ float2 safe_half2_to_float2(half2 vhalf2) {
   return vfloat2;
 }
 
+/*
+The sinusoidal position embedding of dim at pos, as get_pos_embedding of the
+training ops: the sin of the first half of the dims and the cos of the second,
+of frequencies from 1 down to 1 / 10000, and zero on an odd last dim.
+*/
+__forceinline__ __device__ float sinusoidal_position(int pos, int dim,
+                                                     int embedding_dim) {
+  int half_dim = embedding_dim >> 1;
+  if (dim >= half_dim * 2) return 0.f;
+  int freq_idx = dim < half_dim ? dim : dim - half_dim;
+  float freq =
+      expf(-9.210340372f * freq_idx / float(max(half_dim - 1, 1)));  // ln 1e4
+  float res_sin, res_cos;
+  sincosf(pos * freq, &res_sin, &res_cos);
+  return dim < half_dim ? res_sin : res_cos;
+}
+
+/*
+The float4 chunk idx of the position embedding of pos, of T elements and
+chunks float4 chunks per position, loaded from the table pos_emb, or computed
+by sinusoidal_position if pos_emb is nullptr, which bounds pos by no table.
+*/
+template <typename T>
+__forceinline__ __device__ float4 pos_emb_chunk(const T *pos_emb, int pos,
+                                                int idx, int chunks) {
+  if (pos_emb) {
+    return __ldg((const float4 *)pos_emb + pos * chunks + idx);
+  }
+  const int kElems = sizeof(float4) / sizeof(T);
+  float4 res;
+  T *res_t = (T *)&res;
+#pragma unroll
+  for (int i = 0; i < kElems; i++) {
+    res_t[i] = T(sinusoidal_position(pos, idx * kElems + i, chunks * kElems));
+  }
+  return res;
+}
+
 }  // namespace cuda
 }  // namespace lightseq
@@ -9,6 +9,7 @@
 #include <cublasLt.h>
 #include <cuda.h>
 #include <cuda_fp16.h>
+#include <cuda_bf16.h>
 #include <cuda_runtime.h>
 #include <mma.h>
 #include <stdio.h>
@@ -27,6 +28,13 @@ int cublas_gemm_ex(cublasHandle_t handle, cublasOperation_t transa,
                    const __half *B, __half *C,
                    cublasGemmAlgo_t algo = CUBLAS_GEMM_DEFAULT_TENSOR_OP);
 
+int cublas_gemm_ex(cublasHandle_t handle, cublasOperation_t transa,
+                   cublasOperation_t transb, int m, int n, int k,
+                   const float *alpha, const float *beta,
+                   const __nv_bfloat16 *A, const __nv_bfloat16 *B,
+                   __nv_bfloat16 *C,
+                   cublasGemmAlgo_t algo = CUBLAS_GEMM_DEFAULT_TENSOR_OP);
+
 int cublas_strided_batched_gemm(cublasHandle_t handle, int m, int n, int k,
                                 const float *alpha, const float *beta,
                                 const float *A, const float *B, float *C,
@@ -42,6 +50,13 @@ int cublas_strided_batched_gemm(
     int stride_C, int batch,
     cublasGemmAlgo_t algo = CUBLAS_GEMM_DEFAULT_TENSOR_OP);
 
+int cublas_strided_batched_gemm(
+    cublasHandle_t handle, int m, int n, int k, const float *alpha,
+    const float *beta, const __nv_bfloat16 *A, const __nv_bfloat16 *B,
+    __nv_bfloat16 *C, cublasOperation_t op_A, cublasOperation_t op_B,
+    int stride_A, int stride_B, int stride_C, int batch,
+    cublasGemmAlgo_t algo = CUBLAS_GEMM_DEFAULT_TENSOR_OP);
+
 template <typename OutType, typename ScaleType>
 void cublaslt_igemm(const int8_t *input_a, const int8_t *input_b,
                     OutType *output_c, int batch_count, int m, int n, int k,
@@ -58,6 +73,28 @@ void cublaslt_igemm(const int8_t *input_a, const int8_t *input_b,
                     cublasLtMatmulAlgo_info &algo_info,
                     cublasAlgoMap &algo_map);
 
+// output[m, n] = a_scale[0] * b_scale[0] * input_a^T * input_b + beta * output
+// of fp8 e4m3 inputs in column major, input_a is [k, m] (a row major [m, k]
+// weight) and input_b is [k, n]. The scales are device pointers, k and m
+// must be multiples of 16. Needs CUDA 11.8 and a sm_89 or later GPU.
+// input_b is in e5m2 if b_e5m2, as the grads of fp8 training.
+template <typename OutType>
+void cublaslt_fp8_gemm(const uint8_t *input_a, const uint8_t *input_b,
+                       OutType *output, int m, int n, int k,
+                       const float *a_scale, const float *b_scale, float beta,
+                       cublasLtHandle_t cublasLt_handle, cudaStream_t stream,
+                       bool b_e5m2 = false);
+
+// C = act(op(A) * op(B) + bias) in column major as cublas_gemm_ex, with the
+// bias add and the activation fused into the cublasLt epilogue, kNone for the
+// bias add only. bias is [m].
+template <typename T>
+void cublaslt_gemm_bias_act(cublasLtHandle_t cublasLt_handle,
+                            cublasOperation_t transa, cublasOperation_t transb,
+                            int m, int n, int k, const T *A, const T *B,
+                            const T *bias, T *C, ActivationType act_type,
+                            cudaStream_t stream);
+
 inline int round_up(int v, int d) { return (v + d - 1) / d * d; }
 
 void cublasLtMM_withAlgo_i8IO(int8_t *res, int batchCount, int m, int n, int k,
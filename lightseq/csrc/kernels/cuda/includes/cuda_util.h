@@ -4,6 +4,12 @@
 #include <cublasLt.h>
 #include <cuda.h>
 #include <math_constants.h>
+#ifdef LIGHTSEQ_nccl
+#include <nccl.h>
+#endif
+#ifdef LIGHTSEQ_cusparselt
+#include <cusparseLt.h>
+#endif
 
 #include <chrono>
 #include <fstream>
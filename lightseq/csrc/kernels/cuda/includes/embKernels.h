@@ -16,6 +16,14 @@ void launch_enc_emb(const T *token_emb, const T *pos_emb, const int *tokens,
                     int seq_len, int hidden_dim, cudaStream_t stream,
                     const T *lang_emb, const int *lang_id, int multilg_type);
 
+// launch_enc_emb with multilg_type 0 followed by the layer normalization of
+// its output by scale and bias, in one kernel.
+template <typename T>
+void launch_enc_emb_ln(const T *token_emb, const T *pos_emb, const int *tokens,
+                       const T *scale, const T *bias, T *output, T *pad_mask,
+                       int pad_id, int batch_size, int seq_len,
+                       int hidden_dim, cudaStream_t stream);
+
 template <typename T>
 void launch_dec_emb(const T *token_emb, const T *pos_emb, int *tokens,
                     const T *lang_emb, const int *lang_id, T *output,
@@ -22,6 +22,43 @@ namespace cuda {
       AT_ERROR(#NAME, " not implemented for '", toString(TYPE), "'"); \
   }
 
+#define DISPATCH_FLOAT_AND_BFLOAT16(TYPE, LEVEL, NAME, ...)           \
+  switch (TYPE) {                                                     \
+    case at::ScalarType::Float: {                                     \
+      using scalar_t_##LEVEL = float;                                 \
+      __VA_ARGS__;                                                    \
+      break;                                                          \
+    }                                                                 \
+    case at::ScalarType::BFloat16: {                                  \
+      using scalar_t_##LEVEL = at::BFloat16;                          \
+      __VA_ARGS__;                                                    \
+      break;                                                          \
+    }                                                                 \
+    default:                                                          \
+      AT_ERROR(#NAME, " not implemented for '", toString(TYPE), "'"); \
+  }
+
+#define DISPATCH_FLOAT_HALF_AND_BFLOAT16(TYPE, LEVEL, NAME, ...)      \
+  switch (TYPE) {                                                     \
+    case at::ScalarType::Float: {                                     \
+      using scalar_t_##LEVEL = float;                                 \
+      __VA_ARGS__;                                                    \
+      break;                                                          \
+    }                                                                 \
+    case at::ScalarType::Half: {                                      \
+      using scalar_t_##LEVEL = at::Half;                              \
+      __VA_ARGS__;                                                    \
+      break;                                                          \
+    }                                                                 \
+    case at::ScalarType::BFloat16: {                                  \
+      using scalar_t_##LEVEL = at::BFloat16;                          \
+      __VA_ARGS__;                                                    \
+      break;                                                          \
+    }                                                                 \
+    default:                                                          \
+      AT_ERROR(#NAME, " not implemented for '", toString(TYPE), "'"); \
+  }
+
 #define DISPATCH_DOUBLE_FLOAT_AND_HALF(TYPE, LEVEL, NAME, ...)        \
   switch (TYPE) {                                                     \
     case at::ScalarType::Double: {                                    \
@@ -69,5 +106,47 @@ void apex_fused_adam_cuda(at::Tensor& p, at::Tensor& p_copy, at::Tensor& m,
                           at::Tensor& v, at::Tensor& g, float lr, float beta1,
                           float beta2, float eps, float grad_scale, int step,
                           int mode, int bias_correction, float decay);
+
+// Adam of the rows of the sparse embedding grads, see fused_adam_kernel.cu.
+// p, m and v are fp32 [*, row_dim], g the [rows.numel(), row_dim] grads of
+// the rows, of which the first num_rows, a device int, are updated.
+// last_step, [*] int or empty, lazily decays the moments of every row.
+void sparse_adam_cuda(at::Tensor& p, at::Tensor& p_copy, at::Tensor& m,
+                      at::Tensor& v, at::Tensor& rows, at::Tensor& num_rows,
+                      at::Tensor& g, at::Tensor& last_step, float lr,
+                      float beta1, float beta2, float eps, float grad_scale,
+                      int step, int mode, int bias_correction, float decay);
+
+// Multi tensor optimizers, see fused_adam_kernel.cu. The global norm of the
+// grads, noop_flag is set when some grad is inf or nan.
+at::Tensor multi_tensor_grad_norm_cuda(at::Tensor& noop_flag,
+                                       std::vector<at::Tensor>& grads);
+
+// tensor_lists is {grads, params, exp_avgs, exp_avg_sqs} with an optional
+// list of the fp16 params last.
+void multi_tensor_adamw_cuda(
+    at::Tensor& noop_flag, std::vector<std::vector<at::Tensor>>& tensor_lists,
+    at::Tensor& grad_norm, float lr, float beta1, float beta2, float eps,
+    float grad_scale, float max_grad_norm, int step, int mode,
+    int bias_correction, float decay);
+
+void multi_tensor_lamb_cuda(
+    at::Tensor& noop_flag, std::vector<std::vector<at::Tensor>>& tensor_lists,
+    at::Tensor& grad_norm, float lr, float beta1, float beta2, float eps,
+    float grad_scale, float max_grad_norm, int step, int mode,
+    int bias_correction, float decay);
+
+// AdamW of bf16 params, without fp32 master weights: tensor_lists is {grads,
+// params, exp_avgs, exp_avg_sqs}, the params bf16 and updated in place with
+// the stochastic rounding of seed, the grads bf16 or fp32. The moments are
+// fp32 if scale_lists is empty, or else int8 and uint8 blockwise quantized
+// with the scale_lists {exp_avg_scales, exp_avg_sq_scales}, fp32 of one scale
+// per 256 elements, see fused_adam_kernel.cu.
+void multi_tensor_adamw_bf16_cuda(
+    at::Tensor& noop_flag, std::vector<std::vector<at::Tensor>>& tensor_lists,
+    std::vector<std::vector<at::Tensor>>& scale_lists, at::Tensor& grad_norm,
+    float lr, float beta1, float beta2, float eps, float grad_scale,
+    float max_grad_norm, int step, int mode, int bias_correction, float decay,
+    int64_t seed);
 }  // namespace cuda
 }  // namespace lightseq
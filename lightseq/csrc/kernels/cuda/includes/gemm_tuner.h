@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cublasLt.h>
+#include <cuda.h>
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
+#include <cuda_runtime.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace lightseq {
+namespace cuda {
+
+// Workspace of the tuned cublasLt algos of one stream, large enough for the
+// split-K and the Hopper kernels.
+const size_t kGemmTunerWorkspaceSize = 32 << 20;
+
+// The config of a cublasLt algo, which can be stored in a file and turned
+// back into a cublasLtMatmulAlgo_t, see GemmTuner. With a backend >= 0 it
+// is the variant algo_id of that GemmBackend of the tuner instead.
+struct GemmAlgoConfig {
+  int algo_id, tile, stages, splitk, reduction_scheme, swizzle, custom_option;
+  size_t workspace_size;
+  float time_us;
+  int backend = -1;
+};
+
+// A gemm laid out as cublas_strided_batched_gemm, column major.
+struct GemmShape {
+  cublasOperation_t transa, transb;
+  int m, n, k, batch;
+  int64_t stride_a, stride_b, stride_c;
+  cudaDataType_t dtype;
+};
+
+/*
+A gemm implementation besides cublasLt, eg. kernels of the shapes which the
+cublasLt algos are poor at or of custom epilogues. The tuner times the
+variants of every backend of a shape with the cublasLt algos and keeps the
+fastest of all, see GemmTuner::add_backend.
+*/
+class GemmBackend {
+ public:
+  virtual ~GemmBackend() {}
+  // the name in the config files, without spaces.
+  virtual std::string name() const = 0;
+  // the variants worth timing on shape, eg. tilings, none if the backend
+  // does not support it.
+  virtual std::vector<int> variants(const GemmShape &shape) const = 0;
+  // C = alpha * op(A) * op(B) + beta * C in variant, with a workspace of
+  // kGemmTunerWorkspaceSize bytes. Returns false if it could not launch.
+  virtual bool run(const GemmShape &shape, int variant, const float *alpha,
+                   const float *beta, const void *A, const void *B, void *C,
+                   void *workspace, cudaStream_t stream) = 0;
+};
+
+/*
+Runtime autotuning of the cublasLt algos of the gemms of the new arch. The
+first gemm of every (transa, transb, m, n, k, batch, dtype) times the algos
+of the cublasLt heuristics and their split-K variants on the real operands
+and keeps the fastest. The results are cached in a file per GPU SKU and
+cuBLAS version, gemm_<gpu>_sm<sm>.cfg in LIGHTSEQ_GEMM_CONFIG_DIR or
+~/.lightseq/gemm_configs/, which is loaded when the tuner of a device is
+created, so that a shape is tuned once per SKU.
+
+Besides cublasLt the tuner times its GemmBackends, SkinnyGemmBackend for
+the few tokens of the decode steps by default.
+
+Tuning is on with LIGHTSEQ_GEMM_TUNE=1. Shapes met during a cuda graph
+capture are not tuned, see cublaslt_tuned_gemm.
+*/
+class GemmTuner {
+ private:
+  int _device;
+  std::string _config_path;
+  std::map<std::vector<int>, GemmAlgoConfig> _algo_map;
+  std::map<cudaStream_t, void *> _workspaces;
+  std::vector<std::unique_ptr<GemmBackend>> _backends;
+  std::mutex _mutex;
+
+  explicit GemmTuner(int device);
+  void load_config();
+  void save_config(const std::vector<int> &key, const GemmAlgoConfig &config);
+  void *workspace(cudaStream_t stream);
+
+ public:
+  ~GemmTuner();
+
+  static bool enabled();
+  // The tuner of the current device.
+  static GemmTuner &instance();
+
+  // Time the variants of backend too from now on. The shapes tuned already
+  // keep their algos, including the ones loaded from the config file,
+  // which are tuned again only in a new directory of
+  // LIGHTSEQ_GEMM_CONFIG_DIR.
+  void add_backend(std::unique_ptr<GemmBackend> backend);
+
+  // See cublaslt_tuned_gemm.
+  template <typename T>
+  bool gemm(cublasLtHandle_t handle, cublasOperation_t transa,
+            cublasOperation_t transb, int m, int n, int k, const float *alpha,
+            const float *beta, const T *A, const T *B, T *C, int batch,
+            int64_t stride_a, int64_t stride_b, int64_t stride_c,
+            cudaStream_t stream);
+};
+
+// C = alpha * op(A) * op(B) + beta * C in column major like
+// cublas_strided_batched_gemm, batch 1 is cublas_gemm_ex, with the fastest
+// cublasLt algo of the shape. Returns false when tuning is off or the shape
+// has no tuned algo yet during a cuda graph capture, the caller then falls
+// back to the cublas_* wrappers.
+template <typename T>
+bool cublaslt_tuned_gemm(cublasLtHandle_t handle, cublasOperation_t transa,
+                         cublasOperation_t transb, int m, int n, int k,
+                         const float *alpha, const float *beta, const T *A,
+                         const T *B, T *C, cudaStream_t stream, int batch = 1,
+                         int64_t stride_a = 0, int64_t stride_b = 0,
+                         int64_t stride_c = 0) {
+  if (!GemmTuner::enabled()) return false;
+  return GemmTuner::instance().gemm(handle, transa, transb, m, n, k, alpha,
+                                    beta, A, B, C, batch, stride_a, stride_b,
+                                    stride_c, stream);
+}
+
+}  // namespace cuda
+}  // namespace lightseq
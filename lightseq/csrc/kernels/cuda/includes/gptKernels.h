@@ -19,6 +19,9 @@ token_id: input token id, [batch_size, beam_size, max_step]
 output: result, [batch_size, token_seq_len, hidden_size]
 padding_id, the padding_id, default 0
 pos_offset: get real pos when decoding which gridDim.y=1
+positions: [batch_size, beam_size, max_step], the position of every token,
+  eg. its depth in a token tree. nullptr for the position after the left
+  padding
 */
 
 template <typename T>
@@ -26,7 +29,8 @@ void launch_gpt_embedding(const T* token_emb, const T* pos_emb,
                           const int* tokens, T* output, T* pad_mask_ptr,
                           int* left_pad_len_ptr, int batch_size, int beam_size,
                           int hidden_dim, int step_offset, int seq_len,
-                          int max_step, int padding_id, cudaStream_t stream);
+                          int max_step, int padding_id, cudaStream_t stream,
+                          const int* positions = nullptr);
 
 template <typename T>
 void ker_correlation_softmax_gpt_launcher(int batch_size, int batch_seq_len,
@@ -54,6 +58,20 @@ void ker_ppl_launcher(int batch_size, int batch_seq_len,
                       const T* logits, const int* input_ids,
                       const int* real_seq_len, float* ppl, int vocab_size);
 
+// gather the row_idx rows of input, [rows, hidden_size]
+template <typename T>
+void ker_gather_rows_launcher(int rows, int hidden_size,
+                              int max_thread_per_block, cudaStream_t stream,
+                              const T* input, const int* row_idx, T* output);
+
+// log softmax of every row of logits at its target token, fused over a
+// single read of the logits, see ker_target_log_prob
+template <typename T>
+void ker_target_log_prob_launcher(int rows, int max_thread_per_block,
+                                  cudaStream_t stream, const T* logits,
+                                  const int* target_ids, float* log_probs,
+                                  int vocab_size);
+
 template <typename T>
 void ker_topk_sample_launcher(int batch_size, int batch_seq_len,
                               int logits_seq_len, int max_thread_per_block,
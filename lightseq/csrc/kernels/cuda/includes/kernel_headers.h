@@ -1,6 +1,7 @@
 #pragma once
 #include <cuda.h>
 #include <cuda_fp16.h>
+#include <cuda_bf16.h>
 #include <cuda_runtime_api.h>
 #include <cublas_v2.h>
 #include <type_traits>
@@ -20,4 +21,7 @@
 #include "transformerKernels.h"
 #include "cuda_util.h"
 #include "cublas_wrappers.h"
+#include "gemm_tuner.h"
+#include "sparse24_gemm.h"
 #include "llama_kernels.h"
+#include "moe_kernels.h"
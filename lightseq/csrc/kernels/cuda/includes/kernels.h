@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cublas_v2.h>
 #include <cuda.h>
+#include <cuda_bf16.h>
 #include <cuda_fp16.h>
 #include <curand_kernel.h>
 #include <stdio.h>
@@ -13,7 +15,11 @@
 #define WARP_SIZE 32
 namespace lightseq {
 
-enum class ActivationType { kRelu, kGelu };
+// kNone is the bias add only of cublaslt_gemm_bias_act.
+enum class ActivationType { kRelu, kGelu, kNone };
+// the pooling of the tokens of a sequence into one vector, see
+// launch_sequence_pooling.
+enum class PoolingMethod { kCls, kMean, kMax };
 enum LSLayout { kRowMajor, kColMajor, kCol32, kCOL4_4R2_8C, kCOL32_2R_4R4 };
 
 namespace cuda {
@@ -26,17 +32,50 @@ void launch_layer_norm(T *ln_res, T *vars, T *means, const T *inp,
                        const T *scale, const T *bias, int batch_size,
                        int hidden_dim, cudaStream_t stream);
 
+// The layer norm quantized by clip_max_out[0], the prologue of the int8
+// gemm of QAT: ln_res, if not nullptr, also gets the float result for the
+// backward, alpha, if not nullptr, the [batch_size] igemm alpha of the
+// clip_max_out of a linear as in launch_quantize, and q_out is col32 with
+// out_col32.
 template <typename T>
 void launch_layer_norm_i8(int8_t *q_out, uint8_t *clip_mask_out, T *vars,
                           T *means, const T *inp, const T *gamma,
                           const T *betta, const T *clip_max_out, int batch_size,
-                          int hidden_dim, cudaStream_t stream);
+                          int hidden_dim, cudaStream_t stream,
+                          T *ln_res = nullptr, float *alpha = nullptr,
+                          bool out_col32 = false);
 template <typename T>
 void launch_ln_bw(T *gamma_grad, T *betta_grad, T *inp_grad, const T *out_grad,
                   const T *residual_grad, const T *inp_or_out, const T *gamma,
                   const T *betta, const T *vars, const T *means, int batch,
                   int hidden_dim, cudaStream_t stream[2]);
 
+// Fused layer norm backward, dinp and per block partial dgamma / dbetta in
+// one pass over the activations, then a deterministic reduce of the partials.
+// workspace: fp32 [ln_bw_workspace_size(hidden_dim)], the other params are
+// the ones of launch_ln_bw.
+const int kNormBwPartBlocks = 512;
+inline size_t ln_bw_workspace_size(int hidden_dim) {
+  return size_t(kNormBwPartBlocks) * 2 * hidden_dim;
+}
+
+template <typename T>
+void launch_ln_bw_fused(T *gamma_grad, T *betta_grad, T *inp_grad,
+                        const T *out_grad, const T *residual_grad,
+                        const T *inp_or_out, const T *gamma, const T *betta,
+                        const T *vars, const T *means, float *workspace,
+                        int batch, int hidden_dim, cudaStream_t stream);
+
+// RMS norm backward in the same way, rms_vars is rsqrt(mean(x^2) + eps) of
+// launch_rms_layer_norm. inp_or_out is the norm output if inp_is_out, so it
+// works when the input was overwritten after the forward.
+template <typename T>
+void launch_rms_ln_bw(T *gamma_grad, T *inp_grad, const T *out_grad,
+                      const T *residual_grad, const T *inp_or_out,
+                      const T *gamma, const T *rms_vars, bool inp_is_out,
+                      float *workspace, int batch, int hidden_dim,
+                      cudaStream_t stream);
+
 template <typename T>
 void launch_quant_ln_bw(T *gamma_grad, T *betta_grad, T *inp_grad, T *cmax_grad,
                         const T *out_grad, const T *residual_grad,
@@ -44,25 +83,287 @@ void launch_quant_ln_bw(T *gamma_grad, T *betta_grad, T *inp_grad, T *cmax_grad,
                         const T *vars, const T *means, const uint8_t *cmask,
                         int batch, int hidden_dim, cudaStream_t stream[2]);
 
+// seq_ids masks the attention between the sequences of a packed batch, see
+// ker_attn_softmax.
 template <typename T>
 void launch_attn_softmax(T *vals, const T *attn_mask, int batch_size, int heads,
                          int from_len, int to_len, bool mask_future,
-                         cudaStream_t stream);
+                         cudaStream_t stream, const int *seq_ids = nullptr);
 
 template <typename T>
 void launch_attn_softmax_bw(T *out_grad, const T *soft_inp, int rows,
                             int softmax_len, cudaStream_t stream);
 
+// to_len beyond 1024 runs ker_attn_softmax_long, which has no length limit.
 template <typename T>
 void launch_attn_softmax_new(T *out, T *inp, const T *attn_mask, int batch_size,
                              int heads, int from_len, int to_len, int kv_size,
                              bool mask_future, cudaStream_t stream);
 
+// Largest head_dim supported by launch_flash_attention.
+const int kFlashAttnMaxHeadDim = 256;
+// Most (batch * head, split) partial states of the split decode kernel, the
+// workspace of launch_flash_attention holds
+// kFlashMaxPartials * (head_dim + 2) floats.
+const int kFlashMaxPartials = 2048;
+
+// Fused attention with online softmax, see ker_flash_attention. The single
+// query case splits long contexts across blocks when a workspace is given,
+// see ker_flash_decoding. kv_head_num < nhead is grouped-query attention, 0
+// means nhead. CacheT is T, or int8_t for a kv cache quantized with one scale
+// per head vector in k_scale / v_scale. pos_bias is a relative position bias
+// of [nhead, 2 * pos_bias_len - 1] indexed by the key minus the query
+// position, for kv_len <= pos_bias_len. out_token_major writes out as
+// [batch_size, q_len, nhead, head_dim] rather than [batch_size, nhead, q_len,
+// head_dim], which saves the transpose before the output linear. kv_rows of
+// [batch_size, kv_size] reads every key of a batch row from another row of
+// k, v, eg. the beam which computed it, nullptr for the row itself.
+// ring_size > 0 reads a ring of kv_size rows, where the first kv_size -
+// ring_size positions, the attention sinks, keep their rows and the later
+// ones take the last ring_size rows in turn, see kv_cache_row. kv_len counts
+// the positions then, it may exceed kv_size, and mask is indexed by position
+// with a row of mask_size, 0 for kv_size. window > 0 attends to the sinks and
+// to the keys less than window positions before the query only. tree_mask of
+// [batch_size, tree_len, tree_len] masks the attention among the last
+// tree_len positions, which are queries: the query at tree_start + i attends
+// to the key at tree_start + j, tree_start = kv_len - tree_len, only if
+// tree_mask[b][i][j] is non zero, eg. the tokens of a token tree attend to
+// their ancestors and themselves. It is on top of mask_future. heavy_pos of
+// [batch_size, kv_head_num, kv_size - ring_size] holds the positions of the
+// heavy hitters in the sink rows of a ring, -1 for a row of its own
+// position, see launch_evict_heavy_hitters. kv_mass of [batch_size,
+// kv_head_num, kv_size] accumulates the attention probabilities of every
+// row over the queries and their heads, fused into the softmax of a single
+// query, with mass_workspace of batch_size * nhead * max(kv_size, q_len)
+// floats. Both are for a ring without kv_rows only.
+template <typename T, typename CacheT>
+void launch_flash_attention(const T *q, const CacheT *k, const CacheT *v,
+                            const T *mask, T *out, int batch_size, int nhead,
+                            int q_len, int kv_len, int kv_size, int head_dim,
+                            bool mask_future, cudaStream_t stream,
+                            float *workspace = nullptr, int kv_head_num = 0,
+                            const float *k_scale = nullptr,
+                            const float *v_scale = nullptr,
+                            const T *pos_bias = nullptr,
+                            int pos_bias_len = 0,
+                            bool out_token_major = false,
+                            const int *kv_rows = nullptr, int ring_size = 0,
+                            int window = 0, int mask_size = 0,
+                            const unsigned char *tree_mask = nullptr,
+                            int tree_len = 0,
+                            const int *heavy_pos = nullptr,
+                            float *kv_mass = nullptr,
+                            float *mass_workspace = nullptr);
+
+// Keep the kv_size - ring_size keys of the most attention mass out of the
+// window of a kv ring in its sink rows, see ker_evict_heavy_hitters. Called
+// after the launch_flash_attention of num_evict queries with kv_mass, which
+// pushed num_evict keys out of the window, and ring_size >= window +
+// num_evict - 1 so that those are still in the ring. k, v, their scales and
+// kv_mass are updated in place.
+template <typename CacheT>
+void launch_evict_heavy_hitters(CacheT *k, CacheT *v, float *k_scale,
+                                float *v_scale, int *heavy_pos,
+                                float *kv_mass, int batch_size,
+                                int kv_head_num, int kv_len, int num_evict,
+                                int kv_size, int ring_size, int window,
+                                int head_dim, cudaStream_t stream);
+
+// Largest head_dim supported by the flash attention of training.
+const int kFlashAttnBwMaxHeadDim = 128;
+
+// Flash attention of training, launch_flash_attention with the attention
+// dropout of dropout_ratio, which also writes the log of the softmax
+// denominator of every query to lse of [batch_size, nhead, q_len] for
+// launch_flash_attention_bw. q, out: [batch_size, nhead, q_len, head_dim],
+// k, v: [batch_size, nhead, kv_len, head_dim], mask: [batch_size, kv_len].
+template <typename T>
+void launch_flash_attention_train(
+    const T *q, const T *k, const T *v, const T *mask, T *out, float *lse,
+    int batch_size, int nhead, int q_len, int kv_len, int head_dim,
+    bool mask_future, float dropout_ratio, int seed, cudaStream_t stream,
+    const unsigned long long *rng_offset = nullptr);
+
+// Its backward, which recomputes the attention probabilities from q, k and
+// lse, so the memory is linear in the sequence length. The dropout mask is
+// redrawn from the seed of the forward. workspace: fp32
+// [batch_size * nhead * q_len].
+template <typename T>
+void launch_flash_attention_bw(T *dq, T *dk, T *dv, const T *dout,
+                               const T *q, const T *k, const T *v,
+                               const T *mask, const T *out, const float *lse,
+                               float *workspace, int batch_size, int nhead,
+                               int q_len, int kv_len, int head_dim,
+                               bool mask_future, float dropout_ratio,
+                               int seed, cudaStream_t stream,
+                               const unsigned long long *rng_offset = nullptr);
+
+// Attention of an encoder over packed sequences, see
+// ker_varlen_flash_attention. qkv is the [valid_tokens, 3 * nhead * head_dim]
+// output of the qkv linear without its bias, max_seq_len bounds the
+// sequences of cu_seqlens.
+template <typename T>
+void launch_varlen_flash_attention(const T *qkv, const T *qkv_bias, T *out,
+                                   const int *cu_seqlens, int batch_size,
+                                   int nhead, int max_seq_len, int head_dim,
+                                   cudaStream_t stream);
+
+// Block-sparse self attention of an encoder, see
+// ker_block_sparse_attention. qkv is the [batch_size, seq_len, 3 * nhead *
+// head_dim] output of the qkv linear without its bias, the key blocks of
+// query block i are layout_blocks[layout_offsets[i], layout_offsets[i + 1]).
+// block_size is a multiple of WARP_SIZE.
+template <typename T>
+void launch_block_sparse_attention(const T *qkv, const T *qkv_bias,
+                                   const T *mask, T *out,
+                                   const int *layout_offsets,
+                                   const int *layout_blocks, int batch_size,
+                                   int nhead, int seq_len, int head_dim,
+                                   int block_size, cudaStream_t stream);
+
+// Speculative decoding, see ker_speculative_sample and
+// ker_speculative_verify. Both run one block, counter selects the random
+// subsequence of seed and must differ between calls.
+template <typename T>
+void launch_speculative_sample(const T *logits, int *token, int vocab_size,
+                               bool greedy, unsigned long long seed,
+                               unsigned long long counter, cudaStream_t stream);
+
+template <typename T>
+void launch_speculative_verify(const T *target_logits, const T *draft_logits,
+                               int *tokens, int *num_tokens, int num_draft,
+                               int vocab_size, bool greedy,
+                               unsigned long long seed,
+                               unsigned long long counter, cudaStream_t stream);
+
+// Weight-only quantized linear, see ker_weight_only_gemv. qweight holds
+// quant_bits 8 or 4 signed integers of the [in_dim, out_dim] weight, int4
+// packs rows 2i and 2i + 1 into the low and high nibble of one byte, and
+// scale holds one scale per group_size rows of every column. out_dim must be
+// a multiple of 4. The gemv reads the weight once per 4 tokens, more than
+// kWeightOnlyMaxGemvTokens tokens go through launch_weight_only_dequant and
+// a dense gemm instead.
+const int kWeightOnlyMaxGemvTokens = 8;
+
+template <typename T>
+void launch_weight_only_gemv(const T *inp, const int8_t *qweight,
+                             const T *scale, T *out, int batch_tokens,
+                             int in_dim, int out_dim, int quant_bits,
+                             int group_size, bool accumulate,
+                             cudaStream_t stream);
+
+// Dequantize the columns [col_begin, col_begin + num_cols) of the weight
+// into the [in_dim, num_cols] weight, num_cols 0 for all of them.
+template <typename T>
+void launch_weight_only_dequant(const int8_t *qweight, const T *scale,
+                                T *weight, int in_dim, int out_dim,
+                                int quant_bits, int group_size,
+                                cudaStream_t stream, int col_begin = 0,
+                                int num_cols = 0);
+
+// Gate/up linear fused with SiLU(gate) * up, see ker_gemv_swiglu. The weight
+// is [in_dim, 2 * inner_dim] with the gate in the first inner_dim columns,
+// plain or quantized as in launch_weight_only_gemv, and inner_dim must be a
+// multiple of 4. More than kSwiGLUMaxGemvTokens tokens are compute bound and
+// go through a dense gemm and launch_silu_elewise_product instead.
+const int kSwiGLUMaxGemvTokens = 8;
+
+template <typename T>
+void launch_gemv_swiglu(const T *inp, const T *weight, T *out,
+                        int batch_tokens, int in_dim, int inner_dim,
+                        cudaStream_t stream);
+
+template <typename T>
+void launch_weight_only_gemv_swiglu(const T *inp, const int8_t *qweight,
+                                    const T *scale, T *out, int batch_tokens,
+                                    int in_dim, int inner_dim, int quant_bits,
+                                    int group_size, cudaStream_t stream);
+
+// Low rank adapters of a batch with one adapter per row, SGMV style: row r
+// uses the adapter of slot row_slots[r], none when it is -1. a_ptrs and
+// b_ptrs hold the [rank, in_dim] A and the [rank, out_dim] B of every slot,
+// zero padded to rank. shrink computes tmp = inp * A^T, expand adds
+// scales[slot] * tmp * B to out.
+template <typename T>
+void launch_lora_shrink(const T *inp, const T *const *a_ptrs,
+                        const int *row_slots, float *tmp, int rows,
+                        int in_dim, int rank, cudaStream_t stream);
+
+template <typename T>
+void launch_lora_expand(const float *tmp, const T *const *b_ptrs,
+                        const float *scales, const int *row_slots, T *out,
+                        int rows, int rank, int out_dim, cudaStream_t stream);
+
 template <typename T>
 void launch_attn_softmax_bw_new(T *inp_grad, const T *out_grad,
                                 const T *soft_inp, int rows, int softmax_len,
                                 cudaStream_t stream);
 
+const int kAdaptiveSoftmaxThreads = 1024;
+// bisection steps of the topk-th head logit of launch_adaptive_head.
+const int kAdaptiveBisectIters = 24;
+
+// The adaptive softmax of an output head, the log probs of the vocab of
+// out [rows, vocab_size] in three steps. launch_adaptive_head writes the log
+// softmax of head [rows, head_size + num_clusters] over the frequent tokens
+// [0, head_size) and one logit per tail cluster: the tokens into out, the
+// clusters into cluster_logp [rows, num_clusters], and flags in
+// cluster_flags [num_clusters] the clusters which may hold one of the topk
+// tokens of a row, all of them with topk <= 0. For every flagged cluster,
+// launch_adaptive_tail adds the log softmax of its tail logits [rows,
+// cluster_size] to the log prob of the cluster into out from cutoff on.
+// launch_adaptive_skip puts the log prob of any other cluster on its first
+// token begin and -inf on the rest of [begin, end): the first token ranks
+// below the topk of every row and keeps the normalizer of the row exact for
+// the generators which take a log softmax of their logits again.
+template <typename T>
+void launch_adaptive_head(T *out, float *cluster_logp, int *cluster_flags,
+                          const T *head, int rows, int head_size,
+                          int num_clusters, int vocab_size, int topk,
+                          cudaStream_t stream);
+
+template <typename T>
+void launch_adaptive_tail(T *out, const T *tail, const float *cluster_logp,
+                          int rows, int cluster_size, int cutoff,
+                          int cluster_idx, int num_clusters, int vocab_size,
+                          cudaStream_t stream);
+
+template <typename T>
+void launch_adaptive_skip(T *out, const float *cluster_logp, int rows,
+                          int begin, int end, int cluster_idx,
+                          int num_clusters, int vocab_size,
+                          cudaStream_t stream);
+
+// Varlen execution of the encoders: the tokens of a padded [batch_size,
+// seq_len] batch which are not padding_id are packed contiguously, sequence b
+// being the packed tokens [cu_seqlens[b], cu_seqlens[b + 1]), and
+// packed_to_padded holds the padded position of every packed token.
+void launch_varlen_offsets(const int *tokens, int *cu_seqlens,
+                           int *packed_to_padded, int batch_size, int seq_len,
+                           int padding_id, cudaStream_t stream);
+
+// [batch_size * seq_len, hidden_dim] -> [valid_tokens, hidden_dim]
+template <typename T>
+void launch_remove_padding(const T *inp, T *out, const int *packed_to_padded,
+                           int valid_tokens, int hidden_dim,
+                           cudaStream_t stream);
+
+// [valid_tokens, hidden_dim] -> [batch_tokens, hidden_dim], zeros at the
+// padding tokens.
+template <typename T>
+void launch_rebuild_padding(const T *inp, T *out, const int *packed_to_padded,
+                            int valid_tokens, int batch_tokens, int hidden_dim,
+                            cudaStream_t stream);
+
+// [batch_size, seq_len, hidden_dim] -> [batch_size, hidden_dim], the first
+// token of a sequence for kCls, the mean or the max of its tokens which are
+// not padding_id otherwise, then divided by its l2 norm if l2_norm.
+template <typename T, typename OutT>
+void launch_sequence_pooling(const T *inp, const int *tokens, OutT *out,
+                             int batch_size, int seq_len, int hidden_dim,
+                             int padding_id, PoolingMethod method,
+                             bool l2_norm, cudaStream_t stream);
+
 //[sz0, sz1, sz2, sz3] -> [sz0, sz2, sz1, sz3]
 template <typename T>
 void launch_transform_0213(const T *input, T *output, int sz0, int sz1, int sz2,
@@ -109,31 +410,90 @@ void launch_transform_0213_dcmax(T *output, T *grad_cmax, const T *vals,
                                  int seq_len, int hidden_dim, int nhead,
                                  cudaStream_t stream);
 
+// A fresh seed of the dropout masks, the launchers below draw one when seed
+// is negative. Launching with a saved seed regenerates the same mask, eg. when
+// a layer is recomputed in backward. The forward launchers store no mask when
+// it is nullptr, the backward ones then redraw it from the seed of the
+// forward with the counter-based Philox generator.
+int ls_dropout_seed();
+
+// The Philox key of a dropout mask, the seed in the low 32 bits and the
+// device counter *rng_offset, if not nullptr, in the high ones. A layer of a
+// fixed seed advances its counter with launch_ls_dropout_step on the stream
+// instead of drawing a seed on the host, so every replay of a captured cuda
+// graph draws fresh masks. The launchers below take it as rng_offset.
+__forceinline__ __device__ unsigned long long ls_dropout_key(
+    int seed, const unsigned long long *rng_offset) {
+  unsigned long long key = static_cast<unsigned>(seed);
+  return rng_offset ? key + (*rng_offset << 32) : key;
+}
+
+// A zeroed rng_offset of a dropout operator, freed with cudaFree.
+unsigned long long *ls_dropout_new_rng_offset();
+
+void launch_ls_dropout_step(unsigned long long *rng_offset,
+                            cudaStream_t stream);
+
 template <typename T>
 void launch_ls_dropout(T *out, const T *vals, uint8_t *mask, int total_count,
-                       float ratio, cudaStream_t stream, bool backward = false);
+                       float ratio, cudaStream_t stream, bool backward = false,
+                       int seed = -1,
+                       const unsigned long long *rng_offset = nullptr);
 
 template <typename T>
 void launch_ls_dropout_res_bias(T *out, const T *vals, uint8_t *mask,
                                 const T *bias, const T *residual,
                                 int total_count, int dim, float ratio,
-                                cudaStream_t stream);
+                                cudaStream_t stream, int seed = -1,
+                                const unsigned long long *rng_offset = nullptr);
+
+// Fused bias, dropout, residual and layer norm, res_out is the residual sum
+// of launch_ls_dropout_res_bias, with the same mask for a given seed, and
+// ln_res, vars and means its launch_layer_norm. vars and means are nullptr
+// for inference.
+template <typename T>
+void launch_ls_dropout_res_bias_ln(
+    T *ln_res, T *res_out, T *vars, T *means, uint8_t *mask, const T *inp,
+    const T *bias, const T *residual, const T *gamma, const T *betta, int rows,
+    int hidden_dim, float ratio, cudaStream_t stream, int seed = -1,
+    const unsigned long long *rng_offset = nullptr);
+
+// Its backward in one pass like launch_ln_bw_fused, res_out_grad is maybe
+// nullptr, residual_grad is overwritten if residual_cover else accumulated.
+// workspace: fp32 [ln_dropout_bw_workspace_size(hidden_dim)].
+inline size_t ln_dropout_bw_workspace_size(int hidden_dim) {
+  return size_t(kNormBwPartBlocks) * 3 * hidden_dim;
+}
+
+template <typename T>
+void launch_ls_dropout_res_bias_ln_bw(
+    T *inp_grad, T *bias_grad, T *residual_grad, T *gamma_grad, T *betta_grad,
+    const T *out_grad, const T *res_out_grad, const T *res_out,
+    const T *gamma, const T *vars, const T *means, const uint8_t *mask,
+    bool residual_cover, float *workspace, int rows, int hidden_dim,
+    float ratio, cudaStream_t stream, int seed,
+    const unsigned long long *rng_offset = nullptr);
 
 template <ActivationType, typename T>
 void launch_ls_dropout_act_bias(T *out, const T *vals, uint8_t *mask,
                                 const T *bias, int total_count, int dim,
-                                float ratio, cudaStream_t stream);
+                                float ratio, cudaStream_t stream,
+                                int seed = -1,
+                                const unsigned long long *rng_offset = nullptr);
 
 template <typename T>
 void launch_ls_dropout_bias_bwd(T *in_grad, T *bias_grad, const T *out_grad,
                                 const uint8_t *mask, int row_size, int dim,
-                                float ratio, cudaStream_t stream);
+                                float ratio, cudaStream_t stream,
+                                int seed = -1,
+                                const unsigned long long *rng_offset = nullptr);
 
 template <ActivationType act_type, typename T>
-void launch_ls_dropout_act_bias_bwd(T *in_grad, T *bias_grad, const T *input,
-                                    const T *bias, const T *out_grad,
-                                    const uint8_t *mask, int row_size, int dim,
-                                    float ratio, cudaStream_t stream);
+void launch_ls_dropout_act_bias_bwd(
+    T *in_grad, T *bias_grad, const T *input, const T *bias, const T *out_grad,
+    const uint8_t *mask, int row_size, int dim, float ratio,
+    cudaStream_t stream, int seed = -1,
+    const unsigned long long *rng_offset = nullptr);
 
 template <ActivationType act_type, typename T>
 void launch_ls_quant_dropout_act_bias(int8_t *qout, uint8_t *cmask_out,
@@ -192,6 +552,10 @@ template <typename T>
 void launch_fused_add2(T *out, const T *inp1, const T *inp2, int batch_size,
                        int seq_len, int hidden_size, cudaStream_t &stream);
 
+// out += inp of nele elements of any alignment.
+template <typename T>
+void launch_accumulate(T *out, const T *inp, int nele, cudaStream_t stream);
+
 template <typename T>
 void launch_cross_entropy_fw(const T *inputs_ptr, const int *targets_ptr,
                              float *outputs_ptr, float *nll_loss_ptr,
@@ -207,12 +571,46 @@ void launch_cross_entropy_bw(const float *grad_outputs_ptr, const T *inputs_ptr,
                              const int batch_size, const int seq_len,
                              const int vocab_size, cudaStream_t stream);
 
+/* Cross entropy of logits = inputs * weight^T without the full logits, the
+ * vocab is projected chunk_size rows of weight at a time into logits_buffer,
+ * [num_tokens, chunk_size]. inputs: [num_tokens, hidden_size], weight:
+ * [vocab_size, hidden_size]. The forward writes the logsumexp of every token
+ * to lse_ptr, which the backward takes. loss_buffer: [num_tokens * 2],
+ * stats_buffer: [num_tokens * 4]. handle runs on stream. */
+template <typename T>
+void launch_fused_linear_cross_entropy_fw(
+    const T *inputs_ptr, const T *weight_ptr, const int *targets_ptr,
+    float *outputs_ptr, float *nll_loss_ptr, float *lse_ptr,
+    float *loss_buffer, float *stats_buffer, T *logits_buffer,
+    const int padding_idx, const float epsilon, const int num_tokens,
+    const int hidden_size, const int vocab_size, const int chunk_size,
+    cublasHandle_t handle, cudaStream_t stream);
+
+template <typename T>
+void launch_fused_linear_cross_entropy_bw(
+    const float *grad_outputs_ptr, const T *inputs_ptr, const T *weight_ptr,
+    const int *targets_ptr, const float *lse_ptr, T *grad_inputs_ptr,
+    T *grad_weight_ptr, T *logits_buffer, const int padding_idx,
+    const float epsilon, const int num_tokens, const int hidden_size,
+    const int vocab_size, const int chunk_size, cublasHandle_t handle,
+    cudaStream_t stream);
+
 template <typename T>
 void launch_lookup_scale_pos_dropout(
     T *output, const int *input, const T *embeddings, const T *pos_embeddings,
     const T *clip_max, uint8_t *dropout_mask, int *tokens_position,
     int batch_size, int seq_len, int embedding_dim, int padding_idx,
-    float dropout_ratio, int step, cudaStream_t &stream);
+    float dropout_ratio, int step, cudaStream_t &stream,
+    const int *cu_seqlens = nullptr, int num_seqs = 0);
+
+// Packed training batches: every [seq_len] row of a [batch_size, seq_len]
+// batch holds several sequences back to back, sequence i being the tokens
+// [cu_seqlens[i], cu_seqlens[i + 1]) of the flattened batch. A sequence may
+// not cross a row and cu_seqlens[num_seqs] == batch_tokens, the padding at
+// the end of a row is a sequence of its own. seq_ids gets the sequence of
+// every token and positions its position in the sequence, both can be nullptr.
+void launch_packed_seq_ids(int *seq_ids, int *positions, const int *cu_seqlens,
+                           int num_seqs, int batch_tokens, cudaStream_t stream);
 
 template <typename T>
 void launch_d_lookup_scale_pos_dropout(
@@ -222,6 +620,23 @@ void launch_d_lookup_scale_pos_dropout(
     int vocab_size, int max_seq_len, int padding_idx, float dropout_ratio,
     bool trainable_pos, cudaStream_t &stream);
 
+// The grads of the embedding table of launch_d_lookup_scale_pos_dropout as
+// sparse rows, without the pass over the whole table: rows gets the sorted
+// unique tokens of input but the padding, grad_rows [batch_tokens,
+// embedding_dim] the sum of the grads of their positions, of which the first
+// num_rows, a device int, are written. The sums run in position order, so
+// they are deterministic. No positional embedding or quantization grads.
+// workspace holds sparse_emb_grad_workspace_bytes(batch_tokens) bytes.
+size_t sparse_emb_grad_workspace_bytes(int max_batch_tokens);
+
+template <typename T>
+void launch_d_lookup_scale_pos_dropout_sparse(
+    T *grad_rows, int *rows, int *num_rows, const T *grad_output,
+    const int *input, const uint8_t *dropout_mask, int batch_size,
+    int seq_len, int embedding_dim, int vocab_size, int padding_idx,
+    float dropout_ratio, void *workspace, size_t workspace_bytes,
+    cudaStream_t stream);
+
 template <typename T>
 void launch_viterbi(const T *start_transition, const T *end_transition,
                     const T *transition, const T *emission, const T *mask,
@@ -229,6 +644,48 @@ void launch_viterbi(const T *start_transition, const T *end_transition,
                     int num_tags, int seq_len, int batch_size,
                     cudaStream_t stream, const T *bias = nullptr);
 
+// launch_viterbi of the packed sequences at cu_seqlens: [batch_size + 1],
+// emission: [batch_tokens, num_tags], the best_tags stay padded to
+// [batch_size, seq_len].
+template <typename T>
+void launch_viterbi_varlen(const T *start_transition, const T *end_transition,
+                           const T *transition, const T *emission,
+                           const int *cu_seqlens, float *best_score,
+                           int *history, int *best_tags, int num_tags,
+                           int seq_len, int batch_size, cudaStream_t stream,
+                           const T *bias = nullptr);
+
+// Negative log likelihood of the gold tags of a linear crf for its training,
+// see ker_crf_nll. The arguments are those of launch_viterbi, and cu_seqlens
+// for the packed sequences or nullptr. tags: [batch_size, seq_len], or
+// [batch_tokens] when packed. nll, log_z: [batch_size], alpha: fp32
+// [batch_tokens, num_tags], kept for launch_crf_nll_bw.
+template <typename T>
+void launch_crf_nll(const T *start_transition, const T *end_transition,
+                    const T *transition, const T *emission, const T *mask,
+                    const int *cu_seqlens, const T *bias, const int *tags,
+                    float *nll, float *log_z, float *alpha, int num_tags,
+                    int seq_len, int batch_size, cudaStream_t stream);
+
+inline size_t crf_nll_bw_workspace_size(int num_tags) {
+  return size_t(num_tags) * num_tags + 3 * num_tags;
+}
+
+// Its backward by the forward-backward marginals, see ker_crf_nll_bw.
+// grad_nll: [batch_size], nullptr for ones. The grads of the transitions and
+// of the bias are summed over the batch, grad_bias may be nullptr.
+// workspace: fp32 [crf_nll_bw_workspace_size(num_tags)].
+template <typename T>
+void launch_crf_nll_bw(T *grad_start_transition, T *grad_end_transition,
+                       T *grad_transition, T *grad_emission, T *grad_bias,
+                       const float *grad_nll, const T *start_transition,
+                       const T *end_transition, const T *transition,
+                       const T *emission, const T *mask,
+                       const int *cu_seqlens, const T *bias, const int *tags,
+                       const float *log_z, const float *alpha,
+                       float *workspace, int num_tags, int seq_len,
+                       int batch_size, cudaStream_t stream);
+
 template <typename T>
 void launch_quantize(int8_t *q_ptr, uint8_t *clip_mask_ptr, float *alpha_ptr,
                      const T *f_ptr, const T *clip_max_ptr, int numel,
@@ -255,6 +712,97 @@ void launch_dequantize(T *f_ptr, const int8_t *q_ptr, const T *clip_max_ptr,
                        int batch_tokens, int hidden_size, int mask_start_bit,
                        cudaStream_t stream, bool in_col32 = false);
 
+// Largest magnitude of fp8 e4m3, a per-tensor scale is amax / kFp8E4M3Max.
+const float kFp8E4M3Max = 448.f;
+
+// q = f / scale[0] in fp8 e4m3, saturated to +-kFp8E4M3Max, the input of
+// cublaslt_fp8_gemm. fp8 values are passed as bytes, they need CUDA 11.8.
+template <typename T>
+void launch_quantize_fp8(uint8_t *q_ptr, const T *f_ptr,
+                         const float *scale_ptr, size_t numel,
+                         cudaStream_t stream);
+
+// Largest magnitude of fp8 e5m2, the format of the grads in fp8 training.
+const float kFp8E5M2Max = 57344.f;
+
+// The fp8 training of LinearOp. f: [rows, cols] row major is quantized as
+// launch_quantize_fp8, in e5m2 if e5m2, into q: [rows, cols] and its
+// transpose q_t: [cols, rows], the operands of the three gemms of a linear
+// in the TN layout of cublaslt_fp8_gemm. Either one can be nullptr.
+// amax[0] is raised to max|f| unless it is nullptr.
+template <typename T>
+void launch_quantize_fp8_transpose(uint8_t *q_ptr, uint8_t *q_t_ptr,
+                                   float *amax_ptr, const T *f_ptr,
+                                   const float *scale_ptr, int rows, int cols,
+                                   bool e5m2, cudaStream_t stream);
+
+// Delayed scaling of fp8 training: scales[t] = max(amax_history[t, :]) /
+// fp8_max * 2^margin for every tensor t, kept as is while the history is
+// all zero, then amax_history[t, slot] is cleared for the amax of the
+// coming step. amax_history: [num_tensors, history_len], on the gpu only.
+void launch_fp8_update_scales(float *scales, float *amax_history,
+                              int num_tensors, int history_len, int slot,
+                              float fp8_max, float margin,
+                              cudaStream_t stream);
+
+// The dynamic int8 inference of Int8LinearOp, see cublaslt_igemm.
+// q[i] = round(inp[i] / scales[i]), scales[i] = max|inp[i]| / kQuantRangeI8,
+// one scale per row of cols.
+template <typename T>
+void launch_quantize_rows(int8_t *q, float *scales, const T *inp, int rows,
+                          int cols, cudaStream_t stream);
+
+// The weight of a [rows, cols] row major inference kernel, cols the outputs,
+// is quantized and transposed into q: [cols, rows], with one scale per
+// output, scales: [cols].
+template <typename T>
+void launch_quantize_weight_cols(int8_t *q, float *scales, const T *weight,
+                                 int rows, int cols, cudaStream_t stream);
+
+// out = act(c * row_scales[i] * col_scales[j] + bias[j]), c: [rows, cols]
+template <ActivationType act_type, typename T>
+void launch_dequantize_bias_act(T *out, const int32_t *c,
+                                const float *row_scales,
+                                const float *col_scales, const T *bias,
+                                int rows, int cols, cudaStream_t stream);
+
+// out = c * row_scales[i] * col_scales[j] + bias[j] + residual, bias and
+// residual can be nullptr, out can be residual.
+template <typename T>
+void launch_dequantize_bias_res(T *out, const int32_t *c,
+                                const float *row_scales,
+                                const float *col_scales, const T *bias,
+                                const T *residual, int rows, int cols,
+                                cudaStream_t stream);
+
+// The int8 self attention of Int8AttentionOp. The [rows, cols] of every one
+// of batch_heads heads, at head_stride elements from the previous one, are
+// quantized with one scale per head into q: [batch_heads, rows_pad, cols], or
+// [batch_heads, cols, rows_pad] if transpose, zero from rows to rows_pad.
+template <typename T>
+void launch_quantize_heads(int8_t *q, float *scales, const T *inp,
+                           int batch_heads, int rows, int rows_pad, int cols,
+                           int head_stride, bool transpose,
+                           cudaStream_t stream);
+
+// The softmax of the int32 scores inp: [batch_size, nhead, from_len, to_pad]
+// of the first to_len keys, dequantized by alpha and the head scales of the
+// query and the key, into out of the same shape in int8 of the scale
+// 1 / kQuantRangeI8. The mask is the one of launch_attn_softmax_new.
+template <typename T>
+void launch_attn_softmax_i32I_i8O(int8_t *out, const int32_t *inp,
+                                  const float *q_scales, const float *k_scales,
+                                  float alpha, const T *attn_mask,
+                                  int batch_size, int nhead, int from_len,
+                                  int to_len, int to_pad, int kv_size,
+                                  bool mask_future, cudaStream_t stream);
+
+// out = c * scales[h] * scale of the head_size elements of every head h.
+template <typename T>
+void launch_dequantize_heads(T *out, const int32_t *c, const float *scales,
+                             float scale, int batch_heads, int head_size,
+                             cudaStream_t stream);
+
 template <typename T>
 void launch_quantize_bwd(T *grad_ptr, T *cmax_grad_ptr,
                          const uint8_t *clip_mask_ptr, int numel,
@@ -264,6 +812,40 @@ template <typename T>
 void launch_d_cmax(T *grad_ptr, T *grad_cmax_ptr, const uint8_t *clip_mask_ptr,
                    int numel, int mask_start_bit, cudaStream_t stream);
 
+// Gradient Communication Quantization, see gcq_kernels.cu. The bucket is
+// quantized in rows of hidden_dim with a per row scale, the topk-th largest
+// |x| of the row over kQuantRangeI8. error is the fp32 error feedback of the
+// bucket, or nullptr.
+template <typename T>
+void launch_gcq_quantize(int8_t *q, float *scales, const T *grad, float *error,
+                         int numel, int padded_rows, int hidden_dim, int topk,
+                         cudaStream_t stream);
+
+// The mean of the int8 shards of all the ranks, quantized again, or their
+// sum without average.
+void launch_gcq_reduce_quantize(int8_t *q_out, float *scales_out,
+                                const int8_t *q_in, const float *scales_in,
+                                int world_size, int rows, int hidden_dim,
+                                int topk, cudaStream_t stream,
+                                bool average = true);
+
+template <typename T>
+void launch_gcq_dequantize(T *grad, const int8_t *q, const float *scales,
+                           int numel, int hidden_dim, cudaStream_t stream);
+
+// The one-shot all-reduce of tensor parallel inference, see
+// all_reduce_kernels.cu. peers: [world_size] device pointers to the
+// workspaces of one_shot_workspace_bytes of all the ranks, mapped into this
+// one, epochs: [kOneShotBlocks] zeros at first, of this rank. The message
+// is of 16 byte vectors and at most max_bytes, out can be inp.
+const int kOneShotBlocks = 32;
+size_t one_shot_workspace_bytes(size_t max_bytes, int world_size);
+template <typename T>
+void launch_one_shot_all_reduce(T *out, const T *inp, char *const *peers,
+                                unsigned int *epochs, int rank, int world_size,
+                                size_t max_bytes, int nele,
+                                cudaStream_t stream);
+
 template <typename T>
 void launch_split_head(const T *inp, const T *bias, T *query, T *key, T *value,
                        int batch_size, int hidden_dim, int head_dim, int q_len,
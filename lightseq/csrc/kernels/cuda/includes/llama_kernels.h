@@ -8,12 +8,37 @@
 namespace lightseq {
 namespace cuda {
 
+// The input rows read by a kernel, which saves gathering them first: row r
+// of the output reads row rows[r] of the input, or row r * stride + offset
+// without rows. The default reads the input as it is.
+struct RowView {
+  const int *rows = nullptr;
+  size_t stride = 1;
+  size_t offset = 0;
+
+  __host__ __device__ size_t row(size_t idx) const {
+    return rows ? rows[idx] : idx * stride + offset;
+  }
+};
+
 template <typename T>
 void launch_llama_embedding(const T *token_emb, const int *tokens, T *output,
                             T *pad_mask_ptr, int *left_pad_len_ptr,
                             int batch_size, int beam_size, int hidden_dim,
                             int step_offset, int seq_len, int max_step,
-                            int padding_id, cudaStream_t stream);
+                            int padding_id, cudaStream_t stream,
+                            const int *step_offset_ptr = nullptr);
+
+// launch_llama_embedding of an int8 [vocab_size, hidden_dim] token_emb with
+// one scale per token in emb_scale, dequantized in the lookup.
+template <typename T>
+void launch_llama_embedding_i8(const int8_t *token_emb, const T *emb_scale,
+                               const int *tokens, T *output, T *pad_mask_ptr,
+                               int *left_pad_len_ptr, int batch_size,
+                               int beam_size, int hidden_dim, int step_offset,
+                               int seq_len, int max_step, int padding_id,
+                               cudaStream_t stream,
+                               const int *step_offset_ptr = nullptr);
 
 template <typename T>
 void launch_split_rotary_position_qkv(const T *input_ptr, const T *sin_ptr,
@@ -22,18 +47,109 @@ void launch_split_rotary_position_qkv(const T *input_ptr, const T *sin_ptr,
                                       size_t max_step, size_t batch_size,
                                       size_t nhead, size_t offset_seq_len,
                                       size_t query_len, size_t head_dim,
-                                      cudaStream_t stream);
+                                      cudaStream_t stream,
+                                      const int *offset_seq_len_ptr = nullptr,
+                                      const int *page_table = nullptr,
+                                      int page_size = 0, int max_pages = 0,
+                                      const int *seq_offsets = nullptr,
+                                      size_t kv_head_num = 0,
+                                      int ring_size = 0);
+
+// The backward of launch_split_rotary_position_qkv in training, where the
+// sequences start at 0 and k, v are [batch_size, kv_head_num, query_len,
+// head_dim], see kernel_split_rotary_position_qkv_bw.
+template <typename T>
+void launch_split_rotary_position_qkv_bw(
+    T *inp_grad, const T *sin_ptr, const T *cos_ptr, const T *q_grad,
+    const T *k_grad, const T *v_grad, size_t batch_size, size_t nhead,
+    size_t query_len, size_t head_dim, cudaStream_t stream,
+    size_t kv_head_num = 0);
+
+// Quantize k, v into an int8 cache with one scale per head vector, see
+// kernel_split_rotary_position_qkv_i8.
+template <typename T>
+void launch_split_rotary_position_qkv_i8(
+    const T *input_ptr, const T *sin_ptr, const T *cos_ptr, T *q_out,
+    int8_t *cache_k_out, int8_t *cache_v_out, float *cache_k_scale,
+    float *cache_v_scale, size_t max_step, size_t batch_size, size_t nhead,
+    size_t offset_seq_len, size_t query_len, size_t head_dim,
+    cudaStream_t stream, const int *offset_seq_len_ptr = nullptr,
+    const int *page_table = nullptr, int page_size = 0, int max_pages = 0,
+    const int *seq_offsets = nullptr, size_t kv_head_num = 0,
+    int ring_size = 0);
+
+// The qkv linear of weight [in_dim, (nhead + 2 * kv_head_num) * head_dim]
+// fused with launch_split_rotary_position_qkv for decode batches, see
+// kernel_gemv_qkv_rotary. head_dim must be a multiple of 8. More than
+// kQkvRotaryMaxGemvTokens tokens are compute bound and go through a dense
+// gemm and launch_split_rotary_position_qkv instead.
+const int kQkvRotaryMaxGemvTokens = 8;
+
+template <typename T>
+void launch_gemv_qkv_rotary(const T *inp, const T *weight, const T *sin_ptr,
+                            const T *cos_ptr, T *q_out, T *cache_k_out,
+                            T *cache_v_out, size_t max_step, size_t batch_size,
+                            size_t nhead, size_t offset_seq_len,
+                            size_t query_len, size_t head_dim, size_t in_dim,
+                            cudaStream_t stream,
+                            const int *offset_seq_len_ptr = nullptr,
+                            const int *page_table = nullptr,
+                            int page_size = 0, int max_pages = 0,
+                            const int *seq_offsets = nullptr,
+                            size_t kv_head_num = 0, int ring_size = 0);
+
+// Attention over a paged kv cache, see kernel_paged_attention. CacheT is T,
+// or int8_t with the scales of launch_split_rotary_position_qkv_i8.
+template <typename T, typename CacheT>
+void launch_paged_attention(const T *q, const CacheT *cache_k,
+                            const CacheT *cache_v, const T *pad_mask,
+                            const int *page_table, T *output, int batch_size,
+                            int nhead, int head_dim, int query_len,
+                            int offset_seq_len, int page_size, int max_pages,
+                            int max_step, cudaStream_t stream,
+                            const int *offset_seq_len_ptr = nullptr,
+                            const int *seq_offsets = nullptr,
+                            int kv_head_num = 0,
+                            const float *cache_k_scale = nullptr,
+                            const float *cache_v_scale = nullptr);
+
+// Copy num_pages kv pages between pools of [pool_pages, page_vecs, head_dim],
+// page pages[2 * i] of src to page pages[2 * i + 1] of dst, see
+// kernel_copy_kv_pages. An int8 pool has one scale per head vector in
+// [pool_pages, page_vecs] *_scale, so a pool of T copied into an int8 one is
+// quantized and the other way round dequantized. A pool may be in pinned
+// host memory.
+template <typename S, typename D>
+void launch_copy_kv_pages(const S *src, const float *src_scale, D *dst,
+                          float *dst_scale, const int *pages, int num_pages,
+                          int page_vecs, int head_dim, cudaStream_t stream);
 
 template <typename T>
 void launch_silu_elewise_product(const T *inp_ptr, T *out_ptr,
                                  size_t batch_size, size_t seq_len,
                                  size_t inner_size, cudaStream_t stream);
 
+template <typename T>
+void launch_silu_elewise_product_bw(T *inp_grad, const T *out_grad,
+                                    const T *inp_ptr, size_t batch_size,
+                                    size_t seq_len, size_t inner_size,
+                                    cudaStream_t stream);
+
+template <typename T>
+void launch_gelu_elewise_product(const T *inp_ptr, T *out_ptr,
+                                 size_t batch_size, size_t seq_len,
+                                 size_t inner_size, cudaStream_t stream);
+
 template <typename T>
 void launch_rms_layer_norm(const T *inp_ptr, const T *scale_ptr, T *out_ptr,
                            T *res_ptr, T *rms_ptr, size_t batch_tokens,
                            size_t hidden_dim, cudaStream_t stream,
-                           const float ln_epsilon = 1e-6f);
+                           const float ln_epsilon = 1e-6f,
+                           RowView inp_rows = RowView());
+
+// Move the step offset read by the kernels to the next position, so that a
+// CUDA graph can run several decoding steps, see Llama::graph_decode_steps.
+void launch_advance_step_offset(int *step_offset, cudaStream_t stream);
 
 }  // namespace cuda
 }  // namespace lightseq
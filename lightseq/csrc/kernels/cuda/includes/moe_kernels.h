@@ -0,0 +1,85 @@
+#pragma once
+#include <cuda.h>
+#include <cuda_fp16.h>
+#include "kernels.h"
+#include <stdexcept>
+
+namespace lightseq {
+namespace cuda {
+
+/*
+The kernels of a mixture of experts feed forward, see MoEFeedForwardLayer.
+The routed tokens are copied to the slots of their experts, an [expert_num,
+capacity, hidden_dim] buffer of which expert e uses the first
+expert_rows[e] slots, the experts run on their used slots only and the
+outputs are gathered back to the tokens. The routing of token t is the
+[topk] expert, slot and score at k * max_batch_tokens + t, slot -1 for a
+token dropped by a full expert.
+*/
+
+// tokens of a tile of launch_moe_route_dispatch.
+const int kMoeRouteTileTokens = 32;
+
+// ints of the workspace of launch_moe_route_dispatch.
+inline size_t moe_route_workspace_size(size_t max_batch_tokens,
+                                       size_t expert_num) {
+  return 1 + (max_batch_tokens + kMoeRouteTileTokens - 1) /
+                 kMoeRouteTileTokens * expert_num;
+}
+
+// Route every token to the topk experts of the softmax of gate_logits,
+// [batch_tokens, expert_num], and copy it to the next free slot of each of
+// them in a single kernel, renormalizing the scores over the topk experts
+// when topk > 1. The slots of an expert go to its tokens in token order.
+// Supports up to 256 experts and topk up to 8.
+template <typename T>
+void launch_moe_route_dispatch(const T *gate_logits, const T *input,
+                               float *score, int *expert, int *slot,
+                               int *expert_rows, int *workspace, T *output,
+                               int batch_tokens, int max_batch_tokens,
+                               int expert_num, int capacity, int topk,
+                               int hidden_dim, cudaStream_t stream);
+
+// The hard gate routing: every token of sequence b goes to expert gates[b]
+// with score 1, the sequences of an expert take its slots in batch order.
+// The experts then run and combine as for launch_moe_route_dispatch, with
+// launch_moe_combine of topk 1 as the reorder post.
+template <typename T>
+void launch_hard_gate_reorder_pre(const T *input, const int *gates,
+                                  float *score, int *expert, int *slot,
+                                  int *expert_rows, T *output, int batch_size,
+                                  int seq_len, int expert_num, int capacity,
+                                  int hidden_dim, cudaStream_t stream);
+
+// output[e] = act(input[e] * weight[e] + bias[e]) on the expert_rows[e] used
+// slots of every expert e, in one launch whose blocks only cover the row
+// tiles in use, so an expert without tokens costs nothing. input is
+// [expert_num, capacity, in_dim], weight [expert_num, in_dim, out_dim], bias
+// [expert_num, out_dim] or nullptr. act is 0 none, 1 relu, 2 gelu.
+// max_rows bounds the sum of expert_rows, tile_offset is an [expert_num + 1]
+// workspace.
+template <typename T>
+void launch_moe_grouped_gemm(const T *input, const T *weight, const T *bias,
+                             T *output, const int *expert_rows,
+                             int *tile_offset, int expert_num, int capacity,
+                             int max_rows, int in_dim, int out_dim, int act,
+                             cudaStream_t stream);
+
+// output = silu(gate) * up of the used slots of [expert_num, capacity, 2 *
+// inner_dim] [gate, up] rows, into [expert_num, capacity, inner_dim].
+template <typename T>
+void launch_moe_grouped_swiglu(const T *input, T *output,
+                               const int *expert_rows, int expert_num,
+                               int capacity, int inner_dim,
+                               cudaStream_t stream);
+
+// output[t] += sum of (input[expert, slot] + bias[expert]) * score over the
+// topk routes of token t which were not dropped, bias may be nullptr.
+template <typename T>
+void launch_moe_combine(const T *input, const T *bias, const float *score,
+                        const int *expert, const int *slot, T *output,
+                        int batch_tokens, int max_batch_tokens, int capacity,
+                        int topk, int hidden_dim, cudaStream_t stream);
+
+}  // namespace cuda
+}  // namespace lightseq
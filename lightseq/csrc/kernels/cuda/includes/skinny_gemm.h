@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cuda.h>
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
+#include <cuda_runtime.h>
+
+#include "gemm_tuner.h"
+
+namespace lightseq {
+namespace cuda {
+
+// The most columns of C, the tokens of a LinearOp, of a skinny gemm.
+const int kSkinnyGemmMaxN = 16;
+
+/*
+C = alpha * A * B + beta * C of a weight A [m, k] and the few tokens of B
+[k, n], n <= kSkinnyGemmMaxN, all column major and not transposed, as the
+LinearOp of a decode step. A thread computes a row of C for all the tokens,
+so A is read once at the full bandwidth whatever n, the tokens stay in
+shared memory. With splits > 1 the k of the gemm is split over as many
+blocks per row, like the split-K and stream-K gemms, so that a small m still
+fills the gpu; the fp32 partial sums [splits, n, m] in workspace are then
+reduced by a second kernel.
+*/
+template <typename T>
+void launch_skinny_gemm(int m, int n, int k, float alpha, float beta,
+                        const T *A, const T *B, T *C, int splits,
+                        float *workspace, cudaStream_t stream);
+
+// launch_skinny_gemm as a GemmBackend of the GemmTuner, whose variants are
+// the splits.
+class SkinnyGemmBackend : public GemmBackend {
+ public:
+  std::string name() const override { return "skinny"; }
+  std::vector<int> variants(const GemmShape &shape) const override;
+  bool run(const GemmShape &shape, int variant, const float *alpha,
+           const float *beta, const void *A, const void *B, void *C,
+           void *workspace, cudaStream_t stream) override;
+};
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cuda.h>
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
+#include <cuda_runtime.h>
+#ifdef LIGHTSEQ_cusparselt
+#include <cusparseLt.h>
+#endif
+
+#include <map>
+
+namespace lightseq {
+namespace cuda {
+
+// The rows, the columns and the leading dims of the operands of a
+// Sparse24Gemm are multiples of it.
+const int kSparse24Align = 16;
+
+/*
+The gemm of a weight pruned to 2:4 structured sparsity on the sparse tensor
+cores of Ampere and later, with cuSPARSELt. The weight A is [m, k] column
+major, as the kernel of an inference LinearOp, with at most 2 nonzeros in
+every 4 consecutive elements along k. compress() checks the pattern and
+turns A into the values and the metadata of cuSPARSELt, about 9/16 of the
+dense size in fp16, which gemm() multiplies. The plan of a gemm is made at
+the first gemm of its n, so the shapes of a cuda graph should be run once
+before the capture.
+
+Built with USE_CUSPARSELT, which needs cuSPARSELt 0.6 or later, for fp16
+and bf16.
+*/
+template <typename T>
+class Sparse24Gemm {
+ private:
+  int _m;
+  int _k;
+#ifdef LIGHTSEQ_cusparselt
+  struct Plan {
+    cusparseLtMatDescriptor_t mat_a, mat_b, mat_c;
+    cusparseLtMatmulDescriptor_t matmul;
+    cusparseLtMatmulAlgSelection_t alg_sel;
+    cusparseLtMatmulPlan_t plan;
+  };
+  std::map<int, Plan *> _plans;
+  void *_workspace = nullptr;
+  size_t _workspace_size = 0;
+
+  Plan *plan(int n);
+#endif
+
+ public:
+  Sparse24Gemm(int m, int k);
+  ~Sparse24Gemm();
+
+  // Whether the build has cuSPARSELt and the current gpu sparse tensor
+  // cores, for T.
+  static bool supported();
+
+  // Bytes of the compressed A.
+  size_t compressed_size();
+
+  // Compress A into compressed, of compressed_size() bytes, A is not used
+  // after. Throws if A is not 2:4 sparse along k.
+  void compress(const T *A, void *compressed, cudaStream_t stream);
+
+  // C = A * B + beta * C in column major, B [k, n] and C [m, n], with n a
+  // multiple of kSparse24Align and A the compressed one.
+  void gemm(const void *compressed, int n, const T *B, T *C, float beta,
+            cudaStream_t stream);
+};
+
+}  // namespace cuda
+}  // namespace lightseq
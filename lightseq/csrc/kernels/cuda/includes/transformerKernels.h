@@ -1,5 +1,6 @@
 #pragma once
 #include <cuda.h>
+#include <cuda_bf16.h>
 #include <cuda_fp16.h>
 #include <curand_kernel.h>
 #include "kernels.h"
@@ -43,6 +44,35 @@ void ker_diverse_beam_search_launcher(float* can_score, int* can_ids,
                                       cudaStream_t stream, int beam_size,
                                       float diverse_lambda, int vocab_size);
 
+/**
+Fused beam search top k for diverse_lambda == 0, taking the place of
+select_beam_rough_topk_launcher and the sort of its candidates. Writes the
+sorted top beam_size candidates of every batch item to can_idx, can_score
+and num_beam_can + 1 in the layout ker_refresh_result reads, without any
+host sync. beam_topk_score and beam_topk_idx are a
+[batch_size * beam_size * beam_size] workspace.
+*/
+template <typename T>
+void beam_search_topk_launcher(const T* logits, const T* logit_bias,
+                               const float* seq_probs, const float* seq_score,
+                               const int* alive_seq, float* beam_topk_score,
+                               int* beam_topk_idx, int* can_idx,
+                               float* can_score, int* num_beam_can,
+                               int vocab_size, int max_step,
+                               float length_norm, int cur_step,
+                               int batch_size, cudaStream_t stream,
+                               int beam_size, int end_id);
+
+/**
+Beam pruning by score margin on the sorted candidates of beam search, before
+ker_refresh_result, see ker_prune_beams.
+*/
+void ker_prune_beams_launcher(int batch_size, int beam_size,
+                              cudaStream_t stream, int* can_idx,
+                              float* can_score, const int* num_can_per_beam,
+                              int vocab_size, float abs_margin,
+                              float rel_margin, int end_id);
+
 template <typename T>
 void ker_bias_relu_launcher(int batch_token_num, int block_dim,
                             cudaStream_t stream, T* input, const T* bias,
@@ -72,6 +102,29 @@ void ker_refresh_cache_launcher(
     int self_k_bgeem_offset, int beam_size, int dim_per_head, int head_num,
     int vocab_size, int cur_step, int max_step, bool diverse, int end_id);
 
+// Reorder the beams through kv_rows of [batch_size * beam_size, max_step],
+// the cache row of every position, rather than by copying the caches as
+// ker_refresh_cache_launcher does. The attention then reads the caches
+// through kv_rows, see launch_flash_attention.
+void ker_refresh_kv_rows_launcher(int batch_size, int block_dim,
+                                  cudaStream_t stream,
+                                  const int* num_can_per_beam,
+                                  const int* can_idx, int* kv_rows,
+                                  int beam_size, int vocab_size, int cur_step,
+                                  int max_step, bool diverse, int end_id);
+
+// Reset kv_rows of [num_rows, max_step] to the rows themselves.
+void ker_init_kv_rows_launcher(int num_rows, int block_dim,
+                               cudaStream_t stream, int* kv_rows,
+                               int max_step);
+
+// kv_rows of [num_rows, max_step] for the samples of prompt_rows prompts
+// prefilled once, row r samples the prompt r % prompt_rows, whose positions
+// before prompt_len are read from the prefilled row.
+void ker_fork_kv_rows_launcher(int num_rows, int block_dim,
+                               cudaStream_t stream, int* kv_rows,
+                               int prompt_rows, int prompt_len, int max_step);
+
 template <typename T>
 void ker_arrange_encdec_kv_launcher(int batch_token_num, int dec_layer_num,
                                     int hidden_size, cudaStream_t stream,
@@ -103,6 +156,21 @@ void ker_correlation_softmax_encdec_launcher(
     int batch_size, int head_num_per_seq, int batch_seq_len,
     cudaStream_t stream, T* correlation, const int* src_padding_mask);
 
+template <typename T>
+void ker_quantize_encdec_kv_launcher(int batch_size, int dec_layer_num,
+                                     int head_num, int batch_seq_len,
+                                     int dim_per_head, cudaStream_t stream,
+                                     const T* k, const T* v, int8_t* k_i8,
+                                     int8_t* v_i8, float* k_scale,
+                                     float* v_scale, int offset_per_layer);
+
+template <typename T>
+void ker_encdec_attention_i8_launcher(
+    int batch_size, int head_num, int beam_size, int batch_seq_len,
+    int dim_per_head, float scaler, cudaStream_t stream, const T* q,
+    T* out, const int8_t* k_i8, const int8_t* v_i8, const float* k_scale,
+    const float* v_scale, const T* src_padding_mask);
+
 template <typename T>
 void ker_arrange_atten_output_launcher(int batch_token_num, int hidden_size,
                                        cudaStream_t stream, const T* ori_q,
@@ -146,7 +214,8 @@ void ker_topk_sample_launcher(int batch_size, int batch_seq_len,
                               const T* logit_bias, int* old_input_ids,
                               int* new_input_ids, const int vocab_size,
                               const int k, int* all_finished,
-                              curandState* curandstate, int eos_id);
+                              curandState* curandstate, int eos_id,
+                              const int* step_offset_ptr = nullptr);
 
 template <typename T>
 void ker_topp_sample_launcher(int batch_size, int batch_seq_len,
@@ -158,6 +227,62 @@ void ker_topp_sample_launcher(int batch_size, int batch_seq_len,
                               const float p, int* unfinished,
                               curandState* curandstate, int eos_id);
 
+const int kMaxStopTokens = 8;
+
+// the sampling parameters and stop conditions of a row, see
+// ker_topp_threshold_sample
+struct RowSamplingParams {
+  int topk;  // 0 for no topk
+  float topp;
+  float temperature;
+  float repetition_penalty;
+  float min_p;
+  int max_new_tokens;  // 0 for no limit
+  int num_stop_tokens;
+  int stop_tokens[kMaxStopTokens];
+};
+
+// exact topk and topp sampling without sorting the vocab, with temperature,
+// repetition penalty and min-p, the parameters of row_params if not null,
+// see ker_topp_threshold_sample
+template <typename T>
+void ker_topp_threshold_sample_launcher(
+    int batch_size, int batch_seq_len, const int prompt_len,
+    const int max_step, int logits_seq_len, int max_thread_per_block,
+    cudaStream_t stream, const T* logits, const T* logit_bias,
+    int* old_input_ids, const int vocab_size, const int k, const float p,
+    const float temperature, const float repetition_penalty, const float min_p,
+    const RowSamplingParams* row_params, int* unfinished,
+    curandState* curandstate, int eos_id,
+    const int* step_offset_ptr = nullptr);
+
+// the logits processors of a generation step, see ker_process_logits
+struct LogitsProcessParams {
+  float repetition_penalty;  // 1 for none
+  float presence_penalty;    // 0 for none
+  float frequency_penalty;   // 0 for none
+  int no_repeat_ngram_size;  // 0 for none
+  int num_bad_words;
+  // the token automaton of constrained decoding, allowed is nullptr for none
+  const unsigned int* allowed;
+  const int* transition_offsets;
+  const int* transition_tokens;
+  const int* next_states;
+  int* states;  // [rows], the state of every row
+};
+
+// repetition, presence and frequency penalties, no repeat ngram and bad
+// words applied in place to the last logits of every row, see
+// ker_process_logits
+template <typename T>
+void ker_process_logits_launcher(int rows, int seq_len, int prompt_len,
+                                 int max_step, int max_thread_per_block,
+                                 cudaStream_t stream, T* logits,
+                                 const int* alive_seq, int vocab_size,
+                                 const LogitsProcessParams& params,
+                                 const int* bad_words,
+                                 const int* bad_word_offsets);
+
 template <typename T>
 void ker_bias_gelu_launcher(int batch_token_num, int block_dim,
                             cudaStream_t stream, T* input, const T* bias,
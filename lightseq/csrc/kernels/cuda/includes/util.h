@@ -10,6 +10,7 @@
 
 #include <cublas_v2.h>
 #include <cuda.h>
+#include <cuda_bf16.h>
 #include <thrust/copy.h>
 #include <thrust/device_vector.h>
 #include <thrust/iterator/counting_iterator.h>
@@ -100,5 +101,8 @@ void dequantize_array(std::vector<unsigned char>& i8, std::vector<float>& f,
 
 void launch_convert_dtype(float* source_buffer, __half* target_buffer,
                           size_t size, int max_thread, cudaStream_t stream);
+
+void launch_convert_dtype(float* source_buffer, __nv_bfloat16* target_buffer,
+                          size_t size, int max_thread, cudaStream_t stream);
 }  // namespace cuda
 }  // namespace lightseq
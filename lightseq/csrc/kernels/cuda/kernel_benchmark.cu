@@ -0,0 +1,1433 @@
+/*
+The benchmark of the launch_* kernels of kernels.h and llama_kernels.h.
+
+Every kernel is timed with cuda events on the shapes of real models, in each
+dtype it is instantiated for. The bytes of a kernel are its compulsory reads
+and writes and its flops the arithmetic of its math, from which the achieved
+bandwidth and flops are reported as a percentage of the peaks of the device
+and of its roofline, min(peak flops, bytes / flops * peak bandwidth). The peak
+flops are those of the fp32 cores, the kernels below do not use the tensor
+cores.
+
+Usage: kernel_benchmark [--filter substring] [--json path] [--repeat n]
+                        [--warmup n] [--peak_gbps x] [--peak_gflops x]
+
+--json writes the results for the regression tracking of the perf CI.
+*/
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "cuda_util.h"
+#include "embKernels.h"
+#include "kernels.h"
+#include "llama_kernels.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+struct Options {
+  std::string filter;
+  std::string json_path;
+  int repeat = 20;
+  int warmup = 5;
+  double peak_gbps = 0;
+  double peak_gflops = 0;
+};
+
+Options parse_options(int argc, char *argv[]) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      throw std::runtime_error("missing the value of " + arg);
+    }
+    std::string value = argv[++i];
+    if (arg == "--filter") {
+      options.filter = value;
+    } else if (arg == "--json") {
+      options.json_path = value;
+    } else if (arg == "--repeat") {
+      options.repeat = std::max(1, std::atoi(value.c_str()));
+    } else if (arg == "--warmup") {
+      options.warmup = std::max(0, std::atoi(value.c_str()));
+    } else if (arg == "--peak_gbps") {
+      options.peak_gbps = std::atof(value.c_str());
+    } else if (arg == "--peak_gflops") {
+      options.peak_gflops = std::atof(value.c_str());
+    } else {
+      throw std::runtime_error("unknown option " + arg);
+    }
+  }
+  return options;
+}
+
+// The shapes of a model, seq_len is the kv length of the decode configs.
+struct Config {
+  const char *name;
+  int batch;
+  int seq_len;
+  int hidden;
+  int nhead;
+  int inner;
+  int vocab;
+  int head_dim() const { return hidden / nhead; }
+  int tokens() const { return batch * seq_len; }
+};
+
+const Config kEncoderConfigs[] = {
+    {"bert-base", 16, 128, 768, 12, 3072, 30522},
+    {"bert-large", 8, 512, 1024, 16, 4096, 30522},
+};
+
+const Config kPrefillConfigs[] = {
+    {"llama-7b", 4, 512, 4096, 32, 11008, 32000},
+};
+
+const Config kDecodeConfigs[] = {
+    {"llama-7b", 8, 1024, 4096, 32, 11008, 32000},
+};
+
+template <typename T>
+const char *dtype_name();
+template <>
+const char *dtype_name<float>() {
+  return "fp32";
+}
+template <>
+const char *dtype_name<__half>() {
+  return "fp16";
+}
+template <>
+const char *dtype_name<__nv_bfloat16>() {
+  return "bf16";
+}
+
+std::string shape(std::initializer_list<size_t> dims) {
+  std::string res = "[";
+  for (size_t dim : dims) {
+    if (res.size() > 1) res += ", ";
+    res += std::to_string(dim);
+  }
+  return res + "]";
+}
+
+__device__ float hash_uniform(size_t idx, unsigned seed) {
+  unsigned x = unsigned(idx) * 2654435761u ^ unsigned(idx >> 32) ^ seed;
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return (x >> 8) * (1.f / 16777216.f);
+}
+
+template <typename T>
+__global__ void ker_fill_uniform(T *data, size_t numel, float low, float high,
+                                 unsigned seed) {
+  for (size_t i = size_t(blockIdx.x) * blockDim.x + threadIdx.x; i < numel;
+       i += size_t(gridDim.x) * blockDim.x) {
+    data[i] = static_cast<T>(low + (high - low) * hash_uniform(i, seed));
+  }
+}
+
+// The device buffers of one benchmark, freed with it.
+class Buffers {
+ public:
+  explicit Buffers(cudaStream_t stream) : _stream(stream) {}
+  ~Buffers() {
+    for (void *ptr : _ptrs) cudaFree(ptr);
+  }
+
+  template <typename T>
+  T *alloc(size_t numel) {
+    T *ptr = nullptr;
+    CHECK_GPU_ERROR(cudaMalloc(&ptr, std::max(numel, size_t(1)) * sizeof(T)));
+    _ptrs.push_back(ptr);
+    return ptr;
+  }
+
+  // uniform in [low, high), truncated for the integer types.
+  template <typename T>
+  T *uniform(size_t numel, float low = -1.f, float high = 1.f) {
+    T *ptr = alloc<T>(numel);
+    size_t grid_dim = std::min((numel + MAX_THREADS - 1) / MAX_THREADS,
+                               size_t(65535));
+    ker_fill_uniform<T><<<std::max(grid_dim, size_t(1)), MAX_THREADS, 0,
+                          _stream>>>(ptr, numel, low, high, _seed++);
+    return ptr;
+  }
+
+  template <typename T>
+  T *constant(size_t numel, float value) {
+    return uniform<T>(numel, value, value);
+  }
+
+  template <typename T>
+  T *zeros(size_t numel) {
+    T *ptr = alloc<T>(numel);
+    CHECK_GPU_ERROR(cudaMemsetAsync(ptr, 0, numel * sizeof(T), _stream));
+    return ptr;
+  }
+
+  template <typename T>
+  T *copy(const std::vector<T> &host) {
+    T *ptr = alloc<T>(host.size());
+    CHECK_GPU_ERROR(cudaMemcpyAsync(ptr, host.data(), host.size() * sizeof(T),
+                                    cudaMemcpyHostToDevice, _stream));
+    CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
+    return ptr;
+  }
+
+ private:
+  cudaStream_t _stream;
+  std::vector<void *> _ptrs;
+  unsigned _seed = 1;
+};
+
+// [0, seq_len, 2 * seq_len, ..., batch * seq_len]
+std::vector<int> even_seqlens(int batch, int seq_len) {
+  std::vector<int> cu_seqlens(batch + 1);
+  for (int i = 0; i <= batch; i++) cu_seqlens[i] = i * seq_len;
+  return cu_seqlens;
+}
+
+std::vector<int> iota(int size) {
+  std::vector<int> res(size);
+  std::iota(res.begin(), res.end(), 0);
+  return res;
+}
+
+struct Result {
+  std::string kernel;
+  std::string dtype;
+  std::string model;
+  std::string shape;
+  double time_us;
+  double bytes;
+  double flops;
+};
+
+class Bench {
+ public:
+  explicit Bench(const Options &options) : _options(options) {
+    CHECK_GPU_ERROR(cudaStreamCreate(&_stream));
+    CHECK_GPU_ERROR(cudaEventCreate(&_start));
+    CHECK_GPU_ERROR(cudaEventCreate(&_stop));
+    CHECK_GPU_ERROR(cublasCreate(&_handle));
+    CHECK_GPU_ERROR(cublasSetStream(_handle, _stream));
+
+    int device = 0;
+    CHECK_GPU_ERROR(cudaGetDevice(&device));
+    cudaDeviceProp props;
+    CHECK_GPU_ERROR(cudaGetDeviceProperties(&props, device));
+    _device = props.name;
+    // double data rate, memoryClockRate in kHz and memoryBusWidth in bits.
+    _peak_gbps = options.peak_gbps > 0
+                     ? options.peak_gbps
+                     : 2.0 * props.memoryClockRate * 1e3 *
+                           (props.memoryBusWidth / 8) * 1e-9;
+    _peak_gflops = options.peak_gflops > 0
+                       ? options.peak_gflops
+                       : 2.0 * props.multiProcessorCount *
+                             fp32_cores_per_sm(props.major, props.minor) *
+                             props.clockRate * 1e3 * 1e-9;
+    printf("device %s, peak %.1f GB/s, %.1f GFLOP/s\n", _device.c_str(),
+           _peak_gbps, _peak_gflops);
+    printf("%-40s %-5s %-10s %-24s %10s %9s %6s %9s %6s %6s\n", "kernel",
+           "dtype", "model", "shape", "time(us)", "GB/s", "bw%", "GFLOP/s",
+           "flop%", "roof%");
+  }
+
+  ~Bench() {
+    cublasDestroy(_handle);
+    cudaEventDestroy(_start);
+    cudaEventDestroy(_stop);
+    cudaStreamDestroy(_stream);
+  }
+
+  cudaStream_t stream() const { return _stream; }
+  cublasHandle_t handle() const { return _handle; }
+
+  bool enabled(const std::string &kernel) const {
+    return _options.filter.empty() ||
+           kernel.find(_options.filter) != std::string::npos;
+  }
+
+  // Time launch, which issues the kernel on stream(), bytes and flops are
+  // the work of one launch. A kernel which rejects the shape is skipped.
+  template <typename Launch>
+  void run(const std::string &kernel, const char *dtype, const Config &config,
+           const std::string &shape, double bytes, double flops,
+           Launch &&launch) {
+    if (!enabled(kernel)) return;
+    float elapsed_ms = 0.f;
+    try {
+      for (int i = 0; i < _options.warmup; i++) launch();
+      CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
+      CHECK_GPU_ERROR(cudaGetLastError());
+      CHECK_GPU_ERROR(cudaEventRecord(_start, _stream));
+      for (int i = 0; i < _options.repeat; i++) launch();
+      CHECK_GPU_ERROR(cudaEventRecord(_stop, _stream));
+      CHECK_GPU_ERROR(cudaEventSynchronize(_stop));
+      CHECK_GPU_ERROR(cudaGetLastError());
+      CHECK_GPU_ERROR(cudaEventElapsedTime(&elapsed_ms, _start, _stop));
+    } catch (std::exception &e) {
+      printf("%-40s %-5s %-10s %-24s skipped: %s\n", kernel.c_str(), dtype,
+             config.name, shape.c_str(), e.what());
+      return;
+    }
+    Result res{kernel, dtype, config.name, shape,
+               elapsed_ms * 1e3 / _options.repeat, bytes, flops};
+    print(res);
+    _results.push_back(res);
+  }
+
+  void write_json() const {
+    if (_options.json_path.empty()) return;
+    FILE *fp = fopen(_options.json_path.c_str(), "w");
+    if (fp == nullptr) {
+      throw std::runtime_error("can not open " + _options.json_path);
+    }
+    fprintf(fp, "{\n  \"device\": \"%s\",\n", _device.c_str());
+    fprintf(fp, "  \"peak_gbps\": %.1f,\n  \"peak_gflops\": %.1f,\n",
+            _peak_gbps, _peak_gflops);
+    fprintf(fp, "  \"results\": [\n");
+    for (size_t i = 0; i < _results.size(); i++) {
+      const Result &res = _results[i];
+      fprintf(fp,
+              "    {\"kernel\": \"%s\", \"dtype\": \"%s\", \"model\": \"%s\", "
+              "\"shape\": \"%s\", \"time_us\": %.3f, \"gbps\": %.2f, "
+              "\"gflops\": %.2f, \"bw_pct\": %.2f, \"flops_pct\": %.2f, "
+              "\"roofline_pct\": %.2f}%s\n",
+              res.kernel.c_str(), res.dtype.c_str(), res.model.c_str(),
+              res.shape.c_str(), res.time_us, gbps(res), gflops(res),
+              100 * gbps(res) / _peak_gbps, 100 * gflops(res) / _peak_gflops,
+              roofline_pct(res), i + 1 < _results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    printf("wrote %zu results to %s\n", _results.size(),
+           _options.json_path.c_str());
+  }
+
+ private:
+  static int fp32_cores_per_sm(int major, int minor) {
+    if (major == 6) return minor == 0 ? 64 : 128;
+    if (major == 7) return 64;
+    if (major == 8) return minor == 0 ? 64 : 128;
+    return 128;
+  }
+
+  static double gbps(const Result &res) {
+    return res.bytes / (res.time_us * 1e3);
+  }
+
+  static double gflops(const Result &res) {
+    return res.flops / (res.time_us * 1e3);
+  }
+
+  // the achieved fraction of the attainable performance of the kernel.
+  double roofline_pct(const Result &res) const {
+    if (res.flops == 0) return 100 * gbps(res) / _peak_gbps;
+    double attainable =
+        std::min(_peak_gflops, res.flops / res.bytes * _peak_gbps);
+    return 100 * gflops(res) / attainable;
+  }
+
+  void print(const Result &res) const {
+    printf("%-40s %-5s %-10s %-24s %10.2f %9.1f %6.1f %9.1f %6.1f %6.1f\n",
+           res.kernel.c_str(), res.dtype.c_str(), res.model.c_str(),
+           res.shape.c_str(), res.time_us, gbps(res),
+           100 * gbps(res) / _peak_gbps, gflops(res),
+           100 * gflops(res) / _peak_gflops, roofline_pct(res));
+  }
+
+  Options _options;
+  cudaStream_t _stream;
+  cudaEvent_t _start, _stop;
+  cublasHandle_t _handle;
+  std::string _device;
+  double _peak_gbps, _peak_gflops;
+  std::vector<Result> _results;
+};
+
+const float kDropoutRatio = 0.1f;
+// the clip masks of the quantization kernels start at bit 2.
+const int kMaskStartBit = 2;
+// the clip max values hold up to 3 scalars, of input, weight and output.
+const size_t kClipMaxSize = 4;
+
+template <typename T>
+void bench_norm(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  cudaStream_t streams[2] = {stream, stream};
+  Buffers buf(stream);
+  size_t rows = cfg.tokens(), dim = cfg.hidden, numel = rows * dim;
+  std::string shp = shape({rows, dim});
+
+  T *inp = buf.uniform<T>(numel);
+  T *out = buf.alloc<T>(numel);
+  T *gamma = buf.uniform<T>(dim);
+  T *betta = buf.uniform<T>(dim);
+  T *vars = buf.uniform<T>(rows, 0.5f, 1.5f);
+  T *means = buf.uniform<T>(rows);
+  T *out_grad = buf.uniform<T>(numel);
+  T *residual_grad = buf.uniform<T>(numel);
+  T *gamma_grad = buf.alloc<T>(dim);
+  T *betta_grad = buf.alloc<T>(dim);
+  T *cmax = buf.constant<T>(kClipMaxSize, 1.f);
+  T *cmax_grad = buf.alloc<T>(kClipMaxSize);
+  int8_t *q = buf.alloc<int8_t>(numel);
+  uint8_t *cmask = buf.zeros<uint8_t>(numel);
+  float *workspace = buf.alloc<float>(ln_bw_workspace_size(dim));
+
+  bench.run("launch_layer_norm", dtype, cfg, shp,
+            sizeof(T) * (2.0 * numel + 2 * dim + 2 * rows), 8.0 * numel,
+            [&] {
+              launch_layer_norm<T>(out, vars, means, inp, gamma, betta, rows,
+                                   dim, stream);
+            });
+  bench.run("launch_layer_norm_i8", dtype, cfg, shp,
+            (sizeof(T) + 2.0) * numel + sizeof(T) * (2 * dim + 2 * rows),
+            9.0 * numel, [&] {
+              launch_layer_norm_i8<T>(q, cmask, vars, means, inp, gamma, betta,
+                                      cmax, rows, dim, stream);
+            });
+  bench.run("launch_ln_bw", dtype, cfg, shp, sizeof(T) * 4.0 * numel,
+            12.0 * numel, [&] {
+              launch_ln_bw<T>(gamma_grad, betta_grad, out, out_grad,
+                              residual_grad, inp, gamma, betta, vars, means,
+                              rows, dim, streams);
+            });
+  bench.run("launch_ln_bw_fused", dtype, cfg, shp, sizeof(T) * 4.0 * numel,
+            12.0 * numel, [&] {
+              launch_ln_bw_fused<T>(gamma_grad, betta_grad, out, out_grad,
+                                    residual_grad, inp, gamma, betta, vars,
+                                    means, workspace, rows, dim, stream);
+            });
+  bench.run("launch_quant_ln_bw", dtype, cfg, shp,
+            (sizeof(T) * 4.0 + 1) * numel, 12.0 * numel, [&] {
+              launch_quant_ln_bw<T>(gamma_grad, betta_grad, out, cmax_grad,
+                                    out_grad, residual_grad, inp, gamma, betta,
+                                    vars, means, cmask, rows, dim, streams);
+            });
+}
+
+// the norms of llama, also instantiated for bf16.
+template <typename T>
+void bench_rms_norm(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t rows = cfg.tokens(), dim = cfg.hidden, numel = rows * dim;
+  std::string shp = shape({rows, dim});
+
+  T *inp = buf.uniform<T>(numel);
+  T *out = buf.alloc<T>(numel);
+  T *gamma = buf.uniform<T>(dim);
+  T *rms = buf.uniform<T>(rows, 0.5f, 1.5f);
+  T *out_grad = buf.uniform<T>(numel);
+  T *residual_grad = buf.uniform<T>(numel);
+  T *gamma_grad = buf.alloc<T>(dim);
+  float *workspace = buf.alloc<float>(ln_bw_workspace_size(dim));
+
+  bench.run("launch_rms_layer_norm", dtype, cfg, shp, sizeof(T) * 2.0 * numel,
+            5.0 * numel, [&] {
+              launch_rms_layer_norm<T>(inp, gamma, out, nullptr, rms, rows,
+                                       dim, stream);
+            });
+  bench.run("launch_rms_ln_bw", dtype, cfg, shp, sizeof(T) * 4.0 * numel,
+            10.0 * numel, [&] {
+              launch_rms_ln_bw<T>(gamma_grad, out, out_grad, residual_grad,
+                                  inp, gamma, rms, false, workspace, rows, dim,
+                                  stream);
+            });
+}
+
+template <typename T>
+void bench_softmax(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t len = cfg.seq_len, rows = size_t(cfg.batch) * cfg.nhead * len;
+  size_t numel = rows * len;
+  std::string shp = shape({size_t(cfg.batch), size_t(cfg.nhead), len, len});
+
+  T *scores = buf.uniform<T>(numel);
+  T *out = buf.alloc<T>(numel);
+  T *soft = buf.uniform<T>(numel, 0.f, 1.f / len);
+  T *grad = buf.uniform<T>(numel);
+  T *mask = buf.zeros<T>(size_t(cfg.batch) * len);
+
+  // in place, the softmax of a softmax stays finite.
+  bench.run("launch_attn_softmax", dtype, cfg, shp, sizeof(T) * 2.0 * numel,
+            5.0 * numel, [&] {
+              launch_attn_softmax<T>(scores, mask, cfg.batch, cfg.nhead, len,
+                                     len, false, stream);
+            });
+  bench.run("launch_attn_softmax_bw", dtype, cfg, shp,
+            sizeof(T) * 3.0 * numel, 4.0 * numel, [&] {
+              launch_attn_softmax_bw<T>(grad, soft, rows, len, stream);
+            });
+}
+
+template <typename T>
+void bench_softmax_new(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t len = cfg.seq_len, rows = size_t(cfg.batch) * cfg.nhead * len;
+  size_t numel = rows * len;
+  std::string shp = shape({size_t(cfg.batch), size_t(cfg.nhead), len, len});
+
+  T *scores = buf.uniform<T>(numel);
+  T *out = buf.alloc<T>(numel);
+  T *soft = buf.uniform<T>(numel, 0.f, 1.f / len);
+  T *grad = buf.uniform<T>(numel);
+  T *mask = buf.zeros<T>(size_t(cfg.batch) * len);
+
+  bench.run("launch_attn_softmax_new", dtype, cfg, shp,
+            sizeof(T) * 2.0 * numel, 5.0 * numel, [&] {
+              launch_attn_softmax_new<T>(out, scores, mask, cfg.batch,
+                                         cfg.nhead, len, len, len, false,
+                                         stream);
+            });
+  bench.run("launch_attn_softmax_bw_new", dtype, cfg, shp,
+            sizeof(T) * 3.0 * numel, 4.0 * numel, [&] {
+              launch_attn_softmax_bw_new<T>(out, grad, soft, rows, len,
+                                            stream);
+            });
+}
+
+// prefill attention, q_len = kv_len = seq_len, and the packed encoder one.
+template <typename T>
+void bench_attention(Bench &bench, const Config &cfg, bool mask_future) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t batch = cfg.batch, heads = cfg.nhead, len = cfg.seq_len;
+  size_t head_dim = cfg.head_dim(), numel = batch * heads * len * head_dim;
+  std::string shp = shape({batch, heads, len, head_dim});
+  double flops = 4.0 * batch * heads * len * len * head_dim;
+  if (mask_future) flops /= 2;
+
+  T *q = buf.uniform<T>(numel);
+  T *k = buf.uniform<T>(numel);
+  T *v = buf.uniform<T>(numel);
+  T *out = buf.alloc<T>(numel);
+  T *mask = buf.zeros<T>(batch * len);
+  T *qkv = buf.uniform<T>(3 * numel);
+  T *qkv_bias = buf.uniform<T>(3 * heads * head_dim);
+  int *cu_seqlens = buf.copy(even_seqlens(batch, len));
+
+  bench.run("launch_flash_attention", dtype, cfg, shp,
+            sizeof(T) * 4.0 * numel, flops, [&] {
+              launch_flash_attention<T, T>(q, k, v, mask, out, batch, heads,
+                                           len, len, len, head_dim,
+                                           mask_future, stream);
+            });
+  bench.run("launch_flash_attention<token major>", dtype, cfg, shp,
+            sizeof(T) * 4.0 * numel, flops, [&] {
+              launch_flash_attention<T, T>(
+                  q, k, v, mask, out, batch, heads, len, len, len, head_dim,
+                  mask_future, stream, nullptr, 0, nullptr, nullptr, nullptr,
+                  0, true);
+            });
+  if (mask_future) return;
+  bench.run("launch_varlen_flash_attention", dtype, cfg, shp,
+            sizeof(T) * 4.0 * numel, flops, [&] {
+              launch_varlen_flash_attention<T>(qkv, qkv_bias, out, cu_seqlens,
+                                               batch, heads, len, head_dim,
+                                               stream);
+            });
+}
+
+template <typename T>
+void bench_transform(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t batch = cfg.batch, len = cfg.seq_len, dim = cfg.hidden;
+  size_t heads = cfg.nhead, head_dim = cfg.head_dim();
+  size_t numel = batch * len * dim;
+  std::string shp = shape({batch, len, dim});
+  std::string shp3 = shape({batch, len, 3, dim});
+
+  T *inp = buf.uniform<T>(3 * numel);
+  T *inp2 = buf.uniform<T>(numel);
+  T *out = buf.alloc<T>(3 * numel);
+  T *q = buf.alloc<T>(numel);
+  T *k = buf.alloc<T>(numel);
+  T *v = buf.alloc<T>(numel);
+  T *bias = buf.uniform<T>(3 * dim);
+  T *bias_grad = buf.alloc<T>(dim);
+  T *cmax = buf.constant<T>(kClipMaxSize, 1.f);
+  T *cmax_grad = buf.alloc<T>(kClipMaxSize);
+  int8_t *qinp = buf.uniform<int8_t>(3 * numel, -127.f, 128.f);
+  int8_t *qout = buf.alloc<int8_t>(3 * numel);
+  uint8_t *cmask = buf.zeros<uint8_t>(3 * numel);
+
+  bench.run("launch_bias_add_transform_20314", dtype, cfg, shp3,
+            sizeof(T) * 6.0 * numel, 3.0 * numel, [&] {
+              launch_bias_add_transform_20314<T>(out, inp, bias, batch, len, 3,
+                                                 heads, head_dim, stream);
+            });
+  bench.run("launch_bias_add_transform_20314_new", dtype, cfg, shp3,
+            sizeof(T) * 6.0 * numel, 3.0 * numel, [&] {
+              launch_bias_add_transform_20314_new<T>(q, k, v, inp, bias, batch,
+                                                     len, 3, heads, head_dim,
+                                                     stream);
+            });
+  bench.run("launch_quant_bias_add_transform_20314", dtype, cfg, shp3,
+            (sizeof(T) + 2.0) * 3 * numel, 9.0 * numel, [&] {
+              launch_quant_bias_add_transform_20314<T>(
+                  out, cmask, qinp, bias, cmax, batch, len, 3, heads, head_dim,
+                  stream);
+            });
+  bench.run("launch_transform4d_0213", dtype, cfg, shp3,
+            sizeof(T) * 6.0 * numel, 0, [&] {
+              launch_transform4d_0213<T>(out, inp, batch, len, dim, heads, 3,
+                                         stream);
+            });
+  bench.run("launch_quant_transform4d_0213", dtype, cfg, shp3,
+            (sizeof(T) + 2.0) * 3 * numel, 6.0 * numel, [&] {
+              launch_quant_transform4d_0213<T>(qout, cmask, inp, cmax, batch,
+                                               len, dim, heads, 3, stream);
+            });
+  bench.run("launch_transform_0213_dcmax", dtype, cfg, shp,
+            (sizeof(T) * 2.0 + 1) * numel, 2.0 * numel, [&] {
+              launch_transform_0213_dcmax<T>(out, cmax_grad, inp, cmask, batch,
+                                             len, dim, heads, stream);
+            });
+  bench.run("launch_split_head", dtype, cfg, shp3, sizeof(T) * 6.0 * numel,
+            3.0 * numel, [&] {
+              launch_split_head<T>(inp, bias, q, k, v, batch, dim, head_dim,
+                                   len, len, 0, 3, stream);
+            });
+  bench.run("launch_fused_add2", dtype, cfg, shp, sizeof(T) * 3.0 * numel,
+            numel, [&] {
+              launch_fused_add2<T>(out, inp, inp2, batch, len, dim, stream);
+            });
+  bench.run("launch_fuse_transpose_bias_kernel", dtype, cfg, shp,
+            sizeof(T) * numel, numel, [&] {
+              launch_fuse_transpose_bias_kernel<T>(inp, bias_grad, batch * len,
+                                                   dim, stream);
+            });
+}
+
+// the packing of the varlen encoders, also instantiated for bf16.
+template <typename T>
+void bench_padding(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t tokens = cfg.tokens(), dim = cfg.hidden, numel = tokens * dim;
+  std::string shp = shape({tokens, dim});
+
+  T *inp = buf.uniform<T>(numel);
+  T *out = buf.alloc<T>(numel);
+  // a batch without padding, every token is kept.
+  int *packed_to_padded = buf.copy(iota(tokens));
+
+  bench.run("launch_remove_padding", dtype, cfg, shp, sizeof(T) * 2.0 * numel,
+            0, [&] {
+              launch_remove_padding<T>(inp, out, packed_to_padded, tokens, dim,
+                                       stream);
+            });
+  bench.run("launch_rebuild_padding", dtype, cfg, shp,
+            sizeof(T) * 2.0 * numel, 0, [&] {
+              launch_rebuild_padding<T>(inp, out, packed_to_padded, tokens,
+                                        tokens, dim, stream);
+            });
+  bench.run("launch_transform_0213", dtype, cfg, shp, sizeof(T) * 2.0 * numel,
+            0, [&] {
+              launch_transform_0213<T>(inp, out, cfg.batch, cfg.seq_len,
+                                       cfg.nhead, cfg.head_dim(), stream);
+            });
+  int *token_ids = buf.uniform<int>(tokens, 1.f, cfg.vocab);
+  bench.run("launch_sequence_pooling<mean, l2>", dtype, cfg, shp,
+            sizeof(T) * numel + 4.0 * tokens, numel, [&] {
+              launch_sequence_pooling<T, T>(inp, token_ids, out, cfg.batch,
+                                            cfg.seq_len, dim, 0,
+                                            PoolingMethod::kMean, true,
+                                            stream);
+            });
+}
+
+void bench_index(Bench &bench, const Config &cfg) {
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t tokens = cfg.tokens();
+  std::string shp = shape({size_t(cfg.batch), size_t(cfg.seq_len)});
+  const int padding_id = 0;
+
+  int *token_ids = buf.uniform<int>(tokens, 1.f, cfg.vocab);
+  int *cu_seqlens = buf.alloc<int>(cfg.batch + 1);
+  int *packed_to_padded = buf.alloc<int>(tokens);
+  int *seq_cu_seqlens = buf.copy(even_seqlens(cfg.batch, cfg.seq_len));
+  int *seq_ids = buf.alloc<int>(tokens);
+  int *positions = buf.alloc<int>(tokens);
+
+  bench.run("launch_varlen_offsets", "int32", cfg, shp, 4.0 * 2 * tokens, 0,
+            [&] {
+              launch_varlen_offsets(token_ids, cu_seqlens, packed_to_padded,
+                                    cfg.batch, cfg.seq_len, padding_id,
+                                    stream);
+            });
+  bench.run("launch_packed_seq_ids", "int32", cfg, shp, 4.0 * 2 * tokens, 0,
+            [&] {
+              launch_packed_seq_ids(seq_ids, positions, seq_cu_seqlens,
+                                    cfg.batch, tokens, stream);
+            });
+  bench.run("launch_curand_init", "int32", cfg, shp, 0, 0, [&] {
+    launch_curand_init(tokens * cfg.hidden, cfg.hidden, stream);
+  });
+}
+
+template <typename T>
+void bench_concat(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  // the self attention cache of a decode step, [batch * nhead, len, head_dim]
+  size_t rows = size_t(cfg.batch) * cfg.nhead, len = cfg.seq_len;
+  size_t head_dim = cfg.head_dim(), max_len = 2 * len;
+  size_t cache_numel = rows * len * head_dim, step_numel = rows * head_dim;
+  std::string shp = shape({rows, len, head_dim});
+
+  T *cache = buf.uniform<T>(cache_numel);
+  T *step = buf.uniform<T>(step_numel);
+  T *out = buf.alloc<T>(cache_numel + step_numel);
+  T *full_cache = buf.uniform<T>(rows * max_len * head_dim);
+
+  bench.run("launch_concat3_dim1", dtype, cfg, shp,
+            sizeof(T) * 2.0 * (cache_numel + step_numel), 0, [&] {
+              launch_concat3_dim1<T>(cache, step, out, rows, head_dim, len, 1,
+                                     stream);
+            });
+  bench.run("launch_filling_concat3_dim1", dtype, cfg, shp,
+            sizeof(T) * 2.0 * step_numel, 0, [&] {
+              launch_filling_concat3_dim1<T>(full_cache, step, rows, max_len,
+                                             head_dim, len, 1, stream);
+            });
+}
+
+template <ActivationType act, typename T>
+void bench_act_dropout(Bench &bench, const Config &cfg, const char *act_name) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t rows = cfg.tokens(), dim = cfg.inner, numel = rows * dim;
+  std::string shp = shape({rows, dim});
+  std::string suffix = std::string("<") + act_name + ">";
+
+  T *inp = buf.uniform<T>(numel);
+  T *out = buf.alloc<T>(numel);
+  T *out_grad = buf.uniform<T>(numel);
+  T *bias = buf.uniform<T>(dim);
+  T *bias_grad = buf.alloc<T>(dim);
+  T *cmax = buf.constant<T>(kClipMaxSize, 1.f);
+  T *cmax_in_grad = buf.alloc<T>(kClipMaxSize);
+  T *cmax_out_grad = buf.alloc<T>(kClipMaxSize);
+  int8_t *qinp = buf.uniform<int8_t>(numel, -127.f, 128.f);
+  int8_t *qout = buf.alloc<int8_t>(numel);
+  uint8_t *mask = buf.zeros<uint8_t>(numel);
+  uint8_t *cmask_in = buf.zeros<uint8_t>(numel);
+  uint8_t *cmask_out = buf.zeros<uint8_t>(numel);
+  double act_flops = 10.0 * numel;
+
+  bench.run("launch_ls_dropout_act_bias" + suffix, dtype, cfg, shp,
+            (sizeof(T) * 2.0 + 1) * numel, act_flops, [&] {
+              launch_ls_dropout_act_bias<act, T>(out, inp, mask, bias, numel,
+                                                 dim, kDropoutRatio, stream);
+            });
+  bench.run("launch_ls_dropout_act_bias_bwd" + suffix, dtype, cfg, shp,
+            (sizeof(T) * 3.0 + 1) * numel, 2 * act_flops, [&] {
+              launch_ls_dropout_act_bias_bwd<act, T>(
+                  out, bias_grad, inp, bias, out_grad, mask, rows, dim,
+                  kDropoutRatio, stream);
+            });
+  bench.run("launch_ls_quant_dropout_act_bias" + suffix, dtype, cfg, shp,
+            5.0 * numel, act_flops, [&] {
+              launch_ls_quant_dropout_act_bias<act, T>(
+                  qout, cmask_out, cmask_in, mask, qinp, bias, cmax, cmax,
+                  numel, dim, kDropoutRatio, stream);
+            });
+  bench.run("launch_ls_fakequant_dropout_act_bias" + suffix, dtype, cfg, shp,
+            (sizeof(T) + 4.0) * numel, act_flops, [&] {
+              launch_ls_fakequant_dropout_act_bias<act, T>(
+                  out, cmask_out, cmask_in, mask, qinp, bias, cmax, cmax,
+                  numel, dim, kDropoutRatio, stream);
+            });
+  bench.run("launch_ls_quant_dropout_act_bias_bwd" + suffix, dtype, cfg, shp,
+            (sizeof(T) * 2.0 + 4) * numel, 2 * act_flops, [&] {
+              launch_ls_quant_dropout_act_bias_bwd<act, T>(
+                  out, bias_grad, cmax_in_grad, cmax_out_grad, qinp, cmax,
+                  cmask_in, cmask_out, bias, out_grad, mask, rows, dim,
+                  kDropoutRatio, stream);
+            });
+}
+
+template <typename T>
+void bench_dropout(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t rows = cfg.tokens(), dim = cfg.hidden, numel = rows * dim;
+  std::string shp = shape({rows, dim});
+
+  T *inp = buf.uniform<T>(numel);
+  T *residual = buf.uniform<T>(numel);
+  T *out = buf.alloc<T>(numel);
+  T *bias = buf.uniform<T>(dim);
+  T *bias_grad = buf.alloc<T>(dim);
+  T *cmax = buf.constant<T>(kClipMaxSize, 1.f);
+  int8_t *qinp = buf.uniform<int8_t>(numel, -127.f, 128.f);
+  uint8_t *mask = buf.zeros<uint8_t>(numel);
+
+  bench.run("launch_ls_dropout", dtype, cfg, shp,
+            (sizeof(T) * 2.0 + 1) * numel, numel, [&] {
+              launch_ls_dropout<T>(out, inp, mask, numel, kDropoutRatio,
+                                   stream);
+            });
+  bench.run("launch_ls_dropout_res_bias", dtype, cfg, shp,
+            (sizeof(T) * 3.0 + 1) * numel, 3.0 * numel, [&] {
+              launch_ls_dropout_res_bias<T>(out, inp, mask, bias, residual,
+                                            numel, dim, kDropoutRatio, stream);
+            });
+  bench.run("launch_ls_dropout_bias_bwd", dtype, cfg, shp,
+            (sizeof(T) * 2.0 + 1) * numel, 2.0 * numel, [&] {
+              launch_ls_dropout_bias_bwd<T>(out, bias_grad, inp, mask, rows,
+                                            dim, kDropoutRatio, stream);
+            });
+  bench.run("launch_ls_quant_dropout_res_bias", dtype, cfg, shp,
+            (sizeof(T) * 2.0 + 2) * numel, 4.0 * numel, [&] {
+              launch_ls_quant_dropout_res_bias<T>(out, mask, qinp, cmax, bias,
+                                                  residual, numel, dim,
+                                                  kDropoutRatio, stream);
+            });
+
+  bench_act_dropout<ActivationType::kRelu, T>(bench, cfg, "relu");
+  bench_act_dropout<ActivationType::kGelu, T>(bench, cfg, "gelu");
+}
+
+template <typename T>
+void bench_quantize(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t rows = cfg.tokens(), dim = cfg.hidden, numel = rows * dim;
+  std::string shp = shape({rows, dim});
+  // the gradient buckets of gcq, reduced over 8 ranks.
+  const int world_size = 8, topk = 4;
+
+  T *inp = buf.uniform<T>(numel);
+  T *out = buf.alloc<T>(numel);
+  T *cmax = buf.constant<T>(kClipMaxSize, 1.f);
+  T *cmax_grad = buf.alloc<T>(kClipMaxSize);
+  float *fp8_scale = buf.constant<float>(1, 1.f / 448);
+  int8_t *q = buf.uniform<int8_t>(numel, -127.f, 128.f);
+  uint8_t *q8 = buf.alloc<uint8_t>(numel);
+  uint8_t *cmask = buf.zeros<uint8_t>(numel);
+  float *scales = buf.uniform<float>(rows, 0.01f, 0.02f);
+  float *error = buf.zeros<float>(numel);
+  int8_t *q_shards = buf.uniform<int8_t>(world_size * numel, -127.f, 128.f);
+  float *shard_scales = buf.uniform<float>(world_size * rows, 0.01f, 0.02f);
+
+  bench.run("launch_quantize", dtype, cfg, shp, (sizeof(T) + 2.0) * numel,
+            4.0 * numel, [&] {
+              launch_quantize<T>(q, cmask, nullptr, inp, cmax, numel,
+                                 kMaskStartBit, stream);
+            });
+  bench.run("launch_quantize<rows>", dtype, cfg, shp,
+            (sizeof(T) + 2.0) * numel, 4.0 * numel, [&] {
+              launch_quantize<T>(q, cmask, nullptr, inp, cmax, rows, dim,
+                                 kMaskStartBit, stream);
+            });
+  bench.run("launch_fake_quantize", dtype, cfg, shp,
+            (sizeof(T) * 2.0 + 1) * numel, 5.0 * numel, [&] {
+              launch_fake_quantize<T>(cmask, nullptr, out, inp, cmax, numel,
+                                      kMaskStartBit, stream);
+            });
+  bench.run("launch_dequantize", dtype, cfg, shp, (sizeof(T) + 1.0) * numel,
+            2.0 * numel, [&] {
+              launch_dequantize<T>(out, q, cmax, numel, kMaskStartBit, stream);
+            });
+  bench.run("launch_dequantize<rows>", dtype, cfg, shp,
+            (sizeof(T) + 1.0) * numel, 2.0 * numel, [&] {
+              launch_dequantize<T>(out, q, cmax, rows, dim, kMaskStartBit,
+                                   stream);
+            });
+  bench.run("launch_quantize_fp8", dtype, cfg, shp, (sizeof(T) + 1.0) * numel,
+            numel, [&] {
+              launch_quantize_fp8<T>(q8, inp, fp8_scale, numel, stream);
+            });
+  bench.run("launch_quantize_bwd", dtype, cfg, shp,
+            (sizeof(T) * 2.0 + 1) * numel, numel, [&] {
+              launch_quantize_bwd<T>(out, cmax_grad, cmask, numel,
+                                     kMaskStartBit, stream);
+            });
+  bench.run("launch_d_cmax", dtype, cfg, shp, (sizeof(T) * 2.0 + 1) * numel,
+            numel, [&] {
+              launch_d_cmax<T>(out, cmax_grad, cmask, numel, kMaskStartBit,
+                               stream);
+            });
+  bench.run("launch_gcq_quantize", dtype, cfg, shp,
+            (sizeof(T) + 9.0) * numel, 6.0 * numel, [&] {
+              launch_gcq_quantize<T>(q, scales, inp, error, numel, rows, dim,
+                                     topk, stream);
+            });
+  bench.run("launch_gcq_dequantize", dtype, cfg, shp,
+            (sizeof(T) + 1.0) * numel, numel, [&] {
+              launch_gcq_dequantize<T>(out, q, scales, numel, dim, stream);
+            });
+  if (std::is_same<T, float>::value) {
+    bench.run("launch_gcq_reduce_quantize", "int8", cfg, shp,
+              (world_size + 1.0) * numel, 2.0 * world_size * numel, [&] {
+                launch_gcq_reduce_quantize(q, scales, q_shards, shard_scales,
+                                           world_size, rows, dim, topk,
+                                           stream);
+              });
+  }
+}
+
+template <typename T>
+void bench_embedding(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t batch = cfg.batch, len = cfg.seq_len, dim = cfg.hidden;
+  size_t vocab = cfg.vocab, tokens = batch * len, numel = tokens * dim;
+  // the learned positions of bert.
+  size_t max_seq_len = std::max(len, size_t(512));
+  std::string shp = shape({batch, len, dim});
+  const int padding_id = 0;
+
+  int *token_ids = buf.uniform<int>(tokens, 1.f, vocab);
+  int *tokens_position = buf.uniform<int>(tokens, 0.f, len);
+  T *emb = buf.uniform<T>(vocab * dim);
+  T *pos_emb = buf.uniform<T>(max_seq_len * dim);
+  T *out = buf.alloc<T>(numel);
+  T *grad_out = buf.uniform<T>(numel);
+  // the grad of the clip max follows the grad of the embeddings.
+  T *grad_emb = buf.alloc<T>(vocab * dim + 8);
+  T *grad_cmax = buf.alloc<T>(kClipMaxSize);
+  T *grad_pos = buf.alloc<T>(max_seq_len * dim);
+  uint8_t *mask = buf.zeros<uint8_t>(numel);
+  T *pad_mask = buf.alloc<T>(tokens);
+  T *gamma = buf.uniform<T>(dim);
+  T *betta = buf.uniform<T>(dim);
+
+  // the inference embeddings of the encoders, alone and with their layer
+  // norm fused.
+  bench.run("launch_enc_emb", dtype, cfg, shp, sizeof(T) * 3.0 * numel,
+            numel, [&] {
+              launch_enc_emb<T>(emb, pos_emb, token_ids, out, pad_mask,
+                                padding_id, batch, len, dim, stream, nullptr,
+                                nullptr, 0);
+            });
+  bench.run("launch_enc_emb_ln", dtype, cfg, shp, sizeof(T) * 3.0 * numel,
+            10.0 * numel, [&] {
+              launch_enc_emb_ln<T>(emb, pos_emb, token_ids, gamma, betta, out,
+                                   pad_mask, padding_id, batch, len, dim,
+                                   stream);
+            });
+  bench.run("launch_lookup_scale_pos_dropout", dtype, cfg, shp,
+            (sizeof(T) * 3.0 + 1) * numel, 3.0 * numel, [&] {
+              launch_lookup_scale_pos_dropout<T>(
+                  out, token_ids, emb, pos_emb, nullptr, mask, tokens_position,
+                  batch, len, dim, padding_id, kDropoutRatio, 0, stream);
+            });
+  // zeroes the grad of the whole embedding table.
+  bench.run("launch_d_lookup_scale_pos_dropout", dtype, cfg, shp,
+            sizeof(T) * (vocab * dim + max_seq_len * dim + 3.0 * numel) +
+                numel,
+            2.0 * numel, [&] {
+              launch_d_lookup_scale_pos_dropout<T>(
+                  grad_emb, grad_cmax, grad_pos, grad_out, token_ids, mask,
+                  tokens_position, batch, len, dim, vocab, max_seq_len,
+                  padding_id, kDropoutRatio, true, stream);
+            });
+}
+
+// the embeddings of llama, also instantiated for bf16.
+template <typename T>
+void bench_llama_embedding(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t batch = cfg.batch, len = cfg.seq_len, dim = cfg.hidden;
+  size_t vocab = cfg.vocab, tokens = batch * len, numel = tokens * dim;
+  size_t max_step = 2 * len;
+  std::string shp = shape({batch, len, dim});
+  const int padding_id = 0;
+
+  int *token_ids = buf.uniform<int>(tokens, 1.f, vocab);
+  T *emb = buf.uniform<T>(vocab * dim);
+  int8_t *emb_i8 = buf.uniform<int8_t>(vocab * dim, -127.f, 128.f);
+  T *emb_scale = buf.uniform<T>(vocab, 0.01f, 0.02f);
+  T *out = buf.alloc<T>(numel);
+  T *pad_mask = buf.alloc<T>(batch * max_step);
+  int *left_pad_len = buf.alloc<int>(batch);
+
+  bench.run("launch_llama_embedding", dtype, cfg, shp,
+            sizeof(T) * (2.0 * numel + batch * max_step), 0, [&] {
+              launch_llama_embedding<T>(emb, token_ids, out, pad_mask,
+                                        left_pad_len, batch, 1, dim, 0, len,
+                                        max_step, padding_id, stream);
+            });
+  bench.run("launch_llama_embedding_i8", dtype, cfg, shp,
+            (sizeof(T) + 1.0) * numel + sizeof(T) * batch * max_step, numel,
+            [&] {
+              launch_llama_embedding_i8<T>(emb_i8, emb_scale, token_ids, out,
+                                           pad_mask, left_pad_len, batch, 1,
+                                           dim, 0, len, max_step, padding_id,
+                                           stream);
+            });
+}
+
+template <typename T>
+void bench_loss(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t tokens = cfg.tokens(), vocab = cfg.vocab, dim = cfg.hidden;
+  size_t logits_numel = tokens * vocab;
+  std::string shp = shape({tokens, vocab});
+  const int padding_id = 0, chunk_size = 8192, num_tags = 16;
+  const float epsilon = 0.1f;
+
+  T *logits = buf.uniform<T>(logits_numel);
+  T *grad_logits = buf.alloc<T>(logits_numel);
+  int *targets = buf.uniform<int>(tokens, 1.f, vocab);
+  float *loss = buf.alloc<float>(1);
+  float *nll_loss = buf.alloc<float>(1);
+  float *grad_loss = buf.constant<float>(1, 1.f);
+  float *loss_buffer = buf.alloc<float>(2 * tokens);
+  float *stats_buffer = buf.alloc<float>(4 * tokens);
+  float *lse = buf.alloc<float>(tokens);
+  T *inputs = buf.uniform<T>(tokens * dim);
+  T *weight = buf.uniform<T>(vocab * dim, -0.05f, 0.05f);
+  T *grad_inputs = buf.alloc<T>(tokens * dim);
+  T *grad_weight = buf.alloc<T>(vocab * dim);
+  T *logits_buffer = buf.alloc<T>(tokens * chunk_size);
+
+  bench.run("launch_cross_entropy_fw", dtype, cfg, shp,
+            sizeof(T) * double(logits_numel), 4.0 * logits_numel, [&] {
+              launch_cross_entropy_fw<T>(logits, targets, loss, nll_loss,
+                                         loss_buffer, padding_id, epsilon,
+                                         cfg.batch, cfg.seq_len, vocab,
+                                         stream);
+            });
+  bench.run("launch_cross_entropy_bw", dtype, cfg, shp,
+            sizeof(T) * 2.0 * logits_numel, 4.0 * logits_numel, [&] {
+              launch_cross_entropy_bw<T>(grad_loss, logits, targets,
+                                         grad_logits, padding_id, epsilon,
+                                         cfg.batch, cfg.seq_len, vocab,
+                                         stream);
+            });
+  // the logits are chunks in the cache, the gemms dominate.
+  bench.run("launch_fused_linear_cross_entropy_fw", dtype, cfg, shp,
+            sizeof(T) * double(tokens * dim + vocab * dim),
+            2.0 * logits_numel * dim, [&] {
+              launch_fused_linear_cross_entropy_fw<T>(
+                  inputs, weight, targets, loss, nll_loss, lse, loss_buffer,
+                  stats_buffer, logits_buffer, padding_id, epsilon, tokens,
+                  dim, vocab, chunk_size, bench.handle(), stream);
+            });
+  bench.run("launch_fused_linear_cross_entropy_bw", dtype, cfg, shp,
+            sizeof(T) * 2.0 * (tokens * dim + vocab * dim),
+            6.0 * logits_numel * dim, [&] {
+              launch_fused_linear_cross_entropy_bw<T>(
+                  grad_loss, inputs, weight, targets, lse, grad_inputs,
+                  grad_weight, logits_buffer, padding_id, epsilon, tokens, dim,
+                  vocab, chunk_size, bench.handle(), stream);
+            });
+
+  // the crf of a token classification head.
+  size_t emission_numel = tokens * num_tags;
+  T *start_transition = buf.uniform<T>(num_tags);
+  T *end_transition = buf.uniform<T>(num_tags);
+  T *transition = buf.uniform<T>(num_tags * num_tags);
+  T *emission = buf.uniform<T>(emission_numel);
+  T *crf_mask = buf.constant<T>(tokens, 1.f);
+  float *best_score = buf.alloc<float>(cfg.batch);
+  int *history = buf.alloc<int>(emission_numel);
+  int *best_tags = buf.alloc<int>(tokens);
+  bench.run("launch_viterbi", dtype, cfg,
+            shape({size_t(cfg.batch), size_t(cfg.seq_len), size_t(num_tags)}),
+            sizeof(T) * double(emission_numel) + 4.0 * emission_numel,
+            2.0 * emission_numel * num_tags, [&] {
+              launch_viterbi<T>(start_transition, end_transition, transition,
+                                emission, crf_mask, best_score, history,
+                                best_tags, num_tags, cfg.seq_len, cfg.batch,
+                                stream);
+            });
+}
+
+template <typename T>
+void bench_glu(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t tokens = cfg.tokens(), inner = cfg.inner, numel = tokens * inner;
+  std::string shp = shape({tokens, inner});
+
+  // [tokens, 2 * inner], the gate then the up projection.
+  T *inp = buf.uniform<T>(2 * numel);
+  T *inp_grad = buf.alloc<T>(2 * numel);
+  T *out = buf.alloc<T>(numel);
+  T *out_grad = buf.uniform<T>(numel);
+
+  bench.run("launch_silu_elewise_product", dtype, cfg, shp,
+            sizeof(T) * 3.0 * numel, 6.0 * numel, [&] {
+              launch_silu_elewise_product<T>(inp, out, cfg.batch, cfg.seq_len,
+                                             inner, stream);
+            });
+  bench.run("launch_silu_elewise_product_bw", dtype, cfg, shp,
+            sizeof(T) * 5.0 * numel, 12.0 * numel, [&] {
+              launch_silu_elewise_product_bw<T>(inp_grad, out_grad, inp,
+                                                cfg.batch, cfg.seq_len, inner,
+                                                stream);
+            });
+  bench.run("launch_gelu_elewise_product", dtype, cfg, shp,
+            sizeof(T) * 3.0 * numel, 12.0 * numel, [&] {
+              launch_gelu_elewise_product<T>(inp, out, cfg.batch, cfg.seq_len,
+                                             inner, stream);
+            });
+}
+
+// the qkv split and rotary embedding of a prefill, and of its backward.
+template <typename T>
+void bench_rotary(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t batch = cfg.batch, len = cfg.seq_len, heads = cfg.nhead;
+  size_t head_dim = cfg.head_dim(), max_step = 2 * len;
+  size_t numel = batch * len * heads * head_dim;
+  size_t cache_numel = batch * heads * max_step * head_dim;
+  std::string shp = shape({batch, len, 3, heads, head_dim});
+
+  T *inp = buf.uniform<T>(3 * numel);
+  T *inp_grad = buf.alloc<T>(3 * numel);
+  T *sin = buf.uniform<T>(max_step * head_dim / 2);
+  T *cos = buf.uniform<T>(max_step * head_dim / 2);
+  T *q = buf.uniform<T>(numel);
+  T *k = buf.uniform<T>(numel);
+  T *v = buf.uniform<T>(numel);
+  T *cache_k = buf.alloc<T>(cache_numel);
+  T *cache_v = buf.alloc<T>(cache_numel);
+  int8_t *cache_k_i8 = buf.alloc<int8_t>(cache_numel);
+  int8_t *cache_v_i8 = buf.alloc<int8_t>(cache_numel);
+  float *k_scale = buf.alloc<float>(batch * heads * max_step);
+  float *v_scale = buf.alloc<float>(batch * heads * max_step);
+
+  bench.run("launch_split_rotary_position_qkv", dtype, cfg, shp,
+            sizeof(T) * 6.0 * numel, 6.0 * numel, [&] {
+              launch_split_rotary_position_qkv<T>(inp, sin, cos, q, cache_k,
+                                                  cache_v, max_step, batch,
+                                                  heads, 0, len, head_dim,
+                                                  stream);
+            });
+  bench.run("launch_split_rotary_position_qkv_bw", dtype, cfg, shp,
+            sizeof(T) * 6.0 * numel, 6.0 * numel, [&] {
+              launch_split_rotary_position_qkv_bw<T>(inp_grad, sin, cos, q, k,
+                                                     v, batch, heads, len,
+                                                     head_dim, stream);
+            });
+  bench.run("launch_split_rotary_position_qkv_i8", dtype, cfg, shp,
+            sizeof(T) * 4.0 * numel + 2.0 * numel, 10.0 * numel, [&] {
+              launch_split_rotary_position_qkv_i8<T>(
+                  inp, sin, cos, q, cache_k_i8, cache_v_i8, k_scale, v_scale,
+                  max_step, batch, heads, 0, len, head_dim, stream);
+            });
+}
+
+// one decode step of batch sequences of seq_len cached tokens, batch is at
+// most the kWeightOnlyMaxGemvTokens of the gemvs.
+template <typename T>
+void bench_decode(Bench &bench, const Config &cfg) {
+  const char *dtype = dtype_name<T>();
+  cudaStream_t stream = bench.stream();
+  Buffers buf(stream);
+  size_t batch = cfg.batch, kv_len = cfg.seq_len, heads = cfg.nhead;
+  size_t head_dim = cfg.head_dim(), dim = cfg.hidden, inner = cfg.inner;
+  size_t max_step = 2 * kv_len, page_size = 16;
+  size_t max_pages = max_step / page_size, num_pages = batch * max_pages;
+  size_t cache_numel = batch * heads * max_step * head_dim;
+  size_t step_numel = batch * heads * head_dim;
+  std::string attn_shp = shape({batch, heads, kv_len, head_dim});
+  double attn_flops = 4.0 * batch * heads * kv_len * head_dim;
+  double attn_bytes = sizeof(T) * 2.0 * batch * heads * kv_len * head_dim;
+  double attn_bytes_i8 = (2.0 + 8.0 / head_dim) * batch * heads * kv_len *
+                         head_dim;
+  const int group_size = 128;
+
+  T *q = buf.uniform<T>(step_numel);
+  T *out = buf.alloc<T>(std::max(step_numel, batch * 2 * inner));
+  T *cache_k = buf.uniform<T>(cache_numel);
+  T *cache_v = buf.uniform<T>(cache_numel);
+  int8_t *cache_k_i8 = buf.uniform<int8_t>(cache_numel, -127.f, 128.f);
+  int8_t *cache_v_i8 = buf.uniform<int8_t>(cache_numel, -127.f, 128.f);
+  float *k_scale = buf.uniform<float>(batch * heads * max_step, 0.01f, 0.02f);
+  float *v_scale = buf.uniform<float>(batch * heads * max_step, 0.01f, 0.02f);
+  T *mask = buf.zeros<T>(batch * max_step);
+  float *workspace =
+      buf.alloc<float>(size_t(kFlashMaxPartials) * (head_dim + 2));
+  // page p of sequence b is the page b * max_pages + p of the pool.
+  int *page_table = buf.copy(iota(num_pages));
+
+  bench.run("launch_flash_attention<decode>", dtype, cfg, attn_shp,
+            attn_bytes, attn_flops, [&] {
+              launch_flash_attention<T, T>(q, cache_k, cache_v, mask, out,
+                                           batch, heads, 1, kv_len, max_step,
+                                           head_dim, false, stream, workspace);
+            });
+  // the keys of the beams of beam search are spread over all the rows.
+  std::vector<int> kv_rows(batch * max_step);
+  for (size_t i = 0; i < kv_rows.size(); i++) {
+    kv_rows[i] = (i / max_step + i % max_step) % batch;
+  }
+  int *kv_rows_ptr = buf.copy(kv_rows);
+  bench.run("launch_flash_attention<decode, kv rows>", dtype, cfg, attn_shp,
+            attn_bytes, attn_flops, [&] {
+              launch_flash_attention<T, T>(
+                  q, cache_k, cache_v, mask, out, batch, heads, 1, kv_len,
+                  max_step, head_dim, false, stream, workspace, 0, nullptr,
+                  nullptr, nullptr, 0, false, kv_rows_ptr);
+            });
+  // a step at max_step over a ring of kv_len rows, 4 of them sinks, which
+  // reads as many keys as the plain decode.
+  bench.run("launch_flash_attention<decode, ring>", dtype, cfg, attn_shp,
+            attn_bytes, attn_flops, [&] {
+              launch_flash_attention<T, T>(
+                  q, cache_k, cache_v, mask, out, batch, heads, 1, max_step,
+                  kv_len, head_dim, false, stream, workspace, 0, nullptr,
+                  nullptr, nullptr, 0, false, nullptr, kv_len - 4,
+                  kv_len - 4, max_step);
+            });
+  // the same ring with 64 heavy hitters in place of the sinks, the softmax
+  // accumulates the attention mass and the key leaving the window is
+  // compacted into them.
+  int heavy_len = 64;
+  int *heavy_pos = buf.copy(std::vector<int>(batch * heads * heavy_len, -1));
+  float *kv_mass = buf.zeros<float>(batch * heads * kv_len);
+  float *mass_workspace = buf.alloc<float>(batch * heads * kv_len);
+  bench.run("launch_flash_attention<decode, heavy hitters>", dtype, cfg,
+            attn_shp, attn_bytes, attn_flops, [&] {
+              launch_flash_attention<T, T>(
+                  q, cache_k, cache_v, mask, out, batch, heads, 1, max_step,
+                  kv_len, head_dim, false, stream, workspace, 0, nullptr,
+                  nullptr, nullptr, 0, false, nullptr, kv_len - heavy_len,
+                  kv_len - heavy_len, max_step, nullptr, 0, heavy_pos,
+                  kv_mass, mass_workspace);
+              launch_evict_heavy_hitters<T>(
+                  cache_k, cache_v, nullptr, nullptr, heavy_pos, kv_mass,
+                  batch, heads, max_step, 1, kv_len, kv_len - heavy_len,
+                  kv_len - heavy_len, head_dim, stream);
+            });
+  bench.run("launch_flash_attention<decode, int8>", dtype, cfg, attn_shp,
+            attn_bytes_i8, attn_flops, [&] {
+              launch_flash_attention<T, int8_t>(
+                  q, cache_k_i8, cache_v_i8, mask, out, batch, heads, 1,
+                  kv_len, max_step, head_dim, false, stream, workspace, 0,
+                  k_scale, v_scale);
+            });
+  bench.run("launch_paged_attention", dtype, cfg, attn_shp, attn_bytes,
+            attn_flops, [&] {
+              launch_paged_attention<T, T>(q, cache_k, cache_v, mask,
+                                           page_table, out, batch, heads,
+                                           head_dim, 1, kv_len - 1, page_size,
+                                           max_pages, max_step, stream);
+            });
+  bench.run("launch_paged_attention<int8>", dtype, cfg, attn_shp,
+            attn_bytes_i8, attn_flops, [&] {
+              launch_paged_attention<T, int8_t>(
+                  q, cache_k_i8, cache_v_i8, mask, page_table, out, batch,
+                  heads, head_dim, 1, kv_len - 1, page_size, max_pages,
+                  max_step, stream, nullptr, nullptr, 0, k_scale, v_scale);
+            });
+
+  // the qkv of the step, written to the cache at kv_len - 1.
+  T *qkv = buf.uniform<T>(3 * step_numel);
+  T *sin = buf.uniform<T>(max_step * head_dim / 2);
+  T *cos = buf.uniform<T>(max_step * head_dim / 2);
+  T *qkv_weight = buf.uniform<T>(dim * 3 * dim, -0.02f, 0.02f);
+  T *inp = buf.uniform<T>(batch * std::max(dim, inner));
+  std::string step_shp = shape({batch, 3, heads, head_dim});
+  bench.run("launch_split_rotary_position_qkv<decode>", dtype, cfg, step_shp,
+            sizeof(T) * 6.0 * step_numel, 6.0 * step_numel, [&] {
+              launch_split_rotary_position_qkv<T>(qkv, sin, cos, q, cache_k,
+                                                  cache_v, max_step, batch,
+                                                  heads, kv_len - 1, 1,
+                                                  head_dim, stream);
+            });
+  bench.run("launch_gemv_qkv_rotary", dtype, cfg,
+            shape({batch, dim, 3 * dim}), sizeof(T) * 3.0 * dim * dim,
+            2.0 * batch * dim * 3 * dim, [&] {
+              launch_gemv_qkv_rotary<T>(inp, qkv_weight, sin, cos, q, cache_k,
+                                        cache_v, max_step, batch, heads,
+                                        kv_len - 1, 1, head_dim, dim, stream);
+            });
+
+  // the ffn of the step, plain and weight only quantized.
+  T *ffn_weight = buf.uniform<T>(dim * 2 * inner, -0.02f, 0.02f);
+  int8_t *qweight = buf.uniform<int8_t>(dim * 2 * inner, -127.f, 128.f);
+  T *qscale = buf.uniform<T>(dim / group_size * 2 * inner, 0.001f, 0.002f);
+  T *dequant = buf.alloc<T>(dim * inner);
+  std::string ffn_shp = shape({batch, dim, inner});
+  double gemv_flops = 2.0 * batch * dim * inner;
+  bench.run("launch_gemv_swiglu", dtype, cfg, ffn_shp,
+            sizeof(T) * 2.0 * dim * inner, 2 * gemv_flops, [&] {
+              launch_gemv_swiglu<T>(inp, ffn_weight, out, batch, dim, inner,
+                                    stream);
+            });
+  for (int bits : {8, 4}) {
+    std::string suffix = "<int" + std::to_string(bits) + ">";
+    double weight_bytes = bits / 8.0 * dim * inner;
+    bench.run("launch_weight_only_gemv" + suffix, dtype, cfg, ffn_shp,
+              weight_bytes, gemv_flops, [&] {
+                launch_weight_only_gemv<T>(inp, qweight, qscale, out, batch,
+                                           dim, inner, bits, group_size,
+                                           false, stream);
+              });
+    bench.run("launch_weight_only_gemv_swiglu" + suffix, dtype, cfg, ffn_shp,
+              2 * weight_bytes, 2 * gemv_flops, [&] {
+                launch_weight_only_gemv_swiglu<T>(inp, qweight, qscale, out,
+                                                  batch, dim, inner, bits,
+                                                  group_size, stream);
+              });
+    bench.run("launch_weight_only_dequant" + suffix, dtype, cfg,
+              shape({dim, inner}), weight_bytes + sizeof(T) * dim * inner,
+              dim * inner, [&] {
+                launch_weight_only_dequant<T>(qweight, qscale, dequant, dim,
+                                              inner, bits, group_size, stream);
+              });
+  }
+
+  // a multi lora batch, every row with one of num_slots adapters.
+  const int num_slots = 4, rank = 16;
+  std::vector<const T *> host_a(num_slots), host_b(num_slots);
+  for (int i = 0; i < num_slots; i++) {
+    host_a[i] = buf.uniform<T>(rank * dim);
+    host_b[i] = buf.uniform<T>(rank * dim);
+  }
+  const T *const *a_ptrs = buf.copy(host_a);
+  const T *const *b_ptrs = buf.copy(host_b);
+  std::vector<int> host_slots(batch);
+  for (size_t i = 0; i < batch; i++) host_slots[i] = i % num_slots;
+  int *row_slots = buf.copy(host_slots);
+  float *lora_scales = buf.constant<float>(num_slots, 1.f);
+  float *lora_tmp = buf.uniform<float>(batch * rank);
+  std::string lora_shp = shape({batch, dim, size_t(rank)});
+  double lora_bytes = sizeof(T) * (double(num_slots) * rank * dim +
+                                   2.0 * batch * dim);
+  bench.run("launch_lora_shrink", dtype, cfg, lora_shp, lora_bytes,
+            2.0 * batch * dim * rank, [&] {
+              launch_lora_shrink<T>(inp, a_ptrs, row_slots, lora_tmp, batch,
+                                    dim, rank, stream);
+            });
+  bench.run("launch_lora_expand", dtype, cfg, lora_shp, lora_bytes,
+            2.0 * batch * dim * rank, [&] {
+              launch_lora_expand<T>(lora_tmp, b_ptrs, lora_scales, row_slots,
+                                    out, batch, rank, dim, stream);
+            });
+
+  // the draft and verification of speculative decoding.
+  const int num_draft = 4;
+  size_t vocab = cfg.vocab;
+  T *target_logits = buf.uniform<T>((num_draft + 1) * vocab);
+  T *draft_logits = buf.uniform<T>(num_draft * vocab);
+  int *draft_tokens = buf.uniform<int>(num_draft + 1, 0.f, vocab);
+  int *num_tokens = buf.alloc<int>(1);
+  unsigned long long counter = 0;
+  bench.run("launch_speculative_sample", dtype, cfg, shape({vocab}),
+            sizeof(T) * double(vocab), 3.0 * vocab, [&] {
+              launch_speculative_sample<T>(target_logits, num_tokens, vocab,
+                                           false, 1234, counter++, stream);
+            });
+  bench.run("launch_speculative_verify", dtype, cfg,
+            shape({size_t(num_draft), vocab}),
+            sizeof(T) * (2.0 * num_draft + 1) * vocab,
+            6.0 * (num_draft + 1) * vocab, [&] {
+              launch_speculative_verify<T>(target_logits, draft_logits,
+                                           draft_tokens, num_tokens, num_draft,
+                                           vocab, false, 1234, counter++,
+                                           stream);
+            });
+}
+
+template <typename T>
+void bench_encoder(Bench &bench, const Config &cfg) {
+  bench_norm<T>(bench, cfg);
+  bench_softmax<T>(bench, cfg);
+  bench_softmax_new<T>(bench, cfg);
+  bench_attention<T>(bench, cfg, false);
+  bench_transform<T>(bench, cfg);
+  bench_padding<T>(bench, cfg);
+  bench_concat<T>(bench, cfg);
+  bench_dropout<T>(bench, cfg);
+  bench_quantize<T>(bench, cfg);
+  bench_embedding<T>(bench, cfg);
+  bench_loss<T>(bench, cfg);
+}
+
+// the kernels of llama, in fp32, fp16 and bf16.
+template <typename T>
+void bench_prefill(Bench &bench, const Config &cfg) {
+  bench_rms_norm<T>(bench, cfg);
+  bench_softmax_new<T>(bench, cfg);
+  bench_attention<T>(bench, cfg, true);
+  bench_padding<T>(bench, cfg);
+  bench_llama_embedding<T>(bench, cfg);
+  bench_glu<T>(bench, cfg);
+  bench_rotary<T>(bench, cfg);
+}
+
+}  // namespace
+
+}  // namespace cuda
+}  // namespace lightseq
+
+int main(int argc, char *argv[]) {
+  using namespace lightseq::cuda;
+  try {
+    Options options = parse_options(argc, argv);
+    Bench bench(options);
+    for (const Config &cfg : kEncoderConfigs) {
+      bench_encoder<float>(bench, cfg);
+      bench_encoder<__half>(bench, cfg);
+      bench_index(bench, cfg);
+    }
+    for (const Config &cfg : kPrefillConfigs) {
+      bench_prefill<float>(bench, cfg);
+      bench_prefill<__half>(bench, cfg);
+      bench_prefill<__nv_bfloat16>(bench, cfg);
+    }
+    for (const Config &cfg : kDecodeConfigs) {
+      bench_decode<float>(bench, cfg);
+      bench_decode<__half>(bench, cfg);
+      bench_decode<__nv_bfloat16>(bench, cfg);
+    }
+    bench.write_json();
+  } catch (std::exception &e) {
+    fprintf(stderr, "Error! %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
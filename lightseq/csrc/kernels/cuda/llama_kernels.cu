@@ -16,13 +16,37 @@ namespace cg = cooperative_groups;
 namespace lightseq {
 namespace cuda {
 
+/**
+@brief: kernel_llama_future_mask
+Mask the positions after the prompt in pad_mask, so that attention over a
+kv length longer than the current step (eg. inside a CUDA graph captured for
+a step bucket) never attends to the future.
+
+@thread
+gridDim.x = (batch_beams * (max_step - seq_len) + MAX_THREADS - 1) / MAX_THREADS
+blockDim.x = MAX_THREADS
+*/
+template <typename T>
+__global__ void kernel_llama_future_mask(T* pad_mask_ptr, int batch_beams,
+                                         int seq_len, int max_step) {
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  int future_len = max_step - seq_len;
+  if (idx >= batch_beams * future_len) {
+    return;
+  }
+  int batch_beam_idx = idx / future_len;
+  int pos = seq_len + idx % future_len;
+  pad_mask_ptr[batch_beam_idx * max_step + pos] = T(CUDA_FLOAT_INF_NEG);
+}
+
 template <typename T>
 __global__ void kernel_llama_padding(const T* token_emb, const int* token_ids,
                                      T* output, T* pad_mask_ptr,
                                      int* left_pad_len_ptr, int batch_size,
                                      int beam_size, int seq_len, int hidden_dim,
                                      int padding_id, int max_step,
-                                     int step_offset) {
+                                     int step_offset,
+                                     const int* step_offset_ptr) {
   int idx = blockIdx.x * blockDim.x + threadIdx.x;
   if (idx >= batch_size * beam_size * seq_len * hidden_dim) {
     return;
@@ -30,6 +54,9 @@ __global__ void kernel_llama_padding(const T* token_emb, const int* token_ids,
   int batch_idx, beam_idx, seq_idx, state_idx;
   decompose_4dim(idx, beam_size, seq_len, hidden_dim, &batch_idx, &beam_idx,
                  &seq_idx, &state_idx);
+  if (step_offset_ptr) {
+    step_offset = *step_offset_ptr;
+  }
   int token_idx = flat_3dim(batch_idx, beam_idx, seq_idx + step_offset,
                             beam_size, max_step);
   int token_id = token_ids[token_idx];
@@ -54,7 +81,8 @@ __global__ void kernel_llama_embedding(const T* token_emb, const int* token_ids,
                                        int* left_pad_len_ptr, int batch_size,
                                        int beam_size, int seq_len,
                                        int hidden_dim, int padding_id,
-                                       int max_step, int step_offset) {
+                                       int max_step, int step_offset,
+                                       const int* step_offset_ptr) {
   int idx = blockIdx.x * blockDim.x + threadIdx.x;
   if (idx >= batch_size * beam_size * seq_len * hidden_dim) {
     return;
@@ -62,6 +90,9 @@ __global__ void kernel_llama_embedding(const T* token_emb, const int* token_ids,
   int batch_idx, beam_idx, seq_idx, state_idx;
   decompose_4dim(idx, beam_size, seq_len, hidden_dim, &batch_idx, &beam_idx,
                  &seq_idx, &state_idx);
+  if (step_offset_ptr) {
+    step_offset = *step_offset_ptr;
+  }
   int token_idx = flat_3dim(batch_idx, beam_idx, seq_idx + step_offset,
                             beam_size, max_step);
   int token_id = token_ids[token_idx];
@@ -80,7 +111,7 @@ __global__ void kernel_llama_padding<__half>(
     const __half* token_emb, const int* token_ids, __half* output,
     __half* pad_mask_ptr, int* left_pad_len_ptr, int batch_size, int beam_size,
     int seq_len, int hidden_dim, int padding_id, int max_step,
-    int step_offset) {
+    int step_offset, const int* step_offset_ptr) {
   int idx = blockIdx.x * blockDim.x + threadIdx.x;
   if (idx >= batch_size * beam_size * seq_len * hidden_dim) {
     return;
@@ -88,6 +119,9 @@ __global__ void kernel_llama_padding<__half>(
   int batch_idx, beam_idx, seq_idx, state_idx;
   decompose_4dim(idx, beam_size, seq_len, hidden_dim, &batch_idx, &beam_idx,
                  &seq_idx, &state_idx);
+  if (step_offset_ptr) {
+    step_offset = *step_offset_ptr;
+  }
   int token_idx = flat_3dim(batch_idx, beam_idx, seq_idx + step_offset,
                             beam_size, max_step);
   int token_id = token_ids[token_idx];
@@ -111,7 +145,7 @@ __global__ void kernel_llama_embedding<__half>(
     const __half* token_emb, const int* token_ids, __half* output,
     __half* pad_mask_ptr, int* left_pad_len_ptr, int batch_size, int beam_size,
     int seq_len, int hidden_dim, int padding_id, int max_step,
-    int step_offset) {
+    int step_offset, const int* step_offset_ptr) {
   int idx = blockIdx.x * blockDim.x + threadIdx.x;
   if (idx >= batch_size * beam_size * seq_len * hidden_dim) {
     return;
@@ -119,6 +153,9 @@ __global__ void kernel_llama_embedding<__half>(
   int batch_idx, beam_idx, seq_idx, state_idx;
   decompose_4dim(idx, beam_size, seq_len, hidden_dim, &batch_idx, &beam_idx,
                  &seq_idx, &state_idx);
+  if (step_offset_ptr) {
+    step_offset = *step_offset_ptr;
+  }
   int token_idx = flat_3dim(batch_idx, beam_idx, seq_idx + step_offset,
                             beam_size, max_step);
   int token_id = token_ids[token_idx];
@@ -133,13 +170,78 @@ __global__ void kernel_llama_embedding<__half>(
   }
 }
 
+template <>
+__global__ void kernel_llama_padding<__nv_bfloat16>(
+    const __nv_bfloat16* token_emb, const int* token_ids,
+    __nv_bfloat16* output, __nv_bfloat16* pad_mask_ptr, int* left_pad_len_ptr,
+    int batch_size, int beam_size, int seq_len, int hidden_dim, int padding_id,
+    int max_step, int step_offset, const int* step_offset_ptr) {
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= batch_size * beam_size * seq_len * hidden_dim) {
+    return;
+  }
+  int batch_idx, beam_idx, seq_idx, state_idx;
+  decompose_4dim(idx, beam_size, seq_len, hidden_dim, &batch_idx, &beam_idx,
+                 &seq_idx, &state_idx);
+  if (step_offset_ptr) {
+    step_offset = *step_offset_ptr;
+  }
+  int token_idx = flat_3dim(batch_idx, beam_idx, seq_idx + step_offset,
+                            beam_size, max_step);
+  int token_id = token_ids[token_idx];
+  int batch_beam_idx = batch_idx * beam_size + beam_idx;
+
+  float4& output_val = ((float4*)output)[idx];
+  if (token_id == padding_id) {
+    if (state_idx == 0) {
+      pad_mask_ptr[token_idx] = __float2bfloat16(CUDA_FLOAT_INF_NEG);
+      atomicAdd(left_pad_len_ptr + batch_beam_idx, 1);
+    }
+    output_val.x = 0.f;
+    output_val.y = 0.f;
+    output_val.z = 0.f;
+    output_val.w = 0.f;
+  }
+}
+
+template <>
+__global__ void kernel_llama_embedding<__nv_bfloat16>(
+    const __nv_bfloat16* token_emb, const int* token_ids,
+    __nv_bfloat16* output, __nv_bfloat16* pad_mask_ptr, int* left_pad_len_ptr,
+    int batch_size, int beam_size, int seq_len, int hidden_dim, int padding_id,
+    int max_step, int step_offset, const int* step_offset_ptr) {
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= batch_size * beam_size * seq_len * hidden_dim) {
+    return;
+  }
+  int batch_idx, beam_idx, seq_idx, state_idx;
+  decompose_4dim(idx, beam_size, seq_len, hidden_dim, &batch_idx, &beam_idx,
+                 &seq_idx, &state_idx);
+  if (step_offset_ptr) {
+    step_offset = *step_offset_ptr;
+  }
+  int token_idx = flat_3dim(batch_idx, beam_idx, seq_idx + step_offset,
+                            beam_size, max_step);
+  int token_id = token_ids[token_idx];
+
+  float4& output_val = ((float4*)output)[idx];
+
+  if (token_id != padding_id) {
+    if (state_idx == 0) {
+      pad_mask_ptr[token_idx] = __float2bfloat16(0.f);
+    }
+    output_val = ((float4*)token_emb)[token_id * hidden_dim + state_idx];
+  }
+}
+
 template <>
 void launch_llama_embedding<float>(const float* token_emb, const int* tokens,
                                    float* output, float* pad_mask_ptr,
                                    int* left_pad_len_ptr, int batch_size,
                                    int beam_size, int hidden_dim,
                                    int step_offset, int seq_len, int max_step,
-                                   int padding_id, cudaStream_t stream) {
+                                   int padding_id, cudaStream_t stream,
+                                   const int* step_offset_ptr) {
   if (seq_len + step_offset >= max_step) {
     throw std::runtime_error("violate seq_len + step_offset < max_step");
   }
@@ -151,11 +253,20 @@ void launch_llama_embedding<float>(const float* token_emb, const int* tokens,
   int nblock = (nele + MAX_THREADS - 1) / MAX_THREADS;
   kernel_llama_padding<float><<<nblock, MAX_THREADS, 0, stream>>>(
       token_emb, tokens, output, pad_mask_ptr, left_pad_len_ptr, batch_size,
-      beam_size, seq_len, hidden_dim, padding_id, max_step, step_offset);
+      beam_size, seq_len, hidden_dim, padding_id, max_step, step_offset,
+      step_offset_ptr);
 
   kernel_llama_embedding<float><<<nblock, MAX_THREADS, 0, stream>>>(
       token_emb, tokens, output, pad_mask_ptr, left_pad_len_ptr, batch_size,
-      beam_size, seq_len, hidden_dim, padding_id, max_step, step_offset);
+      beam_size, seq_len, hidden_dim, padding_id, max_step, step_offset,
+      step_offset_ptr);
+
+  int nmask = batch_size * beam_size * (max_step - seq_len);
+  if (step_offset == 0 && step_offset_ptr == nullptr && nmask > 0) {
+    kernel_llama_future_mask<float>
+        <<<(nmask + MAX_THREADS - 1) / MAX_THREADS, MAX_THREADS, 0, stream>>>(
+            pad_mask_ptr, batch_size * beam_size, seq_len, max_step);
+  }
 }
 
 template <>
@@ -164,7 +275,8 @@ void launch_llama_embedding<__half>(const __half* token_emb, const int* tokens,
                                     int* left_pad_len_ptr, int batch_size,
                                     int beam_size, int hidden_dim,
                                     int step_offset, int seq_len, int max_step,
-                                    int padding_id, cudaStream_t stream) {
+                                    int padding_id, cudaStream_t stream,
+                                    const int* step_offset_ptr) {
   if (seq_len + step_offset >= max_step) {
     throw std::runtime_error("violate seq_len + step_offset < max_step");
   }
@@ -176,72 +288,299 @@ void launch_llama_embedding<__half>(const __half* token_emb, const int* tokens,
   int nblock = (nele + MAX_THREADS - 1) / MAX_THREADS;
   kernel_llama_padding<__half><<<nblock, MAX_THREADS, 0, stream>>>(
       token_emb, tokens, output, pad_mask_ptr, left_pad_len_ptr, batch_size,
-      beam_size, seq_len, hidden_dim, padding_id, max_step, step_offset);
+      beam_size, seq_len, hidden_dim, padding_id, max_step, step_offset,
+      step_offset_ptr);
   kernel_llama_embedding<__half><<<nblock, MAX_THREADS, 0, stream>>>(
       token_emb, tokens, output, pad_mask_ptr, left_pad_len_ptr, batch_size,
-      beam_size, seq_len, hidden_dim, padding_id, max_step, step_offset);
+      beam_size, seq_len, hidden_dim, padding_id, max_step, step_offset,
+      step_offset_ptr);
+
+  int nmask = batch_size * beam_size * (max_step - seq_len);
+  if (step_offset == 0 && step_offset_ptr == nullptr && nmask > 0) {
+    kernel_llama_future_mask<__half>
+        <<<(nmask + MAX_THREADS - 1) / MAX_THREADS, MAX_THREADS, 0, stream>>>(
+            pad_mask_ptr, batch_size * beam_size, seq_len, max_step);
+  }
+}
+
+template <>
+void launch_llama_embedding<__nv_bfloat16>(
+    const __nv_bfloat16* token_emb, const int* tokens, __nv_bfloat16* output,
+    __nv_bfloat16* pad_mask_ptr, int* left_pad_len_ptr, int batch_size,
+    int beam_size, int hidden_dim, int step_offset, int seq_len, int max_step,
+    int padding_id, cudaStream_t stream, const int* step_offset_ptr) {
+  if (seq_len + step_offset >= max_step) {
+    throw std::runtime_error("violate seq_len + step_offset < max_step");
+  }
+  if (hidden_dim % 8) {
+    throw std::runtime_error("violate hidden_dim % 8 = 0");
+  }
+  hidden_dim >>= 3;
+  int nele = (batch_size * beam_size * seq_len * hidden_dim);
+  int nblock = (nele + MAX_THREADS - 1) / MAX_THREADS;
+  kernel_llama_padding<__nv_bfloat16><<<nblock, MAX_THREADS, 0, stream>>>(
+      token_emb, tokens, output, pad_mask_ptr, left_pad_len_ptr, batch_size,
+      beam_size, seq_len, hidden_dim, padding_id, max_step, step_offset,
+      step_offset_ptr);
+  kernel_llama_embedding<__nv_bfloat16><<<nblock, MAX_THREADS, 0, stream>>>(
+      token_emb, tokens, output, pad_mask_ptr, left_pad_len_ptr, batch_size,
+      beam_size, seq_len, hidden_dim, padding_id, max_step, step_offset,
+      step_offset_ptr);
+
+  int nmask = batch_size * beam_size * (max_step - seq_len);
+  if (step_offset == 0 && step_offset_ptr == nullptr && nmask > 0) {
+    kernel_llama_future_mask<__nv_bfloat16>
+        <<<(nmask + MAX_THREADS - 1) / MAX_THREADS, MAX_THREADS, 0, stream>>>(
+            pad_mask_ptr, batch_size * beam_size, seq_len, max_step);
+  }
 }
 
 template void launch_llama_embedding<float>(
     const float* token_emb, const int* tokens, float* output,
     float* pad_mask_ptr, int* left_pad_len_ptr, int batch_size, int beam_size,
     int hidden_dim, int step_offset, int seq_len, int max_step, int padding_id,
-    cudaStream_t stream);
+    cudaStream_t stream, const int* step_offset_ptr);
 
 template void launch_llama_embedding<__half>(
     const __half* token_emb, const int* tokens, __half* output,
     __half* pad_mask_ptr, int* left_pad_len_ptr, int batch_size, int beam_size,
     int hidden_dim, int step_offset, int seq_len, int max_step, int padding_id,
-    cudaStream_t stream);
+    cudaStream_t stream, const int* step_offset_ptr);
 
+template void launch_llama_embedding<__nv_bfloat16>(
+    const __nv_bfloat16* token_emb, const int* tokens, __nv_bfloat16* output,
+    __nv_bfloat16* pad_mask_ptr, int* left_pad_len_ptr, int batch_size,
+    int beam_size, int hidden_dim, int step_offset, int seq_len, int max_step,
+    int padding_id, cudaStream_t stream, const int* step_offset_ptr);
+
+/**
+@brief: kernel_llama_embedding_i8
+kernel_llama_embedding of an int8 token embedding with one scale per token,
+dequantized on the fly. Every thread writes the float4 of output of
+sizeof(float4) / sizeof(T) elements.
+
+@thread
+gridDim.x = (batch_size * beam_size * seq_len * hidden_dim + MAX_THREADS - 1)
+  / MAX_THREADS
+blockDim.x = MAX_THREADS
+
+@param
+token_emb: [vocab_size, hidden_dim * kVec], of int8
+emb_scale: [vocab_size]
+hidden_dim: hidden size / kVec
+*/
 template <typename T>
+__global__ void kernel_llama_embedding_i8(
+    const int8_t* token_emb, const T* emb_scale, const int* token_ids,
+    T* output, T* pad_mask_ptr, int batch_size, int beam_size, int seq_len,
+    int hidden_dim, int padding_id, int max_step, int step_offset,
+    const int* step_offset_ptr) {
+  const int kVec = sizeof(float4) / sizeof(T);
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= batch_size * beam_size * seq_len * hidden_dim) {
+    return;
+  }
+  int batch_idx, beam_idx, seq_idx, state_idx;
+  decompose_4dim(idx, beam_size, seq_len, hidden_dim, &batch_idx, &beam_idx,
+                 &seq_idx, &state_idx);
+  if (step_offset_ptr) {
+    step_offset = *step_offset_ptr;
+  }
+  int token_idx = flat_3dim(batch_idx, beam_idx, seq_idx + step_offset,
+                            beam_size, max_step);
+  int token_id = token_ids[token_idx];
+  if (token_id == padding_id) {
+    return;
+  }
+  if (state_idx == 0) {
+    pad_mask_ptr[token_idx] = T(0.f);
+  }
+  const int8_t* q =
+      token_emb + ((size_t)token_id * hidden_dim + state_idx) * kVec;
+  float scale = float(emb_scale[token_id]);
+  float4 output_val;
+  T* val = reinterpret_cast<T*>(&output_val);
+#pragma unroll
+  for (int j = 0; j < kVec; j++) {
+    val[j] = T(float(q[j]) * scale);
+  }
+  ((float4*)output)[idx] = output_val;
+}
+
+template <typename T>
+void launch_llama_embedding_i8(const int8_t* token_emb, const T* emb_scale,
+                               const int* tokens, T* output, T* pad_mask_ptr,
+                               int* left_pad_len_ptr, int batch_size,
+                               int beam_size, int hidden_dim, int step_offset,
+                               int seq_len, int max_step, int padding_id,
+                               cudaStream_t stream,
+                               const int* step_offset_ptr) {
+  const int kVec = sizeof(float4) / sizeof(T);
+  if (seq_len + step_offset >= max_step) {
+    throw std::runtime_error("violate seq_len + step_offset < max_step");
+  }
+  if (hidden_dim % kVec) {
+    throw std::runtime_error("violate hidden_dim % " + std::to_string(kVec) +
+                             " = 0");
+  }
+  hidden_dim /= kVec;
+  int nele = (batch_size * beam_size * seq_len * hidden_dim);
+  int nblock = (nele + MAX_THREADS - 1) / MAX_THREADS;
+  kernel_llama_padding<T><<<nblock, MAX_THREADS, 0, stream>>>(
+      nullptr, tokens, output, pad_mask_ptr, left_pad_len_ptr, batch_size,
+      beam_size, seq_len, hidden_dim, padding_id, max_step, step_offset,
+      step_offset_ptr);
+  kernel_llama_embedding_i8<T><<<nblock, MAX_THREADS, 0, stream>>>(
+      token_emb, emb_scale, tokens, output, pad_mask_ptr, batch_size,
+      beam_size, seq_len, hidden_dim, padding_id, max_step, step_offset,
+      step_offset_ptr);
+
+  int nmask = batch_size * beam_size * (max_step - seq_len);
+  if (step_offset == 0 && step_offset_ptr == nullptr && nmask > 0) {
+    kernel_llama_future_mask<T>
+        <<<(nmask + MAX_THREADS - 1) / MAX_THREADS, MAX_THREADS, 0, stream>>>(
+            pad_mask_ptr, batch_size * beam_size, seq_len, max_step);
+  }
+}
+
+template void launch_llama_embedding_i8<float>(
+    const int8_t* token_emb, const float* emb_scale, const int* tokens,
+    float* output, float* pad_mask_ptr, int* left_pad_len_ptr, int batch_size,
+    int beam_size, int hidden_dim, int step_offset, int seq_len, int max_step,
+    int padding_id, cudaStream_t stream, const int* step_offset_ptr);
+
+template void launch_llama_embedding_i8<__half>(
+    const int8_t* token_emb, const __half* emb_scale, const int* tokens,
+    __half* output, __half* pad_mask_ptr, int* left_pad_len_ptr,
+    int batch_size, int beam_size, int hidden_dim, int step_offset,
+    int seq_len, int max_step, int padding_id, cudaStream_t stream,
+    const int* step_offset_ptr);
+
+template void launch_llama_embedding_i8<__nv_bfloat16>(
+    const int8_t* token_emb, const __nv_bfloat16* emb_scale, const int* tokens,
+    __nv_bfloat16* output, __nv_bfloat16* pad_mask_ptr, int* left_pad_len_ptr,
+    int batch_size, int beam_size, int hidden_dim, int step_offset,
+    int seq_len, int max_step, int padding_id, cudaStream_t stream,
+    const int* step_offset_ptr);
+
+// The head dims of the common llama models get kernels of their own, whose
+// index arithmetic and loops are resolved at compile time. HEAD_DIM is 0 for
+// the generic kernel of any other head dim.
+#define DISPATCH_HEAD_DIM(head_dim, ...)         \
+  switch (head_dim) {                            \
+    case 64: {                                   \
+      const int HEAD_DIM = 64;                   \
+      __VA_ARGS__;                               \
+      break;                                     \
+    }                                            \
+    case 80: {                                   \
+      const int HEAD_DIM = 80;                   \
+      __VA_ARGS__;                               \
+      break;                                     \
+    }                                            \
+    case 128: {                                  \
+      const int HEAD_DIM = 128;                  \
+      __VA_ARGS__;                               \
+      break;                                     \
+    }                                            \
+    default: {                                   \
+      const int HEAD_DIM = 0;                    \
+      __VA_ARGS__;                               \
+    }                                            \
+  }
+
+// The row of position pos in a dense kv cache of max_step rows. With
+// ring_size > 0 the first max_step - ring_size positions, the attention
+// sinks, keep their rows and the later ones take the last ring_size rows in
+// turn, see launch_flash_attention.
+__device__ __forceinline__ size_t kv_cache_row(size_t pos, size_t max_step,
+                                               int ring_size) {
+  size_t sink_len = max_step - ring_size;
+  if (ring_size == 0 || pos < sink_len) return pos;
+  return sink_len + (pos - sink_len) % ring_size;
+}
+
+/**
+@brief: kernel_split_rotary_position_qkv
+Split the qkv of the llama attention into q and the kv cache, and rotate q
+and k by their position. Every thread handles a rotary pair, the elements d
+and d + head_dim / 2 of a head.
+
+@thread
+gridDim.x = ceil(batch_size * query_len * (nhead + 2 * kv_head_num) *
+  head_dim / 2 / MAX_THREADS)
+blockDim.x = MAX_THREADS
+
+@param
+head_dim: the head dim when kHeadDim is 0, ignored otherwise
+ring_size: max_step is the rows of the dense cache, the later positions
+  wrap into its last ring_size rows, see kv_cache_row. 0 for none
+*/
+template <typename T, int kHeadDim>
 __global__ void kernel_split_rotary_position_qkv(
     const T* input_ptr, const T* sin_ptr, const T* cos_ptr, T* q_out,
     T* cache_k_out, T* cache_v_out, size_t batch_size, size_t max_step,
     size_t nhead, size_t offset_seq_len, size_t query_len, size_t head_dim,
-    size_t max_thread_num) {
+    size_t max_thread_num, const int* offset_seq_len_ptr,
+    const int* page_table, int page_size, int max_pages,
+    const int* seq_offsets, size_t kv_head_num, int ring_size) {
   size_t idx = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
   if (idx >= max_thread_num) {
     return;
   }
-  int batch_idx, qkv_idx, head_idx, seq_idx, head_dim_idx;
-  decompose_5dim(idx, query_len, 3, nhead, head_dim, &batch_idx, &seq_idx,
-                 &qkv_idx, &head_idx, &head_dim_idx);
+  const int dim = kHeadDim > 0 ? kHeadDim : head_dim;
+  const int half_dim = dim / 2;
+  // input heads are the nhead query heads, then kv_head_num key heads and
+  // kv_head_num value heads.
+  int batch_idx, seq_idx, head_idx, head_dim_idx;
+  decompose_4dim(idx, query_len, nhead + 2 * kv_head_num, half_dim,
+                 &batch_idx, &seq_idx, &head_idx, &head_dim_idx);
+  int qkv_idx = 0;
+  if (head_idx >= nhead + kv_head_num) {
+    qkv_idx = 2, head_idx -= nhead + kv_head_num;
+  } else if (head_idx >= nhead) {
+    qkv_idx = 1, head_idx -= nhead;
+  }
+  if (seq_offsets) {
+    offset_seq_len = seq_offsets[batch_idx];
+  } else if (offset_seq_len_ptr) {
+    offset_seq_len = *offset_seq_len_ptr;
+  }
 
   size_t output_idx = 0;
-  if (qkv_idx) {
-    output_idx = flat_4dim(batch_idx, head_idx, offset_seq_len + seq_idx,
-                           head_dim_idx, nhead, max_step, head_dim);
+  if (qkv_idx && page_table) {
+    // paged cache: [num_pages, kv_head_num, page_size, head_dim]
+    size_t pos = offset_seq_len + seq_idx;
+    size_t page = page_table[batch_idx * max_pages + pos / page_size];
+    output_idx = flat_4dim(page, head_idx, pos % page_size, head_dim_idx,
+                           kv_head_num, page_size, dim);
+  } else if (qkv_idx) {
+    size_t row = kv_cache_row(offset_seq_len + seq_idx, max_step, ring_size);
+    output_idx = flat_4dim(batch_idx, head_idx, row, head_dim_idx,
+                           kv_head_num, max_step, dim);
   } else {
     output_idx = flat_4dim(batch_idx, head_idx, seq_idx, head_dim_idx, nhead,
-                           query_len, head_dim);
+                           query_len, dim);
   }
 
-  // cos part
-  T state_val1 = *(input_ptr + idx);
+  size_t input_idx = (idx / half_dim) * dim + head_dim_idx;
+  T state_val1 = input_ptr[input_idx];
+  T state_val2 = input_ptr[input_idx + half_dim];
 
   if (qkv_idx == 2) {
-    *(cache_v_out + output_idx) = state_val1;
-  } else {
-    T cos_val = *(cos_ptr + (offset_seq_len + seq_idx) * head_dim / 2 +
-                  (head_dim_idx % (head_dim / 2)));
-    T sin_val = *(sin_ptr + (offset_seq_len + seq_idx) * head_dim / 2 +
-                  (head_dim_idx % (head_dim / 2)));
-    T out_val = 0.;
-    if (head_dim_idx < head_dim / 2) {
-      T state_val2 = *(input_ptr + idx + head_dim / 2);
-      out_val = state_val1 * cos_val - state_val2 * sin_val;
-    } else {
-      T state_val2 = *(input_ptr + idx - head_dim / 2);
-      out_val = state_val1 * cos_val + state_val2 * sin_val;
-    }
-
-    if (qkv_idx == 0) {
-      *(q_out + output_idx) = out_val;
-    } else {
-      *(cache_k_out + output_idx) = out_val;
-    }
+    cache_v_out[output_idx] = state_val1;
+    cache_v_out[output_idx + half_dim] = state_val2;
+    return;
   }
+  // computed in float, bf16 has no arithmetic before sm_80.
+  size_t rotary_idx = (offset_seq_len + seq_idx) * half_dim + head_dim_idx;
+  float cos_val = float(cos_ptr[rotary_idx]);
+  float sin_val = float(sin_ptr[rotary_idx]);
+  float out_val1 = float(state_val1) * cos_val - float(state_val2) * sin_val;
+  float out_val2 = float(state_val2) * cos_val + float(state_val1) * sin_val;
+  T* out = qkv_idx == 0 ? q_out : cache_k_out;
+  out[output_idx] = T(out_val1);
+  out[output_idx + half_dim] = T(out_val2);
 }
 
 template <typename T>
@@ -251,25 +590,921 @@ void launch_split_rotary_position_qkv(const T* input_ptr, const T* sin_ptr,
                                       size_t max_step, size_t batch_size,
                                       size_t nhead, size_t offset_seq_len,
                                       size_t query_len, size_t head_dim,
-                                      cudaStream_t stream) {
-  size_t nele = 3 * batch_size * nhead * query_len * head_dim;
+                                      cudaStream_t stream,
+                                      const int* offset_seq_len_ptr,
+                                      const int* page_table, int page_size,
+                                      int max_pages, const int* seq_offsets,
+                                      size_t kv_head_num, int ring_size) {
+  if (kv_head_num == 0) kv_head_num = nhead;
+  size_t nele =
+      batch_size * (nhead + 2 * kv_head_num) * query_len * head_dim / 2;
   size_t nblock = (nele + MAX_THREADS - 1) / MAX_THREADS;
-  kernel_split_rotary_position_qkv<T><<<nblock, MAX_THREADS, 0, stream>>>(
-      input_ptr, sin_ptr, cos_ptr, q_out, cache_k_out, cache_v_out, batch_size,
-      max_step, nhead, offset_seq_len, query_len, head_dim, nele);
+  DISPATCH_HEAD_DIM(
+      head_dim,
+      kernel_split_rotary_position_qkv<T, HEAD_DIM>
+      <<<nblock, MAX_THREADS, 0, stream>>>(
+          input_ptr, sin_ptr, cos_ptr, q_out, cache_k_out, cache_v_out,
+          batch_size, max_step, nhead, offset_seq_len, query_len, head_dim,
+          nele, offset_seq_len_ptr, page_table, page_size, max_pages,
+          seq_offsets, kv_head_num, ring_size));
 }
 
 template void launch_split_rotary_position_qkv<float>(
     const float* input_ptr, const float* sin_ptr, const float* cos_ptr,
     float* q_out, float* cache_k_out, float* cache_v_out, size_t max_step,
     size_t batch_size, size_t nhead, size_t offset_seq_len, size_t query_len,
-    size_t head_dim, cudaStream_t stream);
+    size_t head_dim, cudaStream_t stream, const int* offset_seq_len_ptr,
+    const int* page_table, int page_size, int max_pages,
+    const int* seq_offsets, size_t kv_head_num,
+    int ring_size);
 
 template void launch_split_rotary_position_qkv<__half>(
     const __half* input_ptr, const __half* sin_ptr, const __half* cos_ptr,
     __half* q_out, __half* cache_k_out, __half* cache_v_out, size_t max_step,
     size_t batch_size, size_t nhead, size_t offset_seq_len, size_t query_len,
-    size_t head_dim, cudaStream_t stream);
+    size_t head_dim, cudaStream_t stream, const int* offset_seq_len_ptr,
+    const int* page_table, int page_size, int max_pages,
+    const int* seq_offsets, size_t kv_head_num,
+    int ring_size);
+
+template void launch_split_rotary_position_qkv<__nv_bfloat16>(
+    const __nv_bfloat16* input_ptr, const __nv_bfloat16* sin_ptr,
+    const __nv_bfloat16* cos_ptr, __nv_bfloat16* q_out,
+    __nv_bfloat16* cache_k_out, __nv_bfloat16* cache_v_out, size_t max_step,
+    size_t batch_size, size_t nhead, size_t offset_seq_len, size_t query_len,
+    size_t head_dim, cudaStream_t stream, const int* offset_seq_len_ptr,
+    const int* page_table, int page_size, int max_pages,
+    const int* seq_offsets, size_t kv_head_num,
+    int ring_size);
+
+/**
+@brief: kernel_split_rotary_position_qkv_bw
+the backward of kernel_split_rotary_position_qkv for training, where the
+sequences start at position 0 and k, v are written to [batch_size,
+kv_head_num, query_len, head_dim] instead of a cache. The rotation of the
+pair (a, b) = (x[d], x[d + head_dim / 2]) is orthogonal, so its gradient is
+the inverse rotation of the output gradient:
+  da = ga * cos + gb * sin, db = gb * cos - ga * sin.
+The gradient of v is copied.
+
+@thread
+gridDim.x = (nele + MAX_THREADS - 1) / MAX_THREADS
+blockDim.x = MAX_THREADS
+
+@param
+inp_grad: [batch_size, query_len, nhead + 2 * kv_head_num, head_dim]
+q_grad: [batch_size, nhead, query_len, head_dim]
+k_grad, v_grad: [batch_size, kv_head_num, query_len, head_dim]
+*/
+template <typename T>
+__global__ void kernel_split_rotary_position_qkv_bw(
+    T* inp_grad, const T* sin_ptr, const T* cos_ptr, const T* q_grad,
+    const T* k_grad, const T* v_grad, size_t nhead, size_t query_len,
+    size_t head_dim, size_t max_thread_num, size_t kv_head_num) {
+  size_t idx = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= max_thread_num) {
+    return;
+  }
+  int batch_idx, seq_idx, head_idx, head_dim_idx;
+  decompose_4dim(idx, query_len, nhead + 2 * kv_head_num, head_dim,
+                 &batch_idx, &seq_idx, &head_idx, &head_dim_idx);
+  const T* out_grad = q_grad;
+  size_t out_heads = nhead;
+  if (head_idx >= nhead + kv_head_num) {
+    inp_grad[idx] = v_grad[flat_4dim(batch_idx, head_idx - nhead - kv_head_num,
+                                     seq_idx, head_dim_idx, kv_head_num,
+                                     query_len, head_dim)];
+    return;
+  } else if (head_idx >= nhead) {
+    out_grad = k_grad, out_heads = kv_head_num, head_idx -= nhead;
+  }
+
+  size_t half_dim = head_dim / 2;
+  size_t pair_dim_idx = head_dim_idx % half_dim;
+  size_t out_idx = flat_4dim(batch_idx, head_idx, seq_idx, pair_dim_idx,
+                             out_heads, query_len, head_dim);
+  size_t rotary_idx = seq_idx * half_dim + pair_dim_idx;
+  float cos_val = float(cos_ptr[rotary_idx]);
+  float sin_val = float(sin_ptr[rotary_idx]);
+  float grad_a = float(out_grad[out_idx]);
+  float grad_b = float(out_grad[out_idx + half_dim]);
+  float res = head_dim_idx < half_dim ? grad_a * cos_val + grad_b * sin_val
+                                      : grad_b * cos_val - grad_a * sin_val;
+  inp_grad[idx] = T(res);
+}
+
+template <typename T>
+void launch_split_rotary_position_qkv_bw(
+    T* inp_grad, const T* sin_ptr, const T* cos_ptr, const T* q_grad,
+    const T* k_grad, const T* v_grad, size_t batch_size, size_t nhead,
+    size_t query_len, size_t head_dim, cudaStream_t stream,
+    size_t kv_head_num) {
+  if (kv_head_num == 0) kv_head_num = nhead;
+  size_t nele =
+      batch_size * (nhead + 2 * kv_head_num) * query_len * head_dim;
+  size_t nblock = (nele + MAX_THREADS - 1) / MAX_THREADS;
+  kernel_split_rotary_position_qkv_bw<T><<<nblock, MAX_THREADS, 0, stream>>>(
+      inp_grad, sin_ptr, cos_ptr, q_grad, k_grad, v_grad, nhead, query_len,
+      head_dim, nele, kv_head_num);
+}
+
+template void launch_split_rotary_position_qkv_bw<float>(
+    float* inp_grad, const float* sin_ptr, const float* cos_ptr,
+    const float* q_grad, const float* k_grad, const float* v_grad,
+    size_t batch_size, size_t nhead, size_t query_len, size_t head_dim,
+    cudaStream_t stream, size_t kv_head_num);
+
+template void launch_split_rotary_position_qkv_bw<__half>(
+    __half* inp_grad, const __half* sin_ptr, const __half* cos_ptr,
+    const __half* q_grad, const __half* k_grad, const __half* v_grad,
+    size_t batch_size, size_t nhead, size_t query_len, size_t head_dim,
+    cudaStream_t stream, size_t kv_head_num);
+
+template void launch_split_rotary_position_qkv_bw<__nv_bfloat16>(
+    __nv_bfloat16* inp_grad, const __nv_bfloat16* sin_ptr,
+    const __nv_bfloat16* cos_ptr, const __nv_bfloat16* q_grad,
+    const __nv_bfloat16* k_grad, const __nv_bfloat16* v_grad,
+    size_t batch_size, size_t nhead, size_t query_len, size_t head_dim,
+    cudaStream_t stream, size_t kv_head_num);
+
+// head vectors quantized by one block of kernel_split_rotary_position_qkv_i8.
+const int kQuantKVWarps = 4;
+// rotary pairs (d, d + head_dim / 2) handled by each lane.
+const int kQuantKVPairsPerLane = kFlashAttnMaxHeadDim / 2 / WARP_SIZE;
+
+/**
+@brief: kernel_split_rotary_position_qkv_i8
+kernel_split_rotary_position_qkv for an int8 kv cache. Every warp handles one
+head vector of one token, so that the k and v vectors can be quantized
+symmetrically by their own absmax when they are written to the cache. q is
+written as T.
+
+The scale of the cached vector at element offset i of the cache is stored at
+i / head_dim of cache_k_scale / cache_v_scale, which therefore have the shape
+of the cache without the head_dim axis, for both the dense and paged layout.
+
+@thread
+gridDim.x = ceil(batch_size * query_len * (nhead + 2 * kv_head_num) /
+  kQuantKVWarps)
+blockDim.x = kQuantKVWarps * WARP_SIZE
+*/
+template <typename T, int kHeadDim>
+__global__ void kernel_split_rotary_position_qkv_i8(
+    const T* input_ptr, const T* sin_ptr, const T* cos_ptr, T* q_out,
+    int8_t* cache_k_out, int8_t* cache_v_out, float* cache_k_scale,
+    float* cache_v_scale, size_t max_step, size_t nhead,
+    size_t offset_seq_len, size_t query_len, size_t head_dim,
+    size_t num_vecs, const int* offset_seq_len_ptr, const int* page_table,
+    int page_size, int max_pages, const int* seq_offsets,
+    size_t kv_head_num, int ring_size) {
+  size_t vec_idx = (size_t)blockIdx.x * kQuantKVWarps + threadIdx.x / WARP_SIZE;
+  int lane_id = threadIdx.x % WARP_SIZE;
+  if (vec_idx >= num_vecs) {
+    return;
+  }
+  const int dim = kHeadDim > 0 ? kHeadDim : head_dim;
+  // fully unrolled for the head dims of their own kernel.
+  constexpr int kPairsPerLane =
+      kHeadDim > 0 ? (kHeadDim / 2 + WARP_SIZE - 1) / WARP_SIZE
+                   : kQuantKVPairsPerLane;
+  int batch_idx, seq_idx, head_idx;
+  decompose_3dim(vec_idx, query_len, nhead + 2 * kv_head_num, &batch_idx,
+                 &seq_idx, &head_idx);
+  int qkv_idx = 0;
+  if (head_idx >= nhead + kv_head_num) {
+    qkv_idx = 2, head_idx -= nhead + kv_head_num;
+  } else if (head_idx >= nhead) {
+    qkv_idx = 1, head_idx -= nhead;
+  }
+  if (seq_offsets) {
+    offset_seq_len = seq_offsets[batch_idx];
+  } else if (offset_seq_len_ptr) {
+    offset_seq_len = *offset_seq_len_ptr;
+  }
+
+  size_t pos = offset_seq_len + seq_idx;
+  size_t output_idx = 0;
+  if (qkv_idx && page_table) {
+    size_t page = page_table[batch_idx * max_pages + pos / page_size];
+    output_idx = flat_4dim(page, head_idx, pos % page_size, 0, kv_head_num,
+                           page_size, dim);
+  } else if (qkv_idx) {
+    output_idx = flat_4dim(batch_idx, head_idx,
+                           kv_cache_row(pos, max_step, ring_size), 0,
+                           kv_head_num, max_step, dim);
+  } else {
+    output_idx =
+        flat_4dim(batch_idx, head_idx, seq_idx, 0, nhead, query_len, dim);
+  }
+
+  const T* inp = input_ptr + vec_idx * dim;
+  const T* sin_row = sin_ptr + pos * dim / 2;
+  const T* cos_row = cos_ptr + pos * dim / 2;
+  int half_dim = dim / 2;
+  float val1[kPairsPerLane], val2[kPairsPerLane];
+  float absmax = 0.f;
+#pragma unroll
+  for (int i = 0; i < kPairsPerLane; i++) {
+    int d = lane_id + i * WARP_SIZE;
+    val1[i] = val2[i] = 0.f;
+    if (d >= half_dim) continue;
+    float state_val1 = float(inp[d]), state_val2 = float(inp[d + half_dim]);
+    if (qkv_idx == 2) {
+      val1[i] = state_val1, val2[i] = state_val2;
+    } else {
+      float cos_val = float(cos_row[d]), sin_val = float(sin_row[d]);
+      val1[i] = state_val1 * cos_val - state_val2 * sin_val;
+      val2[i] = state_val2 * cos_val + state_val1 * sin_val;
+    }
+    absmax = fmaxf(absmax, fmaxf(fabsf(val1[i]), fabsf(val2[i])));
+  }
+
+  if (qkv_idx == 0) {
+#pragma unroll
+    for (int i = 0; i < kPairsPerLane; i++) {
+      int d = lane_id + i * WARP_SIZE;
+      if (d >= half_dim) continue;
+      q_out[output_idx + d] = T(val1[i]);
+      q_out[output_idx + d + half_dim] = T(val2[i]);
+    }
+    return;
+  }
+
+  absmax = warpReduceMax(absmax);
+  float quant_scale = absmax > 0.f ? kQuantRangeI8 / absmax : 0.f;
+  int8_t* cache = qkv_idx == 1 ? cache_k_out : cache_v_out;
+#pragma unroll
+  for (int i = 0; i < kPairsPerLane; i++) {
+    int d = lane_id + i * WARP_SIZE;
+    if (d >= half_dim) continue;
+    cache[output_idx + d] = int8_t(fminf(
+        fmaxf(floorf(val1[i] * quant_scale + 0.5f), -kQuantRangeI8),
+        kQuantRangeI8));
+    cache[output_idx + d + half_dim] = int8_t(fminf(
+        fmaxf(floorf(val2[i] * quant_scale + 0.5f), -kQuantRangeI8),
+        kQuantRangeI8));
+  }
+  if (lane_id == 0) {
+    float* cache_scale = qkv_idx == 1 ? cache_k_scale : cache_v_scale;
+    cache_scale[output_idx / dim] = absmax / kQuantRangeI8;
+  }
+}
+
+template <typename T>
+void launch_split_rotary_position_qkv_i8(
+    const T* input_ptr, const T* sin_ptr, const T* cos_ptr, T* q_out,
+    int8_t* cache_k_out, int8_t* cache_v_out, float* cache_k_scale,
+    float* cache_v_scale, size_t max_step, size_t batch_size, size_t nhead,
+    size_t offset_seq_len, size_t query_len, size_t head_dim,
+    cudaStream_t stream, const int* offset_seq_len_ptr,
+    const int* page_table, int page_size, int max_pages,
+    const int* seq_offsets, size_t kv_head_num, int ring_size) {
+  if (kv_head_num == 0) kv_head_num = nhead;
+  if (head_dim > kFlashAttnMaxHeadDim) {
+    throw std::runtime_error("int8 kv cache supports head_dim <= " +
+                             std::to_string(kFlashAttnMaxHeadDim));
+  }
+  size_t num_vecs = batch_size * query_len * (nhead + 2 * kv_head_num);
+  size_t nblock = (num_vecs + kQuantKVWarps - 1) / kQuantKVWarps;
+  DISPATCH_HEAD_DIM(
+      head_dim,
+      kernel_split_rotary_position_qkv_i8<T, HEAD_DIM>
+      <<<nblock, kQuantKVWarps * WARP_SIZE, 0, stream>>>(
+          input_ptr, sin_ptr, cos_ptr, q_out, cache_k_out, cache_v_out,
+          cache_k_scale, cache_v_scale, max_step, nhead, offset_seq_len,
+          query_len, head_dim, num_vecs, offset_seq_len_ptr, page_table,
+          page_size, max_pages, seq_offsets, kv_head_num, ring_size));
+}
+
+template void launch_split_rotary_position_qkv_i8<float>(
+    const float* input_ptr, const float* sin_ptr, const float* cos_ptr,
+    float* q_out, int8_t* cache_k_out, int8_t* cache_v_out,
+    float* cache_k_scale, float* cache_v_scale, size_t max_step,
+    size_t batch_size, size_t nhead, size_t offset_seq_len, size_t query_len,
+    size_t head_dim, cudaStream_t stream, const int* offset_seq_len_ptr,
+    const int* page_table, int page_size, int max_pages,
+    const int* seq_offsets, size_t kv_head_num,
+    int ring_size);
+
+template void launch_split_rotary_position_qkv_i8<__half>(
+    const __half* input_ptr, const __half* sin_ptr, const __half* cos_ptr,
+    __half* q_out, int8_t* cache_k_out, int8_t* cache_v_out,
+    float* cache_k_scale, float* cache_v_scale, size_t max_step,
+    size_t batch_size, size_t nhead, size_t offset_seq_len, size_t query_len,
+    size_t head_dim, cudaStream_t stream, const int* offset_seq_len_ptr,
+    const int* page_table, int page_size, int max_pages,
+    const int* seq_offsets, size_t kv_head_num,
+    int ring_size);
+
+template void launch_split_rotary_position_qkv_i8<__nv_bfloat16>(
+    const __nv_bfloat16* input_ptr, const __nv_bfloat16* sin_ptr,
+    const __nv_bfloat16* cos_ptr, __nv_bfloat16* q_out, int8_t* cache_k_out,
+    int8_t* cache_v_out, float* cache_k_scale, float* cache_v_scale,
+    size_t max_step, size_t batch_size, size_t nhead, size_t offset_seq_len,
+    size_t query_len, size_t head_dim, cudaStream_t stream,
+    const int* offset_seq_len_ptr, const int* page_table, int page_size,
+    int max_pages, const int* seq_offsets, size_t kv_head_num,
+    int ring_size);
+
+// elements of a head vector handled by each lane of kernel_copy_kv_pages.
+const int kCopyKVElemsPerLane = kFlashAttnMaxHeadDim / WARP_SIZE;
+
+// One head vector of kernel_copy_kv_pages, between pools of floating point
+// types.
+template <typename S, typename D>
+__device__ void copy_head_vec(const S* src, const float* src_scale, D* dst,
+                              float* dst_scale, int dim, int lane_id) {
+  for (int d = lane_id; d < dim; d += WARP_SIZE) {
+    dst[d] = D(float(src[d]));
+  }
+}
+
+// quantized by the absmax of the vector, as the int8 kv cache.
+template <typename S>
+__device__ void copy_head_vec(const S* src, const float* src_scale,
+                              int8_t* dst, float* dst_scale, int dim,
+                              int lane_id) {
+  float val[kCopyKVElemsPerLane];
+  float absmax = 0.f;
+#pragma unroll
+  for (int i = 0; i < kCopyKVElemsPerLane; i++) {
+    int d = lane_id + i * WARP_SIZE;
+    val[i] = d < dim ? float(src[d]) : 0.f;
+    absmax = fmaxf(absmax, fabsf(val[i]));
+  }
+  absmax = warpReduceMax(absmax);
+  float quant_scale = absmax > 0.f ? kQuantRangeI8 / absmax : 0.f;
+#pragma unroll
+  for (int i = 0; i < kCopyKVElemsPerLane; i++) {
+    int d = lane_id + i * WARP_SIZE;
+    if (d >= dim) continue;
+    dst[d] = int8_t(fminf(fmaxf(floorf(val[i] * quant_scale + 0.5f),
+                                -kQuantRangeI8),
+                          kQuantRangeI8));
+  }
+  if (lane_id == 0) *dst_scale = absmax / kQuantRangeI8;
+}
+
+template <typename D>
+__device__ void copy_head_vec(const int8_t* src, const float* src_scale,
+                              D* dst, float* dst_scale, int dim,
+                              int lane_id) {
+  float scale = *src_scale;
+  for (int d = lane_id; d < dim; d += WARP_SIZE) {
+    dst[d] = D(float(src[d]) * scale);
+  }
+}
+
+// int8 pools keep the values and the scale as they are.
+__device__ void copy_head_vec(const int8_t* src, const float* src_scale,
+                              int8_t* dst, float* dst_scale, int dim,
+                              int lane_id) {
+  for (int d = lane_id; d < dim; d += WARP_SIZE) {
+    dst[d] = src[d];
+  }
+  if (lane_id == 0) *dst_scale = *src_scale;
+}
+
+/**
+@brief: kernel_copy_kv_pages
+Copy kv pages between two pools of [pool_pages, page_vecs, head_dim], such as
+the paged kv cache of a layer and its part of a pool in pinned host memory,
+which is read and written in place. Every warp copies one head vector, so
+that a vector of S copied into an int8 pool is quantized by its own absmax
+as in kernel_split_rotary_position_qkv_i8.
+
+@thread
+gridDim.x = ceil(num_pages * page_vecs / kQuantKVWarps)
+blockDim.x = kQuantKVWarps * WARP_SIZE
+
+@param
+pages: [num_pages, 2], the page of src and the page of dst
+src_scale, dst_scale: [pool_pages, page_vecs], for int8 pools only
+*/
+template <typename S, typename D>
+__global__ void kernel_copy_kv_pages(const S* src, const float* src_scale,
+                                     D* dst, float* dst_scale,
+                                     const int* pages, int num_pages,
+                                     int page_vecs, int head_dim) {
+  size_t vec_idx = (size_t)blockIdx.x * kQuantKVWarps + threadIdx.x / WARP_SIZE;
+  if (vec_idx >= (size_t)num_pages * page_vecs) {
+    return;
+  }
+  int page_idx = vec_idx / page_vecs;
+  int page_vec = vec_idx % page_vecs;
+  size_t src_vec = (size_t)pages[2 * page_idx] * page_vecs + page_vec;
+  size_t dst_vec = (size_t)pages[2 * page_idx + 1] * page_vecs + page_vec;
+  copy_head_vec(src + src_vec * head_dim, src_scale + src_vec,
+                dst + dst_vec * head_dim, dst_scale + dst_vec, head_dim,
+                threadIdx.x % WARP_SIZE);
+}
+
+template <typename S, typename D>
+void launch_copy_kv_pages(const S* src, const float* src_scale, D* dst,
+                          float* dst_scale, const int* pages, int num_pages,
+                          int page_vecs, int head_dim, cudaStream_t stream) {
+  if (head_dim > kFlashAttnMaxHeadDim) {
+    throw std::runtime_error("kv page copies support head_dim <= " +
+                             std::to_string(kFlashAttnMaxHeadDim));
+  }
+  if (num_pages == 0) {
+    return;
+  }
+  size_t num_vecs = (size_t)num_pages * page_vecs;
+  size_t nblock = (num_vecs + kQuantKVWarps - 1) / kQuantKVWarps;
+  kernel_copy_kv_pages<S, D><<<nblock, kQuantKVWarps * WARP_SIZE, 0, stream>>>(
+      src, src_scale, dst, dst_scale, pages, num_pages, page_vecs, head_dim);
+}
+
+template void launch_copy_kv_pages<float, float>(
+    const float* src, const float* src_scale, float* dst, float* dst_scale,
+    const int* pages, int num_pages, int page_vecs, int head_dim,
+    cudaStream_t stream);
+
+template void launch_copy_kv_pages<float, int8_t>(
+    const float* src, const float* src_scale, int8_t* dst, float* dst_scale,
+    const int* pages, int num_pages, int page_vecs, int head_dim,
+    cudaStream_t stream);
+
+template void launch_copy_kv_pages<int8_t, float>(
+    const int8_t* src, const float* src_scale, float* dst, float* dst_scale,
+    const int* pages, int num_pages, int page_vecs, int head_dim,
+    cudaStream_t stream);
+
+template void launch_copy_kv_pages<__half, __half>(
+    const __half* src, const float* src_scale, __half* dst, float* dst_scale,
+    const int* pages, int num_pages, int page_vecs, int head_dim,
+    cudaStream_t stream);
+
+template void launch_copy_kv_pages<__half, int8_t>(
+    const __half* src, const float* src_scale, int8_t* dst, float* dst_scale,
+    const int* pages, int num_pages, int page_vecs, int head_dim,
+    cudaStream_t stream);
+
+template void launch_copy_kv_pages<int8_t, __half>(
+    const int8_t* src, const float* src_scale, __half* dst, float* dst_scale,
+    const int* pages, int num_pages, int page_vecs, int head_dim,
+    cudaStream_t stream);
+
+template void launch_copy_kv_pages<__nv_bfloat16, __nv_bfloat16>(
+    const __nv_bfloat16* src, const float* src_scale, __nv_bfloat16* dst,
+    float* dst_scale, const int* pages, int num_pages, int page_vecs,
+    int head_dim, cudaStream_t stream);
+
+template void launch_copy_kv_pages<__nv_bfloat16, int8_t>(
+    const __nv_bfloat16* src, const float* src_scale, int8_t* dst,
+    float* dst_scale, const int* pages, int num_pages, int page_vecs,
+    int head_dim, cudaStream_t stream);
+
+template void launch_copy_kv_pages<int8_t, __nv_bfloat16>(
+    const int8_t* src, const float* src_scale, __nv_bfloat16* dst,
+    float* dst_scale, const int* pages, int num_pages, int page_vecs,
+    int head_dim, cudaStream_t stream);
+
+template void launch_copy_kv_pages<int8_t, int8_t>(
+    const int8_t* src, const float* src_scale, int8_t* dst, float* dst_scale,
+    const int* pages, int num_pages, int page_vecs, int head_dim,
+    cudaStream_t stream);
+
+// rotary pairs of adjacent columns handled by each thread of
+// kernel_gemv_qkv_rotary, the warps of a block split the rows.
+const int kQkvRotaryPairsPerThread = 4;
+const int kQkvRotaryWarps = 16;
+const int kQkvRotaryBlockPairs = WARP_SIZE * kQkvRotaryPairsPerThread;
+
+/**
+@brief: kernel_gemv_qkv_rotary
+The qkv linear of a few tokens fused with kernel_split_rotary_position_qkv.
+Every thread accumulates the columns d and d + head_dim / 2 of a head, which
+are the two halves of a rotary pair, so that rotary is applied in registers
+and q, k, v are written to q_out and the caches directly, without the
+[batch_tokens, (nhead + 2 * kv_head_num) * head_dim] qkv output.
+
+@thread
+gridDim.x = ceil((nhead + 2 * kv_head_num) * head_dim / 2 /
+  kQkvRotaryBlockPairs)
+gridDim.y = ceil(batch_size * query_len / kTokens)
+blockDim.x = WARP_SIZE
+blockDim.y = kQkvRotaryWarps
+
+@param
+inp: [batch_size * query_len, in_dim]
+weight: [in_dim, (nhead + 2 * kv_head_num) * head_dim]
+q_out, cache_k_out, cache_v_out: as kernel_split_rotary_position_qkv
+*/
+template <typename T, int kTokens>
+__global__ void kernel_gemv_qkv_rotary(
+    const T* inp, const T* weight, const T* sin_ptr, const T* cos_ptr,
+    T* q_out, T* cache_k_out, T* cache_v_out, int max_step, int nhead,
+    int kv_head_num, int offset_seq_len, int query_len, int head_dim,
+    int in_dim, int batch_tokens, const int* offset_seq_len_ptr,
+    const int* page_table, int page_size, int max_pages,
+    const int* seq_offsets, int ring_size) {
+  int half_dim = head_dim / 2;
+  int ld = (nhead + 2 * kv_head_num) * head_dim;
+  int num_pairs = ld / 2;
+  int block_pair = blockIdx.x * kQkvRotaryBlockPairs;
+  int pair = block_pair + threadIdx.x * kQkvRotaryPairsPerThread;
+  // half_dim is a multiple of kQkvRotaryPairsPerThread, so the pairs of a
+  // thread are adjacent columns of one head.
+  int col = pair / half_dim * head_dim + pair % half_dim;
+  int token_begin = blockIdx.y * kTokens;
+  int tile_tokens = min(kTokens, batch_tokens - token_begin);
+  const T* tile_inp = inp + (size_t)token_begin * in_dim;
+
+  // acc[0] is the first half of the pairs, acc[1] the second.
+  float acc[2][kTokens][kQkvRotaryPairsPerThread];
+#pragma unroll
+  for (int h = 0; h < 2; h++) {
+#pragma unroll
+    for (int t = 0; t < kTokens; t++) {
+#pragma unroll
+      for (int c = 0; c < kQkvRotaryPairsPerThread; c++) acc[h][t][c] = 0.f;
+    }
+  }
+
+  if (pair < num_pairs) {
+#pragma unroll 4
+    for (int row = threadIdx.y; row < in_dim; row += kQkvRotaryWarps) {
+      const T* w_row = weight + (size_t)row * ld + col;
+      float w[2][kQkvRotaryPairsPerThread];
+#pragma unroll
+      for (int c = 0; c < kQkvRotaryPairsPerThread; c++) {
+        w[0][c] = float(w_row[c]);
+        w[1][c] = float(w_row[c + half_dim]);
+      }
+#pragma unroll
+      for (int t = 0; t < kTokens; t++) {
+        if (t >= tile_tokens) break;
+        float x = float(tile_inp[(size_t)t * in_dim + row]);
+#pragma unroll
+        for (int h = 0; h < 2; h++) {
+#pragma unroll
+          for (int c = 0; c < kQkvRotaryPairsPerThread; c++) {
+            acc[h][t][c] += x * w[h][c];
+          }
+        }
+      }
+    }
+  }
+
+  // the halves are reduced one after the other to keep shared memory small.
+  __shared__ float s_acc[kQkvRotaryWarps][kTokens][kQkvRotaryBlockPairs];
+  __shared__ float s_first[kTokens][kQkvRotaryBlockPairs];
+#pragma unroll
+  for (int h = 0; h < 2; h++) {
+#pragma unroll
+    for (int t = 0; t < kTokens; t++) {
+#pragma unroll
+      for (int c = 0; c < kQkvRotaryPairsPerThread; c++) {
+        s_acc[threadIdx.y][t][threadIdx.x * kQkvRotaryPairsPerThread + c] =
+            acc[h][t][c];
+      }
+    }
+    __syncthreads();
+
+    for (int idx = threadIdx.y * WARP_SIZE + threadIdx.x;
+         idx < kTokens * kQkvRotaryBlockPairs;
+         idx += kQkvRotaryWarps * WARP_SIZE) {
+      int t = idx / kQkvRotaryBlockPairs, c = idx % kQkvRotaryBlockPairs;
+      int p = block_pair + c;
+      if (t >= tile_tokens || p >= num_pairs) continue;
+      float sum = 0.f;
+#pragma unroll
+      for (int w = 0; w < kQkvRotaryWarps; w++) sum += s_acc[w][t][c];
+      if (h == 0) {
+        s_first[t][c] = sum;
+        continue;
+      }
+
+      int token = token_begin + t;
+      int batch_idx = token / query_len, seq_idx = token % query_len;
+      int head_idx = p / half_dim, head_dim_idx = p % half_dim;
+      int qkv_idx = 0;
+      if (head_idx >= nhead + kv_head_num) {
+        qkv_idx = 2, head_idx -= nhead + kv_head_num;
+      } else if (head_idx >= nhead) {
+        qkv_idx = 1, head_idx -= nhead;
+      }
+      int step = offset_seq_len;
+      if (seq_offsets) {
+        step = seq_offsets[batch_idx];
+      } else if (offset_seq_len_ptr) {
+        step = *offset_seq_len_ptr;
+      }
+      size_t pos = step + seq_idx;
+
+      size_t output_idx = 0;
+      if (qkv_idx && page_table) {
+        size_t page = page_table[batch_idx * max_pages + pos / page_size];
+        output_idx = flat_4dim(page, head_idx, pos % page_size, head_dim_idx,
+                               kv_head_num, page_size, head_dim);
+      } else if (qkv_idx) {
+        output_idx = flat_4dim(batch_idx, head_idx,
+                               kv_cache_row(pos, max_step, ring_size),
+                               head_dim_idx, kv_head_num, max_step, head_dim);
+      } else {
+        output_idx = flat_4dim(batch_idx, head_idx, seq_idx, head_dim_idx,
+                               nhead, query_len, head_dim);
+      }
+
+      float val1 = s_first[t][c], val2 = sum;
+      if (qkv_idx != 2) {
+        size_t rotary_idx = pos * half_dim + head_dim_idx;
+        float cos_val = float(cos_ptr[rotary_idx]);
+        float sin_val = float(sin_ptr[rotary_idx]);
+        float rot1 = val1 * cos_val - val2 * sin_val;
+        float rot2 = val2 * cos_val + val1 * sin_val;
+        val1 = rot1, val2 = rot2;
+      }
+      T* out = qkv_idx == 0 ? q_out
+                            : (qkv_idx == 1 ? cache_k_out : cache_v_out);
+      out[output_idx] = T(val1);
+      out[output_idx + half_dim] = T(val2);
+    }
+    __syncthreads();
+  }
+}
+
+template <typename T>
+void launch_gemv_qkv_rotary(const T* inp, const T* weight, const T* sin_ptr,
+                            const T* cos_ptr, T* q_out, T* cache_k_out,
+                            T* cache_v_out, size_t max_step, size_t batch_size,
+                            size_t nhead, size_t offset_seq_len,
+                            size_t query_len, size_t head_dim, size_t in_dim,
+                            cudaStream_t stream,
+                            const int* offset_seq_len_ptr,
+                            const int* page_table, int page_size,
+                            int max_pages, const int* seq_offsets,
+                            size_t kv_head_num, int ring_size) {
+  if (kv_head_num == 0) kv_head_num = nhead;
+  if (head_dim % (2 * kQkvRotaryPairsPerThread) != 0) {
+    throw std::runtime_error("fused qkv rotary gemv needs head_dim % " +
+                             std::to_string(2 * kQkvRotaryPairsPerThread) +
+                             " == 0");
+  }
+  int batch_tokens = batch_size * query_len;
+  int num_pairs = (nhead + 2 * kv_head_num) * head_dim / 2;
+  int pair_blocks =
+      (num_pairs + kQkvRotaryBlockPairs - 1) / kQkvRotaryBlockPairs;
+  dim3 block_dim(WARP_SIZE, kQkvRotaryWarps);
+  if (batch_tokens == 1) {
+    kernel_gemv_qkv_rotary<T, 1><<<pair_blocks, block_dim, 0, stream>>>(
+        inp, weight, sin_ptr, cos_ptr, q_out, cache_k_out, cache_v_out,
+        max_step, nhead, kv_head_num, offset_seq_len, query_len, head_dim,
+        in_dim, batch_tokens, offset_seq_len_ptr, page_table, page_size,
+        max_pages, seq_offsets, ring_size);
+  } else if (batch_tokens == 2) {
+    kernel_gemv_qkv_rotary<T, 2><<<pair_blocks, block_dim, 0, stream>>>(
+        inp, weight, sin_ptr, cos_ptr, q_out, cache_k_out, cache_v_out,
+        max_step, nhead, kv_head_num, offset_seq_len, query_len, head_dim,
+        in_dim, batch_tokens, offset_seq_len_ptr, page_table, page_size,
+        max_pages, seq_offsets, ring_size);
+  } else {
+    dim3 grid_dim(pair_blocks, (batch_tokens + 3) / 4);
+    kernel_gemv_qkv_rotary<T, 4><<<grid_dim, block_dim, 0, stream>>>(
+        inp, weight, sin_ptr, cos_ptr, q_out, cache_k_out, cache_v_out,
+        max_step, nhead, kv_head_num, offset_seq_len, query_len, head_dim,
+        in_dim, batch_tokens, offset_seq_len_ptr, page_table, page_size,
+        max_pages, seq_offsets, ring_size);
+  }
+}
+
+template void launch_gemv_qkv_rotary<float>(
+    const float* inp, const float* weight, const float* sin_ptr,
+    const float* cos_ptr, float* q_out, float* cache_k_out, float* cache_v_out,
+    size_t max_step, size_t batch_size, size_t nhead, size_t offset_seq_len,
+    size_t query_len, size_t head_dim, size_t in_dim, cudaStream_t stream,
+    const int* offset_seq_len_ptr, const int* page_table, int page_size,
+    int max_pages, const int* seq_offsets, size_t kv_head_num,
+    int ring_size);
+
+template void launch_gemv_qkv_rotary<__half>(
+    const __half* inp, const __half* weight, const __half* sin_ptr,
+    const __half* cos_ptr, __half* q_out, __half* cache_k_out,
+    __half* cache_v_out, size_t max_step, size_t batch_size, size_t nhead,
+    size_t offset_seq_len, size_t query_len, size_t head_dim, size_t in_dim,
+    cudaStream_t stream, const int* offset_seq_len_ptr, const int* page_table,
+    int page_size, int max_pages, const int* seq_offsets, size_t kv_head_num,
+    int ring_size);
+
+template void launch_gemv_qkv_rotary<__nv_bfloat16>(
+    const __nv_bfloat16* inp, const __nv_bfloat16* weight,
+    const __nv_bfloat16* sin_ptr, const __nv_bfloat16* cos_ptr,
+    __nv_bfloat16* q_out, __nv_bfloat16* cache_k_out,
+    __nv_bfloat16* cache_v_out, size_t max_step, size_t batch_size,
+    size_t nhead, size_t offset_seq_len, size_t query_len, size_t head_dim,
+    size_t in_dim, cudaStream_t stream, const int* offset_seq_len_ptr,
+    const int* page_table, int page_size, int max_pages,
+    const int* seq_offsets, size_t kv_head_num,
+    int ring_size);
+
+/**
+@brief: kernel_paged_attention
+Scaled dot product attention of the query tokens of every sequence over its
+keys and values, which are read through the page table of the sequence. The
+query at q_idx attends to the positions [0, offset_seq_len + q_idx].
+
+When seq_offsets is given, every sequence starts at its own offset and the
+sequences carry no padding, so pad_mask is not read.
+
+An int8 cache is dequantized with cache_k_scale / cache_v_scale, see
+kernel_split_rotary_position_qkv_i8, which are nullptr for a cache of T.
+
+@thread
+gridDim.x = batch_size * nhead
+gridDim.y = query_len
+blockDim.x = MAX_THREADS
+
+@param
+q: [batch_size, nhead, query_len, head_dim]
+cache_k, cache_v: [num_pages, kv_head_num, page_size, head_dim]
+cache_k_scale, cache_v_scale: [num_pages, kv_head_num, page_size]
+pad_mask: [batch_size, max_step], 0 or -inf
+page_table: [batch_size, max_pages]
+output: [batch_size, nhead, query_len, head_dim]
+*/
+template <typename T, typename CacheT>
+__global__ void kernel_paged_attention(
+    const T* q, const CacheT* cache_k, const CacheT* cache_v,
+    const T* pad_mask, const int* page_table, T* output, int nhead,
+    int head_dim, int query_len, int offset_seq_len,
+    const int* offset_seq_len_ptr, int page_size, int max_pages,
+    int max_step, float scale, const int* seq_offsets, int kv_head_num,
+    const float* cache_k_scale, const float* cache_v_scale) {
+  extern __shared__ float smem[];
+  float* q_smem = smem;
+  float* score_smem = smem + head_dim;
+  __shared__ float s_max, s_sum;
+
+  int batch_idx = blockIdx.x / nhead;
+  if (seq_offsets) {
+    offset_seq_len = seq_offsets[batch_idx];
+  } else if (offset_seq_len_ptr) {
+    offset_seq_len = *offset_seq_len_ptr;
+  }
+  // the query heads of a group share one kv head.
+  int kv_head_idx = (blockIdx.x % nhead) / (nhead / kv_head_num);
+  int q_idx = blockIdx.y;
+  int kv_len = offset_seq_len + q_idx + 1;
+  const int* table = page_table + batch_idx * max_pages;
+  const T* mask = pad_mask + batch_idx * max_step;
+
+  const T* q_ptr = q + ((size_t)blockIdx.x * query_len + q_idx) * head_dim;
+  for (int i = threadIdx.x; i < head_dim; i += blockDim.x) {
+    q_smem[i] = (float)q_ptr[i];
+  }
+  __syncthreads();
+
+  float local_max = CUDA_FLOAT_INF_NEG;
+  for (int pos = threadIdx.x; pos < kv_len; pos += blockDim.x) {
+    size_t row = ((size_t)table[pos / page_size] * kv_head_num + kv_head_idx) *
+                     page_size +
+                 pos % page_size;
+    const CacheT* k_ptr = cache_k + row * head_dim;
+    float val = 0.f;
+    for (int i = 0; i < head_dim; i++) {
+      val += q_smem[i] * (float)k_ptr[i];
+    }
+    if (cache_k_scale) val *= cache_k_scale[row];
+    val = val * scale + (seq_offsets ? 0.f : (float)mask[pos]);
+    score_smem[pos] = val;
+    local_max = fmaxf(local_max, val);
+  }
+  blockReduce<ReduceType::kMax, 1>(&local_max);
+  if (threadIdx.x == 0) s_max = local_max;
+  __syncthreads();
+
+  float local_sum = 0.f;
+  for (int pos = threadIdx.x; pos < kv_len; pos += blockDim.x) {
+    float val = __expf(score_smem[pos] - s_max);
+    score_smem[pos] = val;
+    local_sum += val;
+  }
+  blockReduce<ReduceType::kSum, 1>(&local_sum);
+  if (threadIdx.x == 0) s_sum = local_sum + 1e-6f;
+  __syncthreads();
+
+  // fold the value scales into the probabilities.
+  if (cache_v_scale) {
+    for (int pos = threadIdx.x; pos < kv_len; pos += blockDim.x) {
+      score_smem[pos] *=
+          cache_v_scale[((size_t)table[pos / page_size] * kv_head_num +
+                         kv_head_idx) * page_size +
+                        pos % page_size];
+    }
+    __syncthreads();
+  }
+
+  T* out_ptr = output + ((size_t)blockIdx.x * query_len + q_idx) * head_dim;
+  for (int i = threadIdx.x; i < head_dim; i += blockDim.x) {
+    float val = 0.f;
+    for (int pos = 0; pos < kv_len; pos++) {
+      const CacheT* v_ptr =
+          cache_v + (((size_t)table[pos / page_size] * kv_head_num +
+                      kv_head_idx) * page_size + pos % page_size) *
+                        head_dim;
+      val += score_smem[pos] * (float)v_ptr[i];
+    }
+    out_ptr[i] = T(val / s_sum);
+  }
+}
+
+template <typename T, typename CacheT>
+void launch_paged_attention(const T* q, const CacheT* cache_k,
+                            const CacheT* cache_v, const T* pad_mask,
+                            const int* page_table, T* output, int batch_size,
+                            int nhead, int head_dim, int query_len,
+                            int offset_seq_len, int page_size, int max_pages,
+                            int max_step, cudaStream_t stream,
+                            const int* offset_seq_len_ptr,
+                            const int* seq_offsets, int kv_head_num,
+                            const float* cache_k_scale,
+                            const float* cache_v_scale) {
+  if (kv_head_num == 0) kv_head_num = nhead;
+  float scale = 1.f / sqrtf(float(head_dim));
+  dim3 grid_dim(batch_size * nhead, query_len);
+  // the scores of all the keys are kept in shared memory, the kv length is
+  // only known on device with offset_seq_len_ptr or seq_offsets.
+  int kv_bound = (offset_seq_len_ptr || seq_offsets)
+                     ? max_step
+                     : std::min(offset_seq_len + query_len, max_step);
+  size_t smem_size = (head_dim + kv_bound) * sizeof(float);
+  if (smem_size > 48 * 1024) {
+    int device, max_smem;
+    CHECK_GPU_ERROR(cudaGetDevice(&device));
+    CHECK_GPU_ERROR(cudaDeviceGetAttribute(
+        &max_smem, cudaDevAttrMaxSharedMemoryPerBlockOptin, device));
+    if (smem_size > size_t(max_smem)) {
+      throw std::runtime_error(
+          "paged attention over " + std::to_string(kv_bound) +
+          " keys needs " + std::to_string(smem_size) +
+          " bytes of shared memory, the device has " +
+          std::to_string(max_smem));
+    }
+    CHECK_GPU_ERROR(cudaFuncSetAttribute(
+        kernel_paged_attention<T, CacheT>,
+        cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size));
+  }
+  kernel_paged_attention<T, CacheT>
+      <<<grid_dim, MAX_THREADS, smem_size, stream>>>(
+          q, cache_k, cache_v, pad_mask, page_table, output, nhead, head_dim,
+          query_len, offset_seq_len, offset_seq_len_ptr, page_size, max_pages,
+          max_step, scale, seq_offsets, kv_head_num, cache_k_scale,
+          cache_v_scale);
+}
+
+template void launch_paged_attention<float, float>(
+    const float* q, const float* cache_k, const float* cache_v,
+    const float* pad_mask, const int* page_table, float* output,
+    int batch_size, int nhead, int head_dim, int query_len,
+    int offset_seq_len, int page_size, int max_pages, int max_step,
+    cudaStream_t stream, const int* offset_seq_len_ptr,
+    const int* seq_offsets, int kv_head_num, const float* cache_k_scale,
+    const float* cache_v_scale);
+
+template void launch_paged_attention<float, int8_t>(
+    const float* q, const int8_t* cache_k, const int8_t* cache_v,
+    const float* pad_mask, const int* page_table, float* output,
+    int batch_size, int nhead, int head_dim, int query_len,
+    int offset_seq_len, int page_size, int max_pages, int max_step,
+    cudaStream_t stream, const int* offset_seq_len_ptr,
+    const int* seq_offsets, int kv_head_num, const float* cache_k_scale,
+    const float* cache_v_scale);
+
+template void launch_paged_attention<__half, __half>(
+    const __half* q, const __half* cache_k, const __half* cache_v,
+    const __half* pad_mask, const int* page_table, __half* output,
+    int batch_size, int nhead, int head_dim, int query_len,
+    int offset_seq_len, int page_size, int max_pages, int max_step,
+    cudaStream_t stream, const int* offset_seq_len_ptr,
+    const int* seq_offsets, int kv_head_num, const float* cache_k_scale,
+    const float* cache_v_scale);
+
+template void launch_paged_attention<__nv_bfloat16, __nv_bfloat16>(
+    const __nv_bfloat16* q, const __nv_bfloat16* cache_k,
+    const __nv_bfloat16* cache_v, const __nv_bfloat16* pad_mask,
+    const int* page_table, __nv_bfloat16* output, int batch_size, int nhead,
+    int head_dim, int query_len, int offset_seq_len, int page_size,
+    int max_pages, int max_step, cudaStream_t stream,
+    const int* offset_seq_len_ptr, const int* seq_offsets, int kv_head_num,
+    const float* cache_k_scale, const float* cache_v_scale);
+template void launch_paged_attention<__nv_bfloat16, int8_t>(
+    const __nv_bfloat16* q, const int8_t* cache_k, const int8_t* cache_v,
+    const __nv_bfloat16* pad_mask, const int* page_table,
+    __nv_bfloat16* output, int batch_size, int nhead, int head_dim,
+    int query_len, int offset_seq_len, int page_size, int max_pages,
+    int max_step, cudaStream_t stream, const int* offset_seq_len_ptr,
+    const int* seq_offsets, int kv_head_num, const float* cache_k_scale,
+    const float* cache_v_scale);
+template void launch_paged_attention<__half, int8_t>(
+    const __half* q, const int8_t* cache_k, const int8_t* cache_v,
+    const __half* pad_mask, const int* page_table, __half* output,
+    int batch_size, int nhead, int head_dim, int query_len,
+    int offset_seq_len, int page_size, int max_pages, int max_step,
+    cudaStream_t stream, const int* offset_seq_len_ptr,
+    const int* seq_offsets, int kv_head_num, const float* cache_k_scale,
+    const float* cache_v_scale);
 
 template <typename T>
 __global__ void kernel_silu_elewise_product(const T* inp_ptr, T* out_ptr,
@@ -281,9 +1516,9 @@ __global__ void kernel_silu_elewise_product(const T* inp_ptr, T* out_ptr,
   }
   int inpA_idx = idx / inner_size * inner_size * 2 + idx % inner_size;
   int inpB_idx = inpA_idx + inner_size;
-  const T& inpA = *(inp_ptr + inpA_idx);
-  const T& inpB = *(inp_ptr + inpB_idx);
-  *(out_ptr + idx) = inpA / (1.f + __expf(-inpA)) * inpB;
+  float inpA = float(inp_ptr[inpA_idx]);
+  float inpB = float(inp_ptr[inpB_idx]);
+  *(out_ptr + idx) = T(inpA / (1.f + __expf(-inpA)) * inpB);
 }
 
 template <>
@@ -320,16 +1555,115 @@ template void launch_silu_elewise_product<float>(
 template void launch_silu_elewise_product<__half>(
     const __half* inp_ptr, __half* out_ptr, size_t batch_size, size_t seq_len,
     size_t inner_size, cudaStream_t stream);
+template void launch_silu_elewise_product<__nv_bfloat16>(
+    const __nv_bfloat16* inp_ptr, __nv_bfloat16* out_ptr, size_t batch_size,
+    size_t seq_len, size_t inner_size, cudaStream_t stream);
+
+/**
+@brief: kernel_silu_elewise_product_bw
+the backward of kernel_silu_elewise_product, out = silu(a) * b of the
+[batch_tokens, 2, inner_size] input. With s = sigmoid(a):
+  da = dout * b * s * (1 + a * (1 - s)), db = dout * silu(a).
+
+@thread
+gridDim.x = (nele + MAX_THREADS - 1) / MAX_THREADS
+blockDim.x = MAX_THREADS
+*/
+template <typename T>
+__global__ void kernel_silu_elewise_product_bw(T* inp_grad, const T* out_grad,
+                                               const T* inp_ptr,
+                                               size_t inner_size,
+                                               size_t max_thread_num) {
+  size_t idx = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= max_thread_num) {
+    return;
+  }
+  size_t inpA_idx = idx / inner_size * inner_size * 2 + idx % inner_size;
+  size_t inpB_idx = inpA_idx + inner_size;
+  float inpA = float(inp_ptr[inpA_idx]);
+  float inpB = float(inp_ptr[inpB_idx]);
+  float dout = float(out_grad[idx]);
+  float sig = 1.f / (1.f + __expf(-inpA));
+  inp_grad[inpA_idx] = T(dout * inpB * sig * (1.f + inpA * (1.f - sig)));
+  inp_grad[inpB_idx] = T(dout * inpA * sig);
+}
+
+template <typename T>
+void launch_silu_elewise_product_bw(T* inp_grad, const T* out_grad,
+                                    const T* inp_ptr, size_t batch_size,
+                                    size_t seq_len, size_t inner_size,
+                                    cudaStream_t stream) {
+  size_t nele = batch_size * seq_len * inner_size;
+  size_t nblock = (nele + MAX_THREADS - 1) / MAX_THREADS;
+  kernel_silu_elewise_product_bw<T><<<nblock, MAX_THREADS, 0, stream>>>(
+      inp_grad, out_grad, inp_ptr, inner_size, nele);
+}
+
+template void launch_silu_elewise_product_bw<float>(
+    float* inp_grad, const float* out_grad, const float* inp_ptr,
+    size_t batch_size, size_t seq_len, size_t inner_size, cudaStream_t stream);
+template void launch_silu_elewise_product_bw<__half>(
+    __half* inp_grad, const __half* out_grad, const __half* inp_ptr,
+    size_t batch_size, size_t seq_len, size_t inner_size, cudaStream_t stream);
+template void launch_silu_elewise_product_bw<__nv_bfloat16>(
+    __nv_bfloat16* inp_grad, const __nv_bfloat16* out_grad,
+    const __nv_bfloat16* inp_ptr, size_t batch_size, size_t seq_len,
+    size_t inner_size, cudaStream_t stream);
+
+/**
+@brief: kernel_gelu_elewise_product
+gelu(a) * b of the [batch_tokens, 2, inner_size] input, the gated-gelu
+feed forward of T5 v1.1 and mT5.
+
+@thread
+gridDim.x = (nele + MAX_THREADS - 1) / MAX_THREADS
+blockDim.x = MAX_THREADS
+*/
+template <typename T>
+__global__ void kernel_gelu_elewise_product(const T* inp_ptr, T* out_ptr,
+                                            size_t inner_size,
+                                            size_t max_thread_num) {
+  size_t idx = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= max_thread_num) {
+    return;
+  }
+  size_t inpA_idx = idx / inner_size * inner_size * 2 + idx % inner_size;
+  size_t inpB_idx = inpA_idx + inner_size;
+  float inpA = float(inp_ptr[inpA_idx]);
+  float inpB = float(inp_ptr[inpB_idx]);
+  out_ptr[idx] = T(gelu<float>(inpA) * inpB);
+}
+
+template <typename T>
+void launch_gelu_elewise_product(const T* inp_ptr, T* out_ptr,
+                                 size_t batch_size, size_t seq_len,
+                                 size_t inner_size, cudaStream_t stream) {
+  size_t nele = batch_size * seq_len * inner_size;
+  size_t nblock = (nele + MAX_THREADS - 1) / MAX_THREADS;
+  kernel_gelu_elewise_product<T><<<nblock, MAX_THREADS, 0, stream>>>(
+      inp_ptr, out_ptr, inner_size, nele);
+}
+
+template void launch_gelu_elewise_product<float>(
+    const float* inp_ptr, float* out_ptr, size_t batch_size, size_t seq_len,
+    size_t inner_size, cudaStream_t stream);
+template void launch_gelu_elewise_product<__half>(
+    const __half* inp_ptr, __half* out_ptr, size_t batch_size, size_t seq_len,
+    size_t inner_size, cudaStream_t stream);
+template void launch_gelu_elewise_product<__nv_bfloat16>(
+    const __nv_bfloat16* inp_ptr, __nv_bfloat16* out_ptr, size_t batch_size,
+    size_t seq_len, size_t inner_size, cudaStream_t stream);
 
 template <typename T>
 __global__ void ker_rms_layer_norm(const T* inp_ptr, const T* scale_ptr,
                                    T* out_ptr, T* rms_ptr, size_t hidden_dim,
-                                   const float ln_epsilon) {
+                                   const float ln_epsilon, RowView inp_rows) {
   // step 0. compute local sum
   float l_square_sum = 0;
-  const T* thread_inp = inp_ptr + blockIdx.x * hidden_dim;
+  const T* thread_inp = inp_ptr + inp_rows.row(blockIdx.x) * hidden_dim;
   for (uint idx = threadIdx.x; idx < hidden_dim; idx += blockDim.x) {
-    l_square_sum += thread_inp[idx] * thread_inp[idx];
+    float float_inp = float(thread_inp[idx]);
+    l_square_sum += float_inp * float_inp;
   }
 
   // step 1. compute reduce sum
@@ -339,14 +1673,15 @@ __global__ void ker_rms_layer_norm(const T* inp_ptr, const T* scale_ptr,
   __shared__ float s_var;
   if (threadIdx.x == 0) {
     s_var = rsqrtf(kReduce[0] / mean_dim + ln_epsilon);
-    rms_ptr[blockIdx.x] = s_var;
+    rms_ptr[blockIdx.x] = T(s_var);
   }
   __syncthreads();
 
   // step 2. layer norm result
   T* thread_out = out_ptr + blockIdx.x * hidden_dim;
   for (uint idx = threadIdx.x; idx < hidden_dim; idx += blockDim.x) {
-    thread_out[idx] = thread_inp[idx] * scale_ptr[idx] * s_var;
+    thread_out[idx] =
+        T(float(thread_inp[idx]) * float(scale_ptr[idx]) * s_var);
   }
 }
 
@@ -355,10 +1690,12 @@ __global__ void ker_rms_layer_norm<__half>(const __half* inp_ptr,
                                            const __half* scale_ptr,
                                            __half* out_ptr, __half* rms_ptr,
                                            size_t hidden_dim,
-                                           const float ln_epsilon) {
+                                           const float ln_epsilon,
+                                           RowView inp_rows) {
   // step 0. compute local sum
   float l_square_sum = 0;
-  const __half* thread_inp = inp_ptr + blockIdx.x * hidden_dim;
+  const __half* thread_inp =
+      inp_ptr + inp_rows.row(blockIdx.x) * hidden_dim;
   for (uint idx = threadIdx.x; idx < hidden_dim; idx += blockDim.x) {
     float float_inp = __half2float(thread_inp[idx]);
     l_square_sum += float_inp * float_inp;
@@ -387,13 +1724,15 @@ __global__ void ker_rms_layer_norm_with_res(const T* inp_ptr,
                                             const T* scale_ptr, T* out_ptr,
                                             T* res_ptr, T* rms_ptr,
                                             size_t hidden_dim,
-                                            const float ln_epsilon) {
+                                            const float ln_epsilon,
+                                            RowView inp_rows) {
   // step 0. compute local sum
   float l_square_sum = 0;
-  const T* thread_inp = inp_ptr + blockIdx.x * hidden_dim;
+  const T* thread_inp = inp_ptr + inp_rows.row(blockIdx.x) * hidden_dim;
   T* res_thread_out = res_ptr + blockIdx.x * hidden_dim;
   for (uint idx = threadIdx.x; idx < hidden_dim; idx += blockDim.x) {
-    l_square_sum += thread_inp[idx] * thread_inp[idx];
+    float float_inp = float(thread_inp[idx]);
+    l_square_sum += float_inp * float_inp;
     res_thread_out[idx] = thread_inp[idx];
   }
 
@@ -404,14 +1743,15 @@ __global__ void ker_rms_layer_norm_with_res(const T* inp_ptr,
   __shared__ float s_var;
   if (threadIdx.x == 0) {
     s_var = rsqrtf(kReduce[0] / mean_dim + ln_epsilon);
-    rms_ptr[blockIdx.x] = s_var;
+    rms_ptr[blockIdx.x] = T(s_var);
   }
   __syncthreads();
 
   // step 2. layer norm result
   T* thread_out = out_ptr + blockIdx.x * hidden_dim;
   for (uint idx = threadIdx.x; idx < hidden_dim; idx += blockDim.x) {
-    thread_out[idx] = thread_inp[idx] * scale_ptr[idx] * s_var;
+    thread_out[idx] =
+        T(float(thread_inp[idx]) * float(scale_ptr[idx]) * s_var);
   }
 }
 
@@ -419,10 +1759,11 @@ template <>
 __global__ void ker_rms_layer_norm_with_res<__half>(
     const __half* inp_ptr, const __half* scale_ptr, __half* out_ptr,
     __half* res_ptr, __half* rms_ptr, size_t hidden_dim,
-    const float ln_epsilon) {
+    const float ln_epsilon, RowView inp_rows) {
   // step 0. compute local sum
   float l_square_sum = 0;
-  const __half* thread_inp = inp_ptr + blockIdx.x * hidden_dim;
+  const __half* thread_inp =
+      inp_ptr + inp_rows.row(blockIdx.x) * hidden_dim;
   __half* res_thread_out = res_ptr + blockIdx.x * hidden_dim;
   for (uint idx = threadIdx.x; idx < hidden_dim; idx += blockDim.x) {
     float float_inp = __half2float(thread_inp[idx]);
@@ -452,28 +1793,43 @@ template <typename T>
 void launch_rms_layer_norm(const T* inp_ptr, const T* scale_ptr, T* out_ptr,
                            T* res_ptr, T* rms_ptr, size_t batch_tokens,
                            size_t hidden_dim, cudaStream_t stream,
-                           const float ln_epsilon) {
+                           const float ln_epsilon, RowView inp_rows) {
   int nthread = std::min(((hidden_dim + 31) / 32) * 32, size_t(MAX_THREADS));
   dim3 grid_dim(batch_tokens);
   dim3 block_dim(nthread);
 
   if (res_ptr == nullptr) {
     ker_rms_layer_norm<T><<<grid_dim, block_dim, 0, stream>>>(
-        inp_ptr, scale_ptr, out_ptr, rms_ptr, hidden_dim, ln_epsilon);
+        inp_ptr, scale_ptr, out_ptr, rms_ptr, hidden_dim, ln_epsilon,
+        inp_rows);
   } else {
     ker_rms_layer_norm_with_res<T><<<grid_dim, block_dim, 0, stream>>>(
-        inp_ptr, scale_ptr, out_ptr, res_ptr, rms_ptr, hidden_dim, ln_epsilon);
+        inp_ptr, scale_ptr, out_ptr, res_ptr, rms_ptr, hidden_dim, ln_epsilon,
+        inp_rows);
   }
 }
 
 template void launch_rms_layer_norm<float>(
     const float* inp_ptr, const float* scale_ptr, float* out_ptr,
     float* res_ptr, float* rms_ptr, size_t batch_tokens, size_t hidden_dim,
-    cudaStream_t stream, const float ln_epsilon);
+    cudaStream_t stream, const float ln_epsilon, RowView inp_rows);
 template void launch_rms_layer_norm<__half>(
     const __half* inp_ptr, const __half* scale_ptr, __half* out_ptr,
     __half* res_ptr, __half* rms_ptr, size_t batch_tokens, size_t hidden_dim,
-    cudaStream_t stream, const float ln_epsilon);
+    cudaStream_t stream, const float ln_epsilon, RowView inp_rows);
+template void launch_rms_layer_norm<__nv_bfloat16>(
+    const __nv_bfloat16* inp_ptr, const __nv_bfloat16* scale_ptr,
+    __nv_bfloat16* out_ptr, __nv_bfloat16* res_ptr, __nv_bfloat16* rms_ptr,
+    size_t batch_tokens, size_t hidden_dim, cudaStream_t stream,
+    const float ln_epsilon, RowView inp_rows);
+
+__global__ void kernel_advance_step_offset(int* step_offset) {
+  (*step_offset)++;
+}
+
+void launch_advance_step_offset(int* step_offset, cudaStream_t stream) {
+  kernel_advance_step_offset<<<1, 1, 0, stream>>>(step_offset);
+}
 
 }  // namespace cuda
 }  // namespace lightseq
@@ -0,0 +1,145 @@
+#include "common.h"
+#include "kernels.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+const int kLoraShrinkWarps = 8;
+const int kLoraExpandThreads = 256;
+
+}  // namespace
+
+/**
+@brief: ker_lora_shrink
+tmp = inp * A^T with the A of the slot of every row, each warp reduces the
+dots of its ranks over the row.
+
+@thread
+gridDim.x = rows
+blockDim.x = WARP_SIZE
+blockDim.y = kLoraShrinkWarps
+
+@param
+inp: [rows, in_dim]
+a_ptrs: [num_slots] device pointers to [rank, in_dim]
+row_slots: [rows]
+tmp: [rows, rank]
+*/
+template <typename T>
+__global__ void ker_lora_shrink(const T *inp, const T *const *a_ptrs,
+                                const int *row_slots, float *tmp, int in_dim,
+                                int rank) {
+  int row = blockIdx.x;
+  int slot = row_slots[row];
+  if (slot < 0) return;
+  const T *a = a_ptrs[slot];
+  const T *row_inp = inp + (size_t)row * in_dim;
+  for (int k = threadIdx.y; k < rank; k += kLoraShrinkWarps) {
+    const T *a_row = a + (size_t)k * in_dim;
+    float sum = 0.f;
+    for (int i = threadIdx.x; i < in_dim; i += WARP_SIZE) {
+      sum += float(row_inp[i]) * float(a_row[i]);
+    }
+#pragma unroll
+    for (int offset = WARP_SIZE / 2; offset > 0; offset /= 2) {
+      sum += __shfl_xor_sync(0xffffffff, sum, offset);
+    }
+    if (threadIdx.x == 0) tmp[(size_t)row * rank + k] = sum;
+  }
+}
+
+/**
+@brief: ker_lora_expand
+out += scale * tmp * B with the B and the scale of the slot of every row.
+
+@thread
+gridDim.x = ceil(out_dim / kLoraExpandThreads)
+gridDim.y = rows
+blockDim.x = kLoraExpandThreads
+
+@param
+tmp: [rows, rank]
+b_ptrs: [num_slots] device pointers to [rank, out_dim]
+scales: [num_slots]
+row_slots: [rows]
+out: [rows, out_dim]
+*/
+template <typename T>
+__global__ void ker_lora_expand(const float *tmp, const T *const *b_ptrs,
+                                const float *scales, const int *row_slots,
+                                T *out, int rank, int out_dim) {
+  extern __shared__ float s_tmp[];
+  int row = blockIdx.y;
+  int slot = row_slots[row];
+  if (slot < 0) return;
+  for (int k = threadIdx.x; k < rank; k += blockDim.x) {
+    s_tmp[k] = tmp[(size_t)row * rank + k];
+  }
+  __syncthreads();
+  int col = blockIdx.x * blockDim.x + threadIdx.x;
+  if (col >= out_dim) return;
+  const T *b = b_ptrs[slot];
+  float sum = 0.f;
+  for (int k = 0; k < rank; k++) {
+    sum += s_tmp[k] * float(b[(size_t)k * out_dim + col]);
+  }
+  T *dst = out + (size_t)row * out_dim + col;
+  *dst = T(float(*dst) + scales[slot] * sum);
+}
+
+template <typename T>
+void launch_lora_shrink(const T *inp, const T *const *a_ptrs,
+                        const int *row_slots, float *tmp, int rows,
+                        int in_dim, int rank, cudaStream_t stream) {
+  dim3 block_dim(WARP_SIZE, kLoraShrinkWarps);
+  ker_lora_shrink<T><<<rows, block_dim, 0, stream>>>(inp, a_ptrs, row_slots,
+                                                     tmp, in_dim, rank);
+}
+
+template <typename T>
+void launch_lora_expand(const float *tmp, const T *const *b_ptrs,
+                        const float *scales, const int *row_slots, T *out,
+                        int rows, int rank, int out_dim, cudaStream_t stream) {
+  dim3 grid_dim((out_dim + kLoraExpandThreads - 1) / kLoraExpandThreads,
+                rows);
+  ker_lora_expand<T><<<grid_dim, kLoraExpandThreads, rank * sizeof(float),
+                       stream>>>(tmp, b_ptrs, scales, row_slots, out, rank,
+                                 out_dim);
+}
+
+template void launch_lora_shrink<float>(const float *inp,
+                                        const float *const *a_ptrs,
+                                        const int *row_slots, float *tmp,
+                                        int rows, int in_dim, int rank,
+                                        cudaStream_t stream);
+template void launch_lora_shrink<__half>(const __half *inp,
+                                         const __half *const *a_ptrs,
+                                         const int *row_slots, float *tmp,
+                                         int rows, int in_dim, int rank,
+                                         cudaStream_t stream);
+template void launch_lora_shrink<__nv_bfloat16>(
+    const __nv_bfloat16 *inp, const __nv_bfloat16 *const *a_ptrs,
+    const int *row_slots, float *tmp, int rows, int in_dim, int rank,
+    cudaStream_t stream);
+
+template void launch_lora_expand<float>(const float *tmp,
+                                        const float *const *b_ptrs,
+                                        const float *scales,
+                                        const int *row_slots, float *out,
+                                        int rows, int rank, int out_dim,
+                                        cudaStream_t stream);
+template void launch_lora_expand<__half>(const float *tmp,
+                                         const __half *const *b_ptrs,
+                                         const float *scales,
+                                         const int *row_slots, __half *out,
+                                         int rows, int rank, int out_dim,
+                                         cudaStream_t stream);
+template void launch_lora_expand<__nv_bfloat16>(
+    const float *tmp, const __nv_bfloat16 *const *b_ptrs, const float *scales,
+    const int *row_slots, __nv_bfloat16 *out, int rows, int rank, int out_dim,
+    cudaStream_t stream);
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -0,0 +1,753 @@
+#include "common.h"
+#include "moe_kernels.h"
+#include <cub/cub.cuh>
+#include <mma.h>
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+// tokens routed by one block of kernel_moe_route_dispatch, every warp
+// routes kMoeRouteTileTokens / kRouteWarps of them.
+const int kRouteWarps = 8;
+const int kRouteMaxExperts = 256;
+const int kRouteMaxTopk = 8;
+const int kRouteExpertsPerLane = kRouteMaxExperts / WARP_SIZE;
+// the state of an expert in a tile of kernel_moe_route_dispatch, its count
+// in the low bits, and in the two high bits whether the count is the one of
+// the tile only or of every tile up to it. 0 is not published yet.
+const unsigned kTileAggregate = 1u << 30;
+const unsigned kTilePrefix = 2u << 30;
+const unsigned kTileCountMask = kTileAggregate - 1;
+
+const int kGemmTileM = 64;
+const int kGemmTileN = 64;
+const int kGemmThreads = 256;
+
+// copy a row of hidden_dim elements by num_threads threads, in 16 bytes
+// vectors when the row is aligned.
+template <typename T>
+__device__ void copy_row(const T* src, T* dst, int hidden_dim, int tid,
+                         int num_threads) {
+  size_t row_bytes = hidden_dim * sizeof(T);
+  if (((size_t)src | (size_t)dst | row_bytes) % sizeof(int4) == 0) {
+    const int4* src4 = reinterpret_cast<const int4*>(src);
+    int4* dst4 = reinterpret_cast<int4*>(dst);
+    for (int i = tid; i < row_bytes / sizeof(int4); i += num_threads) {
+      dst4[i] = __ldg(&src4[i]);
+    }
+    return;
+  }
+  for (int i = tid; i < hidden_dim; i += num_threads) dst[i] = src[i];
+}
+
+__forceinline__ __device__ float moe_activate(float x, int act) {
+  if (act == 1) return fmaxf(x, 0.f);
+  if (act == 2) return gelu<float>(x);
+  return x;
+}
+
+}  // namespace
+
+/**
+@brief: kernel_moe_route_dispatch
+softmax of the gate logits, route each token to its topk experts and copy it
+to the slots of its experts, in a single pass. The slots of an expert go to
+its tokens in token order, the tokens beyond its capacity are dropped. A
+block routes a tile of kMoeRouteTileTokens tokens, whose slots follow the
+ones of the tiles before it, found by a decoupled look-back over the per
+expert counts the tiles publish in workspace. The tiles are numbered in the
+order the blocks start, so a block only waits for blocks already running.
+
+@thread
+gridDim.x = ceil(batch_tokens / kMoeRouteTileTokens)
+blockDim.x = kRouteWarps * WARP_SIZE
+
+@param
+gate_logits: [batch_tokens, expert_num]
+input: [batch_tokens, hidden_dim]
+score, expert, slot: [topk, max_batch_tokens]
+expert_rows: [expert_num], the used slots of each expert
+workspace: [1 + gridDim.x * expert_num] of zeros, the tile counter and the
+  tile states
+output: [expert_num, capacity, hidden_dim]
+*/
+template <typename T>
+__global__ void kernel_moe_route_dispatch(
+    const T* gate_logits, const T* input, float* score, int* expert, int* slot,
+    int* expert_rows, unsigned* workspace, T* output, int batch_tokens,
+    int max_batch_tokens, int expert_num, int capacity, int topk,
+    int hidden_dim) {
+  __shared__ int s_tile;
+  __shared__ int s_expert[kMoeRouteTileTokens][kRouteMaxTopk];
+  __shared__ int s_slot[kMoeRouteTileTokens][kRouteMaxTopk];
+  __shared__ int s_count[kRouteMaxExperts];
+  __shared__ int s_base[kRouteMaxExperts];
+  if (threadIdx.x == 0) s_tile = atomicAdd(workspace, 1u);
+  for (int e = threadIdx.x; e < expert_num; e += blockDim.x) s_count[e] = 0;
+  __syncthreads();
+  int tile = s_tile;
+  int warp_id = threadIdx.x / WARP_SIZE, lane_id = threadIdx.x % WARP_SIZE;
+
+  // softmax and topk of a token by a warp, the ties go to the lower expert
+  for (int t = warp_id; t < kMoeRouteTileTokens; t += kRouteWarps) {
+    int token_id = tile * kMoeRouteTileTokens + t;
+    if (token_id >= batch_tokens) {
+      if (lane_id < topk) s_expert[t][lane_id] = -1;
+      continue;
+    }
+    float val[kRouteExpertsPerLane];
+    float max_val = CUDA_FLOAT_INF_NEG;
+#pragma unroll
+    for (int i = 0; i < kRouteExpertsPerLane; i++) {
+      int e = lane_id + i * WARP_SIZE;
+      val[i] = e < expert_num
+                   ? float(gate_logits[(size_t)token_id * expert_num + e])
+                   : CUDA_FLOAT_INF_NEG;
+      max_val = fmaxf(max_val, val[i]);
+    }
+    max_val = warpReduceMax(max_val);
+    float sum = 0.f;
+#pragma unroll
+    for (int i = 0; i < kRouteExpertsPerLane; i++) {
+      if (lane_id + i * WARP_SIZE < expert_num) sum += expf(val[i] - max_val);
+    }
+    sum = warpReduceSum(sum);
+
+    int my_expert = -1;
+    float my_score = 0.f, topk_sum = 0.f;
+    for (int k = 0; k < topk; k++) {
+      float best_val = CUDA_FLOAT_INF_NEG;
+      int best_expert = expert_num;
+#pragma unroll
+      for (int i = 0; i < kRouteExpertsPerLane; i++) {
+        int e = lane_id + i * WARP_SIZE;
+        if (e < expert_num && val[i] > best_val) {
+          best_val = val[i], best_expert = e;
+        }
+      }
+      for (int mask = WARP_SIZE >> 1; mask > 0; mask >>= 1) {
+        float other_val =
+            __shfl_xor_sync(WARP_REDUCE_MASK, best_val, mask, WARP_SIZE);
+        int other_expert =
+            __shfl_xor_sync(WARP_REDUCE_MASK, best_expert, mask, WARP_SIZE);
+        if (other_val > best_val ||
+            (other_val == best_val && other_expert < best_expert)) {
+          best_val = other_val, best_expert = other_expert;
+        }
+      }
+#pragma unroll
+      for (int i = 0; i < kRouteExpertsPerLane; i++) {
+        if (lane_id + i * WARP_SIZE == best_expert) {
+          val[i] = CUDA_FLOAT_INF_NEG;
+        }
+      }
+      float prob = expf(best_val - max_val) / sum;
+      topk_sum += prob;
+      if (lane_id == k) my_expert = best_expert, my_score = prob;
+    }
+    if (lane_id < topk) {
+      int pos = lane_id * max_batch_tokens + token_id;
+      score[pos] = topk > 1 ? my_score / topk_sum : my_score;
+      expert[pos] = my_expert;
+      s_expert[t][lane_id] = my_expert;
+    }
+  }
+  __syncthreads();
+
+  // rank of a routed token among the tokens of its expert in the tile, a
+  // token goes to an expert at most once
+  int entry_token = threadIdx.x / topk, entry_k = threadIdx.x % topk;
+  int entry_expert = entry_token < kMoeRouteTileTokens
+                         ? s_expert[entry_token][entry_k]
+                         : -1;
+  int entry_rank = 0;
+  if (entry_expert >= 0) {
+    for (int t = 0; t < entry_token; t++) {
+      for (int k = 0; k < topk; k++) {
+        entry_rank += s_expert[t][k] == entry_expert;
+      }
+    }
+    atomicAdd(&s_count[entry_expert], 1);
+  }
+  __syncthreads();
+
+  // the slots of the tiles before, looked back by a thread per expert
+  volatile unsigned* tile_state = workspace + 1;
+  for (int e = threadIdx.x; e < expert_num; e += blockDim.x) {
+    unsigned count = s_count[e];
+    unsigned* state = workspace + 1 + tile * expert_num + e;
+    unsigned base = 0;
+    if (tile > 0) {
+      atomicExch(state, kTileAggregate | count);
+      for (int prev = tile - 1;;) {
+        unsigned prev_state = tile_state[prev * expert_num + e];
+        if (prev_state == 0) continue;
+        base += prev_state & kTileCountMask;
+        if ((prev_state & ~kTileCountMask) == kTilePrefix) break;
+        prev--;
+      }
+    }
+    atomicExch(state, kTilePrefix | (base + count));
+    s_base[e] = base;
+    if (tile == gridDim.x - 1) {
+      expert_rows[e] = min(int(base + count), capacity);
+    }
+  }
+  __syncthreads();
+
+  if (entry_expert >= 0) {
+    int entry_slot = s_base[entry_expert] + entry_rank;
+    entry_slot = entry_slot < capacity ? entry_slot : -1;
+    s_slot[entry_token][entry_k] = entry_slot;
+    slot[entry_k * max_batch_tokens + tile * kMoeRouteTileTokens +
+         entry_token] = entry_slot;
+  }
+  __syncthreads();
+
+  // copy the tokens to their slots, a warp per routed token
+  for (int entry = warp_id; entry < kMoeRouteTileTokens * topk;
+       entry += kRouteWarps) {
+    int t = entry / topk, k = entry % topk;
+    int expert_id = s_expert[t][k], slot_id = s_slot[t][k];
+    if (expert_id < 0 || slot_id < 0) continue;
+    int token_id = tile * kMoeRouteTileTokens + t;
+    copy_row(input + (size_t)token_id * hidden_dim,
+             output + ((size_t)expert_id * capacity + slot_id) * hidden_dim,
+             hidden_dim, lane_id, WARP_SIZE);
+  }
+}
+
+template <typename T>
+void launch_moe_route_dispatch(const T* gate_logits, const T* input,
+                               float* score, int* expert, int* slot,
+                               int* expert_rows, int* workspace, T* output,
+                               int batch_tokens, int max_batch_tokens,
+                               int expert_num, int capacity, int topk,
+                               int hidden_dim, cudaStream_t stream) {
+  if (expert_num > kRouteMaxExperts || topk > kRouteMaxTopk ||
+      topk > expert_num) {
+    throw std::runtime_error(
+        "violate expert_num <= 256 and topk <= min(expert_num, 8)");
+  }
+  int num_tiles =
+      (batch_tokens + kMoeRouteTileTokens - 1) / kMoeRouteTileTokens;
+  if (num_tiles == 0) {
+    cudaMemsetAsync(expert_rows, 0, expert_num * sizeof(int), stream);
+    return;
+  }
+  cudaMemsetAsync(workspace, 0, (1 + num_tiles * expert_num) * sizeof(int),
+                  stream);
+  kernel_moe_route_dispatch<T>
+      <<<num_tiles, kRouteWarps * WARP_SIZE, 0, stream>>>(
+          gate_logits, input, score, expert, slot, expert_rows,
+          reinterpret_cast<unsigned*>(workspace), output, batch_tokens,
+          max_batch_tokens, expert_num, capacity, topk, hidden_dim);
+}
+
+template void launch_moe_route_dispatch<float>(
+    const float* gate_logits, const float* input, float* score, int* expert,
+    int* slot, int* expert_rows, int* workspace, float* output,
+    int batch_tokens, int max_batch_tokens, int expert_num, int capacity,
+    int topk, int hidden_dim, cudaStream_t stream);
+
+template void launch_moe_route_dispatch<__half>(
+    const __half* gate_logits, const __half* input, float* score, int* expert,
+    int* slot, int* expert_rows, int* workspace, __half* output,
+    int batch_tokens, int max_batch_tokens, int expert_num, int capacity,
+    int topk, int hidden_dim, cudaStream_t stream);
+
+template void launch_moe_route_dispatch<__nv_bfloat16>(
+    const __nv_bfloat16* gate_logits, const __nv_bfloat16* input,
+    float* score, int* expert, int* slot, int* expert_rows, int* workspace,
+    __nv_bfloat16* output, int batch_tokens, int max_batch_tokens,
+    int expert_num, int capacity, int topk, int hidden_dim,
+    cudaStream_t stream);
+
+/**
+@brief: kernel_hard_gate_reorder_pre
+route the tokens of every sequence to the expert of its gate, the sequences
+of an expert take its slots in batch order, and copy them there.
+
+@thread
+gridDim.x = batch_size
+gridDim.y = seq_len
+blockDim.x = MAX_THREADS / 8
+
+@param
+input: [batch_size * seq_len, hidden_dim]
+gates: [batch_size]
+score, expert, slot: [batch_size * seq_len]
+expert_rows: [expert_num] of zeros
+output: [expert_num, capacity, hidden_dim]
+*/
+template <typename T>
+__global__ void kernel_hard_gate_reorder_pre(const T* input, const int* gates,
+                                             float* score, int* expert,
+                                             int* slot, int* expert_rows,
+                                             T* output, int seq_len,
+                                             int capacity, int hidden_dim) {
+  int batch_id = blockIdx.x, seq_id = blockIdx.y;
+  int gate = gates[batch_id];
+  // the sequences of the same gate before this one
+  int rank = 0;
+  for (int i = 0; i < batch_id; i++) rank += gates[i] == gate;
+  int token_id = batch_id * seq_len + seq_id;
+  int slot_id = rank * seq_len + seq_id;
+  slot_id = slot_id < capacity ? slot_id : -1;
+  if (threadIdx.x == 0) {
+    score[token_id] = 1.f;
+    expert[token_id] = gate;
+    slot[token_id] = slot_id;
+    bool last = true;
+    for (int i = batch_id + 1; i < int(gridDim.x) && last; i++) {
+      last = gates[i] != gate;
+    }
+    if (seq_id == 0 && last) {
+      expert_rows[gate] = min((rank + 1) * seq_len, capacity);
+    }
+  }
+  if (slot_id < 0) return;
+  copy_row(input + (size_t)token_id * hidden_dim,
+           output + ((size_t)gate * capacity + slot_id) * hidden_dim,
+           hidden_dim, threadIdx.x, blockDim.x);
+}
+
+template <typename T>
+void launch_hard_gate_reorder_pre(const T* input, const int* gates,
+                                  float* score, int* expert, int* slot,
+                                  int* expert_rows, T* output, int batch_size,
+                                  int seq_len, int expert_num, int capacity,
+                                  int hidden_dim, cudaStream_t stream) {
+  cudaMemsetAsync(expert_rows, 0, expert_num * sizeof(int), stream);
+  if (batch_size * seq_len == 0) return;
+  kernel_hard_gate_reorder_pre<T>
+      <<<dim3(batch_size, seq_len), MAX_THREADS / 8, 0, stream>>>(
+          input, gates, score, expert, slot, expert_rows, output, seq_len,
+          capacity, hidden_dim);
+}
+
+template void launch_hard_gate_reorder_pre<float>(
+    const float* input, const int* gates, float* score, int* expert,
+    int* slot, int* expert_rows, float* output, int batch_size, int seq_len,
+    int expert_num, int capacity, int hidden_dim, cudaStream_t stream);
+
+template void launch_hard_gate_reorder_pre<__half>(
+    const __half* input, const int* gates, float* score, int* expert,
+    int* slot, int* expert_rows, __half* output, int batch_size, int seq_len,
+    int expert_num, int capacity, int hidden_dim, cudaStream_t stream);
+
+template void launch_hard_gate_reorder_pre<__nv_bfloat16>(
+    const __nv_bfloat16* input, const int* gates, float* score, int* expert,
+    int* slot, int* expert_rows, __nv_bfloat16* output, int batch_size,
+    int seq_len, int expert_num, int capacity, int hidden_dim,
+    cudaStream_t stream);
+
+namespace {
+
+/*
+One [kGemmTileM, kGemmTileN] tile of output = act(input * weight + bias) with
+fp32 fma, every thread owns a 4 x 4 micro-tile. input is [rows, in_dim],
+weight is [in_dim, out_dim].
+*/
+template <typename T>
+__device__ void gemm_tile_simt(const T* input, const T* weight, const T* bias,
+                               T* output, int rows, int in_dim, int out_dim,
+                               int row_begin, int col_begin, int act) {
+  const int kTileK = 16;
+  __shared__ float s_a[kGemmTileM][kTileK + 1];
+  __shared__ float s_w[kTileK][kGemmTileN];
+  int tx = threadIdx.x % 16;
+  int ty = threadIdx.x / 16;
+  float acc[4][4] = {0.f};
+
+  for (int k_begin = 0; k_begin < in_dim; k_begin += kTileK) {
+    for (int idx = threadIdx.x; idx < kGemmTileM * kTileK;
+         idx += kGemmThreads) {
+      int r = idx / kTileK, k = idx % kTileK;
+      int row = row_begin + r, col = k_begin + k;
+      s_a[r][k] = row < rows && col < in_dim
+                      ? float(input[(size_t)row * in_dim + col])
+                      : 0.f;
+    }
+    for (int idx = threadIdx.x; idx < kTileK * kGemmTileN;
+         idx += kGemmThreads) {
+      int k = idx / kGemmTileN, c = idx % kGemmTileN;
+      int row = k_begin + k, col = col_begin + c;
+      s_w[k][c] = row < in_dim && col < out_dim
+                      ? float(weight[(size_t)row * out_dim + col])
+                      : 0.f;
+    }
+    __syncthreads();
+#pragma unroll
+    for (int k = 0; k < kTileK; k++) {
+      float a[4], w[4];
+#pragma unroll
+      for (int i = 0; i < 4; i++) {
+        a[i] = s_a[ty + 16 * i][k];
+        w[i] = s_w[k][tx + 16 * i];
+      }
+#pragma unroll
+      for (int i = 0; i < 4; i++) {
+#pragma unroll
+        for (int j = 0; j < 4; j++) acc[i][j] += a[i] * w[j];
+      }
+    }
+    __syncthreads();
+  }
+
+#pragma unroll
+  for (int i = 0; i < 4; i++) {
+    int row = row_begin + ty + 16 * i;
+    if (row >= rows) continue;
+#pragma unroll
+    for (int j = 0; j < 4; j++) {
+      int col = col_begin + tx + 16 * j;
+      if (col >= out_dim) continue;
+      float val = acc[i][j];
+      if (bias) val += float(bias[col]);
+      output[(size_t)row * out_dim + col] = T(moe_activate(val, act));
+    }
+  }
+}
+
+template <typename T>
+__device__ void gemm_tile(const T* input, const T* weight, const T* bias,
+                          T* output, int rows, int in_dim, int out_dim,
+                          int row_begin, int col_begin, int act) {
+  gemm_tile_simt(input, weight, bias, output, rows, in_dim, out_dim,
+                 row_begin, col_begin, act);
+}
+
+/*
+fp16 tiles run on tensor cores from sm70 on: every one of the 8 warps owns a
+[16, 32] piece of the tile, accumulated in fp32.
+*/
+template <>
+__device__ void gemm_tile<__half>(const __half* input, const __half* weight,
+                                  const __half* bias, __half* output,
+                                  int rows, int in_dim, int out_dim,
+                                  int row_begin, int col_begin, int act) {
+#if __CUDA_ARCH__ >= 700
+  using namespace nvcuda;
+  const int kTileK = 32;
+  // padded to keep the fragments off the same banks, multiples of 8 halfs.
+  __shared__ __align__(32) __half s_a[kGemmTileM][kTileK + 8];
+  __shared__ __align__(32) __half s_w[kTileK][kGemmTileN + 8];
+  __shared__ __align__(32) float s_c[kGemmTileM][kGemmTileN + 4];
+  int warp_id = threadIdx.x / WARP_SIZE;
+  int warp_row = (warp_id % 4) * 16;
+  int warp_col = (warp_id / 4) * 32;
+  wmma::fragment<wmma::accumulator, 16, 16, 16, float> acc[2];
+  wmma::fill_fragment(acc[0], 0.f);
+  wmma::fill_fragment(acc[1], 0.f);
+
+  for (int k_begin = 0; k_begin < in_dim; k_begin += kTileK) {
+    for (int idx = threadIdx.x; idx < kGemmTileM * kTileK;
+         idx += kGemmThreads) {
+      int r = idx / kTileK, k = idx % kTileK;
+      int row = row_begin + r, col = k_begin + k;
+      s_a[r][k] = row < rows && col < in_dim
+                      ? input[(size_t)row * in_dim + col]
+                      : __float2half(0.f);
+    }
+    for (int idx = threadIdx.x; idx < kTileK * kGemmTileN;
+         idx += kGemmThreads) {
+      int k = idx / kGemmTileN, c = idx % kGemmTileN;
+      int row = k_begin + k, col = col_begin + c;
+      s_w[k][c] = row < in_dim && col < out_dim
+                      ? weight[(size_t)row * out_dim + col]
+                      : __float2half(0.f);
+    }
+    __syncthreads();
+#pragma unroll
+    for (int k = 0; k < kTileK; k += 16) {
+      wmma::fragment<wmma::matrix_a, 16, 16, 16, __half, wmma::row_major> a;
+      wmma::load_matrix_sync(a, &s_a[warp_row][k], kTileK + 8);
+#pragma unroll
+      for (int j = 0; j < 2; j++) {
+        wmma::fragment<wmma::matrix_b, 16, 16, 16, __half, wmma::row_major> w;
+        wmma::load_matrix_sync(w, &s_w[k][warp_col + 16 * j],
+                               kGemmTileN + 8);
+        wmma::mma_sync(acc[j], a, w, acc[j]);
+      }
+    }
+    __syncthreads();
+  }
+
+#pragma unroll
+  for (int j = 0; j < 2; j++) {
+    wmma::store_matrix_sync(&s_c[warp_row][warp_col + 16 * j], acc[j],
+                            kGemmTileN + 4, wmma::mem_row_major);
+  }
+  __syncthreads();
+  for (int idx = threadIdx.x; idx < kGemmTileM * kGemmTileN;
+       idx += kGemmThreads) {
+    int r = idx / kGemmTileN, c = idx % kGemmTileN;
+    int row = row_begin + r, col = col_begin + c;
+    if (row >= rows || col >= out_dim) continue;
+    float val = s_c[r][c];
+    if (bias) val += __half2float(bias[col]);
+    output[(size_t)row * out_dim + col] = __float2half(moe_activate(val, act));
+  }
+#else
+  gemm_tile_simt(input, weight, bias, output, rows, in_dim, out_dim,
+                 row_begin, col_begin, act);
+#endif
+}
+
+}  // namespace
+
+/**
+@brief: kernel_moe_tile_offset
+exclusive prefix sum of the row tiles of the experts, so that gemm blocks are
+only launched for the rows in use.
+
+@thread
+gridDim.x = 1
+blockDim.x = MAX_THREADS
+
+@param
+expert_rows: [expert_num]
+tile_offset: [expert_num + 1], the total number of tiles at expert_num
+*/
+__global__ void kernel_moe_tile_offset(const int* expert_rows,
+                                       int* tile_offset, int expert_num) {
+  typedef cub::BlockScan<int, MAX_THREADS> BlockScan;
+  __shared__ typename BlockScan::TempStorage temp_storage;
+  int tile_base = 0;
+  for (int base = 0; base < expert_num; base += blockDim.x) {
+    int expert_id = base + threadIdx.x;
+    int tiles = expert_id < expert_num
+                    ? (expert_rows[expert_id] + kGemmTileM - 1) / kGemmTileM
+                    : 0;
+    int offset, tile_num;
+    BlockScan(temp_storage).ExclusiveSum(tiles, offset, tile_num);
+    __syncthreads();
+    if (expert_id < expert_num) tile_offset[expert_id] = tile_base + offset;
+    tile_base += tile_num;
+  }
+  if (threadIdx.x == 0) tile_offset[expert_num] = tile_base;
+}
+
+/**
+@brief: kernel_moe_grouped_gemm
+one gemm per expert on its used slots, fused with bias and activation. the
+blocks of gridDim.x are spread over the row tiles of all experts, blocks
+beyond the tiles in use exit at once.
+
+@thread
+gridDim.x = upper bound of the row tiles in use
+gridDim.y = ceil(out_dim / kGemmTileN)
+blockDim.x = kGemmThreads
+
+@param
+input: [expert_num, capacity, in_dim]
+weight: [expert_num, in_dim, out_dim]
+bias: [expert_num, out_dim] or nullptr
+output: [expert_num, capacity, out_dim]
+*/
+template <typename T>
+__global__ void kernel_moe_grouped_gemm(const T* input, const T* weight,
+                                        const T* bias, T* output,
+                                        const int* expert_rows,
+                                        const int* tile_offset,
+                                        int expert_num, int capacity,
+                                        int in_dim, int out_dim, int act) {
+  int tile_id = blockIdx.x;
+  if (tile_id >= tile_offset[expert_num]) return;
+  // the last expert whose tiles start at or before tile_id, the experts
+  // without tokens have no tiles.
+  int lo = 0, hi = expert_num - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (tile_offset[mid] <= tile_id) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  int expert_id = lo;
+  size_t row_offset = (size_t)expert_id * capacity;
+  gemm_tile(input + row_offset * in_dim,
+            weight + (size_t)expert_id * in_dim * out_dim,
+            bias ? bias + (size_t)expert_id * out_dim : nullptr,
+            output + row_offset * out_dim, expert_rows[expert_id], in_dim,
+            out_dim, (tile_id - tile_offset[expert_id]) * kGemmTileM,
+            blockIdx.y * kGemmTileN, act);
+}
+
+template <typename T>
+void launch_moe_grouped_gemm(const T* input, const T* weight, const T* bias,
+                             T* output, const int* expert_rows,
+                             int* tile_offset, int expert_num, int capacity,
+                             int max_rows, int in_dim, int out_dim, int act,
+                             cudaStream_t stream) {
+  kernel_moe_tile_offset<<<1, MAX_THREADS, 0, stream>>>(
+      expert_rows, tile_offset, expert_num);
+  int tile_bound =
+      min(expert_num * ((capacity + kGemmTileM - 1) / kGemmTileM),
+          (max_rows + kGemmTileM - 1) / kGemmTileM + expert_num);
+  if (tile_bound <= 0) return;
+  dim3 grid_dim(tile_bound, (out_dim + kGemmTileN - 1) / kGemmTileN);
+  kernel_moe_grouped_gemm<T><<<grid_dim, kGemmThreads, 0, stream>>>(
+      input, weight, bias, output, expert_rows, tile_offset, expert_num,
+      capacity, in_dim, out_dim, act);
+}
+
+template void launch_moe_grouped_gemm<float>(
+    const float* input, const float* weight, const float* bias, float* output,
+    const int* expert_rows, int* tile_offset, int expert_num, int capacity,
+    int max_rows, int in_dim, int out_dim, int act, cudaStream_t stream);
+
+template void launch_moe_grouped_gemm<__half>(
+    const __half* input, const __half* weight, const __half* bias,
+    __half* output, const int* expert_rows, int* tile_offset, int expert_num,
+    int capacity, int max_rows, int in_dim, int out_dim, int act,
+    cudaStream_t stream);
+
+template void launch_moe_grouped_gemm<__nv_bfloat16>(
+    const __nv_bfloat16* input, const __nv_bfloat16* weight,
+    const __nv_bfloat16* bias, __nv_bfloat16* output, const int* expert_rows,
+    int* tile_offset, int expert_num, int capacity, int max_rows, int in_dim,
+    int out_dim, int act, cudaStream_t stream);
+
+/**
+@brief: kernel_moe_grouped_swiglu
+silu(gate) * up of the used slots of every expert.
+
+@thread
+gridDim.x = capacity
+gridDim.y = expert_num
+blockDim.x = min(inner_dim, MAX_THREADS / 4)
+
+@param
+input: [expert_num, capacity, 2 * inner_dim]
+output: [expert_num, capacity, inner_dim]
+*/
+template <typename T>
+__global__ void kernel_moe_grouped_swiglu(const T* input, T* output,
+                                          const int* expert_rows,
+                                          int capacity, int inner_dim) {
+  int slot_id = blockIdx.x, expert_id = blockIdx.y;
+  if (slot_id >= expert_rows[expert_id]) return;
+  size_t row = (size_t)expert_id * capacity + slot_id;
+  const T* gate = input + row * 2 * inner_dim;
+  const T* up = gate + inner_dim;
+  for (int i = threadIdx.x; i < inner_dim; i += blockDim.x) {
+    float gate_val = float(gate[i]);
+    float silu = gate_val / (1.f + __expf(-gate_val));
+    output[row * inner_dim + i] = T(silu * float(up[i]));
+  }
+}
+
+template <typename T>
+void launch_moe_grouped_swiglu(const T* input, T* output,
+                               const int* expert_rows, int expert_num,
+                               int capacity, int inner_dim,
+                               cudaStream_t stream) {
+  if (capacity == 0) return;
+  int block_dim = min(inner_dim, MAX_THREADS / 4);
+  kernel_moe_grouped_swiglu<T>
+      <<<dim3(capacity, expert_num), block_dim, 0, stream>>>(
+          input, output, expert_rows, capacity, inner_dim);
+}
+
+template void launch_moe_grouped_swiglu<float>(const float* input,
+                                               float* output,
+                                               const int* expert_rows,
+                                               int expert_num, int capacity,
+                                               int inner_dim,
+                                               cudaStream_t stream);
+
+template void launch_moe_grouped_swiglu<__half>(const __half* input,
+                                                __half* output,
+                                                const int* expert_rows,
+                                                int expert_num, int capacity,
+                                                int inner_dim,
+                                                cudaStream_t stream);
+
+template void launch_moe_grouped_swiglu<__nv_bfloat16>(
+    const __nv_bfloat16* input, __nv_bfloat16* output, const int* expert_rows,
+    int expert_num, int capacity, int inner_dim, cudaStream_t stream);
+
+/**
+@brief: kernel_moe_combine
+gather the tokens back from the slots of their experts and add them to the
+residual by score, dropped routes add nothing. The routing of the token is
+read once into the registers of every thread.
+
+@thread
+gridDim.x = batch_tokens
+blockDim.x = min(hidden_dim, MAX_THREADS / 4)
+
+@param
+input: [expert_num, capacity, hidden_dim]
+bias: [expert_num, hidden_dim] or nullptr
+score, expert, slot: [topk, max_batch_tokens]
+output: [batch_tokens, hidden_dim]
+*/
+template <typename T>
+__global__ void kernel_moe_combine(const T* input, const T* bias,
+                                   const float* score, const int* expert,
+                                   const int* slot, T* output,
+                                   int max_batch_tokens, int capacity,
+                                   int topk, int hidden_dim) {
+  int token_id = blockIdx.x;
+  int routed_num = 0;
+  int row[kRouteMaxTopk], expert_id[kRouteMaxTopk];
+  float weight[kRouteMaxTopk];
+  for (int k = 0; k < topk; ++k) {
+    int pos = k * max_batch_tokens + token_id;
+    int slot_id = slot[pos];
+    if (slot_id < 0) continue;
+    expert_id[routed_num] = expert[pos];
+    row[routed_num] = expert_id[routed_num] * capacity + slot_id;
+    weight[routed_num++] = score[pos];
+  }
+  for (int i = threadIdx.x; i < hidden_dim; i += blockDim.x) {
+    float val = 0.f;
+    for (int k = 0; k < routed_num; ++k) {
+      float expert_val = float(input[(size_t)row[k] * hidden_dim + i]);
+      if (bias) expert_val += float(bias[expert_id[k] * hidden_dim + i]);
+      val += expert_val * weight[k];
+    }
+    size_t idx = (size_t)token_id * hidden_dim + i;
+    output[idx] = T(float(output[idx]) + val);
+  }
+}
+
+template <typename T>
+void launch_moe_combine(const T* input, const T* bias, const float* score,
+                        const int* expert, const int* slot, T* output,
+                        int batch_tokens, int max_batch_tokens, int capacity,
+                        int topk, int hidden_dim, cudaStream_t stream) {
+  if (batch_tokens == 0) return;
+  int block_dim = min(hidden_dim, MAX_THREADS / 4);
+  kernel_moe_combine<T><<<batch_tokens, block_dim, 0, stream>>>(
+      input, bias, score, expert, slot, output, max_batch_tokens, capacity,
+      topk, hidden_dim);
+}
+
+template void launch_moe_combine<float>(const float* input, const float* bias,
+                                        const float* score, const int* expert,
+                                        const int* slot, float* output,
+                                        int batch_tokens, int max_batch_tokens,
+                                        int capacity, int topk, int hidden_dim,
+                                        cudaStream_t stream);
+
+template void launch_moe_combine<__half>(
+    const __half* input, const __half* bias, const float* score,
+    const int* expert, const int* slot, __half* output, int batch_tokens,
+    int max_batch_tokens, int capacity, int topk, int hidden_dim,
+    cudaStream_t stream);
+
+template void launch_moe_combine<__nv_bfloat16>(
+    const __nv_bfloat16* input, const __nv_bfloat16* bias, const float* score,
+    const int* expert, const int* slot, __nv_bfloat16* output,
+    int batch_tokens, int max_batch_tokens, int capacity, int topk,
+    int hidden_dim, cudaStream_t stream);
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -192,20 +192,23 @@ gridDim.x = batch_size * seq_len
 blockDim.x = hidden_size
 
 @param
-q_out: [batch_size* seq_len, hidden_size], quantized ln result.
-q_weight: [hidden_size, inner_size], quantized ffn weight.
+q_out: [batch_size* seq_len, hidden_size], quantized ln result, row major
+  or col32.
 vars: [batch_size* seq_len], variance per token
 means: [batch_size* seq_len], means per token, can be nullput
 inp: [batch_size * seq_len, hidden_size], ln input.
 scale: [hidden_size], ln scale
 bias: [hidden_size], ln bias
+ln_res: [batch_size* seq_len, hidden_size], ln result, can be nullptr
+alpha: [batch_size* seq_len], igemm alpha, can be nullptr
 */
 
 template <typename T>
 __global__ void ker_layer_norm_i8(int8_t *q_out, uint8_t *clip_mask_out,
                                   T *vars, T *means, const T *inp,
                                   const T *scale, const T *bias,
-                                  const T *clip_max_out, int hidden_size) {
+                                  const T *clip_max_out, int hidden_size,
+                                  T *ln_res, float *alpha, bool out_col32) {
   // step 0. compute local sum
   float l_sum = 0;
   float l_square_sum = 0;
@@ -239,11 +242,14 @@ __global__ void ker_layer_norm_i8(int8_t *q_out, uint8_t *clip_mask_out,
 
   // step 2. layer norm result
 
-  int32_t *q_out4 =
-      reinterpret_cast<int32_t *>(q_out) + blockIdx.x * hidden_size;
+  int32_t *q_out4 = reinterpret_cast<int32_t *>(q_out);
   uint32_t *clip_mask_out4 =
       reinterpret_cast<uint32_t *>(clip_mask_out) + blockIdx.x * hidden_size;
   float clip_max_val = clip_max_out[0];
+  if (alpha != nullptr && threadIdx.x == 0) {
+    alpha[blockIdx.x] = clip_max_val * clip_max_out[1] /
+                        (clip_max_out[2] * kQuantRangeI8);
+  }
 
   for (uint idx = threadIdx.x; idx < hidden_size; idx += blockDim.x) {
     float4 vscale = __ldg((const float4 *)scale + idx);
@@ -260,7 +266,16 @@ __global__ void ker_layer_norm_i8(int8_t *q_out, uint8_t *clip_mask_out,
     q_val[2] = quantize(val.z, clip_max_val, clip_mask[2], 2);
     q_val[3] = quantize(val.w, clip_max_val, clip_mask[3], 2);
 
-    q_out4[idx] = reinterpret_cast<int32_t *>(q_val)[0];
+    if (ln_res != nullptr) {
+      reinterpret_cast<float4 *>(ln_res)[blockIdx.x * hidden_size + idx] = val;
+    }
+    int out_idx = blockIdx.x * hidden_size + idx;
+    if (out_col32) {
+      out_idx = row_major2flat_col32(blockIdx.x, idx * 4, gridDim.x,
+                                     hidden_size * 4) /
+                4;
+    }
+    q_out4[out_idx] = reinterpret_cast<int32_t *>(q_val)[0];
     clip_mask_out4[idx] |= reinterpret_cast<uint32_t *>(clip_mask)[0];
   }
 }
@@ -269,7 +284,8 @@ template <>
 __global__ void ker_layer_norm_i8<__half>(
     int8_t *q_out, uint8_t *clip_mask_out, __half *vars, __half *means,
     const __half *inp, const __half *scale, const __half *bias,
-    const __half *clip_max_out, int hidden_size) {
+    const __half *clip_max_out, int hidden_size, __half *ln_res, float *alpha,
+    bool out_col32) {
   // step 0. compute local sum
   float l_sum = 0;
   float l_square_sum = 0;
@@ -304,11 +320,14 @@ __global__ void ker_layer_norm_i8<__half>(
 
   // step 2. layer norm result
 
-  int64_t *q_out8 =
-      reinterpret_cast<int64_t *>(q_out) + blockIdx.x * hidden_size;
+  int64_t *q_out8 = reinterpret_cast<int64_t *>(q_out);
   uint64_t *clip_mask_out8 =
       reinterpret_cast<uint64_t *>(clip_mask_out) + blockIdx.x * hidden_size;
-  float clip_max_val = clip_max_out[0];
+  float clip_max_val = __half2float(clip_max_out[0]);
+  if (alpha != nullptr && threadIdx.x == 0) {
+    alpha[blockIdx.x] = clip_max_val * __half2float(clip_max_out[1]) /
+                        (__half2float(clip_max_out[2]) * kQuantRangeI8);
+  }
 
   for (uint idx = threadIdx.x; idx < hidden_size; idx += blockDim.x) {
     // load scale, bias, input
@@ -328,14 +347,25 @@ __global__ void ker_layer_norm_i8<__half>(
       float2 val_f2 = __half22float2(val_h2[i]);
       val_f2.x = (val_f2.x - s_mean) * s_var * scale_f2.x + bias_f2.x;
       val_f2.y = (val_f2.y - s_mean) * s_var * scale_f2.y + bias_f2.y;
+      val_h2[i] = __float22half2_rn(val_f2);
 
-      q_val[i * 2] = quantize(__half2float(__float2half(val_f2.x)),
-                              clip_max_val, clip_mask[i * 2], 2);
-      q_val[i * 2 + 1] = quantize(__half2float(__float2half(val_f2.y)),
-                                  clip_max_val, clip_mask[i * 2 + 1], 2);
+      q_val[i * 2] = quantize(__low2float(val_h2[i]), clip_max_val,
+                              clip_mask[i * 2], 2);
+      q_val[i * 2 + 1] = quantize(__high2float(val_h2[i]), clip_max_val,
+                                  clip_mask[i * 2 + 1], 2);
     }
 
-    q_out8[idx] = reinterpret_cast<int64_t *>(q_val)[0];
+    if (ln_res != nullptr) {
+      reinterpret_cast<float4 *>(ln_res)[blockIdx.x * hidden_size + idx] =
+          val_f4;
+    }
+    int out_idx = blockIdx.x * hidden_size + idx;
+    if (out_col32) {
+      out_idx = row_major2flat_col32(blockIdx.x, idx * 8, gridDim.x,
+                                     hidden_size * 8) /
+                8;
+    }
+    q_out8[out_idx] = reinterpret_cast<int64_t *>(q_val)[0];
     clip_mask_out8[idx] |= reinterpret_cast<uint64_t *>(clip_mask)[0];
   }
 }
@@ -345,7 +375,8 @@ void launch_layer_norm_i8<float>(int8_t *q_out, uint8_t *clip_mask_out,
                                  float *vars, float *means, const float *inp,
                                  const float *gamma, const float *betta,
                                  const float *clip_max_out, int batch_size,
-                                 int hidden_dim, cudaStream_t stream) {
+                                 int hidden_dim, cudaStream_t stream,
+                                 float *ln_res, float *alpha, bool out_col32) {
   if (hidden_dim % 4 != 0) {
     throw std::runtime_error("violate hidden_dim % 4 = 0");
   }
@@ -356,7 +387,7 @@ void launch_layer_norm_i8<float>(int8_t *q_out, uint8_t *clip_mask_out,
 
   ker_layer_norm_i8<float><<<grid_dim, block_dim, 0, stream>>>(
       q_out, clip_mask_out, vars, means, inp, gamma, betta, clip_max_out,
-      hidden_dim);
+      hidden_dim, ln_res, alpha, out_col32);
 }
 
 template <>
@@ -365,7 +396,9 @@ void launch_layer_norm_i8<__half>(int8_t *q_out, uint8_t *clip_mask_out,
                                   const __half *inp, const __half *gamma,
                                   const __half *betta,
                                   const __half *clip_max_out, int batch_size,
-                                  int hidden_dim, cudaStream_t stream) {
+                                  int hidden_dim, cudaStream_t stream,
+                                  __half *ln_res, float *alpha,
+                                  bool out_col32) {
   if (hidden_dim % 8 != 0) {
     throw std::runtime_error("violate hidden_dim % 8 = 0");
   }
@@ -376,7 +409,7 @@ void launch_layer_norm_i8<__half>(int8_t *q_out, uint8_t *clip_mask_out,
 
   ker_layer_norm_i8<__half><<<grid_dim, block_dim, 0, stream>>>(
       q_out, clip_mask_out, vars, means, inp, gamma, betta, clip_max_out,
-      hidden_dim);
+      hidden_dim, ln_res, alpha, out_col32);
 }
 
 /**
@@ -804,6 +837,618 @@ void launch_ln_bw<__half>(__half *gamma_grad, __half *betta_grad,
       nullptr, hidden_dim);
 }
 
+/**
+@brief: ker_norm_bw_fused
+Fused backward of layer norm and rms norm, one pass over the rows computes
+the gradient of input and the partial gradients of gamma and betta of the
+rows of the block, ker_norm_bw_reduce sums the partials. Every thread owns
+the same VEC columns of all the rows of the block, so the activations are
+read once and the partials need no atomics.
+ln: xhat = (input - mean) * rsqrt(var + eps) or (output - betta) / gamma
+  dinp = (dxhat - (sum(dxhat) + xhat * sum(dxhat * xhat)) / hidden_dim)
+    * rsqrt(var + eps)
+rms: xhat = input * rms_vars or output / gamma
+  dinp = (dxhat - xhat * sum(dxhat * xhat) / hidden_dim) * rms_vars
+dxhat = dout * gamma
+
+@thread
+gridDim.x = part_blocks
+blockDim.x = vec_dim rounded up to 32
+
+@param
+inp_grad: [rows, hidden_dim]
+part_grad: [part_blocks, 2, hidden_dim], the partial dgamma and dbetta
+out_grad: [rows, hidden_dim]
+residual_grad: [rows, hidden_dim], added to inp_grad, maybe nullptr
+inp_or_out: [rows, hidden_dim], ln output if inp_is_out else ln input
+gamma: [hidden_dim]
+betta: [hidden_dim], ln with inp_is_out only
+vars: [rows], the variance of ln, rsqrt(mean(x^2) + eps) of rms
+means: [rows], ln with !inp_is_out only
+vec_dim: hidden_dim / VEC
+*/
+template <typename T, bool kRMS>
+__global__ void ker_norm_bw_fused(T *inp_grad, float *part_grad,
+                                  const T *out_grad, const T *residual_grad,
+                                  const T *inp_or_out, const T *gamma,
+                                  const T *betta, const T *vars,
+                                  const T *means, bool inp_is_out, int rows,
+                                  int rows_per_block, int vec_dim) {
+  constexpr int VEC = sizeof(float4) / sizeof(T);
+  __shared__ float s_sum_dxhat, s_sum_dxhat_xhat;
+  int col = threadIdx.x;
+  bool active = col < vec_dim;
+
+  float vgamma[VEC], vbetta[VEC], dgamma[VEC], dbetta[VEC];
+  if (active) {
+    float4 gamma4 = ((const float4 *)gamma)[col];
+    float4 betta4 = make_float4(0.f, 0.f, 0.f, 0.f);
+    if (!kRMS && inp_is_out) betta4 = ((const float4 *)betta)[col];
+    const T *hgamma = reinterpret_cast<const T *>(&gamma4);
+    const T *hbetta = reinterpret_cast<const T *>(&betta4);
+#pragma unroll
+    for (int i = 0; i < VEC; i++) {
+      vgamma[i] = static_cast<float>(hgamma[i]);
+      vbetta[i] = kRMS ? 0.f : static_cast<float>(hbetta[i]);
+      dgamma[i] = 0.f;
+      dbetta[i] = 0.f;
+    }
+  }
+
+  int row_start = blockIdx.x * rows_per_block;
+  int row_end = min(row_start + rows_per_block, rows);
+  for (int r = row_start; r < row_end; r++) {
+    size_t offset = size_t(r) * vec_dim + col;
+    float var_rsqrt = kRMS ? static_cast<float>(vars[r])
+                           : rsqrtf(static_cast<float>(vars[r]) + LN_EPSILON);
+    float dxhat[VEC], xhat[VEC];
+    float reduce_val[2] = {0.f, 0.f};
+    if (active) {
+      float4 dout4 = ((const float4 *)out_grad)[offset];
+      float4 x4 = ((const float4 *)inp_or_out)[offset];
+      const T *hdout = reinterpret_cast<const T *>(&dout4);
+      const T *hx = reinterpret_cast<const T *>(&x4);
+      float fmean = kRMS || inp_is_out ? 0.f : static_cast<float>(means[r]);
+#pragma unroll
+      for (int i = 0; i < VEC; i++) {
+        float dout = static_cast<float>(hdout[i]);
+        float x = static_cast<float>(hx[i]);
+        xhat[i] = inp_is_out ? (x - vbetta[i]) / add_eps(vgamma[i])
+                             : (x - fmean) * var_rsqrt;
+        dgamma[i] += dout * xhat[i];
+        dbetta[i] += dout;
+        dxhat[i] = dout * vgamma[i];
+        reduce_val[0] += dxhat[i];
+        reduce_val[1] += dxhat[i] * xhat[i];
+      }
+    }
+
+    blockReduce<ReduceType::kSum, 2>(reduce_val);
+    if (threadIdx.x == 0) {
+      float mean_dim = vec_dim * VEC;
+      s_sum_dxhat = kRMS ? 0.f : reduce_val[0] / mean_dim;
+      s_sum_dxhat_xhat = reduce_val[1] / mean_dim;
+    }
+    __syncthreads();
+
+    if (active) {
+      float4 dres4 = make_float4(0.f, 0.f, 0.f, 0.f);
+      if (residual_grad) dres4 = ((const float4 *)residual_grad)[offset];
+      const T *hdres = reinterpret_cast<const T *>(&dres4);
+      float4 dinp4;
+      T *hdinp = reinterpret_cast<T *>(&dinp4);
+#pragma unroll
+      for (int i = 0; i < VEC; i++) {
+        float dinp =
+            (dxhat[i] - s_sum_dxhat - xhat[i] * s_sum_dxhat_xhat) * var_rsqrt;
+        hdinp[i] = static_cast<T>(dinp + static_cast<float>(hdres[i]));
+      }
+      ((float4 *)inp_grad)[offset] = dinp4;
+    }
+    // the sums of the next row overwrite the shared ones
+    __syncthreads();
+  }
+
+  if (!active) return;
+  int hidden_dim = vec_dim * VEC;
+  float *part_gamma = part_grad + size_t(blockIdx.x) * 2 * hidden_dim;
+#pragma unroll
+  for (int i = 0; i < VEC; i++) {
+    part_gamma[col * VEC + i] = dgamma[i];
+    part_gamma[hidden_dim + col * VEC + i] = dbetta[i];
+  }
+}
+
+/**
+@brief: ker_norm_bw_reduce
+sum the partial dgamma and dbetta of ker_norm_bw_fused, and the partial
+dbias of ker_ln_dropout_bias_bw. Every column is summed in the same order, a
+strided sum per thread then a shuffle tree, so the result does not depend on
+the scheduling.
+
+@thread
+gridDim.x = (hidden_dim + TILE_DIM - 1) / TILE_DIM
+blockDim.x = TILE_DIM
+blockDim.y = TILE_DIM
+
+@param
+gamma_grad: [hidden_dim]
+betta_grad: [hidden_dim], maybe nullptr
+bias_grad: [hidden_dim], with num_grads = 3 only
+part_grad: [part_blocks, num_grads, hidden_dim]
+*/
+template <typename T>
+__global__ void ker_norm_bw_reduce(T *gamma_grad, T *betta_grad, T *bias_grad,
+                                   const float *part_grad, int part_blocks,
+                                   int num_grads, int hidden_dim) {
+  __shared__ float gamma_buffer[TILE_DIM][TILE_DIM + 1];
+  __shared__ float betta_buffer[TILE_DIM][TILE_DIM + 1];
+  __shared__ float bias_buffer[TILE_DIM][TILE_DIM + 1];
+
+  cg::thread_block b = cg::this_thread_block();
+  cg::thread_block_tile<TILE_DIM> g = cg::tiled_partition<TILE_DIM>(b);
+
+  int idx = blockIdx.x * TILE_DIM + threadIdx.x;
+  float dgamma = 0.f, dbetta = 0.f, dbias = 0.f;
+  if (idx < hidden_dim) {
+    for (int r = threadIdx.y; r < part_blocks; r += TILE_DIM) {
+      const float *part = part_grad + size_t(r) * num_grads * hidden_dim;
+      dgamma += part[idx];
+      dbetta += part[hidden_dim + idx];
+      if (num_grads == 3) dbias += part[2 * hidden_dim + idx];
+    }
+  }
+  gamma_buffer[threadIdx.x][threadIdx.y] = dgamma;
+  betta_buffer[threadIdx.x][threadIdx.y] = dbetta;
+  bias_buffer[threadIdx.x][threadIdx.y] = dbias;
+  __syncthreads();
+
+  float s1 = gamma_buffer[threadIdx.y][threadIdx.x];
+  float s2 = betta_buffer[threadIdx.y][threadIdx.x];
+  float s3 = bias_buffer[threadIdx.y][threadIdx.x];
+  for (int i = TILE_DIM / 2; i > 0; i >>= 1) {
+    s1 += g.shfl_down(s1, i);
+    s2 += g.shfl_down(s2, i);
+    s3 += g.shfl_down(s3, i);
+  }
+
+  int pos = blockIdx.x * TILE_DIM + threadIdx.y;
+  if (threadIdx.x == 0 && pos < hidden_dim) {
+    gamma_grad[pos] = static_cast<T>(s1);
+    if (betta_grad) betta_grad[pos] = static_cast<T>(s2);
+    if (num_grads == 3) bias_grad[pos] = static_cast<T>(s3);
+  }
+}
+
+template <typename T, bool kRMS>
+void launch_norm_bw_fused(T *gamma_grad, T *betta_grad, T *inp_grad,
+                          const T *out_grad, const T *residual_grad,
+                          const T *inp_or_out, const T *gamma, const T *betta,
+                          const T *vars, const T *means, bool inp_is_out,
+                          float *workspace, int batch, int hidden_dim,
+                          cudaStream_t stream) {
+  constexpr int VEC = sizeof(float4) / sizeof(T);
+  if (hidden_dim % VEC != 0 || hidden_dim > VEC * MAX_THREADS) {
+    throw std::runtime_error("hidden_dim % " + std::to_string(VEC) +
+                             " != 0 || hidden_dim > " +
+                             std::to_string(VEC * MAX_THREADS));
+  }
+  if (batch == 0) return;
+  int rows_per_block = (batch + kNormBwPartBlocks - 1) / kNormBwPartBlocks;
+  int part_blocks = (batch + rows_per_block - 1) / rows_per_block;
+  int vec_dim = hidden_dim / VEC;
+  int nthread = ((vec_dim + 31) / 32) * 32;
+  ker_norm_bw_fused<T, kRMS><<<part_blocks, nthread, 0, stream>>>(
+      inp_grad, workspace, out_grad, residual_grad, inp_or_out, gamma, betta,
+      vars, means, inp_is_out, batch, rows_per_block, vec_dim);
+
+  dim3 grid_dim((hidden_dim + TILE_DIM - 1) / TILE_DIM);
+  dim3 block_dim(TILE_DIM, TILE_DIM);
+  ker_norm_bw_reduce<T><<<grid_dim, block_dim, 0, stream>>>(
+      gamma_grad, betta_grad, nullptr, workspace, part_blocks, 2, hidden_dim);
+}
+
+template <typename T>
+void launch_ln_bw_fused(T *gamma_grad, T *betta_grad, T *inp_grad,
+                        const T *out_grad, const T *residual_grad,
+                        const T *inp_or_out, const T *gamma, const T *betta,
+                        const T *vars, const T *means, float *workspace,
+                        int batch, int hidden_dim, cudaStream_t stream) {
+  launch_norm_bw_fused<T, false>(gamma_grad, betta_grad, inp_grad, out_grad,
+                                 residual_grad, inp_or_out, gamma, betta, vars,
+                                 means, means == nullptr, workspace, batch,
+                                 hidden_dim, stream);
+}
+
+template void launch_ln_bw_fused<float>(
+    float *gamma_grad, float *betta_grad, float *inp_grad,
+    const float *out_grad, const float *residual_grad, const float *inp_or_out,
+    const float *gamma, const float *betta, const float *vars,
+    const float *means, float *workspace, int batch, int hidden_dim,
+    cudaStream_t stream);
+template void launch_ln_bw_fused<__half>(
+    __half *gamma_grad, __half *betta_grad, __half *inp_grad,
+    const __half *out_grad, const __half *residual_grad,
+    const __half *inp_or_out, const __half *gamma, const __half *betta,
+    const __half *vars, const __half *means, float *workspace, int batch,
+    int hidden_dim, cudaStream_t stream);
+
+// the dropout mask of the VEC elements of the vector vec_idx, drawn as by
+// ls_dropout_res_bias_kernel, whose thread i draws the vector i from the
+// Philox subsequence i. So the op matches BiasDropoutResOp for a given seed
+// and rng_offset, key is their ls_dropout_key.
+template <int VEC>
+__forceinline__ __device__ void ln_dropout_draw(unsigned long long key,
+                                                size_t vec_idx, float ratio,
+                                                uint8_t *m) {
+  if (ratio <= 0.f) {
+    // inference, no draw
+#pragma unroll
+    for (int i = 0; i < VEC; i++) m[i] = 1;
+    return;
+  }
+  curandStatePhilox4_32_10_t state;
+  curand_init(key, vec_idx, 0, &state);
+#pragma unroll
+  for (int i = 0; i < VEC; i += 4) {
+    float4 rand = curand_uniform4(&state);
+    m[i] = static_cast<uint8_t>(rand.x > ratio);
+    m[i + 1] = static_cast<uint8_t>(rand.y > ratio);
+    m[i + 2] = static_cast<uint8_t>(rand.z > ratio);
+    m[i + 3] = static_cast<uint8_t>(rand.w > ratio);
+  }
+}
+
+/**
+@brief: ker_dropout_res_bias_ln
+Fused bias, dropout, residual and layer norm at the end of Attention and FFN,
+res_out = dropout(inp + bias) + residual, ln_res = layer_norm(res_out). The
+residual sum stays in the block between the two passes over the row, so it
+is read back from the cache in place of a second kernel.
+
+@thread
+gridDim.x = batch_size * seq_len
+blockDim.x = vec_dim rounded up to 32
+
+@param
+ln_res: [rows, hidden_dim], ln result
+res_out: [rows, hidden_dim], the residual sum, ln input
+vars: [rows], variance per token, nullptr for inference
+means: [rows], means per token, nullptr for inference
+mask: [rows, hidden_dim], uint8 dropout mask, nullptr to store no mask
+inp: [rows, hidden_dim], the output of the linear
+bias: [hidden_dim]
+residual: [rows, hidden_dim]
+gamma: [hidden_dim], ln scale
+betta: [hidden_dim], ln bias
+vec_dim: hidden_dim / VEC
+*/
+template <typename T>
+__global__ void ker_dropout_res_bias_ln(
+    T *ln_res, T *res_out, T *vars, T *means, uint8_t *mask, const T *inp,
+    const T *bias, const T *residual, const T *gamma, const T *betta,
+    float ratio, int seed, const unsigned long long *rng_offset, int vec_dim) {
+  constexpr int VEC = sizeof(float4) / sizeof(T);
+  const float scale = 1.f / (1.f - ratio);
+  const unsigned long long key = ls_dropout_key(seed, rng_offset);
+  size_t row_offset = size_t(blockIdx.x) * vec_dim;
+
+  // step 0. residual sum and local sums
+  float l_sum = 0;
+  float l_square_sum = 0;
+  for (uint idx = threadIdx.x; idx < vec_dim; idx += blockDim.x) {
+    size_t offset = row_offset + idx;
+    uint8_t m[VEC];
+    ln_dropout_draw<VEC>(key, offset, ratio, m);
+    if (mask) {
+      if (VEC == 4) {
+        reinterpret_cast<uint32_t *>(mask)[offset] =
+            *reinterpret_cast<uint32_t *>(m);
+      } else {
+        reinterpret_cast<uint64_t *>(mask)[offset] =
+            *reinterpret_cast<uint64_t *>(m);
+      }
+    }
+    float4 inp4 = ((const float4 *)inp)[offset];
+    float4 bias4 = __ldg((const float4 *)bias + idx);
+    float4 res4 = ((const float4 *)residual)[offset];
+    const T *hinp = reinterpret_cast<const T *>(&inp4);
+    const T *hbias = reinterpret_cast<const T *>(&bias4);
+    const T *hres = reinterpret_cast<const T *>(&res4);
+    float4 out4;
+    T *hout = reinterpret_cast<T *>(&out4);
+#pragma unroll
+    for (int i = 0; i < VEC; i++) {
+      float val = (static_cast<float>(hinp[i]) + static_cast<float>(hbias[i])) *
+                      scale * m[i] +
+                  static_cast<float>(hres[i]);
+      hout[i] = static_cast<T>(val);
+      // the stored value, so the backward sees the statistics of its input
+      val = static_cast<float>(hout[i]);
+      l_sum += val;
+      l_square_sum += val * val;
+    }
+    ((float4 *)res_out)[offset] = out4;
+  }
+
+  // step 1. compute reduce sum
+  float mean_dim = float(vec_dim) * VEC;
+  float reduce_val[2] = {l_sum, l_square_sum};
+  blockReduce<ReduceType::kSum, 2>(reduce_val);
+  __shared__ float s_mean, s_var;
+  if (threadIdx.x == 0) {
+    s_mean = reduce_val[0] / mean_dim;
+    if (means != nullptr) means[blockIdx.x] = s_mean;
+    s_var = reduce_val[1] / mean_dim - s_mean * s_mean + LN_EPSILON;
+    if (vars != nullptr) vars[blockIdx.x] = s_var;
+    s_var = rsqrtf(s_var);
+  }
+  __syncthreads();
+
+  // step 2. layer norm result, every thread reads back its own res_out
+  for (uint idx = threadIdx.x; idx < vec_dim; idx += blockDim.x) {
+    size_t offset = row_offset + idx;
+    float4 gamma4 = __ldg((const float4 *)gamma + idx);
+    float4 betta4 = __ldg((const float4 *)betta + idx);
+    float4 val4 = ((const float4 *)res_out)[offset];
+    const T *hgamma = reinterpret_cast<const T *>(&gamma4);
+    const T *hbetta = reinterpret_cast<const T *>(&betta4);
+    T *hval = reinterpret_cast<T *>(&val4);
+#pragma unroll
+    for (int i = 0; i < VEC; i++) {
+      float val = (static_cast<float>(hval[i]) - s_mean) * s_var *
+                      static_cast<float>(hgamma[i]) +
+                  static_cast<float>(hbetta[i]);
+      hval[i] = static_cast<T>(val);
+    }
+    ((float4 *)ln_res)[offset] = val4;
+  }
+}
+
+template <typename T>
+void launch_ls_dropout_res_bias_ln(T *ln_res, T *res_out, T *vars, T *means,
+                                   uint8_t *mask, const T *inp, const T *bias,
+                                   const T *residual, const T *gamma,
+                                   const T *betta, int rows, int hidden_dim,
+                                   float ratio, cudaStream_t stream, int seed,
+                                   const unsigned long long *rng_offset) {
+  constexpr int VEC = sizeof(float4) / sizeof(T);
+  if (hidden_dim % VEC != 0) {
+    throw std::runtime_error("violate hidden_dim % " + std::to_string(VEC) +
+                             " = 0");
+  }
+  if (rows == 0) return;
+  int vec_dim = hidden_dim / VEC;
+  int nthread = min(((vec_dim + 31) / 32) * 32, MAX_THREADS);
+  ker_dropout_res_bias_ln<T><<<rows, nthread, 0, stream>>>(
+      ln_res, res_out, vars, means, mask, inp, bias, residual, gamma, betta,
+      ratio, seed < 0 ? ls_dropout_seed() : seed, rng_offset, vec_dim);
+}
+
+template void launch_ls_dropout_res_bias_ln<float>(
+    float *ln_res, float *res_out, float *vars, float *means, uint8_t *mask,
+    const float *inp, const float *bias, const float *residual,
+    const float *gamma, const float *betta, int rows, int hidden_dim,
+    float ratio, cudaStream_t stream, int seed,
+    const unsigned long long *rng_offset);
+template void launch_ls_dropout_res_bias_ln<__half>(
+    __half *ln_res, __half *res_out, __half *vars, __half *means,
+    uint8_t *mask, const __half *inp, const __half *bias,
+    const __half *residual, const __half *gamma, const __half *betta,
+    int rows, int hidden_dim, float ratio, cudaStream_t stream, int seed,
+    const unsigned long long *rng_offset);
+
+/**
+@brief: ker_ln_dropout_bias_bw
+Fused backward of ker_dropout_res_bias_ln in the way of ker_norm_bw_fused,
+one pass over the rows computes the gradients of the residual and of the
+input of the dropout, and the partial dgamma, dbetta and dbias of the rows of
+the block. ker_norm_bw_reduce sums the partials.
+dres = dln_inp + dres_out
+dinp = dres * mask / (1 - ratio)
+
+@thread
+gridDim.x = part_blocks
+blockDim.x = vec_dim rounded up to 32
+
+@param
+inp_grad: [rows, hidden_dim]
+residual_grad: [rows, hidden_dim], accumulated into unless residual_cover
+part_grad: [part_blocks, 3, hidden_dim], the partial dgamma, dbetta, dbias
+out_grad: [rows, hidden_dim], the grad of ln_res
+res_out_grad: [rows, hidden_dim], the grad of res_out, maybe nullptr
+res_out: [rows, hidden_dim]
+gamma: [hidden_dim]
+vars, means: [rows]
+mask: [rows, hidden_dim], nullptr to redraw it from seed
+vec_dim: hidden_dim / VEC
+*/
+template <typename T>
+__global__ void ker_ln_dropout_bias_bw(
+    T *inp_grad, T *residual_grad, float *part_grad, const T *out_grad,
+    const T *res_out_grad, const T *res_out, const T *gamma, const T *vars,
+    const T *means, const uint8_t *mask, bool residual_cover, float ratio,
+    int seed, const unsigned long long *rng_offset, int rows,
+    int rows_per_block, int vec_dim) {
+  constexpr int VEC = sizeof(float4) / sizeof(T);
+  const float scale = 1.f / (1.f - ratio);
+  const unsigned long long key = ls_dropout_key(seed, rng_offset);
+  __shared__ float s_sum_dxhat, s_sum_dxhat_xhat;
+  int col = threadIdx.x;
+  bool active = col < vec_dim;
+
+  float vgamma[VEC], dgamma[VEC], dbetta[VEC], dbias[VEC];
+  if (active) {
+    float4 gamma4 = ((const float4 *)gamma)[col];
+    const T *hgamma = reinterpret_cast<const T *>(&gamma4);
+#pragma unroll
+    for (int i = 0; i < VEC; i++) {
+      vgamma[i] = static_cast<float>(hgamma[i]);
+      dgamma[i] = 0.f;
+      dbetta[i] = 0.f;
+      dbias[i] = 0.f;
+    }
+  }
+
+  int row_start = blockIdx.x * rows_per_block;
+  int row_end = min(row_start + rows_per_block, rows);
+  for (int r = row_start; r < row_end; r++) {
+    size_t offset = size_t(r) * vec_dim + col;
+    float var_rsqrt = rsqrtf(static_cast<float>(vars[r]) + LN_EPSILON);
+    float dxhat[VEC], xhat[VEC];
+    float reduce_val[2] = {0.f, 0.f};
+    if (active) {
+      float4 dout4 = ((const float4 *)out_grad)[offset];
+      float4 x4 = ((const float4 *)res_out)[offset];
+      const T *hdout = reinterpret_cast<const T *>(&dout4);
+      const T *hx = reinterpret_cast<const T *>(&x4);
+      float fmean = static_cast<float>(means[r]);
+#pragma unroll
+      for (int i = 0; i < VEC; i++) {
+        float dout = static_cast<float>(hdout[i]);
+        xhat[i] = (static_cast<float>(hx[i]) - fmean) * var_rsqrt;
+        dgamma[i] += dout * xhat[i];
+        dbetta[i] += dout;
+        dxhat[i] = dout * vgamma[i];
+        reduce_val[0] += dxhat[i];
+        reduce_val[1] += dxhat[i] * xhat[i];
+      }
+    }
+
+    blockReduce<ReduceType::kSum, 2>(reduce_val);
+    if (threadIdx.x == 0) {
+      float mean_dim = vec_dim * VEC;
+      s_sum_dxhat = reduce_val[0] / mean_dim;
+      s_sum_dxhat_xhat = reduce_val[1] / mean_dim;
+    }
+    __syncthreads();
+
+    if (active) {
+      uint8_t m[VEC];
+      if (mask) {
+        if (VEC == 4) {
+          *reinterpret_cast<uint32_t *>(m) =
+              reinterpret_cast<const uint32_t *>(mask)[offset];
+        } else {
+          *reinterpret_cast<uint64_t *>(m) =
+              reinterpret_cast<const uint64_t *>(mask)[offset];
+        }
+      } else {
+        ln_dropout_draw<VEC>(key, offset, ratio, m);
+      }
+      float4 dres_out4 = make_float4(0.f, 0.f, 0.f, 0.f);
+      if (res_out_grad) dres_out4 = ((const float4 *)res_out_grad)[offset];
+      float4 dres_acc4 = make_float4(0.f, 0.f, 0.f, 0.f);
+      if (!residual_cover) dres_acc4 = ((const float4 *)residual_grad)[offset];
+      const T *hdres_out = reinterpret_cast<const T *>(&dres_out4);
+      const T *hdres_acc = reinterpret_cast<const T *>(&dres_acc4);
+      float4 dres4, dinp4;
+      T *hdres = reinterpret_cast<T *>(&dres4);
+      T *hdinp = reinterpret_cast<T *>(&dinp4);
+#pragma unroll
+      for (int i = 0; i < VEC; i++) {
+        float dres =
+            (dxhat[i] - s_sum_dxhat - xhat[i] * s_sum_dxhat_xhat) * var_rsqrt +
+            static_cast<float>(hdres_out[i]);
+        float dinp = dres * scale * m[i];
+        dbias[i] += dinp;
+        hdres[i] = static_cast<T>(dres + static_cast<float>(hdres_acc[i]));
+        hdinp[i] = static_cast<T>(dinp);
+      }
+      ((float4 *)residual_grad)[offset] = dres4;
+      ((float4 *)inp_grad)[offset] = dinp4;
+    }
+    // the sums of the next row overwrite the shared ones
+    __syncthreads();
+  }
+
+  if (!active) return;
+  int hidden_dim = vec_dim * VEC;
+  float *part = part_grad + size_t(blockIdx.x) * 3 * hidden_dim;
+#pragma unroll
+  for (int i = 0; i < VEC; i++) {
+    part[col * VEC + i] = dgamma[i];
+    part[hidden_dim + col * VEC + i] = dbetta[i];
+    part[2 * hidden_dim + col * VEC + i] = dbias[i];
+  }
+}
+
+template <typename T>
+void launch_ls_dropout_res_bias_ln_bw(
+    T *inp_grad, T *bias_grad, T *residual_grad, T *gamma_grad, T *betta_grad,
+    const T *out_grad, const T *res_out_grad, const T *res_out,
+    const T *gamma, const T *vars, const T *means, const uint8_t *mask,
+    bool residual_cover, float *workspace, int rows, int hidden_dim,
+    float ratio, cudaStream_t stream, int seed,
+    const unsigned long long *rng_offset) {
+  constexpr int VEC = sizeof(float4) / sizeof(T);
+  if (hidden_dim % VEC != 0 || hidden_dim > VEC * MAX_THREADS) {
+    throw std::runtime_error("hidden_dim % " + std::to_string(VEC) +
+                             " != 0 || hidden_dim > " +
+                             std::to_string(VEC * MAX_THREADS));
+  }
+  if (rows == 0) return;
+  int rows_per_block = (rows + kNormBwPartBlocks - 1) / kNormBwPartBlocks;
+  int part_blocks = (rows + rows_per_block - 1) / rows_per_block;
+  int vec_dim = hidden_dim / VEC;
+  int nthread = ((vec_dim + 31) / 32) * 32;
+  ker_ln_dropout_bias_bw<T><<<part_blocks, nthread, 0, stream>>>(
+      inp_grad, residual_grad, workspace, out_grad, res_out_grad, res_out,
+      gamma, vars, means, mask, residual_cover, ratio, seed, rng_offset, rows,
+      rows_per_block, vec_dim);
+
+  dim3 grid_dim((hidden_dim + TILE_DIM - 1) / TILE_DIM);
+  dim3 block_dim(TILE_DIM, TILE_DIM);
+  ker_norm_bw_reduce<T><<<grid_dim, block_dim, 0, stream>>>(
+      gamma_grad, betta_grad, bias_grad, workspace, part_blocks, 3,
+      hidden_dim);
+}
+
+template void launch_ls_dropout_res_bias_ln_bw<float>(
+    float *inp_grad, float *bias_grad, float *residual_grad, float *gamma_grad,
+    float *betta_grad, const float *out_grad, const float *res_out_grad,
+    const float *res_out, const float *gamma, const float *vars,
+    const float *means, const uint8_t *mask, bool residual_cover,
+    float *workspace, int rows, int hidden_dim, float ratio,
+    cudaStream_t stream, int seed, const unsigned long long *rng_offset);
+template void launch_ls_dropout_res_bias_ln_bw<__half>(
+    __half *inp_grad, __half *bias_grad, __half *residual_grad,
+    __half *gamma_grad, __half *betta_grad, const __half *out_grad,
+    const __half *res_out_grad, const __half *res_out, const __half *gamma,
+    const __half *vars, const __half *means, const uint8_t *mask,
+    bool residual_cover, float *workspace, int rows, int hidden_dim,
+    float ratio, cudaStream_t stream, int seed,
+    const unsigned long long *rng_offset);
+
+template <typename T>
+void launch_rms_ln_bw(T *gamma_grad, T *inp_grad, const T *out_grad,
+                      const T *residual_grad, const T *inp_or_out,
+                      const T *gamma, const T *rms_vars, bool inp_is_out,
+                      float *workspace, int batch, int hidden_dim,
+                      cudaStream_t stream) {
+  launch_norm_bw_fused<T, true>(gamma_grad, nullptr, inp_grad, out_grad,
+                                residual_grad, inp_or_out, gamma, nullptr,
+                                rms_vars, nullptr, inp_is_out, workspace,
+                                batch, hidden_dim, stream);
+}
+
+template void launch_rms_ln_bw<float>(
+    float *gamma_grad, float *inp_grad, const float *out_grad,
+    const float *residual_grad, const float *inp_or_out, const float *gamma,
+    const float *rms_vars, bool inp_is_out, float *workspace, int batch,
+    int hidden_dim, cudaStream_t stream);
+template void launch_rms_ln_bw<__half>(
+    __half *gamma_grad, __half *inp_grad, const __half *out_grad,
+    const __half *residual_grad, const __half *inp_or_out,
+    const __half *gamma, const __half *rms_vars, bool inp_is_out,
+    float *workspace, int batch, int hidden_dim, cudaStream_t stream);
+template void launch_rms_ln_bw<__nv_bfloat16>(
+    __nv_bfloat16 *gamma_grad, __nv_bfloat16 *inp_grad,
+    const __nv_bfloat16 *out_grad, const __nv_bfloat16 *residual_grad,
+    const __nv_bfloat16 *inp_or_out, const __nv_bfloat16 *gamma,
+    const __nv_bfloat16 *rms_vars, bool inp_is_out, float *workspace,
+    int batch, int hidden_dim, cudaStream_t stream);
+
 template <>
 void launch_quant_ln_bw<float>(
 
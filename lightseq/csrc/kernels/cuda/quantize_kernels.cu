@@ -1,7 +1,11 @@
+#include "block_reduce.h"
 #include "kernels.h"
 
 #include <cooperative_groups.h>
 #include <cooperative_groups/reduce.h>
+#if defined(CUDA_VERSION) && CUDA_VERSION >= 11080
+#include <cuda_fp8.h>
+#endif
 
 namespace cg = cooperative_groups;
 namespace lightseq {
@@ -858,5 +862,604 @@ void launch_dequantize<__half>(__half *f_ptr, const int8_t *q_ptr,
       f_ptr, q_ptr, clip_max_ptr, batch_tokens, hidden_size, mask_start_bit,
       in_col32);
 }
+
+/**
+@brief: quantize_fp8_kernel
+per-tensor scaled quantization into fp8 e4m3
+
+@thread
+gridDim.x = min(ceil(numel / MAX_THREADS), 65535)
+blockDim.x = MAX_THREADS
+
+@param
+q_ptr: [numel], fp8 e4m3 bytes
+f_ptr: [numel]
+scale_ptr: [1]
+*/
+template <typename T>
+__global__ void quantize_fp8_kernel(uint8_t *q_ptr, const T *f_ptr,
+                                    const float *scale_ptr, size_t numel) {
+#if defined(CUDA_VERSION) && CUDA_VERSION >= 11080
+  float inv_scale = 1.f / scale_ptr[0];
+  for (size_t i = (size_t)blockIdx.x * blockDim.x + threadIdx.x; i < numel;
+       i += (size_t)gridDim.x * blockDim.x) {
+    q_ptr[i] = __nv_cvt_float_to_fp8(float(f_ptr[i]) * inv_scale,
+                                     __NV_SATFINITE, __NV_E4M3);
+  }
+#endif
+}
+
+template <typename T>
+void launch_quantize_fp8(uint8_t *q_ptr, const T *f_ptr,
+                         const float *scale_ptr, size_t numel,
+                         cudaStream_t stream) {
+#if defined(CUDA_VERSION) && CUDA_VERSION >= 11080
+  size_t grid_dim = (numel + MAX_THREADS - 1) / MAX_THREADS;
+  if (grid_dim > 65535) grid_dim = 65535;
+  quantize_fp8_kernel<T><<<grid_dim, MAX_THREADS, 0, stream>>>(
+      q_ptr, f_ptr, scale_ptr, numel);
+#else
+  throw std::runtime_error("fp8 quantization needs CUDA 11.8 or later");
+#endif
+}
+
+template void launch_quantize_fp8<float>(uint8_t *q_ptr, const float *f_ptr,
+                                         const float *scale_ptr, size_t numel,
+                                         cudaStream_t stream);
+template void launch_quantize_fp8<__half>(uint8_t *q_ptr, const __half *f_ptr,
+                                          const float *scale_ptr, size_t numel,
+                                          cudaStream_t stream);
+template void launch_quantize_fp8<__nv_bfloat16>(
+    uint8_t *q_ptr, const __nv_bfloat16 *f_ptr, const float *scale_ptr,
+    size_t numel, cudaStream_t stream);
+
+/**
+@brief: quantize_fp8_transpose_kernel
+per-tensor scaled quantization into fp8 e4m3 or e5m2 of a row major matrix,
+with its transpose, and the absmax of the matrix
+
+@thread
+gridDim.x = ceil(cols / 32)
+gridDim.y = ceil(rows / 32)
+blockDim = (32, 8)
+
+@param
+q_ptr: [rows, cols], or nullptr
+q_t_ptr: [cols, rows], or nullptr
+amax_ptr: [1], max with |f|, or nullptr
+f_ptr: [rows, cols]
+scale_ptr: [1]
+*/
+template <typename T>
+__global__ void quantize_fp8_transpose_kernel(uint8_t *q_ptr, uint8_t *q_t_ptr,
+                                              float *amax_ptr, const T *f_ptr,
+                                              const float *scale_ptr, int rows,
+                                              int cols, bool e5m2) {
+#if defined(CUDA_VERSION) && CUDA_VERSION >= 11080
+  // padded against the bank conflicts of the transposed reads
+  __shared__ uint8_t tile[32][33];
+  float inv_scale = 1.f / scale_ptr[0];
+  __nv_fp8_interpretation_t fmt = e5m2 ? __NV_E5M2 : __NV_E4M3;
+  int col = blockIdx.x * 32 + threadIdx.x;
+  float thread_max = 0.f;
+  for (int j = threadIdx.y; j < 32; j += blockDim.y) {
+    int row = blockIdx.y * 32 + j;
+    if (row < rows && col < cols) {
+      size_t idx = size_t(row) * cols + col;
+      float f = float(f_ptr[idx]);
+      thread_max = fmaxf(thread_max, fabsf(f));
+      uint8_t q = __nv_cvt_float_to_fp8(f * inv_scale, __NV_SATFINITE, fmt);
+      if (q_ptr) q_ptr[idx] = q;
+      tile[j][threadIdx.x] = q;
+    }
+  }
+
+  if (q_t_ptr) {
+    __syncthreads();
+    int t_col = blockIdx.y * 32 + threadIdx.x;
+    for (int j = threadIdx.y; j < 32; j += blockDim.y) {
+      int t_row = blockIdx.x * 32 + j;
+      if (t_row < cols && t_col < rows) {
+        q_t_ptr[size_t(t_row) * rows + t_col] = tile[threadIdx.x][j];
+      }
+    }
+  }
+
+  if (amax_ptr) {
+    // every row of the block is a warp. non negative floats order as their
+    // int bits.
+    warpReduce<ReduceType::kMax, 1>(&thread_max);
+    if (threadIdx.x == 0) {
+      atomicMax((int *)amax_ptr, __float_as_int(thread_max));
+    }
+  }
+#endif
+}
+
+template <typename T>
+void launch_quantize_fp8_transpose(uint8_t *q_ptr, uint8_t *q_t_ptr,
+                                   float *amax_ptr, const T *f_ptr,
+                                   const float *scale_ptr, int rows, int cols,
+                                   bool e5m2, cudaStream_t stream) {
+#if defined(CUDA_VERSION) && CUDA_VERSION >= 11080
+  dim3 grid_dim((cols + 31) / 32, (rows + 31) / 32);
+  dim3 block_dim(32, 8);
+  quantize_fp8_transpose_kernel<T><<<grid_dim, block_dim, 0, stream>>>(
+      q_ptr, q_t_ptr, amax_ptr, f_ptr, scale_ptr, rows, cols, e5m2);
+#else
+  throw std::runtime_error("fp8 quantization needs CUDA 11.8 or later");
+#endif
+}
+
+template void launch_quantize_fp8_transpose<float>(
+    uint8_t *q_ptr, uint8_t *q_t_ptr, float *amax_ptr, const float *f_ptr,
+    const float *scale_ptr, int rows, int cols, bool e5m2,
+    cudaStream_t stream);
+template void launch_quantize_fp8_transpose<__half>(
+    uint8_t *q_ptr, uint8_t *q_t_ptr, float *amax_ptr, const __half *f_ptr,
+    const float *scale_ptr, int rows, int cols, bool e5m2,
+    cudaStream_t stream);
+template void launch_quantize_fp8_transpose<__nv_bfloat16>(
+    uint8_t *q_ptr, uint8_t *q_t_ptr, float *amax_ptr,
+    const __nv_bfloat16 *f_ptr, const float *scale_ptr, int rows, int cols,
+    bool e5m2, cudaStream_t stream);
+
+/**
+@brief: fp8_update_scales_kernel
+the delayed scaling of fp8 training, the scale of every tensor from the max
+of its amax history, and the slot of the coming step is cleared
+
+@thread
+gridDim.x = num_tensors
+blockDim.x = 32
+
+@param
+scales: [num_tensors]
+amax_history: [num_tensors, history_len]
+*/
+__global__ void fp8_update_scales_kernel(float *scales, float *amax_history,
+                                         int history_len, int slot,
+                                         float fp8_max, float margin) {
+  float *history = amax_history + blockIdx.x * history_len;
+  float amax = 0.f;
+  for (int i = threadIdx.x; i < history_len; i += blockDim.x) {
+    amax = fmaxf(amax, history[i]);
+  }
+  warpReduce<ReduceType::kMax, 1>(&amax);
+  if (threadIdx.x == 0) {
+    // keeps the last scale until the tensor has been seen
+    if (amax > 0.f && isfinite(amax)) {
+      scales[blockIdx.x] = amax / fp8_max * exp2f(margin);
+    }
+    history[slot] = 0.f;
+  }
+}
+
+void launch_fp8_update_scales(float *scales, float *amax_history,
+                              int num_tensors, int history_len, int slot,
+                              float fp8_max, float margin,
+                              cudaStream_t stream) {
+  fp8_update_scales_kernel<<<num_tensors, WARP_REDUCE_SIZE, 0, stream>>>(
+      scales, amax_history, history_len, slot, fp8_max, margin);
+}
+
+/**
+@brief: quantize_rows_kernel
+symmetric int8 quantization with one absmax scale per row
+
+@thread
+gridDim.x = rows
+blockDim.x = 256
+
+@param
+q: [rows, cols]
+scales: [rows]
+inp: [rows, cols]
+*/
+template <typename T>
+__global__ void quantize_rows_kernel(int8_t *q, float *scales, const T *inp,
+                                     int cols) {
+  const T *row = inp + size_t(blockIdx.x) * cols;
+  float row_max = 0.f;
+  for (int i = threadIdx.x; i < cols; i += blockDim.x) {
+    row_max = fmaxf(row_max, fabsf(float(row[i])));
+  }
+  blockReduce<ReduceType::kMax, 1>(&row_max);
+  __shared__ float s_scale;
+  if (threadIdx.x == 0) {
+    s_scale = row_max > 0.f ? row_max / kQuantRangeI8 : 1.f;
+    scales[blockIdx.x] = s_scale;
+  }
+  __syncthreads();
+  float inv_scale = 1.f / s_scale;
+  int8_t *q_row = q + size_t(blockIdx.x) * cols;
+  for (int i = threadIdx.x; i < cols; i += blockDim.x) {
+    float i8 = fminf(fmaxf(rintf(float(row[i]) * inv_scale), -kQuantRangeI8),
+                     kQuantRangeI8);
+    q_row[i] = static_cast<int8_t>(i8);
+  }
+}
+
+template <typename T>
+void launch_quantize_rows(int8_t *q, float *scales, const T *inp, int rows,
+                          int cols, cudaStream_t stream) {
+  quantize_rows_kernel<T><<<rows, 256, 0, stream>>>(q, scales, inp, cols);
+}
+
+template void launch_quantize_rows<float>(int8_t *q, float *scales,
+                                          const float *inp, int rows,
+                                          int cols, cudaStream_t stream);
+template void launch_quantize_rows<__half>(int8_t *q, float *scales,
+                                           const __half *inp, int rows,
+                                           int cols, cudaStream_t stream);
+template void launch_quantize_rows<__nv_bfloat16>(int8_t *q, float *scales,
+                                                  const __nv_bfloat16 *inp,
+                                                  int rows, int cols,
+                                                  cudaStream_t stream);
+
+/**
+@brief: quantize_weight_cols_kernel
+per output channel int8 quantization of an inference kernel, transposed so
+that the outputs are the rows of q, run once at load
+
+@thread
+gridDim.x = cols
+blockDim.x = 256
+
+@param
+q: [cols, rows]
+scales: [cols]
+weight: [rows, cols]
+*/
+template <typename T>
+__global__ void quantize_weight_cols_kernel(int8_t *q, float *scales,
+                                            const T *weight, int rows,
+                                            int cols) {
+  int col = blockIdx.x;
+  float col_max = 0.f;
+  for (int i = threadIdx.x; i < rows; i += blockDim.x) {
+    col_max = fmaxf(col_max, fabsf(float(weight[size_t(i) * cols + col])));
+  }
+  blockReduce<ReduceType::kMax, 1>(&col_max);
+  __shared__ float s_scale;
+  if (threadIdx.x == 0) {
+    s_scale = col_max > 0.f ? col_max / kQuantRangeI8 : 1.f;
+    scales[col] = s_scale;
+  }
+  __syncthreads();
+  float inv_scale = 1.f / s_scale;
+  for (int i = threadIdx.x; i < rows; i += blockDim.x) {
+    float i8 = fminf(
+        fmaxf(rintf(float(weight[size_t(i) * cols + col]) * inv_scale),
+              -kQuantRangeI8),
+        kQuantRangeI8);
+    q[size_t(col) * rows + i] = static_cast<int8_t>(i8);
+  }
+}
+
+template <typename T>
+void launch_quantize_weight_cols(int8_t *q, float *scales, const T *weight,
+                                 int rows, int cols, cudaStream_t stream) {
+  quantize_weight_cols_kernel<T>
+      <<<cols, 256, 0, stream>>>(q, scales, weight, rows, cols);
+}
+
+template void launch_quantize_weight_cols<float>(int8_t *q, float *scales,
+                                                 const float *weight,
+                                                 int rows, int cols,
+                                                 cudaStream_t stream);
+template void launch_quantize_weight_cols<__half>(int8_t *q, float *scales,
+                                                  const __half *weight,
+                                                  int rows, int cols,
+                                                  cudaStream_t stream);
+template void launch_quantize_weight_cols<__nv_bfloat16>(
+    int8_t *q, float *scales, const __nv_bfloat16 *weight, int rows, int cols,
+    cudaStream_t stream);
+
+/**
+@brief: dequantize_bias_act_kernel
+the epilogue of the int32 gemm, dequantized by the scales of its row and of
+its column, then the bias, the activation or the residual
+
+@thread
+gridDim.x = min(ceil(rows * cols / MAX_THREADS), 65535)
+blockDim.x = MAX_THREADS
+
+@param
+out: [rows, cols]
+c: [rows, cols]
+row_scales: [rows]
+col_scales: [cols]
+bias: [cols] or nullptr
+residual: [rows, cols] or nullptr
+*/
+template <int act, typename T>
+__global__ void dequantize_bias_act_kernel(T *out, const int32_t *c,
+                                           const float *row_scales,
+                                           const float *col_scales,
+                                           const T *bias, const T *residual,
+                                           int rows, int cols) {
+  size_t numel = size_t(rows) * cols;
+  for (size_t i = (size_t)blockIdx.x * blockDim.x + threadIdx.x; i < numel;
+       i += (size_t)gridDim.x * blockDim.x) {
+    int row = i / cols, col = i % cols;
+    float val = c[i] * row_scales[row] * col_scales[col];
+    if (bias) val += float(bias[col]);
+    // 0 none, 1 relu, 2 gelu
+    if (act == 1) val = fmaxf(val, 0.f);
+    if (act == 2) val = gelu<float>(val);
+    if (residual) val += float(residual[i]);
+    out[i] = T(val);
+  }
+}
+
+template <ActivationType act_type, typename T>
+void launch_dequantize_bias_act(T *out, const int32_t *c,
+                                const float *row_scales,
+                                const float *col_scales, const T *bias,
+                                int rows, int cols, cudaStream_t stream) {
+  size_t grid_dim = (size_t(rows) * cols + MAX_THREADS - 1) / MAX_THREADS;
+  if (grid_dim > 65535) grid_dim = 65535;
+  const int act = act_type == ActivationType::kRelu ? 1 : 2;
+  dequantize_bias_act_kernel<act, T><<<grid_dim, MAX_THREADS, 0, stream>>>(
+      out, c, row_scales, col_scales, bias, nullptr, rows, cols);
+}
+
+template <typename T>
+void launch_dequantize_bias_res(T *out, const int32_t *c,
+                                const float *row_scales,
+                                const float *col_scales, const T *bias,
+                                const T *residual, int rows, int cols,
+                                cudaStream_t stream) {
+  size_t grid_dim = (size_t(rows) * cols + MAX_THREADS - 1) / MAX_THREADS;
+  if (grid_dim > 65535) grid_dim = 65535;
+  dequantize_bias_act_kernel<0, T><<<grid_dim, MAX_THREADS, 0, stream>>>(
+      out, c, row_scales, col_scales, bias, residual, rows, cols);
+}
+
+template void launch_dequantize_bias_act<ActivationType::kRelu, float>(
+    float *out, const int32_t *c, const float *row_scales,
+    const float *col_scales, const float *bias, int rows, int cols,
+    cudaStream_t stream);
+
+template void launch_dequantize_bias_act<ActivationType::kGelu, float>(
+    float *out, const int32_t *c, const float *row_scales,
+    const float *col_scales, const float *bias, int rows, int cols,
+    cudaStream_t stream);
+
+template void launch_dequantize_bias_res<float>(
+    float *out, const int32_t *c, const float *row_scales,
+    const float *col_scales, const float *bias, const float *residual, int rows,
+    int cols, cudaStream_t stream);
+
+template void launch_dequantize_bias_act<ActivationType::kRelu, __half>(
+    __half *out, const int32_t *c, const float *row_scales,
+    const float *col_scales, const __half *bias, int rows, int cols,
+    cudaStream_t stream);
+
+template void launch_dequantize_bias_act<ActivationType::kGelu, __half>(
+    __half *out, const int32_t *c, const float *row_scales,
+    const float *col_scales, const __half *bias, int rows, int cols,
+    cudaStream_t stream);
+
+template void launch_dequantize_bias_res<__half>(
+    __half *out, const int32_t *c, const float *row_scales,
+    const float *col_scales, const __half *bias, const __half *residual,
+    int rows, int cols, cudaStream_t stream);
+
+template void launch_dequantize_bias_act<ActivationType::kRelu, __nv_bfloat16>(
+    __nv_bfloat16 *out, const int32_t *c, const float *row_scales,
+    const float *col_scales, const __nv_bfloat16 *bias, int rows, int cols,
+    cudaStream_t stream);
+
+template void launch_dequantize_bias_act<ActivationType::kGelu, __nv_bfloat16>(
+    __nv_bfloat16 *out, const int32_t *c, const float *row_scales,
+    const float *col_scales, const __nv_bfloat16 *bias, int rows, int cols,
+    cudaStream_t stream);
+
+template void launch_dequantize_bias_res<__nv_bfloat16>(
+    __nv_bfloat16 *out, const int32_t *c, const float *row_scales,
+    const float *col_scales, const __nv_bfloat16 *bias,
+    const __nv_bfloat16 *residual, int rows, int cols, cudaStream_t stream);
+
+/**
+@brief: quantize_heads_kernel
+The int8 query, key and value of Int8AttentionOp, with one scale per head.
+
+@thread
+gridDim.x = batch_heads
+blockDim.x = MAX_THREADS
+
+@param
+q: [batch_heads, rows_pad, cols], or [batch_heads, cols, rows_pad] if
+  transpose. The rows from rows to rows_pad are zero.
+scales: [batch_heads]
+inp: the [rows, cols] of every head at head_stride from the previous one
+*/
+template <typename T>
+__global__ void quantize_heads_kernel(int8_t *q, float *scales, const T *inp,
+                                      int rows, int rows_pad, int cols,
+                                      int head_stride, bool transpose) {
+  const T *head = inp + size_t(blockIdx.x) * head_stride;
+  int numel = rows * cols;
+  float head_max = 0.f;
+  for (int i = threadIdx.x; i < numel; i += blockDim.x) {
+    head_max = fmaxf(head_max, fabsf(float(head[i])));
+  }
+  blockReduce<ReduceType::kMax, 1>(&head_max);
+  __shared__ float s_scale;
+  if (threadIdx.x == 0) {
+    s_scale = head_max > 0.f ? head_max / kQuantRangeI8 : 1.f;
+    scales[blockIdx.x] = s_scale;
+  }
+  __syncthreads();
+  float inv_scale = 1.f / s_scale;
+  int8_t *q_head = q + size_t(blockIdx.x) * rows_pad * cols;
+  for (int i = threadIdx.x; i < rows_pad * cols; i += blockDim.x) {
+    int row = transpose ? i % rows_pad : i / cols;
+    int col = transpose ? i / rows_pad : i % cols;
+    float val = row < rows ? float(head[row * cols + col]) : 0.f;
+    q_head[i] = static_cast<int8_t>(
+        fminf(fmaxf(rintf(val * inv_scale), -kQuantRangeI8), kQuantRangeI8));
+  }
+}
+
+template <typename T>
+void launch_quantize_heads(int8_t *q, float *scales, const T *inp,
+                           int batch_heads, int rows, int rows_pad, int cols,
+                           int head_stride, bool transpose,
+                           cudaStream_t stream) {
+  quantize_heads_kernel<T><<<batch_heads, MAX_THREADS, 0, stream>>>(
+      q, scales, inp, rows, rows_pad, cols, head_stride, transpose);
+}
+
+/**
+@brief: attn_softmax_i32I_i8O_kernel
+The softmax of the int32 scores of Int8AttentionOp, dequantized by the
+scales of their query and key heads, into int8 probabilities of the fixed
+scale 1 / kQuantRangeI8, the new arch counterpart of
+ker_fuse_softmax_new_value_i32I_i8O.
+
+@thread
+gridDim.x = from_len
+gridDim.y = batch_size
+gridDim.z = nhead
+blockDim.x = kSoftmaxI8Threads
+
+@param
+out: [batch_size, nhead, from_len, to_pad], zero at the masked keys and the
+  pads from to_len to to_pad.
+inp: [batch_size, nhead, from_len, to_pad]
+attn_mask: as the one of launch_attn_softmax_new
+*/
+const int kSoftmaxI8Threads = 256;
+
+template <typename T>
+__global__ void attn_softmax_i32I_i8O_kernel(
+    int8_t *out, const int32_t *inp, const float *q_scales,
+    const float *k_scales, float alpha, const T *attn_mask, int from_len,
+    int to_len, int to_pad, int kv_size, bool mask_future) {
+  int token_id = blockIdx.x;
+  int head = blockIdx.y * gridDim.z + blockIdx.z;
+  size_t row_offset = (size_t(head) * from_len + token_id) * to_pad;
+  const int32_t *inp_row = inp + row_offset;
+  int8_t *out_row = out + row_offset;
+  const T *mask_row =
+      attn_mask ? attn_mask + size_t(blockIdx.y) * kv_size : nullptr;
+  float scale = alpha * q_scales[head] * k_scales[head];
+  // keys after it are masked when mask_future.
+  int last_key = mask_future ? token_id + to_len - from_len : to_len - 1;
+
+  auto load = [&](int j) {
+    if (j > last_key) return REDUCE_FLOAT_INF_NEG;
+    float val = inp_row[j] * scale;
+    if (mask_row) val += float(mask_row[j]);
+    return fmaxf(val, REDUCE_FLOAT_INF_NEG);
+  };
+
+  __shared__ float s_max, s_inv_sum;
+  float l_max = REDUCE_FLOAT_INF_NEG;
+  for (int j = threadIdx.x; j < to_len; j += blockDim.x) {
+    l_max = fmaxf(l_max, load(j));
+  }
+  blockReduce<ReduceType::kMax, 1>(&l_max);
+  if (threadIdx.x == 0) s_max = l_max;
+  __syncthreads();
+
+  float l_sum = 0.f;
+  for (int j = threadIdx.x; j < to_len; j += blockDim.x) {
+    l_sum += __expf(load(j) - s_max);
+  }
+  blockReduce<ReduceType::kSum, 1>(&l_sum);
+  if (threadIdx.x == 0) s_inv_sum = __fdividef(kQuantRangeI8, l_sum + 1e-8f);
+  __syncthreads();
+
+  for (int j = threadIdx.x; j < to_pad; j += blockDim.x) {
+    float prob = j < to_len ? __expf(load(j) - s_max) * s_inv_sum : 0.f;
+    out_row[j] = static_cast<int8_t>(fminf(rintf(prob), kQuantRangeI8));
+  }
+}
+
+template <typename T>
+void launch_attn_softmax_i32I_i8O(int8_t *out, const int32_t *inp,
+                                  const float *q_scales, const float *k_scales,
+                                  float alpha, const T *attn_mask,
+                                  int batch_size, int nhead, int from_len,
+                                  int to_len, int to_pad, int kv_size,
+                                  bool mask_future, cudaStream_t stream) {
+  dim3 grid_dim(from_len, batch_size, nhead);
+  attn_softmax_i32I_i8O_kernel<T><<<grid_dim, kSoftmaxI8Threads, 0,
+                                    stream>>>(
+      out, inp, q_scales, k_scales, alpha, attn_mask, from_len, to_len,
+      to_pad, kv_size, mask_future);
+}
+
+// out[h][i] = c[h][i] * scales[h] * scale
+template <typename T>
+__global__ void dequantize_heads_kernel(T *out, const int32_t *c,
+                                        const float *scales, float scale,
+                                        int head_size) {
+  size_t offset = size_t(blockIdx.y) * head_size;
+  float head_scale = scales[blockIdx.y] * scale;
+  for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < head_size;
+       i += gridDim.x * blockDim.x) {
+    out[offset + i] = T(c[offset + i] * head_scale);
+  }
+}
+
+template <typename T>
+void launch_dequantize_heads(T *out, const int32_t *c, const float *scales,
+                             float scale, int batch_heads, int head_size,
+                             cudaStream_t stream) {
+  dim3 grid_dim((head_size + MAX_THREADS - 1) / MAX_THREADS, batch_heads);
+  dequantize_heads_kernel<T><<<grid_dim, MAX_THREADS, 0, stream>>>(
+      out, c, scales, scale, head_size);
+}
+
+template void launch_quantize_heads<float>(
+    int8_t *q, float *scales, const float *inp, int batch_heads, int rows,
+    int rows_pad, int cols, int head_stride, bool transpose,
+    cudaStream_t stream);
+
+template void launch_attn_softmax_i32I_i8O<float>(
+    int8_t *out, const int32_t *inp, const float *q_scales,
+    const float *k_scales, float alpha, const float *attn_mask, int batch_size,
+    int nhead, int from_len, int to_len, int to_pad, int kv_size,
+    bool mask_future, cudaStream_t stream);
+
+template void launch_dequantize_heads<float>(
+    float *out, const int32_t *c, const float *scales, float scale,
+    int batch_heads, int head_size, cudaStream_t stream);
+
+template void launch_quantize_heads<__half>(
+    int8_t *q, float *scales, const __half *inp, int batch_heads, int rows,
+    int rows_pad, int cols, int head_stride, bool transpose,
+    cudaStream_t stream);
+
+template void launch_attn_softmax_i32I_i8O<__half>(
+    int8_t *out, const int32_t *inp, const float *q_scales,
+    const float *k_scales, float alpha, const __half *attn_mask, int batch_size,
+    int nhead, int from_len, int to_len, int to_pad, int kv_size,
+    bool mask_future, cudaStream_t stream);
+
+template void launch_dequantize_heads<__half>(
+    __half *out, const int32_t *c, const float *scales, float scale,
+    int batch_heads, int head_size, cudaStream_t stream);
+
+template void launch_quantize_heads<__nv_bfloat16>(
+    int8_t *q, float *scales, const __nv_bfloat16 *inp, int batch_heads,
+    int rows, int rows_pad, int cols, int head_stride, bool transpose,
+    cudaStream_t stream);
+
+template void launch_attn_softmax_i32I_i8O<__nv_bfloat16>(
+    int8_t *out, const int32_t *inp, const float *q_scales,
+    const float *k_scales, float alpha, const __nv_bfloat16 *attn_mask,
+    int batch_size, int nhead, int from_len, int to_len, int to_pad,
+    int kv_size, bool mask_future, cudaStream_t stream);
+
+template void launch_dequantize_heads<__nv_bfloat16>(
+    __nv_bfloat16 *out, const int32_t *c, const float *scales, float scale,
+    int batch_heads, int head_size, cudaStream_t stream);
+
 }  // namespace cuda
 }  // namespace lightseq
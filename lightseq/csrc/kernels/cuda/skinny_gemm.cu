@@ -0,0 +1,193 @@
+#include <stdexcept>
+#include <string>
+
+#include "skinny_gemm.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+const int kSkinnyThreads = 256;
+// the rows of B staged in shared memory at once.
+const int kSkinnyTileK = 32;
+// the least k of a split, below it the partial sums cost more than they
+// hide.
+const int kSkinnyMinSplitK = 128;
+const int kSkinnySplits[] = {1, 2, 4, 8, 16};
+
+/*
+A thread per row i of C and a split of k per blockIdx.y. The loads of A are
+coalesced over the rows of a block, B is read from shared memory.
+partial is null with a single split, C is then written directly.
+*/
+template <typename T, int kMaxN>
+__global__ void ker_skinny_gemm(int m, int n, int k, int split_k,
+                                float alpha, float beta, const T *A,
+                                const T *B, T *C, float *partial) {
+  __shared__ float s_b[kSkinnyTileK][kMaxN];
+  int i = blockIdx.x * blockDim.x + threadIdx.x;
+  int k_begin = blockIdx.y * split_k;
+  int k_end = min(k, k_begin + split_k);
+
+  float acc[kMaxN];
+#pragma unroll
+  for (int j = 0; j < kMaxN; j++) acc[j] = 0;
+
+  for (int tile = k_begin; tile < k_end; tile += kSkinnyTileK) {
+    int tile_k = min(kSkinnyTileK, k_end - tile);
+    for (int idx = threadIdx.x; idx < kSkinnyTileK * kMaxN;
+         idx += blockDim.x) {
+      int p = idx / kMaxN, j = idx % kMaxN;
+      s_b[p][j] =
+          p < tile_k && j < n ? static_cast<float>(B[j * k + tile + p]) : 0;
+    }
+    __syncthreads();
+    if (i < m) {
+      const T *a = A + (size_t)tile * m + i;
+      for (int p = 0; p < tile_k; p++) {
+        float a_ip = static_cast<float>(a[(size_t)p * m]);
+#pragma unroll
+        for (int j = 0; j < kMaxN; j++) acc[j] += a_ip * s_b[p][j];
+      }
+    }
+    __syncthreads();
+  }
+
+  if (i >= m) return;
+#pragma unroll
+  for (int j = 0; j < kMaxN; j++) {
+    if (j >= n) break;
+    if (partial != nullptr) {
+      partial[((size_t)blockIdx.y * n + j) * m + i] = acc[j];
+    } else {
+      float c = alpha * acc[j];
+      // beta == 0 ignores C as cublas does, it may be uninitialized.
+      if (beta != 0) c += beta * static_cast<float>(C[(size_t)j * m + i]);
+      C[(size_t)j * m + i] = T(c);
+    }
+  }
+}
+
+// C = alpha * the sum of the partial sums [splits, n, m] + beta * C
+template <typename T>
+__global__ void ker_skinny_gemm_reduce(int mn, int splits, float alpha,
+                                       float beta, const float *partial,
+                                       T *C) {
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= mn) return;
+  float sum = 0;
+  for (int s = 0; s < splits; s++) sum += partial[(size_t)s * mn + idx];
+  float c = alpha * sum;
+  if (beta != 0) c += beta * static_cast<float>(C[idx]);
+  C[idx] = T(c);
+}
+
+template <typename T, int kMaxN>
+void skinny_gemm(int m, int n, int k, float alpha, float beta, const T *A,
+                 const T *B, T *C, int splits, float *workspace,
+                 cudaStream_t stream) {
+  int split_k = (k + splits - 1) / splits;
+  split_k = (split_k + kSkinnyTileK - 1) / kSkinnyTileK * kSkinnyTileK;
+  dim3 grid((m + kSkinnyThreads - 1) / kSkinnyThreads, splits);
+  ker_skinny_gemm<T, kMaxN><<<grid, kSkinnyThreads, 0, stream>>>(
+      m, n, k, split_k, alpha, beta, A, B, C, splits > 1 ? workspace : nullptr);
+  if (splits > 1) {
+    int mn = m * n;
+    ker_skinny_gemm_reduce<T>
+        <<<(mn + kSkinnyThreads - 1) / kSkinnyThreads, kSkinnyThreads, 0,
+           stream>>>(mn, splits, alpha, beta, workspace, C);
+  }
+}
+
+}  // namespace
+
+template <typename T>
+void launch_skinny_gemm(int m, int n, int k, float alpha, float beta,
+                        const T *A, const T *B, T *C, int splits,
+                        float *workspace, cudaStream_t stream) {
+  if (n <= 1) {
+    skinny_gemm<T, 1>(m, n, k, alpha, beta, A, B, C, splits, workspace,
+                      stream);
+  } else if (n <= 2) {
+    skinny_gemm<T, 2>(m, n, k, alpha, beta, A, B, C, splits, workspace,
+                      stream);
+  } else if (n <= 4) {
+    skinny_gemm<T, 4>(m, n, k, alpha, beta, A, B, C, splits, workspace,
+                      stream);
+  } else if (n <= 8) {
+    skinny_gemm<T, 8>(m, n, k, alpha, beta, A, B, C, splits, workspace,
+                      stream);
+  } else if (n <= kSkinnyGemmMaxN) {
+    skinny_gemm<T, kSkinnyGemmMaxN>(m, n, k, alpha, beta, A, B, C, splits,
+                                    workspace, stream);
+  } else {
+    throw std::runtime_error("skinny gemm supports at most " +
+                             std::to_string(kSkinnyGemmMaxN) + " columns");
+  }
+}
+
+template void launch_skinny_gemm<float>(int m, int n, int k, float alpha,
+                                        float beta, const float *A,
+                                        const float *B, float *C, int splits,
+                                        float *workspace,
+                                        cudaStream_t stream);
+template void launch_skinny_gemm<__half>(int m, int n, int k, float alpha,
+                                         float beta, const __half *A,
+                                         const __half *B, __half *C,
+                                         int splits, float *workspace,
+                                         cudaStream_t stream);
+template void launch_skinny_gemm<__nv_bfloat16>(
+    int m, int n, int k, float alpha, float beta, const __nv_bfloat16 *A,
+    const __nv_bfloat16 *B, __nv_bfloat16 *C, int splits, float *workspace,
+    cudaStream_t stream);
+
+std::vector<int> SkinnyGemmBackend::variants(const GemmShape &shape) const {
+  std::vector<int> splits;
+  if (shape.transa != CUBLAS_OP_N || shape.transb != CUBLAS_OP_N ||
+      shape.batch != 1 || shape.n > kSkinnyGemmMaxN) {
+    return splits;
+  }
+  if (shape.dtype != CUDA_R_32F && shape.dtype != CUDA_R_16F &&
+      shape.dtype != CUDA_R_16BF) {
+    return splits;
+  }
+  for (int s : kSkinnySplits) {
+    if (shape.k < s * kSkinnyMinSplitK) break;
+    size_t partial_bytes = (size_t)s * shape.n * shape.m * sizeof(float);
+    if (s > 1 && partial_bytes > kGemmTunerWorkspaceSize) break;
+    splits.push_back(s);
+  }
+  return splits;
+}
+
+bool SkinnyGemmBackend::run(const GemmShape &shape, int variant,
+                            const float *alpha, const float *beta,
+                            const void *A, const void *B, void *C,
+                            void *workspace, cudaStream_t stream) {
+  float *partial = static_cast<float *>(workspace);
+  switch (shape.dtype) {
+    case CUDA_R_32F:
+      launch_skinny_gemm<float>(shape.m, shape.n, shape.k, *alpha, *beta,
+                                (const float *)A, (const float *)B,
+                                (float *)C, variant, partial, stream);
+      break;
+    case CUDA_R_16F:
+      launch_skinny_gemm<__half>(shape.m, shape.n, shape.k, *alpha, *beta,
+                                 (const __half *)A, (const __half *)B,
+                                 (__half *)C, variant, partial, stream);
+      break;
+    case CUDA_R_16BF:
+      launch_skinny_gemm<__nv_bfloat16>(
+          shape.m, shape.n, shape.k, *alpha, *beta, (const __nv_bfloat16 *)A,
+          (const __nv_bfloat16 *)B, (__nv_bfloat16 *)C, variant, partial,
+          stream);
+      break;
+    default:
+      return false;
+  }
+  return cudaGetLastError() == cudaSuccess;
+}
+
+}  // namespace cuda
+}  // namespace lightseq
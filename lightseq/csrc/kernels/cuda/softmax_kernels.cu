@@ -31,10 +31,14 @@ attn_mask: [batch_size, to_len], padding tokens are -inf,
   attn_mask!=nullptr for enc-self-attn and enc-dec-attn
   attn_mask=nullptr and mask_future=ture for dec-self-attn training
   attn_mask=nullptr and mask_future=false for dec-self-attn infer
+seq_ids: [batch_size, to_len], nullptr if the batch is not packed. In a packed
+  self attention, from_len == to_len and the tokens attend only to the
+  tokens of the same sequence, see launch_packed_seq_ids.
 */
 template <typename T, int block_dim, int ele_per_thread>
 __global__ void ker_attn_softmax(T *inp, const T *attn_mask, int from_len,
-                                 int to_len, bool mask_future) {
+                                 int to_len, bool mask_future,
+                                 const int *seq_ids) {
   int batch_id = blockIdx.y;
   int head_id = blockIdx.z;
   const int nhead = gridDim.z;
@@ -53,6 +57,7 @@ __global__ void ker_attn_softmax(T *inp, const T *attn_mask, int from_len,
     attn_mask += batch_id * to_len;
     BlockLoad(ts_load).Load(attn_mask, mval, to_len, REDUCE_FLOAT_INF_NEG);
   }
+  if (seq_ids) seq_ids += batch_id * to_len;
 
   inp += flat_3dim(batch_id, head_id, 0, nhead, from_len * to_len);
   for (int token_id = blockIdx.x * token_per_reduce; token_id < from_len;
@@ -69,9 +74,13 @@ __global__ void ker_attn_softmax(T *inp, const T *attn_mask, int from_len,
     float l_max[token_per_reduce];
     for (int i = 0; i < token_per_reduce; i++) {
       l_max[i] = REDUCE_FLOAT_INF_NEG;
+      int q_seq_id = seq_ids && token_id + i < from_len ? seq_ids[token_id + i]
+                                                        : 0;
       for (int j = 0; j < ele_per_thread; j++) {
         float temp_val;
-        if (mask_future && ele_per_thread * threadIdx.x + j > token_id + i) {
+        int key_id = ele_per_thread * threadIdx.x + j;
+        if ((mask_future && key_id > token_id + i) ||
+            (seq_ids && key_id < to_len && seq_ids[key_id] != q_seq_id)) {
           temp_val = REDUCE_FLOAT_INF_NEG;
         } else {
           temp_val = (float)inp_val[i][j];
@@ -128,7 +137,8 @@ __global__ void ker_attn_softmax(T *inp, const T *attn_mask, int from_len,
 
 template <typename T, int block_dim, int ele_per_thread>
 __global__ void ker_attn_softmax_lt32(T *inp, const T *attn_mask, int from_len,
-                                      int to_len, bool mask_future) {
+                                      int to_len, bool mask_future,
+                                      const int *seq_ids) {
   int batch_id = blockIdx.y;
   int head_id = blockIdx.z;
   const int nhead = gridDim.z;
@@ -147,6 +157,7 @@ __global__ void ker_attn_softmax_lt32(T *inp, const T *attn_mask, int from_len,
     attn_mask += batch_id * to_len;
     BlockLoad(ts_load).Load(attn_mask, mval, to_len, REDUCE_FLOAT_INF_NEG);
   }
+  if (seq_ids) seq_ids += batch_id * to_len;
 
   inp += flat_3dim(batch_id, head_id, 0, nhead, from_len * to_len);
   for (int token_id = blockIdx.x * token_per_reduce; token_id < from_len;
@@ -163,9 +174,13 @@ __global__ void ker_attn_softmax_lt32(T *inp, const T *attn_mask, int from_len,
     float l_max[token_per_reduce];
     for (int i = 0; i < token_per_reduce; i++) {
       l_max[i] = REDUCE_FLOAT_INF_NEG;
+      int q_seq_id = seq_ids && token_id + i < from_len ? seq_ids[token_id + i]
+                                                        : 0;
       for (int j = 0; j < ele_per_thread; j++) {
         float temp_val;
-        if (mask_future && ele_per_thread * threadIdx.x + j > token_id + i) {
+        int key_id = ele_per_thread * threadIdx.x + j;
+        if ((mask_future && key_id > token_id + i) ||
+            (seq_ids && key_id < to_len && seq_ids[key_id] != q_seq_id)) {
           temp_val = REDUCE_FLOAT_INF_NEG;
         } else {
           temp_val = (float)inp_val[i][j];
@@ -214,30 +229,30 @@ template <>
 void launch_attn_softmax<float>(float *inp, const float *attn_mask,
                                 int batch_size, int nhead, int from_len,
                                 int to_len, bool mask_future,
-                                cudaStream_t stream) {
+                                cudaStream_t stream, const int *seq_ids) {
   dim3 grid_dim(1, batch_size, nhead);
   if (to_len <= 32) {
     ker_attn_softmax_lt32<float, 32, 1><<<grid_dim, 32, 0, stream>>>(
-        inp, attn_mask, from_len, to_len, mask_future);
+        inp, attn_mask, from_len, to_len, mask_future, seq_ids);
   } else if (to_len <= 64) {
     ker_attn_softmax_lt32<float, 32, 2><<<grid_dim, 32, 0, stream>>>(
-        inp, attn_mask, from_len, to_len, mask_future);
+        inp, attn_mask, from_len, to_len, mask_future, seq_ids);
   } else if (to_len <= 128) {
     grid_dim.x = 16;
     ker_attn_softmax<float, 64, 2><<<grid_dim, 64, 0, stream>>>(
-        inp, attn_mask, from_len, to_len, mask_future);
+        inp, attn_mask, from_len, to_len, mask_future, seq_ids);
   } else if (to_len <= 256) {
     grid_dim.x = 32;
     ker_attn_softmax<float, 128, 2><<<grid_dim, 128, 0, stream>>>(
-        inp, attn_mask, from_len, to_len, mask_future);
+        inp, attn_mask, from_len, to_len, mask_future, seq_ids);
   } else if (to_len <= 512) {
     grid_dim.x = 64;
     ker_attn_softmax<float, 256, 2><<<grid_dim, 256, 0, stream>>>(
-        inp, attn_mask, from_len, to_len, mask_future);
+        inp, attn_mask, from_len, to_len, mask_future, seq_ids);
   } else if (to_len <= 1024) {
     grid_dim.x = 128;
     ker_attn_softmax<float, 512, 2><<<grid_dim, 512, 0, stream>>>(
-        inp, attn_mask, from_len, to_len, mask_future);
+        inp, attn_mask, from_len, to_len, mask_future, seq_ids);
   } else {
     throw std::runtime_error(
         "Sequence length greater than 512 is currently not supported");
@@ -248,30 +263,30 @@ template <>
 void launch_attn_softmax<__half>(__half *inp, const __half *attn_mask,
                                  int batch_size, int nhead, int from_len,
                                  int to_len, bool mask_future,
-                                 cudaStream_t stream) {
+                                 cudaStream_t stream, const int *seq_ids) {
   dim3 grid_dim(1, batch_size, nhead);
   if (to_len <= 32) {
     ker_attn_softmax_lt32<__half, 32, 1><<<grid_dim, 32, 0, stream>>>(
-        inp, attn_mask, from_len, to_len, mask_future);
+        inp, attn_mask, from_len, to_len, mask_future, seq_ids);
   } else if (to_len <= 64) {
     ker_attn_softmax_lt32<__half, 32, 2><<<grid_dim, 32, 0, stream>>>(
-        inp, attn_mask, from_len, to_len, mask_future);
+        inp, attn_mask, from_len, to_len, mask_future, seq_ids);
   } else if (to_len <= 128) {
     grid_dim.x = 8;
     ker_attn_softmax<__half, 64, 2><<<grid_dim, 64, 0, stream>>>(
-        inp, attn_mask, from_len, to_len, mask_future);
+        inp, attn_mask, from_len, to_len, mask_future, seq_ids);
   } else if (to_len <= 256) {
     grid_dim.x = 16;
     ker_attn_softmax<__half, 128, 2><<<grid_dim, 128, 0, stream>>>(
-        inp, attn_mask, from_len, to_len, mask_future);
+        inp, attn_mask, from_len, to_len, mask_future, seq_ids);
   } else if (to_len <= 512) {
     grid_dim.x = 32;
     ker_attn_softmax<__half, 256, 2><<<grid_dim, 256, 0, stream>>>(
-        inp, attn_mask, from_len, to_len, mask_future);
+        inp, attn_mask, from_len, to_len, mask_future, seq_ids);
   } else if (to_len <= 1024) {
     grid_dim.x = 64;
     ker_attn_softmax<__half, 512, 2><<<grid_dim, 512, 0, stream>>>(
-        inp, attn_mask, from_len, to_len, mask_future);
+        inp, attn_mask, from_len, to_len, mask_future, seq_ids);
   } else {
     throw std::runtime_error(
         "Sequence length greater than 512 is currently not supported");
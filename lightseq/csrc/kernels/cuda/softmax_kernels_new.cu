@@ -29,7 +29,8 @@ inp: [batch_size, nhead, from_len, to_len], softmax input.
 attn_mask: [batch_size, to_len], padding tokens are -inf,
   non padding tokens are 0.
   attn_mask!=nullptr for enc-self-attn and enc-dec-attn
-  attn_mask=nullptr and mask_future=ture for dec-self-attn training
+  attn_mask=nullptr and mask_future=ture for dec-self-attn training, query i
+  attends to the keys [0, i + to_len - from_len]
   attn_mask=nullptr and mask_future=false for dec-self-attn infer
 */
 template <typename T, int block_dim, int ele_per_thread>
@@ -73,7 +74,8 @@ __global__ void ker_attn_softmax(T *out, T *inp, const T *attn_mask,
       l_max[i] = REDUCE_FLOAT_INF_NEG;
       for (int j = 0; j < ele_per_thread; j++) {
         float temp_val;
-        if (mask_future && ele_per_thread * threadIdx.x + j > token_id + i) {
+        if (mask_future && ele_per_thread * threadIdx.x + j >
+                               token_id + i + to_len - from_len) {
           temp_val = REDUCE_FLOAT_INF_NEG;
         } else {
           temp_val = (float)inp_val[i][j];
@@ -169,7 +171,8 @@ __global__ void ker_attn_softmax_lt32(T *out, T *inp, const T *attn_mask,
       l_max[i] = REDUCE_FLOAT_INF_NEG;
       for (int j = 0; j < ele_per_thread; j++) {
         float temp_val;
-        if (mask_future && ele_per_thread * threadIdx.x + j > token_id + i) {
+        if (mask_future && ele_per_thread * threadIdx.x + j >
+                               token_id + i + to_len - from_len) {
           temp_val = REDUCE_FLOAT_INF_NEG;
         } else {
           temp_val = (float)inp_val[i][j];
@@ -209,9 +212,155 @@ __global__ void ker_attn_softmax_lt32(T *out, T *inp, const T *attn_mask,
   }  // blockIdx.x
 }
 
+namespace {
+
+// threads of ker_attn_softmax_long per row.
+const int kLongSoftmaxThreads = 256;
+
+// kVec elements of one 128-bit load, or a single element.
+template <typename T, int kVec>
+struct alignas(sizeof(T) * kVec) SoftmaxPack {
+  T val[kVec];
+};
+
+// merge the running max and sum of exp(x - max) of (max_b, sum_b) into
+// (max_a, sum_a).
+__forceinline__ __device__ void merge_max_sum(float &max_a, float &sum_a,
+                                              float max_b, float sum_b) {
+  float new_max = fmaxf(max_a, max_b);
+  sum_a = sum_a * __expf(max_a - new_max) + sum_b * __expf(max_b - new_max);
+  max_a = new_max;
+}
+
+}  // namespace
+
+/**
+@brief: ker_attn_softmax_long
+Softmax forward of ker_attn_softmax for any to_len. Every block handles one
+query row in two passes over it: the first keeps an online max and sum of
+exp per thread, merged across the block, the second writes the result, so
+that nothing of the row is held in registers. The rows are read kVec
+elements at once, 128 bits when to_len and kv_size are multiples of
+16 / sizeof(T).
+
+@thread
+gridDim.x = from_len
+gridDim.y = batch_size
+gridDim.z = nhead
+blockDim.x = kLongSoftmaxThreads
+
+@param
+as ker_attn_softmax
+*/
+template <typename T, int kVec>
+__global__ void ker_attn_softmax_long(T *out, const T *inp,
+                                      const T *attn_mask, int from_len,
+                                      int to_len, int kv_size,
+                                      bool mask_future) {
+  typedef SoftmaxPack<T, kVec> Pack;
+  int token_id = blockIdx.x;
+  int batch_id = blockIdx.y;
+  int head_id = blockIdx.z;
+  const int nhead = gridDim.z;
+  size_t row_offset =
+      (flat_3dim(batch_id, head_id, 0, nhead, from_len) + token_id) *
+      (size_t)to_len;
+  const Pack *inp_pack = reinterpret_cast<const Pack *>(inp + row_offset);
+  Pack *out_pack = reinterpret_cast<Pack *>(out + row_offset);
+  const Pack *mask_pack =
+      attn_mask ? reinterpret_cast<const Pack *>(attn_mask +
+                                                 (size_t)batch_id * kv_size)
+                : nullptr;
+  // keys after it are masked when mask_future.
+  int last_key = mask_future ? token_id + to_len - from_len : to_len;
+  int num_packs = to_len / kVec;
+
+  auto load = [&](int pack_id, float *val) {
+    Pack x = inp_pack[pack_id];
+    Pack m;
+    if (mask_pack) m = mask_pack[pack_id];
+#pragma unroll
+    for (int j = 0; j < kVec; j++) {
+      if (pack_id * kVec + j > last_key) {
+        val[j] = REDUCE_FLOAT_INF_NEG;
+      } else {
+        val[j] = float(x.val[j]) + (mask_pack ? float(m.val[j]) : 0.f);
+      }
+    }
+  };
+
+  /* step 1. online max and sum */
+  float l_max = REDUCE_FLOAT_INF_NEG, l_sum = 0.f;
+  for (int i = threadIdx.x; i < num_packs; i += blockDim.x) {
+    float val[kVec];
+    load(i, val);
+    float pack_max = val[0];
+#pragma unroll
+    for (int j = 1; j < kVec; j++) pack_max = fmaxf(pack_max, val[j]);
+    float new_max = fmaxf(l_max, pack_max);
+    l_sum *= __expf(l_max - new_max);
+#pragma unroll
+    for (int j = 0; j < kVec; j++) l_sum += __expf(val[j] - new_max);
+    l_max = new_max;
+  }
+  for (int mask = WARP_SIZE / 2; mask > 0; mask >>= 1) {
+    float o_max = __shfl_xor_sync(0xffffffff, l_max, mask);
+    float o_sum = __shfl_xor_sync(0xffffffff, l_sum, mask);
+    merge_max_sum(l_max, l_sum, o_max, o_sum);
+  }
+  __shared__ float s_warp_max[kLongSoftmaxThreads / WARP_SIZE];
+  __shared__ float s_warp_sum[kLongSoftmaxThreads / WARP_SIZE];
+  __shared__ float s_max, s_inv_sum;
+  int warp_id = threadIdx.x / WARP_SIZE, lane_id = threadIdx.x % WARP_SIZE;
+  if (lane_id == 0) {
+    s_warp_max[warp_id] = l_max;
+    s_warp_sum[warp_id] = l_sum;
+  }
+  __syncthreads();
+  if (threadIdx.x == 0) {
+    for (int w = 1; w < blockDim.x / WARP_SIZE; w++) {
+      merge_max_sum(l_max, l_sum, s_warp_max[w], s_warp_sum[w]);
+    }
+    s_max = l_max;
+    s_inv_sum = __fdividef(1.0f, l_sum + EPSILON);
+  }
+  __syncthreads();
+
+  /* step 2. compute final result */
+  for (int i = threadIdx.x; i < num_packs; i += blockDim.x) {
+    float val[kVec];
+    load(i, val);
+    Pack res;
+#pragma unroll
+    for (int j = 0; j < kVec; j++) {
+      res.val[j] = T(__expf(val[j] - s_max) * s_inv_sum);
+    }
+    out_pack[i] = res;
+  }
+}
+
+// The rows beyond the lengths of the tuned kernels.
+template <typename T>
+void launch_attn_softmax_long(T *out, const T *inp, const T *attn_mask,
+                              int batch_size, int nhead, int from_len,
+                              int to_len, int kv_size, bool mask_future,
+                              cudaStream_t stream) {
+  const int kVec = 16 / sizeof(T);
+  dim3 grid_dim(from_len, batch_size, nhead);
+  if (to_len % kVec == 0 && (attn_mask == nullptr || kv_size % kVec == 0)) {
+    ker_attn_softmax_long<T, kVec><<<grid_dim, kLongSoftmaxThreads, 0,
+                                     stream>>>(out, inp, attn_mask, from_len,
+                                               to_len, kv_size, mask_future);
+  } else {
+    ker_attn_softmax_long<T, 1><<<grid_dim, kLongSoftmaxThreads, 0, stream>>>(
+        out, inp, attn_mask, from_len, to_len, kv_size, mask_future);
+  }
+}
+
 /*
   attn_mask!=nullptr for enc-self-attn and enc-dec-attn
-  attn_mask=nullptr and mask_future=ture for dec-self-attn training
+  attn_mask=nullptr and mask_future=ture for dec-self-attn training, query i
+  attends to the keys [0, i + to_len - from_len]
   attn_mask=nullptr and mask_future=false for dec-self-attn infer
 */
 template <>
@@ -244,8 +393,8 @@ void launch_attn_softmax_new<float>(float *out, float *inp,
     ker_attn_softmax<float, 512, 2><<<grid_dim, 512, 0, stream>>>(
         out, inp, attn_mask, from_len, to_len, kv_size, mask_future);
   } else {
-    throw std::runtime_error(
-        "Sequence length greater than 512 is currently not supported");
+    launch_attn_softmax_long(out, inp, attn_mask, batch_size, nhead, from_len,
+                             to_len, kv_size, mask_future, stream);
   }
 }
 
@@ -279,8 +428,51 @@ void launch_attn_softmax_new<__half>(__half *out, __half *inp,
     ker_attn_softmax<__half, 512, 2><<<grid_dim, 512, 0, stream>>>(
         out, inp, attn_mask, from_len, to_len, kv_size, mask_future);
   } else {
-    throw std::runtime_error(
-        "Sequence length greater than 1024 is currently not supported");
+    launch_attn_softmax_long(out, inp, attn_mask, batch_size, nhead, from_len,
+                             to_len, kv_size, mask_future, stream);
+  }
+}
+
+template <>
+void launch_attn_softmax_new<__nv_bfloat16>(__nv_bfloat16 *out,
+                                            __nv_bfloat16 *inp,
+                                            const __nv_bfloat16 *attn_mask,
+                                            int batch_size, int nhead,
+                                            int from_len, int to_len,
+                                            int kv_size, bool mask_future,
+                                            cudaStream_t stream) {
+  dim3 grid_dim(1, batch_size, nhead);
+  if (to_len <= 32) {
+    ker_attn_softmax_lt32<__nv_bfloat16, 32, 1>
+        <<<grid_dim, 32, 0, stream>>>(
+            out, inp, attn_mask, from_len, to_len, kv_size, mask_future);
+  } else if (to_len <= 64) {
+    ker_attn_softmax_lt32<__nv_bfloat16, 32, 2>
+        <<<grid_dim, 32, 0, stream>>>(
+            out, inp, attn_mask, from_len, to_len, kv_size, mask_future);
+  } else if (to_len <= 128) {
+    grid_dim.x = 8;
+    ker_attn_softmax<__nv_bfloat16, 64, 2>
+        <<<grid_dim, 64, 0, stream>>>(
+            out, inp, attn_mask, from_len, to_len, kv_size, mask_future);
+  } else if (to_len <= 256) {
+    grid_dim.x = 16;
+    ker_attn_softmax<__nv_bfloat16, 128, 2>
+        <<<grid_dim, 128, 0, stream>>>(
+            out, inp, attn_mask, from_len, to_len, kv_size, mask_future);
+  } else if (to_len <= 512) {
+    grid_dim.x = 32;
+    ker_attn_softmax<__nv_bfloat16, 256, 2>
+        <<<grid_dim, 256, 0, stream>>>(
+            out, inp, attn_mask, from_len, to_len, kv_size, mask_future);
+  } else if (to_len <= 1024) {
+    grid_dim.x = 64;
+    ker_attn_softmax<__nv_bfloat16, 512, 2>
+        <<<grid_dim, 512, 0, stream>>>(
+            out, inp, attn_mask, from_len, to_len, kv_size, mask_future);
+  } else {
+    launch_attn_softmax_long(out, inp, attn_mask, batch_size, nhead, from_len,
+                             to_len, kv_size, mask_future, stream);
   }
 }
 
@@ -383,10 +575,233 @@ template void launch_attn_softmax_bw_new<__half>(__half *inp_grad,
                                                  const __half *soft_inp,
                                                  int rows, int softmax_len,
                                                  cudaStream_t stream);
+template void launch_attn_softmax_bw_new<__nv_bfloat16>(
+    __nv_bfloat16 *inp_grad, const __nv_bfloat16 *out_grad,
+    const __nv_bfloat16 *soft_inp, int rows, int softmax_len,
+    cudaStream_t stream);
 template void launch_attn_softmax_bw_new<float>(float *inp_grad,
                                                 const float *out_grad,
                                                 const float *soft_inp, int rows,
                                                 int softmax_len,
                                                 cudaStream_t stream);
+
+/**
+@brief: ker_adaptive_head
+The head of an adaptive softmax: the log softmax of every row of head over
+the frequent tokens and one logit per tail cluster. The tokens go to
+out[row][0, head_size), the cluster log probs to cluster_logp. A tail token
+is no more likely than its cluster, so a cluster less likely than the topk-th
+head token has no token among the topk of the row, the others are flagged in
+cluster_flags. The topk-th logit is bracketed by bisection, its lower end is
+kept, which only flags more clusters.
+
+@thread
+gridDim.x = rows
+blockDim.x = kAdaptiveSoftmaxThreads
+
+@param
+head: [rows, head_size + num_clusters]
+out: [rows, vocab_size]
+cluster_logp: [rows, num_clusters]
+cluster_flags: [num_clusters], set to 1 for the clusters to evaluate, left
+  untouched otherwise
+*/
+template <typename T>
+__global__ void ker_adaptive_head(T *out, float *cluster_logp,
+                                  int *cluster_flags, const T *head,
+                                  int head_size, int num_clusters,
+                                  int vocab_size, int topk) {
+  int row = blockIdx.x;
+  int head_len = head_size + num_clusters;
+  const T *head_row = head + size_t(row) * head_len;
+
+  __shared__ float s_max, s_lse, s_lo, s_hi;
+  __shared__ int s_count;
+  float l_max = REDUCE_FLOAT_INF_NEG, l_min = -REDUCE_FLOAT_INF_NEG;
+  for (int j = threadIdx.x; j < head_len; j += blockDim.x) {
+    l_max = fmaxf(l_max, float(head_row[j]));
+  }
+  blockReduce<ReduceType::kMax, 1>(&l_max);
+  if (threadIdx.x == 0) s_max = l_max;
+  __syncthreads();
+
+  float l_sum = 0.f;
+  for (int j = threadIdx.x; j < head_len; j += blockDim.x) {
+    l_sum += __expf(float(head_row[j]) - s_max);
+  }
+  blockReduce<ReduceType::kSum, 1>(&l_sum);
+  if (threadIdx.x == 0) s_lse = s_max + __logf(l_sum);
+  __syncthreads();
+
+  T *out_row = out + size_t(row) * vocab_size;
+  float head_max = REDUCE_FLOAT_INF_NEG;
+  for (int j = threadIdx.x; j < head_len; j += blockDim.x) {
+    float logit = float(head_row[j]);
+    if (j < head_size) {
+      out_row[j] = T(logit - s_lse);
+      head_max = fmaxf(head_max, logit);
+      l_min = fminf(l_min, logit);
+    } else {
+      cluster_logp[row * num_clusters + j - head_size] = logit - s_lse;
+    }
+  }
+  if (topk <= 0 || topk > head_size) {
+    for (int c = threadIdx.x; c < num_clusters; c += blockDim.x) {
+      cluster_flags[c] = 1;
+    }
+    return;
+  }
+
+  // count(logit >= lo) >= topk > count(logit >= hi) for the head tokens.
+  blockReduce<ReduceType::kMax, 1>(&head_max);
+  l_min = -l_min;
+  blockReduce<ReduceType::kMax, 1>(&l_min);
+  if (threadIdx.x == 0) {
+    s_lo = -l_min;
+    s_hi = head_max + 1.f;
+  }
+  __syncthreads();
+  for (int iter = 0; iter < kAdaptiveBisectIters; iter++) {
+    float mid = 0.5f * (s_lo + s_hi);
+    if (threadIdx.x == 0) s_count = 0;
+    __syncthreads();
+    int l_count = 0;
+    for (int j = threadIdx.x; j < head_size; j += blockDim.x) {
+      l_count += float(head_row[j]) >= mid;
+    }
+    atomicAdd(&s_count, l_count);
+    __syncthreads();
+    if (threadIdx.x == 0) {
+      if (s_count >= topk) {
+        s_lo = mid;
+      } else {
+        s_hi = mid;
+      }
+    }
+    __syncthreads();
+  }
+  for (int c = threadIdx.x; c < num_clusters; c += blockDim.x) {
+    if (float(head_row[head_size + c]) >= s_lo) cluster_flags[c] = 1;
+  }
+}
+
+/**
+@brief: ker_adaptive_tail
+The tokens of an evaluated tail cluster: out[row][cutoff + j] is the log
+softmax of tail[row] over the cluster, plus the log prob of the cluster.
+
+@thread
+gridDim.x = rows
+blockDim.x = kAdaptiveSoftmaxThreads
+*/
+template <typename T>
+__global__ void ker_adaptive_tail(T *out, const T *tail,
+                                  const float *cluster_logp, int cluster_size,
+                                  int cutoff, int cluster_idx,
+                                  int num_clusters, int vocab_size) {
+  int row = blockIdx.x;
+  const T *tail_row = tail + size_t(row) * cluster_size;
+  __shared__ float s_max, s_offset;
+  float l_max = REDUCE_FLOAT_INF_NEG;
+  for (int j = threadIdx.x; j < cluster_size; j += blockDim.x) {
+    l_max = fmaxf(l_max, float(tail_row[j]));
+  }
+  blockReduce<ReduceType::kMax, 1>(&l_max);
+  if (threadIdx.x == 0) s_max = l_max;
+  __syncthreads();
+
+  float l_sum = 0.f;
+  for (int j = threadIdx.x; j < cluster_size; j += blockDim.x) {
+    l_sum += __expf(float(tail_row[j]) - s_max);
+  }
+  blockReduce<ReduceType::kSum, 1>(&l_sum);
+  if (threadIdx.x == 0) {
+    s_offset = cluster_logp[row * num_clusters + cluster_idx] - s_max -
+               __logf(l_sum);
+  }
+  __syncthreads();
+
+  T *out_row = out + size_t(row) * vocab_size + cutoff;
+  for (int j = threadIdx.x; j < cluster_size; j += blockDim.x) {
+    out_row[j] = T(float(tail_row[j]) + s_offset);
+  }
+}
+
+// the tokens [begin, end) of every row, a tail cluster not evaluated: its
+// first token holds the log prob of the whole cluster, the others -inf.
+template <typename T>
+__global__ void ker_adaptive_skip(T *out, const float *cluster_logp,
+                                  int begin, int end, int cluster_idx,
+                                  int num_clusters, int vocab_size) {
+  int row = blockIdx.x;
+  T *out_row = out + size_t(row) * vocab_size;
+  for (int j = begin + threadIdx.x; j < end; j += blockDim.x) {
+    out_row[j] = j == begin ? T(cluster_logp[row * num_clusters + cluster_idx])
+                            : T(CUDA_FLOAT_INF_NEG);
+  }
+}
+
+template <typename T>
+void launch_adaptive_head(T *out, float *cluster_logp, int *cluster_flags,
+                          const T *head, int rows, int head_size,
+                          int num_clusters, int vocab_size, int topk,
+                          cudaStream_t stream) {
+  ker_adaptive_head<T><<<rows, kAdaptiveSoftmaxThreads, 0, stream>>>(
+      out, cluster_logp, cluster_flags, head, head_size, num_clusters,
+      vocab_size, topk);
+}
+
+template <typename T>
+void launch_adaptive_tail(T *out, const T *tail, const float *cluster_logp,
+                          int rows, int cluster_size, int cutoff,
+                          int cluster_idx, int num_clusters, int vocab_size,
+                          cudaStream_t stream) {
+  ker_adaptive_tail<T><<<rows, kAdaptiveSoftmaxThreads, 0, stream>>>(
+      out, tail, cluster_logp, cluster_size, cutoff, cluster_idx,
+      num_clusters, vocab_size);
+}
+
+template <typename T>
+void launch_adaptive_skip(T *out, const float *cluster_logp, int rows,
+                          int begin, int end, int cluster_idx,
+                          int num_clusters, int vocab_size,
+                          cudaStream_t stream) {
+  ker_adaptive_skip<T><<<rows, kAdaptiveSoftmaxThreads, 0, stream>>>(
+      out, cluster_logp, begin, end, cluster_idx, num_clusters, vocab_size);
+}
+
+template void launch_adaptive_head<float>(
+    float *out, float *cluster_logp, int *cluster_flags, const float *head,
+    int rows, int head_size, int num_clusters, int vocab_size, int topk,
+    cudaStream_t stream);
+template void launch_adaptive_tail<float>(
+    float *out, const float *tail, const float *cluster_logp, int rows,
+    int cluster_size, int cutoff, int cluster_idx, int num_clusters,
+    int vocab_size, cudaStream_t stream);
+template void launch_adaptive_skip<float>(
+    float *out, const float *cluster_logp, int rows, int begin, int end,
+    int cluster_idx, int num_clusters, int vocab_size, cudaStream_t stream);
+template void launch_adaptive_head<__half>(
+    __half *out, float *cluster_logp, int *cluster_flags, const __half *head,
+    int rows, int head_size, int num_clusters, int vocab_size, int topk,
+    cudaStream_t stream);
+template void launch_adaptive_tail<__half>(
+    __half *out, const __half *tail, const float *cluster_logp, int rows,
+    int cluster_size, int cutoff, int cluster_idx, int num_clusters,
+    int vocab_size, cudaStream_t stream);
+template void launch_adaptive_skip<__half>(
+    __half *out, const float *cluster_logp, int rows, int begin, int end,
+    int cluster_idx, int num_clusters, int vocab_size, cudaStream_t stream);
+template void launch_adaptive_head<__nv_bfloat16>(
+    __nv_bfloat16 *out, float *cluster_logp, int *cluster_flags,
+    const __nv_bfloat16 *head, int rows, int head_size, int num_clusters,
+    int vocab_size, int topk, cudaStream_t stream);
+template void launch_adaptive_tail<__nv_bfloat16>(
+    __nv_bfloat16 *out, const __nv_bfloat16 *tail, const float *cluster_logp,
+    int rows, int cluster_size, int cutoff, int cluster_idx, int num_clusters,
+    int vocab_size, cudaStream_t stream);
+template void launch_adaptive_skip<__nv_bfloat16>(
+    __nv_bfloat16 *out, const float *cluster_logp, int rows, int begin, int end,
+    int cluster_idx, int num_clusters, int vocab_size, cudaStream_t stream);
 }  // namespace cuda
 }  // namespace lightseq
@@ -0,0 +1,190 @@
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include "cuda_util.h"
+#include "sparse24_gemm.h"
+
+namespace lightseq {
+namespace cuda {
+
+#ifdef LIGHTSEQ_cusparselt
+namespace {
+
+template <typename T>
+cudaDataType sparse24_dtype();
+// not supported, see Sparse24Gemm::supported.
+template <>
+cudaDataType sparse24_dtype<float>() {
+  return CUDA_R_32F;
+}
+template <>
+cudaDataType sparse24_dtype<__half>() {
+  return CUDA_R_16F;
+}
+template <>
+cudaDataType sparse24_dtype<__nv_bfloat16>() {
+  return CUDA_R_16BF;
+}
+
+// The cuSPARSELt handle of the current device, shared by the gemms.
+const cusparseLtHandle_t *sparse24_handle() {
+  static std::mutex mutex;
+  static std::map<int, cusparseLtHandle_t *> handles;
+  int device;
+  CHECK_GPU_ERROR(cudaGetDevice(&device));
+  std::lock_guard<std::mutex> lock(mutex);
+  cusparseLtHandle_t *&handle = handles[device];
+  if (handle == nullptr) {
+    handle = new cusparseLtHandle_t;
+    CHECK_GPU_ERROR(cusparseLtInit(handle));
+  }
+  return handle;
+}
+
+}  // namespace
+#endif
+
+template <typename T>
+Sparse24Gemm<T>::Sparse24Gemm(int m, int k) : _m(m), _k(k) {
+  if (!supported()) {
+    throw std::runtime_error(
+        "2:4 sparse gemm needs cuSPARSELt, sm 80 and fp16 or bf16");
+  }
+  if (m % kSparse24Align != 0 || k % kSparse24Align != 0) {
+    throw std::runtime_error("2:4 sparse weight of [" + std::to_string(m) +
+                             ", " + std::to_string(k) +
+                             "] is not a multiple of " +
+                             std::to_string(kSparse24Align));
+  }
+}
+
+template <typename T>
+Sparse24Gemm<T>::~Sparse24Gemm() {
+#ifdef LIGHTSEQ_cusparselt
+  for (auto &iter : _plans) {
+    Plan *plan = iter.second;
+    cusparseLtMatmulPlanDestroy(&plan->plan);
+    cusparseLtMatDescriptorDestroy(&plan->mat_a);
+    cusparseLtMatDescriptorDestroy(&plan->mat_b);
+    cusparseLtMatDescriptorDestroy(&plan->mat_c);
+    delete plan;
+  }
+  if (_workspace) cudaFree(_workspace);
+#endif
+}
+
+template <typename T>
+bool Sparse24Gemm<T>::supported() {
+#ifdef LIGHTSEQ_cusparselt
+  return !std::is_same<T, float>::value && getSMVersion() >= 80;
+#else
+  return false;
+#endif
+}
+
+#ifdef LIGHTSEQ_cusparselt
+template <typename T>
+typename Sparse24Gemm<T>::Plan *Sparse24Gemm<T>::plan(int n) {
+  auto iter = _plans.find(n);
+  if (iter != _plans.end()) return iter->second;
+
+  const cusparseLtHandle_t *handle = sparse24_handle();
+  cudaDataType dtype = sparse24_dtype<T>();
+  Plan *plan = new Plan;
+  CHECK_GPU_ERROR(cusparseLtStructuredDescriptorInit(
+      handle, &plan->mat_a, _m, _k, _m, 16, dtype, CUSPARSE_ORDER_COL,
+      CUSPARSELT_SPARSITY_50_PERCENT));
+  CHECK_GPU_ERROR(cusparseLtDenseDescriptorInit(
+      handle, &plan->mat_b, _k, n, _k, 16, dtype, CUSPARSE_ORDER_COL));
+  CHECK_GPU_ERROR(cusparseLtDenseDescriptorInit(
+      handle, &plan->mat_c, _m, n, _m, 16, dtype, CUSPARSE_ORDER_COL));
+  CHECK_GPU_ERROR(cusparseLtMatmulDescriptorInit(
+      handle, &plan->matmul, CUSPARSE_OPERATION_NON_TRANSPOSE,
+      CUSPARSE_OPERATION_NON_TRANSPOSE, &plan->mat_a, &plan->mat_b,
+      &plan->mat_c, &plan->mat_c, CUSPARSE_COMPUTE_32F));
+  CHECK_GPU_ERROR(cusparseLtMatmulAlgSelectionInit(
+      handle, &plan->alg_sel, &plan->matmul, CUSPARSELT_MATMUL_ALG_DEFAULT));
+  CHECK_GPU_ERROR(cusparseLtMatmulPlanInit(handle, &plan->plan, &plan->matmul,
+                                           &plan->alg_sel));
+
+  size_t workspace_size = 0;
+  CHECK_GPU_ERROR(
+      cusparseLtMatmulGetWorkspace(handle, &plan->plan, &workspace_size));
+  if (workspace_size > _workspace_size) {
+    if (_workspace) CHECK_GPU_ERROR(cudaFree(_workspace));
+    CHECK_GPU_ERROR(cudaMalloc(&_workspace, workspace_size));
+    _workspace_size = workspace_size;
+  }
+  _plans[n] = plan;
+  return plan;
+}
+#endif
+
+template <typename T>
+size_t Sparse24Gemm<T>::compressed_size() {
+  size_t compressed_size = 0;
+#ifdef LIGHTSEQ_cusparselt
+  size_t buffer_size = 0;
+  CHECK_GPU_ERROR(cusparseLtSpMMACompressedSize(
+      sparse24_handle(), &plan(kSparse24Align)->plan, &compressed_size,
+      &buffer_size));
+#endif
+  return compressed_size;
+}
+
+template <typename T>
+void Sparse24Gemm<T>::compress(const T *A, void *compressed,
+                               cudaStream_t stream) {
+#ifdef LIGHTSEQ_cusparselt
+  // the compressed A is the same for the plans of every n.
+  const cusparseLtHandle_t *handle = sparse24_handle();
+  Plan *any_plan = plan(kSparse24Align);
+  int *d_invalid;
+  CHECK_GPU_ERROR(cudaMalloc(&d_invalid, sizeof(int)));
+  CHECK_GPU_ERROR(cusparseLtSpMMAPruneCheck(handle, &any_plan->matmul, A,
+                                            d_invalid, stream));
+  int invalid;
+  CHECK_GPU_ERROR(cudaMemcpyAsync(&invalid, d_invalid, sizeof(int),
+                                  cudaMemcpyDeviceToHost, stream));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(stream));
+  CHECK_GPU_ERROR(cudaFree(d_invalid));
+  if (invalid) {
+    throw std::runtime_error("the weight of [" + std::to_string(_m) + ", " +
+                             std::to_string(_k) + "] is not 2:4 sparse");
+  }
+
+  size_t compressed_size, buffer_size;
+  CHECK_GPU_ERROR(cusparseLtSpMMACompressedSize(
+      handle, &any_plan->plan, &compressed_size, &buffer_size));
+  void *buffer = nullptr;
+  if (buffer_size) CHECK_GPU_ERROR(cudaMalloc(&buffer, buffer_size));
+  CHECK_GPU_ERROR(cusparseLtSpMMACompress(handle, &any_plan->plan, A,
+                                          compressed, buffer, stream));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(stream));
+  if (buffer) CHECK_GPU_ERROR(cudaFree(buffer));
+#endif
+}
+
+template <typename T>
+void Sparse24Gemm<T>::gemm(const void *compressed, int n, const T *B, T *C,
+                           float beta, cudaStream_t stream) {
+#ifdef LIGHTSEQ_cusparselt
+  if (n % kSparse24Align != 0) {
+    throw std::runtime_error("2:4 sparse gemm of n " + std::to_string(n) +
+                             " is not a multiple of " +
+                             std::to_string(kSparse24Align));
+  }
+  float alpha = 1.f;
+  CHECK_GPU_ERROR(cusparseLtMatmul(sparse24_handle(), &plan(n)->plan, &alpha,
+                                   compressed, B, &beta, C, C, _workspace,
+                                   &stream, 1));
+#endif
+}
+
+template class Sparse24Gemm<float>;
+template class Sparse24Gemm<__half>;
+template class Sparse24Gemm<__nv_bfloat16>;
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -0,0 +1,306 @@
+#include "common.h"
+#include "block_reduce.h"
+#include "kernels.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+// The max logit and the softmax denominator of one row, returned to every
+// thread of the block.
+template <typename T>
+__device__ void row_softmax_stats(const T *logits, int vocab_size,
+                                  float *row_max, float *row_sum) {
+  __shared__ float s_max, s_sum;
+  float local_max = REDUCE_FLOAT_INF_NEG;
+  for (int idx = threadIdx.x; idx < vocab_size; idx += blockDim.x) {
+    local_max = fmaxf(local_max, float(logits[idx]));
+  }
+  blockReduce<ReduceType::kMax, 1>(&local_max);
+  if (threadIdx.x == 0) s_max = local_max;
+  __syncthreads();
+
+  float local_sum = 0.f;
+  for (int idx = threadIdx.x; idx < vocab_size; idx += blockDim.x) {
+    local_sum += __expf(float(logits[idx]) - s_max);
+  }
+  blockReduce<ReduceType::kSum, 1>(&local_sum);
+  if (threadIdx.x == 0) s_sum = local_sum;
+  __syncthreads();
+  *row_max = s_max;
+  *row_sum = s_sum;
+  __syncthreads();
+}
+
+template <typename T>
+__device__ float softmax_prob(const T *logits, int idx, float row_max,
+                              float row_sum) {
+  return __expf(float(logits[idx]) - row_max) / row_sum;
+}
+
+// The smallest index of the max logit of one row, returned to every thread.
+template <typename T>
+__device__ int row_argmax(const T *logits, int vocab_size) {
+  __shared__ float s_val[MAX_THREADS / WARP_SIZE];
+  __shared__ int s_idx[MAX_THREADS / WARP_SIZE];
+  __shared__ int s_res;
+  float val = REDUCE_FLOAT_INF_NEG;
+  int idx = vocab_size;
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x) {
+    float x = float(logits[i]);
+    if (x > val) val = x, idx = i;
+  }
+  for (int offset = WARP_SIZE / 2; offset > 0; offset /= 2) {
+    float other_val = __shfl_down_sync(WARP_REDUCE_MASK, val, offset);
+    int other_idx = __shfl_down_sync(WARP_REDUCE_MASK, idx, offset);
+    if (other_val > val || (other_val == val && other_idx < idx)) {
+      val = other_val, idx = other_idx;
+    }
+  }
+  if (threadIdx.x % WARP_SIZE == 0) {
+    s_val[threadIdx.x / WARP_SIZE] = val;
+    s_idx[threadIdx.x / WARP_SIZE] = idx;
+  }
+  __syncthreads();
+  if (threadIdx.x == 0) {
+    for (int w = 1; w < blockDim.x / WARP_SIZE; w++) {
+      if (s_val[w] > val || (s_val[w] == val && s_idx[w] < idx)) {
+        val = s_val[w], idx = s_idx[w];
+      }
+    }
+    s_res = idx;
+  }
+  __syncthreads();
+  int res = s_res;
+  __syncthreads();
+  return res;
+}
+
+// Sample from max(0, p - q), where p is the softmax of target and q is the
+// softmax of draft, or 0 when draft is nullptr. rand is uniform in (0, 1] and
+// the same for every thread, the token is returned to every thread.
+template <typename T>
+__device__ int sample_residual(const T *target, float t_max, float t_sum,
+                               const T *draft, float d_max, float d_sum,
+                               int vocab_size, float rand) {
+  __shared__ float s_chunk_sum[MAX_THREADS];
+  __shared__ int s_res;
+  int chunk = (vocab_size + blockDim.x - 1) / blockDim.x;
+  int begin = min(vocab_size, threadIdx.x * chunk);
+  int end = min(vocab_size, begin + chunk);
+  float local_sum = 0.f;
+  for (int idx = begin; idx < end; idx++) {
+    float w = softmax_prob(target, idx, t_max, t_sum);
+    if (draft) w -= softmax_prob(draft, idx, d_max, d_sum);
+    local_sum += fmaxf(w, 0.f);
+  }
+  s_chunk_sum[threadIdx.x] = local_sum;
+  __syncthreads();
+
+  // the chunk sums are scanned by one thread, then one chunk.
+  if (threadIdx.x == 0) {
+    float total = 0.f;
+    for (int t = 0; t < blockDim.x; t++) total += s_chunk_sum[t];
+    float target_mass = rand * total;
+    float acc = 0.f;
+    int res = -1, last_positive = 0;
+    for (int t = 0; t < blockDim.x && res < 0; t++) {
+      if (s_chunk_sum[t] <= 0.f) continue;
+      if (acc + s_chunk_sum[t] < target_mass) {
+        acc += s_chunk_sum[t];
+        last_positive = min(vocab_size, (t + 1) * chunk) - 1;
+        continue;
+      }
+      for (int idx = t * chunk; idx < min(vocab_size, (t + 1) * chunk);
+           idx++) {
+        float w = softmax_prob(target, idx, t_max, t_sum);
+        if (draft) w -= softmax_prob(draft, idx, d_max, d_sum);
+        if (w <= 0.f) continue;
+        acc += w;
+        last_positive = idx;
+        if (acc >= target_mass) {
+          res = idx;
+          break;
+        }
+      }
+    }
+    // rounding may leave the mass just short of target_mass.
+    s_res = res < 0 ? last_positive : res;
+  }
+  __syncthreads();
+  int res = s_res;
+  __syncthreads();
+  return res;
+}
+
+}  // namespace
+
+/**
+@brief: ker_speculative_sample
+Pick the next token from one row of logits, the argmax when greedy,
+otherwise a sample from its softmax.
+
+@thread
+gridDim.x = 1
+blockDim.x = MAX_THREADS
+
+@param
+logits: [vocab_size]
+token: [1], output
+*/
+template <typename T>
+__global__ void ker_speculative_sample(const T *logits, int *token,
+                                       int vocab_size, bool greedy,
+                                       unsigned long long seed,
+                                       unsigned long long counter) {
+  if (greedy) {
+    int res = row_argmax(logits, vocab_size);
+    if (threadIdx.x == 0) *token = res;
+    return;
+  }
+  __shared__ float s_rand;
+  if (threadIdx.x == 0) {
+    curandStatePhilox4_32_10_t state;
+    curand_init(seed, counter, 0, &state);
+    s_rand = curand_uniform(&state);
+  }
+  float row_max, row_sum;
+  row_softmax_stats(logits, vocab_size, &row_max, &row_sum);
+  int res = sample_residual(logits, row_max, row_sum, (const T *)nullptr, 0.f,
+                            1.f, vocab_size, s_rand);
+  if (threadIdx.x == 0) *token = res;
+}
+
+/**
+@brief: ker_speculative_verify
+Verify the num_draft tokens proposed by a draft model with the logits of the
+target model, following the rejection sampling rule of speculative decoding:
+draft token i is accepted with probability min(1, p(x) / q(x)), where p and q
+are the softmax of the target and draft logits of its position. The first
+rejected token is replaced by a sample from the normalized max(0, p - q) and
+the rest are dropped. When every draft token is accepted, one more token is
+sampled from the last row of the target. When greedy, a draft token is
+accepted if it is the argmax of the target, and the replacement and the bonus
+token are the argmax of the target, which makes the output identical to
+greedy decoding of the target.
+
+@thread
+gridDim.x = 1
+blockDim.x = MAX_THREADS
+
+@param
+target_logits: [num_draft + 1, vocab_size]
+draft_logits: [num_draft, vocab_size], not read when greedy
+tokens: [num_draft + 1], the draft tokens on input, the accepted tokens
+  followed by the replacement or bonus token on output
+num_tokens: [1], output, the number of valid tokens, in [1, num_draft + 1]
+*/
+template <typename T>
+__global__ void ker_speculative_verify(const T *target_logits,
+                                       const T *draft_logits, int *tokens,
+                                       int *num_tokens, int num_draft,
+                                       int vocab_size, bool greedy,
+                                       unsigned long long seed,
+                                       unsigned long long counter) {
+  __shared__ float s_rand;
+  __shared__ bool s_accept;
+  curandStatePhilox4_32_10_t state;
+  if (!greedy && threadIdx.x == 0) {
+    curand_init(seed, counter, 0, &state);
+  }
+
+  for (int i = 0; i <= num_draft; i++) {
+    const T *target_row = target_logits + size_t(i) * vocab_size;
+    if (greedy) {
+      int best = row_argmax(target_row, vocab_size);
+      if (i < num_draft && best == tokens[i]) continue;
+      if (threadIdx.x == 0) {
+        tokens[i] = best;
+        *num_tokens = i + 1;
+      }
+      return;
+    }
+
+    float t_max, t_sum;
+    row_softmax_stats(target_row, vocab_size, &t_max, &t_sum);
+    if (i == num_draft) {
+      if (threadIdx.x == 0) s_rand = curand_uniform(&state);
+      __syncthreads();
+      int res = sample_residual(target_row, t_max, t_sum, (const T *)nullptr,
+                                0.f, 1.f, vocab_size, s_rand);
+      if (threadIdx.x == 0) {
+        tokens[i] = res;
+        *num_tokens = i + 1;
+      }
+      return;
+    }
+
+    const T *draft_row = draft_logits + size_t(i) * vocab_size;
+    float d_max, d_sum;
+    row_softmax_stats(draft_row, vocab_size, &d_max, &d_sum);
+    if (threadIdx.x == 0) {
+      int token = tokens[i];
+      float p = softmax_prob(target_row, token, t_max, t_sum);
+      float q = softmax_prob(draft_row, token, d_max, d_sum);
+      s_accept = curand_uniform(&state) * q <= p;
+      s_rand = curand_uniform(&state);
+    }
+    __syncthreads();
+    if (s_accept) continue;
+    int res = sample_residual(target_row, t_max, t_sum, draft_row, d_max,
+                              d_sum, vocab_size, s_rand);
+    if (threadIdx.x == 0) {
+      tokens[i] = res;
+      *num_tokens = i + 1;
+    }
+    return;
+  }
+}
+
+template <typename T>
+void launch_speculative_sample(const T *logits, int *token, int vocab_size,
+                               bool greedy, unsigned long long seed,
+                               unsigned long long counter,
+                               cudaStream_t stream) {
+  ker_speculative_sample<T><<<1, MAX_THREADS, 0, stream>>>(
+      logits, token, vocab_size, greedy, seed, counter);
+}
+
+template void launch_speculative_sample<float>(
+    const float *logits, int *token, int vocab_size, bool greedy,
+    unsigned long long seed, unsigned long long counter, cudaStream_t stream);
+template void launch_speculative_sample<__half>(
+    const __half *logits, int *token, int vocab_size, bool greedy,
+    unsigned long long seed, unsigned long long counter, cudaStream_t stream);
+template void launch_speculative_sample<__nv_bfloat16>(
+    const __nv_bfloat16 *logits, int *token, int vocab_size, bool greedy,
+    unsigned long long seed, unsigned long long counter, cudaStream_t stream);
+
+template <typename T>
+void launch_speculative_verify(const T *target_logits, const T *draft_logits,
+                               int *tokens, int *num_tokens, int num_draft,
+                               int vocab_size, bool greedy,
+                               unsigned long long seed,
+                               unsigned long long counter,
+                               cudaStream_t stream) {
+  ker_speculative_verify<T><<<1, MAX_THREADS, 0, stream>>>(
+      target_logits, draft_logits, tokens, num_tokens, num_draft, vocab_size,
+      greedy, seed, counter);
+}
+
+template void launch_speculative_verify<float>(
+    const float *target_logits, const float *draft_logits, int *tokens,
+    int *num_tokens, int num_draft, int vocab_size, bool greedy,
+    unsigned long long seed, unsigned long long counter, cudaStream_t stream);
+template void launch_speculative_verify<__half>(
+    const __half *target_logits, const __half *draft_logits, int *tokens,
+    int *num_tokens, int num_draft, int vocab_size, bool greedy,
+    unsigned long long seed, unsigned long long counter, cudaStream_t stream);
+template void launch_speculative_verify<__nv_bfloat16>(
+    const __nv_bfloat16 *target_logits, const __nv_bfloat16 *draft_logits,
+    int *tokens, int *num_tokens, int num_draft, int vocab_size, bool greedy,
+    unsigned long long seed, unsigned long long counter, cudaStream_t stream);
+
+}  // namespace cuda
+}  // namespace lightseq
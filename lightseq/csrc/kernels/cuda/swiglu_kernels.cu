@@ -0,0 +1,227 @@
+#include "common.h"
+#include "kernels.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+// The same tiling as ker_weight_only_gemv: every thread reads 4 adjacent
+// gate columns and the 4 up columns inner_dim after them, the warps of a
+// block split the rows and are reduced in shared memory.
+const int kSwColsPerThread = 4;
+const int kSwWarps = 16;
+const int kSwBlockCols = WARP_SIZE * kSwColsPerThread;
+
+template <int kBits>
+__forceinline__ __device__ int unpack_weight(int8_t q, int r) {
+  if (kBits == 8) return q;
+  return r == 0 ? (int8_t)(q << 4) >> 4 : q >> 4;
+}
+
+// The weights of the kBits ? 8 / kBits : 1 rows stored in row lrow of weight,
+// in columns [col, col + kSwColsPerThread). kBits 0 is a weight of T,
+// otherwise lrow packs quantized rows as in launch_weight_only_gemv.
+template <typename T, int kBits>
+__forceinline__ __device__ void load_weight(const void *weight,
+                                            const T *scale, int lrow,
+                                            int col, int ld, int group_size,
+                                            float (*w)[kSwColsPerThread]) {
+  if (kBits == 0) {
+    const T *row = static_cast<const T *>(weight) + (size_t)lrow * ld + col;
+#pragma unroll
+    for (int c = 0; c < kSwColsPerThread; c++) w[0][c] = float(row[c]);
+    return;
+  }
+  const int kRowsPerLoad = kBits ? 8 / kBits : 1;
+  char4 q4 = *reinterpret_cast<const char4 *>(
+      static_cast<const int8_t *>(weight) + (size_t)lrow * ld + col);
+  int8_t q[kSwColsPerThread] = {q4.x, q4.y, q4.z, q4.w};
+  const T *row_scale =
+      scale + (size_t)(lrow * kRowsPerLoad / group_size) * ld + col;
+#pragma unroll
+  for (int c = 0; c < kSwColsPerThread; c++) {
+    float s = float(row_scale[c]);
+#pragma unroll
+    for (int r = 0; r < kRowsPerLoad; r++) {
+      w[r][c] = unpack_weight<kBits>(q[c], r) * s;
+    }
+  }
+}
+
+}  // namespace
+
+/**
+@brief: ker_gemv_swiglu
+out = SiLU(inp * gate) * (inp * up) for a few tokens, where the gate_up
+weight is [gate, up] along the columns. Both halves are computed by the same
+thread, so the [batch_tokens, 2 * inner_dim] gate_up output is never written.
+
+@thread
+gridDim.x = ceil(inner_dim / kSwBlockCols)
+gridDim.y = ceil(batch_tokens / kTokens)
+blockDim.x = WARP_SIZE
+blockDim.y = kSwWarps
+
+@param
+inp: [batch_tokens, in_dim]
+weight: [in_dim, 2 * inner_dim] of T when kBits is 0, otherwise
+  [in_dim * kBits / 8, 2 * inner_dim] of int8
+scale: [in_dim / group_size, 2 * inner_dim], quantized weight only
+out: [batch_tokens, inner_dim]
+*/
+template <typename T, int kTokens, int kBits>
+__global__ void ker_gemv_swiglu(const T *inp, const void *weight,
+                                const T *scale, T *out, int batch_tokens,
+                                int in_dim, int inner_dim, int group_size) {
+  const int kRowsPerLoad = kBits ? 8 / kBits : 1;
+  int ld = 2 * inner_dim;
+  int block_col = blockIdx.x * kSwBlockCols;
+  int col = block_col + threadIdx.x * kSwColsPerThread;
+  int token_begin = blockIdx.y * kTokens;
+  int tile_tokens = min(kTokens, batch_tokens - token_begin);
+  const T *tile_inp = inp + (size_t)token_begin * in_dim;
+
+  // acc[0] is the gate, acc[1] the up projection.
+  float acc[2][kTokens][kSwColsPerThread];
+#pragma unroll
+  for (int h = 0; h < 2; h++) {
+#pragma unroll
+    for (int t = 0; t < kTokens; t++) {
+#pragma unroll
+      for (int c = 0; c < kSwColsPerThread; c++) acc[h][t][c] = 0.f;
+    }
+  }
+
+  if (col < inner_dim) {
+#pragma unroll 4
+    for (int lrow = threadIdx.y; lrow < in_dim / kRowsPerLoad;
+         lrow += kSwWarps) {
+      float w[2][kRowsPerLoad][kSwColsPerThread];
+      load_weight<T, kBits>(weight, scale, lrow, col, ld, group_size, w[0]);
+      load_weight<T, kBits>(weight, scale, lrow, col + inner_dim, ld,
+                            group_size, w[1]);
+#pragma unroll
+      for (int r = 0; r < kRowsPerLoad; r++) {
+#pragma unroll
+        for (int t = 0; t < kTokens; t++) {
+          if (t >= tile_tokens) break;
+          float x =
+              float(tile_inp[(size_t)t * in_dim + lrow * kRowsPerLoad + r]);
+#pragma unroll
+          for (int h = 0; h < 2; h++) {
+#pragma unroll
+            for (int c = 0; c < kSwColsPerThread; c++) {
+              acc[h][t][c] += x * w[h][r][c];
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // the halves are reduced one after the other to keep shared memory small.
+  __shared__ float s_acc[kSwWarps][kTokens][kSwBlockCols];
+  __shared__ float s_gate[kTokens][kSwBlockCols];
+#pragma unroll
+  for (int h = 0; h < 2; h++) {
+#pragma unroll
+    for (int t = 0; t < kTokens; t++) {
+#pragma unroll
+      for (int c = 0; c < kSwColsPerThread; c++) {
+        s_acc[threadIdx.y][t][threadIdx.x * kSwColsPerThread + c] =
+            acc[h][t][c];
+      }
+    }
+    __syncthreads();
+
+    for (int idx = threadIdx.y * WARP_SIZE + threadIdx.x;
+         idx < kTokens * kSwBlockCols; idx += kSwWarps * WARP_SIZE) {
+      int t = idx / kSwBlockCols, c = idx % kSwBlockCols;
+      if (t >= tile_tokens || block_col + c >= inner_dim) continue;
+      float sum = 0.f;
+#pragma unroll
+      for (int w = 0; w < kSwWarps; w++) sum += s_acc[w][t][c];
+      if (h == 0) {
+        s_gate[t][c] = sum;
+      } else {
+        float gate = s_gate[t][c];
+        out[(size_t)(token_begin + t) * inner_dim + block_col + c] =
+            T(gate / (1.f + __expf(-gate)) * sum);
+      }
+    }
+    __syncthreads();
+  }
+}
+
+template <typename T, int kBits>
+void launch_gemv_swiglu_bits(const T *inp, const void *weight, const T *scale,
+                             T *out, int batch_tokens, int in_dim,
+                             int inner_dim, int group_size,
+                             cudaStream_t stream) {
+  dim3 block_dim(WARP_SIZE, kSwWarps);
+  int col_blocks = (inner_dim + kSwBlockCols - 1) / kSwBlockCols;
+  if (batch_tokens == 1) {
+    ker_gemv_swiglu<T, 1, kBits><<<col_blocks, block_dim, 0, stream>>>(
+        inp, weight, scale, out, batch_tokens, in_dim, inner_dim, group_size);
+  } else if (batch_tokens == 2) {
+    ker_gemv_swiglu<T, 2, kBits><<<col_blocks, block_dim, 0, stream>>>(
+        inp, weight, scale, out, batch_tokens, in_dim, inner_dim, group_size);
+  } else {
+    dim3 grid_dim(col_blocks, (batch_tokens + 3) / 4);
+    ker_gemv_swiglu<T, 4, kBits><<<grid_dim, block_dim, 0, stream>>>(
+        inp, weight, scale, out, batch_tokens, in_dim, inner_dim, group_size);
+  }
+}
+
+template <typename T>
+void launch_gemv_swiglu(const T *inp, const T *weight, T *out,
+                        int batch_tokens, int in_dim, int inner_dim,
+                        cudaStream_t stream) {
+  launch_gemv_swiglu_bits<T, 0>(inp, weight, (const T *)nullptr, out,
+                                batch_tokens, in_dim, inner_dim, in_dim,
+                                stream);
+}
+
+template void launch_gemv_swiglu<float>(const float *inp, const float *weight,
+                                        float *out, int batch_tokens,
+                                        int in_dim, int inner_dim,
+                                        cudaStream_t stream);
+template void launch_gemv_swiglu<__half>(const __half *inp,
+                                         const __half *weight, __half *out,
+                                         int batch_tokens, int in_dim,
+                                         int inner_dim, cudaStream_t stream);
+template void launch_gemv_swiglu<__nv_bfloat16>(
+    const __nv_bfloat16 *inp, const __nv_bfloat16 *weight, __nv_bfloat16 *out,
+    int batch_tokens, int in_dim, int inner_dim, cudaStream_t stream);
+
+template <typename T>
+void launch_weight_only_gemv_swiglu(const T *inp, const int8_t *qweight,
+                                    const T *scale, T *out, int batch_tokens,
+                                    int in_dim, int inner_dim, int quant_bits,
+                                    int group_size, cudaStream_t stream) {
+  if (quant_bits == 4) {
+    launch_gemv_swiglu_bits<T, 4>(inp, qweight, scale, out, batch_tokens,
+                                  in_dim, inner_dim, group_size, stream);
+  } else {
+    launch_gemv_swiglu_bits<T, 8>(inp, qweight, scale, out, batch_tokens,
+                                  in_dim, inner_dim, group_size, stream);
+  }
+}
+
+template void launch_weight_only_gemv_swiglu<float>(
+    const float *inp, const int8_t *qweight, const float *scale, float *out,
+    int batch_tokens, int in_dim, int inner_dim, int quant_bits,
+    int group_size, cudaStream_t stream);
+template void launch_weight_only_gemv_swiglu<__half>(
+    const __half *inp, const int8_t *qweight, const __half *scale,
+    __half *out, int batch_tokens, int in_dim, int inner_dim, int quant_bits,
+    int group_size, cudaStream_t stream);
+template void launch_weight_only_gemv_swiglu<__nv_bfloat16>(
+    const __nv_bfloat16 *inp, const int8_t *qweight,
+    const __nv_bfloat16 *scale, __nv_bfloat16 *out, int batch_tokens,
+    int in_dim, int inner_dim, int quant_bits, int group_size,
+    cudaStream_t stream);
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -19,6 +19,11 @@ bool check_divide_float4<__half>(int sz) {
   return !(sz & 7);  // sz % 8 == 0
 }
 
+template <>
+bool check_divide_float4<__nv_bfloat16>(int sz) {
+  return !(sz & 7);  // sz % 8 == 0
+}
+
 template <typename T>
 void divide_float4(int *sz) {
   if ((*sz) % 4 != 0) {
@@ -35,6 +40,14 @@ void divide_float4<__half>(int *sz) {
   (*sz) >>= 3;
 }
 
+template <>
+void divide_float4<__nv_bfloat16>(int *sz) {
+  if ((*sz) % 8 != 0) {
+    throw std::runtime_error("size need to be a multiple of 8 when use float4");
+  }
+  (*sz) >>= 3;
+}
+
 /**
 @brief: transform_0213
 transform a tensor from
@@ -102,6 +115,9 @@ template void launch_transform_0213<float>(const float *input, float *output,
 template void launch_transform_0213<__half>(const __half *input, __half *output,
                                             int sz0, int sz1, int sz2, int sz3,
                                             cudaStream_t stream);
+template void launch_transform_0213<__nv_bfloat16>(
+    const __nv_bfloat16 *input, __nv_bfloat16 *output, int sz0, int sz1,
+    int sz2, int sz3, cudaStream_t stream);
 
 /**
 @brief: bias_add_transform_20314
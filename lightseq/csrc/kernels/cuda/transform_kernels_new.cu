@@ -2,8 +2,11 @@
 #include <cub/block/block_scan.cuh>
 #include <cub/block/block_store.cuh>
 
+#include "block_reduce.h"
 #include "kernels.h"
+#include "cuda_util.h"
 #include "cstdio"
+#include <algorithm>
 
 using namespace cub;
 
@@ -281,5 +284,244 @@ __global__ void transform_20314_bwd_new(T *output, const T *q_inp,
   else
     res4[trg_offset] = q_inp4[offset];
 }
+
+// threads of the blocks of ker_varlen_offsets.
+const int kVarlenThreads = 256;
+
+/**
+@brief: ker_varlen_offsets
+The packed layout of the non-padding tokens of a [batch_size, seq_len]
+batch, see launch_varlen_offsets. Every block counts the tokens of the
+sequences before its own for its offset, then ranks its tokens with a block
+scan.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = kVarlenThreads
+
+@param
+tokens: [batch_size, seq_len]
+cu_seqlens: [batch_size + 1]
+packed_to_padded: [valid_tokens], the padded position of every packed token
+*/
+__global__ void ker_varlen_offsets(const int *tokens, int *cu_seqlens,
+                                   int *packed_to_padded, int seq_len,
+                                   int padding_id) {
+  typedef BlockScan<int, kVarlenThreads> Scan;
+  __shared__ typename Scan::TempStorage ts_scan;
+  __shared__ int s_offset;
+  int batch_id = blockIdx.x;
+
+  int count = 0;
+  for (int i = threadIdx.x; i < batch_id * seq_len; i += kVarlenThreads) {
+    count += tokens[i] != padding_id;
+  }
+  int prefix, offset;
+  Scan(ts_scan).ExclusiveSum(count, prefix, offset);
+  if (threadIdx.x == 0) s_offset = offset;
+  if (batch_id == 0 && threadIdx.x == 0) cu_seqlens[0] = 0;
+  __syncthreads();
+
+  const int *seq_tokens = tokens + batch_id * seq_len;
+  for (int start = 0; start < seq_len; start += kVarlenThreads) {
+    int pos = start + threadIdx.x;
+    int valid = pos < seq_len && seq_tokens[pos] != padding_id;
+    int rank, chunk_count;
+    Scan(ts_scan).ExclusiveSum(valid, rank, chunk_count);
+    if (valid) packed_to_padded[s_offset + rank] = batch_id * seq_len + pos;
+    __syncthreads();
+    if (threadIdx.x == 0) s_offset += chunk_count;
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) cu_seqlens[batch_id + 1] = s_offset;
+}
+
+void launch_varlen_offsets(const int *tokens, int *cu_seqlens,
+                           int *packed_to_padded, int batch_size, int seq_len,
+                           int padding_id, cudaStream_t stream) {
+  ker_varlen_offsets<<<batch_size, kVarlenThreads, 0, stream>>>(
+      tokens, cu_seqlens, packed_to_padded, seq_len, padding_id);
+}
+
+/**
+@brief: ker_remove_padding
+Gather the rows of the non-padding tokens, or scatter them back when
+rebuild.
+
+@thread
+gridDim.x = ceil(valid_tokens * hidden_dim / 4 / MAX_THREADS)
+blockDim.x = MAX_THREADS
+
+@param
+padded: [batch_size * seq_len, hidden_dim]
+packed: [valid_tokens, hidden_dim]
+*/
+template <bool rebuild>
+__global__ void ker_remove_padding(const float4 *inp, float4 *out,
+                                   const int *packed_to_padded,
+                                   int valid_tokens, int hidden_dim) {
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= valid_tokens * hidden_dim) return;
+  int token = idx / hidden_dim, dim = idx % hidden_dim;
+  size_t padded_idx = (size_t)packed_to_padded[token] * hidden_dim + dim;
+  if (rebuild) {
+    out[padded_idx] = inp[idx];
+  } else {
+    out[idx] = inp[padded_idx];
+  }
+}
+
+template <typename T>
+void launch_remove_padding(const T *inp, T *out, const int *packed_to_padded,
+                           int valid_tokens, int hidden_dim,
+                           cudaStream_t stream) {
+  if (hidden_dim * sizeof(T) % sizeof(float4) != 0) {
+    throw std::runtime_error("violate hidden_dim * sizeof(T) % 16 = 0");
+  }
+  hidden_dim = hidden_dim * sizeof(T) / sizeof(float4);
+  int nblock = (valid_tokens * hidden_dim + MAX_THREADS - 1) / MAX_THREADS;
+  ker_remove_padding<false><<<nblock, MAX_THREADS, 0, stream>>>(
+      (const float4 *)inp, (float4 *)out, packed_to_padded, valid_tokens,
+      hidden_dim);
+}
+
+template <typename T>
+void launch_rebuild_padding(const T *inp, T *out, const int *packed_to_padded,
+                            int valid_tokens, int batch_tokens, int hidden_dim,
+                            cudaStream_t stream) {
+  if (hidden_dim * sizeof(T) % sizeof(float4) != 0) {
+    throw std::runtime_error("violate hidden_dim * sizeof(T) % 16 = 0");
+  }
+  // the padding tokens are zeros.
+  CHECK_GPU_ERROR(cudaMemsetAsync(
+      out, 0, (size_t)batch_tokens * hidden_dim * sizeof(T), stream));
+  hidden_dim = hidden_dim * sizeof(T) / sizeof(float4);
+  int nblock = (valid_tokens * hidden_dim + MAX_THREADS - 1) / MAX_THREADS;
+  ker_remove_padding<true><<<nblock, MAX_THREADS, 0, stream>>>(
+      (const float4 *)inp, (float4 *)out, packed_to_padded, valid_tokens,
+      hidden_dim);
+}
+
+template void launch_remove_padding<float>(const float *inp, float *out,
+                                           const int *packed_to_padded,
+                                           int valid_tokens, int hidden_dim,
+                                           cudaStream_t stream);
+template void launch_remove_padding<__half>(const __half *inp, __half *out,
+                                            const int *packed_to_padded,
+                                            int valid_tokens, int hidden_dim,
+                                            cudaStream_t stream);
+template void launch_remove_padding<__nv_bfloat16>(
+    const __nv_bfloat16 *inp, __nv_bfloat16 *out, const int *packed_to_padded,
+    int valid_tokens, int hidden_dim, cudaStream_t stream);
+
+template void launch_rebuild_padding<float>(const float *inp, float *out,
+                                            const int *packed_to_padded,
+                                            int valid_tokens, int batch_tokens,
+                                            int hidden_dim,
+                                            cudaStream_t stream);
+template void launch_rebuild_padding<__half>(const __half *inp, __half *out,
+                                             const int *packed_to_padded,
+                                             int valid_tokens,
+                                             int batch_tokens, int hidden_dim,
+                                             cudaStream_t stream);
+template void launch_rebuild_padding<__nv_bfloat16>(
+    const __nv_bfloat16 *inp, __nv_bfloat16 *out, const int *packed_to_padded,
+    int valid_tokens, int batch_tokens, int hidden_dim, cudaStream_t stream);
+
+/**
+@brief: ker_sequence_pooling
+Pool the tokens of a sequence into one vector, see launch_sequence_pooling.
+The pooled vector stays in shared memory until its l2 norm is reduced.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = min(hidden_dim, MAX_THREADS) rounded up to a warp
+
+@param
+inp: [batch_size, seq_len, hidden_dim]
+tokens: [batch_size, seq_len]
+out: [batch_size, hidden_dim]
+*/
+template <typename T, typename OutT>
+__global__ void ker_sequence_pooling(const T *inp, const int *tokens,
+                                     OutT *out, int seq_len, int hidden_dim,
+                                     int padding_id, PoolingMethod method,
+                                     bool l2_norm) {
+  extern __shared__ float s_pooled[];
+  __shared__ float s_scale;
+  const T *seq_inp = inp + (size_t)blockIdx.x * seq_len * hidden_dim;
+  const int *seq_tokens = tokens + blockIdx.x * seq_len;
+
+  float sum_square[1] = {0.f};
+  for (int dim = threadIdx.x; dim < hidden_dim; dim += blockDim.x) {
+    float val;
+    if (method == PoolingMethod::kCls) {
+      val = static_cast<float>(seq_inp[dim]);
+    } else {
+      bool is_max = method == PoolingMethod::kMax;
+      val = is_max ? REDUCE_FLOAT_INF_NEG : 0.f;
+      int count = 0;
+      for (int pos = 0; pos < seq_len; pos++) {
+        if (seq_tokens[pos] == padding_id) continue;
+        float x = static_cast<float>(seq_inp[pos * hidden_dim + dim]);
+        val = is_max ? fmaxf(val, x) : val + x;
+        count++;
+      }
+      // a sequence of padding only is pooled to zeros.
+      if (count == 0) {
+        val = 0.f;
+      } else if (!is_max) {
+        val /= count;
+      }
+    }
+    s_pooled[dim] = val;
+    sum_square[0] += val * val;
+  }
+
+  if (l2_norm) {
+    blockReduce<ReduceType::kSum, 1>(sum_square);
+    if (threadIdx.x == 0) s_scale = rsqrtf(fmaxf(sum_square[0], 1e-12f));
+  }
+  __syncthreads();
+
+  OutT *seq_out = out + (size_t)blockIdx.x * hidden_dim;
+  for (int dim = threadIdx.x; dim < hidden_dim; dim += blockDim.x) {
+    float val = s_pooled[dim];
+    seq_out[dim] = static_cast<OutT>(l2_norm ? val * s_scale : val);
+  }
+}
+
+template <typename T, typename OutT>
+void launch_sequence_pooling(const T *inp, const int *tokens, OutT *out,
+                             int batch_size, int seq_len, int hidden_dim,
+                             int padding_id, PoolingMethod method,
+                             bool l2_norm, cudaStream_t stream) {
+  int nthread = std::min(hidden_dim, MAX_THREADS);
+  nthread = (nthread + WARP_SIZE - 1) / WARP_SIZE * WARP_SIZE;
+  ker_sequence_pooling<T, OutT>
+      <<<batch_size, nthread, hidden_dim * sizeof(float), stream>>>(
+          inp, tokens, out, seq_len, hidden_dim, padding_id, method, l2_norm);
+}
+
+template void launch_sequence_pooling<float, float>(
+    const float *inp, const int *tokens, float *out, int batch_size,
+    int seq_len, int hidden_dim, int padding_id, PoolingMethod method,
+    bool l2_norm, cudaStream_t stream);
+template void launch_sequence_pooling<float, __half>(
+    const float *inp, const int *tokens, __half *out, int batch_size,
+    int seq_len, int hidden_dim, int padding_id, PoolingMethod method,
+    bool l2_norm, cudaStream_t stream);
+template void launch_sequence_pooling<__half, __half>(
+    const __half *inp, const int *tokens, __half *out, int batch_size,
+    int seq_len, int hidden_dim, int padding_id, PoolingMethod method,
+    bool l2_norm, cudaStream_t stream);
+template void launch_sequence_pooling<__nv_bfloat16, __nv_bfloat16>(
+    const __nv_bfloat16 *inp, const int *tokens, __nv_bfloat16 *out,
+    int batch_size, int seq_len, int hidden_dim, int padding_id,
+    PoolingMethod method, bool l2_norm, cudaStream_t stream);
+template void launch_sequence_pooling<__nv_bfloat16, __half>(
+    const __nv_bfloat16 *inp, const int *tokens, __half *out, int batch_size,
+    int seq_len, int hidden_dim, int padding_id, PoolingMethod method,
+    bool l2_norm, cudaStream_t stream);
 }  // namespace cuda
 }  // namespace lightseq
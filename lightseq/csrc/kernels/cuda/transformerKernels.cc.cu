@@ -294,6 +294,14 @@ template void select_beam_rough_topk_launcher<__half>(
     int max_thread_per_block, cudaStream_t stream, int beam_size,
     float diverse_lambda, int end_id);
 
+template void select_beam_rough_topk_launcher<__nv_bfloat16>(
+    const __nv_bfloat16* logits, const __nv_bfloat16* logit_bias,
+    const float* seq_probs, const float* seq_score, const int* alive_seq,
+    int* can_idx, float* can_score, int* num_beam_can, int vocab_size,
+    int max_step, float length_norm, int cur_step, int step_token_num,
+    int max_thread_per_block, cudaStream_t stream, int beam_size,
+    float diverse_lambda, int end_id);
+
 /**
 @brief: ker_diverse_beam_search
 Add different diverse score to can_score in each beam
@@ -341,6 +349,312 @@ void ker_diverse_beam_search_launcher(float* can_score, int* can_ids,
       can_score, can_ids, num_beam_can, beam_size, diverse_lambda, vocab_size);
 }
 
+const int kBeamTopkThreads = 256;
+
+/**
+@brief: ker_beam_search_topk_stage1
+one block for one beam, select the exact top beam_size tokens of the beam
+and compute the length penalized score of the sequences ended with them, in
+one pass over the logits. A finished beam only keeps its EOS candidate.
+
+@thread
+gridDim.x = batch_size * beam_size
+blockDim.x = kBeamTopkThreads
+
+@param
+logits: [batch_size, beam_size, vocab_size], cur step logit
+logit_bias: [vocab_size], logit bias
+seq_probs: [batch_size, beam_size], prefix sequence log probability
+seq_score: [batch_size, beam_size], prefix sequence score
+alive_seq: [batch_size, beam_size, max_step], prefix sequence id
+beam_topk_score: [batch_size, beam_size, beam_size], score of the candidates
+    with the batch offset like select_beam_rough_topk
+beam_topk_idx: [batch_size, beam_size, beam_size],
+    can_beam_id * vocab_size + vocab_id of the candidates
+*/
+template <typename T, int beam_size>
+__global__ void ker_beam_search_topk_stage1(
+    const T* logits, const T* logit_bias, const float* seq_probs,
+    const float* seq_score, const int* alive_seq, float* beam_topk_score,
+    int* beam_topk_idx, int vocab_size, int max_step, float length_norm,
+    int cur_step, int end_id) {
+  typedef cub::BlockReduce<cub::KeyValuePair<int, float>, kBeamTopkThreads>
+      BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+  __shared__ float s_max_logit, s_log_prob_base;
+  __shared__ int s_winner;
+
+  int batch_id = blockIdx.x / beam_size;
+  int beam_offset = (blockIdx.x % beam_size) * vocab_size;
+  float* out_score = beam_topk_score + blockIdx.x * beam_size;
+  int* out_idx = beam_topk_idx + blockIdx.x * beam_size;
+
+  if (cur_step != 0 && alive_seq[blockIdx.x * max_step + cur_step] == end_id) {
+    // this is a finished beam, its score will not be changed
+    for (int i = threadIdx.x; i < beam_size; i += blockDim.x) {
+      out_score[i] = i == 0 ? seq_score[blockIdx.x] : CUDA_FLOAT_INF_NEG;
+      out_idx[i] = end_id + beam_offset;
+    }
+    return;
+  }
+
+  /* step1: every thread keeps the sorted top beam_size logits of its tokens,
+   * the max logit and the sum of exp logit relative to it */
+  const T* beam_logits = logits + blockIdx.x * vocab_size;
+  float top_val[beam_size];
+  int top_idx[beam_size];
+#pragma unroll
+  for (int k = 0; k < beam_size; k++) {
+    top_val[k] = CUDA_FLOAT_INF_NEG;
+    top_idx[k] = -1;
+  }
+  float thread_max = CUDA_FLOAT_INF_NEG;
+  float thread_sum = 0.f;
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x) {
+    float lgt = (float)beam_logits[i] + (float)__ldg(&logit_bias[i]);
+    if (lgt > thread_max) {
+      thread_sum = thread_sum * expf(thread_max - lgt) + 1.f;
+      thread_max = lgt;
+    } else {
+      thread_sum += expf(lgt - thread_max);
+    }
+    if (lgt > top_val[beam_size - 1]) {
+      int k = beam_size - 1;
+      for (; k > 0 && top_val[k - 1] < lgt; k--) {
+        top_val[k] = top_val[k - 1];
+        top_idx[k] = top_idx[k - 1];
+      }
+      top_val[k] = lgt;
+      top_idx[k] = i;
+    }
+  }
+
+  /* step2: log softmax base of the beam */
+  float max_logit = blockReduceMax(thread_max);
+  if (threadIdx.x == 0) s_max_logit = max_logit;
+  __syncthreads();
+  float sum_exp_logit = blockReduceSum(
+      thread_sum > 0.f ? thread_sum * expf(thread_max - s_max_logit) : 0.f);
+  if (threadIdx.x == 0) {
+    s_log_prob_base = seq_probs[blockIdx.x] - logf(sum_exp_logit) - s_max_logit;
+  }
+
+  /* step3: merge the thread top k, one token per round */
+  int head = 0;
+  for (int k = 0; k < beam_size; k++) {
+    cub::KeyValuePair<int, float> cand(
+        head < beam_size ? top_idx[head] : -1,
+        head < beam_size ? top_val[head] : CUDA_FLOAT_INF_NEG);
+    cub::KeyValuePair<int, float> best =
+        BlockReduce(temp_storage).Reduce(cand, cub::ArgMax());
+    if (threadIdx.x == 0) {
+      s_winner = best.key;
+      out_score[k] = best.key < 0 ? CUDA_FLOAT_INF_NEG
+                                  : fmaxf((best.value + s_log_prob_base) *
+                                              length_norm,
+                                          min_log_probability + 1.f) +
+                                        batch_id * min_log_probability;
+      out_idx[k] = best.key < 0 ? end_id + beam_offset : best.key + beam_offset;
+    }
+    __syncthreads();
+    if (head < beam_size && top_idx[head] == s_winner && s_winner >= 0) head++;
+  }
+}
+
+/**
+@brief: ker_beam_search_topk_stage2
+one block for one batch item, select the top beam_size candidates among the
+beam_size * beam_size of stage1, sorted in descending order of score. The
+candidate layout is the one ker_refresh_result and ker_refresh_cache read
+after the sort of the rough topk candidates.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = kBeamTopkThreads
+
+@param
+beam_topk_score: [batch_size, beam_size, beam_size]
+beam_topk_idx: [batch_size, beam_size, beam_size]
+can_idx: [batch_size, beam_size]
+can_score: [batch_size, beam_size]
+num_beam_can: [1 + batch_size * beam_size], the exclusive scan of one
+    candidate per beam
+*/
+template <int beam_size>
+__global__ void ker_beam_search_topk_stage2(const float* beam_topk_score,
+                                            const int* beam_topk_idx,
+                                            int* can_idx, float* can_score,
+                                            int* num_beam_can) {
+  typedef cub::BlockReduce<cub::KeyValuePair<int, float>, kBeamTopkThreads>
+      BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+  __shared__ float s_score[beam_size * beam_size];
+  __shared__ bool s_taken[beam_size * beam_size];
+
+  const int num_can = beam_size * beam_size;
+  const float* batch_score = beam_topk_score + blockIdx.x * num_can;
+  const int* batch_idx = beam_topk_idx + blockIdx.x * num_can;
+  for (int i = threadIdx.x; i < num_can; i += blockDim.x) {
+    s_score[i] = batch_score[i];
+    s_taken[i] = false;
+  }
+  __syncthreads();
+
+  // every beam has at least one candidate, so there are beam_size to take
+  for (int k = 0; k < beam_size; k++) {
+    cub::KeyValuePair<int, float> cand(-1, CUDA_FLOAT_INF_NEG);
+    for (int i = threadIdx.x; i < num_can; i += blockDim.x) {
+      if (!s_taken[i] && (cand.key < 0 || s_score[i] > cand.value)) {
+        cand.key = i;
+        cand.value = s_score[i];
+      }
+    }
+    cub::KeyValuePair<int, float> best =
+        BlockReduce(temp_storage).Reduce(cand, cub::ArgMax());
+    if (threadIdx.x == 0) {
+      int pos = blockIdx.x * beam_size + k;
+      can_score[pos] = best.value;
+      can_idx[pos] = batch_idx[best.key];
+      num_beam_can[pos + 1] = pos;
+      s_taken[best.key] = true;
+    }
+    __syncthreads();
+  }
+}
+
+template <typename T, int beam_size>
+void beam_search_topk_launcher_k(const T* logits, const T* logit_bias,
+                                 const float* seq_probs,
+                                 const float* seq_score, const int* alive_seq,
+                                 float* beam_topk_score, int* beam_topk_idx,
+                                 int* can_idx, float* can_score,
+                                 int* num_beam_can, int vocab_size,
+                                 int max_step, float length_norm, int cur_step,
+                                 int batch_size, cudaStream_t stream,
+                                 int end_id) {
+  ker_beam_search_topk_stage1<T, beam_size>
+      <<<batch_size * beam_size, kBeamTopkThreads, 0, stream>>>(
+          logits, logit_bias, seq_probs, seq_score, alive_seq,
+          beam_topk_score, beam_topk_idx, vocab_size, max_step, length_norm,
+          cur_step, end_id);
+  ker_beam_search_topk_stage2<beam_size>
+      <<<batch_size, kBeamTopkThreads, 0, stream>>>(
+          beam_topk_score, beam_topk_idx, can_idx, can_score, num_beam_can);
+}
+
+template <typename T>
+void beam_search_topk_launcher(const T* logits, const T* logit_bias,
+                               const float* seq_probs, const float* seq_score,
+                               const int* alive_seq, float* beam_topk_score,
+                               int* beam_topk_idx, int* can_idx,
+                               float* can_score, int* num_beam_can,
+                               int vocab_size, int max_step,
+                               float length_norm, int cur_step,
+                               int batch_size, cudaStream_t stream,
+                               int beam_size, int end_id) {
+  if (beam_size == 1)
+    beam_search_topk_launcher_k<T, 1>(
+        logits, logit_bias, seq_probs, seq_score, alive_seq, beam_topk_score,
+        beam_topk_idx, can_idx, can_score, num_beam_can, vocab_size, max_step,
+        length_norm, cur_step, batch_size, stream, end_id);
+  if (beam_size == 2)
+    beam_search_topk_launcher_k<T, 2>(
+        logits, logit_bias, seq_probs, seq_score, alive_seq, beam_topk_score,
+        beam_topk_idx, can_idx, can_score, num_beam_can, vocab_size, max_step,
+        length_norm, cur_step, batch_size, stream, end_id);
+  if (beam_size == 4)
+    beam_search_topk_launcher_k<T, 4>(
+        logits, logit_bias, seq_probs, seq_score, alive_seq, beam_topk_score,
+        beam_topk_idx, can_idx, can_score, num_beam_can, vocab_size, max_step,
+        length_norm, cur_step, batch_size, stream, end_id);
+  if (beam_size == 8)
+    beam_search_topk_launcher_k<T, 8>(
+        logits, logit_bias, seq_probs, seq_score, alive_seq, beam_topk_score,
+        beam_topk_idx, can_idx, can_score, num_beam_can, vocab_size, max_step,
+        length_norm, cur_step, batch_size, stream, end_id);
+  if (beam_size == 16)
+    beam_search_topk_launcher_k<T, 16>(
+        logits, logit_bias, seq_probs, seq_score, alive_seq, beam_topk_score,
+        beam_topk_idx, can_idx, can_score, num_beam_can, vocab_size, max_step,
+        length_norm, cur_step, batch_size, stream, end_id);
+  if (beam_size == 32)
+    beam_search_topk_launcher_k<T, 32>(
+        logits, logit_bias, seq_probs, seq_score, alive_seq, beam_topk_score,
+        beam_topk_idx, can_idx, can_score, num_beam_can, vocab_size, max_step,
+        length_norm, cur_step, batch_size, stream, end_id);
+}
+
+template void beam_search_topk_launcher<float>(
+    const float* logits, const float* logit_bias, const float* seq_probs,
+    const float* seq_score, const int* alive_seq, float* beam_topk_score,
+    int* beam_topk_idx, int* can_idx, float* can_score, int* num_beam_can,
+    int vocab_size, int max_step, float length_norm, int cur_step,
+    int batch_size, cudaStream_t stream, int beam_size, int end_id);
+
+template void beam_search_topk_launcher<__half>(
+    const __half* logits, const __half* logit_bias, const float* seq_probs,
+    const float* seq_score, const int* alive_seq, float* beam_topk_score,
+    int* beam_topk_idx, int* can_idx, float* can_score, int* num_beam_can,
+    int vocab_size, int max_step, float length_norm, int cur_step,
+    int batch_size, cudaStream_t stream, int beam_size, int end_id);
+
+template void beam_search_topk_launcher<__nv_bfloat16>(
+    const __nv_bfloat16* logits, const __nv_bfloat16* logit_bias,
+    const float* seq_probs, const float* seq_score, const int* alive_seq,
+    float* beam_topk_score, int* beam_topk_idx, int* can_idx,
+    float* can_score, int* num_beam_can, int vocab_size, int max_step,
+    float length_norm, int cur_step, int batch_size, cudaStream_t stream,
+    int beam_size, int end_id);
+
+/**
+@brief: ker_prune_beams
+beam pruning by score margin, on the sorted candidates of every batch item
+ker_refresh_result reads: the candidate which trails the best one of its
+batch item by more than min(abs_margin, rel_margin * |best score|) becomes
+the eos of its beam, with a score below all the candidates of the batch item
+and above the ones of the next. So the pruned beams finish, never win the
+final selection and count for the early stop.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = beam_size
+
+@param
+can_idx: [none], candidate beam_id * vocab_size + vocab_id
+can_score: [none], with the batch offset
+num_can_per_beam: [batch_size * beam_size], the beam_size candidates of
+    batch item b start at num_can_per_beam[b * beam_size]
+abs_margin: the absolute score margin, <= 0 for none
+rel_margin: the score margin relative to |best score|, <= 0 for none
+*/
+__global__ void ker_prune_beams(int* can_idx, float* can_score,
+                                const int* num_can_per_beam, int vocab_size,
+                                float abs_margin, float rel_margin,
+                                int end_id) {
+  // the best candidate is never pruned
+  if (threadIdx.x == 0) return;
+  int batch_pos = num_can_per_beam[blockIdx.x * blockDim.x];
+  int can_pos = batch_pos + threadIdx.x;
+  float offset = blockIdx.x * min_log_probability;
+  float best = can_score[batch_pos] - offset;
+  float margin = fminf(
+      abs_margin > 0.f ? abs_margin : CUDA_FLOAT_INF_POS,
+      rel_margin > 0.f ? rel_margin * fabsf(best) : CUDA_FLOAT_INF_POS);
+  if (can_score[can_pos] - offset >= best - margin) return;
+  can_idx[can_pos] = can_idx[can_pos] / vocab_size * vocab_size + end_id;
+  can_score[can_pos] = min_log_probability + 0.5f + offset;
+}
+
+void ker_prune_beams_launcher(int batch_size, int beam_size,
+                              cudaStream_t stream, int* can_idx,
+                              float* can_score, const int* num_can_per_beam,
+                              int vocab_size, float abs_margin,
+                              float rel_margin, int end_id) {
+  ker_prune_beams<<<batch_size, beam_size, 0, stream>>>(
+      can_idx, can_score, num_can_per_beam, vocab_size, abs_margin,
+      rel_margin, end_id);
+}
+
 /**
 @brief: ker_bias_relu
 add bias, activated by relu
@@ -1282,6 +1596,219 @@ template void ker_correlation_softmax_encdec_launcher<__half>(
     int batch_size, int head_num_per_seq, int batch_seq_len,
     cudaStream_t stream, __half* correlation, const int* src_padding_mask);
 
+/**
+@brief: ker_quantize_encdec_kv
+quantize the projected encoder k, v of every decoder layer into int8, with
+one scale per head vector, its absmax / 127
+
+@thread
+gridDim.x = batch_size * head_num * batch_seq_len
+gridDim.y = dec_layer_num * 2
+blockDim.x = 32
+
+@param
+k, v: [batch_size, head_num, batch_seq_len, dim_per_head] per layer, with an
+  offset in offset_per_layer between layers.
+k_i8, v_i8: the same as k, v, in int8
+k_scale, v_scale: [batch_size, head_num, batch_seq_len] per layer, with an
+  offset in offset_per_layer / dim_per_head between layers.
+*/
+template <typename T>
+__global__ void ker_quantize_encdec_kv(const T* k, const T* v, int8_t* k_i8,
+                                       int8_t* v_i8, float* k_scale,
+                                       float* v_scale, int offset_per_layer,
+                                       int dim_per_head) {
+  int layer_id = blockIdx.y >> 1;
+  bool is_v = blockIdx.y & 1;
+  size_t vec_offset = (size_t)layer_id * offset_per_layer +
+                      (size_t)blockIdx.x * dim_per_head;
+  const T* src = (is_v ? v : k) + vec_offset;
+  int8_t* dst = (is_v ? v_i8 : k_i8) + vec_offset;
+
+  float absmax = 0.f;
+  for (int i = threadIdx.x; i < dim_per_head; i += blockDim.x) {
+    absmax = fmaxf(absmax, fabsf((float)src[i]));
+  }
+  absmax = warpReduceMax(absmax);
+  float inv_scale = absmax > 0.f ? 127.f / absmax : 0.f;
+  for (int i = threadIdx.x; i < dim_per_head; i += blockDim.x) {
+    float val = rintf((float)src[i] * inv_scale);
+    dst[i] = (int8_t)fminf(fmaxf(val, -127.f), 127.f);
+  }
+  if (threadIdx.x == 0) {
+    float* scale = is_v ? v_scale : k_scale;
+    scale[(size_t)layer_id * (offset_per_layer / dim_per_head) + blockIdx.x] =
+        absmax / 127.f;
+  }
+}
+
+template <typename T>
+void ker_quantize_encdec_kv_launcher(int batch_size, int dec_layer_num,
+                                     int head_num, int batch_seq_len,
+                                     int dim_per_head, cudaStream_t stream,
+                                     const T* k, const T* v, int8_t* k_i8,
+                                     int8_t* v_i8, float* k_scale,
+                                     float* v_scale, int offset_per_layer) {
+  ker_quantize_encdec_kv<T>
+      <<<dim3(batch_size * head_num * batch_seq_len, dec_layer_num * 2), 32, 0,
+         stream>>>(k, v, k_i8, v_i8, k_scale, v_scale, offset_per_layer,
+                   dim_per_head);
+}
+
+template void ker_quantize_encdec_kv_launcher<float>(
+    int batch_size, int dec_layer_num, int head_num, int batch_seq_len,
+    int dim_per_head, cudaStream_t stream, const float* k, const float* v,
+    int8_t* k_i8, int8_t* v_i8, float* k_scale, float* v_scale,
+    int offset_per_layer);
+
+template void ker_quantize_encdec_kv_launcher<__half>(
+    int batch_size, int dec_layer_num, int head_num, int batch_seq_len,
+    int dim_per_head, cudaStream_t stream, const __half* k, const __half* v,
+    int8_t* k_i8, int8_t* v_i8, float* k_scale, float* v_scale,
+    int offset_per_layer);
+
+/**
+@brief: ker_encdec_attention_i8
+the enc-dec attention of a decoding step, softmax(q * k * scaler) * v, on
+the int8 k, v of ker_quantize_encdec_kv. It reads k and v once per query,
+at half the bytes of the gemms on the half k, v.
+
+@thread
+gridDim.x = batch_size * head_num
+gridDim.y = beam_size
+blockDim.x = a multiple of 32
+dynamic shared memory: (dim_per_head + batch_seq_len) floats
+
+@param
+q: [batch_size, head_num, beam_size, dim_per_head]
+out: the same as q, or q itself
+k_i8, v_i8: [batch_size, head_num, batch_seq_len, dim_per_head]
+k_scale, v_scale: [batch_size, head_num, batch_seq_len]
+src_padding_mask: [batch_size, batch_seq_len], -inf at the pads, or nullptr
+*/
+template <typename T>
+__global__ void ker_encdec_attention_i8(const T* q, T* out,
+                                        const int8_t* k_i8,
+                                        const int8_t* v_i8,
+                                        const float* k_scale,
+                                        const float* v_scale,
+                                        const T* src_padding_mask,
+                                        int head_num, int batch_seq_len,
+                                        int dim_per_head, float scaler) {
+  extern __shared__ float s_buf[];
+  float* s_q = s_buf;
+  float* s_prob = s_buf + dim_per_head;
+  int batch_id = blockIdx.x / head_num;
+  size_t q_offset =
+      ((size_t)blockIdx.x * gridDim.y + blockIdx.y) * dim_per_head;
+  const T* q_ptr = q + q_offset;
+  size_t kv_offset = (size_t)blockIdx.x * batch_seq_len;
+  for (int i = threadIdx.x; i < dim_per_head; i += blockDim.x) {
+    s_q[i] = (float)q_ptr[i] * scaler;
+  }
+  __syncthreads();
+
+  /* step 1. the scores, a warp per source token */
+  int warp_id = threadIdx.x >> 5;
+  int lane_id = threadIdx.x & 31;
+  for (int j = warp_id; j < batch_seq_len; j += blockDim.x >> 5) {
+    const int8_t* k_vec = k_i8 + (kv_offset + j) * dim_per_head;
+    float dot = 0.f;
+    for (int i = lane_id; i < dim_per_head; i += 32) {
+      dot += s_q[i] * (float)k_vec[i];
+    }
+    dot = warpReduceSum(dot);
+    if (lane_id == 0) {
+      float score = dot * k_scale[kv_offset + j];
+      if (src_padding_mask) {
+        score += (float)src_padding_mask[batch_id * batch_seq_len + j];
+      }
+      s_prob[j] = score;
+    }
+  }
+  __syncthreads();
+
+  /* step 2. softmax, the v scales folded into the probabilities */
+  __shared__ float s_max, s_sum;
+  float max_val = CUDA_FLOAT_INF_NEG;
+  for (int j = threadIdx.x; j < batch_seq_len; j += blockDim.x) {
+    max_val = fmaxf(max_val, s_prob[j]);
+  }
+  max_val = blockReduceMax(max_val);
+  if (threadIdx.x == 0) s_max = max_val;
+  __syncthreads();
+  float sum = 0.f;
+  for (int j = threadIdx.x; j < batch_seq_len; j += blockDim.x) {
+    float prob =
+        s_prob[j] <= CUDA_FLOAT_INF_NEG ? 0.f : expf(s_prob[j] - s_max);
+    s_prob[j] = prob;
+    sum += prob;
+  }
+  sum = blockReduceSum(sum);
+  if (threadIdx.x == 0) s_sum = sum;
+  __syncthreads();
+  float inv_sum = s_sum > 0.f ? 1.f / s_sum : 0.f;
+  for (int j = threadIdx.x; j < batch_seq_len; j += blockDim.x) {
+    s_prob[j] *= inv_sum * v_scale[kv_offset + j];
+  }
+  for (int i = threadIdx.x; i < dim_per_head; i += blockDim.x) {
+    s_q[i] = 0.f;
+  }
+  __syncthreads();
+
+  /* step 3. prob * v, the source tokens split among the groups of
+   * dim_per_head threads */
+  int groups = max(blockDim.x / dim_per_head, 1);
+  int group_id = threadIdx.x / dim_per_head;
+  if (group_id < groups) {
+    for (int i = threadIdx.x % dim_per_head; i < dim_per_head;
+         i += blockDim.x) {
+      const int8_t* v_col = v_i8 + kv_offset * dim_per_head + i;
+      float acc = 0.f;
+      for (int j = group_id; j < batch_seq_len; j += groups) {
+        acc += s_prob[j] * (float)v_col[(size_t)j * dim_per_head];
+      }
+      atomicAdd(s_q + i, acc);
+    }
+  }
+  __syncthreads();
+  for (int i = threadIdx.x; i < dim_per_head; i += blockDim.x) {
+    out[q_offset + i] = (T)s_q[i];
+  }
+}
+
+template <typename T>
+void ker_encdec_attention_i8_launcher(
+    int batch_size, int head_num, int beam_size, int batch_seq_len,
+    int dim_per_head, float scaler, cudaStream_t stream, const T* q, T* out,
+    const int8_t* k_i8, const int8_t* v_i8, const float* k_scale,
+    const float* v_scale, const T* src_padding_mask) {
+  int block_dim = 256;
+  if (dim_per_head > block_dim) {
+    block_dim = (dim_per_head + 31) / 32 * 32;
+  } else {
+    block_dim = block_dim / dim_per_head * dim_per_head;
+    block_dim = block_dim / 32 * 32;
+  }
+  size_t smem_size = (dim_per_head + batch_seq_len) * sizeof(float);
+  ker_encdec_attention_i8<T>
+      <<<dim3(batch_size * head_num, beam_size), block_dim, smem_size,
+         stream>>>(q, out, k_i8, v_i8, k_scale, v_scale, src_padding_mask,
+                   head_num, batch_seq_len, dim_per_head, scaler);
+}
+
+template void ker_encdec_attention_i8_launcher<float>(
+    int batch_size, int head_num, int beam_size, int batch_seq_len,
+    int dim_per_head, float scaler, cudaStream_t stream, const float* q,
+    float* out, const int8_t* k_i8, const int8_t* v_i8, const float* k_scale,
+    const float* v_scale, const float* src_padding_mask);
+
+template void ker_encdec_attention_i8_launcher<__half>(
+    int batch_size, int head_num, int beam_size, int batch_seq_len,
+    int dim_per_head, float scaler, cudaStream_t stream, const __half* q,
+    __half* out, const int8_t* k_i8, const int8_t* v_i8, const float* k_scale,
+    const float* v_scale, const __half* src_padding_mask);
+
 /**
 @brief: ker_arrange_atten_output
 reshape Scaled Dot-Product Attention output.
@@ -1697,6 +2224,14 @@ template void ker_refresh_cache_launcher<__half>(
     int dim_per_head, int head_num, int vocab_size, int cur_step, int max_step,
     bool diverse, int end_id);
 
+template void ker_refresh_cache_launcher<__nv_bfloat16>(
+    int grid_dim_x, int grid_dim_y, int block_dim, cudaStream_t stream,
+    const int* num_can_per_beam, const int* can_idx,
+    const __nv_bfloat16* self_k_bgeem, const __nv_bfloat16* self_v_bgeem,
+    __nv_bfloat16* new_self_k_bgeem, __nv_bfloat16* new_self_v_bgeem,
+    int self_k_bgeem_offset, int beam_size, int dim_per_head, int head_num,
+    int vocab_size, int cur_step, int max_step, bool diverse, int end_id);
+
 template void ker_refresh_cache_launcher<int8_t>(
     int grid_dim_x, int grid_dim_y, int block_dim, cudaStream_t stream,
     const int* num_can_per_beam, const int* can_idx, const int8_t* self_k_bgeem,
@@ -1705,6 +2240,112 @@ template void ker_refresh_cache_launcher<int8_t>(
     int dim_per_head, int head_num, int vocab_size, int cur_step, int max_step,
     bool diverse, int end_id);
 
+/**
+@brief: ker_refresh_kv_rows
+The indirect counterpart of ker_refresh_cache: instead of copying the cached
+k, v of the parent beam, the new beam takes the row of the parent in
+kv_rows, which tells for every position of a beam the cache row holding it.
+Positions after cur_step keep the beam's own row, which is where the next
+steps write. Updated in place, every block owns the beams of a batch and
+reads a chunk of the parent rows before overwriting it.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = max_thread_per_block
+
+@param
+num_can_per_beam, can_idx: the same as ker_refresh_cache
+kv_rows: [batch_size * beam_size, max_step], the row of batch_size *
+  beam_size of the cache holding each position
+*/
+__global__ void ker_refresh_kv_rows(const int* num_can_per_beam,
+                                    const int* can_idx, int* kv_rows,
+                                    int beam_size, int vocab_size,
+                                    int cur_step, int max_step, bool diverse,
+                                    int end_id) {
+  int batch_id = blockIdx.x;
+  int chunk = blockDim.x / beam_size;
+  int beam_id = threadIdx.x / chunk;
+  bool valid = beam_id < beam_size;
+  int parent = beam_id;
+  if (valid) {
+    int can_pos = num_can_per_beam[batch_id * beam_size] + beam_id;
+    // a finished beam stays as is, as in ker_refresh_cache.
+    if (can_idx[can_pos] % vocab_size != end_id) {
+      parent = can_idx[can_pos] / vocab_size;
+      if (diverse) parent %= beam_size;
+    }
+  }
+  kv_rows += (size_t)batch_id * beam_size * max_step;
+  for (int start = 0; start <= cur_step; start += chunk) {
+    int pos = start + threadIdx.x % chunk;
+    bool in_range = valid && pos <= cur_step;
+    int row = in_range ? kv_rows[parent * max_step + pos] : 0;
+    __syncthreads();
+    if (in_range) kv_rows[beam_id * max_step + pos] = row;
+    __syncthreads();
+  }
+}
+
+void ker_refresh_kv_rows_launcher(int batch_size, int block_dim,
+                                  cudaStream_t stream,
+                                  const int* num_can_per_beam,
+                                  const int* can_idx, int* kv_rows,
+                                  int beam_size, int vocab_size, int cur_step,
+                                  int max_step, bool diverse, int end_id) {
+  ker_refresh_kv_rows<<<batch_size, block_dim, 0, stream>>>(
+      num_can_per_beam, can_idx, kv_rows, beam_size, vocab_size, cur_step,
+      max_step, diverse, end_id);
+}
+
+/**
+@brief: ker_init_kv_rows
+Every position of a row of kv_rows is in the row itself, as before any
+reorder of the beams.
+
+@thread
+gridDim.x = num_rows
+blockDim.x = max_thread_per_block
+*/
+__global__ void ker_init_kv_rows(int* kv_rows, int max_step) {
+  for (int pos = threadIdx.x; pos < max_step; pos += blockDim.x) {
+    kv_rows[(size_t)blockIdx.x * max_step + pos] = blockIdx.x;
+  }
+}
+
+void ker_init_kv_rows_launcher(int num_rows, int block_dim,
+                               cudaStream_t stream, int* kv_rows,
+                               int max_step) {
+  ker_init_kv_rows<<<num_rows, block_dim, 0, stream>>>(kv_rows, max_step);
+}
+
+/**
+@brief: ker_fork_kv_rows
+The rows of the samples of a prompt prefilled once: the prompt positions of
+row r are in the prefilled row r % prompt_rows, the later ones in the row
+itself.
+
+@thread
+gridDim.x = num_rows
+blockDim.x = max_thread_per_block
+*/
+__global__ void ker_fork_kv_rows(int* kv_rows, int prompt_rows,
+                                 int prompt_len, int max_step) {
+  int prompt_row = blockIdx.x % prompt_rows;
+  for (int pos = threadIdx.x; pos < max_step; pos += blockDim.x) {
+    kv_rows[(size_t)blockIdx.x * max_step + pos] =
+        pos < prompt_len ? prompt_row : blockIdx.x;
+  }
+}
+
+void ker_fork_kv_rows_launcher(int num_rows, int block_dim,
+                               cudaStream_t stream, int* kv_rows,
+                               int prompt_rows, int prompt_len,
+                               int max_step) {
+  ker_fork_kv_rows<<<num_rows, block_dim, 0, stream>>>(kv_rows, prompt_rows,
+                                                       prompt_len, max_step);
+}
+
 /**
 @brief: ker_write_trg_tokenid_pos_penalty
 write result from alive seq to output, for length_penlty >= 0
@@ -1825,16 +2466,23 @@ blockDim.x = max_thread_per_block
 logits: [batch_size, logits_seq_len, vocab_size]
 old_input_ids: [batch_size, batch_seq_len]
 new_input_ids: [batch_size, batch_seq_len+1]
-unfinished: [1]
+unfinished: [1], or [max_step] indexed by the step offset
 curandstate: [batch_size]
+step_offset_ptr: [1] or nullptr, the position of the last token, which
+  overrides batch_seq_len - 1, see SamplingOp::set_step_offset_ptr
 */
 template <typename T, int k>
 __global__ void ker_topk_sample(const T* logits, const T* logit_bias,
                                 int* old_input_ids, int* new_input_ids,
                                 const int vocab_size, const int prompt_len,
-                                const int max_step, const int batch_seq_len,
+                                const int max_step, int batch_seq_len,
                                 int logits_seq_len, int* unfinished,
-                                curandState* curandstate, int eos_id) {
+                                curandState* curandstate, int eos_id,
+                                const int* step_offset_ptr) {
+  if (step_offset_ptr) {
+    batch_seq_len = *step_offset_ptr + 1;
+    unfinished += *step_offset_ptr;
+  }
   int last_token_idx_in_batch = blockIdx.x * max_step + batch_seq_len - 1;
 
   /* add EOS to end if last token is EOS */
@@ -1976,37 +2624,38 @@ void ker_topk_sample_launcher(int batch_size, int batch_seq_len,
                               const T* logit_bias, int* old_input_ids,
                               int* new_input_ids, const int vocab_size,
                               const int k, int* unfinished,
-                              curandState* curandstate, int eos_id) {
+                              curandState* curandstate, int eos_id,
+                              const int* step_offset_ptr) {
   if (k == 1)
     ker_topk_sample<T, 1><<<batch_size, max_thread_per_block, 0, stream>>>(
         logits, logit_bias, old_input_ids, new_input_ids, vocab_size,
         prompt_len, max_step, batch_seq_len, logits_seq_len, unfinished,
-        curandstate, eos_id);
+        curandstate, eos_id, step_offset_ptr);
   else if (k == 2)
     ker_topk_sample<T, 2><<<batch_size, max_thread_per_block, 0, stream>>>(
         logits, logit_bias, old_input_ids, new_input_ids, vocab_size,
         prompt_len, max_step, batch_seq_len, logits_seq_len, unfinished,
-        curandstate, eos_id);
+        curandstate, eos_id, step_offset_ptr);
   else if (k == 4)
     ker_topk_sample<T, 4><<<batch_size, max_thread_per_block, 0, stream>>>(
         logits, logit_bias, old_input_ids, new_input_ids, vocab_size,
         prompt_len, max_step, batch_seq_len, logits_seq_len, unfinished,
-        curandstate, eos_id);
+        curandstate, eos_id, step_offset_ptr);
   else if (k == 8)
     ker_topk_sample<T, 8><<<batch_size, max_thread_per_block, 0, stream>>>(
         logits, logit_bias, old_input_ids, new_input_ids, vocab_size,
         prompt_len, max_step, batch_seq_len, logits_seq_len, unfinished,
-        curandstate, eos_id);
+        curandstate, eos_id, step_offset_ptr);
   else if (k == 16)
     ker_topk_sample<T, 16><<<batch_size, max_thread_per_block, 0, stream>>>(
         logits, logit_bias, old_input_ids, new_input_ids, vocab_size,
         prompt_len, max_step, batch_seq_len, logits_seq_len, unfinished,
-        curandstate, eos_id);
+        curandstate, eos_id, step_offset_ptr);
   else if (k == 32)
     ker_topk_sample<T, 32><<<batch_size, max_thread_per_block, 0, stream>>>(
         logits, logit_bias, old_input_ids, new_input_ids, vocab_size,
         prompt_len, max_step, batch_seq_len, logits_seq_len, unfinished,
-        curandstate, eos_id);
+        curandstate, eos_id, step_offset_ptr);
   else {
     throw std::invalid_argument("topk argument should be in [1,2,4,8,16,32]");
   }
@@ -2017,14 +2666,22 @@ template void ker_topk_sample_launcher<float>(
     int logits_seq_len, int max_thread_per_block, cudaStream_t stream,
     const float* logits, const float* logit_bias, int* old_input_ids,
     int* new_input_idx, const int vocab_size, const int k, int* unfinished,
-    curandState* curandstate, int eos_id);
+    curandState* curandstate, int eos_id, const int* step_offset_ptr);
 
 template void ker_topk_sample_launcher<__half>(
     int batch_size, int batch_seq_len, const int prompt_len, const int max_step,
     int logits_seq_len, int max_thread_per_block, cudaStream_t stream,
     const __half* logits, const __half* logit_bias, int* old_input_ids,
     int* new_input_idx, const int vocab_size, const int k, int* unfinished,
-    curandState* curandstate, int eos_id);
+    curandState* curandstate, int eos_id, const int* step_offset_ptr);
+
+template void ker_topk_sample_launcher<__nv_bfloat16>(
+    int batch_size, int batch_seq_len, const int prompt_len, const int max_step,
+    int logits_seq_len, int max_thread_per_block, cudaStream_t stream,
+    const __nv_bfloat16* logits, const __nv_bfloat16* logit_bias,
+    int* old_input_ids, int* new_input_idx, const int vocab_size, const int k,
+    int* unfinished, curandState* curandstate, int eos_id,
+    const int* step_offset_ptr);
 
 /**
 @brief: ker_topp_sample
@@ -2217,6 +2874,491 @@ template void ker_topp_sample_launcher<__half>(
     int* new_input_idx, const int vocab_size, const float p, int* unfinished,
     curandState* curandstate, int eos_id);
 
+template void ker_topp_sample_launcher<__nv_bfloat16>(
+    int batch_size, int batch_seq_len, const int prompt_len, const int max_step,
+    int logits_seq_len, int max_thread_per_block, cudaStream_t stream,
+    const __nv_bfloat16* logits, const __nv_bfloat16* logit_bias,
+    int* old_input_ids, int* new_input_idx, const int vocab_size,
+    const float p, int* unfinished, curandState* curandstate, int eos_id);
+
+/**
+@brief: ker_topp_threshold_sample
+topk and topp sampling without sorting the vocab, with temperature,
+repetition penalty and min-p, exact unlike the rough ker_topp_sample
+
+The logits are adjusted on the fly at every pass: logit_bias added, the
+logits of tokens already in the sequence divided (positive) or multiplied
+(negative) by repetition_penalty, all of them divided by temperature. With
+e = exp(logit - max logit) and Z the sum of e over the vocab, a token is
+allowed if e >= min_p, fewer than k tokens have a larger e (k > 0), and the
+larger e sum to less than p * Z. The allowed tokens are the most likely ones.
+
+Sampling is by rejection: draw a token x with a probability proportional to
+e among the tokens above a pivot (one scan over the vocab, stopping at x),
+then count and sum the e larger than e_x (one pass). x is accepted if it is
+allowed, else no token with e <= e_x is, so the pivot rises to e_x and the
+draw is repeated. Conditioned on acceptance, x is drawn from the
+renormalized allowed tokens, and the pivot usually crosses their boundary in
+a few rounds, so the cost stays a few passes over the logits. k = 1 is the
+argmax of the first pass, which is also the fallback after kMaxRounds.
+
+With row_params, every row takes its own parameters instead, and its stop
+conditions: after one of its stop tokens, or once max_new_tokens are
+generated, the row only gets eos.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = max_thread_per_block, 1024
+dynamic shared memory: (vocab_size + 31) / 32 words if a repetition_penalty
+  is not 1
+
+@param
+logits: [batch_size, logits_seq_len, vocab_size]
+logit_bias: [vocab_size]
+old_input_ids: [batch_size, max_step], the sampled token is written after
+  the batch_seq_len first ones
+unfinished: [1], or [max_step] indexed by the step offset
+row_params: [batch_size] or nullptr
+curandstate: [batch_size]
+step_offset_ptr: [1] or nullptr, the position of the last token, which
+  overrides batch_seq_len - 1, see SamplingOp::set_step_offset_ptr
+*/
+template <typename T>
+__global__ void ker_topp_threshold_sample(
+    const T* logits, const T* logit_bias, int* old_input_ids,
+    const int vocab_size, const int prompt_len, const int max_step,
+    int batch_seq_len, int logits_seq_len, int* unfinished, int k, float p,
+    float temperature, float repetition_penalty, float min_p,
+    const RowSamplingParams* row_params, curandState* curandstate, int eos_id,
+    const int* step_offset_ptr) {
+  if (step_offset_ptr) {
+    batch_seq_len = *step_offset_ptr + 1;
+    unfinished += *step_offset_ptr;
+  }
+  int token_idx_in_batch = blockIdx.x * max_step + batch_seq_len - 1;
+  int last_token = old_input_ids[token_idx_in_batch];
+  bool stop = batch_seq_len > prompt_len && last_token == eos_id;
+  if (row_params != nullptr) {
+    const RowSamplingParams& params = row_params[blockIdx.x];
+    k = params.topk;
+    p = params.topp;
+    temperature = params.temperature;
+    repetition_penalty = params.repetition_penalty;
+    min_p = params.min_p;
+    int generated = batch_seq_len - prompt_len;
+    for (int i = 0; i < params.num_stop_tokens && generated > 0; i++) {
+      stop |= last_token == params.stop_tokens[i];
+    }
+    stop |= params.max_new_tokens > 0 && generated >= params.max_new_tokens;
+  }
+
+  /* add EOS to end if the row stopped */
+  if (stop) {
+    if (threadIdx.x == 0) {
+      old_input_ids[token_idx_in_batch + 1] = eos_id;
+    }
+    return;
+  }
+  const T* row_logits =
+      logits + (size_t(blockIdx.x) * logits_seq_len + logits_seq_len - 1) *
+                   vocab_size;
+
+  /* step0. mark the tokens of the sequence for the repetition penalty */
+  extern __shared__ unsigned int s_seen[];
+  bool penalty = repetition_penalty != 1.f;
+  if (penalty) {
+    for (int idx = threadIdx.x; idx < (vocab_size + 31) / 32;
+         idx += blockDim.x) {
+      s_seen[idx] = 0;
+    }
+    __syncthreads();
+    for (int idx = threadIdx.x; idx < batch_seq_len; idx += blockDim.x) {
+      int token_id = old_input_ids[blockIdx.x * max_step + idx];
+      if (token_id >= 0 && token_id < vocab_size) {
+        atomicOr(s_seen + token_id / 32, 1u << (token_id % 32));
+      }
+    }
+    __syncthreads();
+  }
+  float inv_temperature = 1.f / temperature;
+  auto adjusted_logit = [&](int idx) {
+    float logit = (float)row_logits[idx] + (float)__ldg(&logit_bias[idx]);
+    if (penalty && (s_seen[idx / 32] >> (idx % 32) & 1u)) {
+      logit = logit > 0.f ? logit / repetition_penalty
+                          : logit * repetition_penalty;
+    }
+    return logit * inv_temperature;
+  };
+
+  /* step1. online max, argmax and sum of exp over the vocab, in one pass */
+  float max_logit = CUDA_FLOAT_INF_NEG;
+  float sum_exp_logit = 0.f;
+  int argmax = vocab_size;
+  for (int idx = threadIdx.x; idx < vocab_size; idx += blockDim.x) {
+    float logit = adjusted_logit(idx);
+    if (logit > max_logit) {
+      sum_exp_logit = sum_exp_logit * expf(max_logit - logit) + 1.f;
+      max_logit = logit;
+      argmax = idx;
+    } else {
+      sum_exp_logit += expf(logit - max_logit);
+    }
+  }
+  __shared__ float s_max_logit, s_mass;
+  __shared__ int s_tid, s_last_tid;
+  float block_max_logit = blockReduceMax(max_logit);
+  if (threadIdx.x == 0) {
+    s_max_logit = block_max_logit;
+    s_tid = vocab_size;
+  }
+  __syncthreads();
+  if (max_logit == s_max_logit) atomicMin(&s_tid, argmax);
+  if (sum_exp_logit > 0.f) {
+    sum_exp_logit *= expf(max_logit - s_max_logit);
+  }
+  float block_sum_exp_logit = blockReduceSum(sum_exp_logit);
+  if (threadIdx.x == 0) {
+    s_mass = block_sum_exp_logit;
+  }
+  __syncthreads();
+  int argmax_tid = s_tid;
+  float nucleus_mass = p * s_mass;
+
+  /* step2. the mass of the tokens allowed by min-p, the first pivot */
+  // e >= min_p is e > pivot
+  float pivot = min_p > 0.f ? nextafterf(min_p, 0.f) : 0.f;
+  if (min_p > 0.f && k != 1) {
+    float mass = 0.f;
+    for (int idx = threadIdx.x; idx < vocab_size; idx += blockDim.x) {
+      float logit_exp = expf(adjusted_logit(idx) - s_max_logit);
+      if (logit_exp > pivot) mass += logit_exp;
+    }
+    mass = blockReduceSum(mass);
+    __syncthreads();
+    if (threadIdx.x == 0) {
+      s_mass = mass;
+    }
+    __syncthreads();
+  }
+
+  /* step3. draw above the pivot, until the token is allowed */
+  typedef cub::BlockScan<float, 1024> BlockScan;
+  __shared__ typename BlockScan::TempStorage scan_temp_storage;
+  __shared__ float s_random_mass, s_tid_exp;
+  __shared__ int s_accepted;
+  curandState local_state;
+  if (threadIdx.x == 0) {
+    local_state = curandstate[blockIdx.x];
+    s_accepted = k == 1;
+  }
+  __syncthreads();
+  const int kMaxRounds = 32;
+  for (int round = 0; round < kMaxRounds && !s_accepted; round++) {
+    if (threadIdx.x == 0) {
+      s_random_mass = curand_uniform(&local_state) * s_mass;
+      s_tid = vocab_size;
+      s_last_tid = -1;
+    }
+    __syncthreads();
+
+    // inverse cdf in vocab order, tile by tile
+    float tile_offset = 0.f;
+    for (int tile = 0; tile < vocab_size; tile += blockDim.x) {
+      int idx = tile + threadIdx.x;
+      float logit_exp = 0.f;
+      if (idx < vocab_size) {
+        logit_exp = expf(adjusted_logit(idx) - s_max_logit);
+        if (logit_exp <= pivot) logit_exp = 0.f;
+      }
+      float presum, tile_mass;
+      BlockScan(scan_temp_storage).InclusiveSum(logit_exp, presum, tile_mass);
+      if (logit_exp > 0.f) {
+        atomicMax(&s_last_tid, idx);
+        if (tile_offset + presum >= s_random_mass) atomicMin(&s_tid, idx);
+      }
+      __syncthreads();
+      if (s_tid != vocab_size) break;
+      tile_offset += tile_mass;
+    }
+    // rounding may leave the draw past the last allowed token
+    if (threadIdx.x == 0) {
+      if (s_tid == vocab_size) s_tid = max(s_last_tid, 0);
+      s_tid_exp = expf(adjusted_logit(s_tid) - s_max_logit);
+      s_accepted = p >= 1.f && k <= 0;
+    }
+    __syncthreads();
+    if (s_accepted) break;
+
+    // the count and the mass of the tokens above the drawn one
+    float mass = 0.f;
+    int count = 0;
+    for (int idx = threadIdx.x; idx < vocab_size; idx += blockDim.x) {
+      float logit_exp = expf(adjusted_logit(idx) - s_max_logit);
+      if (logit_exp > s_tid_exp) {
+        mass += logit_exp;
+        count++;
+      }
+    }
+    mass = blockReduceSum(mass);
+    count = blockReduceSum(count);
+    if (threadIdx.x == 0) {
+      s_mass = mass;
+      s_accepted = mass < nucleus_mass && (k <= 0 || count < k);
+    }
+    __syncthreads();
+    // rejected: the new pivot keeps the tokens above the drawn one, their
+    // mass s_mass is the one the next draw is made from
+    pivot = s_tid_exp;
+  }
+
+  if (threadIdx.x == 0) {
+    if (k == 1 || !s_accepted) s_tid = argmax_tid;
+    curandstate[blockIdx.x] = local_state;
+    /* if new sampled tid is not EOS, set unfinish TRUE */
+    if (s_tid != eos_id) unfinished[0] = 1;
+    /* step4 write back new sampled ids */
+    old_input_ids[token_idx_in_batch + 1] = s_tid;
+  }
+}
+
+template <typename T>
+void ker_topp_threshold_sample_launcher(
+    int batch_size, int batch_seq_len, const int prompt_len,
+    const int max_step, int logits_seq_len, int max_thread_per_block,
+    cudaStream_t stream, const T* logits, const T* logit_bias,
+    int* old_input_ids, const int vocab_size, const int k, const float p,
+    const float temperature, const float repetition_penalty, const float min_p,
+    const RowSamplingParams* row_params, int* unfinished,
+    curandState* curandstate, int eos_id, const int* step_offset_ptr) {
+  if (max_thread_per_block != 1024) {
+    throw std::runtime_error("ker_topp_threshold_sample: block size is 1024");
+  }
+  // the per row penalties are only known on the device
+  size_t smem_size = repetition_penalty != 1.f || row_params != nullptr
+                         ? (vocab_size + 31) / 32 * sizeof(int)
+                         : 0;
+  ker_topp_threshold_sample<T>
+      <<<batch_size, max_thread_per_block, smem_size, stream>>>(
+          logits, logit_bias, old_input_ids, vocab_size, prompt_len, max_step,
+          batch_seq_len, logits_seq_len, unfinished, k, p, temperature,
+          repetition_penalty, min_p, row_params, curandstate, eos_id,
+          step_offset_ptr);
+}
+
+template void ker_topp_threshold_sample_launcher<float>(
+    int batch_size, int batch_seq_len, const int prompt_len,
+    const int max_step, int logits_seq_len, int max_thread_per_block,
+    cudaStream_t stream, const float* logits, const float* logit_bias,
+    int* old_input_ids, const int vocab_size, const int k, const float p,
+    const float temperature, const float repetition_penalty, const float min_p,
+    const RowSamplingParams* row_params, int* unfinished,
+    curandState* curandstate, int eos_id, const int* step_offset_ptr);
+
+template void ker_topp_threshold_sample_launcher<__half>(
+    int batch_size, int batch_seq_len, const int prompt_len,
+    const int max_step, int logits_seq_len, int max_thread_per_block,
+    cudaStream_t stream, const __half* logits, const __half* logit_bias,
+    int* old_input_ids, const int vocab_size, const int k, const float p,
+    const float temperature, const float repetition_penalty, const float min_p,
+    const RowSamplingParams* row_params, int* unfinished,
+    curandState* curandstate, int eos_id, const int* step_offset_ptr);
+
+template void ker_topp_threshold_sample_launcher<__nv_bfloat16>(
+    int batch_size, int batch_seq_len, const int prompt_len,
+    const int max_step, int logits_seq_len, int max_thread_per_block,
+    cudaStream_t stream, const __nv_bfloat16* logits,
+    const __nv_bfloat16* logit_bias, int* old_input_ids, const int vocab_size,
+    const int k, const float p, const float temperature,
+    const float repetition_penalty, const float min_p,
+    const RowSamplingParams* row_params, int* unfinished,
+    curandState* curandstate, int eos_id, const int* step_offset_ptr);
+
+/**
+@brief: ker_process_logits
+the logits processors of a generation step, applied in place to the logits
+of the next token of every row with sparse writes, the vocab is not scanned
+
+The tokens of the row are staged in shared memory. Thread j handles the
+first occurrence of token t = tokens[j], counted over the generated tokens:
+the logit of t is divided (positive) or multiplied (negative) by
+repetition_penalty if t is anywhere in the sequence, then decreased by
+presence_penalty if t was generated, and by frequency_penalty per time it
+was generated. Only first occurrences write, so every logit is updated once.
+
+Then the banned tokens get kBannedLogit: with no_repeat_ngram_size n, the
+token following any earlier occurrence of the last n - 1 tokens, the last
+token of every bad word whose other tokens end the sequence (all the single
+token bad words), and with a token automaton, the tokens whose bit is not
+set in the allowed bitset of the state of the row.
+
+The automaton state is advanced on the device: at the first step of a
+generation every row starts in state 0, later the last token moves it along
+its transition, found by binary search among the sorted transition tokens
+of the state. An allowed token without a transition keeps the state.
+
+@thread
+gridDim.x = rows
+blockDim.x = max_thread_per_block
+dynamic shared memory: seq_len ints
+
+@param
+logits: [rows, vocab_size]
+alive_seq: [rows, max_step], the seq_len first tokens are the sequence, the
+  prompt_len first ones the prompt
+bad_words: the token ids of the bad words, back to back
+bad_word_offsets: [num_bad_words + 1], where every bad word starts
+params.allowed: [num_states, (vocab_size + 31) / 32]
+params.transition_offsets: [num_states + 1], where the transitions of every
+  state start in transition_tokens and next_states
+*/
+template <typename T>
+__global__ void ker_process_logits(T* logits, const int* alive_seq,
+                                   int vocab_size, int seq_len, int prompt_len,
+                                   int max_step, LogitsProcessParams params,
+                                   const int* bad_words,
+                                   const int* bad_word_offsets) {
+  // finite, so that a row of banned tokens keeps a defined softmax
+  const float kBannedLogit = -10000.f;
+  extern __shared__ int s_tokens[];
+  const int* row_tokens = alive_seq + blockIdx.x * max_step;
+  for (int idx = threadIdx.x; idx < seq_len; idx += blockDim.x) {
+    s_tokens[idx] = row_tokens[idx];
+  }
+  __syncthreads();
+  T* row_logits = logits + size_t(blockIdx.x) * vocab_size;
+
+  /* step0. advance the automaton along the last token */
+  __shared__ int s_state;
+  if (params.allowed != nullptr && threadIdx.x == 0) {
+    int state = 0;
+    if (seq_len > prompt_len) {
+      state = params.states[blockIdx.x];
+      int token_id = s_tokens[seq_len - 1];
+      int left = params.transition_offsets[state];
+      int right = params.transition_offsets[state + 1];
+      while (left < right) {
+        int mid = (left + right) / 2;
+        if (params.transition_tokens[mid] < token_id) {
+          left = mid + 1;
+        } else {
+          right = mid;
+        }
+      }
+      if (left < params.transition_offsets[state + 1] &&
+          params.transition_tokens[left] == token_id) {
+        state = params.next_states[left];
+      }
+    }
+    params.states[blockIdx.x] = state;
+    s_state = state;
+  }
+
+  /* step1. penalties, by the first occurrence of every token */
+  if (params.repetition_penalty != 1.f || params.presence_penalty != 0.f ||
+      params.frequency_penalty != 0.f) {
+    for (int idx = threadIdx.x; idx < seq_len; idx += blockDim.x) {
+      int token_id = s_tokens[idx];
+      if (token_id < 0 || token_id >= vocab_size) continue;
+      bool first = true;
+      for (int i = 0; i < idx && first; i++) first = s_tokens[i] != token_id;
+      if (!first) continue;
+      int count = 0;
+      for (int i = max(idx, prompt_len); i < seq_len; i++) {
+        count += s_tokens[i] == token_id;
+      }
+      float logit = (float)row_logits[token_id];
+      logit = logit > 0.f ? logit / params.repetition_penalty
+                          : logit * params.repetition_penalty;
+      logit -= params.frequency_penalty * count +
+               (count > 0 ? params.presence_penalty : 0.f);
+      row_logits[token_id] = (T)logit;
+    }
+  }
+  // a banned token may also be penalized
+  __syncthreads();
+
+  /* step2. no repeat ngram */
+  int n = params.no_repeat_ngram_size;
+  if (n > 0 && seq_len >= n) {
+    // the ngram starting at idx ends with the last n - 1 tokens
+    for (int idx = threadIdx.x; idx + n <= seq_len; idx += blockDim.x) {
+      bool match = true;
+      for (int i = 0; i < n - 1 && match; i++) {
+        match = s_tokens[idx + i] == s_tokens[seq_len - n + 1 + i];
+      }
+      int token_id = s_tokens[idx + n - 1];
+      if (match && token_id >= 0 && token_id < vocab_size) {
+        row_logits[token_id] = (T)kBannedLogit;
+      }
+    }
+  }
+
+  /* step3. bad words */
+  for (int word = threadIdx.x; word < params.num_bad_words;
+       word += blockDim.x) {
+    int begin = bad_word_offsets[word];
+    int prefix_len = bad_word_offsets[word + 1] - begin - 1;
+    if (prefix_len > seq_len) continue;
+    bool match = true;
+    for (int i = 0; i < prefix_len && match; i++) {
+      match = bad_words[begin + i] == s_tokens[seq_len - prefix_len + i];
+    }
+    int token_id = bad_words[begin + prefix_len];
+    if (match && token_id >= 0 && token_id < vocab_size) {
+      row_logits[token_id] = (T)kBannedLogit;
+    }
+  }
+
+  /* step4. the tokens the automaton does not allow, 32 per thread */
+  if (params.allowed != nullptr) {
+    int num_words = (vocab_size + 31) / 32;
+    const unsigned int* allowed = params.allowed + size_t(s_state) * num_words;
+    for (int word = threadIdx.x; word < num_words; word += blockDim.x) {
+      unsigned int bits = allowed[word];
+      if (bits == 0xffffffffu) continue;
+      int last = min(32, vocab_size - word * 32);
+      for (int bit = 0; bit < last; bit++) {
+        if (!(bits >> bit & 1u)) row_logits[word * 32 + bit] = (T)kBannedLogit;
+      }
+    }
+  }
+}
+
+template <typename T>
+void ker_process_logits_launcher(int rows, int seq_len, int prompt_len,
+                                 int max_step, int max_thread_per_block,
+                                 cudaStream_t stream, T* logits,
+                                 const int* alive_seq, int vocab_size,
+                                 const LogitsProcessParams& params,
+                                 const int* bad_words,
+                                 const int* bad_word_offsets) {
+  size_t smem_size = seq_len * sizeof(int);
+  if (smem_size > 48 * 1024) {
+    throw std::runtime_error("ker_process_logits: sequence too long");
+  }
+  ker_process_logits<T><<<rows, max_thread_per_block, smem_size, stream>>>(
+      logits, alive_seq, vocab_size, seq_len, prompt_len, max_step, params,
+      bad_words, bad_word_offsets);
+}
+
+template void ker_process_logits_launcher<float>(
+    int rows, int seq_len, int prompt_len, int max_step,
+    int max_thread_per_block, cudaStream_t stream, float* logits,
+    const int* alive_seq, int vocab_size, const LogitsProcessParams& params,
+    const int* bad_words, const int* bad_word_offsets);
+
+template void ker_process_logits_launcher<__half>(
+    int rows, int seq_len, int prompt_len, int max_step,
+    int max_thread_per_block, cudaStream_t stream, __half* logits,
+    const int* alive_seq, int vocab_size, const LogitsProcessParams& params,
+    const int* bad_words, const int* bad_word_offsets);
+
+template void ker_process_logits_launcher<__nv_bfloat16>(
+    int rows, int seq_len, int prompt_len, int max_step,
+    int max_thread_per_block, cudaStream_t stream, __nv_bfloat16* logits,
+    const int* alive_seq, int vocab_size, const LogitsProcessParams& params,
+    const int* bad_words, const int* bad_word_offsets);
+
 /**
 @brief: ker_bias_gelu
 add bias, activated by gelu
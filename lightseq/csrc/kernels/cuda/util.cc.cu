@@ -83,5 +83,22 @@ void launch_convert_dtype(float* source_buffer, __half* target_buffer,
                                                           target_buffer, size);
 }
 
+__global__ void kernel_convert_dtype(float* source_buffer,
+                                     __nv_bfloat16* target_buffer,
+                                     size_t nele) {
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= nele) {
+    return;
+  }
+  *(target_buffer + idx) = __float2bfloat16(*(source_buffer + idx));
+}
+
+void launch_convert_dtype(float* source_buffer, __nv_bfloat16* target_buffer,
+                          size_t size, int max_thread, cudaStream_t stream) {
+  int nblock = (size + max_thread - 1) / max_thread;
+  kernel_convert_dtype<<<nblock, max_thread, 0, stream>>>(source_buffer,
+                                                          target_buffer, size);
+}
+
 }  // namespace cuda
 }  // namespace lightseq
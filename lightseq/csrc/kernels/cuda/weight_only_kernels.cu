@@ -0,0 +1,237 @@
+#include "common.h"
+#include "kernels.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+// Every thread reads 4 adjacent columns of one packed row at once, the
+// warps of a block split the rows and are reduced in shared memory.
+const int kWoColsPerThread = 4;
+const int kWoWarps = 16;
+const int kWoBlockCols = WARP_SIZE * kWoColsPerThread;
+
+// The r-th of the 8 / bits weights packed in one byte, int4 keeps the even
+// row in the low nibble and the odd row in the high nibble.
+template <int kBits>
+__forceinline__ __device__ int unpack_weight(int8_t q, int r) {
+  if (kBits == 8) return q;
+  return r == 0 ? (int8_t)(q << 4) >> 4 : q >> 4;
+}
+
+}  // namespace
+
+/**
+@brief: ker_weight_only_gemv
+out = inp * dequant(qweight) for a few tokens, the weights are dequantized
+in registers, so that each byte of qweight is read once per tile of kTokens
+tokens.
+
+@thread
+gridDim.x = ceil(out_dim / kWoBlockCols)
+gridDim.y = ceil(batch_tokens / kTokens)
+blockDim.x = WARP_SIZE
+blockDim.y = kWoWarps
+
+@param
+inp: [batch_tokens, in_dim]
+qweight: [in_dim * bits / 8, out_dim]
+scale: [in_dim / group_size, out_dim]
+out: [batch_tokens, out_dim], added to when accumulate
+*/
+template <typename T, int kTokens, int kBits>
+__global__ void ker_weight_only_gemv(const T *inp, const int8_t *qweight,
+                                     const T *scale, T *out,
+                                     int batch_tokens, int in_dim,
+                                     int out_dim, int group_size,
+                                     bool accumulate) {
+  const int kRowsPerByte = 8 / kBits;
+  int block_col = blockIdx.x * kWoBlockCols;
+  int col = block_col + threadIdx.x * kWoColsPerThread;
+  int token_begin = blockIdx.y * kTokens;
+  int tile_tokens = min(kTokens, batch_tokens - token_begin);
+  const T *tile_inp = inp + (size_t)token_begin * in_dim;
+
+  float acc[kTokens][kWoColsPerThread];
+#pragma unroll
+  for (int t = 0; t < kTokens; t++) {
+#pragma unroll
+    for (int c = 0; c < kWoColsPerThread; c++) acc[t][c] = 0.f;
+  }
+
+  if (col < out_dim) {
+#pragma unroll 4
+    for (int qrow = threadIdx.y; qrow < in_dim / kRowsPerByte;
+         qrow += kWoWarps) {
+      char4 q4 = *reinterpret_cast<const char4 *>(
+          qweight + (size_t)qrow * out_dim + col);
+      int8_t q[kWoColsPerThread] = {q4.x, q4.y, q4.z, q4.w};
+      int row = qrow * kRowsPerByte;
+      const T *row_scale = scale + (size_t)(row / group_size) * out_dim + col;
+      float s[kWoColsPerThread];
+#pragma unroll
+      for (int c = 0; c < kWoColsPerThread; c++) s[c] = float(row_scale[c]);
+#pragma unroll
+      for (int r = 0; r < kRowsPerByte; r++) {
+        float w[kWoColsPerThread];
+#pragma unroll
+        for (int c = 0; c < kWoColsPerThread; c++) {
+          w[c] = unpack_weight<kBits>(q[c], r) * s[c];
+        }
+#pragma unroll
+        for (int t = 0; t < kTokens; t++) {
+          if (t >= tile_tokens) break;
+          float x = float(tile_inp[(size_t)t * in_dim + row + r]);
+#pragma unroll
+          for (int c = 0; c < kWoColsPerThread; c++) acc[t][c] += x * w[c];
+        }
+      }
+    }
+  }
+
+  __shared__ float s_acc[kWoWarps][kTokens][kWoBlockCols];
+#pragma unroll
+  for (int t = 0; t < kTokens; t++) {
+#pragma unroll
+    for (int c = 0; c < kWoColsPerThread; c++) {
+      s_acc[threadIdx.y][t][threadIdx.x * kWoColsPerThread + c] = acc[t][c];
+    }
+  }
+  __syncthreads();
+
+  for (int idx = threadIdx.y * WARP_SIZE + threadIdx.x;
+       idx < kTokens * kWoBlockCols; idx += kWoWarps * WARP_SIZE) {
+    int t = idx / kWoBlockCols, c = idx % kWoBlockCols;
+    if (t >= tile_tokens || block_col + c >= out_dim) continue;
+    float sum = 0.f;
+#pragma unroll
+    for (int w = 0; w < kWoWarps; w++) sum += s_acc[w][t][c];
+    T *dst = out + (size_t)(token_begin + t) * out_dim + block_col + c;
+    if (accumulate) sum += float(*dst);
+    *dst = T(sum);
+  }
+}
+
+/**
+@brief: ker_weight_only_dequant
+weight = dequant(qweight), for the tokens too many for ker_weight_only_gemv,
+of the num_cols columns starting at col_begin.
+
+@thread
+gridDim.x = ceil(in_dim * bits / 8 * num_cols / MAX_THREADS)
+blockDim.x = MAX_THREADS
+
+@param
+qweight: [in_dim * bits / 8, out_dim]
+scale: [in_dim / group_size, out_dim]
+weight: [in_dim, num_cols]
+*/
+template <typename T, int kBits>
+__global__ void ker_weight_only_dequant(const int8_t *qweight, const T *scale,
+                                        T *weight, int in_dim, int out_dim,
+                                        int group_size, int col_begin,
+                                        int num_cols) {
+  const int kRowsPerByte = 8 / kBits;
+  size_t idx = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= (size_t)in_dim / kRowsPerByte * num_cols) return;
+  int qrow = idx / num_cols, col = idx % num_cols;
+  int8_t q = qweight[(size_t)qrow * out_dim + col_begin + col];
+#pragma unroll
+  for (int r = 0; r < kRowsPerByte; r++) {
+    int row = qrow * kRowsPerByte + r;
+    float s =
+        float(scale[(size_t)(row / group_size) * out_dim + col_begin + col]);
+    weight[(size_t)row * num_cols + col] = T(unpack_weight<kBits>(q, r) * s);
+  }
+}
+
+template <typename T, int kBits>
+void launch_weight_only_gemv_bits(const T *inp, const int8_t *qweight,
+                                  const T *scale, T *out, int batch_tokens,
+                                  int in_dim, int out_dim, int group_size,
+                                  bool accumulate, cudaStream_t stream) {
+  dim3 block_dim(WARP_SIZE, kWoWarps);
+  int col_blocks = (out_dim + kWoBlockCols - 1) / kWoBlockCols;
+  if (batch_tokens == 1) {
+    ker_weight_only_gemv<T, 1, kBits><<<col_blocks, block_dim, 0, stream>>>(
+        inp, qweight, scale, out, batch_tokens, in_dim, out_dim, group_size,
+        accumulate);
+  } else if (batch_tokens == 2) {
+    ker_weight_only_gemv<T, 2, kBits><<<col_blocks, block_dim, 0, stream>>>(
+        inp, qweight, scale, out, batch_tokens, in_dim, out_dim, group_size,
+        accumulate);
+  } else {
+    dim3 grid_dim(col_blocks, (batch_tokens + 3) / 4);
+    ker_weight_only_gemv<T, 4, kBits><<<grid_dim, block_dim, 0, stream>>>(
+        inp, qweight, scale, out, batch_tokens, in_dim, out_dim, group_size,
+        accumulate);
+  }
+}
+
+template <typename T>
+void launch_weight_only_gemv(const T *inp, const int8_t *qweight,
+                             const T *scale, T *out, int batch_tokens,
+                             int in_dim, int out_dim, int quant_bits,
+                             int group_size, bool accumulate,
+                             cudaStream_t stream) {
+  if (quant_bits == 4) {
+    launch_weight_only_gemv_bits<T, 4>(inp, qweight, scale, out, batch_tokens,
+                                       in_dim, out_dim, group_size,
+                                       accumulate, stream);
+  } else {
+    launch_weight_only_gemv_bits<T, 8>(inp, qweight, scale, out, batch_tokens,
+                                       in_dim, out_dim, group_size,
+                                       accumulate, stream);
+  }
+}
+
+template void launch_weight_only_gemv<float>(
+    const float *inp, const int8_t *qweight, const float *scale, float *out,
+    int batch_tokens, int in_dim, int out_dim, int quant_bits, int group_size,
+    bool accumulate, cudaStream_t stream);
+template void launch_weight_only_gemv<__half>(
+    const __half *inp, const int8_t *qweight, const __half *scale,
+    __half *out, int batch_tokens, int in_dim, int out_dim, int quant_bits,
+    int group_size, bool accumulate, cudaStream_t stream);
+template void launch_weight_only_gemv<__nv_bfloat16>(
+    const __nv_bfloat16 *inp, const int8_t *qweight,
+    const __nv_bfloat16 *scale, __nv_bfloat16 *out, int batch_tokens,
+    int in_dim, int out_dim, int quant_bits, int group_size, bool accumulate,
+    cudaStream_t stream);
+
+template <typename T>
+void launch_weight_only_dequant(const int8_t *qweight, const T *scale,
+                                T *weight, int in_dim, int out_dim,
+                                int quant_bits, int group_size,
+                                cudaStream_t stream, int col_begin,
+                                int num_cols) {
+  if (num_cols == 0) num_cols = out_dim;
+  size_t qweight_size = (size_t)in_dim * quant_bits / 8 * num_cols;
+  int grid_dim = (qweight_size + MAX_THREADS - 1) / MAX_THREADS;
+  if (quant_bits == 4) {
+    ker_weight_only_dequant<T, 4><<<grid_dim, MAX_THREADS, 0, stream>>>(
+        qweight, scale, weight, in_dim, out_dim, group_size, col_begin,
+        num_cols);
+  } else {
+    ker_weight_only_dequant<T, 8><<<grid_dim, MAX_THREADS, 0, stream>>>(
+        qweight, scale, weight, in_dim, out_dim, group_size, col_begin,
+        num_cols);
+  }
+}
+
+template void launch_weight_only_dequant<float>(
+    const int8_t *qweight, const float *scale, float *weight, int in_dim,
+    int out_dim, int quant_bits, int group_size, cudaStream_t stream,
+    int col_begin, int num_cols);
+template void launch_weight_only_dequant<__half>(
+    const int8_t *qweight, const __half *scale, __half *weight, int in_dim,
+    int out_dim, int quant_bits, int group_size, cudaStream_t stream,
+    int col_begin, int num_cols);
+template void launch_weight_only_dequant<__nv_bfloat16>(
+    const int8_t *qweight, const __nv_bfloat16 *scale, __nv_bfloat16 *weight,
+    int in_dim, int out_dim, int quant_bits, int group_size,
+    cudaStream_t stream, int col_begin, int num_cols);
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -33,21 +33,60 @@ void gemm(bool a_is_packed, bool b_is_packed, bool transpose_a,
   const CBLAS_TRANSPOSE trans_a = transpose_a ? CblasTrans : CblasNoTrans;
   const CBLAS_TRANSPOSE trans_b = transpose_b ? CblasTrans : CblasNoTrans;
 
-  // if (use_packed_api) {
-  //   cblas_gemm_s8u8s32_compute(
-  //       CblasRowMajor, a_is_packed ? (MKL_INT)CblasPacked : (MKL_INT)trans_a,
-  //       b_is_packed ? (MKL_INT)CblasPacked : (MKL_INT)trans_b,
-  //       CblasRowOffset, m, n, k, alpha, a, lda, 0, b, ldb, 0, beta, c, ldc,
-  //       a_shift_compensation);
-  // } else {
-
-  cblas_gemm_s8u8s32(CblasRowMajor, trans_a, trans_b, CblasRowOffset, m, n, k,
-                     alpha, a, lda, 0, b, ldb, 0, beta, c, ldc,
-                     a_shift_compensation);
-  // }
+  // mkl dispatches to the AVX-512 VNNI or AMX int8 instructions of the host.
+  if (use_packed_api) {
+    cblas_gemm_s8u8s32_compute(
+        CblasRowMajor, a_is_packed ? (MKL_INT)CblasPacked : (MKL_INT)trans_a,
+        b_is_packed ? (MKL_INT)CblasPacked : (MKL_INT)trans_b, CblasRowOffset,
+        m, n, k, alpha, a, lda, 0, b, ldb, 0, beta, c, ldc,
+        a_shift_compensation);
+  } else {
+    cblas_gemm_s8u8s32(CblasRowMajor, trans_a, trans_b, CblasRowOffset, m, n,
+                       k, alpha, a, lda, 0, b, ldb, 0, beta, c, ldc,
+                       a_shift_compensation);
+  }
 
   return;
 }
 
+template <>
+size_t packed_b_size<int8_t>(int64_t m, int64_t n, int64_t k) {
+  return cblas_gemm_s8u8s32_pack_get_size(CblasBMatrix, m, n, k);
+}
+
+template <>
+void pack_b_matrix(bool transpose_b, int64_t m, int64_t n, int64_t k,
+                   const int8_t* b, int64_t ldb, void* dest) {
+  cblas_gemm_s8u8s32_pack(CblasRowMajor, CblasBMatrix,
+                          transpose_b ? CblasTrans : CblasNoTrans, m, n, k, b,
+                          ldb, dest);
+}
+
+void set_gemm_num_threads(int num_threads) {
+  mkl_set_num_threads_local(num_threads);
+}
+
+template <>
+void strided_batch_gemm(bool transpose_a, bool transpose_b, int m, int n,
+                        int k, float alpha, float beta, const float* a,
+                        const float* b, float* c, int stride_a, int stride_b,
+                        int stride_c, int batch) {
+  const CBLAS_TRANSPOSE trans_a = transpose_a ? CblasTrans : CblasNoTrans;
+  const CBLAS_TRANSPOSE trans_b = transpose_b ? CblasTrans : CblasNoTrans;
+  const int64_t lda = transpose_a ? k : m;
+  const int64_t ldb = transpose_b ? n : k;
+  const int64_t ldc = m;
+
+  // the attention gemms are small, one per thread, mkl runs sequentially in
+  // the parallel region.
+  parallel_for(0, batch, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t i = begin; i < end; i++) {
+      cblas_sgemm(CblasColMajor, trans_a, trans_b, m, n, k, alpha,
+                  a + i * stride_a, lda, b + i * stride_b, ldb, beta,
+                  c + i * stride_c, ldc);
+    }
+  });
+}
+
 }  // namespace x86
 }  // namespace lightseq
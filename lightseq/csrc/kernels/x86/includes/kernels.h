@@ -3,8 +3,18 @@
 #include "util.h"
 
 namespace lightseq {
+
+enum class ActivationType { kRelu, kGelu };
+enum class PoolingMethod { kCls, kMean, kMax };
+
 namespace x86 {
 
+// the -inf of the padding tokens in the attention mask, as on cuda.
+const float kFloatInfNeg = -100000000.f;
+const float kLnEpsilon = 1e-8f;
+// the floor of the log probabilities of the beam search, as on cuda.
+const float kMinLogProbability = -2000.f;
+
 template <typename InType, typename OutType>
 void matrix_gemm(const InType* inpA, const InType* inpB, OutType* outC, int m,
                  int n, int k);
@@ -15,5 +25,194 @@ void gemm(bool a_is_packed, bool b_is_packed, bool transpose_a,
           const AType* a, int64_t lda, const BType* b, int64_t ldb, float beta,
           CType* c, int64_t ldc, const CType* a_shift_compensation = nullptr);
 
+// the size in bytes and the packing of the b of gemm, once for a weight, then
+// passed to gemm with b_is_packed.
+// the threads of the mkl gemms issued by the calling thread, see
+// CpuThreadGroup.
+void set_gemm_num_threads(int num_threads);
+
+template <typename BType>
+size_t packed_b_size(int64_t m, int64_t n, int64_t k);
+
+template <typename BType>
+void pack_b_matrix(bool transpose_b, int64_t m, int64_t n, int64_t k,
+                   const BType* b, int64_t ldb, void* dest);
+
+// column major as cublasGemmStridedBatchedEx, C = alpha * op(A) * op(B) +
+// beta * C for every batch.
+template <typename T>
+void strided_batch_gemm(bool transpose_a, bool transpose_b, int m, int n,
+                        int k, float alpha, float beta, const T* a,
+                        const T* b, T* c, int stride_a, int stride_b,
+                        int stride_c, int batch);
+
+/*
+The kernels below are the cpu versions of the cuda kernels of the same name,
+see kernels/cuda, inference only. They are vectorized with the widest isa of
+the cpu, picked at runtime, see simd_rows.h, the rows are split over the
+OpenMP threads.
+*/
+template <typename T>
+void launch_enc_emb(const T* token_emb, const T* pos_emb, const int* tokens,
+                    T* output, T* pad_mask, int pad_id, int batch_size,
+                    int seq_len, int hidden_dim, const T* lang_emb,
+                    const int* lang_id, int multilg_type);
+
+// vars and means are per token, means can be nullptr.
+template <typename T>
+void launch_layer_norm(T* ln_res, T* vars, T* means, const T* inp,
+                       const T* scale, const T* bias, int batch_size,
+                       int hidden_dim);
+
+// inp: [batch_size, nhead, from_len, to_len], attn_mask: [batch_size, kv_size]
+// or nullptr, out can be inp.
+template <typename T>
+void launch_attn_softmax(T* out, const T* inp, const T* attn_mask,
+                         int batch_size, int nhead, int from_len, int to_len,
+                         int kv_size, bool mask_future);
+
+// out = act(inp + bias), bias: [dim]
+template <ActivationType act_type, typename T>
+void launch_bias_act(T* out, const T* inp, const T* bias, int total_count,
+                     int dim);
+
+// out = inp + bias + residual, bias: [dim]
+template <typename T>
+void launch_bias_res(T* out, const T* inp, const T* bias, const T* residual,
+                     int total_count, int dim);
+
+// [dim_0, dim_1, dim_2, dim_3, dim_4] + bias -> [dim_2, dim_0, dim_3, dim_1,
+// dim_4], bias: [dim_2, dim_3, dim_4]
+template <typename T>
+void launch_bias_add_transform_20314(T* output, const T* input, const T* bias,
+                                     int dim_0, int dim_1, int dim_2,
+                                     int dim_3, int dim_4);
+
+// [sz0, sz1, sz2, sz3] -> [sz0, sz2, sz1, sz3]
+template <typename T>
+void launch_transform_0213(const T* input, T* output, int sz0, int sz1,
+                           int sz2, int sz3);
+
+/*
+The int8 gemm of gemm<uint8_t, int8_t, int32_t> takes the activations in
+uint8, quantized symmetrically per row and shifted by +128, the shift is
+removed by the a_shift_compensation of the weight.
+*/
+// q = round(inp / scale) + 128, scales: [rows], amax / 127 of every row.
+template <typename T>
+void launch_quantize_shift_rows(uint8_t* q, float* scales, const T* inp,
+                                int rows, int cols);
+
+// comp[j] = -128 * sum(weight[j]), weight: [n, k]
+void compute_shift_compensation(const int8_t* weight, int32_t* comp, int n,
+                                int k);
+
+// out = act(c * row_scales[i] * col_scales[j] + bias[j])
+template <ActivationType act_type, typename T>
+void launch_dequantize_bias_act(T* out, const int32_t* c,
+                                const float* row_scales,
+                                const float* col_scales, const T* bias,
+                                int rows, int cols);
+
+// out = c * row_scales[i] * col_scales[j] + bias[j] + residual, bias and
+// residual can be nullptr, out can be residual.
+template <typename T>
+void launch_dequantize_bias_res(T* out, const int32_t* c,
+                                const float* row_scales,
+                                const float* col_scales, const T* bias,
+                                const T* residual, int rows, int cols);
+
+/*
+The generation kernels of the decoder, inference only. The beam search keeps
+the candidate layout of the cuda kernels: can_idx and can_score hold the top
+beam_size candidates of every batch item, can_idx is
+beam_id * vocab_size + vocab_id and can_score carries the batch offset
+batch_id * kMinLogProbability, num_beam_can[1:] is the exclusive scan of one
+candidate per beam.
+*/
+// token_emb: [hidden_dim, vocab_size], tokens: [batch_size, beam_size,
+// max_step], output: [batch_size, beam_size, hidden_dim]
+template <typename T>
+void launch_dec_emb(const T* token_emb, const T* pos_emb, int* tokens,
+                    const T* lang_emb, const int* lang_id, T* output,
+                    int batch_size, int beam_size, int hidden_dim,
+                    int vocab_size, int step, int max_step, int multilg_type);
+
+// [sz0, sz1_1, sz2] + [sz0, sz1_2, sz2] -> [sz0, sz1_1 + sz1_2, sz2]
+template <typename T>
+void launch_concat3_dim1(const T* inp1, const T* inp2, T* output, int sz0,
+                         int sz2, int sz1_1, int sz1_2);
+
+// inp: [sz0, sz1_1, sz2] -> output[:, sz1_0 : sz1_0 + sz1_1, :] of
+// [sz0, mx_sz1, sz2], the kv cache update of one step.
+template <typename T>
+void launch_filling_concat3_dim1(T* output, const T* inp, int sz0, int mx_sz1,
+                                 int sz2, int sz1_0, int sz1_1);
+
+// the exact top beam_size candidates of every batch item, logits:
+// [batch_size, beam_size, vocab_size], alive_seq: [batch_size, beam_size,
+// max_step]
+template <typename T>
+void beam_search_topk(const T* logits, const T* logit_bias,
+                      const float* seq_probs, const float* seq_score,
+                      const int* alive_seq, int* can_idx, float* can_score,
+                      int* num_beam_can, int vocab_size, int max_step,
+                      float length_norm, int cur_step, int batch_size,
+                      int beam_size, int end_id);
+
+// beam pruning by score margin on the candidates of beam_search_topk: the
+// candidate which trails the best one of its batch item by more than
+// min(abs_margin, rel_margin * |best score|) becomes the eos of its beam with
+// the lowest score, a margin <= 0 is none. See ker_prune_beams_launcher.
+void prune_beams(int* can_idx, float* can_score, const int* num_can_per_beam,
+                 int vocab_size, int batch_size, int beam_size,
+                 float abs_margin, float rel_margin, int end_id);
+
+// extend the alive sequences with the candidates, num_finish_beam is set to
+// the number of the finished ones.
+void refresh_result(const int* can_idx, const float* can_score,
+                    const int* num_can_per_beam, const int* old_alive_seq,
+                    int* new_alive_seq, float* seq_probs, float* seq_score,
+                    int* num_finish_beam, int vocab_size, int cur_step,
+                    float length_norm, int batch_size, int beam_size,
+                    int max_step, int end_id);
+
+// reorder the self attention caches of the beams, [num_layers, batch_size,
+// beam_size, head_num, max_step, dim_per_head] with layer_size elements per
+// layer, as the candidates.
+template <typename T>
+void refresh_cache(const int* num_can_per_beam, const int* can_idx,
+                   const T* caches_k, const T* caches_v, T* new_caches_k,
+                   T* new_caches_v, size_t layer_size, int num_layers,
+                   int batch_size, int beam_size, int dim_per_head,
+                   int head_num, int vocab_size, int cur_step, int max_step,
+                   int end_id);
+
+// sample the next token of every sequence among its topk most probable, or
+// the smallest set whose probability reaches topp, with random_x: [batch_size]
+// uniform in [0, 1). tokens: [batch_size, max_step], the token is written at
+// batch_seq_len, eos after a finished sequence, unfinished is set to whether
+// any sequence did not end.
+template <typename T>
+void launch_topk_sample(const T* logits, const T* logit_bias, int* tokens,
+                        int* unfinished, const float* random_x, int batch_size,
+                        int batch_seq_len, int prompt_len, int max_step,
+                        int logits_seq_len, int vocab_size, int topk,
+                        int eos_id);
+
+// see the cuda launch_sequence_pooling, the output is T.
+template <typename T>
+void launch_sequence_pooling(const T* inp, const int* tokens, T* out,
+                             int batch_size, int seq_len, int hidden_dim,
+                             int padding_id, PoolingMethod method,
+                             bool l2_norm);
+
+template <typename T>
+void launch_topp_sample(const T* logits, const T* logit_bias, int* tokens,
+                        int* unfinished, const float* random_x, int batch_size,
+                        int batch_seq_len, int prompt_len, int max_step,
+                        int logits_seq_len, int vocab_size, float topp,
+                        int eos_id);
+
 }  // namespace x86
 }  // namespace lightseq
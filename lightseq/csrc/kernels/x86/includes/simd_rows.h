@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+
+namespace lightseq {
+namespace x86 {
+
+/*
+The vectorized rows of the kernels of transformer_kernels.cpp. They are built
+once per isa, see simd_rows_impl.h, and simd_rows() picks the widest one the
+cpu has at runtime, so the library runs on any x86-64 whatever the build host.
+*/
+struct SimdRows {
+  // out = a + b, or a + b + c, c can be nullptr.
+  void (*add_row)(float* out, const float* a, const float* b, const float* c,
+                  int n);
+  // the sum and the square sum of x.
+  void (*sum_square_row)(const float* x, int n, float* sum,
+                         float* square_sum);
+  // y = (x - mean) * rstd * scale + bias
+  void (*normalize_row)(float* y, const float* x, float mean, float rstd,
+                        const float* scale, const float* bias, int n);
+  // y = x + b, b can be nullptr, returns the max of y.
+  float (*add_max_row)(float* y, const float* x, const float* b, int n);
+  // y = exp(y - max_val), returns the sum of y.
+  float (*exp_sum_row)(float* y, float max_val, int n);
+  // y = y * scale
+  void (*scale_row)(float* y, float scale, int n);
+  // y = act(x + bias)
+  void (*bias_relu_row)(float* y, const float* x, const float* bias, int n);
+  void (*bias_gelu_row)(float* y, const float* x, const float* bias, int n);
+  // the max of |x|.
+  float (*amax_row)(const float* x, int n);
+  // y = clamp(round(x * inv_scale) + 128, 1, 255)
+  void (*quantize_shift_row)(uint8_t* y, const float* x, float inv_scale,
+                             int n);
+  // the epilogues of the int8 gemm, out = act(c * row_scale * col_scales +
+  // bias) or c * row_scale * col_scales + bias + residual, bias and residual
+  // can be nullptr.
+  void (*dequantize_relu_row)(float* out, const int32_t* c, float row_scale,
+                              const float* col_scales, const float* bias,
+                              int n);
+  void (*dequantize_gelu_row)(float* out, const int32_t* c, float row_scale,
+                              const float* col_scales, const float* bias,
+                              int n);
+  void (*dequantize_res_row)(float* out, const int32_t* c, float row_scale,
+                             const float* col_scales, const float* bias,
+                             const float* residual, int n);
+  // the k largest of logits + bias, sorted in descending order, top_val[0]
+  // is the max of the row and top_idx is -1 past n. Returns sum(exp(x -
+  // max)) over the row if with_sum.
+  float (*row_topk)(const float* logits, const float* bias, int n, int k,
+                    float* top_val, int* top_idx, bool with_sum);
+  // the name of the isa, for the logs.
+  const char* isa;
+};
+
+namespace avx512 {
+SimdRows simd_rows();
+}
+namespace avx2 {
+SimdRows simd_rows();
+}
+namespace generic {
+SimdRows simd_rows();
+}
+
+// the rows of the widest isa of the cpu.
+const SimdRows& simd_rows();
+
+}  // namespace x86
+}  // namespace lightseq
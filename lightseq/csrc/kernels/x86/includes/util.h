@@ -9,6 +9,7 @@
 #include <stdexcept>
 #include <functional>
 #include <algorithm>
+#include <array>
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -0,0 +1,24 @@
+// The AVX2 rows, see simd_rows.h. Only run on the cpus with AVX2 and FMA.
+// The isa is turned on for these functions only, the rest of the library
+// keeps the baseline of the build.
+#include <immintrin.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "kernels.h"
+#include "simd_rows.h"
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), \
+                             apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC target("avx2,fma")
+#endif
+
+#define LS_X86_AVX2
+#define LS_X86_ISA avx2
+#include "simd_rows_impl.h"
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
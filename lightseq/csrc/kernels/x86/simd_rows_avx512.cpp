@@ -0,0 +1,24 @@
+// The AVX-512 rows, see simd_rows.h. Only run on the cpus with AVX-512F.
+// The isa is turned on for these functions only, the rest of the library
+// keeps the baseline of the build.
+#include <immintrin.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "kernels.h"
+#include "simd_rows.h"
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f"))), \
+                             apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC target("avx512f")
+#endif
+
+#define LS_X86_AVX512
+#define LS_X86_ISA avx512
+#include "simd_rows_impl.h"
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
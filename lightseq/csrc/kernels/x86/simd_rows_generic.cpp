@@ -0,0 +1,31 @@
+// The rows of the baseline isa of the build, and the pick of the rows for the
+// cpu, see simd_rows.h.
+#include <immintrin.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "kernels.h"
+#include "simd_rows.h"
+
+#define LS_X86_ISA generic
+#include "simd_rows_impl.h"
+
+namespace lightseq {
+namespace x86 {
+
+const SimdRows& simd_rows() {
+  static const SimdRows rows = []() {
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return avx512::simd_rows();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      return avx2::simd_rows();
+    }
+#endif
+    return generic::simd_rows();
+  }();
+  return rows;
+}
+
+}  // namespace x86
+}  // namespace lightseq
@@ -0,0 +1,441 @@
+/*
+The rows of SimdRows for one isa, in the namespace LS_X86_ISA. Included by
+simd_rows_avx512.cpp and simd_rows_avx2.cpp, which define LS_X86_AVX512 or
+LS_X86_AVX2 and turn their isa on for the functions below, and by
+simd_rows_generic.cpp for the scalar ones. Only
+intrinsics and the C math functions are used here: an inline function of the
+C++ library built for AVX-512 could be the copy the linker keeps for the
+whole library.
+*/
+#include <immintrin.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "kernels.h"
+#include "simd_rows.h"
+
+#if defined(LS_X86_AVX512) || defined(LS_X86_AVX2)
+#define LS_X86_SIMD
+#endif
+
+namespace lightseq {
+namespace x86 {
+namespace LS_X86_ISA {
+
+#if defined(LS_X86_AVX512)
+typedef __m512 vec_t;
+constexpr int kVecSize = 16;
+
+inline vec_t vload(const float* p) { return _mm512_loadu_ps(p); }
+inline void vstore(float* p, vec_t v) { _mm512_storeu_ps(p, v); }
+inline vec_t vset1(float x) { return _mm512_set1_ps(x); }
+inline vec_t vadd(vec_t a, vec_t b) { return _mm512_add_ps(a, b); }
+inline vec_t vsub(vec_t a, vec_t b) { return _mm512_sub_ps(a, b); }
+inline vec_t vmul(vec_t a, vec_t b) { return _mm512_mul_ps(a, b); }
+inline vec_t vdiv(vec_t a, vec_t b) { return _mm512_div_ps(a, b); }
+inline vec_t vmax(vec_t a, vec_t b) { return _mm512_max_ps(a, b); }
+inline vec_t vmin(vec_t a, vec_t b) { return _mm512_min_ps(a, b); }
+// a * b + c
+inline vec_t vfma(vec_t a, vec_t b, vec_t c) {
+  return _mm512_fmadd_ps(a, b, c);
+}
+inline float vreduce_sum(vec_t v) { return _mm512_reduce_add_ps(v); }
+inline float vreduce_max(vec_t v) { return _mm512_reduce_max_ps(v); }
+inline vec_t vfloor(vec_t v) {
+  return _mm512_roundscale_ps(v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+}
+// 2^n of the integral n
+inline vec_t vpow2n(vec_t n) {
+  __m512i e = _mm512_add_epi32(_mm512_cvttps_epi32(n), _mm512_set1_epi32(127));
+  return _mm512_castsi512_ps(_mm512_slli_epi32(e, 23));
+}
+inline vec_t vabs(vec_t v) { return _mm512_abs_ps(v); }
+inline bool vany_gt(vec_t a, vec_t b) {
+  return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ) != 0;
+}
+inline vec_t vload_i32(const int32_t* p) {
+  return _mm512_cvtepi32_ps(_mm512_loadu_si512(p));
+}
+// round(v) + 128 saturated to [1, 255]
+inline void vstore_shift_u8(uint8_t* p, vec_t v) {
+  __m512i i32 = _mm512_add_epi32(_mm512_cvtps_epi32(v), _mm512_set1_epi32(128));
+  i32 = _mm512_max_epi32(i32, _mm512_set1_epi32(1));
+  _mm_storeu_si128((__m128i*)p, _mm512_cvtusepi32_epi8(i32));
+}
+#elif defined(LS_X86_SIMD)
+typedef __m256 vec_t;
+constexpr int kVecSize = 8;
+
+inline vec_t vload(const float* p) { return _mm256_loadu_ps(p); }
+inline void vstore(float* p, vec_t v) { _mm256_storeu_ps(p, v); }
+inline vec_t vset1(float x) { return _mm256_set1_ps(x); }
+inline vec_t vadd(vec_t a, vec_t b) { return _mm256_add_ps(a, b); }
+inline vec_t vsub(vec_t a, vec_t b) { return _mm256_sub_ps(a, b); }
+inline vec_t vmul(vec_t a, vec_t b) { return _mm256_mul_ps(a, b); }
+inline vec_t vdiv(vec_t a, vec_t b) { return _mm256_div_ps(a, b); }
+inline vec_t vmax(vec_t a, vec_t b) { return _mm256_max_ps(a, b); }
+inline vec_t vmin(vec_t a, vec_t b) { return _mm256_min_ps(a, b); }
+inline vec_t vfma(vec_t a, vec_t b, vec_t c) {
+  return _mm256_fmadd_ps(a, b, c);
+}
+inline float vreduce_sum(vec_t v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+inline float vreduce_max(vec_t v) {
+  __m128 s = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_max_ss(s, _mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+inline vec_t vfloor(vec_t v) { return _mm256_floor_ps(v); }
+inline vec_t vpow2n(vec_t n) {
+  __m256i e = _mm256_add_epi32(_mm256_cvttps_epi32(n), _mm256_set1_epi32(127));
+  return _mm256_castsi256_ps(_mm256_slli_epi32(e, 23));
+}
+inline vec_t vabs(vec_t v) {
+  return _mm256_andnot_ps(_mm256_set1_ps(-0.f), v);
+}
+inline bool vany_gt(vec_t a, vec_t b) {
+  return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ)) != 0;
+}
+inline vec_t vload_i32(const int32_t* p) {
+  return _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)p));
+}
+inline void vstore_shift_u8(uint8_t* p, vec_t v) {
+  __m256i i32 = _mm256_add_epi32(_mm256_cvtps_epi32(v), _mm256_set1_epi32(128));
+  i32 = _mm256_max_epi32(i32, _mm256_set1_epi32(1));
+  __m128i i16 = _mm_packus_epi32(_mm256_castsi256_si128(i32),
+                                 _mm256_extracti128_si256(i32, 1));
+  _mm_storel_epi64((__m128i*)p, _mm_packus_epi16(i16, i16));
+}
+#endif
+
+#ifdef LS_X86_SIMD
+// the cephes expf, exp(x) = 2^n * exp(r) with |r| <= ln(2) / 2, a relative
+// error of about 1e-7 over the clamped range.
+inline vec_t vexp(vec_t x) {
+  x = vmin(vmax(x, vset1(-87.3365f)), vset1(88.3762f));
+  vec_t n = vfloor(vfma(x, vset1(1.44269504088896341f), vset1(0.5f)));
+  x = vfma(n, vset1(-0.693359375f), x);
+  x = vfma(n, vset1(2.12194440e-4f), x);
+
+  vec_t y = vset1(1.9875691500e-4f);
+  y = vfma(y, x, vset1(1.3981999507e-3f));
+  y = vfma(y, x, vset1(8.3334519073e-3f));
+  y = vfma(y, x, vset1(4.1665795894e-2f));
+  y = vfma(y, x, vset1(1.6666665459e-1f));
+  y = vfma(y, x, vset1(5.0000001201e-1f));
+  y = vfma(y, vmul(x, x), vadd(x, vset1(1.f)));
+  return vmul(y, vpow2n(n));
+}
+
+// the tanh approximation of gelu as on cuda, tanh(z) = 1 - 2 / (exp(2z) + 1)
+inline vec_t vgelu(vec_t x) {
+  vec_t z = vmul(vmul(x, x), vset1(0.044715f));
+  z = vmul(vfma(z, x, x), vset1(2.f * 0.7978845608028654f));
+  vec_t tanh_z = vsub(vset1(1.f), vdiv(vset1(2.f), vadd(vexp(z), vset1(1.f))));
+  return vmul(vmul(x, vset1(0.5f)), vadd(tanh_z, vset1(1.f)));
+}
+#endif
+
+inline float gelu(float x) {
+  float cdf =
+      0.5f *
+      (1.0f + tanhf((0.7978845608028654f * (x + 0.044715f * x * x * x))));
+  return x * cdf;
+}
+
+void add_row(float* out, const float* a, const float* b, const float* c,
+             int n) {
+  int i = 0;
+#ifdef LS_X86_SIMD
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vec_t v = vadd(vload(a + i), vload(b + i));
+    if (c) v = vadd(v, vload(c + i));
+    vstore(out + i, v);
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = a[i] + b[i] + (c ? c[i] : 0.f);
+  }
+}
+
+void sum_square_row(const float* x, int n, float* sum, float* square_sum) {
+  float s = 0.f, square_s = 0.f;
+  int i = 0;
+#ifdef LS_X86_SIMD
+  vec_t v_sum = vset1(0.f), v_square_sum = vset1(0.f);
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vec_t v = vload(x + i);
+    v_sum = vadd(v_sum, v);
+    v_square_sum = vfma(v, v, v_square_sum);
+  }
+  s = vreduce_sum(v_sum);
+  square_s = vreduce_sum(v_square_sum);
+#endif
+  for (; i < n; i++) {
+    s += x[i];
+    square_s += x[i] * x[i];
+  }
+  *sum = s;
+  *square_sum = square_s;
+}
+
+void normalize_row(float* y, const float* x, float mean, float rstd,
+                   const float* scale, const float* bias, int n) {
+  int i = 0;
+#ifdef LS_X86_SIMD
+  vec_t v_mean = vset1(mean), v_rstd = vset1(rstd);
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vec_t v = vmul(vsub(vload(x + i), v_mean), v_rstd);
+    vstore(y + i, vfma(v, vload(scale + i), vload(bias + i)));
+  }
+#endif
+  for (; i < n; i++) {
+    y[i] = (x[i] - mean) * rstd * scale[i] + bias[i];
+  }
+}
+
+float add_max_row(float* y, const float* x, const float* b, int n) {
+  float max_val = kFloatInfNeg;
+  int i = 0;
+#ifdef LS_X86_SIMD
+  vec_t v_max = vset1(kFloatInfNeg);
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vec_t v = vload(x + i);
+    if (b) v = vadd(v, vload(b + i));
+    vstore(y + i, v);
+    v_max = vmax(v_max, v);
+  }
+  max_val = vreduce_max(v_max);
+#endif
+  for (; i < n; i++) {
+    y[i] = x[i] + (b ? b[i] : 0.f);
+    if (max_val < y[i]) max_val = y[i];
+  }
+  return max_val;
+}
+
+float exp_sum_row(float* y, float max_val, int n) {
+  float sum = 0.f;
+  int i = 0;
+#ifdef LS_X86_SIMD
+  vec_t v_sum = vset1(0.f);
+  vec_t v_row_max = vset1(max_val);
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vec_t v = vexp(vsub(vload(y + i), v_row_max));
+    vstore(y + i, v);
+    v_sum = vadd(v_sum, v);
+  }
+  sum = vreduce_sum(v_sum);
+#endif
+  for (; i < n; i++) {
+    y[i] = expf(y[i] - max_val);
+    sum += y[i];
+  }
+  return sum;
+}
+
+void scale_row(float* y, float scale, int n) {
+  int i = 0;
+#ifdef LS_X86_SIMD
+  vec_t v_scale = vset1(scale);
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vstore(y + i, vmul(vload(y + i), v_scale));
+  }
+#endif
+  for (; i < n; i++) {
+    y[i] *= scale;
+  }
+}
+
+template <bool is_relu>
+inline void bias_act_row(float* y, const float* x, const float* bias, int n) {
+  int i = 0;
+#ifdef LS_X86_SIMD
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vec_t v = vadd(vload(x + i), vload(bias + i));
+    vstore(y + i, is_relu ? vmax(v, vset1(0.f)) : vgelu(v));
+  }
+#endif
+  for (; i < n; i++) {
+    float v = x[i] + bias[i];
+    y[i] = is_relu ? (v < 0.f ? 0.f : v) : gelu(v);
+  }
+}
+
+void bias_relu_row(float* y, const float* x, const float* bias, int n) {
+  bias_act_row<true>(y, x, bias, n);
+}
+
+void bias_gelu_row(float* y, const float* x, const float* bias, int n) {
+  bias_act_row<false>(y, x, bias, n);
+}
+
+float amax_row(const float* x, int n) {
+  float amax = 0.f;
+  int i = 0;
+#ifdef LS_X86_SIMD
+  vec_t v_amax = vset1(0.f);
+  for (; i + kVecSize <= n; i += kVecSize) {
+    v_amax = vmax(v_amax, vabs(vload(x + i)));
+  }
+  amax = vreduce_max(v_amax);
+#endif
+  for (; i < n; i++) {
+    float v = fabsf(x[i]);
+    if (amax < v) amax = v;
+  }
+  return amax;
+}
+
+void quantize_shift_row(uint8_t* y, const float* x, float inv_scale, int n) {
+  int i = 0;
+#ifdef LS_X86_SIMD
+  vec_t v_inv_scale = vset1(inv_scale);
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vstore_shift_u8(y + i, vmul(vload(x + i), v_inv_scale));
+  }
+#endif
+  for (; i < n; i++) {
+    int v = int(nearbyintf(x[i] * inv_scale)) + 128;
+    y[i] = uint8_t(v < 1 ? 1 : (v > 255 ? 255 : v));
+  }
+}
+
+// 0 for the residual, 1 for relu and 2 for gelu.
+template <int act>
+inline void dequantize_row(float* out, const int32_t* c, float row_scale,
+                           const float* col_scales, const float* bias,
+                           const float* residual, int n) {
+  int i = 0;
+#ifdef LS_X86_SIMD
+  vec_t v_row_scale = vset1(row_scale);
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vec_t v = vmul(vmul(vload_i32(c + i), v_row_scale), vload(col_scales + i));
+    if (bias) v = vadd(v, vload(bias + i));
+    if (act == 1) {
+      v = vmax(v, vset1(0.f));
+    } else if (act == 2) {
+      v = vgelu(v);
+    } else if (residual) {
+      v = vadd(v, vload(residual + i));
+    }
+    vstore(out + i, v);
+  }
+#endif
+  for (; i < n; i++) {
+    float v = c[i] * row_scale * col_scales[i] + (bias ? bias[i] : 0.f);
+    if (act == 1) {
+      v = v < 0.f ? 0.f : v;
+    } else if (act == 2) {
+      v = gelu(v);
+    } else if (residual) {
+      v += residual[i];
+    }
+    out[i] = v;
+  }
+}
+
+void dequantize_relu_row(float* out, const int32_t* c, float row_scale,
+                         const float* col_scales, const float* bias, int n) {
+  dequantize_row<1>(out, c, row_scale, col_scales, bias, nullptr, n);
+}
+
+void dequantize_gelu_row(float* out, const int32_t* c, float row_scale,
+                         const float* col_scales, const float* bias, int n) {
+  dequantize_row<2>(out, c, row_scale, col_scales, bias, nullptr, n);
+}
+
+void dequantize_res_row(float* out, const int32_t* c, float row_scale,
+                        const float* col_scales, const float* bias,
+                        const float* residual, int n) {
+  dequantize_row<0>(out, c, row_scale, col_scales, bias, residual, n);
+}
+
+// insert v at i into the descending top k.
+inline void topk_insert(float* top_val, int* top_idx, int k, float v, int i) {
+  if (!(v > top_val[k - 1])) return;
+  int j = k - 1;
+  for (; j > 0 && top_val[j - 1] < v; j--) {
+    top_val[j] = top_val[j - 1];
+    top_idx[j] = top_idx[j - 1];
+  }
+  top_val[j] = v;
+  top_idx[j] = i;
+}
+
+float row_topk(const float* logits, const float* bias, int n, int k,
+               float* top_val, int* top_idx, bool with_sum) {
+  for (int j = 0; j < k; j++) {
+    top_val[j] = kFloatInfNeg;
+    top_idx[j] = -1;
+  }
+
+  int i = 0;
+#ifdef LS_X86_SIMD
+  // a vector only goes through the scalar insertion if one of its lanes
+  // beats the current k-th value, which is rare after the first vectors.
+  float lanes[kVecSize];
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vec_t v = vadd(vload(logits + i), vload(bias + i));
+    if (!vany_gt(v, vset1(top_val[k - 1]))) continue;
+    vstore(lanes, v);
+    for (int l = 0; l < kVecSize; l++) {
+      topk_insert(top_val, top_idx, k, lanes[l], i + l);
+    }
+  }
+#endif
+  for (; i < n; i++) topk_insert(top_val, top_idx, k, logits[i] + bias[i], i);
+  if (!with_sum) return 0.f;
+
+  const float max_val = top_val[0];
+  float sum = 0.f;
+  i = 0;
+#ifdef LS_X86_SIMD
+  vec_t v_sum = vset1(0.f);
+  vec_t v_max = vset1(max_val);
+  for (; i + kVecSize <= n; i += kVecSize) {
+    vec_t v = vadd(vload(logits + i), vload(bias + i));
+    v_sum = vadd(v_sum, vexp(vsub(v, v_max)));
+  }
+  sum = vreduce_sum(v_sum);
+#endif
+  for (; i < n; i++) sum += expf(logits[i] + bias[i] - max_val);
+  return sum;
+}
+
+SimdRows simd_rows() {
+  SimdRows rows;
+  rows.add_row = add_row;
+  rows.sum_square_row = sum_square_row;
+  rows.normalize_row = normalize_row;
+  rows.add_max_row = add_max_row;
+  rows.exp_sum_row = exp_sum_row;
+  rows.scale_row = scale_row;
+  rows.bias_relu_row = bias_relu_row;
+  rows.bias_gelu_row = bias_gelu_row;
+  rows.amax_row = amax_row;
+  rows.quantize_shift_row = quantize_shift_row;
+  rows.dequantize_relu_row = dequantize_relu_row;
+  rows.dequantize_gelu_row = dequantize_gelu_row;
+  rows.dequantize_res_row = dequantize_res_row;
+  rows.row_topk = row_topk;
+#if defined(LS_X86_AVX512)
+  rows.isa = "avx512";
+#elif defined(LS_X86_SIMD)
+  rows.isa = "avx2";
+#else
+  rows.isa = "scalar";
+#endif
+  return rows;
+}
+
+}  // namespace LS_X86_ISA
+}  // namespace x86
+}  // namespace lightseq
+
+#undef LS_X86_SIMD
@@ -0,0 +1,658 @@
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "kernels.h"
+#include "simd_rows.h"
+
+namespace lightseq {
+namespace x86 {
+
+template <>
+void launch_enc_emb<float>(const float* token_emb, const float* pos_emb,
+                           const int* tokens, float* output, float* pad_mask,
+                           int pad_id, int batch_size, int seq_len,
+                           int hidden_dim, const float* lang_emb,
+                           const int* lang_id, int multilg_type) {
+  const SimdRows& simd = simd_rows();
+  parallel_for(
+      0, batch_size * seq_len, GRAIN_SIZE / hidden_dim,
+      [&](int64_t begin, int64_t end) {
+        for (int64_t idx = begin; idx < end; idx++) {
+          int batch_idx = idx / seq_len, seq_idx = idx % seq_len;
+          const float* emb = token_emb;
+          const float* lemb = nullptr;
+          int token;
+          bool is_pad;
+          if (multilg_type == 2 && seq_idx == 0) {
+            // the language of the sentence as its first token.
+            emb = lang_emb;
+            token = lang_id[batch_idx];
+            is_pad = false;
+          } else {
+            token = multilg_type == 2
+                        ? tokens[batch_idx * (seq_len - 1) + seq_idx - 1]
+                        : tokens[idx];
+            is_pad = token == pad_id;
+            if (multilg_type == 1) {
+              lemb = lang_emb + size_t(lang_id[batch_idx]) * hidden_dim;
+            }
+          }
+
+          float* out = output + idx * hidden_dim;
+          if (is_pad) {
+            pad_mask[idx] = kFloatInfNeg;
+            std::memset(out, 0, hidden_dim * sizeof(float));
+            continue;
+          }
+          pad_mask[idx] = 0.f;
+          simd.add_row(out, emb + size_t(token) * hidden_dim,
+                       pos_emb + size_t(seq_idx) * hidden_dim, lemb,
+                       hidden_dim);
+        }
+      });
+}
+
+template <>
+void launch_layer_norm<float>(float* ln_res, float* vars, float* means,
+                              const float* inp, const float* scale,
+                              const float* bias, int batch_size,
+                              int hidden_dim) {
+  const SimdRows& simd = simd_rows();
+  parallel_for(
+      0, batch_size, GRAIN_SIZE / hidden_dim, [&](int64_t begin, int64_t end) {
+        for (int64_t row = begin; row < end; row++) {
+          const float* x = inp + row * hidden_dim;
+          float* y = ln_res + row * hidden_dim;
+
+          float sum, square_sum;
+          simd.sum_square_row(x, hidden_dim, &sum, &square_sum);
+
+          float mean = sum / hidden_dim;
+          float var = square_sum / hidden_dim - mean * mean + kLnEpsilon;
+          if (means != nullptr) means[row] = mean;
+          vars[row] = var;
+          float rstd = 1.f / sqrtf(var);
+          simd.normalize_row(y, x, mean, rstd, scale, bias, hidden_dim);
+        }
+      });
+}
+
+template <>
+void launch_attn_softmax<float>(float* out, const float* inp,
+                                const float* attn_mask, int batch_size,
+                                int nhead, int from_len, int to_len,
+                                int kv_size, bool mask_future) {
+  const SimdRows& simd = simd_rows();
+  parallel_for(
+      0, int64_t(batch_size) * nhead * from_len, GRAIN_SIZE / to_len,
+      [&](int64_t begin, int64_t end) {
+        for (int64_t row = begin; row < end; row++) {
+          int batch_idx = row / (nhead * from_len);
+          int token_idx = row % from_len;
+          const float* x = inp + row * to_len;
+          float* y = out + row * to_len;
+          const float* mask =
+              attn_mask ? attn_mask + size_t(batch_idx) * kv_size : nullptr;
+          // query i attends to the keys [0, i + to_len - from_len]
+          int valid_len =
+              mask_future ? std::min(to_len, token_idx + to_len - from_len + 1)
+                          : to_len;
+
+          // step 1. the masked scores and their max, into y
+          float max_val = simd.add_max_row(y, x, mask, valid_len);
+
+          // step 2. exp and sum
+          float sum = simd.exp_sum_row(y, max_val, valid_len);
+
+          // step 3. normalize, the future keys are zeros
+          simd.scale_row(y, 1.f / (sum + 1e-8f), valid_len);
+          for (int i = valid_len; i < to_len; i++) {
+            y[i] = 0.f;
+          }
+        }
+      });
+}
+
+template <ActivationType act_type, typename T>
+void launch_bias_act(T* out, const T* inp, const T* bias, int total_count,
+                     int dim) {
+  auto bias_act_row = act_type == ActivationType::kRelu
+                          ? simd_rows().bias_relu_row
+                          : simd_rows().bias_gelu_row;
+  int rows = total_count / dim;
+  parallel_for(0, rows, GRAIN_SIZE / dim, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      bias_act_row(out + row * dim, inp + row * dim, bias, dim);
+    }
+  });
+}
+
+template void launch_bias_act<ActivationType::kRelu, float>(
+    float* out, const float* inp, const float* bias, int total_count, int dim);
+template void launch_bias_act<ActivationType::kGelu, float>(
+    float* out, const float* inp, const float* bias, int total_count, int dim);
+
+template <>
+void launch_bias_res<float>(float* out, const float* inp, const float* bias,
+                            const float* residual, int total_count, int dim) {
+  auto add_row = simd_rows().add_row;
+  int rows = total_count / dim;
+  parallel_for(0, rows, GRAIN_SIZE / dim, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      add_row(out + row * dim, inp + row * dim, bias, residual + row * dim,
+              dim);
+    }
+  });
+}
+
+template <>
+void launch_bias_add_transform_20314<float>(float* output, const float* input,
+                                            const float* bias, int dim_0,
+                                            int dim_1, int dim_2, int dim_3,
+                                            int dim_4) {
+  // a row of dim_4 is contiguous in the input and the output.
+  auto add_row = simd_rows().add_row;
+  int64_t rows = int64_t(dim_0) * dim_1 * dim_2 * dim_3;
+  parallel_for(0, rows, GRAIN_SIZE / dim_4, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      int64_t id3 = row % dim_3;
+      int64_t id2 = row / dim_3 % dim_2;
+      int64_t id1 = row / (dim_3 * dim_2) % dim_1;
+      int64_t id0 = row / (dim_3 * dim_2 * dim_1);
+      int64_t trg_row = ((id2 * dim_0 + id0) * dim_3 + id3) * dim_1 + id1;
+      add_row(output + trg_row * dim_4, input + row * dim_4,
+              bias + (id2 * dim_3 + id3) * dim_4, nullptr, dim_4);
+    }
+  });
+}
+
+template <typename T>
+void launch_transform_0213(const T* input, T* output, int sz0, int sz1,
+                           int sz2, int sz3) {
+  int64_t rows = int64_t(sz0) * sz1 * sz2;
+  parallel_for(0, rows, GRAIN_SIZE / sz3, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      int64_t id2 = row % sz2;
+      int64_t id1 = row / sz2 % sz1;
+      int64_t id0 = row / (sz2 * sz1);
+      int64_t trg_row = (id0 * sz2 + id2) * sz1 + id1;
+      std::memcpy(output + trg_row * sz3, input + row * sz3,
+                  sz3 * sizeof(T));
+    }
+  });
+}
+
+template void launch_transform_0213<float>(const float* input, float* output,
+                                           int sz0, int sz1, int sz2,
+                                           int sz3);
+
+template <>
+void launch_quantize_shift_rows<float>(uint8_t* q, float* scales,
+                                       const float* inp, int rows, int cols) {
+  const SimdRows& simd = simd_rows();
+  parallel_for(0, rows, GRAIN_SIZE / cols, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      const float* x = inp + row * cols;
+      float amax = simd.amax_row(x, cols);
+      float scale = amax > 0.f ? amax / 127.f : 1.f;
+      scales[row] = scale;
+      simd.quantize_shift_row(q + row * cols, x, 1.f / scale, cols);
+    }
+  });
+}
+
+void compute_shift_compensation(const int8_t* weight, int32_t* comp, int n,
+                                int k) {
+  parallel_for(0, n, GRAIN_SIZE / k, [&](int64_t begin, int64_t end) {
+    for (int64_t j = begin; j < end; j++) {
+      int32_t sum = 0;
+      for (int i = 0; i < k; i++) {
+        sum += weight[j * k + i];
+      }
+      comp[j] = -128 * sum;
+    }
+  });
+}
+
+template <ActivationType act_type, typename T>
+void launch_dequantize_bias_act(T* out, const int32_t* c,
+                                const float* row_scales,
+                                const float* col_scales, const T* bias,
+                                int rows, int cols) {
+  auto dequantize_row = act_type == ActivationType::kRelu
+                            ? simd_rows().dequantize_relu_row
+                            : simd_rows().dequantize_gelu_row;
+  parallel_for(0, rows, GRAIN_SIZE / cols, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      dequantize_row(out + row * cols, c + row * cols, row_scales[row],
+                     col_scales, bias, cols);
+    }
+  });
+}
+
+template void launch_dequantize_bias_act<ActivationType::kRelu, float>(
+    float* out, const int32_t* c, const float* row_scales,
+    const float* col_scales, const float* bias, int rows, int cols);
+template void launch_dequantize_bias_act<ActivationType::kGelu, float>(
+    float* out, const int32_t* c, const float* row_scales,
+    const float* col_scales, const float* bias, int rows, int cols);
+
+template <>
+void launch_dequantize_bias_res<float>(float* out, const int32_t* c,
+                                       const float* row_scales,
+                                       const float* col_scales,
+                                       const float* bias,
+                                       const float* residual, int rows,
+                                       int cols) {
+  auto dequantize_res_row = simd_rows().dequantize_res_row;
+  parallel_for(0, rows, GRAIN_SIZE / cols, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      dequantize_res_row(out + row * cols, c + row * cols, row_scales[row],
+                         col_scales, bias,
+                         residual ? residual + row * cols : nullptr, cols);
+    }
+  });
+}
+
+namespace {
+
+// the first of the n indices whose prefix sum of weight(i) exceeds r times
+// their sum
+template <typename Weight>
+inline int sample_index(const Weight& weight, int n, float r) {
+  float total = 0.f;
+  for (int i = 0; i < n; i++) total += weight(i);
+  float threshold = r * total, prefix = 0.f;
+  for (int i = 0; i < n; i++) {
+    prefix += weight(i);
+    if (prefix > threshold) return i;
+  }
+  return n - 1;
+}
+
+}  // namespace
+
+template <>
+void launch_dec_emb<float>(const float* token_emb, const float* pos_emb,
+                           int* tokens, const float* lang_emb,
+                           const int* lang_id, float* output, int batch_size,
+                           int beam_size, int hidden_dim, int vocab_size,
+                           int step, int max_step, int multilg_type) {
+  if (step >= max_step) {
+    throw std::runtime_error("violate step < max_step");
+  }
+  auto add_row = simd_rows().add_row;
+  parallel_for(
+      0, batch_size * beam_size, GRAIN_SIZE / hidden_dim,
+      [&](int64_t begin, int64_t end) {
+        for (int64_t row = begin; row < end; row++) {
+          int batch_idx = row / beam_size;
+          float* out = output + row * hidden_dim;
+          const float* pos = pos_emb + size_t(step) * hidden_dim;
+          if ((multilg_type == 2 || multilg_type == 3) && step == 0) {
+            // the bos of sentence level multilg is the target language.
+            int lid = lang_id[batch_idx];
+            tokens[row * max_step] = lid;
+            add_row(out, lang_emb + size_t(lid) * hidden_dim, pos, nullptr,
+                    hidden_dim);
+          } else {
+            // token_emb is [hidden_dim, vocab_size] for the decoder.
+            int token = tokens[row * max_step + step];
+            for (int i = 0; i < hidden_dim; i++) {
+              out[i] = token_emb[size_t(i) * vocab_size + token] + pos[i];
+            }
+          }
+          if (multilg_type == 1) {
+            const float* lemb =
+                lang_emb + size_t(lang_id[batch_idx]) * hidden_dim;
+            add_row(out, out, lemb, nullptr, hidden_dim);
+          }
+        }
+      });
+}
+
+template <typename T>
+void launch_concat3_dim1(const T* inp1, const T* inp2, T* output, int sz0,
+                         int sz2, int sz1_1, int sz1_2) {
+  const size_t len1 = size_t(sz1_1) * sz2, len2 = size_t(sz1_2) * sz2;
+  parallel_for(0, sz0, GRAIN_SIZE / (len1 + len2 + 1),
+               [&](int64_t begin, int64_t end) {
+                 for (int64_t i = begin; i < end; i++) {
+                   T* out = output + i * (len1 + len2);
+                   std::memcpy(out, inp1 + i * len1, len1 * sizeof(T));
+                   std::memcpy(out + len1, inp2 + i * len2, len2 * sizeof(T));
+                 }
+               });
+}
+
+template void launch_concat3_dim1<float>(const float* inp1, const float* inp2,
+                                         float* output, int sz0, int sz2,
+                                         int sz1_1, int sz1_2);
+
+template <typename T>
+void launch_filling_concat3_dim1(T* output, const T* inp, int sz0, int mx_sz1,
+                                 int sz2, int sz1_0, int sz1_1) {
+  const size_t len = size_t(sz1_1) * sz2;
+  parallel_for(0, sz0, GRAIN_SIZE / (len + 1), [&](int64_t begin, int64_t end) {
+    for (int64_t i = begin; i < end; i++) {
+      std::memcpy(output + (i * mx_sz1 + sz1_0) * sz2, inp + i * len,
+                  len * sizeof(T));
+    }
+  });
+}
+
+template void launch_filling_concat3_dim1<float>(float* output,
+                                                 const float* inp, int sz0,
+                                                 int mx_sz1, int sz2,
+                                                 int sz1_0, int sz1_1);
+
+template <typename T>
+void launch_sequence_pooling(const T* inp, const int* tokens, T* out,
+                             int batch_size, int seq_len, int hidden_dim,
+                             int padding_id, PoolingMethod method,
+                             bool l2_norm) {
+  parallel_for(
+      0, batch_size, GRAIN_SIZE / (size_t(seq_len) * hidden_dim + 1),
+      [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+          const T* seq_inp = inp + i * seq_len * hidden_dim;
+          const int* seq_tokens = tokens + i * seq_len;
+          T* seq_out = out + i * hidden_dim;
+          if (method == PoolingMethod::kCls) {
+            std::memcpy(seq_out, seq_inp, hidden_dim * sizeof(T));
+          } else {
+            bool is_max = method == PoolingMethod::kMax;
+            std::fill(seq_out, seq_out + hidden_dim,
+                      is_max ? kFloatInfNeg : 0.f);
+            int count = 0;
+            for (int pos = 0; pos < seq_len; pos++) {
+              if (seq_tokens[pos] == padding_id) continue;
+              const T* x = seq_inp + pos * hidden_dim;
+              for (int d = 0; d < hidden_dim; d++) {
+                seq_out[d] = is_max ? std::max(seq_out[d], x[d])
+                                    : seq_out[d] + x[d];
+              }
+              count++;
+            }
+            // a sequence of padding only is pooled to zeros.
+            float scale = count == 0 ? 0.f : (is_max ? 1.f : 1.f / count);
+            for (int d = 0; d < hidden_dim; d++) seq_out[d] *= scale;
+          }
+          if (!l2_norm) continue;
+          float sum_square = 0.f;
+          for (int d = 0; d < hidden_dim; d++) {
+            sum_square += seq_out[d] * seq_out[d];
+          }
+          float scale = 1.f / std::sqrt(std::max(sum_square, 1e-12f));
+          for (int d = 0; d < hidden_dim; d++) seq_out[d] *= scale;
+        }
+      });
+}
+
+template void launch_sequence_pooling<float>(const float* inp,
+                                             const int* tokens, float* out,
+                                             int batch_size, int seq_len,
+                                             int hidden_dim, int padding_id,
+                                             PoolingMethod method,
+                                             bool l2_norm);
+
+template <>
+void beam_search_topk<float>(const float* logits, const float* logit_bias,
+                             const float* seq_probs, const float* seq_score,
+                             const int* alive_seq, int* can_idx,
+                             float* can_score, int* num_beam_can,
+                             int vocab_size, int max_step, float length_norm,
+                             int cur_step, int batch_size, int beam_size,
+                             int end_id) {
+  auto row_topk = simd_rows().row_topk;
+  parallel_for(0, batch_size, 1, [&](int64_t begin, int64_t end) {
+    const int num_can = beam_size * beam_size;
+    std::vector<float> beam_score(num_can);
+    std::vector<int> beam_idx(num_can);
+    std::vector<int> order(num_can);
+    for (int64_t batch_id = begin; batch_id < end; batch_id++) {
+      // step 1. the top beam_size tokens of every beam, as the candidates
+      for (int beam_id = 0; beam_id < beam_size; beam_id++) {
+        int64_t row = batch_id * beam_size + beam_id;
+        float* top_val = beam_score.data() + beam_id * beam_size;
+        int* top_idx = beam_idx.data() + beam_id * beam_size;
+        int beam_offset = beam_id * vocab_size;
+        if (cur_step != 0 && alive_seq[row * max_step + cur_step] == end_id) {
+          // a finished beam only keeps its eos, with its score unchanged
+          for (int k = 0; k < beam_size; k++) {
+            top_val[k] = k == 0 ? seq_score[row] : kFloatInfNeg;
+            top_idx[k] = end_id + beam_offset;
+          }
+          continue;
+        }
+        float sum_exp = row_topk(logits + row * vocab_size, logit_bias,
+                                 vocab_size, beam_size, top_val, top_idx, true);
+        float log_prob_base = seq_probs[row] - logf(sum_exp) - top_val[0];
+        for (int k = 0; k < beam_size; k++) {
+          if (top_idx[k] < 0) {
+            top_idx[k] = end_id + beam_offset;
+            continue;
+          }
+          top_val[k] = std::max((top_val[k] + log_prob_base) * length_norm,
+                                kMinLogProbability + 1.f) +
+                       batch_id * kMinLogProbability;
+          top_idx[k] += beam_offset;
+        }
+      }
+
+      // step 2. the top beam_size among the candidates of the batch item
+      for (int i = 0; i < num_can; i++) order[i] = i;
+      std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return beam_score[a] > beam_score[b];
+      });
+      for (int k = 0; k < beam_size; k++) {
+        int pos = batch_id * beam_size + k;
+        can_score[pos] = beam_score[order[k]];
+        can_idx[pos] = beam_idx[order[k]];
+        num_beam_can[pos + 1] = pos;
+      }
+    }
+  });
+}
+
+void prune_beams(int* can_idx, float* can_score, const int* num_can_per_beam,
+                 int vocab_size, int batch_size, int beam_size,
+                 float abs_margin, float rel_margin, int end_id) {
+  for (int batch_id = 0; batch_id < batch_size; batch_id++) {
+    int* batch_idx = can_idx + num_can_per_beam[batch_id * beam_size];
+    float* batch_score = can_score + num_can_per_beam[batch_id * beam_size];
+    float offset = batch_id * kMinLogProbability;
+    float best = batch_score[0] - offset;
+    float margin = std::min(abs_margin > 0.f ? abs_margin : INFINITY,
+                            rel_margin > 0.f ? rel_margin * std::fabs(best)
+                                             : INFINITY);
+    for (int k = 1; k < beam_size; k++) {
+      if (batch_score[k] - offset >= best - margin) continue;
+      batch_idx[k] = batch_idx[k] / vocab_size * vocab_size + end_id;
+      batch_score[k] = kMinLogProbability + 0.5f + offset;
+    }
+  }
+}
+
+void refresh_result(const int* can_idx, const float* can_score,
+                    const int* num_can_per_beam, const int* old_alive_seq,
+                    int* new_alive_seq, float* seq_probs, float* seq_score,
+                    int* num_finish_beam, int vocab_size, int cur_step,
+                    float length_norm, int batch_size, int beam_size,
+                    int max_step, int end_id) {
+  int num_finish = 0;
+  for (int batch_id = 0; batch_id < batch_size; batch_id++) {
+    for (int beam_id = 0; beam_id < beam_size; beam_id++) {
+      int row = batch_id * beam_size + beam_id;
+      int can_pos = num_can_per_beam[batch_id * beam_size] + beam_id;
+      int can_beam_id = can_idx[can_pos] / vocab_size;
+      int can_vocab_id = can_idx[can_pos] % vocab_size;
+
+      const int* old_seq =
+          old_alive_seq + size_t(batch_id * beam_size + can_beam_id) * max_step;
+      int* new_seq = new_alive_seq + size_t(row) * max_step;
+      for (int i = 0; i < max_step; i++) {
+        new_seq[i] = i <= cur_step       ? old_seq[i]
+                     : i == cur_step + 1 ? can_vocab_id
+                                         : end_id;
+      }
+
+      seq_score[row] = can_score[can_pos];
+      if (can_vocab_id != end_id) {
+        // the log probability without the length penalty and batch offset
+        seq_probs[row] =
+            (can_score[can_pos] - batch_id * kMinLogProbability) / length_norm;
+      } else {
+        num_finish++;
+      }
+    }
+  }
+  *num_finish_beam = num_finish;
+}
+
+template <typename T>
+void refresh_cache(const int* num_can_per_beam, const int* can_idx,
+                   const T* caches_k, const T* caches_v, T* new_caches_k,
+                   T* new_caches_v, size_t layer_size, int num_layers,
+                   int batch_size, int beam_size, int dim_per_head,
+                   int head_num, int vocab_size, int cur_step, int max_step,
+                   int end_id) {
+  // [num_layers, batch_size, beam_size, head_num, max_step, dim_per_head],
+  // the first cur_step + 1 steps of the beam the candidate extends.
+  const size_t step_len = size_t(cur_step + 1) * dim_per_head;
+  const size_t head_size = size_t(max_step) * dim_per_head;
+  const size_t beam_len = head_size * head_num;
+  parallel_for(
+      0, int64_t(num_layers) * batch_size * beam_size,
+      GRAIN_SIZE / (2 * step_len * head_num), [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+          int layer_id = i / (batch_size * beam_size);
+          int batch_id = i / beam_size % batch_size;
+          int beam_id = i % beam_size;
+          int can_pos = num_can_per_beam[batch_id * beam_size] + beam_id;
+          if (cur_step != 0 && can_idx[can_pos] % vocab_size == end_id) {
+            continue;
+          }
+          int can_beam_id = can_idx[can_pos] / vocab_size;
+          size_t batch_offset =
+              layer_id * layer_size + size_t(batch_id) * beam_size * beam_len;
+          size_t src = batch_offset + can_beam_id * beam_len;
+          size_t dst = batch_offset + beam_id * beam_len;
+          for (int h = 0; h < head_num; h++) {
+            size_t offset = h * head_size;
+            std::memcpy(new_caches_k + dst + offset, caches_k + src + offset,
+                        step_len * sizeof(T));
+            std::memcpy(new_caches_v + dst + offset, caches_v + src + offset,
+                        step_len * sizeof(T));
+          }
+        }
+      });
+}
+
+template void refresh_cache<float>(
+    const int* num_can_per_beam, const int* can_idx, const float* caches_k,
+    const float* caches_v, float* new_caches_k, float* new_caches_v,
+    size_t layer_size, int num_layers, int batch_size, int beam_size,
+    int dim_per_head, int head_num, int vocab_size, int cur_step, int max_step,
+    int end_id);
+
+template <>
+void launch_topk_sample<float>(const float* logits, const float* logit_bias,
+                               int* tokens, int* unfinished,
+                               const float* random_x, int batch_size,
+                               int batch_seq_len, int prompt_len, int max_step,
+                               int logits_seq_len, int vocab_size, int topk,
+                               int eos_id) {
+  topk = std::min(topk, vocab_size);
+  auto row_topk = simd_rows().row_topk;
+  parallel_for(0, batch_size, 1, [&](int64_t begin, int64_t end) {
+    std::vector<float> top_val(topk);
+    std::vector<int> top_idx(topk);
+    for (int64_t batch_id = begin; batch_id < end; batch_id++) {
+      int* last_token = tokens + batch_id * max_step + batch_seq_len - 1;
+      if (batch_seq_len > prompt_len && last_token[0] == eos_id) {
+        last_token[1] = eos_id;
+        continue;
+      }
+      const float* row =
+          logits + ((batch_id + 1) * logits_seq_len - 1) * size_t(vocab_size);
+      row_topk(row, logit_bias, vocab_size, topk, top_val.data(),
+               top_idx.data(), false);
+      // the probabilities of the top k, relative to their sum
+      const float max_val = top_val[0];
+      for (int k = 0; k < topk; k++) {
+        top_val[k] = top_idx[k] < 0 ? 0.f : expf(top_val[k] - max_val);
+      }
+      int pick = sample_index([&](int j) { return top_val[j]; }, topk,
+                              random_x[batch_id]);
+      last_token[1] = top_idx[pick];
+    }
+  });
+  *unfinished = 0;
+  for (int batch_id = 0; batch_id < batch_size; batch_id++) {
+    if (tokens[batch_id * max_step + batch_seq_len] != eos_id) *unfinished = 1;
+  }
+}
+
+template <>
+void launch_topp_sample<float>(const float* logits, const float* logit_bias,
+                               int* tokens, int* unfinished,
+                               const float* random_x, int batch_size,
+                               int batch_seq_len, int prompt_len, int max_step,
+                               int logits_seq_len, int vocab_size, float topp,
+                               int eos_id) {
+  const SimdRows& simd = simd_rows();
+  parallel_for(0, batch_size, 1, [&](int64_t begin, int64_t end) {
+    std::vector<float> probs(vocab_size);
+    std::vector<int> order(vocab_size);
+    for (int64_t batch_id = begin; batch_id < end; batch_id++) {
+      int* last_token = tokens + batch_id * max_step + batch_seq_len - 1;
+      if (batch_seq_len > prompt_len && last_token[0] == eos_id) {
+        last_token[1] = eos_id;
+        continue;
+      }
+      const float* row =
+          logits + ((batch_id + 1) * logits_seq_len - 1) * size_t(vocab_size);
+
+      // step 1. the unnormalized probabilities, exp(x - max)
+      float max_val =
+          simd.add_max_row(probs.data(), row, logit_bias, vocab_size);
+      float sum = simd.exp_sum_row(probs.data(), max_val, vocab_size);
+
+      // step 2. the smallest set of the most probable tokens whose mass
+      // reaches topp, the nucleus is usually small so it is sorted partially
+      // with a growing bound.
+      for (int i = 0; i < vocab_size; i++) order[i] = i;
+      auto greater = [&](int a, int b) { return probs[a] > probs[b]; };
+      const float threshold = topp * sum;
+      int num_sorted = 0, nucleus = vocab_size;
+      float prefix = 0.f;
+      for (int bound = std::min(64, vocab_size); num_sorted < vocab_size;
+           bound = std::min(bound * 16, vocab_size)) {
+        std::partial_sort(order.begin() + num_sorted, order.begin() + bound,
+                          order.end(), greater);
+        for (; num_sorted < bound; num_sorted++) {
+          prefix += probs[order[num_sorted]];
+          if (prefix >= threshold) break;
+        }
+        if (num_sorted < bound) {
+          nucleus = num_sorted + 1;
+          break;
+        }
+      }
+
+      // step 3. sample in the nucleus
+      int pick = sample_index([&](int j) { return probs[order[j]]; }, nucleus,
+                              random_x[batch_id]);
+      last_token[1] = order[pick];
+    }
+  });
+  *unfinished = 0;
+  for (int batch_id = 0; batch_id < batch_size; batch_id++) {
+    if (tokens[batch_id * max_step + batch_seq_len] != eos_id) *unfinished = 1;
+  }
+}
+
+}  // namespace x86
+}  // namespace lightseq
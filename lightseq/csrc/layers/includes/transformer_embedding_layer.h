@@ -24,11 +24,25 @@ class TransformerEmbeddingLayer {
 
   void Backward(const T *grad_output_ptr, const int *input_ptr);
 
+  // The grads of the embeddings as the sorted unique rows of the batch
+  // instead of the whole table, see launch_d_lookup_scale_pos_dropout_sparse,
+  // for layers without trainable positions and quantization. rows and
+  // grad_rows hold the batch tokens, num_rows is a device int.
+  void BackwardSparse(const T *grad_output_ptr, const int *input_ptr,
+                      T *grad_rows_ptr, int *rows_ptr, int *num_rows_ptr);
+
   void set_cur_batch_shape(int batch_size, int seq_len) {
     _batch_size = batch_size;
     _seq_len = seq_len;
   }
 
+  // Packed batch of the next Forward, nullptr if it is padded. The positions
+  // restart at every sequence, see launch_packed_seq_ids.
+  void set_packed_seqs(const int *cu_seqlens, int num_seqs) {
+    _cu_seqlens = cu_seqlens;
+    _num_seqs = num_seqs;
+  }
+
   void SetTrainingMode(bool training);
   void SetQuantMode(bool enable_quant);
   inline bool IsTrainingMode() const { return _training; }
@@ -76,6 +90,7 @@ class TransformerEmbeddingLayer {
     // free local gpu memory
     cuda_free(_dropout_mask);
     cuda_free(_tokens_position);
+    cuda_free(_sparse_workspace);
   }
 
   // const parameter between batch
@@ -93,8 +108,13 @@ class TransformerEmbeddingLayer {
   bool _training;
   bool _trainable_pos;
   bool _enable_quant;
+  const int *_cu_seqlens = nullptr;
+  int _num_seqs = 0;
   uint8_t *_dropout_mask;
   int *_tokens_position;
+  // of BackwardSparse, allocated by its first call.
+  char *_sparse_workspace = nullptr;
+  size_t _sparse_workspace_bytes = 0;
 
   // weights ptr
   const T *_pos_embeddings_ptr;
@@ -6,6 +6,7 @@
 #include <cuda_runtime_api.h>
 #include <algorithm>
 #include <type_traits>
+#include <vector>
 
 #include "cuda_util.h"
 #include "dropout.h"
@@ -49,6 +50,18 @@ class TransformerEncoderLayer {
 
   void zero_mask_grad();
 
+  // Neither the int8 gemms nor the packed batches run on the flash
+  // attention, they take the attention probs.
+  bool use_flash_attn() const {
+    return _flash_attn && !_enable_quant && !_cu_seqlens;
+  }
+
+  // The pre-ln quantizes the input of the int8 gemm after it in the same
+  // kernel, see launch_layer_norm_i8, for the row major and col32 inputs.
+  static bool fuse_ln_quantize(LSLayout in_layout) {
+    return in_layout == kRowMajor || in_layout == kCol32;
+  }
+
   void set_cur_batch_shape(int batch_size, int seq_len) {
     _batch_size = batch_size;
     _seq_len = seq_len;
@@ -59,10 +72,22 @@ class TransformerEncoderLayer {
     _attn_context.SetConfig(_hidden_size / _heads, _seq_len, _seq_len);
   }
 
+  // Packed batch of the next Forward, nullptr if it is padded, see
+  // launch_packed_seq_ids. The tokens attend only within their sequence.
+  void set_packed_seqs(const int *cu_seqlens, int num_seqs) {
+    _cu_seqlens = cu_seqlens;
+    _num_seqs = num_seqs;
+  }
+
   void SetTrainingMode(bool training);
   void SetQuantMode(bool enable_quant);
   inline bool IsTrainingMode() const { return _training; }
 
+  // The next Backward adds its weight grads onto the buffer of
+  // assign_grad_ptr instead of overwriting it, for the micro batches of a
+  // gradient accumulation but the first one. Not with quantization.
+  void set_accumulate_grads(bool accumulate);
+
   void assign_weight_ptr(const T *weights_ptr) {
     const T *wptr = weights_ptr;
     // assign weights ptr
@@ -146,6 +171,20 @@ class TransformerEncoderLayer {
   }
 
  private:
+  // The bias and layer norm grads and their sizes, written by kernels which
+  // overwrite. An accumulating Backward points them into _grad_acc_ptr and
+  // adds them afterwards.
+  std::vector<std::pair<T **, size_t>> bias_grads() {
+    return {{&_grad_attn_qkvb_ptr, _hidden_size * 3},
+            {&_grad_attn_ob_ptr, _hidden_size},
+            {&_grad_attn_nw_ptr, _hidden_size},
+            {&_grad_attn_nb_ptr, _hidden_size},
+            {&_grad_inter_b_ptr, _intermediate_size},
+            {&_grad_output_b_ptr, _hidden_size},
+            {&_grad_ffn_nw_ptr, _hidden_size},
+            {&_grad_ffn_nb_ptr, _hidden_size}};
+  }
+
   void allocate_mem_buffer() {
     // allocate local gpu memory
     allocate_layer_memory();
@@ -190,11 +229,27 @@ class TransformerEncoderLayer {
     _shared_quant_mem_ptr = nullptr;
   }
 
+  // The flash attention keeps only the context and the lse of the queries,
+  // the [batch_size, nhead, seq_len, seq_len] attention probs are allocated
+  // at the first batch which falls back to them, see use_flash_attn.
+  void allocate_attn_prob_memory() {
+    if (_soft_out_ptr) return;
+    cuda_free(_ctx_bufB_ptr);
+    _soft_out_ptr = cuda_malloc<T>(_max_batch_tokens * _heads * _max_seq_len);
+    _ctx_bufB_ptr = cuda_malloc<T>(_max_batch_tokens * _heads * _max_seq_len);
+  }
+
   void allocate_layer_memory() {
     // allocate local gpu memory
     _qkv_ptr = cuda_malloc<T>(_max_batch_tokens * _hidden_size * 3);
-    _soft_out_ptr = cuda_malloc<T>(_max_batch_tokens * _heads * _max_seq_len);
-    _ctx_bufB_ptr = cuda_malloc<T>(_max_batch_tokens * _heads * _max_seq_len);
+    if (_flash_attn) {
+      _soft_out_ptr = nullptr;
+      _ctx_bufB_ptr = cuda_malloc<T>(_max_batch_tokens * _hidden_size);
+      _flash_lse_ptr = cuda_malloc<float>(_max_batch_tokens * _heads);
+      _flash_ws_ptr = cuda_malloc<float>(_max_batch_tokens * _heads);
+    } else {
+      allocate_attn_prob_memory();
+    }
     if (_is_pre_ln) {
       _gemmQKV_inp_ptr = cuda_malloc<T>(_max_batch_tokens * _hidden_size);
     } else {
@@ -208,6 +263,7 @@ class TransformerEncoderLayer {
     _igemm_alpha_ptr = cuda_malloc<float>(_max_batch_tokens);
     _igemm_beta_ptr = cuda_malloc<float>(1);
     cuda_set<float>(_igemm_beta_ptr, 0, 1);
+    _seq_ids_ptr = cuda_malloc<int>(_max_batch_tokens);
   }
 
   void free_layer_memory() {
@@ -218,10 +274,14 @@ class TransformerEncoderLayer {
     cuda_free(_qkv_ptr);
     cuda_free(_soft_out_ptr);
     cuda_free(_ctx_bufB_ptr);
+    cuda_free(_flash_lse_ptr);
+    cuda_free(_flash_ws_ptr);
     cuda_free(_attn_o_inp_ptr);
     cuda_free(_ff1_inp_ptr);
     cuda_free(_relu_inp_ptr);
     cuda_free(_ff2_inp_ptr);
+    cuda_free(_seq_ids_ptr);
+    cuda_free(_grad_acc_ptr);
   }
 
   const size_t _layer_id;
@@ -241,6 +301,13 @@ class TransformerEncoderLayer {
   size_t _batch_dim;
   bool _training;
   bool _enable_quant;
+  bool _accumulate_grads = false;
+  const int *_cu_seqlens = nullptr;
+  int _num_seqs = 0;
+  // launch_flash_attention_train instead of the attention probs, unless
+  // head_dim > kFlashAttnBwMaxHeadDim or LIGHTSEQ_FLASH_ATTN_TRAIN=0.
+  bool _flash_attn = false;
+  int _flash_seed = 0;
 
   cublasHandle_t _cublasHandle;
   cublasLtHandle_t _cublasLtHandle;
@@ -264,13 +331,18 @@ class TransformerEncoderLayer {
   // local GPU memory
   T *_gemmQKV_inp_ptr;
   T *_qkv_ptr;
-  T *_soft_out_ptr;
-  T *_ctx_bufB_ptr;
+  T *_soft_out_ptr = nullptr;
+  T *_ctx_bufB_ptr = nullptr;
+  float *_flash_lse_ptr = nullptr;
+  float *_flash_ws_ptr = nullptr;
   T *_attn_o_inp_ptr;
   T *_ff1_inp_ptr;
   T *_relu_inp_ptr;
   T *_ff2_inp_ptr;
   int8_t *_relu_inp_i8_ptr;
+  int *_seq_ids_ptr;
+  // the bias grads of an accumulating Backward, see bias_grads.
+  T *_grad_acc_ptr = nullptr;
 
   // local GPU memory for quant
   float *_igemm_alpha_ptr;
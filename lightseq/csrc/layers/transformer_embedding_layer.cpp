@@ -36,7 +36,7 @@ void TransformerEmbeddingLayer<T>::Forward(const int *input_ptr, T *out_ptr,
       out_ptr, input_ptr, _embeddings_ptr, _pos_embeddings_ptr,
       _enable_quant ? _clip_max_ptr : nullptr, _dropout_mask, _tokens_position,
       _batch_size, _seq_len, _embedding_dim, _padding_idx, DropoutRatio(), step,
-      stream);
+      stream, _cu_seqlens, _num_seqs);
 }
 
 template <typename T>
@@ -50,6 +50,25 @@ void TransformerEmbeddingLayer<T>::Backward(const T *grad_output_ptr,
       _max_seq_len, _padding_idx, DropoutRatio(), _trainable_pos, stream);
 }
 
+template <typename T>
+void TransformerEmbeddingLayer<T>::BackwardSparse(const T *grad_output_ptr,
+                                                  const int *input_ptr,
+                                                  T *grad_rows_ptr,
+                                                  int *rows_ptr,
+                                                  int *num_rows_ptr) {
+  cudaStream_t stream = Context::Instance().get_stream();
+  if (_sparse_workspace == nullptr) {
+    _sparse_workspace_bytes =
+        sparse_emb_grad_workspace_bytes(_max_batch_tokens);
+    _sparse_workspace = cuda_malloc<char>(_sparse_workspace_bytes);
+  }
+  launch_d_lookup_scale_pos_dropout_sparse<T>(
+      grad_rows_ptr, rows_ptr, num_rows_ptr, grad_output_ptr, input_ptr,
+      _dropout_mask, _batch_size, _seq_len, _embedding_dim, _vocab_size,
+      _padding_idx, DropoutRatio(), _sparse_workspace,
+      _sparse_workspace_bytes, stream);
+}
+
 template <typename T>
 void TransformerEmbeddingLayer<T>::SetTrainingMode(bool training) {
   // Dropout will be skipped when not in training model.
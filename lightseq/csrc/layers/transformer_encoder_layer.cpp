@@ -54,6 +54,9 @@ TransformerEncoderLayer<T>::TransformerEncoderLayer(
       _mask_future_tokens(mask_future_tokens),
       _algo_map() {
   assert(_hidden_size % _heads == 0);
+  const char *flash_env = getenv("LIGHTSEQ_FLASH_ATTN_TRAIN");
+  _flash_attn = _hidden_size / _heads <= kFlashAttnBwMaxHeadDim &&
+                !(flash_env && std::string(flash_env) == "0");
   allocate_mem_buffer();
 }
 
@@ -77,18 +80,27 @@ void TransformerEncoderLayer<T>::attn_layer_fw(const T *input_ptr,
     int8_t *qout_ptr = i8_buffer_ptr;
     i8_buffer_ptr += _batch_dim * 3;
     int8_t *qweight_ptr = i8_buffer_ptr;
-    if (_is_pre_ln) {
-      _attn_ln.Forward(_gemmQKV_inp_ptr, input_ptr, _attn_nw_ptr, _attn_nb_ptr,
-                       _batch_tokens, _stream);
-    }
     const T *gemmQKV_inp_ptr = _is_pre_ln ? _gemmQKV_inp_ptr : input_ptr;
 
     cublasLtMatmulAlgo_info qkv_algo_info =
         _algo_map.getAlgo(_batch_tokens, _hidden_size * 3, _hidden_size);
     std::vector<LSLayout> qkv_layout = getLSLayout(qkv_algo_info.dataOrder);
-    launch_quantize<T>(qin_ptr, _attn_prob_dropout.get_mask(), _igemm_alpha_ptr,
-                       gemmQKV_inp_ptr, _attn_qkv_cmax_ptr, _batch_tokens,
-                       _hidden_size, 2, _stream, qkv_layout[0]);
+    if (_is_pre_ln && fuse_ln_quantize(qkv_layout[0])) {
+      // the input quantization in the ln, the prologue of the gemm
+      _attn_ln.Forward(_gemmQKV_inp_ptr, qin_ptr, _attn_prob_dropout.get_mask(),
+                       _igemm_alpha_ptr, input_ptr, _attn_nw_ptr, _attn_nb_ptr,
+                       _attn_qkv_cmax_ptr, _batch_tokens, _stream,
+                       qkv_layout[0] == kCol32);
+    } else {
+      if (_is_pre_ln) {
+        _attn_ln.Forward(_gemmQKV_inp_ptr, input_ptr, _attn_nw_ptr,
+                         _attn_nb_ptr, _batch_tokens, _stream);
+      }
+      launch_quantize<T>(qin_ptr, _attn_prob_dropout.get_mask(),
+                         _igemm_alpha_ptr, gemmQKV_inp_ptr, _attn_qkv_cmax_ptr,
+                         _batch_tokens, _hidden_size, 2, _stream,
+                         qkv_layout[0]);
+    }
     launch_quantize<T>(qweight_ptr, _attn_prob_dropout.get_mask(), nullptr,
                        _attn_qkvw_ptr, _attn_qkv_cmax_ptr + 1, 3 * _hidden_size,
                        _hidden_size, 4, _stream, qkv_layout[1]);
@@ -119,21 +131,42 @@ void TransformerEncoderLayer<T>::attn_layer_fw(const T *input_ptr,
                                        _hidden_size / _heads, _stream);
   }
 
-  // attention scores, q*k
-  _attn_scores.Forward(_batch_heads, _soft_out_ptr, k_tf_ptr, q_tf_ptr,
-                       _cublasHandle);
-
-  // Softmax + Mask
-  _softmax.Forward(_soft_out_ptr, input_mask_ptr, _batch_size, _seq_len,
-                   _seq_len, _stream);
+  T *ctx_ptr = buffer;
+  if (use_flash_attn()) {
+    // the attention probs are recomputed from the lse in backward, so the
+    // context is kept in _ctx_bufB_ptr for it.
+    ctx_ptr = _ctx_bufB_ptr;
+    if (_attn_prob_dropout.HasDropout()) _flash_seed = ls_dropout_seed();
+    launch_flash_attention_train<T>(
+        q_tf_ptr, k_tf_ptr, v_tf_ptr, input_mask_ptr, ctx_ptr, _flash_lse_ptr,
+        _batch_size, _heads, _seq_len, _seq_len, _hidden_size / _heads,
+        _mask_future_tokens, _attn_prob_dropout.RATIO(), _flash_seed,
+        _stream);
+  } else {
+    allocate_attn_prob_memory();
+
+    // attention scores, q*k
+    _attn_scores.Forward(_batch_heads, _soft_out_ptr, k_tf_ptr, q_tf_ptr,
+                         _cublasHandle);
+
+    // Softmax + Mask
+    const int *seq_ids_ptr = nullptr;
+    if (_cu_seqlens) {
+      launch_packed_seq_ids(_seq_ids_ptr, nullptr, _cu_seqlens, _num_seqs,
+                            _batch_tokens, _stream);
+      seq_ids_ptr = _seq_ids_ptr;
+    }
+    _softmax.Forward(_soft_out_ptr, input_mask_ptr, _batch_size, _seq_len,
+                     _seq_len, _stream, false, seq_ids_ptr);
 
-  // attn prob dropout.
-  _attn_prob_dropout.dropout(_ctx_bufB_ptr, _soft_out_ptr,
-                             _batch_heads * _seq_len * _seq_len, _stream);
+    // attn prob dropout.
+    _attn_prob_dropout.dropout(_ctx_bufB_ptr, _soft_out_ptr,
+                               _batch_heads * _seq_len * _seq_len, _stream);
 
-  // attention context, score * v
-  _attn_context.Forward(_batch_heads, buffer, v_tf_ptr, _ctx_bufB_ptr,
-                        _cublasHandle);
+    // attention context, score * v
+    _attn_context.Forward(_batch_heads, buffer, v_tf_ptr, _ctx_bufB_ptr,
+                          _cublasHandle);
+  }
 
   if (_enable_quant) {
     int8_t *i8_buffer_ptr = _shared_quant_mem_ptr;
@@ -166,8 +199,8 @@ void TransformerEncoderLayer<T>::attn_layer_fw(const T *input_ptr,
         _batch_tokens, _hidden_size, _stream, attn_out_layout[2] == kCol32);
   } else {
     // [b, nh, s, ad] -> [b, s, nh, ad]
-    launch_transform4d_0213<T>(_attn_o_inp_ptr, buffer, _batch_size, _seq_len,
-                               _hidden_size, _heads, 1, _stream);
+    launch_transform4d_0213<T>(_attn_o_inp_ptr, ctx_ptr, _batch_size,
+                               _seq_len, _hidden_size, _heads, 1, _stream);
 
     _attn_out_linear.Forward(_batch_tokens, _attn_o_inp_ptr, _attn_ow_ptr,
                              output_ptr, _cublasHandle);
@@ -194,17 +227,24 @@ void TransformerEncoderLayer<T>::ffn_layer_fw(T *inp_ptr, T *out_ptr) {
     int8_t *qout_ptr = i8_buffer_ptr;
     i8_buffer_ptr += _batch_tokens * _intermediate_size;
     int8_t *qweight_ptr = i8_buffer_ptr;
-    if (_is_pre_ln) {
-      _ffn_ln.Forward(_ff1_inp_ptr, inp_ptr, _ffn_nw_ptr, _ffn_nb_ptr,
-                      _batch_tokens, _stream);
-    }
 
     cublasLtMatmulAlgo_info ff1_algo_info =
         _algo_map.getAlgo(_batch_tokens, _intermediate_size, _hidden_size);
     std::vector<LSLayout> ff1_layout = getLSLayout(ff1_algo_info.dataOrder);
-    launch_quantize<T>(qin_ptr, _ffn_dropout.get_mask(), _igemm_alpha_ptr,
-                       _ff1_inp_ptr, _inter_cmax_ptr, _batch_tokens,
-                       _hidden_size, 2, _stream, ff1_layout[0]);
+    if (_is_pre_ln && fuse_ln_quantize(ff1_layout[0])) {
+      _ffn_ln.Forward(_ff1_inp_ptr, qin_ptr, _ffn_dropout.get_mask(),
+                      _igemm_alpha_ptr, inp_ptr, _ffn_nw_ptr, _ffn_nb_ptr,
+                      _inter_cmax_ptr, _batch_tokens, _stream,
+                      ff1_layout[0] == kCol32);
+    } else {
+      if (_is_pre_ln) {
+        _ffn_ln.Forward(_ff1_inp_ptr, inp_ptr, _ffn_nw_ptr, _ffn_nb_ptr,
+                        _batch_tokens, _stream);
+      }
+      launch_quantize<T>(qin_ptr, _ffn_dropout.get_mask(), _igemm_alpha_ptr,
+                         _ff1_inp_ptr, _inter_cmax_ptr, _batch_tokens,
+                         _hidden_size, 2, _stream, ff1_layout[0]);
+    }
     launch_quantize<T>(qweight_ptr, _ffn_activation_dropout.get_mask(), nullptr,
                        _inter_w_ptr, _inter_cmax_ptr + 1, _intermediate_size,
                        _hidden_size, 4, _stream, ff1_layout[1]);
@@ -333,7 +373,7 @@ void TransformerEncoderLayer<T>::attn_layer_bw(const T *input_ptr,
   _attn_out_linear.Backward(_batch_tokens, grad_input_ptr, _attn_o_inp_ptr,
                             _attn_ow_ptr, _grad_attn_ow_ptr, _grad_attn_ob_ptr,
                             _cublasHandle, _stream, grad_input_buf_ptr, nullptr,
-                            false);
+                            false, _accumulate_grads);
 
   if (_enable_quant) {
     launch_d_cmax(_grad_attn_ow_ptr, static_cast<T *>(nullptr),
@@ -348,21 +388,31 @@ void TransformerEncoderLayer<T>::attn_layer_bw(const T *input_ptr,
     launch_transform_0213<T>(grad_input_buf_ptr, grad_input_ptr, _batch_size,
                              _seq_len, _heads, _hidden_size / _heads, _stream);
   }
-  // bw of score * v
-  _attn_context.Backward(_batch_heads, grad_input_ptr, v_tf_ptr, _ctx_bufB_ptr,
-                         _cublasHandle, grad_qkv_5d_ptr + 2 * _batch_dim,
-                         grad_softmax_ptr);
+  if (use_flash_attn()) {
+    launch_flash_attention_bw<T>(
+        grad_qkv_5d_ptr, grad_qkv_5d_ptr + _batch_dim,
+        grad_qkv_5d_ptr + 2 * _batch_dim, grad_input_ptr, q_tf_ptr, k_tf_ptr,
+        v_tf_ptr, input_mask_ptr, _ctx_bufB_ptr, _flash_lse_ptr,
+        _flash_ws_ptr, _batch_size, _heads, _seq_len, _seq_len,
+        _hidden_size / _heads, _mask_future_tokens,
+        _attn_prob_dropout.RATIO(), _flash_seed, _stream);
+  } else {
+    // bw of score * v
+    _attn_context.Backward(_batch_heads, grad_input_ptr, v_tf_ptr,
+                           _ctx_bufB_ptr, _cublasHandle,
+                           grad_qkv_5d_ptr + 2 * _batch_dim, grad_softmax_ptr);
 
-  _attn_prob_dropout.d_dropout(grad_softmax_ptr,
-                               _batch_heads * _seq_len * _seq_len, _stream);
+    _attn_prob_dropout.d_dropout(grad_softmax_ptr,
+                                 _batch_heads * _seq_len * _seq_len, _stream);
 
-  _softmax.Backward(grad_softmax_ptr, _soft_out_ptr, _batch_size, _seq_len,
-                    _seq_len, _stream);
+    _softmax.Backward(grad_softmax_ptr, _soft_out_ptr, _batch_size, _seq_len,
+                      _seq_len, _stream);
 
-  // bw of q * k
-  _attn_scores.Backward(_batch_heads, grad_softmax_ptr, k_tf_ptr, q_tf_ptr,
-                        _cublasHandle, grad_qkv_5d_ptr + _batch_dim,
-                        grad_qkv_5d_ptr);
+    // bw of q * k
+    _attn_scores.Backward(_batch_heads, grad_softmax_ptr, k_tf_ptr, q_tf_ptr,
+                          _cublasHandle, grad_qkv_5d_ptr + _batch_dim,
+                          grad_qkv_5d_ptr);
+  }
 
   // [3, b, nh, s, ad] -> [b, s, 3, h]
   launch_transform4d_0213<T>(grad_qkv_4d_ptr, grad_qkv_5d_ptr, _batch_size,
@@ -371,7 +421,8 @@ void TransformerEncoderLayer<T>::attn_layer_bw(const T *input_ptr,
   const T *gemmQKV_inp_ptr = _is_pre_ln ? _gemmQKV_inp_ptr : input_ptr;
   _qkv_linear.Backward(_batch_tokens, grad_qkv_4d_ptr, gemmQKV_inp_ptr,
                        _attn_qkvw_ptr, _grad_attn_qkvw_ptr, _grad_attn_qkvb_ptr,
-                       _cublasHandle, _stream, grad_input_buf_ptr);
+                       _cublasHandle, _stream, grad_input_buf_ptr, nullptr,
+                       true, _accumulate_grads);
 
   if (_is_pre_ln) {
     if (_enable_quant) {
@@ -436,7 +487,7 @@ void TransformerEncoderLayer<T>::ffn_layer_bw(const T *grad_output_ptr,
 
   _ff2.Backward(_batch_tokens, grad_inp_ptr, _ff2_inp_ptr, _output_w_ptr,
                 _grad_output_w_ptr, _grad_output_b_ptr, _cublasHandle, _stream,
-                grad_ff1_out_ptr, nullptr, false);
+                grad_ff1_out_ptr, nullptr, false, _accumulate_grads);
 
   if (_enable_quant) {
     launch_d_cmax(_grad_output_w_ptr, static_cast<T *>(nullptr),
@@ -456,7 +507,7 @@ void TransformerEncoderLayer<T>::ffn_layer_bw(const T *grad_output_ptr,
   }
   _ff1.Backward(_batch_tokens, grad_ff1_out_ptr, _ff1_inp_ptr, _inter_w_ptr,
                 _grad_inter_w_ptr, _grad_inter_b_ptr, _cublasHandle, _stream,
-                grad_ff1_inp_ptr, nullptr, false);
+                grad_ff1_inp_ptr, nullptr, false, _accumulate_grads);
 
   /* ln signature:
   grad_gamma_grad, grad_betta, grad_inp,
@@ -499,6 +550,19 @@ void TransformerEncoderLayer<T>::Backward(const T *grad_output_ptr,
   T *grad_ffn_inp_ptr = _shared_mem_ptr;
   T *buffer = grad_ffn_inp_ptr + _batch_dim;
 
+  // the weight gemms add onto their grads, the bias grads are added after.
+  std::vector<std::pair<T **, size_t>> acc_grads;
+  std::vector<T *> acc_dst_ptrs;
+  if (_accumulate_grads) {
+    acc_grads = bias_grads();
+    T *acc_ptr = _grad_acc_ptr;
+    for (auto &grad : acc_grads) {
+      acc_dst_ptrs.push_back(*grad.first);
+      *grad.first = acc_ptr;
+      acc_ptr += grad.second;
+    }
+  }
+
   /*
   buffer size needed by ffn bw:
       2 * _batch_dim + _batch_size * _seq_len * _intermediate_size
@@ -512,6 +576,12 @@ void TransformerEncoderLayer<T>::Backward(const T *grad_output_ptr,
   */
   attn_layer_bw(input_ptr, input_mask_ptr, grad_ffn_inp_ptr, grad_input_ptr,
                 buffer);
+
+  for (size_t i = 0; i < acc_grads.size(); i++) {
+    launch_accumulate(acc_dst_ptrs[i], *acc_grads[i].first,
+                      acc_grads[i].second, _stream);
+    *acc_grads[i].first = acc_dst_ptrs[i];
+  }
 }
 
 template <typename T>
@@ -534,6 +604,22 @@ void TransformerEncoderLayer<T>::SetQuantMode(bool enable_quant) {
   }
 }
 
+template <typename T>
+void TransformerEncoderLayer<T>::set_accumulate_grads(bool accumulate) {
+  if (accumulate && _enable_quant) {
+    printf(
+        "Encoder layer does not support grad accumulation with quantization, "
+        "overwrite the grads instead\n");
+    accumulate = false;
+  }
+  if (accumulate && !_grad_acc_ptr) {
+    size_t acc_size = 0;
+    for (auto &grad : bias_grads()) acc_size += grad.second;
+    _grad_acc_ptr = cuda_malloc<T>(acc_size);
+  }
+  _accumulate_grads = accumulate;
+}
+
 template <typename T>
 void TransformerEncoderLayer<T>::zero_mask_grad() {
   cudaMemsetAsync(_grad_attn_qkv_cmax_ptr, 0, 12 * sizeof(T), 0);
@@ -11,10 +11,14 @@ CRFLayer<T>::CRFLayer(int num_tags, int max_batch_tokens, int max_batch_size)
   // operators node
   _crf_op = new CRFOP<T>(max_batch_tokens, max_batch_size, num_tags);
   // parameters node
-  _linear_b = new Variable("linear_b", g_dtype<T>());
-  _start_transition = new Variable("start_transition", g_dtype<T>());
-  _end_transition = new Variable("end_transition", g_dtype<T>());
-  _transition = new Variable("transition", g_dtype<T>());
+  cuda::DataType grad_dtype = _context_ptr->is_training()
+                                 ? g_dtype<T>()
+                                 : cuda::DataType::kNotSupported;
+  _linear_b = new Variable("linear_b", g_dtype<T>(), grad_dtype);
+  _start_transition =
+      new Variable("start_transition", g_dtype<T>(), grad_dtype);
+  _end_transition = new Variable("end_transition", g_dtype<T>(), grad_dtype);
+  _transition = new Variable("transition", g_dtype<T>(), grad_dtype);
 
   this->_context_ptr->exit_layer();  // necessary
 }
@@ -36,6 +40,24 @@ void CRFLayer<T>::before_forward(int batch_size, int seq_len,
                           output_decode_score);
 }
 
+template <typename T>
+size_t CRFLayer<T>::load_para_and_grad(const T* para_ptr,
+                                       T* grad_ptr) {  // for training
+  size_t offset = 0;
+  for (Variable* para : {_linear_b, _start_transition, _end_transition}) {
+    para->set_value((char*)(para_ptr + offset));
+    para->set_grad((char*)(grad_ptr + offset));
+    para->set_shape({size_t(_num_tags)});
+    offset += _num_tags;
+  }
+  _transition->set_value((char*)(para_ptr + offset));
+  _transition->set_grad((char*)(grad_ptr + offset));
+  _transition->set_shape({size_t(_num_tags), size_t(_num_tags)});
+  offset += _num_tags * _num_tags;
+
+  return offset;
+}
+
 template <typename T>
 int CRFLayer<T>::load_params(const std::vector<const T*>& para_vec,
                              int offset) {  // for inference
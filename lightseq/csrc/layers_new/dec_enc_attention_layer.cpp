@@ -6,7 +6,8 @@ template <typename T1, typename T2>
 DecEncAttentionLayer<T1, T2>::DecEncAttentionLayer(
     size_t layer_id, size_t max_batch_tokens, size_t max_seq_len,
     size_t hidden_size, size_t num_heads, float attn_prob_dropout_ratio,
-    float hidden_output_dropout_ratio, bool is_pre_ln)
+    float hidden_output_dropout_ratio, bool is_pre_ln, size_t beam_size,
+    bool encdec_kv_int8)
     : Layer("DecEncAttentionLayer"),  // necessary
       _layer_id(layer_id),
       _max_batch_tokens(max_batch_tokens),
@@ -47,6 +48,12 @@ DecEncAttentionLayer<T1, T2>::DecEncAttentionLayer(
   _attn_nw = new Variable("_attn_nw", g_dtype<T1>(), g_dtype<T2>());
   _attn_nb = new Variable("_attn_nb", g_dtype<T1>(), g_dtype<T2>());
 
+  if (encdec_kv_int8 && !_context_ptr->is_training()) {
+    _attn_i8 = new EncDecAttentionI8Op<T1, T2>(
+        max_batch_tokens / beam_size, max_seq_len, beam_size, num_heads,
+        hidden_size / num_heads);
+  }
+
   this->_context_ptr->exit_layer();  // necessary
 }
 
@@ -68,12 +75,17 @@ Variable* DecEncAttentionLayer<T1, T2>::operator()(Variable* inp,
   Variable* transform_20314_out =
       (*_bias_add_transform_20314_q)(q_linear_out, _attn_qb);
 
-  Variable* attn_score = (*_attn_scores)(enc_k, transform_20314_out);
+  Variable* attn_context = nullptr;
+  if (_attn_i8) {
+    attn_context = (*_attn_i8)(transform_20314_out, enc_k, enc_v, enc_mask);
+  } else {
+    Variable* attn_score = (*_attn_scores)(enc_k, transform_20314_out);
 
-  Variable* soft_out = (*_softmax)(attn_score, enc_mask);
+    Variable* soft_out = (*_softmax)(attn_score, enc_mask);
 
-  Variable* prob_dropout = (*_attn_prob_dropout)(soft_out);
-  Variable* attn_context = (*_attn_context)(enc_v, prob_dropout);
+    Variable* prob_dropout = (*_attn_prob_dropout)(soft_out);
+    attn_context = (*_attn_context)(enc_v, prob_dropout);
+  }
 
   Variable* transform_0213_out = (*_transform_0213)(attn_context);
 
@@ -95,7 +107,7 @@ Variable* DecEncAttentionLayer<T1, T2>::operator()(Variable* inp,
 template <typename T1, typename T2>
 void DecEncAttentionLayer<T1, T2>::before_forward(int batch_size,
                                                   int trg_seq_len,
-                                                  int src_seq_len) {
+                                                  int src_seq_len, int step) {
   _batch_tokens = batch_size * trg_seq_len;
   _batch_heads = batch_size * _heads;
   _batch_dim = _batch_tokens * _hidden_size;
@@ -106,15 +118,20 @@ void DecEncAttentionLayer<T1, T2>::before_forward(int batch_size,
 
   _bias_add_transform_20314_q->before_forward(batch_size, trg_seq_len);
 
-  _attn_scores->before_forward(src_seq_len, trg_seq_len, _hidden_size / _heads,
-                               _batch_heads);
+  if (_attn_i8) {
+    _attn_i8->before_forward(batch_size, src_seq_len, step <= 0);
+  } else {
+    _attn_scores->before_forward(src_seq_len, trg_seq_len,
+                                 _hidden_size / _heads, _batch_heads);
 
-  _softmax->before_forward(batch_size, trg_seq_len, src_seq_len);
+    _softmax->before_forward(batch_size, trg_seq_len, src_seq_len);
 
-  _attn_prob_dropout->before_forward(_batch_heads * trg_seq_len * src_seq_len);
+    _attn_prob_dropout->before_forward(_batch_heads * trg_seq_len *
+                                       src_seq_len);
 
-  _attn_context->before_forward(_hidden_size / _heads, trg_seq_len, src_seq_len,
-                                _batch_heads);
+    _attn_context->before_forward(_hidden_size / _heads, trg_seq_len,
+                                  src_seq_len, _batch_heads);
+  }
 
   _transform_0213->before_forward(batch_size, _heads, trg_seq_len,
                                   _hidden_size / _heads);
@@ -7,7 +7,7 @@ FeedForwardLayer<T1, T2>::FeedForwardLayer(
     size_t layer_id, size_t max_batch_tokens, size_t max_seq_len,
     size_t hidden_size, size_t num_heads, size_t intermediate_size,
     float activation_dropout_ratio, float hidden_output_dropout_ratio,
-    bool is_pre_ln, std::string activation_fn)
+    bool is_pre_ln, std::string activation_fn, bool int8, bool sparse24)
     : Layer("FeedForwardLayer"),
       _layer_id(layer_id),
       _max_batch_tokens(max_batch_tokens),
@@ -17,23 +17,72 @@ FeedForwardLayer<T1, T2>::FeedForwardLayer(
       _intermediate_size(intermediate_size),
       _is_pre_ln(is_pre_ln),
       _activation_fn(activation_fn),
+      _int8(int8),
+      _sparse24(sparse24 && !int8) {
+  // operators
+  if (is_pre_ln || int8) {
+    _ffn_ln = new LayerNormalizeOp<T1, T2>(max_batch_tokens, hidden_size);
+  }
+  if (int8) {
+#ifndef LIGHTSEQ_cuda
+    throw std::runtime_error("int8 FeedForwardLayer needs cuda");
+#endif
+    if (!_context_ptr->is_inference()) {
+      throw std::runtime_error("int8 FeedForwardLayer is inference only");
+    }
+    _ff1_int8 = new Int8LinearOp<T1, T2>(max_batch_tokens, intermediate_size,
+                                         hidden_size);
+    _ff2_int8 = new Int8LinearOp<T1, T2>(max_batch_tokens, hidden_size,
+                                         intermediate_size);
+  } else {
+    if (_sparse24 && !_context_ptr->is_inference()) {
+      throw std::runtime_error("2:4 sparse FeedForwardLayer is inference only");
+    }
+    if (_sparse24 && !Sparse24LinearOp<T1, T2>::supported()) {
+      printf("FeedForwardLayer %zu does not support 2:4 sparse linears "
+             "without cuSPARSELt, sm 80 and fp16 or bf16, dense ones are "
+             "used\n",
+             layer_id);
+      _sparse24 = false;
+    }
+    if (_sparse24) {
+      _ff1_sparse24 = new Sparse24LinearOp<T1, T2>(
+          max_batch_tokens, intermediate_size, hidden_size);
+      _ff2_sparse24 = new Sparse24LinearOp<T1, T2>(
+          max_batch_tokens, hidden_size, intermediate_size);
+    } else {
+      _ff1 = new LinearOp<T1, T2>(max_batch_tokens, intermediate_size,
+                                  hidden_size);
+      _ff2 = new LinearOp<T1, T2>(max_batch_tokens, hidden_size,
+                                  intermediate_size);
+    }
+    _ffn_activation_dropout = new BiasActDropoutOp<T1, T2>(
+        activation_dropout_ratio, max_batch_tokens, intermediate_size,
+        activation_fn);
+    if (is_pre_ln) {
+      _ffn_dropout = new BiasDropoutResOp<T1, T2>(
+          hidden_output_dropout_ratio, max_batch_tokens, hidden_size);
+    } else {
+      _ffn_dropout_ln = new BiasDropoutResLnOp<T1, T2>(
+          hidden_output_dropout_ratio, max_batch_tokens, hidden_size);
+    }
+  }
 
-      // operators
-      _ffn_ln(new LayerNormalizeOp<T1, T2>(max_batch_tokens, hidden_size)),
-      _ff1(new LinearOp<T1, T2>(max_batch_tokens, intermediate_size,
-                                hidden_size)),
-      _ffn_activation_dropout(new BiasActDropoutOp<T1, T2>(
-          activation_dropout_ratio, max_batch_tokens, intermediate_size,
-          activation_fn)),
-      _ff2(new LinearOp<T1, T2>(max_batch_tokens, hidden_size,
-                                intermediate_size)),
-      _ffn_dropout(new BiasDropoutResOp<T1, T2>(
-          hidden_output_dropout_ratio, max_batch_tokens, hidden_size)) {
   // parameters node
-  _inter_w = new Variable("_inter_w", g_dtype<T1>(), g_dtype<T2>());
+  if (int8) {
+    _inter_w = new Variable("_inter_w", g_dtype<int8_t>());
+    _output_w = new Variable("_output_w", g_dtype<int8_t>());
+    _inter_w_scale = new Variable("_inter_w_scale", g_dtype<float>());
+    _output_w_scale = new Variable("_output_w_scale", g_dtype<float>());
+  } else if (_sparse24) {
+    // the compressed weights, see Sparse24LinearOp::load_weight.
+    _inter_w = new Variable("_inter_w", g_dtype<int8_t>());
+    _output_w = new Variable("_output_w", g_dtype<int8_t>());
+  } else {
+    _inter_w = new Variable("_inter_w", g_dtype<T1>(), g_dtype<T2>());
+    _output_w = new Variable("_output_w", g_dtype<T1>(), g_dtype<T2>());
+  }
   _inter_b = new Variable("_inter_b", g_dtype<T1>(), g_dtype<T2>());
-
-  _output_w = new Variable("_output_w", g_dtype<T1>(), g_dtype<T2>());
   _output_b = new Variable("_output_b", g_dtype<T1>(), g_dtype<T2>());
 
   _ffn_nw = new Variable("_ffn_nw", g_dtype<T1>(), g_dtype<T2>());
@@ -45,19 +94,28 @@ FeedForwardLayer<T1, T2>::FeedForwardLayer(
 template <typename T1, typename T2>
 Variable* FeedForwardLayer<T1, T2>::operator()(Variable* inp) {
   set_inputs({inp});
-  Variable* ff1_out = nullptr;
-  if (_is_pre_ln) {
-    Variable* ffn_ln_out = (*_ffn_ln)(inp, _ffn_nw, _ffn_nb);
-    ff1_out = (*_ff1)(ffn_ln_out, _inter_w);
+  Variable* ff1_inp = _is_pre_ln ? (*_ffn_ln)(inp, _ffn_nw, _ffn_nb) : inp;
+  Variable* ffn_act_out = nullptr;
+  Variable* ffn_dropout_residual = nullptr;
+  if (_int8) {
+    ffn_act_out = (*_ff1_int8)(ff1_inp, _inter_w, _inter_w_scale, _inter_b,
+                               _activation_fn);
+    ffn_dropout_residual = (*_ff2_int8)(ffn_act_out, _output_w,
+                                        _output_w_scale, _output_b, inp);
   } else {
-    ff1_out = (*_ff1)(inp, _inter_w);
+    Variable* ff1_out = _sparse24 ? (*_ff1_sparse24)(ff1_inp, _inter_w)
+                                  : (*_ff1)(ff1_inp, _inter_w);
+    ffn_act_out = (*_ffn_activation_dropout)(ff1_out, _inter_b);
+    Variable* ff2_out = _sparse24 ? (*_ff2_sparse24)(ffn_act_out, _output_w)
+                                  : (*_ff2)(ffn_act_out, _output_w);
+    if (_ffn_dropout_ln) {
+      Variable* ffn_ln_out =
+          (*_ffn_dropout_ln)(ff2_out, _output_b, inp, _ffn_nw, _ffn_nb);
+      set_outputs({ffn_ln_out});
+      return ffn_ln_out;
+    }
+    ffn_dropout_residual = (*_ffn_dropout)(ff2_out, _output_b, inp);
   }
-
-  Variable* ffn_act_out = (*_ffn_activation_dropout)(ff1_out, _inter_b);
-
-  Variable* ff2_out = (*_ff2)(ffn_act_out, _output_w);
-
-  Variable* ffn_dropout_residual = (*_ffn_dropout)(ff2_out, _output_b, inp);
   if (_is_pre_ln) {
     set_outputs({ffn_dropout_residual});
     return ffn_dropout_residual;
@@ -72,15 +130,29 @@ template <typename T1, typename T2>
 void FeedForwardLayer<T1, T2>::before_forward(int batch_size, int seq_len) {
   int batch_tokens = batch_size * seq_len;
 
-  _ffn_ln->before_forward(batch_size, seq_len);
+  if (_ffn_ln) _ffn_ln->before_forward(batch_size, seq_len);
 
-  _ff1->before_forward(batch_tokens);
+  if (_int8) {
+    _ff1_int8->before_forward(batch_tokens);
+    _ff2_int8->before_forward(batch_tokens);
+    return;
+  }
 
-  _ffn_activation_dropout->before_forward(batch_tokens, _intermediate_size);
+  if (_sparse24) {
+    _ff1_sparse24->before_forward(batch_tokens);
+    _ff2_sparse24->before_forward(batch_tokens);
+  } else {
+    _ff1->before_forward(batch_tokens);
+    _ff2->before_forward(batch_tokens);
+  }
 
-  _ff2->before_forward(batch_tokens);
+  _ffn_activation_dropout->before_forward(batch_tokens, _intermediate_size);
 
-  _ffn_dropout->before_forward(batch_tokens, _hidden_size);
+  if (_ffn_dropout_ln) {
+    _ffn_dropout_ln->before_forward(batch_size, seq_len);
+  } else {
+    _ffn_dropout->before_forward(batch_tokens, _hidden_size);
+  }
 }
 
 template <typename T1, typename T2>
@@ -135,13 +207,28 @@ int FeedForwardLayer<T1, T2>::load_params(
   _ffn_nb->set_value((char*)para_vec[offset + size]), size++;
   _ffn_nb->set_shape({_hidden_size});
 
-  _inter_w->set_value((char*)para_vec[offset + size]), size++;
-  _inter_w->set_shape({_intermediate_size, _hidden_size});
+  if (_int8) {
+    _ff1_int8->load_weight(_inter_w, _inter_w_scale, para_vec[offset + size]),
+        size++;
+  } else if (_sparse24) {
+    _ff1_sparse24->load_weight(_inter_w, para_vec[offset + size]), size++;
+  } else {
+    _inter_w->set_value((char*)para_vec[offset + size]), size++;
+    _inter_w->set_shape({_intermediate_size, _hidden_size});
+  }
   _inter_b->set_value((char*)para_vec[offset + size]), size++;
   _inter_b->set_shape({_intermediate_size});
 
-  _output_w->set_value((char*)para_vec[offset + size]), size++;
-  _output_w->set_shape({_hidden_size, _intermediate_size});
+  if (_int8) {
+    _ff2_int8->load_weight(_output_w, _output_w_scale,
+                           para_vec[offset + size]),
+        size++;
+  } else if (_sparse24) {
+    _ff2_sparse24->load_weight(_output_w, para_vec[offset + size]), size++;
+  } else {
+    _output_w->set_value((char*)para_vec[offset + size]), size++;
+    _output_w->set_shape({_hidden_size, _intermediate_size});
+  }
   _output_b->set_value((char*)para_vec[offset + size]), size++;
   _output_b->set_shape({_hidden_size});
 
@@ -1,5 +1,7 @@
 #include "generator_layer.h"
 
+#include <cstring>
+
 namespace lightseq {
 
 template <typename T>
@@ -14,7 +16,11 @@ GeneratorLayer<T>::GeneratorLayer(GenerateMethod gm, int nshared_dec_layer,
     : Layer("GeneratorLayer"),
       _generate_method(gm),
       _trg_vocab_size(trg_vocab_size),
-      _has_logits_bias(has_logits_bias) {
+      _has_logits_bias(has_logits_bias),
+      _beam_size(gm == GenerateMethod::BeamSearch ? beam_size : 1) {
+  _logits_process = new LogitsProcessOp<T>(
+      max_batch_size * _beam_size, max_step, max_thread_per_block,
+      trg_vocab_size);
   if (_generate_method == GenerateMethod::BeamSearch) {
     _beam_search = new BeamSearchTopOp<T>(
         nshared_dec_layer, max_batch_size, max_step, trg_vocab_size,
@@ -48,6 +54,7 @@ template <typename T>
 std::tuple<Variable*, Variable*> GeneratorLayer<T>::operator()(
     Variable* logits, Variable* alive_seq) {
   set_inputs({logits, alive_seq});
+  logits = (*_logits_process)(logits, alive_seq);
 
   Variable* alive_seq_out = nullptr;
   Variable* seq_score = nullptr;
@@ -71,6 +78,8 @@ std::tuple<Variable*, Variable*> GeneratorLayer<T>::operator()(
 template <typename T>
 void GeneratorLayer<T>::before_forward(int batch_size, int prompt_len,
                                        int cur_step) {
+  _logits_process->before_forward(batch_size * _beam_size, prompt_len,
+                                  prompt_len + cur_step);
   if (_generate_method == GenerateMethod::BeamSearch) {
     _beam_search->before_forward(batch_size, prompt_len, cur_step);
   } else {
@@ -102,6 +111,104 @@ bool GeneratorLayer<T>::is_stop() {
   return true;
 }
 
+template <typename T>
+void GeneratorLayer<T>::set_stop_check_interval(int interval) {
+  if (_sampling) {
+    _sampling->set_stop_check_interval(interval);
+  }
+}
+
+template <typename T>
+void GeneratorLayer<T>::set_step_offset_ptr(const int* step_offset_ptr) {
+  if (_sampling) {
+    _sampling->set_step_offset_ptr(step_offset_ptr);
+  }
+}
+
+template <typename T>
+void GeneratorLayer<T>::clear_step_flags() {
+  if (_sampling) {
+    _sampling->clear_step_flags();
+  }
+}
+
+template <typename T>
+void GeneratorLayer<T>::fetch_step_flags(int cur_step, int offset,
+                                         int num_steps) {
+  if (_sampling) {
+    _sampling->fetch_step_flags(cur_step, offset, num_steps);
+  }
+}
+
+template <typename T>
+void GeneratorLayer<T>::set_logits_processor(
+    const cuda::LogitsProcessConfig& config) {
+  _logits_process->set_config(config);
+}
+
+template <typename T>
+void GeneratorLayer<T>::set_token_automaton(
+    const cuda::TokenAutomaton& automaton) {
+  if (_sampling) {
+    _logits_process->set_automaton(automaton);
+  } else if (automaton.num_states > 0) {
+    printf("token automatons do not support beam search, ignored.\n");
+  }
+}
+
+template <typename T>
+void GeneratorLayer<T>::set_sampling_params(float temperature,
+                                            float repetition_penalty,
+                                            float min_p) {
+  if (_sampling) {
+    _sampling->set_sampling_params(temperature, repetition_penalty, min_p);
+  }
+}
+
+template <typename T>
+void GeneratorLayer<T>::set_generation_configs(
+    const std::vector<cuda::GenerationConfig>& configs) {
+  if (_sampling) {
+    _sampling->set_generation_configs(configs);
+  } else if (!configs.empty()) {
+    printf("per row generation configs do not support beam search, "
+           "ignored.\n");
+  }
+}
+
+template <typename T>
+int GeneratorLayer<T>::stop_step(int steps) {
+  return _sampling ? _sampling->stop_step(steps) : steps;
+}
+
+template <typename T>
+void GeneratorLayer<T>::use_kv_rows() {
+  if (_beam_search) _beam_search->use_kv_rows();
+}
+
+template <typename T>
+void GeneratorLayer<T>::set_beam_pruning(float abs_margin, float rel_margin) {
+  if (_beam_search) _beam_search->set_beam_pruning(abs_margin, rel_margin);
+}
+
+template <typename T>
+void GeneratorLayer<T>::init_kv_rows(int* kv_rows) {
+  if (_beam_search) _beam_search->init_kv_rows(kv_rows);
+}
+
+template <typename T>
+void GeneratorLayer<T>::refresh_kv_rows(int* kv_rows) {
+  if (_beam_search) _beam_search->refresh_kv_rows(kv_rows);
+}
+
+template <typename T>
+void GeneratorLayer<T>::fork_kv_rows(int* kv_rows, int prompt_rows,
+                                     int num_rows, int prompt_len) {
+  if (_sampling) {
+    _sampling->fork_kv_rows(kv_rows, prompt_rows, num_rows, prompt_len);
+  }
+}
+
 template <typename T>
 void GeneratorLayer<T>::refresh_cache(Variable* caches_k, Variable* caches_v) {
   if (_generate_method == GenerateMethod::BeamSearch) {
@@ -30,7 +30,10 @@ GptAttentionLayer<T1, T2>::GptAttentionLayer(int max_batch_tokens,
                                         hidden_size, 3, max_seq_len);
   _sdpa = new SDPALayer<T1, T2>(max_batch_tokens, max_seq_len, _head_dim,
                                 num_heads, 0.f);
-  _transform_0213 = new Transform0213OP<T1, T2>(max_batch_tokens * hidden_size);
+  if (!_sdpa->set_token_major_output()) {
+    _transform_0213 =
+        new Transform0213OP<T1, T2>(max_batch_tokens * hidden_size);
+  }
   _attn_out_linear =
       new LinearOp<T1, T2>(max_batch_tokens, hidden_size, hidden_size);
   _attn_res = new BiasDropoutResOp<T1, T2>(hidden_output_dropout_ratio,
@@ -72,7 +75,8 @@ Variable* GptAttentionLayer<T1, T2>::operator()(Variable* inp,
   Variable* sdpa_res = (*_sdpa)(q_out, cache_k, cache_v, pad_mask);
 
   // [sz0, sz1, sz2, sz3] -> [sz0, sz2, sz1, sz3]
-  Variable* transform_0213_out = (*_transform_0213)(sdpa_res);
+  Variable* transform_0213_out =
+      _transform_0213 ? (*_transform_0213)(sdpa_res) : sdpa_res;
 
   Variable* attn_linear = (*_attn_out_linear)(transform_0213_out, _attn_ow);
 
@@ -116,7 +120,9 @@ void GptAttentionLayer<T1, T2>::before_forward(int batch_size, int query_len,
   _sdpa->before_forward(batch_size, query_len, attn_to_len, _max_seq_len,
                         steps <= 0);
 
-  _transform_0213->before_forward(batch_size, _nhead, query_len, _head_dim);
+  if (_transform_0213) {
+    _transform_0213->before_forward(batch_size, _nhead, query_len, _head_dim);
+  }
 
   _attn_out_linear->before_forward(batch_tokens);
 
@@ -9,7 +9,7 @@ GptLayer<T1, T2>::GptLayer(int layer_id, int max_batch_tokens, int max_seq_len,
                            float activation_dropout_ratio,
                            float hidden_output_dropout_ratio,
                            std::string activation_fn, bool mask_future_tokens,
-                           int beam_size)
+                           int beam_size, bool sparse24)
     : Layer("GptLayer"), _layer_id(layer_id) {
   _attn_layer.reset(new GptAttentionLayer<T1, T2>(
       max_batch_tokens, max_seq_len, hidden_size, num_heads, beam_size,
@@ -18,7 +18,7 @@ GptLayer<T1, T2>::GptLayer(int layer_id, int max_batch_tokens, int max_seq_len,
   _ffn_layer.reset(new FeedForwardLayer<T1, T2>(
       layer_id, max_batch_tokens, max_seq_len, hidden_size, num_heads,
       intermediate_size, activation_dropout_ratio, hidden_output_dropout_ratio,
-      true, activation_fn));
+      true, activation_fn, false, sparse24));
 
   this->_context_ptr->exit_layer();  // necessary
 }
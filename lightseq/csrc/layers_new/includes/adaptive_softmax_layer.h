@@ -0,0 +1,71 @@
+#pragma once
+#include "adaptive_softmax.h"
+#include "layer.h"
+
+namespace lightseq {
+
+// The vocab log probs of an adaptive softmax head, see AdaptiveSoftmaxOp.
+template <class T1, class T2>
+class AdaptiveSoftmaxLayer : public Layer {
+ private:
+  int _num_clusters;
+
+  // operators
+  AdaptiveSoftmaxOp<T1, T2>* _adaptive_softmax_op = nullptr;
+
+  // parameters: the head, then the proj and out of every tail cluster.
+  std::vector<Variable*> _weights;
+
+ public:
+  AdaptiveSoftmaxLayer(int max_batch_tokens, int hidden_size,
+                       const std::vector<int>& cutoffs,
+                       const std::vector<int>& tail_dims)
+      : Layer("AdaptiveSoftmaxLayer"),
+        _num_clusters(int(cutoffs.size()) - 1),
+        _adaptive_softmax_op(new AdaptiveSoftmaxOp<T1, T2>(
+            max_batch_tokens, hidden_size, cutoffs, tail_dims)) {
+    for (int i = 0; i < 1 + 2 * _num_clusters; i++) {
+      _weights.push_back(
+          new Variable("adaptive_softmax_w", g_dtype<T1>(), g_dtype<T2>()));
+    }
+
+    this->_context_ptr->exit_layer();  // necessary
+  }
+
+  virtual ~AdaptiveSoftmaxLayer() {}
+
+  Variable* operator()(Variable* inp) {
+    set_inputs({inp});
+
+    Variable* out = (*_adaptive_softmax_op)(inp, _weights);
+
+    set_outputs({out});
+    return out;
+  }
+
+  void before_forward(int batch_size, int seq_len) {
+    _adaptive_softmax_op->before_forward(size_t(batch_size) * seq_len);
+  }
+
+  // see AdaptiveSoftmaxOp::set_topk.
+  void set_topk(int topk) { _adaptive_softmax_op->set_topk(topk); }
+
+  void before_backward() {}
+
+  int load_params(const std::vector<const T1*>& para_vec, int offset) {
+    for (int i = 0; i < _weights.size(); i++) {
+      _weights[i]->set_value((char*)para_vec[offset + i]);
+    }
+    return _weights.size();
+  }
+};
+
+template class AdaptiveSoftmaxLayer<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class AdaptiveSoftmaxLayer<__half, __half>;
+#endif
+
+template <class T1, class T2>
+using AdaptiveSoftmaxLayerPtr = std::shared_ptr<AdaptiveSoftmaxLayer<T1, T2>>;
+
+}  // namespace lightseq
@@ -37,6 +37,16 @@ class CRFLayer : public Layer {
   void before_forward(int batch_size, int seq_len, bool forward_or_decode,
                       bool output_decode_score);
 
+  // See CRFOP::set_cu_seqlens.
+  void set_cu_seqlens(const int* cu_seqlens) {
+    _crf_op->set_cu_seqlens(cu_seqlens);
+  }
+
+  // See CRFOP::set_tags, the layer then outputs the loss of the tags.
+  void set_tags(const int* tags) { _crf_op->set_tags(tags); }
+
+  size_t load_para_and_grad(const T* para_ptr, T* grad_ptr);
+
   int load_params(const std::vector<const T*>& para_vec, int offset);
 };
 
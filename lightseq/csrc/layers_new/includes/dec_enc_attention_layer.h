@@ -9,6 +9,7 @@
 #include "strided_batch_gemm.h"
 #include "transform_0213.h"
 #include "concat3_dim1.h"
+#include "encdec_attention_i8.h"
 #include "layer.h"
 
 namespace lightseq {
@@ -24,6 +25,9 @@ class DecEncAttentionLayer : public Layer {
   SoftmaxOp<T1, T2>* _softmax = nullptr;
   DropoutOp<T1, T2>* _attn_prob_dropout = nullptr;
   StridedBatchGemmOp<T1, T2>* _attn_context = nullptr;
+  // replaces attn_scores, softmax, attn_prob_dropout and attn_context in
+  // inference with int8 enc k, v, see EncDecAttentionI8Op.
+  EncDecAttentionI8Op<T1, T2>* _attn_i8 = nullptr;
   Transform0213OP<T1, T2>* _transform_0213 = nullptr;
   LinearOp<T1, T2>* _attn_out_linear = nullptr;
   BiasDropoutResOp<T1, T2>* _attn_dropout = nullptr;
@@ -51,14 +55,18 @@ class DecEncAttentionLayer : public Layer {
   DecEncAttentionLayer(size_t layer_id, size_t max_batch_tokens,
                        size_t max_seq_len, size_t hidden_size, size_t num_heads,
                        float attn_prob_dropout_ratio,
-                       float hidden_output_dropout_ratio, bool is_pre_ln);
+                       float hidden_output_dropout_ratio, bool is_pre_ln,
+                       size_t beam_size = 1, bool encdec_kv_int8 = false);
 
   virtual ~DecEncAttentionLayer() {}
 
   Variable* operator()(Variable* inp, Variable* enc_mask, Variable* enc_k,
                        Variable* enc_v);
 
-  void before_forward(int batch_size, int src_seq_len, int trg_seq_len);
+  // step is the decoding step of inference, the int8 enc k, v are quantized
+  // at step 0.
+  void before_forward(int batch_size, int trg_seq_len, int src_seq_len,
+                      int step = -1);
 
   void before_backward();
 
@@ -1,8 +1,11 @@
 #pragma once
 #include "bias_act_dropout.h"
 #include "bias_dropout_residual.h"
+#include "bias_dropout_res_ln.h"
+#include "int8_linear.h"
 #include "linear.h"
 #include "layer_normalize.h"
+#include "sparse24_linear.h"
 #include "layer.h"
 
 namespace lightseq {
@@ -11,11 +14,22 @@ template <class T1, class T2>
 class FeedForwardLayer : public Layer {
  private:
   // operators
+  // pre layer norm or int8 only.
   LayerNormalizeOp<T1, T2>* _ffn_ln = nullptr;
   LinearOp<T1, T2>* _ff1 = nullptr;
+  // fused into _ff1 by GraphFusion for inference.
   BiasActDropoutOp<T1, T2>* _ffn_activation_dropout = nullptr;
   LinearOp<T1, T2>* _ff2 = nullptr;
   BiasDropoutResOp<T1, T2>* _ffn_dropout = nullptr;
+  // post layer norm only, in place of _ffn_dropout and _ffn_ln.
+  BiasDropoutResLnOp<T1, T2>* _ffn_dropout_ln = nullptr;
+  // int8 only, in place of the linears, _ff2 fuses the bias and the residual
+  // in place of _ffn_dropout.
+  Int8LinearOp<T1, T2>* _ff1_int8 = nullptr;
+  Int8LinearOp<T1, T2>* _ff2_int8 = nullptr;
+  // 2:4 sparse only, in place of the linears.
+  Sparse24LinearOp<T1, T2>* _ff1_sparse24 = nullptr;
+  Sparse24LinearOp<T1, T2>* _ff2_sparse24 = nullptr;
 
   // parameters
   Variable* _inter_w;
@@ -24,6 +38,9 @@ class FeedForwardLayer : public Layer {
   Variable* _output_b;
   Variable* _ffn_nw;
   Variable* _ffn_nb;
+  // int8 only, the per output channel scales of the weights.
+  Variable* _inter_w_scale = nullptr;
+  Variable* _output_w_scale = nullptr;
 
   // shape related
   size_t _batch_dim;
@@ -39,13 +56,20 @@ class FeedForwardLayer : public Layer {
 
   bool _is_pre_ln;
   std::string _activation_fn;
+  bool _int8;
+  bool _sparse24;
 
  public:
+  // int8 runs the linears in int8, see MultiheadAttentionLayer. sparse24
+  // runs them on the 2:4 sparse tensor cores, for kernels pruned 2:4 along
+  // the input, see Sparse24LinearOp, and falls back to the dense linears
+  // where it is not supported. Inference only.
   FeedForwardLayer(size_t layer_id, size_t max_batch_tokens, size_t max_seq_len,
                    size_t hidden_size, size_t num_heads,
                    size_t intermediate_size, float activation_dropout_ratio,
                    float hidden_output_dropout_ratio, bool is_pre_ln,
-                   std::string activation_fn);
+                   std::string activation_fn, bool int8 = false,
+                   bool sparse24 = false);
 
   virtual ~FeedForwardLayer() {}
 
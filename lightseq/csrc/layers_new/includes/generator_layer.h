@@ -1,6 +1,7 @@
 #pragma once
 
 #include "beam_search_topk.h"
+#include "logits_process.h"
 #include "sampling.h"
 #include "layer.h"
 
@@ -10,6 +11,7 @@ template <class T>
 class GeneratorLayer : public Layer {
  private:
   // operators
+  LogitsProcessOp<T>* _logits_process;
   BeamSearchTopOp<T>* _beam_search = nullptr;
   SamplingOp<T>* _sampling = nullptr;
 
@@ -17,6 +19,8 @@ class GeneratorLayer : public Layer {
   Variable* _logit_bias;
   size_t _trg_vocab_size;
   bool _has_logits_bias;
+  // the rows of a sequence of the batch
+  int _beam_size;
 
   GenerateMethod _generate_method;
 
@@ -38,14 +42,52 @@ class GeneratorLayer : public Layer {
 
   void refresh_cache(Variable* caches_k, Variable* caches_v);
 
+  // Beam search only, see BeamSearchTopOp::use_kv_rows, before operator().
+  void use_kv_rows();
+  void init_kv_rows(int* kv_rows);
+  void refresh_kv_rows(int* kv_rows);
+  // Sampling only, see SamplingOp::fork_kv_rows.
+  void fork_kv_rows(int* kv_rows, int prompt_rows, int num_rows,
+                    int prompt_len);
+  // Beam search only, see BeamSearchTopOp::set_beam_pruning.
+  void set_beam_pruning(float abs_margin, float rel_margin);
+
   int load_params(const std::vector<const T*>& para_vec, int offset);
 
   bool is_stop();
+
+  // Sampling only, see SamplingOp::set_stop_check_interval. With beam search
+  // the stop is checked every step.
+  void set_stop_check_interval(int interval);
+
+  // Sampling only, see SamplingOp::set_step_offset_ptr.
+  void set_step_offset_ptr(const int* step_offset_ptr);
+  void clear_step_flags();
+  void fetch_step_flags(int cur_step, int offset, int num_steps);
+
+  // Sampling only, see SamplingOp::set_generation_configs.
+  void set_generation_configs(
+      const std::vector<cuda::GenerationConfig>& configs);
+
+  // See LogitsProcessOp, with both generate methods.
+  void set_logits_processor(const cuda::LogitsProcessConfig& config);
+
+  // Sampling only, see LogitsProcessOp::set_automaton.
+  void set_token_automaton(const cuda::TokenAutomaton& automaton);
+
+  // Sampling only, see SamplingOp::set_sampling_params.
+  void set_sampling_params(float temperature, float repetition_penalty,
+                           float min_p);
+
+  // The number of steps of a generation which ended after steps steps,
+  // either because is_stop() or because max_step is reached.
+  int stop_step(int steps);
 };
 
 template class GeneratorLayer<float>;
 #ifdef LIGHTSEQ_cuda
 template class GeneratorLayer<__half>;
+template class GeneratorLayer<__nv_bfloat16>;
 #endif
 
 template <typename T>
@@ -21,6 +21,7 @@ class GptAttentionLayer : public Layer {
   LinearOp<T1, T2>* _qkv_linear = nullptr;
   SplitHeadOp<T1, T2>* _split_head = nullptr;
   SDPALayer<T1, T2>* _sdpa = nullptr;
+  // nullptr when the sdpa writes the token major layout itself.
   Transform0213OP<T1, T2>* _transform_0213 = nullptr;
   LinearOp<T1, T2>* _attn_out_linear = nullptr;
   BiasDropoutResOp<T1, T2>* _attn_res = nullptr;
@@ -57,6 +58,11 @@ class GptAttentionLayer : public Layer {
 
   void before_forward(int batch_size, int trg_seq_len, int steps);
 
+  // see SDPALayer::set_tree_mask.
+  bool set_tree_mask(const unsigned char* tree_mask, int tree_len) {
+    return _sdpa->set_tree_mask(tree_mask, tree_len);
+  }
+
   void before_backward();
 
   size_t load_para_and_grad(const T1* para_ptr, T2* grad_ptr);
@@ -18,7 +18,7 @@ class GptLayer : public Layer {
            int num_heads, int intermediate_size, float attn_prob_dropout_ratio,
            float activation_dropout_ratio, float hidden_output_dropout_ratio,
            std::string activation_fn, bool mask_future_tokens,
-           int beam_size = 1);
+           int beam_size = 1, bool sparse24 = false);
   virtual ~GptLayer() {}
 
   Variable* operator()(Variable* inp, Variable* cache_k, Variable* cache_v,
@@ -29,6 +29,10 @@ class GptLayer : public Layer {
     _ffn_layer->before_forward(batch_size, seq_len);
   }
 
+  bool set_tree_mask(const unsigned char* tree_mask, int tree_len) {
+    return _attn_layer->set_tree_mask(tree_mask, tree_len);
+  }
+
   size_t load_para_and_grad(const T1* para_ptr, T2* grad_ptr);
 
   int load_params(const std::vector<const T1*>& para_vec, int offset);
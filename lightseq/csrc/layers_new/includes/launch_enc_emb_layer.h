@@ -16,17 +16,27 @@ class LaunchEncEmbLayer : public Layer {
   Variable* _pos_emb;
   Variable* _lang_emb;
   Variable* _lang_id;
+  // fuse_ln only.
+  Variable* _ln_gamma = nullptr;
+  Variable* _ln_betta = nullptr;
 
  public:
+  // With fuse_ln the output is the layer normalization of the embedding by
+  // the ln gamma and betta after the embeddings in load_params, see
+  // launch_enc_emb_ln. Cuda only.
   LaunchEncEmbLayer(int max_batch_tokens, int pad_id, int hidden_dim,
-                    int multilg_type)
+                    int multilg_type, bool fuse_ln = false)
       : Layer("LaunchEncEmbLayer"),
-        _launch_enc_op(new LaunchEncEmbOp<T>(max_batch_tokens, pad_id,
-                                             hidden_dim, multilg_type)) {
+        _launch_enc_op(new LaunchEncEmbOp<T>(
+            max_batch_tokens, pad_id, hidden_dim, multilg_type, fuse_ln)) {
     _token_emb = new Variable("token_emb", g_dtype<T>());
     _pos_emb = new Variable("pos_emb", g_dtype<T>());
     _lang_emb = new Variable("lang_emb", g_dtype<T>());
     _lang_id = new Variable("lang_id", g_dtype<T>());
+    if (fuse_ln) {
+      _ln_gamma = new Variable("layer_norm_gamma", g_dtype<T>());
+      _ln_betta = new Variable("layer_norm_betta", g_dtype<T>());
+    }
 
     this->_context_ptr->exit_layer();  // necessary
   }
@@ -37,7 +47,8 @@ class LaunchEncEmbLayer : public Layer {
     set_inputs({inp});
 
     std::tuple<Variable*, Variable*> out =
-        (*_launch_enc_op)(inp, _token_emb, _pos_emb, _lang_emb, _lang_id);
+        (*_launch_enc_op)(inp, _token_emb, _pos_emb, _lang_emb, _lang_id,
+                          _ln_gamma, _ln_betta);
 
     set_outputs({std::get<0>(out), std::get<1>(out)});
     return out;
@@ -54,6 +65,10 @@ class LaunchEncEmbLayer : public Layer {
     // _token_emb->set_shape();
     _pos_emb->set_value((char*)para_vec[offset + 1]);
     // _pos_emb->set_shape();
+    if (_ln_gamma) {
+      _ln_gamma->set_value((char*)para_vec[offset + 2]);
+      _ln_betta->set_value((char*)para_vec[offset + 3]);
+    }
     // _lang_emb->set_value((char*)para_vec[offset + 4]);
     return 0;
   }
@@ -43,6 +43,11 @@ class LaunchGptEmbLayer : public Layer {
     _launch_gpt_op->before_forward(batch_size, seq_len, offset);
   }
 
+  // see LaunchGptEmbOp::set_positions.
+  void set_positions(const int* positions) {
+    _launch_gpt_op->set_positions(positions);
+  }
+
   void before_backward() {}
 
   int load_params(const std::vector<const T*>& para_vec, int offset) {
@@ -12,15 +12,23 @@ class LaunchLlamaEmbLayer : public Layer {
 
   // parameters
   Variable* _token_emb;
+  // the scale of every token of an int8 _token_emb, nullptr otherwise.
+  Variable* _token_emb_scale = nullptr;
 
  public:
   LaunchLlamaEmbLayer(int max_batch_tokens, int max_step, int max_batch_size,
-                      int beam_size, int pad_id, int hidden_dim)
+                      int beam_size, int pad_id, int hidden_dim,
+                      bool quant_emb = false)
       : Layer("LaunchLlamaEmbLayer"),
         _launch_llama_op(new LaunchLlamaEmbOp<T>(max_batch_tokens, max_step,
                                                  max_batch_size, beam_size,
                                                  pad_id, hidden_dim)) {
-    _token_emb = new Variable("token_emb", g_dtype<T>());
+    if (quant_emb) {
+      _token_emb = new Variable("token_emb", g_dtype<int8_t>());
+      _token_emb_scale = new Variable("token_emb_scale", g_dtype<T>());
+    } else {
+      _token_emb = new Variable("token_emb", g_dtype<T>());
+    }
 
     this->_context_ptr->exit_layer();  // necessary
   }
@@ -31,7 +39,9 @@ class LaunchLlamaEmbLayer : public Layer {
     set_inputs({inp});
 
     std::tuple<Variable*, Variable*, Variable*> out =
-        (*_launch_llama_op)(inp, _token_emb);
+        _token_emb_scale
+            ? (*_launch_llama_op)(inp, _token_emb, _token_emb_scale)
+            : (*_launch_llama_op)(inp, _token_emb);
 
     set_outputs({std::get<0>(out), std::get<1>(out), std::get<2>(out)});
     return out;
@@ -41,10 +51,19 @@ class LaunchLlamaEmbLayer : public Layer {
     _launch_llama_op->before_forward(batch_size, seq_len, offset);
   }
 
+  void set_offset_ptr(const int* offset_ptr) {
+    _launch_llama_op->set_offset_ptr(offset_ptr);
+  }
+
   void before_backward() {}
 
-  int load_params(const std::vector<const T*>& para_vec, int offset) {
+  // an int8 embedding also takes its scales at scale_offset.
+  int load_params(const std::vector<const T*>& para_vec, int offset,
+                  int scale_offset = -1) {
     _token_emb->set_value((char*)para_vec[offset]);
+    if (_token_emb_scale) {
+      _token_emb_scale->set_value((char*)para_vec[scale_offset]);
+    }
     return 0;
   }
 };
@@ -52,6 +71,7 @@ class LaunchLlamaEmbLayer : public Layer {
 template class LaunchLlamaEmbLayer<float>;
 #ifdef LIGHTSEQ_cuda
 template class LaunchLlamaEmbLayer<__half>;
+template class LaunchLlamaEmbLayer<__nv_bfloat16>;
 #endif
 
 template <class T>
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "linear.h"
+#include "weight_only_linear.h"
 #include "layer.h"
 
 namespace lightseq {
@@ -10,9 +11,13 @@ class LinearLayer : public Layer {
  private:
   // operators
   LinearOp<T1, T2>* _linear = nullptr;
+  // with a quantized weight instead of _linear.
+  WeightOnlyLinearOp<T1, T2>* _quant_linear = nullptr;
 
   // parameters
   Variable* _linear_w;
+  // one scale per output column of the quantized weight.
+  Variable* _linear_scale = nullptr;
 
   // shape related
   int _max_batch_tokens;
@@ -20,9 +25,12 @@ class LinearLayer : public Layer {
   size_t _output_size;
 
  public:
+  // quant_bits 8 or 4 runs an inference only WeightOnlyLinearOp over a
+  // [input_size, output_size] quantized weight, see load_params.
   LinearLayer(int max_batch_tokens, int input_size, int output_size,
               MATRIX_OP opA = MATRIX_OP::Transpose,
-              MATRIX_OP opB = MATRIX_OP::NonTranspose, float alpha = float(1.));
+              MATRIX_OP opB = MATRIX_OP::NonTranspose, float alpha = float(1.),
+              int quant_bits = 0, size_t max_dequant_cols = 0);
 
   virtual ~LinearLayer() {}
 
@@ -34,12 +42,15 @@ class LinearLayer : public Layer {
 
   size_t load_para_and_grad(const T1* para_ptr, T2* grad_ptr);
 
+  // A quantized weight takes the int8 weight at offset and its scales after
+  // it.
   int load_params(const std::vector<const T1*>& para_vec, int offset);
 };
 
 template class LinearLayer<float, float>;
 #ifdef LIGHTSEQ_cuda
 template class LinearLayer<__half, __half>;
+template class LinearLayer<__nv_bfloat16, __nv_bfloat16>;
 #endif
 
 template <class T1, class T2>
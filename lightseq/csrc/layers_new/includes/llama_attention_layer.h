@@ -1,11 +1,16 @@
 #pragma once
 #include "layer.h"
 #include "linear.h"
+#include "weight_only_linear.h"
+#include "fp8_linear.h"
+#include "int8_linear.h"
 #include "rms_layer_norm.h"
 #include "fuse_rotary_position_qkv.h"
 #include "sdpa_layer.h"
+#include "paged_attention.h"
 #include "transform_0213.h"
 #include "fuse_add2_op.h"
+#include "all_reduce.h"
 
 namespace lightseq {
 
@@ -14,49 +19,182 @@ class LlamaAttentionLayer : public Layer {
  private:
   // operators
   RMSLayerNormalizeOp<T1, T2>* _attn_ln = nullptr;
-  LinearOp<T1, T2>* _qkv_linear = nullptr;
+  // also runs the dense qkv linear, see RotaryPositionQk.
   RotaryPositionQk<T1, T2>* _fuse_rotary = nullptr;
   SDPALayer<T1, T2>* _sdpa = nullptr;
+  PagedAttentionOp<T1, T2>* _paged_attn = nullptr;
+  // nullptr when the sdpa writes the token major layout itself.
   Transform0213OP<T1, T2>* _transform_0213 = nullptr;
   LinearOp<T1, T2>* _attn_out_linear = nullptr;
+  // training only, the dense qkv linear out of the rotary op, which then
+  // outputs k, v instead of writing the caches.
+  LinearOp<T1, T2>* _qkv_linear = nullptr;
+  // weight-only quantization only, in place of the linears above.
+  WeightOnlyLinearOp<T1, T2>* _qkv_quant_linear = nullptr;
+  WeightOnlyLinearOp<T1, T2>* _attn_out_quant_linear = nullptr;
+  // fp8 only, in place of the linears above.
+  Fp8LinearOp<T1, T2>* _qkv_fp8_linear = nullptr;
+  Fp8LinearOp<T1, T2>* _attn_out_fp8_linear = nullptr;
+  // int8 only, in place of the linears above.
+  Int8LinearOp<T1, T2>* _qkv_int8_linear = nullptr;
+  Int8LinearOp<T1, T2>* _attn_out_int8_linear = nullptr;
   FuseAdd2Op<T1, T2>* _add_residual = nullptr;
+  // tensor parallelism only.
+  AllReduceOp<T1, T2>* _all_reduce = nullptr;
 
   // parameters
   Variable* _norm_scale;
   Variable* _attn_qkvw;
   Variable* _attn_ow;
+  // scales of the quantized weights above.
+  Variable* _attn_qkvw_scale = nullptr;
+  Variable* _attn_ow_scale = nullptr;
+  // calibrated scales of the inputs of the fp8 linears.
+  Variable* _attn_qkvw_input_scale = nullptr;
+  Variable* _attn_ow_input_scale = nullptr;
 
   // shape related
   size_t _max_batch_size;
   int _max_batch_tokens;
   int _max_seq_len;
+  // rows of the dense caches per sequence, 0 for max_seq_len, see
+  // set_attention_window.
+  int _cache_len = 0;
   size_t _hidden_size;
+  // q heads and key/value heads of this tensor parallel rank, there are less
+  // key/value heads for grouped-query attention.
   int _nhead;
+  int _kv_head_num;
   int _head_dim;
+  // 0 means the kv cache is dense [batch_size, nhead, max_seq_len, head_dim],
+  // otherwise it is paged, see PagedAttentionOp.
+  int _page_size;
+  int _weight_quant_bits;
+  int _weight_quant_group_size;
+  bool _fp8;
+  bool _int8;
+
+  // rows of the weight and of the scales of a linear of in_dim inputs.
+  size_t weight_rows(size_t in_dim) const {
+    return _weight_quant_bits == 4 ? in_dim / 2 : in_dim;
+  }
+  size_t scale_rows(size_t in_dim) const {
+    return _weight_quant_group_size > 0 ? in_dim / _weight_quant_group_size
+                                        : 1;
+  }
+
+  Variable* attn_out_linear(Variable* inp, Variable* residual);
 
   // tensor slice
   Variable* _cache_k;
   Variable* _cache_v;
 
  public:
+  // weight_quant_bits 8 or 4 quantizes the weights of the linears with one
+  // scale per weight_quant_group_size rows, see WeightOnlyLinearOp. fp8
+  // runs the linears in fp8 instead, see Fp8LinearOp, and int8 in int8
+  // with the activations quantized per token, see Int8LinearOp. Training
+  // only supports the dense weights on one rank, without a paged cache or
+  // grouped-query attention.
   LlamaAttentionLayer(int max_batch_tokens, int max_seq_len, int hidden_size,
-                      int num_heads, int beam_size);
+                      int num_heads, int beam_size, int page_size = 0,
+                      int num_kv_heads = 0, int weight_quant_bits = 0,
+                      int weight_quant_group_size = 0, bool fp8 = false,
+                      bool int8 = false);
 
   virtual ~LlamaAttentionLayer() {}
 
+  // cache_k, cache_v are unused in training and may be nullptr.
   Variable* operator()(Variable* inp, Variable* cache_k, Variable* cache_v,
                        Variable* pad_mask);
 
   void before_forward(int batch_size, int trg_seq_len, int prompt_len);
 
+  // Take the cache position of the current step from device memory, see
+  // RotaryPositionQk::set_offset_seq_len_ptr.
+  void set_prompt_len_ptr(const int* prompt_len_ptr) {
+    _fuse_rotary->set_offset_seq_len_ptr(prompt_len_ptr);
+    if (_paged_attn) _paged_attn->set_offset_seq_len_ptr(prompt_len_ptr);
+  }
+
+  // Share the sin, cos tables of make_rotary_table, see
+  // RotaryPositionQk::set_rotary_table. Called before operator().
+  void set_rotary_table(const T1* sin_ptr, const T1* cos_ptr) {
+    _fuse_rotary->set_rotary_table(sin_ptr, cos_ptr);
+  }
+
+  // Only valid when the layer is built with a page_size.
+  void set_page_table(const int* page_table) {
+    _fuse_rotary->set_page_table(page_table, _page_size);
+    _paged_attn->set_page_table(page_table);
+  }
+
+  // Per-sequence offsets for continuous batching, paged mode only.
+  void set_seq_offsets(const int* seq_offsets) {
+    _fuse_rotary->set_seq_offsets(seq_offsets);
+    _paged_attn->set_seq_offsets(seq_offsets);
+  }
+
+  // Read the dense caches through the cache row of every position, for
+  // beam search without copying the caches, see SDPALayer::set_kv_rows.
+  // Returns false when unsupported, eg. with a paged cache.
+  bool set_kv_rows(const int* kv_rows) {
+    return _paged_attn == nullptr && _sdpa->set_kv_rows(kv_rows);
+  }
+
+  // Attend to the first sink_len positions and to the window positions up
+  // to every query only, with dense caches of sink_len + ring_size rows per
+  // sequence, see RotaryPositionQk::set_kv_ring. ring_size >= window, the
+  // queries of a forward see all of their window while query_len <=
+  // ring_size - window + 1. Dense cache only.
+  void set_attention_window(int sink_len, int window, int ring_size) {
+    _cache_len = sink_len + ring_size;
+    _fuse_rotary->set_kv_ring(_cache_len, ring_size);
+    _sdpa->set_kv_ring(ring_size, window, _max_seq_len);
+  }
+
+  // Keep the sink_len keys of the most attention mass outside the window in
+  // the rows of the sinks of set_attention_window, see
+  // SDPALayer::set_heavy_hitters. heavy_pos: [max_batch_size, kv_head_num,
+  // sink_len], kv_mass: [max_batch_size, kv_head_num, sink_len + ring_size].
+  // After set_attention_window, dense cache only.
+  void set_heavy_hitters(int* heavy_pos, float* kv_mass) {
+    _sdpa->set_heavy_hitters(heavy_pos, kv_mass);
+  }
+
+  // Low rank adapters of the output projection, dense weights only, see
+  // LinearOp::set_lora.
+  void set_lora(const LoraTarget<T1>* attn_out_lora) {
+    if (_attn_out_linear == nullptr) {
+      printf("Error! LoRA needs the dense weights of LlamaAttentionLayer\n");
+      exit(-1);
+    }
+    _attn_out_linear->set_lora(attn_out_lora);
+  }
+
+  // Store the caches in int8, with one scale per cached head vector, see
+  // RotaryPositionQk::set_kv_cache_scales. cache_k, cache_v given to
+  // operator() must then be int8 variables.
+  void set_kv_cache_scales(float* cache_k_scale, float* cache_v_scale) {
+    _fuse_rotary->set_kv_cache_scales(cache_k_scale, cache_v_scale);
+    if (_paged_attn) {
+      _paged_attn->set_kv_cache_scales(cache_k_scale, cache_v_scale);
+    } else {
+      _sdpa->set_kv_cache_scales(cache_k_scale, cache_v_scale);
+    }
+  }
+
   void before_backward();
 
+  size_t load_para_and_grad(const T1* para_ptr, T2* grad_ptr);
+
   int load_params(const std::vector<const T1*>& para_vec, int offset);
 };
 
 template class LlamaAttentionLayer<float, float>;
 #ifdef LIGHTSEQ_cuda
 template class LlamaAttentionLayer<__half, __half>;
+template class LlamaAttentionLayer<__nv_bfloat16, __nv_bfloat16>;
 #endif
 
 template <class T1, class T2>
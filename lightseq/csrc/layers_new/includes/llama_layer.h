@@ -2,6 +2,7 @@
 #include "layer.h"
 #include "llama_attention_layer.h"
 #include "llama_mlp_layer.h"
+#include "moe_feed_forward_layer.h"
 
 namespace lightseq {
 
@@ -10,12 +11,18 @@ class LlamaLayer : public Layer {
  private:
   LlamaAttentionLayerPtr<T1, T2> _attn_layer;
   LlamaMLPLayerPtr<T1, T2> _mlp_layer;
+  // in place of the mlp for the mixture of experts models.
+  MoEFeedForwardLayerPtr<T1, T2> _moe_layer;
 
   int _layer_id;
 
  public:
   LlamaLayer(int max_batch_size, int max_seq_len, int hidden_size,
-             int inner_dim, int num_heads, int beam_size);
+             int inner_dim, int num_heads, int beam_size, int page_size = 0,
+             int num_kv_heads = 0, int weight_quant_bits = 0,
+             int weight_quant_group_size = 0, bool fp8 = false,
+             bool int8 = false, int expert_num = 0, int moe_topk = 2,
+             float moe_capacity_factor = 0.f, bool sparse24 = false);
   virtual ~LlamaLayer() {}
 
   Variable* operator()(Variable* inp, Variable* cache_k, Variable* cache_v,
@@ -23,7 +30,54 @@ class LlamaLayer : public Layer {
 
   void before_forward(int batch_size, int seq_len, int prompt_len) {
     _attn_layer->before_forward(batch_size, seq_len, prompt_len);
-    _mlp_layer->before_forward(batch_size, seq_len);
+    if (_moe_layer) {
+      _moe_layer->before_forward(batch_size, seq_len);
+    } else {
+      _mlp_layer->before_forward(batch_size, seq_len);
+    }
+  }
+
+  void set_prompt_len_ptr(const int* prompt_len_ptr) {
+    _attn_layer->set_prompt_len_ptr(prompt_len_ptr);
+  }
+
+  void set_rotary_table(const T1* sin_ptr, const T1* cos_ptr) {
+    _attn_layer->set_rotary_table(sin_ptr, cos_ptr);
+  }
+
+  void set_page_table(const int* page_table) {
+    _attn_layer->set_page_table(page_table);
+  }
+
+  void set_attention_window(int sink_len, int window, int ring_size) {
+    _attn_layer->set_attention_window(sink_len, window, ring_size);
+  }
+
+  void set_heavy_hitters(int* heavy_pos, float* kv_mass) {
+    _attn_layer->set_heavy_hitters(heavy_pos, kv_mass);
+  }
+
+  void set_seq_offsets(const int* seq_offsets) {
+    _attn_layer->set_seq_offsets(seq_offsets);
+  }
+
+  bool set_kv_rows(const int* kv_rows) {
+    return _attn_layer->set_kv_rows(kv_rows);
+  }
+
+  void set_kv_cache_scales(float* cache_k_scale, float* cache_v_scale) {
+    _attn_layer->set_kv_cache_scales(cache_k_scale, cache_v_scale);
+  }
+
+  void set_lora(const LoraTarget<T1>* attn_out_lora,
+                const LoraTarget<T1>* down_lora) {
+    _attn_layer->set_lora(attn_out_lora);
+    if (_moe_layer == nullptr) {
+      _mlp_layer->set_lora(down_lora);
+    } else if (down_lora != nullptr) {
+      printf("Error! LoRA does not support the experts of LlamaLayer\n");
+      exit(-1);
+    }
   }
 
   size_t load_para_and_grad(const T1* para_ptr, T2* grad_ptr);
@@ -34,6 +88,7 @@ class LlamaLayer : public Layer {
 template class LlamaLayer<float, float>;
 #ifdef LIGHTSEQ_cuda
 template class LlamaLayer<__half, __half>;
+template class LlamaLayer<__nv_bfloat16, __nv_bfloat16>;
 #endif
 
 template <class T1, class T2>
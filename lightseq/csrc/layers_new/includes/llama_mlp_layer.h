@@ -2,8 +2,14 @@
 
 #include "rms_layer_norm.h"
 #include "linear.h"
+#include "weight_only_linear.h"
+#include "swiglu_linear.h"
+#include "fp8_linear.h"
+#include "int8_linear.h"
+#include "sparse24_linear.h"
 #include "act_elewise_product.h"
 #include "fuse_add2_op.h"
+#include "all_reduce.h"
 #include "layer.h"
 
 namespace lightseq {
@@ -13,23 +19,72 @@ class LlamaMLPLayer : public Layer {
  private:
   // operators
   RMSLayerNormalizeOp<T1, T2>* _mlp_ln = nullptr;
-  LinearOp<T1, T2>* _gate_up_linear = nullptr;
+  // the gate_up linear fused with the activation.
+  SwiGLULinearOp<T1, T2>* _gate_up_swiglu = nullptr;
   LinearOp<T1, T2>* _down_linear = nullptr;
+  // weight-only quantization only, in place of the linear above.
+  WeightOnlyLinearOp<T1, T2>* _down_quant_linear = nullptr;
+  // fp8 only, in place of the swiglu and the linear above.
+  Fp8LinearOp<T1, T2>* _gate_up_fp8_linear = nullptr;
+  // int8 only, in place of the swiglu and the linear above.
+  Int8LinearOp<T1, T2>* _gate_up_int8_linear = nullptr;
+  Int8LinearOp<T1, T2>* _down_int8_linear = nullptr;
+  // 2:4 sparse only, in place of the swiglu and the linear above.
+  Sparse24LinearOp<T1, T2>* _gate_up_sparse24_linear = nullptr;
+  Sparse24LinearOp<T1, T2>* _down_sparse24_linear = nullptr;
+  // fp8, int8, 2:4 sparse and training, SwiGLULinearOp has no backward so
+  // training runs the gate_up linear and the activation apart.
   ActElewiseProductOp<T1, T2>* _act_product = nullptr;
+  LinearOp<T1, T2>* _gate_up_linear = nullptr;
+  Fp8LinearOp<T1, T2>* _down_fp8_linear = nullptr;
   FuseAdd2Op<T1, T2>* _add_residual = nullptr;
+  // tensor parallelism only.
+  AllReduceOp<T1, T2>* _all_reduce = nullptr;
 
   // parameters
   Variable* _norm_scale;
   Variable* _gate_up_linear_weight;
   Variable* _down_linear_weight;
+  // scales of the quantized weights above.
+  Variable* _gate_up_linear_scale = nullptr;
+  Variable* _down_linear_scale = nullptr;
+  // calibrated scales of the inputs of the fp8 linears.
+  Variable* _gate_up_linear_input_scale = nullptr;
+  Variable* _down_linear_input_scale = nullptr;
 
   // shape related
   int _max_batch_tokens;
   size_t _hidden_dim;
+  // inner dim of this tensor parallel rank.
   size_t _inner_dim;
+  int _weight_quant_bits;
+  int _weight_quant_group_size;
+  bool _fp8;
+  bool _int8;
+  bool _sparse24;
+
+  // rows of the weight and of the scales of a linear of in_dim inputs.
+  size_t weight_rows(size_t in_dim) const {
+    return _weight_quant_bits == 4 ? in_dim / 2 : in_dim;
+  }
+  size_t scale_rows(size_t in_dim) const {
+    return _weight_quant_group_size > 0 ? in_dim / _weight_quant_group_size
+                                        : 1;
+  }
+
+  Variable* down_linear(Variable* inp, Variable* residual);
 
  public:
-  LlamaMLPLayer(int max_batch_tokens, int hidden_dim, int inner_dim);
+  // weight_quant_bits 8 or 4 quantizes the weights of the linears with one
+  // scale per weight_quant_group_size rows, see WeightOnlyLinearOp. fp8
+  // runs the linears in fp8 instead, see Fp8LinearOp, and int8 in int8
+  // with the activations quantized per token, see Int8LinearOp. sparse24
+  // runs the dense weights, pruned 2:4 along the input, on the sparse
+  // tensor cores, see Sparse24LinearOp, where it is supported. Training
+  // only supports the dense weights on one rank.
+  LlamaMLPLayer(int max_batch_tokens, int hidden_dim, int inner_dim,
+                int weight_quant_bits = 0, int weight_quant_group_size = 0,
+                bool fp8 = false, bool int8 = false, bool sparse24 = false);
 
   virtual ~LlamaMLPLayer() {}
 
@@ -37,12 +92,25 @@ class LlamaMLPLayer : public Layer {
 
   void before_forward(int batch_size, int seq_len);
 
+  // Low rank adapters of the down projection, dense weights only, see
+  // LinearOp::set_lora.
+  void set_lora(const LoraTarget<T1>* down_lora) {
+    if (_down_linear == nullptr) {
+      printf("Error! LoRA needs the dense weights of LlamaMLPLayer\n");
+      exit(-1);
+    }
+    _down_linear->set_lora(down_lora);
+  }
+
+  size_t load_para_and_grad(const T1* para_ptr, T2* grad_ptr);
+
   int load_params(const std::vector<const T1*>& para_vec, int offset);
 };
 
 template class LlamaMLPLayer<float, float>;
 #ifdef LIGHTSEQ_cuda
 template class LlamaMLPLayer<__half, __half>;
+template class LlamaMLPLayer<__nv_bfloat16, __nv_bfloat16>;
 #endif
 
 template <class T1, class T2>
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "rms_layer_norm.h"
+#include "layer_normalize.h"
+#include "linear.h"
+#include "moe_dispatch.h"
+#include "moe_expert_linear.h"
+#include "moe_combine.h"
+#include "layer.h"
+
+namespace lightseq {
+
+// The feed forward of a mixture of experts, for inference: every token runs
+// the experts its gate routes it to, see MoeDispatchOp, and only the experts
+// which received tokens run, on their tokens only.
+//   activation_fn "silu": the Llama mlp, rms norm and the [gate, up] and
+//     down linears of every expert without bias, onto the residual.
+//   "relu" or "gelu": the Transformer and Gpt ffn, layer norm as is_pre_ln
+//     and the two linears of every expert with bias.
+// The gate is a [hidden_dim, expert_num] linear of the normalized input
+// choosing the topk experts of every token, or, for hard_gate, the expert of
+// every sequence given by set_hard_gates.
+template <class T1, class T2>
+class MoEFeedForwardLayer : public Layer {
+ private:
+  // operators
+  RMSLayerNormalizeOp<T1, T2>* _rms_ln = nullptr;
+  LayerNormalizeOp<T1, T2>* _ffn_ln = nullptr;
+  LinearOp<T1, T2>* _gate_linear = nullptr;
+  MoeDispatchOp<T1, T2>* _dispatch = nullptr;
+  MoeExpertLinearOp<T1, T2>* _ff1 = nullptr;
+  MoeExpertLinearOp<T1, T2>* _ff2 = nullptr;
+  MoeCombineOp<T1, T2>* _combine = nullptr;
+
+  // parameters
+  Variable* _ffn_nw;
+  // layer norm only.
+  Variable* _ffn_nb = nullptr;
+  Variable* _gate_w = nullptr;
+  // [expert_num, hidden_dim, inner_dim], of 2 * inner_dim for silu.
+  Variable* _inter_w;
+  // [expert_num, inner_dim, hidden_dim]
+  Variable* _output_w;
+  // relu and gelu only.
+  Variable* _inter_b = nullptr;
+  Variable* _output_b = nullptr;
+
+  // shape related
+  size_t _max_batch_tokens;
+  size_t _hidden_dim;
+  size_t _inner_dim;
+  size_t _expert_num;
+  size_t _topk;
+
+  std::string _activation_fn;
+  bool _is_pre_ln;
+  bool _hard_gate;
+
+ public:
+  // capacity_factor bounds the tokens of an expert, see MoeDispatchOp.
+  MoEFeedForwardLayer(int max_batch_tokens, int hidden_dim, int inner_dim,
+                      int expert_num, int topk, std::string activation_fn,
+                      bool is_pre_ln = true, float capacity_factor = 0.f,
+                      bool hard_gate = false);
+
+  virtual ~MoEFeedForwardLayer() {}
+
+  Variable* operator()(Variable* inp);
+
+  void before_forward(int batch_size, int seq_len);
+
+  // The [batch_size] device array of the expert of every sequence, hard
+  // gate only.
+  void set_hard_gates(const int* hard_gates) {
+    _dispatch->set_hard_gates(hard_gates);
+  }
+
+  // In order ffn_nw, ffn_nb, gate_w, inter_w, inter_b, output_w and
+  // output_b, without the ones this layer does not use.
+  int load_params(const std::vector<const T1*>& para_vec, int offset);
+};
+
+template class MoEFeedForwardLayer<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class MoEFeedForwardLayer<__half, __half>;
+template class MoEFeedForwardLayer<__nv_bfloat16, __nv_bfloat16>;
+#endif
+
+template <class T1, class T2>
+using MoEFeedForwardLayerPtr = std::shared_ptr<MoEFeedForwardLayer<T1, T2>>;
+
+}  // namespace lightseq
@@ -1,11 +1,15 @@
 #pragma once
 #include "bias_act_dropout.h"
 #include "bias_add_transform_20314.h"
+#include "block_sparse_attention.h"
 #include "bias_dropout_residual.h"
+#include "bias_dropout_res_ln.h"
+#include "int8_linear.h"
 #include "linear.h"
 #include "layer_normalize.h"
 #include "sdpa_layer.h"
 #include "transform_0213.h"
+#include "varlen_attention.h"
 #include "layer.h"
 
 namespace lightseq {
@@ -14,15 +18,27 @@ template <class T1, class T2>
 class MultiheadAttentionLayer : public Layer {
  private:
   // operators
+  // pre layer norm or int8 only.
   LayerNormalizeOp<T1, T2>* _attn_ln = nullptr;
   LinearOp<T1, T2>* _qkv_linear = nullptr;
   BiasAddTrans20314<T1, T2>* _bias_add_transform_20314 = nullptr;
 
   SDPALayerPtr<T1, T2> _sdpa_layer = nullptr;
 
+  // nullptr when the sdpa writes the token major layout itself.
   Transform0213OP<T1, T2>* _transform_0213 = nullptr;
   LinearOp<T1, T2>* _attn_out_linear = nullptr;
   BiasDropoutResOp<T1, T2>* _attn_dropout = nullptr;
+  // post layer norm only, in place of _attn_dropout and _attn_ln.
+  BiasDropoutResLnOp<T1, T2>* _attn_dropout_ln = nullptr;
+  // varlen only, in place of the transforms and the sdpa layer above.
+  VarlenAttentionOp<T1, T2>* _varlen_attn = nullptr;
+  // block sparse only, in place of the transforms and the sdpa layer.
+  BlockSparseAttentionOp<T1, T2>* _sparse_attn = nullptr;
+  // int8 only, in place of the linears, the output one fuses the bias and
+  // the residual in place of _attn_dropout.
+  Int8LinearOp<T1, T2>* _qkv_int8_linear = nullptr;
+  Int8LinearOp<T1, T2>* _attn_out_int8_linear = nullptr;
 
   // parameters
   Variable* _attn_qkvw;
@@ -31,6 +47,9 @@ class MultiheadAttentionLayer : public Layer {
   Variable* _attn_ob;
   Variable* _attn_nw;
   Variable* _attn_nb;
+  // int8 only, the per output channel scales of the weights.
+  Variable* _attn_qkvw_scale = nullptr;
+  Variable* _attn_ow_scale = nullptr;
 
   // shape related
   int _batch_dim;
@@ -42,6 +61,9 @@ class MultiheadAttentionLayer : public Layer {
   size_t _hidden_size;
   size_t _heads;
   bool _is_pre_ln;
+  bool _varlen;
+  bool _int8;
+  bool _sparse;
 
   // tensor slice
   Variable* q_out;
@@ -49,17 +71,32 @@ class MultiheadAttentionLayer : public Layer {
   Variable* v_out;
 
  public:
-  MultiheadAttentionLayer(int layer_id, int max_batch_tokens, int max_seq_len,
-                          int hidden_size, int num_heads,
-                          float attn_prob_dropout_ratio,
-                          float hidden_output_dropout_ratio, bool is_pre_ln,
-                          bool mask_future_tokens);
+  MultiheadAttentionLayer(
+      int layer_id, int max_batch_tokens, int max_seq_len, int hidden_size,
+      int num_heads, float attn_prob_dropout_ratio,
+      float hidden_output_dropout_ratio, bool is_pre_ln,
+      bool mask_future_tokens, bool varlen = false, bool int8 = false,
+      const BlockSparseConfig& sparse = BlockSparseConfig());
 
   virtual ~MultiheadAttentionLayer() {}
 
+  // With varlen, inp is the packed tokens of RemovePaddingOp and inp_mask is
+  // not used, see VarlenAttentionOp. Inference only.
+  // With int8, the linears run in int8, see Int8LinearOp, their weights are
+  // quantized per output channel by load_params. The output linear writes
+  // into inp. Inference on cuda only.
+  // With a sparse block_size, the attention only covers the blocks of the
+  // layout, see BlockSparseAttentionOp. Inference only.
   Variable* operator()(Variable* inp, Variable* inp_mask);
 
-  void before_forward(size_t batch_size, size_t seq_len);
+  // valid_tokens is the number of packed tokens of a varlen layer.
+  void before_forward(size_t batch_size, size_t seq_len,
+                      size_t valid_tokens = 0);
+
+  // Only valid for a varlen layer, see RemovePaddingOp::cu_seqlens.
+  void set_cu_seqlens(const int* cu_seqlens) {
+    _varlen_attn->set_cu_seqlens(cu_seqlens);
+  }
 
   size_t load_para_and_grad(const T1* para_ptr, T2* grad_ptr);
 
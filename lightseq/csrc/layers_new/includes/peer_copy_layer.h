@@ -0,0 +1,47 @@
+#pragma once
+#include "peer_copy.h"
+#include "layer.h"
+
+namespace lightseq {
+
+/*
+  Send the input to a fixed Variable of the context of another pipeline
+  stage, see PeerCopyOp.
+*/
+template <class T1, class T2>
+class PeerCopyLayer : public Layer {
+ private:
+  // operators
+  PeerCopyOp<T1, T2>* _peer_copy = nullptr;
+
+ public:
+  PeerCopyLayer(size_t max_ele_num)
+      : Layer("PeerCopyLayer"),
+        _peer_copy(new PeerCopyOp<T1, T2>(max_ele_num)) {
+    this->_context_ptr->exit_layer();  // necessary
+  }
+
+  virtual ~PeerCopyLayer() {}
+
+  Variable* operator()(Variable* inp, Variable* dst, Context* dst_context) {
+    set_inputs({inp});
+    Variable* out = (*_peer_copy)(inp, dst, dst_context);
+    set_outputs({out});
+    return out;
+  }
+
+  void before_forward(size_t ele_num, size_t dst_offset) {
+    _peer_copy->before_forward(ele_num, dst_offset);
+  }
+};
+
+template class PeerCopyLayer<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class PeerCopyLayer<__half, __half>;
+template class PeerCopyLayer<__nv_bfloat16, __nv_bfloat16>;
+#endif
+
+template <class T1, class T2>
+using PeerCopyLayerPtr = std::shared_ptr<PeerCopyLayer<T1, T2>>;
+
+}  // namespace lightseq
@@ -43,6 +43,12 @@ class RMSNormLayer : public Layer {
     _rms_norm->before_forward(batch_size, seq_len);
   }
 
+  // See RMSLayerNormalizeOp::set_input_rows.
+  void set_input_rows(size_t row_stride, size_t row_offset,
+                      const int* inp_rows = nullptr) {
+    _rms_norm->set_input_rows(row_stride, row_offset, inp_rows);
+  }
+
   void before_backward() {}
 
   int load_params(const std::vector<const T1*>& para_vec, int offset) {
@@ -56,6 +62,7 @@ class RMSNormLayer : public Layer {
 template class RMSNormLayer<float, float>;
 #ifdef LIGHTSEQ_cuda
 template class RMSNormLayer<__half, __half>;
+template class RMSNormLayer<__nv_bfloat16, __nv_bfloat16>;
 #endif
 
 template <class T1, class T2>
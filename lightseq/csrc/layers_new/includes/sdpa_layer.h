@@ -1,5 +1,7 @@
 #pragma once
 #include "dropout.h"
+#include "flash_attention.h"
+#include "int8_attention.h"
 #include "softmax.h"
 #include "strided_batch_gemm.h"
 #include "layer.h"
@@ -9,6 +11,12 @@ namespace lightseq {
 /*
 Scaled Dot Product Attention
 See paper "Attention is all you need" for details.
+In inference the attention is computed by the fused FlashAttentionOp, which
+does not write the attention scores to memory. So is it in training with a
+head_dim <= 128, unless Context::flash_attention_train is off, the backward
+recomputes the scores, so the memory is linear in the sequence length.
+The unfused attention of int8 inference, as with a head_dim beyond the fused
+kernel, runs the gemms in int8, see Int8AttentionOp.
 */
 template <class T1, class T2>
 class SDPALayer : public Layer {
@@ -18,6 +26,11 @@ class SDPALayer : public Layer {
   SoftmaxOp<T1, T2>* _softmax = nullptr;
   DropoutOp<T1, T2>* _attn_prob_dropout = nullptr;
   StridedBatchGemmOp<T1, T2>* _attn_context = nullptr;
+  // replaces the operators above in inference, and in training, see
+  // Context::flash_attention_train.
+  FlashAttentionOp<T1, T2>* _flash_attn = nullptr;
+  // replaces the unfused operators in int8 inference.
+  Int8AttentionOp<T1, T2>* _int8_attn = nullptr;
 
   // shape related
   int _max_batch_tokens;
@@ -25,9 +38,18 @@ class SDPALayer : public Layer {
   int _nhead;
   int _head_dim;
 
+  // the settings of the fused path below are inference only.
+  bool fused_inference() {
+    return _flash_attn && !_context_ptr->is_training();
+  }
+
  public:
+  // num_kv_heads < num_heads is grouped-query attention, where key and value
+  // have num_kv_heads heads. Only supported by the fused inference path.
+  // int8 is inference on cuda only.
   SDPALayer(size_t max_batch_tokens, size_t max_seq_len, size_t head_dim,
-            size_t num_heads, float attn_prob_dropout_ratio);
+            size_t num_heads, float attn_prob_dropout_ratio,
+            size_t num_kv_heads = 0, bool int8 = false);
 
   virtual ~SDPALayer() {}
 
@@ -37,10 +59,48 @@ class SDPALayer : public Layer {
 
   void before_forward(int batch_size, int query_len, int kv_len, int kv_size,
                       bool mask_future);
+
+  // Read int8 key and value, see FlashAttentionOp::set_kv_cache_scales.
+  // Only supported by the fused inference path.
+  void set_kv_cache_scales(const float* k_scale, const float* v_scale);
+
+  // Add a relative position bias to the scores, see
+  // FlashAttentionOp::set_pos_bias. Only supported by the fused inference
+  // path.
+  void set_pos_bias(const T1* pos_bias, int max_len);
+
+  // Output [batch_size, query_len, nhead, head_dim], ie. the tokens by the
+  // hidden size, rather than [batch_size, nhead, query_len, head_dim]. Only
+  // supported by the fused inference path, returns false otherwise, when
+  // the caller still transposes the output.
+  bool set_token_major_output();
+
+  // Read key and value through the rows of kv_rows, see
+  // FlashAttentionOp::set_kv_rows. Only supported by the fused inference
+  // path, returns false otherwise.
+  bool set_kv_rows(const int* kv_rows);
+
+  // Mask the attention among the last tree_len positions, see
+  // FlashAttentionOp::set_tree_mask. Only supported by the fused inference
+  // path, returns false otherwise.
+  bool set_tree_mask(const unsigned char* tree_mask, int tree_len);
+
+  // Read key and value from a kv ring with a sliding window, see
+  // FlashAttentionOp::set_kv_ring. Only supported by the fused inference
+  // path.
+  void set_kv_ring(int ring_size, int window, int mask_size);
+
+  // Keep heavy hitters in the sink rows of the kv ring by the attention mass
+  // of the softmax, see FlashAttentionOp::set_heavy_hitters. Only supported
+  // by the fused inference path.
+  void set_heavy_hitters(int* heavy_pos, float* kv_mass);
 };
 
-template class SDPALayer<__half, __half>;
 template class SDPALayer<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class SDPALayer<__half, __half>;
+template class SDPALayer<__nv_bfloat16, __nv_bfloat16>;
+#endif
 
 template <class T1, class T2>
 using SDPALayerPtr = std::shared_ptr<SDPALayer<T1, T2>>;
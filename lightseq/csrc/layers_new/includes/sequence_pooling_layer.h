@@ -0,0 +1,41 @@
+#pragma once
+#include "sequence_pooling.h"
+#include "layer.h"
+
+namespace lightseq {
+
+// The sentence embedding head of an encoder, see SequencePoolingOp.
+template <class T1, class T2>
+class SequencePoolingLayer : public Layer {
+ private:
+  // operators
+  SequencePoolingOp<T1, T2>* _pooling = nullptr;
+
+ public:
+  SequencePoolingLayer(int max_batch_size, int hidden_dim, int padding_id,
+                       PoolingMethod method, bool l2_norm, bool half_output)
+      : Layer("SequencePoolingLayer"),
+        _pooling(new SequencePoolingOp<T1, T2>(max_batch_size, hidden_dim,
+                                               padding_id, method, l2_norm,
+                                               half_output)) {
+    this->_context_ptr->exit_layer();  // necessary
+  }
+
+  virtual ~SequencePoolingLayer() {}
+
+  Variable* operator()(Variable* inp, Variable* tokens) {
+    set_inputs({inp, tokens});
+    Variable* out = (*_pooling)(inp, tokens);
+    set_outputs({out});
+    return out;
+  }
+
+  void before_forward(int batch_size, int seq_len) {
+    _pooling->before_forward(batch_size, seq_len);
+  }
+};
+
+template <class T1, class T2>
+using SequencePoolingLayerPtr = std::shared_ptr<SequencePoolingLayer<T1, T2>>;
+
+}  // namespace lightseq
@@ -0,0 +1,88 @@
+#pragma once
+#include "bias_add_transform_20314.h"
+#include "concat3_dim1.h"
+#include "linear.h"
+#include "rms_layer_norm.h"
+#include "sdpa_layer.h"
+#include "transform_0213.h"
+#include "layer.h"
+
+namespace lightseq {
+
+/*
+The self attention of T5, inference only: a pre rms norm without bias, no
+linear biases and a relative position bias added to the scores, see
+set_pos_bias. The scores are not scaled, T5Weight folds sqrt(head_dim) into
+the q kernel to cancel the scaling of SDPALayer.
+
+The encoder attends to the whole sequence with inp_mask. The decoder, with
+is_decoder, appends the key and value of the step to the cache of
+[batch_size * beam_size * heads, max_seq_len, head_dim] and attends to it.
+*/
+template <class T1, class T2>
+class T5AttentionLayer : public Layer {
+ private:
+  // operators
+  RMSLayerNormalizeOp<T1, T2>* _attn_ln = nullptr;
+  LinearOp<T1, T2>* _qkv_linear = nullptr;
+  BiasAddTrans20314<T1, T2>* _bias_add_transform_20314 = nullptr;
+  // decoder only.
+  Concat3Dim1<T1, T2>* _concat_cache_k = nullptr;
+  Concat3Dim1<T1, T2>* _concat_cache_v = nullptr;
+  SDPALayerPtr<T1, T2> _sdpa_layer;
+  Transform0213OP<T1, T2>* _transform_0213 = nullptr;
+  LinearOp<T1, T2>* _attn_out_linear = nullptr;
+
+  // parameters
+  Variable* _norm_scale;
+  Variable* _attn_qkvw;
+  // zeros, the transform of the qkv output adds a bias.
+  Variable* _attn_qkvb;
+  Variable* _attn_ow;
+
+  // tensor slice
+  Variable* q_out;
+  Variable* k_out;
+  Variable* v_out;
+
+  // shape related
+  size_t _layer_id;
+  size_t _max_batch_tokens;
+  size_t _max_seq_len;
+  size_t _hidden_size;
+  size_t _heads;
+  bool _is_decoder;
+
+ public:
+  T5AttentionLayer(int layer_id, int max_batch_tokens, int max_seq_len,
+                   int hidden_size, int num_heads, bool is_decoder);
+
+  virtual ~T5AttentionLayer() {}
+
+  // The encoder takes inp_mask, the decoder cache_k and cache_v.
+  Variable* operator()(Variable* inp, Variable* inp_mask,
+                       Variable* cache_k = nullptr,
+                       Variable* cache_v = nullptr);
+
+  // The decoder runs the step of seq_len = beam_size, each a query of its
+  // own cache.
+  void before_forward(int batch_size, int seq_len, int step = -1);
+
+  // [heads, 2 * max_len - 1] relative position bias shared by the layers,
+  // see FlashAttentionOp::set_pos_bias.
+  void set_pos_bias(const T1* pos_bias, int max_len) {
+    _sdpa_layer->set_pos_bias(pos_bias, max_len);
+  }
+
+  int load_params(const std::vector<const T1*>& para_vec, int offset);
+};
+
+template class T5AttentionLayer<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class T5AttentionLayer<__half, __half>;
+#endif
+
+template <class T1, class T2>
+using T5AttentionLayerPtr = std::shared_ptr<T5AttentionLayer<T1, T2>>;
+
+}  // namespace lightseq
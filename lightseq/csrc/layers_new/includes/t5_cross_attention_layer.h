@@ -0,0 +1,64 @@
+#pragma once
+#include "bias_add_transform_20314.h"
+#include "linear.h"
+#include "rms_layer_norm.h"
+#include "sdpa_layer.h"
+#include "transform_0213.h"
+#include "layer.h"
+
+namespace lightseq {
+
+/*
+The decoder-encoder attention of T5, inference only: a pre rms norm, no
+linear biases and, unlike the self attention, no position bias. The beams of
+a sentence are the queries of its encoder output, of enc_k and enc_v
+[batch_size, heads, src_seq_len, head_dim], see EncDecKvLayer.
+*/
+template <class T1, class T2>
+class T5CrossAttentionLayer : public Layer {
+ private:
+  // operators
+  RMSLayerNormalizeOp<T1, T2>* _attn_ln = nullptr;
+  LinearOp<T1, T2>* _q_linear = nullptr;
+  BiasAddTrans20314<T1, T2>* _bias_add_transform_20314_q = nullptr;
+  SDPALayerPtr<T1, T2> _sdpa_layer;
+  Transform0213OP<T1, T2>* _transform_0213 = nullptr;
+  LinearOp<T1, T2>* _attn_out_linear = nullptr;
+
+  // parameters
+  Variable* _norm_scale;
+  Variable* _attn_qw;
+  // zeros, the transform of the q output adds a bias.
+  Variable* _attn_qb;
+  Variable* _attn_ow;
+
+  // shape related
+  size_t _max_batch_tokens;
+  size_t _hidden_size;
+  size_t _heads;
+
+ public:
+  T5CrossAttentionLayer(int max_batch_tokens, int max_seq_len,
+                        int hidden_size, int num_heads);
+
+  virtual ~T5CrossAttentionLayer() {}
+
+  Variable* operator()(Variable* inp, Variable* enc_mask, Variable* enc_k,
+                       Variable* enc_v);
+
+  // trg_seq_len is the beam size in inference.
+  void before_forward(int batch_size, int trg_seq_len, int src_seq_len);
+
+  int load_params(const std::vector<const T1*>& para_vec, int offset);
+};
+
+template class T5CrossAttentionLayer<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class T5CrossAttentionLayer<__half, __half>;
+#endif
+
+template <class T1, class T2>
+using T5CrossAttentionLayerPtr =
+    std::shared_ptr<T5CrossAttentionLayer<T1, T2>>;
+
+}  // namespace lightseq
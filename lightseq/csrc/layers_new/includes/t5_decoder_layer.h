@@ -0,0 +1,59 @@
+#pragma once
+#include "layer.h"
+#include "t5_attention_layer.h"
+#include "t5_cross_attention_layer.h"
+#include "t5_ffn_layer.h"
+
+namespace lightseq {
+
+template <class T1, class T2>
+class T5DecoderLayer : public Layer {
+ private:
+  T5AttentionLayerPtr<T1, T2> _self_attn_layer;
+  T5CrossAttentionLayerPtr<T1, T2> _enc_attn_layer;
+  T5FeedForwardLayerPtr<T1, T2> _ffn_layer;
+
+  size_t _layer_id;
+  size_t _hidden_size;
+
+  Variable* enc_k;
+  Variable* enc_v;
+
+ public:
+  // max_batch_tokens is max_batch_size * beam_size, one token per beam.
+  T5DecoderLayer(int layer_id, int max_batch_tokens, int max_seq_len,
+                 int hidden_size, int num_heads, int inner_size,
+                 bool gated_gelu);
+
+  virtual ~T5DecoderLayer() {}
+
+  /*
+    Inputs:
+      total_enc_kv, the key and value of the encoder output of every decoder
+        layer, see EncDecKvLayer;
+      cache_self_k, cache_self_v, of this layer.
+  */
+  Variable* operator()(Variable* inp, Variable* total_enc_kv,
+                       Variable* enc_mask, Variable* cache_self_k,
+                       Variable* cache_self_v);
+
+  void before_forward(int batch_size, int beam_size, int src_seq_len,
+                      int step);
+
+  // the causal relative position bias, see T5AttentionLayer.
+  void set_pos_bias(const T1* pos_bias, int max_len) {
+    _self_attn_layer->set_pos_bias(pos_bias, max_len);
+  }
+
+  int load_params(const std::vector<const T1*>& para_vec, int offset);
+};
+
+template class T5DecoderLayer<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class T5DecoderLayer<__half, __half>;
+#endif
+
+template <class T1, class T2>
+using T5DecoderLayerPtr = std::shared_ptr<T5DecoderLayer<T1, T2>>;
+
+}  // namespace lightseq
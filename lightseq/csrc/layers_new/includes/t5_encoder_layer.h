@@ -0,0 +1,43 @@
+#pragma once
+#include "layer.h"
+#include "t5_attention_layer.h"
+#include "t5_ffn_layer.h"
+
+namespace lightseq {
+
+template <class T1, class T2>
+class T5EncoderLayer : public Layer {
+ private:
+  T5AttentionLayerPtr<T1, T2> _attn_layer;
+  T5FeedForwardLayerPtr<T1, T2> _ffn_layer;
+
+  int _layer_id;
+
+ public:
+  T5EncoderLayer(int layer_id, int max_batch_tokens, int max_seq_len,
+                 int hidden_size, int num_heads, int inner_size,
+                 bool gated_gelu);
+
+  virtual ~T5EncoderLayer() {}
+
+  Variable* operator()(Variable* inp, Variable* inp_mask);
+
+  void before_forward(int batch_size, int seq_len);
+
+  // the bidirectional relative position bias, see T5AttentionLayer.
+  void set_pos_bias(const T1* pos_bias, int max_len) {
+    _attn_layer->set_pos_bias(pos_bias, max_len);
+  }
+
+  int load_params(const std::vector<const T1*>& para_vec, int offset);
+};
+
+template class T5EncoderLayer<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class T5EncoderLayer<__half, __half>;
+#endif
+
+template <class T1, class T2>
+using T5EncoderLayerPtr = std::shared_ptr<T5EncoderLayer<T1, T2>>;
+
+}  // namespace lightseq
@@ -0,0 +1,62 @@
+#pragma once
+#include "act_elewise_product.h"
+#include "bias_act_dropout.h"
+#include "linear.h"
+#include "rms_layer_norm.h"
+#include "layer.h"
+
+namespace lightseq {
+
+/*
+The feed forward of T5, inference only: a pre rms norm, relu(x * first) *
+second without biases. With gated_gelu it is the mT5 one, gelu(x * first) *
+(x * second) * third, with the first and second kernels concatenated into
+one [hidden_size, 2 * inner_size] kernel, see T5Weight.
+*/
+template <class T1, class T2>
+class T5FeedForwardLayer : public Layer {
+ private:
+  // operators
+  RMSLayerNormalizeOp<T1, T2>* _ffn_ln = nullptr;
+  LinearOp<T1, T2>* _inter_linear = nullptr;
+  // relu only, fused into _inter_linear by GraphFusion.
+  BiasActDropoutOp<T1, T2>* _inter_act = nullptr;
+  // gated_gelu only.
+  ActElewiseProductOp<T1, T2>* _act_product = nullptr;
+  LinearOp<T1, T2>* _output_linear = nullptr;
+
+  // parameters
+  Variable* _norm_scale;
+  Variable* _inter_w;
+  // zeros, the relu takes a bias.
+  Variable* _inter_b;
+  Variable* _output_w;
+
+  // shape related
+  size_t _max_batch_tokens;
+  size_t _hidden_size;
+  size_t _inner_size;
+  bool _gated_gelu;
+
+ public:
+  T5FeedForwardLayer(int max_batch_tokens, int hidden_size, int inner_size,
+                     bool gated_gelu);
+
+  virtual ~T5FeedForwardLayer() {}
+
+  Variable* operator()(Variable* inp);
+
+  void before_forward(int batch_size, int seq_len);
+
+  int load_params(const std::vector<const T1*>& para_vec, int offset);
+};
+
+template class T5FeedForwardLayer<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class T5FeedForwardLayer<__half, __half>;
+#endif
+
+template <class T1, class T2>
+using T5FeedForwardLayerPtr = std::shared_ptr<T5FeedForwardLayer<T1, T2>>;
+
+}  // namespace lightseq
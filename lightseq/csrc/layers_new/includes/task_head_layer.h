@@ -0,0 +1,120 @@
+#pragma once
+#include "crf.h"
+#include "linear.h"
+#include "sequence_pooling.h"
+#include "layer.h"
+
+namespace lightseq {
+
+// The task heads of an encoder output [batch_size, seq_len, hidden_size], see
+// TaskHeadLayer.
+enum class TaskHeadType {
+  // the [batch_size, seq_len, num_labels] logits of every token
+  kTokenClassifier = 0,
+  // the [batch_size, num_labels] logits of the pooled sequence
+  kSequenceClassifier = 1,
+  // the int32 [batch_size, seq_len] best tags of a linear crf
+  kCrf = 2,
+  // the [batch_size, hidden_size] pooled sequence
+  kPooling = 3
+};
+
+// One task head on a shared encoder output, inference only. The classifiers
+// are a linear with bias, on the tokens or on their pooling, the crf the
+// linear of emissions and the viterbi decoding of CRFOP, as BertCrf.
+template <class T1, class T2>
+class TaskHeadLayer : public Layer {
+ private:
+  TaskHeadType _type;
+  int _seq_level;
+
+  // operators
+  SequencePoolingOp<T1, T2>* _pooling = nullptr;
+  LinearOp<T1, T2>* _linear = nullptr;
+  CRFOP<T1>* _crf = nullptr;
+
+  // parameters: the [num_labels, hidden_size] kernel and the bias of the
+  // classifiers, the crf adds its own bias and transitions.
+  Variable* _kernel = nullptr;
+  Variable* _bias = nullptr;
+  Variable* _start_transition = nullptr;
+  Variable* _end_transition = nullptr;
+  Variable* _transition = nullptr;
+
+ public:
+  TaskHeadLayer(TaskHeadType type, int max_batch_size, int max_seq_len,
+                int hidden_size, int num_labels, int padding_id,
+                PoolingMethod pooling)
+      : Layer("TaskHeadLayer"), _type(type) {
+    int max_batch_tokens = max_batch_size * max_seq_len;
+    _seq_level = type == TaskHeadType::kSequenceClassifier ||
+                 type == TaskHeadType::kPooling;
+    if (_seq_level) {
+      _pooling = new SequencePoolingOp<T1, T2>(
+          max_batch_size, hidden_size, padding_id, pooling, false, false);
+    }
+    if (type != TaskHeadType::kPooling) {
+      _linear = new LinearOp<T1, T2>(
+          _seq_level ? max_batch_size : max_batch_tokens, num_labels,
+          hidden_size, MATRIX_OP::Transpose, MATRIX_OP::NonTranspose);
+      _kernel = new Variable("task_head_kernel", g_dtype<T1>());
+      _bias = new Variable("task_head_bias", g_dtype<T1>());
+    }
+    if (type == TaskHeadType::kCrf) {
+      _crf = new CRFOP<T1>(max_batch_tokens, max_batch_size, num_labels);
+      _start_transition = new Variable("start_transition", g_dtype<T1>());
+      _end_transition = new Variable("end_transition", g_dtype<T1>());
+      _transition = new Variable("transition", g_dtype<T1>());
+    }
+
+    this->_context_ptr->exit_layer();  // necessary
+  }
+
+  virtual ~TaskHeadLayer() {}
+
+  Variable* operator()(Variable* inp, Variable* tokens, Variable* pad_mask) {
+    set_inputs({inp, tokens, pad_mask});
+    Variable* out = inp;
+    if (_pooling) out = (*_pooling)(out, tokens);
+    if (_crf) {
+      out = (*_linear)(out, _kernel);
+      out = (*_crf)(_start_transition, _end_transition, _transition, out,
+                    pad_mask, _bias);
+    } else if (_linear) {
+      out = (*_linear)(out, _kernel, _bias, "none");
+    }
+    set_outputs({out});
+    return out;
+  }
+
+  void before_forward(int batch_size, int seq_len) {
+    if (_pooling) _pooling->before_forward(batch_size, seq_len);
+    if (_linear) {
+      _linear->before_forward(_seq_level ? batch_size : batch_size * seq_len);
+    }
+    if (_crf) _crf->before_forward(batch_size, seq_len, false, false);
+  }
+
+  void before_backward() {}
+
+  // {kernel, bias} of the classifiers, {kernel, bias, start_transitions,
+  // end_transitions, transitions} of the crf, none of the pooling.
+  int load_params(const std::vector<const T1*>& para_vec, int offset) {
+    int size = 0;
+    for (Variable* para : {_kernel, _bias, _start_transition, _end_transition,
+                           _transition}) {
+      if (para) para->set_value((char*)para_vec[offset + size++]);
+    }
+    return size;
+  }
+};
+
+template class TaskHeadLayer<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class TaskHeadLayer<__half, __half>;
+#endif
+
+template <class T1, class T2>
+using TaskHeadLayerPtr = std::shared_ptr<TaskHeadLayer<T1, T2>>;
+
+}  // namespace lightseq
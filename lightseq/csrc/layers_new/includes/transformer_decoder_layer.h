@@ -37,7 +37,8 @@ class TransformerDecoderLayer : public Layer {
                           float activation_dropout_ratio, bool is_pre_ln,
                           std::string activation_fn,
                           bool is_continuous_cache = true,
-                          int max_batch_size = 1, int beam_size = 1);
+                          int max_batch_size = 1, int beam_size = 1,
+                          bool encdec_kv_int8 = false);
 
   virtual ~TransformerDecoderLayer();
 
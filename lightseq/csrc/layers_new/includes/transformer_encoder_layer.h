@@ -14,19 +14,32 @@ class TransformerEncoderLayer : public Layer {
   int _layer_id;
 
  public:
-  TransformerEncoderLayer(int layer_id, int max_batch_tokens, int max_seq_len,
-                          int hidden_size, int num_heads, int intermediate_size,
-                          float attn_prob_dropout_ratio,
-                          float activation_dropout_ratio,
-                          float hidden_output_dropout_ratio, bool is_pre_ln,
-                          std::string activation_fn, bool mask_future_tokens);
+  TransformerEncoderLayer(
+      int layer_id, int max_batch_tokens, int max_seq_len, int hidden_size,
+      int num_heads, int intermediate_size, float attn_prob_dropout_ratio,
+      float activation_dropout_ratio, float hidden_output_dropout_ratio,
+      bool is_pre_ln, std::string activation_fn, bool mask_future_tokens,
+      bool varlen = false, bool int8 = false,
+      const BlockSparseConfig& sparse = BlockSparseConfig(),
+      bool sparse24 = false);
   virtual ~TransformerEncoderLayer() {}
 
+  // See MultiheadAttentionLayer for varlen, int8 and sparse, and
+  // FeedForwardLayer for sparse24.
   Variable* operator()(Variable* inp, Variable* inp_mask);
 
-  void before_forward(int batch_size, int seq_len) {
-    _attn_layer->before_forward(batch_size, seq_len);
-    _ffn_layer->before_forward(batch_size, seq_len);
+  // valid_tokens is the number of packed tokens of a varlen layer.
+  void before_forward(int batch_size, int seq_len, int valid_tokens = 0) {
+    _attn_layer->before_forward(batch_size, seq_len, valid_tokens);
+    if (valid_tokens > 0) {
+      _ffn_layer->before_forward(1, valid_tokens);
+    } else {
+      _ffn_layer->before_forward(batch_size, seq_len);
+    }
+  }
+
+  void set_cu_seqlens(const int* cu_seqlens) {
+    _attn_layer->set_cu_seqlens(cu_seqlens);
   }
 
   void before_backward() { return; }
@@ -0,0 +1,101 @@
+#pragma once
+#include "remove_padding.h"
+#include "layer.h"
+
+namespace lightseq {
+
+/*
+  Pack the non-padding tokens of the padded encoder input for the varlen
+  encoder layers, see RemovePaddingOp. set_offsets packs a batch and must
+  run before before_forward of every layer after this one.
+*/
+template <class T1, class T2>
+class RemovePaddingLayer : public Layer {
+ private:
+  // operators
+  RemovePaddingOp<T1, T2>* _remove_padding = nullptr;
+
+ public:
+  RemovePaddingLayer(int max_batch_tokens, int hidden_dim, int padding_id)
+      : Layer("RemovePaddingLayer"),
+        _remove_padding(new RemovePaddingOp<T1, T2>(
+            max_batch_tokens, hidden_dim, padding_id)) {
+    this->_context_ptr->exit_layer();  // necessary
+  }
+
+  virtual ~RemovePaddingLayer() {}
+
+  Variable* operator()(Variable* inp) {
+    set_inputs({inp});
+    Variable* out = (*_remove_padding)(inp);
+    set_outputs({out});
+    return out;
+  }
+
+  // Returns the number of packed tokens.
+  int set_offsets(const int* tokens, int batch_size, int seq_len) {
+    return _remove_padding->set_offsets(tokens, batch_size, seq_len);
+  }
+
+  // See RemovePaddingOp::set_packed_offsets.
+  void set_packed_offsets(const int* offsets, int batch_size, int seq_len) {
+    _remove_padding->set_packed_offsets(offsets, batch_size, seq_len);
+  }
+
+  const int* cu_seqlens() const { return _remove_padding->cu_seqlens(); }
+  const int* packed_to_padded() const {
+    return _remove_padding->packed_to_padded();
+  }
+
+  void before_forward(int valid_tokens) {
+    _remove_padding->before_forward(valid_tokens);
+  }
+};
+
+// The padded encoder output of the varlen encoder layers, see
+// RebuildPaddingOp.
+template <class T1, class T2>
+class RebuildPaddingLayer : public Layer {
+ private:
+  // operators
+  RebuildPaddingOp<T1, T2>* _rebuild_padding = nullptr;
+
+ public:
+  RebuildPaddingLayer(int max_batch_tokens, int hidden_dim)
+      : Layer("RebuildPaddingLayer"),
+        _rebuild_padding(
+            new RebuildPaddingOp<T1, T2>(max_batch_tokens, hidden_dim)) {
+    this->_context_ptr->exit_layer();  // necessary
+  }
+
+  virtual ~RebuildPaddingLayer() {}
+
+  Variable* operator()(Variable* inp) {
+    set_inputs({inp});
+    Variable* out = (*_rebuild_padding)(inp);
+    set_outputs({out});
+    return out;
+  }
+
+  void set_packed_to_padded(const int* packed_to_padded) {
+    _rebuild_padding->set_packed_to_padded(packed_to_padded);
+  }
+
+  void before_forward(int valid_tokens, int batch_size, int seq_len) {
+    _rebuild_padding->before_forward(valid_tokens, batch_size, seq_len);
+  }
+};
+
+template class RemovePaddingLayer<float, float>;
+template class RebuildPaddingLayer<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class RemovePaddingLayer<__half, __half>;
+template class RebuildPaddingLayer<__half, __half>;
+#endif
+
+template <class T1, class T2>
+using RemovePaddingLayerPtr = std::shared_ptr<RemovePaddingLayer<T1, T2>>;
+template <class T1, class T2>
+using RebuildPaddingLayerPtr = std::shared_ptr<RebuildPaddingLayer<T1, T2>>;
+
+}  // namespace lightseq
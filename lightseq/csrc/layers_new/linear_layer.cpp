@@ -5,16 +5,28 @@ namespace lightseq {
 template <typename T1, typename T2>
 LinearLayer<T1, T2>::LinearLayer(int max_batch_tokens, int input_size,
                                  int output_size, MATRIX_OP opA, MATRIX_OP opB,
-                                 float alpha)
+                                 float alpha, int quant_bits,
+                                 size_t max_dequant_cols)
     : Layer("LinearLayer"),
       _max_batch_tokens(max_batch_tokens),
       _input_size(input_size),
-      _output_size(output_size),
-      // operators
-      _linear(new LinearOp<T1, T2>(max_batch_tokens, output_size, input_size,
-                                   opA, opB, alpha)) {
+      _output_size(output_size) {
+  // operators
+  if (quant_bits) {
+    _quant_linear = new WeightOnlyLinearOp<T1, T2>(
+        max_batch_tokens, output_size, input_size, quant_bits, 0,
+        max_dequant_cols);
+  } else {
+    _linear = new LinearOp<T1, T2>(max_batch_tokens, output_size, input_size,
+                                   opA, opB, alpha);
+  }
   // parameters node
-  _linear_w = new Variable("_linear_w", g_dtype<T1>(), g_dtype<T2>());
+  if (quant_bits) {
+    _linear_w = new Variable("_linear_w", g_dtype<int8_t>());
+    _linear_scale = new Variable("_linear_scale", g_dtype<T1>());
+  } else {
+    _linear_w = new Variable("_linear_w", g_dtype<T1>(), g_dtype<T2>());
+  }
 
   this->_context_ptr->exit_layer();  // necessary
 }
@@ -22,7 +34,9 @@ LinearLayer<T1, T2>::LinearLayer(int max_batch_tokens, int input_size,
 template <typename T1, typename T2>
 Variable* LinearLayer<T1, T2>::operator()(Variable* inp) {
   set_inputs({inp});
-  Variable* linear_out = (*_linear)(inp, _linear_w);
+  Variable* linear_out = _quant_linear
+                             ? (*_quant_linear)(inp, _linear_w, _linear_scale)
+                             : (*_linear)(inp, _linear_w);
 
   set_outputs({linear_out});
   return linear_out;
@@ -32,6 +46,10 @@ template <typename T1, typename T2>
 void LinearLayer<T1, T2>::before_forward(int batch_size, int seq_len) {
   int batch_tokens = batch_size * seq_len;
 
+  if (_quant_linear) {
+    _quant_linear->before_forward(batch_tokens);
+    return;
+  }
   _linear->before_forward(batch_tokens);
 }
 
@@ -57,6 +75,10 @@ int LinearLayer<T1, T2>::load_params(const std::vector<const T1*>& para_vec,
   int size = 0;
   _linear_w->set_value((char*)para_vec[offset + size]), size++;
   _linear_w->set_shape({_input_size, _output_size});
+  if (_linear_scale) {
+    _linear_scale->set_value((char*)para_vec[offset + size]), size++;
+    _linear_scale->set_shape({_output_size});
+  }
 
   return size;
 }
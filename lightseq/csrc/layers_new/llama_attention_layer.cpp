@@ -6,32 +6,121 @@ template <typename T1, typename T2>
 LlamaAttentionLayer<T1, T2>::LlamaAttentionLayer(int max_batch_size,
                                                  int max_seq_len,
                                                  int hidden_size, int num_heads,
-                                                 int beam_size)
+                                                 int beam_size, int page_size,
+                                                 int num_kv_heads,
+                                                 int weight_quant_bits,
+                                                 int weight_quant_group_size,
+                                                 bool fp8, bool int8)
     : Layer("LlamaAttentionLayer"),
       _max_batch_size(max_batch_size),
       _max_batch_tokens(max_batch_size * max_seq_len),
       _max_seq_len(max_seq_len),
       _hidden_size(hidden_size),
-      _nhead(num_heads),
-      _head_dim(hidden_size / num_heads) {
+      _head_dim(hidden_size / num_heads),
+      _page_size(page_size),
+      _weight_quant_bits(weight_quant_bits),
+      _weight_quant_group_size(weight_quant_group_size),
+      _fp8(fp8),
+      _int8(int8) {
+  // with tensor parallelism every rank holds its share of the q and kv heads.
+  int tp_size = _context_ptr->tp_size();
+  if (num_kv_heads == 0) num_kv_heads = num_heads;
+  if (num_heads % tp_size != 0 || num_kv_heads % tp_size != 0) {
+    printf("Error! %d heads and %d kv heads can not be split into %d ranks\n",
+           num_heads, num_kv_heads, tp_size);
+    exit(-1);
+  }
+  _nhead = num_heads / tp_size;
+  _kv_head_num = num_kv_heads / tp_size;
+  bool training = _context_ptr->is_training();
+  if (training &&
+      (_fp8 || _int8 || _weight_quant_bits || page_size > 0 ||
+       tp_size > 1)) {
+    printf("Error! LlamaAttentionLayer only trains dense weights on one rank "
+           "without a paged cache\n");
+    exit(-1);
+  }
+
   // operators
   _attn_ln = new RMSLayerNormalizeOp<T1, T2>(_max_batch_tokens, hidden_size);
-  _qkv_linear =
-      new LinearOp<T1, T2>(_max_batch_tokens, 3 * hidden_size, hidden_size);
-  _fuse_rotary = new RotaryPositionQk<T1, T2>(max_batch_size, max_seq_len,
-                                              num_heads, _head_dim);
-
-  _sdpa = new SDPALayer<T1, T2>(_max_batch_tokens, max_seq_len, _head_dim,
-                                num_heads, 0.f);
-  _transform_0213 =
-      new Transform0213OP<T1, T2>(_max_batch_tokens * hidden_size);
-  _attn_out_linear =
-      new LinearOp<T1, T2>(_max_batch_tokens, hidden_size, hidden_size);
+  size_t qkv_size = (_nhead + 2 * _kv_head_num) * _head_dim;
+  if (_fp8) {
+    _qkv_fp8_linear =
+        new Fp8LinearOp<T1, T2>(_max_batch_tokens, qkv_size, hidden_size);
+  } else if (_int8) {
+    _qkv_int8_linear =
+        new Int8LinearOp<T1, T2>(_max_batch_tokens, qkv_size, hidden_size);
+  } else if (_weight_quant_bits) {
+    _qkv_quant_linear = new WeightOnlyLinearOp<T1, T2>(
+        _max_batch_tokens, qkv_size, hidden_size, weight_quant_bits,
+        weight_quant_group_size);
+  } else if (training) {
+    _qkv_linear =
+        new LinearOp<T1, T2>(_max_batch_tokens, qkv_size, hidden_size);
+  }
+  // the dense qkv linear is fused into the rotary op in inference.
+  _fuse_rotary = new RotaryPositionQk<T1, T2>(
+      max_batch_size, max_seq_len, _nhead, _head_dim, _kv_head_num,
+      (_fp8 || _int8 || _weight_quant_bits || training) ? 0 : hidden_size);
+
+  if (_page_size > 0) {
+    _paged_attn = new PagedAttentionOp<T1, T2>(_max_batch_tokens, max_seq_len,
+                                               _nhead, _head_dim, page_size,
+                                               _kv_head_num);
+  } else {
+    _sdpa = new SDPALayer<T1, T2>(_max_batch_tokens, max_seq_len, _head_dim,
+                                  _nhead, 0.f, _kv_head_num);
+  }
+  if (_sdpa == nullptr || !_sdpa->set_token_major_output()) {
+    _transform_0213 =
+        new Transform0213OP<T1, T2>(_max_batch_tokens * hidden_size);
+  }
+  if (_fp8) {
+    _attn_out_fp8_linear = new Fp8LinearOp<T1, T2>(
+        _max_batch_tokens, hidden_size, _nhead * _head_dim);
+  } else if (_int8) {
+    _attn_out_int8_linear = new Int8LinearOp<T1, T2>(
+        _max_batch_tokens, hidden_size, _nhead * _head_dim);
+  } else if (_weight_quant_bits) {
+    _attn_out_quant_linear = new WeightOnlyLinearOp<T1, T2>(
+        _max_batch_tokens, hidden_size, _nhead * _head_dim, weight_quant_bits,
+        weight_quant_group_size);
+  } else {
+    _attn_out_linear = new LinearOp<T1, T2>(_max_batch_tokens, hidden_size,
+                                            _nhead * _head_dim);
+  }
+  if (tp_size > 1) {
+    _all_reduce = new AllReduceOp<T1, T2>(_max_batch_tokens, hidden_size);
+    if (_attn_out_linear) _all_reduce->overlap_linear(_attn_out_linear);
+  }
   // _add_residual = new FuseAdd2Op<T1, T2>(_max_batch_tokens, hidden_size);
   // parameters init
   _norm_scale = new Variable("_norm_scale", g_dtype<T1>(), g_dtype<T2>());
-  _attn_qkvw = new Variable("_attn_qkvw", g_dtype<T1>(), g_dtype<T2>());
-  _attn_ow = new Variable("_attn_ow", g_dtype<T1>(), g_dtype<T2>());
+  if (_fp8) {
+    _attn_qkvw = new Variable("_attn_qkvw", g_dtype<int8_t>());
+    _attn_ow = new Variable("_attn_ow", g_dtype<int8_t>());
+    _attn_qkvw_scale = new Variable("_attn_qkvw_scale", g_dtype<float>());
+    _attn_ow_scale = new Variable("_attn_ow_scale", g_dtype<float>());
+    _attn_qkvw_input_scale =
+        new Variable("_attn_qkvw_input_scale", g_dtype<float>());
+    _attn_ow_input_scale =
+        new Variable("_attn_ow_input_scale", g_dtype<float>());
+  } else if (_int8) {
+    _attn_qkvw = new Variable("_attn_qkvw", g_dtype<int8_t>());
+    _attn_ow = new Variable("_attn_ow", g_dtype<int8_t>());
+    _attn_qkvw_scale = new Variable("_attn_qkvw_scale", g_dtype<float>());
+    _attn_ow_scale = new Variable("_attn_ow_scale", g_dtype<float>());
+  } else if (_weight_quant_bits) {
+    _attn_qkvw = new Variable("_attn_qkvw", g_dtype<int8_t>());
+    _attn_ow = new Variable("_attn_ow", g_dtype<int8_t>());
+    _attn_qkvw_scale =
+        new Variable("_attn_qkvw_scale", g_dtype<T1>(), g_dtype<T2>());
+    _attn_ow_scale =
+        new Variable("_attn_ow_scale", g_dtype<T1>(), g_dtype<T2>());
+  } else {
+    _attn_qkvw = new Variable("_attn_qkvw", g_dtype<T1>(), g_dtype<T2>());
+    _attn_ow = new Variable("_attn_ow", g_dtype<T1>(), g_dtype<T2>());
+  }
 
   this->_context_ptr->exit_layer();  // necessary
 }
@@ -44,18 +133,49 @@ Variable* LlamaAttentionLayer<T1, T2>::operator()(Variable* inp,
   set_inputs({inp, cache_k, cache_v, pad_mask});
 
   std::tuple<Variable*, Variable*> ln_out = (*_attn_ln)(inp, _norm_scale);
-  Variable* qkv_out = (*_qkv_linear)(std::get<0>(ln_out), _attn_qkvw);
-
-  Variable* q_out = (*_fuse_rotary)(qkv_out, cache_k, cache_v);
+  Variable* q_out;
+  Variable* k_out = cache_k;
+  Variable* v_out = cache_v;
+  if (_qkv_linear) {
+    Variable* qkv_out = (*_qkv_linear)(std::get<0>(ln_out), _attn_qkvw);
+    std::tie(q_out, k_out, v_out) = (*_fuse_rotary)(qkv_out);
+  } else if (_qkv_fp8_linear) {
+    Variable* qkv_out =
+        (*_qkv_fp8_linear)(std::get<0>(ln_out), _attn_qkvw, _attn_qkvw_scale,
+                           _attn_qkvw_input_scale);
+    q_out = (*_fuse_rotary)(qkv_out, cache_k, cache_v);
+  } else if (_qkv_int8_linear) {
+    Variable* qkv_out = (*_qkv_int8_linear)(std::get<0>(ln_out), _attn_qkvw,
+                                            _attn_qkvw_scale);
+    q_out = (*_fuse_rotary)(qkv_out, cache_k, cache_v);
+  } else if (_qkv_quant_linear) {
+    Variable* qkv_out = (*_qkv_quant_linear)(std::get<0>(ln_out), _attn_qkvw,
+                                             _attn_qkvw_scale);
+    q_out = (*_fuse_rotary)(qkv_out, cache_k, cache_v);
+  } else {
+    q_out = (*_fuse_rotary)(std::get<0>(ln_out), _attn_qkvw, cache_k, cache_v);
+  }
 
   // result of Scaled Dot Product Attention
-  Variable* sdpa_res = (*_sdpa)(q_out, cache_k, cache_v, pad_mask);
+  Variable* sdpa_res =
+      _paged_attn ? (*_paged_attn)(q_out, cache_k, cache_v, pad_mask)
+                  : (*_sdpa)(q_out, k_out, v_out, pad_mask);
 
   // [sz0, sz1, sz2, sz3] -> [sz0, sz2, sz1, sz3]
-  Variable* transform_0213_out = (*_transform_0213)(sdpa_res);
+  Variable* transform_0213_out =
+      _transform_0213 ? (*_transform_0213)(sdpa_res) : sdpa_res;
 
-  Variable* attn_linear =
-      (*_attn_out_linear)(transform_0213_out, _attn_ow, std::get<1>(ln_out));
+  Variable* attn_linear;
+  if (_all_reduce == nullptr) {
+    attn_linear = attn_out_linear(transform_0213_out, std::get<1>(ln_out));
+  } else {
+    // every rank projects its heads into a partial sum of the output, only
+    // rank 0 adds the residual to it.
+    Variable* partial_linear = attn_out_linear(
+        transform_0213_out,
+        _context_ptr->tp_rank() == 0 ? std::get<1>(ln_out) : nullptr);
+    attn_linear = (*_all_reduce)(partial_linear);
+  }
 
   // Variable* attn_out = (*_add_residual)(inp, attn_linear);
 
@@ -63,26 +183,77 @@ Variable* LlamaAttentionLayer<T1, T2>::operator()(Variable* inp,
   return attn_linear;
 }
 
+template <typename T1, typename T2>
+Variable* LlamaAttentionLayer<T1, T2>::attn_out_linear(Variable* inp,
+                                                       Variable* residual) {
+  if (_attn_out_fp8_linear) {
+    return residual ? (*_attn_out_fp8_linear)(inp, _attn_ow, _attn_ow_scale,
+                                              _attn_ow_input_scale, residual)
+                    : (*_attn_out_fp8_linear)(inp, _attn_ow, _attn_ow_scale,
+                                              _attn_ow_input_scale);
+  }
+  if (_attn_out_int8_linear) {
+    return residual ? (*_attn_out_int8_linear)(inp, _attn_ow, _attn_ow_scale,
+                                               nullptr, residual)
+                    : (*_attn_out_int8_linear)(inp, _attn_ow, _attn_ow_scale);
+  }
+  if (_attn_out_quant_linear) {
+    return residual ? (*_attn_out_quant_linear)(inp, _attn_ow, _attn_ow_scale,
+                                                residual)
+                    : (*_attn_out_quant_linear)(inp, _attn_ow, _attn_ow_scale);
+  }
+  return residual ? (*_attn_out_linear)(inp, _attn_ow, residual)
+                  : (*_attn_out_linear)(inp, _attn_ow);
+}
+
 template <typename T1, typename T2>
 void LlamaAttentionLayer<T1, T2>::before_forward(int batch_size, int query_len,
                                                  int prompt_len) {
   // all token number in this batch
   int batch_tokens = batch_size * query_len;
-  int attn_to_len = (prompt_len <= 0) ? query_len : prompt_len + 1;
+  int attn_to_len = (prompt_len <= 0) ? query_len : prompt_len + query_len;
 
   _attn_ln->before_forward(batch_size, query_len);
 
-  _qkv_linear->before_forward(batch_tokens);
+  if (_qkv_linear) {
+    _qkv_linear->before_forward(batch_tokens);
+  } else if (_qkv_fp8_linear) {
+    _qkv_fp8_linear->before_forward(batch_tokens);
+  } else if (_qkv_int8_linear) {
+    _qkv_int8_linear->before_forward(batch_tokens);
+  } else if (_qkv_quant_linear) {
+    _qkv_quant_linear->before_forward(batch_tokens);
+  }
 
   _fuse_rotary->before_forward(batch_size, prompt_len, query_len);
 
-  // mask future when training or (inference and prompt_len=0)
-  _sdpa->before_forward(batch_size, query_len, attn_to_len, _max_seq_len,
-                        prompt_len <= 0);
+  if (_paged_attn) {
+    _paged_attn->before_forward(batch_size, query_len, std::max(prompt_len, 0));
+  } else {
+    // mask future when training or (inference and prompt_len=0), or when
+    // several tokens are appended to the cache at once, e.g. to verify the
+    // draft tokens of speculative decoding. k, v of training are not cached.
+    int kv_size = _cache_len ? _cache_len : _max_seq_len;
+    _sdpa->before_forward(batch_size, query_len, attn_to_len,
+                          _qkv_linear ? query_len : kv_size,
+                          prompt_len <= 0 || query_len > 1);
+  }
+
+  if (_transform_0213) {
+    _transform_0213->before_forward(batch_size, _nhead, query_len, _head_dim);
+  }
 
-  _transform_0213->before_forward(batch_size, _nhead, query_len, _head_dim);
+  if (_attn_out_fp8_linear) {
+    _attn_out_fp8_linear->before_forward(batch_tokens);
+  } else if (_attn_out_int8_linear) {
+    _attn_out_int8_linear->before_forward(batch_tokens);
+  } else if (_attn_out_quant_linear) {
+    _attn_out_quant_linear->before_forward(batch_tokens);
+  } else {
+    _attn_out_linear->before_forward(batch_tokens);
+  }
 
-  _attn_out_linear->before_forward(batch_tokens);
+  if (_all_reduce) _all_reduce->before_forward(batch_tokens, _hidden_size);
 
   // _add_residual->before_forward(batch_size, query_len);
 }
@@ -90,6 +261,32 @@ void LlamaAttentionLayer<T1, T2>::before_forward(int batch_size, int query_len,
 template <typename T1, typename T2>
 void LlamaAttentionLayer<T1, T2>::before_backward() {}
 
+template <typename T1, typename T2>
+size_t LlamaAttentionLayer<T1, T2>::load_para_and_grad(
+    const T1* para_ptr, T2* grad_ptr) {  // for training
+  size_t offset = 0;
+  size_t qkv_size = size_t(_nhead + 2 * _kv_head_num) * _head_dim;
+  size_t attn_size = size_t(_nhead) * _head_dim;
+
+  _norm_scale->set_value((char*)(para_ptr + offset));
+  _norm_scale->set_grad((char*)(grad_ptr + offset));
+  _norm_scale->set_shape({_hidden_size});
+  offset += _hidden_size;
+
+  // [out, in] as torch.nn.Linear.
+  _attn_qkvw->set_value((char*)(para_ptr + offset));
+  _attn_qkvw->set_grad((char*)(grad_ptr + offset));
+  _attn_qkvw->set_shape({qkv_size, _hidden_size});
+  offset += qkv_size * _hidden_size;
+
+  _attn_ow->set_value((char*)(para_ptr + offset));
+  _attn_ow->set_grad((char*)(grad_ptr + offset));
+  _attn_ow->set_shape({_hidden_size, attn_size});
+  offset += _hidden_size * attn_size;
+
+  return offset;
+}
+
 template <typename T1, typename T2>
 int LlamaAttentionLayer<T1, T2>::load_params(
     const std::vector<const T1*>& para_vec, int offset) {  // for inference
@@ -97,11 +294,52 @@ int LlamaAttentionLayer<T1, T2>::load_params(
   _norm_scale->set_value((char*)para_vec[offset + size]), size++;
   _norm_scale->set_shape({_hidden_size});
 
+  size_t qkv_size = size_t(_nhead + 2 * _kv_head_num) * _head_dim;
+  size_t attn_size = size_t(_nhead) * _head_dim;
+  if (_fp8) {
+    // the fp8 weights are [out, in], each with its weight and input scale.
+    _attn_qkvw->set_value((char*)para_vec[offset + size]), size++;
+    _attn_qkvw->set_shape({qkv_size, _hidden_size});
+    _attn_qkvw_scale->set_value((char*)para_vec[offset + size]), size++;
+    _attn_qkvw_scale->set_shape({1});
+    _attn_qkvw_input_scale->set_value((char*)para_vec[offset + size]), size++;
+    _attn_qkvw_input_scale->set_shape({1});
+
+    _attn_ow->set_value((char*)para_vec[offset + size]), size++;
+    _attn_ow->set_shape({_hidden_size, attn_size});
+    _attn_ow_scale->set_value((char*)para_vec[offset + size]), size++;
+    _attn_ow_scale->set_shape({1});
+    _attn_ow_input_scale->set_value((char*)para_vec[offset + size]), size++;
+    _attn_ow_input_scale->set_shape({1});
+    return size;
+  }
+  if (_int8) {
+    // the int8 weights are [out, in], with one scale per output channel.
+    _attn_qkvw->set_value((char*)para_vec[offset + size]), size++;
+    _attn_qkvw->set_shape({qkv_size, _hidden_size});
+    _attn_qkvw_scale->set_value((char*)para_vec[offset + size]), size++;
+    _attn_qkvw_scale->set_shape({qkv_size});
+
+    _attn_ow->set_value((char*)para_vec[offset + size]), size++;
+    _attn_ow->set_shape({_hidden_size, attn_size});
+    _attn_ow_scale->set_value((char*)para_vec[offset + size]), size++;
+    _attn_ow_scale->set_shape({_hidden_size});
+    return size;
+  }
+
   _attn_qkvw->set_value((char*)para_vec[offset + size]), size++;
-  _attn_qkvw->set_shape({_hidden_size, 3 * _hidden_size});
+  _attn_qkvw->set_shape({weight_rows(_hidden_size), qkv_size});
+  if (_weight_quant_bits) {
+    _attn_qkvw_scale->set_value((char*)para_vec[offset + size]), size++;
+    _attn_qkvw_scale->set_shape({scale_rows(_hidden_size), qkv_size});
+  }
 
   _attn_ow->set_value((char*)para_vec[offset + size]), size++;
-  _attn_ow->set_shape({_hidden_size, _hidden_size});
+  _attn_ow->set_shape({weight_rows(attn_size), _hidden_size});
+  if (_weight_quant_bits) {
+    _attn_ow_scale->set_value((char*)para_vec[offset + size]), size++;
+    _attn_ow_scale->set_shape({scale_rows(attn_size), _hidden_size});
+  }
 
   return size;
 }
@@ -5,12 +5,33 @@ namespace lightseq {
 template <typename T1, typename T2>
 LlamaLayer<T1, T2>::LlamaLayer(int max_batch_size, int max_seq_len,
                                int hidden_size, int inner_dim, int num_heads,
-                               int beam_size)
+                               int beam_size, int page_size, int num_kv_heads,
+                               int weight_quant_bits,
+                               int weight_quant_group_size, bool fp8,
+                               bool int8, int expert_num, int moe_topk,
+                               float moe_capacity_factor, bool sparse24)
     : Layer("LlamaLayer") {
   _attn_layer.reset(new LlamaAttentionLayer<T1, T2>(
-      max_batch_size, max_seq_len, hidden_size, num_heads, beam_size));
-  _mlp_layer.reset(new LlamaMLPLayer<T1, T2>(max_batch_size * max_seq_len,
-                                             hidden_size, inner_dim));
+      max_batch_size, max_seq_len, hidden_size, num_heads, beam_size,
+      page_size, num_kv_heads, weight_quant_bits, weight_quant_group_size,
+      fp8, int8));
+  if (expert_num > 0) {
+    if (weight_quant_bits || fp8 || int8) {
+      printf("Error! The experts of LlamaLayer only support dense weights\n");
+      exit(-1);
+    }
+    if (sparse24) {
+      printf("The experts of LlamaLayer do not support 2:4 sparse linears, "
+             "dense ones are used\n");
+    }
+    _moe_layer.reset(new MoEFeedForwardLayer<T1, T2>(
+        max_batch_size * max_seq_len, hidden_size, inner_dim, expert_num,
+        moe_topk, "silu", true, moe_capacity_factor));
+  } else {
+    _mlp_layer.reset(new LlamaMLPLayer<T1, T2>(
+        max_batch_size * max_seq_len, hidden_size, inner_dim,
+        weight_quant_bits, weight_quant_group_size, fp8, int8, sparse24));
+  }
 
   this->_context_ptr->exit_layer();  // necessary
 }
@@ -23,12 +44,31 @@ Variable* LlamaLayer<T1, T2>::operator()(Variable* inp, Variable* cache_k,
 
   Variable* attn_out = (*_attn_layer)(inp, cache_k, cache_v, pad_mask);
 
-  Variable* ffn_out = (*_mlp_layer)(attn_out);
+  Variable* ffn_out =
+      _moe_layer ? (*_moe_layer)(attn_out) : (*_mlp_layer)(attn_out);
 
   set_outputs({ffn_out});
   return ffn_out;
 }
 
+template <typename T1, typename T2>
+size_t LlamaLayer<T1, T2>::load_para_and_grad(const T1* para_ptr,
+                                              T2* grad_ptr) {  // for training
+  size_t offset = 0;
+
+  offset +=
+      _attn_layer->load_para_and_grad(para_ptr + offset, grad_ptr + offset);
+
+  if (_moe_layer) {
+    printf("Error! The experts of LlamaLayer can not be trained\n");
+    exit(-1);
+  }
+  offset +=
+      _mlp_layer->load_para_and_grad(para_ptr + offset, grad_ptr + offset);
+
+  return offset;
+}
+
 template <typename T1, typename T2>
 int LlamaLayer<T1, T2>::load_params(const std::vector<const T1*>& para_vec,
                                     int offset) {  // for inference
@@ -36,7 +76,11 @@ int LlamaLayer<T1, T2>::load_params(const std::vector<const T1*>& para_vec,
 
   size += _attn_layer->load_params(para_vec, offset + size);
 
-  size += _mlp_layer->load_params(para_vec, offset + size);
+  if (_moe_layer) {
+    size += _moe_layer->load_params(para_vec, offset + size);
+  } else {
+    size += _mlp_layer->load_params(para_vec, offset + size);
+  }
 
   return size;
 }
@@ -4,25 +4,138 @@ namespace lightseq {
 
 template <typename T1, typename T2>
 LlamaMLPLayer<T1, T2>::LlamaMLPLayer(int max_batch_tokens, int hidden_dim,
-                                     int inner_dim)
+                                     int inner_dim, int weight_quant_bits,
+                                     int weight_quant_group_size, bool fp8,
+                                     bool int8, bool sparse24)
     : Layer("LlamaMLPLayer"),
       _max_batch_tokens(max_batch_tokens),
       _hidden_dim(hidden_dim),
-      _inner_dim(inner_dim),
-      _mlp_ln(new RMSLayerNormalizeOp<T1, T2>(max_batch_tokens, hidden_dim)),
-      _gate_up_linear(
-          new LinearOp<T1, T2>(max_batch_tokens, 2 * inner_dim, hidden_dim)),
-      _act_product(
-          new ActElewiseProductOp<T1, T2>(max_batch_tokens, inner_dim)),
-      _down_linear(
-          new LinearOp<T1, T2>(max_batch_tokens, hidden_dim, inner_dim))
-// _add_residual(new FuseAdd2Op<T1, T2>(max_batch_tokens, hidden_dim))
-{
+      _weight_quant_bits(weight_quant_bits),
+      _weight_quant_group_size(weight_quant_group_size),
+      _fp8(fp8),
+      _int8(int8),
+      _sparse24(sparse24) {
+  // with tensor parallelism every rank holds a slice of the inner dim.
+  int tp_size = _context_ptr->tp_size();
+  if (inner_dim % tp_size != 0) {
+    printf("Error! inner dim %d can not be split into %d ranks\n", inner_dim,
+           tp_size);
+    exit(-1);
+  }
+  _inner_dim = inner_dim / tp_size;
+  bool training = _context_ptr->is_training();
+  if (training && (_fp8 || _int8 || _weight_quant_bits || tp_size > 1)) {
+    printf("Error! LlamaMLPLayer only trains dense weights on one rank\n");
+    exit(-1);
+  }
+  if (_sparse24 && training) {
+    printf("Error! 2:4 sparse LlamaMLPLayer is inference only\n");
+    exit(-1);
+  }
+  if (_sparse24 && (_fp8 || _int8 || _weight_quant_bits)) {
+    printf("2:4 sparse linears do not support fp8, int8 or weight "
+           "quantization, which are used\n");
+    _sparse24 = false;
+  }
+  if (_sparse24 && !Sparse24LinearOp<T1, T2>::supported()) {
+    printf("LlamaMLPLayer does not support 2:4 sparse linears without "
+           "cuSPARSELt, sm 80 and fp16 or bf16, dense ones are used\n");
+    _sparse24 = false;
+  }
+
+  _mlp_ln = new RMSLayerNormalizeOp<T1, T2>(max_batch_tokens, hidden_dim);
+  if (_fp8) {
+    // the gate_up output is [gate, up] as for SwiGLULinearOp.
+    _gate_up_fp8_linear = new Fp8LinearOp<T1, T2>(
+        max_batch_tokens, 2 * _inner_dim, hidden_dim);
+    _act_product =
+        new ActElewiseProductOp<T1, T2>(max_batch_tokens, _inner_dim);
+    _down_fp8_linear =
+        new Fp8LinearOp<T1, T2>(max_batch_tokens, hidden_dim, _inner_dim);
+  } else if (_int8) {
+    _gate_up_int8_linear = new Int8LinearOp<T1, T2>(
+        max_batch_tokens, 2 * _inner_dim, hidden_dim);
+    _act_product =
+        new ActElewiseProductOp<T1, T2>(max_batch_tokens, _inner_dim);
+    _down_int8_linear =
+        new Int8LinearOp<T1, T2>(max_batch_tokens, hidden_dim, _inner_dim);
+  } else if (_sparse24) {
+    // [gate, up] as for SwiGLULinearOp.
+    _gate_up_sparse24_linear = new Sparse24LinearOp<T1, T2>(
+        max_batch_tokens, 2 * _inner_dim, hidden_dim);
+    _act_product =
+        new ActElewiseProductOp<T1, T2>(max_batch_tokens, _inner_dim);
+    _down_sparse24_linear =
+        new Sparse24LinearOp<T1, T2>(max_batch_tokens, hidden_dim, _inner_dim);
+  } else if (training) {
+    // [gate, up] as for SwiGLULinearOp.
+    _gate_up_linear =
+        new LinearOp<T1, T2>(max_batch_tokens, 2 * _inner_dim, hidden_dim);
+    _act_product =
+        new ActElewiseProductOp<T1, T2>(max_batch_tokens, _inner_dim);
+    _down_linear =
+        new LinearOp<T1, T2>(max_batch_tokens, hidden_dim, _inner_dim);
+  } else {
+    _gate_up_swiglu = new SwiGLULinearOp<T1, T2>(
+        max_batch_tokens, _inner_dim, hidden_dim, weight_quant_bits,
+        weight_quant_group_size);
+    if (_weight_quant_bits) {
+      _down_quant_linear = new WeightOnlyLinearOp<T1, T2>(
+          max_batch_tokens, hidden_dim, _inner_dim, weight_quant_bits,
+          weight_quant_group_size);
+    } else {
+      _down_linear =
+          new LinearOp<T1, T2>(max_batch_tokens, hidden_dim, _inner_dim);
+    }
+  }
+  // _add_residual = new FuseAdd2Op<T1, T2>(max_batch_tokens, hidden_dim);
+  if (tp_size > 1) {
+    _all_reduce = new AllReduceOp<T1, T2>(max_batch_tokens, hidden_dim);
+    if (_down_linear) _all_reduce->overlap_linear(_down_linear);
+  }
+
   _norm_scale = new Variable("_norm_scale", g_dtype<T1>(), g_dtype<T2>());
-  _gate_up_linear_weight =
-      new Variable("_gate_up_linear_weight", g_dtype<T1>(), g_dtype<T2>());
-  _down_linear_weight =
-      new Variable("_down_linear_weight", g_dtype<T1>(), g_dtype<T2>());
+  if (_fp8) {
+    _gate_up_linear_weight =
+        new Variable("_gate_up_linear_weight", g_dtype<int8_t>());
+    _down_linear_weight =
+        new Variable("_down_linear_weight", g_dtype<int8_t>());
+    _gate_up_linear_scale =
+        new Variable("_gate_up_linear_scale", g_dtype<float>());
+    _down_linear_scale = new Variable("_down_linear_scale", g_dtype<float>());
+    _gate_up_linear_input_scale =
+        new Variable("_gate_up_linear_input_scale", g_dtype<float>());
+    _down_linear_input_scale =
+        new Variable("_down_linear_input_scale", g_dtype<float>());
+  } else if (_int8) {
+    _gate_up_linear_weight =
+        new Variable("_gate_up_linear_weight", g_dtype<int8_t>());
+    _down_linear_weight =
+        new Variable("_down_linear_weight", g_dtype<int8_t>());
+    _gate_up_linear_scale =
+        new Variable("_gate_up_linear_scale", g_dtype<float>());
+    _down_linear_scale = new Variable("_down_linear_scale", g_dtype<float>());
+  } else if (_sparse24) {
+    // the compressed weights, see Sparse24LinearOp::load_weight.
+    _gate_up_linear_weight =
+        new Variable("_gate_up_linear_weight", g_dtype<int8_t>());
+    _down_linear_weight =
+        new Variable("_down_linear_weight", g_dtype<int8_t>());
+  } else if (_weight_quant_bits) {
+    _gate_up_linear_weight =
+        new Variable("_gate_up_linear_weight", g_dtype<int8_t>());
+    _down_linear_weight =
+        new Variable("_down_linear_weight", g_dtype<int8_t>());
+    _gate_up_linear_scale =
+        new Variable("_gate_up_linear_scale", g_dtype<T1>(), g_dtype<T2>());
+    _down_linear_scale =
+        new Variable("_down_linear_scale", g_dtype<T1>(), g_dtype<T2>());
+  } else {
+    _gate_up_linear_weight =
+        new Variable("_gate_up_linear_weight", g_dtype<T1>(), g_dtype<T2>());
+    _down_linear_weight =
+        new Variable("_down_linear_weight", g_dtype<T1>(), g_dtype<T2>());
+  }
   this->_context_ptr->exit_layer();  // necessary
 }
 
@@ -30,25 +143,136 @@ template <typename T1, typename T2>
 Variable* LlamaMLPLayer<T1, T2>::operator()(Variable* inp) {
   set_inputs({inp});
   std::tuple<Variable*, Variable*> ln_out = (*_mlp_ln)(inp, _norm_scale);
-  Variable* gate_up_out =
-      (*_gate_up_linear)(std::get<0>(ln_out), _gate_up_linear_weight);
-  Variable* act_out = (*_act_product)(gate_up_out);
-  Variable* down_out =
-      (*_down_linear)(act_out, _down_linear_weight, std::get<1>(ln_out));
+  Variable* act_out;
+  if (_fp8) {
+    Variable* gate_up_out = (*_gate_up_fp8_linear)(
+        std::get<0>(ln_out), _gate_up_linear_weight, _gate_up_linear_scale,
+        _gate_up_linear_input_scale);
+    act_out = (*_act_product)(gate_up_out);
+  } else if (_int8) {
+    Variable* gate_up_out =
+        (*_gate_up_int8_linear)(std::get<0>(ln_out), _gate_up_linear_weight,
+                                _gate_up_linear_scale);
+    act_out = (*_act_product)(gate_up_out);
+  } else if (_sparse24) {
+    Variable* gate_up_out = (*_gate_up_sparse24_linear)(
+        std::get<0>(ln_out), _gate_up_linear_weight);
+    act_out = (*_act_product)(gate_up_out);
+  } else if (_gate_up_linear) {
+    Variable* gate_up_out =
+        (*_gate_up_linear)(std::get<0>(ln_out), _gate_up_linear_weight);
+    act_out = (*_act_product)(gate_up_out);
+  } else if (_weight_quant_bits) {
+    act_out = (*_gate_up_swiglu)(std::get<0>(ln_out), _gate_up_linear_weight,
+                                 _gate_up_linear_scale);
+  } else {
+    act_out = (*_gate_up_swiglu)(std::get<0>(ln_out), _gate_up_linear_weight);
+  }
+  Variable* down_out;
+  if (_all_reduce == nullptr) {
+    down_out = down_linear(act_out, std::get<1>(ln_out));
+  } else {
+    // partial sums of every rank, the residual is added by rank 0 only.
+    Variable* partial_out =
+        down_linear(act_out, _context_ptr->tp_rank() == 0
+                                 ? std::get<1>(ln_out)
+                                 : nullptr);
+    down_out = (*_all_reduce)(partial_out);
+  }
   // Variable* mlp_out = (*_add_residual)(down_out, inp);
   set_outputs({down_out});
   return down_out;
 }
 
+template <typename T1, typename T2>
+Variable* LlamaMLPLayer<T1, T2>::down_linear(Variable* inp,
+                                             Variable* residual) {
+  if (_down_fp8_linear) {
+    return residual ? (*_down_fp8_linear)(inp, _down_linear_weight,
+                                          _down_linear_scale,
+                                          _down_linear_input_scale, residual)
+                    : (*_down_fp8_linear)(inp, _down_linear_weight,
+                                          _down_linear_scale,
+                                          _down_linear_input_scale);
+  }
+  if (_down_int8_linear) {
+    return residual ? (*_down_int8_linear)(inp, _down_linear_weight,
+                                           _down_linear_scale, nullptr,
+                                           residual)
+                    : (*_down_int8_linear)(inp, _down_linear_weight,
+                                           _down_linear_scale);
+  }
+  if (_down_sparse24_linear) {
+    return residual
+               ? (*_down_sparse24_linear)(inp, _down_linear_weight, residual)
+               : (*_down_sparse24_linear)(inp, _down_linear_weight);
+  }
+  if (_down_quant_linear) {
+    return residual ? (*_down_quant_linear)(inp, _down_linear_weight,
+                                            _down_linear_scale, residual)
+                    : (*_down_quant_linear)(inp, _down_linear_weight,
+                                            _down_linear_scale);
+  }
+  return residual ? (*_down_linear)(inp, _down_linear_weight, residual)
+                  : (*_down_linear)(inp, _down_linear_weight);
+}
+
 template <typename T1, typename T2>
 void LlamaMLPLayer<T1, T2>::before_forward(int batch_size, int seq_len) {
   _mlp_ln->before_forward(batch_size, seq_len);
-  _gate_up_linear->before_forward(batch_size * seq_len);
-  _act_product->before_forward(batch_size, seq_len);
-  _down_linear->before_forward(batch_size * seq_len);
+  if (_fp8) {
+    _gate_up_fp8_linear->before_forward(batch_size * seq_len);
+    _act_product->before_forward(batch_size, seq_len);
+    _down_fp8_linear->before_forward(batch_size * seq_len);
+  } else if (_int8) {
+    _gate_up_int8_linear->before_forward(batch_size * seq_len);
+    _act_product->before_forward(batch_size, seq_len);
+    _down_int8_linear->before_forward(batch_size * seq_len);
+  } else if (_sparse24) {
+    _gate_up_sparse24_linear->before_forward(batch_size * seq_len);
+    _act_product->before_forward(batch_size, seq_len);
+    _down_sparse24_linear->before_forward(batch_size * seq_len);
+  } else if (_gate_up_linear) {
+    _gate_up_linear->before_forward(batch_size * seq_len);
+    _act_product->before_forward(batch_size, seq_len);
+    _down_linear->before_forward(batch_size * seq_len);
+  } else if (_down_quant_linear) {
+    _gate_up_swiglu->before_forward(batch_size * seq_len);
+    _down_quant_linear->before_forward(batch_size * seq_len);
+  } else {
+    _gate_up_swiglu->before_forward(batch_size * seq_len);
+    _down_linear->before_forward(batch_size * seq_len);
+  }
+  if (_all_reduce) {
+    _all_reduce->before_forward(batch_size * seq_len, _hidden_dim);
+  }
   // _add_residual->before_forward(batch_size, seq_len);
 }
 
+template <typename T1, typename T2>
+size_t LlamaMLPLayer<T1, T2>::load_para_and_grad(
+    const T1* para_ptr, T2* grad_ptr) {  // for training
+  size_t offset = 0;
+
+  _norm_scale->set_value((char*)(para_ptr + offset));
+  _norm_scale->set_grad((char*)(grad_ptr + offset));
+  _norm_scale->set_shape({_hidden_dim});
+  offset += _hidden_dim;
+
+  // [out, in] as torch.nn.Linear.
+  _gate_up_linear_weight->set_value((char*)(para_ptr + offset));
+  _gate_up_linear_weight->set_grad((char*)(grad_ptr + offset));
+  _gate_up_linear_weight->set_shape({2 * _inner_dim, _hidden_dim});
+  offset += 2 * _inner_dim * _hidden_dim;
+
+  _down_linear_weight->set_value((char*)(para_ptr + offset));
+  _down_linear_weight->set_grad((char*)(grad_ptr + offset));
+  _down_linear_weight->set_shape({_hidden_dim, _inner_dim});
+  offset += _hidden_dim * _inner_dim;
+
+  return offset;
+}
+
 template <typename T1, typename T2>
 int LlamaMLPLayer<T1, T2>::load_params(const std::vector<const T1*>& para_vec,
                                        int offset) {
@@ -57,11 +281,64 @@ int LlamaMLPLayer<T1, T2>::load_params(const std::vector<const T1*>& para_vec,
   _norm_scale->set_value((char*)para_vec[offset + size]), size++;
   _norm_scale->set_shape({_hidden_dim});
 
+  if (_fp8) {
+    // the fp8 weights are [out, in], each with its weight and input scale.
+    _gate_up_linear_weight->set_value((char*)para_vec[offset + size]), size++;
+    _gate_up_linear_weight->set_shape({2 * _inner_dim, _hidden_dim});
+    _gate_up_linear_scale->set_value((char*)para_vec[offset + size]), size++;
+    _gate_up_linear_scale->set_shape({1});
+    _gate_up_linear_input_scale->set_value((char*)para_vec[offset + size]),
+        size++;
+    _gate_up_linear_input_scale->set_shape({1});
+
+    _down_linear_weight->set_value((char*)para_vec[offset + size]), size++;
+    _down_linear_weight->set_shape({_hidden_dim, _inner_dim});
+    _down_linear_scale->set_value((char*)para_vec[offset + size]), size++;
+    _down_linear_scale->set_shape({1});
+    _down_linear_input_scale->set_value((char*)para_vec[offset + size]),
+        size++;
+    _down_linear_input_scale->set_shape({1});
+    return size;
+  }
+  if (_int8) {
+    // the int8 weights are [out, in], with one scale per output channel.
+    _gate_up_linear_weight->set_value((char*)para_vec[offset + size]), size++;
+    _gate_up_linear_weight->set_shape({2 * _inner_dim, _hidden_dim});
+    _gate_up_linear_scale->set_value((char*)para_vec[offset + size]), size++;
+    _gate_up_linear_scale->set_shape({2 * _inner_dim});
+
+    _down_linear_weight->set_value((char*)para_vec[offset + size]), size++;
+    _down_linear_weight->set_shape({_hidden_dim, _inner_dim});
+    _down_linear_scale->set_value((char*)para_vec[offset + size]), size++;
+    _down_linear_scale->set_shape({_hidden_dim});
+    return size;
+  }
+  if (_sparse24) {
+    // the dense [in, out] kernels, compressed at load.
+    _gate_up_sparse24_linear->load_weight(_gate_up_linear_weight,
+                                          para_vec[offset + size]),
+        size++;
+    _down_sparse24_linear->load_weight(_down_linear_weight,
+                                       para_vec[offset + size]),
+        size++;
+    return size;
+  }
+
   _gate_up_linear_weight->set_value((char*)para_vec[offset + size]), size++;
-  _gate_up_linear_weight->set_shape({_hidden_dim, 2 * _inner_dim});
+  _gate_up_linear_weight->set_shape(
+      {weight_rows(_hidden_dim), 2 * _inner_dim});
+  if (_weight_quant_bits) {
+    _gate_up_linear_scale->set_value((char*)para_vec[offset + size]), size++;
+    _gate_up_linear_scale->set_shape(
+        {scale_rows(_hidden_dim), 2 * _inner_dim});
+  }
 
   _down_linear_weight->set_value((char*)para_vec[offset + size]), size++;
-  _down_linear_weight->set_shape({_inner_dim, _hidden_dim});
+  _down_linear_weight->set_shape({weight_rows(_inner_dim), _hidden_dim});
+  if (_weight_quant_bits) {
+    _down_linear_scale->set_value((char*)para_vec[offset + size]), size++;
+    _down_linear_scale->set_shape({scale_rows(_inner_dim), _hidden_dim});
+  }
 
   return size;
 }
@@ -0,0 +1,161 @@
+#include "moe_feed_forward_layer.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+MoEFeedForwardLayer<T1, T2>::MoEFeedForwardLayer(
+    int max_batch_tokens, int hidden_dim, int inner_dim, int expert_num,
+    int topk, std::string activation_fn, bool is_pre_ln,
+    float capacity_factor, bool hard_gate)
+    : Layer("MoEFeedForwardLayer"),
+      _max_batch_tokens(max_batch_tokens),
+      _hidden_dim(hidden_dim),
+      _inner_dim(inner_dim),
+      _expert_num(expert_num),
+      _topk(hard_gate ? 1 : topk),
+      _activation_fn(activation_fn),
+      _is_pre_ln(is_pre_ln),
+      _hard_gate(hard_gate) {
+  if (_context_ptr->is_training() || _context_ptr->tp_size() > 1) {
+    printf("Error! MoEFeedForwardLayer only infers on one rank\n");
+    exit(-1);
+  }
+  bool silu = activation_fn == "silu";
+  if (silu && !is_pre_ln) {
+    printf("Error! MoEFeedForwardLayer of silu only supports pre ln\n");
+    exit(-1);
+  }
+
+  if (silu) {
+    _rms_ln = new RMSLayerNormalizeOp<T1, T2>(max_batch_tokens, hidden_dim);
+  } else {
+    _ffn_ln = new LayerNormalizeOp<T1, T2>(max_batch_tokens, hidden_dim);
+  }
+  if (!hard_gate) {
+    _gate_linear =
+        new LinearOp<T1, T2>(max_batch_tokens, expert_num, hidden_dim);
+  }
+  _dispatch = new MoeDispatchOp<T1, T2>(max_batch_tokens, hidden_dim,
+                                        expert_num, _topk, capacity_factor);
+  size_t max_capacity = _dispatch->capacity(max_batch_tokens);
+  _ff1 = new MoeExpertLinearOp<T1, T2>(max_batch_tokens, max_capacity,
+                                       expert_num, _topk, inner_dim,
+                                       hidden_dim, activation_fn);
+  _ff2 = new MoeExpertLinearOp<T1, T2>(max_batch_tokens, max_capacity,
+                                       expert_num, _topk, hidden_dim,
+                                       inner_dim);
+  _combine = new MoeCombineOp<T1, T2>(max_batch_tokens, hidden_dim,
+                                      expert_num, _topk);
+
+  _ffn_nw = new Variable("_ffn_nw", g_dtype<T1>(), g_dtype<T2>());
+  if (!silu) {
+    _ffn_nb = new Variable("_ffn_nb", g_dtype<T1>(), g_dtype<T2>());
+    _inter_b = new Variable("_inter_b", g_dtype<T1>(), g_dtype<T2>());
+    _output_b = new Variable("_output_b", g_dtype<T1>(), g_dtype<T2>());
+  }
+  if (!hard_gate) {
+    _gate_w = new Variable("_gate_w", g_dtype<T1>(), g_dtype<T2>());
+  }
+  _inter_w = new Variable("_inter_w", g_dtype<T1>(), g_dtype<T2>());
+  _output_w = new Variable("_output_w", g_dtype<T1>(), g_dtype<T2>());
+
+  this->_context_ptr->exit_layer();  // necessary
+}
+
+template <typename T1, typename T2>
+Variable* MoEFeedForwardLayer<T1, T2>::operator()(Variable* inp) {
+  set_inputs({inp});
+  Variable* ln_out = inp;
+  Variable* residual = inp;
+  if (_rms_ln) {
+    std::tuple<Variable*, Variable*> rms_out = (*_rms_ln)(inp, _ffn_nw);
+    ln_out = std::get<0>(rms_out);
+    residual = std::get<1>(rms_out);
+  } else if (_is_pre_ln) {
+    ln_out = (*_ffn_ln)(inp, _ffn_nw, _ffn_nb);
+  }
+
+  std::tuple<Variable*, Variable*> dispatch_out;
+  if (_hard_gate) {
+    dispatch_out = (*_dispatch)(ln_out);
+  } else {
+    Variable* gate_logits = (*_gate_linear)(ln_out, _gate_w);
+    dispatch_out = (*_dispatch)(ln_out, gate_logits);
+  }
+  Variable* dispatched = std::get<0>(dispatch_out);
+  Variable* routing = std::get<1>(dispatch_out);
+
+  Variable* moe_out;
+  if (_rms_ln) {
+    Variable* ff1_out = (*_ff1)(dispatched, routing, _inter_w);
+    Variable* ff2_out = (*_ff2)(ff1_out, routing, _output_w);
+    moe_out = (*_combine)(ff2_out, routing, residual);
+  } else {
+    Variable* ff1_out = (*_ff1)(dispatched, routing, _inter_w, _inter_b);
+    Variable* ff2_out = (*_ff2)(ff1_out, routing, _output_w);
+    moe_out = (*_combine)(ff2_out, routing, _output_b, residual);
+  }
+
+  if (!_rms_ln && !_is_pre_ln) {
+    moe_out = (*_ffn_ln)(moe_out, _ffn_nw, _ffn_nb);
+  }
+  set_outputs({moe_out});
+  return moe_out;
+}
+
+template <typename T1, typename T2>
+void MoEFeedForwardLayer<T1, T2>::before_forward(int batch_size,
+                                                 int seq_len) {
+  size_t batch_tokens = batch_size * seq_len;
+  if (_rms_ln) {
+    _rms_ln->before_forward(batch_size, seq_len);
+  } else {
+    _ffn_ln->before_forward(batch_size, seq_len);
+  }
+  if (_gate_linear) {
+    _gate_linear->before_forward(batch_tokens);
+  }
+  _dispatch->before_forward(batch_size, seq_len);
+  size_t capacity = _dispatch->capacity(batch_tokens);
+  _ff1->before_forward(batch_tokens, capacity);
+  _ff2->before_forward(batch_tokens, capacity);
+  _combine->before_forward(batch_tokens, capacity);
+}
+
+template <typename T1, typename T2>
+int MoEFeedForwardLayer<T1, T2>::load_params(
+    const std::vector<const T1*>& para_vec, int offset) {
+  int size = 0;
+  bool silu = _rms_ln != nullptr;
+
+  _ffn_nw->set_value((char*)para_vec[offset + size]), size++;
+  _ffn_nw->set_shape({_hidden_dim});
+  if (!silu) {
+    _ffn_nb->set_value((char*)para_vec[offset + size]), size++;
+    _ffn_nb->set_shape({_hidden_dim});
+  }
+
+  if (_gate_w) {
+    _gate_w->set_value((char*)para_vec[offset + size]), size++;
+    _gate_w->set_shape({_hidden_dim, _expert_num});
+  }
+
+  _inter_w->set_value((char*)para_vec[offset + size]), size++;
+  _inter_w->set_shape(
+      {_expert_num, _hidden_dim, (silu ? 2 : 1) * _inner_dim});
+  if (!silu) {
+    _inter_b->set_value((char*)para_vec[offset + size]), size++;
+    _inter_b->set_shape({_expert_num, _inner_dim});
+  }
+
+  _output_w->set_value((char*)para_vec[offset + size]), size++;
+  _output_w->set_shape({_expert_num, _inner_dim, _hidden_dim});
+  if (!silu) {
+    _output_b->set_value((char*)para_vec[offset + size]), size++;
+    _output_b->set_shape({_expert_num, _hidden_dim});
+  }
+
+  return size;
+}
+
+}  // namespace lightseq
@@ -7,7 +7,8 @@ MultiheadAttentionLayer<T1, T2>::MultiheadAttentionLayer(
     int layer_id, int max_batch_tokens, int max_seq_len, int hidden_size,
     int num_heads, float attn_prob_dropout_ratio,
     float hidden_output_dropout_ratio, bool is_pre_ln,
-    bool mask_future_tokens)
+    bool mask_future_tokens, bool varlen, bool int8,
+    const BlockSparseConfig& sparse)
     : Layer("MultiheadAttentionLayer"),  // necessary
       _layer_id(layer_id),
       _max_batch_tokens(max_batch_tokens),
@@ -15,29 +16,77 @@ MultiheadAttentionLayer<T1, T2>::MultiheadAttentionLayer(
       _hidden_size(hidden_size),
       _heads(num_heads),
       _is_pre_ln(is_pre_ln),
-      // operators
-      _attn_ln(
-          new LayerNormalizeOp<T1, T2>(max_batch_tokens, hidden_size, false)),
-      _qkv_linear(
-          new LinearOp<T1, T2>(max_batch_tokens, 3 * hidden_size, hidden_size)),
-      _bias_add_transform_20314(new BiasAddTrans20314<T1, T2>(
-          max_batch_tokens, num_heads, hidden_size, 3)),
-
-      _sdpa_layer(new SDPALayer<T1, T2>(max_batch_tokens, max_seq_len,
-                                        hidden_size / num_heads, num_heads,
-                                        attn_prob_dropout_ratio)),
-
-      _transform_0213(
-          new Transform0213OP<T1, T2>(max_batch_tokens * hidden_size)),
-      _attn_out_linear(
-          new LinearOp<T1, T2>(max_batch_tokens, hidden_size, hidden_size)),
-      _attn_dropout(new BiasDropoutResOp<T1, T2>(
-          hidden_output_dropout_ratio, max_batch_tokens, hidden_size)) {
+      _varlen(varlen),
+      _int8(int8),
+      _sparse(sparse.block_size > 0) {
+  // operators
+  if (is_pre_ln || int8) {
+    _attn_ln =
+        new LayerNormalizeOp<T1, T2>(max_batch_tokens, hidden_size, false);
+  }
+  if (int8) {
+#ifndef LIGHTSEQ_cuda
+    throw std::runtime_error("int8 MultiheadAttentionLayer needs cuda");
+#endif
+    if (!_context_ptr->is_inference()) {
+      throw std::runtime_error(
+          "int8 MultiheadAttentionLayer is inference only");
+    }
+    _qkv_int8_linear = new Int8LinearOp<T1, T2>(max_batch_tokens,
+                                                3 * hidden_size, hidden_size);
+    _attn_out_int8_linear =
+        new Int8LinearOp<T1, T2>(max_batch_tokens, hidden_size, hidden_size);
+  } else {
+    _qkv_linear =
+        new LinearOp<T1, T2>(max_batch_tokens, 3 * hidden_size, hidden_size);
+    _attn_out_linear =
+        new LinearOp<T1, T2>(max_batch_tokens, hidden_size, hidden_size);
+    if (is_pre_ln) {
+      _attn_dropout = new BiasDropoutResOp<T1, T2>(
+          hidden_output_dropout_ratio, max_batch_tokens, hidden_size);
+    } else {
+      _attn_dropout_ln = new BiasDropoutResLnOp<T1, T2>(
+          hidden_output_dropout_ratio, max_batch_tokens, hidden_size);
+    }
+  }
+  if (varlen) {
+    if (!_context_ptr->is_inference()) {
+      throw std::runtime_error(
+          "varlen MultiheadAttentionLayer is inference only");
+    }
+    _varlen_attn = new VarlenAttentionOp<T1, T2>(
+        max_batch_tokens, num_heads, hidden_size / num_heads);
+  } else if (_sparse) {
+    if (!_context_ptr->is_inference()) {
+      throw std::runtime_error(
+          "block sparse MultiheadAttentionLayer is inference only");
+    }
+    _sparse_attn = new BlockSparseAttentionOp<T1, T2>(
+        max_batch_tokens, max_seq_len, num_heads, hidden_size / num_heads,
+        sparse);
+  } else {
+    _bias_add_transform_20314 = new BiasAddTrans20314<T1, T2>(
+        max_batch_tokens, num_heads, hidden_size, 3);
+    _sdpa_layer.reset(new SDPALayer<T1, T2>(
+        max_batch_tokens, max_seq_len, hidden_size / num_heads, num_heads,
+        attn_prob_dropout_ratio, 0, int8));
+    if (!_sdpa_layer->set_token_major_output()) {
+      _transform_0213 =
+          new Transform0213OP<T1, T2>(max_batch_tokens * hidden_size);
+    }
+  }
+
   // parameters
-  _attn_qkvw = new Variable("_attn_qkvw", g_dtype<T1>(), g_dtype<T2>());
+  if (int8) {
+    _attn_qkvw = new Variable("_attn_qkvw", g_dtype<int8_t>());
+    _attn_ow = new Variable("_attn_ow", g_dtype<int8_t>());
+    _attn_qkvw_scale = new Variable("_attn_qkvw_scale", g_dtype<float>());
+    _attn_ow_scale = new Variable("_attn_ow_scale", g_dtype<float>());
+  } else {
+    _attn_qkvw = new Variable("_attn_qkvw", g_dtype<T1>(), g_dtype<T2>());
+    _attn_ow = new Variable("_attn_ow", g_dtype<T1>(), g_dtype<T2>());
+  }
   _attn_qkvb = new Variable("_attn_qkvb", g_dtype<T1>(), g_dtype<T2>());
-
-  _attn_ow = new Variable("_attn_ow", g_dtype<T1>(), g_dtype<T2>());
   _attn_ob = new Variable("_attn_ob", g_dtype<T1>(), g_dtype<T2>());
 
   _attn_nw = new Variable("_attn_nw", g_dtype<T1>(), g_dtype<T2>());
@@ -51,27 +100,46 @@ Variable* MultiheadAttentionLayer<T1, T2>::operator()(Variable* inp,
                                                       Variable* inp_mask) {
   set_inputs({inp, inp_mask});
   Variable* qkv_out = nullptr;
-  if (_is_pre_ln) {
-    Variable* attn_ln_out = (*_attn_ln)(inp, _attn_nw, _attn_nb);
-    qkv_out = (*_qkv_linear)(attn_ln_out, _attn_qkvw);
+  Variable* qkv_inp = _is_pre_ln ? (*_attn_ln)(inp, _attn_nw, _attn_nb) : inp;
+  if (_int8) {
+    // the bias is added by the attention below.
+    qkv_out = (*_qkv_int8_linear)(qkv_inp, _attn_qkvw, _attn_qkvw_scale);
   } else {
-    qkv_out = (*_qkv_linear)(inp, _attn_qkvw);
+    qkv_out = (*_qkv_linear)(qkv_inp, _attn_qkvw);
   }
 
-  Variable* transform_20314_out =
-      (*_bias_add_transform_20314)(qkv_out, _attn_qkvb);
-  q_out = new Variable("q_out", transform_20314_out);
-  k_out = new Variable("k_out", transform_20314_out);
-  v_out = new Variable("v_out", transform_20314_out);
-
-  Variable* sdpa_out = (*_sdpa_layer)(q_out, k_out, v_out, inp_mask);
+  Variable* attn_out = nullptr;
+  if (_varlen) {
+    // the packed sequences need no mask.
+    attn_out = (*_varlen_attn)(qkv_out, _attn_qkvb);
+  } else if (_sparse) {
+    attn_out = (*_sparse_attn)(qkv_out, _attn_qkvb, inp_mask);
+  } else {
+    Variable* transform_20314_out =
+        (*_bias_add_transform_20314)(qkv_out, _attn_qkvb);
+    q_out = new Variable("q_out", transform_20314_out);
+    k_out = new Variable("k_out", transform_20314_out);
+    v_out = new Variable("v_out", transform_20314_out);
 
-  Variable* transform_0213_out = (*_transform_0213)(sdpa_out);
+    Variable* sdpa_out = (*_sdpa_layer)(q_out, k_out, v_out, inp_mask);
 
-  Variable* attn_linear = (*_attn_out_linear)(transform_0213_out, _attn_ow);
+    attn_out = _transform_0213 ? (*_transform_0213)(sdpa_out) : sdpa_out;
+  }
 
-  Variable* attn_dropout_residual =
-      (*_attn_dropout)(attn_linear, _attn_ob, inp);
+  Variable* attn_dropout_residual = nullptr;
+  if (_int8) {
+    attn_dropout_residual = (*_attn_out_int8_linear)(
+        attn_out, _attn_ow, _attn_ow_scale, _attn_ob, inp);
+  } else {
+    Variable* attn_linear = (*_attn_out_linear)(attn_out, _attn_ow);
+    if (_attn_dropout_ln) {
+      Variable* attn_ln_out = (*_attn_dropout_ln)(attn_linear, _attn_ob, inp,
+                                                  _attn_nw, _attn_nb);
+      set_outputs({attn_ln_out});
+      return attn_ln_out;
+    }
+    attn_dropout_residual = (*_attn_dropout)(attn_linear, _attn_ob, inp);
+  }
 
   if (_is_pre_ln) {
     set_outputs({attn_dropout_residual});
@@ -86,14 +154,39 @@ Variable* MultiheadAttentionLayer<T1, T2>::operator()(Variable* inp,
 
 template <typename T1, typename T2>
 void MultiheadAttentionLayer<T1, T2>::before_forward(size_t batch_size,
-                                                     size_t seq_len) {
-  _batch_tokens = batch_size * seq_len;
+                                                     size_t seq_len,
+                                                     size_t valid_tokens) {
+  _batch_tokens = _varlen ? valid_tokens : batch_size * seq_len;
   _batch_heads = batch_size * _heads;
   _batch_dim = _batch_tokens * _hidden_size;
 
-  _attn_ln->before_forward(batch_size, seq_len);
+  if (_int8) {
+    _qkv_int8_linear->before_forward(_batch_tokens);
+    _attn_out_int8_linear->before_forward(_batch_tokens);
+  } else {
+    _qkv_linear->before_forward(_batch_tokens);
+    _attn_out_linear->before_forward(_batch_tokens);
+    if (_attn_dropout_ln) {
+      _attn_dropout_ln->before_forward(_varlen ? 1 : batch_size,
+                                       _varlen ? _batch_tokens : seq_len);
+    } else {
+      _attn_dropout->before_forward(_batch_tokens, _hidden_size);
+    }
+  }
 
-  _qkv_linear->before_forward(_batch_tokens);
+  if (_varlen) {
+    if (_attn_ln) _attn_ln->before_forward(1, _batch_tokens);
+    _varlen_attn->before_forward(batch_size, seq_len, _batch_tokens);
+    return;
+  }
+
+  if (_sparse) {
+    if (_attn_ln) _attn_ln->before_forward(batch_size, seq_len);
+    _sparse_attn->before_forward(batch_size, seq_len);
+    return;
+  }
+
+  if (_attn_ln) _attn_ln->before_forward(batch_size, seq_len);
 
   _bias_add_transform_20314->before_forward(batch_size, seq_len);
 
@@ -105,12 +198,10 @@ void MultiheadAttentionLayer<T1, T2>::before_forward(size_t batch_size,
 
   _sdpa_layer->before_forward(batch_size, seq_len, seq_len, -1, false);
 
-  _transform_0213->before_forward(batch_size, _heads, seq_len,
-                                  _hidden_size / _heads);
-
-  _attn_out_linear->before_forward(_batch_tokens);
-
-  _attn_dropout->before_forward(_batch_tokens, _hidden_size);
+  if (_transform_0213) {
+    _transform_0213->before_forward(batch_size, _heads, seq_len,
+                                    _hidden_size / _heads);
+  }
 }
 
 template <typename T1, typename T2>
@@ -159,13 +250,25 @@ int MultiheadAttentionLayer<T1, T2>::load_params(
   _attn_nb->set_value((char*)para_vec[offset + size]), size++;
   _attn_nb->set_shape({_hidden_size});
 
-  _attn_qkvw->set_value((char*)para_vec[offset + size]), size++;
-  _attn_qkvw->set_shape({3 * _hidden_size, _hidden_size});  // row-major
+  if (_int8) {
+    _qkv_int8_linear->load_weight(_attn_qkvw, _attn_qkvw_scale,
+                                  para_vec[offset + size]),
+        size++;
+  } else {
+    _attn_qkvw->set_value((char*)para_vec[offset + size]), size++;
+    _attn_qkvw->set_shape({3 * _hidden_size, _hidden_size});  // row-major
+  }
   _attn_qkvb->set_value((char*)para_vec[offset + size]), size++;
   _attn_qkvb->set_shape({3 * _hidden_size});  // row-major
 
-  _attn_ow->set_value((char*)para_vec[offset + size]), size++;
-  _attn_ow->set_shape({_hidden_size, _hidden_size});
+  if (_int8) {
+    _attn_out_int8_linear->load_weight(_attn_ow, _attn_ow_scale,
+                                       para_vec[offset + size]),
+        size++;
+  } else {
+    _attn_ow->set_value((char*)para_vec[offset + size]), size++;
+    _attn_ow->set_shape({_hidden_size, _hidden_size});
+  }
   _attn_ob->set_value((char*)para_vec[offset + size]), size++;
   _attn_ob->set_shape({_hidden_size});
 
@@ -9,7 +9,8 @@ See paper "Attention is all you need" for details"
 template <typename T1, typename T2>
 SDPALayer<T1, T2>::SDPALayer(size_t max_batch_tokens, size_t max_seq_len,
                              size_t head_dim, size_t num_heads,
-                             float attn_prob_dropout_ratio)
+                             float attn_prob_dropout_ratio,
+                             size_t num_kv_heads, bool int8)
     : Layer("SDPALayer"),
       // for training, max_batch_tokens =
       // max(batch_size * seq_len) for inference,
@@ -19,6 +20,45 @@ SDPALayer<T1, T2>::SDPALayer(size_t max_batch_tokens, size_t max_seq_len,
       _max_seq_len(max_seq_len),
       _nhead(num_heads),
       _head_dim(head_dim) {
+#ifdef LIGHTSEQ_cuda
+  if (!_context_ptr->is_training() && head_dim <= cuda::kFlashAttnMaxHeadDim) {
+    _flash_attn = new FlashAttentionOp<T1, T2>(max_batch_tokens, num_heads,
+                                               head_dim, num_kv_heads);
+    this->_context_ptr->exit_layer();  // necessary
+    return;
+  }
+  if (_context_ptr->is_training() && _context_ptr->flash_attention_train() &&
+      head_dim <= cuda::kFlashAttnBwMaxHeadDim &&
+      (num_kv_heads == 0 || num_kv_heads == num_heads)) {
+    _flash_attn = new FlashAttentionOp<T1, T2>(
+        max_batch_tokens, num_heads, head_dim, 0, attn_prob_dropout_ratio);
+    this->_context_ptr->exit_layer();  // necessary
+    return;
+  }
+#endif
+  if (int8) {
+#ifndef LIGHTSEQ_cuda
+    printf("Error! int8 SDPALayer needs cuda\n");
+    exit(-1);
+#endif
+    if (_context_ptr->is_training()) {
+      printf("Error! int8 SDPALayer is inference only\n");
+      exit(-1);
+    }
+  }
+#ifdef LIGHTSEQ_cuda
+  if (int8 && (num_kv_heads == 0 || num_kv_heads == num_heads)) {
+    _int8_attn = new Int8AttentionOp<T1, T2>(max_batch_tokens, max_seq_len,
+                                             num_heads, head_dim);
+    this->_context_ptr->exit_layer();  // necessary
+    return;
+  }
+#endif
+  if (num_kv_heads && num_kv_heads != num_heads) {
+    printf("Error! SDPALayer only supports grouped-query attention in "
+           "inference with head_dim <= 256.\n");
+    exit(-1);
+  }
   float scale = float(1.0) / sqrt(float(_head_dim));
   _attn_scores = new StridedBatchGemmOp<T1, T2>(
       max_batch_tokens * num_heads * max_seq_len, scale, T1(0.0),
@@ -37,6 +77,17 @@ Variable* SDPALayer<T1, T2>::operator()(Variable* query, Variable* key,
                                         Variable* value, Variable* mask) {
   set_inputs({query, key, value, mask});
 
+  if (_flash_attn) {
+    Variable* attn_context = (*_flash_attn)(query, key, value, mask);
+    set_outputs({attn_context});
+    return attn_context;
+  }
+  if (_int8_attn) {
+    Variable* attn_context = (*_int8_attn)(query, key, value, mask);
+    set_outputs({attn_context});
+    return attn_context;
+  }
+
   Variable* attn_score = (*_attn_scores)(key, query);
 
   Variable* soft_out = (*_softmax)(attn_score, mask);
@@ -56,6 +107,17 @@ template <typename T1, typename T2>
 void SDPALayer<T1, T2>::before_forward(int batch_size, int query_len,
                                        int kv_len, int kv_size,
                                        bool mask_future) {
+  if (_flash_attn) {
+    _flash_attn->before_forward(batch_size, query_len, kv_len,
+                                kv_size == -1 ? kv_len : kv_size,
+                                mask_future);
+    return;
+  }
+  if (_int8_attn) {
+    _int8_attn->before_forward(batch_size, query_len, kv_len,
+                               kv_size == -1 ? kv_len : kv_size, mask_future);
+    return;
+  }
   _softmax->before_forward(batch_size, query_len, kv_len, kv_size, mask_future);
 
   _attn_prob_dropout->before_forward(batch_size * query_len * kv_len * _nhead);
@@ -67,4 +129,68 @@ void SDPALayer<T1, T2>::before_forward(int batch_size, int query_len,
                                 kv_size);
 }
 
+template <typename T1, typename T2>
+void SDPALayer<T1, T2>::set_kv_cache_scales(const float* k_scale,
+                                            const float* v_scale) {
+  if (!fused_inference()) {
+    printf("Error! SDPALayer only supports int8 key and value in inference "
+           "with head_dim <= 256.\n");
+    exit(-1);
+  }
+  _flash_attn->set_kv_cache_scales(k_scale, v_scale);
+}
+
+template <typename T1, typename T2>
+bool SDPALayer<T1, T2>::set_token_major_output() {
+  if (!fused_inference()) return false;
+  _flash_attn->set_token_major_output();
+  return true;
+}
+
+template <typename T1, typename T2>
+bool SDPALayer<T1, T2>::set_kv_rows(const int* kv_rows) {
+  if (!fused_inference()) return false;
+  _flash_attn->set_kv_rows(kv_rows);
+  return true;
+}
+
+template <typename T1, typename T2>
+bool SDPALayer<T1, T2>::set_tree_mask(const unsigned char* tree_mask,
+                                      int tree_len) {
+  if (!fused_inference()) return false;
+  _flash_attn->set_tree_mask(tree_mask, tree_len);
+  return true;
+}
+
+template <typename T1, typename T2>
+void SDPALayer<T1, T2>::set_kv_ring(int ring_size, int window,
+                                    int mask_size) {
+  if (!fused_inference()) {
+    printf("Error! SDPALayer only supports a kv ring in inference with "
+           "head_dim <= 256.\n");
+    exit(-1);
+  }
+  _flash_attn->set_kv_ring(ring_size, window, mask_size);
+}
+
+template <typename T1, typename T2>
+void SDPALayer<T1, T2>::set_heavy_hitters(int* heavy_pos, float* kv_mass) {
+  if (!fused_inference()) {
+    printf("Error! SDPALayer only keeps heavy hitters in inference with "
+           "head_dim <= 256.\n");
+    exit(-1);
+  }
+  _flash_attn->set_heavy_hitters(heavy_pos, kv_mass);
+}
+
+template <typename T1, typename T2>
+void SDPALayer<T1, T2>::set_pos_bias(const T1* pos_bias, int max_len) {
+  if (!fused_inference()) {
+    printf("Error! SDPALayer only supports a position bias in inference "
+           "with head_dim <= 256.\n");
+    exit(-1);
+  }
+  _flash_attn->set_pos_bias(pos_bias, max_len);
+}
+
 }  // namespace lightseq
@@ -0,0 +1,143 @@
+#include "t5_attention_layer.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+T5AttentionLayer<T1, T2>::T5AttentionLayer(int layer_id, int max_batch_tokens,
+                                           int max_seq_len, int hidden_size,
+                                           int num_heads, bool is_decoder)
+    : Layer("T5AttentionLayer"),  // necessary
+      _layer_id(layer_id),
+      _max_batch_tokens(max_batch_tokens),
+      _max_seq_len(max_seq_len),
+      _hidden_size(hidden_size),
+      _heads(num_heads),
+      _is_decoder(is_decoder),
+      // operators
+      _attn_ln(new RMSLayerNormalizeOp<T1, T2>(max_batch_tokens, hidden_size)),
+      _qkv_linear(
+          new LinearOp<T1, T2>(max_batch_tokens, 3 * hidden_size, hidden_size)),
+      _bias_add_transform_20314(new BiasAddTrans20314<T1, T2>(
+          max_batch_tokens, num_heads, hidden_size, 3)),
+      _transform_0213(
+          new Transform0213OP<T1, T2>(max_batch_tokens * hidden_size)),
+      _attn_out_linear(
+          new LinearOp<T1, T2>(max_batch_tokens, hidden_size, hidden_size)) {
+  if (_context_ptr->is_training()) {
+    printf("Error! T5AttentionLayer is inference only\n");
+    exit(-1);
+  }
+  if (is_decoder) {
+    _concat_cache_k = new Concat3Dim1<T1, T2>(
+        max_batch_tokens * num_heads, max_seq_len, hidden_size / num_heads,
+        layer_id, false);
+    _concat_cache_v = new Concat3Dim1<T1, T2>(
+        max_batch_tokens * num_heads, max_seq_len, hidden_size / num_heads,
+        layer_id, false);
+  }
+  _sdpa_layer.reset(new SDPALayer<T1, T2>(max_batch_tokens, max_seq_len,
+                                          hidden_size / num_heads, num_heads,
+                                          0.f));
+
+  // parameters
+  _norm_scale = new Variable("_norm_scale", g_dtype<T1>(), g_dtype<T2>());
+  _attn_qkvw = new Variable("_attn_qkvw", g_dtype<T1>(), g_dtype<T2>());
+  _attn_qkvb = new Variable("_attn_qkvb", g_dtype<T1>(), g_dtype<T2>());
+  _attn_ow = new Variable("_attn_ow", g_dtype<T1>(), g_dtype<T2>());
+
+  this->_context_ptr->exit_layer();  // necessary
+}
+
+template <typename T1, typename T2>
+Variable* T5AttentionLayer<T1, T2>::operator()(Variable* inp,
+                                               Variable* inp_mask,
+                                               Variable* cache_k,
+                                               Variable* cache_v) {
+  if (_is_decoder) {
+    set_inputs({inp, cache_k, cache_v});
+  } else {
+    set_inputs({inp, inp_mask});
+  }
+
+  std::tuple<Variable*, Variable*> ln_out = (*_attn_ln)(inp, _norm_scale);
+  Variable* qkv_out = (*_qkv_linear)(std::get<0>(ln_out), _attn_qkvw);
+
+  Variable* transform_20314_out =
+      (*_bias_add_transform_20314)(qkv_out, _attn_qkvb);
+  q_out = new Variable("q_out", transform_20314_out);
+  k_out = new Variable("k_out", transform_20314_out);
+  v_out = new Variable("v_out", transform_20314_out);
+
+  Variable* sdpa_out;
+  if (_is_decoder) {
+    Variable* cache_k_out = (*_concat_cache_k)(k_out, cache_k);
+    Variable* cache_v_out = (*_concat_cache_v)(v_out, cache_v);
+    sdpa_out = (*_sdpa_layer)(q_out, cache_k_out, cache_v_out);
+  } else {
+    sdpa_out = (*_sdpa_layer)(q_out, k_out, v_out, inp_mask);
+  }
+
+  Variable* transform_0213_out = (*_transform_0213)(sdpa_out);
+
+  Variable* attn_out = (*_attn_out_linear)(transform_0213_out, _attn_ow,
+                                           std::get<1>(ln_out));
+
+  set_outputs({attn_out});
+  return attn_out;
+}
+
+template <typename T1, typename T2>
+void T5AttentionLayer<T1, T2>::before_forward(int batch_size, int seq_len,
+                                              int step) {
+  size_t batch_tokens = batch_size * seq_len;
+  size_t batch_dim = batch_tokens * _hidden_size;
+  size_t head_dim = _hidden_size / _heads;
+
+  _attn_ln->before_forward(batch_size, seq_len);
+  _qkv_linear->before_forward(batch_tokens);
+  _attn_out_linear->before_forward(batch_tokens);
+
+  if (!_is_decoder) {
+    _bias_add_transform_20314->before_forward(batch_size, seq_len);
+    q_out->set_offset(0, {size_t(batch_size), _heads, size_t(seq_len),
+                          head_dim});
+    k_out->set_offset(batch_dim, {size_t(batch_size), _heads,
+                                  size_t(seq_len), head_dim});
+    v_out->set_offset(2 * batch_dim, {size_t(batch_size), _heads,
+                                      size_t(seq_len), head_dim});
+    _sdpa_layer->before_forward(batch_size, seq_len, seq_len, seq_len,
+                                false);
+    _transform_0213->before_forward(batch_size, _heads, seq_len, head_dim);
+    return;
+  }
+
+  // every beam is a sequence of a single query.
+  _bias_add_transform_20314->before_forward(batch_tokens, 1);
+  q_out->set_offset(0, {batch_tokens, _heads, 1, head_dim});
+  k_out->set_offset(batch_dim, {batch_tokens, _heads, 1, head_dim});
+  v_out->set_offset(2 * batch_dim, {batch_tokens, _heads, 1, head_dim});
+  _concat_cache_k->before_forward(batch_tokens * _heads, step, 1);
+  _concat_cache_v->before_forward(batch_tokens * _heads, step, 1);
+  _sdpa_layer->before_forward(batch_tokens, 1, step + 1, _max_seq_len, false);
+  _transform_0213->before_forward(batch_tokens, _heads, 1, head_dim);
+}
+
+template <typename T1, typename T2>
+int T5AttentionLayer<T1, T2>::load_params(
+    const std::vector<const T1*>& para_vec, int offset) {  // for inference
+  int size = 0;
+  _norm_scale->set_value((char*)para_vec[offset + size]), size++;
+  _norm_scale->set_shape({_hidden_size});
+
+  _attn_qkvw->set_value((char*)para_vec[offset + size]), size++;
+  _attn_qkvw->set_shape({_hidden_size, 3 * _hidden_size});
+  _attn_qkvb->set_value((char*)para_vec[offset + size]), size++;
+  _attn_qkvb->set_shape({3 * _hidden_size});
+
+  _attn_ow->set_value((char*)para_vec[offset + size]), size++;
+  _attn_ow->set_shape({_hidden_size, _hidden_size});
+
+  return size;
+}
+
+}  // namespace lightseq
@@ -0,0 +1,100 @@
+#include "t5_cross_attention_layer.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+T5CrossAttentionLayer<T1, T2>::T5CrossAttentionLayer(int max_batch_tokens,
+                                                     int max_seq_len,
+                                                     int hidden_size,
+                                                     int num_heads)
+    : Layer("T5CrossAttentionLayer"),  // necessary
+      _max_batch_tokens(max_batch_tokens),
+      _hidden_size(hidden_size),
+      _heads(num_heads),
+      // operators
+      _attn_ln(new RMSLayerNormalizeOp<T1, T2>(max_batch_tokens, hidden_size)),
+      _q_linear(
+          new LinearOp<T1, T2>(max_batch_tokens, hidden_size, hidden_size)),
+      _bias_add_transform_20314_q(new BiasAddTrans20314<T1, T2>(
+          max_batch_tokens, num_heads, hidden_size, 1)),
+      _sdpa_layer(new SDPALayer<T1, T2>(max_batch_tokens, max_seq_len,
+                                        hidden_size / num_heads, num_heads,
+                                        0.f)),
+      _transform_0213(
+          new Transform0213OP<T1, T2>(max_batch_tokens * hidden_size)),
+      _attn_out_linear(
+          new LinearOp<T1, T2>(max_batch_tokens, hidden_size, hidden_size)) {
+  // parameters
+  _norm_scale = new Variable("_norm_scale", g_dtype<T1>(), g_dtype<T2>());
+  _attn_qw = new Variable("_attn_qw", g_dtype<T1>(), g_dtype<T2>());
+  _attn_qb = new Variable("_attn_qb", g_dtype<T1>(), g_dtype<T2>());
+  _attn_ow = new Variable("_attn_ow", g_dtype<T1>(), g_dtype<T2>());
+
+  this->_context_ptr->exit_layer();  // necessary
+}
+
+template <typename T1, typename T2>
+Variable* T5CrossAttentionLayer<T1, T2>::operator()(Variable* inp,
+                                                    Variable* enc_mask,
+                                                    Variable* enc_k,
+                                                    Variable* enc_v) {
+  set_inputs({inp, enc_mask, enc_k, enc_v});
+
+  std::tuple<Variable*, Variable*> ln_out = (*_attn_ln)(inp, _norm_scale);
+  Variable* q_linear_out = (*_q_linear)(std::get<0>(ln_out), _attn_qw);
+
+  Variable* transform_20314_out =
+      (*_bias_add_transform_20314_q)(q_linear_out, _attn_qb);
+
+  Variable* sdpa_out =
+      (*_sdpa_layer)(transform_20314_out, enc_k, enc_v, enc_mask);
+
+  Variable* transform_0213_out = (*_transform_0213)(sdpa_out);
+
+  Variable* attn_out = (*_attn_out_linear)(transform_0213_out, _attn_ow,
+                                           std::get<1>(ln_out));
+
+  set_outputs({attn_out});
+  return attn_out;
+}
+
+template <typename T1, typename T2>
+void T5CrossAttentionLayer<T1, T2>::before_forward(int batch_size,
+                                                   int trg_seq_len,
+                                                   int src_seq_len) {
+  int batch_tokens = batch_size * trg_seq_len;
+
+  _attn_ln->before_forward(batch_size, trg_seq_len);
+
+  _q_linear->before_forward(batch_tokens);
+
+  _bias_add_transform_20314_q->before_forward(batch_size, trg_seq_len);
+
+  _sdpa_layer->before_forward(batch_size, trg_seq_len, src_seq_len,
+                              src_seq_len, false);
+
+  _transform_0213->before_forward(batch_size, _heads, trg_seq_len,
+                                  _hidden_size / _heads);
+
+  _attn_out_linear->before_forward(batch_tokens);
+}
+
+template <typename T1, typename T2>
+int T5CrossAttentionLayer<T1, T2>::load_params(
+    const std::vector<const T1*>& para_vec, int offset) {  // for inference
+  int size = 0;
+  _norm_scale->set_value((char*)para_vec[offset + size]), size++;
+  _norm_scale->set_shape({_hidden_size});
+
+  _attn_qw->set_value((char*)para_vec[offset + size]), size++;
+  _attn_qw->set_shape({_hidden_size, _hidden_size});
+  _attn_qb->set_value((char*)para_vec[offset + size]), size++;
+  _attn_qb->set_shape({_hidden_size});
+
+  _attn_ow->set_value((char*)para_vec[offset + size]), size++;
+  _attn_ow->set_shape({_hidden_size, _hidden_size});
+
+  return size;
+}
+
+}  // namespace lightseq
@@ -0,0 +1,74 @@
+#include "t5_decoder_layer.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+T5DecoderLayer<T1, T2>::T5DecoderLayer(int layer_id, int max_batch_tokens,
+                                       int max_seq_len, int hidden_size,
+                                       int num_heads, int inner_size,
+                                       bool gated_gelu)
+    : Layer("T5DecoderLayer"),
+      _layer_id(layer_id),
+      _hidden_size(hidden_size) {
+  _self_attn_layer.reset(new T5AttentionLayer<T1, T2>(
+      layer_id, max_batch_tokens, max_seq_len, hidden_size, num_heads, true));
+  _enc_attn_layer.reset(new T5CrossAttentionLayer<T1, T2>(
+      max_batch_tokens, max_seq_len, hidden_size, num_heads));
+  _ffn_layer.reset(new T5FeedForwardLayer<T1, T2>(
+      max_batch_tokens, hidden_size, inner_size, gated_gelu));
+
+  this->_context_ptr->exit_layer();  // necessary
+}
+
+template <typename T1, typename T2>
+Variable* T5DecoderLayer<T1, T2>::operator()(Variable* inp,
+                                             Variable* total_enc_kv,
+                                             Variable* enc_mask,
+                                             Variable* cache_self_k,
+                                             Variable* cache_self_v) {
+  set_inputs({inp, total_enc_kv, enc_mask, cache_self_k, cache_self_v});
+
+  enc_k = new Variable("enc_k", total_enc_kv);
+  enc_v = new Variable("enc_v", total_enc_kv);
+
+  Variable* self_attn_out =
+      (*_self_attn_layer)(inp, nullptr, cache_self_k, cache_self_v);
+
+  Variable* enc_attn_out =
+      (*_enc_attn_layer)(self_attn_out, enc_mask, enc_k, enc_v);
+
+  Variable* ffn_out = (*_ffn_layer)(enc_attn_out);
+
+  set_outputs({ffn_out});
+  return ffn_out;
+}
+
+template <typename T1, typename T2>
+void T5DecoderLayer<T1, T2>::before_forward(int batch_size, int beam_size,
+                                            int src_seq_len, int step) {
+  enc_k->set_offset(2 * _layer_id * _hidden_size * batch_size * src_seq_len,
+                    {size_t(batch_size), size_t(src_seq_len), _hidden_size});
+  enc_v->set_offset(
+      (2 * _layer_id + 1) * _hidden_size * batch_size * src_seq_len,
+      {size_t(batch_size), size_t(src_seq_len), _hidden_size});
+
+  _self_attn_layer->before_forward(batch_size, beam_size, step);
+
+  _enc_attn_layer->before_forward(batch_size, beam_size, src_seq_len);
+
+  _ffn_layer->before_forward(batch_size, beam_size);
+}
+
+template <typename T1, typename T2>
+int T5DecoderLayer<T1, T2>::load_params(const std::vector<const T1*>& para_vec,
+                                        int offset) {  // for inference
+  int size = 0;
+
+  size += _self_attn_layer->load_params(para_vec, offset + size);
+  size += _enc_attn_layer->load_params(para_vec, offset + size);
+  size += _ffn_layer->load_params(para_vec, offset + size);
+
+  return size;
+}
+
+}  // namespace lightseq
@@ -0,0 +1,50 @@
+#include "t5_encoder_layer.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+T5EncoderLayer<T1, T2>::T5EncoderLayer(int layer_id, int max_batch_tokens,
+                                       int max_seq_len, int hidden_size,
+                                       int num_heads, int inner_size,
+                                       bool gated_gelu)
+    : Layer("T5EncoderLayer"), _layer_id(layer_id) {
+  _attn_layer.reset(new T5AttentionLayer<T1, T2>(
+      layer_id, max_batch_tokens, max_seq_len, hidden_size, num_heads, false));
+  _ffn_layer.reset(new T5FeedForwardLayer<T1, T2>(
+      max_batch_tokens, hidden_size, inner_size, gated_gelu));
+
+  this->_context_ptr->exit_layer();  // necessary
+}
+
+template <typename T1, typename T2>
+Variable* T5EncoderLayer<T1, T2>::operator()(Variable* inp,
+                                             Variable* inp_mask) {
+  set_inputs({inp, inp_mask});
+
+  Variable* attn_out = (*_attn_layer)(inp, inp_mask);
+
+  Variable* ffn_out = (*_ffn_layer)(attn_out);
+
+  set_outputs({ffn_out});
+  return ffn_out;
+}
+
+template <typename T1, typename T2>
+void T5EncoderLayer<T1, T2>::before_forward(int batch_size, int seq_len) {
+  _attn_layer->before_forward(batch_size, seq_len);
+
+  _ffn_layer->before_forward(batch_size, seq_len);
+}
+
+template <typename T1, typename T2>
+int T5EncoderLayer<T1, T2>::load_params(const std::vector<const T1*>& para_vec,
+                                        int offset) {  // for inference
+  int size = 0;
+
+  size += _attn_layer->load_params(para_vec, offset + size);
+  size += _ffn_layer->load_params(para_vec, offset + size);
+
+  return size;
+}
+
+}  // namespace lightseq
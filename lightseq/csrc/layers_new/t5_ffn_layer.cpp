@@ -0,0 +1,94 @@
+#include "t5_ffn_layer.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+T5FeedForwardLayer<T1, T2>::T5FeedForwardLayer(int max_batch_tokens,
+                                               int hidden_size, int inner_size,
+                                               bool gated_gelu)
+    : Layer("T5FeedForwardLayer"),  // necessary
+      _max_batch_tokens(max_batch_tokens),
+      _hidden_size(hidden_size),
+      _inner_size(inner_size),
+      _gated_gelu(gated_gelu) {
+  _ffn_ln = new RMSLayerNormalizeOp<T1, T2>(max_batch_tokens, hidden_size);
+  if (gated_gelu) {
+    // the output is [gelu input, linear input] as for ActElewiseProductOp.
+    _inter_linear = new LinearOp<T1, T2>(max_batch_tokens, 2 * inner_size,
+                                         hidden_size);
+    _act_product = new ActElewiseProductOp<T1, T2>(max_batch_tokens,
+                                                   inner_size, "gelu");
+  } else {
+    _inter_linear =
+        new LinearOp<T1, T2>(max_batch_tokens, inner_size, hidden_size);
+    _inter_act = new BiasActDropoutOp<T1, T2>(0, max_batch_tokens, inner_size,
+                                              "relu");
+  }
+  _output_linear =
+      new LinearOp<T1, T2>(max_batch_tokens, hidden_size, inner_size);
+
+  // parameters
+  _norm_scale = new Variable("_norm_scale", g_dtype<T1>(), g_dtype<T2>());
+  _inter_w = new Variable("_inter_w", g_dtype<T1>(), g_dtype<T2>());
+  _inter_b = new Variable("_inter_b", g_dtype<T1>(), g_dtype<T2>());
+  _output_w = new Variable("_output_w", g_dtype<T1>(), g_dtype<T2>());
+
+  this->_context_ptr->exit_layer();  // necessary
+}
+
+template <typename T1, typename T2>
+Variable* T5FeedForwardLayer<T1, T2>::operator()(Variable* inp) {
+  set_inputs({inp});
+
+  std::tuple<Variable*, Variable*> ln_out = (*_ffn_ln)(inp, _norm_scale);
+  Variable* act_out;
+  if (_gated_gelu) {
+    Variable* inter_out = (*_inter_linear)(std::get<0>(ln_out), _inter_w);
+    act_out = (*_act_product)(inter_out);
+  } else {
+    Variable* inter_out = (*_inter_linear)(std::get<0>(ln_out), _inter_w);
+    act_out = (*_inter_act)(inter_out, _inter_b);
+  }
+
+  Variable* ffn_out =
+      (*_output_linear)(act_out, _output_w, std::get<1>(ln_out));
+
+  set_outputs({ffn_out});
+  return ffn_out;
+}
+
+template <typename T1, typename T2>
+void T5FeedForwardLayer<T1, T2>::before_forward(int batch_size, int seq_len) {
+  int batch_tokens = batch_size * seq_len;
+
+  _ffn_ln->before_forward(batch_size, seq_len);
+  _inter_linear->before_forward(batch_tokens);
+  if (_gated_gelu) {
+    _act_product->before_forward(batch_size, seq_len);
+  } else {
+    _inter_act->before_forward(batch_tokens, _inner_size);
+  }
+  _output_linear->before_forward(batch_tokens);
+}
+
+template <typename T1, typename T2>
+int T5FeedForwardLayer<T1, T2>::load_params(
+    const std::vector<const T1*>& para_vec, int offset) {  // for inference
+  int size = 0;
+  size_t inter_size = _gated_gelu ? 2 * _inner_size : _inner_size;
+
+  _norm_scale->set_value((char*)para_vec[offset + size]), size++;
+  _norm_scale->set_shape({_hidden_size});
+
+  _inter_w->set_value((char*)para_vec[offset + size]), size++;
+  _inter_w->set_shape({_hidden_size, inter_size});
+  _inter_b->set_value((char*)para_vec[offset + size]), size++;
+  _inter_b->set_shape({inter_size});
+
+  _output_w->set_value((char*)para_vec[offset + size]), size++;
+  _output_w->set_shape({_inner_size, _hidden_size});
+
+  return size;
+}
+
+}  // namespace lightseq
@@ -8,7 +8,8 @@ TransformerDecoderLayer<T1, T2>::TransformerDecoderLayer(
     int hidden_size, int num_heads, int intermediate_size,
     float attn_dropout_ratio, float hidden_output_dropout_ratio,
     float activation_dropout_ratio, bool is_pre_ln, std::string activation_fn,
-    bool is_continuous_cache, int max_batch_size, int beam_size)
+    bool is_continuous_cache, int max_batch_size, int beam_size,
+    bool encdec_kv_int8)
     : Layer("TransformerDecoderLayer"),
       _layer_id(layer_id),
       _nshared_layer(nshared_layer),
@@ -25,7 +26,8 @@ TransformerDecoderLayer<T1, T2>::TransformerDecoderLayer(
 
   _enc_attn_layer.reset(new DecEncAttentionLayer<T1, T2>(
       layer_id, max_trg_tokens, max_seq_len, hidden_size, num_heads,
-      attn_dropout_ratio, hidden_output_dropout_ratio, is_pre_ln));
+      attn_dropout_ratio, hidden_output_dropout_ratio, is_pre_ln, beam_size,
+      encdec_kv_int8));
 
   _ffn_layer.reset(new FeedForwardLayer<T1, T2>(
       layer_id, max_trg_tokens, max_seq_len, hidden_size, num_heads,
@@ -83,7 +85,7 @@ void TransformerDecoderLayer<T1, T2>::before_forward(
 
   _self_attn_layer->before_forward(batch_size, trg_seq_len, step);
 
-  _enc_attn_layer->before_forward(batch_size, trg_seq_len, src_seq_len);
+  _enc_attn_layer->before_forward(batch_size, trg_seq_len, src_seq_len, step);
 
   _ffn_layer->before_forward(batch_size, trg_seq_len);
 }
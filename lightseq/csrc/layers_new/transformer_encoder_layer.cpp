@@ -7,17 +7,18 @@ TransformerEncoderLayer<T1, T2>::TransformerEncoderLayer(
     int layer_id, int max_batch_tokens, int max_seq_len, int hidden_size,
     int num_heads, int intermediate_size, float attn_prob_dropout_ratio,
     float activation_dropout_ratio, float hidden_output_dropout_ratio,
-    bool is_pre_ln, std::string activation_fn, bool mask_future_tokens)
+    bool is_pre_ln, std::string activation_fn, bool mask_future_tokens,
+    bool varlen, bool int8, const BlockSparseConfig& sparse, bool sparse24)
     : Layer("TransformerEncoderLayer"), _layer_id(layer_id) {
   _attn_layer.reset(new MultiheadAttentionLayer<T1, T2>(
       layer_id, max_batch_tokens, max_seq_len, hidden_size, num_heads,
       attn_prob_dropout_ratio, hidden_output_dropout_ratio, is_pre_ln,
-      mask_future_tokens));
+      mask_future_tokens, varlen, int8, sparse));
 
   _ffn_layer.reset(new FeedForwardLayer<T1, T2>(
       layer_id, max_batch_tokens, max_seq_len, hidden_size, num_heads,
       intermediate_size, activation_dropout_ratio, hidden_output_dropout_ratio,
-      is_pre_ln, activation_fn));
+      is_pre_ln, activation_fn, int8, sparse24));
 
   this->_context_ptr->exit_layer();  // necessary
 }
@@ -1,29 +1,438 @@
 #include "allocator.h"
 
+#ifndef LIGHTSEQ_cuda
+#include <sys/mman.h>
+#endif
+
 namespace lightseq {
 
-Allocator::Allocator() { _ptr_set.clear(); }
+MemoryPool::MemoryPool(int device_id) : _device_id(device_id) {
+#ifdef LIGHTSEQ_cuda
+#if CUDART_VERSION >= 11020
+  int pools_supported = 0;
+  cudaDeviceGetAttribute(&pools_supported, cudaDevAttrMemoryPoolsSupported,
+                         device_id);
+  if (pools_supported) {
+    cudaMemPool_t device_pool;
+    CHECK_GPU_ERROR(cudaDeviceGetDefaultMemPool(&device_pool, device_id));
+    // keep the memory returned by cudaFreeAsync in the driver pool instead of
+    // releasing it back to the OS at every synchronization point.
+    uint64_t threshold = UINT64_MAX;
+    CHECK_GPU_ERROR(cudaMemPoolSetAttribute(
+        device_pool, cudaMemPoolAttrReleaseThreshold, &threshold));
+    _use_async_malloc = true;
+  }
+#endif
+#else
+  const char* huge_pages_env = std::getenv("LIGHTSEQ_HUGE_PAGES");
+  if (huge_pages_env != nullptr && *huge_pages_env != 0) {
+    std::string mode = huge_pages_env;
+    if (mode == "none") {
+      _huge_pages = HugePages::kNone;
+    } else if (mode == "explicit") {
+      _huge_pages = HugePages::kExplicit;
+    } else if (mode != "transparent") {
+      printf("unknown LIGHTSEQ_HUGE_PAGES %s, use transparent huge pages\n",
+             huge_pages_env);
+    }
+  }
+#endif
+}
+
+MemoryPool* MemoryPool::instance(int device_id) {
+  static std::mutex instance_mutex;
+  static std::map<int, MemoryPool*> device_pools;
+  std::lock_guard<std::mutex> lock(instance_mutex);
+  auto iter = device_pools.find(device_id);
+  if (iter != device_pools.end()) {
+    return iter->second;
+  }
+  MemoryPool* pool = new MemoryPool(device_id);
+  device_pools.emplace(device_id, pool);
+  return pool;
+}
+
+MemoryPool* MemoryPool::current() {
+  int device_id = 0;
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaGetDevice(&device_id));
+#endif
+  return instance(device_id);
+}
+
+size_t MemoryPool::round_size(size_t size) {
+  if (size <= kSmallSize) {
+    return std::max(kSmallRound, (size + kSmallRound - 1) / kSmallRound *
+                                     kSmallRound);
+  }
+  return (size + kLargeRound - 1) / kLargeRound * kLargeRound;
+}
+
+size_t MemoryPool::max_waste(size_t rounded_size) {
+  if (rounded_size <= kSmallSize) {
+    return rounded_size;
+  }
+  return std::max(kLargeRound, rounded_size / 8);
+}
+
+#ifndef LIGHTSEQ_cuda
+char* MemoryPool::host_malloc(size_t size, Block* block) {
+  char* ptr = nullptr;
+  // the large blocks are multiples of the huge page size, see round_size.
+  bool huge = size >= kHugePageSize && _huge_pages != HugePages::kNone;
+#ifdef MAP_HUGETLB
+  if (huge && _huge_pages == HugePages::kExplicit) {
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED) {
+      block->mmapped = true;
+      return (char*)addr;
+    }
+  }
+#endif
+  if (posix_memalign((void**)&ptr, huge ? kHugePageSize : kHostAlignment,
+                     size) != 0) {
+    return nullptr;
+  }
+#ifdef MADV_HUGEPAGE
+  if (huge) madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+
+  // first touch, the pages are placed on the numa nodes of the threads which
+  // will compute on them.
+  const int64_t page_size = huge ? kHugePageSize : 4096;
+  const int64_t num_pages = (size + page_size - 1) / page_size;
+#pragma omp parallel for schedule(static)
+  for (int64_t i = 0; i < num_pages; i++) {
+    ptr[i * page_size] = 0;
+  }
+  return ptr;
+}
+#endif
+
+char* MemoryPool::device_malloc(size_t size, Block* block) {
+  char* ptr = nullptr;
+#ifdef LIGHTSEQ_cuda
+  cudaError_t status = cudaSuccess;
+#if CUDART_VERSION >= 11020
+  if (_use_async_malloc) {
+    status = cudaMallocAsync((void**)&ptr, size, block->stream);
+  } else {
+    status = cudaMalloc((void**)&ptr, size);
+  }
+#else
+  status = cudaMalloc((void**)&ptr, size);
+#endif
+  if (status != cudaSuccess) {
+    // clear the sticky error state so that the caller can retry.
+    cudaGetLastError();
+    return nullptr;
+  }
+#else
+  ptr = host_malloc(size, block);
+#endif
+  if (ptr != nullptr) {
+    _stats.num_device_mallocs++;
+  }
+  return ptr;
+}
+
+void MemoryPool::device_free(Block* block) {
+#ifdef LIGHTSEQ_cuda
+  if (block->event != nullptr) {
+    CHECK_GPU_ERROR(cudaEventSynchronize(block->event));
+    CHECK_GPU_ERROR(cudaEventDestroy(block->event));
+    block->event = nullptr;
+  }
+#if CUDART_VERSION >= 11020
+  if (_use_async_malloc) {
+    CHECK_GPU_ERROR(cudaFreeAsync(block->ptr, block->stream));
+  } else {
+    CHECK_GPU_ERROR(cudaFree(block->ptr));
+  }
+#else
+  CHECK_GPU_ERROR(cudaFree(block->ptr));
+#endif
+#else
+  if (block->mmapped) {
+    munmap(block->ptr, block->size);
+  } else {
+    free(block->ptr);
+  }
+#endif
+  block->ptr = nullptr;
+}
+
+void MemoryPool::release_cached_blocks() {
+  for (auto* free_list : {&_small_blocks, &_large_blocks}) {
+    for (auto& iter : *free_list) {
+      _stats.reserved_bytes -= iter.second.size;
+      device_free(&iter.second);
+    }
+    free_list->clear();
+  }
+}
+
+// With the unbounded release threshold the memory freed by cudaFreeAsync
+// stays reserved by the driver pool, trim it so that cudaMalloc in this
+// process and other processes can get it. Called without _mutex, the
+// synchronization of _device_id would otherwise block every stream of the
+// process which allocates meanwhile.
+void MemoryPool::trim_device_pool() {
+#ifdef LIGHTSEQ_cuda
+#if CUDART_VERSION >= 11020
+  if (!_use_async_malloc) return;
+  cudaMemPool_t device_pool;
+  CHECK_GPU_ERROR(cudaDeviceGetDefaultMemPool(&device_pool, _device_id));
+  int device;
+  CHECK_GPU_ERROR(cudaGetDevice(&device));
+  if (device != _device_id) CHECK_GPU_ERROR(cudaSetDevice(_device_id));
+  // the frees must have run for their memory to be trimmed.
+  CHECK_GPU_ERROR(cudaDeviceSynchronize());
+  CHECK_GPU_ERROR(cudaMemPoolTrimTo(device_pool, 0));
+  if (device != _device_id) CHECK_GPU_ERROR(cudaSetDevice(device));
+#endif
+#endif
+}
+
+#ifdef LIGHTSEQ_cuda
+// The query of the legacy default stream fails while another stream
+// captures, which counts as a capture too.
+static bool stream_capturing(cudaStream_t stream) {
+  cudaStreamCaptureStatus capture_status = cudaStreamCaptureStatusNone;
+  if (cudaStreamIsCapturing(stream, &capture_status) != cudaSuccess) {
+    cudaGetLastError();
+    return true;
+  }
+  return capture_status != cudaStreamCaptureStatusNone;
+}
+
+char* MemoryPool::malloc_mem(size_t size, cudaStream_t stream) {
+#else
+char* MemoryPool::malloc_mem(size_t size) {
+#endif
+  std::unique_lock<std::mutex> lock(_mutex);
+  size_t rounded_size = round_size(size);
+  std::multimap<size_t, Block>& free_list = free_blocks(rounded_size);
+  _stats.num_requests++;
+
+  Block block;
+  // best fit among the cached blocks
+  auto iter = free_list.lower_bound(rounded_size);
+  if (iter != free_list.end() &&
+      iter->first - rounded_size <= max_waste(rounded_size)) {
+    block = iter->second;
+    free_list.erase(iter);
+    _stats.num_cache_hits++;
+#ifdef LIGHTSEQ_cuda
+    if (block.event_pending && block.stream != stream) {
+      CHECK_GPU_ERROR(cudaStreamWaitEvent(stream, block.event, 0));
+    }
+    block.event_pending = false;
+    block.stream = stream;
+#endif
+  } else {
+    block.size = rounded_size;
+#ifdef LIGHTSEQ_cuda
+    block.stream = stream;
+#endif
+    block.ptr = device_malloc(rounded_size, &block);
+    bool retry = block.ptr == nullptr;
+#ifdef LIGHTSEQ_cuda
+    // not while the stream is captured into a graph, the synchronizations
+    // below would invalidate the capture.
+    retry = retry && !stream_capturing(stream);
+#endif
+    if (retry) {
+      // the cached blocks may be what stands in the way, give them back to
+      // the device, trim the driver pool so plain cudaMalloc can reuse them,
+      // and try once more.
+      release_cached_blocks();
+      lock.unlock();
+      trim_device_pool();
+      lock.lock();
+      block.ptr = device_malloc(rounded_size, &block);
+    }
+    if (block.ptr == nullptr) {
+      std::string error_message =
+          "memory pool of device " + std::to_string(_device_id) +
+          " failed to allocate " + std::to_string(rounded_size / MB_SIZE) +
+          " MB, reserved " + std::to_string(_stats.reserved_bytes / MB_SIZE) +
+          " MB\n";
+      printf("%s", error_message.c_str());
+      throw std::runtime_error(error_message);
+    }
+    _stats.reserved_bytes += block.size;
+    _stats.peak_reserved_bytes =
+        std::max(_stats.peak_reserved_bytes, _stats.reserved_bytes);
+  }
+
+  block.requested = size;
+  _stats.allocated_bytes += block.size;
+  _stats.requested_bytes += size;
+  _stats.peak_allocated_bytes =
+      std::max(_stats.peak_allocated_bytes, _stats.allocated_bytes);
+  _active_blocks.emplace(block.ptr, block);
+  return block.ptr;
+}
+
+#ifdef LIGHTSEQ_cuda
+void MemoryPool::free_mem(char* ptr, cudaStream_t stream) {
+#else
+void MemoryPool::free_mem(char* ptr) {
+#endif
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto iter = _active_blocks.find(ptr);
+  if (iter == _active_blocks.end()) {
+    printf("memory pool free %p which is not allocated by it!\n", ptr);
+    throw std::runtime_error("memory pool free unknown address.\n");
+  }
+  Block block = iter->second;
+  _active_blocks.erase(iter);
+
+#ifdef LIGHTSEQ_cuda
+  if (block.event == nullptr) {
+    CHECK_GPU_ERROR(
+        cudaEventCreateWithFlags(&block.event, cudaEventDisableTiming));
+  }
+  CHECK_GPU_ERROR(cudaEventRecord(block.event, stream));
+  block.event_pending = true;
+  block.stream = stream;
+#endif
+
+  _stats.allocated_bytes -= block.size;
+  _stats.requested_bytes -= block.requested;
+  free_blocks(block.size).emplace(block.size, block);
+}
+
+void MemoryPool::empty_cache() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    release_cached_blocks();
+  }
+  trim_device_pool();
+}
+
+MemoryPoolStats MemoryPool::stats() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _stats;
+}
+
+void MemoryPool::reset_peak_stats() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _stats.peak_allocated_bytes = _stats.allocated_bytes;
+  _stats.peak_reserved_bytes = _stats.reserved_bytes;
+}
+
+void MemoryPool::print_stats() {
+  MemoryPoolStats s = stats();
+  printf(
+      "****** MemoryPool device %d: allocated %.2f MB (peak %.2f MB), "
+      "reserved %.2f MB (peak %.2f MB), fragmentation %.2f%%, "
+      "hit rate %.2f%% of %zu requests, device mallocs %zu ******\n",
+      _device_id, float(s.allocated_bytes) / MB_SIZE,
+      float(s.peak_allocated_bytes) / MB_SIZE,
+      float(s.reserved_bytes) / MB_SIZE, float(s.peak_reserved_bytes) / MB_SIZE,
+      s.fragmentation() * 100, s.hit_rate() * 100, s.num_requests,
+      s.num_device_mallocs);
+}
+
+#ifdef LIGHTSEQ_cuda
+VirtualBuffer::VirtualBuffer(size_t capacity) {
+  // the primary context of the device, which the driver api needs.
+  CHECK_GPU_ERROR(cudaFree(0));
+  CHECK_GPU_ERROR(cudaGetDevice(&_device_id));
+  CUmemAllocationProp prop = {};
+  prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+  prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  prop.location.id = _device_id;
+  CHECK_GPU_ERROR(cuMemGetAllocationGranularity(
+      &_granularity, &prop, CU_MEM_ALLOC_GRANULARITY_MINIMUM));
+  _capacity = (capacity + _granularity - 1) / _granularity * _granularity;
+  CHECK_GPU_ERROR(cuMemAddressReserve(&_base, _capacity, 0, 0, 0));
+  _chunks.assign(_capacity / _granularity, 0);
+}
+
+VirtualBuffer::~VirtualBuffer() {
+  // the kernels in flight may still use the mapped memory.
+  cudaDeviceSynchronize();
+  for (size_t chunk = 0; chunk < _chunks.size(); chunk++) {
+    if (_chunks[chunk] == 0) continue;
+    cuMemUnmap(_base + chunk * _granularity, _granularity);
+    cuMemRelease(_chunks[chunk]);
+  }
+  cuMemAddressFree(_base, _capacity);
+}
+
+bool VirtualBuffer::supported(int device_id) {
+  CUdevice device;
+  int supported = 0;
+  if (cuDeviceGet(&device, device_id) != CUDA_SUCCESS ||
+      cuDeviceGetAttribute(
+          &supported, CU_DEVICE_ATTRIBUTE_VIRTUAL_MEMORY_MANAGEMENT_SUPPORTED,
+          device) != CUDA_SUCCESS) {
+    return false;
+  }
+  return supported != 0;
+}
+
+void VirtualBuffer::map_chunk(size_t chunk) {
+  CUmemAllocationProp prop = {};
+  prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+  prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  prop.location.id = _device_id;
+  CUmemGenericAllocationHandle handle;
+  CHECK_GPU_ERROR(cuMemCreate(&handle, _granularity, &prop, 0));
+  CUdeviceptr addr = _base + chunk * _granularity;
+  CHECK_GPU_ERROR(cuMemMap(addr, _granularity, 0, handle, 0));
+  CUmemAccessDesc access = {};
+  access.location = prop.location;
+  access.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+  CHECK_GPU_ERROR(cuMemSetAccess(addr, _granularity, &access, 1));
+  _chunks[chunk] = handle;
+  _mapped_bytes += _granularity;
+}
+
+void VirtualBuffer::commit(size_t offset, size_t bytes, size_t count,
+                           size_t stride) {
+  if (bytes == 0) return;
+  for (size_t i = 0; i < count; i++) {
+    size_t begin = offset + i * stride;
+    if (begin + bytes > _capacity) {
+      throw std::runtime_error("commit beyond the capacity of VirtualBuffer");
+    }
+    for (size_t chunk = begin / _granularity;
+         chunk <= (begin + bytes - 1) / _granularity; chunk++) {
+      if (_chunks[chunk] == 0) map_chunk(chunk);
+    }
+  }
+}
+#endif
+
+Allocator::Allocator() { _ptr_map.clear(); }
 
 Allocator::~Allocator() {
-  auto _tmp_ptr_set = _ptr_set;
-  for (auto iter : _tmp_ptr_set) {
+  auto _tmp_ptr_map = _ptr_map;
+  for (auto iter : _tmp_ptr_map) {
     try {
-      free_mem(iter);
+      free_mem(iter.first);
     } catch (...) {
       // printf("execute ~Allocator() free_mem %p failed!\n", iter);
     }
   }
-  _ptr_set.clear();
+  _ptr_map.clear();
 }
 
 char* Allocator::malloc_mem(size_t size) {
   char* ptr = nullptr;
+  MemoryPool* pool = nullptr;
 
   try {
+    pool = MemoryPool::current();
 #ifdef LIGHTSEQ_cuda
-    ptr = cuda::cuda_malloc<char>(size);
+    ptr = pool->malloc_mem(size, _stream);
 #else
-    ptr = (char*)malloc(size);
+    ptr = pool->malloc_mem(size);
 #endif
   } catch (...) {
     std::string error_message =
@@ -32,23 +441,25 @@ char* Allocator::malloc_mem(size_t size) {
     printf("%s", error_message.c_str());
     throw std::runtime_error(error_message);
   }
-  if (_ptr_set.find(ptr) != _ptr_set.end()) {
+  if (_ptr_map.find(ptr) != _ptr_map.end()) {
     printf("allocate same address with twice.\n");
     throw std::runtime_error("allocate same address with twice.\n");
   }
-  _ptr_set.insert(ptr);
+  _ptr_map.emplace(ptr, pool);
   return ptr;
 }
 
 void Allocator::free_mem(char* ptr) {
-  if (_ptr_set.find(ptr) == _ptr_set.end() || ptr == nullptr) {
+  auto iter = _ptr_map.find(ptr);
+  if (iter == _ptr_map.end() || ptr == nullptr) {
     return;
   }
-  _ptr_set.erase(ptr);
+  MemoryPool* pool = iter->second;
+  _ptr_map.erase(iter);
 #ifdef LIGHTSEQ_cuda
-  cuda::cuda_free(ptr);
+  pool->free_mem(ptr, _stream);
 #else
-  free(ptr);
+  pool->free_mem(ptr);
 #endif
 }
 
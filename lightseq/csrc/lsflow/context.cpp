@@ -1,4 +1,10 @@
 #include "context.h"
+#include "scheduler.h"
+#include "profiler.h"
+#include "metrics.h"
+#include "cpu_threads.h"
+#include "fusion.h"
+#include <cstring>
 
 namespace lightseq {
 
@@ -10,13 +16,44 @@ Context::Context(StatusType status_type, int device_id)
   printf("Initial Context, status_type: %s\n", status_type_str().c_str());
 #ifdef LIGHTSEQ_cuda
   if (device_id >= 0) CHECK_GPU_ERROR(cudaSetDevice(device_id));
-  CHECK_GPU_ERROR(cudaStreamCreate(&_stream));
+  if (_scope_stream_priority == StreamPriority::kDefault) {
+    CHECK_GPU_ERROR(cudaStreamCreate(&_stream));
+  } else {
+    // the greatest priority is the lowest number.
+    int least_priority, greatest_priority;
+    CHECK_GPU_ERROR(
+        cudaDeviceGetStreamPriorityRange(&least_priority, &greatest_priority));
+    _stream_priority = _scope_stream_priority == StreamPriority::kHigh
+                           ? greatest_priority
+                           : least_priority;
+    CHECK_GPU_ERROR(cudaStreamCreateWithPriority(
+        &_stream, cudaStreamDefault, _stream_priority));
+  }
   CHECK_GPU_ERROR(cublasCreate(&_cublasHandle));
   CHECK_GPU_ERROR(cublasSetStream(_cublasHandle, _stream));
+  CHECK_GPU_ERROR(cublasLtCreate(&_cublasLtHandle));
+  _allocator_ptr->set_stream(_stream);
 #endif
+  _metrics_ptr.reset(new Metrics(this));
+  const char* fusion_env = std::getenv("LIGHTSEQ_GRAPH_FUSION");
+  if (fusion_env) _graph_fusion = std::string(fusion_env) != "0";
+  const char* flash_env = std::getenv("LIGHTSEQ_FLASH_ATTN_TRAIN");
+  if (flash_env) _flash_attention_train = std::string(flash_env) != "0";
+  const char* plan_env = std::getenv("LIGHTSEQ_PLAN_CACHE_DIR");
+  if (plan_env) _plan_cache_dir = plan_env;
 }
 
 Context::~Context() {
+#ifdef LIGHTSEQ_cuda
+  clear_graphs();
+#endif
+  free_one_shot_all_reduce();
+#ifdef LIGHTSEQ_cuda
+  if (_comm_stream) cudaStreamDestroy(_comm_stream);
+#endif
+#ifdef LIGHTSEQ_nccl
+  if (_nccl_comm) ncclCommDestroy(_nccl_comm);
+#endif
   for (auto& iter : _all_node_vec) {
     delete iter;
   }
@@ -26,6 +63,81 @@ Context::~Context() {
 void Context::set_stream(cudaStream_t stream) {
   _stream = stream;
   CHECK_GPU_ERROR(cublasSetStream(_cublasHandle, _stream));
+  _allocator_ptr->set_stream(_stream);
+  // graphs are launched on the stream they were captured for.
+  clear_graphs();
+}
+
+void Context::switch_compute_stream(cudaStream_t stream) {
+  _stream = stream;
+  CHECK_GPU_ERROR(cublasSetStream(_cublasHandle, _stream));
+  // the memory the operators allocate is used on their stream.
+  _allocator_ptr->set_stream(_stream);
+}
+
+void Context::graph_capture_begin() {
+  if (_capturing) {
+    printf("Error! graph_capture_begin is called during capturing.\n");
+    throw std::runtime_error("nested CUDA graph capture.");
+  }
+  CHECK_GPU_ERROR(
+      cudaStreamBeginCapture(_stream, cudaStreamCaptureModeThreadLocal));
+  _capturing = true;
+}
+
+void Context::graph_capture_end(const std::vector<int>& graph_key) {
+  if (!_capturing) {
+    printf("Error! graph_capture_end is called without capturing.\n");
+    throw std::runtime_error("CUDA graph capture is not started.");
+  }
+  _capturing = false;
+  GraphInstance instance;
+  CHECK_GPU_ERROR(cudaStreamEndCapture(_stream, &instance.graph));
+  CHECK_GPU_ERROR(cudaGraphInstantiate(&instance.graph_exec, instance.graph,
+                                       nullptr, nullptr, 0));
+  instance.plan_version = _mm_ptr->plan_version();
+
+  auto iter = _graphs.find(graph_key);
+  if (iter != _graphs.end()) {
+    CHECK_GPU_ERROR(cudaGraphExecDestroy(iter->second.graph_exec));
+    CHECK_GPU_ERROR(cudaGraphDestroy(iter->second.graph));
+    _graphs.erase(iter);
+  }
+  _graphs.emplace(graph_key, instance);
+}
+
+void Context::graph_capture_abort() {
+  if (!_capturing) return;
+  _capturing = false;
+  // the capture may already be invalidated, the stream still leaves the
+  // capture mode and the sticky error is cleared.
+  cudaGraph_t graph = nullptr;
+  cudaStreamEndCapture(_stream, &graph);
+  if (graph != nullptr) cudaGraphDestroy(graph);
+  cudaGetLastError();
+}
+
+bool Context::graph_replay(const std::vector<int>& graph_key) {
+  auto iter = _graphs.find(graph_key);
+  if (iter == _graphs.end()) {
+    return false;
+  }
+  if (iter->second.plan_version != _mm_ptr->plan_version()) {
+    CHECK_GPU_ERROR(cudaGraphExecDestroy(iter->second.graph_exec));
+    CHECK_GPU_ERROR(cudaGraphDestroy(iter->second.graph));
+    _graphs.erase(iter);
+    return false;
+  }
+  CHECK_GPU_ERROR(cudaGraphLaunch(iter->second.graph_exec, _stream));
+  return true;
+}
+
+void Context::clear_graphs() {
+  for (auto& iter : _graphs) {
+    CHECK_GPU_ERROR(cudaGraphExecDestroy(iter.second.graph_exec));
+    CHECK_GPU_ERROR(cudaGraphDestroy(iter.second.graph));
+  }
+  _graphs.clear();
 }
 #endif
 
@@ -37,6 +149,7 @@ void Context::convert_into_eval() {
 }
 
 int Context::create_global_context(StatusType status_type, int device_id) {
+  std::lock_guard<std::mutex> lock(_global_mutex);
   global_context_id++;
   std::shared_ptr<Context> new_context =
       std::make_shared<Context>(status_type, device_id);
@@ -46,6 +159,7 @@ int Context::create_global_context(StatusType status_type, int device_id) {
 }
 
 void Context::set_global_context(int context_id) {
+  std::lock_guard<std::mutex> lock(_global_mutex);
   auto iter = global_contexts_map.find(context_id);
   if (iter == global_contexts_map.end()) {
     printf("Error occured! context_id %d does not exist!\n", context_id);
@@ -55,9 +169,176 @@ void Context::set_global_context(int context_id) {
 }
 
 std::shared_ptr<Context> Context::global_instance() {
+  if (_scope_context_ptr) return _scope_context_ptr;
+  std::lock_guard<std::mutex> lock(_global_mutex);
   return _global_context_ptr;
 }
 
+void Context::switch_device() {
+#ifdef LIGHTSEQ_cuda
+  if (_device_id >= 0) CHECK_GPU_ERROR(cudaSetDevice(_device_id));
+#endif
+}
+
+void Context::init_tensor_parallel(int tp_rank, int tp_size,
+                                   const std::string& nccl_id_path) {
+  if (tp_size <= 1) return;
+  if (_built || !_all_node_vec.empty()) {
+    printf("Error! tensor parallelism must be set before building layers.\n");
+    throw std::runtime_error("tensor parallelism set after model creation.");
+  }
+  if (tp_rank < 0 || tp_rank >= tp_size) {
+    printf("Error! tensor parallel rank %d is out of [0, %d).\n", tp_rank,
+           tp_size);
+    throw std::runtime_error("invalid tensor parallel rank.");
+  }
+#ifdef LIGHTSEQ_nccl
+  ncclUniqueId nccl_id;
+  if (tp_rank == 0) {
+    CHECK_GPU_ERROR(ncclGetUniqueId(&nccl_id));
+    // written to a temporary file first, the rename makes it appear whole.
+    std::string tmp_path = nccl_id_path + ".tmp";
+    std::ofstream fout(tmp_path, std::ios::binary);
+    fout.write((const char*)&nccl_id, sizeof(nccl_id));
+    fout.close();
+    if (!fout || std::rename(tmp_path.c_str(), nccl_id_path.c_str()) != 0) {
+      printf("Error! can not write nccl id file %s\n", nccl_id_path.c_str());
+      throw std::runtime_error("can not write nccl id file.");
+    }
+  } else {
+    while (true) {
+      std::ifstream fin(nccl_id_path, std::ios::binary);
+      if (fin.read((char*)&nccl_id, sizeof(nccl_id))) break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  }
+  CHECK_GPU_ERROR(ncclCommInitRank(&_nccl_comm, tp_size, nccl_id, tp_rank));
+  _nccl_id = nccl_id;
+  // all the ranks have read the id once the communicator is up, the file
+  // must not be found by a later launch with the same path.
+  if (tp_rank == 0) std::remove(nccl_id_path.c_str());
+  _tp_rank = tp_rank;
+  _tp_size = tp_size;
+  printf("*** tensor parallel rank %d of %d ***\n", tp_rank, tp_size);
+#else
+  printf("Error! tensor parallelism needs lightseq built with USE_NCCL.\n");
+  throw std::runtime_error("lightseq is built without nccl.");
+#endif
+}
+
+void Context::init_one_shot_all_reduce(size_t max_bytes,
+                                       const std::string& ipc_path) {
+  if (_tp_size <= 1 || max_bytes == 0) return;
+#ifdef LIGHTSEQ_nccl
+  free_one_shot_all_reduce();
+  // of whole vectors of the kernel
+  max_bytes = (max_bytes + 15) / 16 * 16;
+  size_t workspace_bytes = cuda::one_shot_workspace_bytes(max_bytes, _tp_size);
+  size_t epochs_bytes = cuda::kOneShotBlocks * sizeof(unsigned int);
+  CHECK_GPU_ERROR(cudaMalloc(&_one_shot_workspace, workspace_bytes));
+  CHECK_GPU_ERROR(cudaMemset(_one_shot_workspace, 0, workspace_bytes));
+  CHECK_GPU_ERROR(cudaMalloc(&_one_shot_epochs, epochs_bytes));
+  CHECK_GPU_ERROR(cudaMemset(_one_shot_epochs, 0, epochs_bytes));
+  // the flags are zeros before any rank can map them.
+  CHECK_GPU_ERROR(cudaDeviceSynchronize());
+
+  cudaIpcMemHandle_t handle;
+  CHECK_GPU_ERROR(cudaIpcGetMemHandle(&handle, _one_shot_workspace));
+  std::string path = ipc_path + "." + std::to_string(_tp_rank);
+  std::string tmp_path = path + ".tmp";
+  // the nccl id of the launch tells the handle from a stale one of a previous
+  // launch with the same path.
+  std::ofstream fout(tmp_path, std::ios::binary);
+  fout.write((const char*)&_nccl_id, sizeof(_nccl_id));
+  fout.write((const char*)&handle, sizeof(handle));
+  fout.close();
+  if (!fout || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    printf("Error! can not write cuda ipc handle file %s\n", path.c_str());
+    throw std::runtime_error("can not write cuda ipc handle file.");
+  }
+
+  _one_shot_peers.assign(_tp_size, nullptr);
+  _one_shot_peers[_tp_rank] = _one_shot_workspace;
+  int mapped = 1;
+  for (int r = 0; r < _tp_size; r++) {
+    if (r == _tp_rank) continue;
+    std::string peer_path = ipc_path + "." + std::to_string(r);
+    cudaIpcMemHandle_t peer_handle;
+    while (true) {
+      std::ifstream fin(peer_path, std::ios::binary);
+      ncclUniqueId peer_id;
+      if (fin.read((char*)&peer_id, sizeof(peer_id)) &&
+          fin.read((char*)&peer_handle, sizeof(peer_handle)) &&
+          std::memcmp(&peer_id, &_nccl_id, sizeof(peer_id)) == 0) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    if (cudaIpcOpenMemHandle((void**)&_one_shot_peers[r], peer_handle,
+                             cudaIpcMemLazyEnablePeerAccess) != cudaSuccess) {
+      cudaGetLastError();
+      _one_shot_peers[r] = nullptr;
+      mapped = 0;
+    }
+  }
+
+  // on all the ranks or none of them
+  int* mapped_dev;
+  CHECK_GPU_ERROR(cudaMalloc(&mapped_dev, sizeof(int)));
+  CHECK_GPU_ERROR(
+      cudaMemcpy(mapped_dev, &mapped, sizeof(int), cudaMemcpyHostToDevice));
+  CHECK_GPU_ERROR(ncclAllReduce(mapped_dev, mapped_dev, 1, ncclInt32, ncclMin,
+                                _nccl_comm, _stream));
+  CHECK_GPU_ERROR(
+      cudaMemcpy(&mapped, mapped_dev, sizeof(int), cudaMemcpyDeviceToHost));
+  CHECK_GPU_ERROR(cudaFree(mapped_dev));
+  // all the ranks have read the handles past the all-reduce.
+  std::remove(path.c_str());
+  if (!mapped) {
+    printf("one-shot all-reduce is off, a rank can not map the workspaces of "
+           "the others.\n");
+    free_one_shot_all_reduce();
+    return;
+  }
+
+  CHECK_GPU_ERROR(cudaMalloc(&_one_shot_peers_dev, _tp_size * sizeof(char*)));
+  CHECK_GPU_ERROR(cudaMemcpy(_one_shot_peers_dev, _one_shot_peers.data(),
+                             _tp_size * sizeof(char*),
+                             cudaMemcpyHostToDevice));
+  _one_shot_bytes = max_bytes;
+  printf("*** one-shot all-reduce of at most %zu bytes ***\n", max_bytes);
+#endif
+}
+
+#ifdef LIGHTSEQ_cuda
+cudaStream_t Context::comm_stream() {
+  if (_comm_stream == nullptr) {
+    CHECK_GPU_ERROR(
+        cudaStreamCreateWithPriority(&_comm_stream, cudaStreamNonBlocking,
+                                     _stream_priority));
+  }
+  return _comm_stream;
+}
+#endif
+
+void Context::free_one_shot_all_reduce() {
+#ifdef LIGHTSEQ_cuda
+  for (int r = 0; r < _one_shot_peers.size(); r++) {
+    if (r != _tp_rank && _one_shot_peers[r]) {
+      cudaIpcCloseMemHandle(_one_shot_peers[r]);
+    }
+  }
+  _one_shot_peers.clear();
+  if (_one_shot_workspace) cudaFree(_one_shot_workspace);
+  if (_one_shot_epochs) cudaFree(_one_shot_epochs);
+  if (_one_shot_peers_dev) cudaFree(_one_shot_peers_dev);
+  _one_shot_workspace = nullptr;
+  _one_shot_epochs = nullptr;
+  _one_shot_peers_dev = nullptr;
+  _one_shot_bytes = 0;
+#endif
+}
+
 void Context::update_node_idx() {
   if (_built) return;
   _node_idx++;
@@ -105,6 +386,8 @@ void Context::build() {
     return;
   }
   _building = true;
+  // the operators created by the graph fusion belong to this context.
+  ContextScope context_scope(shared_from_this());
 
   printf(
       "========== start Lightseq Context build, StatusType: %s, OpType_: %d "
@@ -116,6 +399,38 @@ void Context::build() {
     exit(-1);
   }
 
+#if ONLY_OP == false
+  // the operators of ONLY_OP are run one by one, they are never fused.
+  if (is_inference() && _graph_fusion) run_graph_fusion();
+#endif
+
+  size_t signature = plan_signature();
+  std::string plan_path = plan_cache_path(signature);
+  if (!plan_path.empty() && _mm_ptr->load_plan(plan_path, signature)) {
+    printf("Load the memory plan from %s\n", plan_path.c_str());
+  } else {
+    plan_memory();
+    if (!plan_path.empty()) {
+      std::string command = "mkdir -p " + _plan_cache_dir;
+      system(command.c_str());
+      _mm_ptr->save_plan(plan_path, signature);
+    }
+  }
+  _built = true;
+
+  synchronize();
+
+#ifdef DEBUG_MODE
+  // draw_all_context();
+#endif
+#ifdef MEM_DEBUG
+  MemoryPool::current()->print_stats();
+#endif
+  printf("===== finish Lightseq Context build, StatusType: %s ==========\n\n",
+         status_type_str().c_str());
+}
+
+void Context::plan_memory() {
   printf(
       "Please pay attention to whether the build order of the layer is "
       "consistent with the actual execution order.\n");
@@ -180,15 +495,49 @@ void Context::build() {
   }
 
   _mm_ptr->calculate_buffer_();
-  _built = true;
+}
 
-  synchronize();
+size_t Context::plan_signature() {
+  size_t seed = _mm_ptr->tensor_signature();
+  // the edges tell the graph with and without fusion apart.
+  for (Node* node : _all_node_vec) {
+    for (size_t value : {std::hash<std::string>()(node->name()),
+                         node->parents().size(), node->children().size()}) {
+      seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    }
+  }
+  return seed;
+}
 
-#ifdef DEBUG_MODE
-  // draw_all_context();
+std::string Context::plan_cache_path(size_t signature) {
+#if ONLY_OP == true
+  return "";
+#else
+  // training records the backward too, it is always planned.
+  if (!is_inference() || _plan_cache_dir.empty()) return "";
+  char file_name[64];
+  snprintf(file_name, sizeof(file_name), "plan_%016zx.txt", signature);
+  return _plan_cache_dir + "/" + file_name;
 #endif
-  printf("===== finish Lightseq Context build, StatusType: %s ==========\n\n",
-         status_type_str().c_str());
+}
+
+void Context::run_graph_fusion() {
+  std::map<std::string, int> fused = GraphFusion::run(_all_node_vec);
+  for (auto& iter : fused) {
+    printf("Graph fusion: %d x %s\n", iter.second, iter.first.c_str());
+  }
+}
+
+bool Context::is_layer_output(Variable* var) {
+  for (Layer* lyr : _all_layers) {
+    for (Variable* iter : lyr->outputs()) {
+      if (iter == var) return true;
+    }
+    for (Variable* iter : lyr->inputs()) {
+      if (iter == var) return true;
+    }
+  }
+  return false;
 }
 
 bool Context::check_validate() {
@@ -282,6 +631,61 @@ void Context::synchronize() {
   return;
 }
 
+void Context::suspend() {
+  if (!_built || is_suspended()) {
+    return;
+  }
+  switch_device();
+  synchronize();
+#ifdef LIGHTSEQ_cuda
+  clear_graphs();
+#endif
+  _mm_ptr->release_buffers();
+  MemoryPool::current()->empty_cache();
+}
+
+void Context::resume() {
+  if (!is_suspended()) {
+    return;
+  }
+  switch_device();
+  _mm_ptr->reacquire_buffers();
+}
+
+void Context::enable_multi_stream(int num_streams) {
+#ifdef LIGHTSEQ_cuda
+  if (_scheduler_ptr && _scheduler_ptr->in_scope()) {
+    printf("Error! enable_multi_stream is called during layer forward.\n");
+    throw std::runtime_error("switch stream scheduler during forward.");
+  }
+  if (num_streams <= 1) {
+    _scheduler_ptr.reset();
+    return;
+  }
+  _scheduler_ptr.reset(new StreamScheduler(this, num_streams));
+#else
+  printf("multi stream execution is only supported on cuda, ignored.\n");
+#endif
+}
+
+void Context::enable_profiling(bool enable) {
+  if (!enable) {
+    _profiler_ptr.reset();
+    return;
+  }
+  if (!_profiler_ptr) {
+    _profiler_ptr.reset(new Profiler(this));
+  }
+}
+
+void Context::set_cpu_threads(int num_threads, int numa_node) {
+#if defined LIGHTSEQ_x86 || defined LIGHTSEQ_arm
+  _cpu_threads_ptr.reset(new CpuThreadGroup(num_threads, numa_node));
+#else
+  printf("cpu threads are only used by the cpu backends, ignored.\n");
+#endif
+}
+
 std::shared_ptr<void> Context::get_pybind_layer(std::string layer_name,
                                                 int layer_id) {
   std::string full_name = layer_name + std::to_string(layer_id);
@@ -297,6 +701,10 @@ std::shared_ptr<void> Context::get_pybind_layer(std::string layer_name,
 }
 
 std::shared_ptr<Context> Context::_global_context_ptr = nullptr;
+thread_local std::shared_ptr<Context> Context::_scope_context_ptr = nullptr;
+thread_local StreamPriority Context::_scope_stream_priority =
+    StreamPriority::kDefault;
+std::mutex Context::_global_mutex;
 std::unordered_map<std::string, std::shared_ptr<void>> Context::pybind_layers =
     {};
 std::unordered_map<int, std::shared_ptr<Context>> Context::global_contexts_map =
@@ -0,0 +1,102 @@
+#include "cpu_threads.h"
+
+#include "atomic"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace lightseq {
+
+namespace {
+
+std::atomic<int> next_group_id{0};
+// the group last applied to the thread, -1 for none.
+thread_local int applied_group_id = -1;
+
+#ifdef __linux__
+void pin_current_thread(int cpu) {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(cpu, &cpu_set);
+  if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+    printf("Warning! can not pin the thread to cpu %d\n", cpu);
+  }
+}
+#endif
+
+}  // namespace
+
+CpuThreadGroup::CpuThreadGroup(int num_threads, int numa_node)
+    : _num_threads(num_threads),
+      _numa_node(numa_node),
+      _group_id(next_group_id++) {
+  if (numa_node >= 0) {
+    _cpus = numa_node_cpus(numa_node);
+    if (_cpus.empty()) {
+      printf("Error! numa node %d has no cpus\n", numa_node);
+      exit(-1);
+    }
+  }
+  if (_num_threads <= 0) {
+    _num_threads = _cpus.empty()
+                       ? std::max(1u, std::thread::hardware_concurrency())
+                       : _cpus.size();
+  }
+  // more threads than cpus would only be descheduled by each other.
+  if (!_cpus.empty() && _num_threads > (int)_cpus.size()) {
+    printf("numa node %d has %zu cpus, use %zu threads instead of %d\n",
+           numa_node, _cpus.size(), _cpus.size(), _num_threads);
+    _num_threads = _cpus.size();
+  }
+}
+
+std::vector<int> CpuThreadGroup::numa_node_cpus(int numa_node) {
+  // a list of ranges, eg. "0-15,32-47"
+  std::string path = "/sys/devices/system/node/node" +
+                     std::to_string(numa_node) + "/cpulist";
+  std::ifstream fin(path);
+  std::vector<int> cpus;
+  std::string range;
+  while (std::getline(fin, range, ',')) {
+    size_t dash = range.find('-');
+    try {
+      int first = std::stoi(range.substr(0, dash));
+      int last =
+          dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    } catch (const std::exception&) {
+      break;
+    }
+  }
+  return cpus;
+}
+
+void CpuThreadGroup::pin_team() {
+#ifdef __linux__
+  pin_current_thread(_cpus[0]);
+#ifdef _OPENMP
+  // the team of the calling thread is kept by OpenMP between the parallel
+  // regions of the same size, each member pins itself once.
+#pragma omp parallel num_threads(_num_threads)
+  pin_current_thread(_cpus[omp_get_thread_num() % _cpus.size()]);
+#endif
+#endif
+}
+
+void CpuThreadGroup::enter() {
+  if (applied_group_id == _group_id) return;
+  applied_group_id = _group_id;
+#ifdef _OPENMP
+  omp_set_num_threads(_num_threads);
+#endif
+#ifdef LIGHTSEQ_x86
+  x86::set_gemm_num_threads(_num_threads);
+#endif
+  if (!_cpus.empty()) pin_team();
+}
+
+}  // namespace lightseq
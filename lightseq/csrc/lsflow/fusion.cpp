@@ -0,0 +1,30 @@
+#include "fusion.h"
+#include "node.h"
+
+namespace lightseq {
+
+std::vector<std::pair<std::string, GraphFusion::Rule>>& GraphFusion::rules() {
+  // constructed on first use, the rules are registered by static objects of
+  // the operator library.
+  static std::vector<std::pair<std::string, Rule>> res;
+  return res;
+}
+
+void GraphFusion::register_rule(const std::string& pattern, Rule rule) {
+  rules().emplace_back(pattern, rule);
+}
+
+std::map<std::string, int> GraphFusion::run(const std::vector<Node*>& nodes) {
+  std::map<std::string, int> res;
+  // a rule only adds edges between existing nodes, the vector is stable.
+  for (Node* node : nodes) {
+    if (node->node_type() != NodeType::Operator) continue;
+    Operator* op = static_cast<Operator*>(node);
+    for (auto& rule : rules()) {
+      if (rule.second(op)) res[rule.first]++;
+    }
+  }
+  return res;
+}
+
+}  // namespace lightseq
@@ -2,19 +2,230 @@
   Copyright (c) 2022 - 2023, Bytedance, The LightSeq Team
 */
 #pragma once
+#include "map"
+#include "mutex"
+#include "unordered_map"
+#include "vector"
+
 #include "declaration.h"
 
 namespace lightseq {
 
+/*
+  Struct: MemoryPoolStats
+  Description:
+    Counters of a MemoryPool. allocated_bytes is the memory currently handed
+    out to callers, reserved_bytes additionally includes the blocks cached by
+    the pool for reuse.
+*/
+struct MemoryPoolStats {
+  size_t allocated_bytes = 0;
+  size_t requested_bytes = 0;
+  size_t reserved_bytes = 0;
+  size_t peak_allocated_bytes = 0;
+  size_t peak_reserved_bytes = 0;
+  size_t num_requests = 0;
+  size_t num_cache_hits = 0;
+  size_t num_device_mallocs = 0;
+
+  // Ratio of requests served from cached blocks.
+  double hit_rate() const {
+    return num_requests ? double(num_cache_hits) / num_requests : 0.;
+  }
+
+  // Ratio of reserved memory which does not back a live request, including
+  // both cached blocks and the rounding waste of live blocks.
+  double fragmentation() const {
+    return reserved_bytes ? 1. - double(requested_bytes) / reserved_bytes : 0.;
+  }
+};
+
+/*
+  Class: MemoryPool
+  Description:
+    A size-class caching allocator shared by all the Contexts on the same
+    device. Freed blocks are kept in the pool and handed out again to later
+    requests of a similar size, so that loading and unloading models does not
+    fragment device memory or pay for an implicit device synchronization on
+    every cudaMalloc/cudaFree.
+
+    Small requests (<= 1MB) are rounded up to multiples of 512 bytes and large
+    ones to multiples of 2MB. Small and large blocks live in separate free
+    lists, and a cached block is only reused when the waste it introduces is
+    bounded.
+
+    Reuse is stream ordered: when a block is released, an event is recorded
+    on the releasing stream, and a different stream picking the block up later
+    waits on that event before touching the memory. Device memory itself is
+    obtained with cudaMallocAsync from the device's default memory pool when
+    the driver supports it, which keeps even the raw allocations free of
+    device-wide synchronization.
+
+    Pool instances are intentionally never destroyed, since releasing device
+    memory during static destruction races with the CUDA runtime teardown.
+
+    On the cpu backends the blocks are host memory aligned to 64 bytes, a
+    cache line and an AVX-512 register. The large blocks are aligned to 2MB
+    and backed by huge pages, which cuts the TLB misses of the large
+    activation buffer of the MemoryManager, by default transparent ones
+    through madvise. LIGHTSEQ_HUGE_PAGES=explicit maps them from the
+    reserved huge pages of the host (MAP_HUGETLB), falling back to
+    transparent ones when there are not enough, and LIGHTSEQ_HUGE_PAGES=none
+    disables both. The pages of a new block are first touched by the OpenMP
+    team of the allocating thread, so with a pinned CpuThreadGroup they are
+    placed on the numa node of the team.
+*/
+class MemoryPool {
+ private:
+  struct Block {
+    char* ptr = nullptr;
+    size_t size = 0;
+    size_t requested = 0;
+#ifdef LIGHTSEQ_cuda
+    cudaStream_t stream = 0;
+    cudaEvent_t event = nullptr;
+    bool event_pending = false;
+#else
+    // mapped from the explicit huge pages.
+    bool mmapped = false;
+#endif
+  };
+
+  static const size_t kSmallSize = 1 << 20;
+  static const size_t kSmallRound = 512;
+  static const size_t kLargeRound = 2 << 20;
+
+  int _device_id;
+  std::mutex _mutex;
+  std::multimap<size_t, Block> _small_blocks;
+  std::multimap<size_t, Block> _large_blocks;
+  std::unordered_map<char*, Block> _active_blocks;
+  MemoryPoolStats _stats;
+
+#ifdef LIGHTSEQ_cuda
+  bool _use_async_malloc = false;
+#else
+  enum class HugePages { kNone, kTransparent, kExplicit };
+  HugePages _huge_pages = HugePages::kTransparent;
+
+  static const size_t kHostAlignment = 64;
+  static const size_t kHugePageSize = 2 << 20;
+
+  char* host_malloc(size_t size, Block* block);
+#endif
+
+  explicit MemoryPool(int device_id);
+
+  static size_t round_size(size_t size);
+  static size_t max_waste(size_t rounded_size);
+
+  std::multimap<size_t, Block>& free_blocks(size_t rounded_size) {
+    return rounded_size <= kSmallSize ? _small_blocks : _large_blocks;
+  }
+
+  char* device_malloc(size_t size, Block* block);
+  void device_free(Block* block);
+  void release_cached_blocks();
+  void trim_device_pool();
+
+ public:
+  MemoryPool(const MemoryPool&) = delete;
+  MemoryPool& operator=(const MemoryPool&) = delete;
+
+  // Return the pool of the device, create it if it does not exist yet.
+  static MemoryPool* instance(int device_id);
+
+  // The pool of the current device.
+  static MemoryPool* current();
+
+#ifdef LIGHTSEQ_cuda
+  char* malloc_mem(size_t size, cudaStream_t stream);
+  void free_mem(char* ptr, cudaStream_t stream);
+#else
+  char* malloc_mem(size_t size);
+  void free_mem(char* ptr);
+#endif
+
+  // Return all cached blocks to the device and trim the driver pool, so the
+  // memory is available to other processes. Blocks still in use are not
+  // affected.
+  void empty_cache();
+
+  MemoryPoolStats stats();
+  void reset_peak_stats();
+  void print_stats();
+
+  int device_id() const { return _device_id; }
+};
+
+#ifdef LIGHTSEQ_cuda
+/*
+  Class: VirtualBuffer
+  Description:
+    A device buffer of a fixed address whose physical memory grows on demand.
+    The capacity is reserved as virtual address space (cuMemAddressReserve),
+    and a chunk of the allocation granularity, 2MB on current gpus, is only
+    backed by physical memory (cuMemCreate, cuMemMap) once a range in it is
+    committed. So a buffer of the max shapes, eg. a kv cache, takes the
+    memory of what has been used so far, and the kernels still see one
+    contiguous buffer. The committed chunks stay mapped until destruction,
+    the physical memory is the high watermark of the committed ranges.
+
+    The physical memory is not taken from the MemoryPool.
+*/
+class VirtualBuffer {
+ private:
+  int _device_id = 0;
+  size_t _granularity = 0;
+  size_t _capacity = 0;
+  CUdeviceptr _base = 0;
+  // the physical allocation of every chunk, 0 if not mapped yet.
+  std::vector<CUmemGenericAllocationHandle> _chunks;
+  size_t _mapped_bytes = 0;
+
+  void map_chunk(size_t chunk);
+
+ public:
+  explicit VirtualBuffer(size_t capacity);
+  VirtualBuffer(const VirtualBuffer&) = delete;
+  VirtualBuffer& operator=(const VirtualBuffer&) = delete;
+  ~VirtualBuffer();
+
+  // Whether the device supports the virtual memory management.
+  static bool supported(int device_id);
+
+  char* ptr() { return (char*)_base; }
+  size_t capacity() const { return _capacity; }
+  size_t mapped_bytes() const { return _mapped_bytes; }
+
+  // Back the count ranges of bytes at offset + i * stride with physical
+  // memory, eg. the first tokens of every head of a [batch_size, head_num,
+  // max_step, dim_per_head] cache. Only the chunks not mapped yet cost a
+  // driver call, the others a lookup.
+  void commit(size_t offset, size_t bytes, size_t count = 1,
+              size_t stride = 0);
+};
+#endif
+
 class Allocator {
  private:
-  std::unordered_set<char*> _ptr_set;
+  // The pool every live pointer was taken from.
+  std::unordered_map<char*, MemoryPool*> _ptr_map;
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t _stream = 0;
+#endif
 
  public:
   Allocator();
   virtual ~Allocator();
   char* malloc_mem(size_t size);
   void free_mem(char* ptr);
+
+#ifdef LIGHTSEQ_cuda
+  // The stream on which the allocated memory is used, which decides the
+  // ordering of block reuse in the memory pool.
+  void set_stream(cudaStream_t stream) { _stream = stream; }
+#endif
 };
 
 }  // namespace lightseq
@@ -7,6 +7,7 @@
 #include "deque"
 #include "stack"
 #include "unordered_map"
+#include "mutex"
 
 #include "declaration.h"
 #include "manager.h"
@@ -15,6 +16,12 @@
 
 namespace lightseq {
 
+// The priority of the streams of a context, for the models sharing a gpu:
+// the kernels of a kHigh one are scheduled first whenever both have work
+// queued, so that a latency critical model is not starved by a batch job at
+// kLow, see cudaStreamCreateWithPriority.
+enum class StreamPriority { kDefault, kHigh, kLow };
+
 /*
   - Class:  Context
   - Description:
@@ -32,8 +39,14 @@ namespace lightseq {
       At the same time, a context object also corresponds to a MemoryManager
   object and an Allocator object, which manages the memory development and
   allocation of the entire model.
+
+      The layers, operators and tensors attach to the context of the
+  ContextScope of the thread creating them, or to the global context outside
+  of any scope. A model owns its context and creates its graph in a scope of
+  it, the forward only goes through the pointers kept by the nodes, so
+  models on different threads do not share any mutable state.
 */
-class Context {
+class Context : public std::enable_shared_from_this<Context> {
  private:
   // just for pybind interface.
   static std::unordered_map<std::string, std::shared_ptr<void>> pybind_layers;
@@ -55,15 +68,62 @@ class Context {
   int _device_id;
 
   static std::shared_ptr<Context> _global_context_ptr;
+  // the context of the innermost ContextScope of the thread.
+  static thread_local std::shared_ptr<Context> _scope_context_ptr;
+  // the priority of the streams of the contexts created by the thread, see
+  // StreamPriorityScope.
+  static thread_local StreamPriority _scope_stream_priority;
 
   bool check_validate();
 
+  // guards the global context and the contexts of the ids.
+  static std::mutex _global_mutex;
   static std::unordered_map<int, std::shared_ptr<Context>> global_contexts_map;
   static int global_context_id;
 
   int _regress_begin_idx = -1;
   int _regress_end_idx = -1;
   bool _in_regress = false;
+  bool _in_recompute = false;
+  bool _mask_free_dropout = false;
+  bool _capturable = false;
+  bool _accumulate_weight_grads = false;
+  bool _fp8_training = false;
+  int _fp8_amax_history_len = 16;
+  bool _graph_fusion = true;
+  bool _flash_attention_train = true;
+  std::string _plan_cache_dir;
+
+  void run_graph_fusion();
+  // the lifetime recording forward and calculate_buffer_.
+  void plan_memory();
+  size_t plan_signature();
+  std::string plan_cache_path(size_t signature);
+
+  StreamSchedulerPtr _scheduler_ptr = nullptr;
+  ProfilerPtr _profiler_ptr = nullptr;
+  MetricsPtr _metrics_ptr = nullptr;
+  CpuThreadGroupPtr _cpu_threads_ptr = nullptr;
+
+  int _tp_rank = 0;
+  int _tp_size = 1;
+#ifdef LIGHTSEQ_nccl
+  ncclComm_t _nccl_comm = nullptr;
+  // of the launch, tags the files of init_one_shot_all_reduce.
+  ncclUniqueId _nccl_id;
+#endif
+  bool _tp_all_reduce_int8 = false;
+  int _tp_overlap_chunks = 1;
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t _comm_stream = nullptr;
+#endif
+  // the one-shot all-reduce, see init_one_shot_all_reduce.
+  size_t _one_shot_bytes = 0;
+  char* _one_shot_workspace = nullptr;
+  std::vector<char*> _one_shot_peers;
+  char** _one_shot_peers_dev = nullptr;
+  unsigned int* _one_shot_epochs = nullptr;
+  void free_one_shot_all_reduce();
 
  public:
   Context(StatusType status_type = StatusType::Inference, int device_id = 0);
@@ -74,9 +134,13 @@ class Context {
   void convert_into_train();
   void convert_into_eval();
 
-  // Create a process-level global object
+  // Create a process-level global object, kept alive under the returned id,
+  // for the pybind layers. The models own a context of their own instead,
+  // see ContextScope.
   static int create_global_context(
       StatusType status_type = StatusType::Inference, int device_id = -1);
+  // The context of the ContextScope of the calling thread, the global one
+  // outside of any scope.
   static std::shared_ptr<Context> global_instance();
   static void set_global_context(int context_id);
   static bool global_is_inference() {
@@ -131,6 +195,75 @@ class Context {
   void update_regr_end(int node_idx);
   bool in_regress() { return _in_regress; }
 
+  // Mark the forward replayed by a recomputed layer in its backward, see
+  // Layer::set_recompute(). Operators drawing random numbers, like dropout,
+  // must reproduce the ones of the original forward.
+  void recompute_begin() { _in_recompute = true; }
+  void recompute_end() { _in_recompute = false; }
+  bool in_recompute() { return _in_recompute; }
+
+  // The dropout operators created afterwards store no mask for backward, they
+  // keep the seed of their forward and the backward kernels redraw the mask
+  // from it, see launch_ls_dropout. Saves one byte per dropped element.
+  void set_mask_free_dropout(bool mask_free) { _mask_free_dropout = mask_free; }
+  bool mask_free_dropout() { return _mask_free_dropout; }
+
+  // The layers of training created afterwards can be captured into a cuda
+  // graph with their optimizer step, eg. by torch.cuda.graph: the dropout
+  // operators fix their seed at creation and advance a device counter on the
+  // stream in every forward, see ls_dropout_key, so a replay draws fresh
+  // masks with no host state. The shapes of a graph are static, one graph
+  // per length bucket.
+  void set_capturable(bool capturable) { _capturable = capturable; }
+  bool capturable() { return _capturable; }
+
+  // The weight grad gemms of the LinearOps add onto the grads of the weights
+  // in the next backward instead of overwriting them, for the micro batches
+  // of a gradient accumulation but the first one. The grads of the other
+  // operators still overwrite.
+  void set_accumulate_weight_grads(bool accumulate) {
+    _accumulate_weight_grads = accumulate;
+  }
+  bool accumulate_weight_grads() { return _accumulate_weight_grads; }
+
+  // The LinearOps of training created afterwards run their gemms in fp8,
+  // e4m3 activations and weights and e5m2 grads, with the delayed scaling
+  // of the amax of the last amax_history_len steps of every tensor, see
+  // launch_fp8_update_scales. Needs a sm_89 or later GPU.
+  void set_fp8_training(bool enable, int amax_history_len = 16) {
+    _fp8_training = enable;
+    _fp8_amax_history_len = amax_history_len;
+  }
+  bool fp8_training() { return _fp8_training; }
+  int fp8_amax_history_len() { return _fp8_amax_history_len; }
+
+  // Fuse the operator chains matched by the rules of GraphFusion when an
+  // inference context is built, on by default unless LIGHTSEQ_GRAPH_FUSION
+  // is 0. Must be set before the build.
+  void set_graph_fusion(bool enable) { _graph_fusion = enable; }
+  bool graph_fusion() { return _graph_fusion; }
+
+  // The SDPALayers of training created afterwards run the flash attention
+  // forward and backward, which recompute the attention probabilities
+  // rather than storing them, when their head_dim is supported, see
+  // launch_flash_attention_bw. On by default unless
+  // LIGHTSEQ_FLASH_ATTN_TRAIN is 0.
+  void set_flash_attention_train(bool enable) {
+    _flash_attention_train = enable;
+  }
+  bool flash_attention_train() { return _flash_attention_train; }
+
+  // Keep the memory plan of an inference context in dir, so that the next
+  // instance of the same model, in this process or another one, loads it
+  // rather than planning again, see MemoryManager::save_plan. The file is
+  // named by a hash of the nodes and of the shared tensors, a model of
+  // another config or precision gets its own. LIGHTSEQ_PLAN_CACHE_DIR by
+  // default, empty turns it off. Must be set before the build.
+  void set_plan_cache_dir(const std::string& dir) { _plan_cache_dir = dir; }
+
+  // Whether var is an input or output of a layer, which a fusion keeps.
+  bool is_layer_output(Variable* var);
+
   std::string status_type_str() { return StatusTypeString[_status_type]; }
 
   // Register model-level global resources in the context object, which is
@@ -145,6 +278,93 @@ class Context {
   // processing or debug mode.
   void synchronize();
 
+  // Give the shared buffers of a built context, the activations and the kv
+  // caches, back to the memory pool, which returns its cached blocks to the
+  // device, so that the other processes of a shared gpu may use them while
+  // the model is idle. The weights and the nodes stay, resume() allocates
+  // the active memory plan again, and the graphs are captured again since
+  // the tensors get new addresses. The contents of the buffers are lost.
+  void suspend();
+  void resume();
+  bool is_suspended() const { return _mm_ptr->buffers_released(); }
+
+  // Dispatch the independent operators inside each layer to num_streams
+  // streams, see StreamScheduler. num_streams <= 1 restores the single stream
+  // execution.
+  void enable_multi_stream(int num_streams);
+  StreamScheduler* stream_scheduler() { return _scheduler_ptr.get(); }
+
+  // Time every operator executed after the context is built, see Profiler.
+  // Disabling drops the collected records.
+  void enable_profiling(bool enable);
+  Profiler* profiler() { return _profiler_ptr.get(); }
+
+  // The always-on runtime metrics of the context, see Metrics.
+  Metrics* metrics() { return _metrics_ptr.get(); }
+
+  // Run the cpu kernels of the context with num_threads threads, pinned to
+  // the cpus of numa_node unless it is -1, see CpuThreadGroup. num_threads
+  // <= 0 takes all the cpus of the node. Only for the x86 and arm backends.
+  void set_cpu_threads(int num_threads, int numa_node = -1);
+  CpuThreadGroup* cpu_threads() { return _cpu_threads_ptr.get(); }
+
+  // Tensor parallelism: tp_size contexts, one per device and usually one per
+  // process, split the heads and the ffn of every layer and all-reduce the
+  // partial outputs, see AllReduceOp. Rank 0 publishes the nccl unique id
+  // in the file nccl_id_path, which must be unique to the launch, the other
+  // ranks wait for it, and removes it once the communicator of all the
+  // ranks is up. Must be called before the layers are created, needs
+  // lightseq built with USE_NCCL when tp_size > 1.
+  void init_tensor_parallel(int tp_rank, int tp_size,
+                            const std::string& nccl_id_path);
+  int tp_rank() const { return _tp_rank; }
+  int tp_size() const { return _tp_size; }
+#ifdef LIGHTSEQ_nccl
+  ncclComm_t nccl_comm() const { return _nccl_comm; }
+#endif
+
+  // The tensor parallel all-reduces of inference quantize the partial
+  // outputs to int8 for the communication, with one scale per token, which
+  // halves the traffic of fp16 at the cost of a rounding twice, see
+  // AllReduceOp. For the large messages of the prefill on PCIe gpus.
+  void set_tp_all_reduce_int8(bool enable) { _tp_all_reduce_int8 = enable; }
+  bool tp_all_reduce_int8() const { return _tp_all_reduce_int8; }
+  // The row parallel linears of the prefill split their gemm into
+  // num_chunks chunks of tokens, the all-reduce of a chunk runs on
+  // comm_stream while the next one is computed, see
+  // AllReduceOp::overlap_linear. 1 runs the gemm then the all-reduce. Must
+  // be set before the layers are created.
+  void set_tp_overlap_chunks(int num_chunks) {
+    _tp_overlap_chunks = num_chunks;
+  }
+  int tp_overlap_chunks() const { return _tp_overlap_chunks; }
+#ifdef LIGHTSEQ_cuda
+  // created at the first call.
+  cudaStream_t comm_stream();
+#endif
+  // The tensor parallel all-reduces of inference of at most max_bytes run
+  // in one kernel over the workspaces of all the ranks mapped into each
+  // other, see launch_one_shot_all_reduce, which beats the latency of nccl
+  // on the small messages of the decode. The ranks exchange the cuda ipc
+  // handles of their workspaces in the files ipc_path.<rank>, tagged with the
+  // nccl id of the launch and removed once read. Called by all the ranks after
+  // init_tensor_parallel, it is turned off on all of them when any rank can
+  // not map the others, eg. without peer access between the gpus.
+  void init_one_shot_all_reduce(size_t max_bytes, const std::string& ipc_path);
+  size_t one_shot_bytes() const { return _one_shot_bytes; }
+  char* const* one_shot_peers() const { return _one_shot_peers_dev; }
+  unsigned int* one_shot_epochs() const { return _one_shot_epochs; }
+
+  // Pipeline parallelism keeps one context per stage, each on its own
+  // device, which must be current while the nodes of the context are created
+  // or run. switch_device makes it current, nothing is done for a context
+  // created with device_id -1.
+  int device_id() const { return _device_id; }
+  void switch_device();
+
+  friend class ContextScope;
+  friend class StreamPriorityScope;
+
   static void regist_pybind_layer(std::string layer_name, int layer_id,
                                   std::shared_ptr<void> layer_ptr);
   static std::shared_ptr<void> get_pybind_layer(std::string layer_name,
@@ -153,13 +373,95 @@ class Context {
 #ifdef LIGHTSEQ_cuda
  private:
   cudaStream_t _stream;
+  // the cuda priority of all the streams of the context, 0 by default.
+  int _stream_priority = 0;
   cublasHandle_t _cublasHandle;
+  // cublasLt takes the stream on every matmul, so it is not re-bound.
+  cublasLtHandle_t _cublasLtHandle;
+
+  // A captured CUDA graph together with the memory plan version it was
+  // captured under, the graph is only valid while the tensor addresses it
+  // baked in stay the same.
+  struct GraphInstance {
+    cudaGraph_t graph = nullptr;
+    cudaGraphExec_t graph_exec = nullptr;
+    int plan_version = -1;
+  };
+  std::map<std::vector<int>, GraphInstance> _graphs;
+  bool _capturing = false;
 
  public:
   const cudaStream_t& get_stream() const { return _stream; }
+  int stream_priority() const { return _stream_priority; }
   const cublasHandle_t& get_cublashandle() const { return _cublasHandle; }
+  const cublasLtHandle_t& get_cublaslthandle() const {
+    return _cublasLtHandle;
+  }
   void set_stream(cudaStream_t stream);
+
+  // Temporarily redirect the operators to another stream, used by the
+  // StreamScheduler. Unlike set_stream, the captured graphs are not
+  // affected.
+  void switch_compute_stream(cudaStream_t stream);
+
+  // Capture all the work issued to the context stream between
+  // graph_capture_begin() and graph_capture_end() into a CUDA graph stored
+  // under graph_key. Kernels captured this way must not depend on host values
+  // which change between replays, pass device pointers instead.
+  void graph_capture_begin();
+  void graph_capture_end(const std::vector<int>& graph_key);
+  // End the capture and drop the partial graph, used when the work issued
+  // between begin and end throws. Does nothing when not capturing.
+  void graph_capture_abort();
+
+  // Launch the graph stored under graph_key on the context stream. Returns
+  // false if there is no such graph or the memory plan changed since it was
+  // captured, the caller is then expected to run eagerly and capture again.
+  bool graph_replay(const std::vector<int>& graph_key);
+  void clear_graphs();
+  bool is_capturing() const { return _capturing; }
 #endif
 };
 
+// Makes context the one of Context::global_instance on the calling thread
+// until the scope ends, the previous one is restored then. Scopes nest.
+class ContextScope {
+ public:
+  explicit ContextScope(std::shared_ptr<Context> context)
+      : _prev_context_ptr(Context::_scope_context_ptr) {
+    Context::_scope_context_ptr = context;
+  }
+  ~ContextScope() { Context::_scope_context_ptr = _prev_context_ptr; }
+
+  // Switch to another context within the scope, e.g. the one of the next
+  // pipeline stage.
+  void reset(std::shared_ptr<Context> context) {
+    Context::_scope_context_ptr = context;
+  }
+
+  ContextScope(const ContextScope&) = delete;
+  ContextScope& operator=(const ContextScope&) = delete;
+
+ private:
+  std::shared_ptr<Context> _prev_context_ptr;
+};
+
+// The contexts created on the calling thread until the scope ends get
+// streams of priority, eg. all the ones of a model constructed in the
+// scope. Scopes nest.
+class StreamPriorityScope {
+ public:
+  explicit StreamPriorityScope(StreamPriority priority)
+      : _prev_priority(Context::_scope_stream_priority) {
+    Context::_scope_stream_priority = priority;
+  }
+  ~StreamPriorityScope() { Context::_scope_stream_priority = _prev_priority; }
+
+  StreamPriorityScope(const StreamPriorityScope&) = delete;
+  StreamPriorityScope& operator=(const StreamPriorityScope&) = delete;
+
+ private:
+  StreamPriority _prev_priority;
+};
+
 }  // namespace lightseq
@@ -0,0 +1,56 @@
+/*
+  Copyright (c) 2022 - 2023, Bytedance, The LightSeq Team
+*/
+#pragma once
+#include "vector"
+
+#include "declaration.h"
+
+namespace lightseq {
+
+/*
+  - Class: CpuThreadGroup
+  - Description:
+      The threads of the cpu kernels of one context, see parallel_for in
+  kernels/x86 and kernels/arm. The row-wise and elementwise kernels and the
+  gemms split their work over the OpenMP team of the thread running the
+  model, so the group is applied to that thread when a layer of the context
+  runs forward or backward:
+        1. The team is limited to num_threads threads, and so are the
+  threads of mkl on x86, which would use all the cores of the host otherwise.
+        2. With a numa_node, the calling thread and its team are pinned one
+  per cpu of the node, so the activations and the weights touched first by
+  the team stay in the local memory of the node.
+
+      Each model instance running in its own thread gets its own team from
+  OpenMP, several instances on disjoint nodes or cpus then do not share
+  cores. The group is applied only when the calling thread changes groups.
+  - Implementation file: cpu_threads.cpp
+*/
+class CpuThreadGroup {
+ private:
+  int _num_threads;
+  int _numa_node;
+  // the cpus of the numa node, empty without pinning.
+  std::vector<int> _cpus;
+  // identifies the group applied to a thread.
+  int _group_id;
+
+  void pin_team();
+
+ public:
+  // num_threads <= 0 takes all the cpus of the node, or of the host without
+  // a node. numa_node -1 does not pin the threads.
+  CpuThreadGroup(int num_threads, int numa_node = -1);
+
+  int num_threads() const { return _num_threads; }
+  int numa_node() const { return _numa_node; }
+
+  // Apply the group to the calling thread.
+  void enter();
+
+  // The cpus of a numa node, read from sysfs, empty if it does not exist.
+  static std::vector<int> numa_node_cpus(int numa_node);
+};
+
+}  // namespace lightseq
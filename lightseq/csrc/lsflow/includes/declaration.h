@@ -23,8 +23,12 @@
 
 namespace lightseq {
 
+// The default precision of the build. The models take theirs as a template
+// argument, see LSModelFactory::CreateModel.
 #ifdef FP16_MODE
 typedef __half OpType_;
+#elif defined BF16_MODE
+typedef __nv_bfloat16 OpType_;
 #else
 typedef float OpType_;
 #endif
@@ -71,6 +75,18 @@ class Shape;
 class Allocator;
 using AllocatorPtr = std::shared_ptr<Allocator>;
 
+class StreamScheduler;
+using StreamSchedulerPtr = std::shared_ptr<StreamScheduler>;
+
+class Profiler;
+using ProfilerPtr = std::shared_ptr<Profiler>;
+
+class Metrics;
+using MetricsPtr = std::shared_ptr<Metrics>;
+
+class CpuThreadGroup;
+using CpuThreadGroupPtr = std::shared_ptr<CpuThreadGroup>;
+
 const int MB_SIZE = 1024 * 1024;
 
 #define CHECK_DTYPE(dtype, base_type) (dtype == g_dtype<base_type>())
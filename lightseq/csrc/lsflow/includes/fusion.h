@@ -0,0 +1,52 @@
+/*
+  Copyright (c) 2022 - 2023, Bytedance, The LightSeq Team
+*/
+#pragma once
+#include "functional"
+#include "map"
+#include "vector"
+
+#include "declaration.h"
+
+namespace lightseq {
+
+/*
+  - Class: GraphFusion
+  - Description:
+      Graph level operator fusion, run by Context::build on inference
+  contexts before the lifetimes of the tensors are recorded, so the
+  intermediates removed by a fusion take no space in the memory plan.
+
+      A rule is registered by the operator library under a pattern name, eg.
+  "LinearOp+BiasActDropoutOp". It is tried on every operator in creation
+  order and returns true after rewriting the chain starting at it into the
+  fused operator, see Node::replace_parent and Node::detach, the operators
+  and variables left out of the graph are never run. A rule must keep the
+  outputs of the layers, see Context::is_layer_output.
+
+      LIGHTSEQ_GRAPH_FUSION=0 or Context::set_graph_fusion(false) keeps the
+  graph as built by the layers, to compare the fused model against the
+  unfused one.
+  - Implementation file: fusion.cpp
+*/
+class GraphFusion {
+ public:
+  using Rule = std::function<bool(Operator*)>;
+
+  struct Registrar {
+    Registrar(const std::string& pattern, Rule rule) {
+      GraphFusion::register_rule(pattern, rule);
+    }
+  };
+
+  static void register_rule(const std::string& pattern, Rule rule);
+
+  // Apply the rules to the operators among nodes, returns the number of
+  // fusions by pattern.
+  static std::map<std::string, int> run(const std::vector<Node*>& nodes);
+
+ private:
+  static std::vector<std::pair<std::string, Rule>>& rules();
+};
+
+}  // namespace lightseq
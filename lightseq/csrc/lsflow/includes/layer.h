@@ -29,6 +29,13 @@ class Layer {
   std::vector<Variable*> _inp_var_vec = {};
   std::vector<Variable*> _out_var_vec = {};
 
+  bool _recompute = false;
+
+  std::function<void()> _grad_ready_hook = nullptr;
+
+  // Replay the forward of the layer before its backward.
+  void recompute_forward();
+
  public:
   Layer(std::string name);
   virtual ~Layer();
@@ -45,6 +52,26 @@ class Layer {
 
   Variable* input(int idx);
   Variable* output(int idx);
+  const std::vector<Variable*>& inputs() const { return _inp_var_vec; }
+  const std::vector<Variable*>& outputs() const { return _out_var_vec; }
+
+  // Activation checkpointing: the intermediates of the layer are not kept
+  // from forward to backward, backward replays forward_process() and the
+  // operators of the layer to get them back. The memory manager reuses their
+  // memory in between, at the cost of running the forward twice. The inputs,
+  // outputs and dropout masks are still kept. Must be set before the context
+  // is built, only takes effect on root layers.
+  void set_recompute(bool recompute);
+  bool recompute() const { return _recompute; }
+
+  // Called at the end of every backward once the context is built, after the
+  // kernels computing the grads of the layer are issued to the stream of the
+  // context. It lets the grads of the layer be all-reduced on another stream
+  // while the layers before it are still in backward. Only takes effect on
+  // root layers.
+  void set_grad_ready_hook(std::function<void()> hook) {
+    _grad_ready_hook = hook;
+  }
 
   // Clear the forward propagation mark, you need to ensure that the mark is
   // cleared before each execution of forward.
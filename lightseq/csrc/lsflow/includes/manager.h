@@ -9,6 +9,7 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <set>
 
 #include "declaration.h"
 #include "allocator.h"
@@ -26,12 +27,22 @@ enum LSMemoryType { FixedMemory, SharedMemory, OffsetMemory };
 class TensorUsage {
  public:
   int first_idx, last_idx;
+  // The intermediates of a recomputed layer hold nothing between the original
+  // forward and the recompute, the open interval (gap_first, gap_last). No
+  // gap when gap_last < 0.
+  int gap_first = -1, gap_last = -1;
+  bool gap_opened = false;
   int unique_id;
   size_t size;
   std::string _name;
   TensorUsage(int uid, int fidx, int lidx, size_t s, std::string name)
       : first_idx(fidx), last_idx(lidx), unique_id(uid), size(s), _name(name) {}
   ~TensorUsage() = default;
+
+  // The closed intervals of node idx where the tensor is alive.
+  std::vector<std::pair<int, int>> life_intervals() const;
+  // Whether the two tensors are alive at the same node idx.
+  bool life_overlap(const TensorUsage& other) const;
 };
 
 /*
@@ -47,9 +58,47 @@ class TensorUsage {
     applying for a whole buffer may cause memory allocation failure. On the
     premise of ensuring that the memory of each tensor is continuous, we open up
     several small buffers to avoid the above phenomenon.
+
+    The offsets are computed by several greedy planners, greedy by size,
+    greedy by breadth and best fit in the order of first use, and the plan
+    with the smallest peak is kept. The plans of small graphs are refined
+    further, see plan_report() for the peak of every planner.
+
+    By default the plan is computed once with the max shape of every tensor.
+    Models whose real shapes are usually far below the max shape can also
+    record the shapes set in before_forward for a (batch_size, seq_len) bucket,
+    and keep one cached plan per bucket. Only the active plan holds buffers,
+    switching plans re-allocates them from the allocator and bumps
+    plan_version(), which tells the tensors to fetch their new addresses.
+
+    A plan can also be recorded for a phase rather than a shape bucket, eg.
+    the decoding of continuous batching, whose activations are far smaller
+    than the ones of a prompt. A tensor allowed to grow, such as a kv cache,
+    may then take the memory the other tensors leave in the plan of the
+    phase, see allow_growth().
 */
 class MemoryManager {
+ public:
+  // (batch_size, seq_len) bucket of a cached memory plan.
+  using PlanKey = std::pair<int, int>;
+
+  struct PlanReport {
+    // <planner, peak bytes> of the last computed plan.
+    std::vector<std::pair<std::string, size_t>> peaks;
+    size_t picked = 0;
+    // the most bytes alive at a node, which no plan goes below.
+    size_t lower_bound = 0;
+  };
+
  private:
+  // <TensorUsage, offset> sorted by offset
+  using MemoryPlan = std::vector<std::pair<TensorUsage, size_t>>;
+
+  // graphs of at most kRefineTensors tensors are refined by kRefinePasses
+  // passes of swaps, see plan_offsets_.
+  static const int kRefineTensors = 64;
+  static const int kRefinePasses = 4;
+
   std::vector<char*> buffer_vec_;
   std::vector<size_t> buffer_size_vec_;
   size_t _total_buffer_size;
@@ -58,21 +107,115 @@ class MemoryManager {
   std::map<int, char*> tensor_ptr;
   AllocatorPtr _allocator_ptr;
 
+  // dynamic shape planning
+  std::map<PlanKey, MemoryPlan> _cached_plans;
+  std::map<int, size_t> _recorded_sizes;
+  std::set<int> _growable;
+  PlanKey _active_plan_key = {-1, -1};
+  bool _recording = false;
+  int _plan_version = 0;
+  // the buffers of the active plan are returned, see release_buffers.
+  bool _released = false;
+
+  // <unique_id, name> of the shared tensors in creation order, see
+  // register_tensor.
+  std::vector<std::pair<int, std::string>> _tensors;
+  size_t _tensor_signature = 0;
+
+  PlanReport _plan_report;
+
+  MemoryPlan plan_offsets_(const std::map<int, size_t>& tensor_sizes);
+  // Place the tensors one by one in order, each in the smallest gap left by
+  // the placed tensors alive at the same time, or above them all.
+  static MemoryPlan place_in_order_(const std::vector<TensorUsage>& order);
+  static size_t peak_(const MemoryPlan& plan);
+  void print_plan_report_() const;
+  void allocate_buffer_(const MemoryPlan& plan);
+  void check_plan_(const MemoryPlan& plan);
+
  public:
   MemoryManager() : _allocator_ptr(new Allocator()) {}
   virtual ~MemoryManager() {}
 
   char* get_memory(int unique_id) { return tensor_ptr.find(unique_id)->second; }
 
+  // Called by every shared tensor when it is created. The tensors of two
+  // identical models are registered in the same order with the same names
+  // and sizes, see save_plan.
+  void register_tensor(int unique_id, const std::string& name, size_t size);
+  // A hash of the names and sizes of the registered tensors.
+  size_t tensor_signature() const { return _tensor_signature; }
+
   void update_tensor_life_idx(int unique_id, int node_idx, size_t size,
                               std::string name);
 
   void remove_life_cycle(int unique_id);
 
+  // The tensor is dead from its last use so far to its next use, which must
+  // overwrite it. Used by the recomputed layers, see Layer::set_recompute().
+  void open_life_gap(int unique_id);
+
   void calculate_buffer_();
 
+  // Write the lifetimes and the offsets of the plan computed by
+  // calculate_buffer_() to path, under signature. load_plan() restores them
+  // in another instance of the same model in place of the lifetime recording
+  // forward of Context::build and of calculate_buffer_(), the tensors are
+  // matched by their creation order. It returns false, and changes nothing,
+  // when path is missing or was saved under another signature.
+  void save_plan(const std::string& path, size_t signature);
+  bool load_plan(const std::string& path, size_t signature);
+
   size_t total_buffer_size() { return _total_buffer_size; }
 
+  // The planners of the last plan computed, by calculate_buffer_() or
+  // finish_shape_recording().
+  const PlanReport& plan_report() const { return _plan_report; }
+
+  // Start recording the real byte size of tensors, every set_shape called
+  // before finish_shape_recording() updates the recorded size.
+  void start_shape_recording();
+  bool is_recording() const { return _recording; }
+  void record_tensor_size(int unique_id, size_t size);
+
+  // Compute and cache the memory plan of the bucket with the recorded sizes.
+  // Tensors without recorded size keep their max size.
+  void finish_shape_recording(PlanKey plan_key);
+
+  // The recorded size of the tensor, rather than its max size, bounds it in
+  // the plans recorded from now, so it can exceed the max size.
+  void allow_growth(int unique_id) { _growable.insert(unique_id); }
+
+  bool has_plan(PlanKey plan_key) {
+    return _cached_plans.find(plan_key) != _cached_plans.end();
+  }
+
+  // Bytes of the buffers of a cached plan, 0 if it is not cached.
+  size_t plan_buffer_size(PlanKey plan_key) const;
+
+  // Make the cached plan of the bucket the active one and allocate its
+  // buffers. Must not be called while the contents of shared tensors still
+  // need to be kept, eg. in the middle of autoregressive decoding.
+  void switch_plan(PlanKey plan_key);
+
+  // Return the buffers of the active plan to the allocator, the plans stay
+  // cached. The shared tensors have no memory, and must not be used, until
+  // reacquire_buffers() allocates the active plan again, with new addresses
+  // and lost contents. Used to give the memory of an idle model back.
+  void release_buffers();
+  void reacquire_buffers();
+  bool buffers_released() const { return _released; }
+
+  // Increased every time tensors are given new addresses.
+  int plan_version() const { return _plan_version; }
+
+  // <TensorUsage, offset> of the active plan, empty before the context is
+  // built.
+  std::vector<std::pair<TensorUsage, size_t>> active_plan() const {
+    auto iter = _cached_plans.find(_active_plan_key);
+    return iter == _cached_plans.end() ? MemoryPlan() : iter->second;
+  }
+
   AllocatorPtr allocator() { return _allocator_ptr; }
 };
 }  // namespace lightseq
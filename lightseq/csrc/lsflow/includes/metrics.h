@@ -0,0 +1,120 @@
+/*
+  Copyright (c) 2022 - 2023, Bytedance, The LightSeq Team
+*/
+#pragma once
+#include "map"
+#include "mutex"
+#include "vector"
+
+#include "declaration.h"
+
+namespace lightseq {
+
+/*
+  - Class: Metrics
+  - Description:
+      Always-on runtime metrics of a context, cheap enough for production
+  serving: counters, gauges and histograms updated by the models once per
+  Infer or step, without waiting for the device.
+
+      The cumulative gpu time of every top level layer instance, eg.
+  "LlamaLayer_3", is sampled: one forward out of every sample interval (see
+  begin_forward) brackets its operators with cuda events, which are resolved
+  by end_forward after the model synchronized. The interval is 0 (off) unless
+  set by set_layer_sampling or LIGHTSEQ_METRICS_LAYER_SAMPLING. Operators
+  issued during CUDA graph capture are not sampled.
+
+      prometheus_text() renders the metrics in the Prometheus text exposition
+  format, prefixed with "lightseq_". The metrics are guarded by a mutex, so
+  they can be exported from another thread than the one running the model.
+  - Implementation file: metrics.cpp
+*/
+class Metrics {
+ private:
+  enum class Type { Counter, Gauge, Histogram };
+
+  struct Sample {
+    double value = 0;
+    // histograms only, the counts of the kHistogramBuckets and of +Inf.
+    std::vector<size_t> buckets;
+    size_t count = 0;
+  };
+
+  struct Family {
+    Type type;
+    // by label set, eg. layer="LlamaLayer_3", empty without labels.
+    std::map<std::string, Sample> samples;
+  };
+
+  struct Record {
+    std::string layer;
+#ifdef LIGHTSEQ_cuda
+    cudaEvent_t start;
+    cudaEvent_t end;
+#else
+    double start_us;
+    double end_us;
+#endif
+  };
+
+  // powers of 2 up to 32768, eg. the tokens of a request.
+  static const int kHistogramBuckets = 16;
+
+  Context* _context_ptr;
+  mutable std::mutex _mutex;
+  std::map<std::string, Family> _families;
+
+  int _sample_interval = 0;
+  size_t _num_forwards = 0;
+  bool _sampling = false;
+  std::vector<Record> _pending;
+  Record _current;
+  bool _current_skipped = false;
+#ifdef LIGHTSEQ_cuda
+  std::vector<cudaEvent_t> _free_events;
+
+  cudaEvent_t acquire_event();
+#else
+  std::chrono::high_resolution_clock::time_point _base_time;
+#endif
+
+  Sample& sample(const std::string& name, Type type,
+                 const std::string& labels);
+  static std::string layer_key(const std::string& node_name);
+
+ public:
+  Metrics(Context* context_ptr);
+  ~Metrics();
+
+  // counter += value
+  void add(const std::string& name, double value,
+           const std::string& labels = "");
+  // gauge = value
+  void set(const std::string& name, double value,
+           const std::string& labels = "");
+  // a histogram over the kHistogramBuckets powers of 2.
+  void observe(const std::string& name, double value,
+               const std::string& labels = "");
+  // the value of a counter or a gauge, the sum of a histogram, 0 if unset.
+  double get(const std::string& name, const std::string& labels = "") const;
+
+  // Time the layers of one forward out of every interval, 0 turns it off.
+  void set_layer_sampling(int interval);
+
+  // Called by the models around every Infer or step, end_forward after the
+  // device finished the forward.
+  void begin_forward();
+  void end_forward();
+
+  // Called by Node::recursive_forward around Operator::forward while a
+  // sampled forward runs.
+  bool sampling() const { return _sampling; }
+  void before_op(Operator* op);
+  void after_op(Operator* op);
+
+  std::string prometheus_text() const;
+
+  void reset();
+};
+
+}  // namespace lightseq
@@ -54,6 +54,15 @@ class Node {
   // Add a child node to the current node.
   void add_child(Node* child) { _children.push_back(child); }
 
+  // Graph rewriting before the context is built, see GraphFusion. The
+  // neighbours are not updated, the rule rewires both ends of an edge.
+  void replace_parent(Node* old_parent, Node* new_parent);
+  void replace_child(Node* old_child, Node* new_child);
+  void remove_child(Node* child);
+  void add_parent(Node* parent) { _parents.push_back(parent); }
+  // Drop all the edges of a node left out of the graph.
+  void detach() { _parents.clear(), _children.clear(); }
+
   // Pure virtual functions need to be implemented in subclasses.
   virtual void forward() = 0;
   virtual void backward() = 0;
@@ -153,6 +162,14 @@ class Variable : public Node {
   // registered in the MemoryManager.
   void fixed_memory();
 
+  // The value is not kept between the forward and the recompute of a
+  // recomputed layer, see Layer::set_recompute().
+  void open_life_gap();
+
+  // The value may exceed its max shape in the memory plans recorded from now,
+  // see MemoryManager::allow_growth().
+  void allow_growth();
+
   // Exchange the tensor information of two variable objects,
   // which is used when backup exchange is required such as beam search
   static void swap_tensor(Variable* var_a, Variable* var_b);
@@ -183,6 +200,10 @@ class Variable : public Node {
   char* value(bool is_open_interval = false);
   char* grad(bool is_open_interval = false);
 
+  // Byte size of the value under the current shape, or under the max shape
+  // when no shape is set yet.
+  size_t value_byte_size();
+
   template <typename T>
   T* value(bool is_open_interval = false) {
     return (T*)value(is_open_interval);
@@ -208,7 +229,7 @@ class Variable : public Node {
   }
 
   // Set the offset value and shape parameter for OffsetVariable.
-  void set_offset(int offset, Shape shape);
+  void set_offset(size_t offset, Shape shape);
 
   void add_descendants(Variable* var);
 
@@ -239,5 +260,15 @@ class Operator : public Node {
   Variable* parent(int index) {
     return static_cast<Variable*>(_parents[index]);
   }
+
+  // Floating point operations of the forward pass under the current shapes,
+  // only used for profiling. 0 means unknown.
+  virtual size_t flops() { return 0; }
+
+  // The tensors of the operator which are neither parents nor children, e.g.
+  // its workspaces. The forward pass may write them, and a SharedMemory one
+  // may share memory with the variables of other operators, see
+  // StreamScheduler.
+  virtual std::vector<TensorPtr> workspaces() { return {}; }
 };
 }  // namespace lightseq
@@ -0,0 +1,42 @@
+/*
+  Copyright (c) 2022 - 2023, Bytedance, The LightSeq Team
+*/
+#pragma once
+#include <string>
+
+#ifdef LIGHTSEQ_nvtx
+#include <nvtx3/nvToolsExt.h>
+#endif
+
+namespace lightseq {
+
+/*
+  - Class: NvtxRange
+  - Description:
+      NVTX range of the enclosing scope, shown by Nsight Systems on the
+  timeline of the kernels it launches. Layer::forward and backward are
+  ranges of the layer name, every Operator::forward one of the node name,
+  eg. "LlamaLayer_0/LlamaAttentionLayer_0:LinearOp_0".
+
+      Only built with -DUSE_NVTX=ON, otherwise LS_NVTX_RANGE expands to
+  nothing and its name is not even evaluated.
+*/
+#ifdef LIGHTSEQ_nvtx
+class NvtxRange {
+ public:
+  explicit NvtxRange(const char* name) { nvtxRangePushA(name); }
+  explicit NvtxRange(const std::string& name) { nvtxRangePushA(name.c_str()); }
+  ~NvtxRange() { nvtxRangePop(); }
+  NvtxRange(const NvtxRange&) = delete;
+  NvtxRange& operator=(const NvtxRange&) = delete;
+};
+
+#define LS_NVTX_CONCAT_(a, b) a##b
+#define LS_NVTX_CONCAT(a, b) LS_NVTX_CONCAT_(a, b)
+#define LS_NVTX_RANGE(name) \
+  ::lightseq::NvtxRange LS_NVTX_CONCAT(nvtx_range_, __LINE__)(name)
+#else
+#define LS_NVTX_RANGE(name)
+#endif
+
+}  // namespace lightseq
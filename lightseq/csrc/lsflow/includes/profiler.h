@@ -0,0 +1,115 @@
+/*
+  Copyright (c) 2022 - 2023, Bytedance, The LightSeq Team
+*/
+#pragma once
+#include "map"
+#include "vector"
+
+#include "declaration.h"
+
+namespace lightseq {
+
+/*
+  - Class: Profiler
+  - Description:
+      Opt-in timing of every Operator::forward executed after the context is
+  built. Each operator is wrapped in a pair of cuda events on the stream it
+  runs on, the events are resolved lazily, so profiling does not serialize
+  the host with the device except when the pending records are flushed.
+
+      The latency, the bytes of the values it reads and writes and the FLOPs
+  reported by Operator::flops() are aggregated per operator name (the node
+  name with the instance suffixes removed, eg.
+  "LlamaLayer/LlamaAttentionLayer:LinearOp") and per layer instance.
+
+      export_chrome_trace() writes the timeline in the Chrome trace event
+  format (chrome://tracing, Perfetto), with one row per stream. The active
+  memory plan of the MemoryManager is appended as a second process, whose
+  time axis is the node index: every tensor spans its lifetime and carries
+  its size and offset.
+
+      Operators issued during CUDA graph capture are not profiled.
+  - Implementation file: profiler.cpp
+*/
+class Profiler {
+ private:
+  struct Record {
+    std::string node_name;
+    size_t bytes;
+    size_t flops;
+    int stream_idx;
+#ifdef LIGHTSEQ_cuda
+    cudaEvent_t start;
+    cudaEvent_t end;
+#else
+    double start_us;
+    double end_us;
+#endif
+  };
+
+  struct TraceEvent {
+    std::string node_name;
+    double ts_us;
+    double dur_us;
+    size_t bytes;
+    size_t flops;
+    int stream_idx;
+  };
+
+  struct OpStats {
+    int count = 0;
+    double total_us = 0;
+    double max_us = 0;
+    size_t bytes = 0;
+    size_t flops = 0;
+  };
+
+  // pending records are flushed when there are more than this.
+  static const int kMaxPending = 4096;
+
+  Context* _context_ptr;
+  std::vector<Record> _pending;
+  std::vector<TraceEvent> _trace;
+  std::map<std::string, OpStats> _op_stats;
+  std::map<std::string, OpStats> _layer_stats;
+  Record _current;
+  bool _current_skipped = false;
+
+#ifdef LIGHTSEQ_cuda
+  cudaEvent_t _base_event;
+  std::vector<cudaEvent_t> _free_events;
+  std::map<cudaStream_t, int> _stream_ids;
+
+  cudaEvent_t acquire_event();
+#else
+  std::chrono::high_resolution_clock::time_point _base_time;
+
+  double host_us();
+#endif
+
+  static std::string op_key(const std::string& node_name);
+  static std::string layer_key(const std::string& node_name);
+  static void print_stats(const std::map<std::string, OpStats>& stats,
+                          const std::string& title);
+
+ public:
+  Profiler(Context* context_ptr);
+  ~Profiler();
+
+  // Called by Node::recursive_forward around Operator::forward.
+  void before_op(Operator* op);
+  void after_op(Operator* op);
+
+  // Wait for the device and aggregate all pending records.
+  void flush();
+
+  // Drop all the collected records and statistics.
+  void reset();
+
+  // Print per-op and per-layer statistics, sorted by total latency.
+  void print_summary();
+
+  void export_chrome_trace(const std::string& file_path);
+};
+
+}  // namespace lightseq
@@ -0,0 +1,90 @@
+/*
+  Copyright (c) 2022 - 2023, Bytedance, The LightSeq Team
+*/
+#pragma once
+#include "vector"
+
+#include "declaration.h"
+
+namespace lightseq {
+
+/*
+  - Class: StreamScheduler
+  - Description:
+      Dispatches the operators executed by one Layer::forward to a small pool
+  of streams, so that independent branches of the layer, such as the k/v
+  projections of the encoder output or the experts of a MoE layer, can
+  overlap on the device.
+
+      The operators are still issued in the order of recursive_forward. Before
+  an operator is issued, its accessed memory ranges are compared with the ones
+  of the operators already issued in the layer: the values of its parent
+  variables are read, the values of its child variables are written, and any
+  overlap involving a write is a dependency. This covers both the edges of
+  the graph and the hazards introduced by MemoryManager reusing memory between
+  tensors. An operator continues on the stream of its latest dependency when
+  it is the tail of that stream, otherwise it is forked onto another stream
+  of the pool. Cross-stream dependencies are expressed with cuda events.
+
+      Operators which update a parent in place are expected to only do so on
+  RegressiveVariable (or offsets of it, e.g. the kv caches), which are treated
+  as written.
+
+      When the scope of the layer ends, all pool streams are joined back into
+  the stream of the context, so the rest of the model keeps seeing a single
+  ordered stream.
+  - Implementation file: scheduler.cpp
+*/
+class StreamScheduler {
+ private:
+  struct Access {
+    const char* ptr;
+    size_t bytes;
+    bool is_write;
+  };
+
+  struct IssuedOp {
+    int stream_idx;
+    std::vector<Access> accesses;
+  };
+
+  Context* _context_ptr;
+  int _num_streams;
+  int _depth = 0;
+
+  std::vector<IssuedOp> _issued;
+  // index in _issued of the last operator on each stream, -1 if the stream
+  // is not used in the current scope yet.
+  std::vector<int> _stream_tail;
+  IssuedOp _current;
+
+#ifdef LIGHTSEQ_cuda
+  // _streams[0] is the stream of the context when the scope begins.
+  std::vector<cudaStream_t> _streams;
+  // one event per issued operator, reused across scopes.
+  std::vector<cudaEvent_t> _events;
+  cudaEvent_t _scope_event;
+#endif
+
+  static void collect_accesses(Operator* op, std::vector<Access>* accesses);
+  static bool is_conflict(const std::vector<Access>& a,
+                          const std::vector<Access>& b);
+
+ public:
+  StreamScheduler(Context* context_ptr, int num_streams);
+  ~StreamScheduler();
+
+  int num_streams() const { return _num_streams; }
+  bool in_scope() const { return _depth > 0; }
+
+  // Called by Layer::forward around the execution of the layer. Nested
+  // scopes are merged into the outermost one.
+  void begin_scope();
+  void end_scope();
+
+  // Called by Node::recursive_forward around Operator::forward.
+  void before_op(Operator* op);
+  void after_op(Operator* op);
+};
+
+}  // namespace lightseq
@@ -3,6 +3,8 @@
 */
 
 #pragma once
+#include <atomic>
+
 #include "declaration.h"
 #include "manager.h"
 #include "context.h"
@@ -32,10 +34,19 @@ class Tensor {
   MemoryManagerPtr _mm_ptr = nullptr;
   Context* _ctx_ptr;
 
-  static int global_tensor_id;
+  // tensors are created on the threads of several models at once.
+  static std::atomic<int> global_tensor_id;
   TensorPtr _original_tensor;
   size_t _offset = 0;
 
+  // MemoryManager plan version of _ptr, used to refetch the address after the
+  // memory plan is switched.
+  int _plan_version = -1;
+
+  // Report the real byte size required by the current shape to the
+  // MemoryManager which is recording shapes for dynamic memory plans.
+  void record_size(size_t byte_size);
+
  public:
   // Applies to tensors using FixedMemory and SharedMemory memory types.
   // When the mx_shape parameter is empty, it means that the tensor uses the
@@ -84,6 +95,9 @@ class Tensor {
 
   size_t dim_t() { return _shape.view().size(); }
   int element_size() { return _shape.element_size(); }
+  // The bytes of the memory of the tensor: the max shape of a SharedMemory
+  // tensor, the current shape otherwise, 0 without one.
+  size_t byte_size();
   const size_t& mx_shape_size() const { return _mx_shape_size; }
   const std::vector<size_t>& shape() const { return _shape.view(); }
   const cuda::DataType& dtype() const { return _dtype; }
@@ -97,6 +111,12 @@ class Tensor {
   // Remove tensor life cycle.
   void remove_life_cycle();
 
+  // See MemoryManager::open_life_gap(), only shared tensors have one.
+  void open_life_gap();
+
+  // See MemoryManager::allow_growth(), only shared tensors can grow.
+  void allow_growth();
+
   // Remove the life cycle information registered by the tensor from the
   // MemoryManager, do not use shared memory.
   void reset_fixed();
@@ -1,4 +1,7 @@
 #include "layer.h"
+#include "scheduler.h"
+#include "cpu_threads.h"
+#include "nvtx_range.h"
 
 namespace lightseq {
 
@@ -17,27 +20,84 @@ Layer::Layer(std::string name) : _op_vec({}) {
 Layer::~Layer() {}
 
 void Layer::forward() {
+  LS_NVTX_RANGE(_name);
   _context_ptr->build();
   clear_fw_flag();
   _context_ptr->update_node_idx();
+  if (_context_ptr->cpu_threads()) _context_ptr->cpu_threads()->enter();
+
+  StreamScheduler* scheduler =
+      _context_ptr->is_built() ? _context_ptr->stream_scheduler() : nullptr;
+  if (scheduler) scheduler->begin_scope();
 
   forward_process();
   for (Variable* var : _out_var_vec) {
     if (var == nullptr) continue;
     var->recursive_forward();
   }
+
+  if (scheduler) scheduler->end_scope();
 }
 
 void Layer::backward() {
+  LS_NVTX_RANGE(_name + ":backward");
   _context_ptr->build();
   clear_bw_flag();
   _context_ptr->update_node_idx();
+  if (_context_ptr->cpu_threads()) _context_ptr->cpu_threads()->enter();
+
+  if (_recompute) recompute_forward();
 
   backward_process();
   for (Variable* var : _inp_var_vec) {
     if (var == nullptr) continue;
     var->recursive_backward();
   }
+
+  // not in the backward run by Context::build.
+  if (_grad_ready_hook && _context_ptr->is_built()) _grad_ready_hook();
+}
+
+void Layer::recompute_forward() {
+  if (!_context_ptr->is_built()) {
+    // the outputs are used out of the layer, only its intermediates are
+    // overwritten before they are used again.
+    for (Operator* op : _op_vec) {
+      for (Node* var : op->children()) {
+        Variable* this_var = static_cast<Variable*>(var);
+        if (std::find(_out_var_vec.begin(), _out_var_vec.end(), this_var) !=
+            _out_var_vec.end()) {
+          continue;
+        }
+        this_var->open_life_gap();
+      }
+    }
+  }
+
+  clear_fw_flag();
+  _context_ptr->recompute_begin();
+
+  StreamScheduler* scheduler =
+      _context_ptr->is_built() ? _context_ptr->stream_scheduler() : nullptr;
+  if (scheduler) scheduler->begin_scope();
+
+  forward_process();
+  for (Variable* var : _out_var_vec) {
+    if (var == nullptr) continue;
+    var->recursive_forward();
+  }
+
+  if (scheduler) scheduler->end_scope();
+  _context_ptr->recompute_end();
+}
+
+void Layer::set_recompute(bool recompute) {
+  if (_context_ptr->is_built()) {
+    printf("Error! layer %s set recompute after the context is built\n",
+           name().c_str());
+    exit(-1);
+  }
+  _recompute = recompute;
 }
 
 void Layer::set_inputs(std::vector<Variable*> inps) {
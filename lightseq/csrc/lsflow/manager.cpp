@@ -1,6 +1,26 @@
+#include "cstdio"
+
 #include "manager.h"
 
 namespace lightseq {
+std::vector<std::pair<int, int>> TensorUsage::life_intervals() const {
+  if (gap_last < 0) {
+    return {{first_idx, last_idx}};
+  }
+  return {{first_idx, gap_first}, {gap_last, last_idx}};
+}
+
+bool TensorUsage::life_overlap(const TensorUsage &other) const {
+  for (auto x : life_intervals()) {
+    for (auto y : other.life_intervals()) {
+      if (std::max(x.first, y.first) <= std::min(x.second, y.second)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
 void MemoryManager::update_tensor_life_idx(int unique_id, int node_idx,
                                            size_t size, std::string name) {
   if (size == 0) {
@@ -17,6 +37,16 @@ void MemoryManager::update_tensor_life_idx(int unique_id, int node_idx,
 
   iter->second.last_idx = std::max(iter->second.last_idx, node_idx);
 
+  // node idx only grows during the build, this is the first use after the
+  // gap is opened.
+  TensorUsage &usage = iter->second;
+  if (usage.gap_opened) {
+    usage.gap_opened = false;
+    if (node_idx > usage.gap_first + 1) {
+      usage.gap_last = node_idx;
+    }
+  }
+
   return;
 }
 
@@ -26,40 +56,53 @@ void MemoryManager::remove_life_cycle(int unique_id) {
   }
 }
 
-void MemoryManager::calculate_buffer_() {
-  printf("========== Execute MemoryManager calculate_buffer_ ==========\n\n");
+void MemoryManager::open_life_gap(int unique_id) {
+  std::map<int, TensorUsage>::iterator iter = tensor_usages_.find(unique_id);
+  if (iter == tensor_usages_.end() || iter->second.gap_last >= 0) {
+    return;
+  }
+  iter->second.gap_first = iter->second.last_idx;
+  iter->second.gap_opened = true;
+}
 
-  tensor_ptr.clear();
-  std::vector<std::pair<TensorUsage, size_t>> tensor_usages_vec{};
-  for (auto iter : tensor_usages_) {
-    tensor_usages_vec.push_back(std::make_pair(iter.second, 0));
+namespace {
+
+// the bytes alive at every node idx where a life interval starts, the peak
+// can only be reached there.
+std::map<int, size_t> breadths(const std::vector<TensorUsage> &usages) {
+  std::map<int, size_t> res;
+  for (auto &usage : usages) {
+    for (auto interval : usage.life_intervals()) {
+      res[interval.first] = 0;
+    }
   }
-  std::sort(tensor_usages_vec.begin(), tensor_usages_vec.end(),
-            [](const std::pair<TensorUsage, size_t> &x,
-               const std::pair<TensorUsage, size_t> &y) -> bool {
-              return x.first.size > y.first.size;
-            });
+  for (auto &usage : usages) {
+    for (auto interval : usage.life_intervals()) {
+      auto iter = res.lower_bound(interval.first);
+      for (; iter != res.end() && iter->first <= interval.second; iter++) {
+        iter->second += usage.size;
+      }
+    }
+  }
+  return res;
+}
 
-  // Algorithm.3: Greedy by Size for Offset Calculation
-  // arxiv url: https://arxiv.org/abs/2001.03288
+}  // namespace
+
+MemoryManager::MemoryPlan MemoryManager::place_in_order_(
+    const std::vector<TensorUsage> &order) {
   // tensor_usages_vec means: <TensorUsage, offset>
-  size_t total_consumption = 0;
   std::vector<std::pair<TensorUsage, size_t>> ordered_tensor_usages{};
 
-  for (int idx = 0; idx < tensor_usages_vec.size(); idx++) {
+  for (const TensorUsage &cal_tensor_usage : order) {
     size_t prev_offset = 0;
     size_t best_offset = 0;
     bool best_offset_flag = false;
     size_t smallest_gap = SIZE_MAX;
-    TensorUsage cal_tensor_usage = tensor_usages_vec[idx].first;
     for (auto allocated_tensor : ordered_tensor_usages) {
       TensorUsage allocated_tensor_usage = allocated_tensor.first;
-      size_t max_first_op = std::max(cal_tensor_usage.first_idx,
-                                     allocated_tensor_usage.first_idx);
-      size_t min_last_op =
-          std::min(cal_tensor_usage.last_idx, allocated_tensor_usage.last_idx);
       size_t allocated_offset = allocated_tensor.second;
-      if (max_first_op <= min_last_op) {
+      if (cal_tensor_usage.life_overlap(allocated_tensor_usage)) {
         size_t gap = allocated_offset - prev_offset;
         if (allocated_offset > prev_offset && gap >= cal_tensor_usage.size &&
             gap < smallest_gap) {  // Note the subtraction handling for unsigned
@@ -75,16 +118,137 @@ void MemoryManager::calculate_buffer_() {
     if (!best_offset_flag) {
       best_offset = prev_offset;
     }
-    tensor_usages_vec[idx].second = best_offset;
-    ordered_tensor_usages.push_back(tensor_usages_vec[idx]);
-
-    std::sort(ordered_tensor_usages.begin(), ordered_tensor_usages.end(),
-              [](const std::pair<TensorUsage, size_t> &x,
-                 const std::pair<TensorUsage, size_t> &y) -> bool {
-                return x.second < y.second;
-              });
+    auto pos = std::upper_bound(
+        ordered_tensor_usages.begin(), ordered_tensor_usages.end(),
+        best_offset,
+        [](size_t offset, const std::pair<TensorUsage, size_t> &x) -> bool {
+          return offset < x.second;
+        });
+    ordered_tensor_usages.insert(pos,
+                                 std::make_pair(cal_tensor_usage, best_offset));
+  }
+  return ordered_tensor_usages;
+}
+
+size_t MemoryManager::peak_(const MemoryPlan &plan) {
+  size_t total_consumption = 0;
+  for (auto &iter : plan) {
+    total_consumption =
+        std::max(total_consumption, iter.first.size + iter.second);
+  }
+  return total_consumption;
+}
+
+MemoryManager::MemoryPlan MemoryManager::plan_offsets_(
+    const std::map<int, size_t> &tensor_sizes) {
+  std::vector<TensorUsage> usages;
+  for (auto iter : tensor_usages_) {
+    auto size_iter = tensor_sizes.find(iter.first);
+    if (size_iter != tensor_sizes.end()) {
+      iter.second.size = _growable.count(iter.first)
+                             ? size_iter->second
+                             : std::min(iter.second.size, size_iter->second);
+    }
+    usages.push_back(iter.second);
+  }
+  auto by_size = [](const TensorUsage &x, const TensorUsage &y) {
+    return x.size > y.size;
+  };
+
+  // Every planner places the tensors one by one in the smallest gap they
+  // fit, they differ in the order. No placement goes below the peak of the
+  // bytes alive at a node.
+  std::map<int, size_t> node_breadths = breadths(usages);
+  _plan_report.lower_bound = 0;
+  for (auto &iter : node_breadths) {
+    _plan_report.lower_bound = std::max(_plan_report.lower_bound, iter.second);
+  }
+  std::vector<std::pair<std::string, std::vector<TensorUsage>>> orders;
+
+  // Algorithm.3: Greedy by Size for Offset Calculation
+  // arxiv url: https://arxiv.org/abs/2001.03288
+  std::vector<TensorUsage> order = usages;
+  std::stable_sort(order.begin(), order.end(), by_size);
+  orders.push_back({"greedy_by_size", order});
+
+  // Greedy by Breadth of the same paper: the tensors of the node with the
+  // most bytes alive first.
+  std::vector<std::pair<int, size_t>> nodes(node_breadths.begin(),
+                                            node_breadths.end());
+  std::stable_sort(nodes.begin(), nodes.end(),
+                   [](const std::pair<int, size_t> &x,
+                      const std::pair<int, size_t> &y) {
+                     return x.second > y.second;
+                   });
+  std::vector<TensorUsage> remaining = order;
+  order.clear();
+  for (auto &node : nodes) {
+    auto alive = std::stable_partition(
+        remaining.begin(), remaining.end(), [&](const TensorUsage &usage) {
+          for (auto interval : usage.life_intervals()) {
+            if (interval.first <= node.first && node.first <= interval.second)
+              return false;
+          }
+          return true;
+        });
+    order.insert(order.end(), alive, remaining.end());
+    remaining.erase(alive, remaining.end());
+  }
+  orders.push_back({"greedy_by_breadth", order});
+
+  // Best fit in the order of the first use, the caching allocator of a
+  // framework with the free blocks split by the lifetimes.
+  order = usages;
+  std::stable_sort(order.begin(), order.end(),
+                   [&](const TensorUsage &x, const TensorUsage &y) {
+                     if (x.first_idx != y.first_idx)
+                       return x.first_idx < y.first_idx;
+                     return by_size(x, y);
+                   });
+  orders.push_back({"best_fit_by_lifetime", order});
+
+  MemoryPlan best_plan;
+  size_t best_peak = SIZE_MAX;
+  int best_idx = 0;
+  _plan_report.peaks.clear();
+  for (int idx = 0; idx < orders.size(); idx++) {
+    MemoryPlan plan = place_in_order_(orders[idx].second);
+    size_t peak = peak_(plan);
+    _plan_report.peaks.push_back({orders[idx].first, peak});
+    if (peak < best_peak) {
+      best_plan = plan, best_peak = peak, best_idx = idx;
+    }
+  }
+
+  // Small graphs are refined by swapping neighbours of the best order while
+  // the peak shrinks.
+  if (usages.size() <= kRefineTensors && best_peak > _plan_report.lower_bound) {
+    order = orders[best_idx].second;
+    bool improved = true;
+    for (int pass = 0; pass < kRefinePasses && improved; pass++) {
+      improved = false;
+      for (int idx = 0; idx + 1 < order.size(); idx++) {
+        std::swap(order[idx], order[idx + 1]);
+        MemoryPlan plan = place_in_order_(order);
+        size_t peak = peak_(plan);
+        if (peak < best_peak) {
+          best_plan = plan, best_peak = peak, improved = true;
+        } else {
+          std::swap(order[idx], order[idx + 1]);
+        }
+      }
+    }
+    _plan_report.peaks.push_back({"refined", best_peak});
+  }
+  _plan_report.picked = best_peak;
+  return best_plan;
+}
+
+void MemoryManager::allocate_buffer_(const MemoryPlan &ordered_tensor_usages) {
+  size_t total_consumption = 0;
+  for (auto &iter : ordered_tensor_usages) {
     total_consumption =
-        std::max(total_consumption, best_offset + cal_tensor_usage.size);
+        std::max(total_consumption, iter.first.size + iter.second);
   }
   _total_buffer_size = total_consumption;
 
@@ -95,10 +259,12 @@ void MemoryManager::calculate_buffer_() {
       _allocator_ptr->free_mem(iter);
     }
     buffer_vec_.clear();
+    buffer_size_vec_.clear();
   } catch (...) {
     printf("execute MemoryManager clear buffer failed!\n");
     throw std::runtime_error("execute MemoryManager clear buffer failed!");
   }
+  tensor_ptr.clear();
 
   size_t max_last_addr = 0;
   size_t record_last_addr = 0;
@@ -146,13 +312,17 @@ void MemoryManager::calculate_buffer_() {
     }
   }
 
+  _released = false;
+  _plan_version++;
+}
+
+void MemoryManager::check_plan_(const MemoryPlan &ordered_tensor_usages) {
+  MemoryPlan tensor_usages_vec = ordered_tensor_usages;
   // Add algorithm check module
   // return true means check success,
   auto judge_func = [](const std::pair<TensorUsage, size_t> &x,
                        const std::pair<TensorUsage, size_t> &y) {
-    auto max_time_l = std::max(x.first.first_idx, y.first.first_idx);
-    auto min_time_r = std::min(x.first.last_idx, y.first.last_idx);
-    if (min_time_r < max_time_l) {
+    if (!x.first.life_overlap(y.first)) {
       return true;
     }
     auto max_space_l = std::max(x.second, y.second);
@@ -163,7 +333,7 @@ void MemoryManager::calculate_buffer_() {
     }
     return false;
   };
-  temp_usages_vec.clear();
+  std::vector<std::pair<TensorUsage, size_t>> temp_usages_vec{};
   // print order
   std::sort(tensor_usages_vec.begin(), tensor_usages_vec.end(),
             [](const std::pair<TensorUsage, size_t> &x,
@@ -174,11 +344,13 @@ void MemoryManager::calculate_buffer_() {
                 return x.second + x.first.size > y.second + y.first.size;
               return x.first.first_idx < y.first.first_idx;
             });
+#ifdef MEM_DEBUG
   for (auto iter : tensor_usages_vec) {
     int unique_id = iter.first.unique_id;
     size_t size = iter.first.size;
-    char *addr = tensor_ptr.find(unique_id)->second;
-#ifdef MEM_DEBUG
+    // plans which are only cached do not have addresses yet.
+    auto ptr_iter = tensor_ptr.find(unique_id);
+    char *addr = (ptr_iter == tensor_ptr.end()) ? nullptr : ptr_iter->second;
     printf(
         "idx: %d, life cycle : [%d, %d], name: \"%s\", memory size: %.2f MB, "
         "end "
@@ -189,8 +361,8 @@ void MemoryManager::calculate_buffer_() {
         iter.first._name.c_str(), float(size) / MB_SIZE,
         float(iter.second + size) / MB_SIZE, iter.second, size,
         iter.second + size, addr, addr + size);
-#endif
   }
+#endif
 
   for (auto iter : tensor_usages_vec) {
     for (auto check_iter : temp_usages_vec) {
@@ -226,8 +398,185 @@ void MemoryManager::calculate_buffer_() {
     }
     temp_usages_vec.push_back(iter);
   }
+}
+
+void MemoryManager::register_tensor(int unique_id, const std::string &name,
+                                    size_t size) {
+  _tensors.push_back({unique_id, name});
+  for (size_t value : {std::hash<std::string>()(name), size}) {
+    _tensor_signature ^= value + 0x9e3779b9 + (_tensor_signature << 6) +
+                         (_tensor_signature >> 2);
+  }
+}
+
+/* The first line holds the signature and the number of tensors, every other
+line is a tensor of the plan:
+creation idx | first_idx last_idx gap_first gap_last | size offset
+*/
+void MemoryManager::save_plan(const std::string &path, size_t signature) {
+  std::map<int, int> creation_idx;
+  for (int idx = 0; idx < _tensors.size(); idx++) {
+    creation_idx[_tensors[idx].first] = idx;
+  }
+  std::string tmp_path = path + ".tmp";
+  FILE *fd = fopen(tmp_path.c_str(), "w");
+  if (fd == NULL) {
+    printf("[WARNING] can not write the memory plan %s\n", path.c_str());
+    return;
+  }
+  const MemoryPlan &plan = _cached_plans[{-1, -1}];
+  fprintf(fd, "# lightseq plan %zu %zu\n", signature, _tensors.size());
+  for (auto &iter : plan) {
+    const TensorUsage &usage = iter.first;
+    fprintf(fd, "%d | %d %d %d %d | %zu %zu\n",
+            creation_idx.at(usage.unique_id), usage.first_idx, usage.last_idx,
+            usage.gap_first, usage.gap_last, usage.size, iter.second);
+  }
+  fclose(fd);
+  // written whole first, another instance may be loading it.
+  std::rename(tmp_path.c_str(), path.c_str());
+}
+
+bool MemoryManager::load_plan(const std::string &path, size_t signature) {
+  FILE *fd = fopen(path.c_str(), "r");
+  if (fd == NULL) {
+    return false;
+  }
+  size_t saved_signature = 0, num_tensors = 0;
+  if (fscanf(fd, "# lightseq plan %zu %zu\n", &saved_signature,
+             &num_tensors) != 2 ||
+      saved_signature != signature || num_tensors != _tensors.size()) {
+    printf("[WARNING] %s is the memory plan of another model\n", path.c_str());
+    fclose(fd);
+    return false;
+  }
+  MemoryPlan plan;
+  std::map<int, TensorUsage> usages;
+  int idx, first_idx, last_idx, gap_first, gap_last;
+  size_t size, offset;
+  while (fscanf(fd, "%d | %d %d %d %d | %zu %zu\n", &idx, &first_idx,
+                &last_idx, &gap_first, &gap_last, &size, &offset) == 7) {
+    if (idx < 0 || idx >= _tensors.size()) break;
+    int unique_id = _tensors[idx].first;
+    TensorUsage usage(unique_id, first_idx, last_idx, size,
+                      _tensors[idx].second);
+    usage.gap_first = gap_first, usage.gap_last = gap_last;
+    usages.emplace(unique_id, usage);
+    plan.push_back(std::make_pair(usage, offset));
+  }
+  bool complete = feof(fd);
+  fclose(fd);
+  if (!complete) {
+    printf("[WARNING] %s is not a valid memory plan\n", path.c_str());
+    return false;
+  }
+
+  tensor_usages_ = usages;
+  allocate_buffer_(plan);
+  check_plan_(plan);
+  _active_plan_key = {-1, -1};
+  _cached_plans[_active_plan_key] = plan;
+  return true;
+}
+
+void MemoryManager::print_plan_report_() const {
+  printf("memory planners:");
+  for (auto &iter : _plan_report.peaks) {
+    printf(" %s %.2f MB,", iter.first.c_str(), float(iter.second) / MB_SIZE);
+  }
+  size_t lower_bound = std::max(_plan_report.lower_bound, size_t(1));
+  printf(" lower bound %.2f MB, picked %.2f MB (+%.1f%%)\n",
+         float(_plan_report.lower_bound) / MB_SIZE,
+         float(_plan_report.picked) / MB_SIZE,
+         100.f * (_plan_report.picked - _plan_report.lower_bound) /
+             lower_bound);
+}
+
+void MemoryManager::calculate_buffer_() {
+  printf("========== Execute MemoryManager calculate_buffer_ ==========\n\n");
+
+  MemoryPlan plan = plan_offsets_({});
+  print_plan_report_();
+  allocate_buffer_(plan);
+  check_plan_(plan);
+  _active_plan_key = {-1, -1};
+  _cached_plans[_active_plan_key] = plan;
 
   printf("\n========== Finish MemoryManager calculate_buffer_ ==========\n\n");
 }
 
+void MemoryManager::start_shape_recording() {
+  _recorded_sizes.clear();
+  _recording = true;
+}
+
+void MemoryManager::record_tensor_size(int unique_id, size_t size) {
+  if (!_recording) {
+    return;
+  }
+  size_t &recorded = _recorded_sizes[unique_id];
+  recorded = std::max(recorded, size);
+}
+
+void MemoryManager::finish_shape_recording(PlanKey plan_key) {
+  _recording = false;
+  MemoryPlan plan = plan_offsets_(_recorded_sizes);
+#ifdef MEM_DEBUG
+  print_plan_report_();
+#endif
+  check_plan_(plan);
+  _recorded_sizes.clear();
+  _cached_plans[plan_key] = plan;
+}
+
+size_t MemoryManager::plan_buffer_size(PlanKey plan_key) const {
+  auto iter = _cached_plans.find(plan_key);
+  return iter == _cached_plans.end() ? 0 : peak_(iter->second);
+}
+
+void MemoryManager::switch_plan(PlanKey plan_key) {
+  if (plan_key == _active_plan_key && !_released) {
+    return;
+  }
+  auto iter = _cached_plans.find(plan_key);
+  if (iter == _cached_plans.end()) {
+    printf("Error! memory plan of bucket (%d, %d) is not recorded!\n",
+           plan_key.first, plan_key.second);
+    throw std::runtime_error("switch to unrecorded memory plan");
+  }
+#ifdef MEM_DEBUG
+  printf("MemoryManager switch plan to bucket (%d, %d)\n", plan_key.first,
+         plan_key.second);
+#endif
+  allocate_buffer_(iter->second);
+  _active_plan_key = plan_key;
+}
+
+void MemoryManager::release_buffers() {
+  if (_released) {
+    return;
+  }
+  for (auto iter : buffer_vec_) {
+    _allocator_ptr->free_mem(iter);
+  }
+  printf("******** release shared buffer memory: %zu MB ********\n",
+         _total_buffer_size / MB_SIZE);
+  buffer_vec_.clear();
+  buffer_size_vec_.clear();
+  tensor_ptr.clear();
+  _released = true;
+}
+
+void MemoryManager::reacquire_buffers() {
+  if (!_released) {
+    return;
+  }
+  auto iter = _cached_plans.find(_active_plan_key);
+  if (iter == _cached_plans.end()) {
+    printf("Error! no active memory plan to reacquire!\n");
+    throw std::runtime_error("reacquire buffers without an active plan");
+  }
+  allocate_buffer_(iter->second);
+}
+
 }  // namespace lightseq
@@ -0,0 +1,242 @@
+#include "sstream"
+
+#include "metrics.h"
+#include "node.h"
+
+namespace lightseq {
+
+namespace {
+
+// the metrics updated by the models, the other ones are exported without
+// help text.
+const std::map<std::string, std::string> kMetricHelp = {
+    {"requests_total", "Requests served, a row of an Infer batch or a "
+                       "continuous batching request."},
+    {"prompt_tokens_total", "Prompt tokens run through the model."},
+    {"generated_tokens_total", "Tokens generated by the model."},
+    {"request_prompt_tokens", "Prompt tokens per request."},
+    {"request_generated_tokens", "Generated tokens per request."},
+    {"steps_total", "Decoding steps, each one generates a token of the "
+                    "running sequences."},
+    {"batch_occupancy", "Rows of the last step over the max batch size."},
+    {"kv_cache_utilization", "Used pages over all the pages of the paged kv "
+                             "cache."},
+    {"preemptions_total", "Running requests preempted by a request of a "
+                          "higher priority."},
+    {"cancelled_requests_total", "Requests, or rows of an Infer batch, "
+                                 "cancelled before they finished."},
+    {"expired_requests_total", "Requests evicted once their deadline "
+                               "passed."},
+    {"weight_updates_total", "Hot weight updates switched to, see "
+                             "update_weights."},
+    {"kv_offloaded_tokens_total", "Tokens whose kv was saved to host memory, "
+                                  "see LIGHTSEQ_KV_HOST_MB."},
+    {"kv_restored_tokens_total", "Prompt tokens whose kv was restored from "
+                                 "host memory instead of prefilled."},
+    {"kv_host_utilization", "Used pages over all the pages of the kv in host "
+                            "memory."},
+    {"suspends_total", "Idle releases of the activations and the kv "
+                       "caches, see LSModel::suspend."},
+    {"weight_evictions_total", "Weights paged out to host memory, see "
+                               "ModelManager."},
+    {"memory_plan_bytes", "Size of the shared activation buffer of the "
+                          "memory planner."},
+    {"sampled_forwards_total", "Forwards whose layers were timed, see "
+                               "layer_gpu_seconds_total."},
+    {"layer_gpu_seconds_total", "GPU time of every layer, summed over the "
+                                "sampled forwards only."},
+};
+
+}  // namespace
+
+Metrics::Metrics(Context* context_ptr) : _context_ptr(context_ptr) {
+#ifndef LIGHTSEQ_cuda
+  _base_time = std::chrono::high_resolution_clock::now();
+#endif
+  const char* interval_env = std::getenv("LIGHTSEQ_METRICS_LAYER_SAMPLING");
+  if (interval_env) set_layer_sampling(std::atoi(interval_env));
+}
+
+Metrics::~Metrics() {
+#ifdef LIGHTSEQ_cuda
+  for (Record& record : _pending) {
+    _free_events.push_back(record.start);
+    _free_events.push_back(record.end);
+  }
+  for (cudaEvent_t event : _free_events) {
+    cudaEventDestroy(event);
+  }
+#endif
+}
+
+#ifdef LIGHTSEQ_cuda
+cudaEvent_t Metrics::acquire_event() {
+  cudaEvent_t event;
+  if (_free_events.empty()) {
+    CHECK_GPU_ERROR(cudaEventCreate(&event));
+  } else {
+    event = _free_events.back();
+    _free_events.pop_back();
+  }
+  return event;
+}
+#endif
+
+Metrics::Sample& Metrics::sample(const std::string& name, Type type,
+                                 const std::string& labels) {
+  Family& family = _families[name];
+  family.type = type;
+  Sample& res = family.samples[labels];
+  if (type == Type::Histogram && res.buckets.empty()) {
+    res.buckets.resize(kHistogramBuckets + 1);
+  }
+  return res;
+}
+
+std::string Metrics::layer_key(const std::string& node_name) {
+  return node_name.substr(0, node_name.find_first_of("/:"));
+}
+
+void Metrics::add(const std::string& name, double value,
+                  const std::string& labels) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  sample(name, Type::Counter, labels).value += value;
+}
+
+void Metrics::set(const std::string& name, double value,
+                  const std::string& labels) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  sample(name, Type::Gauge, labels).value = value;
+}
+
+void Metrics::observe(const std::string& name, double value,
+                      const std::string& labels) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  Sample& res = sample(name, Type::Histogram, labels);
+  int bucket = 0;
+  while (bucket < kHistogramBuckets && value > double(1 << bucket)) {
+    bucket++;
+  }
+  res.buckets[bucket]++;
+  res.value += value;
+  res.count++;
+}
+
+double Metrics::get(const std::string& name, const std::string& labels) const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto family = _families.find(name);
+  if (family == _families.end()) return 0;
+  auto res = family->second.samples.find(labels);
+  return res == family->second.samples.end() ? 0 : res->second.value;
+}
+
+void Metrics::set_layer_sampling(int interval) {
+  _sample_interval = std::max(interval, 0);
+}
+
+void Metrics::begin_forward() {
+  _sampling = _sample_interval > 0 && _num_forwards % _sample_interval == 0;
+  _num_forwards++;
+}
+
+void Metrics::end_forward() {
+  if (!_sampling) return;
+  _sampling = false;
+  std::map<std::string, double> layer_seconds;
+  for (Record& record : _pending) {
+#ifdef LIGHTSEQ_cuda
+    float ms = 0;
+    CHECK_GPU_ERROR(cudaEventSynchronize(record.end));
+    CHECK_GPU_ERROR(cudaEventElapsedTime(&ms, record.start, record.end));
+    _free_events.push_back(record.start);
+    _free_events.push_back(record.end);
+    layer_seconds[record.layer] += ms * 1e-3;
+#else
+    layer_seconds[record.layer] += (record.end_us - record.start_us) * 1e-6;
+#endif
+  }
+  _pending.clear();
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  sample("sampled_forwards_total", Type::Counter, "").value += 1;
+  for (auto& iter : layer_seconds) {
+    sample("layer_gpu_seconds_total", Type::Counter,
+           "layer=\"" + iter.first + "\"")
+        .value += iter.second;
+  }
+}
+
+void Metrics::before_op(Operator* op) {
+#ifdef LIGHTSEQ_cuda
+  _current_skipped = _context_ptr->is_capturing();
+  if (_current_skipped) return;
+  _current.start = acquire_event();
+  _current.end = acquire_event();
+  CHECK_GPU_ERROR(cudaEventRecord(_current.start, _context_ptr->get_stream()));
+#else
+  _current.start_us = std::chrono::duration<double, std::micro>(
+                          std::chrono::high_resolution_clock::now() -
+                          _base_time)
+                          .count();
+#endif
+  _current.layer = layer_key(op->name());
+}
+
+void Metrics::after_op(Operator* op) {
+  if (_current_skipped) return;
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaEventRecord(_current.end, _context_ptr->get_stream()));
+#else
+  _current.end_us = std::chrono::duration<double, std::micro>(
+                        std::chrono::high_resolution_clock::now() - _base_time)
+                        .count();
+#endif
+  _pending.push_back(_current);
+}
+
+std::string Metrics::prometheus_text() const {
+  static const char* kTypeNames[] = {"counter", "gauge", "histogram"};
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::ostringstream out;
+  // the counters of tokens stay exact.
+  out.precision(15);
+  for (auto& family_iter : _families) {
+    std::string name = "lightseq_" + family_iter.first;
+    const Family& family = family_iter.second;
+    auto help = kMetricHelp.find(family_iter.first);
+    if (help != kMetricHelp.end()) {
+      out << "# HELP " << name << " " << help->second << "\n";
+    }
+    out << "# TYPE " << name << " " << kTypeNames[int(family.type)] << "\n";
+    for (auto& iter : family.samples) {
+      const std::string& labels = iter.first;
+      const Sample& res = iter.second;
+      if (family.type != Type::Histogram) {
+        out << name << (labels.empty() ? "" : "{" + labels + "}") << " "
+            << res.value << "\n";
+        continue;
+      }
+      std::string sep = labels.empty() ? "" : labels + ",";
+      size_t cumulative = 0;
+      for (int bucket = 0; bucket <= kHistogramBuckets; bucket++) {
+        cumulative += res.buckets[bucket];
+        std::string le = bucket < kHistogramBuckets
+                             ? std::to_string(1 << bucket)
+                             : std::string("+Inf");
+        out << name << "_bucket{" << sep << "le=\"" << le << "\"} "
+            << cumulative << "\n";
+      }
+      std::string suffix = labels.empty() ? "" : "{" + labels + "}";
+      out << name << "_sum" << suffix << " " << res.value << "\n";
+      out << name << "_count" << suffix << " " << res.count << "\n";
+    }
+  }
+  return out.str();
+}
+
+void Metrics::reset() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _families.clear();
+}
+
+}  // namespace lightseq
@@ -1,4 +1,8 @@
 #include "node.h"
+#include "scheduler.h"
+#include "profiler.h"
+#include "nvtx_range.h"
+#include "metrics.h"
 
 namespace lightseq {
 
@@ -42,6 +46,19 @@ void Node::set_parents(std::vector<Node*> parents) {
   }
 }
 
+void Node::replace_parent(Node* old_parent, Node* new_parent) {
+  std::replace(_parents.begin(), _parents.end(), old_parent, new_parent);
+}
+
+void Node::replace_child(Node* old_child, Node* new_child) {
+  std::replace(_children.begin(), _children.end(), old_child, new_child);
+}
+
+void Node::remove_child(Node* child) {
+  _children.erase(std::remove(_children.begin(), _children.end(), child),
+                  _children.end());
+}
+
 void Node::recursive_forward() {
   if (_fw_flag) return;
   for (Node* iter : _parents) {
@@ -88,8 +105,31 @@ void Node::recursive_forward() {
   auto start = std::chrono::high_resolution_clock::now();
 #endif
 
+  StreamScheduler* scheduler = _context_ptr->stream_scheduler();
+  bool scheduled = node_type() == NodeType::Operator && scheduler &&
+                   scheduler->in_scope();
+  if (scheduled) scheduler->before_op(static_cast<Operator*>(this));
+  Profiler* profiler = _context_ptr->is_built() ? _context_ptr->profiler()
+                                                : nullptr;
+  bool profiled = node_type() == NodeType::Operator && profiler;
+  if (profiled) profiler->before_op(static_cast<Operator*>(this));
+  Metrics* metrics = _context_ptr->metrics();
+  bool sampled = node_type() == NodeType::Operator &&
+                 _context_ptr->is_built() && metrics->sampling();
+  if (sampled) metrics->before_op(static_cast<Operator*>(this));
+#ifdef LIGHTSEQ_nvtx
+  if (node_type() == NodeType::Operator) nvtxRangePushA(name().c_str());
+#endif
+
   forward();
 
+#ifdef LIGHTSEQ_nvtx
+  if (node_type() == NodeType::Operator) nvtxRangePop();
+#endif
+  if (sampled) metrics->after_op(static_cast<Operator*>(this));
+  if (profiled) profiler->after_op(static_cast<Operator*>(this));
+  if (scheduled) scheduler->after_op(static_cast<Operator*>(this));
+
 #ifdef DEBUG_MODE
   if (node_type() != NodeType::Operator || !_context_ptr->is_built()) {
     return;
@@ -0,0 +1,248 @@
+#include "profiler.h"
+#include "node.h"
+
+namespace lightseq {
+
+namespace {
+
+std::string json_escape(const std::string& str) {
+  std::string res;
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      res += '\\';
+    }
+    res += c;
+  }
+  return res;
+}
+
+}  // namespace
+
+Profiler::Profiler(Context* context_ptr) : _context_ptr(context_ptr) {
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaEventCreate(&_base_event));
+  CHECK_GPU_ERROR(cudaEventRecord(_base_event, _context_ptr->get_stream()));
+#else
+  _base_time = std::chrono::high_resolution_clock::now();
+#endif
+}
+
+Profiler::~Profiler() {
+#ifdef LIGHTSEQ_cuda
+  cudaDeviceSynchronize();
+  for (Record& record : _pending) {
+    _free_events.push_back(record.start);
+    _free_events.push_back(record.end);
+  }
+  for (cudaEvent_t event : _free_events) {
+    cudaEventDestroy(event);
+  }
+  cudaEventDestroy(_base_event);
+#endif
+}
+
+#ifdef LIGHTSEQ_cuda
+cudaEvent_t Profiler::acquire_event() {
+  cudaEvent_t event;
+  if (_free_events.empty()) {
+    CHECK_GPU_ERROR(cudaEventCreate(&event));
+  } else {
+    event = _free_events.back();
+    _free_events.pop_back();
+  }
+  return event;
+}
+#else
+double Profiler::host_us() {
+  return std::chrono::duration<double, std::micro>(
+             std::chrono::high_resolution_clock::now() - _base_time)
+      .count();
+}
+#endif
+
+std::string Profiler::op_key(const std::string& node_name) {
+  // drop the "_<idx>" suffix of every layer and of the node itself.
+  std::string res;
+  size_t begin = 0;
+  while (begin <= node_name.size()) {
+    size_t end = node_name.find_first_of("/:", begin);
+    if (end == std::string::npos) end = node_name.size();
+    std::string part = node_name.substr(begin, end - begin);
+    size_t pos = part.find_last_of('_');
+    if (pos != std::string::npos && pos + 1 < part.size() &&
+        part.find_first_not_of("0123456789", pos + 1) == std::string::npos) {
+      part = part.substr(0, pos);
+    }
+    res += part;
+    if (end < node_name.size()) res += node_name[end];
+    begin = end + 1;
+  }
+  return res;
+}
+
+std::string Profiler::layer_key(const std::string& node_name) {
+  size_t pos = node_name.find_last_of(':');
+  return pos == std::string::npos ? "" : node_name.substr(0, pos);
+}
+
+void Profiler::before_op(Operator* op) {
+#ifdef LIGHTSEQ_cuda
+  _current_skipped = _context_ptr->is_capturing();
+  if (_current_skipped) return;
+  cudaStream_t stream = _context_ptr->get_stream();
+  auto iter = _stream_ids.find(stream);
+  if (iter == _stream_ids.end()) {
+    iter = _stream_ids.emplace(stream, int(_stream_ids.size())).first;
+  }
+  _current.stream_idx = iter->second;
+  _current.start = acquire_event();
+  _current.end = acquire_event();
+  CHECK_GPU_ERROR(cudaEventRecord(_current.start, stream));
+#else
+  _current.stream_idx = 0;
+  _current.start_us = host_us();
+#endif
+
+  _current.node_name = op->name();
+  _current.flops = op->flops();
+  _current.bytes = 0;
+  for (Node* node : op->parents()) {
+    if (node) _current.bytes += static_cast<Variable*>(node)->value_byte_size();
+  }
+  for (Node* node : op->children()) {
+    if (node) _current.bytes += static_cast<Variable*>(node)->value_byte_size();
+  }
+}
+
+void Profiler::after_op(Operator* op) {
+  if (_current_skipped) return;
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaEventRecord(_current.end, _context_ptr->get_stream()));
+#else
+  _current.end_us = host_us();
+#endif
+  _pending.push_back(_current);
+  if (_pending.size() >= kMaxPending) {
+    flush();
+  }
+}
+
+void Profiler::flush() {
+  for (Record& record : _pending) {
+    TraceEvent event;
+#ifdef LIGHTSEQ_cuda
+    float start_ms = 0, end_ms = 0;
+    CHECK_GPU_ERROR(cudaEventSynchronize(record.end));
+    CHECK_GPU_ERROR(cudaEventElapsedTime(&start_ms, _base_event, record.start));
+    CHECK_GPU_ERROR(cudaEventElapsedTime(&end_ms, _base_event, record.end));
+    _free_events.push_back(record.start);
+    _free_events.push_back(record.end);
+    event.ts_us = start_ms * 1000.;
+    event.dur_us = (end_ms - start_ms) * 1000.;
+#else
+    event.ts_us = record.start_us;
+    event.dur_us = record.end_us - record.start_us;
+#endif
+    event.node_name = record.node_name;
+    event.bytes = record.bytes;
+    event.flops = record.flops;
+    event.stream_idx = record.stream_idx;
+
+    for (OpStats* stats : {&_op_stats[op_key(record.node_name)],
+                           &_layer_stats[layer_key(record.node_name)]}) {
+      stats->count++;
+      stats->total_us += event.dur_us;
+      stats->max_us = std::max(stats->max_us, event.dur_us);
+      stats->bytes += event.bytes;
+      stats->flops += event.flops;
+    }
+    _trace.push_back(event);
+  }
+  _pending.clear();
+}
+
+void Profiler::reset() {
+  flush();
+  _trace.clear();
+  _op_stats.clear();
+  _layer_stats.clear();
+}
+
+void Profiler::print_stats(const std::map<std::string, OpStats>& stats,
+                           const std::string& title) {
+  std::vector<std::pair<std::string, OpStats>> sorted(stats.begin(),
+                                                      stats.end());
+  std::sort(sorted.begin(), sorted.end(),
+            [](const std::pair<std::string, OpStats>& x,
+               const std::pair<std::string, OpStats>& y) {
+              return x.second.total_us > y.second.total_us;
+            });
+  double all_us = 0;
+  for (auto& iter : sorted) all_us += iter.second.total_us;
+
+  printf("========== %s ==========\n", title.c_str());
+  printf("%10s %7s %8s %10s %10s %10s %10s  %s\n", "total(ms)", "ratio",
+         "calls", "avg(us)", "max(us)", "GB/s", "TFLOPS", "name");
+  for (auto& iter : sorted) {
+    const OpStats& s = iter.second;
+    double seconds = s.total_us * 1e-6;
+    printf("%10.3f %6.2f%% %8d %10.2f %10.2f %10.2f %10.3f  %s\n",
+           s.total_us / 1000., all_us ? s.total_us / all_us * 100 : 0.,
+           s.count, s.total_us / s.count, s.max_us,
+           seconds > 0 ? s.bytes / seconds / 1e9 : 0.,
+           seconds > 0 ? s.flops / seconds / 1e12 : 0., iter.first.c_str());
+  }
+}
+
+void Profiler::print_summary() {
+  flush();
+  print_stats(_op_stats, "Profiler: per operator");
+  print_stats(_layer_stats, "Profiler: per layer");
+}
+
+void Profiler::export_chrome_trace(const std::string& file_path) {
+  flush();
+  std::ofstream fout(file_path);
+  if (!fout.is_open()) {
+    printf("Error! can not open profiler trace file %s\n", file_path.c_str());
+    throw std::runtime_error("can not open profiler trace file.");
+  }
+
+  fout << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  fout << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, "
+          "\"args\": {\"name\": \"operators\"}},\n";
+  fout << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+          "\"args\": {\"name\": \"memory plan (time axis is node index)\"}}";
+
+  for (const TraceEvent& event : _trace) {
+    double seconds = event.dur_us * 1e-6;
+    fout << ",\n{\"name\": \"" << json_escape(op_key(event.node_name))
+         << "\", \"cat\": \"op\", \"ph\": \"X\", \"pid\": 0, \"tid\": "
+         << event.stream_idx << ", \"ts\": " << event.ts_us
+         << ", \"dur\": " << event.dur_us << ", \"args\": {\"node\": \""
+         << json_escape(event.node_name) << "\", \"layer\": \""
+         << json_escape(layer_key(event.node_name))
+         << "\", \"bytes\": " << event.bytes << ", \"flops\": " << event.flops
+         << ", \"GB/s\": " << (seconds > 0 ? event.bytes / seconds / 1e9 : 0.)
+         << ", \"TFLOPS\": "
+         << (seconds > 0 ? event.flops / seconds / 1e12 : 0.) << "}}";
+  }
+
+  for (auto& iter : _context_ptr->memory_manager_ptr()->active_plan()) {
+    const TensorUsage& usage = iter.first;
+    fout << ",\n{\"name\": \"" << json_escape(usage._name)
+         << "\", \"cat\": \"memory\", \"ph\": \"X\", \"pid\": 1, \"tid\": 0, "
+            "\"ts\": "
+         << usage.first_idx
+         << ", \"dur\": " << usage.last_idx - usage.first_idx + 1
+         << ", \"args\": {\"unique_id\": " << usage.unique_id
+         << ", \"size\": " << usage.size << ", \"offset\": " << iter.second
+         << "}}";
+  }
+  fout << "\n]}\n";
+  fout.close();
+  printf("Profiler trace with %zu events is saved to %s\n", _trace.size(),
+         file_path.c_str());
+}
+
+}  // namespace lightseq
@@ -0,0 +1,167 @@
+#include "scheduler.h"
+#include "node.h"
+
+namespace lightseq {
+
+StreamScheduler::StreamScheduler(Context* context_ptr, int num_streams)
+    : _context_ptr(context_ptr), _num_streams(std::max(num_streams, 1)) {
+  _stream_tail.assign(_num_streams, -1);
+#ifdef LIGHTSEQ_cuda
+  _streams.assign(_num_streams, 0);
+  for (int idx = 1; idx < _num_streams; idx++) {
+    CHECK_GPU_ERROR(cudaStreamCreateWithPriority(
+        &_streams[idx], cudaStreamNonBlocking,
+        _context_ptr->stream_priority()));
+  }
+  CHECK_GPU_ERROR(
+      cudaEventCreateWithFlags(&_scope_event, cudaEventDisableTiming));
+#endif
+}
+
+StreamScheduler::~StreamScheduler() {
+#ifdef LIGHTSEQ_cuda
+  for (cudaEvent_t event : _events) {
+    cudaEventDestroy(event);
+  }
+  cudaEventDestroy(_scope_event);
+  for (int idx = 1; idx < _num_streams; idx++) {
+    cudaStreamDestroy(_streams[idx]);
+  }
+#endif
+}
+
+void StreamScheduler::collect_accesses(Operator* op,
+                                       std::vector<Access>* accesses) {
+  accesses->clear();
+  for (Node* node : op->parents()) {
+    if (node == nullptr) continue;
+    Variable* var = static_cast<Variable*>(node);
+    bool is_regress =
+        var->variable_type() == VariableType::RegressiveVariable ||
+        (var->variable_type() == VariableType::OffsetVariable &&
+         var->ancestor()->variable_type() == VariableType::RegressiveVariable);
+    accesses->push_back({var->value(), var->value_byte_size(), is_regress});
+  }
+  for (Node* node : op->children()) {
+    if (node == nullptr) continue;
+    Variable* var = static_cast<Variable*>(node);
+    accesses->push_back({var->value(), var->value_byte_size(), true});
+  }
+  for (const TensorPtr& tensor : op->workspaces()) {
+    if (tensor == nullptr) continue;
+    accesses->push_back({tensor->tensor(), tensor->byte_size(), true});
+  }
+}
+
+bool StreamScheduler::is_conflict(const std::vector<Access>& a,
+                                  const std::vector<Access>& b) {
+  for (const Access& x : a) {
+    for (const Access& y : b) {
+      if (!x.is_write && !y.is_write) continue;
+      // a variable without any known size still conflicts on its address.
+      size_t x_bytes = std::max(x.bytes, size_t(1));
+      size_t y_bytes = std::max(y.bytes, size_t(1));
+      if (x.ptr < y.ptr + y_bytes && y.ptr < x.ptr + x_bytes) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void StreamScheduler::begin_scope() {
+  if (_depth++ > 0) return;
+  _issued.clear();
+  _stream_tail.assign(_num_streams, -1);
+#ifdef LIGHTSEQ_cuda
+  _streams[0] = _context_ptr->get_stream();
+  CHECK_GPU_ERROR(cudaEventRecord(_scope_event, _streams[0]));
+#endif
+}
+
+void StreamScheduler::end_scope() {
+  if (--_depth > 0) return;
+#ifdef LIGHTSEQ_cuda
+  for (int idx = 1; idx < _num_streams; idx++) {
+    if (_stream_tail[idx] < 0) continue;
+    CHECK_GPU_ERROR(
+        cudaStreamWaitEvent(_streams[0], _events[_stream_tail[idx]], 0));
+  }
+  _context_ptr->switch_compute_stream(_streams[0]);
+#endif
+  _issued.clear();
+}
+
+void StreamScheduler::before_op(Operator* op) {
+  collect_accesses(op, &_current.accesses);
+
+  // the latest conflicting operator on each stream.
+  std::vector<int> stream_dep(_num_streams, -1);
+  int latest_dep = -1;
+  for (int idx = 0; idx < _issued.size(); idx++) {
+    if (is_conflict(_issued[idx].accesses, _current.accesses)) {
+      stream_dep[_issued[idx].stream_idx] = idx;
+      latest_dep = idx;
+    }
+  }
+
+  // continue a chain when possible, otherwise fork onto an unused stream, or
+  // onto the stream which has been idle the longest.
+  int stream_idx = -1;
+  if (latest_dep >= 0 &&
+      _stream_tail[_issued[latest_dep].stream_idx] == latest_dep) {
+    stream_idx = _issued[latest_dep].stream_idx;
+  }
+  for (int idx = 0; idx < _num_streams && stream_idx < 0; idx++) {
+    if (stream_dep[idx] >= 0 && stream_dep[idx] == _stream_tail[idx]) {
+      stream_idx = idx;
+    }
+  }
+  for (int idx = 0; idx < _num_streams && stream_idx < 0; idx++) {
+    if (_stream_tail[idx] < 0) {
+      stream_idx = idx;
+    }
+  }
+  if (stream_idx < 0) {
+    stream_idx = 0;
+    for (int idx = 1; idx < _num_streams; idx++) {
+      if (_stream_tail[idx] < _stream_tail[stream_idx]) {
+        stream_idx = idx;
+      }
+    }
+  }
+  _current.stream_idx = stream_idx;
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _streams[stream_idx];
+  if (stream_idx != 0 && _stream_tail[stream_idx] < 0) {
+    // the first operator of a pool stream in this scope must observe all the
+    // work issued before the layer.
+    CHECK_GPU_ERROR(cudaStreamWaitEvent(stream, _scope_event, 0));
+  }
+  for (int idx = 0; idx < _num_streams; idx++) {
+    if (idx == stream_idx || stream_dep[idx] < 0) continue;
+    CHECK_GPU_ERROR(cudaStreamWaitEvent(stream, _events[stream_dep[idx]], 0));
+  }
+  if (_context_ptr->get_stream() != stream) {
+    _context_ptr->switch_compute_stream(stream);
+  }
+#endif
+}
+
+void StreamScheduler::after_op(Operator* op) {
+  int op_idx = _issued.size();
+#ifdef LIGHTSEQ_cuda
+  if (op_idx >= _events.size()) {
+    cudaEvent_t event;
+    CHECK_GPU_ERROR(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+    _events.push_back(event);
+  }
+  CHECK_GPU_ERROR(
+      cudaEventRecord(_events[op_idx], _streams[_current.stream_idx]));
+#endif
+  _stream_tail[_current.stream_idx] = op_idx;
+  _issued.push_back(_current);
+}
+
+}  // namespace lightseq
@@ -11,6 +11,10 @@ template <>
 cuda::DataType g_dtype<__half>() {
   return cuda::DataType::kFloat16;
 }
+template <>
+cuda::DataType g_dtype<__nv_bfloat16>() {
+  return cuda::DataType::kBFloat16;
+}
 #endif
 template <>
 cuda::DataType g_dtype<float>() {
@@ -57,6 +61,8 @@ int dtype_size(cuda::DataType dtype) {
   switch (dtype) {
     case cuda::DataType::kFloat16:
       return 2;
+    case cuda::DataType::kBFloat16:
+      return 2;
     case cuda::DataType::kFloat32:
       return 4;
     case cuda::DataType::kFloat64:
@@ -94,7 +100,7 @@ int dtype_size(cuda::DataType dtype) {
   exit(-1);
 }
 
-int Tensor::global_tensor_id = 0;
+std::atomic<int> Tensor::global_tensor_id(0);
 Tensor::Tensor(std::string name, cuda::DataType dtype, size_t mx_shape_size)
     : _id(global_tensor_id++),
       _ctx_ptr(Context::global_instance().get()),
@@ -108,6 +114,7 @@ Tensor::Tensor(std::string name, cuda::DataType dtype, size_t mx_shape_size)
                               : LSMemoryType::FixedMemory;
   if (_mtype == LSMemoryType::SharedMemory) {
     _mm_ptr = _ctx_ptr->memory_manager_ptr();
+    _mm_ptr->register_tensor(_id, _name, _mx_shape_size * dtype_size(_dtype));
     if (_ctx_ptr->mx_tensor_size < _mx_shape_size * dtype_size(_dtype)) {
       _ctx_ptr->mx_tensor_size = _mx_shape_size * dtype_size(_dtype);
       _ctx_ptr->mx_tensor_name = _name;
@@ -138,7 +145,20 @@ void Tensor::set_tensor(char* inp) {
 
 void Tensor::set_tensor(const char* inp) { set_tensor(const_cast<char*>(inp)); }
 
-void Tensor::set_shape(Shape shape) { _shape = shape; }
+void Tensor::set_shape(Shape shape) {
+  _shape = shape;
+  if (_ctx_ptr->memory_manager_ptr()->is_recording()) {
+    record_size(_shape.element_size() * dtype_size(_dtype));
+  }
+}
+
+void Tensor::record_size(size_t byte_size) {
+  if (_mtype == LSMemoryType::OffsetMemory) {
+    _original_tensor->record_size(byte_size + _offset * dtype_size(_dtype));
+  } else if (_mtype == LSMemoryType::SharedMemory) {
+    _mm_ptr->record_tensor_size(_id, byte_size);
+  }
+}
 
 void Tensor::set_offset(size_t offset, Shape shape) {
   if (_original_tensor == nullptr) {
@@ -153,6 +173,9 @@ void Tensor::set_offset(size_t offset, Shape shape) {
   }
   _shape = shape;
   _offset = offset;
+  if (_ctx_ptr->memory_manager_ptr()->is_recording()) {
+    record_size(_shape.element_size() * dtype_size(_dtype));
+  }
 }
 
 char* Tensor::tensor(bool is_open_interval) {
@@ -167,12 +190,13 @@ char* Tensor::tensor(bool is_open_interval) {
     return _ptr;
   }
   if (_mtype == LSMemoryType::SharedMemory) {
-    if (_ptr == nullptr) {
+    if (_ptr == nullptr || _plan_version != _mm_ptr->plan_version()) {
       if (!_ctx_ptr->is_built()) {
         update_life_idx(_ctx_ptr->node_idx() - is_open_interval);
         return _ctx_ptr->temporary_buffer_;
       }
       _ptr = _mm_ptr->get_memory(_id);
+      _plan_version = _mm_ptr->plan_version();
     }
     return _ptr;
   }
@@ -180,6 +204,17 @@ char* Tensor::tensor(bool is_open_interval) {
   return nullptr;
 }
 
+size_t Tensor::byte_size() {
+  if (_mtype == LSMemoryType::SharedMemory) {
+    return _mx_shape_size * dtype_size(_dtype);
+  }
+  const std::vector<size_t>& shape = _shape.view();
+  if (shape.empty() || (shape.size() == 1 && shape[0] == 0)) {
+    return 0;
+  }
+  return _shape.element_size() * dtype_size(_dtype);
+}
+
 void Tensor::update_life_idx(int node_idx) {
   if (_mtype == LSMemoryType::FixedMemory) {
     return;
@@ -193,6 +228,20 @@ void Tensor::remove_life_cycle() {
   if (_mm_ptr) _mm_ptr->remove_life_cycle(_id);
 }
 
+void Tensor::open_life_gap() {
+  if (_mtype != LSMemoryType::SharedMemory) {
+    return;
+  }
+  _mm_ptr->open_life_gap(_id);
+}
+
+void Tensor::allow_growth() {
+  if (_mtype != LSMemoryType::SharedMemory) {
+    return;
+  }
+  _mm_ptr->allow_growth(_id);
+}
+
 void Tensor::reset_fixed() {
   if (_mtype == LSMemoryType::FixedMemory) {
     return;
@@ -71,6 +71,14 @@ void Variable::fixed_memory() {
   return;
 }
 
+void Variable::open_life_gap() {
+  if (_value) _value->open_life_gap();
+}
+
+void Variable::allow_growth() {
+  if (_value) _value->allow_growth();
+}
+
 void Variable::swap_tensor(Variable* var_a, Variable* var_b) {
   Tensor temp = *(var_a->_value.get());
   *(var_a->_value.get()) = *(var_b->_value.get());
@@ -132,6 +140,14 @@ char* Variable::value(bool is_open_interval) {
   return _value->tensor(is_open_interval);
 }
 
+size_t Variable::value_byte_size() {
+  const std::vector<size_t>& shape = _value->shape();
+  if (shape.size() == 1 && shape[0] == 0) {
+    return _value->mx_shape_size() * dtype_size(_fw_dtype);
+  }
+  return _value->element_size() * dtype_size(_fw_dtype);
+}
+
 char* Variable::grad(bool is_open_interval) {
   return _grad->tensor(is_open_interval);
 }
@@ -160,7 +176,7 @@ void Variable::add_descendants(Variable* var) {
   _children_variable.insert(var);
 }
 
-void Variable::set_offset(int offset, Shape shape) {
+void Variable::set_offset(size_t offset, Shape shape) {
   _shape = shape;
   _value->set_offset(offset, shape);
   if (_grad != nullptr) {
@@ -1,13 +1,39 @@
 #include "bert.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
 
 namespace lightseq {
 namespace cuda {
-Bert::Bert(const std::string weight_path, const int max_batch_size)
-    : LSModel({"token_ids"}, {"encoder_output"}),
+
+namespace {
+
+float exit_entropy_opt(const ModelOptions &options) {
+  const char *entropy_opt = model_option(options, "bert_exit_entropy");
+  return entropy_opt ? std::atof(entropy_opt) : 0.f;
+}
+
+std::vector<std::string> bert_output_names(const ModelOptions &options) {
+  if (exit_entropy_opt(options) > 0) return {"logits", "exit_layers"};
+  return {"encoder_output"};
+}
+
+inline float to_float(float value) { return value; }
+#ifdef LIGHTSEQ_cuda
+inline float to_float(__half value) { return __half2float(value); }
+#endif
+
+}  // namespace
+
+template <typename OpType_>
+Bert<OpType_>::Bert(const std::string weight_path, const int max_batch_size,
+                    const ModelOptions &options)
+    : LSModel({"token_ids"}, bert_output_names(options)),
       _max_batch_size(max_batch_size) {
   /* --- step.1 initial context --- */
-  Context::create_global_context(StatusType::Inference);
-  _context_ptr = Context::global_instance();
+  _context_ptr = std::make_shared<Context>(StatusType::Inference, -1);
+  // the graph of the model is created in its own context.
+  ContextScope context_scope(_context_ptr);
 
   /* --- step.2 load model weights into GPU memory --- */
   // saved in custom proto file
@@ -23,16 +49,87 @@ Bert::Bert(const std::string weight_path, const int max_batch_size)
 
   /* --- step.4 inital operator & layer --- */
   int max_batch_tokens = tw_._max_step * _max_batch_size;
+  // a sentence language token is not part of the input tokens, which the
+  // packing is computed from.
+  const char *varlen_opt = model_option(options, "varlen");
+  _varlen = varlen_opt && std::atoi(varlen_opt) != 0 &&
+            tw_._multilg_type != 2;
+  // the linears of the encoder layers run in int8, with the weights quantized
+  // per output channel at load.
+  const char *int8_opt = model_option(options, "int8");
+  bool int8 = int8_opt && std::atoi(int8_opt) != 0;
+  // the output is the pooled [batch_size, hidden_size] sentence embeddings
+  // rather than the encoder output with bert_pooling=cls, mean or
+  // max, l2 normalized with bert_pooling_norm=1, in fp16 with
+  // bert_pooling_fp16=1.
+  const char *pooling_opt = model_option(options, "bert_pooling");
+  std::string pooling = pooling_opt ? pooling_opt : "";
+  const char *norm_opt = model_option(options, "bert_pooling_norm");
+  bool l2_norm = norm_opt && std::atoi(norm_opt) != 0;
+  const char *fp16_opt = model_option(options, "bert_pooling_fp16");
+  _half_output = !pooling.empty() && fp16_opt && std::atoi(fp16_opt) != 0;
+  // early exit: a row leaves the batch after the first layer whose exit head
+  // predicts its label with an entropy below bert_exit_entropy, the
+  // batch is done once every row left it, see early_exit_forward. The
+  // outputs are then the fp32 [batch_size, num_labels] logits and the int32
+  // [batch_size] exit layer of every row.
+  // the block sparse self attention of the weight file, for documents of
+  // thousands of tokens.
+  BlockSparseConfig sparse;
+  sparse.block_size = tw_._sparse_block_size;
+  sparse.window_blocks = tw_._sparse_window_blocks;
+  sparse.global_blocks = tw_._sparse_global_blocks;
+  sparse.random_blocks = tw_._sparse_random_blocks;
+  if (sparse.block_size > 0 && _varlen) {
+    printf("block sparse attention does not support varlen, which "
+           "is turned off\n");
+    _varlen = false;
+  }
+  _exit_entropy = exit_entropy_opt(options);
+  if (_exit_entropy > 0) {
+    if (tw_._num_labels == 0 || tw_._exit_kernels.back().empty()) {
+      throw std::runtime_error(
+          "bert_exit_entropy needs the exit heads of the weight "
+          "file, the one of the last layer included");
+    }
+    // the [CLS] token of a row is its first one.
+    if (tw_._multilg_type == 2) {
+      throw std::runtime_error(
+          "bert_exit_entropy does not support a sentence language "
+          "token");
+    }
+    if (_varlen) {
+      printf("bert_exit_entropy does not support varlen, "
+             "which is turned off\n");
+      _varlen = false;
+    }
+    if (!pooling.empty()) {
+      printf("bert_exit_entropy does not support "
+             "bert_pooling, which is turned off\n");
+      pooling.clear();
+      _half_output = false;
+    }
+  }
 
   // initial LaunchEncEmb layer
+  // the layer normalization of the embedding runs in the embedding kernel,
+  // see launch_enc_emb_ln.
+#ifdef LIGHTSEQ_cuda
+  bool fuse_emb_ln = tw_._multilg_type == 0;
+#else
+  bool fuse_emb_ln = false;
+#endif
   launch_enc_emb_layer.reset(new LaunchEncEmbLayer<OpType_>(
-      max_batch_tokens, tw_._padding_id, tw_._hidden_size, tw_._multilg_type));
+      max_batch_tokens, tw_._padding_id, tw_._hidden_size, tw_._multilg_type,
+      fuse_emb_ln));
   launch_enc_emb_layer->load_params(tw_.get_src_emb_wei(), 0);
 
   // initial LayerNormalize layer
-  lyr_norm_layer.reset(new LyrNormalizeLayer<OpType_, OpType_>(
-      max_batch_tokens, tw_._hidden_size));
-  lyr_norm_layer->load_params(tw_.get_src_emb_wei(), 2);
+  if (!fuse_emb_ln) {
+    lyr_norm_layer.reset(new LyrNormalizeLayer<OpType_, OpType_>(
+        max_batch_tokens, tw_._hidden_size));
+    lyr_norm_layer->load_params(tw_.get_src_emb_wei(), 2);
+  }
 
   // initial TransformerEncoder layers
   float attn_prob_dropout_ratio = 0.0;
@@ -45,12 +142,45 @@ Bert::Bert(const std::string weight_path, const int max_batch_size)
             idx, max_batch_tokens, tw_._max_step, tw_._hidden_size,
             tw_._head_num, tw_._inner_size, attn_prob_dropout_ratio,
             activation_dropout_ratio, hidden_dropout_ratio, !tw_._is_post_ln,
-            tw_._use_gelu ? "gelu" : "relu", false));
+            tw_._use_gelu ? "gelu" : "relu", false, _varlen, int8, sparse,
+            tw_.sparse24(idx)));
     enc_wei_offset +=
         enc_layer_->load_params(tw_.get_enc_wei(), enc_wei_offset);
     enc_layer_vec.push_back(enc_layer_);
   }
 
+  if (_varlen) {
+    _remove_padding_layer.reset(new RemovePaddingLayer<OpType_, OpType_>(
+        max_batch_tokens, tw_._hidden_size, tw_._padding_id));
+    _rebuild_padding_layer.reset(new RebuildPaddingLayer<OpType_, OpType_>(
+        max_batch_tokens, tw_._hidden_size));
+    _rebuild_padding_layer->set_packed_to_padded(
+        _remove_padding_layer->packed_to_padded());
+    for (auto iter : enc_layer_vec) {
+      iter->set_cu_seqlens(_remove_padding_layer->cu_seqlens());
+    }
+  }
+
+  if (!pooling.empty()) {
+    const std::map<std::string, PoolingMethod> kPoolingMethods = {
+        {"cls", PoolingMethod::kCls},
+        {"mean", PoolingMethod::kMean},
+        {"max", PoolingMethod::kMax}};
+    auto method = kPoolingMethods.find(pooling);
+    if (method == kPoolingMethods.end()) {
+      throw std::runtime_error("bert_pooling must be cls, mean or " +
+                               std::string("max, got ") + pooling);
+    }
+    // the mask of the pooling is computed from the input tokens.
+    if (tw_._multilg_type == 2) {
+      throw std::runtime_error(
+          "bert_pooling does not support a sentence language token");
+    }
+    _pooling_layer.reset(new SequencePoolingLayer<OpType_, OpType_>(
+        _max_batch_size, tw_._hidden_size, tw_._padding_id, method->second,
+        l2_norm, _half_output));
+  }
+
   printf("Finish initialize layers and assign weights!\n");
 
   /* --- step.5 construct network --- */
@@ -58,45 +188,264 @@ Bert::Bert(const std::string weight_path, const int max_batch_size)
       (*launch_enc_emb_layer)(inp_tokens);
   Variable *enc_emb = std::get<0>(enc_emb_outs);
   Variable *pad_mask = std::get<1>(enc_emb_outs);
-  enc_emb = (*lyr_norm_layer)(enc_emb);
+  _pad_mask = pad_mask;
+  if (_varlen) enc_emb = (*_remove_padding_layer)(enc_emb);
+  if (lyr_norm_layer) enc_emb = (*lyr_norm_layer)(enc_emb);
   for (auto iter : enc_layer_vec) {
     enc_emb = (*iter)(enc_emb, pad_mask);
+    _enc_outs.push_back(enc_emb);
   }
+  if (_varlen) enc_emb = (*_rebuild_padding_layer)(enc_emb);
+  if (_pooling_layer) enc_emb = (*_pooling_layer)(enc_emb, inp_tokens);
   bert_out = enc_emb;
   printf("Finish construct network!\n");
 
   _context_ptr->build();
 }
 
-Bert::~Bert() {}
+template <typename OpType_>
+Bert<OpType_>::~Bert() {}
 
-void Bert::before_forward(int batch_size, int seq_len) {
+template <typename OpType_>
+void Bert<OpType_>::before_forward(int batch_size, int seq_len) {
   launch_enc_emb_layer->before_forward(batch_size, seq_len);
+  if (_pooling_layer) _pooling_layer->before_forward(batch_size, seq_len);
+
+  if (_varlen) {
+    // the layers after the embedding only see the packed tokens.
+    int valid_tokens = _remove_padding_layer->set_offsets(
+        (const int *)inp_tokens->value(), batch_size, seq_len);
+    _remove_padding_layer->before_forward(valid_tokens);
+    if (lyr_norm_layer) lyr_norm_layer->before_forward(1, valid_tokens);
+    for (auto iter : enc_layer_vec) {
+      iter->before_forward(batch_size, seq_len, valid_tokens);
+    }
+    _rebuild_padding_layer->before_forward(valid_tokens, batch_size, seq_len);
+    return;
+  }
 
-  lyr_norm_layer->before_forward(batch_size, seq_len);
+  if (lyr_norm_layer) lyr_norm_layer->before_forward(batch_size, seq_len);
   for (auto iter : enc_layer_vec) {
     iter->before_forward(batch_size, seq_len);
   }
 }
 
-void Bert::Infer() {
+template <typename OpType_>
+void Bert<OpType_>::Infer() {
   int batch_size = input_shapes_[0][0], seq_len = input_shapes_[0][1];
 
+  if (_exit_entropy > 0) {
+    early_exit_forward(batch_size, seq_len);
+    set_output_shape(0, {batch_size, tw_._num_labels});
+    set_output_shape(1, {batch_size});
+    return;
+  }
+
   before_forward(batch_size, seq_len);
 
   /* --- notice that the order of forward should be the same with network --- */
   launch_enc_emb_layer->forward();
-  lyr_norm_layer->forward();
+  if (_varlen) _remove_padding_layer->forward();
+  if (lyr_norm_layer) lyr_norm_layer->forward();
+  for (auto iter : enc_layer_vec) {
+    iter->forward();
+  }
+  if (_varlen) _rebuild_padding_layer->forward();
+  if (_pooling_layer) _pooling_layer->forward();
+
+  _context_ptr->synchronize();
+
+  if (_pooling_layer) {
+    set_output_shape(0, {batch_size, tw_._hidden_size});
+  } else {
+    set_output_shape(0, {batch_size, seq_len, tw_._hidden_size});
+  }
+}
+
+template <typename OpType_>
+void Bert<OpType_>::encode_packed(const int *tokens, const int *offsets,
+                                  int num_seqs, void *output) {
+  if (!_varlen || _pooling_layer || _exit_entropy > 0) {
+    throw std::runtime_error(
+        "packed encoding needs varlen=1, without pooling or early "
+        "exit");
+  }
+  if (num_seqs <= 0 || num_seqs > _max_batch_size || offsets[0] != 0) {
+    throw std::runtime_error("invalid packed batch of " +
+                             std::to_string(num_seqs) + " sequences");
+  }
+  int seq_len = 0;
+  for (int i = 0; i < num_seqs; i++) {
+    int len = offsets[i + 1] - offsets[i];
+    if (len <= 0 || len > tw_._max_step) {
+      throw std::runtime_error("packed sequence length " +
+                               std::to_string(len) + " out of (0, " +
+                               std::to_string(tw_._max_step) + "]");
+    }
+    seq_len = std::max(seq_len, len);
+  }
+  int valid_tokens = offsets[num_seqs];
+
+  // only the embedding sees the padding, the offsets are given rather than
+  // searched for in the padded tokens.
+  _packed_inputs.assign(size_t(num_seqs) * seq_len, tw_._padding_id);
+  for (int i = 0; i < num_seqs; i++) {
+    std::copy(tokens + offsets[i], tokens + offsets[i + 1],
+              _packed_inputs.begin() + size_t(i) * seq_len);
+  }
+  size_t output_bytes = size_t(valid_tokens) * tw_._hidden_size *
+                        sizeof(OpType_);
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  CHECK_GPU_ERROR(cudaMemcpyAsync(
+      inp_tokens->value(), _packed_inputs.data(),
+      _packed_inputs.size() * sizeof(int), cudaMemcpyHostToDevice, stream));
+#else
+  std::copy(_packed_inputs.begin(), _packed_inputs.end(),
+            (int *)inp_tokens->value());
+#endif
+
+  launch_enc_emb_layer->before_forward(num_seqs, seq_len);
+  _remove_padding_layer->set_packed_offsets(offsets, num_seqs, seq_len);
+  _remove_padding_layer->before_forward(valid_tokens);
+  if (lyr_norm_layer) lyr_norm_layer->before_forward(1, valid_tokens);
+  for (auto iter : enc_layer_vec) {
+    iter->before_forward(num_seqs, seq_len, valid_tokens);
+  }
+
+  launch_enc_emb_layer->forward();
+  _remove_padding_layer->forward();
+  if (lyr_norm_layer) lyr_norm_layer->forward();
   for (auto iter : enc_layer_vec) {
     iter->forward();
   }
 
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaMemcpyAsync(output, _enc_outs.back()->value(),
+                                  output_bytes, cudaMemcpyDefault, stream));
+#else
+  memcpy(output, _enc_outs.back()->value(), output_bytes);
+#endif
   _context_ptr->synchronize();
+  set_output_shape(0, {valid_tokens, tw_._hidden_size});
+}
+
+template <typename OpType_>
+float Bert<OpType_>::exit_head(int layer, const OpType_ *cls, float *logits) {
+  const std::vector<float> &kernel = tw_._exit_kernels[layer];
+  const std::vector<float> &bias = tw_._exit_biases[layer];
+  int num_labels = tw_._num_labels;
+  std::copy(bias.begin(), bias.end(), logits);
+  for (int i = 0; i < tw_._hidden_size; i++) {
+    float value = to_float(cls[i]);
+    const float *kernel_row = kernel.data() + size_t(i) * num_labels;
+    for (int j = 0; j < num_labels; j++) logits[j] += value * kernel_row[j];
+  }
+  float max_logit = *std::max_element(logits, logits + num_labels);
+  float sum = 0.f, weighted = 0.f;
+  for (int j = 0; j < num_labels; j++) {
+    float exp_logit = std::exp(logits[j] - max_logit);
+    sum += exp_logit;
+    weighted += exp_logit * (logits[j] - max_logit);
+  }
+  // -sum(p * log(p)) with p = exp(logit - max_logit) / sum.
+  return std::log(sum) - weighted / sum;
+}
+
+/**
+The encoder layers one by one on the rows still in the batch. After a layer
+of an exit head, its [CLS] outputs are copied to the host, which runs the head
+and moves the rows staying in the batch to its front, with their pad mask, so
+that the next layer runs on fewer rows. The rows keep their order, so a row
+only moves to a lower index and the moves may run in place.
+*/
+template <typename OpType_>
+void Bert<OpType_>::early_exit_forward(int batch_size, int seq_len) {
+  launch_enc_emb_layer->before_forward(batch_size, seq_len);
+  if (lyr_norm_layer) lyr_norm_layer->before_forward(batch_size, seq_len);
+  launch_enc_emb_layer->forward();
+  if (lyr_norm_layer) lyr_norm_layer->forward();
+
+  int hidden_size = tw_._hidden_size, num_labels = tw_._num_labels;
+  size_t row_size = size_t(seq_len) * hidden_size;
+  OpType_ *pad_mask = (OpType_ *)_pad_mask->value();
+  // the index in the batch of the rows still in it.
+  std::vector<int> rows(batch_size);
+  std::iota(rows.begin(), rows.end(), 0);
+  std::vector<float> logits(size_t(batch_size) * num_labels);
+  std::vector<int> exit_layers(batch_size);
+  std::vector<OpType_> cls(size_t(batch_size) * hidden_size);
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+#endif
+
+  for (int idx = 0; idx < tw_._n_enc_layer; idx++) {
+    int active = rows.size();
+    enc_layer_vec[idx]->before_forward(active, seq_len);
+    enc_layer_vec[idx]->forward();
+    if (tw_._exit_kernels[idx].empty()) continue;
 
-  set_output_shape(0, {batch_size, seq_len, tw_._hidden_size});
+    OpType_ *enc_out = (OpType_ *)_enc_outs[idx]->value();
+#ifdef LIGHTSEQ_cuda
+    CHECK_GPU_ERROR(cudaMemcpy2DAsync(
+        cls.data(), hidden_size * sizeof(OpType_), enc_out,
+        row_size * sizeof(OpType_), hidden_size * sizeof(OpType_), active,
+        cudaMemcpyDeviceToHost, stream));
+    CHECK_GPU_ERROR(cudaStreamSynchronize(stream));
+#else
+    for (int i = 0; i < active; i++) {
+      std::copy_n(enc_out + i * row_size, hidden_size,
+                  cls.begin() + size_t(i) * hidden_size);
+    }
+#endif
+
+    bool last_layer = idx == tw_._n_enc_layer - 1;
+    int kept = 0;
+    for (int i = 0; i < active; i++) {
+      float entropy =
+          exit_head(idx, cls.data() + size_t(i) * hidden_size,
+                    logits.data() + size_t(rows[i]) * num_labels);
+      if (last_layer || entropy < _exit_entropy) {
+        exit_layers[rows[i]] = idx;
+        continue;
+      }
+      if (kept != i) {
+#ifdef LIGHTSEQ_cuda
+        CHECK_GPU_ERROR(cudaMemcpyAsync(
+            enc_out + kept * row_size, enc_out + i * row_size,
+            row_size * sizeof(OpType_), cudaMemcpyDeviceToDevice, stream));
+        CHECK_GPU_ERROR(cudaMemcpyAsync(
+            pad_mask + kept * seq_len, pad_mask + i * seq_len,
+            seq_len * sizeof(OpType_), cudaMemcpyDeviceToDevice, stream));
+#else
+        std::copy_n(enc_out + i * row_size, row_size,
+                    enc_out + kept * row_size);
+        std::copy_n(pad_mask + i * seq_len, seq_len,
+                    pad_mask + kept * seq_len);
+#endif
+      }
+      rows[kept++] = rows[i];
+    }
+    rows.resize(kept);
+    if (rows.empty()) break;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_exit_logits_ptr, logits.data(),
+                                  logits.size() * sizeof(float),
+                                  cudaMemcpyDefault, stream));
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_exit_layers_ptr, exit_layers.data(),
+                                  batch_size * sizeof(int), cudaMemcpyDefault,
+                                  stream));
+#else
+  std::copy(logits.begin(), logits.end(), _exit_logits_ptr);
+  std::copy(exit_layers.begin(), exit_layers.end(), _exit_layers_ptr);
+#endif
+  _context_ptr->synchronize();
 }
 
-void Bert::set_input_ptr(int index, void *input_ptr) {
+template <typename OpType_>
+void Bert<OpType_>::set_input_ptr(int index, void *input_ptr) {
   switch (index) {
     case 0:
       inp_tokens->set_value((char *)input_ptr);
@@ -108,7 +457,20 @@ void Bert::set_input_ptr(int index, void *input_ptr) {
   }
 }
 
-void Bert::set_output_ptr(int index, void *output_ptr) {
+template <typename OpType_>
+void Bert<OpType_>::set_output_ptr(int index, void *output_ptr) {
+  if (_exit_entropy > 0) {
+    switch (index) {
+      case 0:
+        _exit_logits_ptr = (float *)output_ptr;
+        return;
+      case 1:
+        _exit_layers_ptr = (int *)output_ptr;
+        return;
+      default:
+        throw std::runtime_error("invalid output index");
+    }
+  }
   switch (index) {
     case 0:
       bert_out->set_value((char *)output_ptr);
@@ -120,7 +482,18 @@ void Bert::set_output_ptr(int index, void *output_ptr) {
   }
 }
 
-const void *Bert::get_output_ptr(int index) {
+template <typename OpType_>
+const void *Bert<OpType_>::get_output_ptr(int index) {
+  if (_exit_entropy > 0) {
+    switch (index) {
+      case 0:
+        return static_cast<void *>(_exit_logits_ptr);
+      case 1:
+        return static_cast<void *>(_exit_layers_ptr);
+      default:
+        throw std::runtime_error("invalid output index");
+    }
+  }
   switch (index) {
     case 0:
       return static_cast<void *>(bert_out->value());
@@ -130,7 +503,8 @@ const void *Bert::get_output_ptr(int index) {
   }
 }
 
-std::vector<int> Bert::get_input_max_shape(int index) {
+template <typename OpType_>
+std::vector<int> Bert<OpType_>::get_input_max_shape(int index) {
   switch (index) {
     case 0:
       return {_max_batch_size, tw_._max_step};
@@ -140,9 +514,21 @@ std::vector<int> Bert::get_input_max_shape(int index) {
       break;
   }
 }
-std::vector<int> Bert::get_output_max_shape(int index) {
+template <typename OpType_>
+std::vector<int> Bert<OpType_>::get_output_max_shape(int index) {
+  if (_exit_entropy > 0) {
+    switch (index) {
+      case 0:
+        return {_max_batch_size, tw_._num_labels};
+      case 1:
+        return {_max_batch_size};
+      default:
+        throw std::runtime_error("invalid output index");
+    }
+  }
   switch (index) {
     case 0:
+      if (_pooling_layer) return {_max_batch_size, tw_._hidden_size};
       return {_max_batch_size, tw_._max_step, tw_._hidden_size};
 
     default:
@@ -151,7 +537,8 @@ std::vector<int> Bert::get_output_max_shape(int index) {
   }
 }
 
-DataType Bert::get_input_dtype(int index) {
+template <typename OpType_>
+DataType Bert<OpType_>::get_input_dtype(int index) {
   switch (index) {
     case 0:
       return DataType::kInt32;
@@ -163,14 +550,21 @@ DataType Bert::get_input_dtype(int index) {
   }
 }
 
-DataType Bert::get_output_dtype(int index) {
+template <typename OpType_>
+DataType Bert<OpType_>::get_output_dtype(int index) {
+  if (_exit_entropy > 0) {
+    switch (index) {
+      case 0:
+        return DataType::kFloat32;
+      case 1:
+        return DataType::kInt32;
+      default:
+        throw std::runtime_error("invalid output index");
+    }
+  }
   switch (index) {
     case 0:
-#ifdef FP16_MODE
-      return DataType::kFloat16;
-#else
-      return DataType::kFloat32;
-#endif
+      return _half_output ? DataType::kFloat16 : g_dtype<OpType_>();
       break;
 
     default:
@@ -178,5 +572,11 @@ DataType Bert::get_output_dtype(int index) {
       break;
   }
 }
+
+template class Bert<float>;
+#ifdef LIGHTSEQ_cuda
+template class Bert<__half>;
+#endif
+
 }  // namespace cuda
 }  // namespace lightseq
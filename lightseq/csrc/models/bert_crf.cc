@@ -2,12 +2,16 @@
 
 namespace lightseq {
 namespace cuda {
-BertCrf::BertCrf(const std::string weight_path, const int max_batch_size)
+template <typename OpType_>
+BertCrf<OpType_>::BertCrf(const std::string weight_path,
+                          const int max_batch_size,
+                          const ModelOptions &options)
     : LSModel({"token_ids"}, {"encoder_output"}),
       _max_batch_size(max_batch_size) {
   /* --- step.1 initial context --- */
-  Context::create_global_context(StatusType::Inference);
-  _context_ptr = Context::global_instance();
+  _context_ptr = std::make_shared<Context>(StatusType::Inference, -1);
+  // the graph of the model is created in its own context.
+  ContextScope context_scope(_context_ptr);
 
   /* --- step.2 load model weights into GPU memory --- */
   // saved in custom proto file
@@ -23,16 +27,32 @@ BertCrf::BertCrf(const std::string weight_path, const int max_batch_size)
 
   /* --- step.4 inital operator & layer --- */
   int max_batch_tokens = tw_._max_step * _max_batch_size;
+  // the encoder, the linear and the crf skip the pad tokens, the crf writes
+  // the padded best tags. A sentence language token is not part of the input
+  // tokens, which the packing is computed from.
+  const char *varlen_opt = model_option(options, "varlen");
+  _varlen = varlen_opt && std::atoi(varlen_opt) != 0 &&
+            tw_._multilg_type != 2;
 
   // initial LaunchEncEmb layer
+  // the layer normalization of the embedding runs in the embedding kernel,
+  // see launch_enc_emb_ln.
+#ifdef LIGHTSEQ_cuda
+  bool fuse_emb_ln = tw_._multilg_type == 0;
+#else
+  bool fuse_emb_ln = false;
+#endif
   launch_enc_emb_layer.reset(new LaunchEncEmbLayer<OpType_>(
-      max_batch_tokens, tw_._padding_id, tw_._hidden_size, tw_._multilg_type));
+      max_batch_tokens, tw_._padding_id, tw_._hidden_size, tw_._multilg_type,
+      fuse_emb_ln));
   launch_enc_emb_layer->load_params(tw_.get_src_emb_wei(), 0);
 
   // initial LayerNormalize layer
-  lyr_norm_layer.reset(new LyrNormalizeLayer<OpType_, OpType_>(
-      max_batch_tokens, tw_._hidden_size));
-  lyr_norm_layer->load_params(tw_.get_src_emb_wei(), 2);
+  if (!fuse_emb_ln) {
+    lyr_norm_layer.reset(new LyrNormalizeLayer<OpType_, OpType_>(
+        max_batch_tokens, tw_._hidden_size));
+    lyr_norm_layer->load_params(tw_.get_src_emb_wei(), 2);
+  }
 
   // initial TransformerEncoder layers
   float attn_prob_dropout_ratio = 0.0;
@@ -45,7 +65,7 @@ BertCrf::BertCrf(const std::string weight_path, const int max_batch_size)
             idx, max_batch_tokens, tw_._max_step, tw_._hidden_size,
             tw_._head_num, tw_._inner_size, attn_prob_dropout_ratio,
             activation_dropout_ratio, hidden_dropout_ratio, !tw_._is_post_ln,
-            tw_._use_gelu ? "gelu" : "relu", false));
+            tw_._use_gelu ? "gelu" : "relu", false, _varlen));
     enc_wei_offset +=
         enc_layer_->load_params(tw_.get_enc_wei(), enc_wei_offset);
     enc_layer_vec.push_back(enc_layer_);
@@ -63,12 +83,22 @@ BertCrf::BertCrf(const std::string weight_path, const int max_batch_size)
       new CRFLayer<OpType_>(tw_._num_tags, max_batch_tokens, _max_batch_size));
   crf_layer->load_params(tw_.get_src_emb_wei(), 5);
 
+  if (_varlen) {
+    _remove_padding_layer.reset(new RemovePaddingLayer<OpType_, OpType_>(
+        max_batch_tokens, tw_._hidden_size, tw_._padding_id));
+    for (auto iter : enc_layer_vec) {
+      iter->set_cu_seqlens(_remove_padding_layer->cu_seqlens());
+    }
+    crf_layer->set_cu_seqlens(_remove_padding_layer->cu_seqlens());
+  }
+
   /* --- step.5 construct network --- */
   std::tuple<Variable *, Variable *> enc_emb_outs =
       (*launch_enc_emb_layer)(inp_tokens);
   Variable *enc_emb = std::get<0>(enc_emb_outs);
   Variable *pad_mask = std::get<1>(enc_emb_outs);
-  enc_emb = (*lyr_norm_layer)(enc_emb);
+  if (_varlen) enc_emb = (*_remove_padding_layer)(enc_emb);
+  if (lyr_norm_layer) enc_emb = (*lyr_norm_layer)(enc_emb);
   for (auto iter : enc_layer_vec) {
     enc_emb = (*iter)(enc_emb, pad_mask);
   }
@@ -79,11 +109,27 @@ BertCrf::BertCrf(const std::string weight_path, const int max_batch_size)
   _context_ptr->build();
 }
 
-BertCrf::~BertCrf() {}
+template <typename OpType_>
+BertCrf<OpType_>::~BertCrf() {}
 
-void BertCrf::before_forward(int batch_size, int seq_len) {
+template <typename OpType_>
+void BertCrf<OpType_>::before_forward(int batch_size, int seq_len) {
   launch_enc_emb_layer->before_forward(batch_size, seq_len);
-  lyr_norm_layer->before_forward(batch_size, seq_len);
+
+  if (_varlen) {
+    int valid_tokens = _remove_padding_layer->set_offsets(
+        (const int *)inp_tokens->value(), batch_size, seq_len);
+    _remove_padding_layer->before_forward(valid_tokens);
+    if (lyr_norm_layer) lyr_norm_layer->before_forward(1, valid_tokens);
+    for (auto iter : enc_layer_vec) {
+      iter->before_forward(batch_size, seq_len, valid_tokens);
+    }
+    linear_layer->before_forward(1, valid_tokens);
+    crf_layer->before_forward(batch_size, seq_len, false, false);
+    return;
+  }
+
+  if (lyr_norm_layer) lyr_norm_layer->before_forward(batch_size, seq_len);
   for (auto iter : enc_layer_vec) {
     iter->before_forward(batch_size, seq_len);
   }
@@ -91,14 +137,16 @@ void BertCrf::before_forward(int batch_size, int seq_len) {
   crf_layer->before_forward(batch_size, seq_len, false, false);
 }
 
-void BertCrf::Infer() {
+template <typename OpType_>
+void BertCrf<OpType_>::Infer() {
   int batch_size = input_shapes_[0][0], seq_len = input_shapes_[0][1];
 
   before_forward(batch_size, seq_len);
 
   /* --- notice that the order of forward should be the same with network --- */
   launch_enc_emb_layer->forward();
-  lyr_norm_layer->forward();
+  if (_varlen) _remove_padding_layer->forward();
+  if (lyr_norm_layer) lyr_norm_layer->forward();
   for (auto iter : enc_layer_vec) {
     iter->forward();
   }
@@ -110,7 +158,8 @@ void BertCrf::Infer() {
   set_output_shape(0, {batch_size, seq_len});
 }
 
-void BertCrf::set_input_ptr(int index, void *input_ptr) {
+template <typename OpType_>
+void BertCrf<OpType_>::set_input_ptr(int index, void *input_ptr) {
   switch (index) {
     case 0:
       inp_tokens->set_value((char *)input_ptr);
@@ -122,7 +171,8 @@ void BertCrf::set_input_ptr(int index, void *input_ptr) {
   }
 }
 
-void BertCrf::set_output_ptr(int index, void *output_ptr) {
+template <typename OpType_>
+void BertCrf<OpType_>::set_output_ptr(int index, void *output_ptr) {
   switch (index) {
     case 0:
       bert_out->set_value((char *)output_ptr);
@@ -134,7 +184,8 @@ void BertCrf::set_output_ptr(int index, void *output_ptr) {
   }
 }
 
-const void *BertCrf::get_output_ptr(int index) {
+template <typename OpType_>
+const void *BertCrf<OpType_>::get_output_ptr(int index) {
   switch (index) {
     case 0:
       return static_cast<void *>(bert_out->value());
@@ -144,7 +195,8 @@ const void *BertCrf::get_output_ptr(int index) {
   }
 }
 
-std::vector<int> BertCrf::get_input_max_shape(int index) {
+template <typename OpType_>
+std::vector<int> BertCrf<OpType_>::get_input_max_shape(int index) {
   switch (index) {
     case 0:
       return {_max_batch_size, tw_._max_step};
@@ -154,7 +206,8 @@ std::vector<int> BertCrf::get_input_max_shape(int index) {
       break;
   }
 }
-std::vector<int> BertCrf::get_output_max_shape(int index) {
+template <typename OpType_>
+std::vector<int> BertCrf<OpType_>::get_output_max_shape(int index) {
   switch (index) {
     case 0:
       return {_max_batch_size, tw_._max_step};
@@ -165,7 +218,8 @@ std::vector<int> BertCrf::get_output_max_shape(int index) {
   }
 }
 
-DataType BertCrf::get_input_dtype(int index) {
+template <typename OpType_>
+DataType BertCrf<OpType_>::get_input_dtype(int index) {
   switch (index) {
     case 0:
       return DataType::kInt32;
@@ -177,7 +231,8 @@ DataType BertCrf::get_input_dtype(int index) {
   }
 }
 
-DataType BertCrf::get_output_dtype(int index) {
+template <typename OpType_>
+DataType BertCrf<OpType_>::get_output_dtype(int index) {
   switch (index) {
     case 0:
       return DataType::kInt32;
@@ -188,5 +243,11 @@ DataType BertCrf::get_output_dtype(int index) {
       break;
   }
 }
+
+template class BertCrf<float>;
+#ifdef LIGHTSEQ_cuda
+template class BertCrf<__half>;
+#endif
+
 }  // namespace cuda
 }  // namespace lightseq
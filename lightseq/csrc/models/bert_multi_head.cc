@@ -0,0 +1,296 @@
+#include "bert_multi_head.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+// head_0 ... of the task heads of the weight file, read ahead of the weights
+// as the output names are given to LSModel.
+std::vector<std::string> task_head_names(const std::string &weight_path) {
+  std::vector<std::string> names;
+  if (!endswith(weight_path, ".hdf5")) return names;
+  hid_t hdf5_file = H5Fopen(weight_path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (hdf5_file < 0) return names;
+  if (H5Lexists(hdf5_file, "task_heads", H5P_DEFAULT) > 0) {
+    for (int head_id = 0;; head_id++) {
+      std::string group = "task_heads/" + std::to_string(head_id);
+      if (H5Lexists(hdf5_file, group.c_str(), H5P_DEFAULT) <= 0) break;
+      names.push_back("head_" + std::to_string(head_id));
+    }
+  }
+  H5Fclose(hdf5_file);
+  return names;
+}
+
+}  // namespace
+
+template <typename OpType_>
+BertMultiHead<OpType_>::BertMultiHead(const std::string weight_path,
+                                      const int max_batch_size,
+                                      const ModelOptions &options)
+    : LSModel({"token_ids"}, task_head_names(weight_path)),
+      _max_batch_size(max_batch_size) {
+  /* --- step.1 initial context --- */
+  _context_ptr = std::make_shared<Context>(StatusType::Inference, -1);
+  // the graph of the model is created in its own context.
+  ContextScope context_scope(_context_ptr);
+
+  /* --- step.2 load model weights into GPU memory --- */
+  std::string res = tw_.initializing(weight_path);
+  if (!res.empty()) {
+    throw std::runtime_error(res);
+  }
+  tw_.print_model_config();
+  if (tw_._task_heads.empty()) {
+    throw std::runtime_error(
+        "BertMultiHead needs the task_heads of a hdf5 weight file");
+  }
+
+  /* --- step.3 initial input Variable node --- */
+  inp_tokens = new Variable("inp_tokens", g_dtype<OpType_>());
+
+  /* --- step.4 inital operator & layer --- */
+  int max_batch_tokens = tw_._max_step * _max_batch_size;
+  // a sentence language token is not part of the input tokens, which the
+  // packing is computed from.
+  const char *varlen_opt = model_option(options, "varlen");
+  _varlen = varlen_opt && std::atoi(varlen_opt) != 0 &&
+            tw_._multilg_type != 2;
+
+  // initial LaunchEncEmb layer
+  // the layer normalization of the embedding runs in the embedding kernel,
+  // see launch_enc_emb_ln.
+#ifdef LIGHTSEQ_cuda
+  bool fuse_emb_ln = tw_._multilg_type == 0;
+#else
+  bool fuse_emb_ln = false;
+#endif
+  launch_enc_emb_layer.reset(new LaunchEncEmbLayer<OpType_>(
+      max_batch_tokens, tw_._padding_id, tw_._hidden_size, tw_._multilg_type,
+      fuse_emb_ln));
+  launch_enc_emb_layer->load_params(tw_.get_src_emb_wei(), 0);
+
+  // initial LayerNormalize layer
+  if (!fuse_emb_ln) {
+    lyr_norm_layer.reset(new LyrNormalizeLayer<OpType_, OpType_>(
+        max_batch_tokens, tw_._hidden_size));
+    lyr_norm_layer->load_params(tw_.get_src_emb_wei(), 2);
+  }
+
+  // initial TransformerEncoder layers
+  float attn_prob_dropout_ratio = 0.0;
+  float activation_dropout_ratio = 0.0;
+  float hidden_dropout_ratio = 0.0;
+  int enc_wei_offset = 0;
+  for (int idx = 0; idx < tw_._n_enc_layer; idx++) {
+    TransformerEncoderLayerPtr<OpType_, OpType_> enc_layer_(
+        new TransformerEncoderLayer<OpType_, OpType_>(
+            idx, max_batch_tokens, tw_._max_step, tw_._hidden_size,
+            tw_._head_num, tw_._inner_size, attn_prob_dropout_ratio,
+            activation_dropout_ratio, hidden_dropout_ratio, !tw_._is_post_ln,
+            tw_._use_gelu ? "gelu" : "relu", false, _varlen));
+    enc_wei_offset +=
+        enc_layer_->load_params(tw_.get_enc_wei(), enc_wei_offset);
+    enc_layer_vec.push_back(enc_layer_);
+  }
+
+  if (_varlen) {
+    _remove_padding_layer.reset(new RemovePaddingLayer<OpType_, OpType_>(
+        max_batch_tokens, tw_._hidden_size, tw_._padding_id));
+    _rebuild_padding_layer.reset(new RebuildPaddingLayer<OpType_, OpType_>(
+        max_batch_tokens, tw_._hidden_size));
+    _rebuild_padding_layer->set_packed_to_padded(
+        _remove_padding_layer->packed_to_padded());
+    for (auto iter : enc_layer_vec) {
+      iter->set_cu_seqlens(_remove_padding_layer->cu_seqlens());
+    }
+  }
+
+  // initial task head layers
+  for (int i = 0; i < (int)tw_._task_heads.size(); i++) {
+    const auto &head = tw_._task_heads[i];
+    TaskHeadType type = static_cast<TaskHeadType>(head.type);
+    // the mask of the pooling is computed from the input tokens.
+    bool pooled = type == TaskHeadType::kSequenceClassifier ||
+                  type == TaskHeadType::kPooling;
+    if (pooled && tw_._multilg_type == 2) {
+      throw std::runtime_error(
+          "the pooled task heads do not support a sentence language token");
+    }
+    TaskHeadLayerPtr<OpType_, OpType_> head_layer(
+        new TaskHeadLayer<OpType_, OpType_>(
+            type, _max_batch_size, tw_._max_step, tw_._hidden_size,
+            head.num_labels, tw_._padding_id,
+            static_cast<PoolingMethod>(head.pooling)));
+    head_layer->load_params(tw_.get_task_head_wei(i), 0);
+    _head_layers.push_back(head_layer);
+  }
+
+  printf("Finish initialize layers and assign weights!\n");
+
+  /* --- step.5 construct network --- */
+  std::tuple<Variable *, Variable *> enc_emb_outs =
+      (*launch_enc_emb_layer)(inp_tokens);
+  Variable *enc_emb = std::get<0>(enc_emb_outs);
+  Variable *pad_mask = std::get<1>(enc_emb_outs);
+  if (_varlen) enc_emb = (*_remove_padding_layer)(enc_emb);
+  if (lyr_norm_layer) enc_emb = (*lyr_norm_layer)(enc_emb);
+  for (auto iter : enc_layer_vec) {
+    enc_emb = (*iter)(enc_emb, pad_mask);
+  }
+  if (_varlen) enc_emb = (*_rebuild_padding_layer)(enc_emb);
+  for (auto iter : _head_layers) {
+    _head_outs.push_back((*iter)(enc_emb, inp_tokens, pad_mask));
+  }
+  printf("Finish construct network!\n");
+
+  _context_ptr->build();
+}
+
+template <typename OpType_>
+BertMultiHead<OpType_>::~BertMultiHead() {}
+
+template <typename OpType_>
+void BertMultiHead<OpType_>::before_forward(int batch_size, int seq_len) {
+  launch_enc_emb_layer->before_forward(batch_size, seq_len);
+  for (auto iter : _head_layers) {
+    iter->before_forward(batch_size, seq_len);
+  }
+
+  if (_varlen) {
+    // the layers after the embedding only see the packed tokens.
+    int valid_tokens = _remove_padding_layer->set_offsets(
+        (const int *)inp_tokens->value(), batch_size, seq_len);
+    _remove_padding_layer->before_forward(valid_tokens);
+    if (lyr_norm_layer) lyr_norm_layer->before_forward(1, valid_tokens);
+    for (auto iter : enc_layer_vec) {
+      iter->before_forward(batch_size, seq_len, valid_tokens);
+    }
+    _rebuild_padding_layer->before_forward(valid_tokens, batch_size, seq_len);
+    return;
+  }
+
+  if (lyr_norm_layer) lyr_norm_layer->before_forward(batch_size, seq_len);
+  for (auto iter : enc_layer_vec) {
+    iter->before_forward(batch_size, seq_len);
+  }
+}
+
+template <typename OpType_>
+void BertMultiHead<OpType_>::Infer() {
+  int batch_size = input_shapes_[0][0], seq_len = input_shapes_[0][1];
+
+  before_forward(batch_size, seq_len);
+
+  /* --- notice that the order of forward should be the same with network --- */
+  launch_enc_emb_layer->forward();
+  if (_varlen) _remove_padding_layer->forward();
+  if (lyr_norm_layer) lyr_norm_layer->forward();
+  for (auto iter : enc_layer_vec) {
+    iter->forward();
+  }
+  if (_varlen) _rebuild_padding_layer->forward();
+  for (auto iter : _head_layers) {
+    iter->forward();
+  }
+
+  _context_ptr->synchronize();
+
+  for (int i = 0; i < (int)_head_layers.size(); i++) {
+    std::vector<int> shape = get_output_max_shape(i);
+    shape[0] = batch_size;
+    if (shape.size() > 1 && (tw_._task_heads[i].type == 0 ||
+                             tw_._task_heads[i].type == 2)) {
+      shape[1] = seq_len;
+    }
+    set_output_shape(i, shape);
+  }
+}
+
+template <typename OpType_>
+void BertMultiHead<OpType_>::set_input_ptr(int index, void *input_ptr) {
+  switch (index) {
+    case 0:
+      inp_tokens->set_value((char *)input_ptr);
+      break;
+
+    default:
+      throw std::runtime_error("invalid input index");
+      break;
+  }
+}
+
+template <typename OpType_>
+void BertMultiHead<OpType_>::set_output_ptr(int index, void *output_ptr) {
+  if (index < 0 || index >= (int)_head_outs.size()) {
+    throw std::runtime_error("invalid output index");
+  }
+  _head_outs[index]->set_value((char *)output_ptr);
+}
+
+template <typename OpType_>
+const void *BertMultiHead<OpType_>::get_output_ptr(int index) {
+  if (index < 0 || index >= (int)_head_outs.size()) {
+    throw std::runtime_error("invalid output index");
+  }
+  return static_cast<void *>(_head_outs[index]->value());
+}
+
+template <typename OpType_>
+std::vector<int> BertMultiHead<OpType_>::get_input_max_shape(int index) {
+  switch (index) {
+    case 0:
+      return {_max_batch_size, tw_._max_step};
+
+    default:
+      throw std::runtime_error("invalid input index");
+      break;
+  }
+}
+
+template <typename OpType_>
+std::vector<int> BertMultiHead<OpType_>::get_output_max_shape(int index) {
+  if (index < 0 || index >= (int)tw_._task_heads.size()) {
+    throw std::runtime_error("invalid output index");
+  }
+  const auto &head = tw_._task_heads[index];
+  switch (static_cast<TaskHeadType>(head.type)) {
+    case TaskHeadType::kTokenClassifier:
+      return {_max_batch_size, tw_._max_step, head.num_labels};
+    case TaskHeadType::kCrf:
+      return {_max_batch_size, tw_._max_step};
+    default:
+      return {_max_batch_size, head.num_labels};
+  }
+}
+
+template <typename OpType_>
+DataType BertMultiHead<OpType_>::get_input_dtype(int index) {
+  switch (index) {
+    case 0:
+      return DataType::kInt32;
+      break;
+
+    default:
+      throw std::runtime_error("invalid input index");
+      break;
+  }
+}
+
+template <typename OpType_>
+DataType BertMultiHead<OpType_>::get_output_dtype(int index) {
+  if (index < 0 || index >= (int)tw_._task_heads.size()) {
+    throw std::runtime_error("invalid output index");
+  }
+  if (tw_._task_heads[index].type == 2) return DataType::kInt32;
+  return g_dtype<OpType_>();
+}
+
+template class BertMultiHead<float>;
+#ifdef LIGHTSEQ_cuda
+template class BertMultiHead<__half>;
+#endif
+
+}  // namespace cuda
+}  // namespace lightseq
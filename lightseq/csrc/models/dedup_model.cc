@@ -0,0 +1,453 @@
+#include "dedup_model.h"
+
+#include <cstring>
+#include <unordered_map>
+
+#include "declaration.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+size_t data_type_size(DataType dtype) {
+  switch (dtype) {
+    case kInt8:
+    case kByte:
+    case kUInt8:
+      return 1;
+    case kFloat16:
+    case kBFloat16:
+    case kInt16:
+    case kUInt16:
+      return 2;
+    case kInt64:
+    case kUInt64:
+    case kFloat64:
+      return 8;
+    default:
+      return 4;
+  }
+}
+
+size_t shape_size(const std::vector<int>& shape) {
+  size_t res = 1;
+  for (int dim : shape) res *= dim;
+  return res;
+}
+
+// the bytes of a dim 0 row of shape.
+size_t row_bytes(const std::vector<int>& shape, DataType dtype) {
+  size_t res = data_type_size(dtype);
+  for (size_t i = 1; i < shape.size(); i++) res *= shape[i];
+  return res;
+}
+
+std::vector<std::string> input_names(LSModel* model) {
+  std::vector<std::string> names;
+  for (int i = 0; i < model->get_input_size(); i++) {
+    names.push_back(model->get_input_name(i));
+  }
+  return names;
+}
+
+std::vector<std::string> output_names(LSModel* model) {
+  std::vector<std::string> names;
+  for (int i = 0; i < model->get_output_size(); i++) {
+    names.push_back(model->get_output_name(i));
+  }
+  return names;
+}
+
+void copy_bytes(void* dst, const void* src, size_t bytes) {
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaMemcpy(dst, src, bytes, cudaMemcpyDefault));
+#else
+  memcpy(dst, src, bytes);
+#endif
+}
+
+}  // namespace
+
+LSModel* dedup_rows_model(LSModel* model) { return new DedupModel(model); }
+
+DedupModel::DedupModel(LSModel* model)
+    : LSModel(input_names(model), output_names(model)),
+      _model(model),
+      _input_ptrs(model->get_input_size(), nullptr),
+      _unique_inputs(model->get_input_size(), nullptr),
+      _unique_outputs(model->get_output_size(), nullptr),
+      _host_inputs(model->get_input_size()) {}
+
+DedupModel::~DedupModel() {
+  std::vector<void*> buffers = _unique_inputs;
+  buffers.insert(buffers.end(), _unique_outputs.begin(), _unique_outputs.end());
+  for (void* buffer : buffers) {
+    if (!buffer) continue;
+#ifdef LIGHTSEQ_cuda
+    cudaFree(buffer);
+#else
+    delete[](char*) buffer;
+#endif
+  }
+}
+
+std::vector<int> DedupModel::find_duplicates(int batch_size,
+                                             int* num_unique) {
+  std::vector<size_t> input_row_bytes;
+  for (int i = 0; i < get_input_size(); i++) {
+    size_t bytes = row_bytes(input_shapes_[i], get_input_dtype(i));
+    _host_inputs[i].resize(batch_size * bytes);
+    copy_bytes(_host_inputs[i].data(), _input_ptrs[i], batch_size * bytes);
+    input_row_bytes.push_back(bytes);
+  }
+
+  std::unordered_map<std::string, int> unique_rows;
+  std::vector<int> unique_of_row(batch_size);
+  std::string key;
+  for (int row = 0; row < batch_size; row++) {
+    key.clear();
+    for (int i = 0; i < get_input_size(); i++) {
+      key.append(_host_inputs[i].data() + row * input_row_bytes[i],
+                 input_row_bytes[i]);
+    }
+    auto res = unique_rows.emplace(key, unique_rows.size());
+    unique_of_row[row] = res.first->second;
+  }
+  *num_unique = unique_rows.size();
+  if (*num_unique == batch_size) return {};
+  return unique_of_row;
+}
+
+void DedupModel::infer_unique(int batch_size, int num_unique) {
+  // the first row of every unique one into the inputs of the unique rows.
+  std::vector<int> first_row(num_unique, -1);
+  for (int row = 0; row < batch_size; row++) {
+    int unique = _unique_of_row[row];
+    if (first_row[unique] < 0) first_row[unique] = row;
+  }
+  for (int i = 0; i < get_input_size(); i++) {
+    size_t bytes = row_bytes(input_shapes_[i], get_input_dtype(i));
+    if (!_unique_inputs[i]) {
+      size_t max_bytes = shape_size(get_input_max_shape(i)) *
+                         data_type_size(get_input_dtype(i));
+#ifdef LIGHTSEQ_cuda
+      CHECK_GPU_ERROR(cudaMalloc(&_unique_inputs[i], max_bytes));
+#else
+      _unique_inputs[i] = new char[max_bytes];
+#endif
+    }
+    std::vector<char> packed(num_unique * bytes);
+    for (int unique = 0; unique < num_unique; unique++) {
+      memcpy(packed.data() + unique * bytes,
+             _host_inputs[i].data() + first_row[unique] * bytes, bytes);
+    }
+    copy_bytes(_unique_inputs[i], packed.data(), packed.size());
+    std::vector<int> shape = input_shapes_[i];
+    shape[0] = num_unique;
+    _model->set_input_ptr(i, _unique_inputs[i]);
+    _model->set_input_shape(i, shape);
+  }
+
+  // the outputs of the unique rows, scattered into the outputs of the model
+  // afterwards.
+  std::vector<void*> outputs;
+  for (int i = 0; i < get_output_size(); i++) {
+    outputs.push_back(const_cast<void*>(_model->get_output_ptr(i)));
+    if (!_unique_outputs[i]) {
+      size_t max_bytes = shape_size(get_output_max_shape(i)) *
+                         data_type_size(get_output_dtype(i));
+#ifdef LIGHTSEQ_cuda
+      CHECK_GPU_ERROR(cudaMalloc(&_unique_outputs[i], max_bytes));
+#else
+      _unique_outputs[i] = new char[max_bytes];
+#endif
+    }
+    _model->set_output_ptr(i, _unique_outputs[i]);
+  }
+
+  std::exception_ptr error;
+  try {
+    _model->Infer();
+  } catch (...) {
+    error = std::current_exception();
+  }
+  for (int i = 0; i < get_input_size(); i++) {
+    _model->set_input_ptr(i, _input_ptrs[i]);
+  }
+  for (int i = 0; i < get_output_size(); i++) {
+    _model->set_output_ptr(i, outputs[i]);
+  }
+  if (error) std::rethrow_exception(error);
+
+  for (int i = 0; i < get_output_size(); i++) {
+    std::vector<int> shape = _model->get_output_shape(i);
+    if (shape.empty() || shape[0] != num_unique) {
+      throw std::runtime_error("DedupModel: output " + get_output_name(i) +
+                               " does not have the batch as dim 0");
+    }
+    size_t bytes = row_bytes(shape, get_output_dtype(i));
+    char* dst = static_cast<char*>(outputs[i]);
+    const char* src = static_cast<const char*>(_unique_outputs[i]);
+    for (int row = 0; row < batch_size; row++) {
+#ifdef LIGHTSEQ_cuda
+      CHECK_GPU_ERROR(cudaMemcpyAsync(dst + row * bytes,
+                                      src + _unique_of_row[row] * bytes,
+                                      bytes, cudaMemcpyDefault));
+#else
+      memcpy(dst + row * bytes, src + _unique_of_row[row] * bytes, bytes);
+#endif
+    }
+    shape[0] = batch_size;
+    set_output_shape(i, shape);
+  }
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaStreamSynchronize(0));
+#endif
+}
+
+void DedupModel::Infer() {
+  int batch_size = input_shapes_[0].empty() ? 0 : input_shapes_[0][0];
+  int num_unique = batch_size;
+  std::vector<int> unique_of_row;
+  if (!_per_row_settings && !_pipelined && batch_size > 1) {
+    unique_of_row = find_duplicates(batch_size, &num_unique);
+  }
+
+  if (unique_of_row.empty()) {
+    for (int i = 0; i < get_input_size(); i++) {
+      _model->set_input_shape(i, input_shapes_[i]);
+    }
+    _model->Infer();
+    for (int i = 0; i < get_output_size(); i++) {
+      set_output_shape(i, _model->get_output_shape(i));
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_row_mutex);
+    _unique_of_row = unique_of_row;
+    _uncancelled.assign(num_unique, 0);
+    for (int unique : unique_of_row) _uncancelled[unique]++;
+    _cancelled.assign(batch_size, false);
+  }
+  std::exception_ptr error;
+  try {
+    infer_unique(batch_size, num_unique);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  {
+    std::lock_guard<std::mutex> lock(_row_mutex);
+    _unique_of_row.clear();
+  }
+  if (error) std::rethrow_exception(error);
+}
+
+void DedupModel::set_input_ptr(int index, void* input_ptr) {
+  _input_ptrs.at(index) = input_ptr;
+  _model->set_input_ptr(index, input_ptr);
+}
+
+void DedupModel::set_output_ptr(int index, void* output_ptr) {
+  _model->set_output_ptr(index, output_ptr);
+}
+
+const void* DedupModel::get_output_ptr(int index) {
+  return _model->get_output_ptr(index);
+}
+
+std::vector<int> DedupModel::get_input_max_shape(int index) {
+  return _model->get_input_max_shape(index);
+}
+
+std::vector<int> DedupModel::get_output_max_shape(int index) {
+  return _model->get_output_max_shape(index);
+}
+
+DataType DedupModel::get_input_dtype(int index) {
+  return _model->get_input_dtype(index);
+}
+
+DataType DedupModel::get_output_dtype(int index) {
+  return _model->get_output_dtype(index);
+}
+
+void DedupModel::benchmark_mode(bool is_benchmark) {
+  _model->benchmark_mode(is_benchmark);
+}
+
+std::vector<WarmupTiming> DedupModel::warmup(
+    const std::vector<std::vector<int>>& shapes) {
+  return _model->warmup(shapes);
+}
+
+void DedupModel::update_weights(const std::string& weight_path) {
+  _model->update_weights(weight_path);
+}
+
+MemoryProfile DedupModel::memory_profile() { return _model->memory_profile(); }
+
+void DedupModel::dynamic_memory_plan(bool enable) {
+  _model->dynamic_memory_plan(enable);
+}
+
+void DedupModel::cuda_graph_mode(bool enable) {
+  _model->cuda_graph_mode(enable);
+}
+
+void DedupModel::suspend() { _model->suspend(); }
+
+void DedupModel::resume() { _model->resume(); }
+
+bool DedupModel::evict_weights() { return _model->evict_weights(); }
+
+bool DedupModel::restore_weights() { return _model->restore_weights(); }
+
+size_t DedupModel::weight_bytes() { return _model->weight_bytes(); }
+
+void DedupModel::set_next_input(int index, void* input_ptr,
+                                std::vector<int> shape) {
+  // the next input is encoded ahead as it is, not of the unique rows.
+  _pipelined = true;
+  _model->set_next_input(index, input_ptr, std::move(shape));
+}
+
+void DedupModel::multi_stream(int num_streams) {
+  _model->multi_stream(num_streams);
+}
+
+void DedupModel::profiling(bool enable) { _model->profiling(enable); }
+
+void DedupModel::export_profile(const std::string& trace_path) {
+  _model->export_profile(trace_path);
+}
+
+std::string DedupModel::metrics_text() { return _model->metrics_text(); }
+
+void DedupModel::layer_time_sampling(int interval) {
+  _model->layer_time_sampling(interval);
+}
+
+int DedupModel::add_request(const std::vector<int>& prompt,
+                            int max_new_tokens, int priority, int deadline_ms,
+                            int session_id) {
+  return _model->add_request(prompt, max_new_tokens, priority, deadline_ms,
+                             session_id);
+}
+
+void DedupModel::drop_session(int session_id) {
+  _model->drop_session(session_id);
+}
+
+std::vector<std::pair<int, std::vector<int>>> DedupModel::step() {
+  return _model->step();
+}
+
+bool DedupModel::has_pending_requests() {
+  return _model->has_pending_requests();
+}
+
+std::vector<std::pair<int, int>> DedupModel::last_step_tokens() {
+  return _model->last_step_tokens();
+}
+
+void DedupModel::cancel_request(int request_id) {
+  _model->cancel_request(request_id);
+}
+
+void DedupModel::evict_expired_requests(bool enable) {
+  _model->evict_expired_requests(enable);
+}
+
+std::vector<int> DedupModel::last_step_evicted() {
+  return _model->last_step_evicted();
+}
+
+void DedupModel::cancel_row(int row) {
+  int unique = row;
+  {
+    std::lock_guard<std::mutex> lock(_row_mutex);
+    if (!_unique_of_row.empty()) {
+      if (row < 0 || row >= int(_unique_of_row.size()) || _cancelled[row]) {
+        return;
+      }
+      _cancelled[row] = true;
+      unique = _unique_of_row[row];
+      // the other rows of the unique one keep decoding it.
+      if (--_uncancelled[unique] > 0) return;
+    }
+  }
+  _model->cancel_row(unique);
+}
+
+void DedupModel::set_token_callback(
+    std::function<void(int, const std::vector<int>&)> callback) {
+  _token_callback = callback;
+  if (!callback) {
+    _model->set_token_callback(callback);
+    return;
+  }
+  _model->set_token_callback([this](int step, const std::vector<int>& tokens) {
+    std::vector<int> unique_of_row;
+    {
+      std::lock_guard<std::mutex> lock(_row_mutex);
+      unique_of_row = _unique_of_row;
+    }
+    if (unique_of_row.empty()) {
+      _token_callback(step, tokens);
+      return;
+    }
+    std::vector<int> row_tokens(unique_of_row.size());
+    for (size_t row = 0; row < unique_of_row.size(); row++) {
+      row_tokens[row] = tokens[unique_of_row[row]];
+    }
+    _token_callback(step, row_tokens);
+  });
+}
+
+void DedupModel::set_sampling_params(float temperature,
+                                     float repetition_penalty, float min_p) {
+  _model->set_sampling_params(temperature, repetition_penalty, min_p);
+}
+
+void DedupModel::set_generation_configs(
+    const std::vector<GenerationConfig>& configs) {
+  _model->set_generation_configs(configs);
+  _per_row_settings = !configs.empty();
+}
+
+void DedupModel::set_logits_processor(const LogitsProcessConfig& config) {
+  _model->set_logits_processor(config);
+}
+
+void DedupModel::set_token_automaton(const TokenAutomaton& automaton) {
+  _model->set_token_automaton(automaton);
+}
+
+void DedupModel::set_draft_model(LSModel* draft_model, int num_draft_tokens) {
+  // the draft model of the dedup_rows option is wrapped too.
+  DedupModel* dedup_draft = dynamic_cast<DedupModel*>(draft_model);
+  if (dedup_draft) draft_model = dedup_draft->model();
+  _model->set_draft_model(draft_model, num_draft_tokens);
+}
+
+void DedupModel::load_lora_adapter(const std::string& name,
+                                   const std::string& path) {
+  _model->load_lora_adapter(name, path);
+}
+
+void DedupModel::set_lora_adapters(const std::vector<std::string>& names) {
+  _model->set_lora_adapters(names);
+  _per_row_settings = !names.empty();
+}
+
+void DedupModel::score_packed(const int* tokens, const int* offsets,
+                              int num_seqs, float* ppl,
+                              float* token_log_probs) {
+  _model->score_packed(tokens, offsets, num_seqs, ppl, token_log_probs);
+}
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -1,13 +1,26 @@
 #include "gpt.h"
+#include "profiler.h"
+#include "metrics.h"
+#include <algorithm>
+#include <numeric>
+#ifdef LIGHTSEQ_cuda
+#include "cublas_wrappers.h"
+#include "gptKernels.h"
+#include "transformerKernels.h"
+#endif
 
 namespace lightseq {
 namespace cuda {
-Gpt::Gpt(const std::string weight_path, const int max_batch_size)
+template <typename OpType_>
+Gpt<OpType_>::Gpt(const std::string weight_path, const int max_batch_size,
+                  const ModelOptions &options)
     : LSModel({"token_ids"}, {"gpt_out", "gpt_scores"}),
-      _max_batch_size(max_batch_size) {
+      _max_batch_size(max_batch_size),
+      _token_streamer(max_batch_size) {
   /* --- step.1 initial context --- */
-  Context::create_global_context(StatusType::Inference);
-  _context_ptr = Context::global_instance();
+  _context_ptr = std::make_shared<Context>(StatusType::Inference, -1);
+  // the graph of the model is created in its own context.
+  ContextScope context_scope(_context_ptr);
 
   /* --- step.2 load model weights into GPU memory --- */
   // saved in custom proto file
@@ -45,7 +58,7 @@ Gpt::Gpt(const std::string weight_path, const int max_batch_size)
         idx, max_batch_tokens * tw_._beam_size, tw_._max_step, tw_._hidden_size,
         tw_._head_num, tw_._inner_size, attn_prob_dropout_ratio,
         activation_dropout_ratio, hidden_dropout_ratio,
-        tw_._use_gelu ? "gelu" : "relu", false));
+        tw_._use_gelu ? "gelu" : "relu", false, 1, tw_.sparse24(idx)));
     enc_wei_offset += gpt_layer->load_params(tw_.get_enc_wei(), enc_wei_offset);
     _gpt_layers_vec.push_back(gpt_layer);
   }
@@ -56,16 +69,36 @@ Gpt::Gpt(const std::string weight_path, const int max_batch_size)
   _lyr_norm_layer->load_params(tw_.get_src_emb_wei(), 2);
 
   // intial Project hidden states to vocab logits
-  _linear_layer.reset(new LinearLayer<OpType_, OpType_>(
-      max_batch_size * tw_._beam_size, tw_._hidden_size, tw_._src_vocab_size,
-      MATRIX_OP::Transpose, MATRIX_OP::NonTranspose, 1.f));
-  _linear_layer->load_params(tw_.get_src_emb_wei(), 0);
+  if (tw_.adaptive_softmax()) {
+    _adaptive_softmax_layer.reset(new AdaptiveSoftmaxLayer<OpType_, OpType_>(
+        max_batch_size * tw_._beam_size, tw_._hidden_size,
+        tw_._adaptive_cutoffs, tw_._adaptive_tail_dims));
+    _adaptive_softmax_layer->load_params(tw_.get_adaptive_softmax_wei(), 0);
+  } else {
+    _linear_layer.reset(new LinearLayer<OpType_, OpType_>(
+        max_batch_size * tw_._beam_size, tw_._hidden_size, tw_._src_vocab_size,
+        MATRIX_OP::Transpose, MATRIX_OP::NonTranspose, 1.f));
+    _linear_layer->load_params(tw_.get_src_emb_wei(), 0);
+  }
 
   _generator_layer.reset(new GeneratorLayer<OpType_>(
       _generate_method, tw_._n_enc_layer, max_batch_size, tw_._max_step,
       tw_._src_vocab_size, tw_._hidden_size, 1024, tw_._beam_size,
       tw_._diverse_lambda, tw_._dim_per_head, tw_._eos_id, tw_._head_num,
       tw_._length_penalty, tw_._topk, tw_._topp, false));
+  // stop_check_interval: decoding steps between two waits for the
+  // stop flag of sampling, 1 by default.
+  const char *stop_check_opt = model_option(options, "stop_check_interval");
+  if (stop_check_opt) {
+    _generator_layer->set_stop_check_interval(std::atoi(stop_check_opt));
+  }
+  // the score margins of beam pruning, see transformer.cu.
+  const char *prune_abs_opt = model_option(options, "beam_prune_abs");
+  const char *prune_rel_opt = model_option(options, "beam_prune_rel");
+  _generator_layer->set_beam_pruning(
+      prune_abs_opt ? std::atof(prune_abs_opt) : 0.f,
+      prune_rel_opt ? std::atof(prune_rel_opt) : 0.f);
+  update_adaptive_topk();
 
   printf("Finish initialize layers and assign weights!\n");
 
@@ -77,6 +110,31 @@ Gpt::Gpt(const std::string weight_path, const int max_batch_size)
   _total_caches_v = new Variable(
       "total_caches_v", cache_size * tw_._n_enc_layer, g_dtype<OpType_>(),
       DataType::kNotSupported, VariableType::RegressiveVariable);
+#ifdef LIGHTSEQ_cuda
+  // kv_virtual_memory=1: the caches are reserved as virtual address
+  // space out of the memory plan, and only backed by physical memory as the
+  // sequences grow. Not with beam search, which swaps the caches with the
+  // buffers of BeamSearchTopOp.
+  const char *kv_vm_opt = model_option(options, "kv_virtual_memory");
+  if (kv_vm_opt && std::atoi(kv_vm_opt) != 0) {
+    int device_id = 0;
+    CHECK_GPU_ERROR(cudaGetDevice(&device_id));
+    if (_generate_method == GenerateMethod::BeamSearch) {
+      printf("beam search does not support kv_virtual_memory\n");
+    } else if (!VirtualBuffer::supported(device_id)) {
+      printf("device %d does not support kv_virtual_memory\n",
+             device_id);
+    } else {
+      size_t cache_bytes = cache_size * tw_._n_enc_layer * sizeof(OpType_);
+      _caches_k_vm.reset(new VirtualBuffer(cache_bytes));
+      _caches_v_vm.reset(new VirtualBuffer(cache_bytes));
+      _total_caches_k->set_value(_caches_k_vm->ptr());
+      _total_caches_v->set_value(_caches_v_vm->ptr());
+      printf("*** kv cache of virtual memory, %zu MB reserved ***\n",
+             2 * _caches_k_vm->capacity() / MB_SIZE);
+    }
+  }
+#endif
 
   // note regress begin
   _context_ptr->regress_begin();
@@ -96,7 +154,9 @@ Gpt::Gpt(const std::string weight_path, const int max_batch_size)
     cache_offset += cache_size;
   }
   gpt_emb = (*_lyr_norm_layer)(gpt_emb);
-  Variable *logits_prob = (*_linear_layer)(gpt_emb);
+  Variable *logits_prob = _adaptive_softmax_layer
+                              ? (*_adaptive_softmax_layer)(gpt_emb)
+                              : (*_linear_layer)(gpt_emb);
 
   std::tuple<Variable *, Variable *> gen_outs =
       (*_generator_layer)(logits_prob, _inp_tokens);
@@ -113,16 +173,32 @@ Gpt::Gpt(const std::string weight_path, const int max_batch_size)
   printf("Finish construct network!\n");
 }
 
-Gpt::~Gpt() {}
+template <typename OpType_>
+Gpt<OpType_>::~Gpt() {
+#ifdef LIGHTSEQ_cuda
+  cudaFree(_score_row_src);
+  cudaFree(_score_target_id);
+  cudaFree(_score_log_prob);
+  cudaFree(_score_hidden);
+  cudaFree(_score_logits);
+  cudaFree(_score_positions);
+  cudaFree(_score_tree_mask);
+#endif
+}
 
-void Gpt::before_forward(int batch_size, int prompt_len, int steps) {
+template <typename OpType_>
+void Gpt<OpType_>::before_forward(int batch_size, int prompt_len, int steps) {
   if (steps == 0) {
     _launch_gpt_emb_layer->before_forward(batch_size, prompt_len, 0);
     for (auto iter : _gpt_layers_vec) {
       iter->before_forward(batch_size * tw_._beam_size, prompt_len, 0);
     }
     _lyr_norm_layer->before_forward(batch_size * tw_._beam_size, 1);
-    _linear_layer->before_forward(batch_size * tw_._beam_size, 1);
+    if (_adaptive_softmax_layer) {
+      _adaptive_softmax_layer->before_forward(batch_size * tw_._beam_size, 1);
+    } else {
+      _linear_layer->before_forward(batch_size * tw_._beam_size, 1);
+    }
     _generator_layer->before_forward(batch_size, prompt_len, 0);
   } else {
     _launch_gpt_emb_layer->before_forward(batch_size, 1,
@@ -132,14 +208,82 @@ void Gpt::before_forward(int batch_size, int prompt_len, int steps) {
                            prompt_len + steps - 1);
     }
     _lyr_norm_layer->before_forward(batch_size * tw_._beam_size, 1);
-    _linear_layer->before_forward(batch_size * tw_._beam_size, 1);
+    if (_adaptive_softmax_layer) {
+      _adaptive_softmax_layer->before_forward(batch_size * tw_._beam_size, 1);
+    } else {
+      _linear_layer->before_forward(batch_size * tw_._beam_size, 1);
+    }
     _generator_layer->before_forward(batch_size, prompt_len, steps);
   }
 }
 
-void Gpt::Infer() {
+template <typename OpType_>
+void Gpt<OpType_>::update_adaptive_topk() {
+  if (!_adaptive_softmax_layer) return;
+  // the best beam_size tokens of a beam cover its candidates, top-p keeps an
+  // unbounded number of tokens.
+  int topk = 0;
+  if (!_reorders_logits && _generate_method == GenerateMethod::BeamSearch) {
+    topk = tw_._beam_size;
+  } else if (!_reorders_logits && _generate_method == GenerateMethod::Topk) {
+    topk = tw_._topk;
+  }
+  _adaptive_softmax_layer->set_topk(topk);
+}
+
+template <typename OpType_>
+void Gpt<OpType_>::commit_caches(int batch_size, int kv_len) {
+#ifdef LIGHTSEQ_cuda
+  // the last committed rows and tokens are all backed.
+  if (batch_size <= _committed_rows && kv_len <= _committed_len) return;
+  // [layer_num, max_batch_size * beam_size, head_num, max_step,
+  // dim_per_head], the first kv_len tokens of every head of the rows.
+  size_t head_bytes = size_t(tw_._dim_per_head) * sizeof(OpType_);
+  size_t layer_bytes = size_t(_max_batch_size) * tw_._beam_size *
+                       tw_._max_step * tw_._hidden_size * sizeof(OpType_);
+  size_t num_heads = size_t(batch_size) * tw_._beam_size * tw_._head_num;
+  for (int layer = 0; layer < tw_._n_enc_layer; layer++) {
+    for (VirtualBuffer *vm : {_caches_k_vm.get(), _caches_v_vm.get()}) {
+      vm->commit(layer * layer_bytes, kv_len * head_bytes, num_heads,
+                 tw_._max_step * head_bytes);
+    }
+  }
+  _committed_rows = batch_size;
+  _committed_len = kv_len;
+#endif
+}
+
+template <typename OpType_>
+void Gpt<OpType_>::switch_memory_plan(int batch_size, int prompt_len) {
+  MemoryManagerPtr mm_ptr = _context_ptr->memory_manager_ptr();
+  int batch_bucket = shape_bucket(batch_size, _max_batch_size);
+  int prompt_bucket = shape_bucket(prompt_len, tw_._max_step);
+  MemoryManager::PlanKey plan_key = {batch_bucket, prompt_bucket};
+  if (!mm_ptr->has_plan(plan_key)) {
+    // the prompt step and the longest decode step of the bucket cover the
+    // largest shape of every tensor.
+    mm_ptr->start_shape_recording();
+    before_forward(batch_bucket, prompt_bucket, 0);
+    if (prompt_bucket + 1 < tw_._max_step) {
+      before_forward(batch_bucket, prompt_bucket,
+                     tw_._max_step - prompt_bucket - 1);
+    }
+    mm_ptr->finish_shape_recording(plan_key);
+  }
+  mm_ptr->switch_plan(plan_key);
+}
+
+template <typename OpType_>
+void Gpt<OpType_>::Infer() {
   int batch_size = input_shapes_[0][0], prompt_len = input_shapes_[0][1];
 
+  if (_dynamic_memory_plan) {
+    switch_memory_plan(batch_size, prompt_len);
+  }
+  Metrics *metrics = _context_ptr->metrics();
+  metrics->begin_forward();
+  _row_cancellation.reset(batch_size);
+
   /* --- notice that the order of forward should be the same with network --- */
 
 #ifdef LIGHTSEQ_cuda
@@ -156,7 +300,24 @@ void Gpt::Infer() {
 
   int steps = 0;
   while (steps + prompt_len < tw_._max_step) {
+#ifdef LIGHTSEQ_cuda
+    if (steps > 0) {
+      // the rows cancelled since the last step end with its token.
+      std::vector<int> cancelled = _row_cancellation.apply(
+          _inp_tokens->value<int>(), prompt_len + steps - 1, tw_._beam_size,
+          tw_._max_step, tw_._eos_id,
+          _generate_method != GenerateMethod::BeamSearch,
+          _context_ptr->get_stream());
+      if (!cancelled.empty()) {
+        metrics->add("cancelled_requests_total", cancelled.size());
+      }
+      if (_row_cancellation.all_cancelled()) break;
+    }
+#endif
     before_forward(batch_size, prompt_len, steps);
+#ifdef LIGHTSEQ_cuda
+    if (_caches_k_vm) commit_caches(batch_size, prompt_len + steps);
+#endif
 
     _launch_gpt_emb_layer->forward();
     for (auto iter : _gpt_layers_vec) {
@@ -164,7 +325,8 @@ void Gpt::Infer() {
     }
 
     if (steps == 0) {
-      OpType_ *linear_inp_ptr = _lyr_norm_layer->input(0)->value<OpType_>();
+      OpType_ *linear_inp_ptr =
+          _lyr_norm_layer->input(0)->template value<OpType_>();
       for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
         for (int i = 0; i < tw_._beam_size; i++) {
           cudaMemcpyAsync(
@@ -179,9 +341,21 @@ void Gpt::Infer() {
       }
     }
     _lyr_norm_layer->forward();
-    _linear_layer->forward();
+    if (_adaptive_softmax_layer) {
+      _adaptive_softmax_layer->forward();
+    } else {
+      _linear_layer->forward();
+    }
 
     _generator_layer->forward();
+#ifdef LIGHTSEQ_cuda
+    if (_token_streamer.enabled()) {
+      // the sampled token follows the last token of every row.
+      _token_streamer.push(
+          steps, _inp_tokens->value<int>() + prompt_len + steps, batch_size,
+          tw_._max_step, _context_ptr->get_stream());
+    }
+#endif
 
     if (_generator_layer->is_stop()) {
       break;
@@ -194,6 +368,9 @@ void Gpt::Infer() {
     }
     steps++;
   }
+  // with a stop check interval, the loop may run past the stop.
+  steps = _generator_layer->stop_step(steps);
+  _token_streamer.flush();
 
   for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
     for (int beam_idx = 0; beam_idx < tw_._beam_size; beam_idx++) {
@@ -213,6 +390,22 @@ void Gpt::Infer() {
                   cudaMemcpyDefault, _context_ptr->get_stream());
 
   _context_ptr->synchronize();
+
+  // every row of the batch is a request, generated tokens after an eos
+  // included.
+  metrics->end_forward();
+  metrics->add("requests_total", batch_size);
+  metrics->add("prompt_tokens_total", double(batch_size) * prompt_len);
+  metrics->add("generated_tokens_total", double(batch_size) * steps);
+  metrics->add("steps_total", steps);
+  for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+    metrics->observe("request_prompt_tokens", prompt_len);
+    metrics->observe("request_generated_tokens", steps);
+  }
+  metrics->set("batch_occupancy", double(batch_size) / _max_batch_size);
+  metrics->set("memory_plan_bytes",
+               _context_ptr->memory_manager_ptr()->total_buffer_size());
+
   if (_generate_method == GenerateMethod::BeamSearch) {
     set_output_shape(0, {batch_size, tw_._beam_size, prompt_len + steps});
     set_output_shape(1, {batch_size, tw_._beam_size});
@@ -222,7 +415,308 @@ void Gpt::Infer() {
   }
 }
 
-void Gpt::set_input_ptr(int index, void *input_ptr) {
+template <typename OpType_>
+void Gpt<OpType_>::set_token_callback(
+    std::function<void(int, const std::vector<int> &)> callback) {
+  if (callback && _generate_method == GenerateMethod::BeamSearch) {
+    // the beams are reordered at every step, their tokens are only final
+    // at the end.
+    printf("streaming output does not support beam search, ignored.\n");
+    return;
+  }
+  _token_streamer.set_callback(callback);
+}
+
+#ifdef LIGHTSEQ_cuda
+template <typename OpType_>
+void Gpt<OpType_>::malloc_score_buffers() {
+  // the scores project the hidden states on the token embedding.
+  if (_adaptive_softmax_layer) {
+    throw std::runtime_error(
+        "scoring is not supported with an adaptive softmax head");
+  }
+  if (_score_row_src != nullptr) return;
+  size_t max_tokens = size_t(_max_batch_size) * tw_._beam_size * tw_._max_step;
+  CHECK_GPU_ERROR(cudaMalloc(&_score_row_src, max_tokens * sizeof(int)));
+  CHECK_GPU_ERROR(cudaMalloc(&_score_target_id, max_tokens * sizeof(int)));
+  CHECK_GPU_ERROR(cudaMalloc(&_score_log_prob, max_tokens * sizeof(float)));
+  CHECK_GPU_ERROR(cudaMalloc(
+      &_score_hidden, kScoreChunkRows * tw_._hidden_size * sizeof(OpType_)));
+  CHECK_GPU_ERROR(cudaMalloc(&_score_logits, size_t(kScoreChunkRows) *
+                                                 tw_._src_vocab_size *
+                                                 sizeof(OpType_)));
+}
+
+template <typename OpType_>
+void Gpt<OpType_>::score_rows(const std::vector<int> &row_src,
+                              const std::vector<int> &target_id,
+                              std::vector<float> *log_prob) {
+  cudaStream_t stream = _context_ptr->get_stream();
+  const std::vector<const OpType_ *> &emb_wei = tw_.get_src_emb_wei();
+  int rows = row_src.size();
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_score_row_src, row_src.data(),
+                                  rows * sizeof(int), cudaMemcpyHostToDevice,
+                                  stream));
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_score_target_id, target_id.data(),
+                                  rows * sizeof(int), cudaMemcpyHostToDevice,
+                                  stream));
+
+  // the last layer norm and the vocab projection only run on the scored
+  // tokens, chunk by chunk to bound the logits buffer.
+  const OpType_ *hidden = _lyr_norm_layer->input(0)->template value<OpType_>();
+  float alpha = 1.f, beta = 0.f;
+  for (int chunk = 0; chunk < rows; chunk += kScoreChunkRows) {
+    int chunk_rows = std::min(kScoreChunkRows, rows - chunk);
+    ker_gather_rows_launcher<OpType_>(chunk_rows, tw_._hidden_size, 1024,
+                                      stream, hidden, _score_row_src + chunk,
+                                      _score_hidden);
+    ker_norm_layer_launcher<OpType_>(chunk_rows, tw_._hidden_size, stream,
+                                     _score_hidden, emb_wei[2], emb_wei[3],
+                                     1024);
+    cublas_gemm_ex(_context_ptr->get_cublashandle(), CUBLAS_OP_T, CUBLAS_OP_N,
+                   tw_._src_vocab_size, chunk_rows, tw_._hidden_size, &alpha,
+                   &beta, emb_wei[0], _score_hidden, _score_logits);
+    ker_target_log_prob_launcher<OpType_>(
+        chunk_rows, 1024, stream, _score_logits, _score_target_id + chunk,
+        _score_log_prob + chunk, tw_._src_vocab_size);
+  }
+  log_prob->resize(rows);
+  CHECK_GPU_ERROR(cudaMemcpyAsync(log_prob->data(), _score_log_prob,
+                                  rows * sizeof(float), cudaMemcpyDeviceToHost,
+                                  stream));
+  _context_ptr->synchronize();
+}
+#endif
+
+template <typename OpType_>
+void Gpt<OpType_>::score_packed(const int *tokens, const int *offsets,
+                                int num_seqs, float *ppl,
+                                float *token_log_probs) {
+#ifdef LIGHTSEQ_cuda
+  // every row of the layers scores a sequence, beams included.
+  int max_rows = _max_batch_size * tw_._beam_size;
+  malloc_score_buffers();
+
+  // longest first, so that the sequences batched together have close lengths
+  // and the layers run on little padding.
+  std::vector<int> order(num_seqs);
+  std::iota(order.begin(), order.end(), 0);
+  auto seq_len = [&](int seq) { return offsets[seq + 1] - offsets[seq]; };
+  std::stable_sort(order.begin(), order.end(),
+                   [&](int a, int b) { return seq_len(a) > seq_len(b); });
+  if (num_seqs > 0 &&
+      (seq_len(order.front()) >= tw_._max_step || seq_len(order.back()) < 1)) {
+    throw std::runtime_error("packed sequence length must be in [1, max_step)");
+  }
+  if (token_log_probs != nullptr && num_seqs > 0) {
+    std::fill(token_log_probs + offsets[0], token_log_probs + offsets[num_seqs],
+              0.f);
+  }
+
+  cudaStream_t stream = _context_ptr->get_stream();
+  std::vector<int> h_tokens, h_row_src, h_target_id;
+  std::vector<float> h_log_prob;
+  for (int begin = 0; begin < num_seqs; begin += max_rows) {
+    int num_rows = std::min(max_rows, num_seqs - begin);
+    int batch_size = (num_rows + tw_._beam_size - 1) / tw_._beam_size;
+    int batch_seq_len = seq_len(order[begin]);
+    if (_dynamic_memory_plan) {
+      switch_memory_plan(batch_size, batch_seq_len);
+    }
+
+    // left padded as Infer, the rows past num_rows repeat the last sequence.
+    // Every token but the last one of a sequence predicts the next one.
+    h_tokens.assign(batch_size * tw_._beam_size * tw_._max_step,
+                    tw_._padding_id);
+    h_row_src.clear();
+    h_target_id.clear();
+    for (int row = 0; row < batch_size * tw_._beam_size; row++) {
+      int seq = order[begin + std::min(row, num_rows - 1)];
+      const int *seq_tokens = tokens + offsets[seq];
+      int pad_len = batch_seq_len - seq_len(seq);
+      std::copy(seq_tokens, seq_tokens + seq_len(seq),
+                h_tokens.begin() + row * tw_._max_step + pad_len);
+      for (int j = 0; row < num_rows && j + 1 < seq_len(seq); j++) {
+        h_row_src.push_back(row * batch_seq_len + pad_len + j);
+        h_target_id.push_back(seq_tokens[j + 1]);
+      }
+    }
+    CHECK_GPU_ERROR(cudaMemcpyAsync(_inp_tokens->value<int>(), h_tokens.data(),
+                                    h_tokens.size() * sizeof(int),
+                                    cudaMemcpyHostToDevice, stream));
+
+    _launch_gpt_emb_layer->before_forward(batch_size, batch_seq_len, 0);
+    for (auto iter : _gpt_layers_vec) {
+      iter->before_forward(batch_size * tw_._beam_size, batch_seq_len, 0);
+    }
+    _launch_gpt_emb_layer->forward();
+    for (auto iter : _gpt_layers_vec) {
+      iter->forward();
+    }
+    score_rows(h_row_src, h_target_id, &h_log_prob);
+
+    int row = 0;
+    for (int i = 0; i < num_rows; i++) {
+      int seq = order[begin + i];
+      double sum_log_prob = 0;
+      for (int j = 1; j < seq_len(seq); j++, row++) {
+        sum_log_prob += h_log_prob[row];
+        if (token_log_probs != nullptr) {
+          token_log_probs[offsets[seq] + j] = h_log_prob[row];
+        }
+      }
+      ppl[seq] = seq_len(seq) > 1 ? -sum_log_prob / (seq_len(seq) - 1) : 0.f;
+    }
+  }
+
+  Metrics *metrics = _context_ptr->metrics();
+  metrics->add("requests_total", num_seqs);
+  if (num_seqs > 0) {
+    metrics->add("prompt_tokens_total", offsets[num_seqs] - offsets[0]);
+  }
+#else
+  throw std::runtime_error("packed scoring is only supported on cuda");
+#endif
+}
+
+template <typename OpType_>
+void Gpt<OpType_>::score_tree(const int *prefix, int prefix_len,
+                              const int *tree_tokens, const int *tree_parents,
+                              int tree_len, float *log_likelihood) {
+#ifdef LIGHTSEQ_cuda
+  int seq_len = prefix_len + tree_len;
+  if (prefix_len < 1 || tree_len < 1 || seq_len >= tw_._max_step) {
+    throw std::runtime_error(
+        "tree scoring needs a prefix and a tree of [1, max_step) tokens");
+  }
+  // the tree is topologically ordered, depth[i] of token i below the prefix
+  // and ancestor[i][j] whether token j is token i or one of its ancestors.
+  std::vector<int> depth(tree_len);
+  std::vector<unsigned char> ancestor(size_t(tree_len) * tree_len, 0);
+  for (int i = 0; i < tree_len; i++) {
+    int parent = tree_parents[i];
+    if (parent < -1 || parent >= i) {
+      throw std::runtime_error("the parent of tree token " +
+                               std::to_string(i) +
+                               " should be -1 or an earlier token");
+    }
+    depth[i] = parent < 0 ? 0 : depth[parent] + 1;
+    if (parent >= 0) {
+      std::copy(ancestor.begin() + size_t(parent) * tree_len,
+                ancestor.begin() + size_t(parent + 1) * tree_len,
+                ancestor.begin() + size_t(i) * tree_len);
+    }
+    ancestor[size_t(i) * tree_len + i] = 1;
+  }
+
+  malloc_score_buffers();
+  int rows = tw_._beam_size;
+  if (_score_positions == nullptr) {
+    CHECK_GPU_ERROR(cudaMalloc(&_score_positions,
+                               size_t(rows) * tw_._max_step * sizeof(int)));
+    CHECK_GPU_ERROR(cudaMalloc(&_score_tree_mask,
+                               size_t(rows) * tw_._max_step * tw_._max_step));
+  }
+  if (_dynamic_memory_plan) {
+    switch_memory_plan(1, seq_len);
+  }
+
+  // one sequence of the prefix and the tree, with the position of every
+  // tree token after its depth. The layers run every beam row of the batch
+  // row, which repeat it.
+  cudaStream_t stream = _context_ptr->get_stream();
+  std::vector<int> h_tokens(size_t(rows) * tw_._max_step, tw_._padding_id);
+  std::vector<int> h_positions(h_tokens.size(), 0);
+  for (int row = 0; row < rows; row++) {
+    int *row_tokens = h_tokens.data() + row * tw_._max_step;
+    int *row_positions = h_positions.data() + row * tw_._max_step;
+    std::copy(prefix, prefix + prefix_len, row_tokens);
+    std::copy(tree_tokens, tree_tokens + tree_len, row_tokens + prefix_len);
+    std::iota(row_positions, row_positions + prefix_len, 0);
+    for (int i = 0; i < tree_len; i++) {
+      row_positions[prefix_len + i] = prefix_len + depth[i];
+    }
+    CHECK_GPU_ERROR(cudaMemcpyAsync(
+        _score_tree_mask + size_t(row) * ancestor.size(), ancestor.data(),
+        ancestor.size(), cudaMemcpyHostToDevice, stream));
+  }
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_inp_tokens->value<int>(), h_tokens.data(),
+                                  h_tokens.size() * sizeof(int),
+                                  cudaMemcpyHostToDevice, stream));
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_score_positions, h_positions.data(),
+                                  h_positions.size() * sizeof(int),
+                                  cudaMemcpyHostToDevice, stream));
+
+  _launch_gpt_emb_layer->set_positions(_score_positions);
+  bool fused = true;
+  for (auto iter : _gpt_layers_vec) {
+    fused = iter->set_tree_mask(_score_tree_mask, tree_len) && fused;
+  }
+  if (fused) {
+    _launch_gpt_emb_layer->before_forward(1, seq_len, 0);
+    for (auto iter : _gpt_layers_vec) {
+      iter->before_forward(rows, seq_len, 0);
+    }
+    _launch_gpt_emb_layer->forward();
+    for (auto iter : _gpt_layers_vec) {
+      iter->forward();
+    }
+  }
+  _launch_gpt_emb_layer->set_positions(nullptr);
+  for (auto iter : _gpt_layers_vec) {
+    iter->set_tree_mask(nullptr, 0);
+  }
+  if (!fused) {
+    throw std::runtime_error("tree scoring needs the fused attention");
+  }
+
+  // every tree token is predicted by its parent, or by the last token of
+  // the prefix.
+  std::vector<int> h_row_src(tree_len), h_target_id(tree_len);
+  for (int i = 0; i < tree_len; i++) {
+    int parent = tree_parents[i];
+    h_row_src[i] = parent < 0 ? prefix_len - 1 : prefix_len + parent;
+    h_target_id[i] = tree_tokens[i];
+  }
+  std::vector<float> h_log_prob;
+  score_rows(h_row_src, h_target_id, &h_log_prob);
+  for (int i = 0; i < tree_len; i++) {
+    int parent = tree_parents[i];
+    log_likelihood[i] =
+        h_log_prob[i] + (parent < 0 ? 0.f : log_likelihood[parent]);
+  }
+
+  Metrics *metrics = _context_ptr->metrics();
+  metrics->add("requests_total", 1);
+  metrics->add("prompt_tokens_total", seq_len);
+#else
+  throw std::runtime_error("tree scoring is only supported on cuda");
+#endif
+}
+
+template <typename OpType_>
+std::string Gpt<OpType_>::metrics_text() {
+  return _context_ptr->metrics()->prometheus_text();
+}
+
+template <typename OpType_>
+void Gpt<OpType_>::layer_time_sampling(int interval) {
+  _context_ptr->metrics()->set_layer_sampling(interval);
+}
+
+template <typename OpType_>
+void Gpt<OpType_>::export_profile(const std::string &trace_path) {
+  Profiler *profiler = _context_ptr->profiler();
+  if (profiler == nullptr) {
+    printf("profiling is not enabled, nothing to export.\n");
+    return;
+  }
+  profiler->print_summary();
+  profiler->export_chrome_trace(trace_path);
+}
+
+template <typename OpType_>
+void Gpt<OpType_>::set_input_ptr(int index, void *input_ptr) {
   switch (index) {
     case 0:
       _input_ptr = (int *)input_ptr;
@@ -234,7 +728,8 @@ void Gpt::set_input_ptr(int index, void *input_ptr) {
   }
 }
 
-void Gpt::set_output_ptr(int index, void *output_ptr) {
+template <typename OpType_>
+void Gpt<OpType_>::set_output_ptr(int index, void *output_ptr) {
   switch (index) {
     case 0:
       _gpt_out_ptr = (int *)output_ptr;
@@ -250,7 +745,8 @@ void Gpt::set_output_ptr(int index, void *output_ptr) {
   }
 }
 
-const void *Gpt::get_output_ptr(int index) {
+template <typename OpType_>
+const void *Gpt<OpType_>::get_output_ptr(int index) {
   switch (index) {
     case 0:
       return static_cast<void *>(_gpt_out_ptr);
@@ -264,7 +760,8 @@ const void *Gpt::get_output_ptr(int index) {
   }
 }
 
-std::vector<int> Gpt::get_input_max_shape(int index) {
+template <typename OpType_>
+std::vector<int> Gpt<OpType_>::get_input_max_shape(int index) {
   switch (index) {
     case 0:
       return {_max_batch_size, tw_._max_step};
@@ -274,7 +771,8 @@ std::vector<int> Gpt::get_input_max_shape(int index) {
       break;
   }
 }
-std::vector<int> Gpt::get_output_max_shape(int index) {
+template <typename OpType_>
+std::vector<int> Gpt<OpType_>::get_output_max_shape(int index) {
   switch (index) {
     case 0:
       return {_max_batch_size, tw_._beam_size, tw_._max_step};
@@ -289,7 +787,8 @@ std::vector<int> Gpt::get_output_max_shape(int index) {
   }
 }
 
-DataType Gpt::get_input_dtype(int index) {
+template <typename OpType_>
+DataType Gpt<OpType_>::get_input_dtype(int index) {
   switch (index) {
     case 0:
       return DataType::kInt32;
@@ -301,7 +800,8 @@ DataType Gpt::get_input_dtype(int index) {
   }
 }
 
-DataType Gpt::get_output_dtype(int index) {
+template <typename OpType_>
+DataType Gpt<OpType_>::get_output_dtype(int index) {
   switch (index) {
     case 0:
       return DataType::kInt32;
@@ -316,5 +816,11 @@ DataType Gpt::get_output_dtype(int index) {
       break;
   }
 }
+
+template class Gpt<float>;
+#ifdef LIGHTSEQ_cuda
+template class Gpt<__half>;
+#endif
+
 }  // namespace cuda
 }  // namespace lightseq
@@ -1,15 +1,19 @@
 #pragma once
 #include "model_base.h"
+#include "model_util.h"
 
 #include "bert_weight.h"
 
 #include "launch_enc_emb_layer.h"
 #include "transformer_encoder_layer.h"
 #include "lyr_normalize_layer.h"
+#include "varlen_layer.h"
+#include "sequence_pooling_layer.h"
 
 namespace lightseq {
 namespace cuda {
 
+template <typename OpType_>
 class Bert : public LSModel {
  private:
   BertWeight<OpType_> tw_;
@@ -18,6 +22,11 @@ class Bert : public LSModel {
   LaunchEncEmbLayerPtr<OpType_> launch_enc_emb_layer;
   std::vector<TransformerEncoderLayerPtr<OpType_, OpType_> > enc_layer_vec;
   LyrNormalizeLayerPtr<OpType_, OpType_> lyr_norm_layer;
+  // varlen only, see RemovePaddingLayer.
+  RemovePaddingLayerPtr<OpType_, OpType_> _remove_padding_layer;
+  RebuildPaddingLayerPtr<OpType_, OpType_> _rebuild_padding_layer;
+  // the sentence embeddings only, see bert_pooling.
+  SequencePoolingLayerPtr<OpType_, OpType_> _pooling_layer;
 
   ContextPtr context_ptr;
 
@@ -28,16 +37,38 @@ class Bert : public LSModel {
   Variable* lang_id;
 
   Variable* bert_out;
+  // early exit only, see bert_exit_entropy.
+  std::vector<Variable*> _enc_outs;
+  Variable* _pad_mask;
+  // the padded token ids of encode_packed, the input of the embedding.
+  std::vector<int> _packed_inputs;
+  float* _exit_logits_ptr = nullptr;
+  int* _exit_layers_ptr = nullptr;
 
   int _max_batch_size;
+  // the encoder layers skip the padding tokens, on with varlen=1.
+  bool _varlen = false;
+  bool _half_output = false;
+  // off if not positive.
+  float _exit_entropy = 0.f;
+
+  // the entropy of the softmax of the logits of the exit head of layer, on
+  // the [CLS] output cls of a row.
+  float exit_head(int layer, const OpType_* cls, float* logits);
+  void early_exit_forward(int batch_size, int seq_len);
 
  public:
-  Bert(const std::string weight_path, const int max_batch_size);
+  Bert(const std::string weight_path, const int max_batch_size,
+       const ModelOptions& options);
   ~Bert();
 
   void before_forward(int batch_size, int seq_len);
 
   void Infer() override;
+  // The encoder layers run on the packed tokens only, varlen=1
+  // without pooling or early exit.
+  void encode_packed(const int* tokens, const int* offsets, int num_seqs,
+                     void* output) override;
   void set_input_ptr(int index, void* input_ptr) override;
   void set_output_ptr(int index, void* output_ptr) override;
   const void* get_output_ptr(int index) override;
@@ -46,6 +77,11 @@ class Bert : public LSModel {
   DataType get_input_dtype(int index) override;
   DataType get_output_dtype(int index) override;
   void benchmark_mode(bool is_benchmark) override {}
+  std::vector<WarmupTiming> warmup(
+      const std::vector<std::vector<int>>& shapes) override {
+    return warmup_infer(this, inp_tokens->value(true), shapes,
+                        {tw_._padding_id});
+  }
 };
 
 LSMODEL_REGISTER(Bert);
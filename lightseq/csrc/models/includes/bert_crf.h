@@ -1,5 +1,6 @@
 #pragma once
 #include "model_base.h"
+#include "model_util.h"
 
 #include "bert_crf_weight.h"
 
@@ -8,10 +9,12 @@
 #include "lyr_normalize_layer.h"
 #include "linear_layer.h"
 #include "crf_layer.h"
+#include "varlen_layer.h"
 
 namespace lightseq {
 namespace cuda {
 
+template <typename OpType_>
 class BertCrf : public LSModel {
  private:
   BertCrfWeight<OpType_> tw_;
@@ -22,6 +25,8 @@ class BertCrf : public LSModel {
   LyrNormalizeLayerPtr<OpType_, OpType_> lyr_norm_layer;
   LinearLayerPtr<OpType_, OpType_> linear_layer;
   CRFLayerPtr<OpType_> crf_layer;
+  // varlen only, see RemovePaddingLayer.
+  RemovePaddingLayerPtr<OpType_, OpType_> _remove_padding_layer;
 
   ContextPtr context_ptr;
 
@@ -29,9 +34,13 @@ class BertCrf : public LSModel {
   Variable* bert_out;
 
   int _max_batch_size;
+  // the layers after the embedding skip the padding tokens, on with
+  // varlen=1.
+  bool _varlen = false;
 
  public:
-  BertCrf(const std::string weight_path, const int max_batch_size);
+  BertCrf(const std::string weight_path, const int max_batch_size,
+          const ModelOptions& options);
   ~BertCrf();
 
   void before_forward(int batch_size, int seq_len);
@@ -45,6 +54,11 @@ class BertCrf : public LSModel {
   DataType get_input_dtype(int index) override;
   DataType get_output_dtype(int index) override;
   void benchmark_mode(bool is_benchmark) override {}
+  std::vector<WarmupTiming> warmup(
+      const std::vector<std::vector<int>>& shapes) override {
+    return warmup_infer(this, inp_tokens->value(true), shapes,
+                        {tw_._padding_id});
+  }
 };
 
 LSMODEL_REGISTER(BertCrf);
@@ -0,0 +1,75 @@
+#pragma once
+#include "model_base.h"
+#include "model_util.h"
+
+#include "bert_weight.h"
+
+#include "launch_enc_emb_layer.h"
+#include "transformer_encoder_layer.h"
+#include "lyr_normalize_layer.h"
+#include "varlen_layer.h"
+#include "task_head_layer.h"
+
+namespace lightseq {
+namespace cuda {
+
+/*
+  Class: BertMultiHead
+  Description:
+    The task heads of the weight file, see BertWeight::_task_heads, on one
+    run of a shared Bert encoder, so that the token classification, the
+    sequence classification, the crf tagging and the sentence embeddings of
+    the same input cost a single encoder forward. Output i, head_i, is the
+    result of task head i, see TaskHeadType: the [batch_size, seq_len,
+    num_labels] or [batch_size, num_labels] logits of the classifiers, the
+    int32 [batch_size, seq_len] tags of the crf or the [batch_size,
+    hidden_size] embeddings of the pooling. The encoder skips the padding
+    tokens with varlen=1, the heads see the padded output.
+*/
+template <typename OpType_>
+class BertMultiHead : public LSModel {
+ private:
+  BertWeight<OpType_> tw_;
+  std::shared_ptr<Context> _context_ptr;
+
+  LaunchEncEmbLayerPtr<OpType_> launch_enc_emb_layer;
+  std::vector<TransformerEncoderLayerPtr<OpType_, OpType_> > enc_layer_vec;
+  LyrNormalizeLayerPtr<OpType_, OpType_> lyr_norm_layer;
+  // varlen only, see RemovePaddingLayer.
+  RemovePaddingLayerPtr<OpType_, OpType_> _remove_padding_layer;
+  RebuildPaddingLayerPtr<OpType_, OpType_> _rebuild_padding_layer;
+  std::vector<TaskHeadLayerPtr<OpType_, OpType_> > _head_layers;
+
+  Variable* inp_tokens;  // need to allocate
+  std::vector<Variable*> _head_outs;
+
+  int _max_batch_size;
+  bool _varlen = false;
+
+ public:
+  BertMultiHead(const std::string weight_path, const int max_batch_size,
+                const ModelOptions& options);
+  ~BertMultiHead();
+
+  void before_forward(int batch_size, int seq_len);
+
+  void Infer() override;
+  void set_input_ptr(int index, void* input_ptr) override;
+  void set_output_ptr(int index, void* output_ptr) override;
+  const void* get_output_ptr(int index) override;
+  std::vector<int> get_input_max_shape(int index) override;
+  std::vector<int> get_output_max_shape(int index) override;
+  DataType get_input_dtype(int index) override;
+  DataType get_output_dtype(int index) override;
+  void benchmark_mode(bool is_benchmark) override {}
+  std::vector<WarmupTiming> warmup(
+      const std::vector<std::vector<int>>& shapes) override {
+    return warmup_infer(this, inp_tokens->value(true), shapes,
+                        {tw_._padding_id});
+  }
+};
+
+LSMODEL_REGISTER(BertMultiHead);
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -0,0 +1,125 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "model_base.h"
+
+namespace lightseq {
+namespace cuda {
+
+/*
+  Class: DedupModel
+  Description:
+    In-batch collapsing of duplicate rows around the model it owns, of the
+    same inputs and outputs: Infer copies the inputs to the host and hashes
+    every row of the batch, the bytes of dim 0 row of every input, then runs
+    the model on the unique rows only, gathered in buffers of its own, and
+    scatters every output row back to all the rows it stands for, eg. the
+    beams and the scores of beam search. So a batch of the same popular
+    prompts costs one row. A batch without duplicates runs as is, on the
+    pointers of the caller.
+
+    Every output has the batch as dim 0. The outputs of the Infer of unique
+    rows are written into the buffers of the model, of the max shapes, so
+    get_output_ptr is unchanged. Sampled duplicate rows get the same sample.
+    The rows of a batch only collapse as long as they share their settings,
+    so per row generation configs or LoRA adapters, and set_next_input,
+    turn it off for the following Infer calls. The token callback gets the
+    tokens of every row of the batch, cancel_row finishes a unique row once
+    all of its duplicates are cancelled.
+
+    Created by LSModelFactory::CreateModel with the dedup_rows option 1.
+*/
+class DedupModel : public LSModel {
+ private:
+  std::unique_ptr<LSModel> _model;
+  std::vector<void*> _input_ptrs;
+  // [max_batch_size, ...] inputs and outputs of the unique rows, allocated
+  // at the first batch with duplicates.
+  std::vector<void*> _unique_inputs;
+  std::vector<void*> _unique_outputs;
+  // the host copy of the inputs, hashed by row.
+  std::vector<std::vector<char>> _host_inputs;
+  bool _per_row_settings = false;
+  bool _pipelined = false;
+
+  // the unique row of every row of the running Infer, see cancel_row.
+  std::mutex _row_mutex;
+  std::vector<int> _unique_of_row;
+  std::vector<int> _uncancelled;
+  std::vector<bool> _cancelled;
+
+  std::function<void(int, const std::vector<int>&)> _token_callback;
+
+  // the unique row of every row of the batch, empty if there are none.
+  std::vector<int> find_duplicates(int batch_size, int* num_unique);
+  void infer_unique(int batch_size, int num_unique);
+
+ public:
+  explicit DedupModel(LSModel* model);
+  ~DedupModel();
+
+  LSModel* model() { return _model.get(); }
+
+  void Infer() override;
+  void set_input_ptr(int index, void* input_ptr) override;
+  void set_output_ptr(int index, void* output_ptr) override;
+  const void* get_output_ptr(int index) override;
+  std::vector<int> get_input_max_shape(int index) override;
+  std::vector<int> get_output_max_shape(int index) override;
+  DataType get_input_dtype(int index) override;
+  DataType get_output_dtype(int index) override;
+  void benchmark_mode(bool is_benchmark) override;
+
+  std::vector<WarmupTiming> warmup(
+      const std::vector<std::vector<int>>& shapes) override;
+  void update_weights(const std::string& weight_path) override;
+  MemoryProfile memory_profile() override;
+  void dynamic_memory_plan(bool enable) override;
+  void cuda_graph_mode(bool enable) override;
+  void suspend() override;
+  void resume() override;
+  bool evict_weights() override;
+  bool restore_weights() override;
+  size_t weight_bytes() override;
+  void set_next_input(int index, void* input_ptr,
+                      std::vector<int> shape) override;
+  void multi_stream(int num_streams) override;
+  void profiling(bool enable) override;
+  void export_profile(const std::string& trace_path) override;
+  std::string metrics_text() override;
+  void layer_time_sampling(int interval) override;
+
+  int add_request(const std::vector<int>& prompt, int max_new_tokens,
+                  int priority = 0, int deadline_ms = 0,
+                  int session_id = -1) override;
+  void drop_session(int session_id) override;
+  std::vector<std::pair<int, std::vector<int>>> step() override;
+  bool has_pending_requests() override;
+  std::vector<std::pair<int, int>> last_step_tokens() override;
+  void cancel_request(int request_id) override;
+  void evict_expired_requests(bool enable) override;
+  std::vector<int> last_step_evicted() override;
+
+  void cancel_row(int row) override;
+  void set_token_callback(
+      std::function<void(int, const std::vector<int>&)> callback) override;
+  void set_sampling_params(float temperature, float repetition_penalty,
+                           float min_p) override;
+  void set_generation_configs(
+      const std::vector<GenerationConfig>& configs) override;
+  void set_logits_processor(const LogitsProcessConfig& config) override;
+  void set_token_automaton(const TokenAutomaton& automaton) override;
+  void set_draft_model(LSModel* draft_model, int num_draft_tokens) override;
+  void load_lora_adapter(const std::string& name,
+                         const std::string& path) override;
+  void set_lora_adapters(const std::vector<std::string>& names) override;
+  void score_packed(const int* tokens, const int* offsets, int num_seqs,
+                    float* ppl, float* token_log_probs) override;
+};
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -7,10 +7,12 @@
 #include "gpt_layer.h"
 #include "lyr_normalize_layer.h"
 #include "linear_layer.h"
+#include "adaptive_softmax_layer.h"
 #include "generator_layer.h"
 
 namespace lightseq {
 namespace cuda {
+template <typename OpType_>
 class Gpt : public LSModel {
  private:
   GptWeight<OpType_> tw_;
@@ -20,6 +22,8 @@ class Gpt : public LSModel {
   std::vector<GptLayerPtr<OpType_, OpType_> > _gpt_layers_vec;
   LyrNormalizeLayerPtr<OpType_, OpType_> _lyr_norm_layer;
   LinearLayerPtr<OpType_, OpType_> _linear_layer;
+  // instead of _linear_layer with an adaptive softmax head, see GptWeight.
+  AdaptiveSoftmaxLayerPtr<OpType_, OpType_> _adaptive_softmax_layer;
   GeneratorLayerPtr<OpType_> _generator_layer;
 
   ContextPtr context_ptr;
@@ -31,6 +35,14 @@ class Gpt : public LSModel {
 
   Variable* _total_caches_k;
   Variable* _total_caches_v;
+#ifdef LIGHTSEQ_cuda
+  // the memory of the caches with kv_virtual_memory, see
+  // commit_caches.
+  std::unique_ptr<VirtualBuffer> _caches_k_vm;
+  std::unique_ptr<VirtualBuffer> _caches_v_vm;
+  int _committed_rows = 0;
+  int _committed_len = 0;
+#endif
 
   int* _gpt_out_ptr = nullptr;
   int* _input_ptr = nullptr;
@@ -38,9 +50,52 @@ class Gpt : public LSModel {
 
   int _max_batch_size;
   GenerateMethod _generate_method;
+  bool _dynamic_memory_plan = false;
+  // streaming output of Infer, see set_token_callback.
+  TokenStreamer _token_streamer;
+  // see cancel_row.
+  RowCancellation _row_cancellation;
+  // the generation settings which may reorder the tokens of the logits, all
+  // the clusters of an adaptive softmax are evaluated once one is set.
+  bool _reorders_logits = false;
+
+  // rows of the vocab projection of score_packed at once, its buffers are
+  // allocated by the first call.
+  static const int kScoreChunkRows = 1024;
+  int* _score_row_src = nullptr;
+  int* _score_target_id = nullptr;
+  float* _score_log_prob = nullptr;
+  OpType_* _score_hidden = nullptr;
+  OpType_* _score_logits = nullptr;
+  // of score_tree, [beam_size, max_step] positions and [beam_size, max_step,
+  // max_step] tree masks at most.
+  int* _score_positions = nullptr;
+  unsigned char* _score_tree_mask = nullptr;
+
+#ifdef LIGHTSEQ_cuda
+  void malloc_score_buffers();
+  // Put the log prob of target_id[i] given the last hidden state of the
+  // batch token row_src[i], of the forward run, into log_prob[i].
+  void score_rows(const std::vector<int>& row_src,
+                  const std::vector<int>& target_id,
+                  std::vector<float>* log_prob);
+#endif
+
+  // Make the memory plan of the input bucket active, record it first if the
+  // bucket is seen for the first time.
+  void switch_memory_plan(int batch_size, int prompt_len);
+
+  // Back the first kv_len tokens of the caches of the batch_size rows with
+  // physical memory, see VirtualBuffer.
+  void commit_caches(int batch_size, int kv_len);
+
+  // The tokens of every row kept by the generator, which bound the clusters
+  // of the adaptive softmax to evaluate, 0 for all of them.
+  void update_adaptive_topk();
 
  public:
-  Gpt(const std::string weight_path, const int max_batch_size);
+  Gpt(const std::string weight_path, const int max_batch_size,
+      const ModelOptions& options);
   ~Gpt();
 
   void before_forward(int batch_size, int prompt_len, int steps);
@@ -54,6 +109,54 @@ class Gpt : public LSModel {
   DataType get_input_dtype(int index) override;
   DataType get_output_dtype(int index) override;
   void benchmark_mode(bool is_benchmark) override {}
+  std::vector<WarmupTiming> warmup(
+      const std::vector<std::vector<int>>& shapes) override {
+    return warmup_infer(this, _input_ptr, shapes,
+                        {tw_._padding_id, tw_._eos_id});
+  }
+  void dynamic_memory_plan(bool enable) override {
+    _dynamic_memory_plan = enable;
+  }
+  void multi_stream(int num_streams) override {
+    _context_ptr->enable_multi_stream(num_streams);
+  }
+  void profiling(bool enable) override {
+    _context_ptr->enable_profiling(enable);
+  }
+  void export_profile(const std::string& trace_path) override;
+  void set_token_callback(
+      std::function<void(int, const std::vector<int>&)> callback) override;
+  void cancel_row(int row) override { _row_cancellation.cancel(row); }
+  std::string metrics_text() override;
+  void set_generation_configs(
+      const std::vector<GenerationConfig>& configs) override {
+    _generator_layer->set_generation_configs(configs);
+    _reorders_logits = _reorders_logits || !configs.empty();
+    update_adaptive_topk();
+  }
+  void set_logits_processor(const LogitsProcessConfig& config) override {
+    _generator_layer->set_logits_processor(config);
+    _reorders_logits = true;
+    update_adaptive_topk();
+  }
+  void set_token_automaton(const TokenAutomaton& automaton) override {
+    _generator_layer->set_token_automaton(automaton);
+    _reorders_logits = true;
+    update_adaptive_topk();
+  }
+  void set_sampling_params(float temperature, float repetition_penalty,
+                           float min_p) override {
+    _generator_layer->set_sampling_params(temperature, repetition_penalty,
+                                          min_p);
+    _reorders_logits = _reorders_logits || repetition_penalty != 1.f;
+    update_adaptive_topk();
+  }
+  void score_packed(const int* tokens, const int* offsets, int num_seqs,
+                    float* ppl, float* token_log_probs) override;
+  void score_tree(const int* prefix, int prefix_len, const int* tree_tokens,
+                  const int* tree_parents, int tree_len,
+                  float* log_likelihood) override;
+  void layer_time_sampling(int interval) override;
 };
 
 LSMODEL_REGISTER(Gpt);
@@ -0,0 +1,126 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "model_base.h"
+
+#ifdef LIGHTSEQ_cuda
+#include <cuda_runtime.h>
+#endif
+
+namespace lightseq {
+namespace cuda {
+
+/*
+  Class: InferPipeline
+  Description:
+    Text in, text out front and back stages around LSModel::Infer, so that
+    the host work of a batch overlaps the inference of the others:
+        1. submit() tokenizes the texts of a batch on a pool of worker
+    threads, the last worker done packs the tokens into a pinned buffer and
+    copies them to the device on a copy stream.
+        2. infer_next() waits for the oldest batch to be on the device, runs
+    Infer, copies the token ids of output 0 back into a pinned buffer and
+    returns at once, with a future of the texts detokenized on the workers.
+
+    So the tokenization of batch N + 1 and the detokenization of batch N - 1
+    both run while batch N is inferred. Up to depth batches are submitted
+    ahead of infer_next, each one owns a slot of pinned and device buffers
+    sized by the max shapes of the model. The tokenizer, eg. SentencePiece or
+    a BPE, is the caller's, both callbacks must be thread safe.
+
+    Prompts are cut to the max input length and padded with pad_id, on the
+    left for the models which count the leading pads such as Llama, on the
+    right otherwise. The detokenizer gets the tokens of the first beam of a
+    row of output 0, without pad_id. submit and infer_next are called from
+    one thread, the pipeline sets the input and output pointers of the model.
+*/
+class InferPipeline {
+ public:
+  using Tokenizer = std::function<std::vector<int>(const std::string&)>;
+  using Detokenizer = std::function<std::string(const std::vector<int>&)>;
+
+ private:
+  struct Slot {
+    // pinned, [max_batch_size, max_seq_len] tokens of the prompts and
+    // output 0 of the model.
+    int* host_input = nullptr;
+    int* host_output = nullptr;
+    void* device_input = nullptr;
+    // every output of the model, only output 0 is copied back.
+    std::vector<void*> device_outputs;
+    // the detokenization of the last batch of the slot.
+    std::shared_future<void> output_done;
+#ifdef LIGHTSEQ_cuda
+    cudaEvent_t input_copied;
+    cudaEvent_t output_copied;
+#endif
+  };
+
+  struct Batch {
+    int slot;
+    std::vector<std::string> texts;
+    std::vector<std::vector<int>> tokens;
+    std::atomic<int> num_left;
+    int seq_len = 0;
+    std::promise<void> input_ready;
+  };
+
+  LSModel* _model;
+  Tokenizer _tokenizer;
+  Detokenizer _detokenizer;
+  int _pad_id;
+  bool _pad_left;
+  int _max_batch_size;
+  int _max_seq_len;
+  size_t _max_output_size;
+#ifdef LIGHTSEQ_cuda
+  int _device;
+  cudaStream_t _copy_stream;
+#endif
+
+  std::vector<Slot> _slots;
+  // submitted batches not inferred yet, the oldest first.
+  std::deque<std::shared_ptr<Batch>> _pending;
+  int _next_slot = 0;
+
+  // the worker pool.
+  std::vector<std::thread> _workers;
+  std::queue<std::function<void()>> _tasks;
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  bool _stop = false;
+
+  void run_worker();
+  void post(std::function<void()> task);
+  // packs the tokens of batch and copies them to the device.
+  void stage_input(Batch* batch);
+
+ public:
+  // num_workers <= 0 takes every cpu of the host.
+  InferPipeline(LSModel* model, Tokenizer tokenizer, Detokenizer detokenizer,
+                int pad_id, bool pad_left = false, int num_workers = 0,
+                int depth = 2);
+  ~InferPipeline();
+
+  // Tokenize and upload a batch of at most the max batch size of the model
+  // in the background. Throws if depth batches are already pending.
+  void submit(std::vector<std::string> texts);
+
+  // Infer the oldest submitted batch. Rethrows an exception of its
+  // tokenizer.
+  std::future<std::vector<std::string>> infer_next();
+
+  int num_pending() const { return _pending.size(); }
+};
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -9,14 +9,56 @@
 #include "linear_layer.h"
 #include "rms_norm_layer.h"
 #include "generator_layer.h"
+#include "peer_copy_layer.h"
+#ifdef LIGHTSEQ_cuda
+#include "lora_adapter_cache.h"
+#endif
 
 namespace lightseq {
 namespace cuda {
+template <typename OpType_>
 class Llama : public LSModel {
  private:
+  // most draft tokens verified by one forward of the target model.
+  static const int kMaxDraftTokens = 16;
+  // vocab columns of the int8 logits kernel dequantized at once for the
+  // batches too large for its gemv, see WeightOnlyLinearOp.
+  static const int kLogitsDequantCols = 16384;
+
+  // A pipeline stage runs the layers [layer_begin, layer_end) in its own
+  // context on its own device. Stage 0 is _context_ptr, which also runs the
+  // embedding and the head.
+  struct PipelineStage {
+    std::shared_ptr<Context> context;
+    int layer_begin = 0;
+    int layer_end = 0;
+    // [max_batch_tokens, hidden_size] hidden states received from the
+    // previous stage, stage 0 receives the output of the last stage, which
+    // is the input of the head.
+    Variable* recv = nullptr;
+    // padding mask copied from stage 0, nullptr for stage 0.
+    Variable* recv_pad_mask = nullptr;
+    PeerCopyLayerPtr<OpType_, OpType_> pad_mask_copy;
+    // input of the first layer and padding mask of the current micro-batch.
+    Variable* input = nullptr;
+    Variable* pad_mask = nullptr;
+    // kv caches of the layers of the stage.
+    Variable* caches_k = nullptr;
+    Variable* caches_v = nullptr;
+    // sends the output of the last layer to the next stage.
+    PeerCopyLayerPtr<OpType_, OpType_> send;
+  };
+
   LlamaWeight<OpType_> tw_;
   std::shared_ptr<Context> _context_ptr;
 
+  // pipeline parallelism, empty when disabled.
+  std::vector<PipelineStage> _stages;
+  int _num_micro_batches = 1;
+  // the cache window of every layer, moved to the rows of each micro-batch.
+  std::vector<Variable*> _caches_k;
+  std::vector<Variable*> _caches_v;
+
   LaunchLlamaEmbLayerPtr<OpType_> _launch_llama_emb_layer;
   std::vector<LlamaLayerPtr<OpType_, OpType_>> _llama_layer_vec;
   RMSNormLayerPtr<OpType_, OpType_> _rms_norm_layer;
@@ -31,16 +73,288 @@ class Llama : public LSModel {
 
   Variable* _total_caches_k;
   Variable* _total_caches_v;
+  // device copy of the cache position of the current decoding step, read by
+  // the kernels captured in CUDA graphs.
+  Variable* _step_offset;
+  // per layer elements of _total_caches_k/v.
+  size_t _cache_size;
+  // int8 kv cache, with one float scale per cached head vector in
+  // _total_caches_k/v_scale, nullptr for a cache of OpType_.
+  Variable* _total_caches_k_scale = nullptr;
+  Variable* _total_caches_v_scale = nullptr;
+
+  // paged kv cache, disabled when nullptr.
+  std::shared_ptr<KVPageTable> _kv_page_table;
+  Variable* _page_table;
+  // prompt pages reused by continuous batching requests, nullptr if
+  // disabled.
+  std::shared_ptr<KVPrefixCache> _prefix_cache;
+
+  // continuous batching, see add_request and step.
+  RequestSlots _request_slots;
+  // the (request id, token) committed by the last step.
+  std::vector<std::pair<int, int>> _step_tokens;
+  // cancellation, see cancel_request and cancel_row, and the requests
+  // evicted by the last step.
+  CancelQueue _cancelled_requests;
+  bool _evict_expired = false;
+  std::vector<int> _step_evicted;
+  RowCancellation _row_cancellation;
+  // per row generation configs, logits processors and token automatons
+  // apply to the rows of Infer, not to the slots of continuous batching.
+  bool _has_generation_configs = false;
+  bool _has_logits_processor = false;
+  bool _has_token_automaton = false;
+  // set_sampling_params changed a default, which speculative decoding does
+  // not apply.
+  bool _has_sampling_params = false;
+  // streaming output of Infer, see set_token_callback.
+  TokenStreamer _token_streamer;
+  // [max_step] cache position of every row of a step.
+  Variable* _seq_offsets;
+  // [max_step] rows of a step read by the head, see forward_rows.
+  Variable* _sample_rows;
+  // [max_batch_size * beam_size, max_step] the cache row holding every
+  // position of a beam, see BeamSearchTopOp::use_kv_rows, or of a sample
+  // sharing the prefill of its prompt, see fork_samples. nullptr when the
+  // attention can not read through it, the caches are then copied as the
+  // beams reorder.
+  Variable* _kv_rows = nullptr;
+  // samples of every prompt, see set_num_return_sequences.
+  int _num_return_sequences = 1;
+  // most prompt tokens prefilled by one step, 0 for no limit.
+  int _prefill_chunk_size = 0;
+  // rows of a dense cache holding the sinks and the attention window of
+  // attn_window, 0 for max_step rows. Longer prompts are prefilled
+  // in chunks of _prefill_chunk_size, see forward_prompt_chunks.
+  int _kv_ring_len = 0;
+  // [layer_num, max_batch_size, kv_head_num, sink tokens] the positions of
+  // the heavy hitters in the rows of the sinks, and [layer_num,
+  // max_batch_size, kv_head_num, _kv_ring_len] the attention mass of every
+  // row, see kv_heavy_hitters. nullptr without heavy hitters.
+  Variable* _kv_heavy_pos = nullptr;
+  Variable* _kv_mass = nullptr;
+  // elements of all layers of both.
+  size_t _kv_heavy_pos_size = 0;
+  size_t _kv_mass_size = 0;
+  // continuous batching runs on a memory plan of its own, whose activations
+  // only cover the tokens of a step, and the memory they leave in the
+  // buffers of the prompt phase holds extra kv pages, see
+  // enter_serving_phase. Disabled by kv_serving_plan=0.
+  bool _serving_plan = false;
+  bool _serving_phase = false;
+  // elements of one page of the cache of a layer.
+  size_t _page_cache_size = 0;
+  int _prompt_num_pages = 0;
+  int _serving_num_pages = 0;
+
+  // speculative decoding, see set_draft_model. The draft model is not owned.
+  Llama* _draft_model = nullptr;
+  int _num_draft_tokens = 0;
+  // [1] tokens kept by each verification of the target model.
+  int* _num_accepted = nullptr;
+  // as a draft model: [kMaxDraftTokens, vocab_size] logits of the tokens
+  // proposed by the last propose_draft_tokens, and the positions of row 0
+  // whose kv are in the cache.
+  OpType_* _draft_logits = nullptr;
+  int _draft_cached_len = 0;
+  unsigned long long _sample_seed = 0;
+  unsigned long long _sample_counter = 0;
+
+  // LoRA serving, see set_lora_adapters. The cache is created by the first
+  // load_lora_adapter, _lora_names holds the adapter of every batch row of
+  // Infer, empty to run the base model.
+#ifdef LIGHTSEQ_cuda
+  std::shared_ptr<LoraAdapterCache<OpType_>> _lora_cache;
+#endif
+  std::vector<std::string> _lora_names;
+  std::vector<int> _lora_batch_slots;
+  int _lora_slots = 4;
+  int _lora_max_rank = 64;
 
   int* _llama_out_ptr = nullptr;
   int* _input_ptr = nullptr;
   float* _llama_scores_ptr = nullptr;
 
+  // streaming of the offloaded layer weights, see
+  // LlamaWeight::set_offload_layers. Slot s holds the weights of its next
+  // layer once _slot_ready[s] is reached on _offload_stream, and can be
+  // refilled once _slot_free[s] is reached on the compute stream.
+  cudaStream_t _offload_stream = nullptr;
+  cudaEvent_t _slot_ready[2];
+  cudaEvent_t _slot_free[2];
+  // the weights restored by restore_weights are on the device once it is
+  // reached, created at the first restore.
+  cudaEvent_t _weights_restored = nullptr;
+
+  // kv of the finished requests of a session and of the preempted requests
+  // in pinned host memory, nullptr when disabled, see kv_host_mb.
+  // _kv_host_k/v are [num_layers, host_pages, page_vecs, head_dim] of
+  // OpType_, or of int8_t with [num_layers, host_pages, page_vecs] scales,
+  // copied on _kv_host_stream.
+  std::shared_ptr<KVHostCache> _kv_host_cache;
+  void* _kv_host_k = nullptr;
+  void* _kv_host_v = nullptr;
+  float* _kv_host_k_scale = nullptr;
+  float* _kv_host_v_scale = nullptr;
+  bool _kv_host_int8 = false;
+  cudaStream_t _kv_host_stream = nullptr;
+  // [max_slots * max_pages, 2] page pairs of a copy, see
+  // launch_copy_kv_pages.
+  Variable* _kv_host_pages = nullptr;
+  // kv pages being copied to host memory, released once _kv_saved is
+  // reached on _kv_host_stream.
+  std::vector<int> _kv_saving_pages;
+  cudaEvent_t _kv_saved;
+  // the restored pages of layer i are on the device once _kv_restored[i] is
+  // reached, the layer waits for it in the next forward.
+  std::vector<cudaEvent_t> _kv_restored;
+  bool _kv_restore_pending = false;
+
   int _max_batch_size;
   GenerateMethod _generate_method;
+  bool _dynamic_memory_plan = false;
+  bool _cuda_graph_mode = false;
+  // decoding steps of cuda graph mode captured into one graph, which the
+  // host launches and waits for once, graph_decode_steps.
+  int _graph_decode_steps = 1;
+
+  // Make the memory plan of the input bucket active, record it first if the
+  // bucket is seen for the first time.
+  void switch_memory_plan(int batch_size, int prompt_len);
+
+  // Make the context of the pipeline stage the one of scope, the scope of the
+  // constructor, and its device current, the context is created on first use.
+  void enter_stage(int stage, ContextScope* scope);
+
+  // the weights loaded by update_weights, run from the next Infer or step().
+  std::mutex _weight_update_mutex;
+  std::unique_ptr<LlamaWeight<OpType_>> _pending_weights;
+  // Point the layers to the weights of tw_.
+  void load_params();
+  // Switch to the pending weights if any, between two forwards.
+  void apply_weight_update();
+  // Build the layers of every pipeline stage and the copies between them,
+  // return the input of the head.
+  Variable* construct_pipeline(Variable* llama_emb, Variable* pad_mask,
+                               size_t cache_size, DataType cache_dtype,
+                               ContextScope* scope);
+  // Point the pipeline stages to the rows [row, row + rows) of the batch.
+  void before_forward_stages(int row, int rows, int seq_len, int offset);
+  // Run every layer over batch_size rows of seq_len tokens at cache position
+  // offset, as micro-batches flowing through the pipeline stages if any.
+  void forward_layers(int batch_size, int seq_len, int offset);
+  // Run the embedding and the layers over the prompt in chunks, which keeps
+  // the keys a chunk needs in the ring of an attention window. Returns the
+  // length of the last chunk, whose tokens the head reads.
+  int forward_prompt_chunks(int batch_size, int prompt_len);
+
+  // Run every layer once on the stream of _context_ptr, with their weights
+  // streamed from host memory when they are offloaded.
+  void forward_layer_vec();
+
+  // Run the network of one decoding step except the generator. The attention
+  // length is rounded up to a bucket so that a single graph serves many
+  // steps, positions past the current one are masked by the padding mask.
+  void graph_decode_step(int batch_size, int offset);
+  // Run num_steps whole decoding steps, the generator included, from a
+  // single graph, the step offset advanced between them on the device. The
+  // sampled token of the first step follows the token at offset. Returns
+  // false when the steps can not run from one graph.
+  bool graph_decode_steps(int batch_size, int offset, int num_steps);
+
+  // Point the cache of every layer to its part of a pool of num_pages.
+  void set_cache_pages(int num_pages);
+  // Record the serving plan with a pool of num_pages, with the activations
+  // of the largest step.
+  void record_serving_plan(int num_pages);
+  // Switch between the plan of Infer and the serving plan of step, whose
+  // pool holds more pages. The pages of the other phase are dropped, which
+  // requires that no request holds any.
+  void enter_serving_phase();
+  void leave_serving_phase();
+  // the context of every pipeline stage, or _context_ptr alone.
+  std::vector<Context*> stage_contexts();
+
+  // Make every sequence hold the kv pages of its first seq_len tokens and
+  // sync the page table to the device.
+  void reserve_kv_pages(int batch_size, int seq_len);
+
+  // Run one forward pass where every token is a sequence of its own, at
+  // cache position offsets[i] of the pages of slot row_slots[i], and sample
+  // the next token of the rows in sample_rows, which are increasing.
+  std::vector<int> forward_rows(const std::vector<int>& tokens,
+                                const std::vector<int>& offsets,
+                                const std::vector<int>& row_slots,
+                                const std::vector<int>& sample_rows);
+  // Run the tokens [offset, offset + query_len) of the single sequence in
+  // row 0 of _inp_tokens, and project its last num_logits (1 or query_len)
+  // tokens to the logits in the output of _linear_layer.
+  void before_forward_tokens(int offset, int query_len, int num_logits);
+  void forward_tokens(int offset, int query_len, int num_logits);
+
+  // As a draft model, follow the first seq_len tokens of tokens, a row of the
+  // target model on device, and write num_draft more tokens after them, with
+  // their logits left in _draft_logits.
+  void propose_draft_tokens(int* tokens, int seq_len, int num_draft,
+                            bool greedy);
+  // Continue the single sequence of row 0 of _inp_tokens, whose first
+  // seq_len tokens are valid and whose kv are cached except the last one,
+  // with the tokens proposed by _draft_model. Return the final length, which
+  // excludes the eos token like the generator does.
+  int speculative_decode(int prompt_len, int seq_len);
+
+  // Add the adapters of _lora_cache to the layers, or remove them.
+  void attach_lora(bool attach);
+  // Point the rows of batch_size * beam_size sequences of seq_len tokens
+  // to the adapter slots of their batch rows in _lora_batch_slots.
+  void set_lora_rows(int batch_size, int seq_len);
+
+  // After the prefill of num_prompts prompts, make num_samples rows of every
+  // one, row s * num_prompts + b for the sample s of prompt b: the tokens,
+  // the mask and the logits of the prompt are copied, its kv are read from
+  // the prefilled row through _kv_rows.
+  void fork_samples(int num_prompts, int num_samples, int prompt_len);
+
+  // Push the tokens sampled by the generator at the step to the streamer.
+  void stream_tokens(int batch_size, int prompt_len, int steps);
+
+  // Append the token sampled for the slot, and retire the request into
+  // finished if it is done.
+  void commit_token(int slot_idx, int token,
+                    std::vector<std::pair<int, std::vector<int>>>* finished);
+  // Move the request of the slot back to the waiting queue, see
+  // RequestSlots::preempt.
+  void preempt_request(int slot_idx);
+  // Remove the cancelled requests, and the expired ones if _evict_expired,
+  // from the waiting queue and their slots into _step_evicted.
+  void evict_requests();
+
+  // The key of the kv of the request in _kv_host_cache, its session or the
+  // request itself.
+  int host_kv_key(const GenerationRequest& request) const {
+    return request.session_id >= 0 ? request.session_id
+                                   : -1 - request.request_id;
+  }
+  // Copy the kv of the first len tokens of the slot to host memory, the
+  // pages are released by release_saved_kv once the copy is done.
+  void save_host_kv(int slot_idx, int len);
+  // Copy the kv of the page pairs through every layer on _kv_host_stream,
+  // from the cache to host memory if to_host, else back, recording
+  // _kv_restored of every layer.
+  void copy_host_kv(const std::vector<int>& pages, bool to_host);
+  // Release the pages saved to host memory, waiting for their copies if
+  // wait, else only once they are done.
+  void release_saved_kv(bool wait);
+  // Make the compute stream wait for the restored pages of the layer.
+  void wait_restored_kv(int layer_idx);
+
+  // Update the gauges of the metrics which follow the step, see Metrics.
+  void update_metric_gauges(int rows);
 
  public:
-  Llama(const std::string weight_path, const int max_batch_size);
+  Llama(const std::string weight_path, const int max_batch_size,
+        const ModelOptions& options);
   ~Llama();
 
   void before_forward(int batch_size, int prompt_len, int steps);
@@ -54,8 +368,85 @@ class Llama : public LSModel {
   DataType get_input_dtype(int index) override;
   DataType get_output_dtype(int index) override;
   void benchmark_mode(bool is_benchmark) override {}
+  std::vector<WarmupTiming> warmup(
+      const std::vector<std::vector<int>>& shapes) override {
+    return warmup_infer(this, _input_ptr, shapes,
+                        {tw_._padding_id, tw_._eos_id});
+  }
+  void dynamic_memory_plan(bool enable) override {
+    _dynamic_memory_plan = enable;
+  }
+  void multi_stream(int num_streams) override {
+    _context_ptr->enable_multi_stream(num_streams);
+  }
+  void profiling(bool enable) override {
+    _context_ptr->enable_profiling(enable);
+  }
+  void export_profile(const std::string& trace_path) override;
+  void cuda_graph_mode(bool enable) override;
+  void suspend() override;
+  void resume() override;
+  bool evict_weights() override;
+  bool restore_weights() override;
+  size_t weight_bytes() override { return tw_.device_wei_bytes(); }
+  MemoryProfile memory_profile() override;
+  void update_weights(const std::string& weight_path) override;
+  int add_request(const std::vector<int>& prompt, int max_new_tokens,
+                  int priority = 0, int deadline_ms = 0,
+                  int session_id = -1) override;
+  void drop_session(int session_id) override {
+    if (_kv_host_cache) _kv_host_cache->erase(session_id);
+  }
+  std::vector<std::pair<int, std::vector<int>>> step() override;
+  bool has_pending_requests() override { return !_request_slots.empty(); }
+  std::vector<std::pair<int, int>> last_step_tokens() override {
+    return _step_tokens;
+  }
+  void cancel_request(int request_id) override {
+    _cancelled_requests.push(request_id);
+  }
+  void evict_expired_requests(bool enable) override {
+    _evict_expired = enable;
+  }
+  std::vector<int> last_step_evicted() override { return _step_evicted; }
+  void cancel_row(int row) override { _row_cancellation.cancel(row); }
+  void set_num_return_sequences(int num) override;
+  void set_draft_model(LSModel* draft_model, int num_draft_tokens) override;
+  void set_token_callback(
+      std::function<void(int, const std::vector<int>&)> callback) override;
+  void load_lora_adapter(const std::string& name,
+                         const std::string& path) override;
+  void set_lora_adapters(const std::vector<std::string>& names) override;
+  std::string metrics_text() override;
+  void set_generation_configs(
+      const std::vector<GenerationConfig>& configs) override {
+    _generator_layer->set_generation_configs(configs);
+    _has_generation_configs = !configs.empty();
+  }
+  void set_logits_processor(const LogitsProcessConfig& config) override {
+    _generator_layer->set_logits_processor(config);
+    _has_logits_processor =
+        config.repetition_penalty != 1.f || config.presence_penalty != 0.f ||
+        config.frequency_penalty != 0.f || config.no_repeat_ngram_size > 0 ||
+        !config.bad_words.empty();
+  }
+  void set_token_automaton(const TokenAutomaton& automaton) override {
+    _generator_layer->set_token_automaton(automaton);
+    _has_token_automaton = automaton.num_states > 0;
+  }
+  void set_sampling_params(float temperature, float repetition_penalty,
+                           float min_p) override {
+    _generator_layer->set_sampling_params(temperature, repetition_penalty,
+                                          min_p);
+    _has_sampling_params =
+        temperature != 1.f || repetition_penalty != 1.f || min_p != 0.f;
+  }
+  void layer_time_sampling(int interval) override;
 };
 
 LSMODEL_REGISTER(Llama);
+#ifdef LIGHTSEQ_cuda
+LSMODEL_REGISTER_PRECISION(Llama, __nv_bfloat16, kBFloat16);
+#endif
 }  // namespace cuda
 }  // namespace lightseq
@@ -0,0 +1,110 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "linear.h"
+
+namespace lightseq {
+namespace cuda {
+
+/*
+  Class: LoraAdapterCache
+  Description:
+    Low rank adapters served on top of a shared base model, in the style of
+    S-LoRA: every adapter loaded by load() stays in host memory, and the
+    ones used by a batch are copied into one of num_slots device slots,
+    evicting the least recently used slot when they are all taken. Adapters
+    of any rank up to max_rank are zero padded to max_rank, so that a batch
+    mixing several adapters runs a single shrink and expand per linear, see
+    launch_lora_shrink.
+
+    Every layer has adapters on kNumTargets linears, the attention output
+    and the down projection, target(layer, t) is the LoraTarget of a
+    LinearOp. The input sizes are those of this tensor parallel rank, the
+    output sizes are the hidden size.
+*/
+template <typename T>
+class LoraAdapterCache {
+ public:
+  static const int kNumTargets = 2;
+
+  LoraAdapterCache(int num_layers, int hidden_size, int attn_out_in_size,
+                   int down_in_size, int max_batch_tokens, int tp_rank,
+                   int tp_size, int num_slots, int max_rank,
+                   cudaStream_t stream);
+  ~LoraAdapterCache();
+
+  // Read the adapter name from the hdf5 file path, replacing the host copy
+  // of an adapter of the same name. For target t of layer l, the file holds
+  // decoder_layers/l/<target>_lora_a of [rank, in] and
+  // decoder_layers/l/<target>_lora_b of [out, rank], with <target>
+  // attention_output and down_project_weight, and lora_conf/alpha. The
+  // adapter output is scaled by alpha / rank.
+  void load(const std::string& name, const std::string& path);
+  bool contains(const std::string& name) const {
+    return _adapters.count(name) > 0;
+  }
+
+  // Make the adapters of names resident and return the slot of each name,
+  // -1 for an empty name, which runs the base model.
+  std::vector<int> acquire(const std::vector<std::string>& names);
+  // Copy the slot of every row to the device, rows past the end of
+  // row_slots run the base model.
+  void set_row_slots(const std::vector<int>& row_slots);
+
+  const LoraTarget<T>* target(int layer, int t) const {
+    return &_targets[layer * kNumTargets + t];
+  }
+  int num_slots() const { return _num_slots; }
+
+ private:
+  struct Adapter {
+    int rank = 0;
+    float scale = 1.f;
+    // [num_layers * kNumTargets] A of [rank, in] and B of [rank, out].
+    std::vector<std::vector<float>> a;
+    std::vector<std::vector<float>> b;
+  };
+
+  int _num_layers;
+  int _max_batch_tokens;
+  int _tp_rank;
+  int _tp_size;
+  int _num_slots;
+  int _max_rank;
+  cudaStream_t _stream;
+  // [kNumTargets] input and output size of every target.
+  std::vector<int> _in_sizes;
+  std::vector<int> _out_sizes;
+
+  std::map<std::string, Adapter> _adapters;
+  // name held by every slot, empty if none, and the acquire call which used
+  // it last.
+  std::vector<std::string> _slot_names;
+  std::vector<uint64_t> _slot_last_use;
+  uint64_t _use_counter = 0;
+
+  // [num_slots] zero padded A and B of every layer and target.
+  T* _slot_weights = nullptr;
+  size_t _slot_size = 0;
+  // [num_layers * kNumTargets, 2, num_slots] pointers to the A and B of
+  // every slot.
+  T** _d_ptrs = nullptr;
+  float* _d_scales = nullptr;
+  int* _d_row_slots = nullptr;
+  std::vector<int> _row_slots;
+  float* _workspace = nullptr;
+  // fp32 staging of the host copies, see convert_dtype_by_gpu.
+  float* _d_staging = nullptr;
+  std::vector<LoraTarget<T>> _targets;
+
+  // offset of the A and of the B of target t of layer in a slot.
+  size_t a_offset(int layer, int t) const;
+  size_t b_offset(int layer, int t) const;
+  void upload(int slot, const Adapter& adapter);
+};
+
+}  // namespace cuda
+}  // namespace lightseq
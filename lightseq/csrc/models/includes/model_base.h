@@ -1,9 +1,18 @@
 #ifndef MODEL_BASE_H
 #define MODEL_BASE_H
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace lightseq {
@@ -22,7 +31,133 @@ enum DataType {
   kUInt16 = 9,
   kUInt32 = 10,
   kUInt64 = 11,
-  kFloat64 = 12
+  kFloat64 = 12,
+  kBFloat16 = 13
+};
+
+// The generation parameters and stop conditions of a row of the batch, see
+// LSModel::set_generation_configs.
+struct GenerationConfig {
+  int topk = 0;  // 0 for no topk
+  float topp = 1.f;
+  float temperature = 1.f;
+  float repetition_penalty = 1.f;
+  float min_p = 0.f;
+  int max_new_tokens = 0;  // 0 for no limit
+  // eos ends the row too
+  std::vector<int> stop_tokens;
+};
+
+// The logits processors of every row, see LSModel::set_logits_processor.
+struct LogitsProcessConfig {
+  // the logits of the tokens already in the sequence are divided (positive)
+  // or multiplied (negative) by repetition_penalty
+  float repetition_penalty = 1.f;
+  // subtracted once from the logits of generated tokens
+  float presence_penalty = 0.f;
+  // subtracted from the logits of generated tokens, per time generated
+  float frequency_penalty = 0.f;
+  // no ngram of this size is generated twice, 0 for none
+  int no_repeat_ngram_size = 0;
+  // token sequences which are never generated
+  std::vector<std::vector<int>> bad_words;
+};
+
+// A token level automaton of constrained decoding, eg. a compiled json
+// grammar, see LSModel::set_token_automaton. Generation starts in state 0.
+struct TokenAutomaton {
+  int num_states = 0;
+  // [num_states, (vocab_size + 31) / 32], bit t % 32 of word t / 32 of a
+  // state is set if token t is allowed in it
+  std::vector<unsigned int> allowed;
+  // [num_states + 1], the transitions of state s are the range
+  // [transition_offsets[s], transition_offsets[s + 1]) of transition_tokens,
+  // sorted, and next_states. An allowed token without a transition keeps
+  // the state.
+  std::vector<int> transition_offsets = {0};
+  std::vector<int> transition_tokens;
+  std::vector<int> next_states;
+};
+
+// The device memory of a model by what it grows with, see
+// LSModel::memory_profile. The activations of the memory plan take about
+// activation_bytes + max_batch_size * activation_row_bytes, the kv cache
+// kv_token_bytes a token.
+struct MemoryProfile {
+  // the weights
+  size_t fixed_bytes = 0;
+  // without the kv cache
+  size_t activation_bytes = 0;
+  size_t activation_row_bytes = 0;
+  // k and v of every layer
+  size_t kv_token_bytes = 0;
+  // the tokens of a sequence in the dense cache, the max step or the ring of
+  // an attention window
+  int kv_row_tokens = 0;
+  // tokens of a page of the paged kv cache, 0 for the dense cache
+  int kv_page_size = 0;
+  int beam_size = 1;
+  int max_step = 0;
+};
+
+// A model config which fits a budget of device memory, see
+// plan_memory_config.
+struct MemoryConfig {
+  // 0 if not even one row fits
+  int max_batch_size = 0;
+  // kv_num_pages of the paged kv cache, 0 for the dense cache
+  int kv_num_pages = 0;
+  size_t planned_bytes = 0;
+};
+
+// The largest max_batch_size of the profile whose weights, activations and
+// kv cache fit budget_bytes, the larger batch the higher the throughput of
+// decoding. A row of the dense cache reserves kv_row_tokens, one of the
+// paged cache the pages of max_row_tokens, max_step if 0, and the memory
+// left is given to more pages. The budget should leave room for the cuda
+// context and the workspaces of the libraries.
+inline MemoryConfig plan_memory_config(const MemoryProfile& profile,
+                                       size_t budget_bytes,
+                                       int max_row_tokens = 0) {
+  MemoryConfig config;
+  size_t page_bytes = size_t(profile.kv_page_size) * profile.kv_token_bytes;
+  size_t row_kv_bytes = size_t(profile.kv_row_tokens) * profile.beam_size *
+                        profile.kv_token_bytes;
+  int row_pages = 0;
+  if (profile.kv_page_size > 0) {
+    int row_tokens = max_row_tokens > 0
+                         ? std::min(max_row_tokens, profile.max_step)
+                         : profile.max_step;
+    row_pages = (row_tokens + profile.kv_page_size - 1) / profile.kv_page_size;
+    row_kv_bytes = row_pages * page_bytes;
+  }
+  size_t base_bytes = profile.fixed_bytes + profile.activation_bytes;
+  size_t row_bytes = profile.activation_row_bytes + row_kv_bytes;
+  if (row_bytes == 0 || budget_bytes < base_bytes + row_bytes) {
+    return config;
+  }
+  config.max_batch_size = (budget_bytes - base_bytes) / row_bytes;
+  config.planned_bytes = base_bytes + config.max_batch_size * row_bytes;
+  if (page_bytes > 0) {
+    size_t kv_bytes = budget_bytes - base_bytes -
+                      config.max_batch_size * profile.activation_row_bytes;
+    config.kv_num_pages = kv_bytes / page_bytes;
+    config.planned_bytes += (config.kv_num_pages -
+                             size_t(config.max_batch_size) * row_pages) *
+                            page_bytes;
+  }
+  return config;
+}
+
+// The Infer times of a shape of LSModel::warmup.
+struct WarmupTiming {
+  // [batch_size, seq_len] of input 0
+  std::vector<int> shape;
+  // the first Infer of the shape, which pays for the cublas heuristics, the
+  // lazy loading of the kernels, the growth of the allocator, the plan of
+  // the bucket and the capture of the cuda graphs, and a second one
+  float first_ms = 0.f;
+  float second_ms = 0.f;
 };
 
 // Bellow is an usage example for lightseq cpp API
@@ -89,6 +224,243 @@ class LSModel {
 
   virtual void benchmark_mode(bool is_benchmark) = 0;
 
+  // Warmup at load: Infer runs twice on every [batch_size, seq_len] shape of
+  // input 0, on tokens of its own, so that the first requests of these
+  // shapes find the gemm heuristics picked, the kernels loaded, the memory
+  // plans of dynamic_memory_plan recorded and the cuda graphs of
+  // cuda_graph_mode captured. Call it after those settings, with the output
+  // pointers set, input 0 is restored afterwards. Empty for the models which
+  // do not support it.
+  virtual std::vector<WarmupTiming> warmup(
+      const std::vector<std::vector<int>>& shapes) {
+    return {};
+  }
+
+  // Hot weight update: loads the weights of weight_path, of the same config,
+  // from the calling thread into device memory of their own while the model
+  // keeps serving from any other thread, then the next Infer or step() runs
+  // them on the graph and the memory plan already built, and frees the old
+  // ones. The weights of both are on the device until then. Throws
+  // std::runtime_error if the weights do not fit the model. Not supported
+  // by every model.
+  virtual void update_weights(const std::string& weight_path) {
+    throw std::runtime_error("weight updates are not supported");
+  }
+
+  // The device memory of the model by what it grows with, from its memory
+  // plan at one row and at max_batch_size rows, so a probe model of a
+  // max_batch_size of 2 gives the config of any budget, see
+  // LSModelFactory::PlanMemory. With a max_batch_size of 1 all of the
+  // activations count per row. All zeros for the models which do not support
+  // it.
+  virtual MemoryProfile memory_profile() { return MemoryProfile(); }
+
+  // Plan the shared activation memory per (batch_size, seq_len) bucket of the
+  // input instead of with the max input shape. Ignored by the models which do
+  // not support it.
+  virtual void dynamic_memory_plan(bool enable) {}
+
+  // Replay the decoding steps from captured CUDA graphs instead of launching
+  // every kernel from the host. Ignored by the models which do not support it.
+  // Llama runs graph_decode_steps steps, sampling included, per
+  // graph launch, checking the stop once after them.
+  virtual void cuda_graph_mode(bool enable) {}
+
+  // Idle memory release for gpus shared by several models or processes:
+  // suspend gives the activation buffers and the kv caches back to the
+  // device and keeps the weights and the built graph, resume allocates them
+  // again, as does the next Infer or step() of a suspended model. The cached
+  // prompts are dropped. Throws std::runtime_error while requests are
+  // pending. Ignored by the models which do not support it.
+  virtual void suspend() {}
+  virtual void resume() {}
+
+  // Whole model residency, see ModelManager: evict_weights suspends the
+  // model and moves its weights to pinned host memory, which frees all of
+  // its device memory but the small fixed buffers. restore_weights copies
+  // them back without waiting for the copy on the host, the next Infer or
+  // step() waits for it on the device, and restores them itself if need
+  // be. Both return false, and do nothing, for the models which do not
+  // support it. weight_bytes is the device memory of the resident weights.
+  virtual bool evict_weights() { return false; }
+  virtual bool restore_weights() { return false; }
+  virtual size_t weight_bytes() { return 0; }
+
+  // Encoder/decoder pipelining: input index of the Infer after the next one
+  // is input_ptr, of shape. The next Infer encodes it on a stream of its own
+  // while decoding, the Infer which then gets this very input skips its
+  // encoder. The input is read asynchronously, so it stays unchanged until
+  // that Infer. Ignored by the models which do not support it.
+  virtual void set_next_input(int index, void* input_ptr,
+                              std::vector<int> shape) {}
+
+  // Run the independent operators inside each layer on num_streams streams.
+  // Ignored by the models which do not support it.
+  virtual void multi_stream(int num_streams) {}
+
+  // Time every operator of the following Infer calls. export_profile prints
+  // the per-op and per-layer summary and writes a Chrome trace to trace_path.
+  // Ignored by the models which do not support it.
+  virtual void profiling(bool enable) {}
+  virtual void export_profile(const std::string& trace_path) {}
+
+  // Always-on runtime metrics: requests, tokens, steps, batch occupancy, kv
+  // cache utilization, memory plan size and the sampled per layer gpu time,
+  // in the Prometheus text exposition format. layer_time_sampling times the
+  // layers of one forward out of every interval, 0 turns it off. Empty for
+  // the models which do not support it.
+  virtual std::string metrics_text() { return ""; }
+  virtual void layer_time_sampling(int interval) {}
+
+  // Continuous batching: requests join the running batch at any decoding
+  // step and leave it as soon as they finish. add_request queues a prompt and
+  // returns its id, each step() runs one iteration of the running batch and
+  // returns the (id, prompt + generated tokens) of the requests which
+  // finished in it. Requests of a higher priority are admitted first and may
+  // preempt running ones of a lower priority, the deadline in ms orders the
+  // requests of a priority. The requests of a session_id >= 0 are the turns
+  // of one chat, whose next prompt repeats the tokens of the last one, the
+  // model may keep their kv until then. Not supported by every model.
+  virtual int add_request(const std::vector<int>& prompt, int max_new_tokens,
+                          int priority = 0, int deadline_ms = 0,
+                          int session_id = -1) {
+    throw std::runtime_error("continuous batching is not supported");
+  }
+  // Free the kv kept for the next request of the session.
+  virtual void drop_session(int session_id) {}
+  virtual std::vector<std::pair<int, std::vector<int>>> step() {
+    throw std::runtime_error("continuous batching is not supported");
+  }
+  virtual bool has_pending_requests() { return false; }
+  // The (id, token) of every request which got a token in the last step(),
+  // the finished ones included.
+  virtual std::vector<std::pair<int, int>> last_step_tokens() { return {}; }
+  // Cancellation: the request leaves the waiting queue or its slot at the
+  // next step(), which releases its kv pages at once, e.g. when its client
+  // disconnected. With evict_expired_requests, so do the requests whose
+  // deadline has passed. last_step_evicted() gives the ids of the requests
+  // which left this way in the last step(), it does not return them as
+  // finished. cancel_request may be called from any thread.
+  virtual void cancel_request(int request_id) {}
+  virtual void evict_expired_requests(bool enable) {}
+  virtual std::vector<int> last_step_evicted() { return {}; }
+
+  // Cancel the row of the batch of the running Infer, from any thread or
+  // from the token callback: it is finished at the next decoding step as if
+  // it sampled eos, so that Infer returns once the other rows finish, at
+  // once if every row is cancelled. Ignored by the models which do not
+  // support it.
+  virtual void cancel_row(int row) {}
+
+  // Streaming output: during the following Infer calls, callback gets the
+  // step (counted from 0 after the prompt) and the token of every sequence
+  // of the batch at this step, shortly after the step is sampled and without
+  // stopping the decoding loop. Steps after a sequence finished carry eos.
+  // An empty callback turns it off. Not supported by every model.
+  virtual void set_token_callback(
+      std::function<void(int, const std::vector<int>&)> callback) {
+    throw std::runtime_error("streaming output is not supported");
+  }
+
+  // Sampling params of topp sampling, applied to the following Infer calls:
+  // temperature, repetition_penalty of the tokens already in a sequence and
+  // min_p, the least probability relative to the most likely token. Not
+  // supported by every model.
+  virtual void set_sampling_params(float temperature, float repetition_penalty,
+                                   float min_p) {
+    throw std::runtime_error("sampling params are not supported");
+  }
+
+  // Parallel sampling: every prompt of the following Infer calls is
+  // prefilled once and sampled num independent times, the output is then
+  // [batch_size, num, seq_len]. The rows of the token callback, of
+  // cancel_row and of the generation configs are the samples, row
+  // s * batch_size + b for the sample s of prompt b. Sampling only, 1 turns
+  // it off. Not supported by every model.
+  virtual void set_num_return_sequences(int num) {
+    throw std::runtime_error("parallel sampling is not supported");
+  }
+
+  // Per row generation: row i of the batch of the following Infer calls is
+  // sampled with configs[i] and stops after its stop tokens or max new
+  // tokens, so requests of different settings run in one forward. An empty
+  // list goes back to the sampling method of the weight file. Sampling only,
+  // not supported by every model.
+  virtual void set_generation_configs(
+      const std::vector<GenerationConfig>& configs) {
+    throw std::runtime_error("per row generation configs are not supported");
+  }
+
+  // Logits processors applied on the device before sampling or beam search
+  // in the following Infer calls, for every row. A default config turns
+  // them off. Not supported by every model.
+  virtual void set_logits_processor(const LogitsProcessConfig& config) {
+    throw std::runtime_error("logits processors are not supported");
+  }
+
+  // Constrained decoding: the following Infer calls only sample the tokens
+  // the automaton allows in the state of every row, advanced on the device
+  // after every step. An automaton without states turns it off. Sampling
+  // only, not supported by every model.
+  virtual void set_token_automaton(const TokenAutomaton& automaton) {
+    throw std::runtime_error("token automatons are not supported");
+  }
+
+  // Speculative decoding: draft_model, a smaller model of the same
+  // vocabulary, proposes num_draft_tokens tokens which this model verifies
+  // in a single forward pass. The draft model is not owned, nullptr turns it
+  // off. Not supported by every model.
+  virtual void set_draft_model(LSModel* draft_model, int num_draft_tokens) {
+    throw std::runtime_error("speculative decoding is not supported");
+  }
+
+  // LoRA serving: load_lora_adapter reads the low rank adapter name from
+  // path, set_lora_adapters picks the adapter of every row of the batch of
+  // the following Infer calls, an empty name or an empty list runs the base
+  // model. Not supported by every model.
+  virtual void load_lora_adapter(const std::string& name,
+                                 const std::string& path) {
+    throw std::runtime_error("LoRA adapters are not supported");
+  }
+  virtual void set_lora_adapters(const std::vector<std::string>& names) {
+    throw std::runtime_error("LoRA adapters are not supported");
+  }
+
+  // Packed scoring: sequence i of the num_seqs ones is tokens[offsets[i],
+  // offsets[i + 1]), without padding. ppl[i] is the mean negative log prob of
+  // its tokens after the first, as the ppl sampling method. token_log_probs,
+  // if not null, gets the log prob of every token given its prefix, 0 for
+  // the first token of a sequence. Host pointers, not supported by every
+  // model.
+  virtual void score_packed(const int* tokens, const int* offsets,
+                            int num_seqs, float* ppl, float* token_log_probs) {
+    throw std::runtime_error("packed scoring is not supported");
+  }
+
+  // Tree scoring: the candidate continuations of a prefix of prefix_len
+  // tokens, merged into a token tree of tree_len tokens, are scored in one
+  // forward with a tree attention mask, without encoding the prefix again
+  // per candidate. tree_parents[i] < i is the parent of the tree token i, -1
+  // for a child of the prefix. log_likelihood[i] gets the log prob of the
+  // path of the tree ending at token i given the prefix, ie. the score of
+  // the candidate ending there. Host pointers, not supported by every model.
+  virtual void score_tree(const int* prefix, int prefix_len,
+                          const int* tree_tokens, const int* tree_parents,
+                          int tree_len, float* log_likelihood) {
+    throw std::runtime_error("tree scoring is not supported");
+  }
+
+  // Packed encoding, the ragged batches of the encoders: sequence i of the
+  // num_seqs ones is tokens[offsets[i], offsets[i + 1]), offsets[0] == 0,
+  // and output gets the [offsets[num_seqs], hidden_size] encoder output of
+  // the tokens in the same order, in the dtype of output 0. tokens and
+  // offsets are host pointers, output may be on host or device. Not
+  // supported by every model.
+  virtual void encode_packed(const int* tokens, const int* offsets,
+                             int num_seqs, void* output) {
+    throw std::runtime_error("packed encoding is not supported");
+  }
+
  protected:
   void set_output_shape(int index, std::vector<int> shape) {
     output_shapes_.at(index) = std::move(shape);
@@ -99,13 +471,94 @@ class LSModel {
   std::vector<std::vector<int>> output_shapes_;
 };
 
-typedef LSModel* (*LSModelConstructor)(const std::string, const int);
+// The options of a model which are not in its model file, by the lower case
+// name of their LIGHTSEQ_* variable without the prefix, e.g. "tp_size" for
+// LIGHTSEQ_TP_SIZE, see docs/environment.md. The models do not read the
+// environment, the launchers fall back to it with model_options_from_env.
+typedef std::map<std::string, std::string> ModelOptions;
+
+// The value of key, nullptr if it is not set.
+inline const char* model_option(const ModelOptions& options,
+                                const std::string& key) {
+  auto iter = options.find(key);
+  return iter == options.end() ? nullptr : iter->second.c_str();
+}
+
+// The LIGHTSEQ_* variables of the environment as options, overridden by
+// options.
+inline ModelOptions model_options_from_env(
+    const ModelOptions& options = ModelOptions()) {
+  const std::string prefix = "LIGHTSEQ_";
+  ModelOptions res;
+  for (char** env = environ; *env != nullptr; env++) {
+    std::string var = *env;
+    size_t eq = var.find('=');
+    if (eq == std::string::npos || var.compare(0, prefix.size(), prefix)) {
+      continue;
+    }
+    std::string key = var.substr(prefix.size(), eq - prefix.size());
+    std::transform(key.begin(), key.end(), key.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    res[key] = var.substr(eq + 1);
+  }
+  for (const auto& kv : options) res[kv.first] = kv.second;
+  return res;
+}
+
+typedef LSModel* (*LSModelConstructor)(const std::string, const int,
+                                       const ModelOptions&);
+
+// "fp32", "fp16" or "bf16", kNotSupported for any other name.
+inline DataType precision_dtype(const std::string& name) {
+  if (name == "fp32") return kFloat32;
+  if (name == "fp16") return kFloat16;
+  if (name == "bf16") return kBFloat16;
+  return kNotSupported;
+}
+
+inline const char* precision_name(DataType precision) {
+  switch (precision) {
+    case kFloat16:
+      return "fp16";
+    case kBFloat16:
+      return "bf16";
+    default:
+      return "fp32";
+  }
+}
+
+// The precision of the models created without one: the precision option if
+// set, else the FP16_MODE or BF16_MODE of the build.
+inline DataType default_precision(
+    const ModelOptions& options = ModelOptions()) {
+  const char* precision_opt = model_option(options, "precision");
+  if (precision_opt && precision_dtype(precision_opt) != kNotSupported) {
+    return precision_dtype(precision_opt);
+  }
+#ifdef FP16_MODE
+  return kFloat16;
+#elif defined BF16_MODE
+  return kBFloat16;
+#else
+  return kFloat32;
+#endif
+}
+
+// In-batch collapsing of duplicate rows around model, which it then owns, see
+// DedupModel of dedup_model.h.
+LSModel* dedup_rows_model(LSModel* model);
+
+// Traffic capture of a sample_rate sample of the requests of model, which it
+// then owns, to the log at path, see CaptureModel of traffic_capture.h.
+LSModel* capture_traffic_model(LSModel* model, const std::string& path,
+                               float sample_rate);
 
 class LSModelFactory {
  private:
   LSModelFactory() {}
   ~LSModelFactory() {}
-  std::map<std::string, LSModelConstructor> object_map_;
+  // by class name and precision
+  std::map<std::pair<std::string, DataType>, LSModelConstructor> object_map_;
 
  public:
   static LSModelFactory& GetInstance() {
@@ -113,39 +566,93 @@ class LSModelFactory {
     return factory;
   }
 
-  void ModelRegister(std::string class_name, LSModelConstructor obj) {
+  void ModelRegister(std::string class_name, DataType precision,
+                     LSModelConstructor obj) {
     if (obj) {
-      object_map_.insert(std::map<std::string, LSModelConstructor>::value_type(
-          class_name, obj));
+      object_map_.insert({{class_name, precision}, obj});
     }
   }
 
+  // Every model is built in fp32 and, on cuda, fp16, Llama in bf16 too, so
+  // one process can host models of different precisions. kNotSupported
+  // stands for default_precision(options). options are passed to the
+  // model, see ModelOptions. With dedup_rows=1 the duplicate rows of a batch
+  // run once, see DedupModel. With capture_path the requests, a
+  // capture_sample_rate of them, are written to a traffic log, see
+  // CaptureModel.
   LSModel* CreateModel(std::string class_name, const std::string weight_path,
-                       const int max_batch_size) {
-    std::map<std::string, LSModelConstructor>::const_iterator iter =
-        object_map_.find(class_name);
+                       const int max_batch_size,
+                       DataType precision = kNotSupported,
+                       const ModelOptions& options = ModelOptions()) {
+    if (precision == kNotSupported) precision = default_precision(options);
+    auto iter = object_map_.find({class_name, precision});
     if (iter != object_map_.end()) {
-      return iter->second(weight_path, max_batch_size);
+      LSModel* model = iter->second(weight_path, max_batch_size, options);
+      const char* dedup_opt = model_option(options, "dedup_rows");
+      if (dedup_opt && std::atoi(dedup_opt) != 0) {
+        model = dedup_rows_model(model);
+      }
+      const char* capture_opt = model_option(options, "capture_path");
+      if (capture_opt && *capture_opt) {
+        const char* rate_opt = model_option(options, "capture_sample_rate");
+        model = capture_traffic_model(model, capture_opt,
+                                      rate_opt ? std::atof(rate_opt) : 1.f);
+      }
+      return model;
     } else {
-      throw std::runtime_error("Model not supported");
+      throw std::runtime_error("Model not supported: " + class_name + " in " +
+                               precision_name(precision));
     }
   }
+
+  // The max_batch_size, and the kv pages of the paged cache, of the model
+  // which fit budget_bytes of device memory, see plan_memory_config. A probe
+  // model of probe_batch_size rows is built for the memory profile first,
+  // and released before returning, with options.
+  MemoryConfig PlanMemory(std::string class_name,
+                          const std::string weight_path, size_t budget_bytes,
+                          int max_row_tokens = 0, int probe_batch_size = 2,
+                          DataType precision = kNotSupported,
+                          const ModelOptions& options = ModelOptions()) {
+    MemoryProfile profile;
+    {
+      std::unique_ptr<LSModel> probe(CreateModel(
+          class_name, weight_path, probe_batch_size, precision, options));
+      profile = probe->memory_profile();
+    }
+    if (profile.max_step == 0) {
+      throw std::runtime_error(class_name +
+                               " does not support memory planning");
+    }
+    return plan_memory_config(profile, budget_bytes, max_row_tokens);
+  }
 };
 
 class Reflector {
  public:
-  Reflector(std::string name, LSModelConstructor obj) {
-    LSModelFactory::GetInstance().ModelRegister(name, obj);
+  Reflector(std::string name, DataType precision, LSModelConstructor obj) {
+    LSModelFactory::GetInstance().ModelRegister(name, precision, obj);
   }
   virtual ~Reflector() {}
 };
 
-#define LSMODEL_REGISTER(className)                                 \
-  LSModel* create_object_##className(const std::string weight_path, \
-                                     const int max_batch_size) {    \
-    return new className(weight_path, max_batch_size);              \
-  }                                                                 \
-  Reflector reflector_##className(#className, create_object_##className);
+#define LSMODEL_REGISTER_PRECISION(className, T, precision)        \
+  LSModel* create_object_##className##_##precision(                \
+      const std::string weight_path, const int max_batch_size,     \
+      const ModelOptions& options) {                               \
+    return new className<T>(weight_path, max_batch_size, options); \
+  }                                                                \
+  Reflector reflector_##className##_##precision(                   \
+      #className, precision, create_object_##className##_##precision);
+
+#ifdef LIGHTSEQ_cuda
+#define LSMODEL_REGISTER(className)                      \
+  LSMODEL_REGISTER_PRECISION(className, float, kFloat32) \
+  LSMODEL_REGISTER_PRECISION(className, __half, kFloat16)
+#else
+#define LSMODEL_REGISTER(className) \
+  LSMODEL_REGISTER_PRECISION(className, float, kFloat32)
+#endif
 
 }  // namespace cuda
 }  // namespace lightseq
@@ -0,0 +1,78 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "model_base.h"
+
+namespace lightseq {
+namespace cuda {
+
+/*
+  Class: ModelManager
+  Description:
+    The residency of many models on one gpu, eg. a long tail of fine-tuned
+    ones, under a budget of device memory for their weights. Every model is
+    created once by LSModelFactory, which parses its weights, and is then
+    paged between the device and pinned host memory as a whole, see
+    LSModel::evict_weights. acquire() makes a model resident, evicting the
+    least recently acquired ones until its weights fit in the budget. The
+    weights are copied back without the host waiting, the first Infer waits
+    for them on the device, so a cold model costs a copy at the bandwidth of
+    the bus rather than a parse of its file. An evicted model is suspended
+    too, it holds no activation memory either.
+
+    The models which do not support eviction, and the ones with pending
+    continuous batching requests, stay resident. A model acquired must not
+    be evicted while it runs: the manager is called from one thread, or the
+    callers serialize acquire with the use of the models.
+*/
+class ModelManager {
+ private:
+  struct Entry {
+    std::unique_ptr<LSModel> model;
+    size_t weight_bytes = 0;
+    bool resident = true;
+    // false once evict_weights refused.
+    bool evictable = true;
+    // acquisitions are numbered, the least recent model is evicted first.
+    size_t last_use = 0;
+  };
+
+  size_t _budget_bytes;
+  size_t _resident_bytes = 0;
+  size_t _clock = 0;
+  std::map<std::string, Entry> _models;
+  std::mutex _mutex;
+
+  Entry& find_entry(const std::string& name);
+  // Evict the least recently used resident models but keep, until bytes
+  // more fit in the budget or no model is left to evict.
+  void make_room(size_t bytes, const std::string& keep);
+  bool evict_entry(Entry& entry);
+
+ public:
+  explicit ModelManager(size_t budget_bytes) : _budget_bytes(budget_bytes) {}
+
+  // Create the model name of class_name, see LSModelFactory::CreateModel. It
+  // is resident and suspended, the least recently used models are evicted
+  // if its weights exceed the budget. Throws std::runtime_error if name is
+  // taken.
+  void add_model(const std::string& name, const std::string& class_name,
+                 const std::string& weight_path, int max_batch_size,
+                 DataType precision = kNotSupported,
+                 const ModelOptions& options = ModelOptions());
+  void remove_model(const std::string& name);
+
+  // The model name, resident.
+  LSModel* acquire(const std::string& name);
+  void evict(const std::string& name);
+
+  bool is_resident(const std::string& name);
+  size_t resident_bytes() const { return _resident_bytes; }
+  size_t budget_bytes() const { return _budget_bytes; }
+};
+
+}  // namespace cuda
+}  // namespace lightseq
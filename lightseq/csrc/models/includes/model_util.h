@@ -1,8 +1,391 @@
 #pragma once
+#include "algorithm"
+#include "atomic"
+#include "chrono"
+#include "deque"
+#include "functional"
+#include "mutex"
+#include "unordered_map"
 #include "layer.h"
+#include "model_base.h"
 
 namespace lightseq {
 
 GenerateMethod get_generate_method(std::string method_);
 
+// Round value up to the next power of two, but no more than max_value. Used
+// to bucket input shapes for dynamic memory plans.
+int shape_bucket(int value, int max_value);
+
+// Rows of a batch run as one sub-batch of seq_len tokens, see length_buckets.
+struct LengthBucket {
+  std::vector<int> rows;
+  int seq_len;
+};
+
+// Split the rows of a right padded [batch_size, seq_len] batch into
+// sub-batches of at most max_bucket_size rows, the longest rows first, so
+// that pad tokens are at most max_waste of the tokens of a sub-batch. A row
+// ends at its last token which is not pad_id.
+std::vector<LengthBucket> length_buckets(const int* tokens, int batch_size,
+                                         int seq_len, int pad_id,
+                                         float max_waste, int max_bucket_size);
+
+/*
+  Class: KVPageTable
+  Description:
+    Host side bookkeeping of a paged kv cache. The cache is a pool of
+    num_pages pages, each holding page_size tokens. A sequence only holds the
+    pages covering the tokens it has produced so far, so short and long
+    sequences share the same pool instead of each reserving max_step tokens.
+
+    table() is [max_seqs, max_pages] and is copied to the device by the
+    model whenever dirty() is set. Unassigned entries point to page 0, they
+    are never read since attention stops at the current position.
+
+    Pages are reference counted, so that a page can be shared by several
+    sequences and by KVPrefixCache. It returns to the pool when the last
+    holder releases it.
+*/
+class KVPageTable {
+ private:
+  int _num_pages;
+  int _page_size;
+  int _max_seqs;
+  int _max_pages;
+  std::vector<int> _free_pages;
+  std::vector<int> _table;
+  std::vector<int> _seq_num_pages;
+  std::vector<int> _ref_count;
+  bool _dirty = true;
+
+ public:
+  KVPageTable(int num_pages, int page_size, int max_seqs, int max_step);
+
+  // Make sure the sequence holds the pages of tokens [0, seq_len). Returns
+  // false if the pool runs out of pages.
+  bool reserve(int seq_idx, int seq_len);
+  void release(int seq_idx);
+  void release_all();
+  // Change the size of the pool, which must not hold any page.
+  void resize(int num_pages);
+  // Make the sequence, which must hold no page yet, start with the given
+  // pages, which it then shares with their other holders.
+  void share(int seq_idx, const std::vector<int>& pages);
+
+  void retain_page(int page) { _ref_count[page]++; }
+  void release_page(int page);
+  int ref_count(int page) const { return _ref_count[page]; }
+
+  const std::vector<int>& table() const { return _table; }
+  bool dirty() const { return _dirty; }
+  void clear_dirty() { _dirty = false; }
+
+  int num_pages() const { return _num_pages; }
+  int page_size() const { return _page_size; }
+  int max_pages() const { return _max_pages; }
+  int num_free_pages() const { return _free_pages.size(); }
+  const int* seq_pages(int seq_idx) const {
+    return _table.data() + seq_idx * _max_pages;
+  }
+};
+
+/*
+  Class: KVPrefixCache
+  Description:
+    Keeps the full kv pages of past prompts, so that a prompt starting with
+    the same tokens, such as a shared system prompt, reuses them and only
+    runs the prefill of the remaining tokens. A cached page holds exactly
+    page_size prompt tokens and is looked up by a hash of its tokens and of
+    the cached page before it, which makes the pages of the cached prompts
+    a radix tree with one page per edge.
+
+    The cache holds one reference of every cached page, so a page shared
+    with running sequences stays valid until all of them release it. Pages
+    only held by the cache are evicted in least recently used order when
+    the pool runs short, together with the pages following them.
+*/
+class KVPrefixCache {
+ private:
+  struct Block {
+    int parent;  // page of the previous block, -1 for the first block
+    std::vector<int> tokens;
+    std::vector<int> children;
+    size_t last_use;
+  };
+
+  std::shared_ptr<KVPageTable> _page_table;
+  // block hash -> page
+  std::unordered_multimap<size_t, int> _index;
+  // page -> block
+  std::unordered_map<int, Block> _blocks;
+  size_t _clock = 0;
+
+  size_t block_hash(int parent, const int* tokens) const;
+  // page of the cached block, -1 if there is none.
+  int find(int parent, const int* tokens) const;
+  // Remove the block and all the blocks following it.
+  void drop(int page);
+
+ public:
+  KVPrefixCache(std::shared_ptr<KVPageTable> page_table)
+      : _page_table(page_table) {}
+
+  // Pages of the longest cached prefix of tokens, of at most max_len tokens.
+  std::vector<int> match(const std::vector<int>& tokens, int max_len);
+  // Cache the full pages of the first len tokens of the sequence.
+  void insert(int seq_idx, const std::vector<int>& tokens, int len);
+  // Evict pages until the pool has num_pages free pages, returns false if
+  // it can not.
+  bool evict(int num_pages);
+  void clear();
+
+  int num_cached_pages() const { return _blocks.size(); }
+};
+
+/*
+  Class: KVHostCache
+  Description:
+    Host side bookkeeping of the kv of idle sessions and preempted requests
+    offloaded to pinned host memory, which holds many more tokens than the
+    gpu. The host memory is a pool of num_pages pages of page_size tokens,
+    each one holding every layer of a page of KVPageTable, so an entry is
+    the list of the host pages of its tokens. The copies are issued by the
+    model.
+
+    An entry keeps the tokens whose kv it holds, so that a prompt which
+    restores it checks that it starts with them. Entries are evicted in
+    least recently used order when the pool runs short.
+*/
+class KVHostCache {
+ private:
+  struct Entry {
+    std::vector<int> tokens;
+    std::vector<int> pages;
+    size_t last_use;
+  };
+
+  int _num_pages;
+  int _page_size;
+  std::vector<int> _free_pages;
+  std::unordered_map<int, Entry> _entries;
+  size_t _clock = 0;
+
+ public:
+  KVHostCache(int num_pages, int page_size);
+
+  // Take the host pages of the kv of the first len tokens under key, which
+  // replaces its entry. Returns the pages, empty if the pool can not hold
+  // them.
+  std::vector<int> save(int key, const std::vector<int>& tokens, int len);
+  // Length of the longest prefix of tokens, of at most max_len tokens, whose
+  // kv is held by the entry of key, with the host pages covering it.
+  int match(int key, const std::vector<int>& tokens, int max_len,
+            std::vector<int>* pages);
+  void erase(int key);
+  void clear();
+
+  int num_pages() const { return _num_pages; }
+  int num_free_pages() const { return _free_pages.size(); }
+  int num_entries() const { return _entries.size(); }
+};
+
+// One request of continuous batching, see RequestSlots.
+struct GenerationRequest {
+  int request_id = -1;
+  std::vector<int> tokens;  // prompt followed by the generated tokens
+  int prompt_len = 0;
+  // tokens run as the prompt, the prompt and the tokens generated before the
+  // last preemption of the request.
+  int prefill_len = 0;
+  int max_new_tokens = 0;
+  int step = 0;  // generated tokens so far
+  int cached_len = 0;  // prefill tokens whose kv is in the cache
+  // the kv of a finished request of a session is kept for its next request,
+  // -1 without session, see KVHostCache.
+  int session_id = -1;
+  int priority = 0;  // higher runs first
+  // steady clock, in ms, 0 without deadline
+  double deadline_ms = 0;
+
+  bool active() const { return request_id >= 0; }
+};
+
+/*
+  Class: RequestSlots
+  Description:
+    Host side state of continuous (iteration-level) batching. Up to
+    max_slots requests run together, each one in its own slot with its own
+    prompt length and step counter. Requests wait until a slot is free, and
+    leave their slot as soon as they finish, so the batch is refilled at
+    every decoding step instead of at every Infer.
+
+    The waiting queue is ordered by priority, then by deadline (requests
+    without one last), then fifo. A waiting request may preempt a running
+    request of a lower priority, which goes back to the queue keeping its
+    generated tokens, its kv is recomputed when it is admitted again unless
+    the model kept it, see KVHostCache.
+*/
+class RequestSlots {
+ private:
+  int _next_request_id = 0;
+  std::vector<GenerationRequest> _slots;
+  std::deque<GenerationRequest> _waiting;
+
+  void enqueue(const GenerationRequest& request);
+
+ public:
+  RequestSlots(int max_slots) : _slots(max_slots) {}
+
+  // deadline_ms is relative to now, 0 without deadline.
+  int add_request(const std::vector<int>& prompt, int max_new_tokens,
+                  int priority = 0, int deadline_ms = 0, int session_id = -1);
+
+  // Whether a runs before b.
+  static bool outranks(const GenerationRequest& a, const GenerationRequest& b);
+
+  bool has_waiting() const { return !_waiting.empty(); }
+  const GenerationRequest& next_waiting() const { return _waiting.front(); }
+  // Move the first waiting request into a free slot, returns the slot or -1.
+  int admit();
+  // Empty the slot and return its request.
+  GenerationRequest retire(int slot_idx);
+  // The slot of the running request which request may preempt, the lowest
+  // ranked one of a lower priority, or -1.
+  int preemption_victim(const GenerationRequest& request) const;
+  // Empty the slot and queue its request again, to resume from its tokens.
+  void preempt(int slot_idx);
+
+  // The slot of the running request, -1 if it does not run.
+  int find_slot(int request_id) const;
+  // Remove the request from the waiting queue, false if it does not wait.
+  bool drop_waiting(int request_id);
+  // The waiting and running requests whose deadline is before now_ms, of
+  // the steady clock.
+  std::vector<int> expired(double now_ms) const;
+
+  GenerationRequest& slot(int slot_idx) { return _slots[slot_idx]; }
+  int max_slots() const { return _slots.size(); }
+  std::vector<int> active_slots() const;
+  bool empty() const;
+};
+
+/*
+  Class: CancelQueue
+  Description:
+    Ids cancelled from any thread, the requests of continuous batching or
+    the rows of the batch of Infer, taken by the decoding loop once per
+    step. take() is a single atomic load while nothing was cancelled.
+*/
+class CancelQueue {
+ private:
+  std::mutex _mutex;
+  std::vector<int> _ids;
+  std::atomic<bool> _pending{false};
+
+ public:
+  void push(int id);
+  // the ids pushed since the last take.
+  std::vector<int> take();
+};
+
+/*
+  Class: RowCancellation
+  Description:
+    The rows of the batch of Infer cancelled by LSModel::cancel_row. Before
+    every decoding step, apply() writes eos as the last token of all the
+    sequences of the rows cancelled since the step before, which the
+    sampling then keeps finished as if they had sampled it. So the steps
+    stop as soon as the rows which are not cancelled finish, and all at once
+    when every row is cancelled.
+*/
+class RowCancellation {
+ private:
+  CancelQueue _queue;
+  std::vector<char> _cancelled;
+  int _num_cancelled = 0;
+  // the source of the eos copies.
+  int _eos_id = 0;
+
+ public:
+  void cancel(int row) { _queue.push(row); }
+  // Start an Infer of batch_size rows, the earlier cancellations are
+  // dropped.
+  void reset(int batch_size);
+#ifdef LIGHTSEQ_cuda
+  // The rows cancelled since the last call, whose beam_size sequences of
+  // tokens, [batch_size * beam_size, max_step] on device, get eos_id at pos
+  // if write_eos. Beam search does not end a row this way, it only stops
+  // once every row is cancelled.
+  std::vector<int> apply(int* tokens, int pos, int beam_size, int max_step,
+                         int eos_id, bool write_eos, cudaStream_t stream);
+#endif
+  bool all_cancelled() const {
+    return !_cancelled.empty() && _num_cancelled == int(_cancelled.size());
+  }
+};
+
+/*
+  Class: TokenStreamer
+  Description:
+    Publishes the tokens of every decoding step to a callback while Infer is
+    still running. push() enqueues an async copy of the tokens of the step
+    into a ring of pinned buffers and returns, the callback of a step is run
+    by a later push() or flush() once its copy has finished, in step order.
+    The decoding loop only waits when the ring is full, i.e. when the
+    callback falls ring_size steps behind.
+*/
+class TokenStreamer {
+ public:
+  // the step counted from 0 after the prompt, and the token of every
+  // sequence of the batch at this step.
+  using Callback = std::function<void(int, const std::vector<int>&)>;
+
+ private:
+  struct Slot {
+    int step;
+    int num_seqs;
+    int* tokens;  // pinned, [max_seqs]
+#ifdef LIGHTSEQ_cuda
+    cudaEvent_t event;
+#endif
+  };
+
+  Callback _callback;
+  int _max_seqs;
+  std::vector<Slot> _ring;
+  // pending slots are [_head, _head + _size) modulo the ring size.
+  int _head = 0;
+  int _size = 0;
+
+  void publish_front();
+
+ public:
+  TokenStreamer(int max_seqs, int ring_size = 8);
+  ~TokenStreamer();
+
+  void set_callback(Callback callback) { _callback = callback; }
+  bool enabled() const { return bool(_callback); }
+
+#ifdef LIGHTSEQ_cuda
+  // Publish the token at tokens[seq * stride] of num_seqs sequences as the
+  // step, tokens is on device and is read on stream.
+  void push(int step, const int* tokens, int num_seqs, int stride,
+            cudaStream_t stream);
+#endif
+  // Publish tokens already on host, after the pending device steps.
+  void push_host(int step, const std::vector<int>& tokens);
+  // Wait for and publish all pending steps.
+  void flush();
+};
+
+// LSModel::warmup of a model whose input 0 holds token ids, input_ptr is the
+// one to restore. The rows of the warmup repeat the smallest token id which
+// is none of excluded_tokens, eg. padding and eos. Throws
+// std::runtime_error for a shape beyond the max input shape.
+std::vector<cuda::WarmupTiming> warmup_infer(
+    cuda::LSModel* model, void* input_ptr,
+    const std::vector<std::vector<int>>& shapes,
+    const std::vector<int>& excluded_tokens);
+
 }  // namespace lightseq
@@ -0,0 +1,125 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "model_base.h"
+
+namespace lightseq {
+namespace cuda {
+
+// Output 0 of a request of OverflowScheduler, on the host.
+struct ScheduledOutput {
+  std::vector<int> shape;
+  std::vector<char> data;
+  // run by the overflow model
+  bool overflow = false;
+  float latency_ms = 0.f;
+};
+
+/*
+  Class: OverflowScheduler
+  Description:
+    The routing of the encoder requests, token ids [batch_size, seq_len] of
+    input 0 such as the ones of Bert, between two instances of a model of
+    the same weights: the primary one, on the gpu, and an overflow one, eg.
+    on the cores of the host, which only takes the requests it is predicted
+    to finish first. Every model runs on a worker thread of its own, its
+    requests queued in order.
+
+    A request goes to the model of least predicted finish time, the
+    predicted time of the requests queued on it plus the cost of the shape,
+    so that the overflow model takes the small requests once the queue of
+    the primary one grows, and the large ones hardly ever. The cost of a
+    model is a moving average of the Infer times per bucket of the shape,
+    see shape_bucket, learnt from warmup by calibrate and from every request
+    after, the shapes of an unseen bucket cost the average time per token of
+    the model. The overflow model only takes requests once it has a cost,
+    and of at most max_overflow_tokens tokens if positive.
+
+    A model of host memory takes host buffers, eg. one of the x86 build
+    behind a proxy of the LSModel interface, the other ones device buffers.
+    Both models are the caller's, and are only used by the scheduler until
+    it is destroyed.
+*/
+class OverflowScheduler {
+ private:
+  struct Task {
+    std::vector<int> tokens;
+    int batch_size;
+    int seq_len;
+    float predicted_ms;
+    std::promise<ScheduledOutput> output;
+  };
+
+  struct Backend {
+    LSModel* model = nullptr;
+    bool host_memory = false;
+    bool overflow = false;
+    int max_batch_size = 0;
+    int max_seq_len = 0;
+    void* input = nullptr;
+    std::vector<void*> outputs;
+    std::vector<size_t> output_bytes;
+
+    // the queued and running tasks, and their predicted time.
+    std::deque<std::shared_ptr<Task>> queue;
+    float backlog_ms = 0.f;
+    // the moving average of the Infer time of a shape bucket, and of a
+    // token.
+    std::map<std::pair<int, int>, float> bucket_ms;
+    float token_ms = -1.f;
+    size_t num_requests = 0;
+    std::thread worker;
+  };
+
+  Backend _backends[2];
+  int _max_overflow_tokens;
+#ifdef LIGHTSEQ_cuda
+  int _device;
+#endif
+  float _cost_decay = 0.25f;
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  bool _stop = false;
+
+  // time of the shape on backend, negative if unknown.
+  float predict_ms(const Backend& backend, int batch_size, int seq_len) const;
+  void record_ms(Backend* backend, int batch_size, int seq_len, float ms);
+  void run_worker(Backend* backend);
+  ScheduledOutput run_task(Backend* backend, const Task& task);
+
+ public:
+  OverflowScheduler(LSModel* primary, LSModel* overflow,
+                    bool primary_host_memory = false,
+                    bool overflow_host_memory = true,
+                    int max_overflow_tokens = 0);
+  ~OverflowScheduler();
+
+  // Seed the costs of both models with the Infer times of their warmup on
+  // every [batch_size, seq_len] shape, see LSModel::warmup. Called before
+  // the first submit.
+  void calibrate(const std::vector<std::vector<int>>& shapes);
+
+  // Queue the right padded token ids [batch_size, seq_len], on the host, on
+  // one of the models. Throws if the shape exceeds the max input shape of
+  // both.
+  std::future<ScheduledOutput> submit(std::vector<int> tokens, int batch_size,
+                                      int seq_len);
+
+  // the weight of a new Infer time in the moving average of its cost.
+  void set_cost_decay(float decay) { _cost_decay = decay; }
+
+  // the requests run by the primary, or the overflow model, so far.
+  size_t num_requests(bool overflow);
+  // the predicted time of the requests queued on a model.
+  float backlog_ms(bool overflow);
+};
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -0,0 +1,84 @@
+#pragma once
+#include "model_base.h"
+
+#include "t5_weight.h"
+
+#include "launch_enc_emb_layer.h"
+#include "launch_dec_emb_layer.h"
+#include "t5_encoder_layer.h"
+#include "t5_decoder_layer.h"
+#include "rms_norm_layer.h"
+#include "linear_layer.h"
+#include "generator_layer.h"
+#include "encdec_kv_layer.h"
+#include "model_util.h"
+
+namespace lightseq {
+namespace cuda {
+/*
+T5 and mT5 of the huggingface export, see T5Weight. The relative position
+bias of the encoder and of the decoder self attention is a table of every
+distance computed when loading, each attention adds it to its scores in the
+fused attention kernel.
+*/
+template <typename OpType_>
+class T5 : public LSModel {
+ private:
+  T5Weight<OpType_> tw_;
+  std::shared_ptr<Context> _context_ptr;
+
+  LaunchEncEmbLayerPtr<OpType_> launch_enc_emb_layer;
+  std::vector<T5EncoderLayerPtr<OpType_, OpType_>> enc_layer_vec;
+  RMSNormLayerPtr<OpType_, OpType_> enc_norm_layer;
+
+  LaunchDecEmbLayerPtr<OpType_> launch_dec_emb_layer;
+  EncDecKvLayerPtr<OpType_, OpType_> _enc_kv_layer;
+  std::vector<T5DecoderLayerPtr<OpType_, OpType_>> dec_layer_vec;
+  RMSNormLayerPtr<OpType_, OpType_> dec_norm_layer;
+  LinearLayerPtr<OpType_, OpType_> linear_layer;
+
+  GeneratorLayerPtr<OpType_> _generator_layer;
+
+  Variable* inp_tokens;  // need to allocate
+
+  Variable* total_cache_k;
+  Variable* total_cache_v;
+
+  Variable* dec_tokens;
+  Variable* dec_tokens_buf;
+  Variable* seq_score;
+  Variable* t5_out;
+
+  int cache_size;
+  int _max_batch_size;
+  bool _output_topk = true;
+  bool _is_sampling;
+  GenerateMethod _generate_method;
+
+ public:
+  T5(const std::string weight_path, const int max_batch_size,
+     const ModelOptions& options);
+  ~T5();
+
+  void encoder_before_forward(int batch_size, int seq_len);
+  void decoder_before_forward(int batch_size, int seq_len, int cur_step);
+
+  void Infer() override;
+  void set_input_ptr(int index, void* input_ptr) override;
+  void set_output_ptr(int index, void* output_ptr) override;
+  const void* get_output_ptr(int index) override;
+  std::vector<int> get_input_max_shape(int index) override;
+  std::vector<int> get_output_max_shape(int index) override;
+  DataType get_input_dtype(int index) override;
+  DataType get_output_dtype(int index) override;
+  void benchmark_mode(bool is_benchmark) override {}
+  std::vector<WarmupTiming> warmup(
+      const std::vector<std::vector<int>>& shapes) override {
+    return warmup_infer(this, inp_tokens->value(true), shapes,
+                        {tw_._padding_id, tw_._end_id});
+  }
+};
+
+LSMODEL_REGISTER(T5);
+}  // namespace cuda
+}  // namespace lightseq
@@ -0,0 +1,175 @@
+#pragma once
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "model_base.h"
+
+namespace lightseq {
+namespace cuda {
+
+enum class TrafficKind { kInfer = 0, kAddRequest = 1, kEncodePacked = 2 };
+
+// A tensor of a request, on the host.
+struct TrafficTensor {
+  DataType dtype = kInt32;
+  std::vector<int> shape;
+  std::vector<char> data;
+};
+
+/*
+  One request of a traffic log: an Infer of the inputs of the model, with
+  their shapes set, an add_request of the prompt and of params {max new
+  tokens, priority, deadline ms, session id}, or an encode_packed of the
+  tokens and the offsets. The arrival is in seconds since the capture
+  started, the latency the time until the Infer or encode_packed returned,
+  or until the step() which finished the request, negative if it was
+  cancelled or failed.
+*/
+struct TrafficRecord {
+  double arrival_s = 0;
+  float latency_ms = -1.f;
+  TrafficKind kind = TrafficKind::kInfer;
+  std::vector<int> params;
+  std::vector<TrafficTensor> tensors;
+};
+
+/*
+  The compact binary traffic log: the magic "LSTRAFC1", then every record as
+  the double arrival, the float latency, the int32 kind, the int32 number and
+  the int32 values of params, the int32 number of tensors and every tensor as
+  its int32 dtype, int32 rank, int32 dims and uint64 size in bytes followed by
+  its bytes, in the byte order of the host. The records are appended as the
+  requests finish, so in the order of their latencies, read_traffic_log sorts
+  them by arrival. The models of a process capturing to the same path share
+  its recorder, see get, eg. the instances of a Triton model.
+*/
+class TrafficRecorder {
+ private:
+  std::ofstream _fout;
+  std::mutex _mutex;
+  std::chrono::steady_clock::time_point _start;
+
+ public:
+  explicit TrafficRecorder(const std::string& path);
+  static std::shared_ptr<TrafficRecorder> get(const std::string& path);
+
+  // thread safe, flushed at once so that the log survives a crash.
+  void write(const TrafficRecord& record);
+  // the arrival time of a request arriving now.
+  double seconds_since_start() const;
+};
+
+// The records of the log at path sorted by arrival, throws
+// std::runtime_error if it is not a traffic log.
+std::vector<TrafficRecord> read_traffic_log(const std::string& path);
+
+/*
+  Class: CaptureModel
+  Description:
+    Production traffic capture around the model it owns, of the same inputs
+    and outputs: a sample of sample_rate of the Infer, add_request and
+    encode_packed calls is written to the traffic log at path, see
+    TrafficRecorder, with the time it arrived and its latency, the inputs of
+    an Infer copied to the host before it runs. The calls out of the sample
+    only cost a random draw, the calls of a draft model are not captured.
+    The recorded log drives a model again with the same timing and inputs,
+    see example/traffic_replay.cc.
+
+    Created by LSModelFactory::CreateModel with the capture_path option,
+    and capture_sample_rate, 1 by default, or by the capture_path and
+    capture_sample_rate parameters of the Triton backend.
+*/
+class CaptureModel : public LSModel {
+ private:
+  std::unique_ptr<LSModel> _model;
+  std::vector<void*> _input_ptrs;
+  float _sample_rate;
+  std::mt19937 _gen;
+  std::uniform_real_distribution<float> _uniform;
+  std::shared_ptr<TrafficRecorder> _recorder;
+  // the sampled requests of add_request in flight, by id.
+  std::mutex _request_mutex;
+  std::map<int, TrafficRecord> _pending;
+
+  bool sample();
+  void finish_pending(int request_id, bool finished);
+
+ public:
+  CaptureModel(LSModel* model, const std::string& path, float sample_rate);
+  // the requests still in flight are written as unfinished.
+  ~CaptureModel();
+
+  LSModel* model() { return _model.get(); }
+
+  void Infer() override;
+  void set_input_ptr(int index, void* input_ptr) override;
+  void set_output_ptr(int index, void* output_ptr) override;
+  const void* get_output_ptr(int index) override;
+  std::vector<int> get_input_max_shape(int index) override;
+  std::vector<int> get_output_max_shape(int index) override;
+  DataType get_input_dtype(int index) override;
+  DataType get_output_dtype(int index) override;
+  void benchmark_mode(bool is_benchmark) override;
+
+  std::vector<WarmupTiming> warmup(
+      const std::vector<std::vector<int>>& shapes) override;
+  void update_weights(const std::string& weight_path) override;
+  MemoryProfile memory_profile() override;
+  void dynamic_memory_plan(bool enable) override;
+  void cuda_graph_mode(bool enable) override;
+  void suspend() override;
+  void resume() override;
+  bool evict_weights() override;
+  bool restore_weights() override;
+  size_t weight_bytes() override;
+  void set_next_input(int index, void* input_ptr,
+                      std::vector<int> shape) override;
+  void multi_stream(int num_streams) override;
+  void profiling(bool enable) override;
+  void export_profile(const std::string& trace_path) override;
+  std::string metrics_text() override;
+  void layer_time_sampling(int interval) override;
+
+  int add_request(const std::vector<int>& prompt, int max_new_tokens,
+                  int priority = 0, int deadline_ms = 0,
+                  int session_id = -1) override;
+  void drop_session(int session_id) override;
+  std::vector<std::pair<int, std::vector<int>>> step() override;
+  bool has_pending_requests() override;
+  std::vector<std::pair<int, int>> last_step_tokens() override;
+  void cancel_request(int request_id) override;
+  void evict_expired_requests(bool enable) override;
+  std::vector<int> last_step_evicted() override;
+
+  void cancel_row(int row) override;
+  void set_token_callback(
+      std::function<void(int, const std::vector<int>&)> callback) override;
+  void set_sampling_params(float temperature, float repetition_penalty,
+                           float min_p) override;
+  void set_num_return_sequences(int num) override;
+  void set_generation_configs(
+      const std::vector<GenerationConfig>& configs) override;
+  void set_logits_processor(const LogitsProcessConfig& config) override;
+  void set_token_automaton(const TokenAutomaton& automaton) override;
+  void set_draft_model(LSModel* draft_model, int num_draft_tokens) override;
+  void load_lora_adapter(const std::string& name,
+                         const std::string& path) override;
+  void set_lora_adapters(const std::vector<std::string>& names) override;
+  void score_packed(const int* tokens, const int* offsets, int num_seqs,
+                    float* ppl, float* token_log_probs) override;
+  void score_tree(const int* prefix, int prefix_len, const int* tree_tokens,
+                  const int* tree_parents, int tree_len,
+                  float* log_likelihood) override;
+  void encode_packed(const int* tokens, const int* offsets, int num_seqs,
+                     void* output) override;
+};
+
+}  // namespace cuda
+}  // namespace lightseq
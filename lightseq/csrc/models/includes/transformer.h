@@ -11,21 +11,49 @@
 #include "linear_layer.h"
 #include "generator_layer.h"
 #include "encdec_kv_layer.h"
+#include "varlen_layer.h"
 #include "model_util.h"
 
 namespace lightseq {
 namespace cuda {
+template <typename OpType_>
 class Transformer : public LSModel {
  private:
+  // the layers from the source tokens to the cross attention kv of the
+  // decoder.
+  struct Encoder {
+    LaunchEncEmbLayerPtr<OpType_> launch_enc_emb_layer;
+    std::vector<TransformerEncoderLayerPtr<OpType_, OpType_>> enc_layer_vec;
+    LyrNormalizeLayerPtr<OpType_, OpType_> enc_norm_layer;
+    // varlen only, see RemovePaddingLayer.
+    RemovePaddingLayerPtr<OpType_, OpType_> _remove_padding_layer;
+    RebuildPaddingLayerPtr<OpType_, OpType_> _rebuild_padding_layer;
+    EncDecKvLayerPtr<OpType_, OpType_> _enc_kv_layer;
+
+    Variable* inp_tokens;  // need to allocate
+    Variable* pad_mask;
+    Variable* total_enc_kv;
+  };
+
   TransformerWeight<OpType_> tw_;
   std::shared_ptr<Context> _context_ptr;
 
-  LaunchEncEmbLayerPtr<OpType_> launch_enc_emb_layer;
-  std::vector<TransformerEncoderLayerPtr<OpType_, OpType_>> enc_layer_vec;
-  LyrNormalizeLayerPtr<OpType_, OpType_> enc_norm_layer;
+  Encoder _encoder;
+
+  // Encoder/decoder pipelining, see set_next_input: a second encoder in a
+  // context of its own, so on its own stream and memory plan, encodes the
+  // input of the next Infer during the decoding of this one.
+  Encoder _next_encoder;
+  std::shared_ptr<Context> _next_context_ptr;
+  void* _next_input_ptr = nullptr;
+  std::vector<int> _next_input_shape;
+  // the input _next_encoder holds the encoder outputs of.
+  void* _encoded_input_ptr = nullptr;
+  std::vector<int> _encoded_input_shape;
+  cudaEvent_t _next_encoded;
+  cudaEvent_t _next_consumed;
 
   LaunchDecEmbLayerPtr<OpType_> launch_dec_emb_layer;
-  EncDecKvLayerPtr<OpType_, OpType_> _enc_kv_layer;
   std::vector<TransformerDecoderLayerPtr<OpType_, OpType_>> dec_layer_vec;
   LyrNormalizeLayerPtr<OpType_, OpType_> dec_norm_layer;
   LinearLayerPtr<OpType_, OpType_> linear_layer;
@@ -34,8 +62,6 @@ class Transformer : public LSModel {
 
   ContextPtr context_ptr;
 
-  Variable* inp_tokens;  // need to allocate
-
   Variable* total_cache_k;
   Variable* total_cache_v;
   Variable* total_cache_k_buf;
@@ -50,6 +76,8 @@ class Transformer : public LSModel {
 
   int cache_size;
   int _max_batch_size;
+  // the encoder layers skip the padding tokens, on with varlen=1.
+  bool _varlen = false;
   bool _output_topk = true;
   bool _is_sampling;
   GenerateMethod _generate_method;
@@ -58,10 +86,19 @@ class Transformer : public LSModel {
                                                   "topk_greedy"};
 
  public:
-  Transformer(const std::string weight_path, const int max_batch_size);
+  Transformer(const std::string weight_path, const int max_batch_size,
+              const ModelOptions& options);
   ~Transformer();
 
-  void encoder_before_forward(int batch_size, int seq_len);
+  // the layers of encoder in the global context, its kv layer in a regress
+  // scope if keep_outputs, so that its outputs outlive the graph.
+  void build_encoder(Encoder* encoder, bool keep_outputs);
+  void encoder_before_forward(Encoder* encoder, int batch_size, int seq_len);
+  void encoder_forward(Encoder* encoder);
+  void build_next_encoder();
+  void encoder_before_forward(int batch_size, int seq_len) {
+    encoder_before_forward(&_encoder, batch_size, seq_len);
+  }
   void decoder_before_forward(int batch_size, int seq_len, int cur_step);
 
   void Infer() override;
@@ -73,6 +110,13 @@ class Transformer : public LSModel {
   DataType get_input_dtype(int index) override;
   DataType get_output_dtype(int index) override;
   void benchmark_mode(bool is_benchmark) override {}
+  std::vector<WarmupTiming> warmup(
+      const std::vector<std::vector<int>>& shapes) override {
+    return warmup_infer(this, _encoder.inp_tokens->value(true), shapes,
+                        {tw_._padding_id, tw_._end_id});
+  }
+  void set_next_input(int index, void* input_ptr,
+                      std::vector<int> shape) override;
 };
 
 LSMODEL_REGISTER(Transformer);
@@ -0,0 +1,319 @@
+#include "infer_pipeline.h"
+
+#include <algorithm>
+
+#include "declaration.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+size_t data_type_size(DataType dtype) {
+  switch (dtype) {
+    case kInt8:
+    case kByte:
+    case kUInt8:
+      return 1;
+    case kFloat16:
+    case kBFloat16:
+    case kInt16:
+    case kUInt16:
+      return 2;
+    case kInt64:
+    case kUInt64:
+    case kFloat64:
+      return 8;
+    default:
+      return 4;
+  }
+}
+
+size_t shape_size(const std::vector<int>& shape) {
+  size_t res = 1;
+  for (int dim : shape) res *= dim;
+  return res;
+}
+
+// the detokenized rows of a batch, one worker task per row.
+struct BatchOutput {
+  std::vector<std::string> texts;
+  std::atomic<int> num_left;
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  std::promise<std::vector<std::string>> texts_ready;
+  std::promise<void> done;
+};
+
+// the first error of the tasks of a promise is kept.
+template <typename T>
+void set_first_exception(std::promise<T>* promise) {
+  try {
+    promise->set_exception(std::current_exception());
+  } catch (const std::future_error&) {
+  }
+}
+
+}  // namespace
+
+InferPipeline::InferPipeline(LSModel* model, Tokenizer tokenizer,
+                             Detokenizer detokenizer, int pad_id,
+                             bool pad_left, int num_workers, int depth)
+    : _model(model),
+      _tokenizer(tokenizer),
+      _detokenizer(detokenizer),
+      _pad_id(pad_id),
+      _pad_left(pad_left),
+      _slots(std::max(depth, 1)) {
+  std::vector<int> input_shape = model->get_input_max_shape(0);
+  _max_batch_size = input_shape[0];
+  _max_seq_len = input_shape[1];
+  _max_output_size = shape_size(model->get_output_max_shape(0));
+  size_t input_size = size_t(_max_batch_size) * _max_seq_len;
+
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaGetDevice(&_device));
+  CHECK_GPU_ERROR(
+      cudaStreamCreateWithFlags(&_copy_stream, cudaStreamNonBlocking));
+#endif
+  for (Slot& slot : _slots) {
+    std::vector<size_t> output_bytes;
+    for (int i = 0; i < model->get_output_size(); i++) {
+      output_bytes.push_back(shape_size(model->get_output_max_shape(i)) *
+                             data_type_size(model->get_output_dtype(i)));
+    }
+#ifdef LIGHTSEQ_cuda
+    CHECK_GPU_ERROR(
+        cudaMallocHost((void**)&slot.host_input, input_size * sizeof(int)));
+    CHECK_GPU_ERROR(cudaMallocHost((void**)&slot.host_output,
+                                   _max_output_size * sizeof(int)));
+    CHECK_GPU_ERROR(cudaMalloc(&slot.device_input, input_size * sizeof(int)));
+    for (size_t bytes : output_bytes) {
+      void* output;
+      CHECK_GPU_ERROR(cudaMalloc(&output, bytes));
+      slot.device_outputs.push_back(output);
+    }
+    CHECK_GPU_ERROR(
+        cudaEventCreateWithFlags(&slot.input_copied, cudaEventDisableTiming));
+    CHECK_GPU_ERROR(
+        cudaEventCreateWithFlags(&slot.output_copied, cudaEventDisableTiming));
+#else
+    // the cpu models read and write host memory.
+    slot.host_input = new int[input_size];
+    slot.host_output = new int[_max_output_size];
+    slot.device_input = slot.host_input;
+    for (size_t bytes : output_bytes) {
+      slot.device_outputs.push_back(new char[bytes]);
+    }
+#endif
+  }
+
+  if (num_workers <= 0) {
+    num_workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (int i = 0; i < num_workers; i++) {
+    _workers.emplace_back(&InferPipeline::run_worker, this);
+  }
+}
+
+InferPipeline::~InferPipeline() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cond.notify_all();
+  // the workers finish the queued tasks first.
+  for (std::thread& worker : _workers) worker.join();
+
+  for (Slot& slot : _slots) {
+#ifdef LIGHTSEQ_cuda
+    cudaEventDestroy(slot.input_copied);
+    cudaEventDestroy(slot.output_copied);
+    cudaFreeHost(slot.host_input);
+    cudaFreeHost(slot.host_output);
+    cudaFree(slot.device_input);
+    for (void* output : slot.device_outputs) cudaFree(output);
+#else
+    delete[] slot.host_input;
+    delete[] slot.host_output;
+    for (void* output : slot.device_outputs) delete[](char*) output;
+#endif
+  }
+#ifdef LIGHTSEQ_cuda
+  cudaStreamDestroy(_copy_stream);
+#endif
+}
+
+void InferPipeline::run_worker() {
+#ifdef LIGHTSEQ_cuda
+  // the copies are issued on the device of the model.
+  CHECK_GPU_ERROR(cudaSetDevice(_device));
+#endif
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cond.wait(lock, [this] { return _stop || !_tasks.empty(); });
+      if (_tasks.empty()) return;
+      task = std::move(_tasks.front());
+      _tasks.pop();
+    }
+    task();
+  }
+}
+
+void InferPipeline::post(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _tasks.push(std::move(task));
+  }
+  _cond.notify_one();
+}
+
+void InferPipeline::stage_input(Batch* batch) {
+  Slot& slot = _slots[batch->slot];
+  int batch_size = batch->tokens.size();
+  int seq_len = 1;
+  for (auto& tokens : batch->tokens) {
+    seq_len = std::max(seq_len, int(tokens.size()));
+  }
+  seq_len = std::min(seq_len, _max_seq_len);
+  for (int i = 0; i < batch_size; i++) {
+    const std::vector<int>& tokens = batch->tokens[i];
+    int len = std::min(int(tokens.size()), seq_len);
+    int* row = slot.host_input + size_t(i) * seq_len;
+    std::fill(row, row + seq_len, _pad_id);
+    std::copy(tokens.begin(), tokens.begin() + len,
+              row + (_pad_left ? seq_len - len : 0));
+  }
+  batch->seq_len = seq_len;
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaMemcpyAsync(slot.device_input, slot.host_input,
+                                  size_t(batch_size) * seq_len * sizeof(int),
+                                  cudaMemcpyHostToDevice, _copy_stream));
+  CHECK_GPU_ERROR(cudaEventRecord(slot.input_copied, _copy_stream));
+#endif
+}
+
+void InferPipeline::submit(std::vector<std::string> texts) {
+  if (_pending.size() == _slots.size()) {
+    throw std::runtime_error("InferPipeline: " +
+                             std::to_string(_slots.size()) +
+                             " batches are already pending");
+  }
+  if (texts.empty() || int(texts.size()) > _max_batch_size) {
+    throw std::runtime_error("InferPipeline: a batch of " +
+                             std::to_string(texts.size()) +
+                             " texts, the max batch size is " +
+                             std::to_string(_max_batch_size));
+  }
+  // the batches take the slots in turn, the last batch of this slot is
+  // inferred already, so its input buffers are free.
+  std::shared_ptr<Batch> batch(new Batch());
+  batch->slot = _next_slot;
+  _next_slot = (_next_slot + 1) % _slots.size();
+  batch->texts = std::move(texts);
+  batch->tokens.resize(batch->texts.size());
+  batch->num_left = batch->texts.size();
+  _pending.push_back(batch);
+
+  for (int i = 0; i < batch->texts.size(); i++) {
+    post([this, batch, i] {
+      try {
+        batch->tokens[i] = _tokenizer(batch->texts[i]);
+      } catch (...) {
+        set_first_exception(&batch->input_ready);
+      }
+      // the last text tokenized uploads the batch.
+      if (--batch->num_left > 0) return;
+      try {
+        stage_input(batch.get());
+        batch->input_ready.set_value();
+      } catch (...) {
+        set_first_exception(&batch->input_ready);
+      }
+    });
+  }
+}
+
+std::future<std::vector<std::string>> InferPipeline::infer_next() {
+  if (_pending.empty()) {
+    throw std::runtime_error("InferPipeline: no batch is pending");
+  }
+  std::shared_ptr<Batch> batch = _pending.front();
+  Slot& slot = _slots[batch->slot];
+  try {
+    batch->input_ready.get_future().get();
+  } catch (...) {
+    _pending.pop_front();
+    throw;
+  }
+  // the output of the last batch of the slot may still be detokenized.
+  if (slot.output_done.valid()) slot.output_done.wait();
+  int batch_size = batch->texts.size();
+
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaEventSynchronize(slot.input_copied));
+#endif
+  _model->set_input_ptr(0, slot.device_input);
+  _model->set_input_shape(0, {batch_size, batch->seq_len});
+  for (int i = 0; i < slot.device_outputs.size(); i++) {
+    _model->set_output_ptr(i, slot.device_outputs[i]);
+  }
+  _model->Infer();
+  _pending.pop_front();
+
+  // [batch_size, beam_size, seq_len] or [batch_size, seq_len], the first
+  // beam of a row is read.
+  std::vector<int> output_shape = _model->get_output_shape(0);
+  size_t output_size = std::min(shape_size(output_shape), _max_output_size);
+  size_t row_stride = output_size / batch_size;
+  int row_len = output_shape.back();
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaMemcpyAsync(slot.host_output, slot.device_outputs[0],
+                                  output_size * sizeof(int),
+                                  cudaMemcpyDeviceToHost, _copy_stream));
+  CHECK_GPU_ERROR(cudaEventRecord(slot.output_copied, _copy_stream));
+#else
+  std::copy((int*)slot.device_outputs[0],
+            (int*)slot.device_outputs[0] + output_size, slot.host_output);
+#endif
+
+  std::shared_ptr<BatchOutput> output(new BatchOutput());
+  output->texts.resize(batch_size);
+  output->num_left = batch_size;
+  std::future<std::vector<std::string>> res =
+      output->texts_ready.get_future();
+  slot.output_done = output->done.get_future().share();
+  for (int i = 0; i < batch_size; i++) {
+    post([this, &slot, output, i, row_stride, row_len] {
+      try {
+#ifdef LIGHTSEQ_cuda
+        CHECK_GPU_ERROR(cudaEventSynchronize(slot.output_copied));
+#endif
+        const int* row = slot.host_output + i * row_stride;
+        std::vector<int> tokens;
+        tokens.reserve(row_len);
+        for (int j = 0; j < row_len; j++) {
+          if (row[j] != _pad_id) tokens.push_back(row[j]);
+        }
+        output->texts[i] = _detokenizer(tokens);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(output->error_mutex);
+        output->error = std::current_exception();
+      }
+      // the last row detokenized frees the slot and sets the texts.
+      if (--output->num_left > 0) return;
+      output->done.set_value();
+      if (output->error) {
+        output->texts_ready.set_exception(output->error);
+      } else {
+        output->texts_ready.set_value(std::move(output->texts));
+      }
+    });
+  }
+  return res;
+}
+
+}  // namespace cuda
+}  // namespace lightseq
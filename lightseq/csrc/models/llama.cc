@@ -1,72 +1,483 @@
 #include "llama.h"
+#include "profiler.h"
+#include "metrics.h"
+#include <algorithm>
+#include <chrono>
 
 namespace lightseq {
 namespace cuda {
-Llama::Llama(const std::string weight_path, const int max_batch_size)
-    : LSModel({"token_ids"}, {"llama_out"}), _max_batch_size(max_batch_size) {
+
+namespace {
+// the memory plan of continuous batching, the buckets of Infer are positive.
+const MemoryManager::PlanKey kServingPlanKey = {0, 0};
+// the plan of one row of memory_profile.
+const MemoryManager::PlanKey kProfilePlanKey = {0, -2};
+}  // namespace
+
+template <typename OpType_>
+Llama<OpType_>::Llama(const std::string weight_path, const int max_batch_size,
+                      const ModelOptions &options)
+    : LSModel({"token_ids"}, {"llama_out"}),
+      _max_batch_size(max_batch_size),
+      _request_slots(max_batch_size),
+      _token_streamer(max_batch_size) {
   /* --- step.1 initial context --- */
-  Context::create_global_context(StatusType::Inference);
-  _context_ptr = Context::global_instance();
+  // All the options of the models, see ModelOptions, are listed in
+  // docs/environment.md.
+  // Tensor parallelism runs one process per gpu, configured by the options:
+  //   tp_size  number of ranks, 1 or unset to disable
+  //   tp_rank  rank of this process, which also picks its gpu
+  //   nccl_id_file  file shared by the ranks to exchange the nccl id, must
+  //                 be unique to the launch, required when tp_size > 1
+  //   tp_all_reduce_int8  1 quantizes the all-reduces of the layers to int8
+  //                       for the communication
+  //   tp_one_shot_bytes  all-reduces of at most these bytes, the decode
+  //                      ones, run in one kernel over the peer mapped
+  //                      workspaces of the ranks
+  //   tp_overlap_chunks  chunks of tokens the row parallel gemms of the
+  //                      prefill are split into, to overlap them with their
+  //                      all-reduces
+  // Pipeline parallelism runs in this process instead:
+  //   pp_size  number of stages, stage s runs a contiguous part of the
+  //            layers on gpu s, 1 or unset to disable
+  //   pp_micro_batches  micro-batches a batch is split into, the stages work
+  //                     on different micro-batches at the same time, pp_size
+  //                     by default
+  const char *tp_size_opt = model_option(options, "tp_size");
+  const char *tp_rank_opt = model_option(options, "tp_rank");
+  const char *nccl_id_opt = model_option(options, "nccl_id_file");
+  const char *tp_int8_opt = model_option(options, "tp_all_reduce_int8");
+  const char *one_shot_opt = model_option(options, "tp_one_shot_bytes");
+  const char *overlap_opt = model_option(options, "tp_overlap_chunks");
+  const char *pp_size_opt = model_option(options, "pp_size");
+  const char *micro_batches_opt = model_option(options, "pp_micro_batches");
+  int tp_size = tp_size_opt ? std::max(std::atoi(tp_size_opt), 1) : 1;
+  int tp_rank = tp_rank_opt ? std::atoi(tp_rank_opt) : 0;
+  int pp_size = pp_size_opt ? std::max(std::atoi(pp_size_opt), 1) : 1;
+  if (pp_size > 1) {
+    int num_devices = 0;
+    CHECK_GPU_ERROR(cudaGetDeviceCount(&num_devices));
+    if (tp_size > 1 || pp_size > num_devices) {
+      std::string error_message =
+          "pipeline parallel of " + std::to_string(pp_size) +
+          " stages needs as many gpus and no tensor parallel\n";
+      printf("%s", error_message.c_str());
+      throw std::runtime_error(error_message);
+    }
+  }
+  _context_ptr = std::make_shared<Context>(
+      StatusType::Inference,
+      tp_size > 1 ? tp_rank : (pp_size > 1 ? 0 : -1));
+  // the graph of the model is created in its own context, the pipeline
+  // stages switch the scope to theirs, see enter_stage.
+  ContextScope context_scope(_context_ptr);
+  if (tp_size > 1) {
+    // a fixed default would let the ranks read the id of a previous launch
+    // and hang in ncclCommInitRank.
+    if (nccl_id_opt == nullptr || *nccl_id_opt == 0) {
+      std::string error_message =
+          "tensor parallel needs nccl_id_file unique to the launch\n";
+      printf("%s", error_message.c_str());
+      throw std::runtime_error(error_message);
+    }
+    std::string nccl_id_path = nccl_id_opt;
+    _context_ptr->init_tensor_parallel(tp_rank, tp_size, nccl_id_path);
+    _context_ptr->set_tp_all_reduce_int8(tp_int8_opt &&
+                                         std::atoi(tp_int8_opt) > 0);
+    if (overlap_opt) {
+      _context_ptr->set_tp_overlap_chunks(std::atoi(overlap_opt));
+    }
+    if (one_shot_opt) {
+      _context_ptr->init_one_shot_all_reduce(
+          std::max(std::atoll(one_shot_opt), 0LL), nccl_id_path + ".ipc");
+    }
+    tw_.set_tensor_parallel(tp_rank, tp_size);
+  }
+  if (pp_size > 1) {
+    tw_.set_pipeline_parallel(pp_size);
+    _stages.resize(pp_size);
+    _stages[0].context = _context_ptr;
+    _num_micro_batches =
+        micro_batches_opt ? std::max(std::atoi(micro_batches_opt), 1)
+                          : pp_size;
+  }
+
+  // weight_quant_bits=8 or 4 quantizes the fp32 kernels of the
+  // layers at load, with one scale per weight_quant_group_size
+  // rows, the whole column by default for int8 and 128 rows for int4.
+  // Kernels stored quantized in the model file are used as they are.
+  const char *quant_bits_opt = model_option(options, "weight_quant_bits");
+  const char *quant_group_opt =
+      model_option(options, "weight_quant_group_size");
+  if (quant_bits_opt) {
+    tw_.set_weight_quant(std::atoi(quant_bits_opt),
+                         quant_group_opt ? std::atoi(quant_group_opt) : 0);
+  }
+  // fp8=1 quantizes the fp32 kernels of the layers to fp8 e4m3 at
+  // load and runs their linears in fp8, which needs a sm_89 or later gpu and
+  // the calibrated input scales in the model file, see Fp8LinearOp.
+  const char *fp8_opt = model_option(options, "fp8");
+  bool fp8 = fp8_opt && std::atoi(fp8_opt) > 0;
+  if (fp8) {
+    int device, major, minor;
+    CHECK_GPU_ERROR(cudaGetDevice(&device));
+    CHECK_GPU_ERROR(cudaDeviceGetAttribute(
+        &major, cudaDevAttrComputeCapabilityMajor, device));
+    CHECK_GPU_ERROR(cudaDeviceGetAttribute(
+        &minor, cudaDevAttrComputeCapabilityMinor, device));
+    if (major * 10 + minor < 89) {
+      printf("fp8 needs compute capability 8.9, got %d.%d, use %s kernels.\n",
+             major, minor, precision_name(g_dtype<OpType_>()));
+      fp8 = false;
+    } else if (quant_bits_opt) {
+      printf("fp8 does not support weight quantization, use %s kernels.\n",
+             precision_name(g_dtype<OpType_>()));
+      fp8 = false;
+    }
+  }
+  tw_.set_fp8(fp8);
+  // int8=1 quantizes the fp32 kernels of the layers to int8 per
+  // output channel at load and runs their linears in int8 with the
+  // activations quantized per token, smoothed by the factors of the model
+  // file when it has them, see LlamaWeight::set_int8. The files of mixed
+  // precision run only the layers of model_conf/int8_layers in int8.
+  const char *int8_opt = model_option(options, "int8");
+  bool int8 = int8_opt && std::atoi(int8_opt) > 0;
+  if (int8 && (fp8 || quant_bits_opt)) {
+    printf("int8 does not support fp8 or weight quantization, use %s "
+           "kernels.\n",
+           fp8 ? "fp8" : "weight quantized");
+    int8 = false;
+  }
+  tw_.set_int8(int8);
+  // offload_layers=1 keeps the layer weights in pinned host memory
+  // and streams them to the gpu two layers at a time, overlapped with the
+  // compute of the previous layer, for models larger than the gpu memory.
+  const char *offload_opt = model_option(options, "offload_layers");
+  tw_.set_offload_layers(offload_opt && std::atoi(offload_opt) > 0);
+  // emb_quant=1 keeps the token embedding and the logits kernel in
+  // int8 with one scale per token, which quarters the memory and the
+  // bandwidth of a large vocabulary against fp32.
+  const char *emb_quant_opt = model_option(options, "emb_quant");
+  tw_.set_emb_quant(emb_quant_opt && std::atoi(emb_quant_opt) > 0);
 
   /* --- step.2 load model weights into GPU memory --- */
-  // saved in custom proto file
+  // saved in custom proto file, or in a .lsw flat weight file, which loads
+  // with the quantization it was saved with. save_flat_weight=path
+  // saves the loaded weights as a flat weight file for a faster startup of
+  // the same dtype and tensor parallel rank, see LlamaWeight::save_flat.
   std::string model_weights_path = weight_path;
   std::string res = tw_.initializing(model_weights_path);
   if (!res.empty()) {
     throw std::runtime_error(res);
   }
+  const char *save_flat_opt = model_option(options, "save_flat_weight");
+  if (save_flat_opt && *save_flat_opt) {
+    tw_.save_flat(save_flat_opt);
+  }
+  if (tw_.offload_layers()) {
+    CHECK_GPU_ERROR(
+        cudaStreamCreateWithFlags(&_offload_stream, cudaStreamNonBlocking));
+    for (int slot = 0; slot < 2; slot++) {
+      CHECK_GPU_ERROR(
+          cudaEventCreateWithFlags(&_slot_ready[slot], cudaEventDisableTiming));
+      CHECK_GPU_ERROR(
+          cudaEventCreateWithFlags(&_slot_free[slot], cudaEventDisableTiming));
+    }
+    printf("*** layer weights streamed from host memory, %zu MB a layer ***\n",
+           tw_.layer_wei_bytes() / (1024 * 1024));
+  }
   printf("*** model max_batch_size: %d ***\n", max_batch_size);
   _generate_method = get_generate_method(tw_._generate_method);
   if (_generate_method != GenerateMethod::BeamSearch) {
     tw_._beam_size = 1;
   }
   tw_.print_model_config();
+  if (!_stages.empty() && _generate_method == GenerateMethod::BeamSearch) {
+    // the beams reorder the caches of all the layers at once.
+    std::string error_message =
+        "pipeline parallel does not support beam search\n";
+    printf("%s", error_message.c_str());
+    throw std::runtime_error(error_message);
+  }
 
   /* --- step.3 initial input Variable node --- */
   _inp_tokens = new Variable("inp_tokens", g_dtype<int>());
 
+  // The paged kv cache is configured by the options:
+  //   kv_page_size  tokens per page, 0 or unset for the dense cache
+  //   kv_num_pages  pages in the pool, enough for every sequence to reach
+  //                 max_step by default
+  //   kv_prefix_cache  0 to disable the reuse of the pages of past prompts
+  //                    by continuous batching
+  //   prefill_chunk  most prompt tokens prefilled by one step of continuous
+  //                  batching, 0 or unset for no limit
+  //   kv_serving_plan  0 to run continuous batching on the memory plan of
+  //                    Infer, rather than on a plan which turns the prompt
+  //                    activations into kv pages
+  //   stop_check_interval  decoding steps between two waits for the stop
+  //                        flag of sampling, 1 by default
+  const char *page_size_opt = model_option(options, "kv_page_size");
+  int page_size = page_size_opt ? std::atoi(page_size_opt) : 0;
+  if (page_size > 0 && _generate_method == GenerateMethod::BeamSearch) {
+    printf("paged kv cache does not support beam search, use dense cache.\n");
+    page_size = 0;
+  }
+  if (page_size > 0 && !_stages.empty()) {
+    printf("paged kv cache does not support pipeline parallel, use dense "
+           "cache.\n");
+    page_size = 0;
+  }
+  // attn_window=W attends to the W positions up to every token
+  // only, and to the first attn_sink_tokens positions, the
+  // attention sinks, 0 by default. The dense caches then hold the sinks, the
+  // window and one prefill chunk, whose rows are reused as a ring, so their
+  // memory and the cost of a decoding step do not grow with the generation.
+  const char *attn_window_opt = model_option(options, "attn_window");
+  int attn_window =
+      attn_window_opt ? std::max(std::atoi(attn_window_opt), 0) : 0;
+  if (attn_window > 0 &&
+      (page_size > 0 || _generate_method == GenerateMethod::BeamSearch)) {
+    printf("attention window does not support %s, attend to the whole "
+           "prefix.\n",
+           page_size > 0 ? "paged kv cache" : "beam search");
+    attn_window = 0;
+  }
+  int attn_sink = 0;
+  if (attn_window > 0) {
+    const char *sink_opt = model_option(options, "attn_sink_tokens");
+    attn_sink = sink_opt ? std::max(std::atoi(sink_opt), 0) : 0;
+    attn_sink = std::min(attn_sink, tw_._max_step - 1);
+    const char *prefill_chunk_opt = model_option(options, "prefill_chunk");
+    int chunk = prefill_chunk_opt ? std::atoi(prefill_chunk_opt) : 0;
+    _prefill_chunk_size = chunk > 0 ? chunk : std::min(attn_window, 512);
+    // the first query of a chunk still sees its whole window.
+    _kv_ring_len = std::min(attn_sink + attn_window + _prefill_chunk_size - 1,
+                            tw_._max_step);
+    printf("*** attention window of %d tokens, %d sink tokens, kv cache of "
+           "%d tokens ***\n",
+           attn_window, attn_sink, _kv_ring_len);
+  }
+  // kv_heavy_hitters=1 turns the sinks of the attention window into
+  // heavy hitters: the keys of the most attention mass, accumulated by the
+  // softmax, outside the window take their rows as the window moves on, so
+  // the cache keeps the attn_sink_tokens keys which matter the most
+  // rather than the first ones, see FlashAttentionOp::set_heavy_hitters.
+  const char *heavy_hitters_opt = model_option(options, "kv_heavy_hitters");
+  bool heavy_hitters = heavy_hitters_opt && std::atoi(heavy_hitters_opt) > 0;
+  if (heavy_hitters && (attn_sink == 0 || !_stages.empty())) {
+    printf("heavy hitters need %s, keep the sink tokens.\n",
+           attn_sink == 0 ? "attn_window and "
+                            "attn_sink_tokens"
+                          : "a single pipeline stage");
+    heavy_hitters = false;
+  }
+  // kv_cache_int8=1 stores the kv cache in int8, which halves its
+  // memory in fp16.
+  const char *cache_int8_opt = model_option(options, "kv_cache_int8");
+  bool cache_int8 = cache_int8_opt && std::atoi(cache_int8_opt) > 0;
+  if (cache_int8 && _generate_method == GenerateMethod::BeamSearch) {
+    printf("int8 kv cache does not support beam search, use %s cache.\n",
+           precision_name(g_dtype<OpType_>()));
+    cache_int8 = false;
+  }
+  if (cache_int8 && !_stages.empty()) {
+    printf("int8 kv cache does not support pipeline parallel, use %s cache.\n",
+           precision_name(g_dtype<OpType_>()));
+    cache_int8 = false;
+  }
+
+  // moe_capacity_factor=F gives every expert of the moe models the
+  // slots of F * topk * tokens / experts tokens, the tokens beyond are
+  // dropped, which bounds the memory of the experts. 0, the default, never
+  // drops a token.
+  float moe_capacity_factor = 0.f;
+  if (tw_._expert_num > 0) {
+    const char *capacity_opt = model_option(options, "moe_capacity_factor");
+    moe_capacity_factor =
+        capacity_opt ? std::max(float(std::atof(capacity_opt)), 0.f) : 0.f;
+  }
+
+  // the mlp kernels of the layers of model_conf/sparse24_layers are pruned
+  // 2:4 and run on the sparse tensor cores, compressed at load.
+  bool sparse24 = !tw_._sparse24_layers.empty();
+  if (sparse24 && (!_stages.empty() || tw_.offload_layers())) {
+    printf("2:4 sparse layers do not support pipeline parallel or offloaded "
+           "layers, dense ones are used.\n");
+    sparse24 = false;
+  }
+
   /* --- step.4 inital operator & layer --- */
   int max_batch_tokens = tw_._max_step * _max_batch_size;
   _launch_llama_emb_layer.reset(new LaunchLlamaEmbLayer<OpType_>(
       max_batch_tokens, tw_._max_step, _max_batch_size, tw_._beam_size,
-      tw_._padding_id, tw_._hidden_size));
-  _launch_llama_emb_layer->load_params(tw_.get_src_emb_wei(), 0);
+      tw_._padding_id, tw_._hidden_size, tw_._emb_quant));
 
-  int enc_wei_offset = 0;
+  // one rotary table for the layers of a device.
+  RopeScaling rope_scaling;
+  rope_scaling.theta = tw_._rope_theta;
+  rope_scaling.type = tw_._rope_scaling_type;
+  rope_scaling.factor = tw_._rope_scaling_factor;
+  rope_scaling.original_max_step = tw_._rope_original_max_step;
+  OpType_* rope_sin = nullptr;
+  OpType_* rope_cos = nullptr;
   for (int idx = 0; idx < tw_._layer_num; idx++) {
+    if (!_stages.empty()) {
+      // the layers of a stage are created in its context, on its device.
+      int stage = tw_.layer_stage(idx);
+      if (_stages[stage].context == nullptr) {
+        _stages[stage].layer_begin = idx;
+        rope_sin = nullptr;
+      }
+      _stages[stage].layer_end = idx + 1;
+      enter_stage(stage, &context_scope);
+    }
+    if (rope_sin == nullptr) {
+      make_rotary_table(Context::global_instance().get(), rope_scaling,
+                        tw_._max_step, tw_._dim_per_head, &rope_sin,
+                        &rope_cos);
+    }
     LlamaLayerPtr<OpType_, OpType_> llama_layer(
         new LlamaLayer<OpType_, OpType_>(max_batch_size, tw_._max_step,
                                          tw_._hidden_size, tw_._inner_size,
-                                         tw_._head_num, tw_._beam_size));
-    enc_wei_offset +=
-        llama_layer->load_params(tw_.get_enc_wei(), enc_wei_offset);
+                                         tw_._head_num, tw_._beam_size,
+                                         page_size, tw_._kv_head_num,
+                                         tw_._weight_quant_bits,
+                                         tw_._weight_quant_group_size,
+                                         tw_._fp8, tw_.int8(idx),
+                                         tw_._expert_num,
+                                         tw_._moe_topk, moe_capacity_factor,
+                                         sparse24 && tw_.sparse24(idx)));
+    llama_layer->set_rotary_table(rope_sin, rope_cos);
+    if (_kv_ring_len) {
+      llama_layer->set_attention_window(attn_sink, attn_window,
+                                        _kv_ring_len - attn_sink);
+    }
     _llama_layer_vec.push_back(llama_layer);
   }
+  if (!_stages.empty()) {
+    enter_stage(0, &context_scope);
+  }
 
   _rms_norm_layer.reset(
       new RMSNormLayer<OpType_, OpType_>(max_batch_tokens, tw_._hidden_size));
-  _rms_norm_layer->load_params(tw_.get_src_emb_wei(), 1);
 
-  // intial Project hidden states to vocab logits
+  // intial Project hidden states to vocab logits, also the logits of every
+  // verified token of speculative decoding.
   _linear_layer.reset(new LinearLayer<OpType_, OpType_>(
-      max_batch_size * tw_._beam_size, tw_._hidden_size, tw_._src_vocab_size,
-      MATRIX_OP::NonTranspose, MATRIX_OP::NonTranspose, 1.f));
-  _linear_layer->load_params(tw_.get_src_emb_wei(), 2);
+      std::max(max_batch_size * tw_._beam_size, kMaxDraftTokens + 1),
+      tw_._hidden_size, tw_._src_vocab_size,
+      MATRIX_OP::NonTranspose, MATRIX_OP::NonTranspose, 1.f,
+      tw_._emb_quant ? 8 : 0, kLogitsDequantCols));
+  load_params();
 
+  // the kv caches hold the kv heads of this tensor parallel rank, which is
+  // what beam search reorders.
+  int kv_head_num = tw_._kv_head_num / tp_size;
+  size_t kv_hidden_size = kv_head_num * tw_._dim_per_head;
   _generator_layer.reset(new GeneratorLayer<OpType_>(
       _generate_method, tw_._layer_num, max_batch_size, tw_._max_step,
-      tw_._src_vocab_size, tw_._hidden_size, 1024, tw_._beam_size,
-      tw_._diverse_lambda, tw_._dim_per_head, tw_._eos_id, tw_._head_num,
+      tw_._src_vocab_size, kv_hidden_size, 1024, tw_._beam_size,
+      tw_._diverse_lambda, tw_._dim_per_head, tw_._eos_id, kv_head_num,
       tw_._length_penalty, tw_._topk, tw_._topp, false));
+  const char *stop_check_opt = model_option(options, "stop_check_interval");
+  if (stop_check_opt) {
+    _generator_layer->set_stop_check_interval(std::atoi(stop_check_opt));
+  }
+  const char *graph_steps_opt = model_option(options, "graph_decode_steps");
+  if (graph_steps_opt) {
+    _graph_decode_steps = std::max(std::atoi(graph_steps_opt), 1);
+  }
+  // the score margins of beam pruning, see transformer.cu.
+  const char *prune_abs_opt = model_option(options, "beam_prune_abs");
+  const char *prune_rel_opt = model_option(options, "beam_prune_rel");
+  _generator_layer->set_beam_pruning(
+      prune_abs_opt ? std::atof(prune_abs_opt) : 0.f,
+      prune_rel_opt ? std::atof(prune_rel_opt) : 0.f);
+  // lora_slots adapters are resident on the gpu at once, of rank
+  // lora_max_rank at most, see load_lora_adapter.
+  const char *slots_opt = model_option(options, "lora_slots");
+  const char *max_rank_opt = model_option(options, "lora_max_rank");
+  if (slots_opt) _lora_slots = std::atoi(slots_opt);
+  if (max_rank_opt) _lora_max_rank = std::atoi(max_rank_opt);
 
   /* --- step.5 construct network --- */
-  size_t cache_size = max_batch_tokens * tw_._beam_size * tw_._hidden_size;
-  _total_caches_k = new Variable("total_caches_k", cache_size * tw_._layer_num,
-                                 g_dtype<OpType_>(), DataType::kNotSupported,
-                                 VariableType::RegressiveVariable);
-  _total_caches_v = new Variable("total_caches_v", cache_size * tw_._layer_num,
-                                 g_dtype<OpType_>(), DataType::kNotSupported,
-                                 VariableType::RegressiveVariable);
+  size_t cache_size = max_batch_tokens * tw_._beam_size * kv_hidden_size;
+  if (_kv_ring_len) {
+    cache_size = size_t(_max_batch_size) * _kv_ring_len * kv_hidden_size;
+  }
+  if (page_size > 0) {
+    int max_seqs = _max_batch_size * tw_._beam_size;
+    int max_pages = (tw_._max_step + page_size - 1) / page_size;
+    const char *num_pages_opt = model_option(options, "kv_num_pages");
+    int num_pages =
+        num_pages_opt ? std::atoi(num_pages_opt) : max_seqs * max_pages;
+    _kv_page_table.reset(
+        new KVPageTable(num_pages, page_size, max_seqs, tw_._max_step));
+    const char *prefill_chunk_opt = model_option(options, "prefill_chunk");
+    _prefill_chunk_size =
+        prefill_chunk_opt ? std::max(std::atoi(prefill_chunk_opt), 0) : 0;
+    const char *prefix_cache_opt = model_option(options, "kv_prefix_cache");
+    if (!prefix_cache_opt || std::atoi(prefix_cache_opt) != 0) {
+      _prefix_cache.reset(new KVPrefixCache(_kv_page_table));
+    }
+    const char *serving_plan_opt = model_option(options, "kv_serving_plan");
+    _serving_plan = !serving_plan_opt || std::atoi(serving_plan_opt) != 0;
+    _page_cache_size = size_t(page_size) * kv_hidden_size;
+    _prompt_num_pages = num_pages;
+    cache_size = num_pages * _page_cache_size;
+    printf("*** paged kv cache: %d pages of %d tokens ***\n", num_pages,
+           page_size);
+  }
+  _cache_size = cache_size;
+  DataType cache_dtype = cache_int8 ? g_dtype<int8_t>() : g_dtype<OpType_>();
+  // with pipeline parallel, the caches of the other stages are on their
+  // devices.
+  int num_cache_layers =
+      _stages.empty() ? tw_._layer_num : _stages[0].layer_end;
+  _total_caches_k = new Variable(
+      "total_caches_k", cache_size * num_cache_layers, cache_dtype,
+      DataType::kNotSupported, VariableType::RegressiveVariable);
+  _total_caches_v = new Variable(
+      "total_caches_v", cache_size * num_cache_layers, cache_dtype,
+      DataType::kNotSupported, VariableType::RegressiveVariable);
+  if (cache_int8) {
+    printf("*** int8 kv cache ***\n");
+  }
+  if (_generate_method == GenerateMethod::BeamSearch || _stages.empty()) {
+    _kv_rows = new Variable("kv_rows", g_dtype<int>());
+    _kv_rows->malloc_memory(size_t(max_batch_size) * tw_._beam_size *
+                            tw_._max_step);
+    for (auto iter : _llama_layer_vec) {
+      if (!iter->set_kv_rows(_kv_rows->value<int>())) {
+        _kv_rows = nullptr;
+        break;
+      }
+    }
+    if (_generate_method != GenerateMethod::BeamSearch) {
+      // sampling reads through it only for the samples sharing a prefill.
+      for (auto iter : _llama_layer_vec) iter->set_kv_rows(nullptr);
+    } else if (_kv_rows) {
+      // the copied caches are not even allocated.
+      _generator_layer->use_kv_rows();
+    }
+  }
+  if (heavy_hitters) {
+    size_t heavy_size = size_t(_max_batch_size) * kv_head_num * attn_sink;
+    size_t mass_size = size_t(_max_batch_size) * kv_head_num * _kv_ring_len;
+    _kv_heavy_pos_size = heavy_size * tw_._layer_num;
+    _kv_mass_size = mass_size * tw_._layer_num;
+    _kv_heavy_pos = new Variable("kv_heavy_pos", g_dtype<int>());
+    _kv_heavy_pos->malloc_memory(_kv_heavy_pos_size);
+    _kv_mass = new Variable("kv_mass", g_dtype<float>());
+    _kv_mass->malloc_memory(_kv_mass_size);
+    for (int idx = 0; idx < tw_._layer_num; idx++) {
+      _llama_layer_vec[idx]->set_heavy_hitters(
+          _kv_heavy_pos->value<int>() + idx * heavy_size,
+          _kv_mass->value<float>() + idx * mass_size);
+    }
+    printf("*** %d heavy hitters in the kv cache ***\n", attn_sink);
+  }
 
   // note regress begin
   _context_ptr->regress_begin();
@@ -76,14 +487,22 @@ Llama::Llama(const std::string weight_path, const int max_batch_size)
   Variable *llama_emb = std::get<0>(llama_emb_outs);
   Variable *pad_mask = std::get<1>(llama_emb_outs);
   pad_mask->set_regress_var();
-  size_t cache_offset = 0;
-  for (auto iter : _llama_layer_vec) {
-    Variable *cache_k = new Variable("cache_k", _total_caches_k);
-    cache_k->set_offset(cache_offset, {cache_size});
-    Variable *cache_v = new Variable("cache_v", _total_caches_v);
-    cache_v->set_offset(cache_offset, {cache_size});
-    llama_emb = (*iter)(llama_emb, cache_k, cache_v, pad_mask);
-    cache_offset += cache_size;
+  if (_stages.empty()) {
+    size_t cache_offset = 0;
+    for (auto iter : _llama_layer_vec) {
+      Variable *cache_k = new Variable("cache_k", _total_caches_k);
+      cache_k->set_offset(cache_offset, {cache_size});
+      Variable *cache_v = new Variable("cache_v", _total_caches_v);
+      cache_v->set_offset(cache_offset, {cache_size});
+      llama_emb = (*iter)(llama_emb, cache_k, cache_v, pad_mask);
+      cache_offset += cache_size;
+      _caches_k.push_back(cache_k);
+      _caches_v.push_back(cache_v);
+    }
+  } else {
+    llama_emb =
+        construct_pipeline(llama_emb, pad_mask, cache_size, cache_dtype,
+                           &context_scope);
   }
   llama_emb = (*_rms_norm_layer)(llama_emb);
   Variable *logits_prob = (*_linear_layer)(llama_emb);
@@ -97,14 +516,368 @@ Llama::Llama(const std::string weight_path, const int max_batch_size)
   _out_tokens = std::get<0>(gen_outs);
   _inp_tokens->malloc_memory(max_batch_size * tw_._beam_size * tw_._max_step);
   _out_tokens->malloc_memory(max_batch_size * tw_._beam_size * tw_._max_step);
+  _step_offset = new Variable("step_offset", g_dtype<int>());
+  _step_offset->malloc_memory(1);
+  if (_kv_page_table) {
+    _page_table = new Variable("page_table", g_dtype<int>());
+    // up to max_step - 1 rows of a continuous batching step, see step().
+    _page_table->malloc_memory(
+        std::max(_kv_page_table->table().size(),
+                 size_t(tw_._max_step) * _kv_page_table->max_pages()));
+    for (auto iter : _llama_layer_vec) {
+      iter->set_page_table(_page_table->value<int>());
+    }
+  }
+  _seq_offsets = new Variable("seq_offsets", g_dtype<int>());
+  _seq_offsets->malloc_memory(tw_._max_step);
+  _sample_rows = new Variable("sample_rows", g_dtype<int>());
+  _sample_rows->malloc_memory(tw_._max_step);
+  if (cache_int8) {
+    size_t scale_size = cache_size / tw_._dim_per_head;
+    _total_caches_k_scale =
+        new Variable("total_caches_k_scale", g_dtype<float>());
+    _total_caches_k_scale->malloc_memory(scale_size * tw_._layer_num);
+    _total_caches_v_scale =
+        new Variable("total_caches_v_scale", g_dtype<float>());
+    _total_caches_v_scale->malloc_memory(scale_size * tw_._layer_num);
+#ifdef LIGHTSEQ_cuda
+    // positions which are never written must dequantize to zeros.
+    CHECK_GPU_ERROR(cudaMemset(_total_caches_k_scale->value(), 0,
+                               scale_size * tw_._layer_num * sizeof(float)));
+    CHECK_GPU_ERROR(cudaMemset(_total_caches_v_scale->value(), 0,
+                               scale_size * tw_._layer_num * sizeof(float)));
+#endif
+    for (int idx = 0; idx < tw_._layer_num; idx++) {
+      _llama_layer_vec[idx]->set_kv_cache_scales(
+          _total_caches_k_scale->value<float>() + idx * scale_size,
+          _total_caches_v_scale->value<float>() + idx * scale_size);
+    }
+  }
+  // kv_host_mb=M keeps the kv of the finished requests of a
+  // session, see add_request, and of the preempted requests in up to M MB of
+  // pinned host memory, so the next request of the session and the resumed
+  // request restore it rather than running its prefill again. The restore is
+  // copied layer by layer on a stream of its own, and every layer of the
+  // next step only waits for its own pages. kv_host_int8=1 keeps
+  // the kv in int8 with one scale per head vector, as the int8 kv cache.
+  const char *kv_host_opt = model_option(options, "kv_host_mb");
+  size_t kv_host_mb = kv_host_opt ? std::max(std::atoi(kv_host_opt), 0) : 0;
+  if (kv_host_mb > 0 && !_kv_page_table) {
+    printf("kv host offload needs the paged kv cache, set "
+           "kv_page_size.\n");
+    kv_host_mb = 0;
+  }
+  int host_pages = 0;
+  if (kv_host_mb > 0) {
+    const char *kv_host_int8_opt = model_option(options, "kv_host_int8");
+    _kv_host_int8 = cache_int8 ||
+                    (kv_host_int8_opt && std::atoi(kv_host_int8_opt) > 0);
+    size_t page_vecs = _page_cache_size / tw_._dim_per_head;
+    size_t vec_bytes =
+        _kv_host_int8 ? tw_._dim_per_head * sizeof(int8_t) + sizeof(float)
+                      : tw_._dim_per_head * sizeof(OpType_);
+    size_t page_bytes = 2 * tw_._layer_num * page_vecs * vec_bytes;
+    host_pages = kv_host_mb * 1024 * 1024 / page_bytes;
+    if (host_pages == 0) {
+      printf("kv host offload of %zu MB can not hold a page of %zu bytes, "
+             "disabled.\n",
+             kv_host_mb, page_bytes);
+    }
+  }
+  if (host_pages > 0) {
+    size_t page_vecs = _page_cache_size / tw_._dim_per_head;
+    _kv_host_cache.reset(new KVHostCache(host_pages, page_size));
+#ifdef LIGHTSEQ_cuda
+    size_t pool_vecs = size_t(tw_._layer_num) * host_pages * page_vecs;
+    size_t pool_bytes = pool_vecs * tw_._dim_per_head *
+                        (_kv_host_int8 ? sizeof(int8_t) : sizeof(OpType_));
+    CHECK_GPU_ERROR(cudaMallocHost(&_kv_host_k, pool_bytes));
+    CHECK_GPU_ERROR(cudaMallocHost(&_kv_host_v, pool_bytes));
+    if (_kv_host_int8) {
+      CHECK_GPU_ERROR(cudaMallocHost((void **)&_kv_host_k_scale,
+                                     pool_vecs * sizeof(float)));
+      CHECK_GPU_ERROR(cudaMallocHost((void **)&_kv_host_v_scale,
+                                     pool_vecs * sizeof(float)));
+    }
+    CHECK_GPU_ERROR(
+        cudaStreamCreateWithFlags(&_kv_host_stream, cudaStreamNonBlocking));
+    CHECK_GPU_ERROR(
+        cudaEventCreateWithFlags(&_kv_saved, cudaEventDisableTiming));
+    _kv_restored.resize(tw_._layer_num);
+    for (cudaEvent_t &event : _kv_restored) {
+      CHECK_GPU_ERROR(
+          cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+    }
+#endif
+    _kv_host_pages = new Variable("kv_host_pages", g_dtype<int>());
+    _kv_host_pages->malloc_memory(2 * _request_slots.max_slots() *
+                                  _kv_page_table->max_pages());
+    printf("*** kv host offload: %d pages of %d tokens%s ***\n", host_pages,
+           page_size, _kv_host_int8 ? " in int8" : "");
+  }
 
   _context_ptr->build();
+  for (int stage = 1; stage < _stages.size(); stage++) {
+    enter_stage(stage, &context_scope);
+    _stages[stage].context->build();
+  }
+  if (!_stages.empty()) {
+    enter_stage(0, &context_scope);
+  }
   printf("Finish construct network!\n");
 }
 
-Llama::~Llama() {}
+template <typename OpType_>
+void Llama<OpType_>::enter_stage(int stage, ContextScope *scope) {
+  PipelineStage &pipeline_stage = _stages[stage];
+  if (pipeline_stage.context == nullptr) {
+    pipeline_stage.context =
+        std::make_shared<Context>(StatusType::Inference, stage);
+  }
+  scope->reset(pipeline_stage.context);
+  pipeline_stage.context->switch_device();
+}
+
+template <typename OpType_>
+Variable *Llama<OpType_>::construct_pipeline(Variable *llama_emb,
+                                             Variable *pad_mask,
+                                             size_t cache_size,
+                                             DataType cache_dtype,
+                                             ContextScope *scope) {
+  int num_stages = _stages.size();
+  size_t max_batch_tokens = size_t(tw_._max_step) * _max_batch_size;
+  size_t hidden_ele_num = max_batch_tokens * tw_._hidden_size;
+  for (int stage = 0; stage < num_stages; stage++) {
+    enter_stage(stage, scope);
+    PipelineStage &pipeline_stage = _stages[stage];
+    pipeline_stage.recv = new Variable("pipeline_recv", g_dtype<OpType_>());
+    pipeline_stage.recv->malloc_memory(hidden_ele_num);
+    if (stage > 0) {
+      pipeline_stage.recv_pad_mask =
+          new Variable("pipeline_pad_mask", g_dtype<OpType_>());
+      pipeline_stage.recv_pad_mask->malloc_memory(max_batch_tokens);
+    }
+    // direct copies to the next stage when the devices allow it, staged
+    // through the host otherwise.
+    int next_device = (stage + 1) % num_stages, can_access = 0;
+    CHECK_GPU_ERROR(cudaDeviceCanAccessPeer(&can_access, stage, next_device));
+    if (can_access &&
+        cudaDeviceEnablePeerAccess(next_device, 0) != cudaSuccess) {
+      // already enabled.
+      cudaGetLastError();
+    }
+  }
+
+  enter_stage(0, scope);
+  // the micro-batches of stage 0 read the embedding one after another.
+  llama_emb->set_regress_var();
+  for (int stage = 1; stage < num_stages; stage++) {
+    PipelineStage &pipeline_stage = _stages[stage];
+    pipeline_stage.pad_mask_copy.reset(
+        new PeerCopyLayer<OpType_, OpType_>(max_batch_tokens));
+    (*pipeline_stage.pad_mask_copy)(pad_mask, pipeline_stage.recv_pad_mask,
+                                    pipeline_stage.context.get());
+  }
+
+  for (int stage = 0; stage < num_stages; stage++) {
+    enter_stage(stage, scope);
+    PipelineStage &pipeline_stage = _stages[stage];
+    Context *context = pipeline_stage.context.get();
+    int num_layers = pipeline_stage.layer_end - pipeline_stage.layer_begin;
+    if (stage == 0) {
+      pipeline_stage.caches_k = _total_caches_k;
+      pipeline_stage.caches_v = _total_caches_v;
+      pipeline_stage.input = new Variable("stage_input", llama_emb);
+      pipeline_stage.pad_mask = new Variable("stage_pad_mask", pad_mask);
+    } else {
+      context->regress_begin();
+      pipeline_stage.caches_k = new Variable(
+          "total_caches_k", cache_size * num_layers, cache_dtype,
+          DataType::kNotSupported, VariableType::RegressiveVariable);
+      pipeline_stage.caches_v = new Variable(
+          "total_caches_v", cache_size * num_layers, cache_dtype,
+          DataType::kNotSupported, VariableType::RegressiveVariable);
+      pipeline_stage.input =
+          new Variable("stage_input", pipeline_stage.recv);
+      pipeline_stage.pad_mask =
+          new Variable("stage_pad_mask", pipeline_stage.recv_pad_mask);
+    }
+    pipeline_stage.input->set_offset(0, {hidden_ele_num});
+    pipeline_stage.pad_mask->set_offset(0, {max_batch_tokens});
+
+    Variable *hidden = pipeline_stage.input;
+    for (int idx = pipeline_stage.layer_begin; idx < pipeline_stage.layer_end;
+         idx++) {
+      size_t cache_offset = (idx - pipeline_stage.layer_begin) * cache_size;
+      Variable *cache_k = new Variable("cache_k", pipeline_stage.caches_k);
+      cache_k->set_offset(cache_offset, {cache_size});
+      Variable *cache_v = new Variable("cache_v", pipeline_stage.caches_v);
+      cache_v->set_offset(cache_offset, {cache_size});
+      _caches_k.push_back(cache_k);
+      _caches_v.push_back(cache_v);
+      hidden = (*_llama_layer_vec[idx])(hidden, cache_k, cache_v,
+                                        pipeline_stage.pad_mask);
+    }
+
+    PipelineStage &next_stage = _stages[(stage + 1) % num_stages];
+    pipeline_stage.send.reset(
+        new PeerCopyLayer<OpType_, OpType_>(hidden_ele_num));
+    (*pipeline_stage.send)(hidden, next_stage.recv, next_stage.context.get());
+    if (stage > 0) {
+      context->regress_end();
+    }
+  }
+  enter_stage(0, scope);
+  return _stages[0].recv;
+}
+
+template <typename OpType_>
+void Llama<OpType_>::before_forward_stages(int row, int rows, int seq_len,
+                                           int offset) {
+  // the dense cache of a layer is [batch_size, kv_heads, max_step, dim].
+  size_t hidden_size = tw_._hidden_size, kv_len = seq_len + offset;
+  size_t cache_row_size = _cache_size / _max_batch_size;
+  size_t hidden_offset = size_t(row) * seq_len * hidden_size;
+  for (PipelineStage &pipeline_stage : _stages) {
+    pipeline_stage.input->set_offset(
+        hidden_offset, {size_t(rows) * seq_len, hidden_size});
+    pipeline_stage.pad_mask->set_offset(row * kv_len, {size_t(rows), kv_len});
+    for (int idx = pipeline_stage.layer_begin; idx < pipeline_stage.layer_end;
+         idx++) {
+      size_t cache_offset =
+          (idx - pipeline_stage.layer_begin) * _cache_size +
+          row * cache_row_size;
+      _caches_k[idx]->set_offset(cache_offset, {_cache_size});
+      _caches_v[idx]->set_offset(cache_offset, {_cache_size});
+      _llama_layer_vec[idx]->before_forward(rows, seq_len, offset);
+    }
+    pipeline_stage.send->before_forward(size_t(rows) * seq_len * hidden_size,
+                                        hidden_offset);
+  }
+}
+
+template <typename OpType_>
+void Llama<OpType_>::forward_layer_vec() {
+  if (!tw_.offload_layers()) {
+    for (int idx = 0; idx < _llama_layer_vec.size(); idx++) {
+      wait_restored_kv(idx);
+      _llama_layer_vec[idx]->forward();
+    }
+    _kv_restore_pending = false;
+    return;
+  }
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  // layer idx is copied while layer idx - 1 runs, once layer idx - 2 is done
+  // with the slot.
+  auto prefetch = [&](int idx) {
+    int slot = idx % 2;
+    CHECK_GPU_ERROR(cudaStreamWaitEvent(_offload_stream, _slot_free[slot], 0));
+    tw_.prefetch_layer(idx, _offload_stream);
+    CHECK_GPU_ERROR(cudaEventRecord(_slot_ready[slot], _offload_stream));
+  };
+  int num_layers = _llama_layer_vec.size();
+  prefetch(0);
+  prefetch(1);
+  for (int idx = 0; idx < num_layers; idx++) {
+    int slot = idx % 2;
+    CHECK_GPU_ERROR(cudaStreamWaitEvent(stream, _slot_ready[slot], 0));
+    wait_restored_kv(idx);
+    _llama_layer_vec[idx]->forward();
+    CHECK_GPU_ERROR(cudaEventRecord(_slot_free[slot], stream));
+    if (idx + 2 < num_layers) {
+      prefetch(idx + 2);
+    }
+  }
+  _kv_restore_pending = false;
+#endif
+}
+
+template <typename OpType_>
+void Llama<OpType_>::wait_restored_kv(int layer_idx) {
+  if (!_kv_restore_pending) {
+    return;
+  }
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaStreamWaitEvent(_context_ptr->get_stream(),
+                                      _kv_restored[layer_idx], 0));
+#endif
+}
+
+template <typename OpType_>
+void Llama<OpType_>::forward_layers(int batch_size, int seq_len, int offset) {
+  if (_stages.empty()) {
+    forward_layer_vec();
+    return;
+  }
+  for (int stage = 1; stage < _stages.size(); stage++) {
+    _stages[stage].pad_mask_copy->before_forward(
+        size_t(batch_size) * (seq_len + offset), 0);
+    _stages[stage].pad_mask_copy->forward();
+  }
+  // the host only enqueues, so stage s + 1 runs micro-batch m while stage s
+  // runs micro-batch m + 1. Every micro-batch has its own rows of the
+  // caches and of the buffers between the stages.
+  int num_micro_batches = std::min(_num_micro_batches, batch_size);
+  int micro_batch_size =
+      (batch_size + num_micro_batches - 1) / num_micro_batches;
+  for (int row = 0; row < batch_size; row += micro_batch_size) {
+    int rows = std::min(micro_batch_size, batch_size - row);
+    before_forward_stages(row, rows, seq_len, offset);
+    for (PipelineStage &pipeline_stage : _stages) {
+      pipeline_stage.context->switch_device();
+      for (int idx = pipeline_stage.layer_begin;
+           idx < pipeline_stage.layer_end; idx++) {
+        _llama_layer_vec[idx]->forward();
+      }
+      pipeline_stage.send->forward();
+    }
+  }
+  _context_ptr->switch_device();
+}
+
+template <typename OpType_>
+int Llama<OpType_>::forward_prompt_chunks(int batch_size, int prompt_len) {
+  int rows = batch_size * tw_._beam_size, chunk = 0;
+  for (int offset = 0; offset < prompt_len; offset += chunk) {
+    chunk = std::min(_prefill_chunk_size, prompt_len - offset);
+    _launch_llama_emb_layer->before_forward(batch_size, chunk, offset);
+    for (auto iter : _llama_layer_vec) {
+      iter->before_forward(rows, chunk, offset);
+    }
+    _launch_llama_emb_layer->forward();
+    forward_layers(rows, chunk, offset);
+  }
+  return chunk;
+}
+
+template <typename OpType_>
+Llama<OpType_>::~Llama() {
+  if (_offload_stream != nullptr) {
+    cudaStreamSynchronize(_offload_stream);
+    for (int slot = 0; slot < 2; slot++) {
+      cudaEventDestroy(_slot_ready[slot]);
+      cudaEventDestroy(_slot_free[slot]);
+    }
+    cudaStreamDestroy(_offload_stream);
+  }
+  if (_kv_host_stream != nullptr) {
+    cudaStreamSynchronize(_kv_host_stream);
+    cudaEventDestroy(_kv_saved);
+    for (cudaEvent_t event : _kv_restored) {
+      cudaEventDestroy(event);
+    }
+    cudaStreamDestroy(_kv_host_stream);
+    cudaFreeHost(_kv_host_k);
+    cudaFreeHost(_kv_host_v);
+    if (_kv_host_k_scale) cudaFreeHost(_kv_host_k_scale);
+    if (_kv_host_v_scale) cudaFreeHost(_kv_host_v_scale);
+  }
+  if (_weights_restored != nullptr) cudaEventDestroy(_weights_restored);
+}
 
-void Llama::before_forward(int batch_size, int prompt_len, int steps) {
+template <typename OpType_>
+void Llama<OpType_>::before_forward(int batch_size, int prompt_len, int steps) {
   if (steps == 0) {
     _launch_llama_emb_layer->before_forward(batch_size, prompt_len, 0);
     for (auto iter : _llama_layer_vec) {
@@ -124,85 +897,1600 @@ void Llama::before_forward(int batch_size, int prompt_len, int steps) {
     _linear_layer->before_forward(batch_size * tw_._beam_size, 1);
     _generator_layer->before_forward(batch_size, prompt_len, steps);
   }
+  if (!_stages.empty()) {
+    // the whole batch as one micro-batch, which covers the shapes of all.
+    if (steps == 0) {
+      before_forward_stages(0, batch_size, prompt_len, 0);
+    } else {
+      before_forward_stages(0, batch_size, 1, prompt_len + steps - 1);
+    }
+  }
+}
+
+template <typename OpType_>
+void Llama<OpType_>::switch_memory_plan(int batch_size, int prompt_len) {
+  MemoryManagerPtr mm_ptr = _context_ptr->memory_manager_ptr();
+  int batch_bucket = shape_bucket(batch_size, _max_batch_size);
+  int prompt_bucket = shape_bucket(prompt_len, tw_._max_step);
+  MemoryManager::PlanKey plan_key = {batch_bucket, prompt_bucket};
+  // every pipeline stage plans the memory of its own context.
+  std::vector<Context *> contexts = {_context_ptr.get()};
+  for (int stage = 1; stage < _stages.size(); stage++) {
+    contexts.push_back(_stages[stage].context.get());
+  }
+  if (!mm_ptr->has_plan(plan_key)) {
+    // the prompt step and the longest decode step of the bucket cover the
+    // largest shape of every tensor.
+    for (Context *context : contexts) {
+      context->memory_manager_ptr()->start_shape_recording();
+    }
+    before_forward(batch_bucket, prompt_bucket, 0);
+    if (prompt_bucket + 1 < tw_._max_step) {
+      before_forward(batch_bucket, prompt_bucket,
+                     tw_._max_step - prompt_bucket - 1);
+    }
+    if (_draft_model && batch_bucket == 1) {
+      // the verification of the draft tokens at the end of the cache.
+      int query_len = std::min(_num_draft_tokens + 1, tw_._max_step);
+      before_forward_tokens(tw_._max_step - query_len, query_len, query_len);
+    }
+    for (Context *context : contexts) {
+      context->memory_manager_ptr()->finish_shape_recording(plan_key);
+    }
+  }
+  for (Context *context : contexts) {
+    context->switch_device();
+    context->memory_manager_ptr()->switch_plan(plan_key);
+  }
+  _context_ptr->switch_device();
+}
+
+template <typename OpType_>
+void Llama<OpType_>::load_params() {
+  _launch_llama_emb_layer->load_params(tw_.get_src_emb_wei(), 0, 4);
+  int enc_wei_offset = 0;
+  for (auto iter : _llama_layer_vec) {
+    enc_wei_offset += iter->load_params(tw_.get_enc_wei(), enc_wei_offset);
+  }
+  _rms_norm_layer->load_params(tw_.get_src_emb_wei(), 1);
+  _linear_layer->load_params(tw_.get_src_emb_wei(), 2);
+}
+
+template <typename OpType_>
+void Llama<OpType_>::update_weights(const std::string &weight_path) {
+  if (!_stages.empty() || tw_.offload_layers()) {
+    // the weights of a stage, or a slot of offloaded layers, would have to
+    // be updated on its own.
+    throw std::runtime_error(std::string("weight update does not support ") +
+                             (_stages.empty() ? "offloaded layers"
+                                              : "pipeline parallel"));
+  }
+  _context_ptr->switch_device();
+  std::unique_ptr<LlamaWeight<OpType_>> weights(new LlamaWeight<OpType_>());
+  weights->copy_load_options(tw_);
+  weights->set_background_stream(true);
+  std::string res;
+  try {
+    res = weights->initializing(weight_path);
+  } catch (...) {
+    weights->free_device_wei();
+    throw;
+  }
+  if (res.empty() && !weights->same_layout(tw_)) {
+    res = "the weights of " + weight_path + " do not fit the model";
+  }
+  if (!res.empty()) {
+    weights->free_device_wei();
+    throw std::runtime_error(res);
+  }
+  std::lock_guard<std::mutex> lock(_weight_update_mutex);
+  if (_pending_weights) {
+    // replaced before it ever ran.
+    _pending_weights->free_device_wei();
+  }
+  _pending_weights = std::move(weights);
+}
+
+template <typename OpType_>
+void Llama<OpType_>::apply_weight_update() {
+  std::unique_ptr<LlamaWeight<OpType_>> weights;
+  {
+    std::lock_guard<std::mutex> lock(_weight_update_mutex);
+    weights = std::move(_pending_weights);
+  }
+  if (!weights) {
+    return;
+  }
+  tw_.swap_device_wei(*weights);
+  load_params();
+  // the cached kv was computed by the old weights, the running requests of
+  // continuous batching keep theirs.
+  if (_prefix_cache) _prefix_cache->clear();
+  if (_kv_host_cache) _kv_host_cache->clear();
+#ifdef LIGHTSEQ_cuda
+  // the graphs baked the addresses of the old weights in.
+  _context_ptr->clear_graphs();
+#endif
+  // the kernels in flight may still read the old ones.
+  _context_ptr->synchronize();
+  weights->free_device_wei();
+  _context_ptr->metrics()->add("weight_updates_total", 1);
+  printf("*** switched to the updated weights ***\n");
+}
+
+template <typename OpType_>
+MemoryProfile Llama<OpType_>::memory_profile() {
+  MemoryProfile profile;
+  if (!_stages.empty()) {
+    // the stages plan the memory of their devices.
+    printf("memory profile does not support pipeline parallel, ignored.\n");
+    return profile;
+  }
+  MemoryManagerPtr mm_ptr = _context_ptr->memory_manager_ptr();
+  int kv_hidden_size =
+      tw_._kv_head_num / _context_ptr->tp_size() * tw_._dim_per_head;
+  size_t cache_dtype_size =
+      _total_caches_k_scale ? sizeof(int8_t) : sizeof(OpType_);
+  profile.kv_token_bytes =
+      2 * _caches_k.size() * kv_hidden_size * cache_dtype_size;
+  profile.kv_row_tokens = _kv_ring_len ? _kv_ring_len : tw_._max_step;
+  profile.kv_page_size = _kv_page_table ? _kv_page_table->page_size() : 0;
+  profile.beam_size = tw_._beam_size;
+  profile.max_step = tw_._max_step;
+  profile.fixed_bytes = tw_.device_wei_bytes();
+
+  // the caches are not recorded, so both plans hold the ones of the prompt
+  // phase.
+  size_t cache_elems = _kv_page_table
+                           ? size_t(_prompt_num_pages) * _page_cache_size
+                           : _cache_size;
+  size_t cache_bytes = 2 * _caches_k.size() * cache_elems * cache_dtype_size;
+  size_t max_bytes = mm_ptr->plan_buffer_size({-1, -1}) - cache_bytes;
+  if (_max_batch_size == 1) {
+    profile.activation_row_bytes = max_bytes;
+    return profile;
+  }
+  if (!mm_ptr->has_plan(kProfilePlanKey)) {
+    // the prompt step of max_step tokens covers the decoding steps.
+    mm_ptr->start_shape_recording();
+    before_forward(1, tw_._max_step, 0);
+    mm_ptr->finish_shape_recording(kProfilePlanKey);
+  }
+  size_t row_bytes = mm_ptr->plan_buffer_size(kProfilePlanKey) - cache_bytes;
+  profile.activation_row_bytes =
+      max_bytes > row_bytes ? (max_bytes - row_bytes) / (_max_batch_size - 1)
+                            : 0;
+  profile.activation_bytes =
+      std::max(row_bytes, profile.activation_row_bytes) -
+      profile.activation_row_bytes;
+  return profile;
+}
+
+template <typename OpType_>
+void Llama<OpType_>::cuda_graph_mode(bool enable) {
+  if (enable && _generate_method == GenerateMethod::BeamSearch) {
+    // beam search swaps the token and cache buffers between steps, which
+    // would have to be part of the graph key.
+    printf("cuda graph mode is not supported with beam search, ignored.\n");
+    return;
+  }
+  if (enable && tw_.offload_layers()) {
+    // the layers wait for the copies of their weights on another stream.
+    printf("cuda graph mode is not supported with offloaded layers, "
+           "ignored.\n");
+    return;
+  }
+  if (enable && _kv_ring_len) {
+    // the rows of the ring are mapped to positions by the kv length, which
+    // a graph fixes to the step bucket.
+    printf("cuda graph mode is not supported with an attention window, "
+           "ignored.\n");
+    return;
+  }
+  if (enable && !_stages.empty()) {
+    // a graph is captured on the stream of a single device.
+    printf("cuda graph mode is not supported with pipeline parallel, "
+           "ignored.\n");
+    return;
+  }
+  _cuda_graph_mode = enable;
+  const int *offset_ptr = enable ? _step_offset->value<int>() : nullptr;
+  _launch_llama_emb_layer->set_offset_ptr(offset_ptr);
+  for (auto iter : _llama_layer_vec) {
+    iter->set_prompt_len_ptr(offset_ptr);
+  }
+#ifdef LIGHTSEQ_cuda
+  if (!enable) {
+    _context_ptr->clear_graphs();
+  }
+#endif
+}
+
+template <typename OpType_>
+void Llama<OpType_>::graph_decode_step(int batch_size, int offset) {
+#ifdef LIGHTSEQ_cuda
+  // the step attends to at most max_step positions, offset + 1 < max_step
+  // holds in generate.
+  int kv_bucket =
+      std::min(shape_bucket(offset + 1, tw_._max_step), tw_._max_step - 1);
+  _launch_llama_emb_layer->before_forward(batch_size, 1, kv_bucket - 1);
+  for (auto iter : _llama_layer_vec) {
+    iter->before_forward(batch_size * tw_._beam_size, 1, kv_bucket - 1);
+  }
+  _rms_norm_layer->before_forward(batch_size * tw_._beam_size, 1);
+  _linear_layer->before_forward(batch_size * tw_._beam_size, 1);
+
+  cudaStream_t stream = _context_ptr->get_stream();
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_step_offset->value<int>(), &offset,
+                                  sizeof(int), cudaMemcpyHostToDevice, stream));
+
+  std::vector<int> graph_key = {batch_size, kv_bucket};
+  if (_context_ptr->graph_replay(graph_key)) {
+    return;
+  }
+  _context_ptr->graph_capture_begin();
+  try {
+    _launch_llama_emb_layer->forward();
+    for (auto iter : _llama_layer_vec) {
+      iter->forward();
+    }
+    _rms_norm_layer->forward();
+    _linear_layer->forward();
+  } catch (...) {
+    _context_ptr->graph_capture_abort();
+    throw;
+  }
+  _context_ptr->graph_capture_end(graph_key);
+  _context_ptr->graph_replay(graph_key);
+#endif
+}
+
+template <typename OpType_>
+bool Llama<OpType_>::graph_decode_steps(int batch_size, int offset,
+                                        int num_steps) {
+#ifdef LIGHTSEQ_cuda
+  // the sampling kernels of the graph take the generate method only.
+  if (_has_generation_configs || _has_logits_processor ||
+      _has_token_automaton) {
+    return false;
+  }
+  // offset + num_steps < max_step holds in generate, see graph_decode_step.
+  int kv_bucket = std::min(shape_bucket(offset + num_steps, tw_._max_step),
+                           tw_._max_step - 1);
+  _launch_llama_emb_layer->before_forward(batch_size, 1, kv_bucket - 1);
+  for (auto iter : _llama_layer_vec) {
+    iter->before_forward(batch_size * tw_._beam_size, 1, kv_bucket - 1);
+  }
+  _rms_norm_layer->before_forward(batch_size * tw_._beam_size, 1);
+  _linear_layer->before_forward(batch_size * tw_._beam_size, 1);
+  // the positions are read from the step offset.
+  _generator_layer->before_forward(batch_size, 0, 1);
+
+  cudaStream_t stream = _context_ptr->get_stream();
+  // every step of the graph first advances it.
+  int step_offset = offset - 1;
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_step_offset->value<int>(), &step_offset,
+                                  sizeof(int), cudaMemcpyHostToDevice,
+                                  stream));
+
+  std::vector<int> graph_key = {batch_size, kv_bucket, num_steps};
+  if (!_context_ptr->graph_replay(graph_key)) {
+    _generator_layer->set_step_offset_ptr(_step_offset->value<int>());
+    _context_ptr->graph_capture_begin();
+    try {
+      for (int step = 0; step < num_steps; step++) {
+        launch_advance_step_offset(_step_offset->value<int>(), stream);
+        _launch_llama_emb_layer->forward();
+        for (auto iter : _llama_layer_vec) {
+          iter->forward();
+        }
+        _rms_norm_layer->forward();
+        _linear_layer->forward();
+        _generator_layer->forward();
+      }
+    } catch (...) {
+      _context_ptr->graph_capture_abort();
+      _generator_layer->set_step_offset_ptr(nullptr);
+      throw;
+    }
+    _context_ptr->graph_capture_end(graph_key);
+    _generator_layer->set_step_offset_ptr(nullptr);
+    _context_ptr->graph_replay(graph_key);
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+template <typename OpType_>
+void Llama<OpType_>::reserve_kv_pages(int batch_size, int seq_len) {
+  for (int seq_idx = 0; seq_idx < batch_size * tw_._beam_size; seq_idx++) {
+    bool reserved = _kv_page_table->reserve(seq_idx, seq_len);
+    if (!reserved && _prefix_cache && _prefix_cache->num_cached_pages()) {
+      // Infer does not read the prefix cache, give its pages to the batch.
+      _prefix_cache->clear();
+      reserved = _kv_page_table->reserve(seq_idx, seq_len);
+    }
+    if (!reserved) {
+      _kv_page_table->release_all();
+      std::string error_message =
+          "kv cache pages are exhausted, " +
+          std::to_string(_kv_page_table->num_pages()) +
+          " pages can not hold " + std::to_string(batch_size) +
+          " sequences of length " + std::to_string(seq_len) + "\n";
+      printf("%s", error_message.c_str());
+      throw std::runtime_error(error_message);
+    }
+  }
+  if (_kv_page_table->dirty()) {
+#ifdef LIGHTSEQ_cuda
+    const std::vector<int> &table = _kv_page_table->table();
+    CHECK_GPU_ERROR(cudaMemcpyAsync(
+        _page_table->value<int>(), table.data(), table.size() * sizeof(int),
+        cudaMemcpyHostToDevice, _context_ptr->get_stream()));
+#endif
+    _kv_page_table->clear_dirty();
+  }
+}
+
+template <typename OpType_>
+void Llama<OpType_>::set_cache_pages(int num_pages) {
+  _cache_size = num_pages * _page_cache_size;
+  for (int idx = 0; idx < _caches_k.size(); idx++) {
+    _caches_k[idx]->set_offset(idx * _cache_size, {_cache_size});
+    _caches_v[idx]->set_offset(idx * _cache_size, {_cache_size});
+  }
+}
+
+template <typename OpType_>
+void Llama<OpType_>::record_serving_plan(int num_pages) {
+  MemoryManagerPtr mm_ptr = _context_ptr->memory_manager_ptr();
+  mm_ptr->start_shape_recording();
+  // the caches record the size of the pool, see forward_rows for the
+  // shapes of a step.
+  set_cache_pages(num_pages);
+  int max_rows = tw_._max_step - 1;
+  int max_samples = std::min(_max_batch_size, max_rows);
+  _launch_llama_emb_layer->before_forward(1, max_rows, 0);
+  for (auto iter : _llama_layer_vec) {
+    iter->before_forward(max_rows, 1, 0);
+  }
+  _rms_norm_layer->before_forward(max_samples, 1);
+  _linear_layer->before_forward(max_samples, 1);
+  _generator_layer->before_forward(max_samples, 1, 0);
+  mm_ptr->finish_shape_recording(kServingPlanKey);
+}
+
+template <typename OpType_>
+void Llama<OpType_>::enter_serving_phase() {
+  if (_serving_phase) {
+    return;
+  }
+  MemoryManagerPtr mm_ptr = _context_ptr->memory_manager_ptr();
+  if (!mm_ptr->has_plan(kServingPlanKey)) {
+    // The prompt phase may use the buffers of the max shapes, and so may the
+    // serving phase. The caches live through the whole forward, so every
+    // extra page of the pool takes page_bytes of the plan.
+    size_t budget = mm_ptr->plan_buffer_size({-1, -1});
+    size_t page_bytes = 2 * _caches_k.size() * _page_cache_size *
+                        (_total_caches_k_scale ? sizeof(int8_t)
+                                               : sizeof(OpType_));
+    _total_caches_k->allow_growth();
+    _total_caches_v->allow_growth();
+    record_serving_plan(_prompt_num_pages);
+    size_t used = mm_ptr->plan_buffer_size(kServingPlanKey);
+    // the scales of the int8 cache are not planned, they keep the pool.
+    int extra_pages = (used < budget && !_total_caches_k_scale)
+                          ? (budget - used) / page_bytes
+                          : 0;
+    // the greedy planner may not pack the larger caches as tightly.
+    while (extra_pages > 0) {
+      record_serving_plan(_prompt_num_pages + extra_pages);
+      used = mm_ptr->plan_buffer_size(kServingPlanKey);
+      if (used <= budget) break;
+      extra_pages -= std::max(int((used - budget) / page_bytes), 1);
+      if (extra_pages <= 0) record_serving_plan(_prompt_num_pages);
+    }
+    _serving_num_pages = _prompt_num_pages + std::max(extra_pages, 0);
+    printf("*** continuous batching: %d kv pages, %d of them in the memory "
+           "of the prompt activations ***\n",
+           _serving_num_pages, _serving_num_pages - _prompt_num_pages);
+  }
+  // no request holds pages, the ones of the prefix cache are dropped with
+  // the buffers of the prompt phase.
+  release_saved_kv(true);
+  if (_prefix_cache) _prefix_cache->clear();
+  _kv_page_table->resize(_serving_num_pages);
+  set_cache_pages(_serving_num_pages);
+  mm_ptr->switch_plan(kServingPlanKey);
+  _serving_phase = true;
+}
+
+template <typename OpType_>
+void Llama<OpType_>::leave_serving_phase() {
+  if (!_serving_phase) {
+    return;
+  }
+  if (_prefix_cache) _prefix_cache->clear();
+  _kv_page_table->resize(_prompt_num_pages);
+  set_cache_pages(_prompt_num_pages);
+  // a dynamic plan is switched to the bucket of the batch by Infer.
+  if (!_dynamic_memory_plan) {
+    _context_ptr->memory_manager_ptr()->switch_plan({-1, -1});
+  }
+  _serving_phase = false;
+}
+
+template <typename OpType_>
+std::vector<Context *> Llama<OpType_>::stage_contexts() {
+  std::vector<Context *> contexts;
+  for (PipelineStage &pipeline_stage : _stages) {
+    if (pipeline_stage.context) {
+      contexts.push_back(pipeline_stage.context.get());
+    }
+  }
+  if (contexts.empty()) contexts.push_back(_context_ptr.get());
+  return contexts;
+}
+
+template <typename OpType_>
+void Llama<OpType_>::suspend() {
+  if (!_request_slots.empty()) {
+    // the running requests keep their kv in the caches.
+    throw std::runtime_error(
+        "the model can not be suspended while requests are pending");
+  }
+  if (_context_ptr->is_suspended()) {
+    return;
+  }
+  // the pages saved to host memory are read until their copies finish, the
+  // kv of the sessions in _kv_host_cache stays.
+  release_saved_kv(true);
+  if (_prefix_cache) _prefix_cache->clear();
+  for (Context *context : stage_contexts()) {
+    context->suspend();
+  }
+  _context_ptr->switch_device();
+  if (_draft_model) _draft_model->suspend();
+  _context_ptr->metrics()->add("suspends_total", 1);
+  _context_ptr->metrics()->set("memory_plan_bytes", 0);
+  printf("*** suspended, the activations and the kv caches are released "
+         "***\n");
+}
+
+template <typename OpType_>
+void Llama<OpType_>::resume() {
+  if (_draft_model) _draft_model->resume();
+  for (Context *context : stage_contexts()) {
+    context->resume();
+  }
+  _context_ptr->switch_device();
+}
+
+template <typename OpType_>
+bool Llama<OpType_>::evict_weights() {
+  if (!_stages.empty() || tw_.offload_layers()) {
+    // the weights of a stage, or a slot of offloaded layers, would have to
+    // be evicted on its own.
+    printf("weight eviction does not support %s, ignored.\n",
+           _stages.empty() ? "offloaded layers" : "pipeline parallel");
+    return false;
+  }
+  if (tw_.device_wei_evicted()) {
+    return true;
+  }
+  suspend();
+  // a pending update is the one paged out.
+  apply_weight_update();
+  _context_ptr->switch_device();
+  tw_.evict_device_wei();
+  _context_ptr->metrics()->add("weight_evictions_total", 1);
+  printf("*** evicted %zu MB of weights to pinned host memory ***\n",
+         tw_.device_wei_bytes() / (1024 * 1024));
+  return true;
+}
+
+template <typename OpType_>
+bool Llama<OpType_>::restore_weights() {
+  if (!_stages.empty() || tw_.offload_layers()) {
+    return false;
+  }
+  if (!tw_.device_wei_evicted()) {
+    return true;
+  }
+  _context_ptr->switch_device();
+  if (_weights_restored == nullptr) {
+    CHECK_GPU_ERROR(cudaEventCreateWithFlags(&_weights_restored,
+                                             cudaEventDisableTiming));
+  }
+  tw_.upload_device_wei(_weights_restored);
+  load_params();
+  // the layers read them once the copy is done, the host does not wait.
+  CHECK_GPU_ERROR(cudaStreamWaitEvent(_context_ptr->get_stream(),
+                                      _weights_restored, 0));
+  return true;
 }
 
-void Llama::Infer() {
+template <typename OpType_>
+void Llama<OpType_>::Infer() {
   int batch_size = input_shapes_[0][0], prompt_len = input_shapes_[0][1];
 
-  /* --- notice that the order of forward should be the same with network --- */
+  if (!_request_slots.empty()) {
+    // Infer reuses the kv pages held by the running requests.
+    throw std::runtime_error(
+        "Infer can not run while continuous batching requests are pending");
+  }
+  release_saved_kv(true);
+  leave_serving_phase();
+  restore_weights();
+  resume();
+  apply_weight_update();
+  // the samples of a prompt share its prefill, see fork_samples.
+  int num_samples = _num_return_sequences;
+  int rows = batch_size * num_samples;
+  bool share_prefill = num_samples > 1;
+  if (rows > _max_batch_size) {
+    throw std::runtime_error(
+        std::to_string(batch_size) + " prompts of " +
+        std::to_string(num_samples) + " samples exceed the max batch size " +
+        std::to_string(_max_batch_size));
+  }
+  if (share_prefill && !_lora_names.empty()) {
+    throw std::runtime_error("parallel sampling does not support LoRA");
+  }
+  _row_cancellation.reset(rows);
+
+  if (_dynamic_memory_plan) {
+    switch_memory_plan(rows, prompt_len);
+  }
+  Metrics *metrics = _context_ptr->metrics();
+  metrics->begin_forward();
 
 #ifdef LIGHTSEQ_cuda
-  for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
-    for (int beam_idx = 0; beam_idx < tw_._beam_size; beam_idx++) {
-      CHECK_GPU_ERROR(cudaMemcpyAsync(
-          _inp_tokens->value<int>() +
-              (batch_idx * tw_._beam_size + beam_idx) * tw_._max_step,
-          _input_ptr + batch_idx * prompt_len, prompt_len * sizeof(int),
-          cudaMemcpyDefault, _context_ptr->get_stream()));
+  if (_cuda_graph_mode) {
+    // graph steps attend to the whole bucket, the masked positions must not
+    // hold stale NaNs from a previous request. This also wipes the pages of
+    // the prefix cache.
+    if (_prefix_cache) _prefix_cache->clear();
+    size_t cache_bytes =
+        _cache_size * tw_._layer_num *
+        (_total_caches_k_scale ? sizeof(int8_t) : sizeof(OpType_));
+    CHECK_GPU_ERROR(cudaMemsetAsync(_total_caches_k->value(), 0, cache_bytes,
+                                    _context_ptr->get_stream()));
+    CHECK_GPU_ERROR(cudaMemsetAsync(_total_caches_v->value(), 0, cache_bytes,
+                                    _context_ptr->get_stream()));
+    if (_graph_decode_steps > 1) {
+      _generator_layer->clear_step_flags();
     }
   }
 #endif
 
+  /* --- notice that the order of forward should be the same with network --- */
+
+#ifdef LIGHTSEQ_cuda
+  // every beam of a batch row starts with its prompt, one strided copy per
+  // beam.
+  for (int beam_idx = 0; beam_idx < tw_._beam_size; beam_idx++) {
+    CHECK_GPU_ERROR(cudaMemcpy2DAsync(
+        _inp_tokens->value<int>() + beam_idx * tw_._max_step,
+        tw_._beam_size * tw_._max_step * sizeof(int), _input_ptr,
+        prompt_len * sizeof(int), prompt_len * sizeof(int), batch_size,
+        cudaMemcpyDefault, _context_ptr->get_stream()));
+  }
+#endif
+
+  if (_kv_page_table) {
+    // pages of an interrupted request are given back here.
+    _kv_page_table->release_all();
+  }
+  if (_kv_rows) _generator_layer->init_kv_rows(_kv_rows->value<int>());
+#ifdef LIGHTSEQ_cuda
+  if (_kv_heavy_pos) {
+    // the heavy hitters start as the first positions, without mass.
+    CHECK_GPU_ERROR(cudaMemsetAsync(_kv_heavy_pos->value(), 0xff,
+                                    _kv_heavy_pos_size * sizeof(int),
+                                    _context_ptr->get_stream()));
+    CHECK_GPU_ERROR(cudaMemsetAsync(_kv_mass->value(), 0,
+                                    _kv_mass_size * sizeof(float),
+                                    _context_ptr->get_stream()));
+  }
+#endif
+
+  bool lora = !_lora_names.empty();
+  if (lora) {
+    if (int(_lora_names.size()) != batch_size) {
+      throw std::runtime_error(
+          "set_lora_adapters got " + std::to_string(_lora_names.size()) +
+          " adapters for a batch of " + std::to_string(batch_size));
+    }
+#ifdef LIGHTSEQ_cuda
+    _lora_batch_slots = _lora_cache->acquire(_lora_names);
+#else
+    _lora_batch_slots.assign(batch_size, -1);
+#endif
+  }
+  attach_lora(lora);
+
+  bool speculative = _draft_model && batch_size == 1 && !share_prefill &&
+                     _generate_method != GenerateMethod::BeamSearch &&
+                     !_cuda_graph_mode && !_draft_model->_cuda_graph_mode &&
+                     !_kv_ring_len && !_draft_model->_kv_ring_len &&
+                     !_has_generation_configs && !_has_logits_processor &&
+                     !_has_token_automaton && !_has_sampling_params;
+
+  int num_prompts = batch_size;
   int steps = 0;
   while (steps + prompt_len < tw_._max_step) {
+#ifdef LIGHTSEQ_cuda
+    if (steps > 0) {
+      // the rows cancelled since the last step end with its token.
+      std::vector<int> cancelled = _row_cancellation.apply(
+          _inp_tokens->value<int>(), prompt_len + steps - 1, tw_._beam_size,
+          tw_._max_step, tw_._eos_id,
+          _generate_method != GenerateMethod::BeamSearch,
+          _context_ptr->get_stream());
+      if (!cancelled.empty()) {
+        metrics->add("cancelled_requests_total", cancelled.size());
+      }
+      if (_row_cancellation.all_cancelled()) break;
+    }
+#endif
+    if (_kv_page_table) {
+      reserve_kv_pages(batch_size, prompt_len + steps);
+    }
+    if (lora && steps <= 1) {
+      set_lora_rows(batch_size, steps == 0 ? prompt_len : 1);
+    }
+    // the captured graphs run the base model.
+    int graph_steps = _graph_decode_steps;
+    if (_cuda_graph_mode && steps > 0 && !lora && !share_prefill &&
+        graph_steps > 1 && prompt_len + steps + graph_steps <= tw_._max_step) {
+      if (_kv_page_table) {
+        reserve_kv_pages(batch_size, prompt_len + steps + graph_steps - 1);
+      }
+      if (graph_decode_steps(batch_size, prompt_len + steps - 1,
+                             graph_steps)) {
+        _generator_layer->fetch_step_flags(steps, prompt_len + steps - 1,
+                                           graph_steps);
+        for (int step = 0; step < graph_steps; step++) {
+          stream_tokens(batch_size, prompt_len, steps + step);
+        }
+        // the steps past the stop only wrote eos, see stop_step.
+        steps += graph_steps;
+        if (_generator_layer->is_stop()) {
+          break;
+        }
+        continue;
+      }
+    }
+    if (_cuda_graph_mode && steps > 0 && !lora && !share_prefill) {
+      graph_decode_step(batch_size, prompt_len + steps - 1);
+      _generator_layer->before_forward(batch_size, prompt_len, steps);
+      _generator_layer->forward();
+      stream_tokens(batch_size, prompt_len, steps);
+      if (_generator_layer->is_stop()) {
+        break;
+      }
+      steps++;
+      continue;
+    }
     before_forward(batch_size, prompt_len, steps);
 
-    _launch_llama_emb_layer->forward();
-    for (auto iter : _llama_layer_vec) {
-      iter->forward();
+    int head_seq_len = prompt_len;
+    if (steps == 0 && _kv_ring_len && prompt_len > _kv_ring_len) {
+      head_seq_len = forward_prompt_chunks(batch_size, prompt_len);
+    } else {
+      _launch_llama_emb_layer->forward();
+      if (steps == 0) {
+        forward_layers(batch_size * tw_._beam_size, prompt_len, 0);
+      } else {
+        forward_layers(batch_size * tw_._beam_size, 1,
+                       prompt_len + steps - 1);
+      }
     }
 
     if (steps == 0) {
-      OpType_ *linear_inp_ptr = _rms_norm_layer->input(0)->value<OpType_>();
-      for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
-        for (int i = 0; i < tw_._beam_size; i++) {
-          cudaMemcpyAsync(
-              linear_inp_ptr +
-                  (batch_idx * tw_._beam_size + i) * tw_._hidden_size,
-              linear_inp_ptr + (batch_idx * tw_._beam_size * prompt_len +
-                                i * prompt_len + prompt_len - 1) *
-                                   tw_._hidden_size,
-              tw_._hidden_size * sizeof(OpType_), cudaMemcpyDefault,
-              _context_ptr->get_stream());
-        }
-      }
+      // the head reads the last prompt token of every sequence in place.
+      _rms_norm_layer->set_input_rows(head_seq_len, head_seq_len - 1);
     }
     _rms_norm_layer->forward();
     _linear_layer->forward();
+    if (steps == 0 && share_prefill) {
+      fork_samples(num_prompts, num_samples, prompt_len);
+      batch_size = rows;
+    }
 
     _generator_layer->forward();
+    stream_tokens(batch_size, prompt_len, steps);
 
     if (_generator_layer->is_stop()) {
       break;
     }
     if (_generate_method == GenerateMethod::BeamSearch) {
-      _generator_layer->refresh_cache(_total_caches_k, _total_caches_v);
+      if (_kv_rows) {
+        _generator_layer->refresh_kv_rows(_kv_rows->value<int>());
+      } else {
+        _generator_layer->refresh_cache(_total_caches_k, _total_caches_v);
+      }
       if (steps + prompt_len + 1 < tw_._max_step) {
         Variable::swap_tensor(_inp_tokens, _out_tokens);
       }
     }
     steps++;
+    if (speculative && prompt_len + steps < tw_._max_step) {
+      // the generator takes the first token, the draft model the rest.
+      steps = _generator_layer->stop_step(steps);
+      if (steps > 0) {
+        steps = speculative_decode(prompt_len, prompt_len + steps) - prompt_len;
+      }
+      break;
+    }
   }
+  // with a stop check interval, the loop may run past the stop.
+  steps = _generator_layer->stop_step(steps);
+  _token_streamer.flush();
 
-  for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
-    for (int beam_idx = 0; beam_idx < tw_._beam_size; beam_idx++) {
-      int *tmp_out_ptr = (_generate_method == GenerateMethod::BeamSearch)
-                             ? _out_tokens->value<int>()
-                             : _inp_tokens->value<int>();
-      cudaMemcpyAsync(
-          _llama_out_ptr +
-              (batch_idx * tw_._beam_size + beam_idx) * (steps + prompt_len),
-          tmp_out_ptr + (batch_idx * tw_._beam_size + beam_idx) * tw_._max_step,
-          (steps + prompt_len) * sizeof(int), cudaMemcpyDefault,
-          _context_ptr->get_stream());
+  int *tmp_out_ptr = (_generate_method == GenerateMethod::BeamSearch)
+                         ? _out_tokens->value<int>()
+                         : _inp_tokens->value<int>();
+  // the sample s of prompt b, row s * num_prompts + b, is output next to
+  // the other samples of the prompt.
+  int out_len = steps + prompt_len, out_rows = num_prompts * tw_._beam_size;
+  for (int sample_idx = 0; sample_idx < num_samples; sample_idx++) {
+    cudaMemcpy2DAsync(_llama_out_ptr + sample_idx * out_len,
+                      num_samples * out_len * sizeof(int),
+                      tmp_out_ptr + size_t(sample_idx) * out_rows *
+                                        tw_._max_step,
+                      tw_._max_step * sizeof(int), out_len * sizeof(int),
+                      out_rows, cudaMemcpyDefault,
+                      _context_ptr->get_stream());
+  }
+
+  _context_ptr->synchronize();
+  attach_lora(false);
+  if (share_prefill) {
+    for (auto iter : _llama_layer_vec) iter->set_kv_rows(nullptr);
+  }
+
+  // every prompt of the batch is a request, generated tokens after an eos
+  // included.
+  metrics->end_forward();
+  metrics->add("requests_total", num_prompts);
+  metrics->add("prompt_tokens_total", double(num_prompts) * prompt_len);
+  metrics->add("generated_tokens_total", double(batch_size) * steps);
+  metrics->add("steps_total", steps);
+  for (int batch_idx = 0; batch_idx < num_prompts; batch_idx++) {
+    metrics->observe("request_prompt_tokens", prompt_len);
+    metrics->observe("request_generated_tokens", steps);
+  }
+  update_metric_gauges(batch_size);
+
+  if (_kv_page_table) {
+    _kv_page_table->release_all();
+  }
+  set_output_shape(0, {num_prompts, tw_._beam_size * num_samples,
+                       prompt_len + steps});
+}
+
+template <typename OpType_>
+void Llama<OpType_>::fork_samples(int num_prompts, int num_samples,
+                                  int prompt_len) {
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  int rows = num_prompts * num_samples;
+  size_t token_block = size_t(num_prompts) * tw_._max_step;
+  size_t logits_block = size_t(num_prompts) * tw_._src_vocab_size;
+  int *tokens = _inp_tokens->value<int>();
+  OpType_ *pad_mask =
+      _launch_llama_emb_layer->output(1)->template value<OpType_>();
+  OpType_ *logits = _linear_layer->output(0)->template value<OpType_>();
+  // the prefilled rows are the first sample of every prompt.
+  for (int sample_idx = 1; sample_idx < num_samples; sample_idx++) {
+    CHECK_GPU_ERROR(cudaMemcpyAsync(
+        tokens + sample_idx * token_block, tokens, token_block * sizeof(int),
+        cudaMemcpyDeviceToDevice, stream));
+    CHECK_GPU_ERROR(cudaMemcpyAsync(pad_mask + sample_idx * token_block,
+                                    pad_mask, token_block * sizeof(OpType_),
+                                    cudaMemcpyDeviceToDevice, stream));
+    CHECK_GPU_ERROR(cudaMemcpyAsync(logits + sample_idx * logits_block,
+                                    logits, logits_block * sizeof(OpType_),
+                                    cudaMemcpyDeviceToDevice, stream));
+  }
+  int *kv_rows = _kv_rows->value<int>();
+  _generator_layer->fork_kv_rows(kv_rows, num_prompts, rows, prompt_len);
+  for (auto iter : _llama_layer_vec) iter->set_kv_rows(kv_rows);
+  _generator_layer->before_forward(rows, prompt_len, 0);
+#endif
+}
+
+template <typename OpType_>
+void Llama<OpType_>::set_num_return_sequences(int num) {
+  if (num < 1) {
+    throw std::runtime_error("num_return_sequences should be at least 1");
+  }
+  if (num > 1 && _generate_method == GenerateMethod::BeamSearch) {
+    throw std::runtime_error("parallel sampling does not support beam search");
+  }
+  if (num > 1 && (!_kv_rows || _kv_ring_len)) {
+    // the samples read the prompt of the prefilled rows through _kv_rows.
+    throw std::runtime_error(
+        "parallel sampling needs the fused attention over a dense kv cache");
+  }
+  _num_return_sequences = num;
+}
+
+template <typename OpType_>
+void Llama<OpType_>::update_metric_gauges(int rows) {
+  Metrics *metrics = _context_ptr->metrics();
+  metrics->set("batch_occupancy", double(rows) / _max_batch_size);
+  if (_kv_page_table) {
+    metrics->set("kv_cache_utilization",
+                 1. - double(_kv_page_table->num_free_pages()) /
+                          _kv_page_table->num_pages());
+  }
+  if (_kv_host_cache) {
+    metrics->set("kv_host_utilization",
+                 1. - double(_kv_host_cache->num_free_pages()) /
+                          _kv_host_cache->num_pages());
+  }
+  metrics->set("memory_plan_bytes",
+               _context_ptr->memory_manager_ptr()->total_buffer_size());
+}
+
+template <typename OpType_>
+std::string Llama<OpType_>::metrics_text() {
+  return _context_ptr->metrics()->prometheus_text();
+}
+
+template <typename OpType_>
+void Llama<OpType_>::layer_time_sampling(int interval) {
+  _context_ptr->metrics()->set_layer_sampling(interval);
+}
+
+template <typename OpType_>
+void Llama<OpType_>::set_draft_model(LSModel *draft_model,
+                                     int num_draft_tokens) {
+  Llama *draft = dynamic_cast<Llama *>(draft_model);
+  std::string error_message;
+  if (draft_model && !draft) {
+    error_message =
+        "the draft model of Llama must be a Llama of the same precision\n";
+  } else if (draft == this) {
+    error_message = "a model can not be its own draft model\n";
+  } else if (draft && draft->_generate_method == GenerateMethod::BeamSearch) {
+    error_message = "the draft model can not use beam search\n";
+  } else if (draft && (_context_ptr->tp_size() > 1 || !_stages.empty() ||
+                       draft->_context_ptr->tp_size() > 1 ||
+                       !draft->_stages.empty())) {
+    error_message =
+        "speculative decoding does not support tensor or pipeline parallel\n";
+  } else if (draft && _generate_method != GenerateMethod::BeamSearch &&
+             (_generate_method != GenerateMethod::Topk || tw_._topk != 1)) {
+    // the verification would sample from the full softmax, not from the
+    // truncated one of topk or topp.
+    error_message =
+        "speculative decoding supports greedy decoding only, topk 1\n";
+  } else if (draft && draft->tw_._src_vocab_size != tw_._src_vocab_size) {
+    error_message = "the draft model has a vocabulary of " +
+                    std::to_string(draft->tw_._src_vocab_size) +
+                    " tokens, the target model " +
+                    std::to_string(tw_._src_vocab_size) + "\n";
+  }
+  if (!error_message.empty()) {
+    printf("%s", error_message.c_str());
+    throw std::runtime_error(error_message);
+  }
+
+  _draft_model = draft;
+  _num_draft_tokens = std::min(std::max(num_draft_tokens, 1), kMaxDraftTokens);
+  if (!draft) return;
+  if (_generate_method == GenerateMethod::BeamSearch) {
+    printf("speculative decoding does not support beam search, ignored.\n");
+  }
+  if (!_num_accepted) {
+    _num_accepted = (int *)_context_ptr->allocator()->malloc_mem(sizeof(int));
+  }
+  if (!draft->_draft_logits) {
+    draft->_draft_logits =
+        (OpType_ *)draft->_context_ptr->allocator()->malloc_mem(
+            size_t(kMaxDraftTokens) * tw_._src_vocab_size * sizeof(OpType_));
+  }
+  _sample_seed = std::chrono::system_clock::now().time_since_epoch().count();
+  draft->_sample_seed = _sample_seed + 1;
+}
+
+template <typename OpType_>
+void Llama<OpType_>::set_token_callback(
+    std::function<void(int, const std::vector<int> &)> callback) {
+  if (callback && _generate_method == GenerateMethod::BeamSearch) {
+    // the beams are reordered at every step, their tokens are only final
+    // at the end.
+    printf("streaming output does not support beam search, ignored.\n");
+    return;
+  }
+  _token_streamer.set_callback(callback);
+}
+
+template <typename OpType_>
+void Llama<OpType_>::load_lora_adapter(const std::string &name,
+                                       const std::string &path) {
+  std::string error_message;
+  if (tw_._weight_quant_bits || tw_._fp8 || tw_._int8) {
+    error_message = "LoRA adapters need the dense weights, not quantized\n";
+  } else if (tw_._expert_num > 0) {
+    error_message = "LoRA adapters do not support the experts of moe\n";
+  } else if (!_stages.empty()) {
+    error_message = "LoRA adapters do not support pipeline parallel\n";
+  }
+#ifndef LIGHTSEQ_cuda
+  error_message = "LoRA adapters need cuda\n";
+#endif
+  if (!error_message.empty()) {
+    printf("%s", error_message.c_str());
+    throw std::runtime_error(error_message);
+  }
+#ifdef LIGHTSEQ_cuda
+  if (!_lora_cache) {
+    int tp_size = _context_ptr->tp_size();
+    _lora_cache.reset(new LoraAdapterCache<OpType_>(
+        tw_._layer_num, tw_._hidden_size,
+        tw_._head_num / tp_size * tw_._dim_per_head,
+        tw_._inner_size / tp_size,
+        tw_._max_step * _max_batch_size * tw_._beam_size,
+        _context_ptr->tp_rank(), tp_size,
+        _lora_slots, _lora_max_rank, _context_ptr->get_stream()));
+  }
+  _lora_cache->load(name, path);
+#endif
+}
+
+template <typename OpType_>
+void Llama<OpType_>::set_lora_adapters(const std::vector<std::string> &names) {
+  for (const std::string &name : names) {
+#ifdef LIGHTSEQ_cuda
+    bool loaded = _lora_cache && _lora_cache->contains(name);
+#else
+    bool loaded = false;
+#endif
+    if (!name.empty() && !loaded) {
+      throw std::runtime_error("LoRA adapter " + name + " is not loaded");
+    }
+  }
+  _lora_names = names;
+}
+
+template <typename OpType_>
+void Llama<OpType_>::attach_lora(bool attach) {
+#ifdef LIGHTSEQ_cuda
+  if (!_lora_cache) return;
+  for (int idx = 0; idx < _llama_layer_vec.size(); idx++) {
+    _llama_layer_vec[idx]->set_lora(
+        attach ? _lora_cache->target(idx, 0) : nullptr,
+        attach ? _lora_cache->target(idx, 1) : nullptr);
+  }
+#endif
+}
+
+template <typename OpType_>
+void Llama<OpType_>::set_lora_rows(int batch_size, int seq_len) {
+#ifdef LIGHTSEQ_cuda
+  int rows = batch_size * tw_._beam_size * seq_len;
+  if (batch_size == 1) {
+    // also covers the rows of speculative decoding.
+    rows = tw_._max_step * _max_batch_size * tw_._beam_size;
+  }
+  std::vector<int> row_slots(rows);
+  for (int row = 0; row < rows; row++) {
+    int batch_idx = batch_size == 1 ? 0 : row / seq_len / tw_._beam_size;
+    row_slots[row] = _lora_batch_slots[batch_idx];
+  }
+  _lora_cache->set_row_slots(row_slots);
+#endif
+}
+
+template <typename OpType_>
+void Llama<OpType_>::stream_tokens(int batch_size, int prompt_len, int steps) {
+#ifdef LIGHTSEQ_cuda
+  if (!_token_streamer.enabled()) return;
+  // the sampled token follows the last token of every row.
+  _token_streamer.push(steps, _inp_tokens->value<int>() + prompt_len + steps,
+                       batch_size, tw_._max_step, _context_ptr->get_stream());
+#endif
+}
+
+template <typename OpType_>
+void Llama<OpType_>::before_forward_tokens(int offset, int query_len,
+                                           int num_logits) {
+  _launch_llama_emb_layer->before_forward(1, query_len, offset);
+  for (auto iter : _llama_layer_vec) {
+    iter->before_forward(1, query_len, offset);
+  }
+  _rms_norm_layer->before_forward(num_logits, 1);
+  _linear_layer->before_forward(num_logits, 1);
+}
+
+template <typename OpType_>
+void Llama<OpType_>::forward_tokens(int offset, int query_len, int num_logits) {
+#ifdef LIGHTSEQ_cuda
+  before_forward_tokens(offset, query_len, num_logits);
+  _launch_llama_emb_layer->forward();
+  forward_layer_vec();
+  // the head reads the last num_logits tokens in place.
+  _rms_norm_layer->set_input_rows(1, query_len - num_logits);
+  _rms_norm_layer->forward();
+  _linear_layer->forward();
+#endif
+}
+
+template <typename OpType_>
+void Llama<OpType_>::propose_draft_tokens(int *tokens, int seq_len,
+                                          int num_draft, bool greedy) {
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  int *inp_tokens_ptr = _inp_tokens->value<int>();
+  if (_kv_page_table) {
+    reserve_kv_pages(1, seq_len + num_draft - 1);
+  }
+  // catch up with the tokens accepted since the last proposal.
+  CHECK_GPU_ERROR(cudaMemcpyAsync(
+      inp_tokens_ptr + _draft_cached_len, tokens + _draft_cached_len,
+      (seq_len - _draft_cached_len) * sizeof(int), cudaMemcpyDefault, stream));
+  int offset = _draft_cached_len, query_len = seq_len - _draft_cached_len;
+  for (int idx = 0; idx < num_draft; idx++) {
+    forward_tokens(offset, query_len, 1);
+    const OpType_ *logits = _linear_layer->output(0)->template value<OpType_>();
+    cuda::launch_speculative_sample(logits, inp_tokens_ptr + seq_len + idx,
+                                    tw_._src_vocab_size, greedy, _sample_seed,
+                                    _sample_counter++, stream);
+    CHECK_GPU_ERROR(cudaMemcpyAsync(
+        _draft_logits + size_t(idx) * tw_._src_vocab_size, logits,
+        tw_._src_vocab_size * sizeof(OpType_), cudaMemcpyDefault, stream));
+    offset += query_len;
+    query_len = 1;
+  }
+  // the kv of the last proposed token are not computed.
+  _draft_cached_len = seq_len + num_draft - 1;
+
+  CHECK_GPU_ERROR(cudaMemcpyAsync(tokens + seq_len, inp_tokens_ptr + seq_len,
+                                  num_draft * sizeof(int), cudaMemcpyDefault,
+                                  stream));
+  _context_ptr->synchronize();
+#endif
+}
+
+template <typename OpType_>
+int Llama<OpType_>::speculative_decode(int prompt_len, int seq_len) {
+#ifdef LIGHTSEQ_cuda
+  Llama *draft = _draft_model;
+  bool greedy = _generate_method == GenerateMethod::Topk && tw_._topk == 1;
+  if (draft->_dynamic_memory_plan) {
+    draft->switch_memory_plan(1, tw_._max_step - 1);
+  }
+  if (draft->_kv_page_table) {
+    draft->_kv_page_table->release_all();
+  }
+  draft->_draft_cached_len = 0;
+
+  cudaStream_t stream = _context_ptr->get_stream();
+  int *tokens = _inp_tokens->value<int>();
+  std::vector<int> new_tokens(kMaxDraftTokens + 2);
+  _context_ptr->synchronize();
+  while (seq_len < tw_._max_step) {
+    // as in Infer, a cancelled row gets eos in place of its last token.
+    std::vector<int> cancelled =
+        _row_cancellation.apply(tokens, seq_len - 1, 1, tw_._max_step,
+                                tw_._eos_id, true, stream);
+    if (!cancelled.empty()) {
+      _context_ptr->metrics()->add("cancelled_requests_total",
+                                   cancelled.size());
+    }
+    if (_row_cancellation.all_cancelled()) break;
+    int num_draft = std::min(
+        {_num_draft_tokens, tw_._max_step - seq_len - 1,
+         draft->tw_._max_step - seq_len});
+    if (num_draft > 0) {
+      draft->propose_draft_tokens(tokens, seq_len, num_draft, greedy);
+    }
+
+    // token seq_len - 1 has no kv yet, it is verified together with the
+    // draft tokens.
+    if (_kv_page_table) {
+      reserve_kv_pages(1, seq_len + num_draft);
+    }
+    forward_tokens(seq_len - 1, num_draft + 1, num_draft + 1);
+    cuda::launch_speculative_verify(
+        _linear_layer->output(0)->template value<OpType_>(),
+        num_draft > 0 ? draft->_draft_logits : nullptr, tokens + seq_len,
+        _num_accepted, num_draft, tw_._src_vocab_size, greedy, _sample_seed,
+        _sample_counter++, stream);
+    CHECK_GPU_ERROR(cudaMemcpyAsync(new_tokens.data(), _num_accepted,
+                                    sizeof(int), cudaMemcpyDeviceToHost,
+                                    stream));
+    CHECK_GPU_ERROR(cudaMemcpyAsync(new_tokens.data() + 1, tokens + seq_len,
+                                    (num_draft + 1) * sizeof(int),
+                                    cudaMemcpyDeviceToHost, stream));
+    _context_ptr->synchronize();
+
+    int num_tokens = new_tokens[0];
+    int eos_idx = std::find(new_tokens.begin() + 1,
+                            new_tokens.begin() + 1 + num_tokens, tw_._eos_id) -
+                  new_tokens.begin() - 1;
+    for (int idx = 0; idx < std::min(num_tokens, eos_idx + 1); idx++) {
+      _token_streamer.push_host(seq_len - prompt_len + idx,
+                                {new_tokens[idx + 1]});
+    }
+    if (eos_idx < num_tokens) {
+      seq_len += eos_idx;
+      break;
+    }
+    // the draft cache stays valid up to its last accepted token.
+    draft->_draft_cached_len =
+        std::min(draft->_draft_cached_len, seq_len + num_tokens - 1);
+    seq_len += num_tokens;
+  }
+  if (draft->_kv_page_table) {
+    draft->_kv_page_table->release_all();
+  }
+#endif
+  return seq_len;
+}
+
+template <typename OpType_>
+int Llama<OpType_>::add_request(const std::vector<int> &prompt,
+                                int max_new_tokens, int priority,
+                                int deadline_ms, int session_id) {
+  if (!_kv_page_table) {
+    std::string error_message =
+        "continuous batching needs the paged kv cache, set "
+        "kv_page_size\n";
+    printf("%s", error_message.c_str());
+    throw std::runtime_error(error_message);
+  }
+  if (_has_generation_configs || _has_logits_processor ||
+      _has_token_automaton) {
+    std::string error_message =
+        "continuous batching does not support per row generation configs, "
+        "logits processors or token automatons, clear them first\n";
+    printf("%s", error_message.c_str());
+    throw std::runtime_error(error_message);
+  }
+  if (prompt.empty() || prompt.size() >= tw_._max_step) {
+    std::string error_message = "prompt length " +
+                                std::to_string(prompt.size()) +
+                                " is out of range (0, max_step)\n";
+    printf("%s", error_message.c_str());
+    throw std::runtime_error(error_message);
+  }
+  if (max_new_tokens <= 0 || max_new_tokens > tw_._max_step - prompt.size()) {
+    max_new_tokens = tw_._max_step - prompt.size();
+  }
+  return _request_slots.add_request(prompt, max_new_tokens, priority,
+                                    deadline_ms, session_id);
+}
+
+template <typename OpType_>
+void Llama<OpType_>::commit_token(
+    int slot_idx, int token,
+    std::vector<std::pair<int, std::vector<int>>> *finished) {
+  GenerationRequest &request = _request_slots.slot(slot_idx);
+  request.tokens.push_back(token);
+  request.step++;
+  _step_tokens.emplace_back(request.request_id, token);
+  if (token == tw_._eos_id || request.step >= request.max_new_tokens) {
+    Metrics *metrics = _context_ptr->metrics();
+    metrics->add("requests_total", 1);
+    metrics->observe("request_prompt_tokens", request.prompt_len);
+    metrics->observe("request_generated_tokens", request.step);
+    if (_kv_host_cache && request.session_id >= 0) {
+      // the last token has no kv yet.
+      save_host_kv(slot_idx, request.tokens.size() - 1);
+    }
+    _kv_page_table->release(slot_idx);
+    GenerationRequest done = _request_slots.retire(slot_idx);
+    finished->emplace_back(done.request_id, std::move(done.tokens));
+  }
+}
+
+template <typename OpType_>
+void Llama<OpType_>::evict_requests() {
+  std::vector<int> ids = _cancelled_requests.take();
+  int num_cancelled = ids.size();
+  if (_evict_expired) {
+    double now_ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now().time_since_epoch())
+                        .count();
+    std::vector<int> expired = _request_slots.expired(now_ms);
+    ids.insert(ids.end(), expired.begin(), expired.end());
+  }
+  Metrics *metrics = _context_ptr->metrics();
+  for (int idx = 0; idx < ids.size(); idx++) {
+    int request_id = ids[idx];
+    int slot_idx = _request_slots.find_slot(request_id);
+    if (slot_idx >= 0) {
+      _kv_page_table->release(slot_idx);
+      _request_slots.retire(slot_idx);
+    } else if (!_request_slots.drop_waiting(request_id)) {
+      // finished, or evicted already.
+      continue;
+    }
+    // the kv saved by a preemption, the one of a session stays.
+    if (_kv_host_cache) _kv_host_cache->erase(-1 - request_id);
+    _step_evicted.push_back(request_id);
+    metrics->add(idx < num_cancelled ? "cancelled_requests_total"
+                                     : "expired_requests_total",
+                 1);
+  }
+}
+
+template <typename OpType_>
+void Llama<OpType_>::preempt_request(int slot_idx) {
+  // the kv is dropped and recomputed on resume. The full pages already
+  // computed go to the prefix cache first, so that the resumed request skips
+  // them unless they were evicted in between, and all of the computed kv to
+  // host memory if it is enabled.
+  const GenerationRequest &request = _request_slots.slot(slot_idx);
+  int computed_len = request.cached_len < request.prefill_len
+                         ? request.cached_len
+                         : int(request.tokens.size()) - 1;
+  if (_prefix_cache) {
+    _prefix_cache->insert(slot_idx, request.tokens, computed_len);
+  }
+  if (_kv_host_cache) {
+    save_host_kv(slot_idx, computed_len);
+  }
+  _kv_page_table->release(slot_idx);
+  _request_slots.preempt(slot_idx);
+  _context_ptr->metrics()->add("preemptions_total", 1);
+}
+
+template <typename OpType_>
+void Llama<OpType_>::save_host_kv(int slot_idx, int len) {
+  const GenerationRequest &request = _request_slots.slot(slot_idx);
+  std::vector<int> host_pages =
+      _kv_host_cache->save(host_kv_key(request), request.tokens, len);
+  if (host_pages.empty()) {
+    return;
+  }
+  // the kv of the slot is written by the forward of the last step, which the
+  // host waited for. The pages stay held until they are copied.
+  const int *seq_pages = _kv_page_table->seq_pages(slot_idx);
+  std::vector<int> pages;
+  for (int idx = 0; idx < host_pages.size(); idx++) {
+    pages.push_back(seq_pages[idx]);
+    pages.push_back(host_pages[idx]);
+    _kv_page_table->retain_page(seq_pages[idx]);
+    _kv_saving_pages.push_back(seq_pages[idx]);
+  }
+  copy_host_kv(pages, true);
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaEventRecord(_kv_saved, _kv_host_stream));
+#endif
+  _context_ptr->metrics()->add("kv_offloaded_tokens_total", len);
+}
+
+template <typename OpType_>
+void Llama<OpType_>::copy_host_kv(const std::vector<int> &pages,
+                                  bool to_host) {
+#ifdef LIGHTSEQ_cuda
+  // the copies of the pairs, like the ones into the host pages, are ordered
+  // by _kv_host_stream.
+  int *device_pages = _kv_host_pages->value<int>();
+  CHECK_GPU_ERROR(cudaMemcpyAsync(device_pages, pages.data(),
+                                  pages.size() * sizeof(int),
+                                  cudaMemcpyHostToDevice, _kv_host_stream));
+  int num_pages = pages.size() / 2;
+  int dim = tw_._dim_per_head;
+  int page_vecs = _page_cache_size / dim;
+  size_t host_layer_vecs = size_t(_kv_host_cache->num_pages()) * page_vecs;
+  // the scales of the int8 cache keep the pool of the prompt phase.
+  size_t scale_layer_vecs = size_t(_prompt_num_pages) * page_vecs;
+  for (int idx = 0; idx < _caches_k.size(); idx++) {
+    for (int kv = 0; kv < 2; kv++) {
+      Variable *cache = kv ? _caches_v[idx] : _caches_k[idx];
+      Variable *cache_scale_var =
+          kv ? _total_caches_v_scale : _total_caches_k_scale;
+      float *cache_scale =
+          cache_scale_var
+              ? cache_scale_var->value<float>() + idx * scale_layer_vecs
+              : nullptr;
+      size_t host_offset = idx * host_layer_vecs * dim;
+      void *host = kv ? _kv_host_v : _kv_host_k;
+      float *host_scale = kv ? _kv_host_v_scale : _kv_host_k_scale;
+      if (host_scale) host_scale += idx * host_layer_vecs;
+      auto copy = [&](auto *cache_ptr, auto *host_ptr) {
+        if (to_host) {
+          launch_copy_kv_pages(cache_ptr, cache_scale, host_ptr, host_scale,
+                               device_pages, num_pages, page_vecs, dim,
+                               _kv_host_stream);
+        } else {
+          launch_copy_kv_pages(host_ptr, host_scale, cache_ptr, cache_scale,
+                               device_pages, num_pages, page_vecs, dim,
+                               _kv_host_stream);
+        }
+      };
+      if (cache_scale) {
+        copy(cache->value<int8_t>(), (int8_t *)host + host_offset);
+      } else if (_kv_host_int8) {
+        copy(cache->value<OpType_>(), (int8_t *)host + host_offset);
+      } else {
+        copy(cache->value<OpType_>(), (OpType_ *)host + host_offset);
+      }
     }
+    if (!to_host) {
+      CHECK_GPU_ERROR(cudaEventRecord(_kv_restored[idx], _kv_host_stream));
+    }
+  }
+#endif
+}
+
+template <typename OpType_>
+void Llama<OpType_>::release_saved_kv(bool wait) {
+  if (_kv_saving_pages.empty()) {
+    return;
+  }
+#ifdef LIGHTSEQ_cuda
+  if (wait) {
+    CHECK_GPU_ERROR(cudaEventSynchronize(_kv_saved));
+  } else if (cudaEventQuery(_kv_saved) != cudaSuccess) {
+    return;
+  }
+#endif
+  for (int page : _kv_saving_pages) {
+    _kv_page_table->release_page(page);
+  }
+  _kv_saving_pages.clear();
+}
+
+template <typename OpType_>
+std::vector<int> Llama<OpType_>::forward_rows(
+    const std::vector<int> &tokens, const std::vector<int> &offsets,
+    const std::vector<int> &row_slots, const std::vector<int> &sample_rows) {
+  std::vector<int> next_tokens(sample_rows.size());
+#ifdef LIGHTSEQ_cuda
+  int num_rows = tokens.size();
+  int max_pages = _kv_page_table->max_pages();
+  std::vector<int> page_table(num_rows * max_pages);
+  for (int row = 0; row < num_rows; row++) {
+    const int *pages = _kv_page_table->seq_pages(row_slots[row]);
+    std::copy(pages, pages + max_pages, page_table.begin() + row * max_pages);
   }
 
+  cudaStream_t stream = _context_ptr->get_stream();
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_seq_offsets->value<int>(), offsets.data(),
+                                  num_rows * sizeof(int),
+                                  cudaMemcpyHostToDevice, stream));
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_page_table->value<int>(), page_table.data(),
+                                  page_table.size() * sizeof(int),
+                                  cudaMemcpyHostToDevice, stream));
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_inp_tokens->value<int>(), tokens.data(),
+                                  num_rows * sizeof(int),
+                                  cudaMemcpyHostToDevice, stream));
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_sample_rows->value<int>(),
+                                  sample_rows.data(),
+                                  sample_rows.size() * sizeof(int),
+                                  cudaMemcpyHostToDevice, stream));
+
+  // the tokens are embedded as one row, whose output is the same memory as
+  // num_rows sequences of a single token, each at its own position.
+  _launch_llama_emb_layer->before_forward(1, num_rows, 0);
+  for (auto iter : _llama_layer_vec) {
+    iter->before_forward(num_rows, 1, 0);
+  }
+  _launch_llama_emb_layer->forward();
+  forward_layer_vec();
+
+  // only the sampled rows go through the head, read in place.
+  int num_samples = sample_rows.size();
+  _rms_norm_layer->before_forward(num_samples, 1);
+  _rms_norm_layer->set_input_rows(1, 0, _sample_rows->value<int>());
+  _linear_layer->before_forward(num_samples, 1);
+  _generator_layer->before_forward(num_samples, 1, 0);
+  _rms_norm_layer->forward();
+  _linear_layer->forward();
+  _generator_layer->forward();
+
+  // the token sampled for a row follows it in its token row.
+  CHECK_GPU_ERROR(cudaMemcpy2DAsync(
+      next_tokens.data(), sizeof(int), _inp_tokens->value<int>() + 1,
+      tw_._max_step * sizeof(int), sizeof(int), num_samples,
+      cudaMemcpyDeviceToHost, stream));
   _context_ptr->synchronize();
-  set_output_shape(0, {batch_size, tw_._beam_size, prompt_len + steps});
+#endif
+  return next_tokens;
 }
 
-void Llama::set_input_ptr(int index, void *input_ptr) {
+template <typename OpType_>
+std::vector<std::pair<int, std::vector<int>>> Llama<OpType_>::step() {
+  std::vector<std::pair<int, std::vector<int>>> finished;
+  _step_tokens.clear();
+  _step_evicted.clear();
+  evict_requests();
+  apply_weight_update();
+  if (_request_slots.empty()) {
+    return finished;
+  }
+  restore_weights();
+  resume();
+  if (_serving_plan) {
+    enter_serving_phase();
+  } else if (_dynamic_memory_plan) {
+    // any mix of rows in a step fits in the plan of the largest bucket.
+    switch_memory_plan(_max_batch_size, tw_._max_step - 1);
+  }
+  // steps of the running batch are launched eagerly, the graph offset
+  // would shift the token of every row.
+  _launch_llama_emb_layer->set_offset_ptr(nullptr);
+  for (auto iter : _llama_layer_vec) {
+    iter->set_seq_offsets(_seq_offsets->value<int>());
+  }
+  // the running batch uses the base model, see set_lora_adapters.
+  attach_lora(false);
+
+  // the waiting requests join while there are free slots. The pages of the
+  // whole request are reserved on admission, so a running request never
+  // runs out of kv cache. The full pages of a prompt prefix seen before are
+  // shared instead, at least the last prompt token is run to sample the
+  // first token. A request which does not fit preempts the running ones of
+  // a lower priority until it does. The kv of a request whose session or
+  // whose preemption saved it to host memory is restored into its pages
+  // after the cached prefix, layer by layer while the step runs.
+  release_saved_kv(false);
+  std::vector<int> restore_pages;
+  while (_request_slots.has_waiting()) {
+    const GenerationRequest &request = _request_slots.next_waiting();
+    int page_size = _kv_page_table->page_size();
+    std::vector<int> cached_pages;
+    if (_prefix_cache) {
+      cached_pages =
+          _prefix_cache->match(request.tokens, request.prefill_len - 1);
+    }
+    // the matched pages must survive the eviction below.
+    for (int page : cached_pages) {
+      _kv_page_table->retain_page(page);
+    }
+    int need_pages =
+        (request.prompt_len + request.max_new_tokens + page_size - 1) /
+            page_size -
+        cached_pages.size();
+    if (need_pages > _kv_page_table->num_free_pages()) {
+      release_saved_kv(true);
+    }
+    bool has_pages = need_pages <= _kv_page_table->num_free_pages() ||
+                     (_prefix_cache && _prefix_cache->evict(need_pages));
+    int slot_idx = has_pages ? _request_slots.admit() : -1;
+    if (slot_idx >= 0) {
+      _kv_page_table->share(slot_idx, cached_pages);
+    }
+    for (int page : cached_pages) {
+      _kv_page_table->release_page(page);
+    }
+    if (slot_idx < 0) {
+      int victim = _request_slots.preemption_victim(request);
+      if (victim < 0) break;
+      preempt_request(victim);
+      continue;
+    }
+    GenerationRequest &admitted = _request_slots.slot(slot_idx);
+    _kv_page_table->reserve(slot_idx,
+                            admitted.prompt_len + admitted.max_new_tokens);
+    admitted.cached_len = cached_pages.size() * page_size;
+    if (_kv_host_cache) {
+      int key = host_kv_key(admitted);
+      std::vector<int> host_pages;
+      int restore_len = _kv_host_cache->match(
+          key, admitted.tokens, admitted.prefill_len - 1, &host_pages);
+      if (restore_len > admitted.cached_len) {
+        const int *seq_pages = _kv_page_table->seq_pages(slot_idx);
+        for (int idx = cached_pages.size(); idx < host_pages.size(); idx++) {
+          restore_pages.push_back(host_pages[idx]);
+          restore_pages.push_back(seq_pages[idx]);
+        }
+        _context_ptr->metrics()->add("kv_restored_tokens_total",
+                                     restore_len - admitted.cached_len);
+        admitted.cached_len = restore_len;
+      }
+      // the host pages are reused after the copies queued before.
+      _kv_host_cache->erase(key);
+    }
+  }
+  if (!restore_pages.empty()) {
+    copy_host_kv(restore_pages, false);
+    _kv_restore_pending = true;
+  }
+
+  // every running request decodes one token, and the prompts still being
+  // prefilled fill the rest of the token budget of the step, in slot order.
+  // A prompt longer than the budget is spread over several steps, which
+  // bounds the latency a long prompt adds to the decoding requests.
+  std::vector<int> tokens, offsets, row_slots, sample_rows, sample_slots;
+  std::vector<int> slots = _request_slots.active_slots();
+  for (int slot_idx : slots) {
+    const GenerationRequest &request = _request_slots.slot(slot_idx);
+    if (request.cached_len < request.prefill_len) continue;
+    sample_rows.push_back(tokens.size());
+    sample_slots.push_back(slot_idx);
+    // the kv of the last token is written by this step.
+    offsets.push_back(request.tokens.size() - 1);
+    tokens.push_back(request.tokens.back());
+    row_slots.push_back(slot_idx);
+  }
+  // the rows are embedded as a single sequence, which must stay shorter
+  // than max_step.
+  int budget = tw_._max_step - 1 - int(tokens.size());
+  if (_prefill_chunk_size > 0) {
+    budget = std::min(budget, _prefill_chunk_size);
+  }
+  std::vector<int> prefill_slots, prefill_lens;
+  for (int slot_idx : slots) {
+    const GenerationRequest &request = _request_slots.slot(slot_idx);
+    if (budget <= 0) break;
+    if (request.cached_len >= request.prefill_len) continue;
+    int chunk_len = std::min(budget, request.prefill_len - request.cached_len);
+    for (int pos = request.cached_len; pos < request.cached_len + chunk_len;
+         pos++) {
+      offsets.push_back(pos);
+      tokens.push_back(request.tokens[pos]);
+      row_slots.push_back(slot_idx);
+    }
+    if (request.cached_len + chunk_len == request.prefill_len) {
+      sample_rows.push_back(tokens.size() - 1);
+      sample_slots.push_back(slot_idx);
+    }
+    prefill_slots.push_back(slot_idx);
+    prefill_lens.push_back(chunk_len);
+    budget -= chunk_len;
+  }
+
+  if (!tokens.empty()) {
+    Metrics *metrics = _context_ptr->metrics();
+    metrics->begin_forward();
+    std::vector<int> next_tokens =
+        forward_rows(tokens, offsets, row_slots, sample_rows);
+    metrics->end_forward();
+    metrics->add("steps_total", 1);
+    int prefill_tokens = 0;
+    for (int len : prefill_lens) prefill_tokens += len;
+    metrics->add("prompt_tokens_total", prefill_tokens);
+    metrics->add("generated_tokens_total", sample_slots.size());
+    update_metric_gauges(slots.size());
+    for (int idx = 0; idx < prefill_slots.size(); idx++) {
+      GenerationRequest &request = _request_slots.slot(prefill_slots[idx]);
+      request.cached_len += prefill_lens[idx];
+      if (_prefix_cache && request.cached_len == request.prompt_len) {
+        _prefix_cache->insert(prefill_slots[idx], request.tokens,
+                              request.prompt_len);
+      }
+    }
+    for (int idx = 0; idx < sample_slots.size(); idx++) {
+      commit_token(sample_slots[idx], next_tokens[idx], &finished);
+    }
+  }
+
+  for (auto iter : _llama_layer_vec) {
+    iter->set_seq_offsets(nullptr);
+  }
+  if (_cuda_graph_mode) {
+    _launch_llama_emb_layer->set_offset_ptr(_step_offset->value<int>());
+  }
+  // the device table now holds the rows of the step, Infer rebuilds it.
+  _kv_page_table->clear_dirty();
+  return finished;
+}
+
+template <typename OpType_>
+void Llama<OpType_>::export_profile(const std::string &trace_path) {
+  Profiler *profiler = _context_ptr->profiler();
+  if (profiler == nullptr) {
+    printf("profiling is not enabled, nothing to export.\n");
+    return;
+  }
+  profiler->print_summary();
+  profiler->export_chrome_trace(trace_path);
+}
+
+template <typename OpType_>
+void Llama<OpType_>::set_input_ptr(int index, void *input_ptr) {
   switch (index) {
     case 0:
       _input_ptr = (int *)input_ptr;
@@ -214,7 +2502,8 @@ void Llama::set_input_ptr(int index, void *input_ptr) {
   }
 }
 
-void Llama::set_output_ptr(int index, void *output_ptr) {
+template <typename OpType_>
+void Llama<OpType_>::set_output_ptr(int index, void *output_ptr) {
   switch (index) {
     case 0:
       _llama_out_ptr = (int *)output_ptr;
@@ -226,7 +2515,8 @@ void Llama::set_output_ptr(int index, void *output_ptr) {
   }
 }
 
-const void *Llama::get_output_ptr(int index) {
+template <typename OpType_>
+const void *Llama<OpType_>::get_output_ptr(int index) {
   switch (index) {
     case 0:
       return static_cast<void *>(_llama_out_ptr);
@@ -237,7 +2527,8 @@ const void *Llama::get_output_ptr(int index) {
   }
 }
 
-std::vector<int> Llama::get_input_max_shape(int index) {
+template <typename OpType_>
+std::vector<int> Llama<OpType_>::get_input_max_shape(int index) {
   switch (index) {
     case 0:
       return {_max_batch_size, tw_._max_step};
@@ -247,7 +2538,8 @@ std::vector<int> Llama::get_input_max_shape(int index) {
       break;
   }
 }
-std::vector<int> Llama::get_output_max_shape(int index) {
+template <typename OpType_>
+std::vector<int> Llama<OpType_>::get_output_max_shape(int index) {
   switch (index) {
     case 0:
       return {_max_batch_size, tw_._beam_size, tw_._max_step};
@@ -258,7 +2550,8 @@ std::vector<int> Llama::get_output_max_shape(int index) {
   }
 }
 
-DataType Llama::get_input_dtype(int index) {
+template <typename OpType_>
+DataType Llama<OpType_>::get_input_dtype(int index) {
   switch (index) {
     case 0:
       return DataType::kInt32;
@@ -270,7 +2563,8 @@ DataType Llama::get_input_dtype(int index) {
   }
 }
 
-DataType Llama::get_output_dtype(int index) {
+template <typename OpType_>
+DataType Llama<OpType_>::get_output_dtype(int index) {
   switch (index) {
     case 0:
       return DataType::kInt32;
@@ -281,5 +2575,12 @@ DataType Llama::get_output_dtype(int index) {
       break;
   }
 }
+
+template class Llama<float>;
+#ifdef LIGHTSEQ_cuda
+template class Llama<__half>;
+template class Llama<__nv_bfloat16>;
+#endif
+
 }  // namespace cuda
 }  // namespace lightseq
@@ -0,0 +1,269 @@
+#include "lora_adapter_cache.h"
+
+#include <algorithm>
+
+#include "hdf5_util.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+const char* const kLoraTargetNames[2] = {"attention_output",
+                                         "down_project_weight"};
+}  // namespace
+
+template <typename T>
+LoraAdapterCache<T>::LoraAdapterCache(int num_layers, int hidden_size,
+                                      int attn_out_in_size, int down_in_size,
+                                      int max_batch_tokens, int tp_rank,
+                                      int tp_size, int num_slots,
+                                      int max_rank, cudaStream_t stream)
+    : _num_layers(num_layers),
+      _max_batch_tokens(max_batch_tokens),
+      _tp_rank(tp_rank),
+      _tp_size(tp_size),
+      _num_slots(num_slots),
+      _max_rank(max_rank),
+      _stream(stream),
+      _in_sizes({attn_out_in_size, down_in_size}),
+      _out_sizes({hidden_size, hidden_size}),
+      _slot_names(num_slots),
+      _slot_last_use(num_slots, 0),
+      _row_slots(max_batch_tokens, -1) {
+  if (num_slots <= 0 || max_rank <= 0) {
+    throw std::runtime_error("LoRA needs at least one slot of rank > 0 !");
+  }
+  size_t max_size = 0;
+  for (int t = 0; t < kNumTargets; t++) {
+    _slot_size += size_t(max_rank) * (_in_sizes[t] + _out_sizes[t]);
+    max_size = std::max(max_size, size_t(max_rank) *
+                                      std::max(_in_sizes[t], _out_sizes[t]));
+  }
+  _slot_size *= num_layers;
+  std::cout << "LoRA cache of " << num_slots << " slots of rank " << max_rank
+            << ", " << num_slots * _slot_size * sizeof(T) / (1024 * 1024)
+            << " MB" << std::endl;
+
+  CHECK_GPU_ERROR(
+      cudaMalloc(&_slot_weights, num_slots * _slot_size * sizeof(T)));
+  CHECK_GPU_ERROR(cudaMemset(_slot_weights, 0,
+                             num_slots * _slot_size * sizeof(T)));
+  CHECK_GPU_ERROR(cudaMalloc(&_d_staging, max_size * sizeof(float)));
+  CHECK_GPU_ERROR(cudaMalloc(&_d_scales, num_slots * sizeof(float)));
+  CHECK_GPU_ERROR(cudaMemset(_d_scales, 0, num_slots * sizeof(float)));
+  CHECK_GPU_ERROR(cudaMalloc(&_d_row_slots, max_batch_tokens * sizeof(int)));
+  CHECK_GPU_ERROR(cudaMemcpy(_d_row_slots, _row_slots.data(),
+                             max_batch_tokens * sizeof(int),
+                             cudaMemcpyHostToDevice));
+  CHECK_GPU_ERROR(cudaMalloc(
+      &_workspace, size_t(max_batch_tokens) * max_rank * sizeof(float)));
+
+  int num_targets = num_layers * kNumTargets;
+  std::vector<T*> ptrs(num_targets * 2 * num_slots);
+  for (int layer = 0; layer < num_layers; layer++) {
+    for (int t = 0; t < kNumTargets; t++) {
+      T** target_ptrs = ptrs.data() + (layer * kNumTargets + t) * 2 * num_slots;
+      for (int s = 0; s < num_slots; s++) {
+        T* slot = _slot_weights + s * _slot_size;
+        target_ptrs[s] = slot + a_offset(layer, t);
+        target_ptrs[num_slots + s] = slot + b_offset(layer, t);
+      }
+    }
+  }
+  CHECK_GPU_ERROR(cudaMalloc(&_d_ptrs, ptrs.size() * sizeof(T*)));
+  CHECK_GPU_ERROR(cudaMemcpy(_d_ptrs, ptrs.data(), ptrs.size() * sizeof(T*),
+                             cudaMemcpyHostToDevice));
+
+  _targets.resize(num_targets);
+  for (int idx = 0; idx < num_targets; idx++) {
+    LoraTarget<T>& target = _targets[idx];
+    target.a_ptrs = _d_ptrs + idx * 2 * num_slots;
+    target.b_ptrs = _d_ptrs + idx * 2 * num_slots + num_slots;
+    target.scales = _d_scales;
+    target.row_slots = _d_row_slots;
+    target.workspace = _workspace;
+    target.rank = max_rank;
+  }
+}
+
+template <typename T>
+LoraAdapterCache<T>::~LoraAdapterCache() {
+  cudaFree(_slot_weights);
+  cudaFree(_d_staging);
+  cudaFree(_d_scales);
+  cudaFree(_d_row_slots);
+  cudaFree(_workspace);
+  cudaFree(_d_ptrs);
+}
+
+template <typename T>
+size_t LoraAdapterCache<T>::a_offset(int layer, int t) const {
+  size_t offset = _slot_size / _num_layers * layer;
+  for (int k = 0; k < t; k++) {
+    offset += size_t(_max_rank) * (_in_sizes[k] + _out_sizes[k]);
+  }
+  return offset;
+}
+
+template <typename T>
+size_t LoraAdapterCache<T>::b_offset(int layer, int t) const {
+  return a_offset(layer, t) + size_t(_max_rank) * _in_sizes[t];
+}
+
+template <typename T>
+void LoraAdapterCache<T>::load(const std::string& name,
+                               const std::string& path) {
+  if (name.empty()) {
+    throw std::runtime_error("LoRA adapter needs a name !");
+  }
+  hid_t hdf5_file = H5Fopen(path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (hdf5_file < 0) {
+    throw std::runtime_error("Unable to read HDF5 file from " + path);
+  }
+  Adapter adapter;
+  float alpha = 0.f;
+  read_hdf5_dataset_scalar(hdf5_file, "lora_conf/alpha", H5T_NATIVE_FLOAT,
+                           &alpha);
+  adapter.a.resize(_num_layers * kNumTargets);
+  adapter.b.resize(_num_layers * kNumTargets);
+  for (int layer = 0; layer < _num_layers; layer++) {
+    std::string dataset_prefix = "decoder_layers/" + std::to_string(layer);
+    for (int t = 0; t < kNumTargets; t++) {
+      std::string name_a =
+          dataset_prefix + "/" + kLoraTargetNames[t] + "_lora_a";
+      std::string name_b =
+          dataset_prefix + "/" + kLoraTargetNames[t] + "_lora_b";
+      // the full input of a tensor parallel linear is split into the ranks.
+      size_t local_in = _in_sizes[t], in = local_in * _tp_size;
+      size_t out = _out_sizes[t];
+      int size_a = get_hdf5_dataset_size(hdf5_file, name_a);
+      if (size_a <= 0 || size_a % in != 0) {
+        throw std::runtime_error("Wrong " + name_a + " size !");
+      }
+      int rank = size_a / in;
+      if (adapter.rank == 0) adapter.rank = rank;
+      if (rank != adapter.rank || rank > _max_rank) {
+        throw std::runtime_error(
+            "LoRA adapter " + name + " has rank " + std::to_string(rank) +
+            " in " + name_a + ", all its targets need the same rank of at "
+            "most lora_max_rank " + std::to_string(_max_rank) +
+            " !");
+      }
+
+      std::vector<float> value(rank * in);
+      read_hdf5_dataset_data(
+          hdf5_file, name_a, H5T_NATIVE_FLOAT, value.data(),
+          [=](int size) { return size != rank * in; },
+          "Wrong " + name_a + " size !");
+      std::vector<float>& a = adapter.a[layer * kNumTargets + t];
+      a.resize(rank * local_in);
+      for (int r = 0; r < rank; r++) {
+        std::copy(value.begin() + r * in + _tp_rank * local_in,
+                  value.begin() + r * in + (_tp_rank + 1) * local_in,
+                  a.begin() + r * local_in);
+      }
+
+      value.resize(out * rank);
+      read_hdf5_dataset_data(
+          hdf5_file, name_b, H5T_NATIVE_FLOAT, value.data(),
+          [=](int size) { return size != out * rank; },
+          "Wrong " + name_b + " size !");
+      // [out, rank] to [rank, out], the layout of launch_lora_expand.
+      std::vector<float>& b = adapter.b[layer * kNumTargets + t];
+      b.resize(rank * out);
+      for (size_t o = 0; o < out; o++) {
+        for (int r = 0; r < rank; r++) {
+          b[r * out + o] = value[o * rank + r];
+        }
+      }
+    }
+  }
+  H5Fclose(hdf5_file);
+  adapter.scale = alpha / adapter.rank;
+
+  _adapters[name] = std::move(adapter);
+  // a resident copy of the previous adapter of this name is stale.
+  for (int s = 0; s < _num_slots; s++) {
+    if (_slot_names[s] == name) {
+      upload(s, _adapters[name]);
+    }
+  }
+  std::cout << "loaded LoRA adapter " << name << " of rank "
+            << _adapters[name].rank << std::endl;
+}
+
+template <typename T>
+void LoraAdapterCache<T>::upload(int slot, const Adapter& adapter) {
+  T* slot_weights = _slot_weights + slot * _slot_size;
+  // the rows past the rank of the adapter must be zero.
+  CHECK_GPU_ERROR(
+      cudaMemsetAsync(slot_weights, 0, _slot_size * sizeof(T), _stream));
+  for (int layer = 0; layer < _num_layers; layer++) {
+    for (int t = 0; t < kNumTargets; t++) {
+      const std::vector<float>& a = adapter.a[layer * kNumTargets + t];
+      const std::vector<float>& b = adapter.b[layer * kNumTargets + t];
+      convert_dtype_by_gpu<T>(const_cast<float*>(a.data()), _d_staging,
+                              nullptr, slot_weights + a_offset(layer, t),
+                              a.size(), _stream);
+      convert_dtype_by_gpu<T>(const_cast<float*>(b.data()), _d_staging,
+                              nullptr, slot_weights + b_offset(layer, t),
+                              b.size(), _stream);
+    }
+  }
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_d_scales + slot, &adapter.scale,
+                                  sizeof(float), cudaMemcpyHostToDevice,
+                                  _stream));
+  // the host copies are pageable and may be replaced by the next load.
+  CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
+}
+
+template <typename T>
+std::vector<int> LoraAdapterCache<T>::acquire(
+    const std::vector<std::string>& names) {
+  _use_counter++;
+  std::vector<int> slots(names.size(), -1);
+  for (size_t i = 0; i < names.size(); i++) {
+    if (names[i].empty()) continue;
+    auto adapter = _adapters.find(names[i]);
+    if (adapter == _adapters.end()) {
+      throw std::runtime_error("LoRA adapter " + names[i] +
+                               " is not loaded !");
+    }
+    int slot = std::find(_slot_names.begin(), _slot_names.end(), names[i]) -
+               _slot_names.begin();
+    if (slot == _num_slots) {
+      // the least recently used slot, but not one of this batch.
+      slot = std::min_element(_slot_last_use.begin(), _slot_last_use.end()) -
+             _slot_last_use.begin();
+      if (_slot_last_use[slot] == _use_counter) {
+        throw std::runtime_error(
+            "A batch uses more LoRA adapters than the " +
+            std::to_string(_num_slots) + " lora_slots !");
+      }
+      upload(slot, adapter->second);
+      _slot_names[slot] = names[i];
+    }
+    _slot_last_use[slot] = _use_counter;
+    slots[i] = slot;
+  }
+  return slots;
+}
+
+template <typename T>
+void LoraAdapterCache<T>::set_row_slots(const std::vector<int>& row_slots) {
+  if (row_slots.size() > size_t(_max_batch_tokens)) {
+    throw std::runtime_error("LoRA rows exceed max batch tokens !");
+  }
+  std::copy(row_slots.begin(), row_slots.end(), _row_slots.begin());
+  std::fill(_row_slots.begin() + row_slots.size(), _row_slots.end(), -1);
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_d_row_slots, _row_slots.data(),
+                                  _max_batch_tokens * sizeof(int),
+                                  cudaMemcpyHostToDevice, _stream));
+}
+
+template class LoraAdapterCache<float>;
+template class LoraAdapterCache<__half>;
+template class LoraAdapterCache<__nv_bfloat16>;
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -0,0 +1,107 @@
+#include "model_manager.h"
+
+namespace lightseq {
+namespace cuda {
+
+ModelManager::Entry& ModelManager::find_entry(const std::string& name) {
+  auto iter = _models.find(name);
+  if (iter == _models.end()) {
+    throw std::runtime_error("ModelManager has no model " + name);
+  }
+  return iter->second;
+}
+
+bool ModelManager::evict_entry(Entry& entry) {
+  if (!entry.resident) {
+    return true;
+  }
+  // the running requests keep their kv, see LSModel::suspend.
+  if (!entry.evictable || entry.model->has_pending_requests()) {
+    return false;
+  }
+  if (!entry.model->evict_weights()) {
+    entry.evictable = false;
+    return false;
+  }
+  entry.resident = false;
+  _resident_bytes -= entry.weight_bytes;
+  return true;
+}
+
+void ModelManager::make_room(size_t bytes, const std::string& keep) {
+  while (_resident_bytes + bytes > _budget_bytes) {
+    Entry* victim = nullptr;
+    for (auto& iter : _models) {
+      Entry& entry = iter.second;
+      if (iter.first == keep || !entry.resident || !entry.evictable ||
+          entry.model->has_pending_requests()) {
+        continue;
+      }
+      if (victim == nullptr || entry.last_use < victim->last_use) {
+        victim = &entry;
+      }
+    }
+    if (victim == nullptr) {
+      printf("ModelManager: %zu MB of resident weights exceed the budget of "
+             "%zu MB, no model left to evict\n",
+             (_resident_bytes + bytes) / (1024 * 1024),
+             _budget_bytes / (1024 * 1024));
+      return;
+    }
+    evict_entry(*victim);
+  }
+}
+
+void ModelManager::add_model(const std::string& name,
+                             const std::string& class_name,
+                             const std::string& weight_path,
+                             int max_batch_size, DataType precision,
+                             const ModelOptions& options) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_models.find(name) != _models.end()) {
+    throw std::runtime_error("ModelManager already has a model " + name);
+  }
+  Entry entry;
+  entry.model.reset(LSModelFactory::GetInstance().CreateModel(
+      class_name, weight_path, max_batch_size, precision, options));
+  entry.weight_bytes = entry.model->weight_bytes();
+  entry.last_use = ++_clock;
+  // the activations of the build are released until the first request.
+  entry.model->suspend();
+  _resident_bytes += entry.weight_bytes;
+  _models.emplace(name, std::move(entry));
+  make_room(0, name);
+}
+
+void ModelManager::remove_model(const std::string& name) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  Entry& entry = find_entry(name);
+  if (entry.resident) _resident_bytes -= entry.weight_bytes;
+  _models.erase(name);
+}
+
+LSModel* ModelManager::acquire(const std::string& name) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  Entry& entry = find_entry(name);
+  entry.last_use = ++_clock;
+  if (!entry.resident) {
+    make_room(entry.weight_bytes, name);
+    entry.model->restore_weights();
+    entry.resident = true;
+    _resident_bytes += entry.weight_bytes;
+  }
+  return entry.model.get();
+}
+
+void ModelManager::evict(const std::string& name) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  evict_entry(find_entry(name));
+}
+
+bool ModelManager::is_resident(const std::string& name) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return find_entry(name).resident;
+}
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -11,4 +11,610 @@ GenerateMethod get_generate_method(std::string method_) {
   return GenerateMethod::UnDefined;
 }
 
+int shape_bucket(int value, int max_value) {
+  int bucket = 1;
+  while (bucket < value) {
+    bucket <<= 1;
+  }
+  return std::min(bucket, max_value);
+}
+
+std::vector<LengthBucket> length_buckets(const int* tokens, int batch_size,
+                                         int seq_len, int pad_id,
+                                         float max_waste,
+                                         int max_bucket_size) {
+  std::vector<int> lengths(batch_size);
+  for (int i = 0; i < batch_size; i++) {
+    const int* row = tokens + size_t(i) * seq_len;
+    int len = seq_len;
+    while (len > 1 && row[len - 1] == pad_id) len--;
+    lengths[i] = len;
+  }
+  std::vector<int> order(batch_size);
+  for (int i = 0; i < batch_size; i++) order[i] = i;
+  std::stable_sort(order.begin(), order.end(),
+                   [&](int a, int b) { return lengths[a] > lengths[b]; });
+
+  // the first row of a bucket is its longest, a row joins the bucket while
+  // the padding stays within max_waste.
+  std::vector<LengthBucket> res;
+  size_t num_tokens = 0;
+  for (int row : order) {
+    if (!res.empty()) {
+      LengthBucket& last = res.back();
+      size_t padded = (last.rows.size() + 1) * size_t(last.seq_len);
+      if (last.rows.size() < size_t(max_bucket_size) &&
+          padded - num_tokens - lengths[row] <= max_waste * padded) {
+        last.rows.push_back(row);
+        num_tokens += lengths[row];
+        continue;
+      }
+    }
+    res.push_back({{row}, lengths[row]});
+    num_tokens = lengths[row];
+  }
+  return res;
+}
+
+KVPageTable::KVPageTable(int num_pages, int page_size, int max_seqs,
+                         int max_step)
+    : _num_pages(num_pages),
+      _page_size(page_size),
+      _max_seqs(max_seqs),
+      _max_pages((max_step + page_size - 1) / page_size) {
+  _table.assign(_max_seqs * _max_pages, 0);
+  _seq_num_pages.assign(_max_seqs, 0);
+  _ref_count.assign(_num_pages, 0);
+  // hand out low page ids first.
+  for (int page = num_pages - 1; page >= 0; page--) {
+    _free_pages.push_back(page);
+  }
+}
+
+bool KVPageTable::reserve(int seq_idx, int seq_len) {
+  int need_pages = (seq_len + _page_size - 1) / _page_size;
+  if (need_pages > _max_pages) {
+    printf("Error! sequence length %d exceeds the kv page table.\n", seq_len);
+    return false;
+  }
+  int& held_pages = _seq_num_pages[seq_idx];
+  while (held_pages < need_pages) {
+    if (_free_pages.empty()) {
+      return false;
+    }
+    int page = _free_pages.back();
+    _free_pages.pop_back();
+    _table[seq_idx * _max_pages + held_pages] = page;
+    _ref_count[page] = 1;
+    held_pages++;
+    _dirty = true;
+  }
+  return true;
+}
+
+void KVPageTable::release(int seq_idx) {
+  int& held_pages = _seq_num_pages[seq_idx];
+  for (int idx = held_pages - 1; idx >= 0; idx--) {
+    release_page(_table[seq_idx * _max_pages + idx]);
+    _table[seq_idx * _max_pages + idx] = 0;
+  }
+  if (held_pages) _dirty = true;
+  held_pages = 0;
+}
+
+void KVPageTable::release_all() {
+  for (int seq_idx = 0; seq_idx < _max_seqs; seq_idx++) {
+    release(seq_idx);
+  }
+}
+
+void KVPageTable::resize(int num_pages) {
+  for (int page = 0; page < _num_pages; page++) {
+    if (_ref_count[page] > 0) {
+      printf("Error! kv page %d is in use while the pool is resized.\n",
+             page);
+      throw std::runtime_error("resize a kv page pool in use");
+    }
+  }
+  _num_pages = num_pages;
+  _ref_count.assign(_num_pages, 0);
+  _free_pages.clear();
+  for (int page = num_pages - 1; page >= 0; page--) {
+    _free_pages.push_back(page);
+  }
+}
+
+void KVPageTable::share(int seq_idx, const std::vector<int>& pages) {
+  if (_seq_num_pages[seq_idx] > 0 || pages.size() > _max_pages) {
+    printf("Error! sequence %d can not share %zu pages.\n", seq_idx,
+           pages.size());
+    throw std::runtime_error("invalid kv page sharing");
+  }
+  for (int idx = 0; idx < pages.size(); idx++) {
+    _table[seq_idx * _max_pages + idx] = pages[idx];
+    _ref_count[pages[idx]]++;
+  }
+  _seq_num_pages[seq_idx] = pages.size();
+  if (!pages.empty()) _dirty = true;
+}
+
+void KVPageTable::release_page(int page) {
+  if (--_ref_count[page] == 0) {
+    _free_pages.push_back(page);
+  }
+}
+
+size_t KVPrefixCache::block_hash(int parent, const int* tokens) const {
+  size_t seed = std::hash<int>()(parent);
+  for (int idx = 0; idx < _page_table->page_size(); idx++) {
+    seed ^= std::hash<int>()(tokens[idx]) + 0x9e3779b9 + (seed << 6) +
+            (seed >> 2);
+  }
+  return seed;
+}
+
+int KVPrefixCache::find(int parent, const int* tokens) const {
+  auto range = _index.equal_range(block_hash(parent, tokens));
+  for (auto iter = range.first; iter != range.second; iter++) {
+    const Block& block = _blocks.at(iter->second);
+    if (block.parent == parent &&
+        std::equal(block.tokens.begin(), block.tokens.end(), tokens)) {
+      return iter->second;
+    }
+  }
+  return -1;
+}
+
+void KVPrefixCache::drop(int page) {
+  Block& block = _blocks.at(page);
+  std::vector<int> children;
+  children.swap(block.children);
+  for (int child : children) {
+    drop(child);
+  }
+  if (block.parent >= 0) {
+    std::vector<int>& siblings = _blocks.at(block.parent).children;
+    auto iter = std::find(siblings.begin(), siblings.end(), page);
+    if (iter != siblings.end()) siblings.erase(iter);
+  }
+  auto range =
+      _index.equal_range(block_hash(block.parent, block.tokens.data()));
+  for (auto iter = range.first; iter != range.second; iter++) {
+    if (iter->second == page) {
+      _index.erase(iter);
+      break;
+    }
+  }
+  _blocks.erase(page);
+  _page_table->release_page(page);
+}
+
+std::vector<int> KVPrefixCache::match(const std::vector<int>& tokens,
+                                      int max_len) {
+  std::vector<int> pages;
+  int page_size = _page_table->page_size();
+  int parent = -1;
+  for (int len = page_size; len <= max_len; len += page_size) {
+    int page = find(parent, tokens.data() + len - page_size);
+    if (page < 0) break;
+    _blocks.at(page).last_use = ++_clock;
+    pages.push_back(page);
+    parent = page;
+  }
+  return pages;
+}
+
+void KVPrefixCache::insert(int seq_idx, const std::vector<int>& tokens,
+                           int len) {
+  int page_size = _page_table->page_size();
+  const int* seq_pages = _page_table->seq_pages(seq_idx);
+  int parent = -1;
+  for (int idx = 0; (idx + 1) * page_size <= len; idx++) {
+    const int* block_tokens = tokens.data() + idx * page_size;
+    int page = find(parent, block_tokens);
+    if (page < 0) {
+      page = seq_pages[idx];
+      Block block;
+      block.parent = parent;
+      block.tokens.assign(block_tokens, block_tokens + page_size);
+      block.last_use = ++_clock;
+      _blocks.emplace(page, block);
+      _index.emplace(block_hash(parent, block_tokens), page);
+      if (parent >= 0) _blocks.at(parent).children.push_back(page);
+      _page_table->retain_page(page);
+    }
+    parent = page;
+  }
+}
+
+bool KVPrefixCache::evict(int num_pages) {
+  while (_page_table->num_free_pages() < num_pages) {
+    // the least recently used block which no sequence holds.
+    int victim = -1;
+    for (auto& iter : _blocks) {
+      if (_page_table->ref_count(iter.first) > 1) continue;
+      if (victim < 0 || iter.second.last_use < _blocks.at(victim).last_use) {
+        victim = iter.first;
+      }
+    }
+    if (victim < 0) {
+      return false;
+    }
+    drop(victim);
+  }
+  return true;
+}
+
+void KVPrefixCache::clear() {
+  for (auto& iter : _blocks) {
+    _page_table->release_page(iter.first);
+  }
+  _blocks.clear();
+  _index.clear();
+}
+
+KVHostCache::KVHostCache(int num_pages, int page_size)
+    : _num_pages(num_pages), _page_size(page_size) {
+  for (int page = num_pages - 1; page >= 0; page--) {
+    _free_pages.push_back(page);
+  }
+}
+
+std::vector<int> KVHostCache::save(int key, const std::vector<int>& tokens,
+                                   int len) {
+  erase(key);
+  int need_pages = (len + _page_size - 1) / _page_size;
+  if (need_pages == 0 || need_pages > _num_pages) {
+    return {};
+  }
+  while (_free_pages.size() < need_pages) {
+    auto victim = _entries.begin();
+    for (auto iter = _entries.begin(); iter != _entries.end(); iter++) {
+      if (iter->second.last_use < victim->second.last_use) victim = iter;
+    }
+    erase(victim->first);
+  }
+  Entry& entry = _entries[key];
+  entry.tokens.assign(tokens.begin(), tokens.begin() + len);
+  entry.last_use = ++_clock;
+  for (int idx = 0; idx < need_pages; idx++) {
+    entry.pages.push_back(_free_pages.back());
+    _free_pages.pop_back();
+  }
+  return entry.pages;
+}
+
+int KVHostCache::match(int key, const std::vector<int>& tokens, int max_len,
+                       std::vector<int>* pages) {
+  pages->clear();
+  auto iter = _entries.find(key);
+  if (iter == _entries.end()) {
+    return 0;
+  }
+  Entry& entry = iter->second;
+  entry.last_use = ++_clock;
+  int len = std::min({max_len, int(entry.tokens.size()), int(tokens.size())});
+  int res = std::mismatch(entry.tokens.begin(), entry.tokens.begin() + len,
+                          tokens.begin())
+                .first -
+            entry.tokens.begin();
+  pages->assign(entry.pages.begin(),
+                entry.pages.begin() + (res + _page_size - 1) / _page_size);
+  return res;
+}
+
+void KVHostCache::erase(int key) {
+  auto iter = _entries.find(key);
+  if (iter == _entries.end()) {
+    return;
+  }
+  for (int page : iter->second.pages) {
+    _free_pages.push_back(page);
+  }
+  _entries.erase(iter);
+}
+
+void KVHostCache::clear() {
+  while (!_entries.empty()) {
+    erase(_entries.begin()->first);
+  }
+}
+
+int RequestSlots::add_request(const std::vector<int>& prompt,
+                              int max_new_tokens, int priority,
+                              int deadline_ms, int session_id) {
+  GenerationRequest request;
+  request.request_id = _next_request_id++;
+  request.session_id = session_id;
+  request.tokens = prompt;
+  request.prompt_len = prompt.size();
+  request.prefill_len = prompt.size();
+  request.max_new_tokens = max_new_tokens;
+  request.priority = priority;
+  if (deadline_ms > 0) {
+    request.deadline_ms =
+        std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count() +
+        deadline_ms;
+  }
+  enqueue(request);
+  return request.request_id;
+}
+
+bool RequestSlots::outranks(const GenerationRequest& a,
+                            const GenerationRequest& b) {
+  if (a.priority != b.priority) return a.priority > b.priority;
+  if (a.deadline_ms != b.deadline_ms) {
+    if (a.deadline_ms == 0 || b.deadline_ms == 0) return b.deadline_ms == 0;
+    return a.deadline_ms < b.deadline_ms;
+  }
+  return a.request_id < b.request_id;
+}
+
+void RequestSlots::enqueue(const GenerationRequest& request) {
+  auto iter = std::upper_bound(_waiting.begin(), _waiting.end(), request,
+                               outranks);
+  _waiting.insert(iter, request);
+}
+
+int RequestSlots::admit() {
+  if (_waiting.empty()) {
+    return -1;
+  }
+  for (int slot_idx = 0; slot_idx < _slots.size(); slot_idx++) {
+    if (_slots[slot_idx].active()) continue;
+    _slots[slot_idx] = _waiting.front();
+    _waiting.pop_front();
+    return slot_idx;
+  }
+  return -1;
+}
+
+GenerationRequest RequestSlots::retire(int slot_idx) {
+  GenerationRequest request = _slots[slot_idx];
+  _slots[slot_idx] = GenerationRequest();
+  return request;
+}
+
+int RequestSlots::preemption_victim(const GenerationRequest& request) const {
+  int victim = -1;
+  for (int slot_idx = 0; slot_idx < _slots.size(); slot_idx++) {
+    const GenerationRequest& running = _slots[slot_idx];
+    if (!running.active() || running.priority >= request.priority) continue;
+    if (victim < 0 || outranks(_slots[victim], running)) victim = slot_idx;
+  }
+  return victim;
+}
+
+void RequestSlots::preempt(int slot_idx) {
+  GenerationRequest request = retire(slot_idx);
+  request.prefill_len = request.tokens.size();
+  request.cached_len = 0;
+  enqueue(request);
+}
+
+std::vector<int> RequestSlots::active_slots() const {
+  std::vector<int> res;
+  for (int slot_idx = 0; slot_idx < _slots.size(); slot_idx++) {
+    if (_slots[slot_idx].active()) res.push_back(slot_idx);
+  }
+  return res;
+}
+
+int RequestSlots::find_slot(int request_id) const {
+  for (int slot_idx = 0; slot_idx < _slots.size(); slot_idx++) {
+    if (_slots[slot_idx].request_id == request_id) return slot_idx;
+  }
+  return -1;
+}
+
+bool RequestSlots::drop_waiting(int request_id) {
+  for (auto iter = _waiting.begin(); iter != _waiting.end(); iter++) {
+    if (iter->request_id == request_id) {
+      _waiting.erase(iter);
+      return true;
+    }
+  }
+  return false;
+}
+
+std::vector<int> RequestSlots::expired(double now_ms) const {
+  std::vector<int> res;
+  for (const GenerationRequest& request : _slots) {
+    if (request.active() && request.deadline_ms > 0 &&
+        request.deadline_ms < now_ms) {
+      res.push_back(request.request_id);
+    }
+  }
+  for (const GenerationRequest& request : _waiting) {
+    if (request.deadline_ms > 0 && request.deadline_ms < now_ms) {
+      res.push_back(request.request_id);
+    }
+  }
+  return res;
+}
+
+bool RequestSlots::empty() const {
+  return _waiting.empty() && active_slots().empty();
+}
+
+void CancelQueue::push(int id) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _ids.push_back(id);
+  _pending.store(true);
+}
+
+std::vector<int> CancelQueue::take() {
+  std::vector<int> res;
+  if (!_pending.load()) return res;
+  std::lock_guard<std::mutex> lock(_mutex);
+  res.swap(_ids);
+  _pending.store(false);
+  return res;
+}
+
+void RowCancellation::reset(int batch_size) {
+  _queue.take();
+  _cancelled.assign(batch_size, 0);
+  _num_cancelled = 0;
+}
+
+#ifdef LIGHTSEQ_cuda
+std::vector<int> RowCancellation::apply(int* tokens, int pos, int beam_size,
+                                        int max_step, int eos_id,
+                                        bool write_eos, cudaStream_t stream) {
+  std::vector<int> res;
+  _eos_id = eos_id;
+  for (int row : _queue.take()) {
+    if (row < 0 || row >= int(_cancelled.size()) || _cancelled[row]) continue;
+    _cancelled[row] = 1;
+    _num_cancelled++;
+    res.push_back(row);
+    if (!write_eos) continue;
+    for (int beam_idx = 0; beam_idx < beam_size; beam_idx++) {
+      CHECK_GPU_ERROR(cudaMemcpyAsync(
+          tokens + (row * beam_size + beam_idx) * max_step + pos, &_eos_id,
+          sizeof(int), cudaMemcpyHostToDevice, stream));
+    }
+  }
+  return res;
+}
+#endif
+
+TokenStreamer::TokenStreamer(int max_seqs, int ring_size)
+    : _max_seqs(max_seqs), _ring(ring_size) {
+  for (Slot& slot : _ring) {
+#ifdef LIGHTSEQ_cuda
+    CHECK_GPU_ERROR(
+        cudaMallocHost((void**)&slot.tokens, max_seqs * sizeof(int)));
+    CHECK_GPU_ERROR(
+        cudaEventCreateWithFlags(&slot.event, cudaEventDisableTiming));
+#else
+    slot.tokens = new int[max_seqs];
+#endif
+  }
+}
+
+TokenStreamer::~TokenStreamer() {
+  for (Slot& slot : _ring) {
+#ifdef LIGHTSEQ_cuda
+    cudaEventSynchronize(slot.event);
+    cudaEventDestroy(slot.event);
+    cudaFreeHost(slot.tokens);
+#else
+    delete[] slot.tokens;
+#endif
+  }
+}
+
+void TokenStreamer::publish_front() {
+  Slot& slot = _ring[_head];
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaEventSynchronize(slot.event));
+#endif
+  _head = (_head + 1) % _ring.size();
+  _size--;
+  if (_callback) {
+    _callback(slot.step,
+              std::vector<int>(slot.tokens, slot.tokens + slot.num_seqs));
+  }
+}
+
+#ifdef LIGHTSEQ_cuda
+void TokenStreamer::push(int step, const int* tokens, int num_seqs, int stride,
+                         cudaStream_t stream) {
+  if (_size == _ring.size()) {
+    publish_front();
+  }
+  Slot& slot = _ring[(_head + _size) % _ring.size()];
+  _size++;
+  slot.step = step;
+  slot.num_seqs = std::min(num_seqs, _max_seqs);
+  CHECK_GPU_ERROR(cudaMemcpy2DAsync(
+      slot.tokens, sizeof(int), tokens, stride * sizeof(int), sizeof(int),
+      slot.num_seqs, cudaMemcpyDeviceToHost, stream));
+  CHECK_GPU_ERROR(cudaEventRecord(slot.event, stream));
+
+  // publish the steps whose copy is done, without waiting for the others.
+  while (_size > 0 && cudaEventQuery(_ring[_head].event) == cudaSuccess) {
+    publish_front();
+  }
+}
+#endif
+
+void TokenStreamer::push_host(int step, const std::vector<int>& tokens) {
+  flush();
+  if (_callback) {
+    _callback(step, tokens);
+  }
+}
+
+void TokenStreamer::flush() {
+  while (_size > 0) {
+    publish_front();
+  }
+}
+
+std::vector<cuda::WarmupTiming> warmup_infer(
+    cuda::LSModel* model, void* input_ptr,
+    const std::vector<std::vector<int>>& shapes,
+    const std::vector<int>& excluded_tokens) {
+  std::vector<int> max_shape = model->get_input_max_shape(0);
+  size_t max_size = 0;
+  for (const std::vector<int>& shape : shapes) {
+    if (shape.size() != 2 || shape[0] <= 0 || shape[1] <= 0 ||
+        shape[0] > max_shape[0] || shape[1] > max_shape[1]) {
+      throw std::runtime_error("warmup shape must be [batch_size, seq_len] "
+                               "within [" + std::to_string(max_shape[0]) +
+                               ", " + std::to_string(max_shape[1]) + "]");
+    }
+    max_size = std::max(max_size, size_t(shape[0]) * shape[1]);
+  }
+  if (shapes.empty()) {
+    return {};
+  }
+  int token_id = 0;
+  while (std::find(excluded_tokens.begin(), excluded_tokens.end(),
+                   token_id) != excluded_tokens.end()) {
+    token_id++;
+  }
+  std::vector<int> tokens(max_size, token_id);
+#ifdef LIGHTSEQ_cuda
+  int* d_tokens = nullptr;
+  CHECK_GPU_ERROR(cudaMalloc(&d_tokens, max_size * sizeof(int)));
+  CHECK_GPU_ERROR(cudaMemcpy(d_tokens, tokens.data(), max_size * sizeof(int),
+                             cudaMemcpyHostToDevice));
+#else
+  int* d_tokens = tokens.data();
+#endif
+  model->set_input_ptr(0, d_tokens);
+
+  std::vector<cuda::WarmupTiming> res;
+  for (const std::vector<int>& shape : shapes) {
+    cuda::WarmupTiming timing;
+    timing.shape = shape;
+    for (float* ms : {&timing.first_ms, &timing.second_ms}) {
+      auto start = std::chrono::steady_clock::now();
+      model->set_input_shape(0, shape);
+      model->Infer();
+#ifdef LIGHTSEQ_cuda
+      CHECK_GPU_ERROR(cudaDeviceSynchronize());
+#endif
+      *ms = std::chrono::duration<float, std::milli>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+    }
+    printf("warmup [%d, %d]: first Infer %.2f ms, then %.2f ms\n", shape[0],
+           shape[1], timing.first_ms, timing.second_ms);
+    res.push_back(timing);
+  }
+
+  if (input_ptr) model->set_input_ptr(0, input_ptr);
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaFree(d_tokens));
+#endif
+  return res;
+}
+
 }  // namespace lightseq
@@ -0,0 +1,274 @@
+#include "overflow_scheduler.h"
+
+#include <chrono>
+#include <cstring>
+
+#include "declaration.h"
+#include "model_util.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+size_t data_type_size(DataType dtype) {
+  switch (dtype) {
+    case kInt8:
+    case kByte:
+    case kUInt8:
+      return 1;
+    case kFloat16:
+    case kBFloat16:
+    case kInt16:
+    case kUInt16:
+      return 2;
+    case kInt64:
+    case kUInt64:
+    case kFloat64:
+      return 8;
+    default:
+      return 4;
+  }
+}
+
+size_t shape_size(const std::vector<int>& shape) {
+  size_t res = 1;
+  for (int dim : shape) res *= dim;
+  return res;
+}
+
+void* malloc_buffer(size_t bytes, bool host_memory) {
+#ifdef LIGHTSEQ_cuda
+  if (!host_memory) {
+    void* buffer;
+    CHECK_GPU_ERROR(cudaMalloc(&buffer, bytes));
+    return buffer;
+  }
+#endif
+  return new char[bytes];
+}
+
+void free_buffer(void* buffer, bool host_memory) {
+#ifdef LIGHTSEQ_cuda
+  if (!host_memory) {
+    cudaFree(buffer);
+    return;
+  }
+#endif
+  delete[](char*) buffer;
+}
+
+// between host and device buffers of either model.
+void copy_buffer(void* dst, const void* src, size_t bytes) {
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaMemcpy(dst, src, bytes, cudaMemcpyDefault));
+#else
+  memcpy(dst, src, bytes);
+#endif
+}
+
+}  // namespace
+
+OverflowScheduler::OverflowScheduler(LSModel* primary, LSModel* overflow,
+                                     bool primary_host_memory,
+                                     bool overflow_host_memory,
+                                     int max_overflow_tokens)
+    : _max_overflow_tokens(max_overflow_tokens) {
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaGetDevice(&_device));
+#endif
+  LSModel* models[2] = {primary, overflow};
+  bool host_memory[2] = {primary_host_memory, overflow_host_memory};
+  for (int i = 0; i < 2; i++) {
+    Backend& backend = _backends[i];
+    backend.model = models[i];
+    backend.host_memory = host_memory[i];
+    backend.overflow = i == 1;
+    std::vector<int> input_shape = models[i]->get_input_max_shape(0);
+    backend.max_batch_size = input_shape[0];
+    backend.max_seq_len = input_shape[1];
+    backend.input = malloc_buffer(
+        size_t(backend.max_batch_size) * backend.max_seq_len * sizeof(int),
+        backend.host_memory);
+    models[i]->set_input_ptr(0, backend.input);
+    for (int j = 0; j < models[i]->get_output_size(); j++) {
+      size_t bytes = shape_size(models[i]->get_output_max_shape(j)) *
+                     data_type_size(models[i]->get_output_dtype(j));
+      backend.output_bytes.push_back(bytes);
+      backend.outputs.push_back(malloc_buffer(bytes, backend.host_memory));
+      models[i]->set_output_ptr(j, backend.outputs.back());
+    }
+  }
+  for (Backend& backend : _backends) {
+    backend.worker = std::thread(&OverflowScheduler::run_worker, this,
+                                 &backend);
+  }
+}
+
+OverflowScheduler::~OverflowScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cond.notify_all();
+  // the workers finish the queued tasks first.
+  for (Backend& backend : _backends) {
+    backend.worker.join();
+    free_buffer(backend.input, backend.host_memory);
+    for (void* output : backend.outputs) {
+      free_buffer(output, backend.host_memory);
+    }
+  }
+}
+
+float OverflowScheduler::predict_ms(const Backend& backend, int batch_size,
+                                    int seq_len) const {
+  auto iter = backend.bucket_ms.find(
+      {shape_bucket(batch_size, backend.max_batch_size),
+       shape_bucket(seq_len, backend.max_seq_len)});
+  if (iter != backend.bucket_ms.end()) return iter->second;
+  if (backend.token_ms < 0) return -1.f;
+  return backend.token_ms * batch_size * seq_len;
+}
+
+void OverflowScheduler::record_ms(Backend* backend, int batch_size,
+                                  int seq_len, float ms) {
+  std::pair<int, int> bucket = {
+      shape_bucket(batch_size, backend->max_batch_size),
+      shape_bucket(seq_len, backend->max_seq_len)};
+  auto iter = backend->bucket_ms.find(bucket);
+  if (iter == backend->bucket_ms.end()) {
+    backend->bucket_ms[bucket] = ms;
+  } else {
+    iter->second += _cost_decay * (ms - iter->second);
+  }
+  float token_ms = ms / (batch_size * seq_len);
+  backend->token_ms = backend->token_ms < 0
+                          ? token_ms
+                          : backend->token_ms +
+                                _cost_decay * (token_ms - backend->token_ms);
+}
+
+void OverflowScheduler::calibrate(
+    const std::vector<std::vector<int>>& shapes) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  // the workers are idle before the first submit.
+  for (Backend& backend : _backends) {
+    for (const WarmupTiming& timing : backend.model->warmup(shapes)) {
+      record_ms(&backend, timing.shape[0], timing.shape[1], timing.second_ms);
+    }
+  }
+}
+
+std::future<ScheduledOutput> OverflowScheduler::submit(std::vector<int> tokens,
+                                                       int batch_size,
+                                                       int seq_len) {
+  if (tokens.size() != size_t(batch_size) * seq_len) {
+    throw std::runtime_error("the tokens should be [batch_size, seq_len]");
+  }
+  std::shared_ptr<Task> task(new Task());
+  task->tokens = std::move(tokens);
+  task->batch_size = batch_size;
+  task->seq_len = seq_len;
+  std::future<ScheduledOutput> res = task->output.get_future();
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  // the predicted finish time of the request on each model, negative if it
+  // does not fit or has no cost yet.
+  float finish_ms[2];
+  for (int i = 0; i < 2; i++) {
+    const Backend& backend = _backends[i];
+    bool fits = batch_size <= backend.max_batch_size &&
+                seq_len <= backend.max_seq_len;
+    if (backend.overflow && _max_overflow_tokens > 0) {
+      fits = fits && batch_size * seq_len <= _max_overflow_tokens;
+    }
+    float cost = fits ? predict_ms(backend, batch_size, seq_len) : -1.f;
+    // the primary model learns the cost of an unseen shape.
+    if (fits && cost < 0 && !backend.overflow) cost = 0.f;
+    finish_ms[i] = cost < 0 ? -1.f : backend.backlog_ms + cost;
+  }
+  if (finish_ms[0] < 0 && finish_ms[1] < 0) {
+    throw std::runtime_error(
+        "the request of [" + std::to_string(batch_size) + ", " +
+        std::to_string(seq_len) + "] tokens fits neither model");
+  }
+  int choice = finish_ms[0] < 0 || (finish_ms[1] >= 0 &&
+                                    finish_ms[1] < finish_ms[0])
+                   ? 1
+                   : 0;
+  Backend& backend = _backends[choice];
+  task->predicted_ms = finish_ms[choice] - backend.backlog_ms;
+  backend.backlog_ms += task->predicted_ms;
+  backend.queue.push_back(task);
+  _cond.notify_all();
+  return res;
+}
+
+ScheduledOutput OverflowScheduler::run_task(Backend* backend,
+                                            const Task& task) {
+  LSModel* model = backend->model;
+  copy_buffer(backend->input, task.tokens.data(),
+              task.tokens.size() * sizeof(int));
+  model->set_input_shape(0, {task.batch_size, task.seq_len});
+  auto start = std::chrono::steady_clock::now();
+  model->Infer();
+
+  ScheduledOutput output;
+  output.overflow = backend->overflow;
+  output.shape = model->get_output_shape(0);
+  size_t bytes = std::min(
+      shape_size(output.shape) * data_type_size(model->get_output_dtype(0)),
+      backend->output_bytes[0]);
+  output.data.resize(bytes);
+  copy_buffer(output.data.data(), model->get_output_ptr(0), bytes);
+  output.latency_ms = std::chrono::duration<float, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+  return output;
+}
+
+void OverflowScheduler::run_worker(Backend* backend) {
+#ifdef LIGHTSEQ_cuda
+  if (!backend->host_memory) CHECK_GPU_ERROR(cudaSetDevice(_device));
+#endif
+  while (true) {
+    std::shared_ptr<Task> task;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cond.wait(lock, [&] { return _stop || !backend->queue.empty(); });
+      if (backend->queue.empty()) return;
+      task = backend->queue.front();
+    }
+    // the task stays queued while it runs, its time counts in the backlog.
+    try {
+      ScheduledOutput output = run_task(backend, *task);
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        record_ms(backend, task->batch_size, task->seq_len,
+                  output.latency_ms);
+      }
+      task->output.set_value(std::move(output));
+    } catch (...) {
+      task->output.set_exception(std::current_exception());
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    backend->queue.pop_front();
+    backend->backlog_ms =
+        std::max(0.f, backend->backlog_ms - task->predicted_ms);
+    backend->num_requests++;
+  }
+}
+
+size_t OverflowScheduler::num_requests(bool overflow) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _backends[overflow ? 1 : 0].num_requests;
+}
+
+float OverflowScheduler::backlog_ms(bool overflow) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _backends[overflow ? 1 : 0].backlog_ms;
+}
+
+}  // namespace cuda
+}  // namespace lightseq
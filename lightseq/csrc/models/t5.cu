@@ -0,0 +1,402 @@
+#include "t5.h"
+
+namespace lightseq {
+namespace cuda {
+template <typename OpType_>
+T5<OpType_>::T5(const std::string weight_path, const int max_batch_size,
+                const ModelOptions &options)
+    : LSModel({"source_ids"}, {"target_ids", "target_scores"}),
+      _max_batch_size(max_batch_size) {
+  /* --- step.1 initial context --- */
+  _context_ptr = std::make_shared<Context>(StatusType::Inference, -1);
+  // the graph of the model is created in its own context.
+  ContextScope context_scope(_context_ptr);
+
+  /* --- step.2 load model weights into GPU memory --- */
+  // saved in hdf5 file
+  std::string res = tw_.initializing(weight_path);
+  if (!res.empty()) {
+    throw std::runtime_error(res);
+  }
+  _generate_method = get_generate_method(tw_._sampling_method);
+  if (_generate_method != GenerateMethod::BeamSearch) {
+    tw_._beam_size = 1;
+  }
+  tw_.print_model_config();
+
+  /* --- step.3 initial input Variable node --- */
+  int max_batch_tokens = tw_._max_step * _max_batch_size;
+  int max_trg_tokens = _max_batch_size * tw_._beam_size;
+
+  /* --- step.4 inital operator & layer --- */
+
+  // initial LaunchEncEmb layer, the position embedding is zeros.
+  launch_enc_emb_layer.reset(new LaunchEncEmbLayer<OpType_>(
+      max_batch_tokens, tw_._padding_id, tw_._hidden_size, 0));
+  launch_enc_emb_layer->load_params(tw_.get_src_emb_wei(), 0);
+
+  // initial T5Encoder layers
+  int enc_wei_offset = 0;
+  for (int idx = 0; idx < tw_._n_enc_layer; idx++) {
+    T5EncoderLayerPtr<OpType_, OpType_> enc_layer_(
+        new T5EncoderLayer<OpType_, OpType_>(
+            idx, max_batch_tokens, tw_._max_step, tw_._hidden_size,
+            tw_._head_num, tw_._inner_size, tw_._is_mt5));
+    enc_wei_offset +=
+        enc_layer_->load_params(tw_.get_enc_wei(), enc_wei_offset);
+    enc_layer_->set_pos_bias(tw_.get_src_emb_wei()[3], tw_._max_step);
+    enc_layer_vec.push_back(enc_layer_);
+  }
+
+  // initial final RMSNorm layer
+  enc_norm_layer.reset(
+      new RMSNormLayer<OpType_, OpType_>(max_batch_tokens, tw_._hidden_size));
+  enc_norm_layer->load_params(tw_.get_src_emb_wei(), 2);
+
+  _enc_kv_layer.reset(new EncDecKvLayer<OpType_, OpType_>(
+      tw_._n_dec_layer, max_batch_tokens, tw_._hidden_size, tw_._head_num));
+  _enc_kv_layer->load_params(tw_.get_trg_emb_wei(), 4);
+
+  // initial LaunchDecEmb layer
+  launch_dec_emb_layer.reset(new LaunchDecEmbLayer<OpType_>(
+      max_batch_size, tw_._beam_size, tw_._hidden_size, tw_._trg_vocab_size,
+      tw_._max_step, 0));
+  launch_dec_emb_layer->load_params(tw_.get_trg_emb_wei(), 0);
+
+  // initial T5Decoder layers
+  int dec_wei_offset = 0;
+  for (int idx = 0; idx < tw_._n_dec_layer; idx++) {
+    T5DecoderLayerPtr<OpType_, OpType_> dec_layer_(
+        new T5DecoderLayer<OpType_, OpType_>(
+            idx, max_trg_tokens, tw_._max_step, tw_._hidden_size,
+            tw_._head_num, tw_._inner_size, tw_._is_mt5));
+    dec_wei_offset +=
+        dec_layer_->load_params(tw_.get_dec_wei(), dec_wei_offset);
+    dec_layer_->set_pos_bias(tw_.get_trg_emb_wei()[3], tw_._max_step);
+    dec_layer_vec.push_back(dec_layer_);
+  }
+
+  // initial final RMSNorm layer
+  dec_norm_layer.reset(
+      new RMSNormLayer<OpType_, OpType_>(max_trg_tokens, tw_._hidden_size));
+  dec_norm_layer->load_params(tw_.get_trg_emb_wei(), 2);
+
+  // intial Project hidden states to vocab logits, the tied embedding of T5
+  // is scaled, the lm_head of mT5 is not.
+  linear_layer.reset(new LinearLayer<OpType_, OpType_>(
+      max_trg_tokens, tw_._hidden_size, tw_._trg_vocab_size,
+      MATRIX_OP::NonTranspose, MATRIX_OP::NonTranspose,
+      tw_._is_mt5 ? 1.f : sqrt(1.f / tw_._hidden_size)));
+  linear_layer->load_params(tw_.get_trg_emb_wei(), 6);
+
+  _generator_layer.reset(new GeneratorLayer<OpType_>(
+      _generate_method, tw_._n_dec_layer, max_batch_size, tw_._max_step,
+      tw_._trg_vocab_size, tw_._hidden_size, 1024, tw_._beam_size,
+      tw_._diverse_lambda, tw_._dim_per_head, tw_._end_id, tw_._head_num,
+      tw_._length_penalty, tw_._topk, tw_._topp, false));
+  // the score margins of beam pruning, see transformer.cu.
+  const char *prune_abs_opt = model_option(options, "beam_prune_abs");
+  const char *prune_rel_opt = model_option(options, "beam_prune_rel");
+  _generator_layer->set_beam_pruning(
+      prune_abs_opt ? std::atof(prune_abs_opt) : 0.f,
+      prune_rel_opt ? std::atof(prune_rel_opt) : 0.f);
+
+  /* --- step.5 construct network --- */
+  inp_tokens = new Variable("inp_tokens", g_dtype<int>());
+  dec_tokens = new Variable("dec_tokens", g_dtype<int>());
+  std::tuple<Variable *, Variable *> enc_emb_outs =
+      (*launch_enc_emb_layer)(inp_tokens);
+  Variable *enc_emb = std::get<0>(enc_emb_outs);
+  Variable *pad_mask = std::get<1>(enc_emb_outs);
+  for (auto iter : enc_layer_vec) {
+    enc_emb = (*iter)(enc_emb, pad_mask);
+  }
+  enc_emb = (*enc_norm_layer)(enc_emb);
+
+  Variable *total_enc_kv = (*_enc_kv_layer)(enc_emb);
+
+  total_enc_kv->set_regress_var();
+
+  _context_ptr->regress_begin();
+
+  Variable *dec_emb = (*launch_dec_emb_layer)(dec_tokens);
+  cache_size = max_batch_tokens * tw_._beam_size * tw_._hidden_size;
+  total_cache_k = new Variable("total_cache_k", cache_size * tw_._n_dec_layer,
+                               g_dtype<OpType_>(), DataType::kNotSupported,
+                               VariableType::RegressiveVariable);
+  total_cache_k->set_shape({size_t(tw_._n_dec_layer),
+                            size_t(_max_batch_size * tw_._beam_size),
+                            size_t(tw_._max_step), size_t(tw_._hidden_size)});
+  total_cache_v = new Variable("total_cache_v", cache_size * tw_._n_dec_layer,
+                               g_dtype<OpType_>(), DataType::kNotSupported,
+                               VariableType::RegressiveVariable);
+  total_cache_v->set_shape({size_t(tw_._n_dec_layer),
+                            size_t(_max_batch_size * tw_._beam_size),
+                            size_t(tw_._max_step), size_t(tw_._hidden_size)});
+  pad_mask->set_regress_var();
+
+  int dec_layer_idx = 0;
+  for (auto iter : dec_layer_vec) {
+    Variable *cache_k = new Variable("cache_k", total_cache_k);
+    cache_k->set_offset(cache_size * dec_layer_idx,
+                        {size_t(max_batch_tokens), size_t(tw_._beam_size),
+                         size_t(tw_._hidden_size)});
+    Variable *cache_v = new Variable("cache_v", total_cache_v);
+    cache_v->set_offset(cache_size * dec_layer_idx,
+                        {size_t(max_batch_tokens), size_t(tw_._beam_size),
+                         size_t(tw_._hidden_size)});
+    dec_emb = (*iter)(dec_emb, total_enc_kv, pad_mask, cache_k, cache_v);
+    dec_layer_idx++;
+  }
+  dec_emb = (*dec_norm_layer)(dec_emb);
+  dec_emb = (*linear_layer)(dec_emb);
+
+  std::tuple<Variable *, Variable *> generate_outs =
+      (*_generator_layer)(dec_emb, dec_tokens);
+
+  _context_ptr->regress_end();
+
+  dec_tokens_buf = std::get<0>(generate_outs);
+  seq_score = std::get<1>(generate_outs);
+  dec_tokens->malloc_memory(max_batch_tokens * tw_._beam_size);
+  dec_tokens_buf->malloc_memory(max_batch_tokens * tw_._beam_size);
+
+  t5_out = new Variable("t5_out", g_dtype<int>());
+
+  std::vector<int> start_id_vec(
+      _max_batch_size * tw_._beam_size * tw_._max_step, tw_._start_id);
+  CHECK_GPU_ERROR(cudaMemcpyAsync(dec_tokens->value(), start_id_vec.data(),
+                                  sizeof(int) * start_id_vec.size(),
+                                  cudaMemcpyHostToDevice,
+                                  _context_ptr->get_stream()));
+  CHECK_GPU_ERROR(cudaMemcpyAsync(dec_tokens_buf->value(), start_id_vec.data(),
+                                  sizeof(int) * start_id_vec.size(),
+                                  cudaMemcpyHostToDevice,
+                                  _context_ptr->get_stream()));
+
+  printf("Finish construct network!\n");
+  _context_ptr->build();
+}
+
+template <typename OpType_>
+T5<OpType_>::~T5() {}
+
+template <typename OpType_>
+void T5<OpType_>::encoder_before_forward(int batch_size, int seq_len) {
+  inp_tokens->set_shape({size_t(batch_size), size_t(seq_len)});
+  launch_enc_emb_layer->before_forward(batch_size, seq_len);
+  for (auto iter : enc_layer_vec) {
+    iter->before_forward(batch_size, seq_len);
+  }
+  enc_norm_layer->before_forward(batch_size, seq_len);
+  _enc_kv_layer->before_forward(batch_size, seq_len);
+}
+
+template <typename OpType_>
+void T5<OpType_>::decoder_before_forward(int batch_size, int seq_len,
+                                         int cur_step) {
+  launch_dec_emb_layer->before_forward(batch_size, cur_step);
+  for (auto iter : dec_layer_vec) {
+    iter->before_forward(batch_size, tw_._beam_size, seq_len, cur_step);
+  }
+
+  int beam_batch_size = batch_size * tw_._beam_size;
+  dec_norm_layer->before_forward(batch_size, tw_._beam_size);
+  linear_layer->before_forward(beam_batch_size, 1);
+  _generator_layer->before_forward(batch_size, 1, cur_step);
+}
+
+template <typename OpType_>
+void T5<OpType_>::Infer() {
+  int batch_size = input_shapes_[0][0], seq_len = input_shapes_[0][1];
+
+  if (tw_._sampling_method == "topk" || tw_._sampling_method == "topp") {
+    _output_topk = false;
+  }
+  if (tw_._sampling_method == "topk_greedy") {
+    _output_topk = true;
+  }
+
+  int _batch_max_decode_length =
+      std::min(tw_._max_step, seq_len + tw_._extra_decode_length) - 1;
+
+  _is_sampling =
+      (tw_._sampling_method == "topk" || tw_._sampling_method == "topp" ||
+       tw_._sampling_method == "topk_greedy");
+
+  if (_is_sampling) {
+    _batch_max_decode_length = tw_._max_step;
+  }
+
+  /* --- notice that the order of forward should be the same with network --- */
+  encoder_before_forward(batch_size, seq_len);
+  decoder_before_forward(batch_size, seq_len, 0);
+
+  launch_enc_emb_layer->forward();
+  for (auto iter : enc_layer_vec) {
+    iter->forward();
+  }
+  enc_norm_layer->forward();
+  _enc_kv_layer->forward();
+
+  int step = 0;
+  for (step = 0; step < _batch_max_decode_length - 1; step++) {
+    decoder_before_forward(batch_size, seq_len, step);
+
+    launch_dec_emb_layer->forward();
+    for (auto iter : dec_layer_vec) {
+      iter->forward();
+    }
+    dec_norm_layer->forward();
+    linear_layer->forward();
+    _generator_layer->forward();
+    if (_generator_layer->is_stop()) {
+      break;
+    }
+    if (_generate_method == GenerateMethod::BeamSearch) {
+      _generator_layer->refresh_cache(total_cache_k, total_cache_v);
+      Variable::swap_tensor(dec_tokens, dec_tokens_buf);
+    }
+  }
+
+  if (_output_topk || _is_sampling) {
+    cuda::ker_write_topk_result<<<batch_size * tw_._beam_size, step + 1, 0,
+                                  _context_ptr->get_stream()>>>(
+        (int *)dec_tokens->value(), (float *)seq_score->value(),
+        (int *)t5_out->value(), tw_._trg_vocab_size, tw_._max_step,
+        tw_._beam_size, tw_._end_id);
+  } else {
+    if (tw_._length_penalty >= 0.f || step == _batch_max_decode_length) {
+      cuda::ker_write_trg_tokenid_pos_penalty<<<batch_size, step + 1, 0,
+                                                _context_ptr->get_stream()>>>(
+          (int *)dec_tokens->value(), (float *)seq_score->value(),
+          (int *)t5_out->value(), tw_._max_step, tw_._beam_size);
+    } else {
+      cuda::ker_write_trg_tokenid_neg_penalty<<<batch_size, step + 1, 0,
+                                                _context_ptr->get_stream()>>>(
+          (int *)dec_tokens->value(), (float *)seq_score->value(),
+          (int *)t5_out->value(), tw_._max_step, tw_._beam_size,
+          tw_._trg_vocab_size, tw_._end_id);
+    }
+  }
+  /* ---step3. output the decoding result--- */
+
+  _context_ptr->synchronize();
+
+  set_output_shape(0,
+                   {batch_size, _output_topk ? tw_._beam_size : 1, step + 1});
+  set_output_shape(1, {batch_size, _output_topk ? tw_._beam_size : 1});
+}
+
+template <typename OpType_>
+void T5<OpType_>::set_input_ptr(int index, void *input_ptr) {
+  switch (index) {
+    case 0:
+      inp_tokens->set_value(static_cast<char *>(input_ptr));
+      break;
+
+    default:
+      throw std::runtime_error("invalid input index");
+      break;
+  }
+}
+
+template <typename OpType_>
+void T5<OpType_>::set_output_ptr(int index, void *output_ptr) {
+  switch (index) {
+    case 0:
+      t5_out->set_value(static_cast<char *>(output_ptr));
+      break;
+
+    case 1:
+      seq_score->set_value(static_cast<char *>(output_ptr));
+      break;
+
+    default:
+      throw std::runtime_error("invalid input index");
+      break;
+  }
+}
+
+template <typename OpType_>
+const void *T5<OpType_>::get_output_ptr(int index) {
+  switch (index) {
+    case 0:
+      return static_cast<void *>(t5_out->value());
+
+    case 1:
+      return static_cast<void *>(seq_score->value());
+
+    default:
+      throw std::runtime_error("invalid output index");
+      break;
+  }
+}
+
+template <typename OpType_>
+std::vector<int> T5<OpType_>::get_input_max_shape(int index) {
+  switch (index) {
+    case 0:
+      return {_max_batch_size, tw_._max_step};
+      break;
+
+    default:
+      throw std::runtime_error("invalid input index");
+      break;
+  }
+}
+
+template <typename OpType_>
+std::vector<int> T5<OpType_>::get_output_max_shape(int index) {
+  switch (index) {
+    case 0:
+      return {_max_batch_size, tw_._beam_size, tw_._max_step};
+      break;
+
+    case 1:
+      return {_max_batch_size, tw_._beam_size};
+      break;
+
+    default:
+      throw std::runtime_error("invalid output index");
+      break;
+  }
+}
+
+template <typename OpType_>
+DataType T5<OpType_>::get_input_dtype(int index) {
+  switch (index) {
+    case 0:
+      return DataType::kInt32;
+      break;
+
+    default:
+      throw std::runtime_error("invalid input index");
+      break;
+  }
+}
+
+template <typename OpType_>
+DataType T5<OpType_>::get_output_dtype(int index) {
+  switch (index) {
+    case 0:
+      return DataType::kInt32;
+      break;
+
+    case 1:
+      return DataType::kFloat32;
+      break;
+
+    default:
+      throw std::runtime_error("invalid output index");
+      break;
+  }
+}
+
+template class T5<float>;
+#ifdef LIGHTSEQ_cuda
+template class T5<__half>;
+#endif
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -0,0 +1,492 @@
+#include "traffic_capture.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "declaration.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+const char kTrafficMagic[8] = {'L', 'S', 'T', 'R', 'A', 'F', 'C', '1'};
+
+size_t data_type_size(DataType dtype) {
+  switch (dtype) {
+    case kInt8:
+    case kByte:
+    case kUInt8:
+      return 1;
+    case kFloat16:
+    case kBFloat16:
+    case kInt16:
+    case kUInt16:
+      return 2;
+    case kInt64:
+    case kUInt64:
+    case kFloat64:
+      return 8;
+    default:
+      return 4;
+  }
+}
+
+size_t shape_size(const std::vector<int>& shape) {
+  size_t res = 1;
+  for (int dim : shape) res *= dim;
+  return res;
+}
+
+std::vector<std::string> input_names(LSModel* model) {
+  std::vector<std::string> names;
+  for (int i = 0; i < model->get_input_size(); i++) {
+    names.push_back(model->get_input_name(i));
+  }
+  return names;
+}
+
+std::vector<std::string> output_names(LSModel* model) {
+  std::vector<std::string> names;
+  for (int i = 0; i < model->get_output_size(); i++) {
+    names.push_back(model->get_output_name(i));
+  }
+  return names;
+}
+
+void copy_bytes(void* dst, const void* src, size_t bytes) {
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaMemcpy(dst, src, bytes, cudaMemcpyDefault));
+#else
+  memcpy(dst, src, bytes);
+#endif
+}
+
+template <typename T>
+void write_value(std::ostream& out, const T& value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+T read_value(std::istream& in) {
+  T value;
+  in.read(reinterpret_cast<char*>(&value), sizeof(T));
+  return value;
+}
+
+void write_ints(std::ostream& out, const std::vector<int>& values) {
+  write_value<int32_t>(out, values.size());
+  out.write(reinterpret_cast<const char*>(values.data()),
+            values.size() * sizeof(int32_t));
+}
+
+std::vector<int> read_ints(std::istream& in) {
+  int32_t size = read_value<int32_t>(in);
+  if (!in || size < 0) throw std::runtime_error("truncated traffic log");
+  std::vector<int> values(size);
+  in.read(reinterpret_cast<char*>(values.data()), size * sizeof(int32_t));
+  return values;
+}
+
+TrafficTensor host_tensor(const int* data, int size) {
+  TrafficTensor tensor;
+  tensor.dtype = kInt32;
+  tensor.shape = {size};
+  tensor.data.assign(reinterpret_cast<const char*>(data),
+                     reinterpret_cast<const char*>(data + size));
+  return tensor;
+}
+
+float ms_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<float, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+}  // namespace
+
+TrafficRecorder::TrafficRecorder(const std::string& path)
+    : _fout(path, std::ios::binary | std::ios::trunc),
+      _start(std::chrono::steady_clock::now()) {
+  if (!_fout.is_open()) {
+    throw std::runtime_error("failed to open the traffic log " + path);
+  }
+  _fout.write(kTrafficMagic, sizeof(kTrafficMagic));
+  _fout.flush();
+}
+
+std::shared_ptr<TrafficRecorder> TrafficRecorder::get(
+    const std::string& path) {
+  static std::mutex recorders_mutex;
+  static std::map<std::string, std::weak_ptr<TrafficRecorder>> recorders;
+  std::lock_guard<std::mutex> lock(recorders_mutex);
+  std::shared_ptr<TrafficRecorder> recorder = recorders[path].lock();
+  if (!recorder) {
+    recorder = std::make_shared<TrafficRecorder>(path);
+    recorders[path] = recorder;
+  }
+  return recorder;
+}
+
+double TrafficRecorder::seconds_since_start() const {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       _start)
+      .count();
+}
+
+void TrafficRecorder::write(const TrafficRecord& record) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  write_value<double>(_fout, record.arrival_s);
+  write_value<float>(_fout, record.latency_ms);
+  write_value<int32_t>(_fout, static_cast<int32_t>(record.kind));
+  write_ints(_fout, record.params);
+  write_value<int32_t>(_fout, record.tensors.size());
+  for (const TrafficTensor& tensor : record.tensors) {
+    write_value<int32_t>(_fout, tensor.dtype);
+    write_ints(_fout, tensor.shape);
+    write_value<uint64_t>(_fout, tensor.data.size());
+    _fout.write(tensor.data.data(), tensor.data.size());
+  }
+  _fout.flush();
+}
+
+std::vector<TrafficRecord> read_traffic_log(const std::string& path) {
+  std::ifstream fin(path, std::ios::binary);
+  if (!fin.is_open()) {
+    throw std::runtime_error("failed to open the traffic log " + path);
+  }
+  char magic[sizeof(kTrafficMagic)];
+  fin.read(magic, sizeof(magic));
+  if (!fin || memcmp(magic, kTrafficMagic, sizeof(magic)) != 0) {
+    throw std::runtime_error(path + " is not a traffic log");
+  }
+  std::vector<TrafficRecord> records;
+  while (fin.peek() != EOF) {
+    TrafficRecord record;
+    record.arrival_s = read_value<double>(fin);
+    record.latency_ms = read_value<float>(fin);
+    record.kind = static_cast<TrafficKind>(read_value<int32_t>(fin));
+    record.params = read_ints(fin);
+    int32_t num_tensors = read_value<int32_t>(fin);
+    if (!fin || num_tensors < 0) throw std::runtime_error("truncated " + path);
+    record.tensors.resize(num_tensors);
+    for (TrafficTensor& tensor : record.tensors) {
+      tensor.dtype = static_cast<DataType>(read_value<int32_t>(fin));
+      tensor.shape = read_ints(fin);
+      tensor.data.resize(read_value<uint64_t>(fin));
+      fin.read(tensor.data.data(), tensor.data.size());
+    }
+    if (!fin) throw std::runtime_error("truncated " + path);
+    records.push_back(std::move(record));
+  }
+  std::stable_sort(records.begin(), records.end(),
+                   [](const TrafficRecord& a, const TrafficRecord& b) {
+                     return a.arrival_s < b.arrival_s;
+                   });
+  return records;
+}
+
+LSModel* capture_traffic_model(LSModel* model, const std::string& path,
+                               float sample_rate) {
+  return new CaptureModel(model, path, sample_rate);
+}
+
+CaptureModel::CaptureModel(LSModel* model, const std::string& path,
+                           float sample_rate)
+    : LSModel(input_names(model), output_names(model)),
+      _model(model),
+      _input_ptrs(model->get_input_size(), nullptr),
+      _sample_rate(sample_rate),
+      _gen(std::random_device()()),
+      _uniform(0.f, 1.f),
+      _recorder(TrafficRecorder::get(path)) {}
+
+CaptureModel::~CaptureModel() {
+  for (auto& id_record : _pending) _recorder->write(id_record.second);
+}
+
+bool CaptureModel::sample() {
+  if (_sample_rate >= 1.f) return true;
+  std::lock_guard<std::mutex> lock(_request_mutex);
+  return _uniform(_gen) < _sample_rate;
+}
+
+void CaptureModel::finish_pending(int request_id, bool finished) {
+  std::lock_guard<std::mutex> lock(_request_mutex);
+  auto iter = _pending.find(request_id);
+  if (iter == _pending.end()) return;
+  TrafficRecord& record = iter->second;
+  if (finished) {
+    record.latency_ms =
+        (_recorder->seconds_since_start() - record.arrival_s) * 1e3;
+  }
+  _recorder->write(record);
+  _pending.erase(iter);
+}
+
+void CaptureModel::Infer() {
+  for (int i = 0; i < get_input_size(); i++) {
+    _model->set_input_shape(i, input_shapes_[i]);
+  }
+  if (!sample()) {
+    _model->Infer();
+    for (int i = 0; i < get_output_size(); i++) {
+      set_output_shape(i, _model->get_output_shape(i));
+    }
+    return;
+  }
+
+  TrafficRecord record;
+  record.arrival_s = _recorder->seconds_since_start();
+  record.kind = TrafficKind::kInfer;
+  for (int i = 0; i < get_input_size(); i++) {
+    TrafficTensor tensor;
+    tensor.dtype = _model->get_input_dtype(i);
+    tensor.shape = input_shapes_[i];
+    if (_input_ptrs[i] && !tensor.shape.empty()) {
+      tensor.data.resize(shape_size(tensor.shape) *
+                         data_type_size(tensor.dtype));
+      copy_bytes(tensor.data.data(), _input_ptrs[i], tensor.data.size());
+    }
+    record.tensors.push_back(std::move(tensor));
+  }
+  auto start = std::chrono::steady_clock::now();
+  try {
+    _model->Infer();
+  } catch (...) {
+    _recorder->write(record);
+    throw;
+  }
+  record.latency_ms = ms_since(start);
+  for (int i = 0; i < get_output_size(); i++) {
+    set_output_shape(i, _model->get_output_shape(i));
+  }
+  _recorder->write(record);
+}
+
+void CaptureModel::set_input_ptr(int index, void* input_ptr) {
+  _input_ptrs.at(index) = input_ptr;
+  _model->set_input_ptr(index, input_ptr);
+}
+
+void CaptureModel::set_output_ptr(int index, void* output_ptr) {
+  _model->set_output_ptr(index, output_ptr);
+}
+
+const void* CaptureModel::get_output_ptr(int index) {
+  return _model->get_output_ptr(index);
+}
+
+std::vector<int> CaptureModel::get_input_max_shape(int index) {
+  return _model->get_input_max_shape(index);
+}
+
+std::vector<int> CaptureModel::get_output_max_shape(int index) {
+  return _model->get_output_max_shape(index);
+}
+
+DataType CaptureModel::get_input_dtype(int index) {
+  return _model->get_input_dtype(index);
+}
+
+DataType CaptureModel::get_output_dtype(int index) {
+  return _model->get_output_dtype(index);
+}
+
+void CaptureModel::benchmark_mode(bool is_benchmark) {
+  _model->benchmark_mode(is_benchmark);
+}
+
+std::vector<WarmupTiming> CaptureModel::warmup(
+    const std::vector<std::vector<int>>& shapes) {
+  // warmup is not traffic.
+  return _model->warmup(shapes);
+}
+
+void CaptureModel::update_weights(const std::string& weight_path) {
+  _model->update_weights(weight_path);
+}
+
+MemoryProfile CaptureModel::memory_profile() {
+  return _model->memory_profile();
+}
+
+void CaptureModel::dynamic_memory_plan(bool enable) {
+  _model->dynamic_memory_plan(enable);
+}
+
+void CaptureModel::cuda_graph_mode(bool enable) {
+  _model->cuda_graph_mode(enable);
+}
+
+void CaptureModel::suspend() { _model->suspend(); }
+
+void CaptureModel::resume() { _model->resume(); }
+
+bool CaptureModel::evict_weights() { return _model->evict_weights(); }
+
+bool CaptureModel::restore_weights() { return _model->restore_weights(); }
+
+size_t CaptureModel::weight_bytes() { return _model->weight_bytes(); }
+
+void CaptureModel::set_next_input(int index, void* input_ptr,
+                                  std::vector<int> shape) {
+  // captured by the Infer which gets it.
+  _model->set_next_input(index, input_ptr, std::move(shape));
+}
+
+void CaptureModel::multi_stream(int num_streams) {
+  _model->multi_stream(num_streams);
+}
+
+void CaptureModel::profiling(bool enable) { _model->profiling(enable); }
+
+void CaptureModel::export_profile(const std::string& trace_path) {
+  _model->export_profile(trace_path);
+}
+
+std::string CaptureModel::metrics_text() { return _model->metrics_text(); }
+
+void CaptureModel::layer_time_sampling(int interval) {
+  _model->layer_time_sampling(interval);
+}
+
+int CaptureModel::add_request(const std::vector<int>& prompt,
+                              int max_new_tokens, int priority,
+                              int deadline_ms, int session_id) {
+  if (!sample()) {
+    return _model->add_request(prompt, max_new_tokens, priority, deadline_ms,
+                               session_id);
+  }
+  TrafficRecord record;
+  record.arrival_s = _recorder->seconds_since_start();
+  record.kind = TrafficKind::kAddRequest;
+  record.params = {max_new_tokens, priority, deadline_ms, session_id};
+  record.tensors.push_back(host_tensor(prompt.data(), prompt.size()));
+  int request_id = _model->add_request(prompt, max_new_tokens, priority,
+                                       deadline_ms, session_id);
+  std::lock_guard<std::mutex> lock(_request_mutex);
+  _pending[request_id] = std::move(record);
+  return request_id;
+}
+
+void CaptureModel::drop_session(int session_id) {
+  _model->drop_session(session_id);
+}
+
+std::vector<std::pair<int, std::vector<int>>> CaptureModel::step() {
+  std::vector<std::pair<int, std::vector<int>>> finished = _model->step();
+  for (const auto& id_tokens : finished) {
+    finish_pending(id_tokens.first, true);
+  }
+  for (int request_id : _model->last_step_evicted()) {
+    finish_pending(request_id, false);
+  }
+  return finished;
+}
+
+bool CaptureModel::has_pending_requests() {
+  return _model->has_pending_requests();
+}
+
+std::vector<std::pair<int, int>> CaptureModel::last_step_tokens() {
+  return _model->last_step_tokens();
+}
+
+void CaptureModel::cancel_request(int request_id) {
+  // written once it leaves the batch, see last_step_evicted.
+  _model->cancel_request(request_id);
+}
+
+void CaptureModel::evict_expired_requests(bool enable) {
+  _model->evict_expired_requests(enable);
+}
+
+std::vector<int> CaptureModel::last_step_evicted() {
+  return _model->last_step_evicted();
+}
+
+void CaptureModel::cancel_row(int row) { _model->cancel_row(row); }
+
+void CaptureModel::set_token_callback(
+    std::function<void(int, const std::vector<int>&)> callback) {
+  _model->set_token_callback(callback);
+}
+
+void CaptureModel::set_sampling_params(float temperature,
+                                       float repetition_penalty,
+                                       float min_p) {
+  _model->set_sampling_params(temperature, repetition_penalty, min_p);
+}
+
+void CaptureModel::set_num_return_sequences(int num) {
+  _model->set_num_return_sequences(num);
+}
+
+void CaptureModel::set_generation_configs(
+    const std::vector<GenerationConfig>& configs) {
+  _model->set_generation_configs(configs);
+}
+
+void CaptureModel::set_logits_processor(const LogitsProcessConfig& config) {
+  _model->set_logits_processor(config);
+}
+
+void CaptureModel::set_token_automaton(const TokenAutomaton& automaton) {
+  _model->set_token_automaton(automaton);
+}
+
+void CaptureModel::set_draft_model(LSModel* draft_model,
+                                   int num_draft_tokens) {
+  // the draft model of the capture_path option is not captured.
+  CaptureModel* capture_draft = dynamic_cast<CaptureModel*>(draft_model);
+  if (capture_draft) draft_model = capture_draft->model();
+  _model->set_draft_model(draft_model, num_draft_tokens);
+}
+
+void CaptureModel::load_lora_adapter(const std::string& name,
+                                     const std::string& path) {
+  _model->load_lora_adapter(name, path);
+}
+
+void CaptureModel::set_lora_adapters(const std::vector<std::string>& names) {
+  _model->set_lora_adapters(names);
+}
+
+void CaptureModel::score_packed(const int* tokens, const int* offsets,
+                                int num_seqs, float* ppl,
+                                float* token_log_probs) {
+  _model->score_packed(tokens, offsets, num_seqs, ppl, token_log_probs);
+}
+
+void CaptureModel::score_tree(const int* prefix, int prefix_len,
+                              const int* tree_tokens, const int* tree_parents,
+                              int tree_len, float* log_likelihood) {
+  _model->score_tree(prefix, prefix_len, tree_tokens, tree_parents, tree_len,
+                     log_likelihood);
+}
+
+void CaptureModel::encode_packed(const int* tokens, const int* offsets,
+                                 int num_seqs, void* output) {
+  if (!sample()) {
+    _model->encode_packed(tokens, offsets, num_seqs, output);
+    return;
+  }
+  TrafficRecord record;
+  record.arrival_s = _recorder->seconds_since_start();
+  record.kind = TrafficKind::kEncodePacked;
+  record.tensors.push_back(host_tensor(tokens, offsets[num_seqs]));
+  record.tensors.push_back(host_tensor(offsets, num_seqs + 1));
+  auto start = std::chrono::steady_clock::now();
+  try {
+    _model->encode_packed(tokens, offsets, num_seqs, output);
+  } catch (...) {
+    _recorder->write(record);
+    throw;
+  }
+  record.latency_ms = ms_since(start);
+  _recorder->write(record);
+}
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -2,13 +2,16 @@
 
 namespace lightseq {
 namespace cuda {
-Transformer::Transformer(const std::string weight_path,
-                         const int max_batch_size)
+template <typename OpType_>
+Transformer<OpType_>::Transformer(const std::string weight_path,
+                                  const int max_batch_size,
+                                  const ModelOptions &options)
     : LSModel({"source_ids"}, {"target_ids", "target_scores"}),
       _max_batch_size(max_batch_size) {
   /* --- step.1 initial context --- */
-  Context::create_global_context(StatusType::Inference);
-  _context_ptr = Context::global_instance();
+  _context_ptr = std::make_shared<Context>(StatusType::Inference, -1);
+  // the graph of the model is created in its own context.
+  ContextScope context_scope(_context_ptr);
 
   /* --- step.2 load model weights into GPU memory --- */
   // saved in custom proto file
@@ -25,40 +28,17 @@ Transformer::Transformer(const std::string weight_path,
 
   /* --- step.3 initial input Variable node --- */
   int max_batch_tokens = tw_._max_step * _max_batch_size;
+  // a sentence language token is not part of the input tokens, which the
+  // packing is computed from.
+  const char *varlen_opt = model_option(options, "varlen");
+  _varlen = varlen_opt && std::atoi(varlen_opt) != 0 &&
+            tw_._multilg_type != 2;
+  // int8 enc-dec attention k, v, see EncDecAttentionI8Op.
+  const char *int8_opt = model_option(options, "encdec_kv_int8");
+  bool encdec_kv_int8 = int8_opt && std::atoi(int8_opt) != 0;
 
   /* --- step.4 inital operator & layer --- */
 
-  // initial LaunchEncEmb layer
-  launch_enc_emb_layer.reset(new LaunchEncEmbLayer<OpType_>(
-      max_batch_tokens, tw_._padding_id, tw_._hidden_size, tw_._multilg_type));
-  launch_enc_emb_layer->load_params(tw_.get_src_emb_wei(), 0);
-
-  // initial LayerNormalize layer
-  enc_norm_layer.reset(new LyrNormalizeLayer<OpType_, OpType_>(
-      max_batch_tokens, tw_._hidden_size));
-  enc_norm_layer->load_params(tw_.get_src_emb_wei(), 2);
-
-  // // initial TransformerEncoder layers
-  float attn_prob_dropout_ratio = 0.0;
-  float activation_dropout_ratio = 0.0;
-  float hidden_dropout_ratio = 0.0;
-  int enc_wei_offset = 0;
-  for (int idx = 0; idx < tw_._n_enc_layer; idx++) {
-    TransformerEncoderLayerPtr<OpType_, OpType_> enc_layer_(
-        new TransformerEncoderLayer<OpType_, OpType_>(
-            idx, max_batch_tokens, tw_._max_step, tw_._hidden_size,
-            tw_._head_num, tw_._inner_size, attn_prob_dropout_ratio,
-            activation_dropout_ratio, hidden_dropout_ratio, !tw_._is_post_ln,
-            tw_._use_gelu ? "gelu" : "relu", false));
-    enc_wei_offset +=
-        enc_layer_->load_params(tw_.get_enc_wei(), enc_wei_offset);
-    enc_layer_vec.push_back(enc_layer_);
-  }
-
-  _enc_kv_layer.reset(new EncDecKvLayer<OpType_, OpType_>(
-      tw_._n_dec_layer, max_batch_tokens, tw_._hidden_size, tw_._head_num));
-  _enc_kv_layer->load_params(tw_.get_trg_emb_wei(), 4);
-
   // initial LaunchDecEmb layer
   launch_dec_emb_layer.reset(new LaunchDecEmbLayer<OpType_>(
       max_batch_size, tw_._beam_size, tw_._hidden_size, tw_._trg_vocab_size,
@@ -78,7 +58,7 @@ Transformer::Transformer(const std::string weight_path,
             tw_._n_dec_layer, idx, max_batch_tokens, tw_._max_step,
             tw_._hidden_size, tw_._head_num, tw_._inner_size, 0, 0, 0,
             !tw_._is_post_ln, tw_._use_gelu ? "gelu" : "relu", false,
-            max_batch_size, tw_._beam_size));
+            max_batch_size, tw_._beam_size, encdec_kv_int8));
     dec_wei_offset +=
         dec_layer_->load_params(tw_.get_dec_wei(), dec_wei_offset);
     dec_layer_vec.push_back(dec_layer_);
@@ -97,20 +77,20 @@ Transformer::Transformer(const std::string weight_path,
       tw_._diverse_lambda, tw_._dim_per_head, tw_._end_id, tw_._head_num,
       tw_._length_penalty, tw_._topk, tw_._topp, true));
   _generator_layer->load_params(tw_.get_trg_emb_wei(), 6);
+  // beam_prune_abs, beam_prune_rel: the absolute and
+  // relative score margins of beam pruning, none by default, see
+  // BeamSearchTopOp::set_beam_pruning.
+  const char *prune_abs_opt = model_option(options, "beam_prune_abs");
+  const char *prune_rel_opt = model_option(options, "beam_prune_rel");
+  _generator_layer->set_beam_pruning(
+      prune_abs_opt ? std::atof(prune_abs_opt) : 0.f,
+      prune_rel_opt ? std::atof(prune_rel_opt) : 0.f);
 
   /* --- step.5 construct network --- */
-  inp_tokens = new Variable("inp_tokens", g_dtype<int>());
+  build_encoder(&_encoder, false);
+  Variable *pad_mask = _encoder.pad_mask;
+  Variable *total_enc_kv = _encoder.total_enc_kv;
   dec_tokens = new Variable("dec_tokens", g_dtype<int>());
-  std::tuple<Variable *, Variable *> enc_emb_outs =
-      (*launch_enc_emb_layer)(inp_tokens);
-  Variable *enc_emb = std::get<0>(enc_emb_outs);
-  Variable *pad_mask = std::get<1>(enc_emb_outs);
-  enc_emb = (*enc_norm_layer)(enc_emb);
-  for (auto iter : enc_layer_vec) {
-    enc_emb = (*iter)(enc_emb, pad_mask);
-  }
-
-  Variable *total_enc_kv = (*_enc_kv_layer)(enc_emb);
 
   total_enc_kv->set_regress_var();
 
@@ -179,22 +159,149 @@ Transformer::Transformer(const std::string weight_path,
   _context_ptr->build();
 }
 
-Transformer::~Transformer() {}
+template <typename OpType_>
+Transformer<OpType_>::~Transformer() {
+  if (_next_context_ptr) {
+    cudaEventDestroy(_next_encoded);
+    cudaEventDestroy(_next_consumed);
+  }
+}
 
-void Transformer::encoder_before_forward(int batch_size, int seq_len) {
-  inp_tokens->set_shape({size_t(batch_size), size_t(seq_len)});
-  launch_enc_emb_layer->before_forward(batch_size, seq_len);
-  int dec_layer_idx = 0;
-  for (auto iter : enc_layer_vec) {
+template <typename OpType_>
+void Transformer<OpType_>::build_encoder(Encoder *encoder, bool keep_outputs) {
+  int max_batch_tokens = tw_._max_step * _max_batch_size;
+  // initial LaunchEncEmb layer
+  encoder->launch_enc_emb_layer.reset(new LaunchEncEmbLayer<OpType_>(
+      max_batch_tokens, tw_._padding_id, tw_._hidden_size, tw_._multilg_type));
+  encoder->launch_enc_emb_layer->load_params(tw_.get_src_emb_wei(), 0);
+
+  // initial LayerNormalize layer
+  encoder->enc_norm_layer.reset(new LyrNormalizeLayer<OpType_, OpType_>(
+      max_batch_tokens, tw_._hidden_size));
+  encoder->enc_norm_layer->load_params(tw_.get_src_emb_wei(), 2);
+
+  // // initial TransformerEncoder layers
+  float attn_prob_dropout_ratio = 0.0;
+  float activation_dropout_ratio = 0.0;
+  float hidden_dropout_ratio = 0.0;
+  int enc_wei_offset = 0;
+  for (int idx = 0; idx < tw_._n_enc_layer; idx++) {
+    TransformerEncoderLayerPtr<OpType_, OpType_> enc_layer_(
+        new TransformerEncoderLayer<OpType_, OpType_>(
+            idx, max_batch_tokens, tw_._max_step, tw_._hidden_size,
+            tw_._head_num, tw_._inner_size, attn_prob_dropout_ratio,
+            activation_dropout_ratio, hidden_dropout_ratio, !tw_._is_post_ln,
+            tw_._use_gelu ? "gelu" : "relu", false, _varlen));
+    enc_wei_offset +=
+        enc_layer_->load_params(tw_.get_enc_wei(), enc_wei_offset);
+    encoder->enc_layer_vec.push_back(enc_layer_);
+  }
+
+  if (_varlen) {
+    encoder->_remove_padding_layer.reset(
+        new RemovePaddingLayer<OpType_, OpType_>(
+            max_batch_tokens, tw_._hidden_size, tw_._padding_id));
+    encoder->_rebuild_padding_layer.reset(
+        new RebuildPaddingLayer<OpType_, OpType_>(max_batch_tokens,
+                                                  tw_._hidden_size));
+    encoder->_rebuild_padding_layer->set_packed_to_padded(
+        encoder->_remove_padding_layer->packed_to_padded());
+    for (auto iter : encoder->enc_layer_vec) {
+      iter->set_cu_seqlens(encoder->_remove_padding_layer->cu_seqlens());
+    }
+  }
+
+  encoder->_enc_kv_layer.reset(new EncDecKvLayer<OpType_, OpType_>(
+      tw_._n_dec_layer, max_batch_tokens, tw_._hidden_size, tw_._head_num));
+  encoder->_enc_kv_layer->load_params(tw_.get_trg_emb_wei(), 4);
+
+  encoder->inp_tokens = new Variable("inp_tokens", g_dtype<int>());
+  std::tuple<Variable *, Variable *> enc_emb_outs =
+      (*encoder->launch_enc_emb_layer)(encoder->inp_tokens);
+  Variable *enc_emb = std::get<0>(enc_emb_outs);
+  encoder->pad_mask = std::get<1>(enc_emb_outs);
+  if (_varlen) enc_emb = (*encoder->_remove_padding_layer)(enc_emb);
+  enc_emb = (*encoder->enc_norm_layer)(enc_emb);
+  for (auto iter : encoder->enc_layer_vec) {
+    enc_emb = (*iter)(enc_emb, encoder->pad_mask);
+  }
+  // the decoder attends to the padded encoder output.
+  if (_varlen) enc_emb = (*encoder->_rebuild_padding_layer)(enc_emb);
+
+  Context *context = Context::global_instance().get();
+  if (keep_outputs) context->regress_begin();
+  encoder->total_enc_kv = (*encoder->_enc_kv_layer)(enc_emb);
+  if (keep_outputs) {
+    encoder->pad_mask->set_regress_var();
+    encoder->total_enc_kv->set_regress_var();
+    context->regress_end();
+  }
+}
+
+template <typename OpType_>
+void Transformer<OpType_>::build_next_encoder() {
+  // the weights are shared, the activations get a memory plan of their own.
+  _next_context_ptr = std::make_shared<Context>(StatusType::Inference, -1);
+  ContextScope context_scope(_next_context_ptr);
+  build_encoder(&_next_encoder, true);
+  _next_context_ptr->build();
+  CHECK_GPU_ERROR(
+      cudaEventCreateWithFlags(&_next_encoded, cudaEventDisableTiming));
+  CHECK_GPU_ERROR(
+      cudaEventCreateWithFlags(&_next_consumed, cudaEventDisableTiming));
+}
+
+template <typename OpType_>
+void Transformer<OpType_>::set_next_input(int index, void *input_ptr,
+                                          std::vector<int> shape) {
+  if (index != 0) {
+    throw std::runtime_error("invalid input index");
+  }
+  if (!_next_context_ptr) build_next_encoder();
+  _next_input_ptr = input_ptr;
+  _next_input_shape = std::move(shape);
+}
+
+template <typename OpType_>
+void Transformer<OpType_>::encoder_before_forward(Encoder *encoder,
+                                                  int batch_size, int seq_len) {
+  encoder->inp_tokens->set_shape({size_t(batch_size), size_t(seq_len)});
+  encoder->launch_enc_emb_layer->before_forward(batch_size, seq_len);
+  encoder->_enc_kv_layer->before_forward(batch_size, seq_len);
+  if (_varlen) {
+    // the layers after the embedding only see the packed tokens.
+    int valid_tokens = encoder->_remove_padding_layer->set_offsets(
+        (const int *)encoder->inp_tokens->value(), batch_size, seq_len);
+    encoder->_remove_padding_layer->before_forward(valid_tokens);
+    for (auto iter : encoder->enc_layer_vec) {
+      iter->before_forward(batch_size, seq_len, valid_tokens);
+    }
+    encoder->enc_norm_layer->before_forward(1, valid_tokens);
+    encoder->_rebuild_padding_layer->before_forward(valid_tokens, batch_size,
+                                                    seq_len);
+    return;
+  }
+  for (auto iter : encoder->enc_layer_vec) {
     iter->before_forward(batch_size, seq_len);
-    dec_layer_idx++;
   }
-  enc_norm_layer->before_forward(batch_size, seq_len);
-  _enc_kv_layer->before_forward(batch_size, seq_len);
+  encoder->enc_norm_layer->before_forward(batch_size, seq_len);
+}
+
+template <typename OpType_>
+void Transformer<OpType_>::encoder_forward(Encoder *encoder) {
+  encoder->launch_enc_emb_layer->forward();
+  if (_varlen) encoder->_remove_padding_layer->forward();
+  encoder->enc_norm_layer->forward();
+  for (auto iter : encoder->enc_layer_vec) {
+    iter->forward();
+  }
+  if (_varlen) encoder->_rebuild_padding_layer->forward();
+  encoder->_enc_kv_layer->forward();
 }
 
-void Transformer::decoder_before_forward(int batch_size, int seq_len,
-                                         int cur_step) {
+template <typename OpType_>
+void Transformer<OpType_>::decoder_before_forward(int batch_size, int seq_len,
+                                                  int cur_step) {
   launch_dec_emb_layer->before_forward(batch_size, cur_step);
   for (auto iter : dec_layer_vec) {
     iter->before_forward(batch_size, tw_._beam_size, seq_len, cur_step);
@@ -206,7 +313,8 @@ void Transformer::decoder_before_forward(int batch_size, int seq_len,
   _generator_layer->before_forward(batch_size, 1, cur_step);
 }
 
-void Transformer::Infer() {
+template <typename OpType_>
+void Transformer<OpType_>::Infer() {
   int batch_size = input_shapes_[0][0], seq_len = input_shapes_[0][1];
 
   if (tw_._sampling_method == "topk" || tw_._sampling_method == "topp") {
@@ -231,12 +339,41 @@ void Transformer::Infer() {
   encoder_before_forward(batch_size, seq_len);
   decoder_before_forward(batch_size, seq_len, 0);
 
-  launch_enc_emb_layer->forward();
-  enc_norm_layer->forward();
-  for (auto iter : enc_layer_vec) {
-    iter->forward();
+  if (_encoded_input_ptr &&
+      _encoded_input_ptr == _encoder.inp_tokens->value() &&
+      _encoded_input_shape == input_shapes_[0]) {
+    // encoded during the decoding of the last Infer, the copy keeps the
+    // outputs of _next_encoder free for the next input.
+    CHECK_GPU_ERROR(cudaStreamWaitEvent(_context_ptr->get_stream(),
+                                        _next_encoded, 0));
+    CHECK_GPU_ERROR(cudaMemcpyAsync(
+        _encoder.total_enc_kv->value(), _next_encoder.total_enc_kv->value(),
+        _next_encoder.total_enc_kv->value_byte_size(),
+        cudaMemcpyDeviceToDevice, _context_ptr->get_stream()));
+    CHECK_GPU_ERROR(cudaMemcpyAsync(
+        _encoder.pad_mask->value(), _next_encoder.pad_mask->value(),
+        _next_encoder.pad_mask->value_byte_size(), cudaMemcpyDeviceToDevice,
+        _context_ptr->get_stream()));
+    CHECK_GPU_ERROR(
+        cudaEventRecord(_next_consumed, _context_ptr->get_stream()));
+  } else {
+    encoder_forward(&_encoder);
+  }
+  _encoded_input_ptr = nullptr;
+
+  if (_next_input_ptr) {
+    std::vector<int> &shape = _next_input_shape;
+    _next_encoder.inp_tokens->set_value((char *)_next_input_ptr);
+    CHECK_GPU_ERROR(cudaStreamWaitEvent(_next_context_ptr->get_stream(),
+                                        _next_consumed, 0));
+    encoder_before_forward(&_next_encoder, shape[0], shape[1]);
+    encoder_forward(&_next_encoder);
+    CHECK_GPU_ERROR(
+        cudaEventRecord(_next_encoded, _next_context_ptr->get_stream()));
+    _encoded_input_ptr = _next_input_ptr;
+    _encoded_input_shape = shape;
+    _next_input_ptr = nullptr;
   }
-  _enc_kv_layer->forward();
 
   int step = 0;
   for (step = 0; step < _batch_max_decode_length - 1; step++) {
@@ -287,10 +424,11 @@ void Transformer::Infer() {
   set_output_shape(1, {batch_size, _output_topk ? tw_._beam_size : 1});
 }
 
-void Transformer::set_input_ptr(int index, void *input_ptr) {
+template <typename OpType_>
+void Transformer<OpType_>::set_input_ptr(int index, void *input_ptr) {
   switch (index) {
     case 0:
-      inp_tokens->set_value(static_cast<char *>(input_ptr));
+      _encoder.inp_tokens->set_value(static_cast<char *>(input_ptr));
       break;
 
     default:
@@ -299,7 +437,8 @@ void Transformer::set_input_ptr(int index, void *input_ptr) {
   }
 }
 
-void Transformer::set_output_ptr(int index, void *output_ptr) {
+template <typename OpType_>
+void Transformer<OpType_>::set_output_ptr(int index, void *output_ptr) {
   switch (index) {
     case 0:
       transformer_out->set_value(static_cast<char *>(output_ptr));
@@ -315,7 +454,8 @@ void Transformer::set_output_ptr(int index, void *output_ptr) {
   }
 }
 
-const void *Transformer::get_output_ptr(int index) {
+template <typename OpType_>
+const void *Transformer<OpType_>::get_output_ptr(int index) {
   switch (index) {
     case 0:
       return static_cast<void *>(transformer_out->value());
@@ -329,7 +469,8 @@ const void *Transformer::get_output_ptr(int index) {
   }
 }
 
-std::vector<int> Transformer::get_input_max_shape(int index) {
+template <typename OpType_>
+std::vector<int> Transformer<OpType_>::get_input_max_shape(int index) {
   switch (index) {
     case 0:
       return {_max_batch_size, tw_._max_step};
@@ -341,7 +482,8 @@ std::vector<int> Transformer::get_input_max_shape(int index) {
   }
 }
 
-std::vector<int> Transformer::get_output_max_shape(int index) {
+template <typename OpType_>
+std::vector<int> Transformer<OpType_>::get_output_max_shape(int index) {
   switch (index) {
     case 0:
       return {_max_batch_size, tw_._beam_size, tw_._max_step};
@@ -357,7 +499,8 @@ std::vector<int> Transformer::get_output_max_shape(int index) {
   }
 }
 
-DataType Transformer::get_input_dtype(int index) {
+template <typename OpType_>
+DataType Transformer<OpType_>::get_input_dtype(int index) {
   switch (index) {
     case 0:
       return DataType::kInt32;
@@ -369,7 +512,8 @@ DataType Transformer::get_input_dtype(int index) {
   }
 }
 
-DataType Transformer::get_output_dtype(int index) {
+template <typename OpType_>
+DataType Transformer<OpType_>::get_output_dtype(int index) {
   switch (index) {
     case 0:
       return DataType::kInt32;
@@ -384,5 +528,11 @@ DataType Transformer::get_output_dtype(int index) {
       break;
   }
 }
+
+template class Transformer<float>;
+#ifdef LIGHTSEQ_cuda
+template class Transformer<__half>;
+#endif
+
 }  // namespace cuda
 }  // namespace lightseq
@@ -187,6 +187,8 @@ class Dropout {
 
   bool HasDropout() const { return _config.RATIO() > 0.0; }
 
+  float RATIO() const { return _config.RATIO(); }
+
   void SetTrainingMode(bool training) { _config.training = training; }
 
   uint8_t *get_mask() { return _mask; }
@@ -80,11 +80,14 @@ class FeedForward {
                 const T *weights, T *weights_grad, T *bias_grad,
                 cublasHandle_t &_cublasHandle, cudaStream_t &stream,
                 T *inp_grad_out = nullptr, T *out_grad_trans_out = nullptr,
-                bool compute_bias = true) {
+                bool compute_bias = true, bool accumulate_grad = false) {
     float alpha = (T)1.0, beta = (T)0.0;
+    // adds onto weights_grad in place, the bias grad still overwrites.
+    float w_beta = accumulate_grad ? 1.f : 0.f;
     cublas_gemm_ex(_cublasHandle, CUBLAS_OP_N, CUBLAS_OP_T, config_.inputSize,
-                   config_.outputSize, bsz, &alpha, &beta, input_ptr, out_grad,
-                   weights_grad, cublasGemmAlgo_t(config_.gemm_algos[1]));
+                   config_.outputSize, bsz, &alpha, &w_beta, input_ptr,
+                   out_grad, weights_grad,
+                   cublasGemmAlgo_t(config_.gemm_algos[1]));
 
     cublas_gemm_ex(_cublasHandle, CUBLAS_OP_N, CUBLAS_OP_N, config_.inputSize,
                    bsz, config_.outputSize, &alpha, &beta, weights, out_grad,
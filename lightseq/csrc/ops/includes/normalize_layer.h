@@ -47,6 +47,17 @@ class Normalize_Layer {
                          clip_max_out, batch_size, config_.hidden_dim, stream);
   }
 
+  // the ln in front of a QAT int8 gemm, of its float result for the
+  // backward, its input quantized by clip_max[0] and the igemm alpha.
+  void Forward(T *ln_res, int8_t *q_out, uint8_t *clip_mask, float *alpha,
+               const T *inp, const T *gamma, const T *betta,
+               const T *clip_max, int batch_size, cudaStream_t stream,
+               bool out_col32) {
+    launch_layer_norm_i8(q_out, clip_mask, vars_, means_, inp, gamma, betta,
+                         clip_max, batch_size, config_.hidden_dim, stream,
+                         ln_res, alpha, out_col32);
+  }
+
   /*
   residual_grad, inp_or_out, betta should be treated carefully.
   inp_or_out = input if use_mean else output
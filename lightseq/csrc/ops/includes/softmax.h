@@ -27,9 +27,11 @@ class Softmax {
   ~Softmax() {}
 
   void Forward(T *vals, const T *attn_mask, int batch_size, int from_len,
-               int to_len, cudaStream_t &stream, bool mask_future = false) {
+               int to_len, cudaStream_t &stream, bool mask_future = false,
+               const int *seq_ids = nullptr) {
     launch_attn_softmax<T>(vals, attn_mask, batch_size, config_.nhead, from_len,
-                           to_len, config_.mask_future | mask_future, stream);
+                           to_len, config_.mask_future | mask_future, stream,
+                           seq_ids);
   }
 
   void Backward(T *out_grad, const T *soft_out, int batch_size, int from_len,
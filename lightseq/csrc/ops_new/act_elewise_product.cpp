@@ -23,13 +23,41 @@ void ActElewiseProductOp<T1, T2>::forward() {
 
 #ifdef LIGHTSEQ_cuda
   cudaStream_t stream = _context_ptr->get_stream();
-  cuda::launch_silu_elewise_product(inp_val, out_val, _batch_size, _seq_len,
-                                    _inner_size, stream);
+  if (_activation_fn == "gelu") {
+    cuda::launch_gelu_elewise_product(inp_val, out_val, _batch_size, _seq_len,
+                                      _inner_size, stream);
+  } else {
+    cuda::launch_silu_elewise_product(inp_val, out_val, _batch_size, _seq_len,
+                                      _inner_size, stream);
+  }
+#endif
+}
+
+template <typename T1, typename T2>
+void ActElewiseProductOp<T1, T2>::backward() {
+  if (_activation_fn != "silu") {
+    printf("Error! ActElewiseProductOp has no backward of %s\n",
+           _activation_fn.c_str());
+    exit(-1);
+  }
+  T1* inp_val = (T1*)parent(0)->value();
+  T2* inp_grad = (T2*)parent(0)->grad();
+  T2* out_grad = (T2*)child(0)->grad();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cuda::launch_silu_elewise_product_bw(inp_grad, out_grad, inp_val,
+                                       _batch_size, _seq_len, _inner_size,
+                                       _context_ptr->get_stream());
 #endif
 }
 
 template class ActElewiseProductOp<float, float>;
 #ifdef LIGHTSEQ_cuda
 template class ActElewiseProductOp<__half, __half>;
+template class ActElewiseProductOp<__nv_bfloat16, __nv_bfloat16>;
 #endif
 }  // namespace lightseq
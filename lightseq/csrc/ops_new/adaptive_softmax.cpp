@@ -0,0 +1,138 @@
+#include "adaptive_softmax.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+AdaptiveSoftmaxOp<T1, T2>::AdaptiveSoftmaxOp(size_t max_batch_tokens,
+                                             size_t hidden_size,
+                                             const std::vector<int>& cutoffs,
+                                             const std::vector<int>& tail_dims)
+    : Operator("AdaptiveSoftmaxOp"),
+      _max_batch_tokens(max_batch_tokens),
+      _hidden_size(hidden_size),
+      _cutoffs(cutoffs),
+      _tail_dims(tail_dims),
+      _num_clusters(int(cutoffs.size()) - 1) {
+  bool valid = _num_clusters > 0 && _tail_dims.size() == _num_clusters &&
+               _cutoffs[0] > 0;
+  for (int i = 0; valid && i < _num_clusters; i++) {
+    valid = _cutoffs[i + 1] > _cutoffs[i] && _tail_dims[i] > 0;
+  }
+  if (!valid) {
+    printf(
+        "Error! AdaptiveSoftmaxOp needs increasing cutoffs and one tail dim "
+        "per cluster\n");
+    exit(-1);
+  }
+  int max_dim = 0, max_cluster = 0;
+  for (int i = 0; i < _num_clusters; i++) {
+    max_dim = std::max(max_dim, _tail_dims[i]);
+    max_cluster = std::max(max_cluster, _cutoffs[i + 1] - _cutoffs[i]);
+  }
+  _head_out.reset(new Tensor("head_out", g_dtype<T1>(),
+                             max_batch_tokens * (_cutoffs[0] + _num_clusters)));
+  _cluster_logp.reset(new Tensor("cluster_logp", g_dtype<float>(),
+                                 max_batch_tokens * _num_clusters));
+  _proj_out.reset(
+      new Tensor("proj_out", g_dtype<T1>(), max_batch_tokens * max_dim));
+  _tail_out.reset(
+      new Tensor("tail_out", g_dtype<T1>(), max_batch_tokens * max_cluster));
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_cluster_flags,
+                             _num_clusters * sizeof(int)));
+  CHECK_GPU_ERROR(cudaMallocHost((void**)&_h_cluster_flags,
+                                 _num_clusters * sizeof(int)));
+#endif
+}
+
+template <typename T1, typename T2>
+AdaptiveSoftmaxOp<T1, T2>::~AdaptiveSoftmaxOp() {
+#ifdef LIGHTSEQ_cuda
+  cudaFree(_p_d_cluster_flags);
+  cudaFreeHost(_h_cluster_flags);
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* AdaptiveSoftmaxOp<T1, T2>::operator()(
+    Variable* inp, const std::vector<Variable*>& weights) {
+  if (weights.size() != 1 + 2 * _num_clusters) {
+    printf("Error! AdaptiveSoftmaxOp needs %d weights, got %zu\n",
+           1 + 2 * _num_clusters, weights.size());
+    exit(-1);
+  }
+  _result = new Variable("AdaptiveSoftmaxOp_out",
+                         _max_batch_tokens * _cutoffs.back(), g_dtype<T1>(),
+                         g_dtype<T2>());
+  std::vector<Node*> parents = {inp};
+  parents.insert(parents.end(), weights.begin(), weights.end());
+  set_parents(parents);
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void AdaptiveSoftmaxOp<T1, T2>::forward() {
+  T1* input_ptr = (T1*)parent(0)->value();
+  T1* out_ptr = (T1*)child(0)->value();
+  T1* head_out_ptr = (T1*)_head_out->tensor();
+  float* cluster_logp_ptr = (float*)_cluster_logp->tensor();
+  T1* proj_out_ptr = (T1*)_proj_out->tensor();
+  T1* tail_out_ptr = (T1*)_tail_out->tensor();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  cublasHandle_t handle = _context_ptr->get_cublashandle();
+  int rows = _batch_tokens, vocab_size = _cutoffs.back();
+  int head_len = _cutoffs[0] + _num_clusters;
+  float alpha = 1.f, beta = 0.f;
+  cuda::cublas_gemm_ex(handle, CUBLAS_OP_T, CUBLAS_OP_N, head_len, rows,
+                       _hidden_size, &alpha, &beta, (T1*)parent(1)->value(),
+                       input_ptr, head_out_ptr);
+  CHECK_GPU_ERROR(cudaMemsetAsync(_p_d_cluster_flags, 0,
+                                  _num_clusters * sizeof(int), stream));
+  cuda::launch_adaptive_head(out_ptr, cluster_logp_ptr, _p_d_cluster_flags,
+                             head_out_ptr, rows, _cutoffs[0], _num_clusters,
+                             vocab_size, _topk, stream);
+  // the clusters to evaluate decide the gemms to launch.
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_h_cluster_flags, _p_d_cluster_flags,
+                                  _num_clusters * sizeof(int),
+                                  cudaMemcpyDeviceToHost, stream));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(stream));
+
+  for (int i = 0; i < _num_clusters; i++) {
+    int begin = _cutoffs[i], cluster_size = _cutoffs[i + 1] - begin;
+    if (!_h_cluster_flags[i]) {
+      cuda::launch_adaptive_skip(out_ptr, cluster_logp_ptr, rows, begin,
+                                 _cutoffs[i + 1], i, _num_clusters,
+                                 vocab_size, stream);
+      continue;
+    }
+    cuda::cublas_gemm_ex(handle, CUBLAS_OP_T, CUBLAS_OP_N, _tail_dims[i],
+                         rows, _hidden_size, &alpha, &beta,
+                         (T1*)parent(2 + 2 * i)->value(), input_ptr,
+                         proj_out_ptr);
+    cuda::cublas_gemm_ex(handle, CUBLAS_OP_T, CUBLAS_OP_N, cluster_size, rows,
+                         _tail_dims[i], &alpha, &beta,
+                         (T1*)parent(3 + 2 * i)->value(), proj_out_ptr,
+                         tail_out_ptr);
+    cuda::launch_adaptive_tail(out_ptr, tail_out_ptr, cluster_logp_ptr, rows,
+                               cluster_size, begin, i, _num_clusters,
+                               vocab_size, stream);
+  }
+#else
+  printf("Error! AdaptiveSoftmaxOp is only supported on cuda\n");
+  exit(-1);
+#endif
+}
+
+template class AdaptiveSoftmaxOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class AdaptiveSoftmaxOp<__half, __half>;
+template class AdaptiveSoftmaxOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
@@ -0,0 +1,220 @@
+#include "all_reduce.h"
+
+namespace lightseq {
+
+namespace {
+// the rows of gcq_kernels.cu are in shared memory
+const size_t kMaxInt8HiddenDim = 12288;
+// the fewest tokens of a chunk worth a gemm and an all-reduce of its own
+const size_t kMinOverlapTokens = 128;
+}  // namespace
+
+template <typename T1, typename T2>
+AllReduceOp<T1, T2>::AllReduceOp(size_t max_batch_tokens, size_t hidden_dim)
+    : Operator("AllReduceOp"),
+      _max_batch_tokens(max_batch_tokens),
+      _hidden_dim(hidden_dim) {
+  size_t tp_size = _context_ptr->tp_size();
+  if (tp_size > 1 && _context_ptr->tp_all_reduce_int8()) {
+    if (hidden_dim > kMaxInt8HiddenDim) {
+      printf("Error! int8 all-reduce of hidden dim %zu, at most %zu\n",
+             hidden_dim, kMaxInt8HiddenDim);
+      exit(-1);
+    }
+    size_t max_rows = (max_batch_tokens + tp_size - 1) / tp_size * tp_size;
+    _quant.reset(new Tensor("quant", g_dtype<int8_t>(), max_rows * hidden_dim));
+    _scales.reset(new Tensor("scales", g_dtype<float>(), max_rows));
+    _quant_shards.reset(
+        new Tensor("quant_shards", g_dtype<int8_t>(), max_rows * hidden_dim));
+    _shard_scales.reset(new Tensor("shard_scales", g_dtype<float>(), max_rows));
+    _quant_reduced.reset(new Tensor("quant_reduced", g_dtype<int8_t>(),
+                                    max_rows / tp_size * hidden_dim));
+    _reduced_scales.reset(
+        new Tensor("reduced_scales", g_dtype<float>(), max_rows / tp_size));
+  }
+}
+
+template <typename T1, typename T2>
+AllReduceOp<T1, T2>::~AllReduceOp() {
+#ifdef LIGHTSEQ_cuda
+  for (cudaEvent_t event : _gemm_done) cudaEventDestroy(event);
+  if (_comm_done) cudaEventDestroy(_comm_done);
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* AllReduceOp<T1, T2>::operator()(Variable* inp) {
+  _result = new Variable("AllReduceOp_out", _max_batch_tokens * _hidden_dim,
+                         g_dtype<T1>(), g_dtype<T2>());
+  set_parents({inp});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void AllReduceOp<T1, T2>::overlap_linear(LinearOp<T1, T2>* linear) {
+#if defined(LIGHTSEQ_cuda) && defined(LIGHTSEQ_nccl)
+  int num_chunks = _context_ptr->tp_overlap_chunks();
+  if (_context_ptr->tp_size() <= 1 || num_chunks <= 1 ||
+      !linear->row_chunkable()) {
+    return;
+  }
+  _linear = linear;
+  _num_chunks = num_chunks;
+  _gemm_done.resize(num_chunks);
+  for (cudaEvent_t& event : _gemm_done) {
+    CHECK_GPU_ERROR(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+  }
+  CHECK_GPU_ERROR(
+      cudaEventCreateWithFlags(&_comm_done, cudaEventDisableTiming));
+#endif
+}
+
+template <typename T1, typename T2>
+void AllReduceOp<T1, T2>::before_forward(size_t batch_tokens,
+                                         size_t hidden_dim) {
+  _batch_tokens = batch_tokens;
+  _ele_num = batch_tokens * hidden_dim;
+  _result->set_shape({batch_tokens, hidden_dim});
+  if (_linear) {
+    _linear->set_deferred(batch_tokens >= _num_chunks * kMinOverlapTokens);
+  }
+}
+
+template <typename T1, typename T2>
+void AllReduceOp<T1, T2>::forward() {
+  T1* inp_ptr = (T1*)parent(0)->value();
+  T1* out_ptr = (T1*)child(0)->value();
+  if (_quant) {
+    // whatever the path of the batch, the plan keeps them
+    _quant->tensor();
+    _scales->tensor();
+    _quant_shards->tensor();
+    _shard_scales->tensor();
+    _quant_reduced->tensor();
+    _reduced_scales->tensor();
+  }
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  if (_linear && _batch_tokens >= _num_chunks * kMinOverlapTokens) {
+    overlap_forward();
+    return;
+  }
+  all_reduce(inp_ptr, out_ptr, _batch_tokens, _context_ptr->get_stream());
+#endif
+}
+
+#ifdef LIGHTSEQ_cuda
+template <typename T1, typename T2>
+void AllReduceOp<T1, T2>::all_reduce(const T1* inp_ptr, T1* out_ptr,
+                                     size_t tokens, cudaStream_t stream) {
+  size_t ele_num = tokens * _hidden_dim;
+#ifdef LIGHTSEQ_nccl
+  if (_context_ptr->tp_size() > 1) {
+    size_t bytes = ele_num * sizeof(T1);
+    if (bytes <= _context_ptr->one_shot_bytes() && bytes % 16 == 0) {
+      cuda::launch_one_shot_all_reduce(
+          out_ptr, inp_ptr, _context_ptr->one_shot_peers(),
+          _context_ptr->one_shot_epochs(), _context_ptr->tp_rank(),
+          _context_ptr->tp_size(), _context_ptr->one_shot_bytes(), ele_num,
+          stream);
+      return;
+    }
+    if (_quant) {
+      int8_all_reduce(inp_ptr, out_ptr, tokens, stream);
+      return;
+    }
+    ncclDataType_t dtype =
+        std::is_same<T1, __half>::value
+            ? ncclFloat16
+            : (std::is_same<T1, __nv_bfloat16>::value ? ncclBfloat16
+                                                      : ncclFloat32);
+    CHECK_GPU_ERROR(ncclAllReduce(inp_ptr, out_ptr, ele_num, dtype, ncclSum,
+                                  _context_ptr->nccl_comm(), stream));
+    return;
+  }
+#endif
+  CHECK_GPU_ERROR(cudaMemcpyAsync(out_ptr, inp_ptr, ele_num * sizeof(T1),
+                                  cudaMemcpyDefault, stream));
+}
+
+template <typename T1, typename T2>
+void AllReduceOp<T1, T2>::int8_all_reduce(const T1* inp_ptr, T1* out_ptr,
+                                          size_t tokens, cudaStream_t stream) {
+#ifdef LIGHTSEQ_nccl
+  ncclComm_t comm = _context_ptr->nccl_comm();
+  int tp_size = _context_ptr->tp_size();
+  int ele_num = tokens * _hidden_dim;
+  int rows = (tokens + tp_size - 1) / tp_size * tp_size;
+  int shard_rows = rows / tp_size;
+  size_t shard_ele = size_t(shard_rows) * _hidden_dim;
+  int8_t* quant = (int8_t*)_quant->tensor();
+  float* scales = (float*)_scales->tensor();
+  int8_t* quant_shards = (int8_t*)_quant_shards->tensor();
+  float* shard_scales = (float*)_shard_scales->tensor();
+  int8_t* quant_reduced = (int8_t*)_quant_reduced->tensor();
+  float* reduced_scales = (float*)_reduced_scales->tensor();
+
+  // the scale of a token is its absmax, the topk 1 of gcq
+  cuda::launch_gcq_quantize(quant, scales, inp_ptr, (float*)nullptr, ele_num,
+                            rows, _hidden_dim, 1, stream);
+  CHECK_GPU_ERROR(ncclGroupStart());
+  for (int r = 0; r < tp_size; r++) {
+    CHECK_GPU_ERROR(ncclSend(quant + r * shard_ele, shard_ele, ncclInt8, r,
+                             comm, stream));
+    CHECK_GPU_ERROR(ncclSend(scales + r * shard_rows, shard_rows,
+                             ncclFloat32, r, comm, stream));
+    CHECK_GPU_ERROR(ncclRecv(quant_shards + r * shard_ele, shard_ele,
+                             ncclInt8, r, comm, stream));
+    CHECK_GPU_ERROR(ncclRecv(shard_scales + r * shard_rows, shard_rows,
+                             ncclFloat32, r, comm, stream));
+  }
+  CHECK_GPU_ERROR(ncclGroupEnd());
+  cuda::launch_gcq_reduce_quantize(quant_reduced, reduced_scales,
+                                   quant_shards, shard_scales, tp_size,
+                                   shard_rows, _hidden_dim, 1, stream, false);
+  CHECK_GPU_ERROR(ncclGroupStart());
+  CHECK_GPU_ERROR(ncclAllGather(quant_reduced, quant, shard_ele, ncclInt8,
+                                comm, stream));
+  CHECK_GPU_ERROR(ncclAllGather(reduced_scales, scales, shard_rows,
+                                ncclFloat32, comm, stream));
+  CHECK_GPU_ERROR(ncclGroupEnd());
+  cuda::launch_gcq_dequantize(out_ptr, quant, scales, ele_num, _hidden_dim,
+                              stream);
+#endif
+}
+
+template <typename T1, typename T2>
+void AllReduceOp<T1, T2>::overlap_forward() {
+  const T1* inp_ptr = (const T1*)parent(0)->value();
+  T1* out_ptr = (T1*)child(0)->value();
+  cudaStream_t stream = _context_ptr->get_stream();
+  cudaStream_t comm_stream = _context_ptr->comm_stream();
+  size_t chunk_tokens = (_batch_tokens + _num_chunks - 1) / _num_chunks;
+  for (int c = 0; c < _num_chunks; c++) {
+    size_t begin = c * chunk_tokens;
+    size_t end = std::min(begin + chunk_tokens, _batch_tokens);
+    if (begin >= end) break;
+    _linear->forward_rows(begin, end);
+    // the first chunk also orders the communication after the readers of
+    // the output before this op.
+    CHECK_GPU_ERROR(cudaEventRecord(_gemm_done[c], stream));
+    CHECK_GPU_ERROR(cudaStreamWaitEvent(comm_stream, _gemm_done[c], 0));
+    all_reduce(inp_ptr + begin * _hidden_dim, out_ptr + begin * _hidden_dim,
+               end - begin, comm_stream);
+  }
+  CHECK_GPU_ERROR(cudaEventRecord(_comm_done, comm_stream));
+  CHECK_GPU_ERROR(cudaStreamWaitEvent(stream, _comm_done, 0));
+}
+#endif
+
+template class AllReduceOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class AllReduceOp<__half, __half>;
+template class AllReduceOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
@@ -43,6 +43,12 @@ BeamSearchTopOp<T>::BeamSearchTopOp(size_t nshared_dec_layer,
       _host_length_norm[i] = host_length_norm_func(i + 1, length_penalty);
     }
   }
+#ifndef LIGHTSEQ_cuda
+  if (_diverse_lambda != 0) {
+    printf("Error! diverse beam search is only supported on cuda\n");
+    exit(-1);
+  }
+#endif
 }
 
 template <typename T>
@@ -74,6 +80,10 @@ std::tuple<Variable*, Variable*> BeamSearchTopOp<T>::operator()(
                            g_dtype<float>(), cuda::DataType::kNotSupported,
                            VariableType::RegressiveVariable);
 
+  if (_kv_rows) {
+    set_children({_alive_seq_out, _seq_score});
+    return std::make_tuple(_alive_seq_out, _seq_score);
+  }
   _caches_k_buf = new Variable("caches_k_buf",
                                _nshared_dec_layer * _max_batch_size *
                                    _max_step * _beam_size * _hidden_size,
@@ -121,24 +131,36 @@ void BeamSearchTopOp<T>::forward() {
       record the candidate's beam_id, vocab_id and probability
   */
 
-  cudaMemsetAsync(num_beam_can_ptr, 0, sizeof(int), stream);
+  if (_diverse_lambda == 0) {
+    // the exact top beam_size candidates of every batch item, already
+    // sorted, the tail of the candidate buffers is the workspace
+    cuda::beam_search_topk_launcher(
+        logits_ptr, logits_bias_ptr, seq_probs_ptr, seq_score_ptr,
+        alive_seq_ptr, can_score_ptr + _step_token_num,
+        can_idx_ptr + _step_token_num, can_idx_ptr, can_score_ptr,
+        num_beam_can_ptr, _trg_vocab_size, _max_step,
+        _host_length_norm[_cur_pos], _cur_pos, _batch_size, stream,
+        _beam_size, _end_id);
+  } else {
+    cudaMemsetAsync(num_beam_can_ptr, 0, sizeof(int), stream);
 
-  cuda::select_beam_rough_topk_launcher(
-      logits_ptr, logits_bias_ptr, seq_probs_ptr, seq_score_ptr, alive_seq_ptr,
-      can_idx_ptr, can_score_ptr, num_beam_can_ptr, _trg_vocab_size, _max_step,
-      _host_length_norm[_cur_pos], _cur_pos, _step_token_num,
-      _max_thread_per_block, stream, _beam_size, _diverse_lambda, _end_id);
+    cuda::select_beam_rough_topk_launcher(
+        logits_ptr, logits_bias_ptr, seq_probs_ptr, seq_score_ptr,
+        alive_seq_ptr, can_idx_ptr, can_score_ptr, num_beam_can_ptr,
+        _trg_vocab_size, _max_step, _host_length_norm[_cur_pos], _cur_pos,
+        _step_token_num, _max_thread_per_block, stream, _beam_size,
+        _diverse_lambda, _end_id);
 
-  thrust::exclusive_scan(thrust::cuda::par.on(stream), num_beam_can_ptr + 1,
-                         num_beam_can_ptr + 1 + _step_token_num,
-                         num_beam_can_ptr + 1);
+    thrust::exclusive_scan(thrust::cuda::par.on(stream), num_beam_can_ptr + 1,
+                           num_beam_can_ptr + 1 + _step_token_num,
+                           num_beam_can_ptr + 1);
 
-  /* ---step 2. sort the candidate with their probability--- */
-  CHECK_GPU_ERROR(cudaMemcpyAsync(&_host_can_num_batch, num_beam_can_ptr,
-                                  sizeof(int), cudaMemcpyDeviceToHost, stream));
-  CHECK_GPU_ERROR(cudaStreamSynchronize(stream));
+    /* ---step 2. sort the candidate with their probability--- */
+    CHECK_GPU_ERROR(cudaMemcpyAsync(&_host_can_num_batch, num_beam_can_ptr,
+                                    sizeof(int), cudaMemcpyDeviceToHost,
+                                    stream));
+    CHECK_GPU_ERROR(cudaStreamSynchronize(stream));
 
-  if (_diverse_lambda != 0) {
     if (_host_can_num_batch < _cub_sort_buffer_bytes / 160) {
       CHECK_GPU_ERROR(cub::DeviceRadixSort::SortPairsDescending(
           (void*)logits_ptr, _cub_sort_buffer_bytes, can_score_ptr,
@@ -153,11 +175,18 @@ void BeamSearchTopOp<T>::forward() {
         can_score_ptr, can_idx_ptr, num_beam_can_ptr, _step_token_num,
         _max_thread_per_block, stream, _beam_size, _diverse_lambda,
         _trg_vocab_size);
+
+    thrust::sort_by_key(thrust::cuda::par.on(stream), can_score_ptr,
+                        can_score_ptr + _host_can_num_batch, can_idx_ptr,
+                        thrust::greater<float>());
   }
 
-  thrust::sort_by_key(thrust::cuda::par.on(stream), can_score_ptr,
-                      can_score_ptr + _host_can_num_batch, can_idx_ptr,
-                      thrust::greater<float>());
+  if (_prune_abs_margin > 0 || _prune_rel_margin > 0) {
+    cuda::ker_prune_beams_launcher(
+        _batch_size, _beam_size, stream, can_idx_ptr, can_score_ptr,
+        num_beam_can_ptr + 1, _trg_vocab_size, _prune_abs_margin,
+        _prune_rel_margin, _end_id);
+  }
 
   /*
     step 3. refresh alive_seq, seq_probs, seq_score, num_finish_beam
@@ -188,6 +217,52 @@ void BeamSearchTopOp<T>::forward() {
     }
   }
 #endif
+#elif defined LIGHTSEQ_x86
+  if (_step == 0) {
+    std::copy(_host_alive_seq_probs.begin(),
+              _host_alive_seq_probs.begin() + _batch_size * _beam_size,
+              seq_probs_ptr);
+  }
+  // the exact top beam_size candidates of every batch item, then refresh
+  // alive_seq, seq_probs, seq_score and the number of finished beams.
+  x86::beam_search_topk(logits_ptr, logits_bias_ptr, seq_probs_ptr,
+                        seq_score_ptr, alive_seq_ptr, can_idx_ptr,
+                        can_score_ptr, num_beam_can_ptr, _trg_vocab_size,
+                        _max_step, _host_length_norm[_cur_pos], _cur_pos,
+                        _batch_size, _beam_size, _end_id);
+  if (_prune_abs_margin > 0 || _prune_rel_margin > 0) {
+    x86::prune_beams(can_idx_ptr, can_score_ptr, num_beam_can_ptr + 1,
+                     _trg_vocab_size, _batch_size, _beam_size,
+                     _prune_abs_margin, _prune_rel_margin, _end_id);
+  }
+  x86::refresh_result(can_idx_ptr, can_score_ptr, num_beam_can_ptr + 1,
+                      alive_seq_ptr, alive_seq_out, seq_probs_ptr,
+                      seq_score_ptr, &_host_can_num_batch, _trg_vocab_size,
+                      _cur_pos, _host_length_norm[_cur_pos], _batch_size,
+                      _beam_size, _max_step, _end_id);
+#elif defined LIGHTSEQ_arm
+  if (_step == 0) {
+    std::copy(_host_alive_seq_probs.begin(),
+              _host_alive_seq_probs.begin() + _batch_size * _beam_size,
+              seq_probs_ptr);
+  }
+  // the exact top beam_size candidates of every batch item, then refresh
+  // alive_seq, seq_probs, seq_score and the number of finished beams.
+  arm::beam_search_topk(logits_ptr, logits_bias_ptr, seq_probs_ptr,
+                        seq_score_ptr, alive_seq_ptr, can_idx_ptr,
+                        can_score_ptr, num_beam_can_ptr, _trg_vocab_size,
+                        _max_step, _host_length_norm[_cur_pos], _cur_pos,
+                        _batch_size, _beam_size, _end_id);
+  if (_prune_abs_margin > 0 || _prune_rel_margin > 0) {
+    arm::prune_beams(can_idx_ptr, can_score_ptr, num_beam_can_ptr + 1,
+                     _trg_vocab_size, _batch_size, _beam_size,
+                     _prune_abs_margin, _prune_rel_margin, _end_id);
+  }
+  arm::refresh_result(can_idx_ptr, can_score_ptr, num_beam_can_ptr + 1,
+                      alive_seq_ptr, alive_seq_out, seq_probs_ptr,
+                      seq_score_ptr, &_host_can_num_batch, _trg_vocab_size,
+                      _cur_pos, _host_length_norm[_cur_pos], _batch_size,
+                      _beam_size, _max_step, _end_id);
 #endif
 }
 
@@ -195,8 +270,11 @@ template <typename T>
 void BeamSearchTopOp<T>::refresh_cache(Variable* caches_k, Variable* caches_v) {
   /* ---step 4. refresh cache: k, v for decoder self attention--- */
 
+  if (_kv_rows) {
+    printf("Error! BeamSearchTopOp refresh_cache after use_kv_rows\n");
+    exit(-1);
+  }
   if (_step > 0) {
-    cudaStream_t stream = _context_ptr->get_stream();
     float* seq_probs_ptr = (float*)_seq_prob->value();
     int* can_idx_ptr = (int*)_can_idx->value();
     float* can_score_ptr = (float*)_can_score->value();
@@ -205,20 +283,69 @@ void BeamSearchTopOp<T>::refresh_cache(Variable* caches_k, Variable* caches_v) {
     T* caches_v_ptr = (T*)caches_v->value();
     T* caches_k_buf_ptr = (T*)_caches_k_buf->value();
     T* caches_v_buf_ptr = (T*)_caches_v_buf->value();
+#ifdef LIGHTSEQ_cuda
+    cudaStream_t stream = _context_ptr->get_stream();
     cuda::ker_refresh_cache_launcher<T>(
         _nshared_dec_layer * (_cur_pos + 1), _step_token_num * 2,
         _max_thread_per_block, stream, num_beam_can_ptr + 1, can_idx_ptr,
         (T*)caches_k_ptr, (T*)caches_v_ptr, (T*)caches_k_buf_ptr,
         (T*)caches_v_buf_ptr, _cache_size, _beam_size, _dim_per_head, _head_num,
         _trg_vocab_size, _cur_pos, _max_step, _diverse_lambda != 0, _end_id);
+#elif defined LIGHTSEQ_x86
+    x86::refresh_cache<T>(num_beam_can_ptr + 1, can_idx_ptr, caches_k_ptr,
+                          caches_v_ptr, caches_k_buf_ptr, caches_v_buf_ptr,
+                          _cache_size, _nshared_dec_layer, _batch_size,
+                          _beam_size, _dim_per_head, _head_num,
+                          _trg_vocab_size, _cur_pos, _max_step, _end_id);
+#elif defined LIGHTSEQ_arm
+    arm::refresh_cache<T>(num_beam_can_ptr + 1, can_idx_ptr, caches_k_ptr,
+                          caches_v_ptr, caches_k_buf_ptr, caches_v_buf_ptr,
+                          _cache_size, _nshared_dec_layer, _batch_size,
+                          _beam_size, _dim_per_head, _head_num,
+                          _trg_vocab_size, _cur_pos, _max_step, _end_id);
+#endif
     Variable::swap_tensor(caches_k, _caches_k_buf);
     Variable::swap_tensor(caches_v, _caches_v_buf);
   }
 }
 
+template <typename T>
+void BeamSearchTopOp<T>::set_beam_pruning(float abs_margin, float rel_margin) {
+  if (_diverse_lambda != 0 && (abs_margin > 0 || rel_margin > 0)) {
+    printf("diverse beam search does not support beam pruning\n");
+    return;
+  }
+  _prune_abs_margin = abs_margin;
+  _prune_rel_margin = rel_margin;
+}
+
+template <typename T>
+void BeamSearchTopOp<T>::init_kv_rows(int* kv_rows) {
+#ifdef LIGHTSEQ_cuda
+  cuda::ker_init_kv_rows_launcher(_max_batch_size * _beam_size,
+                                  _max_thread_per_block,
+                                  _context_ptr->get_stream(), kv_rows,
+                                  _max_step);
+#endif
+}
+
+template <typename T>
+void BeamSearchTopOp<T>::refresh_kv_rows(int* kv_rows) {
+  // the beams are only the copies of the prompt at the first step.
+  if (_step == 0) return;
+#ifdef LIGHTSEQ_cuda
+  cuda::ker_refresh_kv_rows_launcher(
+      _batch_size, _max_thread_per_block, _context_ptr->get_stream(),
+      (int*)_num_beam_can->value() + 1, (int*)_can_idx->value(), kv_rows,
+      _beam_size, _trg_vocab_size, _cur_pos, _max_step, _diverse_lambda != 0,
+      _end_id);
+#endif
+}
+
 template class BeamSearchTopOp<float>;
 #ifdef LIGHTSEQ_cuda
 template class BeamSearchTopOp<__half>;
+template class BeamSearchTopOp<__nv_bfloat16>;
 #endif
 
 }  // namespace lightseq
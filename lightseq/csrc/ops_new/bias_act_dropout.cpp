@@ -2,6 +2,13 @@
 
 namespace lightseq {
 
+template <typename T1, typename T2>
+BiasActDropoutOp<T1, T2>::~BiasActDropoutOp() {
+#ifdef LIGHTSEQ_cuda
+  cudaFree(_rng_offset);
+#endif
+}
+
 template <typename T1, typename T2>
 Variable* BiasActDropoutOp<T1, T2>::operator()(Variable* inp, Variable* bias) {
   _result = new Variable("BiasActDropoutOp_output", _mx_rows * _mx_cols,
@@ -17,7 +24,7 @@ void BiasActDropoutOp<T1, T2>::forward() {
   T1* bias = parent(1)->value<T1>();
   T1* output = child(0)->value<T1>();
 
-  uint8_t* mask_ptr = _mask->tensor<uint8_t>();
+  uint8_t* mask_ptr = _mask ? _mask->tensor<uint8_t>() : nullptr;
 
   if (!_context_ptr->is_built()) {
     return;
@@ -25,12 +32,49 @@ void BiasActDropoutOp<T1, T2>::forward() {
 
 #ifdef LIGHTSEQ_cuda
   cudaStream_t stream = _context_ptr->get_stream();
+  if (!_context_ptr->in_recompute()) {
+    if (_rng_offset) {
+      cuda::launch_ls_dropout_step(_rng_offset, stream);
+    } else {
+      _seed = cuda::ls_dropout_seed();
+    }
+  }
   if (_activation_fn == "relu") {
     cuda::launch_ls_dropout_act_bias<ActivationType::kRelu, T1>(
-        output, input, mask_ptr, bias, _rows * _cols, _cols, RATIO(), stream);
+        output, input, mask_ptr, bias, _rows * _cols, _cols, RATIO(), stream,
+        _seed, _rng_offset);
   } else if (_activation_fn == "gelu") {
     cuda::launch_ls_dropout_act_bias<ActivationType::kGelu, T1>(
-        output, input, mask_ptr, bias, _rows * _cols, _cols, RATIO(), stream);
+        output, input, mask_ptr, bias, _rows * _cols, _cols, RATIO(), stream,
+        _seed, _rng_offset);
+  } else {
+    throw std::runtime_error("not supported activation: " + _activation_fn);
+  }
+#elif defined LIGHTSEQ_x86
+  if (RATIO() > 0.f) {
+    printf("Error! x86 BiasActDropoutOp only supports inference\n");
+    exit(-1);
+  }
+  if (_activation_fn == "relu") {
+    x86::launch_bias_act<ActivationType::kRelu, T1>(output, input, bias,
+                                                     _rows * _cols, _cols);
+  } else if (_activation_fn == "gelu") {
+    x86::launch_bias_act<ActivationType::kGelu, T1>(output, input, bias,
+                                                     _rows * _cols, _cols);
+  } else {
+    throw std::runtime_error("not supported activation: " + _activation_fn);
+  }
+#elif defined LIGHTSEQ_arm
+  if (RATIO() > 0.f) {
+    printf("Error! arm BiasActDropoutOp only supports inference\n");
+    exit(-1);
+  }
+  if (_activation_fn == "relu") {
+    arm::launch_bias_act<ActivationType::kRelu, T1>(output, input, bias,
+                                                     _rows * _cols, _cols);
+  } else if (_activation_fn == "gelu") {
+    arm::launch_bias_act<ActivationType::kGelu, T1>(output, input, bias,
+                                                     _rows * _cols, _cols);
   } else {
     throw std::runtime_error("not supported activation: " + _activation_fn);
   }
@@ -46,7 +90,7 @@ void BiasActDropoutOp<T1, T2>::backward() {
   T2* grad_bias = parent(1)->grad<T2>();
   T2* grad_out = child(0)->grad<T2>();
 
-  uint8_t* mask_ptr = _mask->tensor<uint8_t>();
+  uint8_t* mask_ptr = _mask ? _mask->tensor<uint8_t>() : nullptr;
 
   if (!_context_ptr->is_built()) {
     return;
@@ -57,11 +101,11 @@ void BiasActDropoutOp<T1, T2>::backward() {
   if (_activation_fn == "relu") {
     cuda::launch_ls_dropout_act_bias_bwd<ActivationType::kRelu, T1>(
         grad_inp, grad_bias, input, bias, grad_out, mask_ptr, _rows, _cols,
-        RATIO(), stream);
+        RATIO(), stream, _seed, _rng_offset);
   } else if (_activation_fn == "gelu") {
     cuda::launch_ls_dropout_act_bias_bwd<ActivationType::kGelu, T1>(
         grad_inp, grad_bias, input, bias, grad_out, mask_ptr, _rows, _cols,
-        RATIO(), stream);
+        RATIO(), stream, _seed, _rng_offset);
   } else {
     throw std::runtime_error("not supported activation: " + _activation_fn);
   }
@@ -29,6 +29,14 @@ void BiasAddTrans20314<T1, T2>::forward() {
   cuda::launch_bias_add_transform_20314<T1>(res_ptr, inp_ptr, bias_ptr, _batch,
                                             _seq_len, _trans_count, _heads,
                                             _hidden_size / _heads, _stream);
+#elif defined LIGHTSEQ_x86
+  x86::launch_bias_add_transform_20314<T1>(res_ptr, inp_ptr, bias_ptr, _batch,
+                                           _seq_len, _trans_count, _heads,
+                                           _hidden_size / _heads);
+#elif defined LIGHTSEQ_arm
+  arm::launch_bias_add_transform_20314<T1>(res_ptr, inp_ptr, bias_ptr, _batch,
+                                           _seq_len, _trans_count, _heads,
+                                           _hidden_size / _heads);
 #endif
 }
 
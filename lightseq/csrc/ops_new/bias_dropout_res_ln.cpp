@@ -0,0 +1,150 @@
+#include "bias_dropout_res_ln.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+BiasDropoutResLnOp<T1, T2>::BiasDropoutResLnOp(float r, size_t max_rows,
+                                               size_t hidden_dim)
+    : Operator("BiasDropoutResLnOp"),
+      ratio(r),
+      _max_rows(max_rows),
+      _hidden_dim(hidden_dim) {
+  if (!_context_ptr->mask_free_dropout()) {
+    _mask.reset(
+        new Tensor("mask", g_dtype<uint8_t>(), _max_rows * _hidden_dim));
+  }
+  _vars.reset(new Tensor("vars", g_dtype<T1>(), max_rows));
+  _means.reset(new Tensor("means", g_dtype<T1>(), max_rows));
+#ifdef LIGHTSEQ_cuda
+  _bw_workspace.reset(
+      new Tensor("bw_workspace", g_dtype<float>(),
+                 cuda::ln_dropout_bw_workspace_size(hidden_dim)));
+  if (_context_ptr->capturable()) {
+    _seed = cuda::ls_dropout_seed();
+    _rng_offset = cuda::ls_dropout_new_rng_offset();
+  }
+#endif
+}
+
+template <typename T1, typename T2>
+BiasDropoutResLnOp<T1, T2>::~BiasDropoutResLnOp() {
+#ifdef LIGHTSEQ_cuda
+  cudaFree(_rng_offset);
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* BiasDropoutResLnOp<T1, T2>::operator()(Variable* inp, Variable* bias,
+                                                 Variable* residual,
+                                                 Variable* gamma,
+                                                 Variable* betta) {
+  _ln_out = new Variable("BiasDropoutResLnOp_out", _max_rows * _hidden_dim,
+                         g_dtype<T1>(), g_dtype<T2>());
+  _res_out = new Variable("BiasDropoutResLnOp_res", _max_rows * _hidden_dim,
+                          g_dtype<T1>(), g_dtype<T2>());
+  set_parents({inp, bias, residual, gamma, betta});
+  this->set_children({_ln_out, _res_out});
+  return _ln_out;
+}
+
+template <typename T1, typename T2>
+void BiasDropoutResLnOp<T1, T2>::before_forward(size_t batch_size,
+                                                size_t seq_len) {
+  _rows = batch_size * seq_len;
+  _ln_out->set_shape({batch_size, seq_len, _hidden_dim});
+  _res_out->set_shape({batch_size, seq_len, _hidden_dim});
+}
+
+template <typename T1, typename T2>
+void BiasDropoutResLnOp<T1, T2>::forward() {
+  T1* input = (T1*)parent(0)->value();
+  T1* bias = (T1*)parent(1)->value();
+  T1* residual = (T1*)parent(2)->value();
+  T1* gamma = (T1*)parent(3)->value();
+  T1* betta = (T1*)parent(4)->value();
+  T1* ln_out = (T1*)child(0)->value();
+  T1* res_out = (T1*)child(1)->value();
+  T1* vars = (T1*)_vars->tensor();
+  T1* means = (T1*)_means->tensor();
+  uint8_t* mask_ptr = _mask ? _mask->tensor<uint8_t>() : nullptr;
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  if (!_context_ptr->in_recompute()) {
+    if (_rng_offset) {
+      cuda::launch_ls_dropout_step(_rng_offset, stream);
+    } else {
+      _seed = cuda::ls_dropout_seed();
+    }
+  }
+  cuda::launch_ls_dropout_res_bias_ln<T1>(
+      ln_out, res_out, vars, means, mask_ptr, input, bias, residual, gamma,
+      betta, _rows, _hidden_dim, RATIO(), stream, _seed, _rng_offset);
+#elif defined LIGHTSEQ_x86
+  if (RATIO() > 0.f) {
+    printf("Error! x86 BiasDropoutResLnOp only supports inference\n");
+    exit(-1);
+  }
+  x86::launch_bias_res<T1>(res_out, input, bias, residual,
+                           _rows * _hidden_dim, _hidden_dim);
+  x86::launch_layer_norm(ln_out, vars, means, res_out, gamma, betta, _rows,
+                         _hidden_dim);
+#elif defined LIGHTSEQ_arm
+  if (RATIO() > 0.f) {
+    printf("Error! arm BiasDropoutResLnOp only supports inference\n");
+    exit(-1);
+  }
+  arm::launch_bias_res<T1>(res_out, input, bias, residual,
+                           _rows * _hidden_dim, _hidden_dim);
+  arm::launch_layer_norm(ln_out, vars, means, res_out, gamma, betta, _rows,
+                         _hidden_dim);
+#endif
+}
+
+template <typename T1, typename T2>
+void BiasDropoutResLnOp<T1, T2>::backward() {
+  T2* input_grad = (T2*)parent(0)->grad();
+  T2* bias_grad = (T2*)parent(1)->grad();
+  T2* residual_grad = (T2*)parent(2)->grad();
+  T2* gamma_grad = (T2*)parent(3)->grad();
+  T2* betta_grad = (T2*)parent(4)->grad();
+  T2* ln_out_grad = (T2*)child(0)->grad();
+  // the residual sum only has a grad when it is used past the layer norm.
+  T2* res_out_grad = nullptr;
+  if (!child(1)->children().empty() ||
+      _context_ptr->is_layer_output(child(1))) {
+    res_out_grad = (T2*)child(1)->grad();
+  }
+
+  T1* res_out = (T1*)child(1)->value();
+  T1* gamma = (T1*)parent(3)->value();
+  T1* vars = (T1*)_vars->tensor();
+  T1* means = (T1*)_means->tensor();
+  uint8_t* mask_ptr = _mask ? _mask->tensor<uint8_t>() : nullptr;
+  float* workspace = _bw_workspace ? (float*)_bw_workspace->tensor() : nullptr;
+
+  bool is_res_cover = parent(2)->is_cover();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  cuda::launch_ls_dropout_res_bias_ln_bw<T2>(
+      input_grad, bias_grad, residual_grad, gamma_grad, betta_grad,
+      ln_out_grad, res_out_grad, res_out, gamma, vars, means, mask_ptr,
+      is_res_cover, workspace, _rows, _hidden_dim, RATIO(), stream, _seed,
+      _rng_offset);
+#endif
+}
+
+template class BiasDropoutResLnOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class BiasDropoutResLnOp<__half, __half>;
+#endif
+}  // namespace lightseq
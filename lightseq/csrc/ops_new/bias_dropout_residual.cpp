@@ -1,7 +1,16 @@
 #include "bias_dropout_residual.h"
+#include "fusion.h"
+#include "layer_normalize.h"
 
 namespace lightseq {
 
+template <typename T1, typename T2>
+BiasDropoutResOp<T1, T2>::~BiasDropoutResOp() {
+#ifdef LIGHTSEQ_cuda
+  cudaFree(_rng_offset);
+#endif
+}
+
 template <typename T1, typename T2>
 Variable* BiasDropoutResOp<T1, T2>::operator()(Variable* inp, Variable* bias,
                                                Variable* residual) {
@@ -12,13 +21,40 @@ Variable* BiasDropoutResOp<T1, T2>::operator()(Variable* inp, Variable* bias,
   return _result;
 }
 
+template <typename T1, typename T2>
+bool BiasDropoutResOp<T1, T2>::fuse_layer_norm() {
+  if (_ln_fused || RATIO() > 0) return false;
+  Variable* result = child(0);
+  LayerNormalizeOp<T1, T2>* ln = nullptr;
+  for (Node* iter : result->children()) {
+    ln = dynamic_cast<LayerNormalizeOp<T1, T2>*>(iter);
+    if (ln && ln->parent(0) == result) break;
+    ln = nullptr;
+  }
+  if (ln == nullptr) return false;
+
+  Variable* gamma = ln->parent(1);
+  Variable* betta = ln->parent(2);
+  Variable* ln_out = ln->child(0);
+  add_parent(gamma);
+  add_parent(betta);
+  gamma->replace_child(ln, this);
+  betta->replace_child(ln, this);
+  result->remove_child(ln);
+  add_child(ln_out);
+  ln_out->replace_parent(ln, this);
+  ln->detach();
+  _ln_fused = true;
+  return true;
+}
+
 template <typename T1, typename T2>
 void BiasDropoutResOp<T1, T2>::forward() {
   T1* input = (T1*)parent(0)->value();
   T1* bias = (T1*)parent(1)->value();
   T1* residual = (T1*)parent(2)->value();
   T1* output = (T1*)child(0)->value();
-  uint8_t* mask_ptr = (uint8_t*)_mask->tensor();
+  uint8_t* mask_ptr = _mask ? _mask->tensor<uint8_t>() : nullptr;
 
   if (!_context_ptr->is_built()) {
     return;
@@ -26,8 +62,37 @@ void BiasDropoutResOp<T1, T2>::forward() {
 
 #ifdef LIGHTSEQ_cuda
   cudaStream_t stream = _context_ptr->get_stream();
+  if (!_context_ptr->in_recompute()) {
+    if (_rng_offset) {
+      cuda::launch_ls_dropout_step(_rng_offset, stream);
+    } else {
+      _seed = cuda::ls_dropout_seed();
+    }
+  }
+  if (_ln_fused) {
+    cuda::launch_ls_dropout_res_bias_ln<T1>(
+        (T1*)child(1)->value(), output, nullptr, nullptr, mask_ptr, input,
+        bias, residual, (T1*)parent(3)->value(), (T1*)parent(4)->value(),
+        _rows, _cols, RATIO(), stream, _seed, _rng_offset);
+    return;
+  }
   cuda::launch_ls_dropout_res_bias<T1>(output, input, mask_ptr, bias, residual,
-                                       _rows * _cols, _cols, RATIO(), stream);
+                                       _rows * _cols, _cols, RATIO(), stream,
+                                       _seed, _rng_offset);
+#elif defined LIGHTSEQ_x86
+  if (RATIO() > 0.f) {
+    printf("Error! x86 BiasDropoutResOp only supports inference\n");
+    exit(-1);
+  }
+  x86::launch_bias_res<T1>(output, input, bias, residual, _rows * _cols,
+                           _cols);
+#elif defined LIGHTSEQ_arm
+  if (RATIO() > 0.f) {
+    printf("Error! arm BiasDropoutResOp only supports inference\n");
+    exit(-1);
+  }
+  arm::launch_bias_res<T1>(output, input, bias, residual, _rows * _cols,
+                           _cols);
 #endif
 }
 
@@ -39,7 +104,7 @@ void BiasDropoutResOp<T1, T2>::backward() {
 
   T2* output_grad = (T2*)child(0)->grad();
 
-  uint8_t* mask_ptr = (uint8_t*)_mask->tensor();
+  uint8_t* mask_ptr = _mask ? _mask->tensor<uint8_t>() : nullptr;
 
   bool is_res_cover = parent(2)->is_cover();
 
@@ -50,7 +115,8 @@ void BiasDropoutResOp<T1, T2>::backward() {
 #ifdef LIGHTSEQ_cuda
   cudaStream_t stream = _context_ptr->get_stream();
   cuda::launch_ls_dropout_bias_bwd<T2>(input_grad, bias_grad, output_grad,
-                                       mask_ptr, _rows, _cols, RATIO(), stream);
+                                       mask_ptr, _rows, _cols, RATIO(), stream,
+                                       _seed, _rng_offset);
 
   if (is_res_cover) {  // cover
     CHECK_GPU_ERROR(cudaMemcpyAsync((void*)residual_grad, (void*)output_grad,
@@ -67,4 +133,23 @@ template class BiasDropoutResOp<float, float>;
 #ifdef LIGHTSEQ_cuda
 template class BiasDropoutResOp<__half, __half>;
 #endif
+
+#ifdef LIGHTSEQ_cuda
+namespace {
+
+template <typename T1, typename T2>
+bool fuse_bias_dropout_res_ln(Operator* op) {
+  BiasDropoutResOp<T1, T2>* dropout =
+      dynamic_cast<BiasDropoutResOp<T1, T2>*>(op);
+  return dropout && dropout->fuse_layer_norm();
+}
+
+const char* kBiasDropoutResLn = "BiasDropoutResOp+LayerNormalizeOp";
+GraphFusion::Registrar bias_dropout_res_ln_fp32(
+    kBiasDropoutResLn, fuse_bias_dropout_res_ln<float, float>);
+GraphFusion::Registrar bias_dropout_res_ln_fp16(
+    kBiasDropoutResLn, fuse_bias_dropout_res_ln<__half, __half>);
+
+}  // namespace
+#endif
 }  // namespace lightseq
@@ -0,0 +1,119 @@
+#include "block_sparse_attention.h"
+
+#include <algorithm>
+#include <random>
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+BlockSparseAttentionOp<T1, T2>::BlockSparseAttentionOp(
+    size_t max_batch_tokens, size_t max_seq_len, size_t num_heads,
+    size_t head_dim, const BlockSparseConfig& config)
+    : Operator("BlockSparseAttentionOp"),
+      _max_batch_tokens(max_batch_tokens),
+      _num_heads(num_heads),
+      _head_dim(head_dim),
+      _config(config) {
+  if (config.block_size <= 0 || config.window_blocks < 0 ||
+      config.global_blocks < 0 || config.random_blocks < 0) {
+    printf("Error! BlockSparseAttentionOp got an invalid block layout\n");
+    exit(-1);
+  }
+#ifdef LIGHTSEQ_cuda
+  // every query block attends to at most every key block.
+  size_t max_blocks = (max_seq_len + config.block_size - 1) / config.block_size;
+  _d_layout_offsets = (int*)_context_ptr->allocator()->malloc_mem(
+      (max_blocks + 1) * sizeof(int));
+  _d_layout_blocks = (int*)_context_ptr->allocator()->malloc_mem(
+      max_blocks * max_blocks * sizeof(int));
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* BlockSparseAttentionOp<T1, T2>::operator()(Variable* qkv,
+                                                     Variable* qkv_bias,
+                                                     Variable* mask) {
+  _result = new Variable("BlockSparseAttentionOp_out",
+                         _max_batch_tokens * _num_heads * _head_dim,
+                         g_dtype<T1>(), g_dtype<T2>());
+  set_parents({qkv, qkv_bias, mask});
+  this->set_children({_result});
+  return _result;
+}
+
+/**
+The key blocks of every query block, sorted. The random blocks are the same
+for every layer and batch of a sequence length.
+*/
+template <typename T1, typename T2>
+void BlockSparseAttentionOp<T1, T2>::build_layout(size_t seq_len) {
+  int num_blocks = (seq_len + _config.block_size - 1) / _config.block_size;
+  int global_blocks = std::min(_config.global_blocks, num_blocks);
+  _layout_offsets.assign(1, 0);
+  _layout_blocks.clear();
+  std::mt19937 rng(seq_len);
+  std::vector<bool> attend(num_blocks);
+  for (int q_block = 0; q_block < num_blocks; q_block++) {
+    if (q_block < global_blocks) {
+      attend.assign(num_blocks, true);
+    } else {
+      attend.assign(num_blocks, false);
+      for (int i = 0; i < global_blocks; i++) attend[i] = true;
+      for (int i = std::max(q_block - _config.window_blocks, 0);
+           i <= std::min(q_block + _config.window_blocks, num_blocks - 1);
+           i++) {
+        attend[i] = true;
+      }
+      std::vector<int> others;
+      for (int i = 0; i < num_blocks; i++) {
+        if (!attend[i]) others.push_back(i);
+      }
+      std::shuffle(others.begin(), others.end(), rng);
+      for (int i = 0; i < std::min<int>(_config.random_blocks, others.size());
+           i++) {
+        attend[others[i]] = true;
+      }
+    }
+    for (int i = 0; i < num_blocks; i++) {
+      if (attend[i]) _layout_blocks.push_back(i);
+    }
+    _layout_offsets.push_back(_layout_blocks.size());
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  CHECK_GPU_ERROR(cudaMemcpyAsync(
+      _d_layout_offsets, _layout_offsets.data(),
+      _layout_offsets.size() * sizeof(int), cudaMemcpyHostToDevice, stream));
+  CHECK_GPU_ERROR(cudaMemcpyAsync(
+      _d_layout_blocks, _layout_blocks.data(),
+      _layout_blocks.size() * sizeof(int), cudaMemcpyHostToDevice, stream));
+#endif
+  _layout_seq_len = seq_len;
+}
+
+template <typename T1, typename T2>
+void BlockSparseAttentionOp<T1, T2>::forward() {
+  T1* qkv_ptr = (T1*)parent(0)->value();
+  T1* bias_ptr = (T1*)parent(1)->value();
+  T1* mask_ptr = (T1*)parent(2)->value();
+  T1* out_ptr = (T1*)child(0)->value();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cuda::launch_block_sparse_attention(
+      qkv_ptr, bias_ptr, mask_ptr, out_ptr, _d_layout_offsets,
+      _d_layout_blocks, _batch_size, _num_heads, _seq_len, _head_dim,
+      _config.block_size, _context_ptr->get_stream());
+#endif
+}
+
+template class BlockSparseAttentionOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class BlockSparseAttentionOp<__half, __half>;
+template class BlockSparseAttentionOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
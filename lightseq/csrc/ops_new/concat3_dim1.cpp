@@ -43,6 +43,32 @@ void Concat3Dim1<T1, T2>::forward() {
     cuda::launch_concat3_dim1(cache_ptr, inp_ptr, real_val, _sz0, _mx_sz2,
                               _sz1_0, _sz1_1, _stream);
   }
+#elif defined LIGHTSEQ_x86
+  if (_is_skip) {
+    std::copy(inp_ptr, inp_ptr + _sz0 * _sz1_1 * _mx_sz2, real_val);
+    return;
+  }
+
+  if (!_is_continuous_cache) {
+    x86::launch_filling_concat3_dim1(cache_ptr, inp_ptr, _sz0, _mx_sz1,
+                                     _mx_sz2, _sz1_0, _sz1_1);
+  } else {
+    x86::launch_concat3_dim1(cache_ptr, inp_ptr, real_val, _sz0, _mx_sz2,
+                             _sz1_0, _sz1_1);
+  }
+#elif defined LIGHTSEQ_arm
+  if (_is_skip) {
+    std::copy(inp_ptr, inp_ptr + _sz0 * _sz1_1 * _mx_sz2, real_val);
+    return;
+  }
+
+  if (!_is_continuous_cache) {
+    arm::launch_filling_concat3_dim1(cache_ptr, inp_ptr, _sz0, _mx_sz1,
+                                     _mx_sz2, _sz1_0, _sz1_1);
+  } else {
+    arm::launch_concat3_dim1(cache_ptr, inp_ptr, real_val, _sz0, _mx_sz2,
+                             _sz1_0, _sz1_1);
+  }
 #endif
 }
 
@@ -8,6 +8,16 @@ CRFOP<T>::CRFOP(size_t max_batch_tokens, size_t max_batch_size, size_t num_tags)
       _max_batch_tokens(max_batch_tokens),
       _max_batch_size(max_batch_size),
       _num_tags(num_tags) {
+  if (_context_ptr->is_training()) {
+    _alpha.reset(new Tensor("alpha", g_dtype<float>(),
+                            _max_batch_tokens * _num_tags));
+    _log_z.reset(new Tensor("log_z", g_dtype<float>(), _max_batch_size));
+#ifdef LIGHTSEQ_cuda
+    _bw_workspace.reset(new Tensor("bw_workspace", g_dtype<float>(),
+                                   cuda::crf_nll_bw_workspace_size(num_tags)));
+#endif
+    return;
+  }
   _history.reset(
       new Tensor("history", g_dtype<int>(), _max_batch_tokens * _num_tags));
 }
@@ -17,9 +27,15 @@ Variable* CRFOP<T>::operator()(Variable* start_transition,
                                Variable* end_transition, Variable* transition,
                                Variable* emission, Variable* mask,
                                Variable* bias) {
-  _best_tags = new Variable("best_tags", _max_batch_tokens, g_dtype<int>());
   set_parents(
       {start_transition, end_transition, transition, emission, mask, bias});
+  if (_context_ptr->is_training()) {
+    _nll = new Variable("nll", _max_batch_size, g_dtype<float>(),
+                        g_dtype<float>());
+    this->set_children({_nll});
+    return _nll;
+  }
+  _best_tags = new Variable("best_tags", _max_batch_tokens, g_dtype<int>());
   if (!_output_decode_score) {
     this->set_children({_best_tags});
     return _best_tags;
@@ -39,18 +55,27 @@ void CRFOP<T>::before_forward(size_t batch_size, size_t seq_len,
   if (batch_size * seq_len > _max_batch_tokens) {
     throw std::runtime_error("batch_size * seq_len > _max_batch_tokens");
   }
-  if (forward_or_decode) {
-    throw std::runtime_error("CRF not support forward currently!");
+  if (forward_or_decode != _context_ptr->is_training()) {
+    throw std::runtime_error(
+        "CRF computes the loss in training and decodes in inference");
   }
   _batch_size = batch_size;
   _seq_len = seq_len;
   _forward_or_decode = forward_or_decode;
   _output_decode_score = output_decode_score;
-  _best_tags->set_shape({batch_size * seq_len});
+  if (forward_or_decode) {
+    _nll->set_shape({batch_size});
+  } else {
+    _best_tags->set_shape({batch_size * seq_len});
+  }
 }
 
 template <typename T>
 void CRFOP<T>::forward() {
+  if (_forward_or_decode) {
+    forward_nll();
+    return;
+  }
   const T* start_transition = (const T*)parent(0)->value();
   const T* end_transition = (const T*)parent(1)->value();
   const T* transition = (const T*)parent(2)->value();
@@ -68,20 +93,81 @@ void CRFOP<T>::forward() {
 
 #ifdef LIGHTSEQ_cuda
   cudaStream_t stream = _context_ptr->get_stream();
-  cuda::launch_viterbi<T>(start_transition, end_transition, transition,
-                          emission, mask, best_score, history, best_tags,
-                          _num_tags, _seq_len, _batch_size, stream, bias);
+  if (_cu_seqlens) {
+    cuda::launch_viterbi_varlen<T>(start_transition, end_transition,
+                                   transition, emission, _cu_seqlens,
+                                   best_score, history, best_tags, _num_tags,
+                                   _seq_len, _batch_size, stream, bias);
+  } else {
+    cuda::launch_viterbi<T>(start_transition, end_transition, transition,
+                            emission, mask, best_score, history, best_tags,
+                            _num_tags, _seq_len, _batch_size, stream, bias);
+  }
 #endif
 }
 
 template <typename T>
-void CRFOP<T>::before_backward() {
-  throw std::runtime_error("CRF not support backward currently!");
+void CRFOP<T>::forward_nll() {
+  const T* start_transition = (const T*)parent(0)->value();
+  const T* end_transition = (const T*)parent(1)->value();
+  const T* transition = (const T*)parent(2)->value();
+  const T* emission = (const T*)parent(3)->value();
+  const T* mask = (const T*)parent(4)->value();
+  const T* bias = (const T*)parent(5)->value();
+  float* nll = (float*)child(0)->value();
+  float* log_z = (float*)_log_z->tensor();
+  float* alpha = (float*)_alpha->tensor();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+  if (!_tags) {
+    throw std::runtime_error("CRF training needs the tags of set_tags");
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  cuda::launch_crf_nll<T>(start_transition, end_transition, transition,
+                          emission, mask, _cu_seqlens, bias, _tags, nll,
+                          log_z, alpha, _num_tags, _seq_len, _batch_size,
+                          stream);
+#endif
 }
 
+template <typename T>
+void CRFOP<T>::before_backward() {}
+
 template <typename T>
 void CRFOP<T>::backward() {
-  throw std::runtime_error("CRF not support backward currently!");
+  T* grad_start_transition = (T*)parent(0)->grad();
+  T* grad_end_transition = (T*)parent(1)->grad();
+  T* grad_transition = (T*)parent(2)->grad();
+  T* grad_emission = (T*)parent(3)->grad();
+  T* grad_bias = (T*)parent(5)->grad();
+  const float* grad_nll = (const float*)child(0)->grad();
+  const T* start_transition = (const T*)parent(0)->value();
+  const T* end_transition = (const T*)parent(1)->value();
+  const T* transition = (const T*)parent(2)->value();
+  const T* emission = (const T*)parent(3)->value();
+  const T* mask = (const T*)parent(4)->value();
+  const T* bias = (const T*)parent(5)->value();
+  const float* log_z = (const float*)_log_z->tensor();
+  const float* alpha = (const float*)_alpha->tensor();
+  float* workspace =
+      _bw_workspace ? (float*)_bw_workspace->tensor() : nullptr;
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  cuda::launch_crf_nll_bw<T>(
+      grad_start_transition, grad_end_transition, grad_transition,
+      grad_emission, grad_bias, grad_nll, start_transition, end_transition,
+      transition, emission, mask, _cu_seqlens, bias, _tags, log_z, alpha,
+      workspace, _num_tags, _seq_len, _batch_size, stream);
+#endif
 }
 
 template class CRFOP<float>;
@@ -2,6 +2,13 @@
 
 namespace lightseq {
 
+template <typename T1, typename T2>
+DropoutOp<T1, T2>::~DropoutOp() {
+#ifdef LIGHTSEQ_cuda
+  cudaFree(_rng_offset);
+#endif
+}
+
 template <typename T1, typename T2>
 Variable* DropoutOp<T1, T2>::operator()(Variable* inp) {
   _result =
@@ -15,7 +22,7 @@ template <typename T1, typename T2>
 void DropoutOp<T1, T2>::forward() {
   T1* input = parent(0)->value<T1>();
   T1* output = child(0)->value<T1>();
-  uint8_t* mask_ptr = _mask->tensor<uint8_t>();
+  uint8_t* mask_ptr = _mask ? _mask->tensor<uint8_t>() : nullptr;
 
   if (!_context_ptr->is_built()) {
     return;
@@ -23,10 +30,27 @@ void DropoutOp<T1, T2>::forward() {
 
 #ifdef LIGHTSEQ_cuda
   cudaStream_t stream = _context_ptr->get_stream();
+  if (!_context_ptr->in_recompute()) {
+    if (_rng_offset) {
+      cuda::launch_ls_dropout_step(_rng_offset, stream);
+    } else {
+      _seed = cuda::ls_dropout_seed();
+    }
+  }
   cuda::launch_ls_dropout<T1>(output, input, mask_ptr, _count, RATIO(), stream,
-                              false);
+                              false, _seed, _rng_offset);
 #elif defined LIGHTSEQ_x86
-  //.....
+  if (RATIO() > 0.f) {
+    printf("Error! x86 DropoutOp only supports inference\n");
+    exit(-1);
+  }
+  if (output != input) std::copy(input, input + _count, output);
+#elif defined LIGHTSEQ_arm
+  if (RATIO() > 0.f) {
+    printf("Error! arm DropoutOp only supports inference\n");
+    exit(-1);
+  }
+  if (output != input) std::copy(input, input + _count, output);
 #endif
 }
 
@@ -34,7 +58,7 @@ template <typename T1, typename T2>
 void DropoutOp<T1, T2>::backward() {
   T2* input_grad = (T2*)parent(0)->grad();
   T2* output_grad = (T2*)child(0)->grad();
-  uint8_t* mask_ptr = (uint8_t*)_mask->tensor();
+  uint8_t* mask_ptr = _mask ? _mask->tensor<uint8_t>() : nullptr;
 
   if (!_context_ptr->is_built()) {
     return;
@@ -47,12 +71,28 @@ void DropoutOp<T1, T2>::backward() {
 #ifdef LIGHTSEQ_cuda
   cudaStream_t stream = _context_ptr->get_stream();
   cuda::launch_ls_dropout<T2>(input_grad, output_grad, mask_ptr, _count,
-                              RATIO(), stream, true);
+                              RATIO(), stream, true, _seed, _rng_offset);
 #endif
 }
 
+#ifdef LIGHTSEQ_cuda
+// dropout only runs in training, which bf16 does not support.
+template <>
+void DropoutOp<__nv_bfloat16, __nv_bfloat16>::forward() {
+  printf("ERROR! DropoutOp doesn't support bf16\n");
+  exit(-1);
+}
+
+template <>
+void DropoutOp<__nv_bfloat16, __nv_bfloat16>::backward() {
+  printf("ERROR! DropoutOp doesn't support bf16\n");
+  exit(-1);
+}
+#endif
+
 template class DropoutOp<float, float>;
 #ifdef LIGHTSEQ_cuda
 template class DropoutOp<__half, __half>;
+template class DropoutOp<__nv_bfloat16, __nv_bfloat16>;
 #endif
 }  // namespace lightseq
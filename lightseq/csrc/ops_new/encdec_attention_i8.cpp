@@ -0,0 +1,66 @@
+#include "encdec_attention_i8.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+Variable* EncDecAttentionI8Op<T1, T2>::operator()(Variable* query,
+                                                  Variable* enc_k,
+                                                  Variable* enc_v,
+                                                  Variable* enc_mask) {
+  size_t kv_size = _max_batch_size * _max_seq_len * _nhead * _head_dim;
+  _enc_k_i8 = new Variable("enc_k_i8", kv_size, g_dtype<int8_t>(),
+                           cuda::DataType::kNotSupported,
+                           VariableType::FixedVariable);
+  _enc_v_i8 = new Variable("enc_v_i8", kv_size, g_dtype<int8_t>(),
+                           cuda::DataType::kNotSupported,
+                           VariableType::FixedVariable);
+  _enc_k_scale = new Variable("enc_k_scale", kv_size / _head_dim,
+                              g_dtype<float>(), cuda::DataType::kNotSupported,
+                              VariableType::FixedVariable);
+  _enc_v_scale = new Variable("enc_v_scale", kv_size / _head_dim,
+                              g_dtype<float>(), cuda::DataType::kNotSupported,
+                              VariableType::FixedVariable);
+  _result = new Variable(
+      "EncDecAttentionI8Op_out",
+      _max_batch_size * _beam_size * _nhead * _head_dim, g_dtype<T1>(),
+      g_dtype<T2>());
+  set_parents({query, enc_k, enc_v, enc_mask});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void EncDecAttentionI8Op<T1, T2>::forward() {
+  T1* query_val = (T1*)parent(0)->value();
+  T1* enc_k_val = (T1*)parent(1)->value();
+  T1* enc_v_val = (T1*)parent(2)->value();
+  T1* enc_mask_val = (T1*)parent(3)->value();
+  T1* out_val = (T1*)child(0)->value();
+  int8_t* k_i8 = (int8_t*)_enc_k_i8->value();
+  int8_t* v_i8 = (int8_t*)_enc_v_i8->value();
+  float* k_scale = (float*)_enc_k_scale->value();
+  float* v_scale = (float*)_enc_v_scale->value();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  if (_quantize) {
+    cuda::ker_quantize_encdec_kv_launcher<T1>(
+        _batch_size, 1, _nhead, _src_seq_len, _head_dim, stream, enc_k_val,
+        enc_v_val, k_i8, v_i8, k_scale, v_scale, 0);
+  }
+  cuda::ker_encdec_attention_i8_launcher<T1>(
+      _batch_size, _nhead, _beam_size, _src_seq_len, _head_dim,
+      1.f / sqrt(float(_head_dim)), stream, query_val, out_val, k_i8, v_i8,
+      k_scale, v_scale, enc_mask_val);
+#endif
+}
+
+template class EncDecAttentionI8Op<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class EncDecAttentionI8Op<__half, __half>;
+#endif
+}  // namespace lightseq
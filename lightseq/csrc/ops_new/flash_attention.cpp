@@ -0,0 +1,128 @@
+#include "flash_attention.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+FlashAttentionOp<T1, T2>::~FlashAttentionOp() {
+#ifdef LIGHTSEQ_cuda
+  cudaFree(_rng_offset);
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* FlashAttentionOp<T1, T2>::operator()(Variable* query, Variable* key,
+                                               Variable* value,
+                                               Variable* mask) {
+  _result = new Variable("FlashAttentionOp_out",
+                         _max_batch_tokens * _nhead * _head_dim, g_dtype<T1>(),
+                         g_dtype<T2>());
+  if (mask == nullptr) {
+    set_parents({query, key, value});
+  } else {
+    set_parents({query, key, value, mask});
+  }
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void FlashAttentionOp<T1, T2>::forward() {
+  T1* query_val = (T1*)parent(0)->value();
+  char* key_val = parent(1)->value();
+  char* value_val = parent(2)->value();
+  T1* mask_val = _parents.size() > 3 ? (T1*)parent(3)->value() : nullptr;
+  T1* out_val = (T1*)child(0)->value();
+  float* workspace_val =
+      _workspace ? (float*)_workspace->tensor() : nullptr;
+  float* mass_workspace_val =
+      _mass_workspace ? (float*)_mass_workspace->tensor() : nullptr;
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  if (_context_ptr->is_training()) {
+    if (!_context_ptr->in_recompute()) {
+      if (_rng_offset) {
+        cuda::launch_ls_dropout_step(_rng_offset, stream);
+      } else {
+        _seed = cuda::ls_dropout_seed();
+      }
+    }
+    cuda::launch_flash_attention_train<T1>(
+        query_val, (T1*)key_val, (T1*)value_val, mask_val, out_val,
+        (float*)_lse->tensor(), _batch_size, _nhead, _query_len, _kv_len,
+        _head_dim, _mask_future, RATIO(), _seed, stream, _rng_offset);
+    return;
+  }
+  if (_k_scale) {
+    cuda::launch_flash_attention<T1, int8_t>(
+        query_val, (int8_t*)key_val, (int8_t*)value_val, mask_val, out_val,
+        _batch_size, _nhead, _query_len, _kv_len, _kv_size, _head_dim,
+        _mask_future, stream, workspace_val, _kv_head_num, _k_scale,
+        _v_scale, _pos_bias, _pos_bias_len, _token_major_out, _kv_rows,
+        _ring_size, _window, _mask_size, _tree_mask, _tree_len, _heavy_pos,
+        _kv_mass, mass_workspace_val);
+    if (_heavy_pos) {
+      cuda::launch_evict_heavy_hitters<int8_t>(
+          (int8_t*)key_val, (int8_t*)value_val, (float*)_k_scale,
+          (float*)_v_scale, _heavy_pos, _kv_mass, _batch_size, _kv_head_num,
+          _kv_len, _query_len, _kv_size, _ring_size, _window, _head_dim,
+          stream);
+    }
+    return;
+  }
+  cuda::launch_flash_attention<T1, T1>(
+      query_val, (T1*)key_val, (T1*)value_val, mask_val, out_val, _batch_size,
+      _nhead, _query_len, _kv_len, _kv_size, _head_dim, _mask_future, stream,
+      workspace_val, _kv_head_num, nullptr, nullptr, _pos_bias,
+      _pos_bias_len, _token_major_out, _kv_rows, _ring_size, _window,
+      _mask_size, _tree_mask, _tree_len, _heavy_pos, _kv_mass,
+      mass_workspace_val);
+  // the keys which left the window are compacted into the heavy hitters.
+  if (_heavy_pos) {
+    cuda::launch_evict_heavy_hitters<T1>(
+        (T1*)key_val, (T1*)value_val, nullptr, nullptr, _heavy_pos, _kv_mass,
+        _batch_size, _kv_head_num, _kv_len, _query_len, _kv_size, _ring_size,
+        _window, _head_dim, stream);
+  }
+#endif
+}
+
+template <typename T1, typename T2>
+void FlashAttentionOp<T1, T2>::backward() {
+  T1* query_val = (T1*)parent(0)->value();
+  T1* key_val = (T1*)parent(1)->value();
+  T1* value_val = (T1*)parent(2)->value();
+  T1* mask_val = _parents.size() > 3 ? (T1*)parent(3)->value() : nullptr;
+  T1* out_val = (T1*)child(0)->value();
+  T2* query_grad = (T2*)parent(0)->grad();
+  T2* key_grad = (T2*)parent(1)->grad();
+  T2* value_grad = (T2*)parent(2)->grad();
+  T2* out_grad = (T2*)child(0)->grad();
+  float* lse_val = _lse ? (float*)_lse->tensor() : nullptr;
+  float* workspace_val =
+      _bw_workspace ? (float*)_bw_workspace->tensor() : nullptr;
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  cuda::launch_flash_attention_bw<T2>(
+      query_grad, key_grad, value_grad, out_grad, query_val, key_val,
+      value_val, mask_val, out_val, lse_val, workspace_val, _batch_size,
+      _nhead, _query_len, _kv_len, _head_dim, _mask_future, RATIO(), _seed,
+      stream, _rng_offset);
+#endif
+}
+
+template class FlashAttentionOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class FlashAttentionOp<__half, __half>;
+template class FlashAttentionOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
@@ -0,0 +1,74 @@
+#include "fp8_linear.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+Fp8LinearOp<T1, T2>::Fp8LinearOp(size_t max_batch_tokens, size_t output_size,
+                                 size_t input_size)
+    : Operator("Fp8LinearOp"),
+      _max_batch_tokens(max_batch_tokens),
+      _output_size(output_size),
+      _input_size(input_size) {
+  // cublasLt fp8 matmuls need 16 bytes aligned leading dimensions.
+  if (output_size % 16 != 0 || input_size % 16 != 0) {
+    printf("Error! fp8 weight of [%zu, %zu] is not a multiple of 16\n",
+           output_size, input_size);
+    exit(-1);
+  }
+  _fp8_inp.reset(new Tensor("fp8_inp", g_dtype<int8_t>(),
+                            max_batch_tokens * input_size));
+}
+
+template <typename T1, typename T2>
+Variable* Fp8LinearOp<T1, T2>::operator()(Variable* inp, Variable* weight,
+                                          Variable* weight_scale,
+                                          Variable* input_scale) {
+  _result = new Variable("Fp8LinearOp_out", _max_batch_tokens * _output_size,
+                         g_dtype<T1>(), g_dtype<T2>());
+  set_parents({inp, weight, weight_scale, input_scale});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+Variable* Fp8LinearOp<T1, T2>::operator()(Variable* inp, Variable* weight,
+                                          Variable* weight_scale,
+                                          Variable* input_scale,
+                                          Variable* residual) {
+  _use_residual = true;
+  _result = new Variable("Fp8LinearOp_out", residual);
+  set_parents({inp, weight, weight_scale, input_scale, residual});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void Fp8LinearOp<T1, T2>::forward() {
+  T1* input_ptr = (T1*)parent(0)->value();
+  uint8_t* weight_ptr = (uint8_t*)parent(1)->value();
+  float* weight_scale_ptr = (float*)parent(2)->value();
+  float* input_scale_ptr = (float*)parent(3)->value();
+  T1* out_ptr = (T1*)child(0)->value();
+  uint8_t* fp8_inp_ptr = (uint8_t*)_fp8_inp->tensor();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  cuda::launch_quantize_fp8(fp8_inp_ptr, input_ptr, input_scale_ptr,
+                            _batch_tokens * _input_size, stream);
+  cuda::cublaslt_fp8_gemm(weight_ptr, fp8_inp_ptr, out_ptr, _output_size,
+                          _batch_tokens, _input_size, weight_scale_ptr,
+                          input_scale_ptr, _use_residual ? 1.f : 0.f,
+                          _context_ptr->get_cublaslthandle(), stream);
+#endif
+}
+
+template class Fp8LinearOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class Fp8LinearOp<__half, __half>;
+template class Fp8LinearOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
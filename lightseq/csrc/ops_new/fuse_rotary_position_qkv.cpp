@@ -1,10 +1,77 @@
 #include "fuse_rotary_position_qkv.h"
 
+#include <algorithm>
+#include <vector>
+
 namespace lightseq {
 
+template <typename T>
+void make_rotary_table(Context* context_ptr, const RopeScaling& scaling,
+                       int max_step, int head_dim, T** sin_ptr, T** cos_ptr) {
+  int half_dim = head_dim / 2;
+  double base = scaling.theta > 0 ? scaling.theta : 10000.;
+  double factor = scaling.factor > 0 ? scaling.factor : 1.;
+  if (scaling.type == "ntk") {
+    base *= std::pow(factor, double(head_dim) / (head_dim - 2));
+  } else if (!scaling.type.empty() && scaling.type != "linear" &&
+             scaling.type != "yarn") {
+    printf("Error! unknown rope scaling type %s\n", scaling.type.c_str());
+    exit(-1);
+  }
+
+  // the ramp of yarn over the frequency index, as transformers computes it.
+  double low = 0, high = 0, attn_factor = 1;
+  if (scaling.type == "yarn") {
+    int original_max_step =
+        scaling.original_max_step > 0 ? scaling.original_max_step : max_step;
+    auto correction_dim = [&](double rotations) {
+      return head_dim * std::log(original_max_step / (rotations * 2 * M_PI)) /
+             (2 * std::log(base));
+    };
+    low = std::max(std::floor(correction_dim(scaling.beta_fast)), 0.);
+    high = std::min(std::ceil(correction_dim(scaling.beta_slow)),
+                    double(head_dim - 1));
+    if (high == low) high += 0.001;
+    attn_factor = 0.1 * std::log(factor) + 1;
+  }
+
+  size_t total_size = size_t(max_step) * half_dim;
+  std::vector<T> sin_val(total_size), cos_val(total_size);
+  for (int i = 0; i < half_dim; i++) {
+    double inv_freq = std::pow(base, -2. * i / head_dim);
+    if (scaling.type == "linear") {
+      inv_freq /= factor;
+    } else if (scaling.type == "yarn") {
+      double ramp = std::min(std::max((i - low) / (high - low), 0.), 1.);
+      inv_freq = inv_freq / factor * ramp + inv_freq * (1 - ramp);
+    }
+    for (int j = 0; j < max_step; j++) {
+      // through float, which all of float, __half and bf16 convert from.
+      double angle = j * inv_freq;
+      sin_val[j * half_dim + i] = T(float(std::sin(angle) * attn_factor));
+      cos_val[j * half_dim + i] = T(float(std::cos(angle) * attn_factor));
+    }
+  }
+
+#ifdef LIGHTSEQ_cuda
+  *sin_ptr = (T*)context_ptr->allocator()->malloc_mem(total_size * sizeof(T));
+  *cos_ptr = (T*)context_ptr->allocator()->malloc_mem(total_size * sizeof(T));
+  CHECK_GPU_ERROR(cudaMemcpy(*sin_ptr, sin_val.data(), total_size * sizeof(T),
+                             cudaMemcpyDefault));
+  CHECK_GPU_ERROR(cudaMemcpy(*cos_ptr, cos_val.data(), total_size * sizeof(T),
+                             cudaMemcpyDefault));
+#else
+  *sin_ptr = (T*)malloc(total_size * sizeof(T));
+  *cos_ptr = (T*)malloc(total_size * sizeof(T));
+  std::copy(sin_val.begin(), sin_val.end(), *sin_ptr);
+  std::copy(cos_val.begin(), cos_val.end(), *cos_ptr);
+#endif
+}
+
 template <typename T1, typename T2>
 Variable* RotaryPositionQk<T1, T2>::operator()(Variable* inp, Variable* cache_k,
                                                Variable* cache_v) {
+  default_rotary_table();
   size_t max_size = _max_batch_size * _max_step * _head_num * _head_dim;
   _result = new Variable("RotaryPositionQk_out", max_size, g_dtype<T1>(),
                          g_dtype<T2>());
@@ -13,11 +80,71 @@ Variable* RotaryPositionQk<T1, T2>::operator()(Variable* inp, Variable* cache_k,
   return _result;
 }
 
+template <typename T1, typename T2>
+Variable* RotaryPositionQk<T1, T2>::operator()(Variable* inp, Variable* weight,
+                                               Variable* cache_k,
+                                               Variable* cache_v) {
+  if (_hidden_size == 0) {
+    printf("Error! RotaryPositionQk is built without the qkv linear\n");
+    exit(-1);
+  }
+  default_rotary_table();
+  _fuse_linear = true;
+  size_t max_size = _max_batch_size * _max_step * _head_num * _head_dim;
+  _result = new Variable("RotaryPositionQk_out", max_size, g_dtype<T1>(),
+                         g_dtype<T2>());
+  set_parents({inp, weight, cache_k, cache_v});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+std::tuple<Variable*, Variable*, Variable*>
+RotaryPositionQk<T1, T2>::operator()(Variable* inp) {
+  default_rotary_table();
+  _training = true;
+  size_t max_size = _max_batch_size * _max_step * _head_num * _head_dim;
+  size_t max_kv_size = _max_batch_size * _max_step * _kv_head_num * _head_dim;
+  _result = new Variable("RotaryPositionQk_out", max_size, g_dtype<T1>(),
+                         g_dtype<T2>());
+  _k_result = new Variable("RotaryPositionQk_k_out", max_kv_size,
+                           g_dtype<T1>(), g_dtype<T2>());
+  _v_result = new Variable("RotaryPositionQk_v_out", max_kv_size,
+                           g_dtype<T1>(), g_dtype<T2>());
+  set_parents({inp});
+  this->set_children({_result, _k_result, _v_result});
+  return std::make_tuple(_result, _k_result, _v_result);
+}
+
 template <typename T1, typename T2>
 void RotaryPositionQk<T1, T2>::forward() {
+  if (_training) {
+    T1* inp_val = (T1*)parent(0)->value();
+    T1* q_val = (T1*)child(0)->value();
+    T1* k_val = (T1*)child(1)->value();
+    T1* v_val = (T1*)child(2)->value();
+
+    if (!_context_ptr->is_built()) {
+      return;
+    }
+
+#ifdef LIGHTSEQ_cuda
+    // k, v of query_len steps from position 0.
+    cuda::launch_split_rotary_position_qkv(
+        inp_val, _device_sin_ptr, _device_cos_ptr, q_val, k_val, v_val,
+        _query_len, _batch_size, _head_num, 0, _query_len, _head_dim,
+        _context_ptr->get_stream(), nullptr, nullptr, 0, 0, nullptr,
+        _kv_head_num);
+#endif
+    return;
+  }
+
+  int cache_idx = _fuse_linear ? 2 : 1;
   T1* inp_val = (T1*)parent(0)->value();
-  T1* cache_k_val = (T1*)parent(1)->value();
-  T1* cache_v_val = (T1*)parent(2)->value();
+  T1* weight_val = _fuse_linear ? (T1*)parent(1)->value() : nullptr;
+  char* cache_k_val = parent(cache_idx)->value();
+  char* cache_v_val = parent(cache_idx + 1)->value();
+  T1* qkv_val = _qkv_out ? (T1*)_qkv_out->tensor() : nullptr;
 
   T1* out_val = (T1*)child(0)->value();
 
@@ -27,15 +154,84 @@ void RotaryPositionQk<T1, T2>::forward() {
 
 #ifdef LIGHTSEQ_cuda
   cudaStream_t stream = _context_ptr->get_stream();
+  int max_pages =
+      _page_size ? int((_max_step + _page_size - 1) / _page_size) : 0;
+  size_t cache_len = _ring_size ? _cache_len : _max_step;
+  if (_fuse_linear) {
+    size_t batch_tokens = _batch_size * _query_len;
+    if (!_cache_k_scale && _head_dim % 8 == 0 &&
+        batch_tokens <= cuda::kQkvRotaryMaxGemvTokens) {
+      cuda::launch_gemv_qkv_rotary(
+          inp_val, weight_val, _device_sin_ptr, _device_cos_ptr, out_val,
+          (T1*)cache_k_val, (T1*)cache_v_val, cache_len, _batch_size,
+          _head_num, _offset_seq_len, _query_len, _head_dim, _hidden_size,
+          stream, _offset_seq_len_ptr, _page_table, _page_size, max_pages,
+          _seq_offsets, _kv_head_num, _ring_size);
+      return;
+    }
+    int qkv_size = (_head_num + 2 * _kv_head_num) * _head_dim;
+    float alpha = 1.f, beta = 0.f;
+    // the tuned cublasLt algo when LIGHTSEQ_GEMM_TUNE is on, see GemmTuner.
+    if (!cuda::cublaslt_tuned_gemm(_context_ptr->get_cublaslthandle(),
+                                   CUBLAS_OP_N, CUBLAS_OP_N, qkv_size,
+                                   batch_tokens, _hidden_size, &alpha, &beta,
+                                   weight_val, inp_val, qkv_val, stream)) {
+      cuda::cublas_gemm_ex(_context_ptr->get_cublashandle(), CUBLAS_OP_N,
+                           CUBLAS_OP_N, qkv_size, batch_tokens, _hidden_size,
+                           &alpha, &beta, weight_val, inp_val, qkv_val);
+    }
+    inp_val = qkv_val;
+  }
+  if (_cache_k_scale) {
+    cuda::launch_split_rotary_position_qkv_i8(
+        inp_val, _device_sin_ptr, _device_cos_ptr, out_val,
+        (int8_t*)cache_k_val, (int8_t*)cache_v_val, _cache_k_scale,
+        _cache_v_scale, cache_len, _batch_size, _head_num, _offset_seq_len,
+        _query_len, _head_dim, stream, _offset_seq_len_ptr, _page_table,
+        _page_size, max_pages, _seq_offsets, _kv_head_num, _ring_size);
+    return;
+  }
   cuda::launch_split_rotary_position_qkv(
-      inp_val, _device_sin_ptr, _device_cos_ptr, out_val, cache_k_val,
-      cache_v_val, _max_step, _batch_size, _head_num, _offset_seq_len,
-      _query_len, _head_dim, stream);
+      inp_val, _device_sin_ptr, _device_cos_ptr, out_val, (T1*)cache_k_val,
+      (T1*)cache_v_val, cache_len, _batch_size, _head_num, _offset_seq_len,
+      _query_len, _head_dim, stream, _offset_seq_len_ptr, _page_table,
+      _page_size, max_pages, _seq_offsets, _kv_head_num, _ring_size);
+#endif
+}
+
+template <typename T1, typename T2>
+void RotaryPositionQk<T1, T2>::backward() {
+  if (!_training) {
+    printf("Error! RotaryPositionQk only has a backward in training\n");
+    exit(-1);
+  }
+  T2* inp_grad = (T2*)parent(0)->grad();
+  T2* q_grad = (T2*)child(0)->grad();
+  T2* k_grad = (T2*)child(1)->grad();
+  T2* v_grad = (T2*)child(2)->grad();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cuda::launch_split_rotary_position_qkv_bw(
+      inp_grad, (T2*)_device_sin_ptr, (T2*)_device_cos_ptr, q_grad, k_grad,
+      v_grad, _batch_size, _head_num, _query_len, _head_dim,
+      _context_ptr->get_stream(), _kv_head_num);
 #endif
 }
 
+template void make_rotary_table<float>(Context*, const RopeScaling&, int, int,
+                                       float**, float**);
 template class RotaryPositionQk<float, float>;
 #ifdef LIGHTSEQ_cuda
+template void make_rotary_table<__half>(Context*, const RopeScaling&, int,
+                                        int, __half**, __half**);
+template void make_rotary_table<__nv_bfloat16>(Context*, const RopeScaling&,
+                                               int, int, __nv_bfloat16**,
+                                               __nv_bfloat16**);
 template class RotaryPositionQk<__half, __half>;
+template class RotaryPositionQk<__nv_bfloat16, __nv_bfloat16>;
 #endif
 }  // namespace lightseq
@@ -12,14 +12,18 @@ class ActElewiseProductOp : public Operator {
   size_t _batch_tokens;
   size_t _batch_size;
   size_t _seq_len;
+  // "silu" or "gelu" of the first half, times the second half.
+  std::string _activation_fn;
 
   Variable* _result;
 
  public:
-  ActElewiseProductOp(size_t max_batch_tokens, size_t inner_size)
+  ActElewiseProductOp(size_t max_batch_tokens, size_t inner_size,
+                      std::string activation_fn = "silu")
       : Operator("ActElewiseProductOp"),
         _max_batch_tokens(max_batch_tokens),
-        _inner_size(inner_size) {}
+        _inner_size(inner_size),
+        _activation_fn(activation_fn) {}
 
   virtual ~ActElewiseProductOp() {}
 
@@ -34,7 +38,8 @@ class ActElewiseProductOp : public Operator {
     _result->set_shape({_batch_tokens, _inner_size});
   }
 
-  void backward() override {}
+  // silu only.
+  void backward() override;
 
   void before_backward() {}
 };
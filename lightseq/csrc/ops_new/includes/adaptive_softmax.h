@@ -0,0 +1,73 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// The adaptive softmax output head of a large vocabulary, for inference, as
+// torch.nn.AdaptiveLogSoftmaxWithLoss without biases. The vocab is split at
+// cutoffs: the frequent tokens [0, cutoffs[0]) and one logit per tail
+// cluster i [cutoffs[i], cutoffs[i + 1]) come from the head, the tokens of a
+// cluster from a projection to tail_dims[i] followed by its own output. The
+// result is the full vocab of log probs, so every generator consumes it as
+// it does the logits of a linear head. With set_topk, a tail cluster is only
+// evaluated if it may hold one of the topk tokens of some row, the others
+// put their whole log prob on their first token, see launch_adaptive_skip,
+// which leaves the topk tokens, their order and their normalizer unchanged.
+//   inp: [batch_tokens, hidden_size]
+//   weights: head [cutoffs[0] + num_clusters, hidden_size], then the proj
+//     [tail_dims[i], hidden_size] and out [cluster_size, tail_dims[i]] of
+//     every cluster
+//   result: [batch_tokens, vocab_size] log probs
+template <typename T1, typename T2>
+class AdaptiveSoftmaxOp : public Operator {
+ private:
+  size_t _max_batch_tokens;
+  size_t _batch_tokens;
+  size_t _hidden_size;
+  // the cutoffs of the clusters with the vocab size last, num_clusters + 1
+  std::vector<int> _cutoffs;
+  std::vector<int> _tail_dims;
+  int _num_clusters;
+  int _topk = 0;
+
+  TensorPtr _head_out;
+  TensorPtr _cluster_logp;
+  TensorPtr _proj_out;
+  TensorPtr _tail_out;
+  // [num_clusters], which clusters are evaluated, on the device and pinned.
+  int* _p_d_cluster_flags = nullptr;
+  int* _h_cluster_flags = nullptr;
+  Variable* _result;
+
+ public:
+  AdaptiveSoftmaxOp(size_t max_batch_tokens, size_t hidden_size,
+                    const std::vector<int>& cutoffs,
+                    const std::vector<int>& tail_dims);
+
+  virtual ~AdaptiveSoftmaxOp();
+
+  Variable* operator()(Variable* inp, const std::vector<Variable*>& weights);
+
+  void forward() override;
+
+  std::vector<TensorPtr> workspaces() override {
+    return {_head_out, _cluster_logp, _proj_out, _tail_out};
+  }
+
+  void before_forward(size_t batch_tokens) {
+    _batch_tokens = batch_tokens;
+    _result->set_shape({batch_tokens, (size_t)_cutoffs.back()});
+  }
+
+  // the tokens kept by the consumer of every row, 0 evaluates all the
+  // clusters, eg. for top-p sampling.
+  void set_topk(int topk) { _topk = topk; }
+
+  void backward() override {
+    printf("ERROR! AdaptiveSoftmaxOp can't cal backward()\n");
+    exit(-1);
+  }
+};
+
+}  // namespace lightseq
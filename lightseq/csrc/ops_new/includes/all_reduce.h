@@ -0,0 +1,80 @@
+#pragma once
+#include "declaration.h"
+#include "linear.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Sum of the input over the tensor parallel ranks of the context, see
+// Context::init_tensor_parallel. An identity copy when tp_size is 1.
+// The messages of at most Context::one_shot_bytes go through the one-shot
+// all-reduce, the others through nccl, quantized to int8 per token with
+// Context::tp_all_reduce_int8: an all-to-all of the quantized token shards,
+// their sum quantized again on the rank of the shard, then an all-gather,
+// as the gradient communication quantization of training.
+// With Context::tp_overlap_chunks, the gemm of the row parallel LinearOp in
+// front is split along the tokens, and the all-reduce of every chunk runs on
+// Context::comm_stream while the next chunk is computed, see overlap_linear.
+template <typename T1, typename T2>
+class AllReduceOp : public Operator {
+ private:
+  size_t _max_batch_tokens;
+  size_t _hidden_dim;
+  size_t _batch_tokens;
+  size_t _ele_num;
+
+  // int8 only, the tokens padded to a multiple of tp_size and their shard of
+  // every rank.
+  TensorPtr _quant;
+  TensorPtr _scales;
+  TensorPtr _quant_shards;
+  TensorPtr _shard_scales;
+  TensorPtr _quant_reduced;
+  TensorPtr _reduced_scales;
+
+  Variable* _result;
+
+  // not owned, nullptr without overlap.
+  LinearOp<T1, T2>* _linear = nullptr;
+  int _num_chunks = 1;
+#ifdef LIGHTSEQ_cuda
+  // the gemm of every chunk, and the all-reduce of the last one
+  std::vector<cudaEvent_t> _gemm_done;
+  cudaEvent_t _comm_done = nullptr;
+
+  void all_reduce(const T1* inp_ptr, T1* out_ptr, size_t tokens,
+                  cudaStream_t stream);
+  void int8_all_reduce(const T1* inp_ptr, T1* out_ptr, size_t tokens,
+                       cudaStream_t stream);
+  void overlap_forward();
+#endif
+
+ public:
+  AllReduceOp(size_t max_batch_tokens, size_t hidden_dim);
+
+  ~AllReduceOp();
+
+  Variable* operator()(Variable* inp);
+
+  // linear computes the input, its gemm is run in the chunks of the
+  // forward of the batches of at least 128 tokens per chunk. Only with
+  // Context::tp_overlap_chunks > 1 and nccl.
+  void overlap_linear(LinearOp<T1, T2>* linear);
+
+  void forward() override;
+
+  std::vector<TensorPtr> workspaces() override {
+    return {_quant, _scales, _quant_shards, _shard_scales, _quant_reduced,
+            _reduced_scales};
+  }
+
+  // after the before_forward of the linear to overlap.
+  void before_forward(size_t batch_tokens, size_t hidden_dim);
+
+  void backward() override {
+    printf("ERROR! AllReduceOp can't cal backward()\n");
+    exit(-1);
+  }
+};
+
+}  // namespace lightseq
@@ -42,8 +42,13 @@ class BeamSearchTopOp : public Operator {
   Variable* _seq_prob;
   Variable* _seq_score;
   Variable* _alive_seq_out;
-  Variable* _caches_k_buf;
-  Variable* _caches_v_buf;
+  // nullptr with use_kv_rows, the caches are never copied.
+  Variable* _caches_k_buf = nullptr;
+  Variable* _caches_v_buf = nullptr;
+  bool _kv_rows = false;
+  // the score margins of set_beam_pruning, <= 0 for none.
+  float _prune_abs_margin = 0.f;
+  float _prune_rel_margin = 0.f;
 
  public:
   BeamSearchTopOp(size_t nshared_dec_layer, size_t max_batch_size,
@@ -74,6 +79,23 @@ class BeamSearchTopOp : public Operator {
 
   void refresh_cache(Variable* caches_k, Variable* caches_v);
 
+  // Reorder the beams through kv_rows, see ker_refresh_kv_rows_launcher,
+  // instead of refresh_cache. Must be called before operator(), which then
+  // does not allocate the buffers of the copied caches.
+  void use_kv_rows() { _kv_rows = true; }
+  // kv_rows: [max_batch_size * beam_size, max_step], reset by init_kv_rows
+  // before every generation.
+  void init_kv_rows(int* kv_rows);
+  void refresh_kv_rows(int* kv_rows);
+
+  // Beam pruning by score margin: every step, the candidates which trail the
+  // best one of their batch item by more than abs_margin, or by more than
+  // rel_margin * |best score|, finish as the eos of their beam with the
+  // lowest score, see ker_prune_beams_launcher. So a batch item with a
+  // confident best beam stops as soon as it finishes, and is_stop() comes
+  // earlier. A margin <= 0 is none, not with diverse beam search.
+  void set_beam_pruning(float abs_margin, float rel_margin);
+
   void backward() override {}
 
   void before_backward() {}
@@ -19,10 +19,17 @@ class BiasActDropoutOp : public Operator {
 
   std::string _activation_fn;
 
+  // nullptr with Context::mask_free_dropout().
   TensorPtr _mask;
+  // the seed of _mask, reused when the layer is recomputed and by the mask
+  // free backward.
+  int _seed = 0;
+  // with Context::capturable(), see DropoutOp.
+  unsigned long long* _rng_offset = nullptr;
 
  public:
   float RATIO() const { return _context_ptr->is_training() ? ratio : 0.0; }
+  const std::string& activation_fn() const { return _activation_fn; }
 
   BiasActDropoutOp(float r, size_t mx_rows, size_t mx_cols,
                    std::string activation_fn)
@@ -31,10 +38,18 @@ class BiasActDropoutOp : public Operator {
         _activation_fn(activation_fn),
         _mx_rows(mx_rows),
         _mx_cols(mx_cols) {
-    _mask.reset(new Tensor("_mask", g_dtype<uint8_t>(), _mx_rows * _mx_cols));
+    if (!_context_ptr->mask_free_dropout()) {
+      _mask.reset(new Tensor("_mask", g_dtype<uint8_t>(), _mx_rows * _mx_cols));
+    }
+#ifdef LIGHTSEQ_cuda
+    if (_context_ptr->capturable()) {
+      _seed = cuda::ls_dropout_seed();
+      _rng_offset = cuda::ls_dropout_new_rng_offset();
+    }
+#endif
   }
 
-  virtual ~BiasActDropoutOp() {}
+  virtual ~BiasActDropoutOp();
 
   Variable* operator()(Variable* inp, Variable* bias);
 
@@ -45,6 +60,8 @@ class BiasActDropoutOp : public Operator {
 
   void forward() override;
 
+  std::vector<TensorPtr> workspaces() override { return {_mask}; }
+
   void backward() override;
 };
 }  // namespace lightseq
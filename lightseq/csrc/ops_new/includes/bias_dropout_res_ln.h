@@ -0,0 +1,59 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// BiasDropoutResOp followed by LayerNormalizeOp on its output in one kernel,
+// at the end of attn and ffn of the post layer norm layers. The residual sum
+// is kept as the layer norm input of the backward, which is fused too: the
+// grads of the residual, of the dropout input, of the bias and of the layer
+// norm params in one pass.
+template <typename T1, typename T2>
+class BiasDropoutResLnOp : public Operator {
+ private:
+  float ratio;
+
+  size_t _max_rows;
+  size_t _hidden_dim;
+  size_t _rows;
+
+  // nullptr with Context::mask_free_dropout().
+  TensorPtr _mask;
+  // the seed of _mask, see BiasDropoutResOp.
+  int _seed = 0;
+  // with Context::capturable(), see DropoutOp.
+  unsigned long long* _rng_offset = nullptr;
+  TensorPtr _means;
+  TensorPtr _vars;
+  // partial dgamma / dbetta / dbias of the fused backward
+  TensorPtr _bw_workspace;
+
+  Variable* _ln_out;
+  Variable* _res_out;
+
+ public:
+  float RATIO() const { return _context_ptr->is_training() ? ratio : 0.0; }
+
+  BiasDropoutResLnOp(float r, size_t max_rows, size_t hidden_dim);
+
+  virtual ~BiasDropoutResLnOp();
+
+  // Returns layer_norm(dropout(inp + bias) + residual), see res_out for the
+  // residual sum.
+  Variable* operator()(Variable* inp, Variable* bias, Variable* residual,
+                       Variable* gamma, Variable* betta);
+
+  Variable* res_out() { return _res_out; }
+
+  void before_forward(size_t batch_size, size_t seq_len);
+
+  void forward() override;
+
+  std::vector<TensorPtr> workspaces() override {
+    return {_mask, _means, _vars, _bw_workspace};
+  }
+
+  void backward() override;
+};
+}  // namespace lightseq
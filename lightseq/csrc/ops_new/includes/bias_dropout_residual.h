@@ -16,8 +16,17 @@ class BiasDropoutResOp : public Operator {
   size_t _rows;
   size_t _cols;
 
+  // nullptr with Context::mask_free_dropout().
   TensorPtr _mask;
+  // the seed of _mask, reused when the layer is recomputed and by the mask
+  // free backward.
+  int _seed = 0;
+  // with Context::capturable(), see DropoutOp.
+  unsigned long long* _rng_offset = nullptr;
   Variable* _result;
+  // the layer norm of the output is run by the forward too, see
+  // fuse_layer_norm.
+  bool _ln_fused = false;
 
  public:
   float RATIO() const { return _context_ptr->is_training() ? ratio : 0.0; }
@@ -27,13 +36,29 @@ class BiasDropoutResOp : public Operator {
         ratio(r),
         _max_rows(max_rows),
         _max_cols(max_cols) {
-    _mask.reset(new Tensor("mask", g_dtype<uint8_t>(), _max_rows * _max_cols));
+    if (!_context_ptr->mask_free_dropout()) {
+      _mask.reset(
+          new Tensor("mask", g_dtype<uint8_t>(), _max_rows * _max_cols));
+    }
+#ifdef LIGHTSEQ_cuda
+    if (_context_ptr->capturable()) {
+      _seed = cuda::ls_dropout_seed();
+      _rng_offset = cuda::ls_dropout_new_rng_offset();
+    }
+#endif
   }
 
-  virtual ~BiasDropoutResOp() {}
+  virtual ~BiasDropoutResOp();
 
   Variable* operator()(Variable* inp, Variable* bias, Variable* residual);
 
+  // Absorbs the LayerNormalizeOp of the pre layer norm of the next layer on
+  // the output, whose output becomes the second child, the output is kept
+  // for the residual of the next layer. Run by GraphFusion for inference on
+  // cuda, the training layers use BiasDropoutResLnOp in the post layer norm
+  // ones. Returns false if there is no such layer norm.
+  bool fuse_layer_norm();
+
   void before_forward(size_t rows, size_t cols) {
     _rows = rows, _cols = cols;
     _result->set_shape({_rows, _cols});
@@ -41,6 +66,8 @@ class BiasDropoutResOp : public Operator {
 
   void forward() override;
 
+  std::vector<TensorPtr> workspaces() override { return {_mask}; }
+
   void backward() override;
 };
 }  // namespace lightseq
@@ -0,0 +1,74 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// The block layout of BlockSparseAttentionOp, Longformer / BigBird style.
+// The tokens are split into blocks of block_size, the queries of a block
+// attend to the keys of the window_blocks blocks on either side of it and of
+// its own, of the first global_blocks blocks, and of random_blocks others
+// picked at random per query block. The queries of the global blocks attend
+// to every key. Dense attention if block_size is 0.
+struct BlockSparseConfig {
+  int block_size = 0;
+  int window_blocks = 1;
+  int global_blocks = 1;
+  int random_blocks = 0;
+};
+
+// Self attention of an encoder over a block layout of the keys, with the
+// qkv bias added and the heads split on the fly, see
+// launch_block_sparse_attention. The layout of a sequence length is built
+// on the host by before_forward, the attention of a sequence of n tokens
+// costs O(n * block_size * layout blocks per row). Inference only.
+//   qkv: [batch_size, seq_len, 3, num_heads, head_dim], without the bias
+//   qkv_bias: [3, num_heads, head_dim]
+//   mask: [batch_size, seq_len], added to the scores
+//   result: [batch_size, seq_len, num_heads, head_dim]
+template <typename T1, typename T2>
+class BlockSparseAttentionOp : public Operator {
+ private:
+  size_t _max_batch_tokens;
+  size_t _num_heads;
+  size_t _head_dim;
+  BlockSparseConfig _config;
+
+  size_t _batch_size;
+  size_t _seq_len;
+  // the sequence length of the layout on device, 0 before the first.
+  size_t _layout_seq_len = 0;
+  std::vector<int> _layout_offsets;
+  std::vector<int> _layout_blocks;
+  int* _d_layout_offsets = nullptr;
+  int* _d_layout_blocks = nullptr;
+
+  Variable* _result;
+
+  void build_layout(size_t seq_len);
+
+ public:
+  BlockSparseAttentionOp(size_t max_batch_tokens, size_t max_seq_len,
+                         size_t num_heads, size_t head_dim,
+                         const BlockSparseConfig& config);
+
+  virtual ~BlockSparseAttentionOp() {}
+
+  Variable* operator()(Variable* qkv, Variable* qkv_bias, Variable* mask);
+
+  void before_forward(size_t batch_size, size_t seq_len) {
+    _batch_size = batch_size;
+    _seq_len = seq_len;
+    if (seq_len != _layout_seq_len) build_layout(seq_len);
+    _result->set_shape({_batch_size * _seq_len, _num_heads * _head_dim});
+  }
+
+  void forward() override;
+
+  void backward() override {
+    printf("ERROR! BlockSparseAttentionOp can't cal backward()\n");
+    exit(-1);
+  }
+};
+
+}  // namespace lightseq
@@ -4,7 +4,8 @@
 
 namespace lightseq {
 
-// linear crf
+// linear crf, the viterbi decoding in inference, the negative log likelihood
+// of the gold tags of set_tags and its grads in training, see ker_crf_nll.
 template <typename T>
 class CRFOP : public Operator {
  private:
@@ -15,10 +16,19 @@ class CRFOP : public Operator {
   size_t _max_batch_size;
 
   bool _forward_or_decode;  // true for forward, false for decode
-  bool _output_decode_score;
+  bool _output_decode_score = false;
   TensorPtr _history;
+  // varlen only, see set_cu_seqlens.
+  const int* _cu_seqlens = nullptr;
+
+  // training only, the gold tags and what the backward keeps of the forward.
+  const int* _tags = nullptr;
+  TensorPtr _alpha;
+  TensorPtr _log_z;
+  TensorPtr _bw_workspace;
 
   Variable* _best_tags;
+  Variable* _nll;
 
  public:
   CRFOP(size_t max_batch_tokens, size_t max_batch_size, size_t num_tags);
@@ -32,8 +42,24 @@ class CRFOP : public Operator {
   void before_forward(size_t batch_size, size_t seq_len, bool forward_or_decode,
                       bool output_decode_score);
 
+  // Decode the packed emissions of the sequences at cu_seqlens, [batch_size +
+  // 1] on the device, instead of the padded ones of the mask. The best tags
+  // are still [batch_size, seq_len].
+  void set_cu_seqlens(const int* cu_seqlens) { _cu_seqlens = cu_seqlens; }
+
+  // The gold tags of the next forward in training, [batch_size, seq_len] on
+  // the device, or [batch_tokens] with set_cu_seqlens. The op then returns
+  // the fp32 [batch_size] negative log likelihood.
+  void set_tags(const int* tags) { _tags = tags; }
+
   void forward() override;
 
+  std::vector<TensorPtr> workspaces() override {
+    return {_history, _alpha, _log_z, _bw_workspace};
+  }
+
+  void forward_nll();
+
   void before_backward();
 
   void backward() override;
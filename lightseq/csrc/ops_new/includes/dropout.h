@@ -13,7 +13,14 @@ class DropoutOp : public Operator {
   size_t _count;
   bool _is_skip;
 
+  // nullptr with Context::mask_free_dropout().
   TensorPtr _mask;
+  // the seed of _mask, reused when the layer is recomputed and by the mask
+  // free backward.
+  int _seed = 0;
+  // the counter of ls_dropout_key with Context::capturable(), advanced on the
+  // stream by every forward of the fixed _seed, else nullptr.
+  unsigned long long* _rng_offset = nullptr;
   Variable* _result = nullptr;
 
  public:
@@ -21,10 +28,18 @@ class DropoutOp : public Operator {
 
   DropoutOp(float r, size_t max_ele_num)
       : Operator("Dropout"), ratio(r), _max_ele_num(max_ele_num) {
-    _mask.reset(new Tensor("mask", g_dtype<uint8_t>(), max_ele_num));
+    if (!_context_ptr->mask_free_dropout()) {
+      _mask.reset(new Tensor("mask", g_dtype<uint8_t>(), max_ele_num));
+    }
+#ifdef LIGHTSEQ_cuda
+    if (_context_ptr->capturable()) {
+      _seed = cuda::ls_dropout_seed();
+      _rng_offset = cuda::ls_dropout_new_rng_offset();
+    }
+#endif
   }
 
-  virtual ~DropoutOp() {}
+  virtual ~DropoutOp();
 
   Variable* operator()(Variable* inp);
 
@@ -35,6 +50,8 @@ class DropoutOp : public Operator {
 
   void forward() override;
 
+  std::vector<TensorPtr> workspaces() override { return {_mask}; }
+
   void before_backward(int count) { _count = count; }
 
   void backward() override;
@@ -0,0 +1,64 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Encoder-decoder attention of inference on an int8 copy of enc_k, enc_v,
+// with a scale per head vector. The copy is taken at the first decoding step
+// and kept across the steps, so every later step reads half the bytes of the
+// strided batch gemms on T1.
+//   query: [batch_size, nhead, beam_size, head_dim]
+//   enc_k, enc_v: [batch_size, nhead, src_seq_len, head_dim]
+//   enc_mask: [batch_size, src_seq_len], -inf at the pads
+//   result: [batch_size, nhead, beam_size, head_dim]
+template <typename T1, typename T2>
+class EncDecAttentionI8Op : public Operator {
+ private:
+  size_t _max_batch_size;
+  size_t _max_seq_len;
+  size_t _beam_size;
+  size_t _nhead;
+  size_t _head_dim;
+
+  size_t _batch_size;
+  size_t _src_seq_len;
+  bool _quantize;
+
+  Variable* _enc_k_i8;
+  Variable* _enc_v_i8;
+  Variable* _enc_k_scale;
+  Variable* _enc_v_scale;
+  Variable* _result;
+
+ public:
+  EncDecAttentionI8Op(size_t max_batch_size, size_t max_seq_len,
+                      size_t beam_size, size_t nhead, size_t head_dim)
+      : Operator("EncDecAttentionI8Op"),
+        _max_batch_size(max_batch_size),
+        _max_seq_len(max_seq_len),
+        _beam_size(beam_size),
+        _nhead(nhead),
+        _head_dim(head_dim) {}
+
+  virtual ~EncDecAttentionI8Op() {}
+
+  Variable* operator()(Variable* query, Variable* enc_k, Variable* enc_v,
+                       Variable* enc_mask);
+
+  // quantize enc_k, enc_v at the first step of a batch.
+  void before_forward(size_t batch_size, size_t src_seq_len, bool quantize) {
+    _batch_size = batch_size, _src_seq_len = src_seq_len,
+    _quantize = quantize;
+    _result->set_shape({_batch_size, _nhead, _beam_size, _head_dim});
+  }
+
+  void forward() override;
+
+  void backward() override {
+    printf("ERROR! EncDecAttentionI8Op can't cal backward()\n");
+    exit(-1);
+  }
+};
+
+}  // namespace lightseq
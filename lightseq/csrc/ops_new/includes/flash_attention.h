@@ -0,0 +1,186 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Scaled dot product attention fused into a single kernel with an online
+// softmax, the attention scores are never materialized. With a single query,
+// long contexts are split across thread blocks and merged in a second pass.
+// In training, with the attention dropout, it keeps the log of the softmax
+// denominator of every query and the backward recomputes the probabilities
+// from it, see launch_flash_attention_bw, only the plain attention of the
+// tensors below without the kv settings is supported then.
+//   query: [batch_size, nhead, query_len, head_dim]
+//   key, value: [batch_size, kv_head_num, kv_size, head_dim], of T1, or int8
+//     with the scales set by set_kv_cache_scales
+//   mask: [batch_size, kv_size], added to the scores, optional
+//   result: [batch_size, nhead, query_len, head_dim], or [batch_size,
+//     query_len, nhead, head_dim] after set_token_major_output
+template <typename T1, typename T2>
+class FlashAttentionOp : public Operator {
+ private:
+  size_t _max_batch_tokens;
+  size_t _nhead;
+  size_t _head_dim;
+  size_t _kv_head_num;
+
+  size_t _batch_size;
+  size_t _query_len;
+  size_t _kv_len;
+  size_t _kv_size;
+  bool _mask_future;
+  const float* _k_scale = nullptr;
+  const float* _v_scale = nullptr;
+  const T1* _pos_bias = nullptr;
+  int _pos_bias_len = 0;
+  bool _token_major_out = false;
+  const int* _kv_rows = nullptr;
+  int _ring_size = 0;
+  int _window = 0;
+  int _mask_size = 0;
+  const unsigned char* _tree_mask = nullptr;
+  int _tree_len = 0;
+  int* _heavy_pos = nullptr;
+  float* _kv_mass = nullptr;
+
+  // partial softmax states of the split decode kernel.
+  TensorPtr _workspace;
+  // the scores of a single query, or the lse of several, of the attention
+  // mass, see set_heavy_hitters.
+  TensorPtr _mass_workspace;
+  // training only, the lse of the forward and the sum(dout * out) of the
+  // backward, of every query.
+  TensorPtr _lse;
+  TensorPtr _bw_workspace;
+  float _dropout_ratio;
+  // the seed of the attention dropout, see BiasDropoutResOp.
+  int _seed = 0;
+  // with Context::capturable(), see DropoutOp.
+  unsigned long long* _rng_offset = nullptr;
+  Variable* _result;
+
+ public:
+  float RATIO() const {
+    return _context_ptr->is_training() ? _dropout_ratio : 0.0;
+  }
+
+  // kv_head_num < nhead for grouped-query attention, 0 means nhead.
+  FlashAttentionOp(size_t max_batch_tokens, size_t nhead, size_t head_dim,
+                   size_t kv_head_num = 0, float dropout_ratio = 0.f)
+      : Operator("FlashAttentionOp"),
+        _max_batch_tokens(max_batch_tokens),
+        _nhead(nhead),
+        _head_dim(head_dim),
+        _kv_head_num(kv_head_num ? kv_head_num : nhead),
+        _dropout_ratio(dropout_ratio) {
+#ifdef LIGHTSEQ_cuda
+    _workspace.reset(new Tensor("workspace", g_dtype<float>(),
+                                cuda::kFlashMaxPartials * (head_dim + 2)));
+#endif
+    if (_context_ptr->is_training()) {
+      _lse.reset(
+          new Tensor("lse", g_dtype<float>(), max_batch_tokens * nhead));
+      _bw_workspace.reset(new Tensor("bw_workspace", g_dtype<float>(),
+                                     max_batch_tokens * nhead));
+    }
+#ifdef LIGHTSEQ_cuda
+    if (_context_ptr->is_training() && _context_ptr->capturable()) {
+      _seed = cuda::ls_dropout_seed();
+      _rng_offset = cuda::ls_dropout_new_rng_offset();
+    }
+#endif
+  }
+
+  virtual ~FlashAttentionOp();
+
+  Variable* operator()(Variable* query, Variable* key, Variable* value,
+                       Variable* mask = nullptr);
+
+  void before_forward(size_t batch_size, size_t query_len, size_t kv_len,
+                      size_t kv_size, bool mask_future) {
+    _batch_size = batch_size, _query_len = query_len, _kv_len = kv_len,
+    _kv_size = kv_size, _mask_future = mask_future;
+    if (_token_major_out) {
+      _result->set_shape({_batch_size, _query_len, _nhead, _head_dim});
+    } else {
+      _result->set_shape({_batch_size, _nhead, _query_len, _head_dim});
+    }
+  }
+
+  // Write the result in the [batch_tokens, nhead * head_dim] layout read by
+  // the output linear, in place of a Transform0213OP.
+  void set_token_major_output() { _token_major_out = true; }
+
+  // Read int8 key, value with one scale per head vector, of
+  // [batch_size, kv_head_num, kv_size].
+  void set_kv_cache_scales(const float* k_scale, const float* v_scale) {
+    _k_scale = k_scale;
+    _v_scale = v_scale;
+  }
+
+  // Add a relative position bias of [nhead, 2 * max_len - 1] to the scores,
+  // indexed by the key minus the query position, see
+  // launch_flash_attention. Not owned, it is shared by every layer and step.
+  void set_pos_bias(const T1* pos_bias, int max_len) {
+    _pos_bias = pos_bias;
+    _pos_bias_len = max_len;
+  }
+
+  // Read the keys and values of every batch row at the rows of kv_rows of
+  // [batch_size, kv_size], see launch_flash_attention. Not owned, it is
+  // updated in place as the beams of beam search reorder.
+  void set_kv_rows(const int* kv_rows) { _kv_rows = kv_rows; }
+
+  // Read key and value from a ring of kv_size rows whose last ring_size rows
+  // wrap around, attending to the window positions before every query and
+  // to the sinks only. kv_len of before_forward counts the positions, the
+  // mask is [batch_size, mask_size] by position. See launch_flash_attention.
+  void set_kv_ring(int ring_size, int window, int mask_size) {
+    _ring_size = ring_size;
+    _window = window;
+    _mask_size = mask_size;
+  }
+
+  // Mask the attention among the last tree_len positions with tree_mask of
+  // [batch_size, tree_len, tree_len], eg. the tokens of a token tree, see
+  // launch_flash_attention. Not owned, nullptr turns it off.
+  void set_tree_mask(const unsigned char* tree_mask, int tree_len) {
+    _tree_mask = tree_mask;
+    _tree_len = tree_len;
+  }
+
+  // Keep the keys of the most attention mass in the sink rows of the kv
+  // ring: the softmax accumulates the mass of every row into kv_mass of
+  // [batch_size, kv_head_num, kv_size], and the keys which leave the window
+  // in a forward take the rows of the heavy hitters of less mass, whose
+  // positions are in heavy_pos of [batch_size, kv_head_num, kv_size -
+  // ring_size], see launch_evict_heavy_hitters. Not owned, kv_mass is reset
+  // to 0 and heavy_pos to -1 before every generation. Called before the
+  // context is built.
+  void set_heavy_hitters(int* heavy_pos, float* kv_mass) {
+    _heavy_pos = heavy_pos;
+    _kv_mass = kv_mass;
+#ifdef LIGHTSEQ_cuda
+    if (!_mass_workspace) {
+      _mass_workspace.reset(new Tensor("mass_workspace", g_dtype<float>(),
+                                       _max_batch_tokens * _nhead));
+    }
+#endif
+  }
+
+  void forward() override;
+
+  std::vector<TensorPtr> workspaces() override {
+    return {_workspace, _mass_workspace, _lse, _bw_workspace};
+  }
+
+  void backward() override;
+
+  size_t flops() override {
+    size_t kv_len = _ring_size ? std::min(_kv_len, _kv_size) : _kv_len;
+    return 4 * _batch_size * _nhead * _query_len * kv_len * _head_dim;
+  }
+};
+
+}  // namespace lightseq
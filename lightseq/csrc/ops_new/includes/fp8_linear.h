@@ -0,0 +1,62 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Linear with the weight and the activations in fp8 e4m3 and per-tensor
+// scales, for inference on sm_89 or later GPUs. The input is quantized with
+// the calibrated input_scale into a shared buffer, then multiplied by a
+// cublasLt fp8 gemm, see cublaslt_fp8_gemm.
+//   inp: [batch_tokens, input_size]
+//   weight: [output_size, input_size] of fp8, note it is transposed compared
+//     to the weight of LinearOp
+//   weight_scale, input_scale: [1] of float, the inputs are q * scale
+//   result: [batch_tokens, output_size], or added to residual
+template <typename T1, typename T2>
+class Fp8LinearOp : public Operator {
+ private:
+  size_t _output_size;
+  size_t _input_size;
+  size_t _max_batch_tokens;
+  size_t _batch_tokens;
+  bool _use_residual = false;
+
+  // the fp8 quantized input.
+  TensorPtr _fp8_inp;
+  Variable* _result;
+
+ public:
+  Fp8LinearOp(size_t max_batch_tokens, size_t output_size, size_t input_size);
+
+  virtual ~Fp8LinearOp() {}
+
+  Variable* operator()(Variable* inp, Variable* weight, Variable* weight_scale,
+                       Variable* input_scale);
+  Variable* operator()(Variable* inp, Variable* weight, Variable* weight_scale,
+                       Variable* input_scale, Variable* residual);
+
+  void forward() override;
+
+  std::vector<TensorPtr> workspaces() override { return {_fp8_inp}; }
+
+  void before_forward(size_t batch_tokens) {
+    _batch_tokens = batch_tokens;
+    if (_use_residual) {
+      _result->set_offset(0, {batch_tokens, _output_size});
+    } else {
+      _result->set_shape({batch_tokens, _output_size});
+    }
+  }
+
+  void backward() override {
+    printf("ERROR! Fp8LinearOp can't cal backward()\n");
+    exit(-1);
+  }
+
+  size_t flops() override {
+    return 2 * _batch_tokens * _input_size * _output_size;
+  }
+};
+
+}  // namespace lightseq
@@ -2,34 +2,85 @@
 #include "declaration.h"
 #include "node.h"
 #include "cmath"
+#include "string"
 
 namespace lightseq {
 
+// The rotary frequencies theta^(-2i / head_dim) and how they are stretched
+// past the context length of the pretraining:
+//   linear: the positions are divided by factor.
+//   ntk: theta is scaled by factor^(head_dim / (head_dim - 2)), which keeps
+//     the high frequencies and interpolates the low ones.
+//   yarn: the frequencies of less than beta_slow rotations over
+//     original_max_step are interpolated, the ones of more than beta_fast
+//     kept, with a linear ramp between, and the attention is sharpened by
+//     0.1 * ln(factor) + 1.
+struct RopeScaling {
+  float theta = 10000.f;
+  std::string type;
+  float factor = 1.f;
+  int original_max_step = 0;
+  float beta_fast = 32.f;
+  float beta_slow = 1.f;
+};
+
+// Allocate and fill the [max_step, head_dim / 2] sin and cos tables of
+// RotaryPositionQk in the memory of context_ptr. They only depend on the
+// model config, so the layers of a model share one.
+template <typename T>
+void make_rotary_table(Context* context_ptr, const RopeScaling& scaling,
+                       int max_step, int head_dim, T** sin_ptr, T** cos_ptr);
+
 template <typename T1, typename T2>
 class RotaryPositionQk : public Operator {
  private:
-  T1* _sin_ptr;
-  T1* _cos_ptr;
   size_t _max_step;
   size_t _max_batch_size;
   size_t _batch_size;
   size_t _head_num;
+  size_t _kv_head_num;
   size_t _head_dim;
+  size_t _hidden_size;
   size_t _offset_seq_len;
   size_t _query_len;
+  const int* _offset_seq_len_ptr = nullptr;
+  const int* _page_table = nullptr;
+  int _page_size = 0;
+  const int* _seq_offsets = nullptr;
+  float* _cache_k_scale = nullptr;
+  float* _cache_v_scale = nullptr;
+  // rows of the dense caches and of their ring, see set_kv_ring.
+  size_t _cache_len = 0;
+  int _ring_size = 0;
 
-  T1* _device_sin_ptr;
-  T1* _device_cos_ptr;
+  // built at the first operator() unless given by set_rotary_table.
+  T1* _device_sin_ptr = nullptr;
+  T1* _device_cos_ptr = nullptr;
 
+  // the qkv linear is fused into the op, see the operator() of the weight.
+  bool _fuse_linear = false;
+  // the qkv output of the batches too large for launch_gemv_qkv_rotary.
+  TensorPtr _qkv_out;
   Variable* _result;
+  // training only, see the operator() of the qkv output alone.
+  bool _training = false;
+  Variable* _k_result = nullptr;
+  Variable* _v_result = nullptr;
 
  public:
-  RotaryPositionQk(int max_batch_size, int max_step, int head_num, int head_dim)
+  // The input is [batch_size, query_len, head_num + 2 * kv_head_num,
+  // head_dim], the caches hold kv_head_num heads. kv_head_num = 0 means
+  // head_num. hidden_size is the input size of the qkv linear fused into the
+  // op, 0 when the op only takes the qkv output.
+  RotaryPositionQk(int max_batch_size, int max_step, int head_num, int head_dim,
+                   int kv_head_num = 0, int hidden_size = 0)
       : Operator("RotaryPositionQk"),
         _max_batch_size(max_batch_size),
         _max_step(max_step),
         _head_num(head_num),
-        _head_dim(head_dim) {
+        _kv_head_num(kv_head_num ? kv_head_num : head_num),
+        _head_dim(head_dim),
+        _hidden_size(hidden_size) {
     if (head_dim & 1) {
       printf(
           "Error! head dim should be even number while using RotaryPositionQk "
@@ -37,43 +88,13 @@ class RotaryPositionQk : public Operator {
       exit(0);
     }
 
-    int total_size = max_step * head_dim / 2;
-    _sin_ptr = (T1*)malloc(total_size * sizeof(T1));
-    _cos_ptr = (T1*)malloc(total_size * sizeof(T1));
-
-    for (int i = 0; i < head_dim / 2; i++) {
-      float theta = std::pow(10000, -2. * i / head_dim);
-      for (int j = 0; j < max_step; j++) {
-        T1 sin_val, cos_val;
-        if (std::is_same<T1, float>::value) {
-          sin_val = sin(j * theta), cos_val = cos(j * theta);
-        } else {
-          sin_val = __float2half(sin(j * theta)),
-          cos_val = __float2half(cos(j * theta));
-        }
-        *(_sin_ptr + j * head_dim / 2 + i) =
-            sin_val;  // shape: [max_step, head_dim / 2]
-        *(_cos_ptr + j * head_dim / 2 + i) =
-            cos_val;  // shape: [max_step, head_dim / 2]
-      }
-    }
-
 #ifdef LIGHTSEQ_cuda
-    _device_sin_ptr =
-        (T1*)_context_ptr->allocator()->malloc_mem(total_size * sizeof(T1));
-    _device_cos_ptr =
-        (T1*)_context_ptr->allocator()->malloc_mem(total_size * sizeof(T1));
-    CHECK_GPU_ERROR(cudaMemcpy(_device_sin_ptr, _sin_ptr,
-                               total_size * sizeof(T1), cudaMemcpyDefault));
-    CHECK_GPU_ERROR(cudaMemcpy(_device_cos_ptr, _cos_ptr,
-                               total_size * sizeof(T1), cudaMemcpyDefault));
-    free(_sin_ptr);
-    _sin_ptr = nullptr;
-    free(_cos_ptr);
-    _cos_ptr = nullptr;
-#else
-    _device_sin_ptr = _sin_ptr;
-    _device_cos_ptr = _cos_ptr;
+    if (hidden_size > 0) {
+      _qkv_out.reset(new Tensor(
+          "qkv_out", g_dtype<T1>(),
+          _max_batch_size * _max_step * (_head_num + 2 * _kv_head_num) *
+              _head_dim));
+    }
 #endif
   }
 
@@ -84,14 +105,79 @@ class RotaryPositionQk : public Operator {
     _offset_seq_len = offset_seq_len;
     _query_len = query_len;
     _result->set_shape({_batch_size, _head_num, _query_len, _head_dim});
+    if (_training) {
+      _k_result->set_shape({_batch_size, _kv_head_num, _query_len, _head_dim});
+      _v_result->set_shape({_batch_size, _kv_head_num, _query_len, _head_dim});
+    }
+  }
+
+  // Read offset_seq_len from device memory instead of the value given in
+  // before_forward, which keeps a captured CUDA graph valid across steps.
+  void set_offset_seq_len_ptr(const int* offset_seq_len_ptr) {
+    _offset_seq_len_ptr = offset_seq_len_ptr;
+  }
+
+  // Write k, v into a paged cache of [num_pages, kv_head_num, page_size,
+  // head_dim] through the page table of [max_batch_size, max_pages].
+  void set_page_table(const int* page_table, int page_size) {
+    _page_table = page_table;
+    _page_size = page_size;
+  }
+
+  // The dense caches hold cache_len < max_step rows per sequence, the
+  // positions after the first cache_len - ring_size wrap around the last
+  // ring_size rows, see kv_cache_row.
+  void set_kv_ring(int cache_len, int ring_size) {
+    _cache_len = cache_len;
+    _ring_size = ring_size;
+  }
+
+  // Use the tables of make_rotary_table instead of a table of the op, with
+  // the max_step and head_dim of the op. Called before operator().
+  void set_rotary_table(const T1* sin_ptr, const T1* cos_ptr) {
+    _device_sin_ptr = (T1*)sin_ptr;
+    _device_cos_ptr = (T1*)cos_ptr;
+  }
+
+  // Per-sequence offset_seq_len of [batch_size] on device, used when the
+  // sequences of a batch are at different decoding steps.
+  void set_seq_offsets(const int* seq_offsets) { _seq_offsets = seq_offsets; }
+
+  // Quantize k, v into int8 caches, with the scale of every cached head
+  // vector in cache_k_scale / cache_v_scale, which have the shape of the
+  // caches without head_dim.
+  void set_kv_cache_scales(float* cache_k_scale, float* cache_v_scale) {
+    _cache_k_scale = cache_k_scale;
+    _cache_v_scale = cache_v_scale;
   }
 
   Variable* operator()(Variable* inp_tensor, Variable* cache_k,
                        Variable* cache_v);
+  // Compute the qkv output of inp [batch_size * query_len, hidden_size] and
+  // weight [hidden_size, (head_num + 2 * kv_head_num) * head_dim] first.
+  // Decode batches of a dense cache run launch_gemv_qkv_rotary, which writes
+  // q and the caches without the qkv output.
+  Variable* operator()(Variable* inp, Variable* weight, Variable* cache_k,
+                       Variable* cache_v);
+
+  // For training, the sequences start at position 0 and k, v are outputs of
+  // [batch_size, kv_head_num, query_len, head_dim] instead of caches.
+  // Returns q, k, v.
+  std::tuple<Variable*, Variable*, Variable*> operator()(Variable* inp);
 
   void forward() override;
 
-  void backward() override {}
+  std::vector<TensorPtr> workspaces() override { return {_qkv_out}; }
+
+  void backward() override;
+
+ private:
+  // the unscaled table, for the callers which do not share one.
+  void default_rotary_table() {
+    if (_device_sin_ptr) return;
+    make_rotary_table(_context_ptr, RopeScaling(), _max_step, _head_dim,
+                      &_device_sin_ptr, &_device_cos_ptr);
+  }
 };
 
 }  // namespace lightseq
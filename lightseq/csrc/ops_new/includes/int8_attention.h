@@ -0,0 +1,71 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Self attention of int8 inference, the unfused attention of an int8
+// SDPALayer. query, key and value are quantized with one scale per head,
+// QK^T and PV are int32 imma gemms, see cublaslt_igemm, and the softmax of
+// the dequantized scores is written in int8, of the fixed scale
+// 1 / kQuantRangeI8, as the input of PV, see launch_attn_softmax_i32I_i8O.
+// The keys are padded to a multiple of 4 for the gemms.
+//   query: [batch_size, nhead, query_len, head_dim]
+//   key, value: [batch_size, nhead, kv_size, head_dim], of kv_len keys
+//   mask: [batch_size, kv_size], -inf at the pads, optional
+//   result: [batch_size, nhead, query_len, head_dim]
+template <typename T1, typename T2>
+class Int8AttentionOp : public Operator {
+ private:
+  size_t _max_batch_tokens;
+  size_t _max_seq_len;
+  size_t _nhead;
+  size_t _head_dim;
+
+  size_t _batch_size;
+  size_t _query_len;
+  size_t _kv_len;
+  size_t _kv_size;
+  bool _mask_future;
+
+  // the int8 query, key, transposed value and probabilities, the int32
+  // scores and the scales of the query, key and value heads.
+  TensorPtr _q_i8;
+  TensorPtr _k_i8;
+  TensorPtr _v_i8;
+  TensorPtr _probs_i8;
+  TensorPtr _gemm_out;
+  TensorPtr _head_scales;
+#ifdef LIGHTSEQ_cuda
+  // the alpha 1 and beta 0 of the gemms, device pointers for cublasLt.
+  int32_t* _p_d_gemm_scalars = nullptr;
+#endif
+  Variable* _result;
+
+  size_t kv_pad() const { return (_kv_len + 3) / 4 * 4; }
+
+ public:
+  Int8AttentionOp(size_t max_batch_tokens, size_t max_seq_len, size_t nhead,
+                  size_t head_dim);
+
+  virtual ~Int8AttentionOp();
+
+  Variable* operator()(Variable* query, Variable* key, Variable* value,
+                       Variable* mask = nullptr);
+
+  void before_forward(size_t batch_size, size_t query_len, size_t kv_len,
+                      size_t kv_size, bool mask_future);
+
+  void forward() override;
+
+  std::vector<TensorPtr> workspaces() override {
+    return {_q_i8, _k_i8, _v_i8, _probs_i8, _gemm_out, _head_scales};
+  }
+
+  void backward() override {
+    printf("ERROR! Int8AttentionOp can't cal backward()\n");
+    exit(-1);
+  }
+};
+
+}  // namespace lightseq
@@ -0,0 +1,94 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Linear with an int8 weight and int8 activations, for inference. The input
+// is quantized per token with its absmax in one pass, multiplied by the int8
+// gemm, and the int32 result is dequantized with the bias and the activation
+// or the residual fused.
+// On cuda the gemm is the int32 cublasLt imma gemm, see cublaslt_igemm, which
+// needs the input and output sizes to be multiples of 4.
+// On x86 the input is shifted to uint8 for the gemm of mkl, AVX-512 VNNI or
+// AMX on the hosts which have them, and the weight is packed for the gemm
+// once, at the first forward after it is loaded. On arm the gemm is the NEON
+// int8 dot product (SDOT) of kernels/arm on the weight as it is.
+//   inp: [batch_tokens, input_size]
+//   qweight: [output_size, input_size] of int8, the weight is qweight * scale
+//   scale: [output_size] of float, one per output channel
+//   bias: [output_size], optional, may be nullptr with a residual
+//   result: [batch_tokens, output_size], or added to residual
+template <typename T1, typename T2>
+class Int8LinearOp : public Operator {
+ private:
+  size_t _output_size;
+  size_t _input_size;
+  size_t _max_batch_tokens;
+  size_t _batch_tokens;
+  bool _use_residual = false;
+  // "relu" or "gelu", empty for none.
+  std::string _activation_fn;
+
+  // the uint8 input, its scales and the int32 gemm output.
+  TensorPtr _quant_inp;
+  TensorPtr _inp_scales;
+  TensorPtr _gemm_out;
+  // the packed weight and its shift compensation, of the weight at
+  // _packed_src.
+  std::vector<char> _packed_weight;
+  std::vector<int32_t> _shift_comp;
+  const int8_t* _packed_src = nullptr;
+  bool _use_bias = true;
+#ifdef LIGHTSEQ_cuda
+  // the alpha 1 and beta 0 of the gemm, device pointers for cublasLt.
+  int32_t* _p_d_gemm_scalars = nullptr;
+#endif
+  Variable* _result;
+
+  void pack_weight(const int8_t* qweight);
+
+ public:
+  Int8LinearOp(size_t max_batch_tokens, size_t output_size, size_t input_size);
+
+  virtual ~Int8LinearOp();
+
+  Variable* operator()(Variable* inp, Variable* qweight, Variable* scale);
+  Variable* operator()(Variable* inp, Variable* qweight, Variable* scale,
+                       Variable* bias);
+  Variable* operator()(Variable* inp, Variable* qweight, Variable* scale,
+                       Variable* bias, Variable* residual);
+  Variable* operator()(Variable* inp, Variable* qweight, Variable* scale,
+                       Variable* bias, std::string activation_fn);
+
+  void forward() override;
+
+  std::vector<TensorPtr> workspaces() override {
+    return {_quant_inp, _inp_scales, _gemm_out};
+  }
+
+  // Quantize weight, the [input_size, output_size] row major kernel of an
+  // inference LinearOp, into qweight and scale, in memory of the allocator of
+  // the context. cuda only.
+  void load_weight(Variable* qweight, Variable* scale, const T1* weight);
+
+  void before_forward(size_t batch_tokens) {
+    _batch_tokens = batch_tokens;
+    if (_use_residual) {
+      _result->set_offset(0, {batch_tokens, _output_size});
+    } else {
+      _result->set_shape({batch_tokens, _output_size});
+    }
+  }
+
+  void backward() override {
+    printf("ERROR! Int8LinearOp can't cal backward()\n");
+    exit(-1);
+  }
+
+  size_t flops() override {
+    return 2 * _batch_tokens * _input_size * _output_size;
+  }
+};
+
+}  // namespace lightseq
@@ -12,6 +12,9 @@ class LaunchEncEmbOp : public Operator {
   int _pad_id;
   size_t _hidden_dim;
   size_t _multilg_type;
+  // the layer normalization of the embedding is fused, see
+  // launch_enc_emb_ln.
+  bool _fuse_ln;
 
   size_t _batch_size;
   size_t _seq_len;
@@ -21,12 +24,19 @@ class LaunchEncEmbOp : public Operator {
 
  public:
   LaunchEncEmbOp(size_t max_batch_tokens, int pad_id, size_t hidden_dim,
-                 size_t multilg_type)
+                 size_t multilg_type, bool fuse_ln = false)
       : Operator("LaunchEncEmbOp"),
         _max_batch_tokens(max_batch_tokens),
         _pad_id(pad_id),
         _hidden_dim(hidden_dim),
-        _multilg_type(multilg_type) {}
+        _multilg_type(multilg_type),
+        _fuse_ln(fuse_ln) {
+    if (fuse_ln && multilg_type != 0) {
+      printf("Error! LaunchEncEmbOp fuses the layer norm without the "
+             "multilingual embeddings only.\n");
+      exit(-1);
+    }
+  }
 
   virtual ~LaunchEncEmbOp() {}
 
@@ -34,7 +44,9 @@ class LaunchEncEmbOp : public Operator {
                                               Variable* token_emb,
                                               Variable* pos_emb,
                                               Variable* lang_emb,
-                                              Variable* lang_id);
+                                              Variable* lang_id,
+                                              Variable* ln_gamma = nullptr,
+                                              Variable* ln_betta = nullptr);
 
   void before_forward(size_t batch_size, size_t seq_len) {
     _batch_size = batch_size, _seq_len = seq_len;
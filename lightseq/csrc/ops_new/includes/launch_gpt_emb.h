@@ -19,6 +19,7 @@ class LaunchGptEmbOp : public Operator {
   int _beam_size;
   int _offset;
   int _max_batch_size;
+  const int* _positions = nullptr;
 
   Variable* _result;
   Variable* _pad_mask;
@@ -48,6 +49,11 @@ class LaunchGptEmbOp : public Operator {
     _left_pad_len->set_shape({_batch_size, size_t(_beam_size)});
   }
 
+  // Take the position of every token from positions of [batch_size,
+  // beam_size, max_step], see launch_gpt_embedding. Not owned, nullptr
+  // counts the positions after the left padding.
+  void set_positions(const int* positions) { _positions = positions; }
+
   void forward() override;
 
   void backward() override {
@@ -19,11 +19,17 @@ class LaunchLlamaEmbOp : public Operator {
   int _beam_size;
   int _offset;
   int _max_batch_size;
+  const int* _offset_ptr = nullptr;
+  // int8 token embedding with a scale per token, see
+  // launch_llama_embedding_i8.
+  bool _quant_emb = false;
 
   Variable* _result;
   Variable* _pad_mask;
   Variable* _left_pad_len;
 
+  std::tuple<Variable*, Variable*, Variable*> create_outputs();
+
  public:
   LaunchLlamaEmbOp(size_t max_batch_tokens, int max_step, int max_batch_size,
                    int beam_size, int pad_id, size_t hidden_dim)
@@ -39,6 +45,9 @@ class LaunchLlamaEmbOp : public Operator {
 
   std::tuple<Variable*, Variable*, Variable*> operator()(Variable* inp_tokens,
                                                          Variable* token_emb);
+  // token_emb is of int8, with the scale of every token in token_emb_scale.
+  std::tuple<Variable*, Variable*, Variable*> operator()(
+      Variable* inp_tokens, Variable* token_emb, Variable* token_emb_scale);
 
   void before_forward(size_t batch_size, size_t seq_len, int offset) {
     _batch_size = batch_size, _seq_len = seq_len, _offset = offset;
@@ -47,6 +56,10 @@ class LaunchLlamaEmbOp : public Operator {
     _left_pad_len->set_shape({_batch_size, size_t(_beam_size)});
   }
 
+  // Read the step offset from device memory instead of the value given in
+  // before_forward, which keeps a captured CUDA graph valid across steps.
+  void set_offset_ptr(const int* offset_ptr) { _offset_ptr = offset_ptr; }
+
   void forward() override;
 
   void backward() override {
@@ -15,6 +15,8 @@ class LayerNormalizeOp : public Operator {
 
   TensorPtr means_;
   TensorPtr vars_;
+  // partial dgamma / dbetta of the fused backward
+  TensorPtr _bw_workspace;
 
   Variable* _result;
 
@@ -28,6 +30,10 @@ class LayerNormalizeOp : public Operator {
     vars_.reset(new Tensor("vars", g_dtype<T1>(), max_batch_tokens));
     if (use_mean)
       means_.reset(new Tensor("means", g_dtype<T1>(), max_batch_tokens));
+#ifdef LIGHTSEQ_cuda
+    _bw_workspace.reset(new Tensor("bw_workspace", g_dtype<float>(),
+                                   cuda::ln_bw_workspace_size(hidden_dim)));
+#endif
   }
 
   Variable* operator()(Variable* inp, Variable* gamma, Variable* betta);
@@ -38,6 +44,10 @@ class LayerNormalizeOp : public Operator {
 
   void forward() override;
 
+  std::vector<TensorPtr> workspaces() override {
+    return {means_, vars_, _bw_workspace};
+  }
+
   void backward() override;
 };
 
@@ -4,6 +4,19 @@
 
 namespace lightseq {
 
+// The low rank adapters of a LinearOp, see LoraAdapterCache. Row r of the
+// batch adds scales[s] * inp * A^T * B of the adapter in slot s =
+// row_slots[r], nothing when it is -1.
+template <typename T>
+struct LoraTarget {
+  const T* const* a_ptrs = nullptr;  // [num_slots] of [rank, input_size]
+  const T* const* b_ptrs = nullptr;  // [num_slots] of [rank, output_size]
+  const float* scales = nullptr;     // [num_slots]
+  const int* row_slots = nullptr;    // [max_batch_tokens]
+  float* workspace = nullptr;        // [max_batch_tokens, rank]
+  int rank = 0;
+};
+
 template <typename T1, typename T2>
 class LinearOp : public Operator {
  private:
@@ -18,8 +31,36 @@ class LinearOp : public Operator {
   MATRIX_OP _opA;
   MATRIX_OP _opB;
   bool _use_residual = false;
+  // "relu", "gelu" or "none" fused with the bias into the gemm, inference
+  // only.
+  std::string _activation_fn;
 
   Variable* _result;
+  // not owned, nullptr without adapters.
+  const LoraTarget<T1>* _lora = nullptr;
+  // the gemm is run in chunks by the AllReduceOp behind, see
+  // AllReduceOp::overlap_linear.
+  bool _deferred = false;
+
+  // fp8 training, see Context::set_fp8_training(). The scales of the input,
+  // the weight and the output grad: [3], and their amax histories:
+  // [3, history_len].
+  bool _fp8 = false;
+  int _fp8_history_len = 0;
+  int _fp8_fw_step = 0;
+  int _fp8_bw_step = 0;
+  float* _p_d_fp8_scales = nullptr;
+  float* _p_d_amax_history = nullptr;
+  TensorPtr _fp8_inp;
+  TensorPtr _fp8_inp_t;
+  // the weight in forward, its transpose in backward.
+  TensorPtr _fp8_weight;
+  TensorPtr _fp8_grad;
+  TensorPtr _fp8_grad_t;
+
+  void init_fp8();
+  void fp8_forward();
+  void fp8_backward();
 
 #ifdef PYBIND_INTERFACE
 #define weight_op MATRIX_OP::Transpose
@@ -39,15 +80,47 @@ class LinearOp : public Operator {
         _opB(opB),
         _gemm_algos(std::array<int, 3>({99, 99, 99})),
         _alpha(alpha),
-        _beta(beta) {}
+        _beta(beta) {
+    init_fp8();
+  }
 
-  ~LinearOp() {}
+  ~LinearOp();
 
   Variable* operator()(Variable* inp, Variable* weight);
   Variable* operator()(Variable* inp, Variable* weight, Variable* residual);
+  // act(inp * weight + bias) with the cublasLt epilogue, in place of a
+  // following BiasActDropoutOp when there is no dropout. activation_fn
+  // "none" adds the bias only.
+  Variable* operator()(Variable* inp, Variable* weight, Variable* bias,
+                       std::string activation_fn);
 
   void forward() override;
 
+  std::vector<TensorPtr> workspaces() override {
+    return {_fp8_inp, _fp8_inp_t, _fp8_weight, _fp8_grad, _fp8_grad_t};
+  }
+
+  // Add the low rank adapters of lora to the output, inference only and not
+  // with a fused activation. nullptr removes them.
+  void set_lora(const LoraTarget<T1>* lora) {
+    if (lora && !_activation_fn.empty()) {
+      printf("Error! LinearOp with fused activation can't add lora\n");
+      exit(-1);
+    }
+    _lora = lora;
+  }
+
+  // The forward of the tokens [begin, end) of the batch, on the context
+  // stream. With deferred, forward leaves the whole gemm to the calls of
+  // it. Not with a fused activation or fp8.
+  void forward_rows(size_t begin, size_t end);
+  void set_deferred(bool deferred) { _deferred = deferred; }
+  bool row_chunkable() const { return _activation_fn.empty() && !_fp8; }
+
+  // The GraphFusion rule "LinearOp+BiasActDropoutOp": takes over a following
+  // BiasActDropoutOp without dropout, as the fused operator() above.
+  bool fuse_bias_act();
+
   void before_forward(size_t batch_tokens) {
     _batch_tokens = batch_tokens;
     if (_use_residual) {
@@ -60,6 +133,10 @@ class LinearOp : public Operator {
   void backward() override;
 
   void before_backward() {}
+
+  size_t flops() override {
+    return 2 * _batch_tokens * _input_size * _output_size;
+  }
 };
 
 }  // namespace lightseq
@@ -0,0 +1,76 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Apply the logits processors of LogitsProcessConfig in place to the logits
+// of the next token, reading the tokens of the alive sequences on the
+// device, before SamplingOp or BeamSearchTopOp. The output is the input,
+// with nothing launched while no processor is set.
+//
+// A token automaton constrains the generation to a grammar, see
+// set_automaton. Its state is kept and advanced on the device, so it is only
+// correct when the rows keep their sequence from step to step, ie. sampling.
+template <typename T>
+class LogitsProcessOp : public Operator {
+ private:
+  int _max_rows;
+  int _max_step;
+  int _max_thread_per_block;
+  int _trg_vocab_size;
+
+  int _rows;
+  int _prompt_len;
+  int _seq_len;
+
+  bool _has_processors = false;
+  bool _has_automaton = false;
+#ifdef LIGHTSEQ_cuda
+  cuda::LogitsProcessParams _params = {1.f,     0.f,     0.f,     0,      0,
+                                       nullptr, nullptr, nullptr, nullptr,
+                                       nullptr};
+  // the token ids of the bad words then their offsets
+  int* _p_d_bad_words = nullptr;
+  int _num_bad_word_ids = 0;
+  // the allowed bitsets, the transition offsets, tokens and next states,
+  // back to back
+  int* _p_d_automaton = nullptr;
+  int* _p_d_states = nullptr;  // [max_rows]
+#endif
+
+  Variable* _result;
+
+ public:
+  LogitsProcessOp(int max_rows, int max_step, int max_thread_per_block,
+                  int trg_vocab_size)
+      : Operator("LogitsProcessOp"),
+        _max_rows(max_rows),
+        _max_step(max_step),
+        _max_thread_per_block(max_thread_per_block),
+        _trg_vocab_size(trg_vocab_size) {}
+
+  virtual ~LogitsProcessOp();
+
+  // logits: [rows, trg_vocab_size], alive_seq: [rows, max_step]
+  Variable* operator()(Variable* logits, Variable* alive_seq);
+
+  // rows sequences of seq_len tokens, the prompt_len first ones the prompt.
+  void before_forward(int rows, int prompt_len, int seq_len) {
+    _rows = rows;
+    _prompt_len = prompt_len;
+    _seq_len = seq_len;
+  }
+
+  void forward() override;
+
+  void backward() override {}
+
+  void set_config(const cuda::LogitsProcessConfig& config);
+
+  // Allow only the tokens of the automaton states, see cuda::TokenAutomaton.
+  // An automaton without states turns it off.
+  void set_automaton(const cuda::TokenAutomaton& automaton);
+};
+
+}  // namespace lightseq
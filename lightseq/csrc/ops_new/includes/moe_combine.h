@@ -0,0 +1,57 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+#include "moe_dispatch.h"
+
+namespace lightseq {
+
+// Gather the expert outputs back to their tokens, weighted by the scores of
+// the routing, and add them to residual in place. The dropped routes of a
+// token add nothing, see MoeDispatchOp.
+//   inp: [expert_num, capacity, hidden_dim]
+//   bias: [expert_num, hidden_dim], optional
+//   residual, result: [batch_tokens, hidden_dim]
+template <typename T1, typename T2>
+class MoeCombineOp : public Operator {
+ private:
+  size_t _max_batch_tokens;
+  size_t _hidden_dim;
+  size_t _expert_num;
+  size_t _topk;
+  bool _use_bias = false;
+
+  size_t _batch_tokens;
+  size_t _capacity;
+
+  Variable* _result;
+
+ public:
+  MoeCombineOp(size_t max_batch_tokens, size_t hidden_dim, size_t expert_num,
+               size_t topk)
+      : Operator("MoeCombineOp"),
+        _max_batch_tokens(max_batch_tokens),
+        _hidden_dim(hidden_dim),
+        _expert_num(expert_num),
+        _topk(topk) {}
+
+  virtual ~MoeCombineOp() {}
+
+  Variable* operator()(Variable* inp, Variable* routing, Variable* residual);
+  Variable* operator()(Variable* inp, Variable* routing, Variable* bias,
+                       Variable* residual);
+
+  void forward() override;
+
+  void before_forward(size_t batch_tokens, size_t capacity) {
+    _batch_tokens = batch_tokens;
+    _capacity = capacity;
+    _result->set_offset(0, {batch_tokens, _hidden_dim});
+  }
+
+  void backward() override {
+    printf("ERROR! MoeCombineOp can't cal backward()\n");
+    exit(-1);
+  }
+};
+
+}  // namespace lightseq
@@ -0,0 +1,103 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// The routing of the tokens of a batch to the experts, in one int buffer
+// of size ints, see moe_kernels.h:
+//   score, expert, slot: [topk, max_batch_tokens], score of float
+//   expert_rows: [expert_num], the used slots of every expert
+//   tile_offset: [expert_num + 1], the workspace of the grouped gemms
+//   workspace: the workspace of the router
+struct MoeRouting {
+  float* score;
+  int* expert;
+  int* slot;
+  int* expert_rows;
+  int* tile_offset;
+  int* workspace;
+
+  MoeRouting(int* buffer, size_t max_batch_tokens, size_t topk,
+             size_t expert_num) {
+    size_t routes = max_batch_tokens * topk;
+    score = reinterpret_cast<float*>(buffer);
+    expert = buffer + routes;
+    slot = expert + routes;
+    expert_rows = slot + routes;
+    tile_offset = expert_rows + expert_num;
+    workspace = tile_offset + expert_num + 1;
+  }
+
+  static size_t size(size_t max_batch_tokens, size_t topk,
+                     size_t expert_num);
+};
+
+// Route every token to its experts and copy it to their slots, the input of
+// MoeExpertLinearOp:
+//   soft gate: the topk experts of the softmax of gate_logits, [batch_tokens,
+//     expert_num], with the scores renormalized over them when topk > 1.
+//   hard gate: the expert of its sequence, see set_hard_gates, with score 1.
+// An expert has capacity slots, capacity_factor * topk * batch_tokens /
+// expert_num of them, the tokens beyond are dropped and keep their residual
+// only. 0 never drops: every expert gets batch_tokens slots.
+//   inp: [batch_tokens, hidden_dim]
+//   result: [expert_num, capacity, hidden_dim]
+//   routing: see MoeRouting
+template <typename T1, typename T2>
+class MoeDispatchOp : public Operator {
+ private:
+  size_t _max_batch_tokens;
+  size_t _hidden_dim;
+  size_t _expert_num;
+  size_t _topk;
+  float _capacity_factor;
+  bool _hard_gate = false;
+  const int* _hard_gates = nullptr;
+
+  size_t _batch_size;
+  size_t _seq_len;
+  size_t _batch_tokens;
+  size_t _capacity;
+
+  Variable* _result;
+  Variable* _routing;
+
+ public:
+  MoeDispatchOp(size_t max_batch_tokens, size_t hidden_dim, size_t expert_num,
+                size_t topk, float capacity_factor = 0.f);
+
+  virtual ~MoeDispatchOp() {}
+
+  // soft gate.
+  std::tuple<Variable*, Variable*> operator()(Variable* inp,
+                                              Variable* gate_logits);
+  // hard gate, of topk 1.
+  std::tuple<Variable*, Variable*> operator()(Variable* inp);
+
+  // The [batch_size] expert of every sequence of the hard gate, a device
+  // array which the forward reads.
+  void set_hard_gates(const int* hard_gates) { _hard_gates = hard_gates; }
+
+  // The slots of every expert for batch_tokens tokens.
+  size_t capacity(size_t batch_tokens) const;
+
+  size_t topk() const { return _hard_gate ? 1 : _topk; }
+
+  void forward() override;
+
+  void before_forward(size_t batch_size, size_t seq_len) {
+    _batch_size = batch_size;
+    _seq_len = seq_len;
+    _batch_tokens = batch_size * seq_len;
+    _capacity = capacity(_batch_tokens);
+    _result->set_shape({_expert_num, _capacity, _hidden_dim});
+  }
+
+  void backward() override {
+    printf("ERROR! MoeDispatchOp can't cal backward()\n");
+    exit(-1);
+  }
+};
+
+}  // namespace lightseq
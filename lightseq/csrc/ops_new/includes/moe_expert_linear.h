@@ -0,0 +1,69 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+#include "moe_dispatch.h"
+
+namespace lightseq {
+
+// The linear of every expert on its used slots of the output of
+// MoeDispatchOp, an expert without tokens launches nothing, see
+// launch_moe_grouped_gemm. activation_fn is "", "relu", "gelu", or "silu"
+// for a [gate, up] weight of 2 * output_size columns whose
+// silu(gate) * up is the result.
+//   inp: [expert_num, capacity, input_size]
+//   weight: [expert_num, input_size, output_size], of 2 * output_size for
+//     silu
+//   bias: [expert_num, output_size], optional, not supported by silu
+//   result: [expert_num, capacity, output_size]
+template <typename T1, typename T2>
+class MoeExpertLinearOp : public Operator {
+ private:
+  size_t _max_batch_tokens;
+  size_t _max_capacity;
+  size_t _expert_num;
+  size_t _topk;
+  size_t _output_size;
+  size_t _input_size;
+  std::string _activation_fn;
+  bool _use_bias = false;
+
+  size_t _batch_tokens;
+  size_t _capacity;
+
+  // the [gate, up] output of silu.
+  TensorPtr _gemm_out;
+  Variable* _result;
+
+ public:
+  MoeExpertLinearOp(size_t max_batch_tokens, size_t max_capacity,
+                    size_t expert_num, size_t topk, size_t output_size,
+                    size_t input_size, std::string activation_fn = "");
+
+  virtual ~MoeExpertLinearOp() {}
+
+  Variable* operator()(Variable* inp, Variable* routing, Variable* weight);
+  Variable* operator()(Variable* inp, Variable* routing, Variable* weight,
+                       Variable* bias);
+
+  void forward() override;
+
+  std::vector<TensorPtr> workspaces() override { return {_gemm_out}; }
+
+  void before_forward(size_t batch_tokens, size_t capacity) {
+    _batch_tokens = batch_tokens;
+    _capacity = capacity;
+    _result->set_shape({_expert_num, capacity, _output_size});
+  }
+
+  void backward() override {
+    printf("ERROR! MoeExpertLinearOp can't cal backward()\n");
+    exit(-1);
+  }
+
+  size_t flops() override {
+    size_t gemm_size = _activation_fn == "silu" ? 2 : 1;
+    return 2 * _topk * _batch_tokens * _input_size * _output_size * gemm_size;
+  }
+};
+
+}  // namespace lightseq
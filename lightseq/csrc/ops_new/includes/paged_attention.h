@@ -0,0 +1,92 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Scaled dot product attention over a kv cache stored in fixed-size pages,
+// addressed through a per-sequence page table.
+//   query: [batch_size, nhead, query_len, head_dim]
+//   cache_k, cache_v: [num_pages, kv_head_num, page_size, head_dim], of T1,
+//     or int8 with the scales set by set_kv_cache_scales
+//   pad_mask: [batch_size, max_step]
+//   result: [batch_size, nhead, query_len, head_dim]
+template <typename T1, typename T2>
+class PagedAttentionOp : public Operator {
+ private:
+  size_t _max_batch_tokens;
+  size_t _max_step;
+  size_t _nhead;
+  size_t _head_dim;
+  size_t _kv_head_num;
+  int _page_size;
+  int _max_pages;
+
+  size_t _batch_size;
+  size_t _query_len;
+  size_t _offset_seq_len;
+  const int* _offset_seq_len_ptr = nullptr;
+  const int* _page_table = nullptr;
+  const int* _seq_offsets = nullptr;
+  const float* _cache_k_scale = nullptr;
+  const float* _cache_v_scale = nullptr;
+
+  Variable* _result;
+
+ public:
+  PagedAttentionOp(size_t max_batch_tokens, size_t max_step, size_t nhead,
+                   size_t head_dim, int page_size, size_t kv_head_num = 0)
+      : Operator("PagedAttentionOp"),
+        _max_batch_tokens(max_batch_tokens),
+        _max_step(max_step),
+        _nhead(nhead),
+        _head_dim(head_dim),
+        _kv_head_num(kv_head_num ? kv_head_num : nhead),
+        _page_size(page_size),
+        _max_pages((max_step + page_size - 1) / page_size) {}
+
+  virtual ~PagedAttentionOp() {}
+
+  Variable* operator()(Variable* query, Variable* cache_k, Variable* cache_v,
+                       Variable* pad_mask);
+
+  void before_forward(size_t batch_size, size_t query_len,
+                      size_t offset_seq_len) {
+    _batch_size = batch_size, _query_len = query_len,
+    _offset_seq_len = offset_seq_len;
+    _result->set_shape({_batch_size, _nhead, _query_len, _head_dim});
+  }
+
+  // [max_batch_size, max_pages] on device, filled by the model.
+  void set_page_table(const int* page_table) { _page_table = page_table; }
+
+  void set_offset_seq_len_ptr(const int* offset_seq_len_ptr) {
+    _offset_seq_len_ptr = offset_seq_len_ptr;
+  }
+
+  // Per-sequence offset_seq_len of [batch_size] on device. The sequences
+  // are then expected to carry no padding, and pad_mask is not read.
+  void set_seq_offsets(const int* seq_offsets) { _seq_offsets = seq_offsets; }
+
+  // Read int8 caches, see RotaryPositionQk::set_kv_cache_scales.
+  void set_kv_cache_scales(const float* cache_k_scale,
+                           const float* cache_v_scale) {
+    _cache_k_scale = cache_k_scale;
+    _cache_v_scale = cache_v_scale;
+  }
+
+  void forward() override;
+
+  void backward() override {
+    printf("ERROR! PagedAttentionOp can't cal backward()\n");
+    exit(-1);
+  }
+
+  size_t flops() override {
+    // qk and pv products over the average causal kv length.
+    return 4 * _batch_size * _nhead * _query_len * _head_dim *
+           (_offset_seq_len + (_query_len + 1) / 2);
+  }
+};
+
+}  // namespace lightseq
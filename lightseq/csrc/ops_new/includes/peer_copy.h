@@ -0,0 +1,56 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Copy the input into a fixed Variable of another context, usually on
+// another device, at a stage boundary of pipeline parallelism. The stream of
+// the destination context waits for the copy, the caller must order it after
+// the previous reads of the same destination. The output is an empty Variable
+// which only orders the op in its layer, the destination is not linked into
+// the graph of this context.
+template <typename T1, typename T2>
+class PeerCopyOp : public Operator {
+ private:
+  size_t _max_ele_num;
+  size_t _ele_num = 0;
+  size_t _dst_offset = 0;
+
+  Variable* _dst = nullptr;
+  Context* _dst_context = nullptr;
+  Variable* _result;
+
+#ifdef LIGHTSEQ_cuda
+  cudaEvent_t _copied = nullptr;
+#endif
+
+ public:
+  PeerCopyOp(size_t max_ele_num)
+      : Operator("PeerCopyOp"), _max_ele_num(max_ele_num) {}
+
+  ~PeerCopyOp();
+
+  // dst must hold max_ele_num elements past any dst_offset used.
+  Variable* operator()(Variable* inp, Variable* dst, Context* dst_context);
+
+  void forward() override;
+
+  // Copy ele_num elements to dst_offset of the destination.
+  void before_forward(size_t ele_num, size_t dst_offset) {
+    if (dst_offset + ele_num > _max_ele_num) {
+      printf("Error! PeerCopyOp copies %zu elements to offset %zu of %zu\n",
+             ele_num, dst_offset, _max_ele_num);
+      exit(-1);
+    }
+    _ele_num = ele_num;
+    _dst_offset = dst_offset;
+  }
+
+  void backward() override {
+    printf("ERROR! PeerCopyOp can't cal backward()\n");
+    exit(-1);
+  }
+};
+
+}  // namespace lightseq
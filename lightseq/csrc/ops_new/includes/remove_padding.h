@@ -0,0 +1,105 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Pack the non-padding tokens of a padded [batch_size, seq_len, hidden_dim]
+// batch into [valid_tokens, hidden_dim], for the varlen execution of the
+// encoders, see launch_varlen_offsets. The packing of a batch is computed
+// from its tokens by set_offsets, before before_forward of the ops which
+// work on the packed tokens.
+template <typename T1, typename T2>
+class RemovePaddingOp : public Operator {
+ private:
+  size_t _max_batch_tokens;
+  size_t _hidden_dim;
+  int _padding_id;
+  size_t _valid_tokens;
+
+  int* _cu_seqlens;
+  int* _packed_to_padded;
+  // the host staging of set_packed_offsets.
+  std::vector<int> _h_packed_to_padded;
+
+  Variable* _result;
+
+ public:
+  RemovePaddingOp(size_t max_batch_tokens, size_t hidden_dim, int padding_id);
+
+  virtual ~RemovePaddingOp() {}
+
+  Variable* operator()(Variable* inp);
+
+  // Pack the tokens [batch_size, seq_len] on device, returns the number of
+  // packed tokens. Synchronizes the stream.
+  int set_offsets(const int* tokens, int batch_size, int seq_len);
+
+  // The packing of sequences given packed already, sequence i being the
+  // tokens [offsets[i], offsets[i + 1]) with offsets[0] == 0, padded to
+  // seq_len before the ops which run on the padded batch. offsets is on
+  // host, no synchronization.
+  void set_packed_offsets(const int* offsets, int batch_size, int seq_len);
+
+  // [batch_size + 1] and [valid_tokens] on device, see
+  // launch_varlen_offsets.
+  const int* cu_seqlens() const { return _cu_seqlens; }
+  const int* packed_to_padded() const { return _packed_to_padded; }
+
+  void before_forward(size_t valid_tokens) {
+    _valid_tokens = valid_tokens;
+    _result->set_shape({_valid_tokens, _hidden_dim});
+  }
+
+  void forward() override;
+
+  void backward() override {
+    printf("ERROR! RemovePaddingOp can't cal backward()\n");
+    exit(-1);
+  }
+};
+
+// The inverse of RemovePaddingOp, the padding tokens are zeros.
+template <typename T1, typename T2>
+class RebuildPaddingOp : public Operator {
+ private:
+  size_t _max_batch_tokens;
+  size_t _hidden_dim;
+  size_t _valid_tokens;
+  size_t _batch_tokens;
+
+  const int* _packed_to_padded = nullptr;
+
+  Variable* _result;
+
+ public:
+  RebuildPaddingOp(size_t max_batch_tokens, size_t hidden_dim)
+      : Operator("RebuildPaddingOp"),
+        _max_batch_tokens(max_batch_tokens),
+        _hidden_dim(hidden_dim) {}
+
+  virtual ~RebuildPaddingOp() {}
+
+  Variable* operator()(Variable* inp);
+
+  // See RemovePaddingOp::packed_to_padded.
+  void set_packed_to_padded(const int* packed_to_padded) {
+    _packed_to_padded = packed_to_padded;
+  }
+
+  void before_forward(size_t valid_tokens, size_t batch_size,
+                      size_t seq_len) {
+    _valid_tokens = valid_tokens;
+    _batch_tokens = batch_size * seq_len;
+    _result->set_shape({batch_size, seq_len, _hidden_dim});
+  }
+
+  void forward() override;
+
+  void backward() override {
+    printf("ERROR! RebuildPaddingOp can't cal backward()\n");
+    exit(-1);
+  }
+};
+
+}  // namespace lightseq
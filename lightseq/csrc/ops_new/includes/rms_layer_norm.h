@@ -16,10 +16,19 @@ class RMSLayerNormalizeOp : public Operator {
   bool _use_residual;
 
   TensorPtr _rms_vars;
+  // partial dscale of the fused backward
+  TensorPtr _bw_workspace;
   Variable* _result;
   Variable* _residual;
 
+  // see set_input_rows.
+  size_t _inp_row_stride = 1;
+  size_t _inp_row_offset = 0;
+  const int* _inp_rows = nullptr;
+
  public:
+  // The second output is the residual for the linear after the norm, it is
+  // the input itself and the linear accumulates onto it in place.
   RMSLayerNormalizeOp(size_t max_batch_tokens, size_t hidden_dim,
                       bool use_residual = true, float epsilon = 1e-6)
       : Operator("RMSLayerNormalizeOp"),
@@ -28,6 +37,10 @@ class RMSLayerNormalizeOp : public Operator {
         _use_residual(use_residual),
         _epsilon(epsilon) {
     _rms_vars.reset(new Tensor("rms_vars", g_dtype<T1>(), max_batch_tokens));
+#ifdef LIGHTSEQ_cuda
+    _bw_workspace.reset(new Tensor("bw_workspace", g_dtype<float>(),
+                                   cuda::ln_bw_workspace_size(hidden_dim)));
+#endif
   }
 
   std::tuple<Variable*, Variable*> operator()(Variable* inp, Variable* scale);
@@ -36,9 +49,20 @@ class RMSLayerNormalizeOp : public Operator {
 
   void before_forward(size_t batch_size, size_t seq_len);
 
+  // Normalize only some rows of the input, which the next forward reads in
+  // place: output row r is input row inp_rows[r] if inp_rows, a device
+  // array, else input row r * row_stride + row_offset. Cleared by
+  // before_forward.
+  void set_input_rows(size_t row_stride, size_t row_offset,
+                      const int* inp_rows = nullptr);
+
   void forward() override;
 
-  void backward() override {}
+  std::vector<TensorPtr> workspaces() override {
+    return {_rms_vars, _bw_workspace};
+  }
+
+  void backward() override;
 };
 
 }  // namespace lightseq
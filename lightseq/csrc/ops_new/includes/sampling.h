@@ -1,4 +1,6 @@
 #pragma once
+#include "random"
+
 #include "declaration.h"
 #include "node.h"
 
@@ -15,6 +17,10 @@ class SamplingOp : public Operator {
   int _topk;
   float _topp;
   int _eos_id;
+  // see set_sampling_params
+  float _temperature = 1.f;
+  float _repetition_penalty = 1.f;
+  float _min_p = 0.f;
   bool _has_logits_bias;
   int* _p_d_unfinished;
 
@@ -24,10 +30,32 @@ class SamplingOp : public Operator {
   int _prompt_len;
   int _cur_step;
 
-  int _h_unfinished;
+  // [max_step] pinned, whether any sequence is unfinished after each step,
+  // copied asynchronously and only waited for every _stop_check_interval
+  // steps.
+  int* _h_unfinished = nullptr;
+  int _stop_check_interval = 1;
+  // the flags of the steps before _checked_steps have arrived on the host,
+  // the ones before _scanned_steps are known to be non zero.
+  int _num_steps = 0;
+  int _checked_steps = 0;
+  int _scanned_steps = 0;
+  // see set_step_offset_ptr
+  const int* _step_offset_ptr = nullptr;
 
 #ifdef LIGHTSEQ_cuda
   curandState* _p_d_curandstate;  //[batch_size]
+  // see set_generation_configs, [max_batch_size]
+  cuda::RowSamplingParams* _p_d_row_params;
+  int _num_row_params = 0;
+  // [max_step] the unfinished flag of every step by the position of its
+  // last token, see set_step_offset_ptr.
+  int* _p_d_step_unfinished;
+#else
+  std::vector<int> _host_unfinished;
+  // one uniform draw per sequence and step.
+  std::mt19937 _rng;
+  std::vector<float> _random_x;
 #endif
 
   Variable* _out_token_ids;
@@ -38,7 +66,7 @@ class SamplingOp : public Operator {
              int max_thread_per_block, int trg_vocab_size, int topk, float topp,
              int eos_id);
 
-  virtual ~SamplingOp() {}
+  virtual ~SamplingOp();
 
   // output: new_token_ids
   std::tuple<Variable*, Variable*> operator()(Variable* logits,
@@ -58,7 +86,55 @@ class SamplingOp : public Operator {
 
   void backward() override {}
 
-  bool is_stop() { return _h_unfinished == 0; }
+  // Check the stop flags only every interval steps, so that the host keeps
+  // enqueuing steps while the device runs. The steps run past the stop only
+  // write eos, stop_step gives the real number of steps.
+  void set_stop_check_interval(int interval) {
+    _stop_check_interval = std::max(interval, 1);
+  }
+
+  // While set, forward reads the position of the last token from
+  // step_offset_ptr on the device instead of before_forward, and writes the
+  // unfinished flag of the step at that position on the device, without
+  // copying or waiting. So several steps can be captured into one CUDA
+  // graph, whose flags fetch_step_flags brings to the host. Without
+  // generation configs only, nullptr turns it off.
+  void set_step_offset_ptr(const int* step_offset_ptr) {
+    _step_offset_ptr = step_offset_ptr;
+  }
+
+  // Clear the device flags of set_step_offset_ptr, before the first step.
+  void clear_step_flags();
+
+  // Wait for the num_steps steps from cur_step, the first of which samples
+  // after the token at offset, and take their flags for is_stop.
+  void fetch_step_flags(int cur_step, int offset, int num_steps);
+
+  // Topp sampling only: logits are divided by temperature, those of the
+  // tokens already in the sequence are divided (positive) or multiplied
+  // (negative) by repetition_penalty, and the tokens less likely than min_p
+  // times the most likely one are dropped. 1, 1 and 0 turn them off.
+  void set_sampling_params(float temperature, float repetition_penalty,
+                           float min_p);
+
+  // Sample row i of the batch with configs[i] rather than the generate
+  // method, see LSModel::set_generation_configs. An empty list turns it off.
+  void set_generation_configs(
+      const std::vector<cuda::GenerationConfig>& configs);
+
+  // The prompts of the first prompt_rows of the num_rows rows are prefilled
+  // once and row r samples the prompt r % prompt_rows: point the prompt
+  // positions of kv_rows, [num_rows, max_step], to the prefilled rows, see
+  // ker_fork_kv_rows_launcher. Every row samples from a curand state of its
+  // own, so the continuations are independent.
+  void fork_kv_rows(int* kv_rows, int prompt_rows, int num_rows,
+                    int prompt_len);
+
+  bool is_stop();
+
+  // Wait for the pending flags and return the first step in [0, steps]
+  // which left every sequence finished, steps if there is none.
+  int stop_step(int steps);
 };
 
 }  // namespace lightseq
@@ -0,0 +1,45 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Pool the encoder output [batch_size, seq_len, hidden_dim] into one vector
+// per sequence, masking the tokens which are padding_id, see
+// launch_sequence_pooling. The output is fp16 if half_output, on cuda only.
+template <typename T1, typename T2>
+class SequencePoolingOp : public Operator {
+ private:
+  size_t _max_batch_size;
+  size_t _hidden_dim;
+  int _padding_id;
+  PoolingMethod _method;
+  bool _l2_norm;
+  bool _half_output;
+  size_t _batch_size;
+  size_t _seq_len;
+
+  Variable* _result;
+
+ public:
+  SequencePoolingOp(size_t max_batch_size, size_t hidden_dim, int padding_id,
+                    PoolingMethod method, bool l2_norm, bool half_output);
+
+  virtual ~SequencePoolingOp() {}
+
+  Variable* operator()(Variable* inp, Variable* tokens);
+
+  void before_forward(size_t batch_size, size_t seq_len) {
+    _batch_size = batch_size, _seq_len = seq_len;
+    _result->set_shape({_batch_size, _hidden_dim});
+  }
+
+  void forward() override;
+
+  void backward() override {
+    printf("ERROR! SequencePoolingOp can't cal backward()\n");
+    exit(-1);
+  }
+};
+
+}  // namespace lightseq
@@ -0,0 +1,76 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Linear with a 2:4 sparse weight on the sparse tensor cores, for inference
+// on cuda, see cuda::Sparse24Gemm. The weight is the [input_size,
+// output_size] row major kernel of an inference LinearOp, pruned 2:4 along
+// the input, which load_weight compresses. A batch of tokens which is not a
+// multiple of cuda::kSparse24Align goes through padded buffers of the op.
+//   inp: [batch_tokens, input_size]
+//   weight: the compressed weight of load_weight
+//   result: [batch_tokens, output_size], or added to residual
+template <typename T1, typename T2>
+class Sparse24LinearOp : public Operator {
+ private:
+  size_t _output_size;
+  size_t _input_size;
+  size_t _max_batch_tokens;
+  size_t _batch_tokens;
+  bool _use_residual = false;
+
+#ifdef LIGHTSEQ_cuda
+  std::shared_ptr<cuda::Sparse24Gemm<T1>> _gemm;
+#endif
+  // of the first load_weight, reused by the later ones.
+  char* _compressed_ptr = nullptr;
+  // the input and the output rounded up to kSparse24Align tokens.
+  TensorPtr _pad_inp;
+  TensorPtr _pad_out;
+
+  Variable* _result;
+
+ public:
+  Sparse24LinearOp(size_t max_batch_tokens, size_t output_size,
+                   size_t input_size);
+
+  virtual ~Sparse24LinearOp() {}
+
+  // Whether the build and the gpu support the op for T1, the layers fall
+  // back to a LinearOp on the dense weight otherwise.
+  static bool supported();
+
+  Variable* operator()(Variable* inp, Variable* weight);
+  Variable* operator()(Variable* inp, Variable* weight, Variable* residual);
+
+  void forward() override;
+
+  std::vector<TensorPtr> workspaces() override { return {_pad_inp, _pad_out}; }
+
+  // Compress weight, the pruned kernel of an inference LinearOp, into
+  // memory of the allocator of the context for the weight variable, the
+  // same memory on a reload. Throws if it is not 2:4 sparse.
+  void load_weight(Variable* weight_var, const T1* weight);
+
+  void before_forward(size_t batch_tokens) {
+    _batch_tokens = batch_tokens;
+    if (_use_residual) {
+      _result->set_offset(0, {batch_tokens, _output_size});
+    } else {
+      _result->set_shape({batch_tokens, _output_size});
+    }
+  }
+
+  void backward() override {
+    printf("ERROR! Sparse24LinearOp can't cal backward()\n");
+    exit(-1);
+  }
+
+  size_t flops() override {
+    return 2 * _batch_tokens * _input_size * _output_size;
+  }
+};
+
+}  // namespace lightseq
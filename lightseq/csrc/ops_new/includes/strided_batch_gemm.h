@@ -63,5 +63,7 @@ class StridedBatchGemmOp : public Operator {
   }
 
   void backward() override;
+
+  size_t flops() override { return 2 * _batch_heads * _m * _n * _k; }
 };
 }  // namespace lightseq
@@ -0,0 +1,63 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Gate/up linear of the Llama mlp followed by SiLU(gate) * up, for
+// inference. Decode batches run one gemv that never writes the gate_up
+// output, larger ones a dense gemm into a shared buffer and the elementwise
+// product, see launch_gemv_swiglu. The weight may be quantized as the one of
+// WeightOnlyLinearOp.
+//   inp: [batch_tokens, input_size]
+//   weight: [input_size, 2 * inner_size], or of int8 with scale when
+//     quant_bits is 8 or 4
+//   result: [batch_tokens, inner_size]
+template <typename T1, typename T2>
+class SwiGLULinearOp : public Operator {
+ private:
+  size_t _inner_size;
+  size_t _input_size;
+  size_t _max_batch_tokens;
+  size_t _batch_tokens;
+  int _quant_bits;
+  int _group_size;
+
+  // the gate_up output and the dequantized weight of the batches too large
+  // for the gemv.
+  TensorPtr _gate_up_out;
+  TensorPtr _dequant_weight;
+  Variable* _result;
+
+ public:
+  // quant_bits 0 is a weight of T1, group_size 0 means one scale per column.
+  SwiGLULinearOp(size_t max_batch_tokens, size_t inner_size, size_t input_size,
+                 int quant_bits = 0, int group_size = 0);
+
+  virtual ~SwiGLULinearOp() {}
+
+  Variable* operator()(Variable* inp, Variable* weight);
+  Variable* operator()(Variable* inp, Variable* qweight, Variable* scale);
+
+  void forward() override;
+
+  std::vector<TensorPtr> workspaces() override {
+    return {_gate_up_out, _dequant_weight};
+  }
+
+  void before_forward(size_t batch_tokens) {
+    _batch_tokens = batch_tokens;
+    _result->set_shape({batch_tokens, _inner_size});
+  }
+
+  void backward() override {
+    printf("ERROR! SwiGLULinearOp can't cal backward()\n");
+    exit(-1);
+  }
+
+  size_t flops() override {
+    return 4 * _batch_tokens * _input_size * _inner_size;
+  }
+};
+
+}  // namespace lightseq
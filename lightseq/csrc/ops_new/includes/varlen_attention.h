@@ -0,0 +1,58 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Self attention of an encoder over the packed tokens of RemovePaddingOp,
+// with the qkv bias added and the heads split on the fly, see
+// launch_varlen_flash_attention. Inference only.
+//   qkv: [valid_tokens, 3, num_heads, head_dim], without the bias
+//   qkv_bias: [3, num_heads, head_dim]
+//   result: [valid_tokens, num_heads, head_dim]
+template <typename T1, typename T2>
+class VarlenAttentionOp : public Operator {
+ private:
+  size_t _max_batch_tokens;
+  size_t _num_heads;
+  size_t _head_dim;
+
+  size_t _batch_size;
+  size_t _max_seq_len;
+  size_t _valid_tokens;
+  const int* _cu_seqlens = nullptr;
+
+  Variable* _result;
+
+ public:
+  VarlenAttentionOp(size_t max_batch_tokens, size_t num_heads, size_t head_dim)
+      : Operator("VarlenAttentionOp"),
+        _max_batch_tokens(max_batch_tokens),
+        _num_heads(num_heads),
+        _head_dim(head_dim) {}
+
+  virtual ~VarlenAttentionOp() {}
+
+  Variable* operator()(Variable* qkv, Variable* qkv_bias);
+
+  // See RemovePaddingOp::cu_seqlens.
+  void set_cu_seqlens(const int* cu_seqlens) { _cu_seqlens = cu_seqlens; }
+
+  // max_seq_len is the padded length of the batch.
+  void before_forward(size_t batch_size, size_t max_seq_len,
+                      size_t valid_tokens) {
+    _batch_size = batch_size;
+    _max_seq_len = max_seq_len;
+    _valid_tokens = valid_tokens;
+    _result->set_shape({_valid_tokens, _num_heads * _head_dim});
+  }
+
+  void forward() override;
+
+  void backward() override {
+    printf("ERROR! VarlenAttentionOp can't cal backward()\n");
+    exit(-1);
+  }
+};
+
+}  // namespace lightseq
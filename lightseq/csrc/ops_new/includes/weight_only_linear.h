@@ -0,0 +1,73 @@
+#pragma once
+#include "declaration.h"
+#include "node.h"
+
+namespace lightseq {
+
+// Linear with a weight quantized to int8 or int4 while the activations stay
+// in T1, for inference. Small batches dequantize the weight in registers,
+// larger ones into a shared buffer followed by a dense gemm, see
+// launch_weight_only_gemv. A weight with more than max_dequant_cols columns,
+// such as the logits projection of a large vocabulary, is dequantized and
+// multiplied max_dequant_cols columns at a time, which bounds the buffer.
+//   inp: [batch_tokens, input_size]
+//   qweight: [input_size * quant_bits / 8, output_size], of int8
+//   scale: [input_size / group_size, output_size]
+//   result: [batch_tokens, output_size], or added to residual
+template <typename T1, typename T2>
+class WeightOnlyLinearOp : public Operator {
+ private:
+  size_t _output_size;
+  size_t _input_size;
+  size_t _max_batch_tokens;
+  size_t _batch_tokens;
+  int _quant_bits;
+  int _group_size;
+  size_t _dequant_cols;
+  bool _use_residual = false;
+
+  // the dequantized weight of the batches too large for the gemv, and the
+  // output of its columns when it is dequantized in tiles.
+  TensorPtr _dequant_weight;
+  TensorPtr _tile_out;
+  Variable* _result;
+
+ public:
+  // group_size 0 means one scale per output column, max_dequant_cols 0
+  // dequantizes the whole weight at once.
+  WeightOnlyLinearOp(size_t max_batch_tokens, size_t output_size,
+                     size_t input_size, int quant_bits, int group_size = 0,
+                     size_t max_dequant_cols = 0);
+
+  virtual ~WeightOnlyLinearOp() {}
+
+  Variable* operator()(Variable* inp, Variable* qweight, Variable* scale);
+  Variable* operator()(Variable* inp, Variable* qweight, Variable* scale,
+                       Variable* residual);
+
+  void forward() override;
+
+  std::vector<TensorPtr> workspaces() override {
+    return {_dequant_weight, _tile_out};
+  }
+
+  void before_forward(size_t batch_tokens) {
+    _batch_tokens = batch_tokens;
+    if (_use_residual) {
+      _result->set_offset(0, {batch_tokens, _output_size});
+    } else {
+      _result->set_shape({batch_tokens, _output_size});
+    }
+  }
+
+  void backward() override {
+    printf("ERROR! WeightOnlyLinearOp can't cal backward()\n");
+    exit(-1);
+  }
+
+  size_t flops() override {
+    return 2 * _batch_tokens * _input_size * _output_size;
+  }
+};
+
+}  // namespace lightseq
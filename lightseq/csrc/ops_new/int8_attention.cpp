@@ -0,0 +1,150 @@
+#include "int8_attention.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+Int8AttentionOp<T1, T2>::Int8AttentionOp(size_t max_batch_tokens,
+                                         size_t max_seq_len, size_t nhead,
+                                         size_t head_dim)
+    : Operator("Int8AttentionOp"),
+      _max_batch_tokens(max_batch_tokens),
+      _max_seq_len(max_seq_len),
+      _nhead(nhead),
+      _head_dim(head_dim) {
+#ifdef LIGHTSEQ_cuda
+  if (head_dim % 4 != 0) {
+    printf("Error! int8 attention head_dim %zu is not a multiple of 4\n",
+           head_dim);
+    exit(-1);
+  }
+  int32_t gemm_scalars[2] = {1, 0};
+  CHECK_GPU_ERROR(
+      cudaMalloc((void**)&_p_d_gemm_scalars, sizeof(gemm_scalars)));
+  CHECK_GPU_ERROR(cudaMemcpy(_p_d_gemm_scalars, gemm_scalars,
+                             sizeof(gemm_scalars), cudaMemcpyHostToDevice));
+#endif
+  size_t hidden_size = nhead * head_dim;
+  // the keys padded to a multiple of 4 at most quadruple the tokens.
+  size_t max_kv_tokens = 4 * max_batch_tokens;
+  size_t max_scores = max_batch_tokens * nhead * ((max_seq_len + 3) / 4 * 4);
+  _q_i8.reset(new Tensor("q_i8", g_dtype<int8_t>(),
+                         max_batch_tokens * hidden_size));
+  _k_i8.reset(
+      new Tensor("k_i8", g_dtype<int8_t>(), max_kv_tokens * hidden_size));
+  _v_i8.reset(
+      new Tensor("v_i8", g_dtype<int8_t>(), max_kv_tokens * hidden_size));
+  _probs_i8.reset(new Tensor("probs_i8", g_dtype<int8_t>(), max_scores));
+  // the scores, then the context.
+  _gemm_out.reset(new Tensor("gemm_out", g_dtype<int>(),
+                             std::max(max_scores,
+                                      max_batch_tokens * hidden_size)));
+  _head_scales.reset(new Tensor("head_scales", g_dtype<float>(),
+                                3 * max_batch_tokens * nhead));
+}
+
+template <typename T1, typename T2>
+Int8AttentionOp<T1, T2>::~Int8AttentionOp() {
+#ifdef LIGHTSEQ_cuda
+  cudaFree(_p_d_gemm_scalars);
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* Int8AttentionOp<T1, T2>::operator()(Variable* query, Variable* key,
+                                              Variable* value,
+                                              Variable* mask) {
+  _result = new Variable("Int8AttentionOp_out",
+                         _max_batch_tokens * _nhead * _head_dim,
+                         g_dtype<T1>(), g_dtype<T2>());
+  if (mask != nullptr) {
+    set_parents({query, key, value, mask});
+  } else {
+    set_parents({query, key, value});
+  }
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void Int8AttentionOp<T1, T2>::before_forward(size_t batch_size,
+                                             size_t query_len, size_t kv_len,
+                                             size_t kv_size,
+                                             bool mask_future) {
+  _batch_size = batch_size, _query_len = query_len, _kv_len = kv_len;
+  _kv_size = kv_size, _mask_future = mask_future;
+  if (batch_size * kv_pad() > 4 * _max_batch_tokens ||
+      kv_len > _max_seq_len) {
+    printf("Error! Int8AttentionOp of %zu keys exceeds its buffers\n",
+           batch_size * kv_len);
+    exit(-1);
+  }
+  _result->set_shape({batch_size, _nhead, query_len, _head_dim});
+}
+
+template <typename T1, typename T2>
+void Int8AttentionOp<T1, T2>::forward() {
+  T1* query_val = (T1*)parent(0)->value();
+  T1* key_val = (T1*)parent(1)->value();
+  T1* value_val = (T1*)parent(2)->value();
+  T1* mask_val = _parents.size() > 3 ? (T1*)parent(3)->value() : nullptr;
+  T1* out_val = (T1*)child(0)->value();
+  int8_t* q_i8 = (int8_t*)_q_i8->tensor();
+  int8_t* k_i8 = (int8_t*)_k_i8->tensor();
+  int8_t* v_i8 = (int8_t*)_v_i8->tensor();
+  int8_t* probs_i8 = (int8_t*)_probs_i8->tensor();
+  int32_t* gemm_out = (int32_t*)_gemm_out->tensor();
+  float* head_scales = (float*)_head_scales->tensor();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  cublasLtHandle_t handle = _context_ptr->get_cublaslthandle();
+  int batch_heads = _batch_size * _nhead;
+  int kv_len_pad = kv_pad();
+  float* q_scales = head_scales;
+  float* k_scales = head_scales + batch_heads;
+  float* v_scales = head_scales + 2 * batch_heads;
+
+  cuda::launch_quantize_heads(q_i8, q_scales, query_val, batch_heads,
+                              _query_len, _query_len, _head_dim,
+                              _query_len * _head_dim, false, stream);
+  cuda::launch_quantize_heads(k_i8, k_scales, key_val, batch_heads, _kv_len,
+                              kv_len_pad, _head_dim, _kv_size * _head_dim,
+                              false, stream);
+  // transposed, so that PV reduces the contiguous keys as the imma gemm
+  // needs.
+  cuda::launch_quantize_heads(v_i8, v_scales, value_val, batch_heads,
+                              _kv_len, kv_len_pad, _head_dim,
+                              _kv_size * _head_dim, true, stream);
+
+  // column major: [kv_len_pad, query_len] = k^T * q of every head
+  cuda::cublaslt_igemm<int32_t, int32_t>(
+      k_i8, q_i8, gemm_out, batch_heads, kv_len_pad, _query_len, _head_dim,
+      kv_len_pad * _head_dim, _query_len * _head_dim,
+      kv_len_pad * _query_len, _p_d_gemm_scalars, _p_d_gemm_scalars + 1,
+      handle, stream);
+  cuda::launch_attn_softmax_i32I_i8O<T1>(
+      probs_i8, gemm_out, q_scales, k_scales, 1.f / sqrt(float(_head_dim)),
+      mask_val, _batch_size, _nhead, _query_len, _kv_len, kv_len_pad,
+      _kv_size, _mask_future, stream);
+  // column major: [head_dim, query_len] = v^T^T * probs of every head
+  cuda::cublaslt_igemm<int32_t, int32_t>(
+      v_i8, probs_i8, gemm_out, batch_heads, _head_dim, _query_len,
+      kv_len_pad, _head_dim * kv_len_pad, _query_len * kv_len_pad,
+      _head_dim * _query_len, _p_d_gemm_scalars, _p_d_gemm_scalars + 1,
+      handle, stream);
+  cuda::launch_dequantize_heads(out_val, gemm_out, v_scales,
+                                1.f / cuda::kQuantRangeI8, batch_heads,
+                                _query_len * _head_dim, stream);
+#endif
+}
+
+template class Int8AttentionOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class Int8AttentionOp<__half, __half>;
+template class Int8AttentionOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
@@ -0,0 +1,217 @@
+#include "int8_linear.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+Int8LinearOp<T1, T2>::Int8LinearOp(size_t max_batch_tokens,
+                                   size_t output_size, size_t input_size)
+    : Operator("Int8LinearOp"),
+      _max_batch_tokens(max_batch_tokens),
+      _output_size(output_size),
+      _input_size(input_size) {
+#ifdef LIGHTSEQ_cuda
+  if (output_size % 4 != 0 || input_size % 4 != 0) {
+    printf("Error! int8 weight of [%zu, %zu] is not a multiple of 4\n",
+           output_size, input_size);
+    exit(-1);
+  }
+  int32_t gemm_scalars[2] = {1, 0};
+  CHECK_GPU_ERROR(
+      cudaMalloc((void**)&_p_d_gemm_scalars, sizeof(gemm_scalars)));
+  CHECK_GPU_ERROR(cudaMemcpy(_p_d_gemm_scalars, gemm_scalars,
+                             sizeof(gemm_scalars), cudaMemcpyHostToDevice));
+#endif
+  _quant_inp.reset(new Tensor("quant_inp", g_dtype<uint8_t>(),
+                              max_batch_tokens * input_size));
+  _inp_scales.reset(
+      new Tensor("inp_scales", g_dtype<float>(), max_batch_tokens));
+  _gemm_out.reset(new Tensor("gemm_out", g_dtype<int>(),
+                             max_batch_tokens * output_size));
+}
+
+template <typename T1, typename T2>
+Int8LinearOp<T1, T2>::~Int8LinearOp() {
+#ifdef LIGHTSEQ_cuda
+  cudaFree(_p_d_gemm_scalars);
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* Int8LinearOp<T1, T2>::operator()(Variable* inp, Variable* qweight,
+                                           Variable* scale) {
+  _use_bias = false;
+  _result = new Variable("Int8LinearOp_out", _max_batch_tokens * _output_size,
+                         g_dtype<T1>(), g_dtype<T2>());
+  set_parents({inp, qweight, scale});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+Variable* Int8LinearOp<T1, T2>::operator()(Variable* inp, Variable* qweight,
+                                           Variable* scale, Variable* bias) {
+  _result = new Variable("Int8LinearOp_out", _max_batch_tokens * _output_size,
+                         g_dtype<T1>(), g_dtype<T2>());
+  set_parents({inp, qweight, scale, bias});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+Variable* Int8LinearOp<T1, T2>::operator()(Variable* inp, Variable* qweight,
+                                           Variable* scale, Variable* bias,
+                                           Variable* residual) {
+  _use_residual = true;
+  _result = new Variable("Int8LinearOp_out", residual);
+  if (bias == nullptr) {
+    _use_bias = false;
+    set_parents({inp, qweight, scale, residual});
+  } else {
+    set_parents({inp, qweight, scale, bias, residual});
+  }
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+Variable* Int8LinearOp<T1, T2>::operator()(Variable* inp, Variable* qweight,
+                                           Variable* scale, Variable* bias,
+                                           std::string activation_fn) {
+  if (activation_fn != "relu" && activation_fn != "gelu") {
+    printf("Error! Int8LinearOp can not fuse activation %s\n",
+           activation_fn.c_str());
+    exit(-1);
+  }
+  _activation_fn = activation_fn;
+  return (*this)(inp, qweight, scale, bias);
+}
+
+template <typename T1, typename T2>
+void Int8LinearOp<T1, T2>::load_weight(Variable* qweight, Variable* scale,
+                                       const T1* weight) {
+#ifdef LIGHTSEQ_cuda
+  auto allocator_ptr = _context_ptr->allocator();
+  char* qweight_ptr = allocator_ptr->malloc_mem(_output_size * _input_size);
+  char* scale_ptr = allocator_ptr->malloc_mem(_output_size * sizeof(float));
+  cuda::launch_quantize_weight_cols(
+      (int8_t*)qweight_ptr, (float*)scale_ptr, weight, _input_size,
+      _output_size, _context_ptr->get_stream());
+  qweight->set_value(qweight_ptr);
+  qweight->set_shape({_output_size, _input_size});
+  scale->set_value(scale_ptr);
+  scale->set_shape({_output_size});
+#else
+  printf("Error! Int8LinearOp::load_weight needs cuda\n");
+  exit(-1);
+#endif
+}
+
+template <typename T1, typename T2>
+void Int8LinearOp<T1, T2>::pack_weight(const int8_t* qweight) {
+#ifdef LIGHTSEQ_x86
+  // the weight is the transposed b of the gemm, [n, k] with n the output.
+  _packed_weight.resize(x86::packed_b_size<int8_t>(
+      _max_batch_tokens, _output_size, _input_size));
+  x86::pack_b_matrix(true, _max_batch_tokens, _output_size, _input_size,
+                     qweight, _input_size, _packed_weight.data());
+  _shift_comp.resize(_output_size);
+  x86::compute_shift_compensation(qweight, _shift_comp.data(), _output_size,
+                                  _input_size);
+  _packed_src = qweight;
+#endif
+}
+
+template <typename T1, typename T2>
+void Int8LinearOp<T1, T2>::forward() {
+  T1* input_ptr = (T1*)parent(0)->value();
+  int8_t* qweight_ptr = (int8_t*)parent(1)->value();
+  float* scale_ptr = (float*)parent(2)->value();
+  T1* bias_ptr = _use_bias ? (T1*)parent(3)->value() : nullptr;
+  T1* out_ptr = (T1*)child(0)->value();
+  uint8_t* quant_inp_ptr = (uint8_t*)_quant_inp->tensor();
+  float* inp_scales_ptr = (float*)_inp_scales->tensor();
+  int32_t* gemm_out_ptr = (int32_t*)_gemm_out->tensor();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  int8_t* quant_s8_ptr = (int8_t*)quant_inp_ptr;
+  cuda::launch_quantize_rows(quant_s8_ptr, inp_scales_ptr, input_ptr,
+                             _batch_tokens, _input_size, stream);
+  // column major: [output_size, batch_tokens] = qweight^T * quant_inp
+  cuda::cublaslt_igemm<int32_t, int32_t>(
+      qweight_ptr, quant_s8_ptr, gemm_out_ptr, 1, _output_size, _batch_tokens,
+      _input_size, 0, 0, 0, _p_d_gemm_scalars, _p_d_gemm_scalars + 1,
+      _context_ptr->get_cublaslthandle(), stream);
+
+  if (_activation_fn == "relu") {
+    cuda::launch_dequantize_bias_act<ActivationType::kRelu>(
+        out_ptr, gemm_out_ptr, inp_scales_ptr, scale_ptr, bias_ptr,
+        _batch_tokens, _output_size, stream);
+  } else if (_activation_fn == "gelu") {
+    cuda::launch_dequantize_bias_act<ActivationType::kGelu>(
+        out_ptr, gemm_out_ptr, inp_scales_ptr, scale_ptr, bias_ptr,
+        _batch_tokens, _output_size, stream);
+  } else {
+    cuda::launch_dequantize_bias_res(
+        out_ptr, gemm_out_ptr, inp_scales_ptr, scale_ptr, bias_ptr,
+        _use_residual ? out_ptr : nullptr, _batch_tokens, _output_size,
+        stream);
+  }
+#elif defined LIGHTSEQ_x86
+  if (qweight_ptr != _packed_src) pack_weight(qweight_ptr);
+
+  x86::launch_quantize_shift_rows(quant_inp_ptr, inp_scales_ptr, input_ptr,
+                                  _batch_tokens, _input_size);
+  x86::gemm(false, true, false, true, _batch_tokens, _output_size,
+            _input_size, 1.f, quant_inp_ptr, _input_size,
+            (const int8_t*)_packed_weight.data(), _input_size, 0.f,
+            gemm_out_ptr, _output_size, _shift_comp.data());
+
+  if (_activation_fn == "relu") {
+    x86::launch_dequantize_bias_act<ActivationType::kRelu>(
+        out_ptr, gemm_out_ptr, inp_scales_ptr, scale_ptr, bias_ptr,
+        _batch_tokens, _output_size);
+  } else if (_activation_fn == "gelu") {
+    x86::launch_dequantize_bias_act<ActivationType::kGelu>(
+        out_ptr, gemm_out_ptr, inp_scales_ptr, scale_ptr, bias_ptr,
+        _batch_tokens, _output_size);
+  } else {
+    x86::launch_dequantize_bias_res(
+        out_ptr, gemm_out_ptr, inp_scales_ptr, scale_ptr, bias_ptr,
+        _use_residual ? out_ptr : nullptr, _batch_tokens, _output_size);
+  }
+#elif defined LIGHTSEQ_arm
+  // the int8 dot product takes both sides signed, so there is no shift and
+  // the weight is used as it is.
+  int8_t* quant_s8_ptr = (int8_t*)quant_inp_ptr;
+  arm::launch_quantize_rows(quant_s8_ptr, inp_scales_ptr, input_ptr,
+                            _batch_tokens, _input_size);
+  arm::gemm_s8s8s32_nt(quant_s8_ptr, qweight_ptr, gemm_out_ptr, _batch_tokens,
+                       _output_size, _input_size);
+
+  if (_activation_fn == "relu") {
+    arm::launch_dequantize_bias_act<ActivationType::kRelu>(
+        out_ptr, gemm_out_ptr, inp_scales_ptr, scale_ptr, bias_ptr,
+        _batch_tokens, _output_size);
+  } else if (_activation_fn == "gelu") {
+    arm::launch_dequantize_bias_act<ActivationType::kGelu>(
+        out_ptr, gemm_out_ptr, inp_scales_ptr, scale_ptr, bias_ptr,
+        _batch_tokens, _output_size);
+  } else {
+    arm::launch_dequantize_bias_res(
+        out_ptr, gemm_out_ptr, inp_scales_ptr, scale_ptr, bias_ptr,
+        _use_residual ? out_ptr : nullptr, _batch_tokens, _output_size);
+  }
+#endif
+}
+
+template class Int8LinearOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class Int8LinearOp<__half, __half>;
+template class Int8LinearOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
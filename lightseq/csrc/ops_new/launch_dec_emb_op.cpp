@@ -38,6 +38,14 @@ void LaunchDecEmbOp<T>::forward() {
                           output_ptr, _batch_size, _beam_size, _hidden_size,
                           _trg_vocab_size, _cur_step, _max_step, _multilg_type,
                           _stream);
+#elif defined LIGHTSEQ_x86
+  x86::launch_dec_emb<T>(token_emb, pos_emb, inp_tokens, lang_emb, lang_id,
+                         output_ptr, _batch_size, _beam_size, _hidden_size,
+                         _trg_vocab_size, _cur_step, _max_step, _multilg_type);
+#elif defined LIGHTSEQ_arm
+  arm::launch_dec_emb<T>(token_emb, pos_emb, inp_tokens, lang_emb, lang_id,
+                         output_ptr, _batch_size, _beam_size, _hidden_size,
+                         _trg_vocab_size, _cur_step, _max_step, _multilg_type);
 #endif
 }
 
@@ -5,13 +5,19 @@ namespace lightseq {
 template <typename T>
 std::tuple<Variable*, Variable*> LaunchEncEmbOp<T>::operator()(
     Variable* inp_tokens, Variable* token_emb, Variable* pos_emb,
-    Variable* lang_emb, Variable* lang_id) {
+    Variable* lang_emb, Variable* lang_id, Variable* ln_gamma,
+    Variable* ln_betta) {
   size_t max_size = _max_batch_tokens * _hidden_dim;
 
   _result = new Variable("LaunchEncEmbOp_out", _max_batch_tokens * _hidden_dim,
                          g_dtype<T>());
   _pad_mask = new Variable("pad_mask", _max_batch_tokens, g_dtype<T>());
-  set_parents({inp_tokens, token_emb, pos_emb, lang_emb, lang_id});
+  if (_fuse_ln) {
+    set_parents({inp_tokens, token_emb, pos_emb, lang_emb, lang_id, ln_gamma,
+                 ln_betta});
+  } else {
+    set_parents({inp_tokens, token_emb, pos_emb, lang_emb, lang_id});
+  }
   this->set_children({_result, _pad_mask});
   return std::make_tuple(_result, _pad_mask);
 }
@@ -33,9 +39,24 @@ void LaunchEncEmbOp<T>::forward() {
 
 #ifdef LIGHTSEQ_cuda
   cudaStream_t _stream = _context_ptr->get_stream();
+  if (_fuse_ln) {
+    cuda::launch_enc_emb_ln<T>(
+        token_emb, pos_emb, inp_tokens, (const T*)parent(5)->value(),
+        (const T*)parent(6)->value(), output_ptr, pad_mask, _pad_id,
+        _batch_size, _seq_len, _hidden_dim, _stream);
+    return;
+  }
   cuda::launch_enc_emb<T>(token_emb, pos_emb, inp_tokens, output_ptr, pad_mask,
                           _pad_id, _batch_size, _seq_len, _hidden_dim, _stream,
                           lang_emb, lang_id, _multilg_type);
+#elif defined LIGHTSEQ_x86
+  x86::launch_enc_emb<T>(token_emb, pos_emb, inp_tokens, output_ptr, pad_mask,
+                         _pad_id, _batch_size, _seq_len, _hidden_dim, lang_emb,
+                         lang_id, _multilg_type);
+#elif defined LIGHTSEQ_arm
+  arm::launch_enc_emb<T>(token_emb, pos_emb, inp_tokens, output_ptr, pad_mask,
+                         _pad_id, _batch_size, _seq_len, _hidden_dim, lang_emb,
+                         lang_id, _multilg_type);
 #endif
 }
 
@@ -46,7 +46,7 @@ void LaunchGptEmbOp<T>::forward() {
   cuda::launch_gpt_embedding<T>(token_emb, pos_emb, inp_tokens, output_ptr,
                                 pad_mask_ptr, left_pad_len_ptr, _batch_size,
                                 _beam_size, _hidden_dim, _offset, _seq_len,
-                                _max_step, _pad_id, _stream);
+                                _max_step, _pad_id, _stream, _positions);
 #endif
 }
 
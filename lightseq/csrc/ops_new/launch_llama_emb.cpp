@@ -6,7 +6,20 @@ template <typename T>
 std::tuple<Variable*, Variable*, Variable*> LaunchLlamaEmbOp<T>::operator()(
     Variable* inp_tokens, Variable* token_emb) {
   set_parents({inp_tokens, token_emb});
+  return create_outputs();
+}
+
+template <typename T>
+std::tuple<Variable*, Variable*, Variable*> LaunchLlamaEmbOp<T>::operator()(
+    Variable* inp_tokens, Variable* token_emb, Variable* token_emb_scale) {
+  _quant_emb = true;
+  set_parents({inp_tokens, token_emb, token_emb_scale});
+  return create_outputs();
+}
 
+template <typename T>
+std::tuple<Variable*, Variable*, Variable*>
+LaunchLlamaEmbOp<T>::create_outputs() {
   size_t max_size = _max_batch_tokens * _hidden_dim;
 
   _result =
@@ -42,15 +55,24 @@ void LaunchLlamaEmbOp<T>::forward() {
     cudaMemsetAsync(left_pad_len_ptr, 0, _batch_size * _beam_size * sizeof(int),
                     _stream);
   }
+  if (_quant_emb) {
+    cuda::launch_llama_embedding_i8<T>(
+        (const int8_t*)token_emb, (const T*)parent(2)->value(), inp_tokens,
+        output_ptr, pad_mask_ptr, left_pad_len_ptr, _batch_size, _beam_size,
+        _hidden_dim, _offset, _seq_len, _max_step, _pad_id, _stream,
+        _offset_ptr);
+    return;
+  }
   cuda::launch_llama_embedding<T>(token_emb, inp_tokens, output_ptr,
                                   pad_mask_ptr, left_pad_len_ptr, _batch_size,
                                   _beam_size, _hidden_dim, _offset, _seq_len,
-                                  _max_step, _pad_id, _stream);
+                                  _max_step, _pad_id, _stream, _offset_ptr);
 #endif
 }
 
 template class LaunchLlamaEmbOp<float>;
 #ifdef LIGHTSEQ_cuda
 template class LaunchLlamaEmbOp<__half>;
+template class LaunchLlamaEmbOp<__nv_bfloat16>;
 #endif
 }  // namespace lightseq
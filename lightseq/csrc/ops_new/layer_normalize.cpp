@@ -41,6 +41,12 @@ void LayerNormalizeOp<T1, T2>::forward() {
   cudaStream_t stream = _context_ptr->get_stream();
   cuda::launch_layer_norm(ln_res_val, vars_val, means_val, inp_val, gamma_val,
                           betta_val, _batch_tokens, _hidden_dim, stream);
+#elif defined LIGHTSEQ_x86
+  x86::launch_layer_norm(ln_res_val, vars_val, means_val, inp_val, gamma_val,
+                         betta_val, _batch_tokens, _hidden_dim);
+#elif defined LIGHTSEQ_arm
+  arm::launch_layer_norm(ln_res_val, vars_val, means_val, inp_val, gamma_val,
+                         betta_val, _batch_tokens, _hidden_dim);
 #endif
 }
 
@@ -58,6 +64,7 @@ void LayerNormalizeOp<T1, T2>::backward() {
   T1* vars_val = (T1*)vars_->tensor();
 
   T1* means_val = _use_mean ? (T1*)means_->tensor() : nullptr;
+  float* workspace = _bw_workspace ? (float*)_bw_workspace->tensor() : nullptr;
 
   bool is_res_cover = parent(0)->is_cover();
   if (!is_res_cover) {
@@ -69,11 +76,11 @@ void LayerNormalizeOp<T1, T2>::backward() {
   }
 
 #ifdef LIGHTSEQ_cuda
-  cudaStream_t streams[2] = {_context_ptr->get_stream(),
-                             _context_ptr->get_stream()};
-  cuda::launch_ln_bw(gamma_grad, betta_grad, inp_grad, out_grad, residual_grad,
-                     out_val, gamma_val, betta_val, vars_val, means_val,
-                     _batch_tokens, _hidden_dim, streams);
+  cudaStream_t stream = _context_ptr->get_stream();
+  cuda::launch_ln_bw_fused(gamma_grad, betta_grad, inp_grad, out_grad,
+                           residual_grad, out_val, gamma_val, betta_val,
+                           vars_val, means_val, workspace, _batch_tokens,
+                           _hidden_dim, stream);
 #endif
 }
 
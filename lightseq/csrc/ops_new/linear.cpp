@@ -1,7 +1,59 @@
 #include "linear.h"
+#include "bias_act_dropout.h"
+#include "fusion.h"
 
 namespace lightseq {
 
+template <typename T1, typename T2>
+void LinearOp<T1, T2>::init_fp8() {
+#ifdef LIGHTSEQ_cuda
+  if (!_context_ptr->fp8_training() || !_context_ptr->is_training()) {
+    return;
+  }
+  // the [output_size, input_size] weights of pybind are the TN layout of
+  // cublaslt_fp8_gemm, which needs 16 aligned dims. the other linears keep
+  // their gemms.
+  if (_opA != MATRIX_OP::Transpose || _opB != MATRIX_OP::NonTranspose ||
+      _alpha != 1.f || _output_size % 16 != 0 || _input_size % 16 != 0) {
+    return;
+  }
+  _fp8 = true;
+  _fp8_history_len = _context_ptr->fp8_amax_history_len();
+  if (_fp8_history_len <= 0) {
+    printf("Error! fp8 amax history length %d should be positive\n",
+           _fp8_history_len);
+    exit(-1);
+  }
+  std::vector<float> scales(3, 1.f);
+  CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_fp8_scales, 3 * sizeof(float)));
+  CHECK_GPU_ERROR(cudaMemcpy(_p_d_fp8_scales, scales.data(),
+                             3 * sizeof(float), cudaMemcpyHostToDevice));
+  CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_amax_history,
+                             3 * _fp8_history_len * sizeof(float)));
+  CHECK_GPU_ERROR(cudaMemset(_p_d_amax_history, 0,
+                             3 * _fp8_history_len * sizeof(float)));
+
+  _fp8_inp.reset(new Tensor("fp8_inp", g_dtype<uint8_t>(),
+                            _max_batch_tokens * _input_size));
+  _fp8_inp_t.reset(new Tensor("fp8_inp_t", g_dtype<uint8_t>(),
+                              _max_batch_tokens * _input_size));
+  _fp8_weight.reset(new Tensor("fp8_weight", g_dtype<uint8_t>(),
+                               _output_size * _input_size));
+  _fp8_grad.reset(new Tensor("fp8_grad", g_dtype<uint8_t>(),
+                             _max_batch_tokens * _output_size));
+  _fp8_grad_t.reset(new Tensor("fp8_grad_t", g_dtype<uint8_t>(),
+                               _max_batch_tokens * _output_size));
+#endif
+}
+
+template <typename T1, typename T2>
+LinearOp<T1, T2>::~LinearOp() {
+#ifdef LIGHTSEQ_cuda
+  cudaFree(_p_d_fp8_scales);
+  cudaFree(_p_d_amax_history);
+#endif
+}
+
 template <typename T1, typename T2>
 Variable* LinearOp<T1, T2>::operator()(Variable* inp, Variable* weight) {
   _result = new Variable("LinearOp_out", _max_batch_tokens * _output_size,
@@ -22,32 +74,262 @@ Variable* LinearOp<T1, T2>::operator()(Variable* inp, Variable* weight,
   return _result;
 }
 
+template <typename T1, typename T2>
+Variable* LinearOp<T1, T2>::operator()(Variable* inp, Variable* weight,
+                                       Variable* bias,
+                                       std::string activation_fn) {
+  if (activation_fn != "relu" && activation_fn != "gelu" &&
+      activation_fn != "none") {
+    printf("Error! LinearOp can not fuse activation %s\n",
+           activation_fn.c_str());
+    exit(-1);
+  }
+  _activation_fn = activation_fn;
+  _result = new Variable("LinearOp_out", _max_batch_tokens * _output_size,
+                         g_dtype<T1>(), g_dtype<T2>());
+  set_parents({inp, weight, bias});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+bool LinearOp<T1, T2>::fuse_bias_act() {
+  if (!_activation_fn.empty() || _use_residual || _lora) return false;
+  Variable* linear_out = child(0);
+  if (linear_out->children().size() != 1 || linear_out->is_ancestor() ||
+      _context_ptr->is_layer_output(linear_out)) {
+    return false;
+  }
+  BiasActDropoutOp<T1, T2>* bias_act =
+      dynamic_cast<BiasActDropoutOp<T1, T2>*>(linear_out->children()[0]);
+  if (bias_act == nullptr || bias_act->parent(0) != linear_out ||
+      bias_act->RATIO() > 0) {
+    return false;
+  }
+  const std::string& activation_fn = bias_act->activation_fn();
+  if (activation_fn != "relu" && activation_fn != "gelu") return false;
+
+  Variable* bias = bias_act->parent(1);
+  Variable* result = bias_act->child(0);
+  add_parent(bias);
+  bias->replace_child(bias_act, this);
+  replace_child(linear_out, result);
+  result->replace_parent(bias_act, this);
+  linear_out->detach();
+  bias_act->detach();
+  _activation_fn = activation_fn;
+  _result = result;
+  return true;
+}
+
+template <typename T1, typename T2>
+void LinearOp<T1, T2>::fp8_forward() {
+#ifdef LIGHTSEQ_cuda
+  T1* input_ptr = (T1*)parent(0)->value();
+  T1* weights = (T1*)parent(1)->value();
+  T1* out_ptr = (T1*)child(0)->value();
+  uint8_t* fp8_inp = _fp8_inp->tensor<uint8_t>();
+  uint8_t* fp8_inp_t = _fp8_inp_t->tensor<uint8_t>();
+  uint8_t* fp8_weight = _fp8_weight->tensor<uint8_t>();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+  cudaStream_t stream = _context_ptr->get_stream();
+  // the forward replayed by recompute quantizes with the same scales and
+  // doesn't count as a step.
+  bool record = !_context_ptr->in_recompute();
+  int slot = _fp8_fw_step % _fp8_history_len;
+  float* inp_amax = nullptr;
+  float* weight_amax = nullptr;
+  if (record) {
+    cuda::launch_fp8_update_scales(_p_d_fp8_scales, _p_d_amax_history, 2,
+                                   _fp8_history_len, slot, cuda::kFp8E4M3Max,
+                                   0.f, stream);
+    inp_amax = _p_d_amax_history + slot;
+    weight_amax = _p_d_amax_history + _fp8_history_len + slot;
+    _fp8_fw_step++;
+  }
+  // the transposed input is the one of the weight grad gemm in backward.
+  cuda::launch_quantize_fp8_transpose(fp8_inp, fp8_inp_t, inp_amax, input_ptr,
+                                      _p_d_fp8_scales, _batch_tokens,
+                                      _input_size, false, stream);
+  cuda::launch_quantize_fp8_transpose(fp8_weight, (uint8_t*)nullptr,
+                                      weight_amax, weights,
+                                      _p_d_fp8_scales + 1, _output_size,
+                                      _input_size, false, stream);
+  cuda::cublaslt_fp8_gemm(fp8_weight, fp8_inp, out_ptr, _output_size,
+                          _batch_tokens, _input_size, _p_d_fp8_scales + 1,
+                          _p_d_fp8_scales, _beta,
+                          _context_ptr->get_cublaslthandle(), stream);
+#endif
+}
+
 template <typename T1, typename T2>
 void LinearOp<T1, T2>::forward() {
+  // the fp8 gemms need 16 aligned batch tokens too, the other batches fall
+  // back to the gemms below, so the build records the buffers of both.
+  if (_fp8 && (!_context_ptr->is_built() || _batch_tokens % 16 == 0)) {
+    fp8_forward();
+    if (_context_ptr->is_built()) return;
+  }
   T1* input_ptr = (T1*)parent(0)->value();
   T1* weights = (T1*)parent(1)->value();
   T1* out_ptr = (T1*)child(0)->value();
+  T1* bias_ptr = _activation_fn.empty() ? nullptr : (T1*)parent(2)->value();
 
   if (!_context_ptr->is_built()) {
     return;
   }
   // _beta = float(0.);
 #ifdef LIGHTSEQ_cuda
-  cublasHandle_t _cublasHandle = _context_ptr->get_cublashandle();
-  cuda::cublas_gemm_ex(_cublasHandle, op_from_custom(_opA),
-                       op_from_custom(_opB), _output_size, _batch_tokens,
-                       _input_size, &_alpha, &_beta, weights, input_ptr,
-                       out_ptr, cublasGemmAlgo_t(_gemm_algos[0]));
+  if (!_activation_fn.empty()) {
+    cuda::cublaslt_gemm_bias_act(
+        _context_ptr->get_cublaslthandle(), op_from_custom(_opA),
+        op_from_custom(_opB), _output_size, _batch_tokens, _input_size,
+        weights, input_ptr, bias_ptr, out_ptr,
+        _activation_fn == "relu"
+            ? ActivationType::kRelu
+            : (_activation_fn == "gelu" ? ActivationType::kGelu
+                                        : ActivationType::kNone),
+        _context_ptr->get_stream());
+    return;
+  }
+  if (!_deferred) forward_rows(0, _batch_tokens);
 #elif defined LIGHTSEQ_x86
-  x86::matrix_gemm(weights, input_ptr, out_ptr, _output_size, _batch_tokens,
-                   _input_size);
+  // column major as cublas_gemm_ex above.
+  x86::strided_batch_gemm(_opA == MATRIX_OP::Transpose,
+                          _opB == MATRIX_OP::Transpose, _output_size,
+                          _batch_tokens, _input_size, _alpha, _beta, weights,
+                          input_ptr, out_ptr, 0, 0, 0, 1);
+  if (_activation_fn == "relu") {
+    x86::launch_bias_act<ActivationType::kRelu>(
+        out_ptr, out_ptr, bias_ptr, _batch_tokens * _output_size, _output_size);
+  } else if (_activation_fn == "gelu") {
+    x86::launch_bias_act<ActivationType::kGelu>(
+        out_ptr, out_ptr, bias_ptr, _batch_tokens * _output_size, _output_size);
+  } else if (_activation_fn == "none") {
+    for (size_t i = 0; i < _batch_tokens * _output_size; i++) {
+      out_ptr[i] += bias_ptr[i % _output_size];
+    }
+  }
+#elif defined LIGHTSEQ_arm
+  // column major as cublas_gemm_ex above.
+  arm::strided_batch_gemm(_opA == MATRIX_OP::Transpose,
+                          _opB == MATRIX_OP::Transpose, _output_size,
+                          _batch_tokens, _input_size, _alpha, _beta, weights,
+                          input_ptr, out_ptr, 0, 0, 0, 1);
+  if (_activation_fn == "relu") {
+    arm::launch_bias_act<ActivationType::kRelu>(
+        out_ptr, out_ptr, bias_ptr, _batch_tokens * _output_size, _output_size);
+  } else if (_activation_fn == "gelu") {
+    arm::launch_bias_act<ActivationType::kGelu>(
+        out_ptr, out_ptr, bias_ptr, _batch_tokens * _output_size, _output_size);
+  } else if (_activation_fn == "none") {
+    for (size_t i = 0; i < _batch_tokens * _output_size; i++) {
+      out_ptr[i] += bias_ptr[i % _output_size];
+    }
+  }
+#endif
+}
+
+template <typename T1, typename T2>
+void LinearOp<T1, T2>::forward_rows(size_t begin, size_t end) {
+#ifdef LIGHTSEQ_cuda
+  // the tokens are the columns of the column major gemm
+  const T1* input_ptr = (T1*)parent(0)->value() + begin * _input_size;
+  const T1* weights = (T1*)parent(1)->value();
+  T1* out_ptr = (T1*)child(0)->value() + begin * _output_size;
+  int rows = end - begin;
+  // the tuned cublasLt algo when LIGHTSEQ_GEMM_TUNE is on, see GemmTuner.
+  if (!cuda::cublaslt_tuned_gemm(
+          _context_ptr->get_cublaslthandle(), op_from_custom(_opA),
+          op_from_custom(_opB), _output_size, rows, _input_size, &_alpha,
+          &_beta, weights, input_ptr, out_ptr, _context_ptr->get_stream())) {
+    cublasHandle_t _cublasHandle = _context_ptr->get_cublashandle();
+    cuda::cublas_gemm_ex(_cublasHandle, op_from_custom(_opA),
+                         op_from_custom(_opB), _output_size, rows,
+                         _input_size, &_alpha, &_beta, weights, input_ptr,
+                         out_ptr, cublasGemmAlgo_t(_gemm_algos[0]));
+  }
+  if (_lora) {
+    cudaStream_t stream = _context_ptr->get_stream();
+    float* workspace = _lora->workspace + begin * _lora->rank;
+    cuda::launch_lora_shrink(input_ptr, _lora->a_ptrs,
+                             _lora->row_slots + begin, workspace, rows,
+                             _input_size, _lora->rank, stream);
+    cuda::launch_lora_expand(workspace, _lora->b_ptrs, _lora->scales,
+                             _lora->row_slots + begin, out_ptr, rows,
+                             _lora->rank, _output_size, stream);
+  }
+#endif
+}
+
+template <typename T1, typename T2>
+void LinearOp<T1, T2>::fp8_backward() {
+#ifdef LIGHTSEQ_cuda
+  float w_beta = _context_ptr->accumulate_weight_grads() ? 1.f : 0.f;
+  float inp_beta = parent(0)->is_cover() ? 0.f : 1.f;
+
+  T2* out_grad = (T2*)child(0)->grad();
+  T1* weights = (T1*)parent(1)->value();
+  T2* inp_grad = (T2*)parent(0)->grad();
+  T2* weights_grad = (T2*)parent(1)->grad();
+  uint8_t* fp8_inp_t = _fp8_inp_t->tensor<uint8_t>();
+  uint8_t* fp8_weight_t = _fp8_weight->tensor<uint8_t>();
+  uint8_t* fp8_grad = _fp8_grad->tensor<uint8_t>();
+  uint8_t* fp8_grad_t = _fp8_grad_t->tensor<uint8_t>();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+  cublasLtHandle_t lt_handle = _context_ptr->get_cublaslthandle();
+  cudaStream_t stream = _context_ptr->get_stream();
+  float* grad_scale = _p_d_fp8_scales + 2;
+  float* grad_history = _p_d_amax_history + 2 * _fp8_history_len;
+  int slot = _fp8_bw_step % _fp8_history_len;
+  cuda::launch_fp8_update_scales(grad_scale, grad_history, 1,
+                                 _fp8_history_len, slot, cuda::kFp8E5M2Max,
+                                 0.f, stream);
+  _fp8_bw_step++;
+  cuda::launch_quantize_fp8_transpose(fp8_grad, fp8_grad_t,
+                                      grad_history + slot, out_grad,
+                                      grad_scale, _batch_tokens, _output_size,
+                                      true, stream);
+  // the weight is unchanged since forward, so is its scale.
+  cuda::launch_quantize_fp8_transpose((uint8_t*)nullptr, fp8_weight_t,
+                                      (float*)nullptr, weights,
+                                      _p_d_fp8_scales + 1, _output_size,
+                                      _input_size, false, stream);
+
+  // weights_grad: [output_size, input_size] = out_grad^T * input
+  cuda::cublaslt_fp8_gemm(fp8_inp_t, fp8_grad_t, weights_grad, _input_size,
+                          _output_size, _batch_tokens, _p_d_fp8_scales,
+                          grad_scale, w_beta, lt_handle, stream, true);
+  // inp_grad: [batch_tokens, input_size] = out_grad * weight
+  cuda::cublaslt_fp8_gemm(fp8_weight_t, fp8_grad, inp_grad, _input_size,
+                          _batch_tokens, _output_size, _p_d_fp8_scales + 1,
+                          grad_scale, inp_beta, lt_handle, stream, true);
 #endif
 }
 
 template <typename T1, typename T2>
 void LinearOp<T1, T2>::backward() {
+  if (!_activation_fn.empty()) {
+    printf("ERROR! LinearOp with fused activation can't cal backward()\n");
+    exit(-1);
+  }
+  if (_fp8 && (!_context_ptr->is_built() || _batch_tokens % 16 == 0)) {
+    fp8_backward();
+    if (_context_ptr->is_built()) return;
+  }
   float bw_alpha = 1. / _alpha;
   float w_beta = (float)0.0, inp_beta = (float)0.0;
+  if (_context_ptr->accumulate_weight_grads()) {
+    w_beta = (float)1.0;
+  }
 
   T2* out_grad = (T2*)child(0)->grad();
   T1* input_ptr = (T1*)parent(0)->value();
@@ -66,23 +348,56 @@ void LinearOp<T1, T2>::backward() {
 
 #ifdef LIGHTSEQ_cuda
   cublasHandle_t _cublasHandle = _context_ptr->get_cublashandle();
+  cublasLtHandle_t lt_handle = _context_ptr->get_cublaslthandle();
+  cudaStream_t stream = _context_ptr->get_stream();
   // Q: how to adpat _opA & _opB
   // calculate weights_grad
-  cuda::cublas_gemm_ex(_cublasHandle, CUBLAS_OP_N, CUBLAS_OP_T, _input_size,
-                       _output_size, _batch_tokens, &bw_alpha, &w_beta,
-                       input_ptr, out_grad, weights_grad,
-                       cublasGemmAlgo_t(_gemm_algos[1]));
+  if (!cuda::cublaslt_tuned_gemm(lt_handle, CUBLAS_OP_N, CUBLAS_OP_T,
+                                 _input_size, _output_size, _batch_tokens,
+                                 &bw_alpha, &w_beta, input_ptr, out_grad,
+                                 weights_grad, stream)) {
+    cuda::cublas_gemm_ex(_cublasHandle, CUBLAS_OP_N, CUBLAS_OP_T, _input_size,
+                         _output_size, _batch_tokens, &bw_alpha, &w_beta,
+                         input_ptr, out_grad, weights_grad,
+                         cublasGemmAlgo_t(_gemm_algos[1]));
+  }
 
   // calculate inp_grad
-  cuda::cublas_gemm_ex(_cublasHandle, CUBLAS_OP_N, CUBLAS_OP_N, _input_size,
-                       _batch_tokens, _output_size, &bw_alpha, &inp_beta,
-                       weights, out_grad, inp_grad,
-                       cublasGemmAlgo_t(_gemm_algos[2]));
+  if (!cuda::cublaslt_tuned_gemm(lt_handle, CUBLAS_OP_N, CUBLAS_OP_N,
+                                 _input_size, _batch_tokens, _output_size,
+                                 &bw_alpha, &inp_beta, weights, out_grad,
+                                 inp_grad, stream)) {
+    cuda::cublas_gemm_ex(_cublasHandle, CUBLAS_OP_N, CUBLAS_OP_N, _input_size,
+                         _batch_tokens, _output_size, &bw_alpha, &inp_beta,
+                         weights, out_grad, inp_grad,
+                         cublasGemmAlgo_t(_gemm_algos[2]));
+  }
 #endif
 }
 
 template class LinearOp<float, float>;
 #ifdef LIGHTSEQ_cuda
 template class LinearOp<__half, __half>;
+template class LinearOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+
+namespace {
+
+template <typename T1, typename T2>
+bool fuse_linear_bias_act(Operator* op) {
+  LinearOp<T1, T2>* linear = dynamic_cast<LinearOp<T1, T2>*>(op);
+  return linear && linear->fuse_bias_act();
+}
+
+const char* kLinearBiasAct = "LinearOp+BiasActDropoutOp";
+GraphFusion::Registrar linear_bias_act_fp32(kLinearBiasAct,
+                                            fuse_linear_bias_act<float, float>);
+#ifdef LIGHTSEQ_cuda
+GraphFusion::Registrar linear_bias_act_fp16(
+    kLinearBiasAct, fuse_linear_bias_act<__half, __half>);
+GraphFusion::Registrar linear_bias_act_bf16(
+    kLinearBiasAct, fuse_linear_bias_act<__nv_bfloat16, __nv_bfloat16>);
 #endif
+
+}  // namespace
 }  // namespace lightseq
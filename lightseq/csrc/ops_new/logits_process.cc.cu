@@ -0,0 +1,169 @@
+#include "logits_process.h"
+
+namespace lightseq {
+
+template <typename T>
+LogitsProcessOp<T>::~LogitsProcessOp() {
+#ifdef LIGHTSEQ_cuda
+  if (_p_d_bad_words) cudaFree(_p_d_bad_words);
+  if (_p_d_automaton) cudaFree(_p_d_automaton);
+  if (_p_d_states) cudaFree(_p_d_states);
+#endif
+}
+
+template <typename T>
+Variable* LogitsProcessOp<T>::operator()(Variable* logits,
+                                         Variable* alive_seq) {
+  set_parents({logits, alive_seq});
+  _result = new Variable("LogitsProcessOp_out", logits);
+  set_children({_result});
+  return _result;
+}
+
+template <typename T>
+void LogitsProcessOp<T>::forward() {
+  T* logits_ptr = parent(0)->value<T>();
+  int* alive_seq_ptr = parent(1)->value<int>();
+
+  if (!_context_ptr->is_built() || !(_has_processors || _has_automaton)) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cuda::ker_process_logits_launcher<T>(
+      _rows, _seq_len, _prompt_len, _max_step, _max_thread_per_block,
+      _context_ptr->get_stream(), logits_ptr, alive_seq_ptr, _trg_vocab_size,
+      _params, _p_d_bad_words, _p_d_bad_words + _num_bad_word_ids);
+#endif
+}
+
+template <typename T>
+void LogitsProcessOp<T>::set_config(const cuda::LogitsProcessConfig& config) {
+  if (config.repetition_penalty <= 0.f || config.no_repeat_ngram_size < 0) {
+    printf("Error! logits processors need repetition_penalty > 0 and "
+           "no_repeat_ngram_size >= 0\n");
+    throw std::runtime_error("invalid logits processor config");
+  }
+  std::vector<int> bad_words;
+  std::vector<int> offsets = {0};
+  for (const std::vector<int>& word : config.bad_words) {
+    if (word.empty()) {
+      printf("Error! empty bad word\n");
+      throw std::runtime_error("invalid logits processor config");
+    }
+    bad_words.insert(bad_words.end(), word.begin(), word.end());
+    offsets.push_back(bad_words.size());
+  }
+  _has_processors = config.repetition_penalty != 1.f ||
+                    config.presence_penalty != 0.f ||
+                    config.frequency_penalty != 0.f ||
+                    config.no_repeat_ngram_size > 0 ||
+                    !config.bad_words.empty();
+#ifdef LIGHTSEQ_cuda
+  _params.repetition_penalty = config.repetition_penalty;
+  _params.presence_penalty = config.presence_penalty;
+  _params.frequency_penalty = config.frequency_penalty;
+  _params.no_repeat_ngram_size = config.no_repeat_ngram_size;
+  _params.num_bad_words = config.bad_words.size();
+  // the previous forward may still read the bad words
+  CHECK_GPU_ERROR(cudaStreamSynchronize(_context_ptr->get_stream()));
+  if (_p_d_bad_words) {
+    CHECK_GPU_ERROR(cudaFree(_p_d_bad_words));
+    _p_d_bad_words = nullptr;
+  }
+  _num_bad_word_ids = bad_words.size();
+  if (!config.bad_words.empty()) {
+    bad_words.insert(bad_words.end(), offsets.begin(), offsets.end());
+    CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_bad_words,
+                               bad_words.size() * sizeof(int)));
+    CHECK_GPU_ERROR(cudaMemcpy(_p_d_bad_words, bad_words.data(),
+                               bad_words.size() * sizeof(int),
+                               cudaMemcpyHostToDevice));
+  }
+#else
+  if (_has_processors) {
+    printf("logits processors are only applied on cuda, ignored.\n");
+    _has_processors = false;
+  }
+#endif
+}
+
+template <typename T>
+void LogitsProcessOp<T>::set_automaton(const cuda::TokenAutomaton& automaton) {
+  int num_states = automaton.num_states;
+  size_t num_words = (_trg_vocab_size + 31) / 32;
+  bool valid = num_states >= 0 &&
+               automaton.allowed.size() == num_states * num_words &&
+               automaton.transition_offsets.size() == size_t(num_states) + 1 &&
+               automaton.transition_offsets[0] == 0 &&
+               automaton.transition_tokens.size() ==
+                   size_t(automaton.transition_offsets.back()) &&
+               automaton.next_states.size() ==
+                   automaton.transition_tokens.size();
+  for (int state = 0; valid && state < num_states; state++) {
+    for (int idx = automaton.transition_offsets[state];
+         valid && idx < automaton.transition_offsets[state + 1]; idx++) {
+      valid = automaton.next_states[idx] >= 0 &&
+              automaton.next_states[idx] < num_states &&
+              (idx == automaton.transition_offsets[state] ||
+               automaton.transition_tokens[idx - 1] <
+                   automaton.transition_tokens[idx]);
+    }
+  }
+  if (!valid) {
+    printf("Error! invalid token automaton, it needs num_states * %zu "
+           "allowed words, num_states + 1 transition offsets from 0 and "
+           "sorted transition tokens of every state to valid states\n",
+           num_words);
+    throw std::runtime_error("invalid token automaton");
+  }
+  _has_automaton = num_states > 0;
+#ifdef LIGHTSEQ_cuda
+  // the previous forward may still read the automaton
+  CHECK_GPU_ERROR(cudaStreamSynchronize(_context_ptr->get_stream()));
+  if (_p_d_automaton) {
+    CHECK_GPU_ERROR(cudaFree(_p_d_automaton));
+    _p_d_automaton = nullptr;
+  }
+  _params.allowed = nullptr;
+  if (!_has_automaton) return;
+  if (!_p_d_states) {
+    CHECK_GPU_ERROR(
+        cudaMalloc((void**)&_p_d_states, _max_rows * sizeof(int)));
+  }
+  std::vector<int> buffer(automaton.allowed.begin(), automaton.allowed.end());
+  buffer.insert(buffer.end(), automaton.transition_offsets.begin(),
+                automaton.transition_offsets.end());
+  buffer.insert(buffer.end(), automaton.transition_tokens.begin(),
+                automaton.transition_tokens.end());
+  buffer.insert(buffer.end(), automaton.next_states.begin(),
+                automaton.next_states.end());
+  CHECK_GPU_ERROR(
+      cudaMalloc((void**)&_p_d_automaton, buffer.size() * sizeof(int)));
+  CHECK_GPU_ERROR(cudaMemcpy(_p_d_automaton, buffer.data(),
+                             buffer.size() * sizeof(int),
+                             cudaMemcpyHostToDevice));
+  int* ptr = _p_d_automaton;
+  _params.allowed = reinterpret_cast<const unsigned int*>(ptr);
+  ptr += automaton.allowed.size();
+  _params.transition_offsets = ptr;
+  ptr += automaton.transition_offsets.size();
+  _params.transition_tokens = ptr;
+  ptr += automaton.transition_tokens.size();
+  _params.next_states = ptr;
+  _params.states = _p_d_states;
+#else
+  if (_has_automaton) {
+    printf("token automatons are only applied on cuda, ignored.\n");
+    _has_automaton = false;
+  }
+#endif
+}
+
+template class LogitsProcessOp<float>;
+#ifdef LIGHTSEQ_cuda
+template class LogitsProcessOp<__half>;
+template class LogitsProcessOp<__nv_bfloat16>;
+#endif
+
+}  // namespace lightseq
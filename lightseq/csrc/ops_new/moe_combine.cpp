@@ -0,0 +1,50 @@
+#include "moe_combine.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+Variable* MoeCombineOp<T1, T2>::operator()(Variable* inp, Variable* routing,
+                                           Variable* residual) {
+  _result = new Variable("MoeCombineOp_out", residual);
+  set_parents({inp, routing, residual});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+Variable* MoeCombineOp<T1, T2>::operator()(Variable* inp, Variable* routing,
+                                           Variable* bias,
+                                           Variable* residual) {
+  _use_bias = true;
+  _result = new Variable("MoeCombineOp_out", residual);
+  set_parents({inp, routing, residual, bias});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void MoeCombineOp<T1, T2>::forward() {
+  T1* inp_val = (T1*)parent(0)->value();
+  MoeRouting routing((int*)parent(1)->value(), _max_batch_tokens, _topk,
+                     _expert_num);
+  T1* bias_val = _use_bias ? (T1*)parent(3)->value() : nullptr;
+  T1* out_val = (T1*)child(0)->value();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cuda::launch_moe_combine(inp_val, (const T1*)bias_val, routing.score,
+                           routing.expert, routing.slot, out_val,
+                           _batch_tokens, _max_batch_tokens, _capacity, _topk,
+                           _hidden_dim, _context_ptr->get_stream());
+#endif
+}
+
+template class MoeCombineOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class MoeCombineOp<__half, __half>;
+template class MoeCombineOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
@@ -0,0 +1,110 @@
+#include "moe_dispatch.h"
+
+namespace lightseq {
+
+size_t MoeRouting::size(size_t max_batch_tokens, size_t topk,
+                        size_t expert_num) {
+  size_t res = 3 * max_batch_tokens * topk + 2 * expert_num + 1;
+#ifdef LIGHTSEQ_cuda
+  res += cuda::moe_route_workspace_size(max_batch_tokens, expert_num);
+#endif
+  return res;
+}
+
+template <typename T1, typename T2>
+MoeDispatchOp<T1, T2>::MoeDispatchOp(size_t max_batch_tokens,
+                                     size_t hidden_dim, size_t expert_num,
+                                     size_t topk, float capacity_factor)
+    : Operator("MoeDispatchOp"),
+      _max_batch_tokens(max_batch_tokens),
+      _hidden_dim(hidden_dim),
+      _expert_num(expert_num),
+      _topk(topk),
+      _capacity_factor(capacity_factor) {
+  if (expert_num > 256 || topk < 1 || topk > 8 || topk > expert_num) {
+    printf("Error! MoeDispatchOp does not support top-%zu of %zu experts\n",
+           topk, expert_num);
+    exit(-1);
+  }
+}
+
+template <typename T1, typename T2>
+size_t MoeDispatchOp<T1, T2>::capacity(size_t batch_tokens) const {
+  if (_capacity_factor <= 0) return batch_tokens;
+  size_t res = std::ceil(_capacity_factor * topk() * batch_tokens /
+                         _expert_num);
+  return std::max(std::min(res, batch_tokens), size_t(1));
+}
+
+template <typename T1, typename T2>
+std::tuple<Variable*, Variable*> MoeDispatchOp<T1, T2>::operator()(
+    Variable* inp, Variable* gate_logits) {
+  _result = new Variable(
+      "MoeDispatchOp_out",
+      _expert_num * capacity(_max_batch_tokens) * _hidden_dim, g_dtype<T1>(),
+      g_dtype<T2>());
+  _routing = new Variable("MoeDispatchOp_routing",
+                          MoeRouting::size(_max_batch_tokens, _topk,
+                                           _expert_num),
+                          g_dtype<int>());
+  set_parents({inp, gate_logits});
+  this->set_children({_result, _routing});
+  return std::make_tuple(_result, _routing);
+}
+
+template <typename T1, typename T2>
+std::tuple<Variable*, Variable*> MoeDispatchOp<T1, T2>::operator()(
+    Variable* inp) {
+  _hard_gate = true;
+  _result = new Variable(
+      "MoeDispatchOp_out",
+      _expert_num * capacity(_max_batch_tokens) * _hidden_dim, g_dtype<T1>(),
+      g_dtype<T2>());
+  _routing = new Variable("MoeDispatchOp_routing",
+                          MoeRouting::size(_max_batch_tokens, 1, _expert_num),
+                          g_dtype<int>());
+  set_parents({inp});
+  this->set_children({_result, _routing});
+  return std::make_tuple(_result, _routing);
+}
+
+template <typename T1, typename T2>
+void MoeDispatchOp<T1, T2>::forward() {
+  T1* inp_val = (T1*)parent(0)->value();
+  T1* gate_val = _hard_gate ? nullptr : (T1*)parent(1)->value();
+  T1* out_val = (T1*)child(0)->value();
+  MoeRouting routing((int*)child(1)->value(), _max_batch_tokens, topk(),
+                     _expert_num);
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+  if (_hard_gate && _hard_gates == nullptr) {
+    printf("Error! MoeDispatchOp of the hard gate has no gates set\n");
+    exit(-1);
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  if (_hard_gate) {
+    cuda::launch_hard_gate_reorder_pre(
+        inp_val, _hard_gates, routing.score, routing.expert, routing.slot,
+        routing.expert_rows, out_val, _batch_size, _seq_len, _expert_num,
+        _capacity, _hidden_dim, stream);
+  } else {
+    cuda::launch_moe_route_dispatch(
+        gate_val, inp_val, routing.score, routing.expert, routing.slot,
+        routing.expert_rows, routing.workspace, out_val, _batch_tokens,
+        _max_batch_tokens, _expert_num, _capacity, _topk, _hidden_dim,
+        stream);
+  }
+#endif
+}
+
+template class MoeDispatchOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class MoeDispatchOp<__half, __half>;
+template class MoeDispatchOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
@@ -0,0 +1,100 @@
+#include "moe_expert_linear.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+MoeExpertLinearOp<T1, T2>::MoeExpertLinearOp(
+    size_t max_batch_tokens, size_t max_capacity, size_t expert_num,
+    size_t topk, size_t output_size, size_t input_size,
+    std::string activation_fn)
+    : Operator("MoeExpertLinearOp"),
+      _max_batch_tokens(max_batch_tokens),
+      _max_capacity(max_capacity),
+      _expert_num(expert_num),
+      _topk(topk),
+      _output_size(output_size),
+      _input_size(input_size),
+      _activation_fn(activation_fn) {
+  if (activation_fn != "" && activation_fn != "relu" &&
+      activation_fn != "gelu" && activation_fn != "silu") {
+    printf("Error! MoeExpertLinearOp does not support activation %s\n",
+           activation_fn.c_str());
+    exit(-1);
+  }
+  if (activation_fn == "silu") {
+    _gemm_out.reset(new Tensor("gemm_out", g_dtype<T1>(),
+                               expert_num * max_capacity * 2 * output_size));
+  }
+}
+
+template <typename T1, typename T2>
+Variable* MoeExpertLinearOp<T1, T2>::operator()(Variable* inp,
+                                                Variable* routing,
+                                                Variable* weight) {
+  _result = new Variable("MoeExpertLinearOp_out",
+                         _expert_num * _max_capacity * _output_size,
+                         g_dtype<T1>(), g_dtype<T2>());
+  set_parents({inp, routing, weight});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+Variable* MoeExpertLinearOp<T1, T2>::operator()(Variable* inp,
+                                                Variable* routing,
+                                                Variable* weight,
+                                                Variable* bias) {
+  if (_activation_fn == "silu") {
+    printf("Error! MoeExpertLinearOp of silu does not support bias\n");
+    exit(-1);
+  }
+  _use_bias = true;
+  _result = new Variable("MoeExpertLinearOp_out",
+                         _expert_num * _max_capacity * _output_size,
+                         g_dtype<T1>(), g_dtype<T2>());
+  set_parents({inp, routing, weight, bias});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void MoeExpertLinearOp<T1, T2>::forward() {
+  T1* inp_val = (T1*)parent(0)->value();
+  MoeRouting routing((int*)parent(1)->value(), _max_batch_tokens, _topk,
+                     _expert_num);
+  T1* weight_val = (T1*)parent(2)->value();
+  T1* bias_val = _use_bias ? (T1*)parent(3)->value() : nullptr;
+  T1* out_val = (T1*)child(0)->value();
+  T1* gemm_out = _gemm_out ? (T1*)_gemm_out->tensor() : nullptr;
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  int max_rows = std::min(_topk * _batch_tokens, _expert_num * _capacity);
+  if (_activation_fn == "silu") {
+    cuda::launch_moe_grouped_gemm(
+        inp_val, weight_val, (const T1*)nullptr, gemm_out, routing.expert_rows,
+        routing.tile_offset, _expert_num, _capacity, max_rows, _input_size,
+        2 * _output_size, 0, stream);
+    cuda::launch_moe_grouped_swiglu(gemm_out, out_val, routing.expert_rows,
+                                    _expert_num, _capacity, _output_size,
+                                    stream);
+    return;
+  }
+  int act = _activation_fn == "relu" ? 1 : (_activation_fn == "gelu" ? 2 : 0);
+  cuda::launch_moe_grouped_gemm(inp_val, weight_val, bias_val, out_val,
+                                routing.expert_rows, routing.tile_offset,
+                                _expert_num, _capacity, max_rows, _input_size,
+                                _output_size, act, stream);
+#endif
+}
+
+template class MoeExpertLinearOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class MoeExpertLinearOp<__half, __half>;
+template class MoeExpertLinearOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
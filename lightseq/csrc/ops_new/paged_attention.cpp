@@ -0,0 +1,60 @@
+#include "paged_attention.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+Variable* PagedAttentionOp<T1, T2>::operator()(Variable* query,
+                                               Variable* cache_k,
+                                               Variable* cache_v,
+                                               Variable* pad_mask) {
+  _result = new Variable("PagedAttentionOp_out",
+                         _max_batch_tokens * _nhead * _head_dim, g_dtype<T1>(),
+                         g_dtype<T2>());
+  set_parents({query, cache_k, cache_v, pad_mask});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void PagedAttentionOp<T1, T2>::forward() {
+  T1* query_val = (T1*)parent(0)->value();
+  char* cache_k_val = parent(1)->value();
+  char* cache_v_val = parent(2)->value();
+  T1* pad_mask_val = (T1*)parent(3)->value();
+  T1* out_val = (T1*)child(0)->value();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+  if (_page_table == nullptr) {
+    printf("Error! PagedAttentionOp %s runs without page table.\n",
+           name().c_str());
+    exit(-1);
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  if (_cache_k_scale) {
+    cuda::launch_paged_attention<T1, int8_t>(
+        query_val, (int8_t*)cache_k_val, (int8_t*)cache_v_val, pad_mask_val,
+        _page_table, out_val, _batch_size, _nhead, _head_dim, _query_len,
+        _offset_seq_len, _page_size, _max_pages, _max_step, stream,
+        _offset_seq_len_ptr, _seq_offsets, _kv_head_num, _cache_k_scale,
+        _cache_v_scale);
+    return;
+  }
+  cuda::launch_paged_attention<T1, T1>(
+      query_val, (T1*)cache_k_val, (T1*)cache_v_val, pad_mask_val,
+      _page_table, out_val, _batch_size, _nhead, _head_dim, _query_len,
+      _offset_seq_len, _page_size, _max_pages, _max_step, stream,
+      _offset_seq_len_ptr, _seq_offsets, _kv_head_num);
+#endif
+}
+
+template class PagedAttentionOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class PagedAttentionOp<__half, __half>;
+template class PagedAttentionOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
@@ -0,0 +1,51 @@
+#include "peer_copy.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+PeerCopyOp<T1, T2>::~PeerCopyOp() {
+#ifdef LIGHTSEQ_cuda
+  if (_copied) cudaEventDestroy(_copied);
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* PeerCopyOp<T1, T2>::operator()(Variable* inp, Variable* dst,
+                                         Context* dst_context) {
+  _dst = dst;
+  _dst_context = dst_context;
+  _result = new Variable("PeerCopyOp_out", g_dtype<T1>(), g_dtype<T2>());
+#ifdef LIGHTSEQ_cuda
+  // recorded on the stream of this context, whose device is current now.
+  CHECK_GPU_ERROR(cudaEventCreateWithFlags(&_copied, cudaEventDisableTiming));
+#endif
+  set_parents({inp});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void PeerCopyOp<T1, T2>::forward() {
+  T1* inp_ptr = (T1*)parent(0)->value();
+  T1* dst_ptr = (T1*)_dst->value() + _dst_offset;
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  CHECK_GPU_ERROR(cudaMemcpyPeerAsync(
+      dst_ptr, _dst_context->device_id(), inp_ptr, _context_ptr->device_id(),
+      _ele_num * sizeof(T1), stream));
+  CHECK_GPU_ERROR(cudaEventRecord(_copied, stream));
+  CHECK_GPU_ERROR(cudaStreamWaitEvent(_dst_context->get_stream(), _copied, 0));
+#endif
+}
+
+template class PeerCopyOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class PeerCopyOp<__half, __half>;
+template class PeerCopyOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
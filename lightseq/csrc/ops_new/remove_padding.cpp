@@ -0,0 +1,121 @@
+#include "remove_padding.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+RemovePaddingOp<T1, T2>::RemovePaddingOp(size_t max_batch_tokens,
+                                         size_t hidden_dim, int padding_id)
+    : Operator("RemovePaddingOp"),
+      _max_batch_tokens(max_batch_tokens),
+      _hidden_dim(hidden_dim),
+      _padding_id(padding_id),
+      _cu_seqlens(nullptr),
+      _packed_to_padded(nullptr) {
+#ifdef LIGHTSEQ_cuda
+  // batch_size is at most max_batch_tokens.
+  _cu_seqlens = (int*)_context_ptr->allocator()->malloc_mem(
+      (max_batch_tokens + 1) * sizeof(int));
+  _packed_to_padded = (int*)_context_ptr->allocator()->malloc_mem(
+      max_batch_tokens * sizeof(int));
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* RemovePaddingOp<T1, T2>::operator()(Variable* inp) {
+  _result = new Variable("RemovePaddingOp_out",
+                         _max_batch_tokens * _hidden_dim, g_dtype<T1>(),
+                         g_dtype<T2>());
+  set_parents({inp});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+int RemovePaddingOp<T1, T2>::set_offsets(const int* tokens, int batch_size,
+                                         int seq_len) {
+  int valid_tokens = batch_size * seq_len;
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  cuda::launch_varlen_offsets(tokens, _cu_seqlens, _packed_to_padded,
+                              batch_size, seq_len, _padding_id, stream);
+  CHECK_GPU_ERROR(cudaMemcpyAsync(&valid_tokens, _cu_seqlens + batch_size,
+                                  sizeof(int), cudaMemcpyDeviceToHost,
+                                  stream));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(stream));
+#endif
+  return valid_tokens;
+}
+
+template <typename T1, typename T2>
+void RemovePaddingOp<T1, T2>::set_packed_offsets(const int* offsets,
+                                                 int batch_size,
+                                                 int seq_len) {
+  int valid_tokens = offsets[batch_size];
+  _h_packed_to_padded.resize(valid_tokens);
+  for (int i = 0; i < batch_size; i++) {
+    for (int t = offsets[i]; t < offsets[i + 1]; t++) {
+      _h_packed_to_padded[t] = i * seq_len + t - offsets[i];
+    }
+  }
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_cu_seqlens, offsets,
+                                  (batch_size + 1) * sizeof(int),
+                                  cudaMemcpyHostToDevice, stream));
+  CHECK_GPU_ERROR(cudaMemcpyAsync(
+      _packed_to_padded, _h_packed_to_padded.data(),
+      valid_tokens * sizeof(int), cudaMemcpyHostToDevice, stream));
+#endif
+}
+
+template <typename T1, typename T2>
+void RemovePaddingOp<T1, T2>::forward() {
+  T1* inp_ptr = (T1*)parent(0)->value();
+  T1* out_ptr = (T1*)child(0)->value();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cuda::launch_remove_padding(inp_ptr, out_ptr, _packed_to_padded,
+                              _valid_tokens, _hidden_dim,
+                              _context_ptr->get_stream());
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* RebuildPaddingOp<T1, T2>::operator()(Variable* inp) {
+  _result = new Variable("RebuildPaddingOp_out",
+                         _max_batch_tokens * _hidden_dim, g_dtype<T1>(),
+                         g_dtype<T2>());
+  set_parents({inp});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void RebuildPaddingOp<T1, T2>::forward() {
+  T1* inp_ptr = (T1*)parent(0)->value();
+  T1* out_ptr = (T1*)child(0)->value();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cuda::launch_rebuild_padding(inp_ptr, out_ptr, _packed_to_padded,
+                               _valid_tokens, _batch_tokens, _hidden_dim,
+                               _context_ptr->get_stream());
+#endif
+}
+
+template class RemovePaddingOp<float, float>;
+template class RebuildPaddingOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class RemovePaddingOp<__half, __half>;
+template class RemovePaddingOp<__nv_bfloat16, __nv_bfloat16>;
+template class RebuildPaddingOp<__half, __half>;
+template class RebuildPaddingOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
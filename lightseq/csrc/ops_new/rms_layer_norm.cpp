@@ -12,9 +12,9 @@ std::tuple<Variable*, Variable*> RMSLayerNormalizeOp<T1, T2>::operator()(
   _result =
       new Variable("RMSLayerNormalizeOp_out", _max_batch_tokens * _hidden_dim,
                    g_dtype<T1>(), g_dtype<T2>());
-  _residual =
-      new Variable("RMSLayerNormalizeOp_res", _max_batch_tokens * _hidden_dim,
-                   g_dtype<T1>(), g_dtype<T2>());
+  // the residual is the input itself, the linear that follows adds onto it
+  // in place, which saves copying the input to a buffer of its own.
+  _residual = new Variable("RMSLayerNormalizeOp_res", inp);
   set_parents({inp, scale});
   this->set_children({_result, _residual});
   return std::make_tuple(_result, _residual);
@@ -24,10 +24,24 @@ template <typename T1, typename T2>
 void RMSLayerNormalizeOp<T1, T2>::before_forward(size_t batch_size,
                                                  size_t seq_len) {
   _batch_tokens = batch_size * seq_len;
+  _inp_row_stride = 1, _inp_row_offset = 0, _inp_rows = nullptr;
   _result->set_shape({batch_size, seq_len, _hidden_dim});
   if (_use_residual) {
-    _residual->set_shape({batch_size, seq_len, _hidden_dim});
+    _residual->set_offset(0, {batch_size, seq_len, _hidden_dim});
+  }
+}
+
+template <typename T1, typename T2>
+void RMSLayerNormalizeOp<T1, T2>::set_input_rows(size_t row_stride,
+                                                 size_t row_offset,
+                                                 const int* inp_rows) {
+  if (_use_residual) {
+    printf("Error! RMSLayerNormalizeOp with residual reads all the rows\n");
+    exit(-1);
   }
+  _inp_row_stride = row_stride;
+  _inp_row_offset = row_offset;
+  _inp_rows = inp_rows;
 }
 
 template <typename T1, typename T2>
@@ -35,11 +49,41 @@ void RMSLayerNormalizeOp<T1, T2>::forward() {
   T1* inp_val = (T1*)parent(0)->value();
   T1* scale_val = (T1*)parent(1)->value();
   T1* out_val = (T1*)child(0)->value();
-  T1* res_val = nullptr;
-  if (_use_residual) {
-    res_val = (T1*)child(1)->value();
+  T1* rms_vars_val = (T1*)_rms_vars->tensor();
+
+  if (!_context_ptr->is_built()) {
+    return;
   }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  cuda::RowView inp_rows;
+  inp_rows.rows = _inp_rows;
+  inp_rows.stride = _inp_row_stride;
+  inp_rows.offset = _inp_row_offset;
+  cuda::launch_rms_layer_norm(inp_val, scale_val, out_val, (T1*)nullptr,
+                              rms_vars_val, _batch_tokens, _hidden_dim, stream,
+                              _epsilon, inp_rows);
+#endif
+}
+
+template <typename T1, typename T2>
+void RMSLayerNormalizeOp<T1, T2>::backward() {
+  T2* scale_grad = (T2*)parent(1)->grad();
+  T2* inp_grad = (T2*)parent(0)->grad();
+  T2* out_grad = (T2*)child(0)->grad();
+  T2* residual_grad = nullptr;
+
+  // the input may be overwritten by the residual linear, xhat is recomputed
+  // from the output.
+  T1* out_val = (T1*)child(0)->value();
+  T1* scale_val = (T1*)parent(1)->value();
   T1* rms_vars_val = (T1*)_rms_vars->tensor();
+  float* workspace = _bw_workspace ? (float*)_bw_workspace->tensor() : nullptr;
+
+  if (!parent(0)->is_cover()) {
+    residual_grad = inp_grad;
+  }
 
   if (!_context_ptr->is_built()) {
     return;
@@ -47,13 +91,15 @@ void RMSLayerNormalizeOp<T1, T2>::forward() {
 
 #ifdef LIGHTSEQ_cuda
   cudaStream_t stream = _context_ptr->get_stream();
-  cuda::launch_rms_layer_norm(inp_val, scale_val, out_val, res_val,
-                              rms_vars_val, _batch_tokens, _hidden_dim, stream);
+  cuda::launch_rms_ln_bw(scale_grad, inp_grad, out_grad, residual_grad,
+                         out_val, scale_val, rms_vars_val, true, workspace,
+                         _batch_tokens, _hidden_dim, stream);
 #endif
 }
 
 template class RMSLayerNormalizeOp<float, float>;
 #ifdef LIGHTSEQ_cuda
 template class RMSLayerNormalizeOp<__half, __half>;
+template class RMSLayerNormalizeOp<__nv_bfloat16, __nv_bfloat16>;
 #endif
 }  // namespace lightseq
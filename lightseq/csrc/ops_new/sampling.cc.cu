@@ -21,6 +21,28 @@ SamplingOp<T>::SamplingOp(GenerateMethod gm, int max_batch_size, int max_step,
   cudaStream_t _stream = _context_ptr->get_stream();
   cuda::ker_curand_setup<<<_max_batch_size, 1, 0, _stream>>>(_p_d_curandstate);
   CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_unfinished, sizeof(int)));
+  CHECK_GPU_ERROR(
+      cudaMalloc((void**)&_p_d_row_params,
+                 _max_batch_size * sizeof(cuda::RowSamplingParams)));
+  CHECK_GPU_ERROR(
+      cudaMallocHost((void**)&_h_unfinished, _max_step * sizeof(int)));
+  CHECK_GPU_ERROR(
+      cudaMalloc((void**)&_p_d_step_unfinished, _max_step * sizeof(int)));
+#else
+  _host_unfinished.resize(_max_step);
+  _h_unfinished = _host_unfinished.data();
+  _random_x.resize(_max_batch_size);
+#endif
+}
+
+template <typename T>
+SamplingOp<T>::~SamplingOp() {
+#ifdef LIGHTSEQ_cuda
+  cudaFree(_p_d_curandstate);
+  cudaFree(_p_d_unfinished);
+  cudaFree(_p_d_row_params);
+  cudaFreeHost(_h_unfinished);
+  cudaFree(_p_d_step_unfinished);
 #endif
 }
 
@@ -54,30 +76,239 @@ void SamplingOp<T>::forward() {
 
 #ifdef LIGHTSEQ_cuda
   cudaStream_t _stream = _context_ptr->get_stream();
+  if (_step_offset_ptr) {
+    // the steps past the prompt only, the prompt length is not needed.
+    if (_num_row_params > 0) {
+      printf("Error! the step offset of the device does not support "
+             "generation configs\n");
+      throw std::runtime_error("generation configs with a step offset");
+    }
+    if (_generate_method == GenerateMethod::Topk) {
+      cuda::ker_topk_sample_launcher<T>(
+          _batch_size, _seq_len, 0, _max_step, _logits_seq_len,
+          _max_thread_per_block, _stream, logits_ptr, logits_bias_ptr,
+          inp_tokens_ptr, out_tokens_ptr, _trg_vocab_size, _topk,
+          _p_d_step_unfinished, _p_d_curandstate, _eos_id, _step_offset_ptr);
+    } else if (_generate_method == GenerateMethod::Topp) {
+      cuda::ker_topp_threshold_sample_launcher<T>(
+          _batch_size, _seq_len, 0, _max_step, _logits_seq_len,
+          _max_thread_per_block, _stream, logits_ptr, logits_bias_ptr,
+          inp_tokens_ptr, _trg_vocab_size, 0, _topp, _temperature,
+          _repetition_penalty, _min_p, nullptr, _p_d_step_unfinished,
+          _p_d_curandstate, _eos_id, _step_offset_ptr);
+    }
+    return;
+  }
   CHECK_GPU_ERROR(cudaMemsetAsync(_p_d_unfinished, 0, sizeof(int), _stream));
-  if (_generate_method == GenerateMethod::Topk) {
+  if (_num_row_params > 0) {
+    if (_num_row_params < _batch_size) {
+      printf("Error! %d generation configs for a batch of %d rows\n",
+             _num_row_params, _batch_size);
+      throw std::runtime_error("missing generation configs");
+    }
+    cuda::ker_topp_threshold_sample_launcher<T>(
+        _batch_size, _seq_len, _prompt_len, _max_step, _logits_seq_len,
+        _max_thread_per_block, _stream, logits_ptr, logits_bias_ptr,
+        inp_tokens_ptr, _trg_vocab_size, 0, 1.f, 1.f, 1.f, 0.f,
+        _p_d_row_params, _p_d_unfinished, _p_d_curandstate, _eos_id);
+  } else if (_generate_method == GenerateMethod::Topk) {
     cuda::ker_topk_sample_launcher<T>(
         _batch_size, _seq_len, _prompt_len, _max_step, _logits_seq_len,
         _max_thread_per_block, _stream, logits_ptr, logits_bias_ptr,
         inp_tokens_ptr, out_tokens_ptr, _trg_vocab_size, _topk, _p_d_unfinished,
         _p_d_curandstate, _eos_id);
   } else if (_generate_method == GenerateMethod::Topp) {
-    cuda::ker_topp_sample_launcher<T>(
+    cuda::ker_topp_threshold_sample_launcher<T>(
         _batch_size, _seq_len, _prompt_len, _max_step, _logits_seq_len,
         _max_thread_per_block, _stream, logits_ptr, logits_bias_ptr,
-        inp_tokens_ptr, out_tokens_ptr, _trg_vocab_size, _topp, _p_d_unfinished,
+        inp_tokens_ptr, _trg_vocab_size, 0, _topp, _temperature,
+        _repetition_penalty, _min_p, nullptr, _p_d_unfinished,
         _p_d_curandstate, _eos_id);
   }
 
-  CHECK_GPU_ERROR(cudaMemcpyAsync(&_h_unfinished, _p_d_unfinished, sizeof(int),
-                                  cudaMemcpyDeviceToHost, _stream));
-  CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
+  if (_cur_step == 0) {
+    _checked_steps = _scanned_steps = 0;
+  }
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_h_unfinished + _cur_step, _p_d_unfinished,
+                                  sizeof(int), cudaMemcpyDeviceToHost,
+                                  _stream));
+  _num_steps = _cur_step + 1;
+  if (_num_steps % _stop_check_interval == 0) {
+    CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
+    _checked_steps = _num_steps;
+  }
+#elif defined LIGHTSEQ_x86
+  std::uniform_real_distribution<float> uniform(0.f, 1.f);
+  for (int i = 0; i < _batch_size; i++) _random_x[i] = uniform(_rng);
+  if (_generate_method == GenerateMethod::Topk) {
+    x86::launch_topk_sample<T>(
+        logits_ptr, logits_bias_ptr, inp_tokens_ptr, _h_unfinished + _cur_step,
+        _random_x.data(), _batch_size, _seq_len, _prompt_len, _max_step,
+        _logits_seq_len, _trg_vocab_size, _topk, _eos_id);
+  } else if (_generate_method == GenerateMethod::Topp) {
+    x86::launch_topp_sample<T>(
+        logits_ptr, logits_bias_ptr, inp_tokens_ptr, _h_unfinished + _cur_step,
+        _random_x.data(), _batch_size, _seq_len, _prompt_len, _max_step,
+        _logits_seq_len, _trg_vocab_size, _topp, _eos_id);
+  }
+  if (_cur_step == 0) {
+    _scanned_steps = 0;
+  }
+  // the flags are written on the host, they are all checked.
+  _num_steps = _checked_steps = _cur_step + 1;
+#elif defined LIGHTSEQ_arm
+  std::uniform_real_distribution<float> uniform(0.f, 1.f);
+  for (int i = 0; i < _batch_size; i++) _random_x[i] = uniform(_rng);
+  if (_generate_method == GenerateMethod::Topk) {
+    arm::launch_topk_sample<T>(
+        logits_ptr, logits_bias_ptr, inp_tokens_ptr, _h_unfinished + _cur_step,
+        _random_x.data(), _batch_size, _seq_len, _prompt_len, _max_step,
+        _logits_seq_len, _trg_vocab_size, _topk, _eos_id);
+  } else if (_generate_method == GenerateMethod::Topp) {
+    arm::launch_topp_sample<T>(
+        logits_ptr, logits_bias_ptr, inp_tokens_ptr, _h_unfinished + _cur_step,
+        _random_x.data(), _batch_size, _seq_len, _prompt_len, _max_step,
+        _logits_seq_len, _trg_vocab_size, _topp, _eos_id);
+  }
+  if (_cur_step == 0) {
+    _scanned_steps = 0;
+  }
+  // the flags are written on the host, they are all checked.
+  _num_steps = _checked_steps = _cur_step + 1;
 #endif
 }
 
+template <typename T>
+void SamplingOp<T>::set_sampling_params(float temperature,
+                                        float repetition_penalty,
+                                        float min_p) {
+  if (temperature <= 0.f || repetition_penalty <= 0.f || min_p < 0.f ||
+      min_p >= 1.f) {
+    printf("Error! sampling params need temperature > 0, "
+           "repetition_penalty > 0 and min_p in [0, 1)\n");
+    throw std::runtime_error("invalid sampling params");
+  }
+  _temperature = temperature;
+  _repetition_penalty = repetition_penalty;
+  _min_p = min_p;
+#ifndef LIGHTSEQ_cuda
+  if (temperature != 1.f || repetition_penalty != 1.f || min_p != 0.f) {
+    printf("sampling params are only applied on cuda, ignored.\n");
+  }
+#endif
+}
+
+template <typename T>
+void SamplingOp<T>::set_generation_configs(
+    const std::vector<cuda::GenerationConfig>& configs) {
+  if (int(configs.size()) > _max_batch_size) {
+    printf("Error! %zu generation configs for a max batch size of %d\n",
+           configs.size(), _max_batch_size);
+    throw std::runtime_error("too many generation configs");
+  }
+#ifdef LIGHTSEQ_cuda
+  std::vector<cuda::RowSamplingParams> row_params(configs.size());
+  for (size_t i = 0; i < configs.size(); i++) {
+    const cuda::GenerationConfig& config = configs[i];
+    if (config.topk < 0 || config.topp <= 0.f || config.topp > 1.f ||
+        config.temperature <= 0.f || config.repetition_penalty <= 0.f ||
+        config.min_p < 0.f || config.min_p >= 1.f ||
+        config.stop_tokens.size() > cuda::kMaxStopTokens) {
+      printf("Error! invalid generation config of row %zu, it needs topk >= "
+             "0, topp in (0, 1], temperature > 0, repetition_penalty > 0, "
+             "min_p in [0, 1) and at most %d stop tokens\n",
+             i, cuda::kMaxStopTokens);
+      throw std::runtime_error("invalid generation config");
+    }
+    cuda::RowSamplingParams& params = row_params[i];
+    params.topk = config.topk;
+    params.topp = config.topp;
+    params.temperature = config.temperature;
+    params.repetition_penalty = config.repetition_penalty;
+    params.min_p = config.min_p;
+    params.max_new_tokens = config.max_new_tokens;
+    params.num_stop_tokens = config.stop_tokens.size();
+    std::copy(config.stop_tokens.begin(), config.stop_tokens.end(),
+              params.stop_tokens);
+  }
+  // the previous forward may still read the params
+  CHECK_GPU_ERROR(cudaStreamSynchronize(_context_ptr->get_stream()));
+  CHECK_GPU_ERROR(cudaMemcpy(_p_d_row_params, row_params.data(),
+                             row_params.size() * sizeof(row_params[0]),
+                             cudaMemcpyHostToDevice));
+  _num_row_params = row_params.size();
+#else
+  if (!configs.empty()) {
+    printf("per row generation configs are only supported on cuda, "
+           "ignored.\n");
+  }
+#endif
+}
+
+template <typename T>
+void SamplingOp<T>::clear_step_flags() {
+#ifdef LIGHTSEQ_cuda
+  CHECK_GPU_ERROR(cudaMemsetAsync(_p_d_step_unfinished, 0,
+                                  _max_step * sizeof(int),
+                                  _context_ptr->get_stream()));
+#endif
+}
+
+template <typename T>
+void SamplingOp<T>::fetch_step_flags(int cur_step, int offset,
+                                     int num_steps) {
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  CHECK_GPU_ERROR(cudaMemcpyAsync(
+      _h_unfinished + cur_step, _p_d_step_unfinished + offset,
+      num_steps * sizeof(int), cudaMemcpyDeviceToHost, stream));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(stream));
+  _num_steps = _checked_steps = cur_step + num_steps;
+#endif
+}
+
+template <typename T>
+void SamplingOp<T>::fork_kv_rows(int* kv_rows, int prompt_rows, int num_rows,
+                                 int prompt_len) {
+  if (num_rows > _max_batch_size) {
+    printf("Error! %d sample rows exceed the max batch size %d\n", num_rows,
+           _max_batch_size);
+    throw std::runtime_error("too many sample rows");
+  }
+#ifdef LIGHTSEQ_cuda
+  cuda::ker_fork_kv_rows_launcher(num_rows, _max_thread_per_block,
+                                  _context_ptr->get_stream(), kv_rows,
+                                  prompt_rows, prompt_len, _max_step);
+#endif
+}
+
+template <typename T>
+bool SamplingOp<T>::is_stop() {
+  for (; _scanned_steps < _checked_steps; _scanned_steps++) {
+    if (_h_unfinished[_scanned_steps] == 0) return true;
+  }
+  return false;
+}
+
+template <typename T>
+int SamplingOp<T>::stop_step(int steps) {
+#ifdef LIGHTSEQ_cuda
+  if (_checked_steps < _num_steps) {
+    CHECK_GPU_ERROR(cudaStreamSynchronize(_context_ptr->get_stream()));
+    _checked_steps = _num_steps;
+  }
+#endif
+  int last_step = std::min(steps + 1, _checked_steps);
+  for (int step = 0; step < last_step; step++) {
+    if (_h_unfinished[step] == 0) return step;
+  }
+  return steps;
+}
+
 template class SamplingOp<float>;
 #ifdef LIGHTSEQ_cuda
 template class SamplingOp<__half>;
+template class SamplingOp<__nv_bfloat16>;
 #endif
 
 }  // namespace lightseq
@@ -0,0 +1,70 @@
+#include "sequence_pooling.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+SequencePoolingOp<T1, T2>::SequencePoolingOp(size_t max_batch_size,
+                                             size_t hidden_dim, int padding_id,
+                                             PoolingMethod method,
+                                             bool l2_norm, bool half_output)
+    : Operator("SequencePoolingOp"),
+      _max_batch_size(max_batch_size),
+      _hidden_dim(hidden_dim),
+      _padding_id(padding_id),
+      _method(method),
+      _l2_norm(l2_norm),
+      _half_output(half_output) {
+#ifndef LIGHTSEQ_cuda
+  if (half_output) {
+    printf("Error! SequencePoolingOp has no fp16 output on cpu.\n");
+    exit(-1);
+  }
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* SequencePoolingOp<T1, T2>::operator()(Variable* inp,
+                                                Variable* tokens) {
+  _result = new Variable(
+      "SequencePoolingOp_out", _max_batch_size * _hidden_dim,
+      _half_output ? cuda::DataType::kFloat16 : g_dtype<T1>(), g_dtype<T2>());
+  set_parents({inp, tokens});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void SequencePoolingOp<T1, T2>::forward() {
+  T1* inp_ptr = (T1*)parent(0)->value();
+  int* tokens_ptr = (int*)parent(1)->value();
+  char* out_ptr = child(0)->value();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  if (_half_output) {
+    cuda::launch_sequence_pooling(inp_ptr, tokens_ptr, (__half*)out_ptr,
+                                  _batch_size, _seq_len, _hidden_dim,
+                                  _padding_id, _method, _l2_norm,
+                                  _context_ptr->get_stream());
+  } else {
+    cuda::launch_sequence_pooling(inp_ptr, tokens_ptr, (T1*)out_ptr,
+                                  _batch_size, _seq_len, _hidden_dim,
+                                  _padding_id, _method, _l2_norm,
+                                  _context_ptr->get_stream());
+  }
+#else
+  x86::launch_sequence_pooling(inp_ptr, tokens_ptr, (T1*)out_ptr,
+                               _batch_size, _seq_len, _hidden_dim,
+                               _padding_id, _method, _l2_norm);
+#endif
+}
+
+template class SequencePoolingOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class SequencePoolingOp<__half, __half>;
+template class SequencePoolingOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
@@ -32,6 +32,14 @@ void SoftmaxOp<T1, T2>::forward() {
   cuda::launch_attn_softmax_new<T1>(out_ptr, inp_ptr, mask_ptr, _batchs, _nhead,
                                     _from_len, _to_len, _kv_size,
                                     _config_mask_future | _mask_future, stream);
+#elif defined LIGHTSEQ_x86
+  x86::launch_attn_softmax<T1>(out_ptr, inp_ptr, mask_ptr, _batchs, _nhead,
+                               _from_len, _to_len, _kv_size,
+                               _config_mask_future | _mask_future);
+#elif defined LIGHTSEQ_arm
+  arm::launch_attn_softmax<T1>(out_ptr, inp_ptr, mask_ptr, _batchs, _nhead,
+                               _from_len, _to_len, _kv_size,
+                               _config_mask_future | _mask_future);
 #endif
 }
 
@@ -56,5 +64,6 @@ void SoftmaxOp<T1, T2>::backward() {
 template class SoftmaxOp<float, float>;
 #ifdef LIGHTSEQ_cuda
 template class SoftmaxOp<__half, __half>;
+template class SoftmaxOp<__nv_bfloat16, __nv_bfloat16>;
 #endif
 }  // namespace lightseq
@@ -0,0 +1,126 @@
+#include "sparse24_linear.h"
+
+namespace lightseq {
+
+namespace {
+
+size_t round_up_tokens(size_t tokens) {
+#ifdef LIGHTSEQ_cuda
+  const size_t align = cuda::kSparse24Align;
+  return (tokens + align - 1) / align * align;
+#else
+  return tokens;
+#endif
+}
+
+}  // namespace
+
+template <typename T1, typename T2>
+Sparse24LinearOp<T1, T2>::Sparse24LinearOp(size_t max_batch_tokens,
+                                           size_t output_size,
+                                           size_t input_size)
+    : Operator("Sparse24LinearOp"),
+      _max_batch_tokens(max_batch_tokens),
+      _output_size(output_size),
+      _input_size(input_size) {
+  if (!supported()) {
+    printf("Error! Sparse24LinearOp needs cuSPARSELt, sm 80 and fp16 or "
+           "bf16\n");
+    exit(-1);
+  }
+#ifdef LIGHTSEQ_cuda
+  _gemm.reset(new cuda::Sparse24Gemm<T1>(output_size, input_size));
+#endif
+  size_t pad_tokens = round_up_tokens(max_batch_tokens);
+  _pad_inp.reset(
+      new Tensor("pad_inp", g_dtype<T1>(), pad_tokens * input_size));
+  _pad_out.reset(
+      new Tensor("pad_out", g_dtype<T1>(), pad_tokens * output_size));
+}
+
+template <typename T1, typename T2>
+bool Sparse24LinearOp<T1, T2>::supported() {
+#ifdef LIGHTSEQ_cuda
+  return cuda::Sparse24Gemm<T1>::supported();
+#else
+  return false;
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* Sparse24LinearOp<T1, T2>::operator()(Variable* inp,
+                                               Variable* weight) {
+  _result =
+      new Variable("Sparse24LinearOp_out", _max_batch_tokens * _output_size,
+                   g_dtype<T1>(), g_dtype<T2>());
+  set_parents({inp, weight});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+Variable* Sparse24LinearOp<T1, T2>::operator()(Variable* inp, Variable* weight,
+                                               Variable* residual) {
+  _use_residual = true;
+  _result = new Variable("Sparse24LinearOp_out", residual);
+  set_parents({inp, weight, residual});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void Sparse24LinearOp<T1, T2>::load_weight(Variable* weight_var,
+                                           const T1* weight) {
+#ifdef LIGHTSEQ_cuda
+  size_t compressed_size = _gemm->compressed_size();
+  if (_compressed_ptr == nullptr) {
+    _compressed_ptr = _context_ptr->allocator()->malloc_mem(compressed_size);
+  }
+  _gemm->compress(weight, _compressed_ptr, _context_ptr->get_stream());
+  weight_var->set_value(_compressed_ptr);
+  weight_var->set_shape({compressed_size});
+#endif
+}
+
+template <typename T1, typename T2>
+void Sparse24LinearOp<T1, T2>::forward() {
+  T1* input_ptr = (T1*)parent(0)->value();
+  char* weight_ptr = (char*)parent(1)->value();
+  T1* out_ptr = (T1*)child(0)->value();
+  T1* pad_inp_ptr = (T1*)_pad_inp->tensor();
+  T1* pad_out_ptr = (T1*)_pad_out->tensor();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  float beta = _use_residual ? 1.f : 0.f;
+  // column major: [output_size, batch_tokens] = weight * inp
+  size_t pad_tokens = round_up_tokens(_batch_tokens);
+  if (pad_tokens == _batch_tokens) {
+    _gemm->gemm(weight_ptr, _batch_tokens, input_ptr, out_ptr, beta, stream);
+    return;
+  }
+  // the padded tokens are garbage, only the real ones are copied back.
+  CHECK_GPU_ERROR(cudaMemcpyAsync(
+      pad_inp_ptr, input_ptr, _batch_tokens * _input_size * sizeof(T1),
+      cudaMemcpyDeviceToDevice, stream));
+  size_t out_bytes = _batch_tokens * _output_size * sizeof(T1);
+  if (_use_residual) {
+    CHECK_GPU_ERROR(cudaMemcpyAsync(pad_out_ptr, out_ptr, out_bytes,
+                                    cudaMemcpyDeviceToDevice, stream));
+  }
+  _gemm->gemm(weight_ptr, pad_tokens, pad_inp_ptr, pad_out_ptr, beta, stream);
+  CHECK_GPU_ERROR(cudaMemcpyAsync(out_ptr, pad_out_ptr, out_bytes,
+                                  cudaMemcpyDeviceToDevice, stream));
+#endif
+}
+
+template class Sparse24LinearOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class Sparse24LinearOp<__half, __half>;
+template class Sparse24LinearOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
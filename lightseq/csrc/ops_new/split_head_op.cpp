@@ -50,8 +50,6 @@ Variable* SplitHeadOp<T1, T2>::operator()(Variable* inp, Variable* bias,
 
 template <typename T1, typename T2>
 void SplitHeadOp<T1, T2>::forward() {
-  cudaStream_t _stream = _context_ptr->get_stream();
-
   T1* inp_ptr = (T1*)parent(0)->value();
   T1* bias_ptr = (T1*)parent(1)->value();
 
@@ -76,6 +74,7 @@ void SplitHeadOp<T1, T2>::forward() {
 
   int kv_len = (_cache_sz > 0) ? _cache_sz : _q_len;
 #ifdef LIGHTSEQ_cuda
+  cudaStream_t _stream = _context_ptr->get_stream();
   cuda::launch_split_head<T1>(inp_ptr, bias_ptr, q_ptr, k_ptr, v_ptr,
                               _batch_size, _hidden_size, _head_dim, _q_len,
                               kv_len, _step, _qkv_num, _stream);
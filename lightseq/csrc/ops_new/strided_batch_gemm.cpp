@@ -30,11 +30,28 @@ void StridedBatchGemmOp<T1, T2>::forward() {
   }
 
 #ifdef LIGHTSEQ_cuda
-  cublasHandle_t handle = _context_ptr->get_cublashandle();
-  cuda::cublas_strided_batched_gemm(
-      handle, _m, _n, _k, &_alpha, &_beta, _buffer_a, _buffer_b, output,
-      op_from_custom(_opA), op_from_custom(_opB), stride_a, stride_b, stride_c,
-      _batch_heads, cublasGemmAlgo_t(_gemm_algos[0]));
+  // the tuned cublasLt algo when LIGHTSEQ_GEMM_TUNE is on, see GemmTuner.
+  if (!cuda::cublaslt_tuned_gemm(
+          _context_ptr->get_cublaslthandle(), op_from_custom(_opA),
+          op_from_custom(_opB), _m, _n, _k, &_alpha, &_beta, _buffer_a,
+          _buffer_b, output, _context_ptr->get_stream(), _batch_heads,
+          stride_a, stride_b, stride_c)) {
+    cublasHandle_t handle = _context_ptr->get_cublashandle();
+    cuda::cublas_strided_batched_gemm(
+        handle, _m, _n, _k, &_alpha, &_beta, _buffer_a, _buffer_b, output,
+        op_from_custom(_opA), op_from_custom(_opB), stride_a, stride_b,
+        stride_c, _batch_heads, cublasGemmAlgo_t(_gemm_algos[0]));
+  }
+#elif defined LIGHTSEQ_x86
+  x86::strided_batch_gemm<T1>(
+      _opA == MATRIX_OP::Transpose, _opB == MATRIX_OP::Transpose, _m, _n, _k,
+      _alpha, _beta, _buffer_a, _buffer_b, output, stride_a, stride_b,
+      stride_c, _batch_heads);
+#elif defined LIGHTSEQ_arm
+  arm::strided_batch_gemm<T1>(
+      _opA == MATRIX_OP::Transpose, _opB == MATRIX_OP::Transpose, _m, _n, _k,
+      _alpha, _beta, _buffer_a, _buffer_b, output, stride_a, stride_b,
+      stride_c, _batch_heads);
 #endif
 }
 
@@ -65,13 +82,20 @@ void StridedBatchGemmOp<T1, T2>::backward() {
       (op_from_custom(_opB) == CUBLAS_OP_T ? CUBLAS_OP_N : CUBLAS_OP_T);
 
   cublasHandle_t handle = _context_ptr->get_cublashandle();
+  cublasLtHandle_t lt_handle = _context_ptr->get_cublaslthandle();
+  cudaStream_t stream = _context_ptr->get_stream();
   // Calculate d_A.
-  cuda::cublas_strided_batched_gemm(
-      handle, mb, kb, _n, &_alpha, &_beta,
-      (op_from_custom(_opA) == CUBLAS_OP_T ? _buffer_b : d_output),
-      (op_from_custom(_opA) == CUBLAS_OP_T ? d_output : _buffer_b), inpGradA,
-      CUBLAS_OP_N, op_b, stride_a, stride_b, stride_c, _batch_heads,
-      cublasGemmAlgo_t(_gemm_algos[1]));
+  T2* grad_a_lhs = op_from_custom(_opA) == CUBLAS_OP_T ? _buffer_b : d_output;
+  T2* grad_a_rhs = op_from_custom(_opA) == CUBLAS_OP_T ? d_output : _buffer_b;
+  if (!cuda::cublaslt_tuned_gemm(lt_handle, CUBLAS_OP_N, op_b, mb, kb, _n,
+                                 &_alpha, &_beta, grad_a_lhs, grad_a_rhs,
+                                 inpGradA, stream, _batch_heads, stride_a,
+                                 stride_b, stride_c)) {
+    cuda::cublas_strided_batched_gemm(
+        handle, mb, kb, _n, &_alpha, &_beta, grad_a_lhs, grad_a_rhs, inpGradA,
+        CUBLAS_OP_N, op_b, stride_a, stride_b, stride_c, _batch_heads,
+        cublasGemmAlgo_t(_gemm_algos[1]));
+  }
 
   // A need to transpose.
   cublasOperation_t op_a =
@@ -82,15 +106,21 @@ void StridedBatchGemmOp<T1, T2>::backward() {
   stride_c = _n * _k;
 
   // Calculate d_B.
-  cuda::cublas_strided_batched_gemm(
-      handle, _k, _n, _m, &_alpha, &_beta, _buffer_a, d_output, inpGradB, op_a,
-      CUBLAS_OP_N, stride_a, stride_b, stride_c, _batch_heads,
-      cublasGemmAlgo_t(_gemm_algos[2]));
+  if (!cuda::cublaslt_tuned_gemm(lt_handle, op_a, CUBLAS_OP_N, _k, _n, _m,
+                                 &_alpha, &_beta, _buffer_a, d_output,
+                                 inpGradB, stream, _batch_heads, stride_a,
+                                 stride_b, stride_c)) {
+    cuda::cublas_strided_batched_gemm(
+        handle, _k, _n, _m, &_alpha, &_beta, _buffer_a, d_output, inpGradB,
+        op_a, CUBLAS_OP_N, stride_a, stride_b, stride_c, _batch_heads,
+        cublasGemmAlgo_t(_gemm_algos[2]));
+  }
 #endif
 }
 
 template class StridedBatchGemmOp<float, float>;
 #ifdef LIGHTSEQ_cuda
 template class StridedBatchGemmOp<__half, __half>;
+template class StridedBatchGemmOp<__nv_bfloat16, __nv_bfloat16>;
 #endif
 }  // namespace lightseq
@@ -0,0 +1,111 @@
+#include "swiglu_linear.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+SwiGLULinearOp<T1, T2>::SwiGLULinearOp(size_t max_batch_tokens,
+                                       size_t inner_size, size_t input_size,
+                                       int quant_bits, int group_size)
+    : Operator("SwiGLULinearOp"),
+      _max_batch_tokens(max_batch_tokens),
+      _inner_size(inner_size),
+      _input_size(input_size),
+      _quant_bits(quant_bits),
+      _group_size(group_size > 0 ? group_size : input_size) {
+  if (inner_size % 4 != 0) {
+    printf("Error! SwiGLULinearOp inner size %zu is not a multiple of 4\n",
+           inner_size);
+    exit(-1);
+  }
+  if (quant_bits != 0 &&
+      ((quant_bits != 8 && quant_bits != 4) || input_size % _group_size != 0 ||
+       (quant_bits == 4 && _group_size % 2 != 0))) {
+    printf(
+        "Error! %d bits weight of [%zu, %zu] can not be quantized with group "
+        "size %d\n",
+        quant_bits, input_size, 2 * inner_size, _group_size);
+    exit(-1);
+  }
+#ifdef LIGHTSEQ_cuda
+  if (max_batch_tokens > cuda::kSwiGLUMaxGemvTokens) {
+    _gate_up_out.reset(new Tensor("gate_up_out", g_dtype<T1>(),
+                                  max_batch_tokens * 2 * inner_size));
+    if (quant_bits != 0) {
+      _dequant_weight.reset(new Tensor("dequant_weight", g_dtype<T1>(),
+                                       input_size * 2 * inner_size));
+    }
+  }
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* SwiGLULinearOp<T1, T2>::operator()(Variable* inp, Variable* weight) {
+  _result = new Variable("SwiGLULinearOp_out", _max_batch_tokens * _inner_size,
+                         g_dtype<T1>(), g_dtype<T2>());
+  set_parents({inp, weight});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+Variable* SwiGLULinearOp<T1, T2>::operator()(Variable* inp, Variable* qweight,
+                                             Variable* scale) {
+  _result = new Variable("SwiGLULinearOp_out", _max_batch_tokens * _inner_size,
+                         g_dtype<T1>(), g_dtype<T2>());
+  set_parents({inp, qweight, scale});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void SwiGLULinearOp<T1, T2>::forward() {
+  T1* input_ptr = (T1*)parent(0)->value();
+  char* weight_ptr = parent(1)->value();
+  T1* scale_ptr = _quant_bits ? (T1*)parent(2)->value() : nullptr;
+  T1* out_ptr = (T1*)child(0)->value();
+  T1* gate_up_ptr = _gate_up_out ? (T1*)_gate_up_out->tensor() : nullptr;
+  T1* dequant_ptr =
+      _dequant_weight ? (T1*)_dequant_weight->tensor() : nullptr;
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  if (_batch_tokens <= cuda::kSwiGLUMaxGemvTokens) {
+    if (_quant_bits) {
+      cuda::launch_weight_only_gemv_swiglu(
+          input_ptr, (int8_t*)weight_ptr, scale_ptr, out_ptr, _batch_tokens,
+          _input_size, _inner_size, _quant_bits, _group_size, stream);
+    } else {
+      cuda::launch_gemv_swiglu(input_ptr, (T1*)weight_ptr, out_ptr,
+                               _batch_tokens, _input_size, _inner_size,
+                               stream);
+    }
+    return;
+  }
+  T1* gemm_weight = (T1*)weight_ptr;
+  if (_quant_bits) {
+    cuda::launch_weight_only_dequant((int8_t*)weight_ptr, scale_ptr,
+                                     dequant_ptr, _input_size,
+                                     2 * _inner_size, _quant_bits,
+                                     _group_size, stream);
+    gemm_weight = dequant_ptr;
+  }
+  float alpha = 1.f, beta = 0.f;
+  cuda::cublas_gemm_ex(_context_ptr->get_cublashandle(), CUBLAS_OP_N,
+                       CUBLAS_OP_N, 2 * _inner_size, _batch_tokens,
+                       _input_size, &alpha, &beta, gemm_weight, input_ptr,
+                       gate_up_ptr);
+  cuda::launch_silu_elewise_product(gate_up_ptr, out_ptr, 1, _batch_tokens,
+                                    _inner_size, stream);
+#endif
+}
+
+template class SwiGLULinearOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class SwiGLULinearOp<__half, __half>;
+template class SwiGLULinearOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
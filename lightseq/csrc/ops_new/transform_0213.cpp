@@ -23,6 +23,10 @@ void Transform0213OP<T1, T2>::forward() {
   cudaStream_t _stream = _context_ptr->get_stream();
   cuda::launch_transform_0213<T1>(inp_ptr, res_ptr, _sz0, _sz1, _sz2, _sz3,
                                   _stream);
+#elif defined LIGHTSEQ_x86
+  x86::launch_transform_0213<T1>(inp_ptr, res_ptr, _sz0, _sz1, _sz2, _sz3);
+#elif defined LIGHTSEQ_arm
+  arm::launch_transform_0213<T1>(inp_ptr, res_ptr, _sz0, _sz1, _sz2, _sz3);
 #endif
 }
 
@@ -45,5 +49,6 @@ void Transform0213OP<T1, T2>::backward() {
 template class Transform0213OP<float, float>;
 #ifdef LIGHTSEQ_cuda
 template class Transform0213OP<__half, __half>;
+template class Transform0213OP<__nv_bfloat16, __nv_bfloat16>;
 #endif
 }  // namespace lightseq
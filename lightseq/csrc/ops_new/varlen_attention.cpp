@@ -0,0 +1,38 @@
+#include "varlen_attention.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+Variable* VarlenAttentionOp<T1, T2>::operator()(Variable* qkv,
+                                                Variable* qkv_bias) {
+  _result = new Variable("VarlenAttentionOp_out",
+                         _max_batch_tokens * _num_heads * _head_dim,
+                         g_dtype<T1>(), g_dtype<T2>());
+  set_parents({qkv, qkv_bias});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void VarlenAttentionOp<T1, T2>::forward() {
+  T1* qkv_ptr = (T1*)parent(0)->value();
+  T1* bias_ptr = (T1*)parent(1)->value();
+  T1* out_ptr = (T1*)child(0)->value();
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cuda::launch_varlen_flash_attention(qkv_ptr, bias_ptr, out_ptr, _cu_seqlens,
+                                      _batch_size, _num_heads, _max_seq_len,
+                                      _head_dim, _context_ptr->get_stream());
+#endif
+}
+
+template class VarlenAttentionOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class VarlenAttentionOp<__half, __half>;
+template class VarlenAttentionOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
@@ -0,0 +1,125 @@
+#include "weight_only_linear.h"
+
+namespace lightseq {
+
+template <typename T1, typename T2>
+WeightOnlyLinearOp<T1, T2>::WeightOnlyLinearOp(size_t max_batch_tokens,
+                                               size_t output_size,
+                                               size_t input_size,
+                                               int quant_bits, int group_size,
+                                               size_t max_dequant_cols)
+    : Operator("WeightOnlyLinearOp"),
+      _max_batch_tokens(max_batch_tokens),
+      _output_size(output_size),
+      _input_size(input_size),
+      _quant_bits(quant_bits),
+      _group_size(group_size > 0 ? group_size : input_size),
+      _dequant_cols(max_dequant_cols > 0 && max_dequant_cols < output_size
+                        ? max_dequant_cols
+                        : output_size) {
+  if ((quant_bits != 8 && quant_bits != 4) || output_size % 4 != 0 ||
+      input_size % _group_size != 0 ||
+      (quant_bits == 4 && _group_size % 2 != 0)) {
+    printf(
+        "Error! %d bits weight of [%zu, %zu] can not be quantized with group "
+        "size %d\n",
+        quant_bits, input_size, output_size, _group_size);
+    exit(-1);
+  }
+#ifdef LIGHTSEQ_cuda
+  if (max_batch_tokens > cuda::kWeightOnlyMaxGemvTokens) {
+    _dequant_weight.reset(new Tensor("dequant_weight", g_dtype<T1>(),
+                                     input_size * _dequant_cols));
+    if (_dequant_cols < output_size) {
+      _tile_out.reset(new Tensor("tile_out", g_dtype<T1>(),
+                                 max_batch_tokens * _dequant_cols));
+    }
+  }
+#endif
+}
+
+template <typename T1, typename T2>
+Variable* WeightOnlyLinearOp<T1, T2>::operator()(Variable* inp,
+                                                 Variable* qweight,
+                                                 Variable* scale) {
+  _result = new Variable("WeightOnlyLinearOp_out",
+                         _max_batch_tokens * _output_size, g_dtype<T1>(),
+                         g_dtype<T2>());
+  set_parents({inp, qweight, scale});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+Variable* WeightOnlyLinearOp<T1, T2>::operator()(Variable* inp,
+                                                 Variable* qweight,
+                                                 Variable* scale,
+                                                 Variable* residual) {
+  if (_dequant_cols < _output_size) {
+    printf("Error! WeightOnlyLinearOp with tiles can not add a residual\n");
+    exit(-1);
+  }
+  _use_residual = true;
+  _result = new Variable("WeightOnlyLinearOp_out", residual);
+  set_parents({inp, qweight, scale, residual});
+  this->set_children({_result});
+  return _result;
+}
+
+template <typename T1, typename T2>
+void WeightOnlyLinearOp<T1, T2>::forward() {
+  T1* input_ptr = (T1*)parent(0)->value();
+  int8_t* qweight_ptr = (int8_t*)parent(1)->value();
+  T1* scale_ptr = (T1*)parent(2)->value();
+  T1* out_ptr = (T1*)child(0)->value();
+  T1* dequant_ptr =
+      _dequant_weight ? (T1*)_dequant_weight->tensor() : nullptr;
+  T1* tile_out_ptr = _tile_out ? (T1*)_tile_out->tensor() : nullptr;
+
+  if (!_context_ptr->is_built()) {
+    return;
+  }
+
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = _context_ptr->get_stream();
+  if (_batch_tokens <= cuda::kWeightOnlyMaxGemvTokens) {
+    cuda::launch_weight_only_gemv(input_ptr, qweight_ptr, scale_ptr, out_ptr,
+                                  _batch_tokens, _input_size, _output_size,
+                                  _quant_bits, _group_size, _use_residual,
+                                  stream);
+    return;
+  }
+  if (_dequant_cols < _output_size) {
+    float alpha = 1.f, beta = 0.f;
+    for (size_t col = 0; col < _output_size; col += _dequant_cols) {
+      size_t cols = std::min(_dequant_cols, _output_size - col);
+      cuda::launch_weight_only_dequant(qweight_ptr, scale_ptr, dequant_ptr,
+                                       _input_size, _output_size, _quant_bits,
+                                       _group_size, stream, col, cols);
+      cuda::cublas_gemm_ex(_context_ptr->get_cublashandle(), CUBLAS_OP_N,
+                           CUBLAS_OP_N, cols, _batch_tokens, _input_size,
+                           &alpha, &beta, dequant_ptr, input_ptr,
+                           tile_out_ptr);
+      CHECK_GPU_ERROR(cudaMemcpy2DAsync(
+          out_ptr + col, _output_size * sizeof(T1), tile_out_ptr,
+          cols * sizeof(T1), cols * sizeof(T1), _batch_tokens,
+          cudaMemcpyDeviceToDevice, stream));
+    }
+    return;
+  }
+  cuda::launch_weight_only_dequant(qweight_ptr, scale_ptr, dequant_ptr,
+                                   _input_size, _output_size, _quant_bits,
+                                   _group_size, stream);
+  float alpha = 1.f, beta = _use_residual ? 1.f : 0.f;
+  cuda::cublas_gemm_ex(_context_ptr->get_cublashandle(), CUBLAS_OP_N,
+                       CUBLAS_OP_N, _output_size, _batch_tokens, _input_size,
+                       &alpha, &beta, dequant_ptr, input_ptr, out_ptr);
+#endif
+}
+
+template class WeightOnlyLinearOp<float, float>;
+#ifdef LIGHTSEQ_cuda
+template class WeightOnlyLinearOp<__half, __half>;
+template class WeightOnlyLinearOp<__nv_bfloat16, __nv_bfloat16>;
+#endif
+}  // namespace lightseq
@@ -21,6 +21,7 @@ float BertWeight<float>::float2required(float value) {
   return value;
 }
 
+#ifdef LIGHTSEQ_cuda
 /**
 fp16 version, cast fp32 into fp16
 */
@@ -28,6 +29,7 @@ template <>
 __half BertWeight<__half>::float2required(float value) {
   return __float2half_rn(value);
 }
+#endif
 
 /**
 Read model config stored in custom proto file.
@@ -46,6 +48,10 @@ void BertWeight<T>::proto_get_model_config(const Bert &bert) {
   _is_post_ln = bert.model_conf().is_post_ln();
   _use_gelu = bert.model_conf().use_gelu();
   _multilg_type = bert.model_conf().multilg_type();
+  _sparse_block_size = bert.model_conf().sparse_block_size();
+  _sparse_window_blocks = bert.model_conf().sparse_window_blocks();
+  _sparse_global_blocks = bert.model_conf().sparse_global_blocks();
+  _sparse_random_blocks = bert.model_conf().sparse_random_blocks();
 }
 
 /**
@@ -84,8 +90,7 @@ std::string BertWeight<T>::proto_parse_emb_wei(
   for (float e : value) raw_value.push_back(float2required(e));
   _d_src_emb_wei = raw_value;
   for (int e : offset)
-    _p_d_src_emb_wei.push_back(thrust::raw_pointer_cast(_d_src_emb_wei.data()) +
-                               e);
+    _p_d_src_emb_wei.push_back(raw_ptr(_d_src_emb_wei) + e);
 
   std::cout << "finish initializing emb_wei from host to device" << std::endl;
   return "";
@@ -192,7 +197,7 @@ std::string BertWeight<T>::proto_parse_enc_wei(const Bert &bert) {
   _d_enc_wei = raw_value;
 
   for (int e : offset)
-    _p_d_enc_wei.push_back(thrust::raw_pointer_cast(_d_enc_wei.data()) + e);
+    _p_d_enc_wei.push_back(raw_ptr(_d_enc_wei) + e);
   std::cout << "finish initializing enc_wei from host to device" << std::endl;
   return "";
 }
@@ -241,6 +246,29 @@ void BertWeight<T>::hdf5_get_model_config(hid_t hdf5_file) {
     // default value
     _multilg_type = 0;
   }
+
+  // optional, dense attention by default.
+  std::vector<std::pair<std::string, int *>> sparse_conf = {
+      {"model_conf/sparse_block_size", &_sparse_block_size},
+      {"model_conf/sparse_window_blocks", &_sparse_window_blocks},
+      {"model_conf/sparse_global_blocks", &_sparse_global_blocks},
+      {"model_conf/sparse_random_blocks", &_sparse_random_blocks}};
+  for (auto &conf : sparse_conf) {
+    try {
+      read_hdf5_dataset_scalar(hdf5_file, conf.first, H5T_NATIVE_INT,
+                               conf.second);
+    } catch (HDF5DatasetNotFoundError &e) {
+      *conf.second = 0;
+    }
+  }
+
+  // optional, the layers of kernels pruned 2:4.
+  try {
+    _sparse24_layers = read_hdf5_dataset_data_int(
+        hdf5_file, "model_conf/sparse24_layers", H5T_NATIVE_INT);
+  } catch (HDF5DatasetNotFoundError &e) {
+    _sparse24_layers.clear();
+  }
 }
 
 /**
@@ -294,8 +322,7 @@ void BertWeight<T>::hdf5_parse_emb_wei(hid_t hdf5_file) {
   for (float e : value) raw_value.push_back(float2required(e));
   _d_src_emb_wei = raw_value;
   for (int e : offset)
-    _p_d_src_emb_wei.push_back(thrust::raw_pointer_cast(_d_src_emb_wei.data()) +
-                               e);
+    _p_d_src_emb_wei.push_back(raw_ptr(_d_src_emb_wei) + e);
 
   std::cout << "Finish loading src_emb_wei from host to device" << std::endl;
 }
@@ -423,10 +450,128 @@ void BertWeight<T>::hdf5_parse_enc_wei(hid_t hdf5_file) {
   _d_enc_wei = raw_value;
 
   for (int e : offset)
-    _p_d_enc_wei.push_back(thrust::raw_pointer_cast(_d_enc_wei.data()) + e);
+    _p_d_enc_wei.push_back(raw_ptr(_d_enc_wei) + e);
   std::cout << "Finish loading enc_wei from host to device" << std::endl;
 }
 
+/**
+Load the optional exit heads of the layers into CPU memory.
+*/
+template <typename T>
+void BertWeight<T>::hdf5_parse_exit_wei(hid_t hdf5_file) {
+  _exit_kernels.assign(_n_enc_layer, {});
+  _exit_biases.assign(_n_enc_layer, {});
+  // H5Lexists fails on a path whose parent group does not exist.
+  if (H5Lexists(hdf5_file, "exit_heads", H5P_DEFAULT) <= 0) return;
+
+  for (int layer_id = 0; layer_id < _n_enc_layer; ++layer_id) {
+    std::string dataset_prefix = "exit_heads/" + std::to_string(layer_id);
+    if (H5Lexists(hdf5_file, dataset_prefix.c_str(), H5P_DEFAULT) <= 0) {
+      continue;
+    }
+    int num_labels = get_hdf5_dataset_size(hdf5_file, dataset_prefix + "/bias");
+    if (_num_labels == 0) _num_labels = num_labels;
+
+    _exit_biases[layer_id].resize(_num_labels);
+    read_hdf5_dataset_data(
+        hdf5_file, dataset_prefix + "/bias", H5T_NATIVE_FLOAT,
+        _exit_biases[layer_id].data(),
+        [=](int size) { return size != _num_labels; },
+        "Wrong exit head bias_size !");
+
+    _exit_kernels[layer_id].resize(_hidden_size * _num_labels);
+    read_hdf5_dataset_data(
+        hdf5_file, dataset_prefix + "/kernel", H5T_NATIVE_FLOAT,
+        _exit_kernels[layer_id].data(),
+        [=](int size) { return size != _hidden_size * _num_labels; },
+        "Wrong exit head kernel_size !");
+  }
+  if (_num_labels > 0) {
+    std::cout << "Finish loading the exit heads of " << _num_labels
+              << " labels" << std::endl;
+  }
+}
+
+/**
+Load the optional task heads into GPU memory, see BertMultiHead.
+*/
+template <typename T>
+void BertWeight<T>::hdf5_parse_task_head_wei(hid_t hdf5_file) {
+  _task_heads.clear();
+  _p_d_task_head_wei.clear();
+  if (H5Lexists(hdf5_file, "task_heads", H5P_DEFAULT) <= 0) return;
+
+  std::vector<float> value;
+  std::vector<std::vector<size_t>> offset;
+  for (int head_id = 0;; ++head_id) {
+    std::string dataset_prefix = "task_heads/" + std::to_string(head_id);
+    if (H5Lexists(hdf5_file, dataset_prefix.c_str(), H5P_DEFAULT) <= 0) {
+      break;
+    }
+    TaskHead head;
+    read_hdf5_dataset_scalar(hdf5_file, dataset_prefix + "/type",
+                             H5T_NATIVE_INT, &head.type);
+    if (head.type < 0 || head.type > 3) {
+      throw std::runtime_error("Wrong type of task head " +
+                               std::to_string(head_id));
+    }
+    try {
+      read_hdf5_dataset_scalar(hdf5_file, dataset_prefix + "/pooling",
+                               H5T_NATIVE_INT, &head.pooling);
+    } catch (HDF5DatasetNotFoundError &e) {
+      // cls
+      head.pooling = 0;
+    }
+    if (head.pooling < 0 || head.pooling > 2) {
+      throw std::runtime_error("Wrong pooling of task head " +
+                               std::to_string(head_id));
+    }
+    offset.push_back({});
+    // the pooling head has no weights.
+    if (head.type == 3) {
+      head.num_labels = _hidden_size;
+      _task_heads.push_back(head);
+      continue;
+    }
+
+    int num_labels =
+        get_hdf5_dataset_size(hdf5_file, dataset_prefix + "/bias");
+    head.num_labels = num_labels;
+    std::vector<std::pair<std::string, int>> datasets = {
+        {"kernel", _hidden_size * num_labels}, {"bias", num_labels}};
+    if (head.type == 2) {
+      datasets.push_back({"crf_start_transitions", num_labels});
+      datasets.push_back({"crf_end_transitions", num_labels});
+      datasets.push_back({"crf_transitions", num_labels * num_labels});
+    }
+    for (auto &dataset : datasets) {
+      size_t idx = value.size();
+      int expected = dataset.second;
+      offset.back().push_back(idx);
+      value.resize(idx + expected);
+      read_hdf5_dataset_data(
+          hdf5_file, dataset_prefix + "/" + dataset.first, H5T_NATIVE_FLOAT,
+          value.data() + idx, [=](int size) { return size != expected; },
+          "Wrong task head " + dataset.first + "_size !");
+    }
+    _task_heads.push_back(head);
+  }
+
+  std::vector<T> raw_value;
+  raw_value.reserve(value.size());
+  for (float e : value) raw_value.push_back(float2required(e));
+  _d_task_head_wei = raw_value;
+
+  for (auto &head_offset : offset) {
+    _p_d_task_head_wei.push_back({});
+    for (size_t e : head_offset) {
+      _p_d_task_head_wei.back().push_back(raw_ptr(_d_task_head_wei) + e);
+    }
+  }
+  std::cout << "Finish loading " << _task_heads.size() << " task heads"
+            << std::endl;
+}
+
 /**
 Load the proto file into CPU memory and parse it.
 */
@@ -445,6 +590,11 @@ std::string BertWeight<T>::initializing(std::string weight_path) {
     }
 
     proto_get_model_config(bert);
+    // the exit heads are only read from a hdf5 file.
+    _exit_kernels.assign(_n_enc_layer, {});
+    _exit_biases.assign(_n_enc_layer, {});
+    _task_heads.clear();
+    _p_d_task_head_wei.clear();
     if (_hidden_size % 4 != 0) {
       return "hidden_size should be a multiple of 4 to avoid misaligned "
              "address in CUDA";
@@ -476,6 +626,8 @@ std::string BertWeight<T>::initializing(std::string weight_path) {
     // hdf5_parse_* would throw std::runtime_error on error
     hdf5_parse_emb_wei(hdf5_file);
     hdf5_parse_enc_wei(hdf5_file);
+    hdf5_parse_exit_wei(hdf5_file);
+    hdf5_parse_task_head_wei(hdf5_file);
     H5Fclose(hdf5_file);
 
     std::cout << "Finish loading all weight from host to device" << std::endl;
@@ -486,7 +638,9 @@ std::string BertWeight<T>::initializing(std::string weight_path) {
   }
 }
 
+#ifdef LIGHTSEQ_cuda
 template class BertWeight<__half>;
+#endif
 template class BertWeight<float>;
 
 }  // namespace lightseq
@@ -0,0 +1,225 @@
+#include "flat_weight.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+namespace lightseq {
+
+namespace {
+
+const char kFlatWeightMagic[8] = {'L', 'S', 'F', 'L', 'A', 'T', '0', '1'};
+
+size_t align_up(size_t bytes) {
+  return (bytes + kFlatWeightAlignment - 1) / kFlatWeightAlignment *
+         kFlatWeightAlignment;
+}
+
+#ifdef LIGHTSEQ_cuda
+void check_cuda(cudaError_t err, const std::string &what) {
+  if (err != cudaSuccess) {
+    throw std::runtime_error(what + ": " + cudaGetErrorString(err));
+  }
+}
+#endif
+
+}  // namespace
+
+void FlatWeightWriter::add_tensor(int64_t layer, const void *d_data,
+                                  size_t bytes) {
+  _entries.push_back({{layer, _data_bytes, bytes}, d_data});
+  _data_bytes += align_up(bytes);
+}
+
+void FlatWeightWriter::write(const std::string &path) const {
+  std::string config;
+  for (const auto &kv : _config) {
+    config += kv.first + " " + kv.second + "\n";
+  }
+  uint64_t config_bytes = config.size();
+  uint64_t tensor_num = _entries.size();
+  size_t header_bytes = sizeof(kFlatWeightMagic) + sizeof(uint64_t) +
+                        config_bytes + sizeof(uint64_t) +
+                        tensor_num * 3 * sizeof(uint64_t);
+  size_t data_begin = align_up(header_bytes);
+
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    throw std::runtime_error("Unable to write flat weight file " + path);
+  }
+  std::vector<char> header(data_begin, 0);
+  char *ptr = header.data();
+  auto put = [&](const void *src, size_t bytes) {
+    memcpy(ptr, src, bytes);
+    ptr += bytes;
+  };
+  put(kFlatWeightMagic, sizeof(kFlatWeightMagic));
+  put(&config_bytes, sizeof(config_bytes));
+  put(config.data(), config_bytes);
+  put(&tensor_num, sizeof(tensor_num));
+  for (const Entry &entry : _entries) {
+    uint64_t offset = data_begin + entry.tensor.offset;
+    put(&entry.tensor.layer, sizeof(int64_t));
+    put(&offset, sizeof(offset));
+    put(&entry.tensor.bytes, sizeof(uint64_t));
+  }
+  bool ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+
+  std::vector<char> buffer;
+  for (const Entry &entry : _entries) {
+    buffer.assign(align_up(entry.tensor.bytes), 0);
+#ifdef LIGHTSEQ_cuda
+    check_cuda(cudaMemcpy(buffer.data(), entry.data, entry.tensor.bytes,
+                          cudaMemcpyDefault),
+               "Copy of a weight to host");
+#else
+    memcpy(buffer.data(), entry.data, entry.tensor.bytes);
+#endif
+    ok = ok && fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    throw std::runtime_error("Unable to write flat weight file " + path);
+  }
+}
+
+FlatWeightReader::FlatWeightReader(const std::string &path) {
+  _fd = open(path.c_str(), O_RDONLY);
+  struct stat file_stat;
+  if (_fd < 0 || fstat(_fd, &file_stat) != 0) {
+    throw std::runtime_error("Unable to read flat weight file " + path);
+  }
+  _file_bytes = file_stat.st_size;
+  void *data = mmap(nullptr, _file_bytes, PROT_READ, MAP_PRIVATE, _fd, 0);
+  if (data == MAP_FAILED) {
+    close(_fd);
+    throw std::runtime_error("Unable to map flat weight file " + path);
+  }
+  _data = static_cast<const char *>(data);
+  madvise(data, _file_bytes, MADV_SEQUENTIAL);
+
+  const char *ptr = _data;
+  const char *end = _data + _file_bytes;
+  auto get = [&](void *dst, size_t bytes) {
+    if (ptr + bytes > end) {
+      throw std::runtime_error("Truncated flat weight file " + path);
+    }
+    memcpy(dst, ptr, bytes);
+    ptr += bytes;
+  };
+  char magic[sizeof(kFlatWeightMagic)];
+  get(magic, sizeof(magic));
+  if (memcmp(magic, kFlatWeightMagic, sizeof(magic)) != 0) {
+    throw std::runtime_error(path + " is not a flat weight file");
+  }
+  uint64_t config_bytes;
+  get(&config_bytes, sizeof(config_bytes));
+  std::string config(config_bytes, '\0');
+  get(&config[0], config_bytes);
+  std::istringstream lines(config);
+  std::string key, value;
+  while (lines >> key && std::getline(lines >> std::ws, value)) {
+    _config[key] = value;
+  }
+
+  uint64_t tensor_num;
+  get(&tensor_num, sizeof(tensor_num));
+  _tensors.resize(tensor_num);
+  for (FlatTensor &tensor : _tensors) {
+    get(&tensor.layer, sizeof(int64_t));
+    get(&tensor.offset, sizeof(uint64_t));
+    get(&tensor.bytes, sizeof(uint64_t));
+    if (tensor.offset + tensor.bytes > _file_bytes) {
+      throw std::runtime_error("Truncated flat weight file " + path);
+    }
+  }
+
+#ifdef LIGHTSEQ_cuda
+  for (char *&chunk : _chunks) {
+    check_cuda(cudaHostAlloc(&chunk, kChunkBytes, cudaHostAllocPortable),
+               "Pinned chunk of the flat weight");
+  }
+#endif
+}
+
+FlatWeightReader::~FlatWeightReader() {
+#ifdef LIGHTSEQ_cuda
+  synchronize();
+  if (_event_device >= 0) {
+    int device;
+    cudaGetDevice(&device);
+    cudaSetDevice(_event_device);
+    for (cudaEvent_t event : _events) cudaEventDestroy(event);
+    cudaSetDevice(device);
+  }
+  for (char *chunk : _chunks) cudaFreeHost(chunk);
+#endif
+  munmap(const_cast<char *>(_data), _file_bytes);
+  close(_fd);
+}
+
+const std::string &FlatWeightReader::config(const std::string &key) const {
+  auto iter = _config.find(key);
+  if (iter == _config.end()) {
+    throw std::runtime_error("Flat weight file has no config " + key);
+  }
+  return iter->second;
+}
+
+#ifdef LIGHTSEQ_cuda
+void FlatWeightReader::upload(size_t index, void *d_dst, cudaStream_t stream) {
+  int device;
+  check_cuda(cudaGetDevice(&device), "Device of the flat weight");
+  if (device != _event_device) {
+    // events are recorded on the streams of their own device.
+    synchronize();
+    if (_event_device >= 0) {
+      check_cuda(cudaSetDevice(_event_device), "Device of the flat weight");
+      for (cudaEvent_t event : _events) cudaEventDestroy(event);
+      check_cuda(cudaSetDevice(device), "Device of the flat weight");
+    }
+    for (cudaEvent_t &event : _events) {
+      check_cuda(cudaEventCreateWithFlags(&event, cudaEventDisableTiming),
+                 "Event of the flat weight");
+    }
+    _event_device = device;
+  }
+
+  const FlatTensor &tensor = _tensors.at(index);
+  const char *src = _data + tensor.offset;
+  char *dst = static_cast<char *>(d_dst);
+  for (size_t done = 0; done < tensor.bytes; done += kChunkBytes) {
+    size_t bytes = std::min(kChunkBytes, tensor.bytes - done);
+    int k = _next_chunk;
+    _next_chunk = 1 - _next_chunk;
+    // the chunk is free once its last copy finished
+    check_cuda(cudaEventSynchronize(_events[k]), "Copy of the flat weight");
+    memcpy(_chunks[k], src + done, bytes);
+    check_cuda(cudaMemcpyAsync(dst + done, _chunks[k], bytes,
+                               cudaMemcpyHostToDevice, stream),
+               "Copy of the flat weight");
+    check_cuda(cudaEventRecord(_events[k], stream), "Copy of the flat weight");
+  }
+}
+
+void FlatWeightReader::synchronize() {
+  if (_event_device < 0) return;
+  for (cudaEvent_t event : _events) cudaEventSynchronize(event);
+}
+#else
+void FlatWeightReader::upload(size_t index, void *d_dst) {
+  const FlatTensor &tensor = _tensors.at(index);
+  memcpy(d_dst, _data + tensor.offset, tensor.bytes);
+}
+
+void FlatWeightReader::synchronize() {}
+#endif
+
+}  // namespace lightseq
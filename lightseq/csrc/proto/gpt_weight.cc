@@ -1,6 +1,7 @@
 #include "gpt_weight.h"
 
 #include <fstream>
+#include <future>
 
 /**
 @file
@@ -326,6 +327,33 @@ void GptWeight<T>::hdf5_get_model_config(hid_t hdf5_file) {
   } catch (HDF5DatasetNotFoundError &e) {
     _use_gelu = true;
   }
+
+  // optional, the layers of kernels pruned 2:4.
+  try {
+    _sparse24_layers = read_hdf5_dataset_data_int(
+        hdf5_file, "model_conf/sparse24_layers", H5T_NATIVE_INT);
+  } catch (HDF5DatasetNotFoundError &e) {
+    _sparse24_layers.clear();
+  }
+
+  // optional, the cutoffs of the adaptive softmax clusters.
+  try {
+    _adaptive_cutoffs = read_hdf5_dataset_data_int(
+        hdf5_file, "model_conf/adaptive_cutoffs", H5T_NATIVE_INT);
+  } catch (HDF5DatasetNotFoundError &e) {
+    _adaptive_cutoffs.clear();
+  }
+  if (!_adaptive_cutoffs.empty()) {
+    _adaptive_cutoffs.push_back(_src_vocab_size);
+    for (int i = 0; i + 1 < _adaptive_cutoffs.size(); i++) {
+      if (_adaptive_cutoffs[i] <= (i > 0 ? _adaptive_cutoffs[i - 1] : 0) ||
+          _adaptive_cutoffs[i] >= _src_vocab_size) {
+        throw std::runtime_error(
+            "model_conf/adaptive_cutoffs should be increasing in (0, vocab "
+            "size)");
+      }
+    }
+  }
 }
 
 /**
@@ -385,124 +413,209 @@ void GptWeight<T>::hdf5_parse_emb_wei(hid_t hdf5_file) {
 }
 
 /**
-Load the weights of encoder into GPU memory.
+Read the datasets of encoder layer layer_id into value, with the offsets of
+the weights of get_enc_wei in the layer.
 */
 template <typename T>
-void GptWeight<T>::hdf5_parse_enc_wei(hid_t hdf5_file) {
-  size_t value_size =
-      (_hidden_size * 2 + _hidden_size * _hidden_size * 3 + _hidden_size * 3 +
-       _hidden_size * _hidden_size + _hidden_size * 3 +
-       _hidden_size * _inner_size + _inner_size + _hidden_size * _inner_size +
-       _hidden_size) *
-      _n_enc_layer;
-  std::vector<int> offset;
-  std::vector<float> value(value_size);
-  std::cout << "loading " << value_size * sizeof(T) / (1024 * 1024)
-            << " MB of encoder weight." << std::endl;
+void GptWeight<T>::hdf5_read_enc_layer(hid_t hdf5_file, int layer_id,
+                                       float* value,
+                                       std::vector<size_t>* offset) {
+  offset->clear();
+  std::string dataset_prefix = "encoder_stack/" + std::to_string(layer_id);
+  size_t idx = 0;
+
+  offset->push_back(idx);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/multihead_norm_scale", H5T_NATIVE_FLOAT,
+      value + idx, [=](int size) { return size != _hidden_size; },
+      "Wrong multihead_norm_scale_size !");
+  idx += _hidden_size;
 
-  int idx = 0;
-  for (int layer_id = 0; layer_id < _n_enc_layer; ++layer_id) {
-    std::string dataset_prefix = "encoder_stack/" + std::to_string(layer_id);
+  offset->push_back(idx);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/multihead_norm_bias", H5T_NATIVE_FLOAT,
+      value + idx, [=](int size) { return size != _hidden_size; },
+      "Wrong multihead_norm_bias_size !");
+  idx += _hidden_size;
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/multihead_norm_scale", H5T_NATIVE_FLOAT,
-        value.data() + idx, [=](int size) { return size != _hidden_size; },
-        "Wrong multihead_norm_scale_size !");
-    idx += _hidden_size;
+  offset->push_back(idx);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/multihead_project_kernel_qkv",
+      H5T_NATIVE_FLOAT, value + idx,
+      [=](int size) { return size != _hidden_size * _hidden_size * 3; },
+      "Wrong multihead_project_kernel_qkv_size !");
+  idx += _hidden_size * _hidden_size * 3;
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/multihead_norm_bias", H5T_NATIVE_FLOAT,
-        value.data() + idx, [=](int size) { return size != _hidden_size; },
-        "Wrong multihead_norm_bias_size !");
-    idx += _hidden_size;
+  offset->push_back(idx);
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/multihead_project_kernel_qkv",
-        H5T_NATIVE_FLOAT, value.data() + idx,
-        [=](int size) { return size != _hidden_size * _hidden_size * 3; },
-        "Wrong multihead_project_kernel_qkv_size !");
-    idx += _hidden_size * _hidden_size * 3;
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/multihead_project_bias_qkv",
+      H5T_NATIVE_FLOAT, value + idx,
+      [=](int size) { return size != _hidden_size * 3; },
+      "Wrong multihead_project_bias_qkv_size !");
+  idx += _hidden_size * 3;
 
-    offset.push_back(idx);
+  offset->push_back(idx);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/multihead_project_kernel_output",
+      H5T_NATIVE_FLOAT, value + idx,
+      [=](int size) { return size != _hidden_size * _hidden_size; },
+      "Wrong multihead_project_kernel_output_size !");
+  idx += _hidden_size * _hidden_size;
 
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/multihead_project_bias_qkv",
-        H5T_NATIVE_FLOAT, value.data() + idx,
-        [=](int size) { return size != _hidden_size * 3; },
-        "Wrong multihead_project_bias_qkv_size !");
-    idx += _hidden_size * 3;
+  offset->push_back(idx);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/multihead_project_bias_output",
+      H5T_NATIVE_FLOAT, value + idx,
+      [=](int size) { return size != _hidden_size; },
+      "Wrong multihead_project_bias_output_size !");
+  idx += _hidden_size;
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/multihead_project_kernel_output",
-        H5T_NATIVE_FLOAT, value.data() + idx,
-        [=](int size) { return size != _hidden_size * _hidden_size; },
-        "Wrong multihead_project_kernel_output_size !");
-    idx += _hidden_size * _hidden_size;
+  offset->push_back(idx);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/ffn_norm_scale", H5T_NATIVE_FLOAT,
+      value + idx, [=](int size) { return size != _hidden_size; },
+      "Wrong ffn_norm_scale_size !");
+  idx += _hidden_size;
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/multihead_project_bias_output",
-        H5T_NATIVE_FLOAT, value.data() + idx,
-        [=](int size) { return size != _hidden_size; },
-        "Wrong multihead_project_bias_output_size !");
-    idx += _hidden_size;
+  offset->push_back(idx);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/ffn_norm_bias", H5T_NATIVE_FLOAT,
+      value + idx, [=](int size) { return size != _hidden_size; },
+      "Wrong ffn_norm_bias_size !");
+  idx += _hidden_size;
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/ffn_norm_scale", H5T_NATIVE_FLOAT,
-        value.data() + idx, [=](int size) { return size != _hidden_size; },
-        "Wrong ffn_norm_scale_size !");
-    idx += _hidden_size;
+  offset->push_back(idx);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/ffn_first_kernel", H5T_NATIVE_FLOAT,
+      value + idx,
+      [=](int size) { return size != _hidden_size * _inner_size; },
+      "Wrong ffn_first_kernel_size !");
+  idx += _hidden_size * _inner_size;
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/ffn_norm_bias", H5T_NATIVE_FLOAT,
-        value.data() + idx, [=](int size) { return size != _hidden_size; },
-        "Wrong ffn_norm_bias_size !");
-    idx += _hidden_size;
+  offset->push_back(idx);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/ffn_first_bias", H5T_NATIVE_FLOAT,
+      value + idx, [=](int size) { return size != _inner_size; },
+      "Wrong ffn_first_bias_size !");
+  idx += _inner_size;
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/ffn_first_kernel", H5T_NATIVE_FLOAT,
-        value.data() + idx,
-        [=](int size) { return size != _hidden_size * _inner_size; },
-        "Wrong ffn_first_kernel_size !");
-    idx += _hidden_size * _inner_size;
+  offset->push_back(idx);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/ffn_second_kernel", H5T_NATIVE_FLOAT,
+      value + idx,
+      [=](int size) { return size != _hidden_size * _inner_size; },
+      "Wrong ffn_second_kernel_size !");
+  idx += _hidden_size * _inner_size;
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/ffn_first_bias", H5T_NATIVE_FLOAT,
-        value.data() + idx, [=](int size) { return size != _inner_size; },
-        "Wrong ffn_first_bias_size !");
-    idx += _inner_size;
+  offset->push_back(idx);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/ffn_second_bias", H5T_NATIVE_FLOAT,
+      value + idx, [=](int size) { return size != _hidden_size; },
+      "Wrong ffn_second_bias_size !");
+  idx += _hidden_size;
+}
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/ffn_second_kernel", H5T_NATIVE_FLOAT,
-        value.data() + idx,
-        [=](int size) { return size != _hidden_size * _inner_size; },
-        "Wrong ffn_second_kernel_size !");
-    idx += _hidden_size * _inner_size;
+/**
+Load the weights of encoder into GPU memory. A thread reads the datasets of
+layer N + 1 from the file while layer N is converted and copied.
+*/
+template <typename T>
+void GptWeight<T>::hdf5_parse_enc_wei(hid_t hdf5_file) {
+  size_t layer_size =
+      _hidden_size * 2 + _hidden_size * _hidden_size * 3 + _hidden_size * 3 +
+      _hidden_size * _hidden_size + _hidden_size * 3 +
+      _hidden_size * _inner_size + _inner_size + _hidden_size * _inner_size +
+      _hidden_size;
+  size_t value_size = layer_size * _n_enc_layer;
+  std::cout << "loading " << value_size * sizeof(T) / (1024 * 1024)
+            << " MB of encoder weight." << std::endl;
+  _d_enc_wei.resize(value_size);
+  T* d_enc_wei = thrust::raw_pointer_cast(_d_enc_wei.data());
+
+  // double buffered, the hdf5 library is only called by the reading thread.
+  std::vector<float> value[2] = {std::vector<float>(layer_size),
+                                 std::vector<float>(layer_size)};
+  std::vector<size_t> offset[2];
+  std::future<void> next_layer = std::async(std::launch::async, [&]() {
+    hdf5_read_enc_layer(hdf5_file, 0, value[0].data(), &offset[0]);
+  });
+  std::vector<T> raw_value(layer_size);
+  for (int layer_id = 0; layer_id < _n_enc_layer; ++layer_id) {
+    // rethrows the error of the read
+    next_layer.get();
+    int cur = layer_id % 2;
+    if (layer_id + 1 < _n_enc_layer) {
+      next_layer = std::async(std::launch::async, [&, cur, layer_id]() {
+        hdf5_read_enc_layer(hdf5_file, layer_id + 1, value[1 - cur].data(),
+                            &offset[1 - cur]);
+      });
+    }
+    for (size_t i = 0; i < layer_size; i++) {
+      raw_value[i] = float2required(value[cur][i]);
+    }
+    T* d_layer = d_enc_wei + layer_id * layer_size;
+    cudaMemcpy(d_layer, raw_value.data(), layer_size * sizeof(T),
+               cudaMemcpyHostToDevice);
+    for (size_t e : offset[cur]) _p_d_enc_wei.push_back(d_layer + e);
+  }
+  std::cout << "finish initializing enc_wei from host to device" << std::endl;
+}
+
+/**
+Load the weights of the adaptive softmax head into GPU memory, the tail dims
+are the ones of the projections.
+*/
+template <typename T>
+void GptWeight<T>::hdf5_parse_adaptive_wei(hid_t hdf5_file) {
+  std::string dataset_prefix = "adaptive_softmax";
+  int num_clusters = _adaptive_cutoffs.size() - 1;
+  int head_size = (_adaptive_cutoffs[0] + num_clusters) * _hidden_size;
+  std::vector<int> sizes = {head_size};
+  std::vector<std::string> names = {dataset_prefix + "/head_kernel"};
+  _adaptive_tail_dims.clear();
+  for (int i = 0; i < num_clusters; i++) {
+    std::string tail_prefix =
+        dataset_prefix + "/tail_" + std::to_string(i) + "_";
+    int dim = get_hdf5_dataset_size(hdf5_file, tail_prefix + "proj_kernel") /
+              _hidden_size;
+    if (dim <= 0) {
+      throw std::runtime_error("Wrong " + tail_prefix + "proj_kernel size !");
+    }
+    _adaptive_tail_dims.push_back(dim);
+    sizes.push_back(dim * _hidden_size);
+    names.push_back(tail_prefix + "proj_kernel");
+    sizes.push_back(dim * (_adaptive_cutoffs[i + 1] - _adaptive_cutoffs[i]));
+    names.push_back(tail_prefix + "out_kernel");
+  }
 
+  size_t value_size = 0;
+  for (int size : sizes) value_size += size;
+  std::vector<float> value(value_size);
+  std::cout << "loading " << value_size * sizeof(T) / (1024 * 1024)
+            << " MB of adaptive softmax weight." << std::endl;
+  std::vector<size_t> offset;
+  size_t idx = 0;
+  for (int i = 0; i < sizes.size(); i++) {
     offset.push_back(idx);
+    int expected = sizes[i];
     read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/ffn_second_bias", H5T_NATIVE_FLOAT,
-        value.data() + idx, [=](int size) { return size != _hidden_size; },
-        "Wrong ffn_second_bias_size !");
-    idx += _hidden_size;
-  }  // for
+        hdf5_file, names[i], H5T_NATIVE_FLOAT, value.data() + idx,
+        [=](int size) { return size != expected; },
+        "Wrong " + names[i] + " size !");
+    idx += sizes[i];
+  }
 
   std::vector<T> raw_value;
+  raw_value.reserve(value.size());
   for (float e : value) raw_value.push_back(float2required(e));
-  _d_enc_wei = raw_value;
+  _d_adaptive_wei = raw_value;
+  for (size_t e : offset)
+    _p_d_adaptive_wei.push_back(
+        thrust::raw_pointer_cast(_d_adaptive_wei.data()) + e);
 
-  for (int e : offset)
-    _p_d_enc_wei.push_back(thrust::raw_pointer_cast(_d_enc_wei.data()) + e);
-  std::cout << "finish initializing enc_wei from host to device" << std::endl;
+  std::cout << "finish initializing adaptive softmax weight from host to device"
+            << std::endl;
 }
 
 /**
@@ -548,6 +661,7 @@ std::string GptWeight<T>::initializing(std::string weight_path) {
     // hdf5_parse_* would throw std::runtime_error on error
     hdf5_parse_emb_wei(hdf5_file);
     hdf5_parse_enc_wei(hdf5_file);
+    if (adaptive_softmax()) hdf5_parse_adaptive_wei(hdf5_file);
     H5Fclose(hdf5_file);
 
     std::cout << "Finish loading all weight from host to device" << std::endl;
@@ -19,14 +19,27 @@ class BertWeight {
   void hdf5_get_model_config(hid_t hdf5_file);
   void hdf5_parse_emb_wei(hid_t hdf5_file);
   void hdf5_parse_enc_wei(hid_t hdf5_file);
+  void hdf5_parse_exit_wei(hid_t hdf5_file);
+  void hdf5_parse_task_head_wei(hid_t hdf5_file);
   // store the weights pointer
   std::vector<const T *> _p_d_src_emb_wei;  // size: 4
   std::vector<const T *> _p_d_enc_wei;      // size: 12 * enc_layer_num
+  std::vector<std::vector<const T *>> _p_d_task_head_wei;
 
 #ifdef LIGHTSEQ_cuda
   // store the weights on gpu memory
   thrust::device_vector<T> _d_src_emb_wei;
   thrust::device_vector<T> _d_enc_wei;
+  thrust::device_vector<T> _d_task_head_wei;
+  static const T *raw_ptr(const thrust::device_vector<T> &wei) {
+    return thrust::raw_pointer_cast(wei.data());
+  }
+#else
+  // store the weights on host memory
+  std::vector<T> _d_src_emb_wei;
+  std::vector<T> _d_enc_wei;
+  std::vector<T> _d_task_head_wei;
+  static const T *raw_ptr(const std::vector<T> &wei) { return wei.data(); }
 #endif
 
  public:
@@ -46,6 +59,13 @@ class BertWeight {
     return _p_d_enc_wei;
   }
 
+  const std::vector<const T *> &get_task_head_wei(int head_id) const {
+    // {kernel, bias} of the classifiers, {kernel, bias,
+    // crf_start_transitions, crf_end_transitions, crf_transitions} of the
+    // crf, empty for the pooling, see TaskHeadLayer.
+    return _p_d_task_head_wei[head_id];
+  }
+
   int _hidden_size;
   int _inner_size;
   int _max_step;
@@ -59,6 +79,41 @@ class BertWeight {
   bool _is_post_ln;
   bool _use_gelu;
   int _multilg_type;
+  // the block layout of the self attention, see BlockSparseConfig, 0 for
+  // dense.
+  int _sparse_block_size = 0;
+  int _sparse_window_blocks = 0;
+  int _sparse_global_blocks = 0;
+  int _sparse_random_blocks = 0;
+  // The layers whose ffn kernels are pruned 2:4 along the input, for the
+  // sparse tensor cores, see Sparse24LinearOp. model_conf/sparse24_layers of
+  // a hdf5 file, empty by default.
+  std::vector<int> _sparse24_layers;
+  bool sparse24(int layer_id) const {
+    return std::find(_sparse24_layers.begin(), _sparse24_layers.end(),
+                     layer_id) != _sparse24_layers.end();
+  }
+
+  // The optional exit heads of the layers, see LIGHTSEQ_BERT_EXIT_ENTROPY of
+  // Bert: the [hidden_size, num_labels] kernel and the [num_labels] bias of
+  // layer i, on its [CLS] output, are exit_heads/i/kernel and
+  // exit_heads/i/bias of a hdf5 file. In fp32 on the host, empty for the
+  // layers without one.
+  std::vector<std::vector<float>> _exit_kernels;
+  std::vector<std::vector<float>> _exit_biases;
+  int _num_labels = 0;
+
+  // The optional task heads on the encoder output, see BertMultiHead:
+  // task_heads/i of a hdf5 file, with the int type of TaskHeadType, the
+  // optional int pooling of PoolingMethod, cls by default, and the weights
+  // of get_task_head_wei, the [hidden_size, num_labels] kernel as the
+  // classifier_kernel of BertCrf.
+  struct TaskHead {
+    int type;
+    int num_labels;
+    int pooling;
+  };
+  std::vector<TaskHead> _task_heads;
 
   void print_model_config() {
     std::cout << "***model config***" << std::endl;
@@ -72,6 +127,19 @@ class BertWeight {
     std::cout << "use_gelu: " << _use_gelu << std::endl;
     std::cout << "padding_id: " << _padding_id << std::endl;
     std::cout << "max_step: " << _max_step << std::endl;
+    if (!_sparse24_layers.empty()) {
+      std::cout << "2:4 sparse layers: " << _sparse24_layers.size()
+                << std::endl;
+    }
+    if (_sparse_block_size > 0) {
+      std::cout << "sparse block size: " << _sparse_block_size << std::endl;
+      std::cout << "sparse window blocks: " << _sparse_window_blocks
+                << std::endl;
+      std::cout << "sparse global blocks: " << _sparse_global_blocks
+                << std::endl;
+      std::cout << "sparse random blocks: " << _sparse_random_blocks
+                << std::endl;
+    }
 
     std::cout << std::endl;
   }
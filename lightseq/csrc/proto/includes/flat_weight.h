@@ -0,0 +1,102 @@
+#pragma once
+#ifdef LIGHTSEQ_cuda
+#include <cuda_runtime.h>
+#endif
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace lightseq {
+
+/*
+A flat weight file holds the weights of a model already in the dtype and
+layout its layers run with, after the split of tensor parallelism and the
+quantization, so that loading is a copy of every tensor to the device:
+
+  "LSFLAT01"  magic
+  uint64      config bytes, then "key value\n" lines
+  uint64      tensor number, then {int64 layer, uint64 offset, uint64 bytes}
+              per tensor, layer -1 for the tensors outside the layers
+  data        every tensor at an offset aligned to kFlatWeightAlignment
+
+FlatWeightReader maps the file and, on cuda, uploads the tensors through two
+pinned chunks, the copy of one chunk to the device overlaps the read of the
+next from the page cache or the disk. The other devices copy from the map.
+*/
+const size_t kFlatWeightAlignment = 4096;
+
+struct FlatTensor {
+  int64_t layer;
+  size_t offset;
+  size_t bytes;
+};
+
+class FlatWeightWriter {
+ private:
+  struct Entry {
+    FlatTensor tensor;
+    const void *data;  // device
+  };
+  std::map<std::string, std::string> _config;
+  std::vector<Entry> _entries;
+  size_t _data_bytes = 0;
+
+ public:
+  template <typename V>
+  void set_config(const std::string &key, const V &value) {
+    _config[key] = std::to_string(value);
+  }
+  void set_config(const std::string &key, const std::string &value) {
+    _config[key] = value;
+  }
+  // d_data is device memory, host memory without cuda, which must stay
+  // valid until write.
+  void add_tensor(int64_t layer, const void *d_data, size_t bytes);
+  // Throws std::runtime_error on error.
+  void write(const std::string &path) const;
+};
+
+class FlatWeightReader {
+ private:
+  int _fd = -1;
+  const char *_data = nullptr;
+  size_t _file_bytes = 0;
+  std::map<std::string, std::string> _config;
+  std::vector<FlatTensor> _tensors;
+
+#ifdef LIGHTSEQ_cuda
+  static const size_t kChunkBytes = 64 << 20;
+
+  // double buffered pinned chunks, with the events of their last copies on
+  // the device _event_device.
+  char *_chunks[2] = {nullptr, nullptr};
+  cudaEvent_t _events[2];
+  int _event_device = -1;
+  int _next_chunk = 0;
+#endif
+
+ public:
+  // Throws std::runtime_error when the file is not a flat weight file.
+  explicit FlatWeightReader(const std::string &path);
+  ~FlatWeightReader();
+
+  const std::vector<FlatTensor> &tensors() const { return _tensors; }
+  bool has_config(const std::string &key) const {
+    return _config.count(key) > 0;
+  }
+  // Throws std::runtime_error when the key is missing.
+  const std::string &config(const std::string &key) const;
+
+  // Copy tensor index to d_dst of the current device on stream, the host
+  // side is done when it returns, call synchronize before the device
+  // memory is used. Without cuda the copy is done when it returns.
+#ifdef LIGHTSEQ_cuda
+  void upload(size_t index, void *d_dst, cudaStream_t stream);
+#else
+  void upload(size_t index, void *d_dst);
+#endif
+  void synchronize();
+};
+
+}  // namespace lightseq
@@ -21,14 +21,19 @@ class GptWeight {
   void hdf5_get_model_config(hid_t hdf5_file);
   void hdf5_parse_emb_wei(hid_t hdf5_file);
   void hdf5_parse_enc_wei(hid_t hdf5_file);
+  void hdf5_parse_adaptive_wei(hid_t hdf5_file);
+  void hdf5_read_enc_layer(hid_t hdf5_file, int layer_id, float *value,
+                           std::vector<size_t> *offset);
 
   // store the weights pointer
   std::vector<const T *> _p_d_src_emb_wei;  // size: 4
   std::vector<const T *> _p_d_enc_wei;      // size: 12 * enc_layer_num
+  std::vector<const T *> _p_d_adaptive_wei;  // size: 1 + 2 * num_clusters
 
   // store the weights on gpu memory
   thrust::device_vector<T> _d_src_emb_wei;
   thrust::device_vector<T> _d_enc_wei;
+  thrust::device_vector<T> _d_adaptive_wei;
 
  public:
   std::string initializing(std::string weight_path);
@@ -47,6 +52,11 @@ class GptWeight {
     return _p_d_enc_wei;
   }
 
+  const std::vector<const T *> &get_adaptive_softmax_wei() const {
+    // {head_kernel, {tail_proj_kernel, tail_out_kernel} * num_clusters}
+    return _p_d_adaptive_wei;
+  }
+
   int _hidden_size;
   int _inner_size;
   int _max_step;
@@ -67,6 +77,20 @@ class GptWeight {
   float _length_penalty = 1.0;
   float _diverse_lambda = 0.;
   bool _use_gelu = true;
+  // The layers whose ffn kernels are pruned 2:4 along the input, for the
+  // sparse tensor cores, see Sparse24LinearOp. model_conf/sparse24_layers of
+  // a hdf5 file, empty by default.
+  std::vector<int> _sparse24_layers;
+  bool sparse24(int layer_id) const {
+    return std::find(_sparse24_layers.begin(), _sparse24_layers.end(),
+                     layer_id) != _sparse24_layers.end();
+  }
+  // The output head is an adaptive softmax over the clusters split at
+  // model_conf/adaptive_cutoffs of a hdf5 file, followed by the vocab size,
+  // instead of the token embedding, see AdaptiveSoftmaxOp. Empty by default.
+  std::vector<int> _adaptive_cutoffs;
+  std::vector<int> _adaptive_tail_dims;
+  bool adaptive_softmax() const { return !_adaptive_cutoffs.empty(); }
 
   void print_model_config() {
     std::cout << "***model config***" << std::endl;
@@ -79,6 +103,15 @@ class GptWeight {
     std::cout << "use_gelu: " << _use_gelu << std::endl;
     std::cout << "end_id: " << _eos_id << std::endl;
     std::cout << "padding_id: " << _padding_id << std::endl;
+    if (!_sparse24_layers.empty()) {
+      std::cout << "2:4 sparse layers: " << _sparse24_layers.size()
+                << std::endl;
+    }
+    if (adaptive_softmax()) {
+      std::cout << "adaptive softmax head size: " << _adaptive_cutoffs[0]
+                << ", tail clusters: " << _adaptive_tail_dims.size()
+                << std::endl;
+    }
     std::cout << std::endl;
     std::cout << "***generator config***" << std::endl;
     std::cout << "beam size: " << _beam_size << std::endl;
@@ -3,6 +3,8 @@
 #include "proto_util.h"
 #include "util.h"
 
+#ifdef LIGHTSEQ_cuda
+// the device side of the weight loaders, see LlamaWeight.
 template <typename T>
 void convert_dtype_by_gpu(float* source_addr, float* source_buffer,
                           T* target_buffer, T* target_addr, size_t size,
@@ -12,6 +14,11 @@ void convert_dtype_by_gpu(float* source_addr, float* source_buffer,
                     cudaMemcpyDefault, stream);
     lightseq::cuda::launch_convert_dtype(source_buffer, (__half*)target_addr,
                                          size, 1024, stream);
+  } else if (std::is_same<T, __nv_bfloat16>::value) {
+    cudaMemcpyAsync(source_buffer, source_addr, size * sizeof(float),
+                    cudaMemcpyDefault, stream);
+    lightseq::cuda::launch_convert_dtype(
+        source_buffer, (__nv_bfloat16*)target_addr, size, 1024, stream);
   } else if (std::is_same<T, float>::value) {
     cudaMemcpyAsync(target_addr, source_addr, size * sizeof(float),
                     cudaMemcpyDefault, stream);
@@ -24,3 +31,4 @@ T* malloc_memory(size_t size) {
   cudaMalloc(&buffer_addr, size * sizeof(T));
   return buffer_addr;
 }
+#endif
@@ -2,6 +2,7 @@
 #include "proto_headers.h"
 #include "proto_util.h"
 #include "hdf5_util.h"
+#include "flat_weight.h"
 
 namespace lightseq {
 
@@ -12,6 +13,8 @@ template <typename T>
 class LlamaWeight {
  private:
   cudaStream_t stream;
+  // see set_background_stream.
+  bool _background_stream = false;
   T float2required(float value);
 
   // parsing function for hdf5
@@ -19,31 +22,232 @@ class LlamaWeight {
   void hdf5_parse_emb_wei(hid_t hdf5_file);
   void hdf5_parse_enc_wei(hid_t hdf5_file);
 
+  // the datasets of one decoder layer, read from the hdf5 file by
+  // hdf5_read_enc_layer on a thread while the previous layer is uploaded.
+  struct LayerHostWeights {
+    std::vector<float> attention_norm_scale;
+    std::vector<float> ffn_norm_scale;
+    // [hidden_size, expert_num] the gate of the experts, moe only.
+    std::vector<float> moe_gate;
+    // qkv, attention output, gate up and down kernels, see kEncKernelNames
+    std::vector<float> kernels[4];
+    // not empty for the kernels stored quantized
+    std::vector<int8_t> qweights[4];
+    std::vector<float> qscales[4];
+    // the calibrated scales of the kernel inputs, with fp8
+    float input_scales[4];
+    // the smoothing factors of the inputs of the qkv and the gate up
+    // kernels, with int8, empty when the file has none.
+    std::vector<float> smooth_scales[2];
+  };
+  void hdf5_read_enc_layer(hid_t hdf5_file, int layer_id,
+                           LayerHostWeights *host);
+  // the [rows, cols] of kernel k of every layer, before the tensor parallel
+  // split, the gate up and down kernels of all the experts with moe.
+  std::pair<size_t, size_t> enc_kernel_shape(int k) const;
+
+  // weight-only quantization or fp8 of the linear kernels, see
+  // upload_kernel.
+  size_t quant_group_size(size_t rows) const;
+  void upload_kernel(const std::string &name, int layer_id, float input_scale,
+                     std::vector<float> &value, size_t rows, size_t cols,
+                     float *source_buffer, T *target_buffer);
+  void upload_fp8_kernel(float input_scale, std::vector<float> &value,
+                         size_t rows, size_t cols, float *source_buffer);
+  void upload_int8_kernel(std::vector<float> &value, size_t rows, size_t cols,
+                          float *source_buffer);
+  void upload_quant_kernel(const std::vector<int8_t> &qweight,
+                           std::vector<float> &scale, float *source_buffer,
+                           T *target_buffer);
+
+  // parsing function for the flat weight file, see save_flat.
+  void flat_get_model_config(const FlatWeightReader &reader);
+  void flat_parse_wei(FlatWeightReader &reader);
+
+  // push a weight pointer with the bytes it points to.
+  void push_emb_wei(const void *addr, size_t bytes) {
+    _p_d_src_emb_wei.push_back(reinterpret_cast<const T *>(addr));
+    _src_emb_wei_bytes.push_back(bytes);
+  }
+  void push_enc_wei(const void *addr, size_t bytes) {
+    _p_d_enc_wei.push_back(reinterpret_cast<const T *>(addr));
+    _enc_wei_bytes.push_back(bytes);
+  }
+
   // store the weights pointer
   std::vector<const T *> _p_d_src_emb_wei;  // size: 4
   std::vector<const T *> _p_d_enc_wei;      // size: 12 * enc_layer_num
+  std::vector<size_t> _src_emb_wei_bytes;
+  std::vector<size_t> _enc_wei_bytes;
+  // the first pointer of every layer in _p_d_enc_wei, the layers of mixed
+  // precision have different numbers of them.
+  std::vector<size_t> _enc_wei_layer_begin;
 
   // store the weights on gpu memory
   std::vector<T *> _d_src_emb_wei;
   std::vector<T *> _d_enc_wei;
 
+  // layer weights kept in pinned host memory, see set_offload_layers.
+  void check_offload_layers();
+  void offload_layer(int layer_id, size_t tensor_begin);
+  void finish_offload();
+  bool _offload_layers = false;
+  // [layer_num, _layer_wei_bytes] the weights of every layer, at
+  // _layer_wei_offsets.
+  char *_h_layer_wei = nullptr;
+  size_t _layer_wei_bytes = 0;
+  std::vector<size_t> _layer_wei_offsets;
+  // the even and the odd layers run with their weights copied here.
+  char *_d_layer_slots[2] = {nullptr, nullptr};
+
+  // whole model residency, see evict_device_wei. _h_resident_wei holds
+  // every weight, the embedding ones first, at _resident_offsets, and
+  // _d_resident_wei all of them once uploaded back, nullptr while they are
+  // device allocations of their own.
+  size_t wei_count() const {
+    return _p_d_src_emb_wei.size() + _p_d_enc_wei.size();
+  }
+  const T *&wei_ptr(size_t i) {
+    return i < _p_d_src_emb_wei.size()
+               ? _p_d_src_emb_wei[i]
+               : _p_d_enc_wei[i - _p_d_src_emb_wei.size()];
+  }
+  size_t wei_bytes(size_t i) const {
+    return i < _src_emb_wei_bytes.size()
+               ? _src_emb_wei_bytes[i]
+               : _enc_wei_bytes[i - _src_emb_wei_bytes.size()];
+  }
+  void free_wei_allocations();
+  char *_h_resident_wei = nullptr;
+  char *_d_resident_wei = nullptr;
+  std::vector<size_t> _resident_offsets;
+  size_t _resident_bytes = 0;
+  bool _wei_evicted = false;
+
+  // the decoder weights are sharded by tensor parallel rank.
+  int _tp_rank = 0;
+  int _tp_size = 1;
+  int _pp_size = 1;
+
  public:
+  // weight_path is a .hdf5 file or a .lsw flat weight file of save_flat.
   std::string initializing(std::string weight_path);
 
+  // Save the loaded weights as a flat weight file, in the dtype, the tensor
+  // parallel split and the quantization they were loaded with, which load
+  // with a copy per tensor and no conversion. The file can only be loaded
+  // with the same dtype and tensor parallel rank. Throws std::runtime_error
+  // on error.
+  void save_flat(const std::string &path) const;
+
+  // Must be called before initializing.
+  void set_tensor_parallel(int tp_rank, int tp_size) {
+    _tp_rank = tp_rank;
+    _tp_size = tp_size;
+  }
+
+  // The decoder layers are split into pp_size contiguous pipeline stages,
+  // stage s is loaded on device s. Must be called before initializing.
+  void set_pipeline_parallel(int pp_size) { _pp_size = pp_size; }
+  int pp_size() const { return _pp_size; }
+  int layer_stage(int layer_id) const {
+    return layer_id * _pp_size / _layer_num;
+  }
+
   const std::vector<const T *> &get_src_emb_wei() const {
-    // {token_emb, pos_emb, norm_scale, norm_bias}
+    // {token_emb, norm_scale, logits_kernel}, with set_emb_quant the
+    // embedding and the logits kernel are int8_t pointers and are followed
+    // by {logits_scale, token_emb_scale}.
     return _p_d_src_emb_wei;
   }
 
   const std::vector<const T *> &get_enc_wei() const {
-    // {multihead_norm_scale, multihead_norm_bias, multihead_qkv_kernel,
-    // multihead_qkv_bias multihead_output_kernel, multihead_output_bias
-    // ffn_norm_scale, ffn_norm_bias}
-    // ffn_first_kernel, ffn_first_bias, ffn_second_kernel, ffn_second_bias} *
-    // encoder_layer_num
+    // {attention_norm_scale, qkv_kernel, attention_output_kernel,
+    // ffn_norm_scale, gate_up_kernel, down_kernel} * layer_num
+    // with experts the ffn_norm_scale is followed by the [hidden_size,
+    // expert_num] moe gate kernel, and the gate_up and down kernels are
+    // [expert_num, rows, cols], see MoEFeedForwardLayer.
+    // with weight-only quantization every kernel is an int8_t pointer to the
+    // quantized kernel, followed by its scales. With fp8 it is a pointer to
+    // the transposed [cols, rows] fp8 kernel, followed by the float pointers
+    // of its scale and of the scale of its input. With int8 it is a pointer
+    // to the transposed [cols, rows] int8 kernel, followed by the float
+    // pointer of its [cols] scales.
     return _p_d_enc_wei;
   }
 
+  // Keep the weights of the layers in pinned host memory, with only two
+  // layers on the device at once: layer l runs with its weights in slot
+  // l % 2, which prefetch_layer fills. Ignored for models of one or two
+  // layers and with pipeline parallel. Must be called before initializing.
+  void set_offload_layers(bool offload) { _offload_layers = offload; }
+  bool offload_layers() const { return _offload_layers; }
+  // Copy the weights of layer_id from host memory into its slot on stream,
+  // the slot must not be in use by layer_id - 2 any more.
+  void prefetch_layer(int layer_id, cudaStream_t stream) const {
+    cudaMemcpyAsync(_d_layer_slots[layer_id % 2],
+                    _h_layer_wei + layer_id * _layer_wei_bytes,
+                    _layer_wei_bytes, cudaMemcpyHostToDevice, stream);
+  }
+  size_t layer_wei_bytes() const { return _layer_wei_bytes; }
+  // The device memory of the weights, with the layers offloaded the one of
+  // their two slots.
+  size_t device_wei_bytes() const;
+
+  // Quantize the fp32 kernels of the layers to bits 8 or 4 while loading,
+  // with one scale per group_size rows, 0 for one scale per column. Files
+  // which store quantized kernels set their own. Must be called before
+  // initializing.
+  void set_weight_quant(int bits, int group_size) {
+    _weight_quant_bits = bits;
+    _weight_quant_group_size = group_size;
+  }
+
+  // Quantize the fp32 kernels of the layers to fp8 e4m3 with one scale per
+  // tensor while loading, the files must then hold the calibrated scale of
+  // every kernel input. Must be called before initializing.
+  void set_fp8(bool fp8) { _fp8 = fp8; }
+
+  // Quantize the fp32 kernels of the layers to int8 with one scale per
+  // output channel while loading, for linears of int8 activations quantized
+  // per token. The smoothing factors of the file, name_smooth_scale, move
+  // the outliers of the activations into the kernels, see
+  // hdf5_read_enc_layer. Must be called before initializing. Files of mixed
+  // precision list their int8 layers, see int8.
+  void set_int8(bool int8) { _int8 = int8; }
+
+  // Store the token embedding and the logits kernel in int8 with one scale
+  // per token, for large vocabularies. Must be called before initializing.
+  void set_emb_quant(bool emb_quant) { _emb_quant = emb_quant; }
+
+  // Load the weights on a non-blocking stream of the least priority, for a
+  // load in the background of running models. Must be called before
+  // initializing.
+  void set_background_stream(bool background) {
+    _background_stream = background;
+  }
+
+  // Hot weight update, see Llama::update_weights. The options of the setters
+  // above are taken from other, before initializing.
+  void copy_load_options(const LlamaWeight<T> &other);
+  // Whether the loaded weights have the config and the tensor sizes of
+  // other, so that the layers built for other run them as well.
+  bool same_layout(const LlamaWeight<T> &other) const;
+  // Exchange the loaded device weights with other, the config stays.
+  void swap_device_wei(LlamaWeight<T> &other);
+  // Free the device weights, which must not be in use any more.
+  void free_device_wei();
+
+  // Whole model residency, see ModelManager. evict_device_wei copies the
+  // weights into pinned host memory, on the first eviction only since they
+  // do not change, and frees them on the device. upload_device_wei
+  // allocates them back as one buffer at new addresses and copies them on
+  // the stream of the weights without waiting, done is recorded after the
+  // copy. Not supported with offloaded layers.
+  void evict_device_wei();
+  void upload_device_wei(cudaEvent_t done);
+  bool device_wei_evicted() const { return _wei_evicted; }
+
   size_t _hidden_size;
   int _inner_size;
   int _max_step;
@@ -54,6 +258,8 @@ class LlamaWeight {
   int _weight_per_enc_layer;  // 12
 
   int _head_num;
+  // key/value heads, less than _head_num for grouped-query attention.
+  int _kv_head_num;
   int _padding_id;  // for src
   std::string _generate_method = "topk";
   int _topk = 1;
@@ -64,6 +270,45 @@ class LlamaWeight {
   float _length_penalty = 1.0;
   float _diverse_lambda = 0.;
   bool _use_gelu = true;
+  // the mixture of experts, 0 for the dense mlp. Every token runs the
+  // _moe_topk experts of its gate.
+  int _expert_num = 0;
+  int _moe_topk = 2;
+  // 0 for fp kernels, otherwise 8 or 4, see set_weight_quant.
+  int _weight_quant_bits = 0;
+  int _weight_quant_group_size = 0;
+  bool _fp8 = false;
+  bool _int8 = false;
+  // The layers whose kernels run in int8, model_conf/int8_layers of a hdf5
+  // file, the others keep the kernels of T, eg. the first and the last layers
+  // sensitive to quantization. Int8LinearOp quantizes its inputs and
+  // dequantizes its outputs, so the layers of both precisions chain as they
+  // are. The file turns int8 on for them, empty for all the layers with
+  // set_int8.
+  std::vector<int> _int8_layers;
+  bool int8(int layer_id) const {
+    return _int8 &&
+           (_int8_layers.empty() ||
+            std::find(_int8_layers.begin(), _int8_layers.end(), layer_id) !=
+                _int8_layers.end());
+  }
+  // see set_emb_quant.
+  bool _emb_quant = false;
+  // The layers whose mlp kernels are pruned 2:4 along the input, for the
+  // sparse tensor cores, see Sparse24LinearOp. model_conf/sparse24_layers of
+  // a hdf5 file, empty by default.
+  std::vector<int> _sparse24_layers;
+  bool sparse24(int layer_id) const {
+    return std::find(_sparse24_layers.begin(), _sparse24_layers.end(),
+                     layer_id) != _sparse24_layers.end();
+  }
+
+  // RoPE, see RopeScaling. The scaling type is "linear", "ntk", "yarn" or
+  // empty, original_max_step is the context length of the pretraining.
+  float _rope_theta = 10000.f;
+  std::string _rope_scaling_type;
+  float _rope_scaling_factor = 1.f;
+  int _rope_original_max_step = 0;
 
   void print_model_config() {
     std::cout << "***model config***" << std::endl;
@@ -71,11 +316,38 @@ class LlamaWeight {
     std::cout << "hidden size: " << _hidden_size << std::endl;
     std::cout << "inner size: " << _inner_size << std::endl;
     std::cout << "head number: " << _head_num << std::endl;
+    std::cout << "kv head number: " << _kv_head_num << std::endl;
     std::cout << "dim per head: " << _dim_per_head << std::endl;
     std::cout << "src vocab size: " << _src_vocab_size << std::endl;
     std::cout << "use_gelu: " << _use_gelu << std::endl;
     std::cout << "end_id: " << _eos_id << std::endl;
     std::cout << "padding_id: " << _padding_id << std::endl;
+    if (_expert_num) {
+      std::cout << "experts: " << _expert_num << ", top " << _moe_topk
+                << std::endl;
+    }
+    if (_weight_quant_bits) {
+      std::cout << "weight quant bits: " << _weight_quant_bits
+                << ", group size: " << _weight_quant_group_size << std::endl;
+    }
+    if (_fp8) std::cout << "fp8 kernels" << std::endl;
+    if (_int8 && _int8_layers.empty()) {
+      std::cout << "int8 kernels and activations" << std::endl;
+    } else if (_int8) {
+      std::cout << "int8 kernels and activations of " << _int8_layers.size()
+                << " layers" << std::endl;
+    }
+    if (_emb_quant) std::cout << "int8 embedding and logits" << std::endl;
+    if (!_sparse24_layers.empty()) {
+      std::cout << "2:4 sparse layers: " << _sparse24_layers.size()
+                << std::endl;
+    }
+    std::cout << "rope theta: " << _rope_theta << std::endl;
+    if (!_rope_scaling_type.empty()) {
+      std::cout << "rope scaling: " << _rope_scaling_type << ", factor "
+                << _rope_scaling_factor << ", original max step "
+                << _rope_original_max_step << std::endl;
+    }
     std::cout << std::endl;
     std::cout << "***generator config***" << std::endl;
     std::cout << "beam size: " << _beam_size << std::endl;
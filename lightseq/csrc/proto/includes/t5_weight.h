@@ -0,0 +1,168 @@
+#pragma once
+#include "proto_headers.h"
+#include "proto_util.h"
+
+namespace lightseq {
+
+/*
+Load the weights of a T5 or mT5 model, stored in the hdf5 file of the
+huggingface t5 or mt5 export, into GPU memory, or host memory without cuda.
+
+T5 has no linear biases, the biases the layers take are zeros. The scores of
+its attentions are not scaled, so the q kernels are multiplied by
+sqrt(dim_per_head) to cancel the scaling of FlashAttentionOp. The relative
+position bias of the encoder and of the decoder self attentions is expanded
+once here into a table of [head_num, 2 * max_step - 1], indexed by the key
+minus the query position, which every layer and decoding step shares.
+
+An mT5 model, which has ffn_third_kernel, has the gated-gelu feed forward:
+its first and second kernels are concatenated into one [hidden_size,
+2 * inner_size] kernel, and its logits kernel is lm_head instead of the
+token embedding.
+*/
+template <typename T>
+class T5Weight {
+ private:
+#ifdef LIGHTSEQ_cuda
+  // store the weights on gpu memory
+  typedef thrust::device_vector<T> WeightVector;
+  static const T *raw_ptr(const WeightVector &wei) {
+    return thrust::raw_pointer_cast(wei.data());
+  }
+#else
+  // store the weights on host memory
+  typedef std::vector<T> WeightVector;
+  static const T *raw_ptr(const WeightVector &wei) { return wei.data(); }
+#endif
+
+  T float2required(float value);
+
+  // parsing function for hdf5
+  void hdf5_get_model_config(hid_t hdf5_file);
+  void hdf5_parse_emb_wei(hid_t hdf5_file, std::string source);
+  void hdf5_parse_enc_wei(hid_t hdf5_file);
+  void hdf5_parse_dec_wei(hid_t hdf5_file);
+
+  // append the dataset of size to value and its offset to offset.
+  void hdf5_read(hid_t hdf5_file, const std::string &dataset_name,
+                 size_t size, std::vector<float> *value,
+                 std::vector<size_t> *offset);
+  // the feed forward kernels of the layer of dataset_prefix, see above.
+  void hdf5_read_ffn(hid_t hdf5_file, const std::string &dataset_prefix,
+                     std::vector<float> *value, std::vector<size_t> *offset);
+  // the [head_num, 2 * max_step - 1] relative position bias of the
+  // [num_buckets, head_num] bucket embedding.
+  std::vector<float> expand_pos_bias(const std::vector<float> &bucket_emb,
+                                     bool bidirectional) const;
+  // copy value to the device and push the pointers at offset to ptrs.
+  void upload(const std::vector<float> &value,
+              const std::vector<size_t> &offset,
+              WeightVector *d_value,
+              std::vector<const T *> *ptrs);
+
+  // every bias of get_*_wei points to these zeros.
+  WeightVector _d_zeros;
+  const T *zeros() const { return raw_ptr(_d_zeros); }
+
+  // store the weights pointer
+  std::vector<const T *> _p_d_src_emb_wei;
+  std::vector<const T *> _p_d_trg_emb_wei;
+  std::vector<const T *> _p_d_enc_wei;
+  std::vector<const T *> _p_d_dec_wei;
+
+  WeightVector _d_src_emb_wei;
+  WeightVector _d_trg_emb_wei;
+  WeightVector _d_enc_wei;
+  WeightVector _d_dec_wei;
+
+ public:
+  std::string initializing(std::string weight_path);
+
+  const std::vector<const T *> &get_src_emb_wei() const {
+    // {token_emb, pos_emb, norm_scale, pos_bias}, pos_emb of zeros
+    return _p_d_src_emb_wei;
+  }
+
+  const std::vector<const T *> &get_trg_emb_wei() const {
+    // {token_emb, pos_emb, norm_scale, pos_bias, encdec_kv_kernel,
+    // encdec_kv_bias, logits_kernel}, the token_emb and the logits_kernel
+    // are [hidden_size, trg_vocab_size]
+    return _p_d_trg_emb_wei;
+  }
+
+  const std::vector<const T *> &get_enc_wei() const {
+    // {multihead_norm_scale, multihead_qkv_kernel, multihead_qkv_bias,
+    // multihead_output_kernel, ffn_norm_scale, ffn_first_kernel,
+    // ffn_first_bias, ffn_second_kernel} * encoder_layer_num
+    return _p_d_enc_wei;
+  }
+
+  const std::vector<const T *> &get_dec_wei() const {
+    // {self_norm_scale, self_qkv_kernel, self_qkv_bias, self_output_kernel,
+    // encdec_norm_scale, encdec_q_kernel, encdec_q_bias,
+    // encdec_output_kernel, ffn_norm_scale, ffn_first_kernel,
+    // ffn_first_bias, ffn_second_kernel} * decoder_layer_num
+    return _p_d_dec_wei;
+  }
+
+  int _hidden_size;
+  int _inner_size;
+  int _max_step;
+  int _extra_decode_length;
+  int _src_vocab_size;
+  int _trg_vocab_size;
+  int _n_enc_layer;
+  int _n_dec_layer;
+  int _dim_per_head;
+  int _weight_per_enc_layer = 8;
+  int _weight_per_dec_layer = 12;
+
+  int _head_num;
+  int _relative_attention_num_buckets = 32;
+  int _relative_attention_max_distance = 128;
+  int _padding_id;
+  int _start_id;
+  int _end_id;
+  // gated-gelu feed forward and lm_head, see above.
+  bool _is_mt5 = false;
+  bool _use_gelu = false;
+
+  std::string _sampling_method = "beam_search";
+  int _beam_size = 1;
+  int _topk = 1;
+  float _topp = 0.75;
+  float _length_penalty = 1.0;
+  float _diverse_lambda = 0.;
+
+  void print_model_config() {
+    std::cout << "***model config***" << std::endl;
+    std::cout << "model: " << (_is_mt5 ? "mt5" : "t5") << std::endl;
+    std::cout << "encoder layers: " << _n_enc_layer << std::endl;
+    std::cout << "decoder layers: " << _n_dec_layer << std::endl;
+    std::cout << "hidden size: " << _hidden_size << std::endl;
+    std::cout << "inner size: " << _inner_size << std::endl;
+    std::cout << "head number: " << _head_num << std::endl;
+    std::cout << "dim per head: " << _dim_per_head << std::endl;
+    std::cout << "relative attention buckets: "
+              << _relative_attention_num_buckets << std::endl;
+    std::cout << "src vocab size: " << _src_vocab_size << std::endl;
+    std::cout << "trg vocab size: " << _trg_vocab_size << std::endl;
+    std::cout << "use_gelu: " << _use_gelu << std::endl;
+    std::cout << "start_id: " << _start_id << std::endl;
+    std::cout << "end_id: " << _end_id << std::endl;
+    std::cout << "padding_id: " << _padding_id << std::endl;
+    std::cout << std::endl;
+    std::cout << "***generator config***" << std::endl;
+    std::cout << "beam size: " << _beam_size << std::endl;
+    std::cout << "max step: " << _max_step << std::endl;
+    std::cout << "extra decode length(max decode length - src input length): "
+              << _extra_decode_length << std::endl;
+    std::cout << "length penalty: " << _length_penalty << std::endl;
+    std::cout << "diverse lambda: " << _diverse_lambda << std::endl;
+    std::cout << "sampling method: " << _sampling_method << std::endl;
+    std::cout << "topk: " << _topk << std::endl;
+    std::cout << "topp: " << _topp << std::endl;
+  }
+};
+
+}  // namespace lightseq
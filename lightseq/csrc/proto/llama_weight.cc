@@ -1,6 +1,10 @@
 #include "llama_weight.h"
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
+#include <future>
+#include <sstream>
 
 /**
 @file
@@ -29,8 +33,138 @@ template <>
 __half LlamaWeight<__half>::float2required(float value) {
   return __float2half_rn(value);
 }
+
+/**
+bf16 version, cast fp32 into bf16
+*/
+template <>
+__nv_bfloat16 LlamaWeight<__nv_bfloat16>::float2required(float value) {
+  return __float2bfloat16_rn(value);
+}
+#endif
+
+namespace {
+
+/**
+Keep the column segments {begin, length} of a row-major [rows, cols] matrix,
+in place. Segments are sorted and do not overlap.
+*/
+void keep_columns(std::vector<float>& value, size_t rows, size_t cols,
+                  const std::vector<std::pair<size_t, size_t>>& segments) {
+  size_t dst = 0;
+  for (size_t r = 0; r < rows; r++) {
+    for (const std::pair<size_t, size_t>& seg : segments) {
+      std::copy(value.begin() + r * cols + seg.first,
+                value.begin() + r * cols + seg.first + seg.second,
+                value.begin() + dst);
+      dst += seg.second;
+    }
+  }
+}
+
+/**
+Keep the rows [begin, begin + num_rows) of a row-major [rows, cols] matrix.
+*/
+void keep_rows(std::vector<float>& value, size_t cols, size_t begin,
+               size_t num_rows) {
+  std::copy(value.begin() + begin * cols,
+            value.begin() + (begin + num_rows) * cols, value.begin());
+}
+
+void check_quant_shape(const std::string& name, size_t rows, size_t cols,
+                       int bits, size_t group_size) {
+  if (rows % group_size != 0 || cols % 4 != 0 ||
+      (bits == 4 && group_size % 2 != 0)) {
+    throw std::runtime_error(
+        "Kernel " + name + " of [" + std::to_string(rows) + ", " +
+        std::to_string(cols) + "] can not be quantized to " +
+        std::to_string(bits) + " bits with group size " +
+        std::to_string(group_size) + " !");
+  }
+}
+
+/**
+Symmetric round-to-nearest quantization of the row-major [rows, cols] kernel
+in value, with one scale per group_size rows of every column. int4 packs the
+rows 2i and 2i + 1 into the low and high nibble of one byte.
+*/
+void quantize_kernel(const std::vector<float>& value, size_t rows,
+                     size_t cols, int bits, size_t group_size,
+                     std::vector<int8_t>* qweight, std::vector<float>* scale) {
+  int qmax = (1 << (bits - 1)) - 1;
+  scale->assign(rows / group_size * cols, 0.f);
+  for (size_t r = 0; r < rows; r++) {
+    float* group_scale = scale->data() + r / group_size * cols;
+    for (size_t c = 0; c < cols; c++) {
+      group_scale[c] = std::max(group_scale[c], std::fabs(value[r * cols + c]));
+    }
+  }
+  for (float& s : *scale) {
+    s = s > 0.f ? s / qmax : 1.f;
+  }
+
+  qweight->assign(rows * bits / 8 * cols, 0);
+  for (size_t r = 0; r < rows; r++) {
+    const float* group_scale = scale->data() + r / group_size * cols;
+    for (size_t c = 0; c < cols; c++) {
+      long q = std::lround(value[r * cols + c] / group_scale[c]);
+      q = std::min(std::max(q, long(-qmax - 1)), long(qmax));
+      if (bits == 8) {
+        (*qweight)[r * cols + c] = int8_t(q);
+      } else {
+        uint8_t nibble = uint8_t(q) & 0xf;
+        int8_t& packed = (*qweight)[r / 2 * cols + c];
+        packed = int8_t(uint8_t(packed) | (r % 2 ? nibble << 4 : nibble));
+      }
+    }
+  }
+}
+
+/**
+Symmetric int8 quantization of the row-major [rows, cols] matrix in value,
+with one scale per row.
+*/
+void quantize_rows(const std::vector<float>& value, size_t rows, size_t cols,
+                   std::vector<int8_t>* qweight, std::vector<float>* scale) {
+  scale->assign(rows, 0.f);
+  qweight->resize(rows * cols);
+  for (size_t r = 0; r < rows; r++) {
+    const float* row = value.data() + r * cols;
+    float amax = 0.f;
+    for (size_t c = 0; c < cols; c++) amax = std::max(amax, std::fabs(row[c]));
+    float s = amax > 0.f ? amax / 127 : 1.f;
+    (*scale)[r] = s;
+    for (size_t c = 0; c < cols; c++) {
+      long q = std::lround(row[c] / s);
+      (*qweight)[r * cols + c] = int8_t(std::min(std::max(q, -127L), 127L));
+    }
+  }
+}
+
+// the kernels of a decoder layer, in the order of get_enc_wei.
+const char* const kEncKernelNames[4] = {
+    "attention_project_qkv", "attention_output", "gate_up_project_weight",
+    "down_project_weight"};
+
+template <typename T>
+const char* flat_dtype();
+template <>
+const char* flat_dtype<float>() {
+  return "fp32";
+}
+#ifdef LIGHTSEQ_cuda
+template <>
+const char* flat_dtype<__half>() {
+  return "fp16";
+}
+template <>
+const char* flat_dtype<__nv_bfloat16>() {
+  return "bf16";
+}
 #endif
 
+}  // namespace
+
 /**
 Read model config stored in custom hdf5 file.
 */
@@ -117,7 +251,374 @@ void LlamaWeight<T>::hdf5_get_model_config(hid_t hdf5_file) {
     _diverse_lambda = 0.;
   }
 
+  try {
+    read_hdf5_dataset_scalar(hdf5_file, "model_conf/num_kv_heads",
+                             H5T_NATIVE_INT, &_kv_head_num);
+  } catch (HDF5DatasetNotFoundError& e) {
+    _kv_head_num = 0;
+  }
+  if (_kv_head_num <= 0) {
+    _kv_head_num = _head_num;
+  }
+  if (_head_num % _kv_head_num != 0) {
+    throw std::runtime_error("head_num " + std::to_string(_head_num) +
+                             " is not a multiple of num_kv_heads " +
+                             std::to_string(_kv_head_num));
+  }
+
+  try {
+    read_hdf5_dataset_scalar(hdf5_file, "model_conf/rope_theta",
+                             H5T_NATIVE_FLOAT, &_rope_theta);
+  } catch (HDF5DatasetNotFoundError& e) {
+    _rope_theta = 10000.f;
+  }
+  try {
+    char rope_scaling_buf[128];
+    int rope_scaling_strlen = read_hdf5_dataset_data(
+        hdf5_file, "model_conf/rope_scaling_type", H5T_NATIVE_CHAR,
+        rope_scaling_buf, [](int size) { return size > 128; },
+        "Expect model_conf/rope_scaling_type to have less than 128 "
+        "characters.");
+    _rope_scaling_type = std::string(rope_scaling_buf, rope_scaling_strlen);
+    read_hdf5_dataset_scalar(hdf5_file, "model_conf/rope_scaling_factor",
+                             H5T_NATIVE_FLOAT, &_rope_scaling_factor);
+    read_hdf5_dataset_scalar(hdf5_file, "model_conf/rope_original_max_step",
+                             H5T_NATIVE_INT, &_rope_original_max_step);
+  } catch (HDF5DatasetNotFoundError& e) {
+    _rope_scaling_type = "";
+  }
+
+  // kernels stored quantized, see hdf5_parse_quant_kernel.
+  int quant_bits_read = 0;
+  try {
+    read_hdf5_dataset_scalar(hdf5_file, "model_conf/weight_quant_bits",
+                             H5T_NATIVE_INT, &quant_bits_read);
+  } catch (HDF5DatasetNotFoundError& e) {
+    quant_bits_read = 0;
+  }
+  if (quant_bits_read > 0) {
+    _weight_quant_bits = quant_bits_read;
+    try {
+      read_hdf5_dataset_scalar(hdf5_file, "model_conf/weight_quant_group_size",
+                               H5T_NATIVE_INT, &_weight_quant_group_size);
+    } catch (HDF5DatasetNotFoundError& e) {
+      _weight_quant_group_size = 0;
+    }
+  }
+  if (_weight_quant_bits != 0 && _weight_quant_bits != 8 &&
+      _weight_quant_bits != 4) {
+    throw std::runtime_error("weight quant bits " +
+                             std::to_string(_weight_quant_bits) +
+                             " is not one of 8, 4");
+  }
+  if (_weight_quant_bits == 4 && _weight_quant_group_size <= 0) {
+    // the usual group of AWQ and GPTQ
+    _weight_quant_group_size = 128;
+  }
+  if (_fp8 && _weight_quant_bits != 0) {
+    throw std::runtime_error(
+        "fp8 kernels can not be combined with weight quant bits " +
+        std::to_string(_weight_quant_bits));
+  }
+  // optional, the layers of int8 kernels, the others of T.
+  try {
+    _int8_layers = read_hdf5_dataset_data_int(
+        hdf5_file, "model_conf/int8_layers", H5T_NATIVE_INT);
+  } catch (HDF5DatasetNotFoundError& e) {
+    _int8_layers.clear();
+  }
+  for (int layer_id : _int8_layers) {
+    if (layer_id < 0 || layer_id >= _layer_num) {
+      throw std::runtime_error("Wrong layer " + std::to_string(layer_id) +
+                               " of model_conf/int8_layers !");
+    }
+  }
+  if (!_int8_layers.empty()) _int8 = true;
+  if (_int8 && (_fp8 || _weight_quant_bits != 0)) {
+    throw std::runtime_error(
+        "int8 kernels can not be combined with fp8 or weight quant bits !");
+  }
+
+  try {
+    read_hdf5_dataset_scalar(hdf5_file, "model_conf/expert_num",
+                             H5T_NATIVE_INT, &_expert_num);
+  } catch (HDF5DatasetNotFoundError& e) {
+    _expert_num = 0;
+  }
+  if (_expert_num > 0) {
+    try {
+      read_hdf5_dataset_scalar(hdf5_file, "model_conf/moe_topk",
+                               H5T_NATIVE_INT, &_moe_topk);
+    } catch (HDF5DatasetNotFoundError& e) {
+      _moe_topk = 2;
+    }
+    if (_moe_topk < 1 || _moe_topk > 8 || _moe_topk > _expert_num ||
+        _expert_num > 256) {
+      throw std::runtime_error("Top " + std::to_string(_moe_topk) + " of " +
+                               std::to_string(_expert_num) +
+                               " experts is not supported !");
+    }
+    if (_tp_size > 1 || _fp8 || _int8 || _weight_quant_bits != 0) {
+      throw std::runtime_error(
+          "The experts only support dense kernels on one tensor parallel "
+          "rank !");
+    }
+  }
+
   _dim_per_head = _hidden_size / _head_num;
+
+  // optional, the layers of kernels pruned 2:4.
+  try {
+    _sparse24_layers = read_hdf5_dataset_data_int(
+        hdf5_file, "model_conf/sparse24_layers", H5T_NATIVE_INT);
+  } catch (HDF5DatasetNotFoundError& e) {
+    _sparse24_layers.clear();
+  }
+}
+
+template <typename T>
+size_t LlamaWeight<T>::quant_group_size(size_t rows) const {
+  return _weight_quant_group_size > 0 ? _weight_quant_group_size : rows;
+}
+
+/**
+Upload the row-major [rows, cols] kernel in value to GPU memory, quantized
+when weight-only quantization, fp8 or int8 is on.
+*/
+template <typename T>
+void LlamaWeight<T>::upload_kernel(const std::string& name, int layer_id,
+                                   float input_scale, std::vector<float>& value,
+                                   size_t rows, size_t cols,
+                                   float* source_buffer, T* target_buffer) {
+  if (_fp8) {
+    upload_fp8_kernel(input_scale, value, rows, cols, source_buffer);
+    return;
+  }
+  if (int8(layer_id)) {
+    upload_int8_kernel(value, rows, cols, source_buffer);
+    return;
+  }
+  if (_weight_quant_bits == 0) {
+    T* addr = malloc_memory<T>(rows * cols);
+    push_enc_wei(addr, rows * cols * sizeof(T));
+    convert_dtype_by_gpu<T>(value.data(), source_buffer, target_buffer, addr,
+                            rows * cols, stream);
+    return;
+  }
+  size_t group_size = quant_group_size(rows);
+  check_quant_shape(name, rows, cols, _weight_quant_bits, group_size);
+  std::vector<int8_t> qweight;
+  std::vector<float> scale;
+  quantize_kernel(value, rows, cols, _weight_quant_bits, group_size, &qweight,
+                  &scale);
+  upload_quant_kernel(qweight, scale, source_buffer, target_buffer);
+}
+
+/**
+Upload the [rows, cols] kernel in value as a [cols, rows] fp8 kernel, the
+layout of Fp8LinearOp, with the scale of its amax, followed by input_scale,
+the calibrated scale of its input.
+*/
+template <typename T>
+void LlamaWeight<T>::upload_fp8_kernel(float input_scale,
+                                       std::vector<float>& value, size_t rows,
+                                       size_t cols, float* source_buffer) {
+  size_t size = rows * cols;
+  std::vector<float> buffer(size);
+  transform_param_shape(value.data(), buffer.data(), rows, cols);
+  float amax = 0.f;
+  for (size_t i = 0; i < size; i++) amax = std::max(amax, std::abs(value[i]));
+  float scale = amax > 0.f ? amax / cuda::kFp8E4M3Max : 1.f;
+
+  uint8_t* qaddr = malloc_memory<uint8_t>(size);
+  // allocated apart, so that the weights can be freed one by one.
+  float* scale_addr = malloc_memory<float>(1);
+  float* input_scale_addr = malloc_memory<float>(1);
+  cudaMemcpyAsync(source_buffer, value.data(), size * sizeof(float),
+                  cudaMemcpyHostToDevice, stream);
+  cudaMemcpyAsync(scale_addr, &scale, sizeof(float), cudaMemcpyHostToDevice,
+                  stream);
+  cudaMemcpyAsync(input_scale_addr, &input_scale, sizeof(float),
+                  cudaMemcpyHostToDevice, stream);
+  cuda::launch_quantize_fp8<float>(qaddr, source_buffer, scale_addr, size,
+                                   stream);
+  // the host buffers must outlive the copies.
+  cudaStreamSynchronize(stream);
+  push_enc_wei(qaddr, size);
+  push_enc_wei(scale_addr, sizeof(float));
+  push_enc_wei(input_scale_addr, sizeof(float));
+}
+
+/**
+Upload the [rows, cols] kernel in value as a [cols, rows] int8 kernel, the
+layout of Int8LinearOp, with the scales of its columns.
+*/
+template <typename T>
+void LlamaWeight<T>::upload_int8_kernel(std::vector<float>& value,
+                                        size_t rows, size_t cols,
+                                        float* source_buffer) {
+  size_t size = rows * cols;
+  int8_t* qaddr = malloc_memory<int8_t>(size);
+  float* scale_addr = malloc_memory<float>(cols);
+  cudaMemcpyAsync(source_buffer, value.data(), size * sizeof(float),
+                  cudaMemcpyHostToDevice, stream);
+  cuda::launch_quantize_weight_cols<float>(qaddr, scale_addr, source_buffer,
+                                           rows, cols, stream);
+  push_enc_wei(qaddr, size);
+  push_enc_wei(scale_addr, cols * sizeof(float));
+}
+
+template <typename T>
+void LlamaWeight<T>::upload_quant_kernel(const std::vector<int8_t>& qweight,
+                                         std::vector<float>& scale,
+                                         float* source_buffer,
+                                         T* target_buffer) {
+  int8_t* qaddr = malloc_memory<int8_t>(qweight.size());
+  cudaMemcpyAsync(qaddr, qweight.data(), qweight.size(),
+                  cudaMemcpyHostToDevice, stream);
+  push_enc_wei(qaddr, qweight.size());
+  T* addr = malloc_memory<T>(scale.size());
+  push_enc_wei(addr, scale.size() * sizeof(T));
+  convert_dtype_by_gpu<T>(scale.data(), source_buffer, target_buffer, addr,
+                          scale.size(), stream);
+}
+
+template <typename T>
+std::pair<size_t, size_t> LlamaWeight<T>::enc_kernel_shape(int k) const {
+  size_t qkv_cols = (_head_num + 2 * _kv_head_num) * _dim_per_head;
+  size_t experts = std::max(_expert_num, 1);
+  switch (k) {
+    case 0:
+      return {_hidden_size, qkv_cols};
+    case 1:
+      return {_hidden_size, _hidden_size};
+    case 2:
+      return {experts * _hidden_size, size_t(_inner_size) * 2};
+    default:
+      return {experts * _inner_size, _hidden_size};
+  }
+}
+
+/**
+Read the datasets of decoder layer layer_id into host. A kernel stored
+quantized, as name_qweight of int8 in the layout of launch_weight_only_gemv
+and name_qscale of float with the bits and the group size of model_conf, is
+read instead of its fp32 kernel. With fp8 every kernel needs the scale of
+its input stored as name_input_scale.
+
+With int8 the smoothing factors s of attention_smooth_scale and
+ffn_smooth_scale, [hidden_size] each, are folded into the norm scales and
+the rows of the qkv and gate up kernels: x / s is quantized instead of x
+and s * w instead of w, which leaves their product unchanged but flattens
+the outlier channels of the activations. See hf_llama_smooth_calibrate.py.
+*/
+template <typename T>
+void LlamaWeight<T>::hdf5_read_enc_layer(hid_t hdf5_file, int layer_id,
+                                         LayerHostWeights* host) {
+  std::string dataset_prefix = "decoder_layers/" + std::to_string(layer_id);
+  host->attention_norm_scale.resize(_hidden_size);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/attention_norm_scale", H5T_NATIVE_FLOAT,
+      host->attention_norm_scale.data(),
+      [=](int size) { return size != _hidden_size; },
+      "Wrong attention_norm_scale_size !");
+  host->ffn_norm_scale.resize(_hidden_size);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_prefix + "/ffn_norm_scale", H5T_NATIVE_FLOAT,
+      host->ffn_norm_scale.data(),
+      [=](int size) { return size != _hidden_size; },
+      "Wrong ffn_norm_scale_size !");
+  if (_expert_num > 0) {
+    size_t gate_size = _hidden_size * _expert_num;
+    host->moe_gate.resize(gate_size);
+    read_hdf5_dataset_data(
+        hdf5_file, dataset_prefix + "/moe_gate_weight", H5T_NATIVE_FLOAT,
+        host->moe_gate.data(), [=](int size) { return size != gate_size; },
+        "Wrong moe_gate_weight_size !");
+  }
+
+  for (int k = 0; k < 4; k++) {
+    std::string name = dataset_prefix + "/" + kEncKernelNames[k];
+    size_t rows = enc_kernel_shape(k).first;
+    size_t cols = enc_kernel_shape(k).second;
+    host->kernels[k].clear();
+    host->qweights[k].clear();
+    host->qscales[k].clear();
+
+    std::string qweight_name = name + "_qweight";
+    if (_weight_quant_bits != 0 &&
+        H5Lexists(hdf5_file, qweight_name.c_str(), H5P_DEFAULT) > 0) {
+      if (_tp_size > 1) {
+        throw std::runtime_error(
+            "Quantized kernel " + name +
+            " can not be split into ranks, store it in fp32 to quantize it "
+            "after the split !");
+      }
+      size_t group_size = quant_group_size(rows);
+      check_quant_shape(name, rows, cols, _weight_quant_bits, group_size);
+      size_t qweight_size = rows * _weight_quant_bits / 8 * cols;
+      host->qweights[k].resize(qweight_size);
+      read_hdf5_dataset_data(
+          hdf5_file, qweight_name, H5T_NATIVE_SCHAR, host->qweights[k].data(),
+          [=](int size) { return size != qweight_size; },
+          "Wrong " + qweight_name + " size !");
+      size_t scale_size = rows / group_size * cols;
+      host->qscales[k].resize(scale_size);
+      read_hdf5_dataset_data(
+          hdf5_file, name + "_qscale", H5T_NATIVE_FLOAT,
+          host->qscales[k].data(),
+          [=](int size) { return size != scale_size; },
+          "Wrong " + name + "_qscale size !");
+      continue;
+    }
+
+    host->kernels[k].resize(rows * cols);
+    read_hdf5_dataset_data(
+        hdf5_file, name, H5T_NATIVE_FLOAT, host->kernels[k].data(),
+        [=](int size) { return size != rows * cols; },
+        "Wrong " + std::string(kEncKernelNames[k]) + "_size !");
+    if (!_fp8) continue;
+    float& input_scale = host->input_scales[k];
+    try {
+      read_hdf5_dataset_scalar(hdf5_file, name + "_input_scale",
+                               H5T_NATIVE_FLOAT, &input_scale);
+    } catch (HDF5DatasetNotFoundError& e) {
+      throw std::runtime_error("fp8 kernel " + name +
+                               " needs the calibrated " + name +
+                               "_input_scale !");
+    }
+    if (!(input_scale > 0.f)) {
+      throw std::runtime_error("Wrong " + name + "_input_scale !");
+    }
+  }
+  if (!int8(layer_id)) return;
+
+  const char* const smooth_names[2] = {"attention_smooth_scale",
+                                       "ffn_smooth_scale"};
+  std::vector<float>* norm_scales[2] = {&host->attention_norm_scale,
+                                        &host->ffn_norm_scale};
+  // the qkv and the gate up kernels, which read the norm outputs.
+  const int kernel_ids[2] = {0, 2};
+  for (int i = 0; i < 2; i++) {
+    std::string name = dataset_prefix + "/" + smooth_names[i];
+    std::vector<float>& smooth = host->smooth_scales[i];
+    smooth.clear();
+    if (H5Lexists(hdf5_file, name.c_str(), H5P_DEFAULT) <= 0) continue;
+    smooth.resize(_hidden_size);
+    read_hdf5_dataset_data(
+        hdf5_file, name, H5T_NATIVE_FLOAT, smooth.data(),
+        [=](int size) { return size != _hidden_size; },
+        "Wrong " + std::string(smooth_names[i]) + "_size !");
+    std::vector<float>& kernel = host->kernels[kernel_ids[i]];
+    size_t cols = enc_kernel_shape(kernel_ids[i]).second;
+    for (size_t r = 0; r < _hidden_size; r++) {
+      if (!(smooth[r] > 0.f)) {
+        throw std::runtime_error("Wrong " + name + " !");
+      }
+      (*norm_scales[i])[r] /= smooth[r];
+      for (size_t c = 0; c < cols; c++) kernel[r * cols + c] *= smooth[r];
+    }
+  }
 }
 
 /**
@@ -135,7 +636,13 @@ void LlamaWeight<T>::hdf5_parse_emb_wei(hid_t hdf5_file) {
   std::cout << "loading " << value_size / (1024 * 1024)
             << " M of decoder weight." << std::endl;
 
-  const size_t max_buffer_size = max_value_size;
+  if (_emb_quant && _src_vocab_size % 4 != 0) {
+    throw std::runtime_error("int8 logits need a vocab size multiple of 4 !");
+  }
+  // with _emb_quant only the scales go through the buffers.
+  const size_t max_buffer_size =
+      _emb_quant ? std::max(size_t(_src_vocab_size), _hidden_size)
+                 : max_value_size;
   float* source_buffer;
   T* target_buffer;
   cudaMalloc(&source_buffer, max_buffer_size * sizeof(float));
@@ -149,10 +656,20 @@ void LlamaWeight<T>::hdf5_parse_emb_wei(hid_t hdf5_file) {
       hdf5_file, dataset_prefix + "/token_embedding", H5T_NATIVE_FLOAT,
       value.data(), [=](int size) { return size != buffer_size; },
       "Wrong token_embedding_size !");
-  addr = malloc_memory<T>(buffer_size);
-  _p_d_src_emb_wei.push_back(addr);
-  convert_dtype_by_gpu<T>(value.data(), source_buffer, target_buffer, addr,
-                          buffer_size, stream);
+  // int8 weights with one scale per token, pushed after the others.
+  std::vector<int8_t> qweight;
+  std::vector<float> emb_scale, logits_scale;
+  if (_emb_quant) {
+    quantize_rows(value, _src_vocab_size, _hidden_size, &qweight, &emb_scale);
+    int8_t* qaddr = malloc_memory<int8_t>(buffer_size);
+    push_emb_wei(qaddr, buffer_size);
+    cudaMemcpy(qaddr, qweight.data(), buffer_size, cudaMemcpyHostToDevice);
+  } else {
+    addr = malloc_memory<T>(buffer_size);
+    push_emb_wei(addr, buffer_size * sizeof(T));
+    convert_dtype_by_gpu<T>(value.data(), source_buffer, target_buffer, addr,
+                            buffer_size, stream);
+  }
 
   read_hdf5_dataset_data(
       hdf5_file, dataset_prefix + "/post_norm_scale", H5T_NATIVE_FLOAT,
@@ -160,7 +677,7 @@ void LlamaWeight<T>::hdf5_parse_emb_wei(hid_t hdf5_file) {
       "Wrong norm_scale_size !");
   buffer_size = _hidden_size;
   addr = malloc_memory<T>(buffer_size);
-  _p_d_src_emb_wei.push_back(addr);
+  push_emb_wei(addr, buffer_size * sizeof(T));
   convert_dtype_by_gpu<T>(value.data(), source_buffer, target_buffer, addr,
                           buffer_size, stream);
 
@@ -170,10 +687,26 @@ void LlamaWeight<T>::hdf5_parse_emb_wei(hid_t hdf5_file) {
       [=](int size) { return size != _src_vocab_size * _hidden_size; },
       "Wrong norm_scale_size !");
   buffer_size = _src_vocab_size * _hidden_size;
-  addr = malloc_memory<T>(buffer_size);
-  _p_d_src_emb_wei.push_back(addr);
-  convert_dtype_by_gpu<T>(value.data(), source_buffer, target_buffer, addr,
-                          buffer_size, stream);
+  if (_emb_quant) {
+    // [hidden_size, vocab_size] with one scale per column, the layout of
+    // WeightOnlyLinearOp.
+    quantize_kernel(value, _hidden_size, _src_vocab_size, 8, _hidden_size,
+                    &qweight, &logits_scale);
+    int8_t* qaddr = malloc_memory<int8_t>(buffer_size);
+    push_emb_wei(qaddr, buffer_size);
+    cudaMemcpy(qaddr, qweight.data(), buffer_size, cudaMemcpyHostToDevice);
+    for (std::vector<float>* scale : {&logits_scale, &emb_scale}) {
+      addr = malloc_memory<T>(_src_vocab_size);
+      push_emb_wei(addr, _src_vocab_size * sizeof(T));
+      convert_dtype_by_gpu<T>(scale->data(), source_buffer, target_buffer,
+                              addr, _src_vocab_size, stream);
+    }
+  } else {
+    addr = malloc_memory<T>(buffer_size);
+    push_emb_wei(addr, buffer_size * sizeof(T));
+    convert_dtype_by_gpu<T>(value.data(), source_buffer, target_buffer, addr,
+                            buffer_size, stream);
+  }
 
   std::cout << "finish initializing emb_wei from host to device" << std::endl;
 
@@ -184,27 +717,59 @@ void LlamaWeight<T>::hdf5_parse_emb_wei(hid_t hdf5_file) {
 }
 
 /**
-Load the weights of encoder into GPU memory.
+Load the weights of encoder into GPU memory. A thread reads the datasets of
+layer N + 1 from the file while layer N is split, quantized and uploaded.
 */
 template <typename T>
 void LlamaWeight<T>::hdf5_parse_enc_wei(hid_t hdf5_file) {
+  // q, k and v projections, k and v have _kv_head_num heads.
+  size_t qkv_size =
+      _hidden_size * (_head_num + 2 * _kv_head_num) * _dim_per_head;
+  // the kernels of all the experts with moe.
+  size_t ffn_size = std::max(_expert_num, 1) * _hidden_size * _inner_size;
+  size_t moe_gate_size = _hidden_size * _expert_num;
   size_t value_size =
-      (_hidden_size + _hidden_size * _hidden_size * 3 +
-       _hidden_size * _hidden_size + _hidden_size +
-       _hidden_size * _inner_size * 2 + _hidden_size * _inner_size) *
+      (_hidden_size + qkv_size + _hidden_size * _hidden_size + _hidden_size +
+       moe_gate_size + ffn_size * 3) *
       _layer_num;
 
   std::vector<size_t> value_size_vec = {_hidden_size,
-                                        _hidden_size * _hidden_size * 3,
+                                        qkv_size,
                                         _hidden_size * _hidden_size,
                                         _hidden_size,
-                                        _hidden_size * _inner_size * 2,
-                                        _hidden_size * _inner_size};
+                                        moe_gate_size,
+                                        ffn_size * 2,
+                                        ffn_size};
   size_t max_value_size =
       *max_element(value_size_vec.begin(), value_size_vec.end());
 
-  std::vector<size_t> offset;
-  std::vector<float> value(max_value_size);
+  if (_head_num % _tp_size != 0 || _kv_head_num % _tp_size != 0 ||
+      _inner_size % _tp_size != 0) {
+    throw std::runtime_error("Heads or inner size of the model can not be "
+                             "split into " +
+                             std::to_string(_tp_size) + " ranks !");
+  }
+  if (_pp_size > _layer_num) {
+    throw std::runtime_error("The " + std::to_string(_layer_num) +
+                             " layers can not be split into " +
+                             std::to_string(_pp_size) + " stages !");
+  }
+  // with tensor parallelism, this rank keeps its q and kv heads of the qkv
+  // projection and the rows of them in the output projection, and its slice
+  // of the inner dim of the mlp. norm scales are replicated.
+  size_t dim = _dim_per_head;
+  size_t local_head = _head_num / _tp_size;
+  size_t local_kv_head = _kv_head_num / _tp_size;
+  size_t local_inner = _inner_size / _tp_size;
+  std::vector<std::pair<size_t, size_t>> qkv_segments = {
+      {_tp_rank * local_head * dim, local_head * dim},
+      {(_head_num + _tp_rank * local_kv_head) * dim, local_kv_head * dim},
+      {(_head_num + _kv_head_num + _tp_rank * local_kv_head) * dim,
+       local_kv_head * dim}};
+  std::vector<std::pair<size_t, size_t>> gate_up_segments = {
+      {_tp_rank * local_inner, local_inner},
+      {_inner_size + _tp_rank * local_inner, local_inner}};
+
   std::cout << "loading " << value_size / (1024 * 1024)
             << " M of decoder weight." << std::endl;
 
@@ -214,82 +779,517 @@ void LlamaWeight<T>::hdf5_parse_enc_wei(hid_t hdf5_file) {
   cudaMalloc(&source_buffer, max_buffer_size * sizeof(float));
   cudaMalloc(&target_buffer, max_buffer_size * sizeof(T));
 
+  // double buffered, the hdf5 library is only called by the reading thread
+  // while it runs. The pageable copies out of a buffer are staged before
+  // cudaMemcpyAsync returns, so it can be refilled right after.
+  LayerHostWeights host[2];
+  std::future<void> next_layer = std::async(std::launch::async, [&]() {
+    hdf5_read_enc_layer(hdf5_file, 0, &host[0]);
+  });
+
   T* addr = nullptr;
   size_t buffer_size;
+  int device = 0;
   for (int layer_id = 0; layer_id < _layer_num; ++layer_id) {
+    // rethrows the error of the read
+    next_layer.get();
+    LayerHostWeights& layer = host[layer_id % 2];
+    if (layer_id + 1 < _layer_num) {
+      next_layer = std::async(std::launch::async, [&, layer_id]() {
+        hdf5_read_enc_layer(hdf5_file, layer_id + 1,
+                            &host[(layer_id + 1) % 2]);
+      });
+    }
+    if (layer_stage(layer_id) != device) {
+      // the layers of a pipeline stage live on its device, and so do the
+      // buffers and the stream which convert them.
+      cudaStreamSynchronize(stream);
+      cudaFree(source_buffer);
+      cudaFree(target_buffer);
+      cudaStreamDestroy(stream);
+      device = layer_stage(layer_id);
+      cudaSetDevice(device);
+      cudaStreamCreate(&stream);
+      cudaMalloc(&source_buffer, max_buffer_size * sizeof(float));
+      cudaMalloc(&target_buffer, max_buffer_size * sizeof(T));
+    }
     std::string dataset_prefix = "decoder_layers/" + std::to_string(layer_id);
+    size_t tensor_begin = _p_d_enc_wei.size();
+    _enc_wei_layer_begin.push_back(tensor_begin);
 
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/attention_norm_scale", H5T_NATIVE_FLOAT,
-        value.data(), [=](int size) { return size != _hidden_size; },
-        "Wrong attention_norm_scale_size !");
-    buffer_size = _hidden_size;
-    addr = malloc_memory<T>(buffer_size);
-    _p_d_enc_wei.push_back(addr);
-    convert_dtype_by_gpu<T>(value.data(), source_buffer, target_buffer, addr,
-                            buffer_size, stream);
-
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/attention_project_qkv", H5T_NATIVE_FLOAT,
-        value.data(),
-        [=](int size) { return size != _hidden_size * _hidden_size * 3; },
-        "Wrong attention_project_q_size !");
-    buffer_size = _hidden_size * _hidden_size * 3;
-    addr = malloc_memory<T>(buffer_size);
-    _p_d_enc_wei.push_back(addr);
-    convert_dtype_by_gpu<T>(value.data(), source_buffer, target_buffer, addr,
-                            buffer_size, stream);
-
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/attention_output", H5T_NATIVE_FLOAT,
-        value.data(),
-        [=](int size) { return size != _hidden_size * _hidden_size; },
-        "Wrong attention_output_size !");
-    buffer_size = _hidden_size * _hidden_size;
-    addr = malloc_memory<T>(buffer_size);
-    _p_d_enc_wei.push_back(addr);
-    convert_dtype_by_gpu<T>(value.data(), source_buffer, target_buffer, addr,
-                            buffer_size, stream);
+    // upload kernel k of the layer, split by the tensor parallel rank.
+    auto upload_layer_kernel = [&](int k) {
+      if (!layer.qweights[k].empty()) {
+        upload_quant_kernel(layer.qweights[k], layer.qscales[k],
+                            source_buffer, target_buffer);
+        return;
+      }
+      std::vector<float>& value = layer.kernels[k];
+      size_t rows = enc_kernel_shape(k).first;
+      size_t cols = enc_kernel_shape(k).second;
+      if (_tp_size > 1) {
+        if (k == 0) {
+          keep_columns(value, rows, cols, qkv_segments);
+          cols = (local_head + 2 * local_kv_head) * dim;
+        } else if (k == 1) {
+          keep_rows(value, cols, _tp_rank * local_head * dim,
+                    local_head * dim);
+          rows = local_head * dim;
+        } else if (k == 2) {
+          keep_columns(value, rows, cols, gate_up_segments);
+          cols = local_inner * 2;
+        } else {
+          keep_rows(value, cols, _tp_rank * local_inner, local_inner);
+          rows = local_inner;
+        }
+      }
+      upload_kernel(dataset_prefix + "/" + kEncKernelNames[k], layer_id,
+                    layer.input_scales[k], value, rows, cols, source_buffer,
+                    target_buffer);
+    };
 
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/ffn_norm_scale", H5T_NATIVE_FLOAT,
-        value.data(), [=](int size) { return size != _hidden_size; },
-        "Wrong ffn_norm_scale_size !");
     buffer_size = _hidden_size;
     addr = malloc_memory<T>(buffer_size);
-    _p_d_enc_wei.push_back(addr);
-    convert_dtype_by_gpu<T>(value.data(), source_buffer, target_buffer, addr,
-                            buffer_size, stream);
+    push_enc_wei(addr, buffer_size * sizeof(T));
+    convert_dtype_by_gpu<T>(layer.attention_norm_scale.data(), source_buffer,
+                            target_buffer, addr, buffer_size, stream);
+    upload_layer_kernel(0);
+    upload_layer_kernel(1);
 
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/gate_up_project_weight", H5T_NATIVE_FLOAT,
-        value.data(),
-        [=](int size) { return size != _hidden_size * _inner_size * 2; },
-        "Wrong gate_up_project_weight_size !");
-    buffer_size = _hidden_size * _inner_size * 2;
-    addr = malloc_memory<T>(buffer_size);
-    _p_d_enc_wei.push_back(addr);
-    convert_dtype_by_gpu<T>(value.data(), source_buffer, target_buffer, addr,
-                            buffer_size, stream);
-
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/down_project_weight", H5T_NATIVE_FLOAT,
-        value.data(),
-        [=](int size) { return size != _hidden_size * _inner_size; },
-        "Wrong down_project_weight_size !");
-    buffer_size = _hidden_size * _inner_size;
     addr = malloc_memory<T>(buffer_size);
-    _p_d_enc_wei.push_back(addr);
-    convert_dtype_by_gpu<T>(value.data(), source_buffer, target_buffer, addr,
-                            buffer_size, stream);
+    push_enc_wei(addr, buffer_size * sizeof(T));
+    convert_dtype_by_gpu<T>(layer.ffn_norm_scale.data(), source_buffer,
+                            target_buffer, addr, buffer_size, stream);
+    if (_expert_num > 0) {
+      addr = malloc_memory<T>(moe_gate_size);
+      push_enc_wei(addr, moe_gate_size * sizeof(T));
+      convert_dtype_by_gpu<T>(layer.moe_gate.data(), source_buffer,
+                              target_buffer, addr, moe_gate_size, stream);
+    }
+    upload_layer_kernel(2);
+    upload_layer_kernel(3);
+    if (_offload_layers) offload_layer(layer_id, tensor_begin);
   }
 
   std::cout << "finish initializing dec_wei from host to device" << std::endl;
 
-  value.clear();
-  value.shrink_to_fit();
   cudaFree(source_buffer);
   cudaFree(target_buffer);
+  if (device != 0) {
+    cudaStreamSynchronize(stream);
+    cudaStreamDestroy(stream);
+    cudaSetDevice(0);
+    cudaStreamCreate(&stream);
+  }
+  if (_offload_layers) finish_offload();
+}
+
+template <typename T>
+void LlamaWeight<T>::check_offload_layers() {
+  if (_offload_layers && (_layer_num <= 2 || _pp_size > 1)) {
+    // two layers fit the slots, and the stages have no shared slots.
+    std::cout << "layer weights are not offloaded with " << _layer_num
+              << " layers and " << _pp_size << " pipeline stages"
+              << std::endl;
+    _offload_layers = false;
+  }
+  if (_offload_layers && _int8 && !_int8_layers.empty()) {
+    // the slots have the layout of every layer.
+    std::cout << "layer weights of mixed precision are not offloaded"
+              << std::endl;
+    _offload_layers = false;
+  }
+}
+
+/**
+Move the weights of layer_id, pushed from tensor_begin on, to pinned host
+memory and free them on the device. Every layer has the layout of the first.
+*/
+template <typename T>
+void LlamaWeight<T>::offload_layer(int layer_id, size_t tensor_begin) {
+  const size_t kAlignment = 256;
+  if (_h_layer_wei == nullptr) {
+    for (size_t i = tensor_begin; i < _enc_wei_bytes.size(); i++) {
+      _layer_wei_offsets.push_back(_layer_wei_bytes);
+      _layer_wei_bytes +=
+          (_enc_wei_bytes[i] + kAlignment - 1) / kAlignment * kAlignment;
+    }
+    if (cudaHostAlloc(&_h_layer_wei, _layer_num * _layer_wei_bytes,
+                      cudaHostAllocDefault) != cudaSuccess) {
+      throw std::runtime_error("Unable to allocate " +
+                               std::to_string(_layer_num * _layer_wei_bytes) +
+                               " bytes of pinned memory for the layers !");
+    }
+  }
+  if (_p_d_enc_wei.size() - tensor_begin != _layer_wei_offsets.size()) {
+    throw std::runtime_error("Layer " + std::to_string(layer_id) +
+                             " has other weights than layer 0 !");
+  }
+  cudaStreamSynchronize(stream);
+  char* layer_wei = _h_layer_wei + layer_id * _layer_wei_bytes;
+  for (size_t j = 0; j < _layer_wei_offsets.size(); j++) {
+    void* addr = const_cast<T*>(_p_d_enc_wei[tensor_begin + j]);
+    cudaMemcpy(layer_wei + _layer_wei_offsets[j], addr,
+               _enc_wei_bytes[tensor_begin + j], cudaMemcpyDeviceToHost);
+    cudaFree(addr);
+  }
+}
+
+/**
+Point the weights of every layer to its slot, filled by prefetch_layer.
+*/
+template <typename T>
+void LlamaWeight<T>::finish_offload() {
+  for (char*& slot : _d_layer_slots) {
+    slot = malloc_memory<char>(_layer_wei_bytes);
+    if (slot == nullptr) {
+      throw std::runtime_error("Unable to allocate the layer weight slots !");
+    }
+  }
+  size_t per_layer = _layer_wei_offsets.size();
+  for (size_t i = 0; i < _p_d_enc_wei.size(); i++) {
+    size_t layer_id = i / per_layer;
+    _p_d_enc_wei[i] = reinterpret_cast<const T*>(
+        _d_layer_slots[layer_id % 2] + _layer_wei_offsets[i % per_layer]);
+  }
+  std::cout << "offloaded " << _layer_num * _layer_wei_bytes / (1024 * 1024)
+            << " MB of layer weights to pinned host memory" << std::endl;
+}
+
+/**
+Read model config stored in the flat weight file, the quantization is the
+one the file was saved with.
+*/
+template <typename T>
+void LlamaWeight<T>::flat_get_model_config(const FlatWeightReader& reader) {
+  if (reader.config("dtype") != flat_dtype<T>()) {
+    throw std::runtime_error("Flat weight file of " + reader.config("dtype") +
+                             " can not be loaded as " + flat_dtype<T>());
+  }
+  if (std::stoi(reader.config("tp_size")) != _tp_size ||
+      std::stoi(reader.config("tp_rank")) != _tp_rank) {
+    throw std::runtime_error(
+        "Flat weight file of tensor parallel rank " +
+        reader.config("tp_rank") + " of " + reader.config("tp_size") +
+        " can not be loaded by rank " + std::to_string(_tp_rank) + " of " +
+        std::to_string(_tp_size));
+  }
+  auto get_int = [&](const std::string& key) {
+    return std::stoi(reader.config(key));
+  };
+  _hidden_size = get_int("hidden_size");
+  _inner_size = get_int("inner_size");
+  _max_step = get_int("max_step");
+  _extra_decode_length = get_int("extra_decode_length");
+  _src_vocab_size = get_int("src_vocab_size");
+  _layer_num = get_int("layer_num");
+  _head_num = get_int("head_num");
+  _kv_head_num = get_int("kv_head_num");
+  _padding_id = get_int("padding_id");
+  _generate_method = reader.config("generate_method");
+  _topk = get_int("topk");
+  _topp = std::stof(reader.config("topp"));
+  _eos_id = get_int("eos_id");
+  _beam_size = get_int("beam_size");
+  _length_penalty = std::stof(reader.config("length_penalty"));
+  _diverse_lambda = std::stof(reader.config("diverse_lambda"));
+  _use_gelu = get_int("use_gelu") != 0;
+  _weight_quant_bits = get_int("weight_quant_bits");
+  _weight_quant_group_size = get_int("weight_quant_group_size");
+  _fp8 = get_int("fp8") != 0;
+  _int8 = reader.has_config("int8") && get_int("int8") != 0;
+  _int8_layers.clear();
+  if (reader.has_config("int8_layers")) {
+    std::istringstream layers(reader.config("int8_layers"));
+    std::string layer_id;
+    while (std::getline(layers, layer_id, ',')) {
+      _int8_layers.push_back(std::stoi(layer_id));
+    }
+  }
+  _emb_quant = reader.has_config("emb_quant") && get_int("emb_quant") != 0;
+  if (reader.has_config("expert_num")) {
+    _expert_num = get_int("expert_num");
+    _moe_topk = get_int("moe_topk");
+  }
+  if (reader.has_config("rope_theta")) {
+    _rope_theta = std::stof(reader.config("rope_theta"));
+    _rope_scaling_type = reader.config("rope_scaling_type");
+    _rope_scaling_factor = std::stof(reader.config("rope_scaling_factor"));
+    _rope_original_max_step = get_int("rope_original_max_step");
+  }
+  _dim_per_head = _hidden_size / _head_num;
+}
+
+/**
+Load the tensors of the flat weight file into GPU memory, the layers of a
+pipeline stage on its device.
+*/
+template <typename T>
+void LlamaWeight<T>::flat_parse_wei(FlatWeightReader& reader) {
+  const std::vector<FlatTensor>& tensors = reader.tensors();
+  size_t emb_num = 0;
+  for (const FlatTensor& tensor : tensors) emb_num += tensor.layer < 0;
+  size_t enc_num = tensors.size() - emb_num;
+  // the layers of mixed precision have different numbers of tensors.
+  if (emb_num != (_emb_quant ? 5 : 3) || _layer_num <= 0 ||
+      (_int8_layers.empty() && enc_num % _layer_num != 0)) {
+    throw std::runtime_error("Wrong tensor number of the flat weight file !");
+  }
+  if (_pp_size > _layer_num) {
+    throw std::runtime_error("The " + std::to_string(_layer_num) +
+                             " layers can not be split into " +
+                             std::to_string(_pp_size) + " stages !");
+  }
+  size_t total_bytes = 0;
+  for (const FlatTensor& tensor : tensors) total_bytes += tensor.bytes;
+  std::cout << "loading " << total_bytes / (1024 * 1024)
+            << " MB of flat weight." << std::endl;
+
+  int device = 0;
+  int layer_id = -1;
+  size_t tensor_begin = 0;
+  for (size_t i = 0; i < tensors.size(); i++) {
+    const FlatTensor& tensor = tensors[i];
+    if (tensor.layer >= _layer_num || tensor.layer < layer_id) {
+      throw std::runtime_error("Wrong layer of the flat weight file !");
+    }
+    if (tensor.layer != layer_id) {
+      if (_offload_layers && layer_id >= 0) {
+        reader.synchronize();
+        offload_layer(layer_id, tensor_begin);
+      }
+      layer_id = tensor.layer;
+      tensor_begin = _p_d_enc_wei.size();
+      if (layer_id >= 0) _enc_wei_layer_begin.push_back(tensor_begin);
+    }
+    if (tensor.layer >= 0 && layer_stage(tensor.layer) != device) {
+      reader.synchronize();
+      cudaStreamDestroy(stream);
+      device = layer_stage(tensor.layer);
+      cudaSetDevice(device);
+      cudaStreamCreate(&stream);
+    }
+    char* addr = malloc_memory<char>(tensor.bytes);
+    reader.upload(i, addr, stream);
+    if (tensor.layer < 0) {
+      push_emb_wei(addr, tensor.bytes);
+    } else {
+      push_enc_wei(addr, tensor.bytes);
+    }
+  }
+  reader.synchronize();
+  if (device != 0) {
+    cudaStreamDestroy(stream);
+    cudaSetDevice(0);
+    cudaStreamCreate(&stream);
+  }
+  if (_offload_layers) {
+    offload_layer(layer_id, tensor_begin);
+    finish_offload();
+  }
+}
+
+template <typename T>
+void LlamaWeight<T>::save_flat(const std::string& path) const {
+  if (_offload_layers) {
+    throw std::runtime_error(
+        "Layer weights offloaded to host memory can not be saved as a flat "
+        "weight file !");
+  }
+  FlatWeightWriter writer;
+  writer.set_config("dtype", std::string(flat_dtype<T>()));
+  writer.set_config("tp_rank", _tp_rank);
+  writer.set_config("tp_size", _tp_size);
+  writer.set_config("hidden_size", _hidden_size);
+  writer.set_config("inner_size", _inner_size);
+  writer.set_config("max_step", _max_step);
+  writer.set_config("extra_decode_length", _extra_decode_length);
+  writer.set_config("src_vocab_size", _src_vocab_size);
+  writer.set_config("layer_num", _layer_num);
+  writer.set_config("head_num", _head_num);
+  writer.set_config("kv_head_num", _kv_head_num);
+  writer.set_config("padding_id", _padding_id);
+  writer.set_config("generate_method", _generate_method);
+  writer.set_config("topk", _topk);
+  writer.set_config("topp", _topp);
+  writer.set_config("eos_id", _eos_id);
+  writer.set_config("beam_size", _beam_size);
+  writer.set_config("length_penalty", _length_penalty);
+  writer.set_config("diverse_lambda", _diverse_lambda);
+  writer.set_config("use_gelu", int(_use_gelu));
+  writer.set_config("weight_quant_bits", _weight_quant_bits);
+  writer.set_config("weight_quant_group_size", _weight_quant_group_size);
+  writer.set_config("fp8", int(_fp8));
+  writer.set_config("int8", int(_int8));
+  if (!_int8_layers.empty()) {
+    std::string int8_layers;
+    for (int layer_id : _int8_layers) {
+      if (!int8_layers.empty()) int8_layers += ",";
+      int8_layers += std::to_string(layer_id);
+    }
+    writer.set_config("int8_layers", int8_layers);
+  }
+  writer.set_config("emb_quant", int(_emb_quant));
+  writer.set_config("expert_num", _expert_num);
+  writer.set_config("moe_topk", _moe_topk);
+  writer.set_config("rope_theta", _rope_theta);
+  writer.set_config("rope_scaling_type", _rope_scaling_type);
+  writer.set_config("rope_scaling_factor", _rope_scaling_factor);
+  writer.set_config("rope_original_max_step", _rope_original_max_step);
+
+  for (size_t i = 0; i < _p_d_src_emb_wei.size(); i++) {
+    writer.add_tensor(-1, _p_d_src_emb_wei[i], _src_emb_wei_bytes[i]);
+  }
+  int layer_id = -1;
+  for (size_t i = 0; i < _p_d_enc_wei.size(); i++) {
+    while (layer_id + 1 < int(_enc_wei_layer_begin.size()) &&
+           _enc_wei_layer_begin[layer_id + 1] <= i) {
+      layer_id++;
+    }
+    writer.add_tensor(layer_id, _p_d_enc_wei[i], _enc_wei_bytes[i]);
+  }
+  // the weights of a stage may still be in flight on the stream.
+  cudaDeviceSynchronize();
+  writer.write(path);
+  std::cout << "Saved flat weight file " << path << std::endl;
+}
+
+template <typename T>
+void LlamaWeight<T>::copy_load_options(const LlamaWeight<T>& other) {
+  _tp_rank = other._tp_rank;
+  _tp_size = other._tp_size;
+  _pp_size = other._pp_size;
+  _weight_quant_bits = other._weight_quant_bits;
+  _weight_quant_group_size = other._weight_quant_group_size;
+  _fp8 = other._fp8;
+  _int8 = other._int8;
+  _int8_layers = other._int8_layers;
+  _emb_quant = other._emb_quant;
+  _offload_layers = other._offload_layers;
+}
+
+template <typename T>
+bool LlamaWeight<T>::same_layout(const LlamaWeight<T>& other) const {
+  return _layer_num == other._layer_num &&
+         _hidden_size == other._hidden_size &&
+         _inner_size == other._inner_size && _head_num == other._head_num &&
+         _kv_head_num == other._kv_head_num &&
+         _dim_per_head == other._dim_per_head &&
+         _src_vocab_size == other._src_vocab_size &&
+         _max_step == other._max_step && _expert_num == other._expert_num &&
+         _int8_layers == other._int8_layers &&
+         _src_emb_wei_bytes == other._src_emb_wei_bytes &&
+         _enc_wei_bytes == other._enc_wei_bytes;
+}
+
+template <typename T>
+void LlamaWeight<T>::swap_device_wei(LlamaWeight<T>& other) {
+  _p_d_src_emb_wei.swap(other._p_d_src_emb_wei);
+  _p_d_enc_wei.swap(other._p_d_enc_wei);
+  // the host copy belongs to the weights it copies.
+  std::swap(_h_resident_wei, other._h_resident_wei);
+  std::swap(_d_resident_wei, other._d_resident_wei);
+  _resident_offsets.swap(other._resident_offsets);
+  std::swap(_resident_bytes, other._resident_bytes);
+  std::swap(_wei_evicted, other._wei_evicted);
+}
+
+template <typename T>
+void LlamaWeight<T>::free_wei_allocations() {
+  if (_d_resident_wei) {
+    cudaFree(_d_resident_wei);
+    _d_resident_wei = nullptr;
+    return;
+  }
+  // every weight is a device allocation of its own, see push_enc_wei.
+  for (const T* addr : _p_d_src_emb_wei) cudaFree(const_cast<T*>(addr));
+  for (const T* addr : _p_d_enc_wei) cudaFree(const_cast<T*>(addr));
+}
+
+template <typename T>
+void LlamaWeight<T>::free_device_wei() {
+  if (!_wei_evicted) free_wei_allocations();
+  if (_h_resident_wei) {
+    cudaFreeHost(_h_resident_wei);
+    _h_resident_wei = nullptr;
+  }
+  _p_d_src_emb_wei.clear();
+  _p_d_enc_wei.clear();
+  cudaStreamDestroy(stream);
+}
+
+/**
+Page the weights out to pinned host memory, at offsets aligned as the ones
+of the offloaded layers, so that upload_device_wei copies them back in one
+transfer at the bandwidth of the bus.
+*/
+template <typename T>
+void LlamaWeight<T>::evict_device_wei() {
+  if (_wei_evicted) {
+    return;
+  }
+  if (_h_layer_wei) {
+    throw std::runtime_error("the weights of offloaded layers can not be "
+                             "evicted");
+  }
+  const size_t kAlignment = 256;
+  cudaStreamSynchronize(stream);
+  if (_h_resident_wei == nullptr) {
+    _resident_offsets.clear();
+    _resident_bytes = 0;
+    for (size_t i = 0; i < wei_count(); i++) {
+      _resident_offsets.push_back(_resident_bytes);
+      _resident_bytes +=
+          (wei_bytes(i) + kAlignment - 1) / kAlignment * kAlignment;
+    }
+    if (cudaHostAlloc(&_h_resident_wei, _resident_bytes,
+                      cudaHostAllocDefault) != cudaSuccess) {
+      _h_resident_wei = nullptr;
+      throw std::runtime_error("Unable to allocate " +
+                               std::to_string(_resident_bytes) +
+                               " bytes of pinned memory for the weights !");
+    }
+    for (size_t i = 0; i < wei_count(); i++) {
+      cudaMemcpyAsync(_h_resident_wei + _resident_offsets[i], wei_ptr(i),
+                      wei_bytes(i), cudaMemcpyDeviceToHost, stream);
+    }
+    cudaStreamSynchronize(stream);
+  }
+  free_wei_allocations();
+  for (size_t i = 0; i < wei_count(); i++) wei_ptr(i) = nullptr;
+  _wei_evicted = true;
+}
+
+template <typename T>
+void LlamaWeight<T>::upload_device_wei(cudaEvent_t done) {
+  if (!_wei_evicted) {
+    return;
+  }
+  if (cudaMalloc(&_d_resident_wei, _resident_bytes) != cudaSuccess) {
+    _d_resident_wei = nullptr;
+    throw std::runtime_error("Unable to allocate " +
+                             std::to_string(_resident_bytes) +
+                             " bytes of device memory for the weights !");
+  }
+  cudaMemcpyAsync(_d_resident_wei, _h_resident_wei, _resident_bytes,
+                  cudaMemcpyHostToDevice, stream);
+  cudaEventRecord(done, stream);
+  for (size_t i = 0; i < wei_count(); i++) {
+    wei_ptr(i) = reinterpret_cast<const T*>(_d_resident_wei +
+                                            _resident_offsets[i]);
+  }
+  _wei_evicted = false;
+}
+
+template <typename T>
+size_t LlamaWeight<T>::device_wei_bytes() const {
+  size_t bytes = 0;
+  for (size_t wei_bytes : _src_emb_wei_bytes) bytes += wei_bytes;
+  if (_h_layer_wei) {
+    return bytes + 2 * _layer_wei_bytes;
+  }
+  for (size_t wei_bytes : _enc_wei_bytes) bytes += wei_bytes;
+  return bytes;
 }
 
 /**
@@ -297,7 +1297,14 @@ Load the proto file into CPU memory and parse it.
 */
 template <typename T>
 std::string LlamaWeight<T>::initializing(std::string weight_path) {
-  cudaStreamCreate(&stream);
+  if (_background_stream) {
+    int least_priority, greatest_priority;
+    cudaDeviceGetStreamPriorityRange(&least_priority, &greatest_priority);
+    cudaStreamCreateWithPriority(&stream, cudaStreamNonBlocking,
+                                 least_priority);
+  } else {
+    cudaStreamCreate(&stream);
+  }
   // If weight is of type pb, parse using proto parser.
   if (endswith(weight_path, ".hdf5")) {
     std::cout << "Parsing hdf5: " << weight_path << std::endl;
@@ -307,22 +1314,36 @@ std::string LlamaWeight<T>::initializing(std::string weight_path) {
       return "Unable to read HDF5 file from " + weight_path;
     }
     hdf5_get_model_config(hdf5_file);
+    check_offload_layers();
 
     // hdf5_parse_* would throw std::runtime_error on error
     hdf5_parse_emb_wei(hdf5_file);
     hdf5_parse_enc_wei(hdf5_file);
     H5Fclose(hdf5_file);
 
+    cudaStreamSynchronize(stream);
+    std::cout << "Finish loading all weight from host to device" << std::endl;
+    return "";
+  } else if (endswith(weight_path, ".lsw")) {
+    std::cout << "Parsing flat weight: " << weight_path << std::endl;
+
+    // would throw std::runtime_error on error
+    FlatWeightReader reader(weight_path);
+    flat_get_model_config(reader);
+    check_offload_layers();
+    flat_parse_wei(reader);
+
     cudaStreamSynchronize(stream);
     std::cout << "Finish loading all weight from host to device" << std::endl;
     return "";
   } else {
     return "Unsupported weight extention for [" + weight_path +
-           "]; Supported extensions: .pb, .hdf5\n";
+           "]; Supported extensions: .hdf5, .lsw\n";
   }
 }
 #ifdef LIGHTSEQ_cuda
 template class LlamaWeight<__half>;
+template class LlamaWeight<__nv_bfloat16>;
 #endif
 template class LlamaWeight<float>;
 
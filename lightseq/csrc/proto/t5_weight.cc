@@ -0,0 +1,441 @@
+#include "t5_weight.h"
+
+#include <algorithm>
+#include <cmath>
+
+/**
+@file
+Load the model weights which stored in hdf5 file into GPU memory.
+Currently, fp16 and fp32 versions are provided.
+Weights in hdf5 file will always be in fp32. For fp16, the weights
+  will be casted from fp32 into fp16
+*/
+
+namespace lightseq {
+
+/**
+Cast weights into required datatype.
+The datatype of weights in hdf5 file will always be in fp32.
+*/
+template <>
+float T5Weight<float>::float2required(float value) {
+  return value;
+}
+
+#ifdef LIGHTSEQ_cuda
+/**
+fp16 version, cast fp32 into fp16
+*/
+template <>
+__half T5Weight<__half>::float2required(float value) {
+  return __float2half_rn(value);
+}
+#endif
+
+/**
+Read model config stored in hdf5 file.
+*/
+template <typename T>
+void T5Weight<T>::hdf5_get_model_config(hid_t hdf5_file) {
+  _hidden_size = get_hdf5_dataset_size(hdf5_file, "trg_embedding/norm_scale");
+
+  _inner_size =
+      get_hdf5_dataset_size(hdf5_file, "encoder_stack/0/ffn_first_kernel") /
+      _hidden_size;
+
+  try {
+    get_hdf5_dataset_size(hdf5_file, "encoder_stack/0/ffn_third_kernel");
+    _is_mt5 = true;
+  } catch (HDF5DatasetNotFoundError &e) {
+    _is_mt5 = false;
+  }
+
+  read_hdf5_dataset_scalar(hdf5_file, "model_conf/max_step", H5T_NATIVE_INT,
+                           &_max_step);
+
+  _src_vocab_size =
+      get_hdf5_dataset_size(hdf5_file, "src_embedding/token_embedding") /
+      _hidden_size;
+
+  _trg_vocab_size =
+      get_hdf5_dataset_size(hdf5_file, "trg_embedding/token_embedding") /
+      _hidden_size;
+
+  read_hdf5_dataset_scalar(hdf5_file, "model_conf/n_encoder_stack",
+                           H5T_NATIVE_INT, &_n_enc_layer);
+
+  read_hdf5_dataset_scalar(hdf5_file, "model_conf/n_decoder_stack",
+                           H5T_NATIVE_INT, &_n_dec_layer);
+
+  read_hdf5_dataset_scalar(hdf5_file, "model_conf/head_num", H5T_NATIVE_INT,
+                           &_head_num);
+
+  _dim_per_head = _hidden_size / _head_num;
+
+  try {
+    read_hdf5_dataset_scalar(hdf5_file,
+                             "model_conf/relative_attention_num_buckets",
+                             H5T_NATIVE_INT, &_relative_attention_num_buckets);
+  } catch (HDF5DatasetNotFoundError &e) {
+    _relative_attention_num_buckets = 32;
+  }
+
+  try {
+    int multilg_type = 0;
+    read_hdf5_dataset_scalar(hdf5_file, "model_conf/multilg_type",
+                             H5T_NATIVE_INT, &multilg_type);
+    if (multilg_type != 0) {
+      throw std::runtime_error("T5 does not support multilg_type " +
+                               std::to_string(multilg_type) + " !");
+    }
+  } catch (HDF5DatasetNotFoundError &e) {
+  }
+
+  read_hdf5_dataset_scalar(hdf5_file, "model_conf/beam_size", H5T_NATIVE_INT,
+                           &_beam_size);
+
+  read_hdf5_dataset_scalar(hdf5_file, "model_conf/extra_decode_length",
+                           H5T_NATIVE_INT, &_extra_decode_length);
+
+  read_hdf5_dataset_scalar(hdf5_file, "model_conf/length_penalty",
+                           H5T_NATIVE_FLOAT, &_length_penalty);
+
+  read_hdf5_dataset_scalar(hdf5_file, "model_conf/src_padding_id",
+                           H5T_NATIVE_INT, &_padding_id);
+
+  read_hdf5_dataset_scalar(hdf5_file, "model_conf/trg_start_id", H5T_NATIVE_INT,
+                           &_start_id);
+
+  read_hdf5_dataset_scalar(hdf5_file, "model_conf/trg_end_id", H5T_NATIVE_INT,
+                           &_end_id);
+
+  if (_end_id == 0) {
+    _end_id = _trg_vocab_size - 1;
+  }
+
+  read_hdf5_dataset_scalar(hdf5_file, "model_conf/diverse_lambda",
+                           H5T_NATIVE_FLOAT, &_diverse_lambda);
+
+  // special handling for string reading
+  // string were converted to numpy array of np.int8 in python
+  // hence needed to be read as an char array here
+  char _sampling_method_buf[128];  // get 128 character for sampling method
+  int _sampling_method_strlen = read_hdf5_dataset_data(
+      hdf5_file, "model_conf/sampling_method", H5T_NATIVE_CHAR,
+      _sampling_method_buf, [](int size) { return size > 128; },
+      "Expect model_conf/sampling_method to have less than 128 characters.");
+  std::string _sampling_method_read =
+      std::string(_sampling_method_buf, _sampling_method_strlen);
+  if (_sampling_method_read != "") {
+    _sampling_method = _sampling_method_read;
+  }
+
+  read_hdf5_dataset_scalar(hdf5_file, "model_conf/topk", H5T_NATIVE_INT,
+                           &_topk);
+
+  read_hdf5_dataset_scalar(hdf5_file, "model_conf/topp", H5T_NATIVE_FLOAT,
+                           &_topp);
+
+  try {
+    read_hdf5_dataset_scalar(hdf5_file, "model_conf/use_gelu", H5T_NATIVE_HBOOL,
+                             &_use_gelu);
+  } catch (HDF5DatasetNotFoundError &e) {
+    _use_gelu = false;
+  }
+}
+
+template <typename T>
+void T5Weight<T>::hdf5_read(hid_t hdf5_file, const std::string &dataset_name,
+                            size_t size, std::vector<float> *value,
+                            std::vector<size_t> *offset) {
+  size_t idx = value->size();
+  offset->push_back(idx);
+  value->resize(idx + size);
+  read_hdf5_dataset_data(
+      hdf5_file, dataset_name, H5T_NATIVE_FLOAT, value->data() + idx,
+      [=](int read_size) { return size_t(read_size) != size; },
+      "Wrong " + dataset_name + "_size !");
+}
+
+template <typename T>
+void T5Weight<T>::hdf5_read_ffn(hid_t hdf5_file,
+                                const std::string &dataset_prefix,
+                                std::vector<float> *value,
+                                std::vector<size_t> *offset) {
+  size_t kernel_size = _hidden_size * _inner_size;
+  if (!_is_mt5) {
+    hdf5_read(hdf5_file, dataset_prefix + "/ffn_first_kernel", kernel_size,
+              value, offset);
+    hdf5_read(hdf5_file, dataset_prefix + "/ffn_second_kernel", kernel_size,
+              value, offset);
+    return;
+  }
+
+  // [hidden_size, inner_size] first and second kernels into one
+  // [hidden_size, 2, inner_size] kernel, every row of the output is then the
+  // gelu input followed by the linear one, see ActElewiseProductOp.
+  std::vector<float> first, second;
+  std::vector<size_t> ignored;
+  hdf5_read(hdf5_file, dataset_prefix + "/ffn_first_kernel", kernel_size,
+            &first, &ignored);
+  hdf5_read(hdf5_file, dataset_prefix + "/ffn_second_kernel", kernel_size,
+            &second, &ignored);
+  size_t idx = value->size();
+  offset->push_back(idx);
+  value->resize(idx + 2 * kernel_size);
+  for (int i = 0; i < _hidden_size; i++) {
+    std::copy(first.begin() + i * _inner_size,
+              first.begin() + (i + 1) * _inner_size,
+              value->begin() + idx + 2 * i * _inner_size);
+    std::copy(second.begin() + i * _inner_size,
+              second.begin() + (i + 1) * _inner_size,
+              value->begin() + idx + (2 * i + 1) * _inner_size);
+  }
+  hdf5_read(hdf5_file, dataset_prefix + "/ffn_third_kernel", kernel_size,
+            value, offset);
+}
+
+/**
+The bucket of huggingface's T5Attention._relative_position_bucket, applied to
+every distance of key minus query position in (-max_step, max_step).
+*/
+template <typename T>
+std::vector<float> T5Weight<T>::expand_pos_bias(
+    const std::vector<float> &bucket_emb, bool bidirectional) const {
+  int max_len = _max_step;
+  std::vector<float> pos_bias(_head_num * (2 * max_len - 1));
+  for (int distance = 1 - max_len; distance < max_len; distance++) {
+    int num_buckets = _relative_attention_num_buckets;
+    int relative_position = distance;
+    int bucket = 0;
+    if (bidirectional) {
+      num_buckets /= 2;
+      if (relative_position > 0) bucket += num_buckets;
+      relative_position = std::abs(relative_position);
+    } else {
+      relative_position = -std::min(relative_position, 0);
+    }
+    int max_exact = num_buckets / 2;
+    if (relative_position < max_exact) {
+      bucket += relative_position;
+    } else {
+      int if_large =
+          max_exact +
+          int(std::log(double(relative_position) / max_exact) /
+              std::log(double(_relative_attention_max_distance) / max_exact) *
+              (num_buckets - max_exact));
+      bucket += std::min(if_large, num_buckets - 1);
+    }
+    for (int h = 0; h < _head_num; h++) {
+      pos_bias[h * (2 * max_len - 1) + distance + max_len - 1] =
+          bucket_emb[bucket * _head_num + h];
+    }
+  }
+  return pos_bias;
+}
+
+template <typename T>
+void T5Weight<T>::upload(const std::vector<float> &value,
+                         const std::vector<size_t> &offset,
+                         WeightVector *d_value,
+                         std::vector<const T *> *ptrs) {
+  std::vector<T> raw_value;
+  raw_value.reserve(value.size());
+  for (float e : value) raw_value.push_back(float2required(e));
+  *d_value = raw_value;
+  for (size_t e : offset) ptrs->push_back(raw_ptr(*d_value) + e);
+}
+
+/**
+Load the weights of embedding layer into GPU memory.
+Compared with the encoder, the decoder has more
+  encoder output project weights and the logits kernel.
+*/
+template <typename T>
+void T5Weight<T>::hdf5_parse_emb_wei(hid_t hdf5_file, std::string source) {
+  int vocab_size = (source == "src") ? _src_vocab_size : _trg_vocab_size;
+  std::string dataset_prefix =
+      (source == "src") ? "src_embedding" : "trg_embedding";
+
+  std::vector<size_t> offset;
+  std::vector<float> value;
+  hdf5_read(hdf5_file, dataset_prefix + "/token_embedding",
+            vocab_size * _hidden_size, &value, &offset);
+  std::vector<float> bucket_emb;
+  std::vector<size_t> ignored;
+  hdf5_read(hdf5_file, dataset_prefix + "/position_embedding",
+            _relative_attention_num_buckets * _head_num, &bucket_emb,
+            &ignored);
+  hdf5_read(hdf5_file, dataset_prefix + "/norm_scale", _hidden_size, &value,
+            &offset);
+
+  offset.push_back(value.size());
+  std::vector<float> pos_bias = expand_pos_bias(bucket_emb, source == "src");
+  value.insert(value.end(), pos_bias.begin(), pos_bias.end());
+
+  if (source == "trg") {
+    hdf5_read(hdf5_file, dataset_prefix + "/encode_output_project_kernel_kv",
+              _hidden_size * _hidden_size * 2 * _n_dec_layer, &value, &offset);
+    if (_is_mt5) {
+      hdf5_read(hdf5_file, dataset_prefix + "/lm_head",
+                _hidden_size * _trg_vocab_size, &value, &offset);
+    }
+  }
+  std::cout << "loading " << value.size() * sizeof(T) / (1024 * 1024)
+            << " MB of embedding weight." << std::endl;
+
+  std::vector<const T *> *ptrs =
+      (source == "src") ? &_p_d_src_emb_wei : &_p_d_trg_emb_wei;
+  upload(value, offset,
+         (source == "src") ? &_d_src_emb_wei : &_d_trg_emb_wei, ptrs);
+
+  // {token_emb, pos_emb, norm_scale, pos_bias} and the decoder's
+  // {encdec_kv_kernel, encdec_kv_bias, logits_kernel}
+  ptrs->insert(ptrs->begin() + 1, zeros());
+  if (source == "trg") {
+    ptrs->insert(ptrs->begin() + 5, zeros());
+    if (!_is_mt5) ptrs->push_back(ptrs->at(0));
+  }
+
+  std::cout << "finish initializing " << source
+            << "_emb_wei from host to device" << std::endl;
+}
+
+/**
+Load the weights of encoder into GPU memory.
+*/
+template <typename T>
+void T5Weight<T>::hdf5_parse_enc_wei(hid_t hdf5_file) {
+  std::vector<size_t> offset;
+  std::vector<float> value;
+  float q_scale = std::sqrt(float(_dim_per_head));
+
+  for (int layer_id = 0; layer_id < _n_enc_layer; ++layer_id) {
+    std::string dataset_prefix = "encoder_stack/" + std::to_string(layer_id);
+
+    hdf5_read(hdf5_file, dataset_prefix + "/multihead_norm_scale",
+              _hidden_size, &value, &offset);
+    hdf5_read(hdf5_file, dataset_prefix + "/multihead_project_kernel_qkv",
+              _hidden_size * _hidden_size * 3, &value, &offset);
+    // cancel the 1 / sqrt(dim_per_head) of the attention, see t5_weight.h
+    float *qkv = value.data() + offset.back();
+    for (int i = 0; i < _hidden_size; i++) {
+      for (int j = 0; j < _hidden_size; j++) {
+        qkv[i * 3 * _hidden_size + j] *= q_scale;
+      }
+    }
+    hdf5_read(hdf5_file, dataset_prefix + "/multihead_project_kernel_output",
+              _hidden_size * _hidden_size, &value, &offset);
+    hdf5_read(hdf5_file, dataset_prefix + "/ffn_norm_scale", _hidden_size,
+              &value, &offset);
+    hdf5_read_ffn(hdf5_file, dataset_prefix, &value, &offset);
+  }
+  std::cout << "loading " << value.size() * sizeof(T) / (1024 * 1024)
+            << " MB of encoder weight." << std::endl;
+
+  std::vector<const T *> ptrs;
+  upload(value, offset, &_d_enc_wei, &ptrs);
+  // the ffn kernels read are the [first, second] kernels of T5 and the
+  // [concatenated first and second, third] kernels of mT5.
+  for (int layer_id = 0; layer_id < _n_enc_layer; ++layer_id) {
+    const T *const *layer = ptrs.data() + layer_id * 6;
+    _p_d_enc_wei.insert(_p_d_enc_wei.end(),
+                        {layer[0], layer[1], zeros(), layer[2], layer[3],
+                         layer[4], zeros(), layer[5]});
+  }
+
+  std::cout << "finish initializing enc_wei from host to device" << std::endl;
+}
+
+/**
+Load the weights of decoder into GPU memory.
+*/
+template <typename T>
+void T5Weight<T>::hdf5_parse_dec_wei(hid_t hdf5_file) {
+  std::vector<size_t> offset;
+  std::vector<float> value;
+  float q_scale = std::sqrt(float(_dim_per_head));
+
+  for (int layer_id = 0; layer_id < _n_dec_layer; ++layer_id) {
+    std::string dataset_prefix = "decoder_stack/" + std::to_string(layer_id);
+
+    hdf5_read(hdf5_file, dataset_prefix + "/self_norm_scale", _hidden_size,
+              &value, &offset);
+    hdf5_read(hdf5_file, dataset_prefix + "/self_project_kernel_qkv",
+              _hidden_size * _hidden_size * 3, &value, &offset);
+    float *qkv = value.data() + offset.back();
+    for (int i = 0; i < _hidden_size; i++) {
+      for (int j = 0; j < _hidden_size; j++) {
+        qkv[i * 3 * _hidden_size + j] *= q_scale;
+      }
+    }
+    hdf5_read(hdf5_file, dataset_prefix + "/self_project_kernel_output",
+              _hidden_size * _hidden_size, &value, &offset);
+    hdf5_read(hdf5_file, dataset_prefix + "/encdec_norm_scale", _hidden_size,
+              &value, &offset);
+    hdf5_read(hdf5_file, dataset_prefix + "/encdec_project_kernel_q",
+              _hidden_size * _hidden_size, &value, &offset);
+    float *q = value.data() + offset.back();
+    for (int i = 0; i < _hidden_size * _hidden_size; i++) q[i] *= q_scale;
+    hdf5_read(hdf5_file, dataset_prefix + "/encdec_project_kernel_output",
+              _hidden_size * _hidden_size, &value, &offset);
+    hdf5_read(hdf5_file, dataset_prefix + "/ffn_norm_scale", _hidden_size,
+              &value, &offset);
+    hdf5_read_ffn(hdf5_file, dataset_prefix, &value, &offset);
+  }
+  std::cout << "loading " << value.size() * sizeof(T) / (1024 * 1024)
+            << " MB of decoder weight." << std::endl;
+
+  std::vector<const T *> ptrs;
+  upload(value, offset, &_d_dec_wei, &ptrs);
+  for (int layer_id = 0; layer_id < _n_dec_layer; ++layer_id) {
+    const T *const *layer = ptrs.data() + layer_id * 9;
+    _p_d_dec_wei.insert(
+        _p_d_dec_wei.end(),
+        {layer[0], layer[1], zeros(), layer[2], layer[3], layer[4], zeros(),
+         layer[5], layer[6], layer[7], zeros(), layer[8]});
+  }
+
+  std::cout << "finish initializing dec_wei from host to device" << std::endl;
+}
+
+/**
+Load the hdf5 file into CPU memory and parse it.
+*/
+template <typename T>
+std::string T5Weight<T>::initializing(std::string weight_path) {
+  if (!endswith(weight_path, ".hdf5")) {
+    return "Unsupported weight extention for [" + weight_path +
+           "]; Supported extensions: .hdf5\n";
+  }
+  std::cout << "Parsing hdf5: " << weight_path << std::endl;
+
+  hid_t hdf5_file = H5Fopen(weight_path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (hdf5_file < 0) {
+    return "Unable to read HDF5 file from " + weight_path;
+  }
+  hdf5_get_model_config(hdf5_file);
+
+  // the zero biases and position embedding
+  size_t zeros_size = std::max({_max_step * _hidden_size, 3 * _hidden_size,
+                                2 * _hidden_size * _n_dec_layer,
+                                2 * _inner_size});
+  _d_zeros = std::vector<T>(zeros_size, float2required(0.f));
+
+  // hdf5_parse_* would throw std::runtime_error on error
+  hdf5_parse_emb_wei(hdf5_file, "src");
+  hdf5_parse_emb_wei(hdf5_file, "trg");
+  hdf5_parse_enc_wei(hdf5_file);
+  hdf5_parse_dec_wei(hdf5_file);
+  H5Fclose(hdf5_file);
+
+  std::cout << "Finish loading all weight from host to device" << std::endl;
+  return "";
+}
+
+#ifdef LIGHTSEQ_cuda
+template class T5Weight<__half>;
+#endif
+template class T5Weight<float>;
+
+}  // namespace lightseq
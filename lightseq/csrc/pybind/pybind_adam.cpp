@@ -60,6 +60,146 @@ void apex_adam(at::Tensor& p, at::Tensor& p_copy, at::Tensor& m, at::Tensor& v,
   apex_fused_adam_cuda(p, p_copy, m, v, g, lr, beta1, beta2, eps, grad_scale,
                        step, mode, bias_correction, decay);
 }
+
+void sparse_adam(at::Tensor& p, at::Tensor& p_copy, at::Tensor& m,
+                 at::Tensor& v, at::Tensor& rows, at::Tensor& num_rows,
+                 at::Tensor& g, at::Tensor& last_step, float lr, float beta1,
+                 float beta2, float eps, float grad_scale, int step, int mode,
+                 int bias_correction, float decay) {
+  CHECK_INPUT(p);
+  if (p_copy.numel() > 0) CHECK_INPUT(p_copy);
+  CHECK_INPUT(m);
+  CHECK_INPUT(v);
+  CHECK_INPUT(rows);
+  CHECK_INPUT(num_rows);
+  CHECK_INPUT(g);
+  if (last_step.numel() > 0) CHECK_INPUT(last_step);
+  AT_ASSERTM(p.scalar_type() == at::ScalarType::Float &&
+                 m.scalar_type() == at::ScalarType::Float &&
+                 v.scalar_type() == at::ScalarType::Float,
+             "expected params and states to be of float type");
+  AT_ASSERTM(rows.scalar_type() == at::ScalarType::Int &&
+                 num_rows.scalar_type() == at::ScalarType::Int,
+             "expected rows and num_rows to be of int type");
+  AT_ASSERTM(g.dim() == 2 && g.size(0) == rows.numel(),
+             "expected the [rows, row_dim] grads of the rows");
+  int64_t num_elem = p.numel();
+  AT_ASSERTM(m.numel() == num_elem && v.numel() == num_elem,
+             "number of elements in m, v and p tensors should be equal");
+  AT_ASSERTM(p_copy.numel() == num_elem || p_copy.numel() == 0,
+             "number of elements in p_copy and p tensors should be equal, or "
+             "p_copy should be empty");
+  AT_ASSERTM(
+      last_step.numel() == 0 || last_step.numel() * g.size(1) <= num_elem,
+             "last_step should have one step per row of p, or be empty");
+
+  sparse_adam_cuda(p, p_copy, m, v, rows, num_rows, g, last_step, lr, beta1,
+                   beta2, eps, grad_scale, step, mode, bias_correction, decay);
+}
+
+void check_multi_tensor_lists(
+    const std::vector<std::vector<at::Tensor>>& tensor_lists) {
+  AT_ASSERTM(tensor_lists.size() == 4 || tensor_lists.size() == 5,
+             "expected grads, params, exp_avgs, exp_avg_sqs and optionally "
+             "the fp16 params");
+  AT_ASSERTM(tensor_lists[0].size() > 0, "no tensor to update");
+  auto grad_type = tensor_lists[0][0].scalar_type();
+  for (int i = 0; i < tensor_lists[0].size(); i++) {
+    AT_ASSERTM(tensor_lists[0][i].scalar_type() == grad_type,
+               "all the grads should be of the same type");
+    for (int l = 1; l < 4; l++) {
+      AT_ASSERTM(tensor_lists[l][i].scalar_type() == at::ScalarType::Float,
+                 "expected params and states to be of float type");
+    }
+    if (tensor_lists.size() == 5) {
+      AT_ASSERTM(tensor_lists[4][i].scalar_type() == grad_type,
+                 "expected the param copies to be of the grad type");
+    }
+  }
+}
+
+at::Tensor multi_tensor_grad_norm(at::Tensor& noop_flag,
+                                  std::vector<at::Tensor>& grads) {
+  CHECK_INPUT(noop_flag);
+  AT_ASSERTM(grads.size() > 0, "no grad to compute the norm");
+  return multi_tensor_grad_norm_cuda(noop_flag, grads);
+}
+
+void multi_tensor_adamw(at::Tensor& noop_flag,
+                        std::vector<std::vector<at::Tensor>>& tensor_lists,
+                        at::Tensor& grad_norm, float lr, float beta1,
+                        float beta2, float eps, float grad_scale,
+                        float max_grad_norm, int step, int mode,
+                        int bias_correction, float decay) {
+  CHECK_INPUT(noop_flag);
+  CHECK_INPUT(grad_norm);
+  check_multi_tensor_lists(tensor_lists);
+  multi_tensor_adamw_cuda(noop_flag, tensor_lists, grad_norm, lr, beta1, beta2,
+                          eps, grad_scale, max_grad_norm, step, mode,
+                          bias_correction, decay);
+}
+
+void multi_tensor_lamb(at::Tensor& noop_flag,
+                       std::vector<std::vector<at::Tensor>>& tensor_lists,
+                       at::Tensor& grad_norm, float lr, float beta1,
+                       float beta2, float eps, float grad_scale,
+                       float max_grad_norm, int step, int mode,
+                       int bias_correction, float decay) {
+  CHECK_INPUT(noop_flag);
+  CHECK_INPUT(grad_norm);
+  check_multi_tensor_lists(tensor_lists);
+  multi_tensor_lamb_cuda(noop_flag, tensor_lists, grad_norm, lr, beta1, beta2,
+                         eps, grad_scale, max_grad_norm, step, mode,
+                         bias_correction, decay);
+}
+
+void multi_tensor_adamw_bf16(
+    at::Tensor& noop_flag, std::vector<std::vector<at::Tensor>>& tensor_lists,
+    std::vector<std::vector<at::Tensor>>& scale_lists, at::Tensor& grad_norm,
+    float lr, float beta1, float beta2, float eps, float grad_scale,
+    float max_grad_norm, int step, int mode, int bias_correction, float decay,
+    int64_t seed) {
+  CHECK_INPUT(noop_flag);
+  CHECK_INPUT(grad_norm);
+  AT_ASSERTM(tensor_lists.size() == 4,
+             "expected grads, params, exp_avgs and exp_avg_sqs");
+  AT_ASSERTM(scale_lists.empty() || scale_lists.size() == 2,
+             "expected no scales, or exp_avg_scales and exp_avg_sq_scales");
+  AT_ASSERTM(tensor_lists[0].size() > 0, "no tensor to update");
+  bool quant = scale_lists.size() == 2;
+  for (auto& scales : scale_lists) {
+    AT_ASSERTM(scales.size() == tensor_lists[0].size(),
+               "expected the scales of every param");
+  }
+  auto grad_type = tensor_lists[0][0].scalar_type();
+  for (int i = 0; i < tensor_lists[0].size(); i++) {
+    AT_ASSERTM(tensor_lists[0][i].scalar_type() == grad_type,
+               "all the grads should be of the same type");
+    AT_ASSERTM(tensor_lists[1][i].scalar_type() == at::ScalarType::BFloat16,
+               "expected params to be of bfloat16 type");
+    if (!quant) {
+      AT_ASSERTM(
+          tensor_lists[2][i].scalar_type() == at::ScalarType::Float &&
+              tensor_lists[3][i].scalar_type() == at::ScalarType::Float,
+          "expected states to be of float type without scales");
+      continue;
+    }
+    AT_ASSERTM(tensor_lists[2][i].scalar_type() == at::ScalarType::Char &&
+                   tensor_lists[3][i].scalar_type() == at::ScalarType::Byte,
+               "expected int8 exp_avgs and uint8 exp_avg_sqs with scales");
+    int64_t num_blocks = (tensor_lists[1][i].numel() + 255) / 256;
+    for (int l = 0; l < 2; l++) {
+      CHECK_INPUT(scale_lists[l][i]);
+      AT_ASSERTM(scale_lists[l][i].scalar_type() == at::ScalarType::Float &&
+                     scale_lists[l][i].numel() == num_blocks,
+                 "expected one float scale per 256 elements of a param");
+    }
+  }
+  multi_tensor_adamw_bf16_cuda(noop_flag, tensor_lists, scale_lists, grad_norm,
+                               lr, beta1, beta2, eps, grad_scale,
+                               max_grad_norm, step, mode, bias_correction,
+                               decay, seed);
+}
 }  // namespace cuda
 }  // namespace lightseq
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
@@ -67,4 +207,15 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         "LightSeq Adam optimized CUDA implementation.");
   m.def("apex_adam", &lightseq::cuda::apex_adam,
         "Apex adam optimized CUDA implementation.");
+  m.def("sparse_adam", &lightseq::cuda::sparse_adam,
+        "LightSeq Adam of sparse rows with lazily decayed moments.");
+  m.def("multi_tensor_grad_norm", &lightseq::cuda::multi_tensor_grad_norm,
+        "LightSeq multi tensor global grad norm and inf/nan check.");
+  m.def("multi_tensor_adamw", &lightseq::cuda::multi_tensor_adamw,
+        "LightSeq multi tensor AdamW CUDA implementation.");
+  m.def("multi_tensor_lamb", &lightseq::cuda::multi_tensor_lamb,
+        "LightSeq multi tensor LAMB CUDA implementation.");
+  m.def("multi_tensor_adamw_bf16", &lightseq::cuda::multi_tensor_adamw_bf16,
+        "LightSeq multi tensor AdamW of bf16 params with stochastic rounding "
+        "and optionally 8 bit states.");
 }
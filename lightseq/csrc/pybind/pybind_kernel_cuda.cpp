@@ -6,6 +6,8 @@
 #include "cuda_util.h"
 #include "kernels.h"
 #include "llama_kernels.h"
+#include "transformerKernels.h"
+#include "moe_kernels.h"
 #include "cmath"
 #include "memory"
 #include <cuda.h>
@@ -255,6 +257,45 @@ void torch_launch_ln_bw(torch::Tensor &gamma_grad, torch::Tensor &betta_grad,
                hidden_dim, streams);
 }
 
+template <typename T>
+void torch_launch_ln_bw_fused(
+    torch::Tensor &gamma_grad, torch::Tensor &betta_grad,
+    torch::Tensor &inp_grad, const torch::Tensor &out_grad,
+    const torch::Tensor &residual_grad, const torch::Tensor &inp_or_out,
+    const torch::Tensor &gamma, const torch::Tensor &betta,
+    const torch::Tensor &vars, const torch::Tensor &means,
+    torch::Tensor &workspace, int batch_size, int hidden_dim, bool with_mean,
+    bool fuse_add) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  const T *p_residual_grad = fuse_add ? rptr<T>(residual_grad) : nullptr;
+  const T *p_betta = with_mean ? nullptr : rptr<T>(betta);
+  const T *p_means = with_mean ? rptr<T>(means) : nullptr;
+
+  launch_ln_bw_fused(rptr<T>(gamma_grad), rptr<T>(betta_grad),
+                     rptr<T>(inp_grad), rptr<T>(out_grad), p_residual_grad,
+                     rptr<T>(inp_or_out), rptr<T>(gamma), p_betta,
+                     rptr<T>(vars), p_means, rptr<float>(workspace),
+                     batch_size, hidden_dim, stream);
+}
+
+template <typename T>
+void torch_launch_rms_ln_bw(torch::Tensor &gamma_grad, torch::Tensor &inp_grad,
+                            const torch::Tensor &out_grad,
+                            const torch::Tensor &residual_grad,
+                            const torch::Tensor &inp_or_out,
+                            const torch::Tensor &gamma,
+                            const torch::Tensor &rms_vars,
+                            torch::Tensor &workspace, int batch_size,
+                            int hidden_dim, bool inp_is_out, bool fuse_add) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  const T *p_residual_grad = fuse_add ? rptr<T>(residual_grad) : nullptr;
+
+  launch_rms_ln_bw(rptr<T>(gamma_grad), rptr<T>(inp_grad), rptr<T>(out_grad),
+                   p_residual_grad, rptr<T>(inp_or_out), rptr<T>(gamma),
+                   rptr<T>(rms_vars), inp_is_out, rptr<float>(workspace),
+                   batch_size, hidden_dim, stream);
+}
+
 template <typename T>
 void torch_launch_ln_bw_i8(
     torch::Tensor &gamma_grad, torch::Tensor &betta_grad,
@@ -330,6 +371,110 @@ void torch_launch_ls_dropout_act_bias_bwd(
       stream);
 }
 
+// The dropout kernels with the mask of seed, mask_free stores no mask in the
+// forward and redraws it in the backward.
+template <typename T>
+void torch_launch_ls_dropout(torch::Tensor &output, torch::Tensor &mask,
+                             const torch::Tensor &input, int total_count,
+                             float ratio, bool backward, int seed,
+                             bool mask_free) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_ls_dropout<T>(rptr<T>(output), rptr<T>(input),
+                       mask_free ? nullptr : rptr<uint8_t>(mask), total_count,
+                       ratio, stream, backward, seed);
+}
+
+template <typename T>
+void torch_launch_ls_dropout_res_bias(torch::Tensor &output,
+                                      torch::Tensor &mask,
+                                      const torch::Tensor &input,
+                                      const torch::Tensor &bias,
+                                      const torch::Tensor &residual,
+                                      int total_seq, int hidden_dim,
+                                      float ratio, int seed, bool mask_free) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_ls_dropout_res_bias<T>(
+      rptr<T>(output), rptr<T>(input),
+      mask_free ? nullptr : rptr<uint8_t>(mask), rptr<T>(bias),
+      rptr<T>(residual), total_seq * hidden_dim, hidden_dim, ratio, stream,
+      seed);
+}
+
+template <typename T>
+void torch_launch_ls_dropout_bias_bwd(torch::Tensor &in_grad,
+                                      torch::Tensor &bias_grad,
+                                      const torch::Tensor &out_grad,
+                                      const torch::Tensor &mask, int total_seq,
+                                      int hidden_dim, float ratio, int seed,
+                                      bool mask_free) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_ls_dropout_bias_bwd<T>(
+      rptr<T>(in_grad), rptr<T>(bias_grad), rptr<T>(out_grad),
+      mask_free ? nullptr : rptr<uint8_t>(mask), total_seq, hidden_dim, ratio,
+      stream, seed);
+}
+
+template <ActivationType actType, typename T>
+void torch_launch_ls_dropout_act_bias_seed(
+    torch::Tensor &output, torch::Tensor &mask, const torch::Tensor &input,
+    const torch::Tensor &bias, int total_seq, int hidden_dim, float ratio,
+    int seed, bool mask_free) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_ls_dropout_act_bias<actType, T>(
+      rptr<T>(output), rptr<T>(input),
+      mask_free ? nullptr : rptr<uint8_t>(mask), rptr<T>(bias),
+      total_seq * hidden_dim, hidden_dim, ratio, stream, seed);
+}
+
+template <ActivationType actType, typename T>
+void torch_launch_ls_dropout_act_bias_bwd_seed(
+    torch::Tensor &in_grad, torch::Tensor &bias_grad,
+    const torch::Tensor &mask, const torch::Tensor &input,
+    const torch::Tensor &bias, const torch::Tensor &out_grad, int total_seq,
+    int hidden_dim, float ratio, int seed, bool mask_free) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_ls_dropout_act_bias_bwd<actType, T>(
+      rptr<T>(in_grad), rptr<T>(bias_grad), rptr<T>(input), rptr<T>(bias),
+      rptr<T>(out_grad), mask_free ? nullptr : rptr<uint8_t>(mask), total_seq,
+      hidden_dim, ratio, stream, seed);
+}
+
+template <typename T>
+void torch_launch_ls_dropout_res_bias_ln(
+    torch::Tensor &ln_res, torch::Tensor &res_out, torch::Tensor &vars,
+    torch::Tensor &means, torch::Tensor &mask, const torch::Tensor &input,
+    const torch::Tensor &bias, const torch::Tensor &residual,
+    const torch::Tensor &gamma, const torch::Tensor &betta, int total_seq,
+    int hidden_dim, float ratio, int seed) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_ls_dropout_res_bias_ln<T>(
+      rptr<T>(ln_res), rptr<T>(res_out), rptr<T>(vars), rptr<T>(means),
+      rptr<uint8_t>(mask), rptr<T>(input), rptr<T>(bias), rptr<T>(residual),
+      rptr<T>(gamma), rptr<T>(betta), total_seq, hidden_dim, ratio, stream,
+      seed);
+}
+
+// redraw_mask passes no mask, so the backward redraws it from seed.
+template <typename T>
+void torch_launch_ls_dropout_res_bias_ln_bw(
+    torch::Tensor &in_grad, torch::Tensor &bias_grad,
+    torch::Tensor &residual_grad, torch::Tensor &gamma_grad,
+    torch::Tensor &betta_grad, const torch::Tensor &out_grad,
+    const torch::Tensor &res_out_grad, const torch::Tensor &res_out,
+    const torch::Tensor &gamma, const torch::Tensor &vars,
+    const torch::Tensor &means, const torch::Tensor &mask,
+    torch::Tensor &workspace, int total_seq, int hidden_dim, float ratio,
+    int seed, bool with_res_out_grad, bool residual_cover, bool redraw_mask) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_ls_dropout_res_bias_ln_bw<T>(
+      rptr<T>(in_grad), rptr<T>(bias_grad), rptr<T>(residual_grad),
+      rptr<T>(gamma_grad), rptr<T>(betta_grad), rptr<T>(out_grad),
+      with_res_out_grad ? rptr<T>(res_out_grad) : nullptr, rptr<T>(res_out),
+      rptr<T>(gamma), rptr<T>(vars), rptr<T>(means),
+      redraw_mask ? nullptr : rptr<uint8_t>(mask), residual_cover,
+      rptr<float>(workspace), total_seq, hidden_dim, ratio, stream, seed);
+}
+
 template <ActivationType actType, typename T>
 void torch_launch_ls_quant_dropout_act_bias(
     torch::Tensor &output, torch::Tensor &cmask_out, torch::Tensor &cmask_in,
@@ -405,6 +550,39 @@ void torch_launch_fake_quantize(torch::Tensor &clip_max_mask,
                           rptr<T>(input), rptr<T>(clip_max), numel, 2, stream);
 }
 
+// error is the fp32 error feedback of grad, an empty tensor disables it.
+template <typename T>
+void torch_launch_gcq_quantize(torch::Tensor &q, torch::Tensor &scales,
+                               const torch::Tensor &grad, torch::Tensor &error,
+                               int hidden_dim, int topk) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  float *error_ptr = error.numel() > 0 ? rptr<float>(error) : nullptr;
+  launch_gcq_quantize<T>(rptr<int8_t>(q), rptr<float>(scales), rptr<T>(grad),
+                         error_ptr, grad.numel(), scales.numel(), hidden_dim,
+                         topk, stream);
+}
+
+void torch_launch_gcq_reduce_quantize(torch::Tensor &q_out,
+                                      torch::Tensor &scales_out,
+                                      const torch::Tensor &q_in,
+                                      const torch::Tensor &scales_in,
+                                      int world_size, int hidden_dim,
+                                      int topk) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_gcq_reduce_quantize(rptr<int8_t>(q_out), rptr<float>(scales_out),
+                             rptr<int8_t>(q_in), rptr<float>(scales_in),
+                             world_size, scales_out.numel(), hidden_dim, topk,
+                             stream);
+}
+
+template <typename T>
+void torch_launch_gcq_dequantize(torch::Tensor &grad, const torch::Tensor &q,
+                                 const torch::Tensor &scales, int hidden_dim) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_gcq_dequantize<T>(rptr<T>(grad), rptr<int8_t>(q), rptr<float>(scales),
+                           grad.numel(), hidden_dim, stream);
+}
+
 int get_sm_version() { return getSMVersion(); }
 
 std::string get_gpu_name() { return getGPUName(); }
@@ -428,6 +606,120 @@ void torch_launch_viterbi(const torch::Tensor &start_transition,
   CHECK_GPU_ERROR(cudaGetLastError());
 }
 
+template <typename T>
+void torch_launch_viterbi_varlen(
+    const torch::Tensor &start_transition, const torch::Tensor &end_transition,
+    const torch::Tensor &transition, const torch::Tensor &emission,
+    const torch::Tensor &cu_seqlens, torch::Tensor &best_score,
+    torch::Tensor &history, torch::Tensor &best_tags, int num_tags,
+    int seq_len, int batch_size) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_viterbi_varlen(rptr<T>(start_transition), rptr<T>(end_transition),
+                        rptr<T>(transition), rptr<T>(emission),
+                        rptr<int>(cu_seqlens), rptr<float>(best_score),
+                        rptr<int>(history), rptr<int>(best_tags), num_tags,
+                        seq_len, batch_size, stream);
+  cudaStreamSynchronize(stream);
+  CHECK_GPU_ERROR(cudaGetLastError());
+}
+
+template <typename T>
+void torch_launch_crf_nll(const torch::Tensor &start_transition,
+                          const torch::Tensor &end_transition,
+                          const torch::Tensor &transition,
+                          const torch::Tensor &emission,
+                          const torch::Tensor &mask, const torch::Tensor &tags,
+                          torch::Tensor &nll, torch::Tensor &log_z,
+                          torch::Tensor &alpha, int num_tags, int seq_len,
+                          int batch_size) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_crf_nll(rptr<T>(start_transition), rptr<T>(end_transition),
+                 rptr<T>(transition), rptr<T>(emission), rptr<T>(mask),
+                 (const int *)nullptr, (const T *)nullptr, rptr<int>(tags),
+                 rptr<float>(nll), rptr<float>(log_z), rptr<float>(alpha),
+                 num_tags, seq_len, batch_size, stream);
+  cudaStreamSynchronize(stream);
+  CHECK_GPU_ERROR(cudaGetLastError());
+}
+
+template <typename T>
+void torch_launch_crf_nll_bw(
+    torch::Tensor &grad_start_transition, torch::Tensor &grad_end_transition,
+    torch::Tensor &grad_transition, torch::Tensor &grad_emission,
+    const torch::Tensor &grad_nll, const torch::Tensor &start_transition,
+    const torch::Tensor &end_transition, const torch::Tensor &transition,
+    const torch::Tensor &emission, const torch::Tensor &mask,
+    const torch::Tensor &tags, const torch::Tensor &log_z,
+    const torch::Tensor &alpha, torch::Tensor &workspace, int num_tags,
+    int seq_len, int batch_size) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_crf_nll_bw(
+      rptr<T>(grad_start_transition), rptr<T>(grad_end_transition),
+      rptr<T>(grad_transition), rptr<T>(grad_emission), (T *)nullptr,
+      rptr<float>(grad_nll), rptr<T>(start_transition),
+      rptr<T>(end_transition), rptr<T>(transition), rptr<T>(emission),
+      rptr<T>(mask), (const int *)nullptr, (const T *)nullptr,
+      rptr<int>(tags), rptr<float>(log_z), rptr<float>(alpha),
+      rptr<float>(workspace), num_tags, seq_len, batch_size, stream);
+  cudaStreamSynchronize(stream);
+  CHECK_GPU_ERROR(cudaGetLastError());
+}
+
+// workspace is the split decoding workspace of a single query, an empty
+// tensor disables it.
+template <typename T>
+void torch_launch_flash_attention(const torch::Tensor &q,
+                                  const torch::Tensor &k,
+                                  const torch::Tensor &v,
+                                  const torch::Tensor &mask, torch::Tensor &out,
+                                  torch::Tensor &workspace, int batch_size,
+                                  int nhead, int q_len, int kv_len, int kv_size,
+                                  int head_dim, bool mask_future,
+                                  int kv_head_num) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  float *workspace_ptr =
+      workspace.numel() > 0 ? rptr<float>(workspace) : nullptr;
+  launch_flash_attention<T, T>(rptr<T>(q), rptr<T>(k), rptr<T>(v),
+                               rptr<T>(mask), rptr<T>(out), batch_size, nhead,
+                               q_len, kv_len, kv_size, head_dim, mask_future,
+                               stream, workspace_ptr, kv_head_num);
+  cudaStreamSynchronize(stream);
+  CHECK_GPU_ERROR(cudaGetLastError());
+}
+
+template <typename T>
+void torch_launch_flash_attention_train(
+    const torch::Tensor &q, const torch::Tensor &k, const torch::Tensor &v,
+    const torch::Tensor &mask, torch::Tensor &out, torch::Tensor &lse,
+    int batch_size, int nhead, int q_len, int kv_len, int head_dim,
+    bool mask_future) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_flash_attention_train(rptr<T>(q), rptr<T>(k), rptr<T>(v),
+                               rptr<T>(mask), rptr<T>(out), rptr<float>(lse),
+                               batch_size, nhead, q_len, kv_len, head_dim,
+                               mask_future, 0.f, 0, stream);
+  cudaStreamSynchronize(stream);
+  CHECK_GPU_ERROR(cudaGetLastError());
+}
+
+template <typename T>
+void torch_launch_flash_attention_bw(
+    torch::Tensor &dq, torch::Tensor &dk, torch::Tensor &dv,
+    const torch::Tensor &dout, const torch::Tensor &q, const torch::Tensor &k,
+    const torch::Tensor &v, const torch::Tensor &mask,
+    const torch::Tensor &out, const torch::Tensor &lse,
+    torch::Tensor &workspace, int batch_size, int nhead, int q_len,
+    int kv_len, int head_dim, bool mask_future) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_flash_attention_bw(
+      rptr<T>(dq), rptr<T>(dk), rptr<T>(dv), rptr<T>(dout), rptr<T>(q),
+      rptr<T>(k), rptr<T>(v), rptr<T>(mask), rptr<T>(out), rptr<float>(lse),
+      rptr<float>(workspace), batch_size, nhead, q_len, kv_len, head_dim,
+      mask_future, 0.f, 0, stream);
+  cudaStreamSynchronize(stream);
+  CHECK_GPU_ERROR(cudaGetLastError());
+}
+
 class RotaryPositionWeight {
  public:
   float *_device_sin_ptr;
@@ -525,6 +817,23 @@ void torch_launch_split_rotary_position(
   CHECK_GPU_ERROR(cudaGetLastError());
 }
 
+template <typename T>
+void torch_launch_paged_attention(
+    const torch::Tensor &q, const torch::Tensor &cache_k,
+    const torch::Tensor &cache_v, const torch::Tensor &pad_mask,
+    const torch::Tensor &page_table, torch::Tensor &output, int batch_size,
+    int nhead, int head_dim, int query_len, int offset_seq_len, int page_size,
+    int max_pages, int max_step, int kv_head_num) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_paged_attention<T, T>(
+      rptr<T>(q), rptr<T>(cache_k), rptr<T>(cache_v), rptr<T>(pad_mask),
+      rptr<int>(page_table), rptr<T>(output), batch_size, nhead, head_dim,
+      query_len, offset_seq_len, page_size, max_pages, max_step, stream,
+      nullptr, nullptr, kv_head_num);
+  cudaStreamSynchronize(stream);
+  CHECK_GPU_ERROR(cudaGetLastError());
+}
+
 template <typename T>
 void torch_silu_elewise_product(const torch::Tensor &inp, torch::Tensor out,
                                 int batch_size, int seq_len, int inner_size) {
@@ -548,6 +857,67 @@ void torch_rms_layer_norm(const torch::Tensor &inp, const torch::Tensor &scale,
   CHECK_GPU_ERROR(cudaGetLastError());
 }
 
+// Sample the token after the first seq_len ones of every row of tokens,
+// [batch_size, max_step], from logits, [batch_size, vocab_size], with fresh
+// curand states.
+template <typename T>
+void torch_launch_topp_threshold_sample(
+    const torch::Tensor &logits, const torch::Tensor &logit_bias,
+    torch::Tensor &tokens, torch::Tensor &unfinished, int batch_size,
+    int seq_len, int max_step, int vocab_size, int k, float p,
+    float temperature, float repetition_penalty, float min_p, int eos_id) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  torch::Tensor states =
+      torch::empty({int64_t(batch_size * sizeof(curandState))},
+                   logits.options().dtype(torch::kUInt8));
+  // the kernel is launched without the triple chevrons of nvcc.
+  curandState *states_ptr = rptr<curandState>(states);
+  void *setup_args[] = {&states_ptr};
+  CHECK_GPU_ERROR(cudaLaunchKernel((const void *)ker_curand_setup,
+                                   dim3(batch_size), dim3(1), setup_args, 0,
+                                   stream));
+  ker_topp_threshold_sample_launcher<T>(
+      batch_size, seq_len, seq_len, max_step, 1, MAX_THREADS, stream,
+      rptr<T>(logits), rptr<T>(logit_bias), rptr<int>(tokens), vocab_size, k,
+      p, temperature, repetition_penalty, min_p, nullptr, rptr<int>(unfinished),
+      states_ptr, eos_id);
+  cudaStreamSynchronize(stream);
+  CHECK_GPU_ERROR(cudaGetLastError());
+}
+
+template <typename T>
+void torch_launch_speculative_verify(const torch::Tensor &target_logits,
+                                     const torch::Tensor &draft_logits,
+                                     torch::Tensor &tokens,
+                                     torch::Tensor &num_tokens, int num_draft,
+                                     int vocab_size, bool greedy, int64_t seed,
+                                     int64_t counter) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_speculative_verify<T>(rptr<T>(target_logits), rptr<T>(draft_logits),
+                               rptr<int>(tokens), rptr<int>(num_tokens),
+                               num_draft, vocab_size, greedy, seed, counter,
+                               stream);
+  cudaStreamSynchronize(stream);
+  CHECK_GPU_ERROR(cudaGetLastError());
+}
+
+template <typename T>
+void torch_launch_moe_route_dispatch(
+    const torch::Tensor &gate_logits, const torch::Tensor &input,
+    torch::Tensor &score, torch::Tensor &expert, torch::Tensor &slot,
+    torch::Tensor &expert_rows, torch::Tensor &workspace,
+    torch::Tensor &output, int batch_tokens, int max_batch_tokens,
+    int expert_num, int capacity, int topk, int hidden_dim) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  launch_moe_route_dispatch<T>(
+      rptr<T>(gate_logits), rptr<T>(input), rptr<float>(score),
+      rptr<int>(expert), rptr<int>(slot), rptr<int>(expert_rows),
+      rptr<int>(workspace), rptr<T>(output), batch_tokens, max_batch_tokens,
+      expert_num, capacity, topk, hidden_dim, stream);
+  cudaStreamSynchronize(stream);
+  CHECK_GPU_ERROR(cudaGetLastError());
+}
+
 }  // namespace cuda
 }  // namespace lightseq
 
@@ -634,6 +1004,17 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         "Test kernel wrapper");
   m.def("torch_launch_ln_bw_fp16", &lightseq::cuda::torch_launch_ln_bw<__half>,
         "Test kernel wrapper");
+  m.def("torch_launch_ln_bw_fused_fp32",
+        &lightseq::cuda::torch_launch_ln_bw_fused<float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ln_bw_fused_fp16",
+        &lightseq::cuda::torch_launch_ln_bw_fused<__half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_rms_ln_bw_fp32",
+        &lightseq::cuda::torch_launch_rms_ln_bw<float>, "Test kernel wrapper");
+  m.def("torch_launch_rms_ln_bw_fp16",
+        &lightseq::cuda::torch_launch_rms_ln_bw<__half>,
+        "Test kernel wrapper");
   m.def("torch_launch_ln_bw_i8_fp32",
         &lightseq::cuda::torch_launch_ln_bw_i8<float>, "Test kernel wrapper");
   m.def("torch_launch_ln_bw_i8_fp16",
@@ -678,6 +1059,68 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         &lightseq::cuda::torch_launch_ls_dropout_act_bias_bwd<
             lightseq::ActivationType::kGelu, __half>,
         "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_fp32",
+        &lightseq::cuda::torch_launch_ls_dropout<float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_fp16",
+        &lightseq::cuda::torch_launch_ls_dropout<__half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_res_bias_fp32",
+        &lightseq::cuda::torch_launch_ls_dropout_res_bias<float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_res_bias_fp16",
+        &lightseq::cuda::torch_launch_ls_dropout_res_bias<__half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_bias_bwd_fp32",
+        &lightseq::cuda::torch_launch_ls_dropout_bias_bwd<float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_bias_bwd_fp16",
+        &lightseq::cuda::torch_launch_ls_dropout_bias_bwd<__half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_relu_bias_seed_fp32",
+        &lightseq::cuda::torch_launch_ls_dropout_act_bias_seed<
+            lightseq::ActivationType::kRelu, float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_relu_bias_seed_fp16",
+        &lightseq::cuda::torch_launch_ls_dropout_act_bias_seed<
+            lightseq::ActivationType::kRelu, __half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_relu_bias_bwd_seed_fp32",
+        &lightseq::cuda::torch_launch_ls_dropout_act_bias_bwd_seed<
+            lightseq::ActivationType::kRelu, float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_relu_bias_bwd_seed_fp16",
+        &lightseq::cuda::torch_launch_ls_dropout_act_bias_bwd_seed<
+            lightseq::ActivationType::kRelu, __half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_gelu_bias_seed_fp32",
+        &lightseq::cuda::torch_launch_ls_dropout_act_bias_seed<
+            lightseq::ActivationType::kGelu, float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_gelu_bias_seed_fp16",
+        &lightseq::cuda::torch_launch_ls_dropout_act_bias_seed<
+            lightseq::ActivationType::kGelu, __half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_gelu_bias_bwd_seed_fp32",
+        &lightseq::cuda::torch_launch_ls_dropout_act_bias_bwd_seed<
+            lightseq::ActivationType::kGelu, float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_gelu_bias_bwd_seed_fp16",
+        &lightseq::cuda::torch_launch_ls_dropout_act_bias_bwd_seed<
+            lightseq::ActivationType::kGelu, __half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_res_bias_ln_fp32",
+        &lightseq::cuda::torch_launch_ls_dropout_res_bias_ln<float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_res_bias_ln_fp16",
+        &lightseq::cuda::torch_launch_ls_dropout_res_bias_ln<__half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_res_bias_ln_bw_fp32",
+        &lightseq::cuda::torch_launch_ls_dropout_res_bias_ln_bw<float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_ls_dropout_res_bias_ln_bw_fp16",
+        &lightseq::cuda::torch_launch_ls_dropout_res_bias_ln_bw<__half>,
+        "Test kernel wrapper");
   m.def("torch_launch_ls_quant_dropout_relu_bias_fp32",
         &lightseq::cuda::torch_launch_ls_quant_dropout_act_bias<
             lightseq::ActivationType::kRelu, float>,
@@ -746,6 +1189,21 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def("torch_launch_fake_quantize_fp16",
         &lightseq::cuda::torch_launch_fake_quantize<__half>,
         "Test kernel wrapper");
+  m.def("torch_launch_gcq_quantize_fp32",
+        &lightseq::cuda::torch_launch_gcq_quantize<float>,
+        "GCQ quantize with error feedback");
+  m.def("torch_launch_gcq_quantize_fp16",
+        &lightseq::cuda::torch_launch_gcq_quantize<__half>,
+        "GCQ quantize with error feedback");
+  m.def("torch_launch_gcq_reduce_quantize",
+        &lightseq::cuda::torch_launch_gcq_reduce_quantize,
+        "GCQ int8 shard reduce and requantize");
+  m.def("torch_launch_gcq_dequantize_fp32",
+        &lightseq::cuda::torch_launch_gcq_dequantize<float>,
+        "GCQ dequantize");
+  m.def("torch_launch_gcq_dequantize_fp16",
+        &lightseq::cuda::torch_launch_gcq_dequantize<__half>,
+        "GCQ dequantize");
   m.def("get_sm_version", &lightseq::cuda::get_sm_version,
         "Test kernel wrapper");
   m.def("get_gpu_name", &lightseq::cuda::get_gpu_name, "Test kernel wrapper");
@@ -754,6 +1212,40 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         &lightseq::cuda::torch_launch_viterbi<__half>, "Test kernel wrapper");
   m.def("torch_launch_viterbi_fp32",
         &lightseq::cuda::torch_launch_viterbi<float>, "Test kernel wrapper");
+  m.def("torch_launch_viterbi_varlen_fp16",
+        &lightseq::cuda::torch_launch_viterbi_varlen<__half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_viterbi_varlen_fp32",
+        &lightseq::cuda::torch_launch_viterbi_varlen<float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_crf_nll_fp16",
+        &lightseq::cuda::torch_launch_crf_nll<__half>, "Test kernel wrapper");
+  m.def("torch_launch_crf_nll_fp32",
+        &lightseq::cuda::torch_launch_crf_nll<float>, "Test kernel wrapper");
+  m.def("torch_launch_crf_nll_bw_fp16",
+        &lightseq::cuda::torch_launch_crf_nll_bw<__half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_crf_nll_bw_fp32",
+        &lightseq::cuda::torch_launch_crf_nll_bw<float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_flash_attention_fp16",
+        &lightseq::cuda::torch_launch_flash_attention<__half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_flash_attention_fp32",
+        &lightseq::cuda::torch_launch_flash_attention<float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_flash_attention_train_fp16",
+        &lightseq::cuda::torch_launch_flash_attention_train<__half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_flash_attention_train_fp32",
+        &lightseq::cuda::torch_launch_flash_attention_train<float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_flash_attention_bw_fp16",
+        &lightseq::cuda::torch_launch_flash_attention_bw<__half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_flash_attention_bw_fp32",
+        &lightseq::cuda::torch_launch_flash_attention_bw<float>,
+        "Test kernel wrapper");
 
   m.def("torch_launch_split_rotary_position_fp32",
         &lightseq::cuda::torch_launch_split_rotary_position<float>,
@@ -761,6 +1253,12 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def("torch_launch_split_rotary_position_fp16",
         &lightseq::cuda::torch_launch_split_rotary_position<half>,
         "Test llama rotary position kernel");
+  m.def("torch_launch_paged_attention_fp32",
+        &lightseq::cuda::torch_launch_paged_attention<float>,
+        "Test llama paged attention kernel");
+  m.def("torch_launch_paged_attention_fp16",
+        &lightseq::cuda::torch_launch_paged_attention<__half>,
+        "Test llama paged attention kernel");
   m.def("torch_silu_elewise_product_fp32",
         &lightseq::cuda::torch_silu_elewise_product<float>,
         "Test llama rotary position kernel");
@@ -774,4 +1272,22 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def("torch_rms_layer_norm_fp16",
         &lightseq::cuda::torch_rms_layer_norm<__half>,
         "Test llama rms layer norm kernel");
+  m.def("torch_launch_topp_threshold_sample_fp32",
+        &lightseq::cuda::torch_launch_topp_threshold_sample<float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_topp_threshold_sample_fp16",
+        &lightseq::cuda::torch_launch_topp_threshold_sample<__half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_speculative_verify_fp32",
+        &lightseq::cuda::torch_launch_speculative_verify<float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_speculative_verify_fp16",
+        &lightseq::cuda::torch_launch_speculative_verify<__half>,
+        "Test kernel wrapper");
+  m.def("torch_launch_moe_route_dispatch_fp32",
+        &lightseq::cuda::torch_launch_moe_route_dispatch<float>,
+        "Test kernel wrapper");
+  m.def("torch_launch_moe_route_dispatch_fp16",
+        &lightseq::cuda::torch_launch_moe_route_dispatch<__half>,
+        "Test kernel wrapper");
 }
@@ -2,6 +2,7 @@
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <stdexcept>
+#include <string>
 
 namespace py = pybind11;
 
@@ -82,6 +83,129 @@ void test_gemm_u8s8s32(
   return;
 }
 
+namespace {
+
+using FloatArray =
+    py::array_t<float, py::array::c_style | py::array::forcecast>;
+
+void check_size(const py::array& arr, size_t size, const char* name) {
+  if (size_t(arr.size()) != size) {
+    std::printf("Error! %s should have %zu elements but found %zu\n", name,
+                size, size_t(arr.size()));
+    throw std::runtime_error("wrong size");
+  }
+}
+
+}  // namespace
+
+// row major, c[i] = op(a[i]) * op(b[i]), a: [batch, m, k] or [batch, k, m]
+// with trans_a, b: [batch, k, n] or [batch, n, k] with trans_b, c: [batch, m,
+// n]. As the column major C^T = op(B)^T * op(A)^T of strided_batch_gemm.
+void test_strided_batch_gemm(const FloatArray& inpA, const FloatArray& inpB,
+                             FloatArray& outC, bool trans_a, bool trans_b) {
+  auto a = inpA.unchecked<3>();
+  auto b = inpB.unchecked<3>();
+  auto c = outC.mutable_unchecked<3>();
+  int batch = a.shape(0);
+  int m = a.shape(trans_a ? 2 : 1);
+  int k = a.shape(trans_a ? 1 : 2);
+  int n = b.shape(trans_b ? 1 : 2);
+  if (b.shape(0) != batch || b.shape(trans_b ? 2 : 1) != k) {
+    std::printf("Error! inpB.shape() should be (%d, %d, %d)\n", batch,
+                trans_b ? n : k, trans_b ? k : n);
+    throw std::runtime_error("wrong shape of b");
+  }
+  check_size(outC, size_t(batch) * m * n, "outC");
+
+  strided_batch_gemm(trans_b, trans_a, n, m, k, 1.f, 0.f, b.data(0, 0, 0),
+                     a.data(0, 0, 0), c.mutable_data(0, 0, 0), n * k, m * k,
+                     m * n, batch);
+}
+
+// inp, out: [rows, hidden_dim], scale, bias: [hidden_dim], vars, means: [rows]
+void test_layer_norm(const FloatArray& inp, const FloatArray& scale,
+                     const FloatArray& bias, FloatArray& out, FloatArray& vars,
+                     FloatArray& means) {
+  auto inp_ = inp.unchecked<2>();
+  int rows = inp_.shape(0);
+  int hidden_dim = inp_.shape(1);
+  check_size(scale, hidden_dim, "scale");
+  check_size(bias, hidden_dim, "bias");
+  check_size(out, size_t(rows) * hidden_dim, "out");
+  check_size(vars, rows, "vars");
+  check_size(means, rows, "means");
+
+  launch_layer_norm(out.mutable_data(), vars.mutable_data(),
+                    means.mutable_data(), inp_.data(0, 0), scale.data(),
+                    bias.data(), rows, hidden_dim);
+}
+
+// inp, out: [batch_size, nhead, from_len, to_len], attn_mask: [batch_size,
+// to_len] or empty.
+void test_attn_softmax(const FloatArray& inp, const FloatArray& attn_mask,
+                       FloatArray& out, bool mask_future) {
+  auto inp_ = inp.unchecked<4>();
+  int batch_size = inp_.shape(0);
+  int nhead = inp_.shape(1);
+  int from_len = inp_.shape(2);
+  int to_len = inp_.shape(3);
+  check_size(out, inp_.size(), "out");
+  const float* mask_ptr = nullptr;
+  if (attn_mask.size() > 0) {
+    check_size(attn_mask, size_t(batch_size) * to_len, "attn_mask");
+    mask_ptr = attn_mask.data();
+  }
+
+  launch_attn_softmax(out.mutable_data(), inp_.data(0, 0, 0, 0), mask_ptr,
+                      batch_size, nhead, from_len, to_len, to_len,
+                      mask_future);
+}
+
+// out = act(inp + bias), inp, out: [rows, dim], bias: [dim]
+void test_bias_act(const FloatArray& inp, const FloatArray& bias,
+                   FloatArray& out, const std::string& activation_fn) {
+  auto inp_ = inp.unchecked<2>();
+  int dim = inp_.shape(1);
+  int total_count = inp_.size();
+  check_size(bias, dim, "bias");
+  check_size(out, total_count, "out");
+
+  if (activation_fn == "relu") {
+    launch_bias_act<ActivationType::kRelu>(out.mutable_data(), inp_.data(0, 0),
+                                           bias.data(), total_count, dim);
+  } else if (activation_fn == "gelu") {
+    launch_bias_act<ActivationType::kGelu>(out.mutable_data(), inp_.data(0, 0),
+                                           bias.data(), total_count, dim);
+  } else {
+    throw std::runtime_error("not supported activation: " + activation_fn);
+  }
+}
+
+// q = round(inp / scales) + 128, inp, q: [rows, cols], scales: [rows]
+void test_quantize_shift_rows(
+    const FloatArray& inp,
+    py::array_t<uint8_t, py::array::c_style | py::array::forcecast>& q,
+    FloatArray& scales) {
+  auto inp_ = inp.unchecked<2>();
+  int rows = inp_.shape(0);
+  int cols = inp_.shape(1);
+  check_size(q, size_t(rows) * cols, "q");
+  check_size(scales, rows, "scales");
+
+  launch_quantize_shift_rows(q.mutable_data(), scales.mutable_data(),
+                             inp_.data(0, 0), rows, cols);
+}
+
+// [sz0, sz1, sz2, sz3] -> [sz0, sz2, sz1, sz3]
+void test_transform_0213(const FloatArray& inp, FloatArray& out) {
+  auto inp_ = inp.unchecked<4>();
+  check_size(out, inp_.size(), "out");
+
+  launch_transform_0213(inp_.data(0, 0, 0, 0), out.mutable_data(),
+                        inp_.shape(0), inp_.shape(1), inp_.shape(2),
+                        inp_.shape(3));
+}
+
 }  // namespace x86
 }  // namespace lightseq
 
@@ -90,4 +214,18 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         "LightSeq test gemm with fp32 (x86 CPU)");
   m.def("test_gemm_u8s8s32", &lightseq::x86::test_gemm_u8s8s32,
         "LightSeq test gemm with int8 (x86 CPU)");
+  m.def("test_strided_batch_gemm", &lightseq::x86::test_strided_batch_gemm,
+        "LightSeq test strided batch gemm with fp32 (x86 CPU)");
+  m.def("test_layer_norm", &lightseq::x86::test_layer_norm,
+        "LightSeq test layer norm with fp32 (x86 CPU)");
+  m.def("test_attn_softmax", &lightseq::x86::test_attn_softmax,
+        "LightSeq test attention softmax with fp32 (x86 CPU)");
+  m.def("test_bias_act", &lightseq::x86::test_bias_act,
+        "LightSeq test bias and activation with fp32 (x86 CPU)");
+  m.def("test_quantize_shift_rows", &lightseq::x86::test_quantize_shift_rows,
+        "LightSeq test row quantization to uint8 (x86 CPU)");
+  m.def("test_transform_0213", &lightseq::x86::test_transform_0213,
+        "LightSeq test transform 0213 with fp32 (x86 CPU)");
+  m.def("set_gemm_num_threads", &lightseq::x86::set_gemm_num_threads,
+        "LightSeq set the threads of the mkl gemm (x86 CPU)");
 }
@@ -48,12 +48,23 @@ int create_transformer_encoder_layer(
   return 0;
 }
 
+// cu_seqlens of a packed batch, int32 [num_seqs + 1], see
+// launch_packed_seq_ids. An empty tensor is a padded batch.
+const int *packed_cu_seqlens(const torch::Tensor &cu_seqlens) {
+  if (cu_seqlens.numel() == 0) return nullptr;
+  CHECK_INPUT(cu_seqlens);
+  AT_ASSERTM(cu_seqlens.dtype() == torch::kInt32, "cu_seqlens must be int32");
+  return (const int *)cu_seqlens.data_ptr();
+}
+
 template <typename T>
 std::vector<torch::Tensor> transformer_encoder_layer_fw(
     int layer_id, const torch::Tensor &input, const torch::Tensor &input_mask,
-    bool training_mode, bool prelayernorm, bool quant_mode) {
+    bool training_mode, bool prelayernorm, bool quant_mode,
+    const torch::Tensor &cu_seqlens) {
   CHECK_INPUT(input);
   CHECK_INPUT(input_mask);
+  const int *cu_seqlens_ptr = packed_cu_seqlens(cu_seqlens);
 
   const T *input_ptr = (const T *)input.data_ptr();
   const T *input_mask_ptr = (const T *)input_mask.data_ptr();
@@ -65,6 +76,7 @@ std::vector<torch::Tensor> transformer_encoder_layer_fw(
       std::static_pointer_cast<TransformerEncoderLayer<T>>(
           s_transformer_encoder_layers[layer_id]);
   layer->set_cur_batch_shape(input.size(0), input.size(1));
+  layer->set_packed_seqs(cu_seqlens_ptr, cu_seqlens.numel() - 1);
   layer->SetTrainingMode(training_mode);
   layer->SetQuantMode(quant_mode);
   layer->Forward(input_ptr, input_mask_ptr, out_ptr);
@@ -76,7 +88,7 @@ template <typename T>
 std::vector<torch::Tensor> transformer_encoder_layer_bw(
     int layer_id, const torch::Tensor &grad_dec_output,
     const torch::Tensor &output, const torch::Tensor &input,
-    const torch::Tensor &input_mask) {
+    const torch::Tensor &input_mask, bool accumulate_grads) {
   auto g_output = grad_dec_output.contiguous();
   CHECK_INPUT(g_output);
   CHECK_INPUT(output);
@@ -98,6 +110,7 @@ std::vector<torch::Tensor> transformer_encoder_layer_bw(
       std::static_pointer_cast<TransformerEncoderLayer<T>>(
           s_transformer_encoder_layers[layer_id]);
   layer->set_cur_batch_shape(g_output.size(0), g_output.size(1));
+  layer->set_accumulate_grads(accumulate_grads);
   layer->Backward(grad_dec_output_ptr, input_ptr, output_ptr, input_mask_ptr,
                   grad_input_ptr);
 
@@ -236,7 +249,9 @@ int create_transformer_embedding_layer(int layer_id,
                                        bool trainable_pos = false) {
   cudaStream_t stream = at::cuda::getCurrentCUDAStream();
   Context::Instance().set_stream(stream);
-  const T *pos_embeddings_ptr = (const T *)pos_embeddings.data_ptr();
+  // an empty pos_embeddings computes the sinusoidal positions in the kernel.
+  const T *pos_embeddings_ptr =
+      pos_embeddings.numel() ? (const T *)pos_embeddings.data_ptr() : nullptr;
 
   auto layer = std::make_shared<TransformerEmbeddingLayer<T>>(
       layer_id, pos_embeddings_ptr, max_batch_tokens, embedding_dim, vocab_size,
@@ -255,9 +270,10 @@ int create_transformer_embedding_layer(int layer_id,
 template <typename T>
 std::vector<torch::Tensor> transformer_embedding_layer_fw(
     int layer_id, const torch::Tensor &input, int step, bool training_mode,
-    bool quant_mode) {
+    bool quant_mode, const torch::Tensor &cu_seqlens) {
   CHECK_INPUT(input);
   const int *input_ptr = (const int *)input.data_ptr();
+  const int *cu_seqlens_ptr = packed_cu_seqlens(cu_seqlens);
 
   std::shared_ptr<TransformerEmbeddingLayer<T>> layer =
       std::static_pointer_cast<TransformerEmbeddingLayer<T>>(
@@ -276,6 +292,7 @@ std::vector<torch::Tensor> transformer_embedding_layer_fw(
   T *out_ptr = (T *)output.data_ptr();
 
   layer->set_cur_batch_shape(input.size(0), input.size(1));
+  layer->set_packed_seqs(cu_seqlens_ptr, cu_seqlens.numel() - 1);
   layer->SetTrainingMode(training_mode);
   layer->SetQuantMode(quant_mode);
   layer->Forward(input_ptr, out_ptr, step);
@@ -303,6 +320,38 @@ void transformer_embedding_layer_bw(int layer_id,
   return;
 }
 
+// {rows, num_rows, grad_rows}: the grads of the embeddings of the sorted
+// unique tokens of the batch, of which the first num_rows are valid, see
+// TransformerEmbeddingLayer::BackwardSparse.
+template <typename T>
+std::vector<torch::Tensor> transformer_embedding_layer_sparse_bw(
+    int layer_id, const torch::Tensor &grad_output,
+    const torch::Tensor &input) {
+  auto g_output = grad_output.contiguous();
+  CHECK_INPUT(g_output);
+  CHECK_INPUT(input);
+
+  std::shared_ptr<TransformerEmbeddingLayer<T>> layer =
+      std::static_pointer_cast<TransformerEmbeddingLayer<T>>(
+          s_transformer_embedding_layers[layer_id]);
+
+  int batch_tokens = g_output.size(0) * g_output.size(1);
+  auto int_options = torch::TensorOptions()
+                         .dtype(torch::kInt32)
+                         .device(g_output.device());
+  auto rows = torch::empty({batch_tokens}, int_options);
+  auto num_rows = torch::empty({1}, int_options);
+  auto grad_rows =
+      torch::empty({batch_tokens, layer->EmbeddingDim()}, g_output.options());
+
+  layer->set_cur_batch_shape(g_output.size(0), g_output.size(1));
+  layer->BackwardSparse((const T *)g_output.data_ptr(),
+                        (const int *)input.data_ptr(),
+                        (T *)grad_rows.data_ptr(), (int *)rows.data_ptr(),
+                        (int *)num_rows.data_ptr());
+  return {rows, num_rows, grad_rows};
+}
+
 template <typename T>
 void assign_layer_weight_grad(const torch::Tensor &weights,
                               torch::Tensor &grads, std::string layer_name,
@@ -526,6 +575,12 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def("transformer_embedding_layer_bw_fp16",
         &lightseq::cuda::transformer_embedding_layer_bw<__half>,
         "LightSeq Transformer Embedding backward with fp16 (CUDA)");
+  m.def("transformer_embedding_layer_sparse_bw_fp32",
+        &lightseq::cuda::transformer_embedding_layer_sparse_bw<float>,
+        "LightSeq Transformer Embedding sparse backward with fp32 (CUDA)");
+  m.def("transformer_embedding_layer_sparse_bw_fp16",
+        &lightseq::cuda::transformer_embedding_layer_sparse_bw<__half>,
+        "LightSeq Transformer Embedding sparse backward with fp16 (CUDA)");
   m.def("create_transformer_embedding_layer_fp32",
         &lightseq::cuda::create_transformer_embedding_layer<float>,
         "Create LightSeq Transformer Embedding Layer with fp32 (CUDA)");
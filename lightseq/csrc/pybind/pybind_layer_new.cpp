@@ -1,4 +1,5 @@
 #include <ATen/cuda/CUDAContext.h>
+#include <pybind11/functional.h>
 #include <torch/extension.h>
 #include <string>
 
@@ -6,6 +7,7 @@
 #include "cuda_util.h"
 #include "transformer_encoder_layer.h"
 #include "transformer_decoder_layer.h"
+#include "llama_layer.h"
 #include "sdpa_layer.h"
 
 // x is torch::Tensor
@@ -46,6 +48,31 @@ void set_global_context(int context_id) {
   Context::set_global_context(context_id);
 }
 
+// For the layers created afterwards, see Context::set_mask_free_dropout().
+void set_mask_free_dropout(bool mask_free) {
+  Context::global_instance()->set_mask_free_dropout(mask_free);
+}
+
+// For the layers created afterwards, see Context::set_capturable().
+void set_capturable(bool capturable) {
+  Context::global_instance()->set_capturable(capturable);
+}
+
+// The layers run on the current torch stream, which torch.cuda.graph
+// switches to its capture stream.
+void follow_torch_stream() {
+#ifdef LIGHTSEQ_cuda
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  std::shared_ptr<Context> context = Context::global_instance();
+  if (context->get_stream() != stream) context->switch_compute_stream(stream);
+#endif
+}
+
+// For the layers created afterwards, see Context::set_fp8_training().
+void set_fp8_training(bool enable, int amax_history_len) {
+  Context::global_instance()->set_fp8_training(enable, amax_history_len);
+}
+
 template <typename T1, typename T2>
 int create_transformer_encoder_layer_new(
     int layer_id, int max_batch_tokens, int max_seq_len, int hidden_dim,
@@ -104,6 +131,7 @@ std::vector<torch::Tensor> transformer_encoder_layer_fw(
 
   layer->before_forward(input.size(0), input.size(1));
 
+  follow_torch_stream();
   layer->forward();
 
   return {output};
@@ -143,6 +171,111 @@ std::vector<torch::Tensor> transformer_encoder_layer_bw(
   out_node->set_value(output_ptr);
   out_node->set_grad(grad_output_ptr);
 
+  follow_torch_stream();
+  layer->backward();
+
+  return {grad_inp};
+}
+
+/* Llama layer, dense weights of [out, in] */
+template <typename T1, typename T2>
+int create_llama_layer_new(int layer_id, int max_batch_size, int max_seq_len,
+                           int hidden_dim, int inner_dim, int num_heads) {
+  auto layer = std::make_shared<LlamaLayer<T1, T2>>(
+      max_batch_size, max_seq_len, hidden_dim, inner_dim, num_heads, 1);
+
+  Variable *inp(new Variable("input", g_dtype<T1>(), g_dtype<T2>()));
+  Variable *pad_mask(new Variable("pad_mask", g_dtype<T1>()));
+
+  // no kv caches in training.
+  (*layer)(inp, nullptr, nullptr, pad_mask);
+
+  Context::regist_pybind_layer("LlamaLayer", layer_id, layer);
+
+  std::string T1_dtype = (std::is_same<T1, __half>::value) ? "half" : "float";
+  std::string T2_dtype = (std::is_same<T2, __half>::value) ? "half" : "float";
+
+  std::cout << "Llama layer #" << layer_id << " is created with date type ["
+            << T1_dtype << ", " << T2_dtype << "]." << std::endl;
+
+  return 0;
+}
+
+template <typename T1, typename T2>
+std::vector<torch::Tensor> llama_layer_fw(int layer_id,
+                                          const torch::Tensor &input,
+                                          const torch::Tensor &pad_mask) {
+  CHECK_INPUT(input);
+  CHECK_INPUT(pad_mask);
+
+  auto output = torch::empty_like(input);
+
+  const char *input_ptr = (const char *)input.data_ptr();
+  const char *pad_mask_ptr = (const char *)pad_mask.data_ptr();
+
+  char *out_ptr = (char *)output.data_ptr();
+
+  std::shared_ptr<LlamaLayer<T1, T2>> layer =
+      std::static_pointer_cast<LlamaLayer<T1, T2>>(
+          Context::get_pybind_layer("LlamaLayer", layer_id));
+
+  Variable *inp_node = layer->input(0);
+  inp_node->set_value(input_ptr);
+  inp_node->set_shape(
+      {size_t(input.size(0)), size_t(input.size(1)), size_t(input.size(2))});
+  Variable *pad_mask_node = layer->input(3);
+  pad_mask_node->set_value(pad_mask_ptr);
+  pad_mask_node->set_shape(
+      {size_t(pad_mask.size(0)), size_t(pad_mask.size(1))});
+
+  Variable *out_node = layer->output(0);
+  out_node->set_value(out_ptr);
+
+  layer->before_forward(input.size(0), input.size(1), 0);
+
+  follow_torch_stream();
+  layer->forward();
+
+  return {output};
+}
+
+template <typename T1, typename T2>
+std::vector<torch::Tensor> llama_layer_bw(int layer_id,
+                                          const torch::Tensor &grad_out,
+                                          const torch::Tensor &output,
+                                          const torch::Tensor &input,
+                                          const torch::Tensor &pad_mask) {
+  CHECK_INPUT(grad_out);
+  CHECK_INPUT(output);
+  CHECK_INPUT(input);
+  CHECK_INPUT(pad_mask);
+
+  auto grad_inp = torch::empty_like(grad_out);
+
+  // inputs.
+  char *grad_output_ptr = (char *)grad_out.data_ptr();
+  const char *input_ptr = (const char *)input.data_ptr();
+  const char *output_ptr = (const char *)output.data_ptr();
+  const char *pad_mask_ptr = (const char *)pad_mask.data_ptr();
+
+  // outputs.
+  char *grad_input_ptr = (char *)grad_inp.data_ptr();
+
+  std::shared_ptr<LlamaLayer<T1, T2>> layer =
+      std::static_pointer_cast<LlamaLayer<T1, T2>>(
+          Context::get_pybind_layer("LlamaLayer", layer_id));
+
+  Variable *inp_node = layer->input(0);
+  inp_node->set_value(input_ptr);
+  inp_node->set_grad(grad_input_ptr);
+  Variable *pad_mask_node = layer->input(3);
+  pad_mask_node->set_value(pad_mask_ptr);
+
+  Variable *out_node = layer->output(0);
+  out_node->set_value(output_ptr);
+  out_node->set_grad(grad_output_ptr);
+
+  follow_torch_stream();
   layer->backward();
 
   return {grad_inp};
@@ -232,6 +365,7 @@ std::vector<torch::Tensor> transformer_decoder_layer_fw(
   size_t hidden_size = dec_input.size(2);
 
   std::shared_ptr<Context> _context_ptr = layer->get_context();
+  follow_torch_stream();
 
   if (layer_id == 0) {
     std::shared_ptr<EncDecKvLayer<T1, T2>> enc_kv_layer =
@@ -308,6 +442,11 @@ void assign_layer_weight_grad(const torch::Tensor &weights,
               Context::get_pybind_layer("EncDecKvLayer", 0));
       enc_kv_layer->load_para_and_grad(wptr + offset, gptr + offset);
     }
+  } else if (layer_name == "LlamaLayer") {
+    std::shared_ptr<LlamaLayer<T1, T2>> layer =
+        std::static_pointer_cast<LlamaLayer<T1, T2>>(
+            Context::get_pybind_layer("LlamaLayer", layer_id));
+    layer->load_para_and_grad(wptr, gptr);
   } else {
     printf("Error! layer_name %s is unsupported!\n", layer_name.c_str());
     exit(-1);
@@ -317,6 +456,42 @@ void assign_layer_weight_grad(const torch::Tensor &weights,
   return;
 }
 
+template <typename T1, typename T2>
+std::shared_ptr<Layer> get_pybind_root_layer(std::string layer_name,
+                                             int layer_id) {
+  std::shared_ptr<Layer> layer;
+  if (layer_name == "TransformerEncoderLayer") {
+    layer = std::static_pointer_cast<TransformerEncoderLayer<T1, T2>>(
+        Context::get_pybind_layer("TransformerEncoderLayer", layer_id));
+  } else if (layer_name == "TransformerDecoderLayer") {
+    layer = std::static_pointer_cast<TransformerDecoderLayer<T1, T2>>(
+        Context::get_pybind_layer("TransformerDecoderLayer", layer_id));
+  } else if (layer_name == "LlamaLayer") {
+    layer = std::static_pointer_cast<LlamaLayer<T1, T2>>(
+        Context::get_pybind_layer("LlamaLayer", layer_id));
+  } else {
+    printf("Error! layer_name %s is unsupported!\n", layer_name.c_str());
+    exit(-1);
+  }
+  return layer;
+}
+
+template <typename T1, typename T2>
+void set_layer_recompute(std::string layer_name, int layer_id,
+                         bool recompute) {
+  get_pybind_root_layer<T1, T2>(layer_name, layer_id)
+      ->set_recompute(recompute);
+}
+
+// hook is called with the GIL held, from the backward of the layer, see
+// Layer::set_grad_ready_hook.
+template <typename T1, typename T2>
+void set_layer_grad_ready_hook(std::string layer_name, int layer_id,
+                               std::function<void()> hook) {
+  get_pybind_root_layer<T1, T2>(layer_name, layer_id)
+      ->set_grad_ready_hook(hook);
+}
+
 template <typename T1, typename T2>
 int create_sdpa_layer(int layer_id, int max_batch_tokens, int max_seq_len,
                       int head_dim, int num_heads,
@@ -378,6 +553,7 @@ std::vector<torch::Tensor> sdpa_layer_fw(
 
   layer->before_forward(batch_size, query_len, kv_len, kv_size, mask_future);
 
+  follow_torch_stream();
   layer->forward();
 
   return {result};
@@ -435,6 +611,13 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         "Create Lightseq Context");
   m.def("set_global_context", &lightseq::set_global_context,
         "Set Lightseq Context");
+  m.def("set_mask_free_dropout", &lightseq::set_mask_free_dropout,
+        "Redraw the dropout masks in backward instead of storing them");
+  m.def("set_fp8_training", &lightseq::set_fp8_training,
+        "Run the linears of training in fp8 with delayed scaling");
+  m.def("set_capturable", &lightseq::set_capturable,
+        "Draw the dropout masks of a fixed seed from a device counter, for "
+        "the cuda graph capture of training");
 
   m.def("create_transformer_encoder_layer_new_fp32",
         &lightseq::create_transformer_encoder_layer_new<float, float>,
@@ -456,10 +639,28 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         &lightseq::transformer_decoder_layer_fw<float, float>,
         "LightSeq Transformer Decoder forward with fp32");
 
+  m.def("create_llama_layer_new_fp32",
+        &lightseq::create_llama_layer_new<float, float>,
+        "Create LightSeq Llama Layer with fp32");
+
+  m.def("llama_layer_fw_fp32", &lightseq::llama_layer_fw<float, float>,
+        "LightSeq Llama Layer forward with fp32");
+
+  m.def("llama_layer_bw_fp32", &lightseq::llama_layer_bw<float, float>,
+        "LightSeq Llama Layer backward with fp32");
+
   m.def("assign_layer_weight_grad_fp32",
         &lightseq::assign_layer_weight_grad<float, float>,
         "Bind layer weights and grads");
 
+  m.def("set_layer_recompute_fp32",
+        &lightseq::set_layer_recompute<float, float>,
+        "Recompute the layer forward in backward");
+
+  m.def("set_layer_grad_ready_hook_fp32",
+        &lightseq::set_layer_grad_ready_hook<float, float>,
+        "Call a hook when the grads of the layer are issued in backward");
+
   m.def("torch_sdpa_layer_fp32", &lightseq::torch_sdpa_layer<float, float>,
         "Empty");
 
@@ -490,10 +691,28 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         &lightseq::transformer_decoder_layer_fw<__half, __half>,
         "LightSeq Transformer Decoder forward with fp16 (CUDA)");
 
+  m.def("create_llama_layer_new_fp16",
+        &lightseq::create_llama_layer_new<__half, __half>,
+        "Create LightSeq Llama Layer with fp16 (CUDA)");
+
+  m.def("llama_layer_fw_fp16", &lightseq::llama_layer_fw<__half, __half>,
+        "LightSeq Llama Layer forward with fp16 (CUDA)");
+
+  m.def("llama_layer_bw_fp16", &lightseq::llama_layer_bw<__half, __half>,
+        "LightSeq Llama Layer backward with fp16 (CUDA)");
+
   m.def("assign_layer_weight_grad_fp16",
         &lightseq::assign_layer_weight_grad<__half, __half>,
         "Bind layer weights and grads");
 
+  m.def("set_layer_recompute_fp16",
+        &lightseq::set_layer_recompute<__half, __half>,
+        "Recompute the layer forward in backward");
+
+  m.def("set_layer_grad_ready_hook_fp16",
+        &lightseq::set_layer_grad_ready_hook<__half, __half>,
+        "Call a hook when the grads of the layer are issued in backward");
+
   m.def("torch_sdpa_layer_fp16", &lightseq::torch_sdpa_layer<__half, __half>,
         "Empty");
 
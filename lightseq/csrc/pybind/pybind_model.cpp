@@ -1,7 +1,9 @@
 #include <cuda_runtime.h>
 #include <cuda_fp16.h>
 #include <pybind11/numpy.h>
+#include <pybind11/functional.h>
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
 
 #include "model_base.h"
 #include "util.h"
@@ -16,16 +18,107 @@ namespace py = pybind11;
 namespace lightseq {
 namespace cuda {
 
+// The options of the models below override the LIGHTSEQ_* variables of the
+// environment, the models themselves do not read it, see ModelOptions.
+
+// "" for the default precision, see LSModelFactory::CreateModel.
+DataType model_precision(const std::string &precision) {
+  DataType res = precision_dtype(precision);
+  if (!precision.empty() && res == kNotSupported) {
+    throw std::runtime_error("precision must be fp32, fp16 or bf16, got " +
+                             precision);
+  }
+  return res;
+}
+
 class PyTransformer {
  private:
   LSModel *model_;
   int *d_input_;
   std::vector<void *> d_outputs_;
+  int max_batch_size_;
+  // off if negative, see set_length_bucketing.
+  float bucket_waste_ = -1.f;
+  int bucket_pad_id_ = 0;
+
+  std::tuple<py::array_t<int>, py::array_t<float>> infer_buckets(
+      const int *input_seq_data, int batch_size, int batch_seq_len) {
+    std::vector<LengthBucket> buckets =
+        length_buckets(input_seq_data, batch_size, batch_seq_len,
+                       bucket_pad_id_, bucket_waste_, max_batch_size_);
+    std::vector<std::vector<int>> bucket_tokens(buckets.size());
+    std::vector<std::vector<float>> bucket_scores(buckets.size());
+    std::vector<int> bucket_steps(buckets.size());
+    std::vector<int> bucket_input;
+    int num_beams = 1, max_steps = 1;
+    for (int b = 0; b < buckets.size(); b++) {
+      const LengthBucket &bucket = buckets[b];
+      int rows = bucket.rows.size();
+      bucket_input.resize(size_t(rows) * bucket.seq_len);
+      for (int i = 0; i < rows; i++) {
+        std::copy_n(input_seq_data + size_t(bucket.rows[i]) * batch_seq_len,
+                    bucket.seq_len,
+                    bucket_input.begin() + size_t(i) * bucket.seq_len);
+      }
+      CHECK_GPU_ERROR(cudaMemcpy(d_input_, bucket_input.data(),
+                                 sizeof(int) * bucket_input.size(),
+                                 cudaMemcpyHostToDevice));
+      model_->set_input_ptr(0, d_input_);
+      model_->set_input_shape(0, {rows, bucket.seq_len});
+
+      model_->Infer();
+
+      // [rows, beams, steps], the steps differ between the buckets.
+      std::vector<int> output_shape = model_->get_output_shape(0);
+      num_beams = output_shape[1];
+      bucket_steps[b] = output_shape[2];
+      max_steps = std::max(max_steps, bucket_steps[b]);
+      bucket_tokens[b].resize(size_t(rows) * num_beams * bucket_steps[b]);
+      bucket_scores[b].resize(size_t(rows) * num_beams);
+      CHECK_GPU_ERROR(cudaMemcpy(bucket_tokens[b].data(),
+                                 model_->get_output_ptr(0),
+                                 sizeof(int) * bucket_tokens[b].size(),
+                                 cudaMemcpyDeviceToHost));
+      CHECK_GPU_ERROR(cudaMemcpy(bucket_scores[b].data(),
+                                 model_->get_output_ptr(1),
+                                 sizeof(float) * bucket_scores[b].size(),
+                                 cudaMemcpyDeviceToHost));
+    }
+
+    auto tokens = py::array_t<int>(
+        std::vector<int>{batch_size, num_beams, max_steps});
+    auto scores = py::array_t<float>(std::vector<int>{batch_size, num_beams});
+    int *tokens_data = tokens.mutable_data(0, 0);
+    float *scores_data = scores.mutable_data(0, 0);
+    for (int b = 0; b < buckets.size(); b++) {
+      int steps = bucket_steps[b];
+      for (int i = 0; i < buckets[b].rows.size(); i++) {
+        size_t row = buckets[b].rows[i];
+        for (int beam = 0; beam < num_beams; beam++) {
+          const int *src =
+              bucket_tokens[b].data() + (size_t(i) * num_beams + beam) * steps;
+          int *dst = tokens_data + (row * num_beams + beam) * max_steps;
+          std::copy_n(src, steps, dst);
+          // the last token is eos, see ker_write_topk_result.
+          std::fill(dst + steps, dst + max_steps, src[steps - 1]);
+          scores_data[row * num_beams + beam] =
+              bucket_scores[b][size_t(i) * num_beams + beam];
+        }
+      }
+    }
+    return std::make_tuple(tokens, scores);
+  }
 
  public:
-  PyTransformer(std::string weight_path, int max_batch_size) {
+  // model_name is an encoder-decoder model of the same inputs and outputs.
+  PyTransformer(std::string weight_path, int max_batch_size,
+                std::string model_name = "Transformer",
+                std::string precision = "",
+                const ModelOptions &options = ModelOptions()) {
     model_ = LSModelFactory::GetInstance().CreateModel(
-        "Transformer", weight_path, max_batch_size);
+        model_name, weight_path, max_batch_size, model_precision(precision),
+        model_options_from_env(options));
+    max_batch_size_ = max_batch_size;
     std::vector<int> max_input_shape = model_->get_input_max_shape(0);
     int max_size =
         std::accumulate(max_input_shape.begin(), max_input_shape.end(), 1,
@@ -50,12 +143,24 @@ class PyTransformer {
     }
   }
 
+  // Length bucketing: infer sorts the rows by their length without the
+  // trailing pad_id, runs them back to back in sub-batches whose padding is
+  // at most max_padding_waste of their tokens and returns the rows in their
+  // order. A negative max_padding_waste turns it off.
+  void set_length_bucketing(float max_padding_waste, int pad_id) {
+    bucket_waste_ = max_padding_waste;
+    bucket_pad_id_ = pad_id;
+  }
+
   std::tuple<py::array_t<int>, py::array_t<float>> infer(
       py::array_t<int, py::array::c_style | py::array::forcecast> input_seq) {
     auto input_seq_out = input_seq.mutable_unchecked<2>();
     const int *input_seq_data = input_seq_out.data(0, 0);
     int batch_size = input_seq_out.shape(0);
     int batch_seq_len = input_seq_out.shape(1);
+    if (bucket_waste_ >= 0) {
+      return infer_buckets(input_seq_data, batch_size, batch_seq_len);
+    }
 
     CHECK_GPU_ERROR(cudaMemcpy(d_input_, input_seq_data,
                                sizeof(int) * input_seq_out.size(),
@@ -87,16 +192,103 @@ class PyTransformer {
   }
 };
 
+class PyT5 : public PyTransformer {
+ public:
+  PyT5(std::string weight_path, int max_batch_size,
+       std::string precision = "",
+       const ModelOptions &options = ModelOptions())
+      : PyTransformer(weight_path, max_batch_size, "T5", precision, options) {
+  }
+};
+
 class PyBert {
  private:
   LSModel *model_;
   int *d_input_;
   std::vector<void *> d_outputs_;
+  int max_batch_size_;
+  // off if negative, see set_length_bucketing.
+  float bucket_waste_ = -1.f;
+  int bucket_pad_id_ = 0;
+
+  // the first size values of output 0, as float.
+  void copy_output(float *output_data, size_t size) {
+    DataType output_type = model_->get_output_dtype(0);
+    if (output_type == kFloat32) {
+      const float *d_output =
+          static_cast<const float *>(model_->get_output_ptr(0));
+
+      CHECK_GPU_ERROR(cudaMemcpy(output_data, d_output, sizeof(float) * size,
+                                 cudaMemcpyDeviceToHost));
+    } else if (output_type == kFloat16) {
+      const half *d_output =
+          static_cast<const half *>(model_->get_output_ptr(0));
+      std::vector<half> h_bert_out(size);
+      CHECK_GPU_ERROR(cudaMemcpy(h_bert_out.data(), d_output,
+                                 sizeof(half) * size, cudaMemcpyDeviceToHost));
+      for (auto i = 0; i < h_bert_out.size(); i++) {
+        float f_data = __half2float(h_bert_out[i]);
+        output_data[i] = f_data;
+      }
+    } else {
+      throw std::runtime_error("Not supported output type");
+    }
+  }
+
+  py::array_t<float> infer_buckets(const int *input_seq_data, int batch_size,
+                                   int batch_seq_len) {
+    std::vector<LengthBucket> buckets =
+        length_buckets(input_seq_data, batch_size, batch_seq_len,
+                       bucket_pad_id_, bucket_waste_, max_batch_size_);
+    std::vector<int> max_shape = model_->get_output_max_shape(0);
+    int hidden_size = max_shape.back();
+    // [batch_size, hidden_size] with LIGHTSEQ_BERT_POOLING, else the
+    // positions past the sub-batch of a row stay 0.
+    bool pooled = max_shape.size() == 2;
+    int out_seq_len = pooled ? 1 : batch_seq_len;
+    auto output = py::array_t<float>(
+        pooled ? std::vector<int>{batch_size, hidden_size}
+               : std::vector<int>{batch_size, batch_seq_len, hidden_size});
+    float *output_data = output.mutable_data(0, 0);
+    std::fill(output_data, output_data + output.size(), 0.f);
+    std::vector<int> bucket_input;
+    std::vector<float> bucket_output;
+    for (const LengthBucket &bucket : buckets) {
+      int rows = bucket.rows.size();
+      bucket_input.resize(size_t(rows) * bucket.seq_len);
+      for (int i = 0; i < rows; i++) {
+        std::copy_n(input_seq_data + size_t(bucket.rows[i]) * batch_seq_len,
+                    bucket.seq_len,
+                    bucket_input.begin() + size_t(i) * bucket.seq_len);
+      }
+      CHECK_GPU_ERROR(cudaMemcpy(d_input_, bucket_input.data(),
+                                 sizeof(int) * bucket_input.size(),
+                                 cudaMemcpyHostToDevice));
+      model_->set_input_ptr(0, d_input_);
+      model_->set_input_shape(0, {rows, bucket.seq_len});
+
+      model_->Infer();
+
+      size_t row_size = size_t(pooled ? 1 : bucket.seq_len) * hidden_size;
+      bucket_output.resize(rows * row_size);
+      copy_output(bucket_output.data(), bucket_output.size());
+      for (int i = 0; i < rows; i++) {
+        std::copy_n(bucket_output.begin() + i * row_size, row_size,
+                    output_data + size_t(bucket.rows[i]) * out_seq_len *
+                                      hidden_size);
+      }
+    }
+    return output;
+  }
 
  public:
-  PyBert(std::string weight_path, int max_batch_size) {
-    model_ = LSModelFactory::GetInstance().CreateModel("Bert", weight_path,
-                                                       max_batch_size);
+  PyBert(std::string weight_path, int max_batch_size,
+         std::string precision = "",
+         const ModelOptions &options = ModelOptions()) {
+    model_ = LSModelFactory::GetInstance().CreateModel(
+        "Bert", weight_path, max_batch_size, model_precision(precision),
+        model_options_from_env(options));
+    max_batch_size_ = max_batch_size;
     std::vector<int> max_input_shape = model_->get_input_max_shape(0);
     int max_size =
         std::accumulate(max_input_shape.begin(), max_input_shape.end(), 1,
@@ -121,12 +313,24 @@ class PyBert {
     }
   }
 
+  // Length bucketing: infer sorts the rows by their length without the
+  // trailing pad_id, runs them back to back in sub-batches whose padding is
+  // at most max_padding_waste of their tokens and returns the rows in their
+  // order. A negative max_padding_waste turns it off.
+  void set_length_bucketing(float max_padding_waste, int pad_id) {
+    bucket_waste_ = max_padding_waste;
+    bucket_pad_id_ = pad_id;
+  }
+
   py::array_t<float> infer(
       py::array_t<int, py::array::c_style | py::array::forcecast> input_seq) {
     auto input_seq_out = input_seq.mutable_unchecked<2>();
     const int *input_seq_data = input_seq_out.data(0, 0);
     int batch_size = input_seq_out.shape(0);
     int batch_seq_len = input_seq_out.shape(1);
+    if (bucket_waste_ >= 0) {
+      return infer_buckets(input_seq_data, batch_size, batch_seq_len);
+    }
 
     CHECK_GPU_ERROR(cudaMemcpy(d_input_, input_seq_data,
                                sizeof(int) * input_seq_out.size(),
@@ -140,28 +344,7 @@ class PyBert {
     std::vector<int> output_shape = model_->get_output_shape(0);
     auto output = py::array_t<float>(output_shape);
     float *output_data = output.mutable_data(0, 0);
-    DataType output_type = model_->get_output_dtype(0);
-    if (output_type == kFloat32) {
-      const float *d_output =
-          static_cast<const float *>(model_->get_output_ptr(0));
-
-      CHECK_GPU_ERROR(cudaMemcpy(output_data, d_output,
-                                 sizeof(float) * output.size(),
-                                 cudaMemcpyDeviceToHost));
-    } else if (output_type == kFloat16) {
-      const half *d_output =
-          static_cast<const half *>(model_->get_output_ptr(0));
-      std::vector<half> h_bert_out(output.size());
-      CHECK_GPU_ERROR(cudaMemcpy(h_bert_out.data(), d_output,
-                                 sizeof(half) * output.size(),
-                                 cudaMemcpyDeviceToHost));
-      for (auto i = 0; i < h_bert_out.size(); i++) {
-        float f_data = __half2float(h_bert_out[i]);
-        output_data[i] = f_data;
-      }
-    } else {
-      throw std::runtime_error("Not supported output type");
-    }
+    copy_output(output_data, output.size());
 
     return output;
   }
@@ -174,9 +357,12 @@ class PyBertCrf {
   std::vector<void *> d_outputs_;
 
  public:
-  PyBertCrf(std::string weight_path, int max_batch_size) {
-    model_ = LSModelFactory::GetInstance().CreateModel("BertCrf", weight_path,
-                                                       max_batch_size);
+  PyBertCrf(std::string weight_path, int max_batch_size,
+            std::string precision = "",
+            const ModelOptions &options = ModelOptions()) {
+    model_ = LSModelFactory::GetInstance().CreateModel(
+        "BertCrf", weight_path, max_batch_size, model_precision(precision),
+        model_options_from_env(options));
     std::vector<int> max_input_shape = model_->get_input_max_shape(0);
     int max_size =
         std::accumulate(max_input_shape.begin(), max_input_shape.end(), 1,
@@ -230,6 +416,98 @@ class PyBertCrf {
   }
 };
 
+class PyBertMultiHead {
+ private:
+  LSModel *model_;
+  int *d_input_;
+  std::vector<void *> d_outputs_;
+
+ public:
+  PyBertMultiHead(std::string weight_path, int max_batch_size,
+                  std::string precision = "",
+                  const ModelOptions &options = ModelOptions()) {
+    model_ = LSModelFactory::GetInstance().CreateModel(
+        "BertMultiHead", weight_path, max_batch_size,
+        model_precision(precision), model_options_from_env(options));
+    std::vector<int> max_input_shape = model_->get_input_max_shape(0);
+    int max_size =
+        std::accumulate(max_input_shape.begin(), max_input_shape.end(), 1,
+                        std::multiplies<int>());
+    CHECK_GPU_ERROR(cudaMalloc(&d_input_, sizeof(int) * max_size));
+
+    // every output is of at most 4 bytes per value.
+    for (int i = 0; i < model_->get_output_size(); i++) {
+      void *d_output;
+      std::vector<int> shape = model_->get_output_max_shape(i);
+      int output_size = std::accumulate(shape.begin(), shape.end(), 1,
+                                        std::multiplies<int>());
+      CHECK_GPU_ERROR(cudaMalloc(&d_output, output_size * sizeof(float)));
+      model_->set_output_ptr(i, d_output);
+      d_outputs_.push_back(d_output);
+    }
+  }
+  ~PyBertMultiHead() {
+    delete model_;
+    CHECK_GPU_ERROR(cudaFree(d_input_));
+    for (auto d_output : d_outputs_) {
+      CHECK_GPU_ERROR(cudaFree(d_output));
+    }
+  }
+
+  // the output of every task head, the int tags of the crf ones and the
+  // float logits or embeddings of the others.
+  py::list infer(
+      py::array_t<int, py::array::c_style | py::array::forcecast> input_seq) {
+    auto input_seq_out = input_seq.mutable_unchecked<2>();
+    const int *input_seq_data = input_seq_out.data(0, 0);
+    int batch_size = input_seq_out.shape(0);
+    int batch_seq_len = input_seq_out.shape(1);
+
+    CHECK_GPU_ERROR(cudaMemcpy(d_input_, input_seq_data,
+                               sizeof(int) * input_seq_out.size(),
+                               cudaMemcpyHostToDevice));
+
+    model_->set_input_ptr(0, d_input_);
+    model_->set_input_shape(0, {batch_size, batch_seq_len});
+
+    model_->Infer();
+
+    py::list outputs;
+    for (int i = 0; i < model_->get_output_size(); i++) {
+      std::vector<int> output_shape = model_->get_output_shape(i);
+      DataType output_type = model_->get_output_dtype(i);
+      const void *d_output = model_->get_output_ptr(i);
+      if (output_type == kInt32) {
+        auto output = py::array_t<int>(output_shape);
+        CHECK_GPU_ERROR(cudaMemcpy(output.mutable_data(), d_output,
+                                   sizeof(int) * output.size(),
+                                   cudaMemcpyDeviceToHost));
+        outputs.append(output);
+        continue;
+      }
+      auto output = py::array_t<float>(output_shape);
+      float *output_data = output.mutable_data();
+      if (output_type == kFloat32) {
+        CHECK_GPU_ERROR(cudaMemcpy(output_data, d_output,
+                                   sizeof(float) * output.size(),
+                                   cudaMemcpyDeviceToHost));
+      } else if (output_type == kFloat16) {
+        std::vector<half> h_output(output.size());
+        CHECK_GPU_ERROR(cudaMemcpy(h_output.data(), d_output,
+                                   sizeof(half) * output.size(),
+                                   cudaMemcpyDeviceToHost));
+        for (size_t j = 0; j < h_output.size(); j++) {
+          output_data[j] = __half2float(h_output[j]);
+        }
+      } else {
+        throw std::runtime_error("Not supported output type");
+      }
+      outputs.append(output);
+    }
+    return outputs;
+  }
+};
+
 class PyGpt {
  private:
   LSModel *model_;
@@ -237,9 +515,12 @@ class PyGpt {
   std::vector<void *> d_outputs_;
 
  public:
-  PyGpt(std::string weight_path, int max_batch_size) {
-    model_ = LSModelFactory::GetInstance().CreateModel("Gpt", weight_path,
-                                                       max_batch_size);
+  PyGpt(std::string weight_path, int max_batch_size,
+        std::string precision = "",
+        const ModelOptions &options = ModelOptions()) {
+    model_ = LSModelFactory::GetInstance().CreateModel(
+        "Gpt", weight_path, max_batch_size, model_precision(precision),
+        model_options_from_env(options));
     std::vector<int> max_input_shape = model_->get_input_max_shape(0);
     int max_size =
         std::accumulate(max_input_shape.begin(), max_input_shape.end(), 1,
@@ -264,6 +545,51 @@ class PyGpt {
     }
   }
 
+  void dynamic_memory_plan(bool enable) {
+    model_->dynamic_memory_plan(enable);
+  }
+
+  void multi_stream(int num_streams) { model_->multi_stream(num_streams); }
+
+  void profiling(bool enable) { model_->profiling(enable); }
+
+  void export_profile(const std::string &trace_path) {
+    model_->export_profile(trace_path);
+  }
+
+  std::string metrics() { return model_->metrics_text(); }
+
+  void set_sampling_params(float temperature, float repetition_penalty,
+                           float min_p) {
+    model_->set_sampling_params(temperature, repetition_penalty, min_p);
+  }
+
+  void set_generation_configs(const std::vector<GenerationConfig> &configs) {
+    model_->set_generation_configs(configs);
+  }
+
+  void set_logits_processor(const LogitsProcessConfig &config) {
+    model_->set_logits_processor(config);
+  }
+
+  void set_token_automaton(const TokenAutomaton &automaton) {
+    model_->set_token_automaton(automaton);
+  }
+
+  void layer_time_sampling(int interval) {
+    model_->layer_time_sampling(interval);
+  }
+
+  std::vector<WarmupTiming> warmup(
+      const std::vector<std::vector<int>> &shapes) {
+    return model_->warmup(shapes);
+  }
+
+  void set_token_callback(
+      std::function<void(int, const std::vector<int> &)> callback) {
+    model_->set_token_callback(callback);
+  }
+
   std::tuple<py::array_t<int>, py::array_t<float>> infer(
       py::array_t<int, py::array::c_style | py::array::forcecast> input_seq) {
     auto input_seq_out = input_seq.mutable_unchecked<2>();
@@ -306,6 +632,62 @@ class PyGpt {
 
     return std::make_tuple(output, scores);
   }
+
+  // see LSModel::score_packed, the sequences are tokens[offsets[i],
+  // offsets[i + 1]). Returns the ppl of every sequence, and the log prob of
+  // every token too if return_token_log_probs.
+  py::object ppl_packed(
+      py::array_t<int, py::array::c_style | py::array::forcecast> tokens,
+      py::array_t<int, py::array::c_style | py::array::forcecast> offsets,
+      bool return_token_log_probs) {
+    auto tokens_out = tokens.unchecked<1>();
+    auto offsets_out = offsets.unchecked<1>();
+    int num_seqs = offsets_out.shape(0) - 1;
+    if (num_seqs < 0 || offsets_out(0) < 0 ||
+        offsets_out(num_seqs) > tokens_out.shape(0)) {
+      throw std::runtime_error(
+          "offsets must be num_seqs + 1 positions of tokens");
+    }
+
+    auto ppl = py::array_t<float>(num_seqs);
+    py::array_t<float> token_log_probs;
+    float *token_log_probs_data = nullptr;
+    if (return_token_log_probs) {
+      token_log_probs = py::array_t<float>(tokens_out.shape(0));
+      token_log_probs_data = token_log_probs.mutable_data();
+      std::fill(token_log_probs_data,
+                token_log_probs_data + token_log_probs.size(), 0.f);
+    }
+    model_->score_packed(tokens.data(), offsets.data(), num_seqs,
+                         ppl.mutable_data(), token_log_probs_data);
+
+    if (return_token_log_probs) {
+      return py::make_tuple(ppl, token_log_probs);
+    }
+    return ppl;
+  }
+
+  // see LSModel::score_tree, the candidates of prefix are the paths of the
+  // tree of tree_tokens whose parents are tree_parents. Returns the log
+  // likelihood of the path ending at every tree token.
+  py::array_t<float> score_tree(
+      py::array_t<int, py::array::c_style | py::array::forcecast> prefix,
+      py::array_t<int, py::array::c_style | py::array::forcecast> tree_tokens,
+      py::array_t<int, py::array::c_style | py::array::forcecast>
+          tree_parents) {
+    int tree_len = tree_tokens.size();
+    if (prefix.ndim() != 1 || tree_tokens.ndim() != 1 ||
+        tree_parents.ndim() != 1 || tree_parents.size() != tree_len) {
+      throw std::runtime_error(
+          "prefix, tree_tokens and tree_parents must be 1-d, one parent per "
+          "tree token");
+    }
+    auto log_likelihood = py::array_t<float>(tree_len);
+    model_->score_tree(prefix.data(), prefix.size(), tree_tokens.data(),
+                       tree_parents.data(), tree_len,
+                       log_likelihood.mutable_data());
+    return log_likelihood;
+  }
 };
 
 class PyLlama {
@@ -315,9 +697,12 @@ class PyLlama {
   std::vector<void *> d_outputs_;
 
  public:
-  PyLlama(std::string weight_path, int max_batch_size) {
-    model_ = LSModelFactory::GetInstance().CreateModel("Llama", weight_path,
-                                                       max_batch_size);
+  PyLlama(std::string weight_path, int max_batch_size,
+          std::string precision = "",
+          const ModelOptions &options = ModelOptions()) {
+    model_ = LSModelFactory::GetInstance().CreateModel(
+        "Llama", weight_path, max_batch_size, model_precision(precision),
+        model_options_from_env(options));
     std::vector<int> max_input_shape = model_->get_input_max_shape(0);
     int max_size =
         std::accumulate(max_input_shape.begin(), max_input_shape.end(), 1,
@@ -342,6 +727,103 @@ class PyLlama {
     }
   }
 
+  void dynamic_memory_plan(bool enable) {
+    model_->dynamic_memory_plan(enable);
+  }
+
+  void multi_stream(int num_streams) { model_->multi_stream(num_streams); }
+
+  void profiling(bool enable) { model_->profiling(enable); }
+
+  void export_profile(const std::string &trace_path) {
+    model_->export_profile(trace_path);
+  }
+
+  std::string metrics() { return model_->metrics_text(); }
+
+  void set_sampling_params(float temperature, float repetition_penalty,
+                           float min_p) {
+    model_->set_sampling_params(temperature, repetition_penalty, min_p);
+  }
+
+  void set_generation_configs(const std::vector<GenerationConfig> &configs) {
+    model_->set_generation_configs(configs);
+  }
+
+  void set_logits_processor(const LogitsProcessConfig &config) {
+    model_->set_logits_processor(config);
+  }
+
+  void set_token_automaton(const TokenAutomaton &automaton) {
+    model_->set_token_automaton(automaton);
+  }
+
+  void layer_time_sampling(int interval) {
+    model_->layer_time_sampling(interval);
+  }
+
+  std::vector<WarmupTiming> warmup(
+      const std::vector<std::vector<int>> &shapes) {
+    return model_->warmup(shapes);
+  }
+
+  void set_token_callback(
+      std::function<void(int, const std::vector<int> &)> callback) {
+    model_->set_token_callback(callback);
+  }
+
+  void cuda_graph_mode(bool enable) { model_->cuda_graph_mode(enable); }
+
+  void suspend() { model_->suspend(); }
+  void resume() { model_->resume(); }
+
+  MemoryProfile memory_profile() { return model_->memory_profile(); }
+
+  void update_weights(const std::string &weight_path) {
+    model_->update_weights(weight_path);
+  }
+
+  int add_request(const std::vector<int> &prompt, int max_new_tokens,
+                  int priority, int deadline_ms, int session_id) {
+    return model_->add_request(prompt, max_new_tokens, priority, deadline_ms,
+                               session_id);
+  }
+
+  void drop_session(int session_id) { model_->drop_session(session_id); }
+
+  void cancel_request(int request_id) { model_->cancel_request(request_id); }
+
+  void evict_expired_requests(bool enable) {
+    model_->evict_expired_requests(enable);
+  }
+
+  std::vector<int> last_step_evicted() { return model_->last_step_evicted(); }
+
+  void cancel_row(int row) { model_->cancel_row(row); }
+
+  void set_num_return_sequences(int num) {
+    model_->set_num_return_sequences(num);
+  }
+
+  std::vector<std::pair<int, std::vector<int>>> step() {
+    return model_->step();
+  }
+
+  bool has_pending_requests() { return model_->has_pending_requests(); }
+
+  // the draft model must outlive its use by this model.
+  void set_draft_model(PyLlama *draft, int num_draft_tokens) {
+    model_->set_draft_model(draft ? draft->model_ : nullptr, num_draft_tokens);
+  }
+
+  void load_lora_adapter(const std::string &name, const std::string &path) {
+    model_->load_lora_adapter(name, path);
+  }
+
+  void set_lora_adapters(const std::vector<std::string> &names) {
+    model_->set_lora_adapters(names);
+  }
+
   py::array_t<int> infer(
       py::array_t<int, py::array::c_style | py::array::forcecast> input_seq) {
     auto input_seq_out = input_seq.mutable_unchecked<2>();
@@ -381,33 +863,251 @@ class PyLlama {
 PYBIND11_MODULE(inference, m) {
   m.attr("__name__") = "lightseq.inference";
 
+  py::class_<lightseq::cuda::GenerationConfig>(m, "GenerationConfig")
+      .def(py::init<>())
+      .def_readwrite("topk", &lightseq::cuda::GenerationConfig::topk)
+      .def_readwrite("topp", &lightseq::cuda::GenerationConfig::topp)
+      .def_readwrite("temperature",
+                     &lightseq::cuda::GenerationConfig::temperature)
+      .def_readwrite("repetition_penalty",
+                     &lightseq::cuda::GenerationConfig::repetition_penalty)
+      .def_readwrite("min_p", &lightseq::cuda::GenerationConfig::min_p)
+      .def_readwrite("max_new_tokens",
+                     &lightseq::cuda::GenerationConfig::max_new_tokens)
+      .def_readwrite("stop_tokens",
+                     &lightseq::cuda::GenerationConfig::stop_tokens);
+
+  py::class_<lightseq::cuda::LogitsProcessConfig>(m, "LogitsProcessConfig")
+      .def(py::init<>())
+      .def_readwrite("repetition_penalty",
+                     &lightseq::cuda::LogitsProcessConfig::repetition_penalty)
+      .def_readwrite("presence_penalty",
+                     &lightseq::cuda::LogitsProcessConfig::presence_penalty)
+      .def_readwrite("frequency_penalty",
+                     &lightseq::cuda::LogitsProcessConfig::frequency_penalty)
+      .def_readwrite(
+          "no_repeat_ngram_size",
+          &lightseq::cuda::LogitsProcessConfig::no_repeat_ngram_size)
+      .def_readwrite("bad_words",
+                     &lightseq::cuda::LogitsProcessConfig::bad_words);
+
+  py::class_<lightseq::cuda::TokenAutomaton>(m, "TokenAutomaton")
+      .def(py::init<>())
+      .def_readwrite("num_states", &lightseq::cuda::TokenAutomaton::num_states)
+      .def_readwrite("allowed", &lightseq::cuda::TokenAutomaton::allowed)
+      .def_readwrite("transition_offsets",
+                     &lightseq::cuda::TokenAutomaton::transition_offsets)
+      .def_readwrite("transition_tokens",
+                     &lightseq::cuda::TokenAutomaton::transition_tokens)
+      .def_readwrite("next_states",
+                     &lightseq::cuda::TokenAutomaton::next_states);
+
+  py::class_<lightseq::cuda::WarmupTiming>(m, "WarmupTiming")
+      .def_readonly("shape", &lightseq::cuda::WarmupTiming::shape)
+      .def_readonly("first_ms", &lightseq::cuda::WarmupTiming::first_ms)
+      .def_readonly("second_ms", &lightseq::cuda::WarmupTiming::second_ms);
+
+  py::class_<lightseq::cuda::MemoryProfile>(m, "MemoryProfile")
+      .def(py::init<>())
+      .def_readwrite("fixed_bytes", &lightseq::cuda::MemoryProfile::fixed_bytes)
+      .def_readwrite("activation_bytes",
+                     &lightseq::cuda::MemoryProfile::activation_bytes)
+      .def_readwrite("activation_row_bytes",
+                     &lightseq::cuda::MemoryProfile::activation_row_bytes)
+      .def_readwrite("kv_token_bytes",
+                     &lightseq::cuda::MemoryProfile::kv_token_bytes)
+      .def_readwrite("kv_row_tokens",
+                     &lightseq::cuda::MemoryProfile::kv_row_tokens)
+      .def_readwrite("kv_page_size",
+                     &lightseq::cuda::MemoryProfile::kv_page_size)
+      .def_readwrite("beam_size", &lightseq::cuda::MemoryProfile::beam_size)
+      .def_readwrite("max_step", &lightseq::cuda::MemoryProfile::max_step);
+
+  py::class_<lightseq::cuda::MemoryConfig>(m, "MemoryConfig")
+      .def(py::init<>())
+      .def_readwrite("max_batch_size",
+                     &lightseq::cuda::MemoryConfig::max_batch_size)
+      .def_readwrite("kv_num_pages",
+                     &lightseq::cuda::MemoryConfig::kv_num_pages)
+      .def_readwrite("planned_bytes",
+                     &lightseq::cuda::MemoryConfig::planned_bytes);
+
+  m.def("plan_memory_config", &lightseq::cuda::plan_memory_config,
+        py::arg("profile"), py::arg("budget_bytes"),
+        py::arg("max_row_tokens") = 0);
+  m.def(
+      "plan_memory",
+      [](const std::string &model_name, const std::string &weight_path,
+         size_t budget_bytes, int max_row_tokens, int probe_batch_size,
+         const std::string &precision,
+         const lightseq::cuda::ModelOptions &options) {
+        return lightseq::cuda::LSModelFactory::GetInstance().PlanMemory(
+            model_name, weight_path, budget_bytes, max_row_tokens,
+            probe_batch_size, lightseq::cuda::model_precision(precision),
+            lightseq::cuda::model_options_from_env(options));
+      },
+      py::arg("model_name"), py::arg("weight_path"), py::arg("budget_bytes"),
+      py::arg("max_row_tokens") = 0, py::arg("probe_batch_size") = 2,
+      py::arg("precision") = "",
+      py::arg("options") = lightseq::cuda::ModelOptions());
+
   py::class_<lightseq::cuda::PyTransformer>(m, "Transformer")
-      .def(py::init<const std::string, const int>(), py::arg("weight_path"),
-           py::arg("max_batch_size"))
+      .def(py::init([](const std::string &weight_path, int max_batch_size,
+                       const std::string &precision,
+                       const lightseq::cuda::ModelOptions &options) {
+             return new lightseq::cuda::PyTransformer(
+                 weight_path, max_batch_size, "Transformer", precision,
+                 options);
+           }),
+           py::arg("weight_path"), py::arg("max_batch_size"),
+           py::arg("precision") = "",
+           py::arg("options") = lightseq::cuda::ModelOptions())
       .def("infer", &lightseq::cuda::PyTransformer::infer,
-           py::return_value_policy::reference_internal, py::arg("input_seq"));
+           py::return_value_policy::reference_internal, py::arg("input_seq"))
+      .def("set_length_bucketing",
+           &lightseq::cuda::PyTransformer::set_length_bucketing,
+           py::arg("max_padding_waste"), py::arg("pad_id"));
+
+  py::class_<lightseq::cuda::PyT5>(m, "T5")
+      .def(py::init<const std::string, const int, const std::string,
+                    const lightseq::cuda::ModelOptions &>(),
+           py::arg("weight_path"), py::arg("max_batch_size"),
+           py::arg("precision") = "",
+           py::arg("options") = lightseq::cuda::ModelOptions())
+      .def("infer", &lightseq::cuda::PyT5::infer,
+           py::return_value_policy::reference_internal, py::arg("input_seq"))
+      .def("set_length_bucketing", &lightseq::cuda::PyT5::set_length_bucketing,
+           py::arg("max_padding_waste"), py::arg("pad_id"));
 
   py::class_<lightseq::cuda::PyBert>(m, "Bert")
-      .def(py::init<const std::string, const int>(), py::arg("weight_path"),
-           py::arg("max_batch_size"))
+      .def(py::init<const std::string, const int, const std::string,
+                    const lightseq::cuda::ModelOptions &>(),
+           py::arg("weight_path"), py::arg("max_batch_size"),
+           py::arg("precision") = "",
+           py::arg("options") = lightseq::cuda::ModelOptions())
       .def("infer", &lightseq::cuda::PyBert::infer,
-           py::return_value_policy::reference_internal, py::arg("input_seq"));
+           py::return_value_policy::reference_internal, py::arg("input_seq"))
+      .def("set_length_bucketing",
+           &lightseq::cuda::PyBert::set_length_bucketing,
+           py::arg("max_padding_waste"), py::arg("pad_id"));
 
   py::class_<lightseq::cuda::PyBertCrf>(m, "BertCrf")
-      .def(py::init<const std::string, const int>(), py::arg("weight_path"),
-           py::arg("max_batch_size"))
+      .def(py::init<const std::string, const int, const std::string,
+                    const lightseq::cuda::ModelOptions &>(),
+           py::arg("weight_path"), py::arg("max_batch_size"),
+           py::arg("precision") = "",
+           py::arg("options") = lightseq::cuda::ModelOptions())
       .def("infer", &lightseq::cuda::PyBertCrf::infer,
            py::return_value_policy::reference_internal, py::arg("input_seq"));
 
+  py::class_<lightseq::cuda::PyBertMultiHead>(m, "BertMultiHead")
+      .def(py::init<const std::string, const int, const std::string,
+                    const lightseq::cuda::ModelOptions &>(),
+           py::arg("weight_path"), py::arg("max_batch_size"),
+           py::arg("precision") = "",
+           py::arg("options") = lightseq::cuda::ModelOptions())
+      .def("infer", &lightseq::cuda::PyBertMultiHead::infer,
+           py::arg("input_seq"));
+
   py::class_<lightseq::cuda::PyGpt>(m, "Gpt")
-      .def(py::init<const std::string, const int>(), py::arg("weight_path"),
-           py::arg("max_batch_size"))
+      .def(py::init<const std::string, const int, const std::string,
+                    const lightseq::cuda::ModelOptions &>(),
+           py::arg("weight_path"), py::arg("max_batch_size"),
+           py::arg("precision") = "",
+           py::arg("options") = lightseq::cuda::ModelOptions())
       .def("infer", &lightseq::cuda::PyGpt::infer,
-           py::return_value_policy::reference_internal, py::arg("input_seq"));
+           py::return_value_policy::reference_internal, py::arg("input_seq"))
+      .def("ppl_packed", &lightseq::cuda::PyGpt::ppl_packed, py::arg("tokens"),
+           py::arg("offsets"), py::arg("return_token_log_probs") = false)
+      .def("score_tree", &lightseq::cuda::PyGpt::score_tree, py::arg("prefix"),
+           py::arg("tree_tokens"), py::arg("tree_parents"))
+      .def("dynamic_memory_plan", &lightseq::cuda::PyGpt::dynamic_memory_plan,
+           py::arg("enable"))
+      .def("multi_stream", &lightseq::cuda::PyGpt::multi_stream,
+           py::arg("num_streams"))
+      .def("profiling", &lightseq::cuda::PyGpt::profiling, py::arg("enable"))
+      .def("export_profile", &lightseq::cuda::PyGpt::export_profile,
+           py::arg("trace_path"))
+      .def("metrics", &lightseq::cuda::PyGpt::metrics)
+      .def("set_generation_configs",
+           &lightseq::cuda::PyGpt::set_generation_configs, py::arg("configs"))
+      .def("set_logits_processor", &lightseq::cuda::PyGpt::set_logits_processor,
+           py::arg("config"))
+      .def("set_token_automaton", &lightseq::cuda::PyGpt::set_token_automaton,
+           py::arg("automaton"))
+      .def("set_sampling_params", &lightseq::cuda::PyGpt::set_sampling_params,
+           py::arg("temperature") = 1.f, py::arg("repetition_penalty") = 1.f,
+           py::arg("min_p") = 0.f)
+      .def("layer_time_sampling", &lightseq::cuda::PyGpt::layer_time_sampling,
+           py::arg("interval"))
+      .def("warmup", &lightseq::cuda::PyGpt::warmup, py::arg("shapes"))
+      .def("set_token_callback", &lightseq::cuda::PyGpt::set_token_callback,
+           py::arg("callback"));
 
   py::class_<lightseq::cuda::PyLlama>(m, "Llama")
-      .def(py::init<const std::string, const int>(), py::arg("weight_path"),
-           py::arg("max_batch_size"))
+      .def(py::init<const std::string, const int, const std::string,
+                    const lightseq::cuda::ModelOptions &>(),
+           py::arg("weight_path"), py::arg("max_batch_size"),
+           py::arg("precision") = "",
+           py::arg("options") = lightseq::cuda::ModelOptions())
       .def("infer", &lightseq::cuda::PyLlama::infer,
-           py::return_value_policy::reference_internal, py::arg("input_seq"));
+           py::return_value_policy::reference_internal, py::arg("input_seq"))
+      .def("dynamic_memory_plan", &lightseq::cuda::PyLlama::dynamic_memory_plan,
+           py::arg("enable"))
+      .def("cuda_graph_mode", &lightseq::cuda::PyLlama::cuda_graph_mode,
+           py::arg("enable"))
+      .def("suspend", &lightseq::cuda::PyLlama::suspend)
+      .def("resume", &lightseq::cuda::PyLlama::resume)
+      .def("multi_stream", &lightseq::cuda::PyLlama::multi_stream,
+           py::arg("num_streams"))
+      .def("profiling", &lightseq::cuda::PyLlama::profiling, py::arg("enable"))
+      .def("export_profile", &lightseq::cuda::PyLlama::export_profile,
+           py::arg("trace_path"))
+      .def("metrics", &lightseq::cuda::PyLlama::metrics)
+      .def("set_generation_configs",
+           &lightseq::cuda::PyLlama::set_generation_configs, py::arg("configs"))
+      .def("set_logits_processor",
+           &lightseq::cuda::PyLlama::set_logits_processor, py::arg("config"))
+      .def("set_token_automaton",
+           &lightseq::cuda::PyLlama::set_token_automaton,
+           py::arg("automaton"))
+      .def("set_sampling_params", &lightseq::cuda::PyLlama::set_sampling_params,
+           py::arg("temperature") = 1.f, py::arg("repetition_penalty") = 1.f,
+           py::arg("min_p") = 0.f)
+      .def("layer_time_sampling", &lightseq::cuda::PyLlama::layer_time_sampling,
+           py::arg("interval"))
+      .def("warmup", &lightseq::cuda::PyLlama::warmup, py::arg("shapes"))
+      .def("add_request", &lightseq::cuda::PyLlama::add_request,
+           py::arg("prompt"), py::arg("max_new_tokens") = 0,
+           py::arg("priority") = 0, py::arg("deadline_ms") = 0,
+           py::arg("session_id") = -1)
+      .def("drop_session", &lightseq::cuda::PyLlama::drop_session,
+           py::arg("session_id"))
+      .def("memory_profile", &lightseq::cuda::PyLlama::memory_profile)
+      .def("update_weights", &lightseq::cuda::PyLlama::update_weights,
+           py::arg("weight_path"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("cancel_request", &lightseq::cuda::PyLlama::cancel_request,
+           py::arg("request_id"))
+      .def("evict_expired_requests",
+           &lightseq::cuda::PyLlama::evict_expired_requests,
+           py::arg("enable") = true)
+      .def("last_step_evicted", &lightseq::cuda::PyLlama::last_step_evicted)
+      .def("cancel_row", &lightseq::cuda::PyLlama::cancel_row,
+           py::arg("row"))
+      .def("set_num_return_sequences",
+           &lightseq::cuda::PyLlama::set_num_return_sequences,
+           py::arg("num"))
+      .def("step", &lightseq::cuda::PyLlama::step)
+      .def("has_pending_requests",
+           &lightseq::cuda::PyLlama::has_pending_requests)
+      .def("set_draft_model", &lightseq::cuda::PyLlama::set_draft_model,
+           py::arg("draft_model"), py::arg("num_draft_tokens") = 4,
+           py::keep_alive<1, 2>())
+      .def("set_token_callback", &lightseq::cuda::PyLlama::set_token_callback,
+           py::arg("callback"))
+      .def("load_lora_adapter", &lightseq::cuda::PyLlama::load_lora_adapter,
+           py::arg("name"), py::arg("path"))
+      .def("set_lora_adapters", &lightseq::cuda::PyLlama::set_lora_adapters,
+           py::arg("names"));
 }
@@ -1,10 +1,12 @@
 #include <ATen/cuda/CUDAContext.h>
 #include <torch/extension.h>
+#include <algorithm>
 #include <string>
 
 #include "declaration.h"
 #include "context.h"
 
+#include "kernels.h"
 #include "split_head_op.h"
 
 // x is torch::Tensor
@@ -67,6 +69,77 @@ void torch_split_head_op(const torch::Tensor& input, const torch::Tensor& bias,
   print_time_duration(start, "op cost");
 }
 
+// Returns {loss, nll_loss, lse}, the summed losses and the logsumexp of
+// every token, without the [tokens, vocab] logits, see
+// launch_fused_linear_cross_entropy_fw.
+template <typename T>
+std::vector<torch::Tensor> torch_fused_linear_cross_entropy_fw(
+    const torch::Tensor& inputs, const torch::Tensor& weight,
+    const torch::Tensor& targets, int padding_idx, float epsilon,
+    int chunk_size) {
+  CHECK_INPUT(inputs);
+  CHECK_INPUT(weight);
+  CHECK_INPUT(targets);
+  int hidden_size = weight.size(1);
+  int vocab_size = weight.size(0);
+  int num_tokens = inputs.numel() / hidden_size;
+  chunk_size = std::min(chunk_size, vocab_size);
+
+  auto float_options = inputs.options().dtype(torch::kFloat32);
+  torch::Tensor loss = torch::empty({1}, float_options);
+  torch::Tensor nll_loss = torch::empty({1}, float_options);
+  torch::Tensor lse = torch::empty({num_tokens}, float_options);
+  torch::Tensor loss_buffer = torch::empty({num_tokens * 2}, float_options);
+  torch::Tensor stats_buffer = torch::empty({num_tokens * 4}, float_options);
+  torch::Tensor logits_buffer =
+      torch::empty({num_tokens, chunk_size}, inputs.options());
+
+  cublasHandle_t handle = at::cuda::getCurrentCUDABlasHandle();
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  cuda::launch_fused_linear_cross_entropy_fw<T>(
+      (const T*)inputs.data_ptr(), (const T*)weight.data_ptr(),
+      (const int*)targets.data_ptr(), (float*)loss.data_ptr(),
+      (float*)nll_loss.data_ptr(), (float*)lse.data_ptr(),
+      (float*)loss_buffer.data_ptr(), (float*)stats_buffer.data_ptr(),
+      (T*)logits_buffer.data_ptr(), padding_idx, epsilon, num_tokens,
+      hidden_size, vocab_size, chunk_size, handle, stream);
+  return {loss, nll_loss, lse};
+}
+
+// Returns {grad_inputs, grad_weight} from the lse of the forward.
+template <typename T>
+std::vector<torch::Tensor> torch_fused_linear_cross_entropy_bw(
+    const torch::Tensor& grad_loss, const torch::Tensor& inputs,
+    const torch::Tensor& weight, const torch::Tensor& targets,
+    const torch::Tensor& lse, int padding_idx, float epsilon,
+    int chunk_size) {
+  CHECK_INPUT(grad_loss);
+  CHECK_INPUT(inputs);
+  CHECK_INPUT(weight);
+  CHECK_INPUT(targets);
+  CHECK_INPUT(lse);
+  int hidden_size = weight.size(1);
+  int vocab_size = weight.size(0);
+  int num_tokens = inputs.numel() / hidden_size;
+  chunk_size = std::min(chunk_size, vocab_size);
+
+  torch::Tensor grad_inputs = torch::empty_like(inputs);
+  torch::Tensor grad_weight = torch::empty_like(weight);
+  torch::Tensor logits_buffer =
+      torch::empty({num_tokens, chunk_size}, inputs.options());
+
+  cublasHandle_t handle = at::cuda::getCurrentCUDABlasHandle();
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  cuda::launch_fused_linear_cross_entropy_bw<T>(
+      (const float*)grad_loss.data_ptr(), (const T*)inputs.data_ptr(),
+      (const T*)weight.data_ptr(), (const int*)targets.data_ptr(),
+      (const float*)lse.data_ptr(), (T*)grad_inputs.data_ptr(),
+      (T*)grad_weight.data_ptr(), (T*)logits_buffer.data_ptr(), padding_idx,
+      epsilon, num_tokens, hidden_size, vocab_size, chunk_size, handle,
+      stream);
+  return {grad_inputs, grad_weight};
+}
+
 }  // namespace lightseq
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
@@ -74,4 +147,16 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         &lightseq::torch_split_head_op<float, float>, "empty");
   m.def("torch_split_head_op_fp16",
         &lightseq::torch_split_head_op<__half, __half>, "empty");
+  m.def("torch_fused_linear_cross_entropy_fw_fp32",
+        &lightseq::torch_fused_linear_cross_entropy_fw<float>,
+        "Fused linear and cross entropy forward with fp32 (CUDA)");
+  m.def("torch_fused_linear_cross_entropy_fw_fp16",
+        &lightseq::torch_fused_linear_cross_entropy_fw<__half>,
+        "Fused linear and cross entropy forward with fp16 (CUDA)");
+  m.def("torch_fused_linear_cross_entropy_bw_fp32",
+        &lightseq::torch_fused_linear_cross_entropy_bw<float>,
+        "Fused linear and cross entropy backward with fp32 (CUDA)");
+  m.def("torch_fused_linear_cross_entropy_bw_fp16",
+        &lightseq::torch_fused_linear_cross_entropy_bw<__half>,
+        "Fused linear and cross entropy backward with fp16 (CUDA)");
 }
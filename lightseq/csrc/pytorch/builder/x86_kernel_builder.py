@@ -23,6 +23,10 @@ class X86KernelBuilder(OpBuilder):
         return [
             "csrc/kernels/x86/util.cc",
             "csrc/kernels/x86/gemm.cpp",
+            "csrc/kernels/x86/transformer_kernels.cpp",
+            "csrc/kernels/x86/simd_rows_avx512.cpp",
+            "csrc/kernels/x86/simd_rows_avx2.cpp",
+            "csrc/kernels/x86/simd_rows_generic.cpp",
             "csrc/pybind/pybind_kernel_x86.cpp",
         ]
 
@@ -0,0 +1,404 @@
+#include <algorithm>
+#include <sstream>
+
+#include "batch_scheduler.h"
+#include "cuda_util.h"
+#include "model_base.h"
+
+namespace lightseq {
+namespace server {
+
+namespace {
+
+// pops an idle worker tries before it sleeps.
+const int kIdleSpins = 2000;
+// bounds the sleep of an idle worker, in case a notification is missed.
+const std::chrono::milliseconds kIdleSleep(1);
+
+double ms_since(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+// adds label to every sample of the metrics text, and drops its comments
+// unless keep_comments, so that the metrics of several models merge.
+std::string add_label(const std::string& text, const std::string& label,
+                      bool keep_comments) {
+  std::istringstream in(text);
+  std::ostringstream out;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty()) continue;
+    if (line[0] == '#') {
+      if (keep_comments) out << line << "\n";
+      continue;
+    }
+    size_t brace = line.find('{');
+    size_t space = line.find(' ');
+    if (brace != std::string::npos && brace < space) {
+      out << line.substr(0, brace + 1) << label << ","
+          << line.substr(brace + 1) << "\n";
+    } else {
+      out << line.substr(0, space) << "{" << label << "}"
+          << line.substr(space) << "\n";
+    }
+  }
+  return out.str();
+}
+
+}  // namespace
+
+struct BatchScheduler::Worker {
+  int gpu;
+  lightseq::cuda::LSModel* model = nullptr;
+  int max_batch_size = 0;
+  int max_seq_len = 0;
+  // 0 if the model does not tell
+  int vocab_size = 0;
+  void* d_input = nullptr;
+  // pinned, of the max input shape
+  int* h_input = nullptr;
+  std::vector<void*> d_outputs;
+  // the outputs of int32 or fp32, the other ones are not returned
+  std::vector<int> outputs;
+  // the end of the last batch, see BatchPolicy::idle_release_ms
+  Clock::time_point last_batch;
+  bool suspended = false;
+};
+
+BatchScheduler::BatchScheduler(const std::string& model_name,
+                               const std::string& weights,
+                               const std::vector<int>& gpus,
+                               const BatchPolicy& policy, int pad_id,
+                               bool pad_left)
+    : _model_name(model_name),
+      _weights(weights),
+      _gpus(gpus),
+      _policy(policy),
+      _pad_id(pad_id),
+      _pad_left(pad_left),
+      _queue(policy.queue_capacity),
+      _metrics(nullptr) {
+  if (_gpus.empty()) {
+    throw std::runtime_error("BatchScheduler needs at least one gpu");
+  }
+  if (_policy.max_batch_size < 1) {
+    throw std::runtime_error("max_batch_size should be positive");
+  }
+}
+
+BatchScheduler::~BatchScheduler() { stop(); }
+
+void BatchScheduler::load_model(Worker* worker) {
+  CHECK_GPU_ERROR(cudaSetDevice(worker->gpu));
+  worker->model = lightseq::cuda::LSModelFactory::GetInstance().CreateModel(
+      _model_name, _weights, _policy.max_batch_size,
+      lightseq::cuda::kNotSupported, lightseq::cuda::model_options_from_env());
+  lightseq::cuda::LSModel* model = worker->model;
+  if (model->get_input_dtype(0) != lightseq::cuda::kInt32) {
+    throw std::runtime_error(_model_name + " does not take int32 tokens");
+  }
+  std::vector<int> input_shape = model->get_input_max_shape(0);
+  worker->max_batch_size = std::min(_policy.max_batch_size, input_shape[0]);
+  worker->max_seq_len = input_shape[1];
+  worker->vocab_size = model->get_input_vocab_size(0);
+  size_t input_size = sizeof(int) * input_shape[0] * input_shape[1];
+  CHECK_GPU_ERROR(cudaMalloc(&worker->d_input, input_size));
+  CHECK_GPU_ERROR(cudaMallocHost(&worker->h_input, input_size));
+  model->set_input_ptr(0, worker->d_input);
+
+  for (int i = 0; i < model->get_output_size(); i++) {
+    std::vector<int> shape = model->get_output_max_shape(i);
+    size_t total_size = 1;
+    for (int dim : shape) total_size *= dim;
+    void* d_output;
+    // large enough for the outputs of 4 bytes, the widest ones.
+    CHECK_GPU_ERROR(cudaMalloc(&d_output, total_size * sizeof(int)));
+    model->set_output_ptr(i, d_output);
+    worker->d_outputs.push_back(d_output);
+
+    lightseq::cuda::DataType dtype = model->get_output_dtype(i);
+    if (dtype == lightseq::cuda::kInt32 || dtype == lightseq::cuda::kFloat32) {
+      worker->outputs.push_back(i);
+    } else if (worker->gpu == _gpus[0]) {
+      printf("lightseq_server does not support the dtype %d of output %s, "
+             "it is not returned\n",
+             int(dtype), model->get_output_name(i).c_str());
+    }
+  }
+}
+
+void BatchScheduler::worker_loop(Worker* worker, std::promise<void>* ready) {
+  try {
+    load_model(worker);
+  } catch (...) {
+    ready->set_exception(std::current_exception());
+    return;
+  }
+  ready->set_value();
+
+  worker->last_batch = Clock::now();
+  InferRequestPtr carry;
+  std::vector<InferRequestPtr> batch;
+  while (true) {
+    InferRequestPtr first = carry ? std::move(carry) : pop_wait(worker);
+    if (!first) break;
+    if (!check_queue_time(first)) continue;
+
+    int seq_len = first->tokens.size();
+    Clock::time_point deadline =
+        first->arrival + std::chrono::microseconds(
+                             int64_t(_policy.max_queue_delay_ms * 1e3));
+    batch.push_back(std::move(first));
+    while (int(batch.size()) < worker->max_batch_size) {
+      InferRequestPtr next = pop_until(deadline);
+      if (!next) break;
+      if (!check_queue_time(next)) continue;
+      int next_len = std::max(seq_len, int(next->tokens.size()));
+      if (_policy.max_batch_tokens > 0 &&
+          (batch.size() + 1) * next_len > size_t(_policy.max_batch_tokens)) {
+        carry = std::move(next);
+        break;
+      }
+      seq_len = next_len;
+      batch.push_back(std::move(next));
+    }
+    run_batch(worker, batch);
+    batch.clear();
+  }
+}
+
+InferRequestPtr BatchScheduler::pop_wait(Worker* worker) {
+  InferRequestPtr request;
+  while (!_stopping.load()) {
+    for (int i = 0; i < kIdleSpins; i++) {
+      if (_queue.try_pop(request)) return request;
+      std::this_thread::yield();
+    }
+    if (_policy.idle_release_ms > 0 && !worker->suspended &&
+        ms_since(worker->last_batch) > _policy.idle_release_ms) {
+      try {
+        worker->model->suspend();
+      } catch (std::exception& e) {
+        printf("gpu %d failed to suspend its model: %s\n", worker->gpu,
+               e.what());
+      }
+      // not retried, the next batch resumes the model anyway.
+      worker->suspended = true;
+    }
+    std::unique_lock<std::mutex> lock(_idle_mutex);
+    _idle_workers++;
+    // checked again after the increment, so that a submit which missed the
+    // sleeping worker queued its request before.
+    if (!_queue.try_pop(request) && !_stopping.load()) {
+      _idle_cv.wait_for(lock, kIdleSleep);
+    }
+    _idle_workers--;
+    if (request) return request;
+  }
+  return nullptr;
+}
+
+InferRequestPtr BatchScheduler::pop_until(Clock::time_point deadline) {
+  InferRequestPtr request;
+  do {
+    if (_queue.try_pop(request)) return request;
+    std::this_thread::yield();
+  } while (Clock::now() < deadline && !_stopping.load());
+  return nullptr;
+}
+
+bool BatchScheduler::check_queue_time(InferRequestPtr& request) {
+  double queue_ms = ms_since(request->arrival);
+  _metrics.observe("server_queue_ms", queue_ms);
+  if (_policy.max_queue_time_ms <= 0 || queue_ms <= _policy.max_queue_time_ms) {
+    return true;
+  }
+  InferResult result;
+  result.status = 504;
+  result.error = "the request waited longer than the max queue time";
+  finish(request, std::move(result));
+  return false;
+}
+
+void BatchScheduler::run_batch(Worker* worker,
+                               std::vector<InferRequestPtr>& batch) {
+  lightseq::cuda::LSModel* model = worker->model;
+  int batch_size = batch.size();
+  int seq_len = 0;
+  for (InferRequestPtr& request : batch) {
+    seq_len = std::max(seq_len, int(request->tokens.size()));
+  }
+  std::fill(worker->h_input, worker->h_input + batch_size * seq_len, _pad_id);
+  for (int row = 0; row < batch_size; row++) {
+    const std::vector<int>& tokens = batch[row]->tokens;
+    int offset = row * seq_len + (_pad_left ? seq_len - tokens.size() : 0);
+    std::copy(tokens.begin(), tokens.end(), worker->h_input + offset);
+  }
+
+  std::vector<InferResult> results(batch_size);
+  Clock::time_point start = Clock::now();
+  try {
+    CHECK_GPU_ERROR(cudaMemcpy(worker->d_input, worker->h_input,
+                               sizeof(int) * batch_size * seq_len,
+                               cudaMemcpyHostToDevice));
+    model->set_input_shape(0, {batch_size, seq_len});
+    model->Infer();
+
+    for (int i : worker->outputs) {
+      std::vector<int> shape = model->get_output_shape(i);
+      size_t row_size = 1;
+      for (size_t j = 1; j < shape.size(); j++) row_size *= shape[j];
+      bool is_int = model->get_output_dtype(i) == lightseq::cuda::kInt32;
+      // the outputs of both dtypes are 4 bytes.
+      std::vector<int> data(row_size * batch_size);
+      CHECK_GPU_ERROR(cudaMemcpy(data.data(), model->get_output_ptr(i),
+                                 sizeof(int) * data.size(),
+                                 cudaMemcpyDeviceToHost));
+      for (int row = 0; row < batch_size; row++) {
+        InferOutput output;
+        output.name = model->get_output_name(i);
+        output.shape.assign(shape.begin() + 1, shape.end());
+        output.is_int = is_int;
+        const int* begin = data.data() + row * row_size;
+        if (is_int) {
+          output.int_data.assign(begin, begin + row_size);
+        } else {
+          const float* fbegin = reinterpret_cast<const float*>(begin);
+          output.float_data.assign(fbegin, fbegin + row_size);
+        }
+        results[row].outputs.push_back(std::move(output));
+      }
+    }
+  } catch (std::exception& e) {
+    for (InferResult& result : results) {
+      result.status = 500;
+      result.error = e.what();
+      result.outputs.clear();
+    }
+  }
+  _metrics.observe("server_infer_ms", ms_since(start));
+  _metrics.observe("server_batch_size", batch_size);
+  _metrics.add("server_batches_total", 1,
+               "gpu=\"" + std::to_string(worker->gpu) + "\"");
+  for (int row = 0; row < batch_size; row++) {
+    finish(batch[row], std::move(results[row]));
+  }
+  worker->last_batch = Clock::now();
+  worker->suspended = false;
+}
+
+void BatchScheduler::finish(InferRequestPtr& request, InferResult result) {
+  _metrics.add("server_requests_total", 1,
+               "status=\"" + std::to_string(result.status) + "\"");
+  _metrics.observe("server_request_ms", ms_since(request->arrival));
+  request->result.set_value(std::move(result));
+  request.reset();
+}
+
+void BatchScheduler::start() {
+  std::vector<std::promise<void>> ready(_gpus.size());
+  for (size_t i = 0; i < _gpus.size(); i++) {
+    _workers.emplace_back(new Worker());
+    _workers[i]->gpu = _gpus[i];
+  }
+  for (size_t i = 0; i < _gpus.size(); i++) {
+    _threads.emplace_back(&BatchScheduler::worker_loop, this,
+                          _workers[i].get(), &ready[i]);
+  }
+  try {
+    for (std::promise<void>& worker_ready : ready) {
+      worker_ready.get_future().get();
+    }
+  } catch (...) {
+    stop();
+    throw;
+  }
+  _max_seq_len = _workers[0]->max_seq_len;
+  _vocab_size = _workers[0]->vocab_size;
+}
+
+void BatchScheduler::stop() {
+  _stopping.store(true);
+  {
+    std::lock_guard<std::mutex> lock(_idle_mutex);
+    _idle_cv.notify_all();
+  }
+  for (std::thread& thread : _threads) thread.join();
+  _threads.clear();
+
+  InferRequestPtr request;
+  while (_queue.try_pop(request)) {
+    InferResult result;
+    result.status = 503;
+    result.error = "the server is stopping";
+    finish(request, std::move(result));
+  }
+  for (std::unique_ptr<Worker>& worker : _workers) {
+    if (worker->model == nullptr) continue;
+    CHECK_GPU_ERROR(cudaSetDevice(worker->gpu));
+    delete worker->model;
+    CHECK_GPU_ERROR(cudaFree(worker->d_input));
+    CHECK_GPU_ERROR(cudaFreeHost(worker->h_input));
+    for (void* d_output : worker->d_outputs) {
+      CHECK_GPU_ERROR(cudaFree(d_output));
+    }
+    worker->model = nullptr;
+  }
+}
+
+std::future<InferResult> BatchScheduler::submit(std::vector<int> tokens) {
+  InferRequestPtr request(new InferRequest());
+  std::future<InferResult> res = request->result.get_future();
+  request->arrival = Clock::now();
+  if (tokens.empty() || int(tokens.size()) > _max_seq_len) {
+    InferResult result;
+    result.status = 400;
+    result.error = "the request should have 1 to " +
+                   std::to_string(_max_seq_len) + " tokens";
+    finish(request, std::move(result));
+    return res;
+  }
+  // the embedding lookups do not check the ids.
+  for (int token : tokens) {
+    if (token < 0 || (_vocab_size > 0 && token >= _vocab_size)) {
+      InferResult result;
+      result.status = 400;
+      result.error = "token id " + std::to_string(token) + " is out of [0, " +
+                     (_vocab_size > 0 ? std::to_string(_vocab_size)
+                                      : std::string("inf")) +
+                     ")";
+      finish(request, std::move(result));
+      return res;
+    }
+  }
+  request->tokens = std::move(tokens);
+  if (_stopping.load() || !_queue.try_push(std::move(request))) {
+    InferResult result;
+    result.status = 503;
+    result.error = _stopping.load() ? "the server is stopping"
+                                    : "the request queue is full";
+    finish(request, std::move(result));
+    return res;
+  }
+  if (_idle_workers.load() > 0) {
+    std::lock_guard<std::mutex> lock(_idle_mutex);
+    _idle_cv.notify_one();
+  }
+  return res;
+}
+
+std::string BatchScheduler::metrics_text() const {
+  _metrics.set("server_queue_depth", _queue.size_approx());
+  std::string res = _metrics.prometheus_text();
+  for (size_t i = 0; i < _workers.size(); i++) {
+    if (_workers[i]->model == nullptr) continue;
+    res += add_label(_workers[i]->model->metrics_text(),
+                     "gpu=\"" + std::to_string(_workers[i]->gpu) + "\"",
+                     i == 0);
+  }
+  return res;
+}
+
+}  // namespace server
+}  // namespace lightseq
@@ -0,0 +1,349 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+#include "http_frontend.h"
+
+namespace lightseq {
+namespace server {
+
+namespace {
+
+const size_t kMaxHeaderBytes = 16 << 10;
+const size_t kMaxBodyBytes = 16 << 20;
+
+const char* status_text(int status) {
+  switch (status) {
+    case 200:
+      return "OK";
+    case 400:
+      return "Bad Request";
+    case 404:
+      return "Not Found";
+    case 405:
+      return "Method Not Allowed";
+    case 413:
+      return "Payload Too Large";
+    case 503:
+      return "Service Unavailable";
+    case 504:
+      return "Gateway Timeout";
+    default:
+      return "Internal Server Error";
+  }
+}
+
+std::string lower(std::string str) {
+  std::transform(str.begin(), str.end(), str.begin(), ::tolower);
+  return str;
+}
+
+std::string json_string(const std::string& str) {
+  std::string res = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      res += '\\';
+      res += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      res += escaped;
+    } else {
+      res += c;
+    }
+  }
+  return res + "\"";
+}
+
+std::string json_error(const std::string& error) {
+  return "{\"error\": " + json_string(error) + "}\n";
+}
+
+// the ints of {"tokens": [...]}, the other keys of the body are ignored.
+bool parse_tokens(const std::string& body, std::vector<int>* tokens) {
+  size_t pos = body.find("\"tokens\"");
+  if (pos == std::string::npos) return false;
+  const char* ptr = body.c_str() + pos + strlen("\"tokens\"");
+  auto skip_spaces = [&]() {
+    while (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n') ptr++;
+  };
+  skip_spaces();
+  if (*ptr++ != ':') return false;
+  skip_spaces();
+  if (*ptr++ != '[') return false;
+  skip_spaces();
+  if (*ptr == ']') return true;
+  while (true) {
+    char* end;
+    errno = 0;
+    long token = strtol(ptr, &end, 10);
+    if (end == ptr || errno == ERANGE || token < INT_MIN || token > INT_MAX) {
+      return false;
+    }
+    tokens->push_back(token);
+    ptr = end;
+    skip_spaces();
+    if (*ptr == ']') return true;
+    if (*ptr++ != ',') return false;
+    skip_spaces();
+  }
+}
+
+std::string json_result(const InferResult& result) {
+  std::ostringstream out;
+  out << "{\"outputs\": [";
+  for (size_t i = 0; i < result.outputs.size(); i++) {
+    const InferOutput& output = result.outputs[i];
+    out << (i ? ", " : "") << "{\"name\": " << json_string(output.name)
+        << ", \"shape\": [";
+    for (size_t j = 0; j < output.shape.size(); j++) {
+      out << (j ? ", " : "") << output.shape[j];
+    }
+    out << "], \"data\": [";
+    if (output.is_int) {
+      for (size_t j = 0; j < output.int_data.size(); j++) {
+        out << (j ? ", " : "") << output.int_data[j];
+      }
+    } else {
+      char value[32];
+      for (size_t j = 0; j < output.float_data.size(); j++) {
+        float data = output.float_data[j];
+        if (std::isfinite(data)) {
+          snprintf(value, sizeof(value), "%.9g", data);
+        } else {
+          snprintf(value, sizeof(value), "null");
+        }
+        out << (j ? ", " : "") << value;
+      }
+    }
+    out << "]}";
+  }
+  out << "]}\n";
+  return out.str();
+}
+
+// false once the peer closed the connection.
+bool recv_more(int fd, std::string* buffer) {
+  char chunk[16 << 10];
+  while (true) {
+    ssize_t res = recv(fd, chunk, sizeof(chunk), 0);
+    if (res > 0) {
+      buffer->append(chunk, res);
+      return true;
+    }
+    if (res < 0 && errno == EINTR) continue;
+    return false;
+  }
+}
+
+bool send_all(int fd, const std::string& data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t res = send(fd, data.data() + sent, data.size() - sent,
+                       MSG_NOSIGNAL);
+    if (res < 0 && errno == EINTR) continue;
+    if (res <= 0) return false;
+    sent += res;
+  }
+  return true;
+}
+
+bool send_response(int fd, int status, const std::string& content_type,
+                   const std::string& body, bool keep_alive) {
+  std::ostringstream out;
+  out << "HTTP/1.1 " << status << " " << status_text(status) << "\r\n"
+      << "Content-Type: " << content_type << "\r\n"
+      << "Content-Length: " << body.size() << "\r\n";
+  if (!keep_alive) out << "Connection: close\r\n";
+  out << "\r\n" << body;
+  return send_all(fd, out.str());
+}
+
+}  // namespace
+
+HttpFrontend::HttpFrontend(BatchScheduler& scheduler, const std::string& host,
+                           int port, int max_connections)
+    : _scheduler(scheduler), _port(port), _max_connections(max_connections) {
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+    throw std::runtime_error("invalid ipv4 address " + host + " to listen on");
+  }
+  _listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (_listen_fd < 0) {
+    throw std::runtime_error(std::string("failed to create the socket, ") +
+                             strerror(errno));
+  }
+  int enable = 1;
+  setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  if (bind(_listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(_listen_fd, 128) < 0) {
+    std::string error = strerror(errno);
+    close(_listen_fd);
+    throw std::runtime_error("failed to listen on " + host + ":" +
+                             std::to_string(port) + ", " + error);
+  }
+}
+
+HttpFrontend::~HttpFrontend() {
+  if (_listen_fd >= 0) close(_listen_fd);
+}
+
+void HttpFrontend::stop() {
+  // only async-signal-safe calls, see the class comment.
+  _stopping.store(true);
+  shutdown(_listen_fd, SHUT_RDWR);
+}
+
+void HttpFrontend::run() {
+  printf("lightseq_server listening on port %d\n", _port);
+  while (!_stopping.load()) {
+    int fd = accept(_listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (_stopping.load()) break;
+      // eg. out of file descriptors, retried after a while.
+      if (errno != EINTR) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      continue;
+    }
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    {
+      std::lock_guard<std::mutex> lock(_connection_mutex);
+      if (int(_connections.size()) >= _max_connections) {
+        send_response(fd, 503, "application/json",
+                      json_error("too many connections"), false);
+        close(fd);
+        continue;
+      }
+      _connections.insert(fd);
+    }
+    std::thread(&HttpFrontend::serve_connection, this, fd).detach();
+  }
+
+  // the requests in flight are still answered, the idle connections close.
+  {
+    std::lock_guard<std::mutex> lock(_connection_mutex);
+    for (int fd : _connections) shutdown(fd, SHUT_RD);
+  }
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(_connection_mutex);
+      if (_connections.empty()) break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+void HttpFrontend::serve_connection(int fd) {
+  std::string buffer;
+  bool keep_alive = true;
+  while (keep_alive) {
+    size_t header_end;
+    bool open = true;
+    while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos &&
+           buffer.size() <= kMaxHeaderBytes && open) {
+      open = recv_more(fd, &buffer);
+    }
+    if (!open) break;
+    if (header_end == std::string::npos) {
+      send_response(fd, 413, "application/json",
+                    json_error("the headers are too large"), false);
+      break;
+    }
+
+    std::istringstream header(buffer.substr(0, header_end));
+    std::string method, path, version, line;
+    header >> method >> path >> version;
+    std::getline(header, line);
+    size_t content_length = 0;
+    std::string connection;
+    while (std::getline(header, line)) {
+      size_t colon = line.find(':');
+      if (colon == std::string::npos) continue;
+      std::string key = lower(line.substr(0, colon));
+      std::string value = line.substr(colon + 1);
+      value.erase(0, value.find_first_not_of(" \t"));
+      value.erase(value.find_last_not_of(" \t\r") + 1);
+      if (key == "content-length") {
+        content_length = strtoull(value.c_str(), nullptr, 10);
+      } else if (key == "connection") {
+        connection = lower(value);
+      }
+    }
+    keep_alive = version == "HTTP/1.1" ? connection != "close"
+                                       : connection == "keep-alive";
+    if (content_length > kMaxBodyBytes) {
+      send_response(fd, 413, "application/json",
+                    json_error("the body is too large"), false);
+      break;
+    }
+
+    size_t request_size = header_end + 4 + content_length;
+    while (buffer.size() < request_size && open) {
+      open = recv_more(fd, &buffer);
+    }
+    if (!open) break;
+    std::string body = buffer.substr(header_end + 4, content_length);
+    buffer.erase(0, request_size);
+
+    std::string response, content_type = "application/json";
+    int status = handle(method, path.substr(0, path.find('?')), body,
+                        &response, &content_type);
+    if (!send_response(fd, status, content_type, response, keep_alive)) {
+      break;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(_connection_mutex);
+  _connections.erase(fd);
+  close(fd);
+}
+
+int HttpFrontend::handle(const std::string& method, const std::string& path,
+                         const std::string& body, std::string* response,
+                         std::string* content_type) {
+  if (path == "/v1/infer") {
+    if (method != "POST") {
+      *response = json_error("/v1/infer takes a POST");
+      return 405;
+    }
+    std::vector<int> tokens;
+    if (!parse_tokens(body, &tokens)) {
+      *response = json_error("the body should be {\"tokens\": [...]}");
+      return 400;
+    }
+    InferResult result = _scheduler.submit(std::move(tokens)).get();
+    *response =
+        result.status == 200 ? json_result(result) : json_error(result.error);
+    return result.status;
+  }
+  if (path == "/v1/health") {
+    *content_type = "text/plain";
+    *response = "ok\n";
+    return 200;
+  }
+  if (path == "/metrics") {
+    *content_type = "text/plain; version=0.0.4";
+    *response = _scheduler.metrics_text();
+    return 200;
+  }
+  *response = json_error("no route " + path);
+  return 404;
+}
+
+}  // namespace server
+}  // namespace lightseq
@@ -0,0 +1,150 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+#include "mpmc_queue.h"
+
+namespace lightseq {
+namespace server {
+
+using Clock = std::chrono::steady_clock;
+
+// How the queued requests are batched into the Infer of a worker.
+struct BatchPolicy {
+  // rows of an Infer, bounded by the max batch size of the model
+  int max_batch_size = 8;
+  // padded tokens (rows * longest row) of an Infer, 0 for no limit
+  int max_batch_tokens = 0;
+  // an Infer waits up to this long after the arrival of its first request
+  // for more of them, 0 runs what is queued right away
+  double max_queue_delay_ms = 0;
+  // requests which waited longer in the queue fail with 504, 0 never
+  double max_queue_time_ms = 0;
+  // requests beyond fail with 503
+  size_t queue_capacity = 1024;
+  // a worker idle this long suspends its model, which gives the memory of
+  // the activations and the kv caches back until the next batch, see
+  // LSModel::suspend. 0 never
+  double idle_release_ms = 0;
+};
+
+// The rows of every output of the model, of int32 or fp32.
+struct InferOutput {
+  std::string name;
+  // of the row, without the batch dim
+  std::vector<int> shape;
+  std::vector<int> int_data;
+  std::vector<float> float_data;
+  bool is_int = true;
+};
+
+struct InferResult {
+  // an http status, 200 on success
+  int status = 200;
+  std::string error;
+  std::vector<InferOutput> outputs;
+};
+
+struct InferRequest {
+  std::vector<int> tokens;
+  Clock::time_point arrival;
+  std::promise<InferResult> result;
+};
+
+using InferRequestPtr = std::unique_ptr<InferRequest>;
+
+/*
+  - Class: BatchScheduler
+  - Description:
+      Serves the requests of any number of frontend threads with a model of
+  LSModelFactory on every gpu. submit() pushes the request into a lock-free
+  MpmcQueue, the worker thread of every gpu pops the requests and batches
+  them into one Infer by the BatchPolicy: a batch is run once it has
+  max_batch_size rows, once the next request would exceed max_batch_tokens,
+  or max_queue_delay_ms after its first request arrived. The rows are padded
+  with pad_id, on the right, or on the left for the generative models, into
+  the [batch_size, seq_len] input 0 of the model.
+
+      The queue is used without a lock. An idle worker spins for a while
+  and then sleeps on a condition variable, which submit() only notifies
+  while some worker sleeps. A worker waiting for its batch to fill spins
+  until max_queue_delay_ms. A worker idle for idle_release_ms suspends its
+  model, the next batch resumes it.
+
+      The models are created by the worker threads, each on its gpu and with
+  a context of its own, so they run concurrently.
+  - Implementation file: batch_scheduler.cc
+*/
+class BatchScheduler {
+ private:
+  struct Worker;
+
+  std::string _model_name;
+  std::string _weights;
+  std::vector<int> _gpus;
+  BatchPolicy _policy;
+  int _pad_id;
+  bool _pad_left;
+
+  MpmcQueue<InferRequestPtr> _queue;
+  std::vector<std::unique_ptr<Worker>> _workers;
+  std::vector<std::thread> _threads;
+  std::atomic<bool> _stopping{false};
+  int _max_seq_len = 0;
+  int _vocab_size = 0;
+
+  std::atomic<int> _idle_workers{0};
+  std::mutex _idle_mutex;
+  std::condition_variable _idle_cv;
+
+  // exported from the frontend threads, see metrics_text.
+  mutable Metrics _metrics;
+
+  void worker_loop(Worker* worker, std::promise<void>* ready);
+  void load_model(Worker* worker);
+  // the next request, nullptr once stopping.
+  InferRequestPtr pop_wait(Worker* worker);
+  // the next request arriving before deadline, nullptr if none.
+  InferRequestPtr pop_until(Clock::time_point deadline);
+  // false, after failing the request, when it waited too long.
+  bool check_queue_time(InferRequestPtr& request);
+  void run_batch(Worker* worker, std::vector<InferRequestPtr>& batch);
+  void finish(InferRequestPtr& request, InferResult result);
+
+ public:
+  BatchScheduler(const std::string& model_name, const std::string& weights,
+                 const std::vector<int>& gpus, const BatchPolicy& policy,
+                 int pad_id = 0, bool pad_left = false);
+  ~BatchScheduler();
+
+  // Loads the models and starts the workers, rethrows the error of a model
+  // which failed to load.
+  void start();
+  // Stops the workers after their running batch, the queued requests fail
+  // with 503.
+  void stop();
+
+  // The result of the row tokens, which fails right away with 400 if it is
+  // longer than max_seq_len() or has an id out of [0, vocab_size()), and
+  // with 503 if the queue is full.
+  std::future<InferResult> submit(std::vector<int> tokens);
+
+  int max_seq_len() const { return _max_seq_len; }
+  // 0 if the model does not tell, only the negative ids are rejected then.
+  int vocab_size() const { return _vocab_size; }
+
+  // The metrics of the scheduler, and those of the models labeled by gpu,
+  // in the Prometheus text exposition format.
+  std::string metrics_text() const;
+};
+
+}  // namespace server
+}  // namespace lightseq
@@ -0,0 +1,60 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "batch_scheduler.h"
+
+namespace lightseq {
+namespace server {
+
+/*
+  - Class: HttpFrontend
+  - Description:
+      A minimal HTTP/1.1 frontend of a BatchScheduler on POSIX sockets, with
+  keep-alive connections served by a thread each and TCP_NODELAY, so that a
+  request costs no connection setup and no Nagle delay:
+
+    POST /v1/infer    {"tokens": [63, 47, 65]}
+      -> {"outputs": [{"name": "target_ids", "shape": [4, 12],
+                        "data": [...]}, ...]}
+      every output of the model for the row, without the batch dim. Errors
+      are {"error": "..."} with the status of the InferResult.
+    GET /v1/health    200 once the models are loaded
+    GET /metrics      BatchScheduler::metrics_text()
+
+      stop() may be called from a signal handler.
+  - Implementation file: http_frontend.cc
+*/
+class HttpFrontend {
+ private:
+  BatchScheduler& _scheduler;
+  int _port;
+  int _max_connections;
+  int _listen_fd = -1;
+  std::atomic<bool> _stopping{false};
+
+  std::mutex _connection_mutex;
+  std::set<int> _connections;
+
+  void serve_connection(int fd);
+  // the status and the body of the response.
+  int handle(const std::string& method, const std::string& path,
+             const std::string& body, std::string* response,
+             std::string* content_type);
+
+ public:
+  // Listens on the ipv4 address host, eg. 127.0.0.1 for the local clients
+  // only or 0.0.0.0 for all the interfaces.
+  HttpFrontend(BatchScheduler& scheduler, const std::string& host, int port,
+               int max_connections);
+  ~HttpFrontend();
+
+  // Serves until stop(), then waits for the open connections to close.
+  void run();
+  void stop();
+};
+
+}  // namespace server
+}  // namespace lightseq
@@ -0,0 +1,114 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace lightseq {
+namespace server {
+
+/*
+  - Class: MpmcQueue
+  - Description:
+      A bounded lock-free queue of many producers and many consumers, the
+  ring of D. Vyukov: every cell has a sequence number telling whether it is
+  free for the producer of ticket pos (sequence == pos) or holds the value
+  for the consumer of ticket pos (sequence == pos + 1). Producers and
+  consumers only contend on their own position counter with one
+  compare-and-swap, and never wait for each other, so a full queue fails
+  try_push instead of blocking the producer.
+
+      The capacity is rounded up to a power of 2.
+*/
+template <typename T>
+class MpmcQueue {
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  // the positions of the producers and of the consumers on their own cache
+  // lines.
+  static const size_t kCacheLine = 64;
+
+  std::unique_ptr<Cell[]> _cells;
+  size_t _mask;
+  alignas(kCacheLine) std::atomic<size_t> _enqueue_pos{0};
+  alignas(kCacheLine) std::atomic<size_t> _dequeue_pos{0};
+
+ public:
+  explicit MpmcQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+    _cells.reset(new Cell[size]);
+    _mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+      _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpmcQueue(const MpmcQueue&) = delete;
+  MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+  // false if the queue is full, value is then left unchanged.
+  bool try_push(T&& value) {
+    size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &_cells[pos & _mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = intptr_t(seq) - intptr_t(pos);
+      if (diff == 0) {
+        if (_enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = _enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = std::move(value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // false if the queue is empty.
+  bool try_pop(T& value) {
+    size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &_cells[pos & _mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+      if (diff == 0) {
+        if (_dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = _dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    value = std::move(cell->data);
+    cell->sequence.store(pos + _mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // the values queued, exact only while no one pushes or pops.
+  size_t size_approx() const {
+    size_t enqueued = _enqueue_pos.load(std::memory_order_relaxed);
+    size_t dequeued = _dequeue_pos.load(std::memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+  }
+
+  size_t capacity() const { return _mask + 1; }
+};
+
+}  // namespace server
+}  // namespace lightseq
@@ -0,0 +1,134 @@
+#include <csignal>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "batch_scheduler.h"
+#include "http_frontend.h"
+
+/**
+@file
+Standalone HTTP server of the models of LSModelFactory, the replacement of
+the TensorRT Inference Server custom backends of inference/server.
+
+The requests of the frontend threads go through a lock-free queue to the
+worker thread of every gpu of --gpus, which batches them into one Infer of
+up to --max_batch_size rows and --max_batch_tokens padded tokens. A batch
+waits at most --max_queue_delay_ms after its first request for more of them,
+the requests which waited longer than --max_queue_time_ms fail with 504, the
+ones beyond --queue_capacity with 503. A worker idle for --idle_release_ms
+gives the memory of the activations and the kv caches of its model back to
+the gpu until its next batch, for gpus shared with other processes. The server
+only listens on the loopback address unless --host says otherwise, eg.
+0.0.0.0 for all the interfaces. See BatchScheduler and HttpFrontend.
+
+Usage:
+  lightseq_server --weights model.hdf5 [--model Transformer] [--gpus 0,1]
+      [--host 127.0.0.1] [--port 8000] [--max_batch_size 8]
+      [--max_batch_tokens 0]
+      [--max_queue_delay_ms 1] [--max_queue_time_ms 0]
+      [--queue_capacity 1024] [--max_connections 256] [--pad_id 0]
+      [--pad_side right|left] [--idle_release_ms 0]
+
+  curl -d '{"tokens": [63, 47, 65, 1507, 88, 74]}' localhost:8000/v1/infer
+
+The generative models, eg. Gpt and Llama, take the prompts padded on the
+left.
+*/
+
+namespace {
+
+struct Options {
+  std::string model = "Transformer";
+  std::string weights;
+  std::vector<int> gpus = {0};
+  std::string host = "127.0.0.1";
+  int port = 8000;
+  int max_connections = 256;
+  int pad_id = 0;
+  bool pad_left = false;
+  lightseq::server::BatchPolicy policy;
+};
+
+Options parse_options(int argc, char* argv[]) {
+  Options opt;
+  opt.policy.max_queue_delay_ms = 1;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string key = argv[i], value = argv[i + 1];
+    if (key == "--model") {
+      opt.model = value;
+    } else if (key == "--weights") {
+      opt.weights = value;
+    } else if (key == "--gpus") {
+      opt.gpus.clear();
+      std::istringstream gpus(value);
+      std::string gpu;
+      while (std::getline(gpus, gpu, ',')) opt.gpus.push_back(std::stoi(gpu));
+    } else if (key == "--host") {
+      opt.host = value;
+    } else if (key == "--port") {
+      opt.port = std::stoi(value);
+    } else if (key == "--max_connections") {
+      opt.max_connections = std::stoi(value);
+    } else if (key == "--pad_id") {
+      opt.pad_id = std::stoi(value);
+    } else if (key == "--pad_side") {
+      if (value != "right" && value != "left") {
+        throw std::runtime_error("--pad_side must be right or left");
+      }
+      opt.pad_left = value == "left";
+    } else if (key == "--max_batch_size") {
+      opt.policy.max_batch_size = std::stoi(value);
+    } else if (key == "--max_batch_tokens") {
+      opt.policy.max_batch_tokens = std::stoi(value);
+    } else if (key == "--max_queue_delay_ms") {
+      opt.policy.max_queue_delay_ms = std::stod(value);
+    } else if (key == "--max_queue_time_ms") {
+      opt.policy.max_queue_time_ms = std::stod(value);
+    } else if (key == "--queue_capacity") {
+      opt.policy.queue_capacity = std::stoul(value);
+    } else if (key == "--idle_release_ms") {
+      opt.policy.idle_release_ms = std::stod(value);
+    } else {
+      throw std::runtime_error("unknown option " + key);
+    }
+  }
+  if (opt.weights.empty()) {
+    throw std::runtime_error("--weights is required");
+  }
+  if (opt.gpus.empty()) {
+    throw std::runtime_error("--gpus is empty");
+  }
+  return opt;
+}
+
+lightseq::server::HttpFrontend* g_frontend = nullptr;
+
+void handle_signal(int signum) {
+  if (g_frontend) g_frontend->stop();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  try {
+    Options opt = parse_options(argc, argv);
+    lightseq::server::BatchScheduler scheduler(opt.model, opt.weights,
+                                               opt.gpus, opt.policy,
+                                               opt.pad_id, opt.pad_left);
+    scheduler.start();
+    lightseq::server::HttpFrontend frontend(scheduler, opt.host, opt.port,
+                                            opt.max_connections);
+    g_frontend = &frontend;
+    std::signal(SIGINT, handle_signal);
+    std::signal(SIGTERM, handle_signal);
+    frontend.run();
+    g_frontend = nullptr;
+    scheduler.stop();
+  } catch (std::exception& e) {
+    printf("Error! %s\n", e.what());
+    return -1;
+  }
+  return 0;
+}
@@ -1,4 +1,6 @@
 import os, sys
+import argparse
+import time
 
 cur_dir = os.path.dirname(os.path.abspath(__file__))
 par_dir = os.path.dirname(cur_dir)
@@ -7,6 +9,8 @@ csrc_dir = os.path.dirname(par_dir)
 sys.path.insert(0, csrc_dir)
 
 
+import random
+
 import torch
 import numpy as np
 
@@ -86,7 +90,369 @@ def test_gemm_u8s8s32():
     return custom, baseline
 
 
+@kt.case(dtypes=[torch.float], rtol=1e-4, atol=1e-4)
+def test_strided_batch_gemm():
+    batch, seq_len = kt.bs_sl()
+    head_dim = kt.hidden_dim // kt.nhead
+    nbatch = batch * kt.nhead
+    # the attention scores, q * k^T
+    inpA = kt.rand([nbatch, seq_len, head_dim])
+    inpB = kt.rand([nbatch, seq_len, head_dim])
+
+    cus_inpA = inpA.contiguous().numpy()
+    cus_inpB = inpB.contiguous().numpy()
+    cus_outC = np.zeros([nbatch, seq_len, seq_len], dtype=np.float32)
+
+    def custom():
+        x86_kernel_module.test_strided_batch_gemm(
+            cus_inpA, cus_inpB, cus_outC, False, True
+        )
+        return [np.array(cus_outC)]
+
+    def baseline():
+        return [torch.bmm(inpA, inpB.transpose(1, 2))]
+
+    return custom, baseline
+
+
+@kt.case(dtypes=[torch.float], rtol=1e-4, atol=1e-4)
+def test_layer_norm():
+    batch, seq_len = kt.bs_sl()
+    hidden_dim = kt.hidden_dim
+    inp = kt.rand([batch * seq_len, hidden_dim])
+    gamma = kt.rand([hidden_dim])
+    beta = kt.rand([hidden_dim])
+
+    cus_inp, cus_gamma, cus_beta = [t.numpy() for t in (inp, gamma, beta)]
+    cus_out = np.zeros_like(cus_inp)
+    cus_vars = np.zeros([batch * seq_len], dtype=np.float32)
+    cus_means = np.zeros([batch * seq_len], dtype=np.float32)
+
+    def custom():
+        x86_kernel_module.test_layer_norm(
+            cus_inp, cus_gamma, cus_beta, cus_out, cus_vars, cus_means
+        )
+        return [np.array(cus_out), np.array(cus_means)]
+
+    def baseline():
+        out = torch.nn.functional.layer_norm(
+            inp, [hidden_dim], weight=gamma, bias=beta, eps=1e-8
+        )
+        return [out, inp.mean(dim=-1)]
+
+    return custom, baseline
+
+
+@kt.case(dtypes=[torch.float], rtol=1e-4, atol=1e-5)
+def test_attn_softmax():
+    batch, from_len = kt.bs_sl()
+    mask_future = random.choice([True, False])
+    to_len = from_len
+    inp = kt.rand([batch, kt.nhead, from_len, to_len])
+    if mask_future:
+        mask = kt.dec_self_attn_mask(to_len) * -1e8
+        base_mask = mask.unsqueeze(0).unsqueeze(0)
+        cus_mask = np.zeros([0], dtype=np.float32)
+    else:
+        mask = kt.attn_mask(batch, to_len) * -1e8
+        base_mask = mask.unsqueeze(1).unsqueeze(1)
+        cus_mask = mask.numpy()
+
+    cus_inp = inp.numpy()
+    cus_out = np.zeros_like(cus_inp)
+
+    def custom():
+        x86_kernel_module.test_attn_softmax(cus_inp, cus_mask, cus_out, mask_future)
+        return [np.array(cus_out)]
+
+    def baseline():
+        return [torch.softmax(inp + base_mask, dim=-1)]
+
+    return custom, baseline
+
+
+@kt.case(dtypes=[torch.float], rtol=1e-3, atol=1e-4)
+def test_bias_act():
+    batch, seq_len = kt.bs_sl()
+    hidden_dim = kt.hidden_dim
+    activation_fn = random.choice(["relu", "gelu"])
+    inp = kt.rand([batch * seq_len, hidden_dim])
+    bias = kt.rand([hidden_dim])
+
+    cus_inp, cus_bias = inp.numpy(), bias.numpy()
+    cus_out = np.zeros_like(cus_inp)
+
+    def custom():
+        x86_kernel_module.test_bias_act(cus_inp, cus_bias, cus_out, activation_fn)
+        return [np.array(cus_out)]
+
+    def baseline():
+        if activation_fn == "relu":
+            return [torch.relu(inp + bias)]
+        return [torch.nn.functional.gelu(inp + bias)]
+
+    return custom, baseline
+
+
+@kt.case(dtypes=[torch.float], rtol=0, atol=1)
+def test_quantize_shift_rows():
+    batch, seq_len = kt.bs_sl()
+    hidden_dim = kt.hidden_dim
+    inp = kt.rand([batch * seq_len, hidden_dim])
+
+    cus_inp = inp.numpy()
+    cus_q = np.zeros(cus_inp.shape, dtype=np.uint8)
+    cus_scales = np.zeros([batch * seq_len], dtype=np.float32)
+
+    def custom():
+        x86_kernel_module.test_quantize_shift_rows(cus_inp, cus_q, cus_scales)
+        return [cus_q.astype(np.int32)]
+
+    def baseline():
+        scales = inp.abs().amax(dim=-1, keepdim=True) / 127
+        q = torch.round(inp / scales).clamp(-127, 127) + 128
+        return [q.to(torch.int32)]
+
+    return custom, baseline
+
+
+@kt.case(dtypes=[torch.float])
+def test_transform_0213():
+    batch, seq_len = kt.bs_sl()
+    hidden_dim = kt.hidden_dim
+    inp = kt.rand([batch, seq_len, kt.nhead, hidden_dim // kt.nhead])
+
+    cus_inp = inp.numpy()
+    cus_out = np.zeros(
+        [batch, kt.nhead, seq_len, hidden_dim // kt.nhead], dtype=np.float32
+    )
+
+    def custom():
+        x86_kernel_module.test_transform_0213(cus_inp, cus_out)
+        return [np.array(cus_out)]
+
+    def baseline():
+        return [inp.transpose(1, 2).contiguous()]
+
+    return custom, baseline
+
+
+# (hidden_dim, inner_dim, nhead) of the models that the cpu backend serves.
+BENCH_CONFIGS = {
+    "bert-base": (768, 3072, 12),
+    "bert-large": (1024, 4096, 16),
+    "gpt2-medium": (1024, 4096, 16),
+    "gpt2-large": (1280, 5120, 20),
+}
+
+
+def bench_time(func, nrepeat):
+    """The mean seconds of a call, after a warmup."""
+    func()
+    begin = time.perf_counter()
+    for _ in range(nrepeat):
+        func()
+    return (time.perf_counter() - begin) / nrepeat
+
+
+def bench_report(name, flops, nbytes, custom, baseline, nrepeat):
+    """
+    Print the time and the throughput of custom and its MKL or ATen baseline,
+    flops and nbytes are the work and the memory traffic of one call.
+    """
+    for tag, func in (("custom", custom), ("baseline", baseline)):
+        t = bench_time(func, nrepeat)
+        print(
+            "%-44s %-8s %9.3f ms %9.2f GFLOP/s %8.2f GB/s"
+            % (name, tag, t * 1e3, flops / t * 1e-9, nbytes / t * 1e-9)
+        )
+
+
+def bench_kernels(batch_size, seq_len, nrepeat):
+    """
+    The kernels on the shapes of the encoder layers of batch_size x seq_len
+    tokens and of a decoding step of batch_size tokens.
+    """
+    print(f"torch threads: {torch.get_num_threads()}")
+    for model, (hidden_dim, inner_dim, nhead) in BENCH_CONFIGS.items():
+        for tokens in (batch_size * seq_len, batch_size):
+            prefix = f"{model} tokens={tokens}"
+            # qkv, output, ffn1 and ffn2 projections
+            for n, k in (
+                (3 * hidden_dim, hidden_dim),
+                (hidden_dim, hidden_dim),
+                (inner_dim, hidden_dim),
+                (hidden_dim, inner_dim),
+            ):
+                bench_linear(f"{prefix} gemm {n}x{k}", tokens, n, k, nrepeat)
+                bench_int8_linear(f"{prefix} int8 gemm {n}x{k}", tokens, n, k, nrepeat)
+            bench_norm_act(prefix, tokens, hidden_dim, inner_dim, nrepeat)
+        bench_attention(
+            f"{model} tokens={batch_size * seq_len}",
+            batch_size,
+            seq_len,
+            hidden_dim,
+            nhead,
+            nrepeat,
+        )
+
+
+def bench_linear(name, m, n, k, nrepeat):
+    inp = torch.rand([m, k]) - 0.5
+    weight = torch.rand([n, k]) - 0.5
+    out = torch.zeros([m, n])
+    cus_inp = inp.numpy()[np.newaxis]
+    cus_weight = weight.numpy()[np.newaxis]
+    cus_out = out.numpy()[np.newaxis]
+
+    def custom():
+        x86_kernel_module.test_strided_batch_gemm(
+            cus_inp, cus_weight, cus_out, False, True
+        )
+
+    def baseline():
+        torch.matmul(inp, weight.t(), out=out)
+
+    nbytes = 4 * (m * k + n * k + m * n)
+    bench_report(name, 2 * m * n * k, nbytes, custom, baseline, nrepeat)
+
+
+def bench_int8_linear(name, m, n, k, nrepeat):
+    inp = torch.randint(1, 256, [m, k], dtype=torch.uint8)
+    weight = torch.randint(-127, 128, [n, k], dtype=torch.int8)
+    comp = weight.to(torch.int32).sum(dim=1).mul(-128).numpy()
+    cus_inp, cus_weight = inp.numpy(), weight.numpy()
+    cus_out = np.zeros([m, n], dtype=np.int32)
+    base_inp, base_weight = inp.float(), weight.float()
+
+    def custom():
+        x86_kernel_module.test_gemm_u8s8s32(
+            cus_inp, cus_weight, comp, cus_out, False, True
+        )
+
+    def baseline():
+        torch.nn.functional.linear(base_inp, base_weight)
+
+    nbytes = m * k + n * k + 4 * m * n
+    bench_report(name, 2 * m * n * k, nbytes, custom, baseline, nrepeat)
+
+
+def bench_norm_act(prefix, tokens, hidden_dim, inner_dim, nrepeat):
+    inp = torch.rand([tokens, hidden_dim]) - 0.5
+    gamma, beta = torch.rand([hidden_dim]), torch.rand([hidden_dim])
+    cus_inp, cus_gamma, cus_beta = inp.numpy(), gamma.numpy(), beta.numpy()
+    cus_out = np.zeros_like(cus_inp)
+    cus_vars = np.zeros([tokens], dtype=np.float32)
+    cus_means = np.zeros([tokens], dtype=np.float32)
+    numel = tokens * hidden_dim
+
+    bench_report(
+        f"{prefix} layer_norm {hidden_dim}",
+        8 * numel,
+        4 * 2 * numel,
+        lambda: x86_kernel_module.test_layer_norm(
+            cus_inp, cus_gamma, cus_beta, cus_out, cus_vars, cus_means
+        ),
+        lambda: torch.nn.functional.layer_norm(inp, [hidden_dim], gamma, beta),
+        nrepeat,
+    )
+
+    cus_q = np.zeros(cus_inp.shape, dtype=np.uint8)
+    cus_scales = np.zeros([tokens], dtype=np.float32)
+
+    def base_quantize():
+        scales = inp.abs().amax(dim=-1, keepdim=True) / 127
+        torch.round(inp / scales).add_(128).to(torch.uint8)
+
+    bench_report(
+        f"{prefix} quantize {hidden_dim}",
+        3 * numel,
+        5 * numel,
+        lambda: x86_kernel_module.test_quantize_shift_rows(cus_inp, cus_q, cus_scales),
+        base_quantize,
+        nrepeat,
+    )
+
+    ffn = torch.rand([tokens, inner_dim]) - 0.5
+    bias = torch.rand([inner_dim])
+    cus_ffn, cus_bias = ffn.numpy(), bias.numpy()
+    cus_ffn_out = np.zeros_like(cus_ffn)
+    numel = tokens * inner_dim
+    bench_report(
+        f"{prefix} bias_gelu {inner_dim}",
+        10 * numel,
+        4 * 2 * numel,
+        lambda: x86_kernel_module.test_bias_act(
+            cus_ffn, cus_bias, cus_ffn_out, "gelu"
+        ),
+        lambda: torch.nn.functional.gelu(ffn + bias),
+        nrepeat,
+    )
+
+
+def bench_attention(prefix, batch_size, seq_len, hidden_dim, nhead, nrepeat):
+    head_dim = hidden_dim // nhead
+    nbatch = batch_size * nhead
+    q = torch.rand([nbatch, seq_len, head_dim]) - 0.5
+    k = torch.rand([nbatch, seq_len, head_dim]) - 0.5
+    scores = torch.zeros([nbatch, seq_len, seq_len])
+    cus_q, cus_k, cus_scores = q.numpy(), k.numpy(), scores.numpy()
+
+    bench_report(
+        f"{prefix} attn q*k^T",
+        2 * nbatch * seq_len * seq_len * head_dim,
+        4 * (2 * nbatch * seq_len * head_dim + nbatch * seq_len * seq_len),
+        lambda: x86_kernel_module.test_strided_batch_gemm(
+            cus_q, cus_k, cus_scores, False, True
+        ),
+        lambda: torch.bmm(q, k.transpose(1, 2), out=scores),
+        nrepeat,
+    )
+
+    inp = scores.view(batch_size, nhead, seq_len, seq_len)
+    mask = kt.attn_mask(batch_size, seq_len, dtype=torch.float) * -1e8
+    base_mask = mask.unsqueeze(1).unsqueeze(1)
+    cus_inp, cus_mask = inp.numpy(), mask.numpy()
+    cus_out = np.zeros_like(cus_inp)
+    numel = inp.numel()
+    bench_report(
+        f"{prefix} attn_softmax {seq_len}",
+        5 * numel,
+        4 * 2 * numel,
+        lambda: x86_kernel_module.test_attn_softmax(cus_inp, cus_mask, cus_out, False),
+        lambda: torch.softmax(inp + base_mask, dim=-1),
+        nrepeat,
+    )
+
+
 if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument(
+        "--bench",
+        action="store_true",
+        help="time the kernels on the shapes of bert and gpt instead",
+    )
+    parser.add_argument("--batch_size", type=int, default=8)
+    parser.add_argument("--seq_len", type=int, default=128)
+    parser.add_argument("--nrepeat", type=int, default=20)
+    parser.add_argument("--threads", type=int, default=None)
+    args = parser.parse_args()
+
     kt.init(device="cpu", nhead=16)
-    kernel_list = ["test_gemm_case", "test_gemm_u8s8s32"]
-    kt.run(kernel_list)
+    if args.threads is not None:
+        torch.set_num_threads(args.threads)
+        x86_kernel_module.set_gemm_num_threads(args.threads)
+    if args.bench:
+        bench_kernels(args.batch_size, args.seq_len, args.nrepeat)
+    else:
+        kernel_list = [
+            "test_gemm_case",
+            "test_gemm_u8s8s32",
+            "test_strided_batch_gemm",
+            "test_layer_norm",
+            "test_attn_softmax",
+            "test_bias_act",
+            "test_quantize_shift_rows",
+            "test_transform_0213",
+        ]
+        kt.run(kernel_list)
@@ -8,7 +8,10 @@
 #include "triton/core/tritonbackend.h"
 #include "triton_model.h"
 #include "cstring"
+#include <cstdlib>
+#include <map>
 #include "triton_utils.h"
+#include "nvtx_range.h"
 
 namespace triton {
 namespace backend {
@@ -207,6 +210,236 @@ TRITONSERVER_Error* TRITONBACKEND_ModelInstanceFinalize(
 
 /////////////
 
+namespace {
+
+// An output of a response, copied into the responses of the same inputs.
+struct ResponseOutput {
+  std::string name;
+  TRITONSERVER_DataType datatype;
+  std::vector<int64_t> shape;
+  const void* buffer;
+  uint32_t byte_size;
+};
+
+// The names, shapes and bytes of the inputs of request, empty if one of them
+// is not in cpu memory, eg. the zero copy gpu output of an ensemble step.
+std::string request_input_key(TRITONBACKEND_Request* request) {
+  std::string key;
+  uint32_t input_count;
+  TRITONBACKEND_RequestInputCount(request, &input_count);
+  for (uint32_t input_idx = 0; input_idx < input_count; input_idx++) {
+    TRITONBACKEND_Input* input = nullptr;
+    const int64_t* shape = nullptr;
+    const char* input_name = nullptr;
+    TRITONSERVER_DataType datatype;
+    uint32_t dims_count, buffer_count;
+    uint64_t byte_size;
+    TRITONSERVER_Error* err =
+        TRITONBACKEND_RequestInputByIndex(request, input_idx, &input);
+    if (err == nullptr) {
+      err = TRITONBACKEND_InputProperties(input, &input_name, &datatype,
+                                          &shape, &dims_count, &byte_size,
+                                          &buffer_count);
+    }
+    if (err != nullptr) {
+      TRITONSERVER_ErrorDelete(err);
+      return "";
+    }
+    key.append(input_name, strlen(input_name) + 1);
+    key.append((const char*)shape, dims_count * sizeof(int64_t));
+    for (uint32_t buffer_idx = 0; buffer_idx < buffer_count; buffer_idx++) {
+      const void* buffer = nullptr;
+      uint64_t buffer_byte_size;
+      TRITONSERVER_MemoryType memory_type = TRITONSERVER_MEMORY_GPU;
+      int64_t memory_type_id;
+      TRITONSERVER_Error* err =
+          TRITONBACKEND_InputBuffer(input, buffer_idx, &buffer,
+                                    &buffer_byte_size, &memory_type,
+                                    &memory_type_id);
+      if (err != nullptr) {
+        TRITONSERVER_ErrorDelete(err);
+        return "";
+      }
+      if (memory_type == TRITONSERVER_MEMORY_GPU) return "";
+      key.append((const char*)buffer, buffer_byte_size);
+    }
+  }
+  return key;
+}
+
+// The single row of int32 tokens of the input name of a request, in any
+// memory. what names the row in the error.
+TRITONSERVER_Error* read_token_row(TRITONBACKEND_Request* request,
+                                   const std::string& name, const char* what,
+                                   std::vector<int>* tokens) {
+  TRITONBACKEND_Input* input = nullptr;
+  RETURN_IF_ERROR(TRITONBACKEND_RequestInput(request, name.c_str(), &input));
+  const int64_t* shape = nullptr;
+  TRITONSERVER_DataType datatype;
+  uint32_t dims_count, buffer_count;
+  uint64_t byte_size;
+  RETURN_IF_ERROR(TRITONBACKEND_InputProperties(input, nullptr, &datatype,
+                                                &shape, &dims_count,
+                                                &byte_size, &buffer_count));
+  if (datatype != TRITONSERVER_TYPE_INT32 || dims_count == 0 ||
+      shape[dims_count - 1] * sizeof(int) != byte_size) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        (std::string(what) + " must be a single row of int32 tokens")
+            .c_str());
+  }
+  tokens->resize(byte_size / sizeof(int));
+  uint64_t offset = 0;
+  for (uint32_t buffer_idx = 0; buffer_idx < buffer_count; buffer_idx++) {
+    const void* buffer = nullptr;
+    uint64_t buffer_byte_size;
+    TRITONSERVER_MemoryType memory_type;
+    int64_t memory_type_id;
+    RETURN_IF_ERROR(TRITONBACKEND_InputBuffer(input, buffer_idx, &buffer,
+                                              &buffer_byte_size, &memory_type,
+                                              &memory_type_id));
+#ifdef LIGHTSEQ_cuda
+    cudaMemcpy((char*)tokens->data() + offset, buffer, buffer_byte_size,
+               cudaMemcpyDefault);
+#else
+    memcpy((char*)tokens->data() + offset, buffer, buffer_byte_size);
+#endif
+    offset += buffer_byte_size;
+  }
+  return nullptr;  // success
+}
+
+// A request of a sequence of the sequence batcher: input 0 of the model is
+// the [1, turn_len] tokens of the new turn, output 0 gets the [1, 1, len]
+// tokens of the whole conversation, see
+// ModelInstanceState::RunSequenceTurn.
+TRITONSERVER_Error* execute_sequence_turn(ModelInstanceState* instance_state,
+                                          TRITONBACKEND_Request* request,
+                                          TRITONBACKEND_Response* response,
+                                          uint64_t correlation_id) {
+  std::shared_ptr<::lightseq::cuda::LSModel> lightseq_model_ptr =
+      instance_state->LightseqModel();
+  uint32_t flags = 0;
+  RETURN_IF_ERROR(TRITONBACKEND_RequestFlags(request, &flags));
+  std::vector<int> turn;
+  RETURN_IF_ERROR(read_token_row(request,
+                                 lightseq_model_ptr->get_input_name(0),
+                                 "the turn of a sequence", &turn));
+
+  std::vector<int> tokens;
+  try {
+    tokens = instance_state->RunSequenceTurn(
+        correlation_id, flags & TRITONSERVER_REQUEST_FLAG_SEQUENCE_START,
+        flags & TRITONSERVER_REQUEST_FLAG_SEQUENCE_END, turn);
+  } catch (const std::exception& e) {
+    return TRITONSERVER_ErrorNew(TRITONSERVER_ERROR_INTERNAL, e.what());
+  }
+
+  std::string output_name = lightseq_model_ptr->get_output_name(0);
+  const std::vector<int64_t> output_shape = {1, 1, int64_t(tokens.size())};
+  TRITONBACKEND_Output* output = nullptr;
+  RETURN_IF_ERROR(TRITONBACKEND_ResponseOutput(
+      response, &output, output_name.c_str(), TRITONSERVER_TYPE_INT32,
+      output_shape.data(), output_shape.size()));
+  void* output_buffer = nullptr;
+  uint64_t output_byte_size = tokens.size() * sizeof(int);
+  TRITONSERVER_MemoryType output_memory_type = TRITONSERVER_MEMORY_CPU;
+  int64_t output_memory_type_id = 0;
+  RETURN_IF_ERROR(TRITONBACKEND_OutputBuffer(output, &output_buffer,
+                                             output_byte_size,
+                                             &output_memory_type,
+                                             &output_memory_type_id));
+#ifdef LIGHTSEQ_cuda
+  cudaMemcpy(output_buffer, tokens.data(), output_byte_size,
+             cudaMemcpyDefault);
+#else
+  memcpy(output_buffer, tokens.data(), output_byte_size);
+#endif
+  return nullptr;  // success
+}
+
+// The requests of a ragged batch, input 0 of each being one row of tokens
+// of its own length, run as one packed encoding without padding, see
+// LSModel::encode_packed. The offsets of the rows are the
+// BATCH_ACCUMULATED_ELEMENT_COUNT_WITH_ZERO batch input of Triton, counted
+// here from the shapes of the requests. Every response gets the
+// [1, len, hidden_size] output 0 of its own tokens. A request of an invalid
+// input gets its error and the others still run.
+void execute_ragged_batch(
+    ModelInstanceState* instance_state,
+    const std::vector<TRITONBACKEND_Request*>& requests,
+    const std::vector<TRITONBACKEND_Response**>& responses) {
+  std::shared_ptr<::lightseq::cuda::LSModel> lightseq_model_ptr =
+      instance_state->LightseqModel();
+  std::string input_name = lightseq_model_ptr->get_input_name(0);
+  std::vector<int> tokens, offsets = {0}, row;
+  std::vector<TRITONBACKEND_Response**> packed_responses;
+  for (size_t r = 0; r < requests.size(); r++) {
+    RESPOND_AND_SET_NULL_IF_ERROR(
+        responses[r],
+        read_token_row(requests[r], input_name, "a ragged input", &row));
+    if (*responses[r] == nullptr) continue;
+    tokens.insert(tokens.end(), row.begin(), row.end());
+    offsets.push_back(tokens.size());
+    packed_responses.push_back(responses[r]);
+  }
+  if (packed_responses.empty()) return;
+
+  std::string output_name = lightseq_model_ptr->get_output_name(0);
+  TRITONSERVER_DataType datatype =
+      instance_state->StateForModel()->GetOutputDataTypeByName(output_name);
+  int64_t hidden_size = lightseq_model_ptr->get_output_max_shape(0).back();
+  uint64_t token_byte_size =
+      hidden_size * TRITONSERVER_DataTypeByteSize(datatype);
+  char* d_output = (char*)instance_state->get_d_output(output_name);
+  // a zero copy input of an earlier batch is not the model's to write.
+  lightseq_model_ptr->set_input_ptr(0, instance_state->get_d_input(input_name));
+  try {
+    lightseq_model_ptr->encode_packed(tokens.data(), offsets.data(),
+                                      packed_responses.size(), d_output);
+  } catch (const std::exception& e) {
+    for (TRITONBACKEND_Response** response : packed_responses) {
+      RESPOND_AND_SET_NULL_IF_ERROR(
+          response,
+          TRITONSERVER_ErrorNew(TRITONSERVER_ERROR_INTERNAL, e.what()));
+    }
+    return;
+  }
+  instance_state->ExportMetrics();
+
+  for (size_t i = 0; i < packed_responses.size(); i++) {
+    const std::vector<int64_t> output_shape = {1, offsets[i + 1] - offsets[i],
+                                               hidden_size};
+    uint64_t byte_size = output_shape[1] * token_byte_size;
+    TRITONBACKEND_Output* output = nullptr;
+    void* output_buffer = nullptr;
+    TRITONSERVER_MemoryType output_memory_type = TRITONSERVER_MEMORY_GPU;
+    int64_t output_memory_type_id = 0;
+    RESPOND_AND_SET_NULL_IF_ERROR(
+        packed_responses[i],
+        TRITONBACKEND_ResponseOutput(*packed_responses[i], &output,
+                                     output_name.c_str(), datatype,
+                                     output_shape.data(),
+                                     output_shape.size()));
+    if (*packed_responses[i] == nullptr) continue;
+    RESPOND_AND_SET_NULL_IF_ERROR(
+        packed_responses[i],
+        TRITONBACKEND_OutputBuffer(output, &output_buffer, byte_size,
+                                   &output_memory_type,
+                                   &output_memory_type_id));
+    if (*packed_responses[i] == nullptr) continue;
+    const char* src = d_output + offsets[i] * token_byte_size;
+#ifdef LIGHTSEQ_cuda
+    cudaMemcpyAsync(output_buffer, src, byte_size, cudaMemcpyDefault,
+                    instance_state->CudaStream());
+#else
+    memcpy(output_buffer, src, byte_size);
+#endif
+  }
+}
+
+}  // namespace
+
 extern "C" {
 
 // When Triton calls TRITONBACKEND_ModelInstanceExecute it is required
@@ -217,6 +450,7 @@ extern "C" {
 TRITONSERVER_Error* TRITONBACKEND_ModelInstanceExecute(
     TRITONBACKEND_ModelInstance* instance, TRITONBACKEND_Request** requests,
     const uint32_t request_count) {
+  LS_NVTX_RANGE("TRITONBACKEND_ModelInstanceExecute");
   // Collect various timestamps during the execution of this batch or
   // requests. These values are reported below before returning from
   // the function.
@@ -248,6 +482,10 @@ TRITONSERVER_Error* TRITONBACKEND_ModelInstanceExecute(
 
   std::shared_ptr<::lightseq::cuda::LSModel> lightseq_model_ptr =
       instance_state->LightseqModel();
+#ifdef LIGHTSEQ_cuda
+  // the copies of the inputs and outputs, Infer synchronizes its own stream.
+  cudaStream_t stream = instance_state->CudaStream();
+#endif
 
   // 'responses' is initialized as a parallel array to 'requests',
   // with one TRITONBACKEND_Response object for each
@@ -278,8 +516,89 @@ TRITONSERVER_Error* TRITONBACKEND_ModelInstanceExecute(
   uint64_t compute_start_ns = 0;
   SET_TIMESTAMP(compute_start_ns);
 
+  // With LIGHTSEQ_DEDUP_ROWS=1 a request of the same inputs as an earlier
+  // one of the batch gets a copy of its outputs instead of an Infer, and the
+  // duplicate rows of a request run once, see DedupModel.
+  static const bool dedup_requests = [] {
+    const char* dedup_env = std::getenv("LIGHTSEQ_DEDUP_ROWS");
+    return dedup_env && std::atoi(dedup_env) != 0;
+  }();
+  std::map<std::string, uint32_t> request_keys;
+  std::vector<std::vector<ResponseOutput>> response_outputs(request_count);
+  instance_state->EvictIdleSequences();
+
+  // the requests of the sequence batcher carry a correlation id, the
+  // stateless ones of a model with sequence batching, and of the other
+  // models, have 0.
+  std::vector<uint64_t> correlation_ids(request_count, 0);
+  if (model_state->SequenceBatching()) {
+    for (uint32_t idx = 0; idx < request_count; idx++) {
+      LOG_IF_ERROR(TRITONBACKEND_RequestCorrelationId(requests[idx],
+                                                      &correlation_ids[idx]),
+                   "failed getting the correlation id");
+    }
+  }
+  // the stateless requests of a ragged batch run at once, not in the loop.
+  std::vector<bool> ragged(request_count, false);
+  if (model_state->RaggedBatching()) {
+    LS_NVTX_RANGE("ragged batch");
+    std::vector<TRITONBACKEND_Request*> ragged_requests;
+    std::vector<TRITONBACKEND_Response**> ragged_responses;
+    for (uint32_t idx = 0; idx < request_count; idx++) {
+      if (correlation_ids[idx] != 0) continue;
+      ragged[idx] = true;
+      ragged_requests.push_back(requests[idx]);
+      ragged_responses.push_back(&responses[idx]);
+    }
+    execute_ragged_batch(instance_state, ragged_requests, ragged_responses);
+  }
+
   for (uint32_t idx = 0; idx < request_count; idx++) {
+    if (ragged[idx]) continue;
+    LS_NVTX_RANGE("request " + std::to_string(idx));
     TRITONBACKEND_Request* request = requests[idx];
+    uint64_t correlation_id = correlation_ids[idx];
+    if (correlation_id != 0) {
+      RESPOND_AND_SET_NULL_IF_ERROR(
+          &responses[idx], execute_sequence_turn(instance_state, request,
+                                                 responses[idx],
+                                                 correlation_id));
+      continue;
+    }
+    std::string request_key;
+    if (dedup_requests && request_count > 1) {
+      request_key = request_input_key(request);
+    }
+    auto same_request = request_keys.end();
+    if (!request_key.empty()) {
+      same_request = request_keys.find(request_key);
+    }
+    if (same_request != request_keys.end()) {
+      uint32_t same_idx = same_request->second;
+      for (const ResponseOutput& same : response_outputs[same_idx]) {
+        TRITONBACKEND_Output* output = nullptr;
+        void* single_output_buffer = nullptr;
+        TRITONSERVER_MemoryType output_memory_type = TRITONSERVER_MEMORY_GPU;
+        int64_t output_memory_type_id = 0;
+        LOG_IF_ERROR(TRITONBACKEND_ResponseOutput(
+                         responses[idx], &output, same.name.c_str(),
+                         same.datatype, same.shape.data(), same.shape.size()),
+                     "failed create an TRITONBACKEND_OutputBuffer");
+        LOG_IF_ERROR(TRITONBACKEND_OutputBuffer(
+                         output, &single_output_buffer, same.byte_size,
+                         &output_memory_type, &output_memory_type_id),
+                     "failed get a buffer to use to hold the tensor data for "
+                     "the output.");
+#ifdef LIGHTSEQ_cuda
+        cudaMemcpyAsync(single_output_buffer, same.buffer, same.byte_size,
+                        cudaMemcpyDefault, stream);
+#else
+        memcpy(single_output_buffer, same.buffer, same.byte_size);
+#endif
+      }
+      continue;
+    }
+    if (!request_key.empty()) request_keys.emplace(request_key, idx);
     uint32_t input_count;
     TRITONBACKEND_RequestInputCount(request, &input_count);
 
@@ -304,7 +623,8 @@ TRITONSERVER_Error* TRITONBACKEND_ModelInstanceExecute(
 
       // malloc GPU memory by triton api;
       void* d_input = instance_state->get_d_input(input_name);
-      void* moved_d_input = d_input;
+      void* input_ptr = d_input;
+      uint64_t input_offset = 0;
       for (uint32_t buffer_idx = 0; buffer_idx < buffer_count; buffer_idx++) {
         const void* partial_buffer = nullptr;
         uint64_t buffer_byte_size;
@@ -314,14 +634,26 @@ TRITONSERVER_Error* TRITONBACKEND_ModelInstanceExecute(
                          input, buffer_idx, &partial_buffer, &buffer_byte_size,
                          &memory_type, &memory_type_id),
                      "failed get input buffer");
+        char* dst = (char*)d_input + input_offset;
 #ifdef LIGHTSEQ_cuda
-        cudaMemcpy(moved_d_input, partial_buffer, buffer_byte_size,
-                   cudaMemcpyHostToDevice);
+        if (buffer_count == 1 && memory_type == TRITONSERVER_MEMORY_GPU &&
+            memory_type_id == device_id) {
+          // zero copy, e.g. the gpu output of the previous ensemble step.
+          input_ptr = const_cast<void*>(partial_buffer);
+          break;
+        }
+        if (memory_type == TRITONSERVER_MEMORY_CPU) {
+          // pageable, staged in pinned memory so that the copy is async.
+          char* h_input = (char*)instance_state->get_h_input(input_name);
+          memcpy(h_input + input_offset, partial_buffer, buffer_byte_size);
+          partial_buffer = h_input + input_offset;
+        }
+        cudaMemcpyAsync(dst, partial_buffer, buffer_byte_size,
+                        cudaMemcpyDefault, stream);
 #else
-        memcpy((char*)moved_d_input, (char*)partial_buffer, buffer_byte_size);
+        memcpy(dst, (char*)partial_buffer, buffer_byte_size);
 #endif
-        moved_d_input = (void*)(reinterpret_cast<uint64_t>(moved_d_input) +
-                                buffer_byte_size);
+        input_offset += buffer_byte_size;
       }
 
       // match triton client input with lightseq input by input_name.
@@ -334,10 +666,17 @@ TRITONSERVER_Error* TRITONBACKEND_ModelInstanceExecute(
         }
         lightseq_model_ptr->set_input_shape(
             lightseq_input_idx, std::vector<int>(shape, shape + dims_count));
+        lightseq_model_ptr->set_input_ptr(lightseq_input_idx, input_ptr);
       }
     }
 
+#ifdef LIGHTSEQ_cuda
+    // the inputs, and the outputs of the previous request which Infer
+    // overwrites.
+    cudaStreamSynchronize(stream);
+#endif
     lightseq_model_ptr->Infer();
+    instance_state->ExportMetrics();
 
     // create response buffer
     TRITONBACKEND_Response* response = responses[idx];
@@ -372,6 +711,9 @@ TRITONSERVER_Error* TRITONBACKEND_ModelInstanceExecute(
                        &output_memory_type, &output_memory_type_id),
                    "failed get a buffer to use to hold the tensor data for the "
                    "output.");
+      response_outputs[idx].push_back({output_name, triton_datatype_,
+                                       triton_shape, single_output_buffer,
+                                       buffer_byte_size});
 
       for (int lightseq_output_idx = 0;
            lightseq_output_idx < lightseq_model_ptr->get_output_size();
@@ -384,8 +726,10 @@ TRITONSERVER_Error* TRITONBACKEND_ModelInstanceExecute(
         const void* d_output = static_cast<const void*>(
             lightseq_model_ptr->get_output_ptr(output_idx));
 #ifdef LIGHTSEQ_cuda
-        cudaMemcpy(single_output_buffer, d_output, buffer_byte_size,
-                   cudaMemcpyDeviceToHost);
+        // the buffer is on the gpu unless triton could not give one, the
+        // outputs are only known after Infer so they are always copied.
+        cudaMemcpyAsync(single_output_buffer, d_output, buffer_byte_size,
+                        cudaMemcpyDefault, stream);
 #else
         memcpy((char*)single_output_buffer, (char*)d_output, buffer_byte_size);
 #endif
@@ -393,6 +737,10 @@ TRITONSERVER_Error* TRITONBACKEND_ModelInstanceExecute(
     }
   }
 
+#ifdef LIGHTSEQ_cuda
+  cudaStreamSynchronize(stream);
+#endif
+
   uint64_t compute_end_ns = 0;
   SET_TIMESTAMP(compute_end_ns);
 
@@ -1,4 +1,9 @@
 
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
 #include "triton/backend/backend_common.h"
 #include "triton/backend/backend_input_collector.h"
 #include "triton/backend/backend_model.h"
@@ -78,6 +83,38 @@ class ModelState : public BackendModel {
   TRITONSERVER_Error* ValidateModelConfig();
 
   std::string GetModelType() { return model_type_; }
+  // the optional "precision" parameter, fp32, fp16 or bf16.
+  ::lightseq::cuda::DataType GetPrecision() { return precision_; }
+  // the optional "warmup_shapes" parameter, eg. "1x32,8x128", the
+  // [batch_size, seq_len] shapes every instance runs at load, see
+  // LSModel::warmup.
+  const std::vector<std::vector<int>>& GetWarmupShapes() {
+    return warmup_shapes_;
+  }
+  // Whether the model config has the sequence_batching of Triton, whose
+  // requests of a correlation id are the turns of a conversation, see
+  // ModelInstanceState::RunSequenceTurn. The optional
+  // "sequence_max_new_tokens" parameter bounds the tokens generated per
+  // turn, 0 for up to the max step, and a sequence idle for
+  // "sequence_idle_timeout_ms" is dropped, 0 never.
+  bool SequenceBatching() { return sequence_batching_; }
+  int SequenceMaxNewTokens() { return sequence_max_new_tokens_; }
+  int64_t SequenceIdleTimeoutMs() { return sequence_idle_timeout_ms_; }
+  // Whether input 0 has the allow_ragged_batch of Triton: the requests of
+  // a batch are rows of any length, run as one packed batch without
+  // padding, see LSModel::encode_packed.
+  bool RaggedBatching() { return ragged_batching_; }
+  // the optional "stream_priority" parameter, high, low or default, of the
+  // streams of every instance, see ::lightseq::StreamPriority. It orders
+  // the kernels of the models of one process, the SM share of a batch
+  // model of another process is capped by MPS, with
+  // CUDA_MPS_ACTIVE_THREAD_PERCENTAGE in its environment.
+  ::lightseq::StreamPriority GetStreamPriority() { return stream_priority_; }
+  // the optional "capture_path" parameter, the traffic log the instances
+  // write a "capture_sample_rate" sample of their requests to, 1 by default,
+  // see ::lightseq::cuda::CaptureModel. Empty for no capture.
+  const std::string& CapturePath() { return capture_path_; }
+  float CaptureSampleRate() { return capture_sample_rate_; }
 
  private:
   ModelState(TRITONBACKEND_Model* triton_model);
@@ -89,6 +126,16 @@ class ModelState : public BackendModel {
   std::vector<int64_t> shape_;
 
   std::string model_type_;
+  ::lightseq::cuda::DataType precision_ = ::lightseq::cuda::kNotSupported;
+  std::vector<std::vector<int>> warmup_shapes_;
+  bool sequence_batching_ = false;
+  bool ragged_batching_ = false;
+  ::lightseq::StreamPriority stream_priority_ =
+      ::lightseq::StreamPriority::kDefault;
+  int sequence_max_new_tokens_ = 0;
+  int64_t sequence_idle_timeout_ms_ = 0;
+  std::string capture_path_;
+  float capture_sample_rate_ = 1.f;
 };
 
 ModelState::ModelState(TRITONBACKEND_Model* triton_model)
@@ -172,6 +219,11 @@ TRITONSERVER_Error* ModelState::ValidateModelConfig() {
     TRITONSERVER_DataType datatype_;
     datatype_ = ModelConfigDataTypeToTritonServerDataType(input_dtype);
     input_data_type_map_.emplace(input_name_, datatype_);
+
+    common::TritonJson::Value ragged_obj;
+    if (input_idx == 0 && input.Find("allow_ragged_batch", &ragged_obj)) {
+      RETURN_IF_ERROR(ragged_obj.AsBool(&ragged_batching_));
+    }
   }
 
   common::TritonJson::Value outputs;
@@ -206,6 +258,88 @@ TRITONSERVER_Error* ModelState::ValidateModelConfig() {
       "string_value", &model_type_value, &model_type_length));
   model_type_ = std::string(model_type_value);
 
+  common::TritonJson::Value precision_obj;
+  if (parameters.Find("precision", &precision_obj)) {
+    std::string precision_value;
+    RETURN_IF_ERROR(
+        precision_obj.MemberAsString("string_value", &precision_value));
+    precision_ = ::lightseq::cuda::precision_dtype(precision_value);
+    if (precision_ == ::lightseq::cuda::kNotSupported) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INVALID_ARG,
+          ("precision must be fp32, fp16 or bf16, got " + precision_value)
+              .c_str());
+    }
+  }
+
+  common::TritonJson::Value priority_obj;
+  if (parameters.Find("stream_priority", &priority_obj)) {
+    std::string priority_value;
+    RETURN_IF_ERROR(
+        priority_obj.MemberAsString("string_value", &priority_value));
+    if (priority_value == "high") {
+      stream_priority_ = ::lightseq::StreamPriority::kHigh;
+    } else if (priority_value == "low") {
+      stream_priority_ = ::lightseq::StreamPriority::kLow;
+    } else if (priority_value != "default") {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INVALID_ARG,
+          ("stream_priority must be high, low or default, got " +
+           priority_value)
+              .c_str());
+    }
+  }
+
+  common::TritonJson::Value warmup_obj;
+  if (parameters.Find("warmup_shapes", &warmup_obj)) {
+    std::string warmup_value;
+    RETURN_IF_ERROR(warmup_obj.MemberAsString("string_value", &warmup_value));
+    std::istringstream shapes(warmup_value);
+    std::string shape;
+    while (std::getline(shapes, shape, ',')) {
+      int batch_size = 0, seq_len = 0;
+      char sep = 0;
+      std::istringstream dims(shape);
+      if (!(dims >> batch_size >> sep >> seq_len) || sep != 'x') {
+        return TRITONSERVER_ErrorNew(
+            TRITONSERVER_ERROR_INVALID_ARG,
+            ("warmup_shapes must be like 1x32,8x128, got " + warmup_value)
+                .c_str());
+      }
+      warmup_shapes_.push_back({batch_size, seq_len});
+    }
+  }
+
+  common::TritonJson::Value sequence_batching;
+  sequence_batching_ =
+      ModelConfig().Find("sequence_batching", &sequence_batching);
+  common::TritonJson::Value max_new_tokens_obj;
+  if (parameters.Find("sequence_max_new_tokens", &max_new_tokens_obj)) {
+    std::string max_new_tokens_value;
+    RETURN_IF_ERROR(max_new_tokens_obj.MemberAsString("string_value",
+                                                      &max_new_tokens_value));
+    sequence_max_new_tokens_ = std::atoi(max_new_tokens_value.c_str());
+  }
+  common::TritonJson::Value idle_timeout_obj;
+  if (parameters.Find("sequence_idle_timeout_ms", &idle_timeout_obj)) {
+    std::string idle_timeout_value;
+    RETURN_IF_ERROR(
+        idle_timeout_obj.MemberAsString("string_value", &idle_timeout_value));
+    sequence_idle_timeout_ms_ = std::atoll(idle_timeout_value.c_str());
+  }
+  common::TritonJson::Value capture_path_obj;
+  if (parameters.Find("capture_path", &capture_path_obj)) {
+    RETURN_IF_ERROR(
+        capture_path_obj.MemberAsString("string_value", &capture_path_));
+  }
+  common::TritonJson::Value capture_rate_obj;
+  if (parameters.Find("capture_sample_rate", &capture_rate_obj)) {
+    std::string capture_rate_value;
+    RETURN_IF_ERROR(
+        capture_rate_obj.MemberAsString("string_value", &capture_rate_value));
+    capture_sample_rate_ = std::atof(capture_rate_value.c_str());
+  }
+
   // Record the file_name of model paramters
   const char* model_file_name;
   size_t file_name_len;
@@ -264,6 +398,28 @@ class ModelInstanceState : public BackendModelInstance {
   void* get_d_output(std::string output_name) {
     return d_outputs_map.find(output_name)->second;
   }
+  // pinned memory of the size of the input, for the async copies of the
+  // inputs in pageable host memory.
+  void* get_h_input(std::string input_name) {
+    return h_inputs_map.find(input_name)->second;
+  }
+
+  // Write the metrics of the model, see LSModel::metrics_text, to
+  // $LIGHTSEQ_METRICS_DIR/lightseq_<instance name>.prom for the textfile
+  // collector of the Prometheus node exporter, at most once per second.
+  void ExportMetrics();
+
+  // Run the turn of the sequence correlation_id, the new tokens of the
+  // conversation, and return the tokens of all of its turns so far with
+  // the ones generated. The turns of a sequence are one session of the
+  // model, which keeps the kv of the last ones rather than prefilling the
+  // whole conversation again, in its prefix cache or in host memory with
+  // LIGHTSEQ_KV_HOST_MB, see LSModel::add_request. A start restarts the
+  // sequence and an end drops it. Needs the continuous batching of Llama.
+  std::vector<int> RunSequenceTurn(uint64_t correlation_id, bool start,
+                                   bool end, const std::vector<int>& turn);
+  // Drop the sequences idle for longer than the sequence idle timeout.
+  void EvictIdleSequences();
 
  private:
   ModelInstanceState(ModelState* model_state,
@@ -275,7 +431,19 @@ class ModelInstanceState : public BackendModelInstance {
   std::unordered_map<std::string, int> output_name_map_;
 
   std::map<std::string, void*> d_inputs_map;
+  std::map<std::string, void*> h_inputs_map;
   std::map<std::string, void*> d_outputs_map;
+
+  std::chrono::steady_clock::time_point last_metrics_export_;
+
+  struct Sequence {
+    int session_id;
+    std::vector<int> tokens;
+    std::chrono::steady_clock::time_point last_use;
+  };
+  std::map<uint64_t, Sequence> sequences_;
+  int next_session_id_ = 0;
+  void EndSequence(uint64_t correlation_id);
 };
 
 ModelInstanceState::ModelInstanceState(
@@ -289,10 +457,21 @@ ModelInstanceState::ModelInstanceState(
 #ifdef LIGHTSEQ_cuda
   cudaSetDevice(DeviceId());
 #endif
-  lightseq_model_ptr_ = std::shared_ptr<::lightseq::cuda::LSModel>(
+  // all the contexts of the model are created by its constructor.
+  ::lightseq::StreamPriorityScope priority_scope(
+      model_state->GetStreamPriority());
+  ::lightseq::cuda::LSModel* model =
       ::lightseq::cuda::LSModelFactory::GetInstance().CreateModel(
           model_state->GetModelType(), file_name,
-          model_state_->MaxBatchSize()));
+          model_state_->MaxBatchSize(), model_state_->GetPrecision(),
+          ::lightseq::cuda::model_options_from_env());
+  // the instances of the model share one traffic log.
+  if (!model_state_->CapturePath().empty()) {
+    model = ::lightseq::cuda::capture_traffic_model(
+        model, model_state_->CapturePath(),
+        model_state_->CaptureSampleRate());
+  }
+  lightseq_model_ptr_ = std::shared_ptr<::lightseq::cuda::LSModel>(model);
 
   LOG_MESSAGE(TRITONSERVER_LOG_INFO, "lightseq_model initialize success");
 
@@ -326,6 +505,15 @@ ModelInstanceState::ModelInstanceState(
                  "failed allocate gpu memory");
     d_inputs_map.insert(std::make_pair(input_name, d_input));
     lightseq_model_ptr_->set_input_ptr(idx, d_input);
+
+    void* h_input = nullptr;
+#ifdef LIGHTSEQ_cuda
+    LOG_IF_ERROR(TRITONBACKEND_MemoryManagerAllocate(
+                     model_state->TritonMemoryManager(), &h_input,
+                     TRITONSERVER_MEMORY_CPU_PINNED, 0, input_byte_size),
+                 "failed allocate pinned memory");
+#endif
+    h_inputs_map.insert(std::make_pair(input_name, h_input));
   }
 
   // initialize d_outputs
@@ -341,11 +529,116 @@ ModelInstanceState::ModelInstanceState(
     void* d_output = nullptr;
     LOG_IF_ERROR(TRITONBACKEND_MemoryManagerAllocate(
                      model_state->TritonMemoryManager(), &d_output,
-                     TRITONSERVER_MEMORY_GPU, 0, output_byte_size),
+                     TRITONSERVER_MEMORY_GPU, DeviceId(), output_byte_size),
                  "failed allocate gpu memory");
     d_outputs_map.insert(std::make_pair(output_name, d_output));
     lightseq_model_ptr_->set_output_ptr(idx, d_output);
   }
+
+  // the first requests would pay for the gemm heuristics, the lazy loading
+  // of the kernels and the growth of the allocator otherwise.
+  if (!model_state_->GetWarmupShapes().empty()) {
+    std::vector<::lightseq::cuda::WarmupTiming> timings;
+    try {
+      timings = lightseq_model_ptr_->warmup(model_state_->GetWarmupShapes());
+    } catch (const std::exception& e) {
+      throw BackendModelInstanceException(TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INVALID_ARG,
+          (std::string("warmup failed, ") + e.what()).c_str()));
+    }
+    for (const ::lightseq::cuda::WarmupTiming& timing : timings) {
+      std::string msg = "warmup [" + std::to_string(timing.shape[0]) + ", " +
+                        std::to_string(timing.shape[1]) + "]: first Infer " +
+                        std::to_string(timing.first_ms) + " ms, then " +
+                        std::to_string(timing.second_ms) + " ms";
+      LOG_MESSAGE(TRITONSERVER_LOG_INFO, msg.c_str());
+    }
+  }
+}
+
+void ModelInstanceState::ExportMetrics() {
+  const char* metrics_dir = std::getenv("LIGHTSEQ_METRICS_DIR");
+  if (metrics_dir == nullptr) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (now - last_metrics_export_ < std::chrono::seconds(1)) {
+    return;
+  }
+  last_metrics_export_ = now;
+
+  // the collector must never read a partial file.
+  std::string path =
+      std::string(metrics_dir) + "/lightseq_" + Name() + ".prom";
+  std::string tmp_path = path + ".tmp";
+  std::ofstream fout(tmp_path);
+  if (!fout.is_open()) {
+    std::string msg = "failed to write metrics to " + tmp_path;
+    LOG_MESSAGE(TRITONSERVER_LOG_WARN, msg.c_str());
+    return;
+  }
+  fout << lightseq_model_ptr_->metrics_text();
+  fout.close();
+  std::rename(tmp_path.c_str(), path.c_str());
+}
+
+void ModelInstanceState::EndSequence(uint64_t correlation_id) {
+  auto iter = sequences_.find(correlation_id);
+  if (iter == sequences_.end()) {
+    return;
+  }
+  lightseq_model_ptr_->drop_session(iter->second.session_id);
+  sequences_.erase(iter);
+}
+
+std::vector<int> ModelInstanceState::RunSequenceTurn(
+    uint64_t correlation_id, bool start, bool end,
+    const std::vector<int>& turn) {
+  if (start) EndSequence(correlation_id);
+  auto iter = sequences_.find(correlation_id);
+  if (iter == sequences_.end()) {
+    Sequence sequence;
+    sequence.session_id = next_session_id_++;
+    iter = sequences_.emplace(correlation_id, sequence).first;
+  }
+  Sequence& sequence = iter->second;
+  sequence.tokens.insert(sequence.tokens.end(), turn.begin(), turn.end());
+  sequence.last_use = std::chrono::steady_clock::now();
+
+  std::vector<int> tokens;
+  try {
+    int request_id = lightseq_model_ptr_->add_request(
+        sequence.tokens, model_state_->SequenceMaxNewTokens(), 0, 0,
+        sequence.session_id);
+    while (tokens.empty() && lightseq_model_ptr_->has_pending_requests()) {
+      for (auto& finished : lightseq_model_ptr_->step()) {
+        if (finished.first == request_id) tokens = std::move(finished.second);
+      }
+    }
+  } catch (...) {
+    EndSequence(correlation_id);
+    throw;
+  }
+  sequence.tokens = tokens;
+  if (end) EndSequence(correlation_id);
+  return tokens;
+}
+
+void ModelInstanceState::EvictIdleSequences() {
+  int64_t timeout_ms = model_state_->SequenceIdleTimeoutMs();
+  if (timeout_ms <= 0) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  std::vector<uint64_t> idle;
+  for (auto& iter : sequences_) {
+    if (now - iter.second.last_use > std::chrono::milliseconds(timeout_ms)) {
+      idle.push_back(iter.first);
+    }
+  }
+  for (uint64_t correlation_id : idle) {
+    EndSequence(correlation_id);
+  }
 }
 
 }  // namespace lightseq
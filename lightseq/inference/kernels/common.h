@@ -3,6 +3,7 @@
 
 #include <cuda.h>
 #include <cuda_fp16.h>
+#include <curand_kernel.h>
 
 namespace lightseq {
 namespace cuda {
@@ -388,5 +389,22 @@ __forceinline__ __host__ __device__ void decompose_2dim(int src, int dim1,
   *id0 = src / dim1;
 }
 
+/* Sample one of k candidates sorted in descending order of logit by their
+ * softmax probability, see ker_logits_topk_launcher */
+__forceinline__ __device__ int sample_topk_candidate(const float *topk_val,
+                                                     const int *topk_idx,
+                                                     int k,
+                                                     curandState *state) {
+  if (k == 1) return topk_idx[0];
+  float sum_exp = 0.f;
+  for (int i = 0; i < k; i++) sum_exp += expf(topk_val[i] - topk_val[0]);
+  float x = curand_uniform(state) * sum_exp;
+  for (int i = 0; i < k - 1; i++) {
+    x -= expf(topk_val[i] - topk_val[0]);
+    if (x <= 0.f) return topk_idx[i];
+  }
+  return topk_idx[k - 1];
+}
+
 }  // namespace cuda
 }  // namespace lightseq
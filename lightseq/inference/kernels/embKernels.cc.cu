@@ -629,5 +629,99 @@ template void launch_patch_emb<__half>(
     int image_size, int batch_size, int max_step, int hidden_dim,
     int channel_input, cudaStream_t stream);
 
+/**
+@brief: ker_patch_im2col
+the elementwise part of the patch embedding: the rows of the cls and the
+position embeddings (plus the conv bias) of output, and the patches of input
+gathered into rows of patches, whose gemm with the conv weight is added to
+output afterwards, see VitEncoder::run_one_infer.
+Either input, float NCHW, or input_uint8, uint8 NHWC, is not null. The uint8
+pixels are normalized on the fly, pixel * pixel_scale[c] + pixel_shift[c].
+
+@thread
+gridDim.x = batch_size
+gridDim.y = max_step
+blockDim.x = MAX_THREADS
+
+@param
+conv_bias: [hidden_dim]
+pos_emb: [max_step, hidden_dim]
+cls_emb: [hidden_dim]
+input: [batch_size, channel_input, image_size, image_size]
+input_uint8: [batch_size, image_size, image_size, channel_input]
+pixel_norm: {pixel_scale, pixel_shift}, [2, channel_input]
+output: result, [batch_size, max_step, hidden_dim]
+patches: result, [batch_size, max_step - 1, channel_input * patch_size *
+  patch_size], a patch is laid out like a filter of the conv weight
+*/
+template <typename T>
+__global__ void ker_patch_im2col(const T *conv_bias, const T *pos_emb,
+                                 const T *cls_emb, const float *input,
+                                 const uint8_t *input_uint8,
+                                 const float *pixel_norm, T *output,
+                                 T *patches, int patch_size, int image_size,
+                                 int hidden_dim, int channel_input) {
+  int out_offset = flat_3dim(blockIdx.x, blockIdx.y, 0, gridDim.y, hidden_dim);
+  const T *pos = pos_emb + blockIdx.y * hidden_dim;
+  for (int i = threadIdx.x; i < hidden_dim; i += blockDim.x) {
+    T head = blockIdx.y == 0 ? __ldg(&cls_emb[i]) : __ldg(&conv_bias[i]);
+    output[out_offset + i] = head + __ldg(&pos[i]);
+  }
+  if (blockIdx.y == 0) {
+    return;
+  }
+
+  int val_num_per_patch = channel_input * patch_size * patch_size;
+  int patch_row_id, patch_col_id, value_row_id, value_col_id, channel_id;
+  decompose_2dim(blockIdx.y - 1, image_size / patch_size, &patch_row_id,
+                 &patch_col_id);
+  T *patch = patches + flat_3dim(blockIdx.x, blockIdx.y - 1, 0, gridDim.y - 1,
+                                 val_num_per_patch);
+  for (int idx = threadIdx.x; idx < val_num_per_patch; idx += blockDim.x) {
+    decompose_3dim(idx, patch_size, patch_size, &channel_id, &value_row_id,
+                   &value_col_id);
+    int row = patch_row_id * patch_size + value_row_id;
+    int col = patch_col_id * patch_size + value_col_id;
+    float val;
+    if (input_uint8) {
+      float pixel = __ldg(&input_uint8[flat_4dim(
+          blockIdx.x, row, col, channel_id, image_size, image_size,
+          channel_input)]);
+      val = pixel * __ldg(&pixel_norm[channel_id]) +
+            __ldg(&pixel_norm[channel_input + channel_id]);
+    } else {
+      val = __ldg(&input[flat_4dim(blockIdx.x, channel_id, row, col,
+                                   channel_input, image_size, image_size)]);
+    }
+    patch[idx] = (T)val;
+  }
+}
+
+template <typename T>
+void launch_patch_im2col(const T *conv_bias, const T *pos_emb,
+                         const T *cls_emb, const float *input,
+                         const uint8_t *input_uint8, const float *pixel_norm,
+                         T *output, T *patches, int patch_size, int image_size,
+                         int batch_size, int max_step, int hidden_dim,
+                         int channel_input, cudaStream_t stream) {
+  ker_patch_im2col<T><<<dim3(batch_size, max_step), MAX_THREADS, 0, stream>>>(
+      conv_bias, pos_emb, cls_emb, input, input_uint8, pixel_norm, output,
+      patches, patch_size, image_size, hidden_dim, channel_input);
+}
+
+template void launch_patch_im2col<float>(
+    const float *conv_bias, const float *pos_emb, const float *cls_emb,
+    const float *input, const uint8_t *input_uint8, const float *pixel_norm,
+    float *output, float *patches, int patch_size, int image_size,
+    int batch_size, int max_step, int hidden_dim, int channel_input,
+    cudaStream_t stream);
+
+template void launch_patch_im2col<__half>(
+    const __half *conv_bias, const __half *pos_emb, const __half *cls_emb,
+    const float *input, const uint8_t *input_uint8, const float *pixel_norm,
+    __half *output, __half *patches, int patch_size, int image_size,
+    int batch_size, int max_step, int hidden_dim, int channel_input,
+    cudaStream_t stream);
+
 }  // namespace cuda
 }  // namespace lightseq
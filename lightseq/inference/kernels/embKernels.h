@@ -1,6 +1,7 @@
 #pragma once
 #include <cuda.h>
 #include <cuda_fp16.h>
+#include <stdint.h>
 
 namespace lightseq {
 namespace cuda {
@@ -30,5 +31,13 @@ void launch_patch_emb(const T *conv_weight, const T *conv_bias,
                       int max_step, int hidden_dim, int channel_input,
                       cudaStream_t stream);
 
+template <typename T>
+void launch_patch_im2col(const T *conv_bias, const T *pos_emb,
+                         const T *cls_emb, const float *input,
+                         const uint8_t *input_uint8, const float *pixel_norm,
+                         T *output, T *patches, int patch_size, int image_size,
+                         int batch_size, int max_step, int hidden_dim,
+                         int channel_input, cudaStream_t stream);
+
 }  // namespace cuda
 }  // namespace lightseq
@@ -244,12 +244,13 @@ template void ker_attention_mask_weights_launcher<__half>(
 
 /**
 @brief: ker_arrange_qkv_with_cache
-split and reshape ori_qkv matrix into new_q, new_k, new_v during encoder
-self-attention
-ori_qkv is the result of gemm
+split and reshape ori_qkv matrix into new_q during the incremental decoding of
+gpt self-attention, and append the new k and v of the step to the caches,
+which are preallocated to cache_len tokens. Only the new tokens are written,
+so the cache traffic of a generation is linear in its length.
 
 @thread
-gridDim.x = batch_size * batch_seq_len
+gridDim.x = batch_size
 gridDim.y = 3
 blockDim.x = hidden_size
 
@@ -257,126 +258,95 @@ blockDim.x = hidden_size
 ori_qkv: [batch_size, 1, 3, hidden_size]
 qkv_bias: [3, hidden_size]
 new_q: [batch_size, head_num, 1, dim_per_head]
-max_batch_dim: max_batch_size * max_seq_len * hidden_size
-batch_seq_len: the sequence length of the current batch
+k_cache, v_cache: [batch_size, head_num, cache_len, dim_per_head]
+step: the position of the new token in the caches
 dim_per_head: dim of one head in multi-head attention
 head_num: head number in multi-head attention
 */
 template <typename T>
 __global__ void ker_arrange_qkv_with_cache(const T* ori_qkv, const T* qkv_bias,
-                                           T* new_q, T* new_k, T* k_cache,
-                                           T* new_v, T* v_cache,
-                                           int max_batch_dim, int batch_seq_len,
+                                           T* new_q, T* k_cache, T* v_cache,
+                                           int cache_len, int step,
                                            int dim_per_head, int head_num) {
-  int batch_id = blockIdx.x / batch_seq_len;
-  int token_id = blockIdx.x % batch_seq_len;
+  int batch_id = blockIdx.x;
   int head_id = threadIdx.x / dim_per_head;
   int dim_id = threadIdx.x % dim_per_head;
-  int target_id = targetid_4dim(batch_id, head_id, token_id, dim_id, head_num,
-                                batch_seq_len, dim_per_head);
-  T new_val;
-
-  if (token_id < batch_seq_len - 1) {
-    int old_target_id =
-        targetid_4dim(batch_id, head_id, token_id, dim_id, head_num,
-                      batch_seq_len - 1, dim_per_head);
-    if (blockIdx.y == 0) return;
-    if (blockIdx.y == 1) new_val = k_cache[old_target_id];
-    if (blockIdx.y == 2) new_val = v_cache[old_target_id];
-  } else {
-    new_val = ori_qkv[(batch_id * gridDim.y + blockIdx.y) * blockDim.x +
+  T new_val = ori_qkv[(batch_id * gridDim.y + blockIdx.y) * blockDim.x +
                       threadIdx.x] +
               __ldg(&qkv_bias[blockIdx.y * blockDim.x + threadIdx.x]);
-    if (blockIdx.y == 0) {
-      target_id = targetid_4dim(batch_id, head_id, 0, dim_id, head_num, 1,
-                                dim_per_head);
-    }
-  }
 
-  if (blockIdx.y == 0) new_q[target_id] = new_val;
-  if (blockIdx.y == 1) new_k[target_id] = new_val;
-  if (blockIdx.y == 2) new_v[target_id] = new_val;
+  if (blockIdx.y == 0) {
+    new_q[targetid_4dim(batch_id, head_id, 0, dim_id, head_num, 1,
+                        dim_per_head)] = new_val;
+    return;
+  }
+  int target_id = targetid_4dim(batch_id, head_id, step, dim_id, head_num,
+                                cache_len, dim_per_head);
+  if (blockIdx.y == 1) k_cache[target_id] = new_val;
+  if (blockIdx.y == 2) v_cache[target_id] = new_val;
 }
 
 template <>
 __global__ void ker_arrange_qkv_with_cache<__half>(
-    const __half* ori_qkv, const __half* qkv_bias, __half* new_q, __half* new_k,
-    __half* k_cache, __half* new_v, __half* v_cache, int max_batch_dim,
-    int batch_seq_len, int dim_per_head, int head_num) {
-  int batch_id = blockIdx.x / batch_seq_len;
-  int token_id = blockIdx.x % batch_seq_len;
+    const __half* ori_qkv, const __half* qkv_bias, __half* new_q,
+    __half* k_cache, __half* v_cache, int cache_len, int step,
+    int dim_per_head, int head_num) {
+  int batch_id = blockIdx.x;
   int head_id = threadIdx.x / dim_per_head;
   int dim_id = threadIdx.x % dim_per_head;
-  int target_id = targetid_4dim(batch_id, head_id, token_id, dim_id, head_num,
-                                batch_seq_len, dim_per_head);
-  half2 new_val;
   const half2* p_ori_qkv = (const half2*)ori_qkv;
   const half2* p_bias = (const half2*)qkv_bias;
-  const half2* p_k_cache = (const half2*)k_cache;
-  const half2* p_v_cache = (const half2*)v_cache;
-  half2* p_new_q = (half2*)new_q;
-  half2* p_new_k = (half2*)new_k;
-  half2* p_new_v = (half2*)new_v;
-
-  if (token_id < batch_seq_len - 1) {
-    int old_target_id =
-        targetid_4dim(batch_id, head_id, token_id, dim_id, head_num,
-                      batch_seq_len - 1, dim_per_head);
-    if (blockIdx.y == 0) return;
-    if (blockIdx.y == 1) new_val = p_k_cache[old_target_id];
-    if (blockIdx.y == 2) new_val = p_v_cache[old_target_id];
-  } else {
-    new_val =
-        __hadd2(p_ori_qkv[(batch_id * gridDim.y + blockIdx.y) * blockDim.x +
-                          threadIdx.x],
-                __ldg(&p_bias[blockIdx.y * blockDim.x + threadIdx.x]));
-    if (blockIdx.y == 0) {
-      target_id = targetid_4dim(batch_id, head_id, 0, dim_id, head_num, 1,
-                                dim_per_head);
-    }
+  half2 new_val =
+      __hadd2(p_ori_qkv[(batch_id * gridDim.y + blockIdx.y) * blockDim.x +
+                        threadIdx.x],
+              __ldg(&p_bias[blockIdx.y * blockDim.x + threadIdx.x]));
+
+  if (blockIdx.y == 0) {
+    ((half2*)new_q)[targetid_4dim(batch_id, head_id, 0, dim_id, head_num, 1,
+                                  dim_per_head)] = new_val;
+    return;
   }
-
-  if (blockIdx.y == 0) p_new_q[target_id] = new_val;
-  if (blockIdx.y == 1) p_new_k[target_id] = new_val;
-  if (blockIdx.y == 2) p_new_v[target_id] = new_val;
+  int target_id = targetid_4dim(batch_id, head_id, step, dim_id, head_num,
+                                cache_len, dim_per_head);
+  if (blockIdx.y == 1) ((half2*)k_cache)[target_id] = new_val;
+  if (blockIdx.y == 2) ((half2*)v_cache)[target_id] = new_val;
 }
 
 template <typename T>
-void ker_arrange_qkv_with_cache_launcher(int batch_token_num, int hidden_size,
+void ker_arrange_qkv_with_cache_launcher(int batch_size, int hidden_size,
                                          cudaStream_t stream, const T* ori_qkv,
-                                         const T* qkv_bias, T* new_q, T* new_k,
-                                         T* k_cache, T* new_v, T* v_cache,
-                                         int max_batch_dim, int batch_seq_len,
-                                         int dim_per_head, int head_num) {
+                                         const T* qkv_bias, T* new_q,
+                                         T* k_cache, T* v_cache, int cache_len,
+                                         int step, int dim_per_head,
+                                         int head_num) {
   ker_arrange_qkv_with_cache<T>
-      <<<dim3(batch_token_num, 3), hidden_size, 0, stream>>>(
-          ori_qkv, qkv_bias, new_q, new_k, k_cache, new_v, v_cache,
-          max_batch_dim, batch_seq_len, dim_per_head, head_num);
+      <<<dim3(batch_size, 3), hidden_size, 0, stream>>>(
+          ori_qkv, qkv_bias, new_q, k_cache, v_cache, cache_len, step,
+          dim_per_head, head_num);
 }
 
 template <>
 void ker_arrange_qkv_with_cache_launcher<__half>(
-    int batch_token_num, int hidden_size, cudaStream_t stream,
-    const __half* ori_qkv, const __half* qkv_bias, __half* new_q, __half* new_k,
-    __half* k_cache, __half* new_v, __half* v_cache, int max_batch_dim,
-    int batch_seq_len, int dim_per_head, int head_num) {
+    int batch_size, int hidden_size, cudaStream_t stream,
+    const __half* ori_qkv, const __half* qkv_bias, __half* new_q,
+    __half* k_cache, __half* v_cache, int cache_len, int step,
+    int dim_per_head, int head_num) {
   ker_arrange_qkv_with_cache<__half>
-      <<<dim3(batch_token_num, 3), hidden_size / 2, 0, stream>>>(
-          ori_qkv, qkv_bias, new_q, new_k, k_cache, new_v, v_cache,
-          max_batch_dim / 2, batch_seq_len, dim_per_head / 2, head_num);
+      <<<dim3(batch_size, 3), hidden_size / 2, 0, stream>>>(
+          ori_qkv, qkv_bias, new_q, k_cache, v_cache, cache_len, step,
+          dim_per_head / 2, head_num);
 }
 
 template void ker_arrange_qkv_with_cache_launcher<float>(
-    int batch_token_num, int hidden_size, cudaStream_t stream,
-    const float* ori_qkv, const float* qkv_bias, float* new_q, float* new_k,
-    float* k_cache, float* new_v, float* v_cache, int max_batch_dim,
-    int batch_seq_len, int dim_per_head, int head_num);
+    int batch_size, int hidden_size, cudaStream_t stream, const float* ori_qkv,
+    const float* qkv_bias, float* new_q, float* k_cache, float* v_cache,
+    int cache_len, int step, int dim_per_head, int head_num);
 
 template void ker_arrange_qkv_with_cache_launcher<__half>(
-    int batch_token_num, int hidden_size, cudaStream_t stream,
-    const __half* ori_qkv, const __half* qkv_bias, __half* new_q, __half* new_k,
-    __half* k_cache, __half* new_v, __half* v_cache, int max_batch_dim,
-    int batch_seq_len, int dim_per_head, int head_num);
+    int batch_size, int hidden_size, cudaStream_t stream,
+    const __half* ori_qkv, const __half* qkv_bias, __half* new_q,
+    __half* k_cache, __half* v_cache, int cache_len, int step,
+    int dim_per_head, int head_num);
 
 /**
 @brief: ker_ppl
@@ -464,6 +434,123 @@ template void ker_ppl_launcher<__half>(
     cudaStream_t stream, const __half* logits, const int* input_ids,
     const int* real_seq_len, float* ppl, int vocab_size);
 
+/**
+@brief: ker_gather_rows
+gather rows of a matrix, eg. the hidden states of the tokens to score out of
+a padded batch
+
+@thread
+gridDim.x = rows
+blockDim.x = max_thread_per_block
+
+@param
+input: [input_rows, hidden_size]
+row_idx: [rows], the input row of every output row
+output: [rows, hidden_size]
+*/
+template <typename T>
+__global__ void ker_gather_rows(const T* input, const int* row_idx, T* output,
+                                int hidden_size) {
+  const T* src = input + (size_t)row_idx[blockIdx.x] * hidden_size;
+  T* dst = output + (size_t)blockIdx.x * hidden_size;
+  for (int idx = threadIdx.x; idx < hidden_size; idx += blockDim.x) {
+    dst[idx] = src[idx];
+  }
+}
+
+template <typename T>
+void ker_gather_rows_launcher(int rows, int hidden_size,
+                              int max_thread_per_block, cudaStream_t stream,
+                              const T* input, const int* row_idx, T* output) {
+  ker_gather_rows<T><<<rows, max_thread_per_block, 0, stream>>>(
+      input, row_idx, output, hidden_size);
+}
+
+template void ker_gather_rows_launcher<float>(int rows, int hidden_size,
+                                              int max_thread_per_block,
+                                              cudaStream_t stream,
+                                              const float* input,
+                                              const int* row_idx,
+                                              float* output);
+
+template void ker_gather_rows_launcher<__half>(int rows, int hidden_size,
+                                               int max_thread_per_block,
+                                               cudaStream_t stream,
+                                               const __half* input,
+                                               const int* row_idx,
+                                               __half* output);
+
+/**
+@brief: ker_target_log_prob
+log softmax of every row of logits, gathered at the target token of the row.
+Unlike ker_ppl, the logits are read only once: every thread keeps a running
+max and the sum of exp(logit - max) rescaled when the max grows, the partial
+sums are rescaled to the block max before the block reduce.
+
+@thread
+gridDim.x = rows
+blockDim.x = max_thread_per_block
+
+@param
+logits: [rows, vocab_size]
+target_ids: [rows]
+log_probs: [rows], log(softmax(logits)[target_id])
+*/
+template <typename T>
+__global__ void ker_target_log_prob(const T* logits, const int* target_ids,
+                                    float* log_probs, int vocab_size) {
+  const T* row_logits = logits + (size_t)blockIdx.x * vocab_size;
+  float max_logit = CUDA_FLOAT_INF_NEG;
+  float sum_exp_logit = 0.f;
+  for (int idx = threadIdx.x; idx < vocab_size; idx += blockDim.x) {
+    float lgt = (float)row_logits[idx];
+    if (lgt > max_logit) {
+      sum_exp_logit = sum_exp_logit * expf(max_logit - lgt) + 1.f;
+      max_logit = lgt;
+    } else {
+      sum_exp_logit += expf(lgt - max_logit);
+    }
+  }
+
+  __shared__ float s_max_logit;
+  float block_max_logit = blockReduceMax(max_logit);
+  if (threadIdx.x == 0) {
+    s_max_logit = block_max_logit;
+  }
+  __syncthreads();
+
+  // threads without any logit have sum_exp_logit = 0
+  if (sum_exp_logit > 0.f) {
+    sum_exp_logit *= expf(max_logit - s_max_logit);
+  }
+  sum_exp_logit = blockReduceSum(sum_exp_logit);
+
+  if (threadIdx.x == 0) {
+    int token_id = target_ids[blockIdx.x];
+    log_probs[blockIdx.x] =
+        (float)row_logits[token_id] - s_max_logit - logf(sum_exp_logit);
+  }
+}
+
+template <typename T>
+void ker_target_log_prob_launcher(int rows, int max_thread_per_block,
+                                  cudaStream_t stream, const T* logits,
+                                  const int* target_ids, float* log_probs,
+                                  int vocab_size) {
+  ker_target_log_prob<T><<<rows, max_thread_per_block, 0, stream>>>(
+      logits, target_ids, log_probs, vocab_size);
+}
+
+template void ker_target_log_prob_launcher<float>(
+    int rows, int max_thread_per_block, cudaStream_t stream,
+    const float* logits, const int* target_ids, float* log_probs,
+    int vocab_size);
+
+template void ker_target_log_prob_launcher<__half>(
+    int rows, int max_thread_per_block, cudaStream_t stream,
+    const __half* logits, const int* target_ids, float* log_probs,
+    int vocab_size);
+
 /**
 @brief: ker_topk_sample
 
@@ -670,6 +757,66 @@ template void ker_topk_sample_launcher<__half>(
     const int vocab_size, const int k, int* unfinished,
     curandState* curandstate, int eos_id);
 
+/**
+@brief: ker_gpt_topk_sample_candidates
+sample the next token of every sequence from the top k candidates of
+ker_logits_topk_launcher, the sequences are updated like ker_topk_sample.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = WARP_SIZE
+
+@param
+topk_val: [batch_size, k]
+topk_idx: [batch_size, k]
+old_input_ids: [batch_size, batch_seq_len]
+new_input_ids: [batch_size, batch_seq_len+1]
+unfinished: [1]
+curandstate: [batch_size]
+*/
+__global__ void ker_gpt_topk_sample_candidates(
+    const float* topk_val, const int* topk_idx, int k, int* old_input_ids,
+    int* new_input_ids, const int batch_seq_len, int* unfinished,
+    curandState* curandstate, int eos_id) {
+  int last_token_idx_in_batch = blockIdx.x * batch_seq_len + batch_seq_len - 1;
+  __shared__ int s_tid;
+  if (threadIdx.x == 0) {
+    /* add EOS to end if last token is EOS */
+    if (old_input_ids[last_token_idx_in_batch] == eos_id) {
+      s_tid = eos_id;
+    } else {
+      s_tid = sample_topk_candidate(topk_val + blockIdx.x * k,
+                                    topk_idx + blockIdx.x * k, k,
+                                    curandstate + blockIdx.x);
+      if (s_tid != eos_id) unfinished[0] = 1;
+    }
+  }
+  __syncthreads();
+
+  /* copy old_input_ids to new_input_ids and add new sampled ids */
+  int left_token_idx = blockIdx.x * batch_seq_len + threadIdx.x;
+  int right_token_idx = (blockIdx.x + 1) * batch_seq_len;
+  for (int idx = left_token_idx; idx < right_token_idx; idx += blockDim.x) {
+    int new_idx = idx + blockIdx.x;
+    new_input_ids[new_idx] = old_input_ids[idx];
+  }
+  if (threadIdx.x == 0) {
+    new_input_ids[(blockIdx.x + 1) * (batch_seq_len + 1) - 1] = s_tid;
+    //  save the newly sampled ids to old_input_ids for next step inputs
+    old_input_ids[gridDim.x * batch_seq_len + blockIdx.x] = s_tid;
+  }
+}
+
+void ker_gpt_topk_sample_candidates_launcher(
+    int batch_size, int batch_seq_len, cudaStream_t stream,
+    const float* topk_val, const int* topk_idx, int k, int* old_input_ids,
+    int* new_input_ids, int* unfinished, curandState* curandstate,
+    int eos_id) {
+  ker_gpt_topk_sample_candidates<<<batch_size, WARP_SIZE, 0, stream>>>(
+      topk_val, topk_idx, k, old_input_ids, new_input_ids, batch_seq_len,
+      unfinished, curandstate, eos_id);
+}
+
 /**
 @brief: ker_topp_sample
 
@@ -28,12 +28,12 @@ void ker_attention_mask_weights_launcher(int batch_size, int dst_seq_len,
                                          const int* real_seq_len);
 
 template <typename T>
-void ker_arrange_qkv_with_cache_launcher(int batch_token_num, int hidden_size,
+void ker_arrange_qkv_with_cache_launcher(int batch_size, int hidden_size,
                                          cudaStream_t stream, const T* ori_qkv,
-                                         const T* qkv_bias, T* new_q, T* new_k,
-                                         T* k_cache, T* new_v, T* v_cache,
-                                         int max_batch_dim, int batch_seq_len,
-                                         int dim_per_head, int head_num);
+                                         const T* qkv_bias, T* new_q,
+                                         T* k_cache, T* v_cache, int cache_len,
+                                         int step, int dim_per_head,
+                                         int head_num);
 
 template <typename T>
 void ker_ppl_launcher(int batch_size, int batch_seq_len,
@@ -41,6 +41,20 @@ void ker_ppl_launcher(int batch_size, int batch_seq_len,
                       const T* logits, const int* input_ids,
                       const int* real_seq_len, float* ppl, int vocab_size);
 
+// gather the row_idx rows of input, [rows, hidden_size]
+template <typename T>
+void ker_gather_rows_launcher(int rows, int hidden_size,
+                              int max_thread_per_block, cudaStream_t stream,
+                              const T* input, const int* row_idx, T* output);
+
+// log softmax of every row of logits at its target token, fused over a
+// single read of the logits, see ker_target_log_prob
+template <typename T>
+void ker_target_log_prob_launcher(int rows, int max_thread_per_block,
+                                  cudaStream_t stream, const T* logits,
+                                  const int* target_ids, float* log_probs,
+                                  int vocab_size);
+
 template <typename T>
 void ker_topk_sample_launcher(int batch_size, int batch_seq_len,
                               int logits_seq_len, int max_thread_per_block,
@@ -59,5 +73,12 @@ void ker_topp_sample_launcher(int batch_size, int batch_seq_len,
                               const float p, int* unfinished,
                               curandState* curandstate, int eos_id);
 
+// ker_topk_sample_launcher from the candidates of ker_logits_topk_launcher.
+void ker_gpt_topk_sample_candidates_launcher(
+    int batch_size, int batch_seq_len, cudaStream_t stream,
+    const float* topk_val, const int* topk_idx, int k, int* old_input_ids,
+    int* new_input_ids, int* unfinished, curandState* curandstate,
+    int eos_id);
+
 }  // namespace cuda
 }  // namespace lightseq
@@ -2,6 +2,8 @@
 #include "transformerKernels.h"
 #include "common.h"
 
+#include <mma.h>
+
 /**
 @file
 Implemented the cuda kernel function and its launcher
@@ -149,351 +151,609 @@ template void ker_norm_layer_prepost_launcher<__half>(
     __half* output, const __half* scale, const __half* bias,
     const int max_thread_per_block, bool is_post_ln);
 
+namespace {
+
+// tokens routed by one block of ker_route_dispatch_tokens, every warp routes
+// kMoeRouteTileTokens / kRouteWarps of them.
+const int kRouteWarps = 8;
+const int kRouteMaxExperts = 256;
+const int kRouteMaxTopk = 8;
+const int kRouteExpertsPerLane = kRouteMaxExperts / WARP_SIZE;
+// the state of an expert in a tile of ker_route_dispatch_tokens, its count
+// in the low bits, and in the two high bits whether the count is the one of
+// the tile only or of every tile up to it. 0 is not published yet.
+const unsigned kTileAggregate = 1u << 30;
+const unsigned kTilePrefix = 2u << 30;
+const unsigned kTileCountMask = kTileAggregate - 1;
+
+// copy a row of hidden_size elements by the lanes of a warp, in 16 bytes
+// vectors when the row is aligned.
+template <typename T>
+__device__ void copy_row(const T* src, T* dst, int hidden_size, int lane_id) {
+  size_t row_bytes = hidden_size * sizeof(T);
+  if (((size_t)src | (size_t)dst | row_bytes) % sizeof(int4) == 0) {
+    const int4* src4 = reinterpret_cast<const int4*>(src);
+    int4* dst4 = reinterpret_cast<int4*>(dst);
+    for (int i = lane_id; i < row_bytes / sizeof(int4); i += WARP_SIZE) {
+      dst4[i] = __ldg(&src4[i]);
+    }
+    return;
+  }
+  for (int i = lane_id; i < hidden_size; i += WARP_SIZE) {
+    dst[i] = __ldg(&src[i]);
+  }
+}
+
+}  // namespace
+
 /**
-@brief: ker_softmax_topk_router
-softmax of gate output and route each token to topk experts
-Currently, support topk = 1, 2
+@brief: ker_route_dispatch_tokens
+softmax of the gate output, route each token to its topk experts and copy it
+to the capacity slots of its experts, in a single pass. The slots of an
+expert go to its tokens in token order, the tokens beyond its capacity are
+dropped. A block routes a tile of kMoeRouteTileTokens tokens, whose slots
+follow the ones of the tiles before it, found by a decoupled look-back over
+the per expert counts the tiles publish in workspace (Merrill and Garland,
+"Single-pass Parallel Prefix Scan with Decoupled Look-back"). The tiles are
+numbered in the order the blocks start, so a block only waits for blocks
+which are already running.
 
 @thread
-gridDim.x = batch_token_num
-blockDim.x = first multiple of WARP_SIZE greater than expert_num
+gridDim.x = ceil(batch_token_num / kMoeRouteTileTokens)
+blockDim.x = kRouteWarps * WARP_SIZE
 
 @param
 gate_out: [batch_token_num, expert_num]
-score_routed: [expert_num, max_token_num]
-  score if the token is routed to the expert, else -1.0
-expert_routed: [max_token_num * topk]
-  ids of two routed experts.
+input: [batch_token_num, hidden_size]
+score_routed: [topk, max_token_num]
+  score of the k-th expert of the token, normalized over the topk experts
+  when topk > 1.
+expert_routed: [topk, max_token_num]
+  ids of the routed experts.
+slot_routed: [topk, max_token_num]
+  slot of the token in its k-th expert, -1 if dropped.
+expert_rows: [expert_num], number of used slots of each expert
+workspace: [1 + gridDim.x * expert_num], zeros, the tile counter and the
+  tile states
+output: [expert_num, capacity, hidden_size]
 */
 template <typename T>
-__global__ void ker_softmax_topk_router(const T* gate_out, float* score_routed,
-                                        int* expert_routed, int batch_token_num,
-                                        int expert_num, int max_token_num,
-                                        int topk) {
-  int token_id = blockIdx.x, expert_id = threadIdx.x;
-  // softmax
-  float val = expert_id < expert_num
-                  ? (float)__ldg(&gate_out[token_id * expert_num + expert_id])
-                  : CUDA_FLOAT_INF_NEG;
-  float max_val = blockReduceMax(val);
-  __shared__ float smax;
-  if (threadIdx.x == 0) smax = max_val;
+__global__ void ker_route_dispatch_tokens(
+    const T* gate_out, const T* input, float* score_routed, int* expert_routed,
+    int* slot_routed, int* expert_rows, unsigned* workspace, T* output,
+    int batch_token_num, int expert_num, int max_token_num, int capacity,
+    int topk, int hidden_size) {
+  __shared__ int s_tile;
+  __shared__ int s_expert[kMoeRouteTileTokens][kRouteMaxTopk];
+  __shared__ int s_slot[kMoeRouteTileTokens][kRouteMaxTopk];
+  __shared__ int s_count[kRouteMaxExperts];
+  __shared__ int s_base[kRouteMaxExperts];
+  if (threadIdx.x == 0) s_tile = atomicAdd(workspace, 1u);
+  for (int e = threadIdx.x; e < expert_num; e += blockDim.x) s_count[e] = 0;
   __syncthreads();
-
-  float score = expert_id < expert_num ? expf(val - smax) : 0.f;
-  float rsum = blockReduceSum(score);
-  __shared__ float ssum;
-  if (threadIdx.x == 0) ssum = rsum;
-  __syncthreads();
-  score /= ssum;
-
-  // routing
-  int idx = expert_id * max_token_num + token_id;
-  score_routed[idx] = -1.0f;
-  __shared__ int first_expert;
-  __shared__ float first_score;
-  if (val == smax) {
-    first_expert = expert_id;
+  int tile = s_tile;
+  int warp_id = threadIdx.x / WARP_SIZE, lane_id = threadIdx.x % WARP_SIZE;
+
+  // softmax and topk of a token by a warp, the ties go to the lower expert
+  for (int t = warp_id; t < kMoeRouteTileTokens; t += kRouteWarps) {
+    int token_id = tile * kMoeRouteTileTokens + t;
+    if (token_id >= batch_token_num) {
+      if (lane_id < topk) s_expert[t][lane_id] = -1;
+      continue;
+    }
+    float val[kRouteExpertsPerLane];
+    float max_val = CUDA_FLOAT_INF_NEG;
+#pragma unroll
+    for (int i = 0; i < kRouteExpertsPerLane; i++) {
+      int e = lane_id + i * WARP_SIZE;
+      val[i] = e < expert_num
+                   ? (float)__ldg(&gate_out[token_id * expert_num + e])
+                   : CUDA_FLOAT_INF_NEG;
+      max_val = fmaxf(max_val, val[i]);
+    }
+    max_val = warpReduceMax(max_val);
+    float sum = 0.f;
+#pragma unroll
+    for (int i = 0; i < kRouteExpertsPerLane; i++) {
+      if (lane_id + i * WARP_SIZE < expert_num) sum += expf(val[i] - max_val);
+    }
+    sum = warpReduceSum(sum);
+
+    int my_expert = -1;
+    float my_score = 0.f, topk_sum = 0.f;
+    for (int k = 0; k < topk; k++) {
+      float best_val = CUDA_FLOAT_INF_NEG;
+      int best_expert = expert_num;
+#pragma unroll
+      for (int i = 0; i < kRouteExpertsPerLane; i++) {
+        int e = lane_id + i * WARP_SIZE;
+        if (e < expert_num && val[i] > best_val) {
+          best_val = val[i], best_expert = e;
+        }
+      }
+      for (int mask = WARP_SIZE >> 1; mask > 0; mask >>= 1) {
+        float other_val =
+            __shfl_xor_sync(WARP_REDUCE_MASK, best_val, mask, WARP_SIZE);
+        int other_expert =
+            __shfl_xor_sync(WARP_REDUCE_MASK, best_expert, mask, WARP_SIZE);
+        if (other_val > best_val ||
+            (other_val == best_val && other_expert < best_expert)) {
+          best_val = other_val, best_expert = other_expert;
+        }
+      }
+#pragma unroll
+      for (int i = 0; i < kRouteExpertsPerLane; i++) {
+        if (lane_id + i * WARP_SIZE == best_expert) {
+          val[i] = CUDA_FLOAT_INF_NEG;
+        }
+      }
+      float score = expf(best_val - max_val) / sum;
+      topk_sum += score;
+      if (lane_id == k) my_expert = best_expert, my_score = score;
+    }
+    if (lane_id < topk) {
+      int pos = lane_id * max_token_num + token_id;
+      score_routed[pos] = topk > 1 ? my_score / topk_sum : my_score;
+      expert_routed[pos] = my_expert;
+      s_expert[t][lane_id] = my_expert;
+    }
   }
   __syncthreads();
-  if (expert_id == first_expert) {
-    first_score = score;
-    expert_routed[token_id] = expert_id;
-    val = CUDA_FLOAT_INF_NEG;
-  }
 
-  if (topk == 1) {
-    if (expert_id == first_expert) {
-      score_routed[idx] = first_score;
+  // rank of a routed token among the tokens of its expert in the tile, a
+  // token goes to an expert at most once
+  int entry_token = threadIdx.x / topk, entry_k = threadIdx.x % topk;
+  int entry_expert = entry_token < kMoeRouteTileTokens
+                         ? s_expert[entry_token][entry_k]
+                         : -1;
+  int entry_rank = 0;
+  if (entry_expert >= 0) {
+    for (int t = 0; t < entry_token; t++) {
+      for (int k = 0; k < topk; k++) {
+        entry_rank += s_expert[t][k] == entry_expert;
+      }
     }
-    return;
+    atomicAdd(&s_count[entry_expert], 1);
   }
+  __syncthreads();
 
-  max_val = blockReduceMax(val);
-  if (threadIdx.x == 0) smax = max_val;
+  // the slots of the tiles before, looked back by a thread per expert
+  volatile unsigned* tile_state = workspace + 1;
+  for (int e = threadIdx.x; e < expert_num; e += blockDim.x) {
+    unsigned count = s_count[e];
+    unsigned* state = workspace + 1 + tile * expert_num + e;
+    unsigned base = 0;
+    if (tile > 0) {
+      atomicExch(state, kTileAggregate | count);
+      for (int prev = tile - 1;;) {
+        unsigned prev_state = tile_state[prev * expert_num + e];
+        if (prev_state == 0) continue;
+        base += prev_state & kTileCountMask;
+        if ((prev_state & ~kTileCountMask) == kTilePrefix) break;
+        prev--;
+      }
+    }
+    atomicExch(state, kTilePrefix | (base + count));
+    s_base[e] = base;
+    if (tile == gridDim.x - 1) {
+      expert_rows[e] = min(int(base + count), capacity);
+    }
+  }
   __syncthreads();
-  __shared__ int second_expert;
-  if (val == smax) {
-    second_expert = expert_id;
+
+  if (entry_expert >= 0) {
+    int slot = s_base[entry_expert] + entry_rank;
+    slot = slot < capacity ? slot : -1;
+    s_slot[entry_token][entry_k] = slot;
+    slot_routed[entry_k * max_token_num + tile * kMoeRouteTileTokens +
+                entry_token] = slot;
   }
   __syncthreads();
-  if (expert_id == second_expert) {
-    expert_routed[token_id + max_token_num] = expert_id;
-    score_routed[first_expert * max_token_num + token_id] =
-        first_score / (first_score + score);
-    score_routed[idx] = score / (first_score + score);
+
+  // copy the tokens to their slots, a warp per routed token
+  for (int entry = warp_id; entry < kMoeRouteTileTokens * topk;
+       entry += kRouteWarps) {
+    int t = entry / topk, k = entry % topk;
+    int expert_id = s_expert[t][k], slot = s_slot[t][k];
+    if (expert_id < 0 || slot < 0) continue;
+    int token_id = tile * kMoeRouteTileTokens + t;
+    copy_row(input + (size_t)token_id * hidden_size,
+             output + ((size_t)expert_id * capacity + slot) * hidden_size,
+             hidden_size, lane_id);
   }
 }
 
 template <typename T>
-void ker_softmax_topk_router_launcher(int batch_token_num, int expert_num,
-                                      int max_token_num, int topk,
-                                      cudaStream_t stream, const T* gate_out,
-                                      float* score_routed, int* expert_routed) {
-  int block_dim = (expert_num + 31) >> 5 << 5;
-  ker_softmax_topk_router<T><<<batch_token_num, block_dim, 0, stream>>>(
-      gate_out, score_routed, expert_routed, batch_token_num, expert_num,
-      max_token_num, topk);
+void ker_route_dispatch_tokens_launcher(
+    int batch_token_num, int expert_num, int max_token_num, int capacity,
+    int topk, int hidden_size, cudaStream_t stream, const T* gate_out,
+    const T* input, float* score_routed, int* expert_routed, int* slot_routed,
+    int* expert_rows, int* workspace, T* output) {
+  if (expert_num > kRouteMaxExperts || topk > kRouteMaxTopk ||
+      topk > expert_num) {
+    throw std::runtime_error(
+        "violate expert_num <= 256 and topk <= min(expert_num, 8)");
+  }
+  int num_tiles =
+      (batch_token_num + kMoeRouteTileTokens - 1) / kMoeRouteTileTokens;
+  if (num_tiles == 0) {
+    cudaMemsetAsync(expert_rows, 0, expert_num * sizeof(int), stream);
+    return;
+  }
+  cudaMemsetAsync(workspace, 0, (1 + num_tiles * expert_num) * sizeof(int),
+                  stream);
+  ker_route_dispatch_tokens<T>
+      <<<num_tiles, kRouteWarps * WARP_SIZE, 0, stream>>>(
+          gate_out, input, score_routed, expert_routed, slot_routed,
+          expert_rows, reinterpret_cast<unsigned*>(workspace), output,
+          batch_token_num, expert_num, max_token_num, capacity, topk,
+          hidden_size);
 }
 
-template void ker_softmax_topk_router_launcher<float>(
-    int batch_token_num, int expert_num, int max_token_num, int topk,
-    cudaStream_t stream, const float* gate_out, float* score_routed,
-    int* expert_routed);
-template void ker_softmax_topk_router_launcher<__half>(
-    int batch_token_num, int expert_num, int max_token_num, int topk,
-    cudaStream_t stream, const __half* gate_out, float* score_routed,
-    int* expert_routed);
+template void ker_route_dispatch_tokens_launcher<float>(
+    int batch_token_num, int expert_num, int max_token_num, int capacity,
+    int topk, int hidden_size, cudaStream_t stream, const float* gate_out,
+    const float* input, float* score_routed, int* expert_routed,
+    int* slot_routed, int* expert_rows, int* workspace, float* output);
 
-/**
-@brief: ker_reorder_tokens
-reorder tokens by expert routing
+template void ker_route_dispatch_tokens_launcher<__half>(
+    int batch_token_num, int expert_num, int max_token_num, int capacity,
+    int topk, int hidden_size, cudaStream_t stream, const __half* gate_out,
+    const __half* input, float* score_routed, int* expert_routed,
+    int* slot_routed, int* expert_rows, int* workspace, __half* output);
 
-@thread
-gridDim.x = expert_num
-gridDim.y = batch_token_num
-blockDim.x = max_thread_per_block
+namespace {
 
-@param
-input: [batch_token_num, hidden_size]
-score: [expert_num, max_token_num]
-output: [expert_num, max_token_num, hidden_size]
+const int kGemmTileM = 64;
+const int kGemmTileN = 64;
+const int kGemmThreads = 256;
+
+__forceinline__ __device__ float moe_activate(float x, MoeActivation act) {
+  if (act == MoeActivation::kRelu) return fmaxf(x, 0.f);
+  if (act == MoeActivation::kGelu) return gelu<float>(x);
+  return x;
+}
+
+/*
+One [kGemmTileM, kGemmTileN] tile of output = act(input * weight + bias) with
+fp32 fma, every thread owns a 4 x 4 micro-tile. input is [rows, in_dim],
+weight is [in_dim, out_dim].
 */
 template <typename T>
-__global__ void ker_reorder_tokens(const T* input, const float* score,
-                                   T* output, int max_token_num,
-                                   int hidden_size) {
-  int expert_id = blockIdx.x, token_id = blockIdx.y;
-  int score_pos = expert_id * max_token_num + token_id;
-  if (__ldg(&score[score_pos]) > 0.) {
-    for (std::size_t i = threadIdx.x; i < hidden_size; i += blockDim.x) {
-      output[score_pos * hidden_size + i] =
-          __ldg(&input[token_id * hidden_size + i]);
+__device__ void gemm_tile_simt(const T* input, const T* weight, const T* bias,
+                               T* output, int rows, int in_dim, int out_dim,
+                               int row_begin, int col_begin,
+                               MoeActivation act) {
+  const int kTileK = 16;
+  __shared__ float s_a[kGemmTileM][kTileK + 1];
+  __shared__ float s_w[kTileK][kGemmTileN];
+  int tx = threadIdx.x % 16;
+  int ty = threadIdx.x / 16;
+  float acc[4][4] = {0.f};
+
+  for (int k_begin = 0; k_begin < in_dim; k_begin += kTileK) {
+    for (int idx = threadIdx.x; idx < kGemmTileM * kTileK;
+         idx += kGemmThreads) {
+      int r = idx / kTileK, k = idx % kTileK;
+      int row = row_begin + r, col = k_begin + k;
+      s_a[r][k] = row < rows && col < in_dim
+                      ? float(input[(size_t)row * in_dim + col])
+                      : 0.f;
+    }
+    for (int idx = threadIdx.x; idx < kTileK * kGemmTileN;
+         idx += kGemmThreads) {
+      int k = idx / kGemmTileN, c = idx % kGemmTileN;
+      int row = k_begin + k, col = col_begin + c;
+      s_w[k][c] = row < in_dim && col < out_dim
+                      ? float(weight[(size_t)row * out_dim + col])
+                      : 0.f;
+    }
+    __syncthreads();
+#pragma unroll
+    for (int k = 0; k < kTileK; k++) {
+      float a[4], w[4];
+#pragma unroll
+      for (int i = 0; i < 4; i++) {
+        a[i] = s_a[ty + 16 * i][k];
+        w[i] = s_w[k][tx + 16 * i];
+      }
+#pragma unroll
+      for (int i = 0; i < 4; i++) {
+#pragma unroll
+        for (int j = 0; j < 4; j++) acc[i][j] += a[i] * w[j];
+      }
+    }
+    __syncthreads();
+  }
+
+#pragma unroll
+  for (int i = 0; i < 4; i++) {
+    int row = row_begin + ty + 16 * i;
+    if (row >= rows) continue;
+#pragma unroll
+    for (int j = 0; j < 4; j++) {
+      int col = col_begin + tx + 16 * j;
+      if (col >= out_dim) continue;
+      float val = acc[i][j];
+      if (bias) val += float(bias[col]);
+      output[(size_t)row * out_dim + col] = T(moe_activate(val, act));
     }
   }
 }
 
 template <typename T>
-void ker_reorder_tokens_launcher(int batch_token_num, int expert_num,
-                                 int max_token_num, int hidden_size,
-                                 int max_thread_per_block, cudaStream_t stream,
-                                 const T* input, const float* score,
-                                 T* output) {
-  ker_reorder_tokens<T>
-      <<<dim3(expert_num, batch_token_num), max_thread_per_block, 0, stream>>>(
-          input, score, output, max_token_num, hidden_size);
+__device__ void gemm_tile(const T* input, const T* weight, const T* bias,
+                          T* output, int rows, int in_dim, int out_dim,
+                          int row_begin, int col_begin, MoeActivation act) {
+  gemm_tile_simt(input, weight, bias, output, rows, in_dim, out_dim,
+                 row_begin, col_begin, act);
 }
 
-template void ker_reorder_tokens_launcher<float>(
-    int batch_token_num, int expert_num, int max_token_num, int hidden_size,
-    int max_thread_per_block, cudaStream_t stream, const float* input,
-    const float* score, float* output);
+/*
+fp16 tiles run on tensor cores from sm70 on: every one of the 8 warps owns a
+[16, 32] piece of the tile, accumulated in fp32.
+*/
+template <>
+__device__ void gemm_tile<__half>(const __half* input, const __half* weight,
+                                  const __half* bias, __half* output,
+                                  int rows, int in_dim, int out_dim,
+                                  int row_begin, int col_begin,
+                                  MoeActivation act) {
+#if __CUDA_ARCH__ >= 700
+  using namespace nvcuda;
+  const int kTileK = 32;
+  // padded to keep the fragments off the same banks, multiples of 8 halfs.
+  __shared__ __align__(32) __half s_a[kGemmTileM][kTileK + 8];
+  __shared__ __align__(32) __half s_w[kTileK][kGemmTileN + 8];
+  __shared__ __align__(32) float s_c[kGemmTileM][kGemmTileN + 4];
+  int warp_id = threadIdx.x / WARP_SIZE;
+  int warp_row = (warp_id % 4) * 16;
+  int warp_col = (warp_id / 4) * 32;
+  wmma::fragment<wmma::accumulator, 16, 16, 16, float> acc[2];
+  wmma::fill_fragment(acc[0], 0.f);
+  wmma::fill_fragment(acc[1], 0.f);
+
+  for (int k_begin = 0; k_begin < in_dim; k_begin += kTileK) {
+    for (int idx = threadIdx.x; idx < kGemmTileM * kTileK;
+         idx += kGemmThreads) {
+      int r = idx / kTileK, k = idx % kTileK;
+      int row = row_begin + r, col = k_begin + k;
+      s_a[r][k] = row < rows && col < in_dim
+                      ? input[(size_t)row * in_dim + col]
+                      : __float2half(0.f);
+    }
+    for (int idx = threadIdx.x; idx < kTileK * kGemmTileN;
+         idx += kGemmThreads) {
+      int k = idx / kGemmTileN, c = idx % kGemmTileN;
+      int row = k_begin + k, col = col_begin + c;
+      s_w[k][c] = row < in_dim && col < out_dim
+                      ? weight[(size_t)row * out_dim + col]
+                      : __float2half(0.f);
+    }
+    __syncthreads();
+#pragma unroll
+    for (int k = 0; k < kTileK; k += 16) {
+      wmma::fragment<wmma::matrix_a, 16, 16, 16, __half, wmma::row_major> a;
+      wmma::load_matrix_sync(a, &s_a[warp_row][k], kTileK + 8);
+#pragma unroll
+      for (int j = 0; j < 2; j++) {
+        wmma::fragment<wmma::matrix_b, 16, 16, 16, __half, wmma::row_major> w;
+        wmma::load_matrix_sync(w, &s_w[k][warp_col + 16 * j],
+                               kGemmTileN + 8);
+        wmma::mma_sync(acc[j], a, w, acc[j]);
+      }
+    }
+    __syncthreads();
+  }
+
+#pragma unroll
+  for (int j = 0; j < 2; j++) {
+    wmma::store_matrix_sync(&s_c[warp_row][warp_col + 16 * j], acc[j],
+                            kGemmTileN + 4, wmma::mem_row_major);
+  }
+  __syncthreads();
+  for (int idx = threadIdx.x; idx < kGemmTileM * kGemmTileN;
+       idx += kGemmThreads) {
+    int r = idx / kGemmTileN, c = idx % kGemmTileN;
+    int row = row_begin + r, col = col_begin + c;
+    if (row >= rows || col >= out_dim) continue;
+    float val = s_c[r][c];
+    if (bias) val += __half2float(bias[col]);
+    output[(size_t)row * out_dim + col] = __float2half(moe_activate(val, act));
+  }
+#else
+  gemm_tile_simt(input, weight, bias, output, rows, in_dim, out_dim,
+                 row_begin, col_begin, act);
+#endif
+}
 
-template void ker_reorder_tokens_launcher<__half>(
-    int batch_token_num, int expert_num, int max_token_num, int hidden_size,
-    int max_thread_per_block, cudaStream_t stream, const __half* input,
-    const float* score, __half* output);
+}  // namespace
 
 /**
-@brief: ker_strided_bias_gelu
-activated by gelu, add bias, each expert has unique bias
+@brief: ker_group_tile_offset
+exclusive prefix sum of the row tiles of the groups, so that gemm blocks are
+only launched for the rows in use.
 
 @thread
-gridDim.x = expert_num
-gridDim.y = batch_token_num
-blockDim.x = max_thread_per_block
+gridDim.x = 1
+blockDim.x = MAX_THREADS
 
 @param
-input: [expert_num, max_token_num, feature_dim]
-bias: [expert_num, feature_dim]
-feature_dim: the dim of input feature
+group_rows: [num_groups]
+tile_offset: [num_groups + 1], the total number of tiles at num_groups
 */
-template <typename T>
-__global__ void ker_strided_bias_gelu(T* input, const T* bias, int feature_dim,
-                                      int max_token_num) {
-  int offset = (blockIdx.x * max_token_num + blockIdx.y) * feature_dim;
-  for (int idx = threadIdx.x; idx < feature_dim; idx += blockDim.x) {
-    int cur_offset = offset + idx;
-    input[cur_offset] = gelu<float>(
-        input[cur_offset] + __ldg(&bias[blockIdx.x * feature_dim + idx]));
+__global__ void ker_group_tile_offset(const int* group_rows, int* tile_offset,
+                                      int num_groups) {
+  typedef cub::BlockScan<int, MAX_THREADS> BlockScan;
+  __shared__ typename BlockScan::TempStorage temp_storage;
+  int tile_base = 0;
+  for (int base = 0; base < num_groups; base += blockDim.x) {
+    int group_id = base + threadIdx.x;
+    int tiles = group_id < num_groups
+                    ? (group_rows[group_id] + kGemmTileM - 1) / kGemmTileM
+                    : 0;
+    int offset, tile_num;
+    BlockScan(temp_storage).ExclusiveSum(tiles, offset, tile_num);
+    __syncthreads();
+    if (group_id < num_groups) tile_offset[group_id] = tile_base + offset;
+    tile_base += tile_num;
   }
+  if (threadIdx.x == 0) tile_offset[num_groups] = tile_base;
 }
 
-/* fp16 version */
-template <>
-__global__ void ker_strided_bias_gelu<__half>(__half* input, const __half* bias,
-                                              int feature_dim,
-                                              int max_token_num) {
-  int offset = (blockIdx.x * max_token_num + blockIdx.y) * feature_dim;
-  half2* pinput = (half2*)input;
-  const half2* pbias = (const half2*)bias;
-  for (int idx = threadIdx.x; idx < feature_dim; idx += blockDim.x) {
-    int cur_offset = offset + idx;
-    pinput[cur_offset] = gelu<half2>(__hadd2(
-        pinput[cur_offset], __ldg(&pbias[blockIdx.x * feature_dim + idx])));
-  }
-}
-
-template <typename T>
-void ker_strided_bias_gelu_launcher(int batch_token_num, int expert_num,
-                                    int max_token_num, int feature_dim,
-                                    int block_dim, cudaStream_t stream,
-                                    T* input, const T* bias) {
-  ker_strided_bias_gelu<T>
-      <<<dim3(expert_num, batch_token_num), block_dim, 0, stream>>>(
-          input, bias, feature_dim, max_token_num);
-}
-
-template <>
-void ker_strided_bias_gelu_launcher<__half>(int batch_token_num, int expert_num,
-                                            int max_token_num, int feature_dim,
-                                            int block_dim, cudaStream_t stream,
-                                            __half* input, const __half* bias) {
-  ker_strided_bias_gelu<__half>
-      <<<dim3(expert_num, batch_token_num), block_dim, 0, stream>>>(
-          input, bias, feature_dim / 2, max_token_num);
-}
-
-template void ker_strided_bias_gelu_launcher<float>(
-    int batch_token_num, int expert_num, int max_token_num, int feature_dim,
-    int block_dim, cudaStream_t stream, float* input, const float* bias);
-
-template void ker_strided_bias_gelu_launcher<__half>(
-    int batch_token_num, int expert_num, int max_token_num, int feature_dim,
-    int block_dim, cudaStream_t stream, __half* input, const __half* bias);
-
 /**
-@brief: ker_strided_bias_relu
-activated by relu, add bias, each expert has unique bias
+@brief: ker_grouped_gemm_bias_act
+one variable size gemm per group, fused with bias and activation. the blocks
+of gridDim.x are spread over the row tiles of all groups, blocks beyond the
+tiles in use exit at once.
 
 @thread
-gridDim.x = expert_num
-gridDim.y = batch_token_num
-blockDim.x = max_thread_per_block
+gridDim.x = upper bound of the row tiles in use
+gridDim.y = ceil(out_dim / kGemmTileN)
+blockDim.x = kGemmThreads
 
 @param
-input: [expert_num, max_token_num, feature_dim]
-bias: [expert_num, feature_dim]
-feature_dim: the dim of input feature
+input: [num_groups, group_capacity, in_dim]
+weight: [weight_num, in_dim, out_dim]
+bias: [weight_num, out_dim] or nullptr
+output: [num_groups, group_capacity, out_dim]
 */
 template <typename T>
-__global__ void ker_strided_bias_relu(T* input, const T* bias, int feature_dim,
-                                      int max_token_num) {
-  int offset = (blockIdx.x * max_token_num + blockIdx.y) * feature_dim;
-  for (int idx = threadIdx.x; idx < feature_dim; idx += blockDim.x) {
-    int cur_offset = offset + idx;
-    input[cur_offset] =
-        max(input[cur_offset] + __ldg(&bias[blockIdx.x * feature_dim + idx]),
-            (T)0.f);
-  }
-}
-
-template <>
-__global__ void ker_strided_bias_relu<__half>(__half* input, const __half* bias,
-                                              int feature_dim,
-                                              int max_token_num) {
-  int offset = (blockIdx.x * max_token_num + blockIdx.y) * feature_dim;
-  half2* pinput = (half2*)input;
-  const half2* pbias = (const half2*)bias;
-  for (int idx = threadIdx.x; idx < feature_dim; idx += blockDim.x) {
-    int cur_offset = offset + idx;
-    float2 f2_inp = __half22float2(pinput[cur_offset]);
-    float2 f2_bias =
-        __half22float2(__ldg(&pbias[blockIdx.x * feature_dim + idx]));
-    f2_inp.x = fmaxf(f2_inp.x + f2_bias.x, 0.f);
-    f2_inp.y = fmaxf(f2_inp.y + f2_bias.y, 0.f);
-    pinput[cur_offset] = __float22half2_rn(f2_inp);
+__global__ void ker_grouped_gemm_bias_act(
+    int num_groups, int weight_num, int group_capacity, int in_dim,
+    int out_dim, const int* group_rows, const int* tile_offset, const T* input,
+    const T* weight, const T* bias, T* output, MoeActivation act) {
+  int tile_id = blockIdx.x;
+  if (tile_id >= tile_offset[num_groups]) return;
+  // the last group whose tiles start at or before tile_id.
+  int lo = 0, hi = num_groups - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (tile_offset[mid] <= tile_id) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
   }
+  int group_id = lo;
+  int weight_id = group_id % weight_num;
+  size_t row_offset = (size_t)group_id * group_capacity;
+  gemm_tile(input + row_offset * in_dim,
+            weight + (size_t)weight_id * in_dim * out_dim,
+            bias ? bias + (size_t)weight_id * out_dim : nullptr,
+            output + row_offset * out_dim, group_rows[group_id], in_dim,
+            out_dim, (tile_id - tile_offset[group_id]) * kGemmTileM,
+            blockIdx.y * kGemmTileN, act);
 }
 
 template <typename T>
-void ker_strided_bias_relu_launcher(int batch_token_num, int expert_num,
-                                    int max_token_num, int feature_dim,
-                                    int block_dim, cudaStream_t stream,
-                                    T* input, const T* bias) {
-  ker_strided_bias_relu<T>
-      <<<dim3(expert_num, batch_token_num), block_dim, 0, stream>>>(
-          input, bias, feature_dim, max_token_num);
-}
-
-template <>
-void ker_strided_bias_relu_launcher<__half>(int batch_token_num, int expert_num,
-                                            int max_token_num, int feature_dim,
-                                            int block_dim, cudaStream_t stream,
-                                            __half* input, const __half* bias) {
-  ker_strided_bias_relu<__half>
-      <<<dim3(expert_num, batch_token_num), block_dim, 0, stream>>>(
-          input, bias, feature_dim / 2, max_token_num);
+void ker_grouped_gemm_bias_act_launcher(
+    int num_groups, int weight_num, int group_capacity, int max_rows,
+    int in_dim, int out_dim, const int* group_rows, int* tile_offset,
+    const T* input, const T* weight, const T* bias, T* output,
+    MoeActivation act, cudaStream_t stream) {
+  ker_group_tile_offset<<<1, MAX_THREADS, 0, stream>>>(group_rows, tile_offset,
+                                                       num_groups);
+  int tile_bound =
+      min(num_groups * ((group_capacity + kGemmTileM - 1) / kGemmTileM),
+          (max_rows + kGemmTileM - 1) / kGemmTileM + num_groups);
+  if (tile_bound <= 0) return;
+  dim3 grid_dim(tile_bound, (out_dim + kGemmTileN - 1) / kGemmTileN);
+  ker_grouped_gemm_bias_act<T><<<grid_dim, kGemmThreads, 0, stream>>>(
+      num_groups, weight_num, group_capacity, in_dim, out_dim, group_rows,
+      tile_offset, input, weight, bias, output, act);
 }
 
-template void ker_strided_bias_relu_launcher<float>(
-    int batch_token_num, int expert_num, int max_token_num, int feature_dim,
-    int block_dim, cudaStream_t stream, float* input, const float* bias);
-
-template void ker_strided_bias_relu_launcher<__half>(
-    int batch_token_num, int expert_num, int max_token_num, int feature_dim,
-    int block_dim, cudaStream_t stream, __half* input, const __half* bias);
-
+template void ker_grouped_gemm_bias_act_launcher<float>(
+    int num_groups, int weight_num, int group_capacity, int max_rows,
+    int in_dim, int out_dim, const int* group_rows, int* tile_offset,
+    const float* input, const float* weight, const float* bias, float* output,
+    MoeActivation act, cudaStream_t stream);
+
+template void ker_grouped_gemm_bias_act_launcher<__half>(
+    int num_groups, int weight_num, int group_capacity, int max_rows,
+    int in_dim, int out_dim, const int* group_rows, int* tile_offset,
+    const __half* input, const __half* weight, const __half* bias,
+    __half* output, MoeActivation act, cudaStream_t stream);
 /**
-@brief: ker_bias_redirect_tokens
+@brief: ker_bias_combine_residual
 add second bias, each expert has unique bias,
-redirect tokens to original positions, combine by score
+gather tokens from the capacity slots of their experts, combine by score.
+dropped tokens only keep the residual. The routing of the token, see
+ker_route_dispatch_tokens, is read once into the registers of every thread.
 
 @thread
 gridDim.x = batch_token_num
 blockDim.x = max_thread_per_block
 
 @param
-input: [expert_num, max_token_num, feature_dim]
+input: [expert_num, capacity, feature_dim]
 bias: [expert_num, feature_dim]
-score: [expert_num, max_token_num]
-expert_routed: [max_token_num * topk]
+score: [topk, max_token_num]
+expert_routed: [topk, max_token_num]
+slot_routed: [topk, max_token_num]
 output: [batch_token_num, feature_dim]
 */
 template <typename T>
-__global__ void ker_bias_redirect_residual(const T* input, const T* bias,
-                                           const float* score,
-                                           const int* expert_routed, T* output,
-                                           int feature_dim, int max_token_num,
-                                           int topk) {
-  int expert_id = -1, token_id = blockIdx.x;
-  float input_val, score_val, bias_val, output_val;
+__global__ void ker_bias_combine_residual(const T* input, const T* bias,
+                                          const float* score,
+                                          const int* expert_routed,
+                                          const int* slot_routed, T* output,
+                                          int feature_dim, int max_token_num,
+                                          int capacity, int topk) {
+  int token_id = blockIdx.x;
+  // the used slots of the token and their experts, the dropped ones are
+  // skipped.
+  int routed_num = 0;
+  int row[kRouteMaxTopk], expert[kRouteMaxTopk];
+  float weight[kRouteMaxTopk];
+  for (int k = 0; k < topk; ++k) {
+    int pos = k * max_token_num + token_id;
+    int slot = __ldg(&slot_routed[pos]);
+    if (slot < 0) continue;
+    expert[routed_num] = __ldg(&expert_routed[pos]);
+    row[routed_num] = expert[routed_num] * capacity + slot;
+    weight[routed_num++] = __ldg(&score[pos]);
+  }
   for (int idx = threadIdx.x; idx < feature_dim; idx += blockDim.x) {
-    output_val = 0.0;
-    for (int k = 0; k < topk; ++k) {
-      expert_id = __ldg(&expert_routed[k * max_token_num + token_id]);
-      score_val = __ldg(&score[expert_id * max_token_num + token_id]);
-      input_val = __ldg(
-          &input[(expert_id * max_token_num + token_id) * feature_dim + idx]);
-      bias_val = __ldg(&bias[expert_id * feature_dim + idx]);
-      output_val += ((input_val + bias_val) * score_val);
+    float output_val = 0.f;
+    for (int k = 0; k < routed_num; ++k) {
+      float input_val = __ldg(&input[row[k] * feature_dim + idx]);
+      float bias_val = __ldg(&bias[expert[k] * feature_dim + idx]);
+      output_val += (input_val + bias_val) * weight[k];
     }
     output[token_id * feature_dim + idx] += output_val;
   }
 }
 
 template <>
-__global__ void ker_bias_redirect_residual<__half>(
+__global__ void ker_bias_combine_residual<__half>(
     const __half* input, const __half* bias, const float* score,
-    const int* expert_routed, __half* output, int feature_dim,
-    int max_token_num, int topk) {
-  int expert_id = -1, token_id = blockIdx.x;
+    const int* expert_routed, const int* slot_routed, __half* output,
+    int feature_dim, int max_token_num, int capacity, int topk) {
+  int token_id = blockIdx.x;
   const half2 *pinput = (const half2*)input, *pbias = (const half2*)bias;
   half2* poutput = (half2*)output;
-  float2 f2_input_val, f2_bias_val, f2_output_val;
-  float score_val;
+  int routed_num = 0;
+  int row[kRouteMaxTopk], expert[kRouteMaxTopk];
+  float weight[kRouteMaxTopk];
+  for (int k = 0; k < topk; ++k) {
+    int pos = k * max_token_num + token_id;
+    int slot = __ldg(&slot_routed[pos]);
+    if (slot < 0) continue;
+    expert[routed_num] = __ldg(&expert_routed[pos]);
+    row[routed_num] = expert[routed_num] * capacity + slot;
+    weight[routed_num++] = __ldg(&score[pos]);
+  }
   for (int idx = threadIdx.x; idx < feature_dim; idx += blockDim.x) {
-    f2_output_val.x = 0.f;
-    f2_output_val.y = 0.f;
-    for (int k = 0; k < topk; ++k) {
-      expert_id = __ldg(&expert_routed[k * max_token_num + token_id]);
-      score_val = __ldg(&score[expert_id * max_token_num + token_id]);
-      f2_input_val = __half22float2(__ldg(
-          &pinput[(expert_id * max_token_num + token_id) * feature_dim + idx]));
-      f2_bias_val =
-          __half22float2(__ldg(&pbias[expert_id * feature_dim + idx]));
-      f2_output_val.x += ((f2_input_val.x + f2_bias_val.x) * score_val);
-      f2_output_val.y += ((f2_input_val.y + f2_bias_val.y) * score_val);
+    float2 f2_output_val = make_float2(0.f, 0.f);
+    for (int k = 0; k < routed_num; ++k) {
+      float2 f2_input_val =
+          __half22float2(__ldg(&pinput[row[k] * feature_dim + idx]));
+      float2 f2_bias_val =
+          __half22float2(__ldg(&pbias[expert[k] * feature_dim + idx]));
+      f2_output_val.x += (f2_input_val.x + f2_bias_val.x) * weight[k];
+      f2_output_val.y += (f2_input_val.y + f2_bias_val.y) * weight[k];
     }
     poutput[token_id * feature_dim + idx] =
         __hadd2(poutput[token_id * feature_dim + idx],
@@ -502,36 +762,32 @@ __global__ void ker_bias_redirect_residual<__half>(
 }
 
 template <typename T>
-void ker_bias_redirect_residual_launcher(int hidden_size, int max_token_num,
-                                         int topk, int batch_token_num,
-                                         int block_dim, cudaStream_t stream,
-                                         const T* input, const T* bias,
-                                         const float* score,
-                                         const int* expert_routed, T* output) {
-  ker_bias_redirect_residual<T><<<batch_token_num, block_dim, 0, stream>>>(
-      input, bias, score, expert_routed, output, hidden_size, max_token_num,
-      topk);
+void ker_bias_combine_residual_launcher(
+    int hidden_size, int max_token_num, int capacity, int topk,
+    int batch_token_num, int block_dim, cudaStream_t stream, const T* input,
+    const T* bias, const float* score, const int* expert_routed,
+    const int* slot_routed, T* output) {
+  ker_bias_combine_residual<T><<<batch_token_num, block_dim, 0, stream>>>(
+      input, bias, score, expert_routed, slot_routed, output, hidden_size,
+      max_token_num, capacity, topk);
 }
 
 template <>
-void ker_bias_redirect_residual_launcher<__half>(
-    int hidden_size, int max_token_num, int topk, int batch_token_num,
-    int block_dim, cudaStream_t stream, const __half* input, const __half* bias,
-    const float* score, const int* expert_routed, __half* output) {
-  ker_bias_redirect_residual<__half><<<batch_token_num, block_dim, 0, stream>>>(
-      input, bias, score, expert_routed, output, hidden_size / 2, max_token_num,
-      topk);
+void ker_bias_combine_residual_launcher<__half>(
+    int hidden_size, int max_token_num, int capacity, int topk,
+    int batch_token_num, int block_dim, cudaStream_t stream,
+    const __half* input, const __half* bias, const float* score,
+    const int* expert_routed, const int* slot_routed, __half* output) {
+  ker_bias_combine_residual<__half><<<batch_token_num, block_dim, 0, stream>>>(
+      input, bias, score, expert_routed, slot_routed, output, hidden_size / 2,
+      max_token_num, capacity, topk);
 }
 
-template void ker_bias_redirect_residual_launcher<float>(
-    int hidden_size, int max_token_num, int topk, int batch_token_num,
-    int block_dim, cudaStream_t stream, const float* input, const float* bias,
-    const float* score, const int* expert_routed, float* output);
-
-template void ker_bias_redirect_residual_launcher<__half>(
-    int hidden_size, int max_token_num, int topk, int batch_token_num,
-    int block_dim, cudaStream_t stream, const __half* input, const __half* bias,
-    const float* score, const int* expert_routed, __half* output);
+template void ker_bias_combine_residual_launcher<float>(
+    int hidden_size, int max_token_num, int capacity, int topk,
+    int batch_token_num, int block_dim, cudaStream_t stream,
+    const float* input, const float* bias, const float* score,
+    const int* expert_routed, const int* slot_routed, float* output);
 
 /**
 @brief: ker_hard_gate_reorder_pre
@@ -7,6 +7,8 @@
 namespace lightseq {
 namespace cuda {
 
+enum class MoeActivation { kNone, kRelu, kGelu };
+
 template <typename T>
 void ker_norm_layer_prepost_launcher(int token_num, int hidden_size,
                                      cudaStream_t stream, T* input, T* output,
@@ -14,37 +16,50 @@ void ker_norm_layer_prepost_launcher(int token_num, int hidden_size,
                                      const int max_thread_per_block,
                                      bool is_post_ln = false);
 
-template <typename T>
-void ker_softmax_topk_router_launcher(int batch_token_num, int expert_num,
-                                      int max_token_num, int topk,
-                                      cudaStream_t stream, const T* gate_out,
-                                      float* score_routed, int* expert_routed);
+// tokens of a tile of ker_route_dispatch_tokens_launcher.
+const int kMoeRouteTileTokens = 32;
 
-template <typename T>
-void ker_reorder_tokens_launcher(int batch_token_num, int expert_num,
-                                 int max_token_num, int hidden_size,
-                                 int max_thread_per_block, cudaStream_t stream,
-                                 const T* input, const float* score, T* output);
+// ints of the workspace of ker_route_dispatch_tokens_launcher.
+inline int moe_route_workspace_size(int max_token_num, int expert_num) {
+  return 1 + (max_token_num + kMoeRouteTileTokens - 1) / kMoeRouteTileTokens *
+                 expert_num;
+}
 
+/**
+Route every token to the topk experts of the softmax of gate_out and copy it
+to the next free capacity slot of each of them in output, [expert_num,
+capacity, hidden_size], in a single kernel. score_routed, expert_routed and
+slot_routed are [topk, max_token_num], slot -1 for a token dropped by a full
+expert, expert_rows gets the used slots of every expert. Supports up to 256
+experts and topk up to 8.
+*/
 template <typename T>
-void ker_strided_bias_gelu_launcher(int batch_token_num, int expert_num,
-                                    int max_token_num, int feature_dim,
-                                    int block_dim, cudaStream_t stream,
-                                    T* input, const T* bias);
+void ker_route_dispatch_tokens_launcher(
+    int batch_token_num, int expert_num, int max_token_num, int capacity,
+    int topk, int hidden_size, cudaStream_t stream, const T* gate_out,
+    const T* input, float* score_routed, int* expert_routed, int* slot_routed,
+    int* expert_rows, int* workspace, T* output);
 
 template <typename T>
-void ker_strided_bias_relu_launcher(int batch_token_num, int expert_num,
-                                    int max_token_num, int feature_dim,
-                                    int block_dim, cudaStream_t stream,
-                                    T* input, const T* bias);
+void ker_bias_combine_residual_launcher(
+    int hidden_size, int max_token_num, int capacity, int topk,
+    int batch_token_num, int block_dim, cudaStream_t stream, const T* input,
+    const T* bias, const float* score, const int* expert_routed,
+    const int* slot_routed, T* output);
 
+/**
+output[g] = act(input[g] * weight[g % weight_num] + bias[g % weight_num]) for
+every one of num_groups groups, where group g has group_rows[g] rows starting
+at row g * group_capacity of input and output. weight is [weight_num, in_dim,
+out_dim], bias is [weight_num, out_dim] or nullptr. max_rows bounds the sum of
+group_rows. tile_offset is a [num_groups + 1] workspace.
+*/
 template <typename T>
-void ker_bias_redirect_residual_launcher(int hidden_size, int max_token_num,
-                                         int topk, int batch_token_num,
-                                         int block_dim, cudaStream_t stream,
-                                         const T* input, const T* bias,
-                                         const float* score,
-                                         const int* expert_routed, T* output);
+void ker_grouped_gemm_bias_act_launcher(
+    int num_groups, int weight_num, int group_capacity, int max_rows,
+    int in_dim, int out_dim, const int* group_rows, int* tile_offset,
+    const T* input, const T* weight, const T* bias, T* output,
+    MoeActivation act, cudaStream_t stream);
 
 template <typename T>
 void ker_hard_gate_reorder_pre_launcher(const T* input, cudaStream_t stream,
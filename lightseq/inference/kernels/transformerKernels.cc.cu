@@ -342,6 +342,321 @@ void ker_diverse_beam_search_launcher(float* can_score, int* can_ids,
       can_score, can_ids, num_beam_can, beam_size, diverse_lambda, vocab_size);
 }
 
+const int kBeamTopkThreads = 256;
+
+/**
+@brief: ker_beam_search_topk_stage1
+one block for one beam, select the exact top beam_size tokens of the beam
+and compute the length penalized score of the sequences ended with them, in
+one pass over the logits. A finished beam only keeps its EOS candidate.
+
+@thread
+gridDim.x = batch_size * beam_size
+blockDim.x = kBeamTopkThreads
+
+@param
+logits: [batch_size, beam_size, vocab_size], cur step logit
+logit_bias: [vocab_size], logit bias
+seq_probs: [batch_size, beam_size], prefix sequence log probability
+seq_score: [batch_size, beam_size], prefix sequence score
+alive_seq: [batch_size, beam_size, max_step], prefix sequence id
+beam_topk_score: [batch_size, beam_size, beam_size], score of the candidates
+    with the batch offset like select_beam_rough_topk
+beam_topk_idx: [batch_size, beam_size, beam_size],
+    can_beam_id * vocab_size + vocab_id of the candidates
+vocab_mask: [lang_num, vocab_size], the vocab ids every target language can
+    decode, nullptr for all of them
+lang_id: [batch_size], target language of every batch item
+*/
+template <typename T, int beam_size>
+__global__ void ker_beam_search_topk_stage1(
+    const T* logits, const T* logit_bias, const float* seq_probs,
+    const float* seq_score, const int* alive_seq, float* beam_topk_score,
+    int* beam_topk_idx, int vocab_size, int max_step, float length_norm,
+    int cur_step, int end_id, const int8_t* vocab_mask, const int* lang_id) {
+  typedef cub::BlockReduce<cub::KeyValuePair<int, float>, kBeamTopkThreads>
+      BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+  __shared__ float s_max_logit, s_log_prob_base;
+  __shared__ int s_winner;
+
+  int batch_id = blockIdx.x / beam_size;
+  int beam_offset = (blockIdx.x % beam_size) * vocab_size;
+  float* out_score = beam_topk_score + blockIdx.x * beam_size;
+  int* out_idx = beam_topk_idx + blockIdx.x * beam_size;
+
+  if (cur_step != 0 && alive_seq[blockIdx.x * max_step + cur_step] == end_id) {
+    // this is a finished beam, its score will not be changed
+    for (int i = threadIdx.x; i < beam_size; i += blockDim.x) {
+      out_score[i] = i == 0 ? seq_score[blockIdx.x] : CUDA_FLOAT_INF_NEG;
+      out_idx[i] = end_id + beam_offset;
+    }
+    return;
+  }
+
+  /* step1: every thread keeps the sorted top beam_size logits of its tokens,
+   * the max logit and the sum of exp logit relative to it */
+  const T* beam_logits = logits + blockIdx.x * vocab_size;
+  const int8_t* lang_mask =
+      vocab_mask ? vocab_mask + (size_t)lang_id[batch_id] * vocab_size
+                 : nullptr;
+  float top_val[beam_size];
+  int top_idx[beam_size];
+#pragma unroll
+  for (int k = 0; k < beam_size; k++) {
+    top_val[k] = CUDA_FLOAT_INF_NEG;
+    top_idx[k] = -1;
+  }
+  float thread_max = CUDA_FLOAT_INF_NEG;
+  float thread_sum = 0.f;
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x) {
+    if (lang_mask && !lang_mask[i]) continue;
+    float lgt = (float)beam_logits[i] + (float)__ldg(&logit_bias[i]);
+    if (lgt > thread_max) {
+      thread_sum = thread_sum * expf(thread_max - lgt) + 1.f;
+      thread_max = lgt;
+    } else {
+      thread_sum += expf(lgt - thread_max);
+    }
+    if (lgt > top_val[beam_size - 1]) {
+      int k = beam_size - 1;
+      for (; k > 0 && top_val[k - 1] < lgt; k--) {
+        top_val[k] = top_val[k - 1];
+        top_idx[k] = top_idx[k - 1];
+      }
+      top_val[k] = lgt;
+      top_idx[k] = i;
+    }
+  }
+
+  /* step2: log softmax base of the beam */
+  float max_logit = blockReduceMax(thread_max);
+  if (threadIdx.x == 0) s_max_logit = max_logit;
+  __syncthreads();
+  float sum_exp_logit = blockReduceSum(
+      thread_sum > 0.f ? thread_sum * expf(thread_max - s_max_logit) : 0.f);
+  if (threadIdx.x == 0) {
+    s_log_prob_base = seq_probs[blockIdx.x] - logf(sum_exp_logit) - s_max_logit;
+  }
+
+  /* step3: merge the thread top k, one token per round */
+  int head = 0;
+  for (int k = 0; k < beam_size; k++) {
+    cub::KeyValuePair<int, float> cand(
+        head < beam_size ? top_idx[head] : -1,
+        head < beam_size ? top_val[head] : CUDA_FLOAT_INF_NEG);
+    cub::KeyValuePair<int, float> best =
+        BlockReduce(temp_storage).Reduce(cand, cub::ArgMax());
+    if (threadIdx.x == 0) {
+      s_winner = best.key;
+      out_score[k] = best.key < 0 ? CUDA_FLOAT_INF_NEG
+                                  : fmaxf((best.value + s_log_prob_base) *
+                                              length_norm,
+                                          min_log_probability + 1.f) +
+                                        batch_id * min_log_probability;
+      out_idx[k] = best.key < 0 ? end_id + beam_offset : best.key + beam_offset;
+    }
+    __syncthreads();
+    if (head < beam_size && top_idx[head] == s_winner && s_winner >= 0) head++;
+  }
+}
+
+/**
+@brief: ker_beam_search_topk_stage2
+one block for one batch item, select the top beam_size candidates among the
+beam_size * beam_size of stage1, sorted in descending order of score. The
+candidate layout is the one ker_refresh_result and ker_refresh_cache read
+after the sort of the rough topk candidates.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = kBeamTopkThreads
+
+@param
+beam_topk_score: [batch_size, beam_size, beam_size]
+beam_topk_idx: [batch_size, beam_size, beam_size]
+can_idx: [batch_size, beam_size]
+can_score: [batch_size, beam_size]
+num_beam_can: [1 + batch_size * beam_size], the exclusive scan of one
+    candidate per beam
+*/
+template <int beam_size>
+__global__ void ker_beam_search_topk_stage2(const float* beam_topk_score,
+                                            const int* beam_topk_idx,
+                                            int* can_idx, float* can_score,
+                                            int* num_beam_can) {
+  typedef cub::BlockReduce<cub::KeyValuePair<int, float>, kBeamTopkThreads>
+      BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+  __shared__ float s_score[beam_size * beam_size];
+  __shared__ bool s_taken[beam_size * beam_size];
+
+  const int num_can = beam_size * beam_size;
+  const float* batch_score = beam_topk_score + blockIdx.x * num_can;
+  const int* batch_idx = beam_topk_idx + blockIdx.x * num_can;
+  for (int i = threadIdx.x; i < num_can; i += blockDim.x) {
+    s_score[i] = batch_score[i];
+    s_taken[i] = false;
+  }
+  __syncthreads();
+
+  // every beam has at least one candidate, so there are beam_size to take
+  for (int k = 0; k < beam_size; k++) {
+    cub::KeyValuePair<int, float> cand(-1, CUDA_FLOAT_INF_NEG);
+    for (int i = threadIdx.x; i < num_can; i += blockDim.x) {
+      if (!s_taken[i] && (cand.key < 0 || s_score[i] > cand.value)) {
+        cand.key = i;
+        cand.value = s_score[i];
+      }
+    }
+    cub::KeyValuePair<int, float> best =
+        BlockReduce(temp_storage).Reduce(cand, cub::ArgMax());
+    if (threadIdx.x == 0) {
+      int pos = blockIdx.x * beam_size + k;
+      can_score[pos] = best.value;
+      can_idx[pos] = batch_idx[best.key];
+      num_beam_can[pos + 1] = pos;
+      s_taken[best.key] = true;
+    }
+    __syncthreads();
+  }
+}
+
+template <typename T, int beam_size>
+void beam_search_topk_launcher_k(const T* logits, const T* logit_bias,
+                                 const float* seq_probs,
+                                 const float* seq_score, const int* alive_seq,
+                                 float* beam_topk_score, int* beam_topk_idx,
+                                 int* can_idx, float* can_score,
+                                 int* num_beam_can, int vocab_size,
+                                 int max_step, float length_norm, int cur_step,
+                                 int batch_size, cudaStream_t stream,
+                                 int end_id, const int8_t* vocab_mask,
+                                 const int* lang_id) {
+  ker_beam_search_topk_stage1<T, beam_size>
+      <<<batch_size * beam_size, kBeamTopkThreads, 0, stream>>>(
+          logits, logit_bias, seq_probs, seq_score, alive_seq,
+          beam_topk_score, beam_topk_idx, vocab_size, max_step, length_norm,
+          cur_step, end_id, vocab_mask, lang_id);
+  ker_beam_search_topk_stage2<beam_size>
+      <<<batch_size, kBeamTopkThreads, 0, stream>>>(
+          beam_topk_score, beam_topk_idx, can_idx, can_score, num_beam_can);
+}
+
+template <typename T>
+void beam_search_topk_launcher(const T* logits, const T* logit_bias,
+                               const float* seq_probs, const float* seq_score,
+                               const int* alive_seq, float* beam_topk_score,
+                               int* beam_topk_idx, int* can_idx,
+                               float* can_score, int* num_beam_can,
+                               int vocab_size, int max_step,
+                               float length_norm, int cur_step,
+                               int batch_size, cudaStream_t stream,
+                               int beam_size, int end_id,
+                               const int8_t* vocab_mask, const int* lang_id) {
+  if (beam_size == 1)
+    beam_search_topk_launcher_k<T, 1>(
+        logits, logit_bias, seq_probs, seq_score, alive_seq, beam_topk_score,
+        beam_topk_idx, can_idx, can_score, num_beam_can, vocab_size, max_step,
+        length_norm, cur_step, batch_size, stream, end_id, vocab_mask,
+        lang_id);
+  if (beam_size == 2)
+    beam_search_topk_launcher_k<T, 2>(
+        logits, logit_bias, seq_probs, seq_score, alive_seq, beam_topk_score,
+        beam_topk_idx, can_idx, can_score, num_beam_can, vocab_size, max_step,
+        length_norm, cur_step, batch_size, stream, end_id, vocab_mask,
+        lang_id);
+  if (beam_size == 4)
+    beam_search_topk_launcher_k<T, 4>(
+        logits, logit_bias, seq_probs, seq_score, alive_seq, beam_topk_score,
+        beam_topk_idx, can_idx, can_score, num_beam_can, vocab_size, max_step,
+        length_norm, cur_step, batch_size, stream, end_id, vocab_mask,
+        lang_id);
+  if (beam_size == 8)
+    beam_search_topk_launcher_k<T, 8>(
+        logits, logit_bias, seq_probs, seq_score, alive_seq, beam_topk_score,
+        beam_topk_idx, can_idx, can_score, num_beam_can, vocab_size, max_step,
+        length_norm, cur_step, batch_size, stream, end_id, vocab_mask,
+        lang_id);
+  if (beam_size == 16)
+    beam_search_topk_launcher_k<T, 16>(
+        logits, logit_bias, seq_probs, seq_score, alive_seq, beam_topk_score,
+        beam_topk_idx, can_idx, can_score, num_beam_can, vocab_size, max_step,
+        length_norm, cur_step, batch_size, stream, end_id, vocab_mask,
+        lang_id);
+  if (beam_size == 32)
+    beam_search_topk_launcher_k<T, 32>(
+        logits, logit_bias, seq_probs, seq_score, alive_seq, beam_topk_score,
+        beam_topk_idx, can_idx, can_score, num_beam_can, vocab_size, max_step,
+        length_norm, cur_step, batch_size, stream, end_id, vocab_mask,
+        lang_id);
+}
+
+template void beam_search_topk_launcher<float>(
+    const float* logits, const float* logit_bias, const float* seq_probs,
+    const float* seq_score, const int* alive_seq, float* beam_topk_score,
+    int* beam_topk_idx, int* can_idx, float* can_score, int* num_beam_can,
+    int vocab_size, int max_step, float length_norm, int cur_step,
+    int batch_size, cudaStream_t stream, int beam_size, int end_id,
+    const int8_t* vocab_mask, const int* lang_id);
+
+template void beam_search_topk_launcher<__half>(
+    const __half* logits, const __half* logit_bias, const float* seq_probs,
+    const float* seq_score, const int* alive_seq, float* beam_topk_score,
+    int* beam_topk_idx, int* can_idx, float* can_score, int* num_beam_can,
+    int vocab_size, int max_step, float length_norm, int cur_step,
+    int batch_size, cudaStream_t stream, int beam_size, int end_id,
+    const int8_t* vocab_mask, const int* lang_id);
+
+/**
+@brief: ker_prune_beams
+beam pruning by score margin, on the sorted candidates of every batch item
+ker_refresh_result reads: the candidate which trails the best one of its
+batch item by more than min(abs_margin, rel_margin * |best score|) becomes
+the eos of its beam, with a score below all the candidates of the batch item
+and above the ones of the next. So the pruned beams finish, never win the
+final selection and count for the early stop.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = beam_size
+
+@param
+can_idx: [none], candidate beam_id * vocab_size + vocab_id
+can_score: [none], with the batch offset
+num_can_per_beam: [batch_size * beam_size], the beam_size candidates of
+    batch item b start at num_can_per_beam[b * beam_size]
+abs_margin: the absolute score margin, <= 0 for none
+rel_margin: the score margin relative to |best score|, <= 0 for none
+*/
+__global__ void ker_prune_beams(int* can_idx, float* can_score,
+                                const int* num_can_per_beam, int vocab_size,
+                                float abs_margin, float rel_margin,
+                                int end_id) {
+  // the best candidate is never pruned
+  if (threadIdx.x == 0) return;
+  int batch_pos = num_can_per_beam[blockIdx.x * blockDim.x];
+  int can_pos = batch_pos + threadIdx.x;
+  float offset = blockIdx.x * min_log_probability;
+  float best = can_score[batch_pos] - offset;
+  float margin = fminf(
+      abs_margin > 0.f ? abs_margin : CUDA_FLOAT_INF_POS,
+      rel_margin > 0.f ? rel_margin * fabsf(best) : CUDA_FLOAT_INF_POS);
+  if (can_score[can_pos] - offset >= best - margin) return;
+  can_idx[can_pos] = can_idx[can_pos] / vocab_size * vocab_size + end_id;
+  can_score[can_pos] = min_log_probability + 0.5f + offset;
+}
+
+void ker_prune_beams_launcher(int batch_size, int beam_size,
+                              cudaStream_t stream, int* can_idx,
+                              float* can_score, const int* num_can_per_beam,
+                              int vocab_size, float abs_margin,
+                              float rel_margin, int end_id) {
+  ker_prune_beams<<<batch_size, beam_size, 0, stream>>>(
+      can_idx, can_score, num_can_per_beam, vocab_size, abs_margin,
+      rel_margin, end_id);
+}
+
 /**
 @brief: ker_bias_relu
 add bias, activated by relu
@@ -1283,6 +1598,217 @@ template void ker_correlation_softmax_encdec_launcher<__half>(
     int batch_size, int head_num_per_seq, int batch_seq_len,
     cudaStream_t stream, __half* correlation, const int* src_padding_mask);
 
+/**
+@brief: ker_quantize_encdec_kv
+quantize the projected encoder k, v of every decoder layer into int8, with
+one scale per head vector, its absmax / 127
+
+@thread
+gridDim.x = batch_size * head_num * batch_seq_len
+gridDim.y = dec_layer_num * 2
+blockDim.x = 32
+
+@param
+k, v: [batch_size, head_num, batch_seq_len, dim_per_head] per layer, with an
+  offset in offset_per_layer between layers.
+k_i8, v_i8: the same as k, v, in int8
+k_scale, v_scale: [batch_size, head_num, batch_seq_len] per layer, with an
+  offset in offset_per_layer / dim_per_head between layers.
+*/
+template <typename T>
+__global__ void ker_quantize_encdec_kv(const T* k, const T* v, int8_t* k_i8,
+                                       int8_t* v_i8, float* k_scale,
+                                       float* v_scale, int offset_per_layer,
+                                       int dim_per_head) {
+  int layer_id = blockIdx.y >> 1;
+  bool is_v = blockIdx.y & 1;
+  size_t vec_offset = (size_t)layer_id * offset_per_layer +
+                      (size_t)blockIdx.x * dim_per_head;
+  const T* src = (is_v ? v : k) + vec_offset;
+  int8_t* dst = (is_v ? v_i8 : k_i8) + vec_offset;
+
+  float absmax = 0.f;
+  for (int i = threadIdx.x; i < dim_per_head; i += blockDim.x) {
+    absmax = fmaxf(absmax, fabsf((float)src[i]));
+  }
+  absmax = warpReduceMax(absmax);
+  float inv_scale = absmax > 0.f ? 127.f / absmax : 0.f;
+  for (int i = threadIdx.x; i < dim_per_head; i += blockDim.x) {
+    float val = rintf((float)src[i] * inv_scale);
+    dst[i] = (int8_t)fminf(fmaxf(val, -127.f), 127.f);
+  }
+  if (threadIdx.x == 0) {
+    float* scale = is_v ? v_scale : k_scale;
+    scale[(size_t)layer_id * (offset_per_layer / dim_per_head) + blockIdx.x] =
+        absmax / 127.f;
+  }
+}
+
+template <typename T>
+void ker_quantize_encdec_kv_launcher(int batch_size, int dec_layer_num,
+                                     int head_num, int batch_seq_len,
+                                     int dim_per_head, cudaStream_t stream,
+                                     const T* k, const T* v, int8_t* k_i8,
+                                     int8_t* v_i8, float* k_scale,
+                                     float* v_scale, int offset_per_layer) {
+  ker_quantize_encdec_kv<T>
+      <<<dim3(batch_size * head_num * batch_seq_len, dec_layer_num * 2), 32, 0,
+         stream>>>(k, v, k_i8, v_i8, k_scale, v_scale, offset_per_layer,
+                   dim_per_head);
+}
+
+template void ker_quantize_encdec_kv_launcher<float>(
+    int batch_size, int dec_layer_num, int head_num, int batch_seq_len,
+    int dim_per_head, cudaStream_t stream, const float* k, const float* v,
+    int8_t* k_i8, int8_t* v_i8, float* k_scale, float* v_scale,
+    int offset_per_layer);
+
+template void ker_quantize_encdec_kv_launcher<__half>(
+    int batch_size, int dec_layer_num, int head_num, int batch_seq_len,
+    int dim_per_head, cudaStream_t stream, const __half* k, const __half* v,
+    int8_t* k_i8, int8_t* v_i8, float* k_scale, float* v_scale,
+    int offset_per_layer);
+
+/**
+@brief: ker_encdec_attention_i8
+the enc-dec attention of a decoding step, softmax(q * k * scaler) * v, on
+the int8 k, v of ker_quantize_encdec_kv. It reads k and v once per query,
+at half the bytes of the gemms on the half k, v.
+
+@thread
+gridDim.x = batch_size * head_num
+gridDim.y = beam_size
+blockDim.x = a multiple of 32
+dynamic shared memory: (dim_per_head + batch_seq_len) floats
+
+@param
+q: [batch_size, head_num, beam_size, dim_per_head]
+out: the same as q, or q itself
+k_i8, v_i8: [batch_size, head_num, batch_seq_len, dim_per_head]
+k_scale, v_scale: [batch_size, head_num, batch_seq_len]
+src_padding_mask: [batch_size, batch_seq_len], nonzero at the pads
+*/
+template <typename T>
+__global__ void ker_encdec_attention_i8(const T* q, T* out,
+                                        const int8_t* k_i8,
+                                        const int8_t* v_i8,
+                                        const float* k_scale,
+                                        const float* v_scale,
+                                        const int* src_padding_mask,
+                                        int head_num, int batch_seq_len,
+                                        int dim_per_head, float scaler) {
+  extern __shared__ float s_buf[];
+  float* s_q = s_buf;
+  float* s_prob = s_buf + dim_per_head;
+  int batch_id = blockIdx.x / head_num;
+  size_t q_offset =
+      ((size_t)blockIdx.x * gridDim.y + blockIdx.y) * dim_per_head;
+  const T* q_ptr = q + q_offset;
+  size_t kv_offset = (size_t)blockIdx.x * batch_seq_len;
+  for (int i = threadIdx.x; i < dim_per_head; i += blockDim.x) {
+    s_q[i] = (float)q_ptr[i] * scaler;
+  }
+  __syncthreads();
+
+  /* step 1. the scores, a warp per source token */
+  int warp_id = threadIdx.x >> 5;
+  int lane_id = threadIdx.x & 31;
+  for (int j = warp_id; j < batch_seq_len; j += blockDim.x >> 5) {
+    const int8_t* k_vec = k_i8 + (kv_offset + j) * dim_per_head;
+    float dot = 0.f;
+    for (int i = lane_id; i < dim_per_head; i += 32) {
+      dot += s_q[i] * (float)k_vec[i];
+    }
+    dot = warpReduceSum(dot);
+    if (lane_id == 0) {
+      s_prob[j] = src_padding_mask[batch_id * batch_seq_len + j]
+                      ? CUDA_FLOAT_INF_NEG
+                      : dot * k_scale[kv_offset + j];
+    }
+  }
+  __syncthreads();
+
+  /* step 2. softmax, the v scales folded into the probabilities */
+  __shared__ float s_max, s_sum;
+  float max_val = CUDA_FLOAT_INF_NEG;
+  for (int j = threadIdx.x; j < batch_seq_len; j += blockDim.x) {
+    max_val = fmaxf(max_val, s_prob[j]);
+  }
+  max_val = blockReduceMax(max_val);
+  if (threadIdx.x == 0) s_max = max_val;
+  __syncthreads();
+  float sum = 0.f;
+  for (int j = threadIdx.x; j < batch_seq_len; j += blockDim.x) {
+    float prob =
+        s_prob[j] <= CUDA_FLOAT_INF_NEG ? 0.f : expf(s_prob[j] - s_max);
+    s_prob[j] = prob;
+    sum += prob;
+  }
+  sum = blockReduceSum(sum);
+  if (threadIdx.x == 0) s_sum = sum;
+  __syncthreads();
+  float inv_sum = s_sum > 0.f ? 1.f / s_sum : 0.f;
+  for (int j = threadIdx.x; j < batch_seq_len; j += blockDim.x) {
+    s_prob[j] *= inv_sum * v_scale[kv_offset + j];
+  }
+  for (int i = threadIdx.x; i < dim_per_head; i += blockDim.x) {
+    s_q[i] = 0.f;
+  }
+  __syncthreads();
+
+  /* step 3. prob * v, the source tokens split among the groups of
+   * dim_per_head threads */
+  int groups = max(blockDim.x / dim_per_head, 1);
+  int group_id = threadIdx.x / dim_per_head;
+  if (group_id < groups) {
+    for (int i = threadIdx.x % dim_per_head; i < dim_per_head;
+         i += blockDim.x) {
+      const int8_t* v_col = v_i8 + kv_offset * dim_per_head + i;
+      float acc = 0.f;
+      for (int j = group_id; j < batch_seq_len; j += groups) {
+        acc += s_prob[j] * (float)v_col[(size_t)j * dim_per_head];
+      }
+      atomicAdd(s_q + i, acc);
+    }
+  }
+  __syncthreads();
+  for (int i = threadIdx.x; i < dim_per_head; i += blockDim.x) {
+    out[q_offset + i] = (T)s_q[i];
+  }
+}
+
+template <typename T>
+void ker_encdec_attention_i8_launcher(
+    int batch_size, int head_num, int beam_size, int batch_seq_len,
+    int dim_per_head, float scaler, cudaStream_t stream, const T* q, T* out,
+    const int8_t* k_i8, const int8_t* v_i8, const float* k_scale,
+    const float* v_scale, const int* src_padding_mask) {
+  int block_dim = 256;
+  if (dim_per_head > block_dim) {
+    block_dim = (dim_per_head + 31) / 32 * 32;
+  } else {
+    block_dim = block_dim / dim_per_head * dim_per_head;
+    block_dim = block_dim / 32 * 32;
+  }
+  size_t smem_size = (dim_per_head + batch_seq_len) * sizeof(float);
+  ker_encdec_attention_i8<T>
+      <<<dim3(batch_size * head_num, beam_size), block_dim, smem_size,
+         stream>>>(q, out, k_i8, v_i8, k_scale, v_scale, src_padding_mask,
+                   head_num, batch_seq_len, dim_per_head, scaler);
+}
+
+template void ker_encdec_attention_i8_launcher<float>(
+    int batch_size, int head_num, int beam_size, int batch_seq_len,
+    int dim_per_head, float scaler, cudaStream_t stream, const float* q,
+    float* out, const int8_t* k_i8, const int8_t* v_i8, const float* k_scale,
+    const float* v_scale, const int* src_padding_mask);
+
+template void ker_encdec_attention_i8_launcher<__half>(
+    int batch_size, int head_num, int beam_size, int batch_seq_len,
+    int dim_per_head, float scaler, cudaStream_t stream, const __half* q,
+    __half* out, const int8_t* k_i8, const int8_t* v_i8, const float* k_scale,
+    const float* v_scale, const int* src_padding_mask);
+
 /**
 @brief: ker_arrange_atten_output
 reshape Scaled Dot-Product Attention output.
@@ -1462,6 +1988,101 @@ __global__ void ker_refresh_result(const int* can_idx, const float* can_score,
   }
 }  // namespace cuda
 
+/**
+@brief: ker_refresh_beam_history
+the same as ker_refresh_result, but only appends the token of the candidate
+and its parent beam at cur_step + 1 of alive_seq and beam_parent, which are
+updated in place. So a step costs O(beam_size) instead of copying the
+[beam_size, max_step] ancestors of every beam, see ker_backtrace_beam_seq.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = beam_size
+
+@param
+can_idx: [none], no certain length, determined by rough candidate number
+can_score: [none], no certain length, determined by rough candidate number
+num_can_per_beam: [batch_size * beam_size]
+    save exclusive_scan_sum of the beam candidate number array
+alive_seq: [batch_size, beam_size, max_step]
+beam_parent: [batch_size, beam_size, max_step], the beam of the previous step
+    of every token
+history_len: [batch_size], the last step written of every batch item
+seq_probs: [batch_size, beam_size]
+seq_score: [batch_size, beam_size]
+num_finish_beam: record current finished beam.
+*/
+__global__ void ker_refresh_beam_history(
+    const int* can_idx, const float* can_score, const int* num_can_per_beam,
+    int* alive_seq, int* beam_parent, int* history_len, float* seq_probs,
+    float* seq_score, int* num_finish_beam, int vocab_size, int max_step,
+    int cur_step, float length_norm, float diverse_lambda, int end_id) {
+  int can_pos = num_can_per_beam[blockIdx.x * blockDim.x] + threadIdx.x;
+  int ori_can_idx = can_idx[can_pos];  // can_beam_id * vocab_size + vocab_id
+  int can_beam_id = ori_can_idx / vocab_size;
+  int can_vocab_id = ori_can_idx % vocab_size;
+  int rank_id = 0;
+  if (diverse_lambda != 0) {
+    rank_id = can_beam_id / blockDim.x;  // rank in each beam
+    can_beam_id %= blockDim.x;
+  }
+  int target_id = targetid_3dim(blockIdx.x, threadIdx.x, cur_step + 1,
+                                blockDim.x, max_step);
+  alive_seq[target_id] = can_vocab_id;
+  beam_parent[target_id] = can_beam_id;
+  if (threadIdx.x == 0) {
+    history_len[blockIdx.x] = cur_step + 1;
+  }
+
+  int beam_pos = blockIdx.x * blockDim.x + threadIdx.x;
+  if (can_vocab_id != end_id) {
+    seq_probs[beam_pos] = (can_score[can_pos] -
+                           blockIdx.x * min_log_probability +
+                           diverse_lambda * (rank_id + 1)) /
+                          length_norm;  // recover it
+    return;
+  }
+  atomicAdd(num_finish_beam, 1);
+  // note, with batch offset value, to sort between batch element
+  seq_score[beam_pos] = can_score[can_pos] + diverse_lambda * (rank_id + 1);
+}
+
+/**
+@brief: ker_backtrace_beam_seq
+write the full token sequences of the beams kept by ker_refresh_beam_history,
+following the parent beams from the last step of every batch item back to
+<start>, the positions after it are filled with end_id.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = beam_size
+
+@param
+alive_seq: [batch_size, beam_size, max_step]
+beam_parent: [batch_size, beam_size, max_step]
+history_len: [batch_size]
+seq: [batch_size, beam_size, max_step], the output
+*/
+__global__ void ker_backtrace_beam_seq(const int* alive_seq,
+                                       const int* beam_parent,
+                                       const int* history_len, int* seq,
+                                       int max_step, int end_id) {
+  int last_step = history_len[blockIdx.x];
+  int* beam_seq = seq + (blockIdx.x * blockDim.x + threadIdx.x) * max_step;
+  for (int i = last_step + 1; i < max_step; i++) {
+    beam_seq[i] = end_id;
+  }
+  int beam_id = threadIdx.x;
+  for (int i = last_step; i > 0; i--) {
+    int target_id =
+        targetid_3dim(blockIdx.x, beam_id, i, blockDim.x, max_step);
+    beam_seq[i] = alive_seq[target_id];
+    beam_id = beam_parent[target_id];
+  }
+  beam_seq[0] = alive_seq[targetid_3dim(blockIdx.x, beam_id, 0, blockDim.x,
+                                        max_step)];
+}
+
 /**
 @brief: ker_refresh_cache
 supply current step's projected k,v to K, V cache
@@ -2017,6 +2638,160 @@ template void ker_topk_sample_launcher<__half>(
     const int vocab_size, const int k, int* unfinished,
     curandState* curandstate, int eos_id);
 
+/**
+@brief: ker_step_topk_log_probs
+one block for one sequence, the exact top k tokens of the logits of the step
+and their log probs, in descending order, in one pass over the logits like
+ker_beam_search_topk_stage1. A finished sequence gets k eos of log prob 0.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = kBeamTopkThreads
+
+@param
+logits: [batch_size, vocab_size], cur step logit
+logit_bias: [vocab_size], logit bias
+alive_seq: [batch_size, max_step], prefix sequence id
+vocab_ids: [vocab_size], vocab id of every logit of a vocab shortlist,
+    negative for its padding, nullptr for the identity
+topk_ids: [batch_size, max_step, k], vocab id of the top k tokens of
+    cur_step
+topk_log_probs: [batch_size, max_step, k], their log probs
+*/
+template <typename T, int max_k>
+__global__ void ker_step_topk_log_probs(const T* logits, const T* logit_bias,
+                                        const int* alive_seq,
+                                        const int* vocab_ids, int vocab_size,
+                                        int max_step, int cur_step, int k,
+                                        int end_id, int* topk_ids,
+                                        float* topk_log_probs) {
+  typedef cub::BlockReduce<cub::KeyValuePair<int, float>, kBeamTopkThreads>
+      BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+  __shared__ float s_max_logit, s_log_sum_exp;
+  __shared__ int s_winner;
+
+  int* out_ids = topk_ids + ((size_t)blockIdx.x * max_step + cur_step) * k;
+  float* out_log_probs =
+      topk_log_probs + ((size_t)blockIdx.x * max_step + cur_step) * k;
+  if (cur_step != 0 && alive_seq[blockIdx.x * max_step + cur_step] == end_id) {
+    for (int i = threadIdx.x; i < k; i += blockDim.x) {
+      out_ids[i] = vocab_ids ? vocab_ids[end_id] : end_id;
+      out_log_probs[i] = 0.f;
+    }
+    return;
+  }
+
+  /* step1: every thread keeps the sorted top max_k logits of its tokens,
+   * the max logit and the sum of exp logit relative to it */
+  const T* seq_logits = logits + blockIdx.x * vocab_size;
+  float top_val[max_k];
+  int top_idx[max_k];
+#pragma unroll
+  for (int i = 0; i < max_k; i++) {
+    top_val[i] = CUDA_FLOAT_INF_NEG;
+    top_idx[i] = -1;
+  }
+  float thread_max = CUDA_FLOAT_INF_NEG;
+  float thread_sum = 0.f;
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x) {
+    if (vocab_ids && vocab_ids[i] < 0) continue;
+    float lgt = (float)seq_logits[i] + (float)__ldg(&logit_bias[i]);
+    if (lgt > thread_max) {
+      thread_sum = thread_sum * expf(thread_max - lgt) + 1.f;
+      thread_max = lgt;
+    } else {
+      thread_sum += expf(lgt - thread_max);
+    }
+    if (lgt > top_val[max_k - 1]) {
+      int j = max_k - 1;
+      for (; j > 0 && top_val[j - 1] < lgt; j--) {
+        top_val[j] = top_val[j - 1];
+        top_idx[j] = top_idx[j - 1];
+      }
+      top_val[j] = lgt;
+      top_idx[j] = i;
+    }
+  }
+
+  /* step2: log softmax base of the sequence */
+  float max_logit = blockReduceMax(thread_max);
+  if (threadIdx.x == 0) s_max_logit = max_logit;
+  __syncthreads();
+  float sum_exp_logit = blockReduceSum(
+      thread_sum > 0.f ? thread_sum * expf(thread_max - s_max_logit) : 0.f);
+  if (threadIdx.x == 0) {
+    s_log_sum_exp = logf(sum_exp_logit) + s_max_logit;
+  }
+
+  /* step3: merge the thread top k, one token per round */
+  int head = 0;
+  for (int i = 0; i < k; i++) {
+    cub::KeyValuePair<int, float> cand(
+        head < max_k ? top_idx[head] : -1,
+        head < max_k ? top_val[head] : CUDA_FLOAT_INF_NEG);
+    cub::KeyValuePair<int, float> best =
+        BlockReduce(temp_storage).Reduce(cand, cub::ArgMax());
+    if (threadIdx.x == 0) {
+      s_winner = best.key;
+      out_ids[i] = best.key < 0 || !vocab_ids ? best.key : vocab_ids[best.key];
+      out_log_probs[i] =
+          best.key < 0 ? CUDA_FLOAT_INF_NEG : best.value - s_log_sum_exp;
+    }
+    __syncthreads();
+    if (head < max_k && top_idx[head] == s_winner && s_winner >= 0) head++;
+  }
+}
+
+template <typename T>
+void ker_step_topk_log_probs_launcher(
+    int batch_size, int max_step, int cur_step, cudaStream_t stream,
+    const T* logits, const T* logit_bias, const int* alive_seq,
+    const int* vocab_ids, int vocab_size, int k, int end_id, int* topk_ids,
+    float* topk_log_probs) {
+  if (k <= 1) {
+    ker_step_topk_log_probs<T, 1><<<batch_size, kBeamTopkThreads, 0, stream>>>(
+        logits, logit_bias, alive_seq, vocab_ids, vocab_size, max_step,
+        cur_step, k, end_id, topk_ids, topk_log_probs);
+  } else if (k <= 2) {
+    ker_step_topk_log_probs<T, 2><<<batch_size, kBeamTopkThreads, 0, stream>>>(
+        logits, logit_bias, alive_seq, vocab_ids, vocab_size, max_step,
+        cur_step, k, end_id, topk_ids, topk_log_probs);
+  } else if (k <= 4) {
+    ker_step_topk_log_probs<T, 4><<<batch_size, kBeamTopkThreads, 0, stream>>>(
+        logits, logit_bias, alive_seq, vocab_ids, vocab_size, max_step,
+        cur_step, k, end_id, topk_ids, topk_log_probs);
+  } else if (k <= 8) {
+    ker_step_topk_log_probs<T, 8><<<batch_size, kBeamTopkThreads, 0, stream>>>(
+        logits, logit_bias, alive_seq, vocab_ids, vocab_size, max_step,
+        cur_step, k, end_id, topk_ids, topk_log_probs);
+  } else if (k <= 16) {
+    ker_step_topk_log_probs<T, 16>
+        <<<batch_size, kBeamTopkThreads, 0, stream>>>(
+            logits, logit_bias, alive_seq, vocab_ids, vocab_size, max_step,
+            cur_step, k, end_id, topk_ids, topk_log_probs);
+  } else if (k <= 32) {
+    ker_step_topk_log_probs<T, 32>
+        <<<batch_size, kBeamTopkThreads, 0, stream>>>(
+            logits, logit_bias, alive_seq, vocab_ids, vocab_size, max_step,
+            cur_step, k, end_id, topk_ids, topk_log_probs);
+  } else {
+    throw std::invalid_argument("step topk should be in [1, 32]");
+  }
+}
+
+template void ker_step_topk_log_probs_launcher<float>(
+    int batch_size, int max_step, int cur_step, cudaStream_t stream,
+    const float* logits, const float* logit_bias, const int* alive_seq,
+    const int* vocab_ids, int vocab_size, int k, int end_id, int* topk_ids,
+    float* topk_log_probs);
+
+template void ker_step_topk_log_probs_launcher<__half>(
+    int batch_size, int max_step, int cur_step, cudaStream_t stream,
+    const __half* logits, const __half* logit_bias, const int* alive_seq,
+    const int* vocab_ids, int vocab_size, int k, int end_id, int* topk_ids,
+    float* topk_log_probs);
+
 /**
 @brief: ker_topp_sample
 quick rough topp sampling from logits
@@ -2273,5 +3048,970 @@ __global__ void ker_curand_setup(curandState* state) {
   curand_init(clock(), blockIdx.x, 0, &state[blockIdx.x]);
 }
 
+namespace {
+
+// A block of ker_logits_topk covers kLogitsTopkTiles tiles of
+// kLogitsTopkTileCols vocab ids for kLogitsTopkTileTokens tokens.
+const int kLogitsTopkWarps = 16;
+const int kLogitsTopkTileCols = WARP_SIZE * 4;
+const int kLogitsTopkTiles = kLogitsTopkBlockCols / kLogitsTopkTileCols;
+const int kLogitsTopkTileTokens = 4;
+const int kLogitsTopkMaxK = 32;
+const int kLogitsTopkMergeThreads = 256;
+
+int logits_topk_col_blocks(int vocab_size) {
+  return (vocab_size + kLogitsTopkBlockCols - 1) / kLogitsTopkBlockCols;
+}
+
+}  // namespace
+
+/**
+@brief: ker_logits_topk
+project the hidden states to the logits of kLogitsTopkBlockCols vocab ids
+tile by tile and keep the running top k logits of every token in shared
+memory, so that the logits are never written to global memory.
+
+@thread
+gridDim.x = ceil(vocab_size / kLogitsTopkBlockCols)
+gridDim.y = ceil(token_num / kTokens)
+blockDim.x = WARP_SIZE
+blockDim.y = kLogitsTopkWarps
+
+@param
+inp: [token_num, hidden_size]
+weight: [vocab_size, hidden_size] if kTrans else [hidden_size, vocab_size]
+logit_bias: [vocab_size], can be nullptr
+tile_val: [token_num, gridDim.x, k], top k logits of every block
+tile_idx: [token_num, gridDim.x, k], vocab ids of tile_val
+*/
+template <typename T, int kTokens, bool kTrans>
+__global__ void ker_logits_topk(const T* inp, const T* weight,
+                                const T* logit_bias, float* tile_val,
+                                int* tile_idx, int token_num, int hidden_size,
+                                int vocab_size, int k, float scale) {
+  __shared__ float s_acc[kLogitsTopkWarps][kTokens][kLogitsTopkTileCols];
+  __shared__ float s_top_val[kTokens][kLogitsTopkMaxK];
+  __shared__ int s_top_idx[kTokens][kLogitsTopkMaxK];
+
+  int lane = threadIdx.x, warp = threadIdx.y;
+  int flat_tid = warp * WARP_SIZE + lane;
+  int token_begin = blockIdx.y * kTokens;
+  int tile_tokens = min(kTokens, token_num - token_begin);
+  const T* tile_inp = inp + (size_t)token_begin * hidden_size;
+
+  for (int i = flat_tid; i < kTokens * k; i += kLogitsTopkWarps * WARP_SIZE) {
+    s_top_val[i / k][i % k] = CUDA_FLOAT_INF_NEG;
+    s_top_idx[i / k][i % k] = -1;
+  }
+
+  for (int tile = 0; tile < kLogitsTopkTiles; tile++) {
+    int tile_col =
+        blockIdx.x * kLogitsTopkBlockCols + tile * kLogitsTopkTileCols;
+    if (tile_col >= vocab_size) break;
+
+    /* step1: logits of the tile, reduced into s_acc[0] */
+    if (kTrans) {
+      // one warp for one vocab id, the lanes split the hidden
+      for (int c = warp; c < kLogitsTopkTileCols; c += kLogitsTopkWarps) {
+        int col = tile_col + c;
+        float acc[kTokens];
+#pragma unroll
+        for (int t = 0; t < kTokens; t++) acc[t] = 0.f;
+        if (col < vocab_size) {
+          const T* col_weight = weight + (size_t)col * hidden_size;
+          for (int h = lane; h < hidden_size; h += WARP_SIZE) {
+            float w = (float)col_weight[h];
+#pragma unroll
+            for (int t = 0; t < kTokens; t++) {
+              if (t < tile_tokens) {
+                acc[t] += (float)tile_inp[(size_t)t * hidden_size + h] * w;
+              }
+            }
+          }
+        }
+#pragma unroll
+        for (int t = 0; t < kTokens; t++) {
+          acc[t] = warpReduceSum(acc[t]);
+          if (lane == 0) s_acc[0][t][c] = acc[t];
+        }
+      }
+    } else {
+      // every lane computes 4 adjacent vocab ids, the warps split the hidden
+      int col = tile_col + lane * 4;
+      float acc[kTokens][4];
+#pragma unroll
+      for (int t = 0; t < kTokens; t++) {
+#pragma unroll
+        for (int c = 0; c < 4; c++) acc[t][c] = 0.f;
+      }
+      for (int h = warp; h < hidden_size; h += kLogitsTopkWarps) {
+        const T* row_weight = weight + (size_t)h * vocab_size + col;
+        float w[4];
+#pragma unroll
+        for (int c = 0; c < 4; c++) {
+          w[c] = col + c < vocab_size ? (float)row_weight[c] : 0.f;
+        }
+#pragma unroll
+        for (int t = 0; t < kTokens; t++) {
+          if (t >= tile_tokens) break;
+          float x = (float)tile_inp[(size_t)t * hidden_size + h];
+#pragma unroll
+          for (int c = 0; c < 4; c++) acc[t][c] += x * w[c];
+        }
+      }
+#pragma unroll
+      for (int t = 0; t < kTokens; t++) {
+#pragma unroll
+        for (int c = 0; c < 4; c++) s_acc[warp][t][lane * 4 + c] = acc[t][c];
+      }
+      __syncthreads();
+      // every (t, c) is read and written by one thread only
+      for (int i = flat_tid; i < kTokens * kLogitsTopkTileCols;
+           i += kLogitsTopkWarps * WARP_SIZE) {
+        int t = i / kLogitsTopkTileCols, c = i % kLogitsTopkTileCols;
+        float sum = 0.f;
+#pragma unroll
+        for (int w = 0; w < kLogitsTopkWarps; w++) sum += s_acc[w][t][c];
+        s_acc[0][t][c] = sum;
+      }
+    }
+    __syncthreads();
+
+    /* step2: one warp inserts the logits of one token bigger than its
+     * current k-th logit into its sorted top k */
+    if (warp < tile_tokens) {
+      float* top_val = s_top_val[warp];
+      int* top_idx = s_top_idx[warp];
+      for (int c = lane; c < kLogitsTopkTileCols; c += WARP_SIZE) {
+        int col = tile_col + c;
+        float logit = CUDA_FLOAT_INF_NEG;
+        if (col < vocab_size) {
+          logit = s_acc[0][warp][c] * scale;
+          if (logit_bias) logit += (float)__ldg(&logit_bias[col]);
+        }
+        unsigned int mask =
+            __ballot_sync(WARP_REDUCE_MASK, logit > top_val[k - 1]);
+        while (mask) {
+          int src = __ffs(mask) - 1;
+          mask &= mask - 1;
+          float val = __shfl_sync(WARP_REDUCE_MASK, logit, src);
+          int vocab_id = __shfl_sync(WARP_REDUCE_MASK, col, src);
+          if (lane == 0 && val > top_val[k - 1]) {
+            int j = k - 1;
+            for (; j > 0 && top_val[j - 1] < val; j--) {
+              top_val[j] = top_val[j - 1];
+              top_idx[j] = top_idx[j - 1];
+            }
+            top_val[j] = val;
+            top_idx[j] = vocab_id;
+          }
+          __syncwarp();
+        }
+      }
+    }
+    __syncthreads();
+  }
+
+  /* step3: write back the top k of the block */
+  for (int i = flat_tid; i < tile_tokens * k;
+       i += kLogitsTopkWarps * WARP_SIZE) {
+    int t = i / k, j = i % k;
+    size_t pos = ((size_t)(token_begin + t) * gridDim.x + blockIdx.x) * k + j;
+    tile_val[pos] = s_top_val[t][j];
+    tile_idx[pos] = s_top_idx[t][j];
+  }
+}
+
+/**
+@brief: ker_logits_topk_merge
+merge the top k of all the blocks of ker_logits_topk for one token, one
+candidate per round, in descending order of logit and ascending order of
+vocab id.
+
+@thread
+gridDim.x = token_num
+blockDim.x = kLogitsTopkMergeThreads
+
+@param
+tile_val: [token_num, num_can]
+tile_idx: [token_num, num_can]
+topk_val: [token_num, k]
+topk_idx: [token_num, k]
+*/
+__global__ void ker_logits_topk_merge(const float* tile_val,
+                                      const int* tile_idx, float* topk_val,
+                                      int* topk_idx, int num_can, int k) {
+  typedef cub::BlockReduce<cub::KeyValuePair<int, float>,
+                           kLogitsTopkMergeThreads>
+      BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+  __shared__ float s_last_val;
+  __shared__ int s_last_idx;
+
+  const float* can_val = tile_val + (size_t)blockIdx.x * num_can;
+  const int* can_idx = tile_idx + (size_t)blockIdx.x * num_can;
+  for (int r = 0; r < k; r++) {
+    cub::KeyValuePair<int, float> cand(-1, CUDA_FLOAT_INF_NEG);
+    for (int i = threadIdx.x; i < num_can; i += blockDim.x) {
+      float val = can_val[i];
+      int idx = can_idx[i];
+      // skip the candidates taken in the previous rounds
+      if (r > 0 &&
+          (val > s_last_val || (val == s_last_val && idx <= s_last_idx))) {
+        continue;
+      }
+      if (cand.key < 0 || val > cand.value ||
+          (val == cand.value && idx < cand.key)) {
+        cand.key = idx;
+        cand.value = val;
+      }
+    }
+    cub::KeyValuePair<int, float> best =
+        BlockReduce(temp_storage).Reduce(cand, cub::ArgMax());
+    __syncthreads();
+    if (threadIdx.x == 0) {
+      topk_val[blockIdx.x * k + r] = best.value;
+      topk_idx[blockIdx.x * k + r] = best.key;
+      s_last_val = best.value;
+      s_last_idx = best.key;
+    }
+    __syncthreads();
+  }
+}
+
+size_t logits_topk_workspace_bytes(int token_num, int vocab_size, int k) {
+  int col_blocks = logits_topk_col_blocks(vocab_size);
+  return (size_t)token_num * col_blocks * k * (sizeof(float) + sizeof(int));
+}
+
+template <typename T, bool kTrans>
+void ker_logits_topk_trans_launcher(const T* inp, const T* weight,
+                                    const T* logit_bias, float* tile_val,
+                                    int* tile_idx, int token_num,
+                                    int hidden_size, int vocab_size, int k,
+                                    float scale, cudaStream_t stream) {
+  int col_blocks = logits_topk_col_blocks(vocab_size);
+  dim3 block_dim(WARP_SIZE, kLogitsTopkWarps);
+  if (token_num == 1) {
+    ker_logits_topk<T, 1, kTrans><<<col_blocks, block_dim, 0, stream>>>(
+        inp, weight, logit_bias, tile_val, tile_idx, token_num, hidden_size,
+        vocab_size, k, scale);
+  } else if (token_num == 2) {
+    ker_logits_topk<T, 2, kTrans><<<col_blocks, block_dim, 0, stream>>>(
+        inp, weight, logit_bias, tile_val, tile_idx, token_num, hidden_size,
+        vocab_size, k, scale);
+  } else {
+    dim3 grid_dim(col_blocks, (token_num + kLogitsTopkTileTokens - 1) /
+                                  kLogitsTopkTileTokens);
+    ker_logits_topk<T, kLogitsTopkTileTokens, kTrans>
+        <<<grid_dim, block_dim, 0, stream>>>(inp, weight, logit_bias, tile_val,
+                                             tile_idx, token_num, hidden_size,
+                                             vocab_size, k, scale);
+  }
+}
+
+template <typename T>
+void ker_logits_topk_launcher(const T* inp, const T* weight,
+                              const T* logit_bias, void* workspace,
+                              float* topk_val, int* topk_idx, int token_num,
+                              int hidden_size, int vocab_size, int k,
+                              float scale, bool weight_trans,
+                              cudaStream_t stream) {
+  if (k < 1 || k > kLogitsTopkMaxK || k > vocab_size) {
+    throw std::invalid_argument("topk argument should be in [1, 32]");
+  }
+  int col_blocks = logits_topk_col_blocks(vocab_size);
+  float* tile_val = (float*)workspace;
+  int* tile_idx = (int*)(tile_val + (size_t)token_num * col_blocks * k);
+  if (weight_trans) {
+    ker_logits_topk_trans_launcher<T, true>(inp, weight, logit_bias, tile_val,
+                                            tile_idx, token_num, hidden_size,
+                                            vocab_size, k, scale, stream);
+  } else {
+    ker_logits_topk_trans_launcher<T, false>(inp, weight, logit_bias, tile_val,
+                                             tile_idx, token_num, hidden_size,
+                                             vocab_size, k, scale, stream);
+  }
+  ker_logits_topk_merge<<<token_num, kLogitsTopkMergeThreads, 0, stream>>>(
+      tile_val, tile_idx, topk_val, topk_idx, col_blocks * k, k);
+}
+
+template void ker_logits_topk_launcher<float>(
+    const float* inp, const float* weight, const float* logit_bias,
+    void* workspace, float* topk_val, int* topk_idx, int token_num,
+    int hidden_size, int vocab_size, int k, float scale, bool weight_trans,
+    cudaStream_t stream);
+
+template void ker_logits_topk_launcher<__half>(
+    const __half* inp, const __half* weight, const __half* logit_bias,
+    void* workspace, float* topk_val, int* topk_idx, int token_num,
+    int hidden_size, int vocab_size, int k, float scale, bool weight_trans,
+    cudaStream_t stream);
+
+/**
+@brief: ker_topk_sample_candidates
+sample the next token of every sequence from the top k candidates of
+ker_logits_topk_launcher, the sequences are updated like ker_topk_sample.
+
+@thread
+gridDim.x = batch_size
+blockDim.x = 1
+
+@param
+topk_val: [batch_size, k]
+topk_idx: [batch_size, k]
+old_input_ids: [batch_size, max_step]
+unfinished: [1]
+curandstate: [batch_size]
+*/
+__global__ void ker_topk_sample_candidates(const float* topk_val,
+                                           const int* topk_idx, int k,
+                                           int* old_input_ids, int max_step,
+                                           int batch_seq_len, int* unfinished,
+                                           curandState* curandstate,
+                                           int eos_id) {
+  int last_token_idx_in_batch = blockIdx.x * max_step + batch_seq_len - 1;
+
+  /* add EOS to end if last token is EOS */
+  if (batch_seq_len > 1 && old_input_ids[last_token_idx_in_batch] == eos_id) {
+    old_input_ids[last_token_idx_in_batch + 1] = eos_id;
+    return;
+  }
+  int tid = sample_topk_candidate(topk_val + blockIdx.x * k,
+                                  topk_idx + blockIdx.x * k, k,
+                                  curandstate + blockIdx.x);
+  if (tid != eos_id) unfinished[0] = 1;
+  old_input_ids[last_token_idx_in_batch + 1] = tid;
+}
+
+void ker_topk_sample_candidates_launcher(int batch_size, int batch_seq_len,
+                                         int max_step, cudaStream_t stream,
+                                         const float* topk_val,
+                                         const int* topk_idx, int k,
+                                         int* old_input_ids, int* unfinished,
+                                         curandState* curandstate,
+                                         int eos_id) {
+  ker_topk_sample_candidates<<<batch_size, 1, 0, stream>>>(
+      topk_val, topk_idx, k, old_input_ids, max_step, batch_seq_len,
+      unfinished, curandstate, eos_id);
+}
+
+/**
+@brief: ker_batch_finished
+whether all the beams of every batch item end with eos at step, for the
+batch compaction of beam search
+
+@thread
+gridDim.x = batch_size
+blockDim.x = beam_size
+
+@param
+alive_seq: [batch_size, beam_size, max_step]
+finished: [batch_size]
+*/
+__global__ void ker_batch_finished(const int* alive_seq, int* finished,
+                                   int max_step, int step, int end_id) {
+  int token =
+      alive_seq[(blockIdx.x * blockDim.x + threadIdx.x) * max_step + step];
+  int all_end = __syncthreads_and(token == end_id);
+  if (threadIdx.x == 0) {
+    finished[blockIdx.x] = all_end;
+  }
+}
+
+void ker_batch_finished_launcher(int batch_size, int beam_size,
+                                 cudaStream_t stream, const int* alive_seq,
+                                 int* finished, int max_step, int step,
+                                 int end_id) {
+  ker_batch_finished<<<batch_size, beam_size, 0, stream>>>(
+      alive_seq, finished, max_step, step, end_id);
+}
+
+/**
+@brief: ker_gather_batch_rows
+dst[i] = src[batch_ids[i]] for the rows of every batch item
+
+@thread
+gridDim.x = ceil(row_size / MAX_THREADS)
+gridDim.y = batch_size
+blockDim.x = MAX_THREADS
+
+@param
+src: [none, row_size]
+dst: [batch_size, row_size]
+batch_ids: [batch_size]
+*/
+template <typename T>
+__global__ void ker_gather_batch_rows(const T* src, T* dst,
+                                      const int* batch_ids, int row_size) {
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= row_size) return;
+  dst[(size_t)blockIdx.y * row_size + idx] =
+      src[(size_t)batch_ids[blockIdx.y] * row_size + idx];
+}
+
+template <typename T>
+void ker_gather_batch_rows_launcher(int batch_size, int row_size,
+                                    cudaStream_t stream, const T* src, T* dst,
+                                    const int* batch_ids) {
+  dim3 grid_dim((row_size + MAX_THREADS - 1) / MAX_THREADS, batch_size);
+  ker_gather_batch_rows<T>
+      <<<grid_dim, MAX_THREADS, 0, stream>>>(src, dst, batch_ids, row_size);
+}
+
+template void ker_gather_batch_rows_launcher<int>(int batch_size,
+                                                  int row_size,
+                                                  cudaStream_t stream,
+                                                  const int* src, int* dst,
+                                                  const int* batch_ids);
+template void ker_gather_batch_rows_launcher<float>(int batch_size,
+                                                    int row_size,
+                                                    cudaStream_t stream,
+                                                    const float* src,
+                                                    float* dst,
+                                                    const int* batch_ids);
+template void ker_gather_batch_rows_launcher<__half>(int batch_size,
+                                                     int row_size,
+                                                     cudaStream_t stream,
+                                                     const __half* src,
+                                                     __half* dst,
+                                                     const int* batch_ids);
+
+/**
+@brief: ker_gather_seq_score
+dst[i] = src[batch_ids[i]] for the beam scores of every batch item, the
+batch offset of the scores is moved to the new batch id
+
+@thread
+gridDim.x = batch_size
+blockDim.x = beam_size
+
+@param
+src: [none, beam_size]
+dst: [batch_size, beam_size]
+batch_ids: [batch_size]
+*/
+__global__ void ker_gather_seq_score(const float* src, float* dst,
+                                     const int* batch_ids) {
+  int batch_id = batch_ids[blockIdx.x];
+  dst[blockIdx.x * blockDim.x + threadIdx.x] =
+      src[batch_id * blockDim.x + threadIdx.x] +
+      float(int(blockIdx.x) - batch_id) * min_log_probability;
+}
+
+void ker_gather_seq_score_launcher(int batch_size, int beam_size,
+                                   cudaStream_t stream, const float* src,
+                                   float* dst, const int* batch_ids) {
+  ker_gather_seq_score<<<batch_size, beam_size, 0, stream>>>(src, dst,
+                                                             batch_ids);
+}
+
+/**
+@brief: ker_gather_self_kv
+gather the K, V cache of decoder self attention of the steps so far by
+batch item, like ker_refresh_cache does by beam
+
+@thread
+gridDim.x = decoder_layer_num * (cur_step + 1)
+gridDim.y = batch_size * beam_size * 2
+blockDim.x = max_thread_per_block
+
+@param
+batch_ids: [batch_size]
+self_k_bgeem: [none, beam_size, head_num, max_step, dim_per_head] *
+    decoder_layer_num
+self_v_bgeem: [none, beam_size, head_num, max_step, dim_per_head] *
+    decoder_layer_num
+new_self_k_bgeem: [batch_size, beam_size, head_num, max_step, dim_per_head] *
+    decoder_layer_num
+new_self_v_bgeem: [batch_size, beam_size, head_num, max_step, dim_per_head] *
+    decoder_layer_num
+self_k_bgeem_offset = max_batch_size * max_step * hidden_size * beam_size
+*/
+template <typename T>
+__global__ void ker_gather_self_kv(const int* batch_ids, const T* self_k_bgeem,
+                                   const T* self_v_bgeem, T* new_self_k_bgeem,
+                                   T* new_self_v_bgeem, int self_k_bgeem_offset,
+                                   int beam_size, int dim_per_head,
+                                   int head_num, int cur_step, int max_step) {
+  int layer_id = blockIdx.x / (cur_step + 1);
+  int step_id = blockIdx.x % (cur_step + 1);
+  int kv_id = blockIdx.y & 1;
+  int beam_id_global = blockIdx.y >> 1;
+  int batch_id = beam_id_global / beam_size;
+  int beam_id = beam_id_global % beam_size;
+  int hidden_size = dim_per_head * head_num;
+  int batch_offset = beam_size * hidden_size * max_step;
+  int ori_batch_id = batch_ids[batch_id];
+  for (std::size_t i = threadIdx.x; i < hidden_size; i += blockDim.x) {
+    int head_id = i / dim_per_head;
+    int dim_id = i % dim_per_head;
+    int base_pos = targetid_5dim(0, beam_id, head_id, step_id, dim_id,
+                                 beam_size, head_num, max_step, dim_per_head) +
+                   layer_id * self_k_bgeem_offset;
+    int ori_id = base_pos + batch_offset * ori_batch_id;
+    int new_id = base_pos + batch_offset * batch_id;
+    if (kv_id == 0) {
+      new_self_k_bgeem[new_id] = self_k_bgeem[ori_id];
+    } else {
+      new_self_v_bgeem[new_id] = self_v_bgeem[ori_id];
+    }
+  }
+}
+
+template <typename T>
+void ker_gather_self_kv_launcher(int dec_layer_num, int batch_size,
+                                 int max_thread_per_block, cudaStream_t stream,
+                                 const int* batch_ids, const T* self_k_bgeem,
+                                 const T* self_v_bgeem, T* new_self_k_bgeem,
+                                 T* new_self_v_bgeem, int self_k_bgeem_offset,
+                                 int beam_size, int dim_per_head, int head_num,
+                                 int cur_step, int max_step) {
+  dim3 grid_dim(dec_layer_num * (cur_step + 1), batch_size * beam_size * 2);
+  ker_gather_self_kv<T><<<grid_dim, max_thread_per_block, 0, stream>>>(
+      batch_ids, self_k_bgeem, self_v_bgeem, new_self_k_bgeem,
+      new_self_v_bgeem, self_k_bgeem_offset, beam_size, dim_per_head,
+      head_num, cur_step, max_step);
+}
+
+template <>
+void ker_gather_self_kv_launcher<__half>(
+    int dec_layer_num, int batch_size, int max_thread_per_block,
+    cudaStream_t stream, const int* batch_ids, const __half* self_k_bgeem,
+    const __half* self_v_bgeem, __half* new_self_k_bgeem,
+    __half* new_self_v_bgeem, int self_k_bgeem_offset, int beam_size,
+    int dim_per_head, int head_num, int cur_step, int max_step) {
+  // dim_per_head is even, copy two halfs at once
+  dim3 grid_dim(dec_layer_num * (cur_step + 1), batch_size * beam_size * 2);
+  ker_gather_self_kv<half2><<<grid_dim, max_thread_per_block / 2, 0, stream>>>(
+      batch_ids, (const half2*)self_k_bgeem, (const half2*)self_v_bgeem,
+      (half2*)new_self_k_bgeem, (half2*)new_self_v_bgeem,
+      self_k_bgeem_offset / 2, beam_size, dim_per_head / 2, head_num, cur_step,
+      max_step);
+}
+
+template void ker_gather_self_kv_launcher<float>(
+    int dec_layer_num, int batch_size, int max_thread_per_block,
+    cudaStream_t stream, const int* batch_ids, const float* self_k_bgeem,
+    const float* self_v_bgeem, float* new_self_k_bgeem,
+    float* new_self_v_bgeem, int self_k_bgeem_offset, int beam_size,
+    int dim_per_head, int head_num, int cur_step, int max_step);
+
+template void ker_gather_self_kv_launcher<__half>(
+    int dec_layer_num, int batch_size, int max_thread_per_block,
+    cudaStream_t stream, const int* batch_ids, const __half* self_k_bgeem,
+    const __half* self_v_bgeem, __half* new_self_k_bgeem,
+    __half* new_self_v_bgeem, int self_k_bgeem_offset, int beam_size,
+    int dim_per_head, int head_num, int cur_step, int max_step);
+
+/**
+@brief: ker_gather_vocab_shortlist
+gather the logits projection columns and the logit bias of the vocab
+shortlist, shortlist id i of the projection is the vocab id shortlist[i].
+The padding ids of the shortlist, -1, get a zero column and a logit bias
+low enough to never be sampled.
+
+@thread
+gridDim.x = ceil(shortlist_size / MAX_THREADS)
+gridDim.y = hidden_size + 1, the last row is the logit bias
+blockDim.x = MAX_THREADS
+
+@param
+kernel: [hidden_size, vocab_size]
+logit_bias: [vocab_size]
+shortlist: [shortlist_size]
+new_kernel: [hidden_size, shortlist_size]
+new_logit_bias: [shortlist_size]
+*/
+template <typename T>
+__global__ void ker_gather_vocab_shortlist(const T* kernel,
+                                           const T* logit_bias,
+                                           const int* shortlist, T* new_kernel,
+                                           T* new_logit_bias, int hidden_size,
+                                           int vocab_size,
+                                           int shortlist_size) {
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= shortlist_size) return;
+  int vocab_id = shortlist[idx];
+  if (blockIdx.y == hidden_size) {
+    // -1e4 is still finite in fp16
+    new_logit_bias[idx] = vocab_id < 0 ? T(-10000.f) : logit_bias[vocab_id];
+    return;
+  }
+  new_kernel[(size_t)blockIdx.y * shortlist_size + idx] =
+      vocab_id < 0 ? T(0.f)
+                   : kernel[(size_t)blockIdx.y * vocab_size + vocab_id];
+}
+
+template <typename T>
+void ker_gather_vocab_shortlist_launcher(int hidden_size, int vocab_size,
+                                         int shortlist_size,
+                                         cudaStream_t stream, const T* kernel,
+                                         const T* logit_bias,
+                                         const int* shortlist, T* new_kernel,
+                                         T* new_logit_bias) {
+  dim3 grid_dim((shortlist_size + MAX_THREADS - 1) / MAX_THREADS,
+                hidden_size + 1);
+  ker_gather_vocab_shortlist<T><<<grid_dim, MAX_THREADS, 0, stream>>>(
+      kernel, logit_bias, shortlist, new_kernel, new_logit_bias, hidden_size,
+      vocab_size, shortlist_size);
+}
+
+template void ker_gather_vocab_shortlist_launcher<float>(
+    int hidden_size, int vocab_size, int shortlist_size, cudaStream_t stream,
+    const float* kernel, const float* logit_bias, const int* shortlist,
+    float* new_kernel, float* new_logit_bias);
+template void ker_gather_vocab_shortlist_launcher<__half>(
+    int hidden_size, int vocab_size, int shortlist_size, cudaStream_t stream,
+    const __half* kernel, const __half* logit_bias, const int* shortlist,
+    __half* new_kernel, __half* new_logit_bias);
+
+/**
+@brief: ker_map_vocab_shortlist
+turn the token of step of every beam from a shortlist id into its vocab id
+
+@thread
+gridDim.x = ceil(token_num / MAX_THREADS)
+blockDim.x = MAX_THREADS
+
+@param
+alive_seq: [token_num, max_step]
+shortlist: [shortlist_size]
+*/
+__global__ void ker_map_vocab_shortlist(int* alive_seq, const int* shortlist,
+                                        int token_num, int max_step,
+                                        int step) {
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= token_num) return;
+  int* token = alive_seq + idx * max_step + step;
+  *token = shortlist[*token];
+}
+
+void ker_map_vocab_shortlist_launcher(int token_num, int max_step, int step,
+                                      cudaStream_t stream, int* alive_seq,
+                                      const int* shortlist) {
+  ker_map_vocab_shortlist<<<(token_num + MAX_THREADS - 1) / MAX_THREADS,
+                            MAX_THREADS, 0, stream>>>(alive_seq, shortlist,
+                                                      token_num, max_step,
+                                                      step);
+}
+
+/**
+@brief: ker_replace_token
+replace the token id from_id with to_id
+
+@thread
+gridDim.x = ceil(size / MAX_THREADS)
+blockDim.x = MAX_THREADS
+
+@param
+tokens: [size]
+*/
+__global__ void ker_replace_token(int* tokens, int size, int from_id,
+                                  int to_id) {
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx < size && tokens[idx] == from_id) tokens[idx] = to_id;
+}
+
+void ker_replace_token_launcher(int size, int from_id, int to_id,
+                                cudaStream_t stream, int* tokens) {
+  ker_replace_token<<<(size + MAX_THREADS - 1) / MAX_THREADS, MAX_THREADS, 0,
+                      stream>>>(tokens, size, from_id, to_id);
+}
+
+/**
+@brief: ker_mask_lang_vocab
+push the logits of the vocab ids the target language of the batch item can
+not decode far below the others, -1e4 is still finite in fp16
+
+@thread
+gridDim.x = ceil(vocab_size / MAX_THREADS)
+gridDim.y = token_num
+blockDim.x = MAX_THREADS
+
+@param
+logits: [token_num, vocab_size]
+vocab_mask: [lang_num, vocab_size]
+lang_id: [token_num / beam_size]
+*/
+template <typename T>
+__global__ void ker_mask_lang_vocab(T* logits, const int8_t* vocab_mask,
+                                    const int* lang_id, int vocab_size,
+                                    int beam_size) {
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= vocab_size) return;
+  int lang = lang_id[blockIdx.y / beam_size];
+  if (!vocab_mask[(size_t)lang * vocab_size + idx]) {
+    logits[(size_t)blockIdx.y * vocab_size + idx] = T(-10000.f);
+  }
+}
+
+template <typename T>
+void ker_mask_lang_vocab_launcher(int token_num, int vocab_size,
+                                  int beam_size, cudaStream_t stream,
+                                  T* logits, const int8_t* vocab_mask,
+                                  const int* lang_id) {
+  dim3 grid_dim((vocab_size + MAX_THREADS - 1) / MAX_THREADS, token_num);
+  ker_mask_lang_vocab<T><<<grid_dim, MAX_THREADS, 0, stream>>>(
+      logits, vocab_mask, lang_id, vocab_size, beam_size);
+}
+
+template void ker_mask_lang_vocab_launcher<float>(
+    int token_num, int vocab_size, int beam_size, cudaStream_t stream,
+    float* logits, const int8_t* vocab_mask, const int* lang_id);
+template void ker_mask_lang_vocab_launcher<__half>(
+    int token_num, int vocab_size, int beam_size, cudaStream_t stream,
+    __half* logits, const int8_t* vocab_mask, const int* lang_id);
+
+
+/**
+@brief: ker_token_merge_metric
+the keys of a token summed over the heads and l2 normalized, whose dot
+product is the similarity of token merging
+
+@thread
+gridDim.x = batch_size * batch_seq_len
+blockDim.x = first multiple of WARP_SIZE not less than dim_per_head
+
+@param
+keys: [batch_size, head_num, batch_seq_len, dim_per_head]
+metric: [batch_size, batch_seq_len, dim_per_head]
+*/
+template <typename T>
+__global__ void ker_token_merge_metric(const T* keys, float* metric,
+                                       int batch_seq_len, int head_num,
+                                       int dim_per_head) {
+  int batch_id = blockIdx.x / batch_seq_len;
+  int token_id = blockIdx.x % batch_seq_len;
+  float val = 0.f;
+  if (threadIdx.x < dim_per_head) {
+    for (int head_id = 0; head_id < head_num; head_id++) {
+      val += (float)keys[((size_t)(batch_id * head_num + head_id) *
+                              batch_seq_len +
+                          token_id) *
+                             dim_per_head +
+                         threadIdx.x];
+    }
+  }
+  float sum = blockReduceSum<float>(val * val);
+  __shared__ float s_rnorm;
+  if (threadIdx.x == 0) s_rnorm = rsqrtf(sum + epsilon);
+  __syncthreads();
+  if (threadIdx.x < dim_per_head) {
+    metric[(size_t)blockIdx.x * dim_per_head + threadIdx.x] = val * s_rnorm;
+  }
+}
+
+/**
+@brief: ker_token_merge_match
+bipartite soft matching, every token of an even position finds the most
+similar token of an odd position, the cls token gets the lowest score so that
+it is never merged
+
+@thread
+gridDim.x = batch_size
+gridDim.y = (batch_seq_len + 1) / 2
+blockDim.x = MAX_THREADS / 8
+
+@param
+metric: [batch_size, batch_seq_len, dim_per_head]
+score: [batch_size, (batch_seq_len + 1) / 2]
+match: [batch_size, (batch_seq_len + 1) / 2], the index of the odd token
+*/
+__global__ void ker_token_merge_match(const float* metric, float* score,
+                                      int* match, int batch_seq_len,
+                                      int dim_per_head) {
+  const float* src =
+      metric + ((size_t)blockIdx.x * batch_seq_len + 2 * blockIdx.y) *
+                   dim_per_head;
+  float best = CUDA_FLOAT_INF_NEG;
+  int best_id = 0;
+  for (int i = threadIdx.x; i < batch_seq_len / 2; i += blockDim.x) {
+    const float* dst =
+        metric + ((size_t)blockIdx.x * batch_seq_len + 2 * i + 1) *
+                     dim_per_head;
+    float val = 0.f;
+    for (int j = 0; j < dim_per_head; j++) val += src[j] * dst[j];
+    if (val > best) {
+      best = val;
+      best_id = i;
+    }
+  }
+
+  __shared__ float s_best[MAX_THREADS / 8];
+  __shared__ int s_best_id[MAX_THREADS / 8];
+  s_best[threadIdx.x] = best;
+  s_best_id[threadIdx.x] = best_id;
+  __syncthreads();
+  for (int stride = blockDim.x / 2; stride > 0; stride >>= 1) {
+    if (threadIdx.x < stride) {
+      float other = s_best[threadIdx.x + stride];
+      int other_id = s_best_id[threadIdx.x + stride];
+      if (other > s_best[threadIdx.x] ||
+          (other == s_best[threadIdx.x] && other_id < s_best_id[threadIdx.x])) {
+        s_best[threadIdx.x] = other;
+        s_best_id[threadIdx.x] = other_id;
+      }
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    int idx = blockIdx.x * gridDim.y + blockIdx.y;
+    score[idx] = blockIdx.y == 0 ? CUDA_FLOAT_INF_NEG : s_best[0];
+    match[idx] = s_best_id[0];
+  }
+}
+
+/**
+@brief: ker_token_merge_plan
+the merge_num even tokens of the highest score are merged into their match,
+the tokens of the output are the other even tokens in their order, the cls
+token first, then the odd ones. src_tokens lists the input tokens of every
+output token, from src_offsets[i] to src_offsets[i + 1]
+
+@thread
+gridDim.x = batch_size
+blockDim.x = MAX_THREADS
+
+@param
+score: [batch_size, (batch_seq_len + 1) / 2]
+match: [batch_size, (batch_seq_len + 1) / 2]
+src_offsets: [batch_size, batch_seq_len - merge_num + 1]
+src_tokens: [batch_size, batch_seq_len]
+*/
+__global__ void ker_token_merge_plan(const float* score, const int* match,
+                                     int* src_offsets, int* src_tokens,
+                                     int batch_seq_len, int merge_num) {
+  int src_num = (batch_seq_len + 1) / 2;
+  int dst_num = batch_seq_len / 2;
+  int kept_num = src_num - merge_num;
+  score += blockIdx.x * src_num;
+  match += blockIdx.x * src_num;
+  src_offsets += blockIdx.x * (batch_seq_len - merge_num + 1);
+  src_tokens += blockIdx.x * batch_seq_len;
+
+  __shared__ bool s_merged[MAX_THREADS];
+  __shared__ int s_filled[MAX_THREADS];
+  if (threadIdx.x < src_num) {
+    float val = score[threadIdx.x];
+    int rank = 0;
+    for (int i = 0; i < src_num; i++) {
+      rank += score[i] > val || (score[i] == val && i < threadIdx.x);
+    }
+    s_merged[threadIdx.x] = rank < merge_num;
+  }
+  if (threadIdx.x < dst_num) s_filled[threadIdx.x] = 1;
+  __syncthreads();
+  if (threadIdx.x != 0) return;
+
+  // the number of input tokens of output token i at src_offsets[i + 1]
+  for (int i = 0; i < dst_num; i++) src_offsets[kept_num + i + 1] = 1;
+  int kept = 0;
+  for (int i = 0; i < src_num; i++) {
+    if (s_merged[i]) {
+      src_offsets[kept_num + match[i] + 1]++;
+    } else {
+      src_offsets[++kept] = 1;
+    }
+  }
+  src_offsets[0] = 0;
+  for (int i = 0; i < kept_num + dst_num; i++) {
+    src_offsets[i + 1] += src_offsets[i];
+  }
+
+  for (int i = 0; i < dst_num; i++) {
+    src_tokens[src_offsets[kept_num + i]] = 2 * i + 1;
+  }
+  kept = 0;
+  for (int i = 0; i < src_num; i++) {
+    if (s_merged[i]) {
+      int dst = match[i];
+      src_tokens[src_offsets[kept_num + dst] + s_filled[dst]++] = 2 * i;
+    } else {
+      src_tokens[src_offsets[kept++]] = 2 * i;
+    }
+  }
+}
+
+/**
+@brief: ker_token_merge
+every output token is the average of its input tokens, weighted by the
+number of tokens each is merged from
+
+@thread
+gridDim.x = batch_size
+gridDim.y = new_seq_len
+blockDim.x = min(hidden_size, MAX_THREADS)
+
+@param
+input: [batch_size, batch_seq_len, hidden_size]
+size: [batch_size, batch_seq_len], all ones if nullptr
+output: [batch_size, new_seq_len, hidden_size]
+new_size: [batch_size, new_seq_len]
+*/
+template <typename T>
+__global__ void ker_token_merge(const T* input, const int* src_offsets,
+                                const int* src_tokens, const float* size,
+                                T* output, float* new_size, int batch_seq_len,
+                                int hidden_size) {
+  int new_seq_len = gridDim.y;
+  src_offsets += blockIdx.x * (new_seq_len + 1);
+  src_tokens += blockIdx.x * batch_seq_len;
+  input += (size_t)blockIdx.x * batch_seq_len * hidden_size;
+  int start = src_offsets[blockIdx.y], end = src_offsets[blockIdx.y + 1];
+
+  float total = 0.f;
+  for (int i = start; i < end; i++) {
+    total += size ? size[blockIdx.x * batch_seq_len + src_tokens[i]] : 1.f;
+  }
+  for (int j = threadIdx.x; j < hidden_size; j += blockDim.x) {
+    float val = 0.f;
+    for (int i = start; i < end; i++) {
+      int token_id = src_tokens[i];
+      float weight = size ? size[blockIdx.x * batch_seq_len + token_id] : 1.f;
+      val += weight * (float)input[(size_t)token_id * hidden_size + j];
+    }
+    output[((size_t)blockIdx.x * new_seq_len + blockIdx.y) * hidden_size + j] =
+        (T)(val / total);
+  }
+  if (threadIdx.x == 0) {
+    new_size[blockIdx.x * new_seq_len + blockIdx.y] = total;
+  }
+}
+
+template <typename T>
+void ker_token_merge_launcher(int batch_size, int batch_seq_len,
+                              int merge_num, int hidden_size, int head_num,
+                              cudaStream_t stream, const T* keys,
+                              const T* input, const float* size, T* output,
+                              float* new_size, float* metric, float* score,
+                              int* match, int* src_offsets, int* src_tokens) {
+  int dim_per_head = hidden_size / head_num;
+  int new_seq_len = batch_seq_len - merge_num;
+  ker_token_merge_metric<T>
+      <<<batch_size * batch_seq_len, (dim_per_head + 31) / 32 * 32, 0,
+         stream>>>(keys, metric, batch_seq_len, head_num, dim_per_head);
+  ker_token_merge_match<<<dim3(batch_size, (batch_seq_len + 1) / 2),
+                          MAX_THREADS / 8, 0, stream>>>(
+      metric, score, match, batch_seq_len, dim_per_head);
+  ker_token_merge_plan<<<batch_size, MAX_THREADS, 0, stream>>>(
+      score, match, src_offsets, src_tokens, batch_seq_len, merge_num);
+  ker_token_merge<T><<<dim3(batch_size, new_seq_len),
+                       min(hidden_size, MAX_THREADS), 0, stream>>>(
+      input, src_offsets, src_tokens, size, output, new_size, batch_seq_len,
+      hidden_size);
+}
+
+template void ker_token_merge_launcher<float>(
+    int batch_size, int batch_seq_len, int merge_num, int hidden_size,
+    int head_num, cudaStream_t stream, const float* keys, const float* input,
+    const float* size, float* output, float* new_size, float* metric,
+    float* score, int* match, int* src_offsets, int* src_tokens);
+template void ker_token_merge_launcher<__half>(
+    int batch_size, int batch_seq_len, int merge_num, int hidden_size,
+    int head_num, cudaStream_t stream, const __half* keys, const __half* input,
+    const float* size, __half* output, float* new_size, float* metric,
+    float* score, int* match, int* src_offsets, int* src_tokens);
+
 }  // namespace cuda
 }  // namespace lightseq
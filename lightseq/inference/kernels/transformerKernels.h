@@ -44,6 +44,39 @@ void ker_diverse_beam_search_launcher(float* can_score, int* can_ids,
                                       cudaStream_t stream, int beam_size,
                                       float diverse_lambda, int vocab_size);
 
+/**
+Fused beam search top k for diverse_lambda == 0, taking the place of
+select_beam_rough_topk_launcher and the sort of its candidates. Writes the
+sorted top beam_size candidates of every batch item to can_idx, can_score
+and num_beam_can + 1 in the layout ker_refresh_result reads, without any
+host sync. beam_topk_score and beam_topk_idx are a
+[batch_size * beam_size * beam_size] workspace. With a [lang_num, vocab_size]
+vocab_mask, a batch item only decodes the vocab ids of its target language
+in lang_id.
+*/
+template <typename T>
+void beam_search_topk_launcher(const T* logits, const T* logit_bias,
+                               const float* seq_probs, const float* seq_score,
+                               const int* alive_seq, float* beam_topk_score,
+                               int* beam_topk_idx, int* can_idx,
+                               float* can_score, int* num_beam_can,
+                               int vocab_size, int max_step,
+                               float length_norm, int cur_step,
+                               int batch_size, cudaStream_t stream,
+                               int beam_size, int end_id,
+                               const int8_t* vocab_mask = nullptr,
+                               const int* lang_id = nullptr);
+
+/**
+Beam pruning by score margin on the sorted candidates of beam search, before
+ker_refresh_result, see ker_prune_beams.
+*/
+void ker_prune_beams_launcher(int batch_size, int beam_size,
+                              cudaStream_t stream, int* can_idx,
+                              float* can_score, const int* num_can_per_beam,
+                              int vocab_size, float abs_margin,
+                              float rel_margin, int end_id);
+
 template <typename T>
 void ker_bias_relu_launcher(int batch_token_num, int block_dim,
                             cudaStream_t stream, T* input, const T* bias,
@@ -104,6 +137,21 @@ void ker_correlation_softmax_encdec_launcher(
     int batch_size, int head_num_per_seq, int batch_seq_len,
     cudaStream_t stream, T* correlation, const int* src_padding_mask);
 
+template <typename T>
+void ker_quantize_encdec_kv_launcher(int batch_size, int dec_layer_num,
+                                     int head_num, int batch_seq_len,
+                                     int dim_per_head, cudaStream_t stream,
+                                     const T* k, const T* v, int8_t* k_i8,
+                                     int8_t* v_i8, float* k_scale,
+                                     float* v_scale, int offset_per_layer);
+
+template <typename T>
+void ker_encdec_attention_i8_launcher(
+    int batch_size, int head_num, int beam_size, int batch_seq_len,
+    int dim_per_head, float scaler, cudaStream_t stream, const T* q,
+    T* out, const int8_t* k_i8, const int8_t* v_i8, const float* k_scale,
+    const float* v_scale, const int* src_padding_mask);
+
 template <typename T>
 void ker_arrange_atten_output_launcher(int batch_token_num, int hidden_size,
                                        cudaStream_t stream, const T* ori_q,
@@ -119,6 +167,17 @@ __global__ void ker_refresh_result(const int* can_idx, const float* can_score,
                                    int cur_step, float length_norm,
                                    float diverse_lambda, int end_id);
 
+__global__ void ker_refresh_beam_history(
+    const int* can_idx, const float* can_score, const int* num_can_per_beam,
+    int* alive_seq, int* beam_parent, int* history_len, float* seq_probs,
+    float* seq_score, int* num_finish_beam, int vocab_size, int max_step,
+    int cur_step, float length_norm, float diverse_lambda, int end_id);
+
+__global__ void ker_backtrace_beam_seq(const int* alive_seq,
+                                       const int* beam_parent,
+                                       const int* history_len, int* seq,
+                                       int max_step, int end_id);
+
 __global__ void ker_write_trg_tokenid_pos_penalty(const int* alive_seq,
                                                   float* seq_scores,
                                                   int* output, int max_step,
@@ -159,6 +218,15 @@ void ker_topp_sample_launcher(int batch_size, int batch_seq_len,
                               int* unfinished, curandState* curandstate,
                               int eos_id);
 
+// The top k tokens of the logits of cur_step of every sequence and their log
+// probs, k <= 32, see ker_step_topk_log_probs.
+template <typename T>
+void ker_step_topk_log_probs_launcher(
+    int batch_size, int max_step, int cur_step, cudaStream_t stream,
+    const T* logits, const T* logit_bias, const int* alive_seq,
+    const int* vocab_ids, int vocab_size, int k, int end_id, int* topk_ids,
+    float* topk_log_probs);
+
 template <typename T>
 void ker_bias_gelu_launcher(int batch_token_num, int block_dim,
                             cudaStream_t stream, T* input, const T* bias,
@@ -166,5 +234,97 @@ void ker_bias_gelu_launcher(int batch_token_num, int block_dim,
 
 __global__ void ker_curand_setup(curandState* state);
 
+// The fused vocab projection and top k of ker_logits_topk_launcher is used
+// for at most kLogitsTopkMaxTokens tokens; the gemm is faster beyond that.
+const int kLogitsTopkMaxTokens = 8;
+// Vocab ids covered by one block of ker_logits_topk_launcher.
+const int kLogitsTopkBlockCols = 1024;
+
+size_t logits_topk_workspace_bytes(int token_num, int vocab_size, int k);
+
+/**
+The top k logits of every token, in descending order, of
+scale * inp * weight + logit_bias. The logits of a block of vocab ids are
+only kept in shared memory, so the [token_num, vocab_size] logits are never
+written. The weight is [vocab_size, hidden_size] if weight_trans, else
+[hidden_size, vocab_size]. logit_bias can be nullptr. The workspace has
+logits_topk_workspace_bytes.
+*/
+template <typename T>
+void ker_logits_topk_launcher(const T* inp, const T* weight,
+                              const T* logit_bias, void* workspace,
+                              float* topk_val, int* topk_idx, int token_num,
+                              int hidden_size, int vocab_size, int k,
+                              float scale, bool weight_trans,
+                              cudaStream_t stream);
+
+void ker_topk_sample_candidates_launcher(int batch_size, int batch_seq_len,
+                                         int max_step, cudaStream_t stream,
+                                         const float* topk_val,
+                                         const int* topk_idx, int k,
+                                         int* old_input_ids, int* unfinished,
+                                         curandState* curandstate,
+                                         int eos_id);
+
+void ker_batch_finished_launcher(int batch_size, int beam_size,
+                                 cudaStream_t stream, const int* alive_seq,
+                                 int* finished, int max_step, int step,
+                                 int end_id);
+
+template <typename T>
+void ker_gather_batch_rows_launcher(int batch_size, int row_size,
+                                    cudaStream_t stream, const T* src, T* dst,
+                                    const int* batch_ids);
+
+void ker_gather_seq_score_launcher(int batch_size, int beam_size,
+                                   cudaStream_t stream, const float* src,
+                                   float* dst, const int* batch_ids);
+
+template <typename T>
+void ker_gather_self_kv_launcher(int dec_layer_num, int batch_size,
+                                 int max_thread_per_block, cudaStream_t stream,
+                                 const int* batch_ids, const T* self_k_bgeem,
+                                 const T* self_v_bgeem, T* new_self_k_bgeem,
+                                 T* new_self_v_bgeem, int self_k_bgeem_offset,
+                                 int beam_size, int dim_per_head, int head_num,
+                                 int cur_step, int max_step);
+
+// The logits projection columns and the logit bias of the vocab shortlist,
+// see Decoder::set_vocab_shortlist.
+template <typename T>
+void ker_gather_vocab_shortlist_launcher(int hidden_size, int vocab_size,
+                                         int shortlist_size,
+                                         cudaStream_t stream, const T* kernel,
+                                         const T* logit_bias,
+                                         const int* shortlist, T* new_kernel,
+                                         T* new_logit_bias);
+
+void ker_map_vocab_shortlist_launcher(int token_num, int max_step, int step,
+                                      cudaStream_t stream, int* alive_seq,
+                                      const int* shortlist);
+
+void ker_replace_token_launcher(int size, int from_id, int to_id,
+                                cudaStream_t stream, int* tokens);
+
+// The logits of the vocab ids the target language of every batch item can
+// not decode, for the searches without a vocab mask of their own.
+template <typename T>
+void ker_mask_lang_vocab_launcher(int token_num, int vocab_size,
+                                  int beam_size, cudaStream_t stream,
+                                  T* logits, const int8_t* vocab_mask,
+                                  const int* lang_id);
+
+// Token merging of a ViT layer, merge_num tokens of input are averaged into
+// others by the similarity of their keys, see VitEncoder::merge_tokens. size
+// is the number of tokens each token is merged from, all ones if nullptr.
+// Needs (batch_seq_len + 1) / 2 <= MAX_THREADS.
+template <typename T>
+void ker_token_merge_launcher(int batch_size, int batch_seq_len,
+                              int merge_num, int hidden_size, int head_num,
+                              cudaStream_t stream, const T* keys,
+                              const T* input, const float* size, T* output,
+                              float* new_size, float* metric, float* score,
+                              int* match, int* src_offsets, int* src_tokens);
+
 }  // namespace cuda
 }  // namespace lightseq
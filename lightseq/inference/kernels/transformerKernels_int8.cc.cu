@@ -2320,5 +2320,59 @@ template void ker_topp_sample_i8I_launcher<__half>(
     const int vocab_size, const float p, int *unfinished,
     curandState *curandstate, int eos_id, float dequant_scale, bool in_col32);
 
+template <typename T>
+__global__ void ker_abs_histogram(const T *input, int size, float *abs_max,
+                                  unsigned long long *hist, int num_bins) {
+  int stride = blockDim.x * gridDim.x;
+  if (hist == nullptr) {
+    float thread_max = 0.f;
+    for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < size;
+         i += stride) {
+      thread_max = fmaxf(thread_max, fabsf(float(input[i])));
+    }
+    float block_max = blockReduceMax(thread_max);
+    // the int order of non-negative floats is their float order
+    if (threadIdx.x == 0) {
+      atomicMax(reinterpret_cast<int *>(abs_max), __float_as_int(block_max));
+    }
+    return;
+  }
+
+  extern __shared__ unsigned int s_hist[];
+  for (int i = threadIdx.x; i < num_bins; i += blockDim.x) s_hist[i] = 0;
+  __syncthreads();
+  float range = abs_max[0];
+  float bin_scale = range > 0.f ? num_bins / range : 0.f;
+  for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < size; i += stride) {
+    int bin = min(int(fabsf(float(input[i])) * bin_scale), num_bins - 1);
+    atomicAdd(s_hist + bin, 1u);
+  }
+  __syncthreads();
+  for (int i = threadIdx.x; i < num_bins; i += blockDim.x) {
+    if (s_hist[i]) atomicAdd(hist + i, (unsigned long long)s_hist[i]);
+  }
+}
+
+template <typename T>
+void launch_abs_histogram(const T *input, int size, float *abs_max,
+                          unsigned long long *hist, int num_bins,
+                          cudaStream_t stream) {
+  if (size <= 0) return;
+  int grid_dim = min((size + 1023) >> 10, 512);
+  int smem_bytes = hist == nullptr ? 0 : num_bins * sizeof(unsigned int);
+  ker_abs_histogram<T><<<grid_dim, 1024, smem_bytes, stream>>>(
+      input, size, abs_max, hist, num_bins);
+}
+
+template void launch_abs_histogram<float>(const float *input, int size,
+                                          float *abs_max,
+                                          unsigned long long *hist,
+                                          int num_bins, cudaStream_t stream);
+
+template void launch_abs_histogram<__half>(const __half *input, int size,
+                                           float *abs_max,
+                                           unsigned long long *hist,
+                                           int num_bins, cudaStream_t stream);
+
 }  // namespace cuda
 }  // namespace lightseq
@@ -142,5 +142,24 @@ void ker_topp_sample_i8I_launcher(int batch_size, int batch_seq_len,
                                   int eos_id, float dequant_scale,
                                   bool in_col32 = false);
 
+/**
+@brief: launch_abs_histogram
+the absmax or the histogram of |input| of a tensor to calibrate, for the
+post-training quantization of quant_calibrator.h, accumulated over the calls.
+with hist null, it only reduces the absmax of input into abs_max[0]. otherwise
+abs_max[0] is the range, the abs of every element is binned into one of the
+num_bins bins of [0, abs_max[0]], the larger ones into the last, in shared
+memory per block before hist. no host synchronization.
+
+@param
+input: [size]
+abs_max: [1]
+hist: [num_bins], or nullptr
+*/
+template <typename T>
+void launch_abs_histogram(const T *input, int size, float *abs_max,
+                          unsigned long long *hist, int num_bins,
+                          cudaStream_t stream);
+
 }  // namespace cuda
 }  // namespace lightseq
@@ -31,7 +31,8 @@ BertEncoder<OpType_>::BertEncoder(int max_batch_size, const int *p_d_token_id,
       _fzero((_DataType)0.f),
       _atten_scaler((_DataType)sqrt(1.f / tw._dim_per_head)),
       _max_batch_dim(max_batch_size * tw._max_step * tw._hidden_size),
-      _max_thread_per_block(1024) {}
+      _max_thread_per_block(1024),
+      _graphs(stream, CudaGraphCache::max_graphs_from_env()) {}
 
 /**
 Compute GPU memory size needed by transformer encoder,
@@ -98,6 +99,7 @@ Encoder inference
 */
 template <OperationType OpType_>
 void BertEncoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
+  LS_NVTX_RANGE("BertEncoder::run_one_infer");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -112,12 +114,29 @@ void BertEncoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
   std::cout << "batch_size-" << batch_size << " batch_seq_len-" << batch_seq_len
             << std::endl;
   print_vec(_p_d_token_id, "batch_token_ids", batch_size * batch_seq_len);
+  forward();
+#else
+  /* ---step2. encoder feedforward--- */
+  if (_observer) {
+    forward();
+    return;
+  }
+  _graphs.run({batch_size, batch_seq_len, (int64_t)_p_d_token_id,
+               (int64_t)_p_d_output, (int64_t)_p_d_lang_id},
+              [this]() { forward(); });
 #endif
+  return;
+}
 
-  /* ---step2. encoder feedforward--- */
+/**
+The kernels of one encoder forward, no host synchronization, so that it can
+be captured into a CUDA graph
+*/
+template <OperationType OpType_>
+void BertEncoder<OpType_>::forward() {
   launch_enc_emb<_DataType>(_p_d_src_emb_wei[0], _p_d_src_emb_wei[1],
                             _p_d_token_id, _p_d_output, _p_d_padding_mask,
-                            _tw._padding_id, batch_size, batch_seq_len,
+                            _tw._padding_id, _batch_size, _batch_seq_len,
                             _tw._hidden_size, _stream, _p_d_src_emb_wei[4],
                             _p_d_lang_id, _tw._multilg_type);
 #ifdef DEBUG_RESULT
@@ -153,11 +172,18 @@ void BertEncoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
   return;
 }
 
+template <OperationType OpType_>
+void BertEncoder<OpType_>::observe(int clip_id, const _DataType *act,
+                                   int size) {
+  if (_observer) _observer(_layer_id, clip_id, act, size);
+}
+
 /**
 Encoder self attention
 */
 template <OperationType OpType_>
 void BertEncoder<OpType_>::self_attention() {
+  LS_NVTX_RANGE("BertEncoder::self_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _batch_token_num, _tw._hidden_size, _stream, _p_d_output, _p_d_q,
@@ -171,6 +197,7 @@ void BertEncoder<OpType_>::self_attention() {
   print_vec(_p_d_q + _batch_token_num * _tw._hidden_size - 5,
             "layer norm out(tail): ", 5);
 #endif
+  observe(4, _p_d_q, _batch_token_num * _tw._hidden_size);
 
   /* ---step 1. qkv = ori_q * qkv_wei + bias, and reshape qkv for multi-head
    * gemm--- */
@@ -180,6 +207,7 @@ void BertEncoder<OpType_>::self_attention() {
       _tw._hidden_size * 3, _p_d_q, _BType, _tw._hidden_size, &_fzero,
       _p_d_qkv_projected, _CType, _tw._hidden_size * 3, _computeType,
       CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+  observe(8, _p_d_qkv_projected, _batch_token_num * _tw._hidden_size * 3);
 
 #ifdef DEBUG_RESULT
   print_vec(_p_d_qkv_projected, "self qkv(head): ", 5);
@@ -230,8 +258,18 @@ void BertEncoder<OpType_>::self_attention() {
 #ifdef DEBUG_RESULT
   print_vec(_p_d_v, "self attn before ffn(head): ", 5);
 #endif
+  observe(5, _p_d_v, _batch_token_num * _tw._hidden_size);
 
   /* ---step 4. new_q = ori_q + new_q * output_wei--- */
+  if (_observer) {
+    // the output dense alone, before the residual, into the free q
+    CHECK_GPU_ERROR(cublasGemmEx(
+        _hd, CUBLAS_OP_N, CUBLAS_OP_N, _tw._hidden_size, _batch_token_num,
+        _tw._hidden_size, &_fone, _p_d_enc_wei[_weight_offset + 4], _AType,
+        _tw._hidden_size, _p_d_v, _BType, _tw._hidden_size, &_fzero, _p_d_q,
+        _CType, _tw._hidden_size, _computeType, CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+    observe(9, _p_d_q, _batch_token_num * _tw._hidden_size);
+  }
   CHECK_GPU_ERROR(cublasGemmEx(
       _hd, CUBLAS_OP_N, CUBLAS_OP_N, _tw._hidden_size, _batch_token_num,
       _tw._hidden_size, &_fone, _p_d_enc_wei[_weight_offset + 4], _AType,
@@ -251,6 +289,7 @@ void BertEncoder<OpType_>::self_attention() {
 
 template <OperationType OpType_>
 void BertEncoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("BertEncoder::ffn_add_norm");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _batch_token_num, _tw._hidden_size, _stream, _p_d_output, _p_d_ffn_buf1,
@@ -265,6 +304,7 @@ void BertEncoder<OpType_>::ffn_add_norm() {
   print_vec(_p_d_ffn_buf1 + _batch_token_num * _tw._hidden_size - 5,
             "layer norm(tail): ", 5);
 #endif
+  observe(6, _p_d_ffn_buf1, _batch_token_num * _tw._hidden_size);
 
   /* ---step 1. first ffn layer--- */
   CHECK_GPU_ERROR(cublasGemmEx(
@@ -273,6 +313,7 @@ void BertEncoder<OpType_>::ffn_add_norm() {
       _tw._inner_size, _p_d_ffn_buf1, _BType, _tw._hidden_size, &_fzero,
       _p_d_ffn_buf2, _CType, _tw._inner_size, _computeType,
       CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+  observe(10, _p_d_ffn_buf2, _batch_token_num * _tw._inner_size);
 
   if (_tw._use_gelu) {
     ker_bias_gelu_launcher<_DataType>(
@@ -283,6 +324,7 @@ void BertEncoder<OpType_>::ffn_add_norm() {
         _batch_token_num, _max_thread_per_block, _stream, _p_d_ffn_buf2,
         _p_d_enc_wei[_weight_offset + 9], _tw._inner_size);
   }
+  observe(7, _p_d_ffn_buf2, _batch_token_num * _tw._inner_size);
 
 #ifdef DEBUG_RESULT
   print_vec(_p_d_ffn_buf2, "ffn activation(head): ", 5);
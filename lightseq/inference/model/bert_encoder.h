@@ -9,6 +9,7 @@
 #include <algorithm>
 #include <chrono>
 #include <cmath>
+#include <functional>
 #include <iostream>
 #include <string>
 
@@ -37,6 +38,8 @@ class BertEncoder {
   // private member function
   void self_attention();
   void ffn_add_norm();
+  void forward();
+  void observe(int clip_id, const _DataType *act, int size);
 
   const int _max_batch_size;
   int *_p_d_padding_mask;  // true sequence length(remove padding), [batch_size]
@@ -74,6 +77,12 @@ class BertEncoder {
   int _layer_id;
   int _weight_offset;
 
+  // graphs of forward() by batch size, seq len and io pointers, enabled by
+  // LIGHTSEQ_CUDA_GRAPHS=<max graphs>
+  CudaGraphCache _graphs;
+
+  std::function<void(int, int, const _DataType *, int)> _observer;
+
  public:
   const int *_p_d_token_id;  // input token id [batch_size, batch_seq_len]
   _DataType
@@ -87,6 +96,16 @@ class BertEncoder {
   void init_buffer(void *pbuf);
   std::string check();
   void run_one_infer(int batch_size, int batch_seq_len);
+  // called with the activations of every layer which a QuantBert quantizes,
+  // by the index of their clip max in the 11 of its layer, eg. 4 for the
+  // multihead layer norm output, for the calibration of quant_calibrator.h.
+  // the infers run without cuda graphs while it is set.
+  void set_activation_observer(
+      std::function<void(int layer_id, int clip_id, const _DataType *act,
+                         int size)>
+          observer) {
+    _observer = observer;
+  }
 };
 
 }  // namespace cuda
@@ -32,6 +32,9 @@ Decoder<OpType_>::Decoder(int max_batch_size, const int* p_d_padding_mask,
       _stream(stream),
       _hd(hd),
       _output_topk(output_topk),
+      _step_topk(0),
+      _p_d_step_topk_ids(nullptr),
+      _p_d_step_topk_log_probs(nullptr),
       _p_d_lang_id(p_d_lang_id),  // source token id
       _layer_size_encdec_k(max_batch_size * tw._max_step * tw._hidden_size),
       _layer_size_self_k(max_batch_size * tw._max_step * tw._hidden_size *
@@ -46,7 +49,28 @@ Decoder<OpType_>::Decoder(int max_batch_size, const int* p_d_padding_mask,
                          min_log_probability / 2),
       _h_length_norm(tw._max_step, 1.f),
       _h_unfinished(1),
-      _is_benchmark(false) {
+      _is_benchmark(false),
+      _beam_history(false),
+      _encdec_kv_int8(false),
+      _p_d_encdec_k_i8(nullptr),
+      _p_d_encdec_v_i8(nullptr),
+      _p_d_encdec_k_scale(nullptr),
+      _p_d_encdec_v_scale(nullptr),
+      _compact_batch(false),
+      _prune_abs_margin(0.f),
+      _prune_rel_margin(0.f),
+      _h_batch_finished(max_batch_size),
+      _has_cancel_pending(false),
+      _num_cancelled(0),
+      _vocab_size(tw._trg_vocab_size),
+      _end_id(tw._end_id),
+      _p_d_logit_kernel(_p_d_trg_emb_wei[0]),
+      _p_d_logit_bias(_p_d_trg_emb_wei[6]),
+      _shortlist_capacity(0),
+      _p_d_shortlist_ids(nullptr),
+      _p_d_shortlist_kernel(nullptr),
+      _p_d_shortlist_bias(nullptr),
+      _p_d_lang_vocab_mask(nullptr) {
   for (int i = 0; i < _h_alive_seq_probs.size(); i += tw._beam_size) {
     _h_alive_seq_probs[i] = 0.f;
   }
@@ -55,6 +79,8 @@ Decoder<OpType_>::Decoder(int max_batch_size, const int* p_d_padding_mask,
       _h_length_norm[i] = length_norm(i + 1, tw._length_penalty);
     }
   }
+  const char* int8_env = std::getenv("LIGHTSEQ_ENCDEC_KV_INT8");
+  _encdec_kv_int8 = int8_env && std::string(int8_env) == "1";
 
   return;
 }
@@ -197,10 +223,36 @@ void Decoder<OpType_>::init_buffer(void* pbuf) {
   _p_d_can_num = pint;
   pint += _max_batch_size * _tw._beam_size + 1;
 
+  CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_beam_parent,
+                             _max_batch_size * _tw._beam_size * _tw._max_step *
+                                 sizeof(int)));
+  CHECK_GPU_ERROR(
+      cudaMalloc((void**)&_p_d_history_len, _max_batch_size * sizeof(int)));
+  if (_encdec_kv_int8) {
+    size_t kv_size = (size_t)_tw._n_dec_layer * _layer_size_encdec_k;
+    size_t scale_size = kv_size / _tw._dim_per_head;
+    CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_encdec_k_i8, kv_size));
+    CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_encdec_v_i8, kv_size));
+    CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_encdec_k_scale,
+                               scale_size * sizeof(float)));
+    CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_encdec_v_scale,
+                               scale_size * sizeof(float)));
+  }
   CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_sample_unfinished, sizeof(int)));
+  CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_batch_finished,
+                             _max_batch_size * sizeof(int)));
+  CHECK_GPU_ERROR(
+      cudaMalloc((void**)&_p_d_batch_ids, _max_batch_size * sizeof(int)));
+  CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_padding_mask_buf,
+                             _max_batch_size * _tw._max_step * sizeof(int)));
   CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_curandstate,
                              _max_batch_size * sizeof(curandState)));
   ker_curand_setup<<<_max_batch_size, 1, 0, _stream>>>(_p_d_curandstate);
+  if (!_tw._trg_lang_vocab_mask.empty()) {
+    CHECK_GPU_ERROR(cudaMalloc((void**)&_p_d_lang_vocab_mask,
+                               _tw._trg_lang_vocab_mask.size()));
+    update_lang_vocab_mask(nullptr);
+  }
 
   CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
   CHECK_GPU_ERROR(cudaGetLastError());
@@ -266,11 +318,193 @@ void Decoder<OpType_>::benchmark_mode(bool is_benchmark) {
   _is_benchmark = is_benchmark;
 }
 
+template <OperationType OpType_>
+Decoder<OpType_>::~Decoder() {
+  cudaFree(_p_d_shortlist_ids);
+  cudaFree(_p_d_shortlist_kernel);
+  cudaFree(_p_d_shortlist_bias);
+  cudaFree(_p_d_lang_vocab_mask);
+  cudaFree(_p_d_step_topk_ids);
+  cudaFree(_p_d_step_topk_log_probs);
+  cudaFree(_p_d_encdec_k_i8);
+  cudaFree(_p_d_encdec_v_i8);
+  cudaFree(_p_d_encdec_k_scale);
+  cudaFree(_p_d_encdec_v_scale);
+}
+
+template <OperationType OpType_>
+void Decoder<OpType_>::set_beam_pruning(float abs_margin, float rel_margin) {
+  if ((abs_margin > 0 || rel_margin > 0) &&
+      (_tw._sampling_method != "beam_search" || _tw._diverse_lambda != 0)) {
+    throw std::runtime_error("beam pruning needs beam search without diverse");
+  }
+  _prune_abs_margin = abs_margin;
+  _prune_rel_margin = rel_margin;
+}
+
+template <OperationType OpType_>
+void Decoder<OpType_>::output_step_topk(int k) {
+  if (k > 32) {
+    throw std::runtime_error("step topk should not be greater than 32");
+  }
+  if (k > 0 && _tw._sampling_method != "topk" &&
+      _tw._sampling_method != "topp") {
+    // the beams are reordered at every step.
+    throw std::runtime_error("step topk log probs need topk or topp sampling");
+  }
+  // the buffers may still be used by the last run
+  CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
+  cudaFree(_p_d_step_topk_ids);
+  cudaFree(_p_d_step_topk_log_probs);
+  _p_d_step_topk_ids = nullptr;
+  _p_d_step_topk_log_probs = nullptr;
+  _step_topk = k;
+  if (k <= 0) return;
+  size_t size = (size_t)_max_batch_size * _tw._max_step * k;
+  CHECK_GPU_ERROR(cudaMalloc(&_p_d_step_topk_ids, size * sizeof(int)));
+  CHECK_GPU_ERROR(
+      cudaMalloc(&_p_d_step_topk_log_probs, size * sizeof(float)));
+}
+
+/**
+Restrict the logits projection and the search of the next runs to the vocab
+ids of tokens, the full vocab if tokens is empty.
+The decoding runs on the ids of the shortlist. The search kernels compare
+the tokens with the eos id, so the eos takes the first shortlist id which is
+not a vocab id of the shortlist, and is the only token kept as a shortlist
+id in the alive seqs, see map_shortlist_tokens.
+*/
+template <OperationType OpType_>
+void Decoder<OpType_>::set_vocab_shortlist(const std::vector<int>& tokens) {
+  _vocab_size = _tw._trg_vocab_size;
+  _end_id = _tw._end_id;
+  _p_d_logit_kernel = _p_d_trg_emb_wei[0];
+  _p_d_logit_bias = _p_d_trg_emb_wei[6];
+  if (tokens.empty()) {
+    update_lang_vocab_mask(nullptr);
+    return;
+  }
+
+  std::set<int> token_set;
+  for (int token : tokens) {
+    if (token < 0 || token >= _tw._trg_vocab_size) {
+      throw std::runtime_error("vocab shortlist token " +
+                               std::to_string(token) + " out of vocab");
+    }
+    if (token != _tw._end_id) token_set.insert(token);
+  }
+  int size = token_set.size() + 1;
+  if (size < _tw._beam_size) {
+    throw std::runtime_error("vocab shortlist smaller than beam_size");
+  }
+  // a multiple of 8 for the tensor core gemm, the padding is never sampled
+  int shortlist_size = min((size + 7) / 8 * 8, _tw._trg_vocab_size);
+  if (shortlist_size == _tw._trg_vocab_size) {
+    update_lang_vocab_mask(nullptr);
+    return;
+  }
+  int end_id = 0;
+  while (token_set.count(end_id)) end_id++;
+
+  // gather ids, then shortlist id to alive seq id
+  std::vector<int> h_ids(shortlist_size * 2, -1);
+  auto token = token_set.begin();
+  for (int i = 0; i < shortlist_size; i++) {
+    if (i == end_id) {
+      h_ids[i] = _tw._end_id;
+      h_ids[shortlist_size + i] = end_id;
+    } else if (token != token_set.end()) {
+      h_ids[i] = *token;
+      h_ids[shortlist_size + i] = *token;
+      token++;
+    } else {
+      h_ids[shortlist_size + i] = end_id;
+    }
+  }
+
+  // the buffers may still be used by the last run
+  CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
+  if (shortlist_size > _shortlist_capacity) {
+    cudaFree(_p_d_shortlist_ids);
+    cudaFree(_p_d_shortlist_kernel);
+    cudaFree(_p_d_shortlist_bias);
+    CHECK_GPU_ERROR(
+        cudaMalloc(&_p_d_shortlist_ids, shortlist_size * 2 * sizeof(int)));
+    CHECK_GPU_ERROR(cudaMalloc(
+        &_p_d_shortlist_kernel,
+        (size_t)_tw._hidden_size * shortlist_size * sizeof(_DataType)));
+    CHECK_GPU_ERROR(
+        cudaMalloc(&_p_d_shortlist_bias, shortlist_size * sizeof(_DataType)));
+    _shortlist_capacity = shortlist_size;
+  }
+  CHECK_GPU_ERROR(cudaMemcpy(_p_d_shortlist_ids, h_ids.data(),
+                             shortlist_size * 2 * sizeof(int),
+                             cudaMemcpyHostToDevice));
+  ker_gather_vocab_shortlist_launcher<_DataType>(
+      _tw._hidden_size, _tw._trg_vocab_size, shortlist_size, _stream,
+      _p_d_trg_emb_wei[0], _p_d_trg_emb_wei[6], _p_d_shortlist_ids,
+      _p_d_shortlist_kernel, _p_d_shortlist_bias);
+
+  _vocab_size = shortlist_size;
+  _end_id = end_id;
+  _p_d_logit_kernel = _p_d_shortlist_kernel;
+  _p_d_logit_bias = _p_d_shortlist_bias;
+  h_ids.resize(shortlist_size);
+  update_lang_vocab_mask(&h_ids);
+}
+
+/**
+The target language vocab masks in the ids of the decoding, vocab_ids is the
+vocab id of every id, -1 for a padding, nullptr for the whole vocab. The eos
+is always allowed.
+*/
+template <OperationType OpType_>
+void Decoder<OpType_>::update_lang_vocab_mask(
+    const std::vector<int>* vocab_ids) {
+  if (!_p_d_lang_vocab_mask) return;
+  const std::vector<int8_t>& mask = _tw._trg_lang_vocab_mask;
+  int lang_num = mask.size() / _tw._trg_vocab_size;
+  std::vector<int8_t> h_mask(lang_num * _vocab_size);
+  for (int lang = 0; lang < lang_num; lang++) {
+    const int8_t* lang_mask = mask.data() + lang * _tw._trg_vocab_size;
+    for (int i = 0; i < _vocab_size; i++) {
+      int vocab_id = vocab_ids ? (*vocab_ids)[i] : i;
+      h_mask[lang * _vocab_size + i] =
+          vocab_id == _tw._end_id || (vocab_id >= 0 && lang_mask[vocab_id]);
+    }
+  }
+  // the mask may still be read by the last run
+  CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
+  CHECK_GPU_ERROR(cudaMemcpy(_p_d_lang_vocab_mask, h_mask.data(),
+                             h_mask.size(), cudaMemcpyHostToDevice));
+}
+
+/**
+Turn the shortlist ids of the tokens of this step into vocab ids, for the
+embedding of the next step. The eos is kept as _end_id.
+*/
+template <OperationType OpType_>
+void Decoder<OpType_>::map_shortlist_tokens() {
+  if (_vocab_size == _tw._trg_vocab_size) return;
+  ker_map_vocab_shortlist_launcher(_step_token_num, _tw._max_step,
+                                   _cur_step + 1, _stream, _p_d_alive_seq,
+                                   _p_d_shortlist_ids + _vocab_size);
+}
+
+template <OperationType OpType_>
+void Decoder<OpType_>::map_shortlist_eos(int result_size) {
+  if (_end_id == _tw._end_id) return;
+  ker_replace_token_launcher(result_size, _end_id, _tw._end_id, _stream,
+                             _p_d_result);
+}
+
 /**
 Decoder inference
 */
 template <OperationType OpType_>
-void Decoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
+void Decoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len,
+                                     bool project_encoder) {
+  LS_NVTX_RANGE("Decoder::run_one_infer");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -291,19 +525,51 @@ void Decoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
   if (_is_sampling) {
     _batch_max_decode_length = _tw._max_step;
   }
+  // the random states and lang ids of the batch items are not compacted
+  _compact_batch = _tw._sampling_method == "beam_search" &&
+                   _tw._multilg_type == 0 && !_is_benchmark;
+  // topk_greedy_search runs beam_search at the first step only, and keeps
+  // the full sequences
+  _beam_history = _tw._sampling_method == "beam_search";
+  _input_batch_size = batch_size;
+  _p_d_cur_padding_mask = _p_d_padding_mask;
+  _h_batch_order.resize(batch_size);
+  std::iota(_h_batch_order.begin(), _h_batch_order.end(), 0);
+  {
+    std::lock_guard<std::mutex> lock(_cancel_mutex);
+    _h_cancel_pending.clear();
+    _has_cancel_pending.store(false);
+  }
+  _h_cancelled.assign(batch_size, 0);
+  _num_cancelled = 0;
 
-  project_encoder_output();  // project encoder output
+  if (project_encoder) {
+    project_encoder_output(batch_size, batch_seq_len);
+  }
+  if (_encdec_kv_int8) {
+    quantize_encdec_kv(batch_size);
+  }
   // init the first step's token id with target start_id
   CHECK_GPU_ERROR(cudaMemcpyAsync(_p_d_alive_seq_probs,
                                   _h_alive_seq_probs.data(),
                                   sizeof(float) * _batch_size * _tw._beam_size,
                                   cudaMemcpyHostToDevice, _stream));
+  if (_step_topk > 0) {
+    size_t size = (size_t)_batch_size * _tw._max_step * _step_topk;
+    CHECK_GPU_ERROR(cudaMemsetAsync(_p_d_step_topk_ids, 0,
+                                    size * sizeof(int), _stream));
+    CHECK_GPU_ERROR(cudaMemsetAsync(_p_d_step_topk_log_probs, 0,
+                                    size * sizeof(float), _stream));
+  }
 
   /* ---step2. autoregressive decoding--- */
   for (_cur_step = 0; _cur_step < _batch_max_decode_length - 1; _cur_step++) {
 #ifdef DEBUG_RESULT
     std::cout << "*** run step " << _cur_step << " ***" << std::endl;
 #endif
+    if (_cur_step > 0 && apply_cancellations()) {
+      break;
+    }
     bool early_stop = run_step();
     if (!_is_benchmark && early_stop) {  // one step
       break;
@@ -311,14 +577,19 @@ void Decoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
   }
 
   /* ---step3. output the decoding result--- */
+  if (_beam_history) {
+    backtrace_beam_history();
+  }
+  restore_batch_order();
   if (_output_topk || _is_sampling) {
     if (_cur_step == _batch_max_decode_length) {
       _cur_step -= 1;
     }
     ker_write_topk_result<<<_batch_size * _tw._beam_size, _cur_step + 1, 0,
                             _stream>>>(
-        _p_d_alive_seq, _p_d_alive_seq_score, _p_d_result, _tw._trg_vocab_size,
-        _tw._max_step, _tw._beam_size, _tw._end_id);
+        _p_d_alive_seq, _p_d_alive_seq_score, _p_d_result, _vocab_size,
+        _tw._max_step, _tw._beam_size, _end_id);
+    map_shortlist_eos(_batch_size * _tw._beam_size * (_cur_step + 1));
     return;
   }
   if (_tw._length_penalty >= 0.f || _cur_step == _batch_max_decode_length) {
@@ -330,8 +601,9 @@ void Decoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
     ker_write_trg_tokenid_neg_penalty<<<_batch_size, _cur_step + 1, 0,
                                         _stream>>>(
         _p_d_alive_seq, _p_d_alive_seq_score, _p_d_result, _tw._max_step,
-        _tw._beam_size, _tw._trg_vocab_size, _tw._end_id);
+        _tw._beam_size, _vocab_size, _end_id);
   }
+  map_shortlist_eos(_batch_size * (_cur_step + 1));
 #ifdef DEBUG_RESULT
   for (int i = 0; i < _batch_size; i++) {
     print_vec(_p_d_result + i * (_cur_step + 1), "finial res", _cur_step + 1);
@@ -340,21 +612,63 @@ void Decoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
   return;
 }
 
+template <OperationType OpType_>
+void Decoder<OpType_>::cancel_item(int batch_idx) {
+  std::lock_guard<std::mutex> lock(_cancel_mutex);
+  _h_cancel_pending.push_back(batch_idx);
+  _has_cancel_pending.store(true);
+}
+
+/**
+Mark the pending cancelled items. The sampled ones get eos as the token of
+the last step, which the sampling kernels then keep, beam search ORs them
+into the finished items of compact_batch.
+*/
+template <OperationType OpType_>
+bool Decoder<OpType_>::apply_cancellations() {
+  if (!_has_cancel_pending.load()) {
+    return _num_cancelled == _input_batch_size;
+  }
+  std::vector<int> items;
+  {
+    std::lock_guard<std::mutex> lock(_cancel_mutex);
+    items.swap(_h_cancel_pending);
+    _has_cancel_pending.store(false);
+  }
+  bool write_eos =
+      _tw._sampling_method == "topk" || _tw._sampling_method == "topp";
+  for (int item : items) {
+    if (item < 0 || item >= _input_batch_size || _h_cancelled[item]) continue;
+    _h_cancelled[item] = 1;
+    _num_cancelled++;
+    if (write_eos) {
+      // sampling does not compact the batch.
+      CHECK_GPU_ERROR(cudaMemcpyAsync(
+          _p_d_alive_seq + item * _tw._max_step + _cur_step, &_end_id,
+          sizeof(int), cudaMemcpyHostToDevice, _stream));
+    }
+  }
+  return _num_cancelled == _input_batch_size;
+}
+
 /**
 Project encoder output
 */
 template <OperationType OpType_>
-void Decoder<OpType_>::project_encoder_output() {
+void Decoder<OpType_>::project_encoder_output(int batch_size,
+                                              int batch_seq_len) {
+  LS_NVTX_RANGE("Decoder::project_encoder_output");
   int kv_dim = _tw._hidden_size * 2 * _tw._n_dec_layer;
+  int batch_token_num = batch_size * batch_seq_len;
 #ifdef DEBUG_RESULT
   CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
   print_vec(_p_d_encoder_output, "_p_d_encoder_output(head):", 5);
-  print_vec(_p_d_encoder_output + _batch_token_num * _tw._hidden_size - 5,
+  print_vec(_p_d_encoder_output + batch_token_num * _tw._hidden_size - 5,
             "_p_d_encoder_output(tail)", 5);
   print_vec(_p_d_trg_emb_wei[4], "encoder project(head):", 10);
 #endif
   CHECK_GPU_ERROR(cublasGemmEx(
-      _hd, CUBLAS_OP_N, CUBLAS_OP_N, kv_dim, _batch_token_num, _tw._hidden_size,
+      _hd, CUBLAS_OP_N, CUBLAS_OP_N, kv_dim, batch_token_num, _tw._hidden_size,
       &_type_one, _p_d_trg_emb_wei[4], _AType, kv_dim, _p_d_encoder_output,
       _BType, _tw._hidden_size, &_type_zero, _p_d_encoder_out_buf, _CType,
       kv_dim, _computeType, CUBLAS_GEMM_DEFAULT_TENSOR_OP));
@@ -365,13 +679,13 @@ void Decoder<OpType_>::project_encoder_output() {
   CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
   print_vec(_p_d_encoder_out_buf, "encoder out(head):", 5);
   print_vec(_p_d_encoder_out_buf +
-                _batch_token_num * _tw._hidden_size * _tw._n_dec_layer - 5,
+                batch_token_num * _tw._hidden_size * _tw._n_dec_layer - 5,
             "encoder out(tail):", 5);
 #endif
   ker_arrange_encdec_kv_launcher<_DataType>(
-      _batch_token_num, _tw._n_dec_layer, _tw._hidden_size, _stream,
+      batch_token_num, _tw._n_dec_layer, _tw._hidden_size, _stream,
       _p_d_encoder_out_buf, _p_d_trg_emb_wei[5], _p_d_encdec_k_bgeem[0],
-      _p_d_encdec_v_bgeem[0], _layer_size_encdec_k, _batch_seq_len,
+      _p_d_encdec_v_bgeem[0], _layer_size_encdec_k, batch_seq_len,
       _tw._dim_per_head, _tw._head_num, _max_thread_per_block);
   return;
 }
@@ -381,17 +695,31 @@ Decode one step
 */
 template <OperationType OpType_>
 bool Decoder<OpType_>::run_step() {
+  LS_NVTX_RANGE("Decoder::run_step");
   embedding();
   decoder_stack();
+  // the step topk reads the logits, which the fused sampling never writes
+  if (_tw._sampling_method == "topk" &&
+      _step_token_num <= kLogitsTopkMaxTokens && !_p_d_lang_vocab_mask &&
+      _step_topk == 0) {
+    return fused_topk_sample();
+  }
   /* --- Project hidden states to vocab logits--- */
 
   CHECK_GPU_ERROR(cublasGemmEx(
-      _hd, CUBLAS_OP_N, CUBLAS_OP_N, _tw._trg_vocab_size, _step_token_num,
-      _tw._hidden_size, &_logit_scaler, _p_d_trg_emb_wei[0], _AType,
-      _tw._trg_vocab_size, _p_d_cur_step_query, _BType, _tw._hidden_size,
-      // &_type_zero, _p_d_logit_buf, _CType, _tw._trg_vocab_size, _computeType,
-      &_fzero, _p_d_logit_buf, _CType, _tw._trg_vocab_size, CUDA_R_32F,
+      _hd, CUBLAS_OP_N, CUBLAS_OP_N, _vocab_size, _step_token_num,
+      _tw._hidden_size, &_logit_scaler, _p_d_logit_kernel, _AType, _vocab_size,
+      _p_d_cur_step_query, _BType, _tw._hidden_size,
+      // &_type_zero, _p_d_logit_buf, _CType, _vocab_size, _computeType,
+      &_fzero, _p_d_logit_buf, _CType, _vocab_size, CUDA_R_32F,
       CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+  // the fused beam search top k masks the logits it reads itself
+  if (_p_d_lang_vocab_mask &&
+      (_tw._sampling_method != "beam_search" || _tw._diverse_lambda != 0)) {
+    ker_mask_lang_vocab_launcher<_DataType>(
+        _step_token_num, _vocab_size, _tw._beam_size, _stream, _p_d_logit_buf,
+        _p_d_lang_vocab_mask, _p_d_lang_id);
+  }
 
 #ifdef DEBUG_RESULT
   for (int i = 0; i < _batch_size; i++) {       // batch_id
@@ -400,13 +728,21 @@ bool Decoder<OpType_>::run_step() {
       print_vec(_p_d_cur_step_query + i * _tw._beam_size * _tw._hidden_size +
                     j * _tw._hidden_size,
                 "hidden", 10);
-      print_vec(_p_d_logit_buf + i * _tw._beam_size * _tw._trg_vocab_size +
-                    j * _tw._trg_vocab_size,
+      print_vec(_p_d_logit_buf + (i * _tw._beam_size + j) * _vocab_size,
                 "logits", 10);
     }
   }
 #endif
 
+  if (_step_topk > 0) {
+    ker_step_topk_log_probs_launcher<_DataType>(
+        _step_token_num, _tw._max_step, _cur_step, _stream, _p_d_logit_buf,
+        _p_d_logit_bias, _p_d_alive_seq,
+        _vocab_size == _tw._trg_vocab_size ? nullptr : _p_d_shortlist_ids,
+        _vocab_size, _step_topk, _end_id, _p_d_step_topk_ids,
+        _p_d_step_topk_log_probs);
+  }
+
   if (_tw._sampling_method == "topk") {
     return sample();
   } else if (_tw._sampling_method == "topp") {
@@ -425,6 +761,7 @@ Decode embedding
 */
 template <OperationType OpType_>
 void Decoder<OpType_>::embedding() {
+  LS_NVTX_RANGE("Decoder::embedding");
   // _p_d_trg_emb_wei: {token_emb, position_emb, norm_scale, norm_bias,
   // enc_out_kernel_kv, enc_out_bias_kv, logit_bias}
   launch_dec_emb<_DataType>(_p_d_trg_emb_wei[0], _p_d_trg_emb_wei[1],
@@ -479,6 +816,7 @@ Decoder self attention
 */
 template <OperationType OpType_>
 void Decoder<OpType_>::self_attention() {
+  LS_NVTX_RANGE("Decoder::self_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _step_token_num, _tw._hidden_size, _stream, _p_d_cur_step_query,
@@ -590,6 +928,7 @@ Encode-Decoder attention
 */
 template <OperationType OpType_>
 void Decoder<OpType_>::encdec_attention() {
+  LS_NVTX_RANGE("Decoder::encdec_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _step_token_num, _tw._hidden_size, _stream, _p_d_cur_step_query,
@@ -616,28 +955,41 @@ void Decoder<OpType_>::encdec_attention() {
       _p_d_dec_wei[_weight_offset + 9], _p_d_query_buf1, _tw._beam_size,
       _tw._dim_per_head, _tw._head_num, _max_thread_per_block);
 
-  /* ---step 2. correlation = q * k, perform softmax on correlation--- */
-  CHECK_GPU_ERROR(cublasGemmStridedBatchedEx(
-      _hd, CUBLAS_OP_T, CUBLAS_OP_N, _batch_seq_len, _tw._beam_size,
-      _tw._dim_per_head, &_atten_scaler, _p_d_encdec_k_bgeem[_layer_id], _AType,
-      _tw._dim_per_head, _batch_seq_len * _tw._dim_per_head, _p_d_query_buf1,
-      _BType, _tw._dim_per_head, _tw._beam_size * _tw._dim_per_head,
-      &_type_zero, _p_d_c, _CType, _batch_seq_len,
-      _tw._beam_size * _batch_seq_len, _batch_size * _tw._head_num,
-      _computeType, CUBLAS_GEMM_DEFAULT_TENSOR_OP));
-  ker_correlation_softmax_encdec_launcher<_DataType>(
-      _batch_size, _tw._head_num * _tw._beam_size, _batch_seq_len, _stream,
-      _p_d_c, _p_d_padding_mask);
-
-  /* ---step 3. new_q = correlation * v--- */
-  CHECK_GPU_ERROR(cublasGemmStridedBatchedEx(
-      _hd, CUBLAS_OP_N, CUBLAS_OP_N, _tw._dim_per_head, _tw._beam_size,
-      _batch_seq_len, &_type_one, _p_d_encdec_v_bgeem[_layer_id], _AType,
-      _tw._dim_per_head, _batch_seq_len * _tw._dim_per_head, _p_d_c, _BType,
-      _batch_seq_len, _tw._beam_size * _batch_seq_len, &_type_zero,
-      _p_d_query_buf1, _CType, _tw._dim_per_head,
-      _tw._beam_size * _tw._dim_per_head, _batch_size * _tw._head_num,
-      _computeType, CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+  if (_encdec_kv_int8) {
+    /* ---step 2-3. new_q = softmax(q * k) * v on the int8 k, v--- */
+    size_t kv_offset = (size_t)_layer_id * _layer_size_encdec_k;
+    size_t scale_offset = kv_offset / _tw._dim_per_head;
+    ker_encdec_attention_i8_launcher<_DataType>(
+        _batch_size, _tw._head_num, _tw._beam_size, _batch_seq_len,
+        _tw._dim_per_head, _atten_scaler, _stream, _p_d_query_buf1,
+        _p_d_query_buf1, _p_d_encdec_k_i8 + kv_offset,
+        _p_d_encdec_v_i8 + kv_offset, _p_d_encdec_k_scale + scale_offset,
+        _p_d_encdec_v_scale + scale_offset, _p_d_cur_padding_mask);
+  } else {
+    /* ---step 2. correlation = q * k, perform softmax on correlation--- */
+    CHECK_GPU_ERROR(cublasGemmStridedBatchedEx(
+        _hd, CUBLAS_OP_T, CUBLAS_OP_N, _batch_seq_len, _tw._beam_size,
+        _tw._dim_per_head, &_atten_scaler, _p_d_encdec_k_bgeem[_layer_id],
+        _AType, _tw._dim_per_head, _batch_seq_len * _tw._dim_per_head,
+        _p_d_query_buf1, _BType, _tw._dim_per_head,
+        _tw._beam_size * _tw._dim_per_head, &_type_zero, _p_d_c, _CType,
+        _batch_seq_len, _tw._beam_size * _batch_seq_len,
+        _batch_size * _tw._head_num, _computeType,
+        CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+    ker_correlation_softmax_encdec_launcher<_DataType>(
+        _batch_size, _tw._head_num * _tw._beam_size, _batch_seq_len, _stream,
+        _p_d_c, _p_d_cur_padding_mask);
+
+    /* ---step 3. new_q = correlation * v--- */
+    CHECK_GPU_ERROR(cublasGemmStridedBatchedEx(
+        _hd, CUBLAS_OP_N, CUBLAS_OP_N, _tw._dim_per_head, _tw._beam_size,
+        _batch_seq_len, &_type_one, _p_d_encdec_v_bgeem[_layer_id], _AType,
+        _tw._dim_per_head, _batch_seq_len * _tw._dim_per_head, _p_d_c, _BType,
+        _batch_seq_len, _tw._beam_size * _batch_seq_len, &_type_zero,
+        _p_d_query_buf1, _CType, _tw._dim_per_head,
+        _tw._beam_size * _tw._dim_per_head, _batch_size * _tw._head_num,
+        _computeType, CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+  }
 
   ker_arrange_atten_output_launcher<_DataType>(
       _step_token_num, _tw._hidden_size, _stream, _p_d_query_buf1,
@@ -663,6 +1015,7 @@ void Decoder<OpType_>::encdec_attention() {
 
 template <OperationType OpType_>
 void Decoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("Decoder::ffn_add_norm");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _step_token_num, _tw._hidden_size, _stream, _p_d_cur_step_query,
@@ -715,22 +1068,59 @@ void Decoder<OpType_>::ffn_add_norm() {
 
 template <OperationType OpType_>
 bool Decoder<OpType_>::sample() {
+  LS_NVTX_RANGE("Decoder::sample");
   CHECK_GPU_ERROR(
       cudaMemsetAsync(_p_d_sample_unfinished, 0, sizeof(int), _stream));
   /* --- Sample new tokens from logits --- */
   if (_tw._sampling_method == "topk") {
     ker_topk_sample_launcher<_DataType>(
         _batch_size, (_cur_step + 1), _tw._max_step, 1, _max_thread_per_block,
-        _stream, _p_d_logit_buf, _p_d_trg_emb_wei[6], _p_d_alive_seq,
-        _p_d_alive_seq_buf, _tw._trg_vocab_size, _tw._topk,
-        _p_d_sample_unfinished, _p_d_curandstate, _tw._end_id);
+        _stream, _p_d_logit_buf, _p_d_logit_bias, _p_d_alive_seq,
+        _p_d_alive_seq_buf, _vocab_size, _tw._topk, _p_d_sample_unfinished,
+        _p_d_curandstate, _end_id);
   } else {
     ker_topp_sample_launcher<_DataType>(
         _batch_size, (_cur_step + 1), _tw._max_step, 1, _max_thread_per_block,
-        _stream, _p_d_logit_buf, _p_d_trg_emb_wei[6], _p_d_alive_seq,
-        _p_d_alive_seq_buf, _tw._trg_vocab_size, _tw._topp,
-        _p_d_sample_unfinished, _p_d_curandstate, _tw._end_id);
+        _stream, _p_d_logit_buf, _p_d_logit_bias, _p_d_alive_seq,
+        _p_d_alive_seq_buf, _vocab_size, _tw._topp, _p_d_sample_unfinished,
+        _p_d_curandstate, _end_id);
+  }
+  map_shortlist_tokens();
+#ifdef DEBUG_RESULT
+  print_vec(_p_d_sample_unfinished, "unfinished flag", 1);
+  for (int ii = 0; ii < _batch_size; ii++) {
+    print_vec(_p_d_alive_seq + ii * _tw._max_step,
+              "Batch token ids: ", _cur_step + 2);
   }
+#endif
+
+  CHECK_GPU_ERROR(cudaMemcpyAsync(&_h_unfinished, _p_d_sample_unfinished,
+                                  sizeof(int), cudaMemcpyDeviceToHost,
+                                  _stream));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
+
+  return _h_unfinished == 1 ? false : true;
+}
+
+/**
+Top k sampling of a few tokens with the vocab projection fused into the top
+k, so that the logits are never written to _p_d_logit_buf, which is the
+workspace instead. The candidates are kept in the beam search buffers.
+*/
+template <OperationType OpType_>
+bool Decoder<OpType_>::fused_topk_sample() {
+  CHECK_GPU_ERROR(
+      cudaMemsetAsync(_p_d_sample_unfinished, 0, sizeof(int), _stream));
+  ker_logits_topk_launcher<_DataType>(
+      _p_d_cur_step_query, _p_d_logit_kernel, _p_d_logit_bias,
+      _p_d_logit_buf, _p_d_can_score, _p_d_can_idx, _step_token_num,
+      _tw._hidden_size, _vocab_size, _tw._topk, _logit_scaler, false,
+      _stream);
+  ker_topk_sample_candidates_launcher(
+      _batch_size, _cur_step + 1, _tw._max_step, _stream, _p_d_can_score,
+      _p_d_can_idx, _tw._topk, _p_d_alive_seq, _p_d_sample_unfinished,
+      _p_d_curandstate, _end_id);
+  map_shortlist_tokens();
 #ifdef DEBUG_RESULT
   print_vec(_p_d_sample_unfinished, "unfinished flag", 1);
   for (int ii = 0; ii < _batch_size; ii++) {
@@ -749,18 +1139,30 @@ bool Decoder<OpType_>::sample() {
 
 template <OperationType OpType_>
 bool Decoder<OpType_>::beam_search() {
+  LS_NVTX_RANGE("Decoder::beam_search");
   /*
     step 1. logits bias and softmax,
       select rough topk candidate for every batch item,
       record the candidate's beam_id, vocab_id and probability
   */
-  update_new_seq_probs();
+  if (_tw._diverse_lambda == 0) {
+    // the exact top beam_size candidates of every batch item, already
+    // sorted, the tail of the candidate buffers is the workspace
+    beam_search_topk_launcher(
+        _p_d_logit_buf, _p_d_logit_bias, _p_d_alive_seq_probs,
+        _p_d_alive_seq_score, _p_d_alive_seq, _p_d_can_score + _step_token_num,
+        _p_d_can_idx + _step_token_num, _p_d_can_idx, _p_d_can_score,
+        _p_d_can_num, _vocab_size, _tw._max_step, _h_length_norm[_cur_step],
+        _cur_step, _batch_size, _stream, _tw._beam_size, _end_id,
+        _p_d_lang_vocab_mask, _p_d_lang_id);
+  } else {
+    update_new_seq_probs();
 
-  /* ---step 2. sort the candidate with their probability--- */
-  CHECK_GPU_ERROR(cudaMemcpyAsync(&_h_can_num_batch, _p_d_can_num, sizeof(int),
-                                  cudaMemcpyDeviceToHost, _stream));
-  CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
-  if (_tw._diverse_lambda != 0) {
+    /* ---step 2. sort the candidate with their probability--- */
+    CHECK_GPU_ERROR(cudaMemcpyAsync(&_h_can_num_batch, _p_d_can_num,
+                                    sizeof(int), cudaMemcpyDeviceToHost,
+                                    _stream));
+    CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
     if (_h_can_num_batch < _cub_sort_buffer_bytes / 160) {
       CHECK_GPU_ERROR(cub::DeviceRadixSort::SortPairsDescending(
           (float*)_p_d_logit_buf, _cub_sort_buffer_bytes, _p_d_can_score,
@@ -774,17 +1176,22 @@ bool Decoder<OpType_>::beam_search() {
     ker_diverse_beam_search_launcher(_p_d_can_score, _p_d_can_idx, _p_d_can_num,
                                      _step_token_num, _max_thread_per_block,
                                      _stream, _tw._beam_size,
-                                     _tw._diverse_lambda, _tw._trg_vocab_size);
-  }
+                                     _tw._diverse_lambda, _vocab_size);
 
-  thrust::sort_by_key(thrust::cuda::par.on(_stream), _p_d_can_score,
-                      _p_d_can_score + _h_can_num_batch, _p_d_can_idx,
-                      thrust::greater<float>());
+    thrust::sort_by_key(thrust::cuda::par.on(_stream), _p_d_can_score,
+                        _p_d_can_score + _h_can_num_batch, _p_d_can_idx,
+                        thrust::greater<float>());
 
 #ifdef DEBUG_RESULT
-  print_vec(_p_d_can_score, "can score", _h_can_num_batch);
-  print_vec(_p_d_can_idx, "can idx", _h_can_num_batch);
+    print_vec(_p_d_can_score, "can score", _h_can_num_batch);
+    print_vec(_p_d_can_idx, "can idx", _h_can_num_batch);
 #endif
+  }
+  if (_prune_abs_margin > 0 || _prune_rel_margin > 0) {
+    ker_prune_beams_launcher(_batch_size, _tw._beam_size, _stream, _p_d_can_idx,
+                             _p_d_can_score, _p_d_can_num + 1, _vocab_size,
+                             _prune_abs_margin, _prune_rel_margin, _end_id);
+  }
 
   /*
     step 3. refresh alive_seq, seq_probs, seq_score, num_finish_beam
@@ -792,15 +1199,32 @@ bool Decoder<OpType_>::beam_search() {
       Deciding whether early stop based on num_finish_beam
   */
   CHECK_GPU_ERROR(cudaMemsetAsync(_p_d_can_num, 0, sizeof(int), _stream));
-  ker_refresh_result<<<dim3(_batch_size, _tw._beam_size), _tw._max_step, 0,
-                       _stream>>>(
-      _p_d_can_idx, _p_d_can_score, _p_d_can_num + 1, _p_d_alive_seq,
-      _p_d_alive_seq_buf, _p_d_alive_seq_probs, _p_d_alive_seq_score,
-      _p_d_can_num, _tw._trg_vocab_size, _cur_step, _h_length_norm[_cur_step],
-      _tw._diverse_lambda, _tw._end_id);
-  int* tmp = _p_d_alive_seq_buf;
-  _p_d_alive_seq_buf = _p_d_alive_seq;
-  _p_d_alive_seq = tmp;
+  if (_beam_history) {
+    ker_refresh_beam_history<<<_batch_size, _tw._beam_size, 0, _stream>>>(
+        _p_d_can_idx, _p_d_can_score, _p_d_can_num + 1, _p_d_alive_seq,
+        _p_d_beam_parent, _p_d_history_len, _p_d_alive_seq_probs,
+        _p_d_alive_seq_score, _p_d_can_num, _vocab_size, _tw._max_step,
+        _cur_step, _h_length_norm[_cur_step], _tw._diverse_lambda, _end_id);
+  } else {
+    ker_refresh_result<<<dim3(_batch_size, _tw._beam_size), _tw._max_step, 0,
+                         _stream>>>(
+        _p_d_can_idx, _p_d_can_score, _p_d_can_num + 1, _p_d_alive_seq,
+        _p_d_alive_seq_buf, _p_d_alive_seq_probs, _p_d_alive_seq_score,
+        _p_d_can_num, _vocab_size, _cur_step, _h_length_norm[_cur_step],
+        _tw._diverse_lambda, _end_id);
+    int* tmp = _p_d_alive_seq_buf;
+    _p_d_alive_seq_buf = _p_d_alive_seq;
+    _p_d_alive_seq = tmp;
+  }
+  map_shortlist_tokens();
+  if (_compact_batch) {
+    ker_batch_finished_launcher(_batch_size, _tw._beam_size, _stream,
+                                _p_d_alive_seq, _p_d_batch_finished,
+                                _tw._max_step, _cur_step + 1, _end_id);
+    CHECK_GPU_ERROR(cudaMemcpyAsync(
+        _h_batch_finished.data(), _p_d_batch_finished,
+        sizeof(int) * _batch_size, cudaMemcpyDeviceToHost, _stream));
+  }
   CHECK_GPU_ERROR(cudaMemcpyAsync(&_h_can_num_batch, _p_d_can_num, sizeof(int),
                                   cudaMemcpyDeviceToHost, _stream));
   CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
@@ -824,6 +1248,17 @@ bool Decoder<OpType_>::beam_search() {
 #endif
     return true;
   }
+  if (_compact_batch && _num_cancelled > 0) {
+    // the cancelled items are compacted as the finished ones.
+    bool all_finished = true;
+    for (int i = 0; i < _batch_size; i++) {
+      _h_batch_finished[i] |= _h_cancelled[_h_batch_order[i]];
+      all_finished = all_finished && _h_batch_finished[i];
+    }
+    if (all_finished) {
+      return true;
+    }
+  }
 
   /* ---step 4. refresh cache: k, v for decoder self attention--- */
   if (_cur_step > 0) {
@@ -832,8 +1267,8 @@ bool Decoder<OpType_>::beam_search() {
         _max_thread_per_block, _stream, _p_d_can_num + 1, _p_d_can_idx,
         _p_d_self_k_bgeem1[0], _p_d_self_v_bgeem1[0], _p_d_self_k_bgeem2[0],
         _p_d_self_v_bgeem2[0], _layer_size_self_k, _tw._beam_size,
-        _tw._dim_per_head, _tw._head_num, _tw._trg_vocab_size, _cur_step,
-        _tw._max_step, _tw._diverse_lambda != 0, _tw._end_id);
+        _tw._dim_per_head, _tw._head_num, _vocab_size, _cur_step, _tw._max_step,
+        _tw._diverse_lambda != 0, _end_id);
     _DataType** ftmp = _p_d_self_k_bgeem2;
     _p_d_self_k_bgeem2 = _p_d_self_k_bgeem1;
     _p_d_self_k_bgeem1 = ftmp;
@@ -841,9 +1276,190 @@ bool Decoder<OpType_>::beam_search() {
     _p_d_self_v_bgeem2 = _p_d_self_v_bgeem1;
     _p_d_self_v_bgeem1 = ftmp;
   }
+  if (_compact_batch) {
+    compact_batch();
+  }
   return false;
 }
 
+/**
+Move the batch items whose beams all reached eos behind the alive ones, so
+that the later steps only compute the alive items. Only alive_seq and
+seq_score of the finished items are kept, for the result.
+The buffers free between two steps are used as the gather destinations.
+*/
+template <OperationType OpType_>
+void Decoder<OpType_>::compact_batch() {
+  _h_batch_ids.clear();
+  for (int i = 0; i < _batch_size; i++) {
+    if (!_h_batch_finished[i]) _h_batch_ids.push_back(i);
+  }
+  int alive_batch_size = _h_batch_ids.size();
+  if (alive_batch_size == _batch_size) {
+    return;
+  }
+  for (int i = 0; i < _batch_size; i++) {
+    if (_h_batch_finished[i]) _h_batch_ids.push_back(i);
+  }
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_p_d_batch_ids, _h_batch_ids.data(),
+                                  sizeof(int) * _batch_size,
+                                  cudaMemcpyHostToDevice, _stream));
+
+  /* ---step 1. reorder alive_seq and seq_score of all the items--- */
+  ker_gather_batch_rows_launcher<int>(
+      _batch_size, _tw._beam_size * _tw._max_step, _stream, _p_d_alive_seq,
+      _p_d_alive_seq_buf, _p_d_batch_ids);
+  int* tmp = _p_d_alive_seq_buf;
+  _p_d_alive_seq_buf = _p_d_alive_seq;
+  _p_d_alive_seq = tmp;
+  if (_beam_history) {
+    // the finished items keep the parents and the length of their last step
+    ker_gather_batch_rows_launcher<int>(
+        _batch_size, _tw._beam_size * _tw._max_step, _stream,
+        _p_d_beam_parent, _p_d_alive_seq_buf, _p_d_batch_ids);
+    CHECK_GPU_ERROR(cudaMemcpyAsync(
+        _p_d_beam_parent, _p_d_alive_seq_buf,
+        sizeof(int) * _step_token_num * _tw._max_step,
+        cudaMemcpyDeviceToDevice, _stream));
+    ker_gather_batch_rows_launcher<int>(_batch_size, 1, _stream,
+                                        _p_d_history_len, _p_d_alive_seq_buf,
+                                        _p_d_batch_ids);
+    CHECK_GPU_ERROR(cudaMemcpyAsync(_p_d_history_len, _p_d_alive_seq_buf,
+                                    sizeof(int) * _batch_size,
+                                    cudaMemcpyDeviceToDevice, _stream));
+  }
+  float* score_buf = _p_d_can_score;
+  ker_gather_seq_score_launcher(_batch_size, _tw._beam_size, _stream,
+                                _p_d_alive_seq_score, score_buf,
+                                _p_d_batch_ids);
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_p_d_alive_seq_score, score_buf,
+                                  sizeof(float) * _step_token_num,
+                                  cudaMemcpyDeviceToDevice, _stream));
+
+  /* ---step 2. gather the rest of the alive items--- */
+  float* probs_buf = score_buf + _step_token_num;
+  ker_gather_batch_rows_launcher<float>(alive_batch_size, _tw._beam_size,
+                                        _stream, _p_d_alive_seq_probs,
+                                        probs_buf, _p_d_batch_ids);
+  CHECK_GPU_ERROR(cudaMemcpyAsync(
+      _p_d_alive_seq_probs, probs_buf,
+      sizeof(float) * alive_batch_size * _tw._beam_size,
+      cudaMemcpyDeviceToDevice, _stream));
+  int* mask_buf = reinterpret_cast<int*>(probs_buf + _step_token_num);
+  ker_gather_batch_rows_launcher<int>(alive_batch_size, _batch_seq_len,
+                                      _stream, _p_d_cur_padding_mask,
+                                      mask_buf, _p_d_batch_ids);
+  CHECK_GPU_ERROR(cudaMemcpyAsync(
+      _p_d_padding_mask_buf, mask_buf,
+      sizeof(int) * alive_batch_size * _batch_seq_len,
+      cudaMemcpyDeviceToDevice, _stream));
+  _p_d_cur_padding_mask = _p_d_padding_mask_buf;
+
+  ker_gather_self_kv_launcher<_DataType>(
+      _tw._n_dec_layer, alive_batch_size, _max_thread_per_block, _stream,
+      _p_d_batch_ids, _p_d_self_k_bgeem1[0], _p_d_self_v_bgeem1[0],
+      _p_d_self_k_bgeem2[0], _p_d_self_v_bgeem2[0], _layer_size_self_k,
+      _tw._beam_size, _tw._dim_per_head, _tw._head_num, _cur_step,
+      _tw._max_step);
+  _DataType** ftmp = _p_d_self_k_bgeem2;
+  _p_d_self_k_bgeem2 = _p_d_self_k_bgeem1;
+  _p_d_self_k_bgeem1 = ftmp;
+  ftmp = _p_d_self_v_bgeem2;
+  _p_d_self_v_bgeem2 = _p_d_self_v_bgeem1;
+  _p_d_self_v_bgeem1 = ftmp;
+
+  // the stale self attention cache is larger than the encdec one
+  int encdec_row_size = _batch_seq_len * _tw._hidden_size;
+  for (int i = 0; i < _tw._n_dec_layer; i++) {
+    ker_gather_batch_rows_launcher<_DataType>(
+        alive_batch_size, encdec_row_size, _stream, _p_d_encdec_k_bgeem[i],
+        _p_d_self_k_bgeem2[i], _p_d_batch_ids);
+    CHECK_GPU_ERROR(cudaMemcpyAsync(
+        _p_d_encdec_k_bgeem[i], _p_d_self_k_bgeem2[i],
+        sizeof(_DataType) * alive_batch_size * encdec_row_size,
+        cudaMemcpyDeviceToDevice, _stream));
+    ker_gather_batch_rows_launcher<_DataType>(
+        alive_batch_size, encdec_row_size, _stream, _p_d_encdec_v_bgeem[i],
+        _p_d_self_v_bgeem2[i], _p_d_batch_ids);
+    CHECK_GPU_ERROR(cudaMemcpyAsync(
+        _p_d_encdec_v_bgeem[i], _p_d_self_v_bgeem2[i],
+        sizeof(_DataType) * alive_batch_size * encdec_row_size,
+        cudaMemcpyDeviceToDevice, _stream));
+  }
+  if (_encdec_kv_int8) {
+    quantize_encdec_kv(alive_batch_size);
+  }
+
+  std::vector<int> batch_order(_h_batch_order);
+  for (int i = 0; i < _batch_size; i++) {
+    _h_batch_order[i] = batch_order[_h_batch_ids[i]];
+  }
+  _batch_size = alive_batch_size;
+  _step_token_num = alive_batch_size * _tw._beam_size;
+#ifdef DEBUG_RESULT
+  std::cout << "compact batch to " << _batch_size << " items" << std::endl;
+#endif
+}
+
+/**
+Quantize the encdec k, v of the batch for ker_encdec_attention_i8, after
+they are projected or gathered by compact_batch.
+*/
+template <OperationType OpType_>
+void Decoder<OpType_>::quantize_encdec_kv(int batch_size) {
+  ker_quantize_encdec_kv_launcher<_DataType>(
+      batch_size, _tw._n_dec_layer, _tw._head_num, _batch_seq_len,
+      _tw._dim_per_head, _stream, _p_d_encdec_k_bgeem[0],
+      _p_d_encdec_v_bgeem[0], _p_d_encdec_k_i8, _p_d_encdec_v_i8,
+      _p_d_encdec_k_scale, _p_d_encdec_v_scale, _layer_size_encdec_k);
+}
+
+/**
+Write the full token sequences of all the beams into alive_seq, from the
+tokens and the parent beams of ker_refresh_beam_history.
+*/
+template <OperationType OpType_>
+void Decoder<OpType_>::backtrace_beam_history() {
+  ker_backtrace_beam_seq<<<_input_batch_size, _tw._beam_size, 0, _stream>>>(
+      _p_d_alive_seq, _p_d_beam_parent, _p_d_history_len, _p_d_alive_seq_buf,
+      _tw._max_step, _end_id);
+  int* tmp = _p_d_alive_seq_buf;
+  _p_d_alive_seq_buf = _p_d_alive_seq;
+  _p_d_alive_seq = tmp;
+}
+
+/**
+Undo compact_batch on alive_seq and seq_score, to write the result in the
+input batch order.
+*/
+template <OperationType OpType_>
+void Decoder<OpType_>::restore_batch_order() {
+  if (_batch_size == _input_batch_size) {
+    return;
+  }
+  _batch_size = _input_batch_size;
+  _step_token_num = _batch_size * _tw._beam_size;
+  _h_batch_ids.resize(_batch_size);
+  for (int i = 0; i < _batch_size; i++) {
+    _h_batch_ids[_h_batch_order[i]] = i;
+  }
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_p_d_batch_ids, _h_batch_ids.data(),
+                                  sizeof(int) * _batch_size,
+                                  cudaMemcpyHostToDevice, _stream));
+  ker_gather_batch_rows_launcher<int>(
+      _batch_size, _tw._beam_size * _tw._max_step, _stream, _p_d_alive_seq,
+      _p_d_alive_seq_buf, _p_d_batch_ids);
+  int* tmp = _p_d_alive_seq_buf;
+  _p_d_alive_seq_buf = _p_d_alive_seq;
+  _p_d_alive_seq = tmp;
+  ker_gather_seq_score_launcher(_batch_size, _tw._beam_size, _stream,
+                                _p_d_alive_seq_score, _p_d_can_score,
+                                _p_d_batch_ids);
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_p_d_alive_seq_score, _p_d_can_score,
+                                  sizeof(float) * _step_token_num,
+                                  cudaMemcpyDeviceToDevice, _stream));
+}
+
 /**
 Logits bias and softmax.
 Select rough topk candidate for every batch item.
@@ -854,12 +1470,11 @@ void Decoder<OpType_>::update_new_seq_probs() {
   CHECK_GPU_ERROR(cudaMemsetAsync(_p_d_can_num, 0, sizeof(int), _stream));
 
   select_beam_rough_topk_launcher(
-      _p_d_logit_buf, _p_d_trg_emb_wei[6], _p_d_alive_seq_probs,
+      _p_d_logit_buf, _p_d_logit_bias, _p_d_alive_seq_probs,
       _p_d_alive_seq_score, _p_d_alive_seq, _p_d_can_idx, _p_d_can_score,
-      _p_d_can_num, _tw._trg_vocab_size, _tw._max_step,
-      _h_length_norm[_cur_step], _cur_step, _step_token_num,
-      _max_thread_per_block, _stream, _tw._beam_size, _tw._diverse_lambda,
-      _tw._end_id);
+      _p_d_can_num, _vocab_size, _tw._max_step, _h_length_norm[_cur_step],
+      _cur_step, _step_token_num, _max_thread_per_block, _stream,
+      _tw._beam_size, _tw._diverse_lambda, _end_id);
 
   thrust::exclusive_scan(thrust::cuda::par.on(_stream), _p_d_can_num + 1,
                          _p_d_can_num + 1 + _step_token_num, _p_d_can_num + 1);
@@ -868,6 +1483,7 @@ void Decoder<OpType_>::update_new_seq_probs() {
 
 template <OperationType OpType_>
 bool Decoder<OpType_>::topk_greedy_search() {
+  LS_NVTX_RANGE("Decoder::topk_greedy_search");
   _tw._diverse_lambda = 0;
   if (_cur_step == 0) {
     return beam_search();
@@ -878,9 +1494,10 @@ bool Decoder<OpType_>::topk_greedy_search() {
   /* --- Sample new tokens from logits --- */
   ker_topk_sample_launcher<_DataType>(
       _step_token_num, (_cur_step + 1), _tw._max_step, 1, _max_thread_per_block,
-      _stream, _p_d_logit_buf, _p_d_trg_emb_wei[6], _p_d_alive_seq,
-      _p_d_alive_seq_buf, _tw._trg_vocab_size, 1, _p_d_sample_unfinished,
-      _p_d_curandstate, _tw._end_id);
+      _stream, _p_d_logit_buf, _p_d_logit_bias, _p_d_alive_seq,
+      _p_d_alive_seq_buf, _vocab_size, 1, _p_d_sample_unfinished,
+      _p_d_curandstate, _end_id);
+  map_shortlist_tokens();
 
 #ifdef DEBUG_RESULT
   print_vec(_p_d_sample_unfinished, "unfinished flag", 1);
@@ -9,9 +9,13 @@
 #include <cublasLt.h>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cmath>
 #include <iostream>
+#include <mutex>
+#include <numeric>
+#include <set>
 #include <string>
 #include <unistd.h>
 
@@ -36,7 +40,6 @@ class Decoder {
   const cudaDataType_t _BType = _optraits::BType;
   const cudaDataType_t _CType = _optraits::CType;
   // private mem function
-  void project_encoder_output();
   bool run_step();
   void embedding();
   void decoder_stack();
@@ -44,9 +47,19 @@ class Decoder {
   void encdec_attention();
   void ffn_add_norm();
   bool sample();
+  bool fused_topk_sample();
   bool beam_search();
   void update_new_seq_probs();
   bool topk_greedy_search();
+  void compact_batch();
+  void quantize_encdec_kv(int batch_size);
+  void backtrace_beam_history();
+  void restore_batch_order();
+  // take the pending cancellations, return whether every item is cancelled
+  bool apply_cancellations();
+  void map_shortlist_tokens();
+  void map_shortlist_eos(int result_size);
+  void update_lang_vocab_mask(const std::vector<int>* vocab_ids);
 
   // constructor init var
   const int _max_batch_size;
@@ -59,6 +72,10 @@ class Decoder {
   cublasHandle_t _hd;
 
   const int* _p_d_padding_mask;
+  // padding mask of the alive batch items, _p_d_padding_mask until the batch
+  // is compacted
+  const int* _p_d_cur_padding_mask;
+  int* _p_d_padding_mask_buf;
   const _DataType* _p_d_encoder_output;
   int* _p_d_sample_unfinished;
   curandState* _p_d_curandstate;  //[batch_size]
@@ -71,6 +88,19 @@ class Decoder {
   int* _p_d_can_num;
   int* _p_d_alive_seq;
   int* _p_d_alive_seq_buf;
+  // beam search only appends the token and the parent beam of every step to
+  // alive_seq and beam_parent, the sequences are backtraced at the end.
+  // history_len is the last step of every batch item.
+  bool _beam_history;
+  int* _p_d_beam_parent;
+  int* _p_d_history_len;
+  // int8 copy of encdec k, v with a scale per head vector, read by the
+  // encdec attention instead of the gemms with LIGHTSEQ_ENCDEC_KV_INT8=1
+  bool _encdec_kv_int8;
+  int8_t* _p_d_encdec_k_i8;
+  int8_t* _p_d_encdec_v_i8;
+  float* _p_d_encdec_k_scale;
+  float* _p_d_encdec_v_scale;
   _DataType* _p_d_cur_step_query;
   // cur step's projected query-key-value in self atten, one pointer for one
   // decoder layer device memory in [batch_size, beam_size, 3, hidden_size]
@@ -102,6 +132,27 @@ class Decoder {
   _DataType* _p_d_encoder_out_buf;
   _DataType* _p_d_logit_buf;
 
+  // batch compaction of beam search: the finished batch items are moved
+  // behind the alive ones, which are the first _batch_size items of all the
+  // buffers. _h_batch_order is the input batch id of every item.
+  bool _compact_batch;
+  int _input_batch_size;
+  int* _p_d_batch_finished;
+  int* _p_d_batch_ids;
+  std::vector<int> _h_batch_finished;
+  std::vector<int> _h_batch_ids;
+  std::vector<int> _h_batch_order;
+  // the score margins of set_beam_pruning, <= 0 for none.
+  float _prune_abs_margin;
+  float _prune_rel_margin;
+
+  // the input batch items cancelled by cancel_item, taken before every step
+  std::mutex _cancel_mutex;
+  std::vector<int> _h_cancel_pending;
+  std::atomic<bool> _has_cancel_pending;
+  std::vector<char> _h_cancelled;
+  int _num_cancelled;
+
   int _batch_size;
   int _batch_seq_len;
   int _batch_token_num;
@@ -116,6 +167,21 @@ class Decoder {
   const std::vector<const _DataType*>&
       _p_d_dec_wei;  // size: 18 * dec_layer_num
 
+  // vocab size, eos id, logits projection kernel and logit bias of the
+  // decoding, those of the vocab shortlist if any, see set_vocab_shortlist
+  int _vocab_size;
+  int _end_id;
+  const _DataType* _p_d_logit_kernel;
+  const _DataType* _p_d_logit_bias;
+  int _shortlist_capacity;
+  // [2, shortlist_size] vocab id, and alive seq id, of every shortlist id
+  int* _p_d_shortlist_ids;
+  _DataType* _p_d_shortlist_kernel;  // [hidden_size, shortlist_size]
+  _DataType* _p_d_shortlist_bias;    // [shortlist_size]
+  // [lang_num, _vocab_size] vocab mask of every target language of a multi
+  // lingual model, nullptr without one
+  int8_t* _p_d_lang_vocab_mask;
+
   const _DataType _type_one;
   const _DataType _type_zero;
 
@@ -135,14 +201,51 @@ class Decoder {
           TransformerWeight<OpType_>& tw, cudaStream_t stream,
           cublasHandle_t hd, bool output_topk = false,
           const int* p_d_lang_id = nullptr);
+  ~Decoder();
   long compute_buffer_bytesize();
   void init_buffer(void* pbuf);
   std::string check();
-  void run_one_infer(int batch_size, int batch_seq_len);
+  // the encdec K/V of the encoder output, which run_one_infer does unless
+  // project_encoder = false, e.g. to reuse them, see EncdecKvCache
+  void project_encoder_output(int batch_size, int batch_seq_len);
+  void run_one_infer(int batch_size, int batch_seq_len,
+                     bool project_encoder = true);
+  // per layer [batch_size, head_num, batch_seq_len, dim_per_head]
+  const std::vector<_DataType*>& encdec_k() const {
+    return _p_d_encdec_k_bgeem;
+  }
+  const std::vector<_DataType*>& encdec_v() const {
+    return _p_d_encdec_v_bgeem;
+  }
   void benchmark_mode(bool is_benchmark);
+  // Cancel the input batch item of the running run_one_infer, from any
+  // thread: topk and topp sampling finish it at the next step as if it
+  // sampled eos, beam search drops it from the compacted batch. The decoding
+  // stops once every item is cancelled.
+  void cancel_item(int batch_idx);
+  // constrained decoding: the next runs only score the vocab ids of tokens,
+  // the whole vocab if tokens is empty
+  void set_vocab_shortlist(const std::vector<int>& tokens);
+  // distillation data: the next runs of topk or topp sampling also write the
+  // k <= 32 most likely tokens of every step and their log probs, fused into
+  // the pass over the logits before the sampling, see _p_d_step_topk_ids.
+  void output_step_topk(int k);
+  // beam pruning by score margin: every step of beam search, the candidates
+  // which trail the best one of their batch item by more than abs_margin, or
+  // by more than rel_margin * |best score|, finish as the eos of their beam
+  // with the lowest score, see ker_prune_beams_launcher. So a batch item
+  // with a confident best beam finishes early and leaves the compacted
+  // batch. A margin <= 0 is none, not with diverse beam search.
+  void set_beam_pruning(float abs_margin, float rel_margin);
   int _cur_step;
   float* _p_d_alive_seq_score;
   bool _output_topk;
+  // [batch_size, max_step, step_topk], the vocab ids and log probs of the
+  // top tokens of step t, which sampled the token t of the result, zeros
+  // past the last step
+  int _step_topk;
+  int* _p_d_step_topk_ids;
+  float* _p_d_step_topk_log_probs;
   int* _p_d_result;
   const int* _p_d_lang_id;
 };
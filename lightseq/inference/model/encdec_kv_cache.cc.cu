@@ -0,0 +1,157 @@
+#include "encdec_kv_cache.h"
+
+#include <cstdlib>
+
+namespace lightseq {
+namespace cuda {
+
+template <OperationType OpType_>
+EncdecKvCache<OpType_>::EncdecKvCache(int capacity, int max_step,
+                                      int hidden_size, int n_dec_layer,
+                                      cudaStream_t stream)
+    : _capacity(capacity),
+      _max_step(max_step),
+      _hidden_size(hidden_size),
+      _n_dec_layer(n_dec_layer),
+      _slot_size((size_t)2 * n_dec_layer * max_step * hidden_size),
+      _stream(stream),
+      _hits(0),
+      _misses(0) {
+  CHECK_GPU_ERROR(cudaMalloc(&_p_d_kv, sizeof(_DataType) * _slot_size *
+                                           (size_t)capacity));
+  CHECK_GPU_ERROR(cudaMalloc(&_p_d_mask,
+                             sizeof(int) * (size_t)max_step * capacity));
+  std::cout << "Allocated "
+            << (sizeof(_DataType) * _slot_size * capacity) / (1024 * 1024)
+            << "MB GPU buffer for " << capacity << " encdec kv cache entries"
+            << std::endl;
+}
+
+template <OperationType OpType_>
+EncdecKvCache<OpType_>::~EncdecKvCache() {
+  CHECK_GPU_ERROR(cudaFree(_p_d_kv));
+  CHECK_GPU_ERROR(cudaFree(_p_d_mask));
+}
+
+template <OperationType OpType_>
+int EncdecKvCache<OpType_>::capacity_from_env() {
+  const char* size_env = std::getenv("LIGHTSEQ_ENCDEC_CACHE_SIZE");
+  if (size_env == nullptr) return 0;
+  int capacity = std::atoi(size_env);
+  return capacity > 0 ? capacity : 0;
+}
+
+template <OperationType OpType_>
+uint64_t EncdecKvCache<OpType_>::hash_tokens(const int* tokens, int seq_len) {
+  // FNV-1a, the padded length is part of the key as it changes the layout
+  uint64_t hash = 14695981039346656037ull;
+  hash = (hash ^ (uint64_t)seq_len) * 1099511628211ull;
+  for (int i = 0; i < seq_len; i++) {
+    hash = (hash ^ (uint32_t)tokens[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+template <OperationType OpType_>
+typename std::list<typename EncdecKvCache<OpType_>::Entry>::iterator
+EncdecKvCache<OpType_>::find(const int* tokens, int seq_len) {
+  auto iter = _map.find(hash_tokens(tokens, seq_len));
+  if (iter == _map.end()) return _lru.end();
+  const std::vector<int>& cached = iter->second->tokens;
+  if (cached.size() != seq_len ||
+      !std::equal(cached.begin(), cached.end(), tokens)) {
+    return _lru.end();
+  }
+  return iter->second;
+}
+
+template <OperationType OpType_>
+bool EncdecKvCache<OpType_>::lookup(const int* h_tokens, int batch_size,
+                                    int batch_seq_len, int* p_d_padding_mask,
+                                    const std::vector<_DataType*>& encdec_k,
+                                    const std::vector<_DataType*>& encdec_v) {
+  _batch_entries.clear();
+  for (int i = 0; i < batch_size; i++) {
+    auto entry = find(h_tokens + i * batch_seq_len, batch_seq_len);
+    if (entry == _lru.end()) {
+      _misses += batch_size;
+      return false;
+    }
+    _batch_entries.push_back(entry);
+  }
+
+  size_t row_size = (size_t)batch_seq_len * _hidden_size;
+  for (int i = 0; i < batch_size; i++) {
+    auto entry = _batch_entries[i];
+    int slot = entry->slot;
+    CHECK_GPU_ERROR(cudaMemcpyAsync(
+        p_d_padding_mask + i * batch_seq_len, _p_d_mask + slot * _max_step,
+        sizeof(int) * batch_seq_len, cudaMemcpyDeviceToDevice, _stream));
+    const _DataType* slot_kv = _p_d_kv + slot * _slot_size;
+    for (int l = 0; l < _n_dec_layer; l++) {
+      CHECK_GPU_ERROR(cudaMemcpyAsync(
+          encdec_k[l] + i * row_size, slot_kv + (2 * l) * row_size,
+          sizeof(_DataType) * row_size, cudaMemcpyDeviceToDevice, _stream));
+      CHECK_GPU_ERROR(cudaMemcpyAsync(
+          encdec_v[l] + i * row_size, slot_kv + (2 * l + 1) * row_size,
+          sizeof(_DataType) * row_size, cudaMemcpyDeviceToDevice, _stream));
+    }
+    _lru.splice(_lru.begin(), _lru, entry);
+  }
+  _hits += batch_size;
+  return true;
+}
+
+template <OperationType OpType_>
+void EncdecKvCache<OpType_>::insert(const int* h_tokens, int batch_size,
+                                    int batch_seq_len,
+                                    const int* p_d_padding_mask,
+                                    const std::vector<_DataType*>& encdec_k,
+                                    const std::vector<_DataType*>& encdec_v) {
+  size_t row_size = (size_t)batch_seq_len * _hidden_size;
+  for (int i = 0; i < batch_size; i++) {
+    const int* tokens = h_tokens + i * batch_seq_len;
+    auto entry = find(tokens, batch_seq_len);
+    if (entry != _lru.end()) {
+      // a duplicate sentence of the batch
+      _lru.splice(_lru.begin(), _lru, entry);
+      continue;
+    }
+    uint64_t key = hash_tokens(tokens, batch_seq_len);
+    auto collided = _map.find(key);
+    int slot;
+    if (collided != _map.end()) {
+      slot = collided->second->slot;
+      _lru.erase(collided->second);
+      _map.erase(collided);
+    } else if (_lru.size() < _capacity) {
+      slot = _lru.size();
+    } else {
+      slot = _lru.back().slot;
+      _map.erase(_lru.back().key);
+      _lru.pop_back();
+    }
+    _lru.push_front(
+        Entry{key, std::vector<int>(tokens, tokens + batch_seq_len), slot});
+    _map[key] = _lru.begin();
+
+    CHECK_GPU_ERROR(cudaMemcpyAsync(
+        _p_d_mask + slot * _max_step, p_d_padding_mask + i * batch_seq_len,
+        sizeof(int) * batch_seq_len, cudaMemcpyDeviceToDevice, _stream));
+    _DataType* slot_kv = _p_d_kv + slot * _slot_size;
+    for (int l = 0; l < _n_dec_layer; l++) {
+      CHECK_GPU_ERROR(cudaMemcpyAsync(
+          slot_kv + (2 * l) * row_size, encdec_k[l] + i * row_size,
+          sizeof(_DataType) * row_size, cudaMemcpyDeviceToDevice, _stream));
+      CHECK_GPU_ERROR(cudaMemcpyAsync(
+          slot_kv + (2 * l + 1) * row_size, encdec_v[l] + i * row_size,
+          sizeof(_DataType) * row_size, cudaMemcpyDeviceToDevice, _stream));
+    }
+  }
+}
+
+template class EncdecKvCache<OperationType::FP16>;
+template class EncdecKvCache<OperationType::FP32>;
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "../tools/util.h"
+
+/**
+@file
+LRU cache of the encoder-decoder attention inputs of source sentences
+*/
+namespace lightseq {
+namespace cuda {
+
+/**
+An entry keeps what the decoder reads of the encoder for one source
+sentence padded to batch_seq_len: its padding mask and the projected encdec
+K/V of all the decoder layers. A batch whose sentences all hit is copied
+from the cache and skips both the encoder and the projection, otherwise
+the whole batch runs and its sentences are inserted after it.
+
+The entries are preallocated for max_step tokens. hits() and misses() count
+sentences, a sentence of a batch that misses is a miss.
+*/
+template <OperationType OpType_>
+class EncdecKvCache {
+ private:
+  typedef OperationTypeTraits<OpType_> _optraits;
+  typedef typename _optraits::DataType _DataType;
+
+  struct Entry {
+    uint64_t key;
+    std::vector<int> tokens;
+    int slot;
+  };
+
+  const int _capacity;
+  const int _max_step;
+  const int _hidden_size;
+  const int _n_dec_layer;
+  const size_t _slot_size;  // in _DataType
+  cudaStream_t _stream;
+  _DataType* _p_d_kv;
+  int* _p_d_mask;
+
+  std::list<Entry> _lru;  // most recently used first
+  std::unordered_map<uint64_t, typename std::list<Entry>::iterator> _map;
+  std::vector<typename std::list<Entry>::iterator> _batch_entries;
+  long _hits;
+  long _misses;
+
+  static uint64_t hash_tokens(const int* tokens, int seq_len);
+  // the entry of one sentence, _lru.end() if missing
+  typename std::list<Entry>::iterator find(const int* tokens, int seq_len);
+
+ public:
+  EncdecKvCache(int capacity, int max_step, int hidden_size, int n_dec_layer,
+                cudaStream_t stream);
+  ~EncdecKvCache();
+
+  // Capacity in entries from LIGHTSEQ_ENCDEC_CACHE_SIZE, 0 if not set.
+  static int capacity_from_env();
+
+  // h_tokens: [batch_size, batch_seq_len] on host
+  // encdec_k, encdec_v: the per layer buffers of the decoder,
+  // [batch_size, head_num, batch_seq_len, dim_per_head]
+  bool lookup(const int* h_tokens, int batch_size, int batch_seq_len,
+              int* p_d_padding_mask, const std::vector<_DataType*>& encdec_k,
+              const std::vector<_DataType*>& encdec_v);
+  void insert(const int* h_tokens, int batch_size, int batch_seq_len,
+              const int* p_d_padding_mask,
+              const std::vector<_DataType*>& encdec_k,
+              const std::vector<_DataType*>& encdec_v);
+
+  long hits() const { return _hits; }
+  long misses() const { return _misses; }
+};
+
+}  // namespace cuda
+}  // namespace lightseq
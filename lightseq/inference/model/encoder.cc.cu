@@ -102,6 +102,7 @@ Encoder inference
 */
 template <OperationType OpType_>
 void Encoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
+  LS_NVTX_RANGE("Encoder::run_one_infer");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -166,6 +167,7 @@ Encoder self attention
 */
 template <OperationType OpType_>
 void Encoder<OpType_>::self_attention() {
+  LS_NVTX_RANGE("Encoder::self_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _batch_token_num, _tw._hidden_size, _stream, _p_d_output, _p_d_q,
@@ -227,6 +229,7 @@ void Encoder<OpType_>::self_attention() {
 
 template <OperationType OpType_>
 void Encoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("Encoder::ffn_add_norm");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _batch_token_num, _tw._hidden_size, _stream, _p_d_output, _p_d_ffn_buf1,
@@ -140,6 +140,44 @@ std::string GptEncoder<OpType_>::check() {
 
 template <OperationType OpType_>
 void GptEncoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
+  LS_NVTX_RANGE("GptEncoder::run_one_infer");
+  run_encoder(batch_size, batch_seq_len);
+  compute_ppl();
+}
+
+/**
+Score the packed rows of a right padded batch: the final hidden states of
+  the row_src tokens are gathered out of the padding, projected to the vocab
+  and log softmaxed at their target token, so the vocab projection, the
+  largest gemm of scoring, skips the padding
+*/
+template <OperationType OpType_>
+void GptEncoder<OpType_>::run_packed_ppl(int batch_size, int batch_seq_len,
+                                         int rows, const int *p_d_row_src,
+                                         const int *p_d_target_id,
+                                         float *p_d_log_prob) {
+  run_encoder(batch_size, batch_seq_len);
+  if (rows == 0) {
+    return;
+  }
+
+  // the caches are not used by scoring, reuse them for the packed rows
+  _DataType *p_d_packed = _p_d_k_cache;
+  ker_gather_rows_launcher<_DataType>(rows, _tw._hidden_size,
+                                      _max_thread_per_block, _stream,
+                                      _p_d_query, p_d_row_src, p_d_packed);
+  CHECK_GPU_ERROR(cublasGemmEx(
+      _hd, CUBLAS_OP_T, CUBLAS_OP_N, _tw._src_vocab_size, rows,
+      _tw._hidden_size, &_fone, _p_d_src_emb_wei[0], _AType, _tw._hidden_size,
+      p_d_packed, _BType, _tw._hidden_size, &_fzero, _p_d_logit, _CType,
+      _tw._src_vocab_size, _computeType, CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+  ker_target_log_prob_launcher<_DataType>(
+      rows, _max_thread_per_block, _stream, _p_d_logit, p_d_target_id,
+      p_d_log_prob, _tw._src_vocab_size);
+}
+
+template <OperationType OpType_>
+void GptEncoder<OpType_>::run_encoder(int batch_size, int batch_seq_len) {
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -184,10 +222,6 @@ void GptEncoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
   ker_norm_layer_launcher<_DataType>(
       _batch_token_num, _tw._hidden_size, _stream, _p_d_query,
       _p_d_src_emb_wei[2], _p_d_src_emb_wei[3], _max_thread_per_block);
-
-  compute_ppl();
-
-  return;
 }
 
 template <OperationType OpType_>
@@ -197,6 +231,7 @@ void GptEncoder<OpType_>::benchmark_mode(bool is_benchmark) {
 
 template <OperationType OpType_>
 int GptEncoder<OpType_>::run_one_sample(int batch_size, int batch_seq_len) {
+  LS_NVTX_RANGE("GptEncoder::run_one_sample");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -248,7 +283,10 @@ int GptEncoder<OpType_>::run_one_sample(int batch_size, int batch_seq_len) {
   ker_norm_layer_launcher<_DataType>(
       _batch_token_num, _tw._hidden_size, _stream, _p_d_query,
       _p_d_src_emb_wei[2], _p_d_src_emb_wei[3], _max_thread_per_block);
-  if (sample_one_token() == 0 || _batch_seq_len >= _batch_max_seq_len) {
+  int prompt_len = _batch_seq_len;
+  int unfinished = sample_one_token();
+  stream_tokens(prompt_len);
+  if (unfinished == 0 || _batch_seq_len >= _batch_max_seq_len) {
     CHECK_GPU_ERROR(cudaMemcpyAsync(_p_d_sample_id_buf, _p_d_sample_id,
                                     _batch_token_num * sizeof(int),
                                     cudaMemcpyDeviceToDevice, _stream));
@@ -290,6 +328,7 @@ int GptEncoder<OpType_>::run_one_sample(int batch_size, int batch_seq_len) {
 #else
 
     bool unfinish = sample_one_token_with_cache();
+    stream_tokens(prompt_len);
     if (!unfinish && !_is_benchmark) break;
 #endif
   }
@@ -304,6 +343,7 @@ int GptEncoder<OpType_>::run_one_sample(int batch_size, int batch_seq_len) {
 
 template <OperationType OpType_>
 int GptEncoder<OpType_>::sample_one_token() {
+  LS_NVTX_RANGE("GptEncoder::sample_one_token");
   /* ---step 1. project hidden states to vocab logits--- */
   CHECK_GPU_ERROR(cublasGemmEx(
       _hd, CUBLAS_OP_T, CUBLAS_OP_N, _tw._src_vocab_size, _batch_token_num,
@@ -349,6 +389,10 @@ int GptEncoder<OpType_>::sample_one_token() {
 
 template <OperationType OpType_>
 int GptEncoder<OpType_>::sample_one_token_with_cache() {
+  LS_NVTX_RANGE("GptEncoder::sample_one_token_with_cache");
+  if (_tw._sampling_method == "topk" && _batch_size <= kLogitsTopkMaxTokens) {
+    return fused_topk_sample_with_cache();
+  }
   /* ---step 1. project hidden states to vocab logits--- */
   CHECK_GPU_ERROR(cublasGemmEx(
       _hd, CUBLAS_OP_T, CUBLAS_OP_N, _tw._src_vocab_size, _batch_size,
@@ -395,8 +439,58 @@ int GptEncoder<OpType_>::sample_one_token_with_cache() {
   return _h_unfinished;
 }
 
+/**
+sample_one_token_with_cache of top k for a few tokens, the vocab projection is
+fused into the top k, so that the logits are never written to _p_d_logit,
+which keeps the workspace and the candidates instead.
+*/
+template <OperationType OpType_>
+int GptEncoder<OpType_>::fused_topk_sample_with_cache() {
+  size_t workspace_bytes = logits_topk_workspace_bytes(
+      _batch_size, _tw._src_vocab_size, _tw._topk);
+  float *topk_val = (float *)((char *)_p_d_logit + workspace_bytes);
+  int *topk_idx = (int *)(topk_val + _batch_size * _tw._topk);
+  ker_logits_topk_launcher<_DataType>(
+      _p_d_query, _p_d_src_emb_wei[0], nullptr, _p_d_logit, topk_val,
+      topk_idx, _batch_size, _tw._hidden_size, _tw._src_vocab_size,
+      _tw._topk, 1.f, true, _stream);
+
+  CHECK_GPU_ERROR(cudaMemsetAsync(_p_d_unfinished, 0, sizeof(int), _stream));
+  ker_gpt_topk_sample_candidates_launcher(
+      _batch_size, _batch_seq_len, _stream, topk_val, topk_idx, _tw._topk,
+      _p_d_sample_id, _p_d_sample_id_buf, _p_d_unfinished, _p_d_curandstate,
+      _tw._eos_id);
+  int *temp = _p_d_sample_id;
+  _p_d_sample_id = _p_d_sample_id_buf;
+  _p_d_sample_id_buf = temp;
+  CHECK_GPU_ERROR(cudaMemcpyAsync(&_h_unfinished, _p_d_unfinished, sizeof(int),
+                                  cudaMemcpyDeviceToHost, _stream));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
+  _p_d_last_sample_id = _p_d_sample_id_buf + _batch_token_num;
+  _batch_seq_len++;
+  _batch_token_num += _batch_size;
+  return _h_unfinished;
+}
+
+/**
+Give the tokens of the last sampled step, which the sampling kernels also
+keep in _p_d_last_sample_id, to _token_callback. The sampling synchronizes
+the stream at every step anyway, so the copy is synchronous.
+*/
+template <OperationType OpType_>
+void GptEncoder<OpType_>::stream_tokens(int prompt_len) {
+  if (!_token_callback) return;
+  std::vector<int> tokens(_batch_size);
+  CHECK_GPU_ERROR(cudaMemcpyAsync(tokens.data(), _p_d_last_sample_id,
+                                  _batch_size * sizeof(int),
+                                  cudaMemcpyDeviceToHost, _stream));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
+  _token_callback(_batch_seq_len - prompt_len - 1, tokens);
+}
+
 template <OperationType OpType_>
 void GptEncoder<OpType_>::self_attention(bool cache) {
+  LS_NVTX_RANGE("GptEncoder::self_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _batch_token_num, _tw._hidden_size, _stream, _p_d_query, _p_d_q,
@@ -452,14 +546,18 @@ void GptEncoder<OpType_>::self_attention(bool cache) {
     } else {
       stream = _stream;
     }
-    CHECK_GPU_ERROR(
-        cudaMemcpyAsync(_p_d_k_cache + _layer_id * _max_batch_dim, _p_d_k,
-                        _batch_token_num * _tw._hidden_size * sizeof(_DataType),
-                        cudaMemcpyDeviceToDevice, stream));
-    CHECK_GPU_ERROR(
-        cudaMemcpyAsync(_p_d_v_cache + _layer_id * _max_batch_dim, _p_d_v,
-                        _batch_token_num * _tw._hidden_size * sizeof(_DataType),
-                        cudaMemcpyDeviceToDevice, stream));
+    // the caches of [batch_size, head_num, _batch_max_seq_len, dim_per_head]
+    // hold the whole generation, the steps append to them, see
+    // ker_arrange_qkv_with_cache.
+    size_t width = _batch_seq_len * _tw._dim_per_head * sizeof(_DataType);
+    size_t pitch = _batch_max_seq_len * _tw._dim_per_head * sizeof(_DataType);
+    int rows = _batch_size * _tw._head_num;
+    CHECK_GPU_ERROR(cudaMemcpy2DAsync(
+        _p_d_k_cache + _layer_id * _max_batch_dim, pitch, _p_d_k, width, width,
+        rows, cudaMemcpyDeviceToDevice, stream));
+    CHECK_GPU_ERROR(cudaMemcpy2DAsync(
+        _p_d_v_cache + _layer_id * _max_batch_dim, pitch, _p_d_v, width, width,
+        rows, cudaMemcpyDeviceToDevice, stream));
   }
 
 #ifdef DEBUG_RESULT
@@ -552,6 +650,7 @@ void GptEncoder<OpType_>::self_attention(bool cache) {
 
 template <OperationType OpType_>
 void GptEncoder<OpType_>::self_attention_with_cache() {
+  LS_NVTX_RANGE("GptEncoder::self_attention_with_cache");
   _DataType *_p_d_k_cache_cur_layer = _p_d_k_cache + _layer_id * _max_batch_dim;
   _DataType *_p_d_v_cache_cur_layer = _p_d_v_cache + _layer_id * _max_batch_dim;
 
@@ -597,37 +696,18 @@ void GptEncoder<OpType_>::self_attention_with_cache() {
               _batch_size * _tw._hidden_size * 3);
   }
 #endif
-  // get q, k, v by split and reshape qkv
+  // get q by split and reshape qkv, append the new k and v to the caches
   ker_arrange_qkv_with_cache_launcher<_DataType>(
-      _batch_token_num, _tw._hidden_size, _stream, _p_d_qkv_projected,
-      _p_d_enc_wei[_weight_offset + 3], _p_d_q, _p_d_k, _p_d_k_cache_cur_layer,
-      _p_d_v, _p_d_v_cache_cur_layer, _max_batch_dim, _batch_seq_len,
+      _batch_size, _tw._hidden_size, _stream, _p_d_qkv_projected,
+      _p_d_enc_wei[_weight_offset + 3], _p_d_q, _p_d_k_cache_cur_layer,
+      _p_d_v_cache_cur_layer, _batch_max_seq_len, _batch_seq_len - 1,
       _tw._dim_per_head, _tw._head_num);
-
-  // copy new k and v to cache
-  cudaStream_t stream;
-  if (_batch_token_num > 360) {
-    stream = _cache_stream;
-    CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
-  } else {
-    stream = _stream;
-  }
-  CHECK_GPU_ERROR(
-      cudaMemcpyAsync(_p_d_k_cache_cur_layer, _p_d_k,
-                      _batch_token_num * _tw._hidden_size * sizeof(_DataType),
-                      cudaMemcpyDeviceToDevice, stream));
-  CHECK_GPU_ERROR(
-      cudaMemcpyAsync(_p_d_v_cache_cur_layer, _p_d_v,
-                      _batch_token_num * _tw._hidden_size * sizeof(_DataType),
-                      cudaMemcpyDeviceToDevice, stream));
+  // the attention reads the first _batch_seq_len tokens of the caches.
+  int cache_stride = _batch_max_seq_len * _tw._dim_per_head;
 #ifdef DEBUG_RESULT
   if (_layer_id == 0) {
     print_vec(_p_d_q, "_p_d_q", _batch_size * _tw._hidden_size - 5,
               _batch_size * _tw._hidden_size);
-    print_vec(_p_d_k, "_p_d_k", _batch_token_num * _tw._hidden_size - 5,
-              _batch_token_num * _tw._hidden_size);
-    print_vec(_p_d_v, "_p_d_v", _batch_token_num * _tw._hidden_size - 5,
-              _batch_token_num * _tw._hidden_size);
   }
 #endif
 
@@ -635,8 +715,8 @@ void GptEncoder<OpType_>::self_attention_with_cache() {
   correlation: [batch_size, heads_num, 1, batch_seq_len]--- */
   CHECK_GPU_ERROR(cublasGemmStridedBatchedEx(
       _hd, CUBLAS_OP_T, CUBLAS_OP_N, _batch_seq_len, 1, _tw._dim_per_head,
-      &_atten_scaler, _p_d_k, _AType, _tw._dim_per_head,
-      _batch_seq_len * _tw._dim_per_head, _p_d_q, _BType, _tw._dim_per_head,
+      &_atten_scaler, _p_d_k_cache_cur_layer, _AType, _tw._dim_per_head,
+      cache_stride, _p_d_q, _BType, _tw._dim_per_head,
       _tw._dim_per_head, &_fzero, _p_d_c, _CType, _batch_seq_len,
       _batch_seq_len, _batch_size * _tw._head_num, _computeType,
       CUBLAS_GEMM_DEFAULT_TENSOR_OP));
@@ -662,8 +742,8 @@ void GptEncoder<OpType_>::self_attention_with_cache() {
   /* ---step 3. new_q = correlation * v--- */
   CHECK_GPU_ERROR(cublasGemmStridedBatchedEx(
       _hd, CUBLAS_OP_N, CUBLAS_OP_N, _tw._dim_per_head, 1, _batch_seq_len,
-      &_fone, _p_d_v, _AType, _tw._dim_per_head,
-      _batch_seq_len * _tw._dim_per_head, _p_d_c, _BType, _batch_seq_len,
+      &_fone, _p_d_v_cache_cur_layer, _AType, _tw._dim_per_head,
+      cache_stride, _p_d_c, _BType, _batch_seq_len,
       _batch_seq_len, &_fzero, _p_d_q, _CType, _tw._dim_per_head,
       _tw._dim_per_head, _batch_size * _tw._head_num, _computeType,
       CUBLAS_GEMM_DEFAULT_TENSOR_OP));
@@ -706,6 +786,7 @@ void GptEncoder<OpType_>::self_attention_with_cache() {
 
 template <OperationType OpType_>
 void GptEncoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("GptEncoder::ffn_add_norm");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _batch_token_num, _tw._hidden_size, _stream, _p_d_query, _p_d_ffn_buf1,
@@ -735,6 +816,7 @@ void GptEncoder<OpType_>::ffn_add_norm() {
 
 template <OperationType OpType_>
 void GptEncoder<OpType_>::ffn_add_norm_with_cache() {
+  LS_NVTX_RANGE("GptEncoder::ffn_add_norm_with_cache");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _batch_size, _tw._hidden_size, _stream, _p_d_query, _p_d_ffn_buf1,
@@ -10,6 +10,7 @@
 #include <algorithm>
 #include <chrono>
 #include <cmath>
+#include <functional>
 #include <iostream>
 #include <string>
 
@@ -33,9 +34,13 @@ class GptEncoder {
   void self_attention(bool cache = false);
   void self_attention_with_cache();
   void ffn_add_norm();
+  // embedding, layers and last layer norm of the prompt, into _p_d_query
+  void run_encoder(int batch_size, int batch_seq_len);
   void ffn_add_norm_with_cache();
   int sample_one_token();
   int sample_one_token_with_cache();
+  int fused_topk_sample_with_cache();
+  void stream_tokens(int prompt_len);
 
   const int _max_batch_size;
 
@@ -94,6 +99,8 @@ class GptEncoder {
   const int *_p_d_token_id;  // input token id, [batch_size, batch_seq_len]
   float *_p_d_ppl;           // ppl for every seq, [batch_size]
   int *_p_d_sample_id;
+  // see LSModel::set_token_callback
+  std::function<void(int, const std::vector<int> &)> _token_callback;
 
   GptEncoder(int max_batch_size, const int *p_d_token_id, float *p_d_ppl,
              int *p_d_sample_id, const GptWeight<OpType_> &tw,
@@ -102,6 +109,10 @@ class GptEncoder {
   void init_buffer(void *pbuf);
   std::string check();
   void run_one_infer(int batch_size, int batch_seq_len);
+  // log prob of target_id for the row_src tokens of the batch, [rows]
+  void run_packed_ppl(int batch_size, int batch_seq_len, int rows,
+                      const int *p_d_row_src, const int *p_d_target_id,
+                      float *p_d_log_prob);
   int run_one_sample(int batch_size, int batch_seq_len);
   void compute_ppl();
   void benchmark_mode(bool is_benchmark);
@@ -48,7 +48,11 @@ MoeDecoder<OpType_>::MoeDecoder(int max_batch_size, const int* p_d_padding_mask,
       _h_unfinished(1),
       _gate_weight_offset(0),
       _p_d_dec_gate_wei(tw.get_dec_gate_wei()),
-      _max_step_token_num(max_batch_size * tw._beam_size) {
+      _max_step_token_num(max_batch_size * tw._beam_size),
+      _capacity(0),
+      _max_expert_rows(0),
+      _ep(nullptr),
+      _ep_decode_steps(0) {
   for (int i = 0; i < _h_alive_seq_probs.size(); i += tw._beam_size) {
     _h_alive_seq_probs[i] = 0.f;
   }
@@ -80,8 +84,20 @@ long MoeDecoder<OpType_>::compute_buffer_bytesize() {
           (_tw._hidden_size + _tw._inner_size + 1);
   decode_buffer_bytesize *= sizeof(_DataType);
   decode_buffer_bytesize +=
-      (_max_step_token_num * _tw._expert_num_decoder * sizeof(float) +
+      (_tw._moe_topk_decoder * _max_step_token_num * sizeof(float) +
        _tw._moe_topk_decoder * _max_step_token_num * sizeof(int));
+  // slots of routed tokens, rows of every expert, grouped gemm tiles and the
+  // workspace of the router
+  decode_buffer_bytesize +=
+      (_tw._moe_topk_decoder * _max_step_token_num +
+       _tw._expert_num_decoder * 3 + 1 +
+       moe_route_workspace_size(_max_step_token_num, _tw._expert_num_decoder)) *
+      sizeof(int);
+  if (_ep) {
+    // received tokens
+    decode_buffer_bytesize += _max_step_token_num * _tw._expert_num_decoder *
+                              _tw._hidden_size * sizeof(_DataType);
+  }
 
   long sf = _max_batch_size * _tw._beam_size * _tw._trg_vocab_size * 2 +
             _max_batch_size * _tw._beam_size * 2;
@@ -168,10 +184,26 @@ void MoeDecoder<OpType_>::init_buffer(void* pbuf) {
   curp += _tw._expert_num_decoder * _max_step_token_num * _tw._hidden_size;
   _p_d_moe_inner_buf = curp;  // moe ffns buffer
   curp += _tw._expert_num_decoder * _max_step_token_num * _tw._inner_size;
+  // tokens received from every rank, only with expert parallelism
+  _p_d_moe_recv_buf = curp;
+  if (_ep) {
+    curp += _tw._expert_num_decoder * _max_step_token_num * _tw._hidden_size;
+  }
   _p_d_score_routed = reinterpret_cast<float*>(curp);  // expert routing score
   // ids of routed experts in moe
   _p_d_expert_id_routed = reinterpret_cast<int*>(
-      _p_d_score_routed + _max_step_token_num * _tw._expert_num_decoder);
+      _p_d_score_routed + _tw._moe_topk_decoder * _max_step_token_num);
+  // slots of routed tokens in their experts
+  _p_d_slot_routed =
+      _p_d_expert_id_routed + _tw._moe_topk_decoder * _max_step_token_num;
+  // used slots of every expert, sent and received
+  _p_d_expert_rows =
+      _p_d_slot_routed + _tw._moe_topk_decoder * _max_step_token_num;
+  _p_d_recv_rows = _p_d_expert_rows + _tw._expert_num_decoder;
+  // row tiles of the grouped gemm of the experts
+  _p_d_tile_offset = _p_d_recv_rows + _tw._expert_num_decoder;
+  // tile states of the router
+  _p_d_route_workspace = _p_d_tile_offset + _tw._expert_num_decoder + 1;
 
   // for beam search
   curp = reuse_p;
@@ -277,6 +309,9 @@ std::string MoeDecoder<OpType_>::check() {
   if (_tw._expert_num_decoder > 1024) {
     return "number of moe expert should not be greater than 1024";
   }
+  if (_ep && _tw._gate_type == 1) {
+    return "hard gate does not support expert parallelism";
+  }
   return "";
 }
 
@@ -285,6 +320,7 @@ Decoder inference
 */
 template <OperationType OpType_>
 void MoeDecoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
+  LS_NVTX_RANGE("MoeDecoder::run_one_infer");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -306,6 +342,19 @@ void MoeDecoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
     _batch_max_decode_length = _tw._max_step;
   }
 
+  _capacity = _step_token_num;
+  _max_expert_rows = _tw._moe_topk_decoder * _step_token_num;
+  if (_ep) {
+    // the capacity and the number of steps must be the same on every rank
+    int agreed[2] = {_step_token_num, _batch_max_decode_length};
+    _ep->max_over_ranks(agreed, 2, _stream);
+    _capacity = min(_ep->capacity(agreed[0], _tw._moe_topk_decoder,
+                                  _tw._expert_num_decoder),
+                    _max_step_token_num);
+    _max_expert_rows = _tw._moe_topk_decoder * agreed[0] * _ep->size();
+    _ep_decode_steps = agreed[1] - 1;
+  }
+
   project_encoder_output();  // project encoder output
   // init the first step's token id with target start_id
   CHECK_GPU_ERROR(cudaMemcpyAsync(_p_d_alive_seq_probs,
@@ -314,12 +363,17 @@ void MoeDecoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
                                   cudaMemcpyHostToDevice, _stream));
 
   /* ---step2. autoregressive decoding--- */
-  for (_cur_step = 0; _cur_step < _batch_max_decode_length - 1; _cur_step++) {
+  if (_ep) {
+    decode_expert_parallel();
+  } else {
+    for (_cur_step = 0; _cur_step < _batch_max_decode_length - 1;
+         _cur_step++) {
 #ifdef DEBUG_RESULT
-    std::cout << "*** run step " << _cur_step << " ***" << std::endl;
+      std::cout << "*** run step " << _cur_step << " ***" << std::endl;
 #endif
-    if (run_step()) {  // one step
-      break;
+      if (run_step()) {  // one step
+        break;
+      }
     }
   }
 
@@ -353,11 +407,58 @@ void MoeDecoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
   return;
 }
 
+/**
+Autoregressive decoding with expert parallelism. Every rank takes part in
+  the all-to-all of every MoE layer of every step, so a rank which has
+  finished keeps serving its experts to the others until all are finished.
+*/
+template <OperationType OpType_>
+void MoeDecoder<OpType_>::decode_expert_parallel() {
+  int local_steps = _batch_max_decode_length - 1;
+  int finish_step = local_steps;
+  bool finished = local_steps <= 0;
+  for (int step = 0; step < _ep_decode_steps; step++) {
+    if (finished) {
+      idle_step();
+    } else {
+      _cur_step = step;
+#ifdef DEBUG_RESULT
+      std::cout << "*** run step " << _cur_step << " ***" << std::endl;
+#endif
+      if (run_step()) {  // one step
+        finish_step = step;
+        finished = true;
+      } else if (step == local_steps - 1) {
+        finished = true;
+      }
+    }
+    if (_ep->all_finished(finished, _stream)) break;
+  }
+  _cur_step = finish_step;
+}
+
+/**
+A decoding step of a rank which has finished, only its experts are run
+*/
+template <OperationType OpType_>
+void MoeDecoder<OpType_>::idle_step() {
+  for (_layer_id = 0; _layer_id < _tw._n_dec_layer; _layer_id++) {
+    if (_tw._is_moe_layer_decoder[_layer_id]) {
+      _weight_offset = _layer_id * _tw._weight_per_dec_layer;
+      // no token of this rank goes to any expert
+      CHECK_GPU_ERROR(cudaMemsetAsync(
+          _p_d_expert_rows, 0, _tw._expert_num_decoder * sizeof(int), _stream));
+      run_experts();
+    }
+  }
+}
+
 /**
 Project encoder output
 */
 template <OperationType OpType_>
 void MoeDecoder<OpType_>::project_encoder_output() {
+  LS_NVTX_RANGE("MoeDecoder::project_encoder_output");
   int kv_dim = _tw._hidden_size * 2 * _tw._n_dec_layer;
 #ifdef DEBUG_RESULT
   CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
@@ -394,6 +495,7 @@ Decode one step
 */
 template <OperationType OpType_>
 bool MoeDecoder<OpType_>::run_step() {
+  LS_NVTX_RANGE("MoeDecoder::run_step");
   embedding();
   decoder_stack();
   /* --- Project hidden states to vocab logits--- */
@@ -435,6 +537,7 @@ Decode embedding
 */
 template <OperationType OpType_>
 void MoeDecoder<OpType_>::embedding() {
+  LS_NVTX_RANGE("MoeDecoder::embedding");
   // _p_d_trg_emb_wei: {token_emb, position_emb, norm_scale, norm_bias,
   // enc_out_kernel_kv, enc_out_bias_kv, logit_bias}
   launch_dec_emb<_DataType>(_p_d_trg_emb_wei[0], _p_d_trg_emb_wei[1],
@@ -490,6 +593,7 @@ Decoder self attention
 */
 template <OperationType OpType_>
 void MoeDecoder<OpType_>::self_attention() {
+  LS_NVTX_RANGE("MoeDecoder::self_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _step_token_num, _tw._hidden_size, _stream, _p_d_cur_step_query,
@@ -602,6 +706,7 @@ Encode-Decoder attention
 */
 template <OperationType OpType_>
 void MoeDecoder<OpType_>::encdec_attention() {
+  LS_NVTX_RANGE("MoeDecoder::encdec_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _step_token_num, _tw._hidden_size, _stream, _p_d_cur_step_query,
@@ -667,6 +772,7 @@ void MoeDecoder<OpType_>::encdec_attention() {
 
 template <OperationType OpType_>
 void MoeDecoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("MoeDecoder::ffn_add_norm");
   if (_tw._is_moe_layer_decoder[_layer_id]) {
     if (_tw._gate_type == 1) {
       moe_fw_hard_gate();
@@ -683,6 +789,7 @@ void MoeDecoder<OpType_>::ffn_add_norm() {
 
 template <OperationType OpType_>
 void MoeDecoder<OpType_>::ffn() {
+  LS_NVTX_RANGE("MoeDecoder::ffn");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _step_token_num, _tw._hidden_size, _stream, _p_d_cur_step_query,
@@ -880,6 +987,12 @@ void MoeDecoder<OpType_>::moe_fw_hard_gate() {
   }
 }
 
+/**
+Soft gate MoE: the routed tokens are packed into [expert_num, capacity,
+  hidden_size] slots and every expert runs only on its used slots with one
+  grouped gemm per ffn layer. With expert parallelism the slots are
+  exchanged with the ranks owning the experts, see moe_expert_parallel.h
+*/
 template <OperationType OpType_>
 void MoeDecoder<OpType_>::moe_fw() {
   ker_norm_layer_prepost_launcher<_DataType>(
@@ -895,55 +1008,68 @@ void MoeDecoder<OpType_>::moe_fw() {
       _tw._hidden_size, &_type_zero, _p_d_gate, _CType, _tw._expert_num_decoder,
       _computeType, CUBLAS_GEMM_DEFAULT_TENSOR_OP));
 
-  ker_softmax_topk_router_launcher<_DataType>(
+  // _p_d_moe_input_buf: [expert_num, capacity, hidden_size]
+  ker_route_dispatch_tokens_launcher<_DataType>(
       _step_token_num, _tw._expert_num_decoder, _max_step_token_num,
-      _tw._moe_topk_decoder, _stream, _p_d_gate, _p_d_score_routed,
-      _p_d_expert_id_routed);
+      _capacity, _tw._moe_topk_decoder, _tw._hidden_size, _stream, _p_d_gate,
+      _p_d_query_buf1, _p_d_score_routed, _p_d_expert_id_routed,
+      _p_d_slot_routed, _p_d_expert_rows, _p_d_route_workspace,
+      _p_d_moe_input_buf);
 
-  ker_reorder_tokens_launcher<_DataType>(
-      _step_token_num, _tw._expert_num_decoder, _max_step_token_num,
-      _tw._hidden_size, _max_thread_per_block, _stream, _p_d_query_buf1,
-      _p_d_score_routed, _p_d_moe_input_buf);
+  run_experts();
 
-  CHECK_GPU_ERROR(cublasGemmStridedBatchedEx(
-      _hd, CUBLAS_OP_N, CUBLAS_OP_N, _tw._inner_size, _step_token_num,
-      _tw._hidden_size, &_type_one, _p_d_dec_wei[_weight_offset + 14], _AType,
-      _tw._inner_size, _tw._hidden_size * _tw._inner_size, _p_d_moe_input_buf,
-      _BType, _tw._hidden_size, _tw._hidden_size * _max_step_token_num,
-      &_type_zero, _p_d_moe_inner_buf, _CType, _tw._inner_size,
-      _tw._inner_size * _max_step_token_num, _tw._expert_num_decoder,
-      _computeType, CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+  ker_bias_combine_residual_launcher<_DataType>(
+      _tw._hidden_size, _max_step_token_num, _capacity, _tw._moe_topk_decoder,
+      _step_token_num, _max_thread_per_block, _stream, _p_d_moe_input_buf,
+      _p_d_dec_wei[_weight_offset + 17], _p_d_score_routed,
+      _p_d_expert_id_routed, _p_d_slot_routed, _p_d_cur_step_query);
+}
 
-  if (_tw._use_gelu) {
-    ker_strided_bias_gelu_launcher<_DataType>(
-        _step_token_num, _tw._expert_num_decoder, _max_step_token_num,
-        _tw._inner_size, _max_thread_per_block, _stream, _p_d_moe_inner_buf,
-        _p_d_dec_wei[_weight_offset + 15]);
-  } else {
-    ker_strided_bias_relu_launcher<_DataType>(
-        _step_token_num, _tw._expert_num_decoder, _max_step_token_num,
-        _tw._inner_size, _max_thread_per_block, _stream, _p_d_moe_inner_buf,
-        _p_d_dec_wei[_weight_offset + 15]);
+/**
+Run the experts on the dispatched tokens in _p_d_moe_input_buf and write
+  the results back in place. With expert parallelism the tokens are sent to
+  the ranks of their experts first and gathered back after.
+*/
+template <OperationType OpType_>
+void MoeDecoder<OpType_>::run_experts() {
+  int ep_size = _ep ? _ep->size() : 1;
+  int local_expert_num = _tw._expert_num_decoder / ep_size;
+  _DataType* recv_buf = _p_d_moe_input_buf;
+  int* recv_rows = _p_d_expert_rows;
+  long chunk_size = (long)local_expert_num * _capacity * _tw._hidden_size;
+  if (ep_size > 1) {
+    // recv_buf: [ep_size, local_expert_num, capacity, hidden_size]
+    recv_buf = _p_d_moe_recv_buf;
+    recv_rows = _p_d_recv_rows;
+    _ep->all_to_all(_p_d_expert_rows, recv_rows,
+                    local_expert_num * sizeof(int), _stream);
+    _ep->all_to_all(_p_d_moe_input_buf, recv_buf,
+                    chunk_size * sizeof(_DataType), _stream);
   }
 
-  CHECK_GPU_ERROR(cublasGemmStridedBatchedEx(
-      _hd, CUBLAS_OP_N, CUBLAS_OP_N, _tw._hidden_size, _step_token_num,
-      _tw._inner_size, &_type_one, _p_d_dec_wei[_weight_offset + 16], _AType,
-      _tw._hidden_size, _tw._hidden_size * _tw._inner_size, _p_d_moe_inner_buf,
-      _BType, _tw._inner_size, _tw._inner_size * _max_step_token_num,
-      &_type_zero, _p_d_moe_input_buf, _CType, _tw._hidden_size,
-      _tw._hidden_size * _max_step_token_num, _tw._expert_num_decoder,
-      _computeType, CUBLAS_GEMM_DEFAULT_TENSOR_OP));
-
-  ker_bias_redirect_residual_launcher<_DataType>(
-      _tw._hidden_size, _max_step_token_num, _tw._moe_topk_decoder,
-      _step_token_num, _max_thread_per_block, _stream, _p_d_moe_input_buf,
-      _p_d_dec_wei[_weight_offset + 17], _p_d_score_routed,
-      _p_d_expert_id_routed, _p_d_cur_step_query);
+  ker_grouped_gemm_bias_act_launcher<_DataType>(
+      _tw._expert_num_decoder, local_expert_num, _capacity, _max_expert_rows,
+      _tw._hidden_size, _tw._inner_size, recv_rows, _p_d_tile_offset,
+      recv_buf, _p_d_dec_wei[_weight_offset + 14],
+      _p_d_dec_wei[_weight_offset + 15], _p_d_moe_inner_buf,
+      _tw._use_gelu ? MoeActivation::kGelu : MoeActivation::kRelu, _stream);
+
+  // the second bias is added with the routing score in the combine
+  ker_grouped_gemm_bias_act_launcher<_DataType>(
+      _tw._expert_num_decoder, local_expert_num, _capacity, _max_expert_rows,
+      _tw._inner_size, _tw._hidden_size, recv_rows, _p_d_tile_offset,
+      _p_d_moe_inner_buf, _p_d_dec_wei[_weight_offset + 16], nullptr,
+      recv_buf, MoeActivation::kNone, _stream);
+
+  if (ep_size > 1) {
+    _ep->all_to_all(recv_buf, _p_d_moe_input_buf,
+                    chunk_size * sizeof(_DataType), _stream);
+  }
 }
 
 template <OperationType OpType_>
 bool MoeDecoder<OpType_>::sample() {
+  LS_NVTX_RANGE("MoeDecoder::sample");
   CHECK_GPU_ERROR(
       cudaMemsetAsync(_p_d_sample_unfinished, 0, sizeof(int), _stream));
   /* --- Sample new tokens from logits --- */
@@ -978,6 +1104,7 @@ bool MoeDecoder<OpType_>::sample() {
 
 template <OperationType OpType_>
 bool MoeDecoder<OpType_>::beam_search() {
+  LS_NVTX_RANGE("MoeDecoder::beam_search");
   /*
     step 1. logits bias and softmax,
       select rough topk candidate for every batch item,
@@ -1096,6 +1223,7 @@ void MoeDecoder<OpType_>::update_new_seq_probs() {
 
 template <OperationType OpType_>
 bool MoeDecoder<OpType_>::topk_greedy_search() {
+  LS_NVTX_RANGE("MoeDecoder::topk_greedy_search");
   _tw._diverse_lambda = 0;
   if (_cur_step == 0) {
     return beam_search();
@@ -16,6 +16,7 @@
 
 #include "../proto/moe_weight.h"
 #include "../tools/util.h"
+#include "moe_expert_parallel.h"
 
 /**
 @file
@@ -37,6 +38,8 @@ class MoeDecoder {
   // private mem function
   void project_encoder_output();
   bool run_step();
+  void decode_expert_parallel();
+  void idle_step();
   void embedding();
   void decoder_stack();
   void self_attention();
@@ -45,6 +48,7 @@ class MoeDecoder {
   void ffn();
   void moe_fw_hard_gate();
   void moe_fw();
+  void run_experts();
   bool sample();
   bool beam_search();
   void update_new_seq_probs();
@@ -76,6 +80,18 @@ class MoeDecoder {
   int* _p_d_alive_seq;
   int* _p_d_alive_seq_buf;
   int* _p_d_expert_id_routed;
+  int _capacity;         // slots of every expert
+  int _max_expert_rows;  // bound of the used slots of all experts
+  int* _p_d_slot_routed;
+  int* _p_d_expert_rows;
+  int* _p_d_tile_offset;
+  int* _p_d_route_workspace;
+
+  // expert parallelism, see moe_expert_parallel.h
+  MoeExpertParallel* _ep;
+  int _ep_decode_steps;
+  _DataType* _p_d_moe_recv_buf;
+  int* _p_d_recv_rows;
 
   int* _p_d_hard_gates;
   int* _h_hard_gates;
@@ -146,6 +162,8 @@ class MoeDecoder {
              const _DataType* p_d_encoder_output, int* p_d_result,
              MoeWeight<OpType_>& tw, cudaStream_t stream, cublasHandle_t hd,
              bool output_topk = false, const int* p_d_lang_id = nullptr);
+  // must be called before compute_buffer_bytesize
+  void set_expert_parallel(MoeExpertParallel* ep) { _ep = ep; }
   long compute_buffer_bytesize();
   void set_hard_gates_ptr(int* hard_gates, std::set<int>* gate_sets,
                           int* p_d_hard_gates);
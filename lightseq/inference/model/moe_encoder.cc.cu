@@ -35,7 +35,10 @@ MoeEncoder<OpType_>::MoeEncoder(int max_batch_size, int *p_d_token_id,
       _max_token_num(max_batch_size * tw._max_step),
       _max_thread_per_block(1024),
       _gate_weight_offset(0),
-      _p_d_enc_gate_wei(tw.get_enc_gate_wei()) {}
+      _p_d_enc_gate_wei(tw.get_enc_gate_wei()),
+      _capacity(0),
+      _max_expert_rows(0),
+      _ep(nullptr) {}
 
 /**
 Compute GPU memory size needed by moe_encoder,
@@ -49,8 +52,18 @@ long MoeEncoder<OpType_>::compute_buffer_bytesize() {
   long sz3 = _max_token_num * _tw._expert_num_encoder *
                  (_max_batch_dim + _max_token_num * _tw._inner_size + 1) *
                  sizeof(_DataType) +
-             _max_token_num * _tw._expert_num_encoder * sizeof(float) +
+             _tw._moe_topk_encoder * _max_token_num * sizeof(float) +
              _tw._moe_topk_encoder * _max_token_num * sizeof(int);
+  // slots of routed tokens, rows of every expert, grouped gemm tiles and the
+  // workspace of the router
+  sz3 += (_tw._moe_topk_encoder * _max_token_num +
+          _tw._expert_num_encoder * 3 + 1 +
+          moe_route_workspace_size(_max_token_num, _tw._expert_num_encoder)) *
+         sizeof(int);
+  if (_ep) {
+    // received tokens
+    sz3 += _max_batch_dim * _tw._expert_num_encoder * sizeof(_DataType);
+  }
 
   return max(sz1 * sizeof(_DataType), sz2 * sizeof(_DataType) + sz3);
 }
@@ -75,11 +88,22 @@ void MoeEncoder<OpType_>::init_buffer(void *pbuf) {
   _p_d_score_routed = reinterpret_cast<float *>(
       _p_d_gate + _max_token_num * _tw._expert_num_encoder);
   _p_d_expert_id_routed = reinterpret_cast<int *>(
-      _p_d_score_routed + _max_token_num * _tw._expert_num_encoder);
+      _p_d_score_routed + _tw._moe_topk_encoder * _max_token_num);
   _p_d_moe_input_buf = reinterpret_cast<_DataType *>(
       _p_d_expert_id_routed + _tw._moe_topk_encoder * _max_token_num);
   _p_d_moe_inner_buf =
       _p_d_moe_input_buf + _tw._expert_num_encoder * _max_batch_dim;
+  _p_d_moe_recv_buf =
+      _p_d_moe_inner_buf +
+      _tw._expert_num_encoder * _max_token_num * _tw._inner_size;
+  // the received tokens only take memory with expert parallelism
+  _p_d_slot_routed = reinterpret_cast<int *>(
+      _p_d_moe_recv_buf +
+      (_ep ? _tw._expert_num_encoder * _max_batch_dim : 0));
+  _p_d_expert_rows = _p_d_slot_routed + _tw._moe_topk_encoder * _max_token_num;
+  _p_d_recv_rows = _p_d_expert_rows + _tw._expert_num_encoder;
+  _p_d_tile_offset = _p_d_recv_rows + _tw._expert_num_encoder;
+  _p_d_route_workspace = _p_d_tile_offset + _tw._expert_num_encoder + 1;
   // encoder and decoder use the same buffer to save gpu memory useage
 
   return;
@@ -117,6 +141,9 @@ std::string MoeEncoder<OpType_>::check() {
   if (_tw._expert_num_encoder > 1024) {
     return "number of moe expert should not be greater than 1024";
   }
+  if (_ep && _tw._gate_type == 1) {
+    return "hard gate does not support expert parallelism";
+  }
   return "";
 }
 
@@ -125,6 +152,7 @@ Encoder inference
 */
 template <OperationType OpType_>
 void MoeEncoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
+  LS_NVTX_RANGE("MoeEncoder::run_one_infer");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -137,6 +165,17 @@ void MoeEncoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
   _batch_seq_len = batch_seq_len;
   _batch_token_num = batch_size * batch_seq_len;
   _gate_weight_offset = 0;
+  _capacity = _batch_token_num;
+  _max_expert_rows = _tw._moe_topk_encoder * _batch_token_num;
+  if (_ep) {
+    // the capacity must be the same on every rank
+    int token_num = _batch_token_num;
+    _ep->max_over_ranks(&token_num, 1, _stream);
+    _capacity = min(_ep->capacity(token_num, _tw._moe_topk_encoder,
+                                  _tw._expert_num_encoder),
+                    _max_token_num);
+    _max_expert_rows = _tw._moe_topk_encoder * token_num * _ep->size();
+  }
 #ifdef DEBUG_RESULT
   std::cout << "batch_size-" << batch_size << " batch_seq_len-" << batch_seq_len
             << std::endl;
@@ -189,6 +228,7 @@ Encoder self attention
 */
 template <OperationType OpType_>
 void MoeEncoder<OpType_>::self_attention() {
+  LS_NVTX_RANGE("MoeEncoder::self_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _batch_token_num, _tw._hidden_size, _stream, _p_d_output, _p_d_q,
@@ -249,6 +289,7 @@ void MoeEncoder<OpType_>::self_attention() {
 
 template <OperationType OpType_>
 void MoeEncoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("MoeEncoder::ffn_add_norm");
   if (_tw._is_moe_layer_encoder[_layer_id]) {
     if (_tw._gate_type == 1) {
       // hard gate
@@ -266,6 +307,7 @@ void MoeEncoder<OpType_>::ffn_add_norm() {
 
 template <OperationType OpType_>
 void MoeEncoder<OpType_>::ffn() {
+  LS_NVTX_RANGE("MoeEncoder::ffn");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _batch_token_num, _tw._hidden_size, _stream, _p_d_output, _p_d_ffn_buf1,
@@ -445,6 +487,12 @@ void MoeEncoder<OpType_>::moe_fw_hard_gate() {
   }
 }
 
+/**
+Soft gate MoE: the routed tokens are packed into [expert_num, capacity,
+  hidden_size] slots and every expert runs only on its used slots with one
+  grouped gemm per ffn layer. With expert parallelism the slots are
+  exchanged with the ranks owning the experts, see moe_expert_parallel.h
+*/
 template <OperationType OpType_>
 void MoeEncoder<OpType_>::moe_fw() {
   ker_norm_layer_prepost_launcher<_DataType>(
@@ -459,51 +507,63 @@ void MoeEncoder<OpType_>::moe_fw() {
       _p_d_gate, _CType, _tw._expert_num_encoder, _computeType,
       CUBLAS_GEMM_DEFAULT_TENSOR_OP));
 
-  ker_softmax_topk_router_launcher<_DataType>(
-      _batch_token_num, _tw._expert_num_encoder, _max_token_num,
-      _tw._moe_topk_encoder, _stream, _p_d_gate, _p_d_score_routed,
-      _p_d_expert_id_routed);
+  // _p_d_moe_input_buf: [expert_num, capacity, hidden_size]
+  ker_route_dispatch_tokens_launcher<_DataType>(
+      _batch_token_num, _tw._expert_num_encoder, _max_token_num, _capacity,
+      _tw._moe_topk_encoder, _tw._hidden_size, _stream, _p_d_gate,
+      _p_d_ffn_buf1, _p_d_score_routed, _p_d_expert_id_routed,
+      _p_d_slot_routed, _p_d_expert_rows, _p_d_route_workspace,
+      _p_d_moe_input_buf);
 
-  ker_reorder_tokens_launcher<_DataType>(
-      _batch_token_num, _tw._expert_num_encoder, _max_token_num,
-      _tw._hidden_size, _max_thread_per_block, _stream, _p_d_ffn_buf1,
-      _p_d_score_routed, _p_d_moe_input_buf);
+  run_experts();
 
-  CHECK_GPU_ERROR(cublasGemmStridedBatchedEx(
-      _hd, CUBLAS_OP_N, CUBLAS_OP_N, _tw._inner_size, _batch_token_num,
-      _tw._hidden_size, &_fone, _p_d_enc_wei[_weight_offset + 8], _AType,
-      _tw._inner_size, _tw._hidden_size * _tw._inner_size, _p_d_moe_input_buf,
-      _BType, _tw._hidden_size, _tw._hidden_size * _max_token_num, &_fzero,
-      _p_d_moe_inner_buf, _CType, _tw._inner_size,
-      _tw._inner_size * _max_token_num, _tw._expert_num_encoder, _computeType,
-      CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+  ker_bias_combine_residual_launcher<_DataType>(
+      _tw._hidden_size, _max_token_num, _capacity, _tw._moe_topk_encoder,
+      _batch_token_num, _max_thread_per_block, _stream, _p_d_moe_input_buf,
+      _p_d_enc_wei[_weight_offset + 11], _p_d_score_routed,
+      _p_d_expert_id_routed, _p_d_slot_routed, _p_d_output);
+}
 
-  if (_tw._use_gelu) {
-    ker_strided_bias_gelu_launcher<_DataType>(
-        _batch_token_num, _tw._expert_num_encoder, _max_token_num,
-        _tw._inner_size, _max_thread_per_block, _stream, _p_d_moe_inner_buf,
-        _p_d_enc_wei[_weight_offset + 9]);
-  } else {
-    ker_strided_bias_relu_launcher<_DataType>(
-        _batch_token_num, _tw._expert_num_encoder, _max_token_num,
-        _tw._inner_size, _max_thread_per_block, _stream, _p_d_moe_inner_buf,
-        _p_d_enc_wei[_weight_offset + 9]);
+/**
+Run the experts on the dispatched tokens in _p_d_moe_input_buf and write
+  the results back in place. With expert parallelism the tokens are sent to
+  the ranks of their experts first and gathered back after.
+*/
+template <OperationType OpType_>
+void MoeEncoder<OpType_>::run_experts() {
+  int ep_size = _ep ? _ep->size() : 1;
+  int local_expert_num = _tw._expert_num_encoder / ep_size;
+  _DataType *recv_buf = _p_d_moe_input_buf;
+  int *recv_rows = _p_d_expert_rows;
+  long chunk_size = (long)local_expert_num * _capacity * _tw._hidden_size;
+  if (ep_size > 1) {
+    // recv_buf: [ep_size, local_expert_num, capacity, hidden_size]
+    recv_buf = _p_d_moe_recv_buf;
+    recv_rows = _p_d_recv_rows;
+    _ep->all_to_all(_p_d_expert_rows, recv_rows,
+                    local_expert_num * sizeof(int), _stream);
+    _ep->all_to_all(_p_d_moe_input_buf, recv_buf,
+                    chunk_size * sizeof(_DataType), _stream);
   }
 
-  CHECK_GPU_ERROR(cublasGemmStridedBatchedEx(
-      _hd, CUBLAS_OP_N, CUBLAS_OP_N, _tw._hidden_size, _batch_token_num,
-      _tw._inner_size, &_fone, _p_d_enc_wei[_weight_offset + 10], _AType,
-      _tw._hidden_size, _tw._hidden_size * _tw._inner_size, _p_d_moe_inner_buf,
-      _BType, _tw._inner_size, _tw._inner_size * _max_token_num, &_fzero,
-      _p_d_moe_input_buf, _CType, _tw._hidden_size,
-      _tw._hidden_size * _max_token_num, _tw._expert_num_encoder, _computeType,
-      CUBLAS_GEMM_DEFAULT_TENSOR_OP));
-
-  ker_bias_redirect_residual_launcher<_DataType>(
-      _tw._hidden_size, _max_token_num, _tw._moe_topk_encoder, _batch_token_num,
-      _max_thread_per_block, _stream, _p_d_moe_input_buf,
-      _p_d_enc_wei[_weight_offset + 11], _p_d_score_routed,
-      _p_d_expert_id_routed, _p_d_output);
+  ker_grouped_gemm_bias_act_launcher<_DataType>(
+      _tw._expert_num_encoder, local_expert_num, _capacity, _max_expert_rows,
+      _tw._hidden_size, _tw._inner_size, recv_rows, _p_d_tile_offset,
+      recv_buf, _p_d_enc_wei[_weight_offset + 8],
+      _p_d_enc_wei[_weight_offset + 9], _p_d_moe_inner_buf,
+      _tw._use_gelu ? MoeActivation::kGelu : MoeActivation::kRelu, _stream);
+
+  // the second bias is added with the routing score in the combine
+  ker_grouped_gemm_bias_act_launcher<_DataType>(
+      _tw._expert_num_encoder, local_expert_num, _capacity, _max_expert_rows,
+      _tw._inner_size, _tw._hidden_size, recv_rows, _p_d_tile_offset,
+      _p_d_moe_inner_buf, _p_d_enc_wei[_weight_offset + 10], nullptr,
+      recv_buf, MoeActivation::kNone, _stream);
+
+  if (ep_size > 1) {
+    _ep->all_to_all(recv_buf, _p_d_moe_input_buf,
+                    chunk_size * sizeof(_DataType), _stream);
+  }
 }
 
 template class MoeEncoder<OperationType::FP16>;
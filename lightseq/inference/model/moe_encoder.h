@@ -14,6 +14,7 @@
 
 #include "../proto/moe_weight.h"
 #include "../tools/util.h"
+#include "moe_expert_parallel.h"
 
 namespace lightseq {
 namespace cuda {
@@ -34,6 +35,7 @@ class MoeEncoder {
   void ffn();
   void moe_fw_hard_gate();
   void moe_fw();
+  void run_experts();
 
   const int _max_batch_size;
   int *_p_d_padding_mask;  // true sequence length(remove padding), [batch_size]
@@ -61,6 +63,17 @@ class MoeEncoder {
   _DataType *_p_d_moe_inner_buf;
   float *_p_d_score_routed;
   int *_p_d_expert_id_routed;
+  int _capacity;         // slots of every expert
+  int _max_expert_rows;  // bound of the used slots of all experts
+  int *_p_d_slot_routed;
+  int *_p_d_expert_rows;
+  int *_p_d_tile_offset;
+  int *_p_d_route_workspace;
+
+  // expert parallelism, see moe_expert_parallel.h
+  MoeExpertParallel *_ep;
+  _DataType *_p_d_moe_recv_buf;
+  int *_p_d_recv_rows;
 
   int *_h_hard_gates;
   int *_p_d_hard_gates;
@@ -88,6 +101,8 @@ class MoeEncoder {
              _DataType *p_d_output, const MoeWeight<OpType_> &tw,
              cudaStream_t stream, cublasHandle_t hd,
              const int *p_d_lang_id = nullptr);
+  // must be called before compute_buffer_bytesize
+  void set_expert_parallel(MoeExpertParallel *ep) { _ep = ep; }
   long compute_buffer_bytesize();
   void set_hard_gates_ptr(int *hard_gates, std::set<int> *gate_sets,
                           int *p_d_hard_gates);
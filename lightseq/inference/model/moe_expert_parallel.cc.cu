@@ -0,0 +1,128 @@
+#include "moe_expert_parallel.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+
+namespace lightseq {
+namespace cuda {
+
+MoeExpertParallel::MoeExpertParallel(int rank, int size,
+                                     float capacity_factor,
+                                     const std::string& nccl_id_path)
+    : _rank(rank),
+      _size(size),
+      _capacity_factor(capacity_factor),
+      _p_d_reduce_buf(nullptr) {
+  if (size < 1 || rank < 0 || rank >= size) {
+    throw std::runtime_error("expert parallel rank " + std::to_string(rank) +
+                             " is out of [0, " + std::to_string(size) + ")");
+  }
+  if (size == 1) return;
+#ifdef LIGHTSEQ_nccl
+  ncclUniqueId nccl_id;
+  if (rank == 0) {
+    CHECK_GPU_ERROR(ncclGetUniqueId(&nccl_id));
+    // written to a temporary file first, the rename makes it appear whole.
+    std::string tmp_path = nccl_id_path + ".tmp";
+    std::ofstream fout(tmp_path, std::ios::binary);
+    fout.write((const char*)&nccl_id, sizeof(nccl_id));
+    fout.close();
+    if (!fout || std::rename(tmp_path.c_str(), nccl_id_path.c_str()) != 0) {
+      throw std::runtime_error("can not write nccl id file " + nccl_id_path);
+    }
+  } else {
+    while (true) {
+      std::ifstream fin(nccl_id_path, std::ios::binary);
+      if (fin.read((char*)&nccl_id, sizeof(nccl_id))) break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  }
+  CHECK_GPU_ERROR(ncclCommInitRank(&_comm, size, nccl_id, rank));
+  // read by all the ranks, a later launch must not find it.
+  if (rank == 0) std::remove(nccl_id_path.c_str());
+  CHECK_GPU_ERROR(cudaMalloc(&_p_d_reduce_buf, kMaxReduceNum * sizeof(int)));
+  std::cout << "*** expert parallel rank " << rank << " of " << size << " ***"
+            << std::endl;
+#else
+  throw std::runtime_error(
+      "expert parallelism needs lightseq built with USE_NCCL");
+#endif
+}
+
+MoeExpertParallel::~MoeExpertParallel() {
+  if (_size == 1) return;
+#ifdef LIGHTSEQ_nccl
+  ncclCommDestroy(_comm);
+  cudaFree(_p_d_reduce_buf);
+#endif
+}
+
+int MoeExpertParallel::capacity(int token_num, int topk,
+                                int expert_num) const {
+  if (_capacity_factor <= 0.f) return token_num;
+  int cap = (int)ceil(_capacity_factor * token_num * topk / expert_num);
+  // an expert never gets a token twice.
+  return max(min(cap, token_num), 1);
+}
+
+#ifdef LIGHTSEQ_nccl
+void MoeExpertParallel::all_reduce_host(int* vals, int num, ncclRedOp_t op,
+                                        cudaStream_t stream) {
+  if (num > kMaxReduceNum) {
+    throw std::runtime_error("too many values to reduce over ranks");
+  }
+  CHECK_GPU_ERROR(cudaMemcpyAsync(_p_d_reduce_buf, vals, num * sizeof(int),
+                                  cudaMemcpyHostToDevice, stream));
+  CHECK_GPU_ERROR(ncclAllReduce(_p_d_reduce_buf, _p_d_reduce_buf, num,
+                                ncclInt32, op, _comm, stream));
+  CHECK_GPU_ERROR(cudaMemcpyAsync(vals, _p_d_reduce_buf, num * sizeof(int),
+                                  cudaMemcpyDeviceToHost, stream));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(stream));
+}
+#endif
+
+void MoeExpertParallel::max_over_ranks(int* vals, int num,
+                                       cudaStream_t stream) {
+  if (_size == 1) return;
+#ifdef LIGHTSEQ_nccl
+  all_reduce_host(vals, num, ncclMax, stream);
+#endif
+}
+
+bool MoeExpertParallel::all_finished(bool finished, cudaStream_t stream) {
+  if (_size == 1) return finished;
+  int val = finished ? 1 : 0;
+#ifdef LIGHTSEQ_nccl
+  all_reduce_host(&val, 1, ncclMin, stream);
+#endif
+  return val == 1;
+}
+
+void MoeExpertParallel::all_to_all(const void* send_buf, void* recv_buf,
+                                   size_t chunk_bytes, cudaStream_t stream) {
+  if (_size == 1) {
+    if (send_buf != recv_buf) {
+      CHECK_GPU_ERROR(cudaMemcpyAsync(recv_buf, send_buf, chunk_bytes,
+                                      cudaMemcpyDeviceToDevice, stream));
+    }
+    return;
+  }
+#ifdef LIGHTSEQ_nccl
+  const char* psend = static_cast<const char*>(send_buf);
+  char* precv = static_cast<char*>(recv_buf);
+  CHECK_GPU_ERROR(ncclGroupStart());
+  for (int peer = 0; peer < _size; peer++) {
+    CHECK_GPU_ERROR(ncclSend(psend + peer * chunk_bytes, chunk_bytes, ncclChar,
+                             peer, _comm, stream));
+    CHECK_GPU_ERROR(ncclRecv(precv + peer * chunk_bytes, chunk_bytes, ncclChar,
+                             peer, _comm, stream));
+  }
+  CHECK_GPU_ERROR(ncclGroupEnd());
+#endif
+}
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include <string>
+
+#include "../tools/util.h"
+
+/**
+@file
+Expert parallelism of the MoE model.
+
+The experts of every MoE layer are sharded across the ranks of one group,
+  rank r owns experts [r * expert_num / ep_size, (r + 1) * expert_num /
+  ep_size). Every rank runs the whole model on its own batch, only the
+  expert ffns are distributed: the routed tokens are packed into
+  [expert_num, capacity, hidden_size] slots, sent to the owners of the
+  experts with an all-to-all together with the used slots of every expert,
+  computed by one grouped gemm over the used slots and sent back with a
+  second all-to-all.
+
+Capacity is the number of slots of every expert, the same on every rank,
+  tokens beyond the capacity of their expert skip it. With
+  capacity_factor > 0 the capacity is
+  ceil(capacity_factor * token_num * topk / expert_num), otherwise it is
+  token_num and no token is ever dropped. A hot expert runs on at most
+  capacity slots, so it never makes the step much longer.
+
+Every rank must call Moe::Infer the same number of times.
+*/
+namespace lightseq {
+namespace cuda {
+
+class MoeExpertParallel {
+ private:
+  static const int kMaxReduceNum = 4;
+
+  int _rank;
+  int _size;
+  float _capacity_factor;
+  int* _p_d_reduce_buf;
+#ifdef LIGHTSEQ_nccl
+  ncclComm_t _comm;
+
+  void all_reduce_host(int* vals, int num, ncclRedOp_t op,
+                       cudaStream_t stream);
+#endif
+
+ public:
+  // Rank 0 publishes the nccl unique id in the file nccl_id_path, which
+  // must be unique to the launch, the other ranks wait for it, and removes
+  // it once the communicator is up.
+  MoeExpertParallel(int rank, int size, float capacity_factor,
+                    const std::string& nccl_id_path);
+  ~MoeExpertParallel();
+
+  int rank() const { return _rank; }
+  int size() const { return _size; }
+
+  // slots of every expert in a MoE layer where every rank routes at most
+  // token_num tokens to topk of expert_num experts.
+  int capacity(int token_num, int topk, int expert_num) const;
+
+  // replace every one of the num values by its max over the ranks.
+  void max_over_ranks(int* vals, int num, cudaStream_t stream);
+
+  // whether every rank is finished, synchronizes the stream.
+  bool all_finished(bool finished, cudaStream_t stream);
+
+  // send the i-th of size chunks of send_buf to rank i and receive the
+  // chunk of rank i into the i-th chunk of recv_buf, chunk_bytes each.
+  void all_to_all(const void* send_buf, void* recv_buf, size_t chunk_bytes,
+                  cudaStream_t stream);
+};
+
+}  // namespace cuda
+}  // namespace lightseq
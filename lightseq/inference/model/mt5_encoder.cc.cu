@@ -106,6 +106,7 @@ Encoder inference
 */
 template <OperationType OpType_>
 void MT5Encoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
+  LS_NVTX_RANGE("MT5Encoder::run_one_infer");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -170,6 +171,7 @@ Encoder self attention
 */
 template <OperationType OpType_>
 void MT5Encoder<OpType_>::self_attention() {
+  LS_NVTX_RANGE("MT5Encoder::self_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
 
 #ifdef DEBUG_RESULT
@@ -277,6 +279,7 @@ void MT5Encoder<OpType_>::self_attention() {
 
 template <OperationType OpType_>
 void MT5Encoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("MT5Encoder::ffn_add_norm");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
 
   t5_ker_norm_layer_launcher<_DataType>(
@@ -213,6 +213,7 @@ Encoder inference
 template <OperationType OpType_>
 void QuantBertEncoder<OpType_>::run_one_infer(int batch_size,
                                               int batch_seq_len) {
+  LS_NVTX_RANGE("QuantBertEncoder::run_one_infer");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -269,6 +270,7 @@ Encoder self attention
 */
 template <OperationType OpType_>
 void QuantBertEncoder<OpType_>::self_attention() {
+  LS_NVTX_RANGE("QuantBertEncoder::self_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   if (_layer_id == 0) {
     ker_norm_layer_resual_i8O_launcher<_DataType>(
@@ -400,6 +402,7 @@ void QuantBertEncoder<OpType_>::self_attention() {
 
 template <OperationType OpType_>
 void QuantBertEncoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("QuantBertEncoder::ffn_add_norm");
 #ifdef DEBUG_RESULT
   for (int i = 0; i < _batch_size; i++) {       // batch_id
     for (int j = 0; j < _batch_seq_len; j++) {  // token_id
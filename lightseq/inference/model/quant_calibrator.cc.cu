@@ -0,0 +1,292 @@
+#include <algorithm>
+#include <cmath>
+
+#include "quant_calibrator.h"
+#include "../kernels/transformerKernels_int8.h"
+
+/**
+@file
+Post-training quantization calibration of the clip max of the activations,
+see quant_calibrator.h
+*/
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+// the quantization levels of int8 |x|, and the first bin of the clip max
+// searched by entropy and mse, as in pytorch_quantization.
+const int kQuantLevels = 128;
+const int kStartBin = 128;
+const float kQuantRange = 127;
+const float kMinClipMax = 1e-5f;
+
+/**
+The bin whose lower edge is the clip max of the least KL divergence between
+the histogram and its quantization into kQuantLevels levels, the last one on
+ties, the _compute_amax_entropy of pytorch_quantization.
+*/
+int entropy_bin(std::vector<double> bins) {
+  int stop = bins.size();
+  if (stop <= kStartBin) return stop;
+  bins[0] = bins[1];
+  // suffix[i], the sum of bins[i:], which is clipped into the bin i - 1
+  std::vector<double> suffix(stop + 1, 0);
+  for (int i = stop - 1; i >= 0; i--) suffix[i] = suffix[i + 1] + bins[i];
+
+  std::vector<double> level_sum(kQuantLevels), level_nonzero(kQuantLevels);
+  double best_divergence = INFINITY;
+  int best_bin = stop;
+  for (int i = kStartBin; i <= stop; i++) {
+    std::fill(level_sum.begin(), level_sum.end(), 0);
+    std::fill(level_nonzero.begin(), level_nonzero.end(), 0);
+    for (int j = 0; j < i; j++) {
+      if (bins[j] == 0) continue;
+      int level = (long long)j * kQuantLevels / i;
+      level_sum[level] += bins[j];
+      level_nonzero[level] += 1;
+    }
+    // the quantized density spreads every level over its non zero bins
+    double q_total = 0;
+    for (int j = 0; j < i; j++) {
+      if (bins[j] == 0) continue;
+      int level = (long long)j * kQuantLevels / i;
+      q_total += level_sum[level] / level_nonzero[level];
+    }
+    double p_total = suffix[0];
+    double divergence = 0;
+    for (int j = 0; j < i; j++) {
+      double p = j == i - 1 ? bins[j] + suffix[i] : bins[j];
+      if (p == 0) continue;
+      if (bins[j] == 0) {
+        divergence = INFINITY;
+        break;
+      }
+      int level = (long long)j * kQuantLevels / i;
+      double q = level_sum[level] / level_nonzero[level] / q_total;
+      p /= p_total;
+      divergence += p * log(p / q);
+    }
+    if (divergence <= best_divergence) {
+      best_divergence = divergence;
+      best_bin = i;
+    }
+  }
+  return best_bin;
+}
+
+/**
+The bin whose center is the clip max of the least mean squared error of the
+fake quantization of the bin centers, the _compute_amax_mse of
+pytorch_quantization.
+*/
+int mse_bin(const std::vector<double> &bins) {
+  int num_bins = bins.size();
+  if (num_bins <= kStartBin) return num_bins - 1;
+  double best_mse = INFINITY;
+  int best_bin = num_bins - 1;
+  for (int i = kStartBin; i < num_bins; i++) {
+    double amax = i + 0.5;
+    double mse = 0;
+    for (int j = 0; j < num_bins; j++) {
+      double center = j + 0.5;
+      double level = std::min(round(center / amax * kQuantRange),
+                              double(kQuantRange));
+      double error = level * amax / kQuantRange - center;
+      mse += error * error * bins[j];
+    }
+    if (mse < best_mse) {
+      best_mse = mse;
+      best_bin = i;
+    }
+  }
+  return best_bin;
+}
+
+/**
+The first bin whose cumulative count reaches percentile of the total count,
+the _compute_amax_percentile of pytorch_quantization. its upper edge is the
+clip max, so that at most 100 - percentile of the data is clipped.
+*/
+int percentile_bin(const std::vector<double> &bins, float percentile) {
+  double total = 0;
+  for (double e : bins) total += e;
+  double cumulative = 0;
+  for (int i = 0; i < bins.size(); i++) {
+    cumulative += bins[i];
+    if (cumulative >= total * percentile / 100) return i;
+  }
+  return bins.size() - 1;
+}
+
+// quantize the float dataset into uint8 by its absmax, in place
+void quantize_hdf5_dataset(hid_t hdf5_file, const std::string &dataset_name,
+                           const std::string &clip_max_name) {
+  std::vector<float> value =
+      read_hdf5_dataset_data_float(hdf5_file, dataset_name, H5T_NATIVE_FLOAT);
+  float clip_max = kMinClipMax;
+  for (float e : value) clip_max = std::max(clip_max, fabsf(e));
+  std::vector<unsigned char> value_i8(value.size());
+  for (size_t i = 0; i < value.size(); i++) {
+    value_i8[i] = quantize(value[i], kQuantRange, clip_max);
+  }
+  write_hdf5_dataset_data(hdf5_file, dataset_name, H5T_NATIVE_UCHAR,
+                          value_i8.data(), value_i8.size());
+  write_hdf5_dataset_scalar(hdf5_file, clip_max_name, H5T_NATIVE_FLOAT,
+                            &clip_max);
+}
+
+}  // namespace
+
+CalibMethod calib_method_from_name(const std::string &name) {
+  if (name == "max") return CalibMethod::kMax;
+  if (name == "entropy") return CalibMethod::kEntropy;
+  if (name == "percentile") return CalibMethod::kPercentile;
+  if (name == "mse") return CalibMethod::kMse;
+  throw std::runtime_error("unknown calibration method " + name +
+                           ", should be max, entropy, percentile or mse");
+}
+
+HistogramCalibrator::HistogramCalibrator(int num_tensors, cudaStream_t stream,
+                                         int num_bins)
+    : _num_tensors(num_tensors),
+      _num_bins(num_bins),
+      _stream(stream),
+      _histogram(false) {
+  CHECK_GPU_ERROR(cudaMalloc(&_p_d_abs_max, num_tensors * sizeof(float)));
+  CHECK_GPU_ERROR(cudaMalloc(
+      &_p_d_hist, num_tensors * num_bins * sizeof(unsigned long long)));
+  CHECK_GPU_ERROR(cudaMemsetAsync(_p_d_abs_max, 0,
+                                  num_tensors * sizeof(float), stream));
+  CHECK_GPU_ERROR(cudaMemsetAsync(
+      _p_d_hist, 0, num_tensors * num_bins * sizeof(unsigned long long),
+      stream));
+}
+
+HistogramCalibrator::~HistogramCalibrator() {
+  cudaFree(_p_d_abs_max);
+  cudaFree(_p_d_hist);
+}
+
+template <typename T>
+void HistogramCalibrator::collect(int tensor_id, const T *act, int size) {
+  if (tensor_id < 0 || tensor_id >= _num_tensors) {
+    throw std::runtime_error("calibration tensor id out of range");
+  }
+  launch_abs_histogram<T>(act, size, _p_d_abs_max + tensor_id,
+                          _histogram ? _p_d_hist + tensor_id * _num_bins
+                                     : nullptr,
+                          _num_bins, _stream);
+}
+
+void HistogramCalibrator::start_histogram() { _histogram = true; }
+
+std::vector<float> HistogramCalibrator::compute_amax(CalibMethod method,
+                                                     float percentile) {
+  if (method != CalibMethod::kMax && !_histogram) {
+    throw std::runtime_error(
+        "the histograms are collected after start_histogram");
+  }
+  if (percentile < 0 || percentile > 100) {
+    throw std::runtime_error("percentile should be in [0, 100]");
+  }
+  std::vector<float> abs_max(_num_tensors);
+  std::vector<unsigned long long> hist(_num_tensors * _num_bins);
+  CHECK_GPU_ERROR(cudaMemcpyAsync(abs_max.data(), _p_d_abs_max,
+                                  _num_tensors * sizeof(float),
+                                  cudaMemcpyDeviceToHost, _stream));
+  CHECK_GPU_ERROR(cudaMemcpyAsync(
+      hist.data(), _p_d_hist, hist.size() * sizeof(unsigned long long),
+      cudaMemcpyDeviceToHost, _stream));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
+
+  std::vector<float> amax(_num_tensors);
+  for (int t = 0; t < _num_tensors; t++) {
+    float bin_width = abs_max[t] / _num_bins;
+    std::vector<double> bins(hist.begin() + t * _num_bins,
+                             hist.begin() + (t + 1) * _num_bins);
+    switch (method) {
+      case CalibMethod::kMax:
+        amax[t] = abs_max[t];
+        break;
+      case CalibMethod::kEntropy:
+        amax[t] = entropy_bin(bins) * bin_width;
+        break;
+      case CalibMethod::kPercentile:
+        amax[t] = (percentile_bin(bins, percentile) + 1) * bin_width;
+        break;
+      case CalibMethod::kMse:
+        amax[t] = (mse_bin(bins) + 0.5f) * bin_width;
+        break;
+    }
+    amax[t] = std::max(amax[t], kMinClipMax);
+  }
+  return amax;
+}
+
+template void HistogramCalibrator::collect<float>(int tensor_id,
+                                                  const float *act, int size);
+template void HistogramCalibrator::collect<__half>(int tensor_id,
+                                                   const __half *act,
+                                                   int size);
+
+void write_quant_bert_hdf5(const std::string &float_path,
+                           const std::string &quant_path,
+                           const std::vector<float> &act_clip_max) {
+  hid_t float_file = H5Fopen(float_path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (float_file < 0) {
+    throw std::runtime_error("Unable to read HDF5 file from " + float_path);
+  }
+  int n_enc_layer;
+  read_hdf5_dataset_scalar(float_file, "model_conf/n_encoder_stack",
+                           H5T_NATIVE_INT, &n_enc_layer);
+  if (act_clip_max.size() != n_enc_layer * 7) {
+    H5Fclose(float_file);
+    throw std::runtime_error("expect 7 activation clip max per layer");
+  }
+  hid_t quant_file = H5Fcreate(quant_path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
+                               H5P_DEFAULT);
+  if (quant_file < 0) {
+    H5Fclose(float_file);
+    throw std::runtime_error("Unable to create HDF5 file " + quant_path);
+  }
+  for (const char *group : {"model_conf", "src_embedding", "encoder_stack"}) {
+    if (H5Ocopy(float_file, group, quant_file, group, H5P_DEFAULT,
+                H5P_DEFAULT) < 0) {
+      H5Fclose(float_file);
+      H5Fclose(quant_file);
+      throw std::runtime_error(std::string("Failed to copy ") + group +
+                               " of " + float_path);
+    }
+  }
+  H5Fclose(float_file);
+
+  quantize_hdf5_dataset(quant_file, "src_embedding/token_embedding",
+                        "src_embedding/emb_clip_max");
+  const std::vector<std::string> kernel_names = {
+      "multihead_project_kernel_qkv", "multihead_project_kernel_output",
+      "ffn_first_kernel", "ffn_second_kernel"};
+  const std::vector<std::string> act_names = {
+      "multihead_ln_clip_max",        "multihead_project_output_clip_max",
+      "ffn_ln_clip_max",              "ffn_first_act_clip_max",
+      "multihead_qkv_dense_clip_max", "multihead_output_dense_clip_max",
+      "ffn_first_output_clip_max"};
+  for (int layer_id = 0; layer_id < n_enc_layer; layer_id++) {
+    std::string dataset_prefix =
+        "encoder_stack/" + std::to_string(layer_id) + "/";
+    for (const std::string &name : kernel_names) {
+      quantize_hdf5_dataset(quant_file, dataset_prefix + name,
+                            dataset_prefix + name + "_clip_max");
+    }
+    for (int i = 0; i < act_names.size(); i++) {
+      write_hdf5_dataset_scalar(quant_file, dataset_prefix + act_names[i],
+                                H5T_NATIVE_FLOAT,
+                                &act_clip_max[layer_id * 7 + i]);
+    }
+  }
+  H5Fclose(quant_file);
+}
+
+}  // namespace cuda
+}  // namespace lightseq
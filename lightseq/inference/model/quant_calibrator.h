@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include <string>
+#include <vector>
+
+#include "../tools/util.h"
+
+/**
+@file
+Post-training quantization calibration of the clip max of the activations,
+as the HistogramCalibrator of pytorch_quantization but on the gpu: a first
+pass over the calibration set collects the absmax of every tensor, a second
+one its histogram of |x| in [0, absmax], see launch_abs_histogram, and the
+clip max is picked from the histogram by entropy, percentile or mse.
+*/
+
+namespace lightseq {
+namespace cuda {
+
+enum class CalibMethod { kMax, kEntropy, kPercentile, kMse };
+
+// max, entropy, percentile or mse
+CalibMethod calib_method_from_name(const std::string &name);
+
+class HistogramCalibrator {
+ private:
+  const int _num_tensors;
+  const int _num_bins;
+  cudaStream_t _stream;
+  bool _histogram;
+
+  float *_p_d_abs_max;            // [num_tensors]
+  unsigned long long *_p_d_hist;  // [num_tensors, num_bins]
+
+ public:
+  HistogramCalibrator(int num_tensors, cudaStream_t stream,
+                      int num_bins = 2048);
+  ~HistogramCalibrator();
+
+  // accumulates act into the absmax of tensor_id, or into its histogram
+  // after start_histogram. no host synchronization.
+  template <typename T>
+  void collect(int tensor_id, const T *act, int size);
+  // the end of the absmax pass over the calibration set.
+  void start_histogram();
+  // the clip max of every tensor, in [0, absmax].
+  std::vector<float> compute_amax(CalibMethod method,
+                                  float percentile = 99.99f);
+};
+
+/**
+Write the QuantBert hdf5 of the Bert hdf5 of float_path into quant_path: the
+kernels and the token embedding are quantized by their absmax, act_clip_max
+holds the 7 activation clip max of every layer, in the order of the ones of
+QuantBertWeight::get_enc_clip_max from multihead_ln_clip_max on.
+*/
+void write_quant_bert_hdf5(const std::string &float_path,
+                           const std::string &quant_path,
+                           const std::vector<float> &act_clip_max);
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -414,6 +414,7 @@ QuantDecoder inference
 */
 template <OperationType OpType_>
 void QuantDecoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
+  LS_NVTX_RANGE("QuantDecoder::run_one_infer");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -488,6 +489,7 @@ Project encoder output
 */
 template <OperationType OpType_>
 void QuantDecoder<OpType_>::project_encoder_output() {
+  LS_NVTX_RANGE("QuantDecoder::project_encoder_output");
   int kv_dim = _tw._hidden_size * 2 * _tw._n_dec_layer;
 #ifdef DEBUG_RESULT
   CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
@@ -524,6 +526,7 @@ Decode one step
 */
 template <OperationType OpType_>
 bool QuantDecoder<OpType_>::run_step() {
+  LS_NVTX_RANGE("QuantDecoder::run_step");
   embedding();
   decoder_stack();
   /* --- Project hidden states to vocab logits--- */
@@ -569,6 +572,7 @@ Decode embedding
 */
 template <OperationType OpType_>
 void QuantDecoder<OpType_>::embedding() {
+  LS_NVTX_RANGE("QuantDecoder::embedding");
   // _p_d_trg_emb_wei: {token_emb, position_emb, norm_scale, norm_bias,
   // enc_out_kernel_kv, enc_out_bias_kv, logit_bias}
   launch_dec_emb_i8I<_DataType>(
@@ -618,6 +622,7 @@ QuantDecoder self attention
 */
 template <OperationType OpType_>
 void QuantDecoder<OpType_>::self_attention() {
+  LS_NVTX_RANGE("QuantDecoder::self_attention");
   if (_layer_id == 0) {
     ker_norm_layer_resual_i8O_launcher<_DataType>(
         _step_token_num, _tw._hidden_size, _stream, _p_d_cur_step_query,
@@ -733,6 +738,7 @@ Encode-Decoder attention
 */
 template <OperationType OpType_>
 void QuantDecoder<OpType_>::encdec_attention() {
+  LS_NVTX_RANGE("QuantDecoder::encdec_attention");
 #ifdef DEBUG_RESULT
   print_vec(_int8_ffn_in_buf, "encdec attn ln(head): ", 5);
   print_vec(_int8_ffn_in_buf + _step_token_num * _tw._hidden_size - 5,
@@ -852,6 +858,7 @@ void QuantDecoder<OpType_>::encdec_attention() {
 
 template <OperationType OpType_>
 void QuantDecoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("QuantDecoder::ffn_add_norm");
 #ifdef DEBUG_RESULT
   print_vec(_int8_ffn_in_buf, "ffn ln(head): ", 5);
   print_vec(_int8_ffn_in_buf + _step_token_num * _tw._hidden_size - 5,
@@ -950,6 +957,7 @@ void QuantDecoder<OpType_>::ffn_add_norm() {
 
 template <OperationType OpType_>
 bool QuantDecoder<OpType_>::sample() {
+  LS_NVTX_RANGE("QuantDecoder::sample");
   CHECK_GPU_ERROR(
       cudaMemsetAsync(_p_d_sample_unfinished, 0, sizeof(int), _stream));
   /* --- Sample new tokens from logits --- */
@@ -986,6 +994,7 @@ bool QuantDecoder<OpType_>::sample() {
 
 template <OperationType OpType_>
 bool QuantDecoder<OpType_>::beam_search() {
+  LS_NVTX_RANGE("QuantDecoder::beam_search");
   /*
     step 1. logits bias and softmax,
       select rough topk candidate for every batch item,
@@ -1099,6 +1108,7 @@ void QuantDecoder<OpType_>::update_new_seq_probs() {
 
 template <OperationType OpType_>
 bool QuantDecoder<OpType_>::topk_greedy_search() {
+  LS_NVTX_RANGE("QuantDecoder::topk_greedy_search");
   _tw._diverse_lambda = 0;
   if (_cur_step == 0) {
     return beam_search();
@@ -217,6 +217,7 @@ QuantEncoder inference
 */
 template <OperationType OpType_>
 void QuantEncoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
+  LS_NVTX_RANGE("QuantEncoder::run_one_infer");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -276,6 +277,7 @@ QuantEncoder self attention
 */
 template <OperationType OpType_>
 void QuantEncoder<OpType_>::self_attention() {
+  LS_NVTX_RANGE("QuantEncoder::self_attention");
   if (_layer_id == 0) {
     ker_norm_layer_resual_i8O_launcher<_DataType>(
         _batch_token_num, _tw._hidden_size, _stream, _p_d_output,
@@ -374,6 +376,7 @@ void QuantEncoder<OpType_>::self_attention() {
 
 template <OperationType OpType_>
 void QuantEncoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("QuantEncoder::ffn_add_norm");
   if (_sm_gt_eq_80) {
     cublaslt_gemm(_int8_p_d_enc_wei[_layer_id * 4 + 2], _int8_ffn_in_buf,
                   _int8_ffn_out_buf, 1, _tw._inner_size, _batch_token_num,
@@ -139,6 +139,18 @@ void QuantGptEncoder<OpType_>::init_buffer() {
   _p_d_self_v_cache1 = _p_d_self_v_cache.data();
   _p_d_self_v_cache2 = _p_d_self_v_cache.data() + _tw._n_enc_layer;
 
+  // the kernels prepacked at export are only valid on gpus of their layout
+  const std::vector<const int8_t *> &packed_kernels =
+      _tw.get_enc_packed_kernels();
+  std::string weight_layout_name = _sm_gt_eq_80 ? "col" : "col4_4r2_8c";
+  if (!packed_kernels.empty() &&
+      _tw.get_int8_weight_layout() != weight_layout_name) {
+    throw std::runtime_error(
+        "int8 kernels prepacked in " + _tw.get_int8_weight_layout() +
+        " layout, but this gpu needs " + weight_layout_name +
+        ", export the model again with --pack_sm of this gpu !");
+  }
+
   // malloc weights
   _int8_p_d_enc_wei = std::vector<int8_t *>(_tw._n_enc_layer * 4);
   _scaled_ffn2_colsum = std::vector<_DataType *>(_tw._n_enc_layer);
@@ -180,6 +192,22 @@ void QuantGptEncoder<OpType_>::init_buffer() {
     _p_device_wei.push_back(
         to_gpu(_p_d_enc_wei[_weight_offset + 11], _tw._hidden_size, _stream));
 
+    _scaled_ffn2_colsum[_layer_id] = nullptr;
+    if (!packed_kernels.empty()) {
+      size_t kernel_sizes[4] = {
+          size_t(_tw._hidden_size) * _tw._hidden_size * 3,
+          size_t(_tw._hidden_size) * _tw._hidden_size,
+          size_t(_tw._hidden_size) * _tw._inner_size,
+          size_t(_tw._inner_size) * _tw._hidden_size};
+      for (int k = 0; k < 4; k++) {
+        CHECK_GPU_ERROR(cudaMemcpyAsync(
+            _int8_p_d_enc_wei[_layer_id * 4 + k],
+            packed_kernels[_layer_id * 4 + k], kernel_sizes[k] * sizeof(int8_t),
+            cudaMemcpyHostToDevice, _stream));
+      }
+      continue;
+    }
+
     auto weight_layout = _sm_gt_eq_80 ? kColMajor : kColMajor32;
 
     quantize_weight(_p_d_enc_wei[_weight_offset + 2],
@@ -205,8 +233,6 @@ void QuantGptEncoder<OpType_>::init_buffer() {
                     _tw._hidden_size,
                     _quant_range / _enc_clip_max[_layer_id * 12 + 3], _stream,
                     _cublas_lt_handle, kColMajor);
-
-    _scaled_ffn2_colsum[_layer_id] = nullptr;
   }
 
   CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
@@ -254,6 +280,7 @@ std::string QuantGptEncoder<OpType_>::check() {
 template <OperationType OpType_>
 void QuantGptEncoder<OpType_>::run_one_infer(int batch_size,
                                              int batch_seq_len) {
+  LS_NVTX_RANGE("QuantGptEncoder::run_one_infer");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -300,6 +327,7 @@ void QuantGptEncoder<OpType_>::benchmark_mode(bool is_benchmark) {
 template <OperationType OpType_>
 int QuantGptEncoder<OpType_>::run_one_sample(int batch_size,
                                              int batch_seq_len) {
+  LS_NVTX_RANGE("QuantGptEncoder::run_one_sample");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -398,6 +426,7 @@ int QuantGptEncoder<OpType_>::run_one_sample(int batch_size,
 
 template <OperationType OpType_>
 int QuantGptEncoder<OpType_>::sample_one_token() {
+  LS_NVTX_RANGE("QuantGptEncoder::sample_one_token");
   /* ---step 1. project hidden states to vocab logits--- */
   cublasLtMM_withAlgo_i8IO(_int8_ffn_out_buf, 1, _batch_token_num,
                            _tw._src_vocab_size, _tw._hidden_size, 0, 0, 0,
@@ -440,6 +469,7 @@ int QuantGptEncoder<OpType_>::sample_one_token() {
 
 template <OperationType OpType_>
 int QuantGptEncoder<OpType_>::sample_one_token_with_cache() {
+  LS_NVTX_RANGE("QuantGptEncoder::sample_one_token_with_cache");
   /* ---step 1. project hidden states to vocab logits--- */
   cublasLtMM_withAlgo_i8IO(_int8_ffn_out_buf, 1, _batch_size,
                            _tw._src_vocab_size, _tw._hidden_size, 0, 0, 0,
@@ -483,6 +513,7 @@ int QuantGptEncoder<OpType_>::sample_one_token_with_cache() {
 
 template <OperationType OpType_>
 void QuantGptEncoder<OpType_>::self_attention() {
+  LS_NVTX_RANGE("QuantGptEncoder::self_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   if (_layer_id == 0) {
     ker_norm_layer_resual_i8O_launcher<_DataType>(
@@ -584,6 +615,7 @@ void QuantGptEncoder<OpType_>::self_attention() {
 
 template <OperationType OpType_>
 void QuantGptEncoder<OpType_>::self_attention_with_cache() {
+  LS_NVTX_RANGE("QuantGptEncoder::self_attention_with_cache");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   if (_layer_id == 0) {
     ker_norm_layer_resual_i8O_launcher<_DataType>(
@@ -659,6 +691,7 @@ void QuantGptEncoder<OpType_>::self_attention_with_cache() {
 
 template <OperationType OpType_>
 void QuantGptEncoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("QuantGptEncoder::ffn_add_norm");
   /* ---step 1. first ffn layer--- */
   if (_sm_gt_eq_80) {
     cublaslt_gemm(_int8_p_d_enc_wei[_layer_id * 4 + 2], _int8_ffn_in_buf,
@@ -733,6 +766,7 @@ void QuantGptEncoder<OpType_>::ffn_add_norm() {
 
 template <OperationType OpType_>
 void QuantGptEncoder<OpType_>::ffn_add_norm_with_cache() {
+  LS_NVTX_RANGE("QuantGptEncoder::ffn_add_norm_with_cache");
   /* ---step 1. first ffn layer--- */
   if (_sm_gt_eq_80) {
     cublaslt_gemm(_int8_p_d_enc_wei[_layer_id * 4 + 2], _int8_ffn_in_buf,
@@ -187,6 +187,7 @@ Encoder inference
 */
 template <OperationType OpType_>
 void QuantVitEncoder<OpType_>::run_one_infer(int batch_size) {
+  LS_NVTX_RANGE("QuantVitEncoder::run_one_infer");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -235,6 +236,7 @@ Encoder self attention
 */
 template <OperationType OpType_>
 void QuantVitEncoder<OpType_>::self_attention() {
+  LS_NVTX_RANGE("QuantVitEncoder::self_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   if (_layer_id == 0) {
     ker_norm_layer_resual_i8O_launcher<_DataType>(
@@ -366,6 +368,7 @@ void QuantVitEncoder<OpType_>::self_attention() {
 
 template <OperationType OpType_>
 void QuantVitEncoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("QuantVitEncoder::ffn_add_norm");
 #ifdef DEBUG_RESULT
   for (int i = 0; i < _batch_size; i++) {       // batch_id
     for (int j = 0; j < _batch_seq_len; j++) {  // token_id
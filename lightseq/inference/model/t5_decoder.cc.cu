@@ -266,6 +266,7 @@ T5Decoder inference
 */
 template <OperationType OpType_>
 void T5Decoder<OpType_>::run_one_infer(int batch_size, int batch_seq_len) {
+  LS_NVTX_RANGE("T5Decoder::run_one_infer");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -339,6 +340,7 @@ Project encoder output
 */
 template <OperationType OpType_>
 void T5Decoder<OpType_>::project_encoder_output() {
+  LS_NVTX_RANGE("T5Decoder::project_encoder_output");
   int kv_dim = _tw._hidden_size * 2 * _tw._n_dec_layer;
 #ifdef DEBUG_RESULT
   CHECK_GPU_ERROR(cudaStreamSynchronize(_stream));
@@ -375,6 +377,7 @@ Decode one step
 */
 template <OperationType OpType_>
 bool T5Decoder<OpType_>::run_step() {
+  LS_NVTX_RANGE("T5Decoder::run_step");
   embedding();
   decoder_stack();
   /* --- Project hidden states to vocab logits--- */
@@ -419,6 +422,7 @@ Decode embedding
 */
 template <OperationType OpType_>
 void T5Decoder<OpType_>::embedding() {
+  LS_NVTX_RANGE("T5Decoder::embedding");
   // _p_d_trg_emb_wei: {token_emb, position_emb, norm_scale, norm_bias,
   // enc_out_kernel_kv, enc_out_bias_kv, logit_bias}
   t5_launch_dec_emb<_DataType>(_p_d_trg_emb_wei[0], _p_d_alive_seq,
@@ -479,6 +483,7 @@ T5Decoder self attention
 */
 template <OperationType OpType_>
 void T5Decoder<OpType_>::self_attention() {
+  LS_NVTX_RANGE("T5Decoder::self_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
 
   t5_ker_norm_layer_launcher<_DataType>(
@@ -598,6 +603,7 @@ Encode-Decoder attention
 */
 template <OperationType OpType_>
 void T5Decoder<OpType_>::encdec_attention() {
+  LS_NVTX_RANGE("T5Decoder::encdec_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   // ker_norm_layer_resual_launcher<_DataType>(
   //     _step_token_num, _tw._hidden_size, _stream, _p_d_cur_step_query,
@@ -676,6 +682,7 @@ void T5Decoder<OpType_>::encdec_attention() {
 
 template <OperationType OpType_>
 void T5Decoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("T5Decoder::ffn_add_norm");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
 
   t5_ker_norm_layer_launcher<_DataType>(
@@ -728,6 +735,7 @@ void T5Decoder<OpType_>::ffn_add_norm() {
 
 template <OperationType OpType_>
 bool T5Decoder<OpType_>::sample() {
+  LS_NVTX_RANGE("T5Decoder::sample");
   CHECK_GPU_ERROR(
       cudaMemsetAsync(_p_d_sample_unfinished, 0, sizeof(int), _stream));
   /* --- Sample new tokens from logits --- */
@@ -762,6 +770,7 @@ bool T5Decoder<OpType_>::sample() {
 
 template <OperationType OpType_>
 bool T5Decoder<OpType_>::beam_search() {
+  LS_NVTX_RANGE("T5Decoder::beam_search");
   /*
     step 1. logits bias and softmax,
       select rough topk candidate for every batch item,
@@ -881,6 +890,7 @@ void T5Decoder<OpType_>::update_new_seq_probs() {
 
 template <OperationType OpType_>
 bool T5Decoder<OpType_>::topk_greedy_search() {
+  LS_NVTX_RANGE("T5Decoder::topk_greedy_search");
   _tw._diverse_lambda = 0;
   if (_cur_step == 0) {
     return beam_search();
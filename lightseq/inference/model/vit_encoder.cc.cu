@@ -2,6 +2,9 @@
 #include "../kernels/embKernels.h"
 #include "../kernels/transformerKernels.h"
 
+#include <cstdlib>
+#include <sstream>
+
 /**
 @file
 ViT encoder, composed by gemm lib and
@@ -11,6 +14,13 @@ ViT encoder, composed by gemm lib and
 namespace lightseq {
 namespace cuda {
 
+namespace {
+
+// timed runs of every candidate algo of a tuned gemm
+const int kGemmTuneRepeat = 5;
+
+}  // namespace
+
 template <OperationType OpType_>
 VitEncoder<OpType_>::VitEncoder(int max_batch_size,
                                 const float *p_d_pixel_input,
@@ -30,7 +40,45 @@ VitEncoder<OpType_>::VitEncoder(int max_batch_size,
       _fzero((_DataType)0.f),
       _atten_scaler((_DataType)sqrt(1.f / tw._dim_per_head)),
       _max_batch_dim(max_batch_size * tw._max_step * tw._hidden_size),
-      _max_thread_per_block(1024) {}
+      _max_thread_per_block(1024),
+      _graphs(stream, CudaGraphCache::max_graphs_from_env()) {
+  // (pixel / 255 - mean) / std as one multiply add, the sizes are checked
+  // by check()
+  int channel_num = std::min({(size_t)tw._channel_input, tw._image_mean.size(),
+                              tw._image_std.size()});
+  std::vector<float> pixel_norm(2 * tw._channel_input);
+  for (int i = 0; i < channel_num; i++) {
+    pixel_norm[i] = 1.f / (255.f * tw._image_std[i]);
+    pixel_norm[tw._channel_input + i] = -tw._image_mean[i] / tw._image_std[i];
+  }
+  _d_pixel_norm = pixel_norm;
+
+  // LIGHTSEQ_VIT_TOKEN_MERGE=<r> merges r tokens away in every layer,
+  // <layer>:<r>,... in the given layers only. The tokens of a layer go down
+  // by at most half of them but the cls token.
+  _merge_num.assign(tw._n_enc_layer, 0);
+  const char *merge_env = std::getenv("LIGHTSEQ_VIT_TOKEN_MERGE");
+  std::istringstream merge_spec(merge_env ? merge_env : "");
+  std::string item;
+  while (std::getline(merge_spec, item, ',')) {
+    size_t colon = item.find(':');
+    if (colon == std::string::npos) {
+      _merge_num.assign(tw._n_enc_layer, std::stoi(item));
+      continue;
+    }
+    int layer_id = std::stoi(item.substr(0, colon));
+    if (layer_id < 0 || layer_id >= tw._n_enc_layer) {
+      throw std::runtime_error("LIGHTSEQ_VIT_TOKEN_MERGE has no layer " +
+                               std::to_string(layer_id));
+    }
+    _merge_num[layer_id] = std::stoi(item.substr(colon + 1));
+  }
+  _out_seq_len = tw._max_step;
+  for (int &merge_num : _merge_num) {
+    merge_num = std::max(0, std::min(merge_num, (_out_seq_len - 1) / 2));
+    _out_seq_len -= merge_num;
+  }
+}
 
 /**
 Compute GPU memory size needed by transformer encoder,
@@ -38,10 +86,26 @@ Compute GPU memory size needed by transformer encoder,
 */
 template <OperationType OpType_>
 long VitEncoder<OpType_>::compute_buffer_bytesize() {
+  long bytesize = shared_buffer_bytesize();
+  if (_out_seq_len == _tw._max_step) return bytesize;
+  // the buffers of token merging, after the shared ones, see init_buffer
+  long merge_sz = (long)_max_batch_size *
+                  (_tw._max_step * (_tw._dim_per_head + 5L) + 2);
+  return (bytesize + 15) / 16 * 16 + merge_sz * sizeof(float);
+}
+
+/**
+The GPU memory size of the buffers the steps of a layer share
+*/
+template <OperationType OpType_>
+long VitEncoder<OpType_>::shared_buffer_bytesize() {
   long sz1 = _max_batch_dim * 6 +
              _max_batch_size * _tw._head_num * _tw._max_step * _tw._max_step;
   long sz2 = _max_batch_dim + _max_batch_size * _tw._max_step * _tw._inner_size;
-  return max(sz1, sz2) * sizeof(_DataType);
+  // the patches of the patch embedding
+  long sz0 = (long)_max_batch_size * (_tw._max_step - 1) * _tw._channel_input *
+             _tw._patch_size * _tw._patch_size;
+  return max(sz0, max(sz1, sz2)) * sizeof(_DataType);
 }
 
 /**
@@ -60,6 +124,21 @@ void VitEncoder<OpType_>::init_buffer(void *pbuf) {
   _p_d_c = _p_d_v + _max_batch_dim;
   _p_d_ffn_buf1 = p_d_buf;
   _p_d_ffn_buf2 = _p_d_ffn_buf1 + _max_batch_dim;
+  _p_d_patches = p_d_buf;
+  if (_out_seq_len == _tw._max_step) return;
+
+  long merge_offset = (shared_buffer_bytesize() + 15) / 16 * 16;
+  long max_token_num = (long)_max_batch_size * _tw._max_step;
+  long max_src_num = (long)_max_batch_size * ((_tw._max_step + 1) / 2);
+  _p_d_merge_metric = reinterpret_cast<float *>(
+      reinterpret_cast<char *>(pbuf) + merge_offset);
+  _p_d_merge_score = _p_d_merge_metric + max_token_num * _tw._dim_per_head;
+  _p_d_merge_match = reinterpret_cast<int *>(_p_d_merge_score + max_src_num);
+  _p_d_merge_offsets = _p_d_merge_match + max_src_num;
+  _p_d_merge_tokens = _p_d_merge_offsets + max_token_num + _max_batch_size;
+  _p_d_token_size[0] =
+      reinterpret_cast<float *>(_p_d_merge_tokens + max_token_num);
+  _p_d_token_size[1] = _p_d_token_size[0] + max_token_num;
   return;
 }
 
@@ -88,6 +167,15 @@ std::string VitEncoder<OpType_>::check() {
                            1) {
     return "violate max_step = (image_size / patch_size) ** 2 + 1";
   }
+  if (_tw._image_mean.size() != (size_t)_tw._channel_input ||
+      _tw._image_std.size() != (size_t)_tw._channel_input) {
+    return "violate image_mean.size() = image_std.size() = channel_input";
+  }
+  if (_out_seq_len < _tw._max_step &&
+      (_tw._max_step + 1) / 2 > _max_thread_per_block) {
+    return "violate (max_step + 1) / 2 <= max_thread_per_block with token "
+           "merging";
+  }
   return "";
 }
 
@@ -96,6 +184,7 @@ Encoder inference
 */
 template <OperationType OpType_>
 void VitEncoder<OpType_>::run_one_infer(int batch_size) {
+  LS_NVTX_RANGE("VitEncoder::run_one_infer");
   if (batch_size > _max_batch_size) {
     throw std::runtime_error("batch size of input greater than max_batch_size");
   }
@@ -105,11 +194,29 @@ void VitEncoder<OpType_>::run_one_infer(int batch_size) {
   _batch_token_num = batch_size * _batch_seq_len;
 
   /* ---step2. encoder feedforward--- */
-  launch_patch_emb<_DataType>(_p_d_src_emb_wei[0], _p_d_src_emb_wei[1],
-                              _p_d_src_emb_wei[2], _p_d_src_emb_wei[3],
-                              _p_d_pixel_input, _p_d_output, _tw._patch_size,
-                              _tw._image_size, _batch_size, _tw._max_step,
-                              _tw._hidden_size, _tw._channel_input, _stream);
+#ifdef DEBUG_RESULT
+  forward();
+#else
+  // the first run of a batch size tunes the attention gemms eagerly, the
+  // graph captured later bakes in the tuned algos.
+  _graphs.run({batch_size, (int64_t)_p_d_pixel_input,
+               (int64_t)_p_d_pixel_uint8, (int64_t)_p_d_output},
+              [this]() { forward(); });
+#endif
+  return;
+}
+
+/**
+The kernels of one encoder forward, host synchronizes only at the gemm
+tuning of a new batch size, which a CudaGraphCache runs eagerly
+*/
+template <OperationType OpType_>
+void VitEncoder<OpType_>::forward() {
+  // the tokens of the layers shrink with token merging
+  _batch_seq_len = _tw._max_step;
+  _batch_token_num = _batch_size * _batch_seq_len;
+  _token_size_id = -1;
+  patch_emb();
 #ifdef DEBUG_RESULT
   for (int i = 0; i < _batch_size; i++) {  // batch_id
     for (int j = 0; j < 10; j++) {         // patch_id
@@ -123,6 +230,7 @@ void VitEncoder<OpType_>::run_one_infer(int batch_size) {
   for (_layer_id = 0; _layer_id < _tw._n_enc_layer; _layer_id++) {
     _weight_offset = _layer_id * _tw._weight_per_enc_layer;
     self_attention();
+    if (_merge_num[_layer_id] > 0) merge_tokens();
     ffn_add_norm();
   }
   // last layer norm
@@ -143,11 +251,99 @@ void VitEncoder<OpType_>::run_one_infer(int batch_size) {
   return;
 }
 
+/**
+Patch embedding, the conv of stride patch_size is a gemm of the conv weight
+and the patches, im2col, added to the cls, position embeddings and bias
+*/
+template <OperationType OpType_>
+void VitEncoder<OpType_>::patch_emb() {
+  launch_patch_im2col<_DataType>(
+      _p_d_src_emb_wei[1], _p_d_src_emb_wei[2], _p_d_src_emb_wei[3],
+      _p_d_pixel_input, _p_d_pixel_uint8,
+      thrust::raw_pointer_cast(_d_pixel_norm.data()), _p_d_output,
+      _p_d_patches, _tw._patch_size, _tw._image_size, _batch_size,
+      _tw._max_step, _tw._hidden_size, _tw._channel_input, _stream);
+
+  // output[:, 1:] += patches * conv_weight^T, for every image
+  int patch_num = _batch_seq_len - 1;
+  int patch_dim = _tw._channel_input * _tw._patch_size * _tw._patch_size;
+  CHECK_GPU_ERROR(cublasGemmStridedBatchedEx(
+      _hd, CUBLAS_OP_T, CUBLAS_OP_N, _tw._hidden_size, patch_num, patch_dim,
+      &_fone, _p_d_src_emb_wei[0], _AType, patch_dim, 0, _p_d_patches, _BType,
+      patch_dim, patch_num * patch_dim, &_fone, _p_d_output + _tw._hidden_size,
+      _CType, _tw._hidden_size, _batch_seq_len * _tw._hidden_size,
+      _batch_size, _computeType, CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+}
+
+/**
+Token merging, ToMe style bipartite soft matching on the keys of the layer:
+the tokens of the even positions most similar to a token of the odd positions
+are averaged into it, weighted by the tokens each is merged from, before the
+ffn. Only the shapes of the layers change, by batch size they are the same
+at every inference, so a CudaGraphCache still captures forward()
+*/
+template <OperationType OpType_>
+void VitEncoder<OpType_>::merge_tokens() {
+  int merge_num = _merge_num[_layer_id];
+  int new_seq_len = _batch_seq_len - merge_num;
+  const float *size =
+      _token_size_id < 0 ? nullptr : _p_d_token_size[_token_size_id];
+  _token_size_id = _token_size_id == 0 ? 1 : 0;
+  // q is free after the self attention, k still holds its keys
+  ker_token_merge_launcher<_DataType>(
+      _batch_size, _batch_seq_len, merge_num, _tw._hidden_size, _tw._head_num,
+      _stream, _p_d_k, _p_d_output, size, _p_d_q,
+      _p_d_token_size[_token_size_id], _p_d_merge_metric, _p_d_merge_score,
+      _p_d_merge_match, _p_d_merge_offsets, _p_d_merge_tokens);
+  _batch_seq_len = new_seq_len;
+  _batch_token_num = _batch_size * _batch_seq_len;
+  CHECK_GPU_ERROR(cudaMemcpyAsync(
+      _p_d_output, _p_d_q,
+      (size_t)_batch_token_num * _tw._hidden_size * sizeof(_DataType),
+      cudaMemcpyDeviceToDevice, _stream));
+}
+
+/**
+Time every tensor op algo of gemm, a call of a gemm that can be rerun on its
+inputs, and return the fastest one
+*/
+template <OperationType OpType_>
+cublasGemmAlgo_t VitEncoder<OpType_>::tune_gemm(
+    const std::function<cublasStatus_t(cublasGemmAlgo_t)> &gemm) {
+  cudaEvent_t start, stop;
+  CHECK_GPU_ERROR(cudaEventCreate(&start));
+  CHECK_GPU_ERROR(cudaEventCreate(&stop));
+  cublasGemmAlgo_t best_algo = CUBLAS_GEMM_DEFAULT_TENSOR_OP;
+  float best_ms = -1.f;
+  for (int i = CUBLAS_GEMM_DEFAULT_TENSOR_OP; i <= CUBLAS_GEMM_ALGO15_TENSOR_OP;
+       i++) {
+    cublasGemmAlgo_t algo = static_cast<cublasGemmAlgo_t>(i);
+    // the warm up run, algos that do not support the shape are skipped
+    if (gemm(algo) != CUBLAS_STATUS_SUCCESS) continue;
+    CHECK_GPU_ERROR(cudaEventRecord(start, _stream));
+    for (int j = 0; j < kGemmTuneRepeat; j++) {
+      CHECK_GPU_ERROR(gemm(algo));
+    }
+    CHECK_GPU_ERROR(cudaEventRecord(stop, _stream));
+    CHECK_GPU_ERROR(cudaEventSynchronize(stop));
+    float ms;
+    CHECK_GPU_ERROR(cudaEventElapsedTime(&ms, start, stop));
+    if (best_ms < 0 || ms < best_ms) {
+      best_ms = ms;
+      best_algo = algo;
+    }
+  }
+  CHECK_GPU_ERROR(cudaEventDestroy(start));
+  CHECK_GPU_ERROR(cudaEventDestroy(stop));
+  return best_algo;
+}
+
 /**
 Encoder self attention
 */
 template <OperationType OpType_>
 void VitEncoder<OpType_>::self_attention() {
+  LS_NVTX_RANGE("VitEncoder::self_attention");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _batch_token_num, _tw._hidden_size, _stream, _p_d_output, _p_d_q,
@@ -183,15 +379,34 @@ void VitEncoder<OpType_>::self_attention() {
       _p_d_enc_wei[_weight_offset + 3], _p_d_q, _max_batch_dim, _batch_seq_len,
       _tw._dim_per_head, _tw._head_num, _max_thread_per_block);
 
+  // the attention gemms of a batch size are tuned in their first layer and
+  // after every token merging, both write buffers they do not read and are
+  // safe to rerun
+  bool tune_attn_gemm = false;
+  int64_t gemm_shape = ((int64_t)_batch_size << 32) | _batch_seq_len;
+  if (_layer_id == 0 || _merge_num[_layer_id - 1] > 0) {
+    auto algos = _attn_gemm_algos.find(gemm_shape);
+    tune_attn_gemm = algos == _attn_gemm_algos.end();
+    if (!tune_attn_gemm) {
+      _attn_score_algo = algos->second.first;
+      _attn_value_algo = algos->second.second;
+    }
+  }
+
   /* ---step 2. correlation = q * k, perform softmax on correlation--- */
-  CHECK_GPU_ERROR(cublasGemmStridedBatchedEx(
-      _hd, CUBLAS_OP_T, CUBLAS_OP_N, _batch_seq_len, _batch_seq_len,
-      _tw._dim_per_head, &_atten_scaler, _p_d_k, _AType, _tw._dim_per_head,
-      _batch_seq_len * _tw._dim_per_head, _p_d_q, _BType, _tw._dim_per_head,
-      _batch_seq_len * _tw._dim_per_head, &_fzero, _p_d_c, _CType,
-      _batch_seq_len, _batch_seq_len * _batch_seq_len,
-      _batch_size * _tw._head_num, _computeType,
-      CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+  auto score_gemm = [&](cublasGemmAlgo_t algo) {
+    return cublasGemmStridedBatchedEx(
+        _hd, CUBLAS_OP_T, CUBLAS_OP_N, _batch_seq_len, _batch_seq_len,
+        _tw._dim_per_head, &_atten_scaler, _p_d_k, _AType, _tw._dim_per_head,
+        _batch_seq_len * _tw._dim_per_head, _p_d_q, _BType, _tw._dim_per_head,
+        _batch_seq_len * _tw._dim_per_head, &_fzero, _p_d_c, _CType,
+        _batch_seq_len, _batch_seq_len * _batch_seq_len,
+        _batch_size * _tw._head_num, _computeType, algo);
+  };
+  if (tune_attn_gemm) {
+    _attn_score_algo = tune_gemm(score_gemm);
+  }
+  CHECK_GPU_ERROR(score_gemm(_attn_score_algo));
   ker_correlation_softmax_encself_launcher<_DataType>(
       _batch_size, _batch_seq_len, _tw._head_num, _stream, _p_d_c,
       _p_d_padding_mask);
@@ -203,14 +418,20 @@ void VitEncoder<OpType_>::self_attention() {
 #endif
 
   /* ---step 3. new_q = correlation * v--- */
-  CHECK_GPU_ERROR(cublasGemmStridedBatchedEx(
-      _hd, CUBLAS_OP_N, CUBLAS_OP_N, _tw._dim_per_head, _batch_seq_len,
-      _batch_seq_len, &_fone, _p_d_v, _AType, _tw._dim_per_head,
-      _batch_seq_len * _tw._dim_per_head, _p_d_c, _BType, _batch_seq_len,
-      _batch_seq_len * _batch_seq_len, &_fzero, _p_d_q, _CType,
-      _tw._dim_per_head, _batch_seq_len * _tw._dim_per_head,
-      _batch_size * _tw._head_num, _computeType,
-      CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+  auto value_gemm = [&](cublasGemmAlgo_t algo) {
+    return cublasGemmStridedBatchedEx(
+        _hd, CUBLAS_OP_N, CUBLAS_OP_N, _tw._dim_per_head, _batch_seq_len,
+        _batch_seq_len, &_fone, _p_d_v, _AType, _tw._dim_per_head,
+        _batch_seq_len * _tw._dim_per_head, _p_d_c, _BType, _batch_seq_len,
+        _batch_seq_len * _batch_seq_len, &_fzero, _p_d_q, _CType,
+        _tw._dim_per_head, _batch_seq_len * _tw._dim_per_head,
+        _batch_size * _tw._head_num, _computeType, algo);
+  };
+  if (tune_attn_gemm) {
+    _attn_value_algo = tune_gemm(value_gemm);
+    _attn_gemm_algos[gemm_shape] = {_attn_score_algo, _attn_value_algo};
+  }
+  CHECK_GPU_ERROR(value_gemm(_attn_value_algo));
   // use v to save reshaped q, since they are in same size and v
   // will not be use again before the next multi-head-attention
   ker_arrange_atten_output_launcher<_DataType>(
@@ -241,6 +462,7 @@ void VitEncoder<OpType_>::self_attention() {
 
 template <OperationType OpType_>
 void VitEncoder<OpType_>::ffn_add_norm() {
+  LS_NVTX_RANGE("VitEncoder::ffn_add_norm");
   /* ---step 0. layer_norm, add output_bias to "query"--- */
   ker_norm_layer_resual_launcher<_DataType>(
       _batch_token_num, _tw._hidden_size, _stream, _p_d_output, _p_d_ffn_buf1,
@@ -10,7 +10,10 @@
 #include <chrono>
 #include <cmath>
 #include <iostream>
+#include <functional>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "../proto/vit_weight.h"
 #include "../tools/util.h"
@@ -37,6 +40,12 @@ class VitEncoder {
   // private member function
   void self_attention();
   void ffn_add_norm();
+  void patch_emb();
+  void merge_tokens();
+  void forward();
+  long shared_buffer_bytesize();
+  cublasGemmAlgo_t tune_gemm(
+      const std::function<cublasStatus_t(cublasGemmAlgo_t)> &gemm);
 
   const int _max_batch_size;
   int *_p_d_padding_mask;  // true sequence length(remove padding), [batch_size]
@@ -57,6 +66,17 @@ class VitEncoder {
   _DataType *_p_d_c;
   _DataType *_p_d_ffn_buf1;
   _DataType *_p_d_ffn_buf2;
+  _DataType *_p_d_patches;
+
+  // {pixel_scale, pixel_shift} of uint8 pixels, see launch_patch_im2col
+  thrust::device_vector<float> _d_pixel_norm;
+  // the fastest algos of the attention score and value gemms, by batch size
+  // and sequence length. The sequence lengths of the layers are fixed, so
+  // each batch size is a few gemm shapes, tuned at its first inference.
+  std::unordered_map<int64_t, std::pair<cublasGemmAlgo_t, cublasGemmAlgo_t>>
+      _attn_gemm_algos;
+  cublasGemmAlgo_t _attn_score_algo;
+  cublasGemmAlgo_t _attn_value_algo;
 
   // {conv_weight, conv_bias, pos_emb, cls_embedding}
   const std::vector<const _DataType *> &_p_d_src_emb_wei;
@@ -73,9 +93,30 @@ class VitEncoder {
   int _layer_id;
   int _weight_offset;
 
+  // token merging of LIGHTSEQ_VIT_TOKEN_MERGE, the tokens merged away after
+  // the self attention of every layer, see merge_tokens
+  std::vector<int> _merge_num;
+  int _out_seq_len;
+  float *_p_d_merge_metric;
+  float *_p_d_merge_score;
+  int *_p_d_merge_match;
+  int *_p_d_merge_offsets;
+  int *_p_d_merge_tokens;
+  // the number of tokens each token is merged from, of the last two merges
+  float *_p_d_token_size[2];
+  // the one of the last merge, -1 before the first
+  int _token_size_id;
+
+  // graphs of forward() by batch size and io pointers, enabled by
+  // LIGHTSEQ_CUDA_GRAPHS=<max graphs>
+  CudaGraphCache _graphs;
+
  public:
   const float *_p_d_pixel_input;  // input pixels [batch_size, channel_input,
                                   // image_size, image_size]
+  // uint8 input pixels [batch_size, image_size, image_size, channel_input],
+  // used instead of _p_d_pixel_input when not null
+  const uint8_t *_p_d_pixel_uint8 = nullptr;
   _DataType
       *_p_d_output;  // encoder output, [batch_size, batch_seq_len, hidden_size]
 
@@ -87,6 +128,9 @@ class VitEncoder {
   void init_buffer(void *pbuf);
   std::string check();
   void run_one_infer(int batch_size);
+  // the sequence length of the output, shorter than max_step with token
+  // merging
+  int output_seq_len() const { return _out_seq_len; }
 };
 
 }  // namespace cuda
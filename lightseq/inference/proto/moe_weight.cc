@@ -349,13 +349,15 @@ std::string MoeWeight<OpType_>::proto_parse_enc_wei(const Moe &moe) {
       if (_is_moe_layer_encoder[layer_id]) {
         if (enc_layer.gate_kernel_size() != _hidden_size * _expert_num_encoder)
           return "Wrong gate_kernel_size !";
-        for (float ele : enc_layer.gate_kernel()) value.push_back(ele);
+        for (float ele : enc_layer.gate_kernel()) value_gate.push_back(ele);
         offset_gate.push_back(idx_gate);
         idx_gate += _hidden_size * _expert_num_encoder;
       }
     }
   }  // for
 
+  shard_expert_wei(value, offset, idx, _weight_per_enc_layer, 8,
+                   _is_moe_layer_encoder, _expert_num_encoder);
   std::vector<_DataType> raw_value;
   for (float e : value) raw_value.push_back(float2required(e));
   _d_enc_wei = raw_value;
@@ -539,13 +541,15 @@ std::string MoeWeight<OpType_>::proto_parse_dec_wei(const Moe &moe) {
       if (_is_moe_layer_decoder[layer_id]) {
         if (dec_layer.gate_kernel_size() != _hidden_size * _expert_num_decoder)
           return "Wrong gate_kernel_size !";
-        for (float ele : dec_layer.gate_kernel()) value.push_back(ele);
+        for (float ele : dec_layer.gate_kernel()) value_gate.push_back(ele);
         offset_gate.push_back(idx_gate);
         idx_gate += _hidden_size * _expert_num_decoder;
       }
     }
   }  // for
 
+  shard_expert_wei(value, offset, idx, _weight_per_dec_layer, 14,
+                   _is_moe_layer_decoder, _expert_num_decoder);
   std::vector<_DataType> raw_value;
   for (float e : value) raw_value.push_back(float2required(e));
   _d_dec_wei = raw_value;
@@ -1017,6 +1021,8 @@ void MoeWeight<OpType_>::hdf5_parse_enc_wei(hid_t hdf5_file) {
     }
   }
 
+  shard_expert_wei(value, offset, idx, _weight_per_enc_layer, 8,
+                   _is_moe_layer_encoder, _expert_num_encoder);
   std::vector<_DataType> raw_value;
   raw_value.reserve(value.size());
   for (float e : value) raw_value.push_back(float2required(e));
@@ -1249,6 +1255,8 @@ void MoeWeight<OpType_>::hdf5_parse_dec_wei(hid_t hdf5_file) {
     }
   }
 
+  shard_expert_wei(value, offset, idx, _weight_per_dec_layer, 14,
+                   _is_moe_layer_decoder, _expert_num_decoder);
   std::vector<_DataType> raw_value;
   raw_value.reserve(value.size());
   for (float e : value) raw_value.push_back(float2required(e));
@@ -1271,6 +1279,41 @@ void MoeWeight<OpType_>::hdf5_parse_dec_wei(hid_t hdf5_file) {
   std::cout << "Finish loading dec_wei from host to device" << std::endl;
 }
 
+/**
+With expert parallelism, keep the first ffn kernel and bias and the second
+ffn kernel of the local experts of every MoE layer only. The second ffn bias
+is kept whole, it is added by the rank which owns the token.
+*/
+template <OperationType OpType_>
+void MoeWeight<OpType_>::shard_expert_wei(
+    std::vector<float> &value, std::vector<int> &offset, int end,
+    int weight_per_layer, int ffn_first_kernel_idx,
+    const std::vector<bool> &is_moe_layer, int expert_num) {
+  if (_ep_size == 1) return;
+  if (expert_num % _ep_size != 0) {
+    throw std::runtime_error("expert num " + std::to_string(expert_num) +
+                             " can not be split to " +
+                             std::to_string(_ep_size) + " ranks");
+  }
+  std::vector<float> local_value;
+  std::vector<int> local_offset;
+  for (int i = 0; i < offset.size(); i++) {
+    int begin = offset[i];
+    int size = (i + 1 < offset.size() ? offset[i + 1] : end) - begin;
+    int wei_id = i % weight_per_layer;
+    if (is_moe_layer[i / weight_per_layer] && wei_id >= ffn_first_kernel_idx &&
+        wei_id < ffn_first_kernel_idx + 3) {
+      size /= _ep_size;
+      begin += _ep_rank * size;
+    }
+    local_offset.push_back(local_value.size());
+    local_value.insert(local_value.end(), value.begin() + begin,
+                       value.begin() + begin + size);
+  }
+  value.swap(local_value);
+  offset.swap(local_offset);
+}
+
 /**
 Load the proto file into CPU memory and parse it.
 */
@@ -42,6 +42,10 @@ class MoeWeight {
   void hdf5_parse_enc_wei(hid_t hdf5_file);
   void hdf5_parse_dec_wei(hid_t hdf5_file);
 
+  void shard_expert_wei(std::vector<float> &value, std::vector<int> &offset,
+                        int end, int weight_per_layer, int ffn_first_kernel_idx,
+                        const std::vector<bool> &is_moe_layer, int expert_num);
+
   // store the weights pointer
   std::vector<const _DataType *> _p_d_src_emb_wei;  // size: 4
   std::vector<const _DataType *> _p_d_trg_emb_wei;  // size: 4
@@ -146,6 +150,15 @@ class MoeWeight {
   std::map<int, int> lang2gate;
   int _gate_type;
 
+  // expert parallelism, see model/moe_expert_parallel.h. must be set before
+  // initializing, only the ffn weights of the local experts are loaded.
+  int _ep_rank = 0;
+  int _ep_size = 1;
+  void set_expert_parallel(int ep_rank, int ep_size) {
+    _ep_rank = ep_rank;
+    _ep_size = ep_size;
+  }
+
   void print_model_config() {
     std::cout << "***model config***" << std::endl;
     std::cout << "encoder layers: " << _n_enc_layer << std::endl;
@@ -180,6 +193,7 @@ class MoeWeight {
     std::cout << "decoder moe topk:" << _moe_topk_decoder << std::endl;
     std::cout << "encoder moe layers:" << _n_moelayer_encoder << std::endl;
     std::cout << "decoder moe layers:" << _n_moelayer_decoder << std::endl;
+    std::cout << "expert parallel size:" << _ep_size << std::endl;
   }
 };
 
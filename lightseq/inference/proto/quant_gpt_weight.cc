@@ -304,6 +304,19 @@ void QuantGptWeight<OpType_>::hdf5_get_model_config(hid_t hdf5_file) {
   if (_eos_id_read != 0) {
     _eos_id = _eos_id_read;
   }
+
+  try {
+    char layout_buf[32];
+    int layout_strlen = read_hdf5_dataset_data(
+        hdf5_file, "model_conf/int8_weight_layout", H5T_NATIVE_CHAR,
+        layout_buf, [](int size) { return size > 32; },
+        "Expect model_conf/int8_weight_layout to have less than 32 "
+        "characters.");
+    _int8_weight_layout = std::string(layout_buf, layout_strlen);
+  } catch (HDF5DatasetNotFoundError &e) {
+    // kernels of uint8, quantized at load
+    _int8_weight_layout = "";
+  }
 }
 
 /**
@@ -380,16 +393,52 @@ void QuantGptWeight<OpType_>::hdf5_parse_enc_wei(hid_t hdf5_file) {
        _hidden_size * _inner_size + _inner_size + _hidden_size * _inner_size +
        _hidden_size) *
       _n_enc_layer;
-  std::vector<int> offset;
+  // the kernels prepacked at export are read as is, see
+  // get_enc_packed_kernels.
+  bool packed = !_int8_weight_layout.empty();
+  size_t kernel_size =
+      (_hidden_size * _hidden_size * 4 + _hidden_size * _inner_size * 2) *
+      _n_enc_layer;
+  if (packed) {
+    value_size -= kernel_size;
+    _d_enc_packed_kernels.resize(kernel_size);
+  }
+  std::vector<int> offset, packed_offset;
   std::vector<float> value(value_size);
-  std::vector<unsigned char> value_i8(value_size);
+  std::vector<unsigned char> value_i8(packed ? 0 : value_size);
   std::cout << "loading " << value_size * sizeof(OpType_) / (1024 * 1024)
             << " MB of encoder weight." << std::endl;
 
   float clip_max;
-  int idx = 0;
+  int idx = 0, packed_idx = 0;
   for (int layer_id = 0; layer_id < _n_enc_layer; ++layer_id) {
     std::string dataset_prefix = "encoder_stack/" + std::to_string(layer_id);
+    auto read_kernel = [&](const std::string &name, int size) {
+      std::string dataset = dataset_prefix + "/" + name;
+      if (packed) {
+        offset.push_back(-1);
+        packed_offset.push_back(packed_idx);
+        read_hdf5_dataset_data(
+            hdf5_file, dataset, H5T_NATIVE_SCHAR,
+            _d_enc_packed_kernels.data() + packed_idx,
+            [=](int read_size) { return read_size != size; },
+            "Wrong " + name + "_size !");
+        packed_idx += size;
+      } else {
+        offset.push_back(idx);
+        read_hdf5_dataset_data(
+            hdf5_file, dataset, H5T_NATIVE_UCHAR, value_i8.data() + idx,
+            [=](int read_size) { return read_size != size; },
+            "Wrong " + name + "_size !");
+      }
+      read_hdf5_dataset_scalar(hdf5_file, dataset + "_clip_max",
+                               H5T_NATIVE_FLOAT, &clip_max);
+      if (!packed) {
+        dequantize_array(value_i8, value, clip_max, _quant_range, idx, size);
+        idx += size;
+      }
+      _enc_clip_max.push_back(clip_max);
+    };
 
     offset.push_back(idx);
     read_hdf5_dataset_data(
@@ -405,19 +454,8 @@ void QuantGptWeight<OpType_>::hdf5_parse_enc_wei(hid_t hdf5_file) {
         "Wrong multihead_norm_bias_size !");
     idx += _hidden_size;
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/multihead_project_kernel_qkv",
-        H5T_NATIVE_UCHAR, value_i8.data() + idx,
-        [=](int size) { return size != _hidden_size * _hidden_size * 3; },
-        "Wrong multihead_project_kernel_qkv_size !");
-    read_hdf5_dataset_scalar(
-        hdf5_file, dataset_prefix + "/multihead_project_kernel_qkv_clip_max",
-        H5T_NATIVE_FLOAT, &clip_max);
-    dequantize_array(value_i8, value, clip_max, _quant_range, idx,
-                     _hidden_size * _hidden_size * 3);
-    _enc_clip_max.push_back(clip_max);
-    idx += _hidden_size * _hidden_size * 3;
+    read_kernel("multihead_project_kernel_qkv",
+                _hidden_size * _hidden_size * 3);
 
     offset.push_back(idx);
     read_hdf5_dataset_data(
@@ -427,19 +465,7 @@ void QuantGptWeight<OpType_>::hdf5_parse_enc_wei(hid_t hdf5_file) {
         "Wrong multihead_project_bias_qkv_size !");
     idx += _hidden_size * 3;
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/multihead_project_kernel_output",
-        H5T_NATIVE_UCHAR, value_i8.data() + idx,
-        [=](int size) { return size != _hidden_size * _hidden_size; },
-        "Wrong multihead_project_kernel_output_size !");
-    read_hdf5_dataset_scalar(
-        hdf5_file, dataset_prefix + "/multihead_project_kernel_output_clip_max",
-        H5T_NATIVE_FLOAT, &clip_max);
-    dequantize_array(value_i8, value, clip_max, _quant_range, idx,
-                     _hidden_size * _hidden_size);
-    _enc_clip_max.push_back(clip_max);
-    idx += _hidden_size * _hidden_size;
+    read_kernel("multihead_project_kernel_output", _hidden_size * _hidden_size);
 
     offset.push_back(idx);
     read_hdf5_dataset_data(
@@ -463,19 +489,7 @@ void QuantGptWeight<OpType_>::hdf5_parse_enc_wei(hid_t hdf5_file) {
         "Wrong ffn_norm_bias_size !");
     idx += _hidden_size;
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/ffn_first_kernel", H5T_NATIVE_UCHAR,
-        value_i8.data() + idx,
-        [=](int size) { return size != _hidden_size * _inner_size; },
-        "Wrong ffn_first_kernel_size !");
-    read_hdf5_dataset_scalar(hdf5_file,
-                             dataset_prefix + "/ffn_first_kernel_clip_max",
-                             H5T_NATIVE_FLOAT, &clip_max);
-    dequantize_array(value_i8, value, clip_max, _quant_range, idx,
-                     _hidden_size * _inner_size);
-    _enc_clip_max.push_back(clip_max);
-    idx += _hidden_size * _inner_size;
+    read_kernel("ffn_first_kernel", _hidden_size * _inner_size);
 
     offset.push_back(idx);
     read_hdf5_dataset_data(
@@ -484,19 +498,7 @@ void QuantGptWeight<OpType_>::hdf5_parse_enc_wei(hid_t hdf5_file) {
         "Wrong ffn_first_bias_size !");
     idx += _inner_size;
 
-    offset.push_back(idx);
-    read_hdf5_dataset_data(
-        hdf5_file, dataset_prefix + "/ffn_second_kernel", H5T_NATIVE_UCHAR,
-        value_i8.data() + idx,
-        [=](int size) { return size != _hidden_size * _inner_size; },
-        "Wrong ffn_second_kernel_size !");
-    read_hdf5_dataset_scalar(hdf5_file,
-                             dataset_prefix + "/ffn_second_kernel_clip_max",
-                             H5T_NATIVE_FLOAT, &clip_max);
-    dequantize_array(value_i8, value, clip_max, _quant_range, idx,
-                     _hidden_size * _inner_size);
-    _enc_clip_max.push_back(clip_max);
-    idx += _hidden_size * _inner_size;
+    read_kernel("ffn_second_kernel", _hidden_size * _inner_size);
 
     offset.push_back(idx);
     read_hdf5_dataset_data(
@@ -542,7 +544,12 @@ void QuantGptWeight<OpType_>::hdf5_parse_enc_wei(hid_t hdf5_file) {
   for (float e : value) raw_value.push_back(float2required(e));
   _d_enc_wei = raw_value;
 
-  for (int e : offset) _p_d_enc_wei.push_back(_d_enc_wei.data() + e);
+  for (int e : offset) {
+    _p_d_enc_wei.push_back(e < 0 ? nullptr : _d_enc_wei.data() + e);
+  }
+  for (int e : packed_offset) {
+    _p_d_enc_packed_kernels.push_back(_d_enc_packed_kernels.data() + e);
+  }
   std::cout << "finish initializing enc_wei from host to device" << std::endl;
 }
 
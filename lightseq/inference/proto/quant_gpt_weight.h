@@ -52,6 +52,11 @@ class QuantGptWeight {
   float _logits_clip_max;
   std::vector<float> _enc_clip_max;  // size: 11 * enc_layer_num
 
+  // the int8 kernels prepacked at export, see get_enc_packed_kernels.
+  std::string _int8_weight_layout;
+  std::vector<int8_t> _d_enc_packed_kernels;
+  std::vector<const int8_t *> _p_d_enc_packed_kernels;
+
  public:
   std::string initializing(std::string weight_path);
 
@@ -77,6 +82,20 @@ class QuantGptWeight {
 
   std::vector<float> get_enc_clip_max() const { return _enc_clip_max; }
 
+  // {multihead_qkv_kernel, multihead_output_kernel, ffn_first_kernel,
+  // ffn_second_kernel} * encoder_layer_num of int8 in the layouts of
+  // get_int8_weight_layout, which QuantGptEncoder copies as is. Empty unless
+  // the hdf5 file has model_conf/int8_weight_layout, see
+  // pack_ls_quant_encoder, in which case the kernels of get_enc_wei are null.
+  const std::vector<const int8_t *> &get_enc_packed_kernels() const {
+    return _p_d_enc_packed_kernels;
+  }
+
+  // "col" for gpus of sm 80 and above, "col4_4r2_8c" before them.
+  const std::string &get_int8_weight_layout() const {
+    return _int8_weight_layout;
+  }
+
   const float _quant_range = 127;
 
   int _hidden_size;
@@ -178,6 +178,11 @@ std::string TransformerWeight<OpType_>::proto_parse_emb_wei(
       _d_trg_lang_emb = raw_value;
       _p_d_trg_emb_wei.push_back(
           thrust::raw_pointer_cast(_d_trg_lang_emb.data()));
+      if (layer.lang_vocab_mask_size() % vocab_size != 0) {
+        return "Wrong lang_vocab_mask_size !";
+      }
+      _trg_lang_vocab_mask.assign(layer.lang_vocab_mask().begin(),
+                                  layer.lang_vocab_mask().end());
     }
 
     std::cout << "Finish loading multi lingual weights from host to device"
@@ -670,6 +675,16 @@ void TransformerWeight<OpType_>::hdf5_parse_emb_wei(hid_t hdf5_file,
       _d_trg_lang_emb = raw_value;
       _p_d_trg_emb_wei.push_back(
           thrust::raw_pointer_cast(_d_trg_lang_emb.data()));
+      try {
+        std::vector<int> lang_vocab_mask = read_hdf5_dataset_data_int(
+            hdf5_file, dataset_prefix + "/lang_vocab_mask", H5T_NATIVE_INT,
+            [=](int size) { return size <= 0 || size % vocab_size != 0; },
+            "Wrong lang_vocab_mask_size !");
+        _trg_lang_vocab_mask.assign(lang_vocab_mask.begin(),
+                                    lang_vocab_mask.end());
+      } catch (HDF5DatasetNotFoundError &e) {
+        // every language decodes the whole vocab
+      }
     }
 
     std::cout << "Finish loading multi lingual weights from host to device"
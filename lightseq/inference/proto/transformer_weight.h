@@ -116,6 +116,9 @@ class TransformerWeight {
   bool _no_scale_embedding;
   bool _use_gelu;
   int _multilg_type;
+  // [num_lang, trg_vocab_size] 0/1 mask of the tokens every target language
+  // decodes, empty if the multi lingual model has none
+  std::vector<int8_t> _trg_lang_vocab_mask;
 
   void print_model_config() {
     std::cout << "***model config***" << std::endl;
@@ -48,6 +48,12 @@ void VitWeight<OpType_>::proto_get_model_config(const Vit &vit) {
   _channel_input = vit.src_embedding().conv_weight_size() /
                    (_hidden_size * _patch_size * _patch_size);
   _is_post_ln = vit.model_conf().is_post_ln();
+  _image_mean.assign(vit.model_conf().image_mean().begin(),
+                     vit.model_conf().image_mean().end());
+  _image_std.assign(vit.model_conf().image_std().begin(),
+                    vit.model_conf().image_std().end());
+  if (_image_mean.empty()) _image_mean.assign(_channel_input, 0.5f);
+  if (_image_std.empty()) _image_std.assign(_channel_input, 0.5f);
 }
 
 /**
@@ -245,6 +251,23 @@ void VitWeight<OpType_>::hdf5_get_model_config(hid_t hdf5_file) {
   _channel_input =
       get_hdf5_dataset_size(hdf5_file, "src_embedding/conv_weight") /
       (_hidden_size * _patch_size * _patch_size);
+
+  auto size_predicate = [this](int size) { return size != _channel_input; };
+  try {
+    _image_mean = read_hdf5_dataset_data_float(
+        hdf5_file, "model_conf/image_mean", H5T_NATIVE_FLOAT, size_predicate,
+        "image_mean must have channel_input values");
+  } catch (HDF5DatasetNotFoundError &e) {
+    // default value of the HuggingFace ViT image processor
+    _image_mean.assign(_channel_input, 0.5f);
+  }
+  try {
+    _image_std = read_hdf5_dataset_data_float(
+        hdf5_file, "model_conf/image_std", H5T_NATIVE_FLOAT, size_predicate,
+        "image_std must have channel_input values");
+  } catch (HDF5DatasetNotFoundError &e) {
+    _image_std.assign(_channel_input, 0.5f);
+  }
 }
 
 /**
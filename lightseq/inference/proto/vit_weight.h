@@ -69,6 +69,9 @@ class VitWeight {
   int _image_size;
   int _patch_size;
   int _channel_input;
+  // the normalization of uint8 pixels, [channel_input]
+  std::vector<float> _image_mean;
+  std::vector<float> _image_std;
 
   int _head_num;
   bool _is_post_ln;
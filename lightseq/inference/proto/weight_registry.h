@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cuda_runtime.h>
+#include <stdlib.h>
+
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <typeindex>
+
+namespace lightseq {
+namespace cuda {
+
+/*
+The weights of the models in the process, by weight class, checkpoint and
+device, so that the instances of one checkpoint on one gpu, created for
+concurrency by LSModelFactory or the triton backend, share one read-only copy
+of the weights and only allocate their own buffers and caches. The weights are
+freed with the last model which holds them. LIGHTSEQ_SHARE_WEIGHTS=0 gives
+every model its own copy.
+*/
+class WeightRegistry {
+ public:
+  typedef std::tuple<std::type_index, std::string, int, std::string> Key;
+
+  static WeightRegistry &instance() {
+    static WeightRegistry registry;
+    return registry;
+  }
+
+  static bool enabled() {
+    const char *env = std::getenv("LIGHTSEQ_SHARE_WEIGHTS");
+    return env == nullptr || std::atoi(env) != 0;
+  }
+
+  // The weights of key, loaded by init, which returns an error message or
+  // an empty string, when no model holds them. Throws std::runtime_error
+  // with the message of init.
+  template <typename W, typename Init>
+  std::shared_ptr<W> acquire(const Key &key, Init init) {
+    // the loads are serialized, a second instance waits for the weights of
+    // the first instead of loading them again.
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto iter = _weights.find(key);
+    if (iter != _weights.end()) {
+      std::shared_ptr<void> weight = iter->second.lock();
+      if (weight) return std::static_pointer_cast<W>(weight);
+    }
+    std::shared_ptr<W> weight = std::make_shared<W>();
+    std::string res = init(*weight);
+    if (!res.empty()) {
+      throw std::runtime_error(res);
+    }
+    _weights[key] = weight;
+    return weight;
+  }
+
+ private:
+  std::mutex _mutex;
+  std::map<Key, std::weak_ptr<void>> _weights;
+};
+
+/*
+Set weight to the weights of weight_path on the current device, shared with
+the models of the same checkpoint, loaded by init(W &) when there are none.
+variant tells apart the copies of a checkpoint loaded with other options.
+*/
+template <typename W, typename Init>
+void acquire_weight(const std::string &weight_path, const std::string &variant,
+                    Init init, std::shared_ptr<W> *weight) {
+  if (!WeightRegistry::enabled()) {
+    *weight = std::make_shared<W>();
+    std::string res = init(**weight);
+    if (!res.empty()) {
+      throw std::runtime_error(res);
+    }
+    return;
+  }
+  int device = 0;
+  cudaGetDevice(&device);
+  std::string path = weight_path;
+  char *real_path = realpath(weight_path.c_str(), nullptr);
+  if (real_path != nullptr) {
+    path = real_path;
+    free(real_path);
+  }
+  WeightRegistry::Key key(std::type_index(typeid(W)), path, device, variant);
+  *weight = WeightRegistry::instance().acquire<W>(key, init);
+}
+
+template <typename W>
+void acquire_weight(const std::string &weight_path,
+                    std::shared_ptr<W> *weight) {
+  acquire_weight(
+      weight_path, "", [&](W &tw) { return tw.initializing(weight_path); },
+      weight);
+}
+
+}  // namespace cuda
+}  // namespace lightseq
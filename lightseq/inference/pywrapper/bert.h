@@ -2,6 +2,7 @@
 #include "model_base.h"
 #include "../model/bert_encoder.h"
 #include "../proto/bert_weight.h"
+#include "../proto/weight_registry.h"
 #include "../tools/util.h"
 
 #ifdef FP16_MODE
@@ -26,7 +27,8 @@ class Bert : public LSModel {
   cudaStream_t stream_;
   cublasHandle_t hd_;
   void *d_buf_;
-  BertWeight<bert_optype> tw_;
+  // shared with the models of the same checkpoint, see acquire_weight.
+  std::shared_ptr<BertWeight<bert_optype>> tw_;
 
  public:
   Bert(const std::string weight_path, const int max_batch_size);
@@ -40,6 +42,9 @@ class Bert : public LSModel {
   std::vector<int> get_input_max_shape(int index) override;
   std::vector<int> get_output_max_shape(int index) override;
   DataType get_input_dtype(int index) override;
+  int get_input_vocab_size(int index) override {
+    return index == 0 ? tw_->_src_vocab_size : 0;
+  }
   DataType get_output_dtype(int index) override;
   void benchmark_mode(bool is_benchmark) override{};
 };
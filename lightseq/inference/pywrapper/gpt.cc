@@ -1,3 +1,5 @@
+#include <numeric>
+
 #include "gpt.h"
 
 namespace lightseq {
@@ -19,10 +21,7 @@ Gpt::Gpt(const std::string weight_path, const int max_batch_size)
 
   // saved in custom proto file
   std::string model_weights_path = weight_path;
-  std::string res = tw_.initializing(model_weights_path);
-  if (!res.empty()) {
-    throw std::runtime_error(res);
-  }
+  acquire_weight(model_weights_path, &tw_);
 
   /*
     step3. instantiate gpt encoder, init the gpu memory buffer.
@@ -31,15 +30,22 @@ Gpt::Gpt(const std::string weight_path, const int max_batch_size)
 
   // register device memory for inputs and outputs
   CHECK_GPU_ERROR(
-      cudaMalloc(&d_input_, _max_batch_size * tw_._max_step * sizeof(int)));
+      cudaMalloc(&d_input_, _max_batch_size * tw_->_max_step * sizeof(int)));
   CHECK_GPU_ERROR(
-      cudaMalloc(&d_sample_id, _max_batch_size * tw_._max_step * sizeof(int)));
+      cudaMalloc(&d_sample_id, _max_batch_size * tw_->_max_step * sizeof(int)));
   CHECK_GPU_ERROR(cudaMalloc(&d_ppl, _max_batch_size * sizeof(float)));
+  int max_batch_tokens = _max_batch_size * tw_->_max_step;
+  CHECK_GPU_ERROR(
+      cudaMalloc(&d_score_row_src_, max_batch_tokens * sizeof(int)));
+  CHECK_GPU_ERROR(
+      cudaMalloc(&d_score_target_id_, max_batch_tokens * sizeof(int)));
+  CHECK_GPU_ERROR(
+      cudaMalloc(&d_score_log_prob_, max_batch_tokens * sizeof(float)));
 
   encoder_ = std::make_shared<GptEncoder<gpt_optype>>(
-      max_batch_size, d_input_, d_ppl, d_sample_id, tw_, stream_, cache_stream_,
-      hd_);
-  res = encoder_->check();
+      max_batch_size, d_input_, d_ppl, d_sample_id, *tw_, stream_,
+      cache_stream_, hd_);
+  std::string res = encoder_->check();
   if (!res.empty()) {
     throw std::runtime_error(res);
   }
@@ -58,6 +64,9 @@ Gpt::~Gpt() {
   CHECK_GPU_ERROR(cudaFree(d_input_));
   CHECK_GPU_ERROR(cudaFree(d_sample_id));
   CHECK_GPU_ERROR(cudaFree(d_ppl));
+  CHECK_GPU_ERROR(cudaFree(d_score_row_src_));
+  CHECK_GPU_ERROR(cudaFree(d_score_target_id_));
+  CHECK_GPU_ERROR(cudaFree(d_score_log_prob_));
   CHECK_GPU_ERROR(cudaFree(d_buf_));
   CHECK_GPU_ERROR(cudaStreamDestroy(stream_));
   CHECK_GPU_ERROR(cudaStreamDestroy(cache_stream_));
@@ -70,11 +79,12 @@ const float* Gpt::get_score_ptr() { return d_ppl; }
 void Gpt::Infer() {
   int batch_size = input_shapes_[0][0], seq_len = input_shapes_[0][1];
 
-  if (tw_._sampling_method == "ppl") {
+  if (tw_->_sampling_method == "ppl") {
     encoder_->run_one_infer(batch_size, seq_len);
     CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
     set_output_shape(0, {batch_size});
-  } else if (tw_._sampling_method == "topk" || tw_._sampling_method == "topp") {
+  } else if (tw_->_sampling_method == "topk" ||
+             tw_->_sampling_method == "topp") {
     int sampled_seq_len = encoder_->run_one_sample(batch_size, seq_len);
     CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
     set_output_shape(0, {batch_size, sampled_seq_len});
@@ -83,6 +93,80 @@ void Gpt::Infer() {
   }
 }
 
+void Gpt::score_packed(const int* tokens, const int* offsets, int num_seqs,
+                       float* ppl, float* token_log_probs) {
+  // longest first, so that the sequences batched together have close lengths
+  // and the encoder runs on little padding.
+  std::vector<int> order(num_seqs);
+  std::iota(order.begin(), order.end(), 0);
+  auto seq_len = [&](int seq) { return offsets[seq + 1] - offsets[seq]; };
+  std::stable_sort(order.begin(), order.end(),
+                   [&](int a, int b) { return seq_len(a) > seq_len(b); });
+  if (num_seqs > 0 &&
+      (seq_len(order.front()) > tw_->_max_step || seq_len(order.back()) < 1)) {
+    throw std::runtime_error("packed sequence length must be in [1, max_step]");
+  }
+  if (token_log_probs != nullptr && num_seqs > 0) {
+    std::fill(token_log_probs + offsets[0], token_log_probs + offsets[num_seqs],
+              0.f);
+  }
+
+  const int* input_ptr = encoder_->_p_d_token_id;
+  encoder_->_p_d_token_id = d_input_;
+  std::vector<int> h_tokens, h_row_src, h_target_id;
+  std::vector<float> h_log_prob;
+  for (int begin = 0; begin < num_seqs; begin += _max_batch_size) {
+    int batch_size = std::min(_max_batch_size, num_seqs - begin);
+    int batch_seq_len = seq_len(order[begin]);
+    // right padded, every token but the last one of a sequence predicts the
+    // next one.
+    h_tokens.assign(batch_size * batch_seq_len, tw_->_padding_id);
+    h_row_src.clear();
+    h_target_id.clear();
+    for (int i = 0; i < batch_size; i++) {
+      int seq = order[begin + i];
+      const int* seq_tokens = tokens + offsets[seq];
+      std::copy(seq_tokens, seq_tokens + seq_len(seq),
+                h_tokens.begin() + i * batch_seq_len);
+      for (int j = 0; j + 1 < seq_len(seq); j++) {
+        h_row_src.push_back(i * batch_seq_len + j);
+        h_target_id.push_back(seq_tokens[j + 1]);
+      }
+    }
+    int rows = h_row_src.size();
+    CHECK_GPU_ERROR(cudaMemcpyAsync(d_input_, h_tokens.data(),
+                                    h_tokens.size() * sizeof(int),
+                                    cudaMemcpyHostToDevice, stream_));
+    CHECK_GPU_ERROR(cudaMemcpyAsync(d_score_row_src_, h_row_src.data(),
+                                    rows * sizeof(int), cudaMemcpyHostToDevice,
+                                    stream_));
+    CHECK_GPU_ERROR(cudaMemcpyAsync(d_score_target_id_, h_target_id.data(),
+                                    rows * sizeof(int), cudaMemcpyHostToDevice,
+                                    stream_));
+    encoder_->run_packed_ppl(batch_size, batch_seq_len, rows, d_score_row_src_,
+                             d_score_target_id_, d_score_log_prob_);
+    h_log_prob.resize(rows);
+    CHECK_GPU_ERROR(cudaMemcpyAsync(h_log_prob.data(), d_score_log_prob_,
+                                    rows * sizeof(float),
+                                    cudaMemcpyDeviceToHost, stream_));
+    CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
+
+    int row = 0;
+    for (int i = 0; i < batch_size; i++) {
+      int seq = order[begin + i];
+      double sum_log_prob = 0;
+      for (int j = 1; j < seq_len(seq); j++, row++) {
+        sum_log_prob += h_log_prob[row];
+        if (token_log_probs != nullptr) {
+          token_log_probs[offsets[seq] + j] = h_log_prob[row];
+        }
+      }
+      ppl[seq] = seq_len(seq) > 1 ? -sum_log_prob / (seq_len(seq) - 1) : 0.f;
+    }
+  }
+  encoder_->_p_d_token_id = input_ptr;
+}
+
 void Gpt::set_input_ptr(int index, void* input_ptr) {
   switch (index) {
     case 0:
@@ -98,11 +182,11 @@ void Gpt::set_input_ptr(int index, void* input_ptr) {
 void Gpt::set_output_ptr(int index, void* output_ptr) {
   switch (index) {
     case 0:
-      if (tw_._sampling_method == "ppl") {
+      if (tw_->_sampling_method == "ppl") {
         encoder_->_p_d_ppl = static_cast<float*>(output_ptr);
         break;
-      } else if (tw_._sampling_method == "topk" ||
-                 tw_._sampling_method == "topp") {
+      } else if (tw_->_sampling_method == "topk" ||
+                 tw_->_sampling_method == "topp") {
         encoder_->_p_d_sample_id = static_cast<int*>(output_ptr);
         break;
 
@@ -120,11 +204,11 @@ void Gpt::set_output_ptr(int index, void* output_ptr) {
 const void* Gpt::get_output_ptr(int index) {
   switch (index) {
     case 0:
-      if (tw_._sampling_method == "ppl") {
+      if (tw_->_sampling_method == "ppl") {
         return static_cast<void*>(encoder_->_p_d_ppl);
         break;
-      } else if (tw_._sampling_method == "topk" ||
-                 tw_._sampling_method == "topp") {
+      } else if (tw_->_sampling_method == "topk" ||
+                 tw_->_sampling_method == "topp") {
         return static_cast<void*>(encoder_->_p_d_sample_id);
         break;
       } else {
@@ -141,7 +225,7 @@ const void* Gpt::get_output_ptr(int index) {
 std::vector<int> Gpt::get_input_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._max_step};
+      return {_max_batch_size, tw_->_max_step};
 
     default:
       throw std::runtime_error("invalid input index");
@@ -153,12 +237,12 @@ std::vector<int> Gpt::get_output_max_shape(int index) {
   switch (index) {
     case 0:
 
-      if (tw_._sampling_method == "ppl") {
+      if (tw_->_sampling_method == "ppl") {
         return {_max_batch_size};
         break;
-      } else if (tw_._sampling_method == "topk" ||
-                 tw_._sampling_method == "topp") {
-        return {_max_batch_size, tw_._max_step};
+      } else if (tw_->_sampling_method == "topk" ||
+                 tw_->_sampling_method == "topp") {
+        return {_max_batch_size, tw_->_max_step};
         break;
       } else {
         throw std::runtime_error("Unsupported sampling_method");
@@ -186,11 +270,11 @@ DataType Gpt::get_input_dtype(int index) {
 DataType Gpt::get_output_dtype(int index) {
   switch (index) {
     case 0:
-      if (tw_._sampling_method == "ppl") {
+      if (tw_->_sampling_method == "ppl") {
         return DataType::kFloat32;
         break;
-      } else if (tw_._sampling_method == "topk" ||
-                 tw_._sampling_method == "topp") {
+      } else if (tw_->_sampling_method == "topk" ||
+                 tw_->_sampling_method == "topp") {
         return DataType::kInt32;
         break;
       } else {
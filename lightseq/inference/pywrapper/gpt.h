@@ -2,6 +2,7 @@
 #include "model_base.h"
 #include "../model/gpt_encoder.h"
 #include "../proto/gpt_weight.h"
+#include "../proto/weight_registry.h"
 #include "../tools/util.h"
 
 #ifdef FP16_MODE
@@ -23,12 +24,18 @@ class Gpt : public LSModel {
   int* d_sample_id;
   float* d_ppl;
   void* d_buf_;
+  // see score_packed, the scored rows and target tokens of a batch and their
+  // log probs, [max_batch_size * max_step] each
+  int* d_score_row_src_;
+  int* d_score_target_id_;
+  float* d_score_log_prob_;
 
   int _max_batch_size;
   cudaStream_t stream_;
   cudaStream_t cache_stream_;
   cublasHandle_t hd_;
-  lightseq::cuda::GptWeight<gpt_optype> tw_;
+  // shared with the models of the same checkpoint, see acquire_weight.
+  std::shared_ptr<lightseq::cuda::GptWeight<gpt_optype>> tw_;
   std::set<std::string> available_sampling_methods = {"topk", "topp"};
 
  public:
@@ -47,8 +54,17 @@ class Gpt : public LSModel {
   std::vector<int> get_input_max_shape(int index) override;
   std::vector<int> get_output_max_shape(int index) override;
   DataType get_input_dtype(int index) override;
+  int get_input_vocab_size(int index) override {
+    return index == 0 ? tw_->_src_vocab_size : 0;
+  }
   DataType get_output_dtype(int index) override;
   void benchmark_mode(bool is_benchmark) override;
+  void score_packed(const int* tokens, const int* offsets, int num_seqs,
+                    float* ppl, float* token_log_probs) override;
+  void set_token_callback(
+      std::function<void(int, const std::vector<int>&)> callback) override {
+    encoder_->_token_callback = callback;
+  }
 };
 
 LSMODEL_REGISTER(Gpt);
@@ -1,8 +1,10 @@
 #ifndef MODEL_BASE_H
 #define MODEL_BASE_H
 
+#include <functional>
 #include <iostream>
 #include <map>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -77,6 +79,9 @@ class LSModel {
   std::string get_input_name(int index) { return kInputNames[index]; }
   int get_input_size() { return kInputNames.size(); }
   virtual DataType get_input_dtype(int index) = 0;
+  // the ids of token input index are in [0, vocab size), 0 if unknown or
+  // the input is not tokens
+  virtual int get_input_vocab_size(int index) { return 0; }
 
   // output getter and setter
   virtual void set_output_ptr(int index, void* output_ptr) = 0;
@@ -89,6 +94,44 @@ class LSModel {
 
   virtual void benchmark_mode(bool is_benchmark) = 0;
 
+  // hits and misses of the cache of repeated inputs, zero without one
+  virtual long get_cache_hits() { return 0; }
+  virtual long get_cache_misses() { return 0; }
+
+  // Constrained decoding: the following Infer calls only score and sample the
+  // vocab ids of tokens, the whole vocab again if tokens is empty. Not
+  // supported by every model.
+  virtual void set_vocab_shortlist(const std::vector<int>& tokens) {
+    throw std::runtime_error("vocab shortlist is not supported");
+  }
+
+  // Streaming output: during the following Infer calls, callback gets the
+  // step (counted from 0 after the prompt) and the token of every sequence
+  // of the batch at this step, right after the step is sampled. Steps after
+  // a sequence finished carry eos. An empty callback turns it off. Not
+  // supported by every model.
+  virtual void set_token_callback(
+      std::function<void(int, const std::vector<int>&)> callback) {
+    throw std::runtime_error("streaming output is not supported");
+  }
+
+  // Cancel the row of the batch of the running Infer, from any thread: it
+  // is finished at the next decoding step, so that Infer returns once the
+  // other rows finish, at once if every row is cancelled. Ignored by the
+  // models which do not support it.
+  virtual void cancel_row(int row) {}
+
+  // Packed scoring: sequence i of the num_seqs ones is tokens[offsets[i],
+  // offsets[i + 1]), without padding. ppl[i] is the mean negative log prob of
+  // its tokens after the first, as the ppl sampling method. token_log_probs,
+  // if not null, gets the log prob of every token given its prefix, 0 for
+  // the first token of a sequence. Host pointers, not supported by every
+  // model.
+  virtual void score_packed(const int* tokens, const int* offsets,
+                            int num_seqs, float* ppl, float* token_log_probs) {
+    throw std::runtime_error("packed scoring is not supported");
+  }
+
  protected:
   void set_output_shape(int index, std::vector<int> shape) {
     output_shapes_.at(index) = std::move(shape);
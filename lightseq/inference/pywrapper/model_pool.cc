@@ -0,0 +1,205 @@
+#include "model_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <numeric>
+#include <thread>
+
+#include "../tools/util.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+size_t dtype_bytes(DataType dtype) {
+  switch (dtype) {
+    case kFloat32:
+    case kInt32:
+      return 4;
+    case kFloat16:
+      return 2;
+    case kInt8:
+    case kByte:
+    case kUInt8:
+      return 1;
+    default:
+      throw std::runtime_error("Not supported data type of ModelPool");
+  }
+}
+
+size_t shape_size(const std::vector<int>& shape) {
+  return std::accumulate(shape.begin(), shape.end(), (size_t)1,
+                         std::multiplies<size_t>());
+}
+
+}  // namespace
+
+ModelPool::ModelPool(const std::string& model_name,
+                     const std::string& weight_path, int max_batch_size,
+                     const std::vector<int>& devices)
+    : max_batch_size_(max_batch_size) {
+  if (devices.empty()) {
+    throw std::invalid_argument("ModelPool needs at least one device");
+  }
+  for (int device : devices) {
+    CHECK_GPU_ERROR(cudaSetDevice(device));
+    Replica replica;
+    replica.device = device;
+    replica.model = LSModelFactory::GetInstance().CreateModel(
+        model_name, weight_path, max_batch_size);
+    if (replica.model->get_input_size() != 1) {
+      throw std::invalid_argument("ModelPool only supports one input");
+    }
+    CHECK_GPU_ERROR(cudaStreamCreate(&replica.stream));
+
+    input_dtype_ = replica.model->get_input_dtype(0);
+    size_t input_bytes = dtype_bytes(input_dtype_) *
+                         shape_size(replica.model->get_input_max_shape(0));
+    CHECK_GPU_ERROR(cudaMalloc(&replica.d_input, input_bytes));
+    CHECK_GPU_ERROR(cudaMallocHost(&replica.h_input, input_bytes));
+
+    output_dtypes_.clear();
+    for (int i = 0; i < replica.model->get_output_size(); i++) {
+      output_dtypes_.push_back(replica.model->get_output_dtype(i));
+      size_t output_bytes =
+          dtype_bytes(output_dtypes_[i]) *
+          shape_size(replica.model->get_output_max_shape(i));
+      void *d_output, *h_output;
+      CHECK_GPU_ERROR(cudaMalloc(&d_output, output_bytes));
+      CHECK_GPU_ERROR(cudaMallocHost(&h_output, output_bytes));
+      replica.model->set_output_ptr(i, d_output);
+      replica.d_outputs.push_back(d_output);
+      replica.h_outputs.push_back(h_output);
+    }
+    replicas_.push_back(replica);
+  }
+  output_shapes_.resize(output_dtypes_.size());
+  outputs_.resize(output_dtypes_.size());
+}
+
+ModelPool::~ModelPool() {
+  for (Replica& replica : replicas_) {
+    CHECK_GPU_ERROR(cudaSetDevice(replica.device));
+    delete replica.model;
+    CHECK_GPU_ERROR(cudaFree(replica.d_input));
+    CHECK_GPU_ERROR(cudaFreeHost(replica.h_input));
+    for (int i = 0; i < replica.d_outputs.size(); i++) {
+      CHECK_GPU_ERROR(cudaFree(replica.d_outputs[i]));
+      CHECK_GPU_ERROR(cudaFreeHost(replica.h_outputs[i]));
+    }
+    CHECK_GPU_ERROR(cudaStreamDestroy(replica.stream));
+  }
+}
+
+void ModelPool::Infer(const void* input, const std::vector<int>& input_shape) {
+  int batch_size = input_shape.at(0);
+  int replica_num = replicas_.size();
+  int shard_batch_size = (batch_size + replica_num - 1) / replica_num;
+  if (shard_batch_size > max_batch_size_) {
+    throw std::runtime_error(
+        "batch size of input greater than max_batch_size of all the devices");
+  }
+  size_t row_bytes = dtype_bytes(input_dtype_) * shape_size(input_shape) /
+                     std::max(batch_size, 1);
+
+  std::vector<int> shard_sizes;
+  std::vector<std::thread> threads;
+  std::vector<std::exception_ptr> errors(replica_num);
+  for (int begin = 0; begin < batch_size; begin += shard_batch_size) {
+    int shard_id = shard_sizes.size();
+    std::vector<int> shard_shape(input_shape);
+    shard_shape[0] = std::min(shard_batch_size, batch_size - begin);
+    shard_sizes.push_back(shard_shape[0]);
+    const char* shard_input =
+        static_cast<const char*>(input) + begin * row_bytes;
+    threads.emplace_back([this, shard_id, shard_input, shard_shape,
+                          &errors]() {
+      try {
+        run_shard(replicas_[shard_id], shard_input, shard_shape);
+      } catch (...) {
+        errors[shard_id] = std::current_exception();
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (std::exception_ptr& error : errors) {
+    if (error) std::rethrow_exception(error);
+  }
+
+  for (int i = 0; i < output_dtypes_.size(); i++) {
+    gather_output(i, shard_sizes);
+  }
+}
+
+void ModelPool::run_shard(Replica& replica, const char* input,
+                          const std::vector<int>& shard_shape) {
+  CHECK_GPU_ERROR(cudaSetDevice(replica.device));
+  size_t input_bytes = dtype_bytes(input_dtype_) * shape_size(shard_shape);
+  std::memcpy(replica.h_input, input, input_bytes);
+  CHECK_GPU_ERROR(cudaMemcpyAsync(replica.d_input, replica.h_input,
+                                  input_bytes, cudaMemcpyHostToDevice,
+                                  replica.stream));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(replica.stream));
+
+  replica.model->set_input_ptr(0, replica.d_input);
+  replica.model->set_input_shape(0, shard_shape);
+  // synchronizes the stream of the model
+  replica.model->Infer();
+
+  for (int i = 0; i < output_dtypes_.size(); i++) {
+    size_t output_bytes = dtype_bytes(output_dtypes_[i]) *
+                          shape_size(replica.model->get_output_shape(i));
+    CHECK_GPU_ERROR(cudaMemcpyAsync(replica.h_outputs[i],
+                                    replica.d_outputs[i], output_bytes,
+                                    cudaMemcpyDeviceToHost, replica.stream));
+  }
+  CHECK_GPU_ERROR(cudaStreamSynchronize(replica.stream));
+}
+
+void ModelPool::gather_output(int index, const std::vector<int>& shard_sizes) {
+  size_t elem_bytes = dtype_bytes(output_dtypes_[index]);
+  std::vector<int> shape = replicas_[0].model->get_output_shape(index);
+  shape[0] = 0;
+  for (int i = 0; i < shard_sizes.size(); i++) {
+    std::vector<int> shard_shape = replicas_[i].model->get_output_shape(index);
+    if (shard_shape.size() > 2 &&
+        !std::equal(shard_shape.begin() + 1, shard_shape.end() - 1,
+                    shape.begin() + 1)) {
+      throw std::runtime_error(
+          "output shapes of the shards only differ in the last dim");
+    }
+    shape[0] += shard_shape[0];
+    if (shape.size() > 1) {
+      shape.back() = std::max(shape.back(), shard_shape.back());
+    }
+  }
+  output_shapes_[index] = shape;
+  outputs_[index].resize(shape_size(shape) * elem_bytes);
+
+  size_t row_len = shape.size() > 1 ? shape.back() : 1;
+  char* dst = outputs_[index].data();
+  for (int i = 0; i < shard_sizes.size(); i++) {
+    std::vector<int> shard_shape = replicas_[i].model->get_output_shape(index);
+    size_t shard_row_len = shard_shape.size() > 1 ? shard_shape.back() : 1;
+    if (shard_row_len == 0) continue;
+    size_t row_num = shape_size(shard_shape) / shard_row_len;
+    const char* src = static_cast<const char*>(replicas_[i].h_outputs[index]);
+    for (size_t r = 0; r < row_num; r++) {
+      std::memcpy(dst, src, shard_row_len * elem_bytes);
+      for (size_t j = shard_row_len; j < row_len; j++) {
+        std::memcpy(dst + j * elem_bytes,
+                    dst + (shard_row_len - 1) * elem_bytes, elem_bytes);
+      }
+      dst += row_len * elem_bytes;
+      src += shard_row_len * elem_bytes;
+    }
+  }
+}
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include <string>
+#include <vector>
+
+#include "model_base.h"
+
+namespace lightseq {
+namespace cuda {
+
+/*
+Data parallel replicas of one LSModel on several GPUs of one process.
+Infer splits the batch of the input into one shard per device, which the
+replicas run concurrently from one thread per device, with their own stream
+and pinned staging buffers, and gathers the outputs in the batch order.
+
+The shards of a generation can decode to different lengths, the shorter
+outputs are padded along the last dim with their last element, which is the
+eos of a finished sequence.
+*/
+class ModelPool {
+ private:
+  struct Replica {
+    int device;
+    LSModel* model;
+    cudaStream_t stream;
+    void* d_input;
+    void* h_input;  // pinned
+    std::vector<void*> d_outputs;
+    std::vector<void*> h_outputs;  // pinned
+  };
+
+  std::vector<Replica> replicas_;
+  const int max_batch_size_;
+  DataType input_dtype_;
+  std::vector<DataType> output_dtypes_;
+  std::vector<std::vector<int>> output_shapes_;
+  std::vector<std::vector<char>> outputs_;
+
+  void run_shard(Replica& replica, const char* input,
+                 const std::vector<int>& shard_shape);
+  void gather_output(int index, const std::vector<int>& shard_sizes);
+
+ public:
+  // max_batch_size is the one of every replica
+  ModelPool(const std::string& model_name, const std::string& weight_path,
+            int max_batch_size, const std::vector<int>& devices);
+  ~ModelPool();
+
+  // input: [batch_size, ...] on host, batch_size is at most
+  // max_batch_size * device number
+  void Infer(const void* input, const std::vector<int>& input_shape);
+
+  DataType get_input_dtype() { return input_dtype_; }
+  int get_output_size() { return output_dtypes_.size(); }
+  DataType get_output_dtype(int index) { return output_dtypes_.at(index); }
+  // the outputs of the last Infer on host
+  std::vector<int> get_output_shape(int index) {
+    return output_shapes_.at(index);
+  }
+  const void* get_output_ptr(int index) { return outputs_.at(index).data(); }
+};
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -1,5 +1,7 @@
 #include "moe.h"
 
+#include <cstdlib>
+
 #include "embKernels.h"
 
 namespace lightseq {
@@ -12,6 +14,37 @@ Moe::Moe(const std::string weight_path, const int max_batch_size)
       decoder_(nullptr),
       _max_batch_size(max_batch_size) {
   /* ---step1. init environment--- */
+  // Expert parallelism runs one process per gpu, each on its own batch,
+  // configured from the environment, see moe_expert_parallel.h:
+  //   LIGHTSEQ_EP_SIZE  number of ranks the experts are sharded to, 1 or
+  //                     unset to disable
+  //   LIGHTSEQ_EP_RANK  rank of this process, which also picks its gpu
+  //   LIGHTSEQ_NCCL_ID_FILE  file shared by the ranks to exchange the nccl
+  //                          id, must be unique to the launch, required
+  //                          when LIGHTSEQ_EP_SIZE > 1
+  //   LIGHTSEQ_MOE_CAPACITY_FACTOR  slots of every expert relative to an
+  //                                 even routing, tokens beyond are dropped.
+  //                                 0 or unset to never drop, also works
+  //                                 without expert parallelism
+  const char *ep_size_env = std::getenv("LIGHTSEQ_EP_SIZE");
+  const char *ep_rank_env = std::getenv("LIGHTSEQ_EP_RANK");
+  const char *nccl_id_env = std::getenv("LIGHTSEQ_NCCL_ID_FILE");
+  const char *capacity_env = std::getenv("LIGHTSEQ_MOE_CAPACITY_FACTOR");
+  int ep_size = ep_size_env ? std::max(std::atoi(ep_size_env), 1) : 1;
+  int ep_rank = ep_rank_env ? std::atoi(ep_rank_env) : 0;
+  float capacity_factor = capacity_env ? std::atof(capacity_env) : 0.f;
+  if (ep_size > 1) {
+    if (nccl_id_env == nullptr || *nccl_id_env == 0) {
+      throw std::runtime_error(
+          "expert parallel needs LIGHTSEQ_NCCL_ID_FILE unique to the launch");
+    }
+    CHECK_GPU_ERROR(cudaSetDevice(ep_rank));
+  }
+  if (ep_size > 1 || capacity_factor > 0.f) {
+    ep_ = std::make_shared<MoeExpertParallel>(ep_rank, ep_size,
+                                              capacity_factor,
+                                              nccl_id_env ? nccl_id_env : "");
+  }
   CHECK_GPU_ERROR(cudaStreamCreate(&stream_));
   CHECK_GPU_ERROR(cublasCreate(&hd_));
   CHECK_GPU_ERROR(cublasSetStream(hd_, stream_));
@@ -20,28 +53,38 @@ Moe::Moe(const std::string weight_path, const int max_batch_size)
 
   // saved in custom proto file
   std::string model_weights_path = weight_path;
-  std::string res = tw_.initializing(model_weights_path, max_batch_size);
-  if (!res.empty()) {
-    throw std::runtime_error(res);
+  // the experts of a rank and the capacity of the batch are loaded with the
+  // weights.
+  bool split_experts = ep_size > 1 || capacity_factor > 0.f;
+  std::string variant = std::to_string(max_batch_size);
+  if (split_experts) {
+    variant += "/" + std::to_string(ep_rank) + "/" + std::to_string(ep_size);
   }
-
-  if (tw_._sampling_method == "topk" || tw_._sampling_method == "topp") {
-    tw_._beam_size = 1;
+  acquire_weight(
+      model_weights_path, variant,
+      [&](MoeWeight<moe_optytpe> &tw) {
+        if (split_experts) tw.set_expert_parallel(ep_rank, ep_size);
+        return tw.initializing(model_weights_path, max_batch_size);
+      },
+      &tw_);
+
+  if (tw_->_sampling_method == "topk" || tw_->_sampling_method == "topp") {
+    tw_->_beam_size = 1;
   }
-  tw_.print_model_config();
+  tw_->print_model_config();
 
   /*
     step3. instantiate encoder and decoder, init the gpu memory buffer.
       using thrust vector to avoid manage gpu memory by hand
   */
 
-  CHECK_GPU_ERROR(
-      cudaMalloc(&d_input_, _max_batch_size * tw_._max_step * sizeof(int32_t)));
   CHECK_GPU_ERROR(cudaMalloc(
-      &d_padding_mask_, _max_batch_size * tw_._max_step * sizeof(int32_t)));
+      &d_input_, _max_batch_size * tw_->_max_step * sizeof(int32_t)));
+  CHECK_GPU_ERROR(cudaMalloc(
+      &d_padding_mask_, _max_batch_size * tw_->_max_step * sizeof(int32_t)));
 
   CHECK_GPU_ERROR(cudaMalloc(
-      &d_encoder_output_, _max_batch_size * tw_._max_step * tw_._hidden_size *
+      &d_encoder_output_, _max_batch_size * tw_->_max_step * tw_->_hidden_size *
                               sizeof(optraits::DataType)));
   CHECK_GPU_ERROR(
       cudaMalloc(&d_src_lang_id_, _max_batch_size * sizeof(int32_t)));
@@ -49,16 +92,18 @@ Moe::Moe(const std::string weight_path, const int max_batch_size)
       cudaMalloc(&d_trg_lang_id_, _max_batch_size * sizeof(int32_t)));
 
   encoder_ = std::make_shared<MoeEncoder<moe_optytpe>>(
-      _max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, tw_,
+      _max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, *tw_,
       stream_, hd_, d_src_lang_id_);
-  res = encoder_->check();
+  encoder_->set_expert_parallel(ep_.get());
+  std::string res = encoder_->check();
   if (!res.empty()) {
     throw std::runtime_error(res);
   }
 
   decoder_ = std::make_shared<MoeDecoder<moe_optytpe>>(
-      _max_batch_size, d_padding_mask_, d_encoder_output_, d_output_, tw_,
+      _max_batch_size, d_padding_mask_, d_encoder_output_, d_output_, *tw_,
       stream_, hd_, true, d_trg_lang_id_);
+  decoder_->set_expert_parallel(ep_.get());
   res = decoder_->check();
   if (!res.empty()) {
     throw std::runtime_error(res);
@@ -76,7 +121,7 @@ Moe::Moe(const std::string weight_path, const int max_batch_size)
   CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
 
   // malloc memory for hard gates
-  if (tw_._gate_type == 1) {
+  if (tw_->_gate_type == 1) {
     CHECK_GPU_ERROR(
         cudaMalloc(&_p_d_hard_gates, 3 * _max_batch_size * sizeof(int)));
     h_hard_gates.resize(3 * _max_batch_size);
@@ -110,21 +155,21 @@ void Moe::Infer() {
   int batch_size = input_shapes_[0][0], seq_len = input_shapes_[0][1];
 
   // for multilg
-  if (tw_._multilg_type != 0) {
+  if (tw_->_multilg_type != 0) {
     // multilg request: src_lang_id, trg_lang_id, src_token0, src_token1...
     launch_split_multilg_request(encoder_->_p_d_token_id, d_src_lang_id_,
                                  d_trg_lang_id_, d_input_, batch_size, seq_len,
                                  stream_);
     encoder_->_p_d_token_id = d_input_;
-    if (tw_._multilg_type == 1) {
+    if (tw_->_multilg_type == 1) {
       seq_len -= 2;
     }
-    if (tw_._multilg_type == 2 || tw_._multilg_type == 3) {
+    if (tw_->_multilg_type == 2 || tw_->_multilg_type == 3) {
       seq_len -= 1;
     }
   }
 
-  if (tw_._gate_type == 1) {
+  if (tw_->_gate_type == 1) {
     // hard gate
     /**
       1. calculate gate according to lang_id
@@ -141,7 +186,7 @@ void Moe::Infer() {
   CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
 
   int output_seq_len = get_output_seq_len();
-  int beam_size = tw_._beam_size;
+  int beam_size = tw_->_beam_size;
   int output_k = decoder_->_output_topk ? beam_size : 1;
 
   set_output_shape(0, {batch_size, output_k, output_seq_len});
@@ -194,7 +239,7 @@ const void *Moe::get_output_ptr(int index) {
 std::vector<int> Moe::get_input_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._max_step};
+      return {_max_batch_size, tw_->_max_step};
       break;
 
     default:
@@ -206,11 +251,11 @@ std::vector<int> Moe::get_input_max_shape(int index) {
 std::vector<int> Moe::get_output_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._beam_size, tw_._max_step};
+      return {_max_batch_size, tw_->_beam_size, tw_->_max_step};
       break;
 
     case 1:
-      return {_max_batch_size, tw_._beam_size};
+      return {_max_batch_size, tw_->_beam_size};
       break;
 
     default:
@@ -259,9 +304,9 @@ void Moe::init_hard_gates() {
                              cudaMemcpyDeviceToHost));
 
   for (int i = 0; i < batch_size; i++) {
-    auto iter = tw_.lang2gate.find(h_lang_id[i]);
+    auto iter = tw_->lang2gate.find(h_lang_id[i]);
     int gate = -1;
-    if (iter != tw_.lang2gate.end()) {
+    if (iter != tw_->lang2gate.end()) {
       gate = iter->second;
       h_gate_sets.insert(gate);
     }
@@ -3,7 +3,9 @@
 #include "model_base.h"
 #include "../model/moe_decoder.h"
 #include "../model/moe_encoder.h"
+#include "../model/moe_expert_parallel.h"
 #include "../proto/moe_weight.h"
+#include "../proto/weight_registry.h"
 #include "../tools/util.h"
 
 #ifdef FP16_MODE
@@ -21,6 +23,7 @@ class Moe : public LSModel {
   typedef OperationTypeTraits<moe_optytpe> optraits;
   std::shared_ptr<MoeEncoder<moe_optytpe>> encoder_;
   std::shared_ptr<MoeDecoder<moe_optytpe>> decoder_;
+  std::shared_ptr<MoeExpertParallel> ep_;
 
   optraits::DataType *d_encoder_output_;
   int *d_input_;
@@ -32,7 +35,8 @@ class Moe : public LSModel {
   int _max_batch_size;
   cudaStream_t stream_;
   cublasHandle_t hd_;
-  MoeWeight<moe_optytpe> tw_;
+  // shared with the models of the same checkpoint, see acquire_weight.
+  std::shared_ptr<MoeWeight<moe_optytpe>> tw_;
 
   // for hard gates
   int *_p_d_hard_gates;
@@ -68,6 +72,9 @@ class Moe : public LSModel {
   std::vector<int> get_input_max_shape(int index) override;
   std::vector<int> get_output_max_shape(int index) override;
   DataType get_input_dtype(int index) override;
+  int get_input_vocab_size(int index) override {
+    return index == 0 ? tw_->_src_vocab_size : 0;
+  }
   DataType get_output_dtype(int index) override;
   void benchmark_mode(bool is_benchmark) override{};
 };
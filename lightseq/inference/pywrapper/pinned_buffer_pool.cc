@@ -0,0 +1,85 @@
+#include "pinned_buffer_pool.h"
+
+#include <cstring>
+#include <functional>
+#include <numeric>
+#include <stdexcept>
+
+#include "../tools/util.h"
+
+namespace lightseq {
+namespace cuda {
+
+namespace {
+
+// the wrappers allocate 4 bytes per element of every dtype
+size_t max_bytes(const std::vector<int>& shape) {
+  return sizeof(int) * std::accumulate(shape.begin(), shape.end(), (size_t)1,
+                                       std::multiplies<size_t>());
+}
+
+void check_bytes(size_t bytes, size_t capacity) {
+  if (bytes > capacity) {
+    throw std::invalid_argument(
+        "Copy of " + std::to_string(bytes) +
+        " bytes exceeds the pinned buffer of the max shape, " +
+        std::to_string(capacity) + " bytes");
+  }
+}
+
+}  // namespace
+
+PinnedBufferPool::PinnedBufferPool(LSModel* model) {
+  CHECK_GPU_ERROR(cudaGetDevice(&device_));
+  CHECK_GPU_ERROR(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+  for (int i = 0; i < model->get_input_size(); i++) {
+    input_bytes_.push_back(max_bytes(model->get_input_max_shape(i)));
+    void* h_input;
+    CHECK_GPU_ERROR(cudaMallocHost(&h_input, input_bytes_.back()));
+    inputs_.push_back(h_input);
+  }
+  for (int i = 0; i < model->get_output_size(); i++) {
+    output_bytes_.push_back(max_bytes(model->get_output_max_shape(i)));
+    void* h_output;
+    CHECK_GPU_ERROR(cudaMallocHost(&h_output, output_bytes_.back()));
+    outputs_.push_back(h_output);
+  }
+}
+
+PinnedBufferPool::~PinnedBufferPool() {
+  cudaSetDevice(device_);
+  for (void* h_input : inputs_) cudaFreeHost(h_input);
+  for (void* h_output : outputs_) cudaFreeHost(h_output);
+  cudaStreamDestroy(stream_);
+}
+
+void PinnedBufferPool::input_to_device(int index, void* d_dst, size_t bytes) {
+  check_bytes(bytes, input_bytes(index));
+  CHECK_GPU_ERROR(cudaMemcpyAsync(d_dst, inputs_[index], bytes,
+                                  cudaMemcpyHostToDevice, stream_));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
+}
+
+void PinnedBufferPool::output_to_host(int index, const void* d_src,
+                                      size_t bytes) {
+  check_bytes(bytes, output_bytes(index));
+  CHECK_GPU_ERROR(cudaMemcpyAsync(outputs_[index], d_src, bytes,
+                                  cudaMemcpyDeviceToHost, stream_));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
+}
+
+void PinnedBufferPool::copy_to_device(int index, void* d_dst, const void* src,
+                                      size_t bytes) {
+  check_bytes(bytes, input_bytes(index));
+  std::memcpy(inputs_[index], src, bytes);
+  input_to_device(index, d_dst, bytes);
+}
+
+void PinnedBufferPool::copy_to_host(int index, void* dst, const void* d_src,
+                                    size_t bytes) {
+  output_to_host(index, d_src, bytes);
+  std::memcpy(dst, outputs_[index], bytes);
+}
+
+}  // namespace cuda
+}  // namespace lightseq
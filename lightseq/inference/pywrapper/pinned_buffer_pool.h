@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include <vector>
+
+#include "model_base.h"
+
+namespace lightseq {
+namespace cuda {
+
+/*
+Pinned host buffers of the inputs and outputs of one LSModel, sized by their
+max shapes, through which the wrappers and the triton backend stage their
+host copies. A copy from pinned memory is one DMA on the stream of the pool
+instead of a staged copy of pageable memory by the driver, and does not
+serialize with the legacy default stream of the other models.
+
+The copies are synchronous, Infer of the model synchronizes its own stream,
+so the pool needs no events. The users serialize the copies with Infer.
+*/
+class PinnedBufferPool {
+ private:
+  int device_;
+  cudaStream_t stream_;
+  std::vector<void*> inputs_;
+  std::vector<size_t> input_bytes_;
+  std::vector<void*> outputs_;
+  std::vector<size_t> output_bytes_;
+
+ public:
+  explicit PinnedBufferPool(LSModel* model);
+  ~PinnedBufferPool();
+
+  void* input(int index) { return inputs_.at(index); }
+  size_t input_bytes(int index) { return input_bytes_.at(index); }
+  void* output(int index) { return outputs_.at(index); }
+  size_t output_bytes(int index) { return output_bytes_.at(index); }
+
+  // copies the first bytes of the pinned input to d_dst
+  void input_to_device(int index, void* d_dst, size_t bytes);
+  // copies bytes of d_src to the pinned output
+  void output_to_host(int index, const void* d_src, size_t bytes);
+
+  // the same with a copy between src / dst and the pinned buffer
+  void copy_to_device(int index, void* d_dst, const void* src, size_t bytes);
+  void copy_to_host(int index, void* dst, const void* d_src, size_t bytes);
+};
+
+}  // namespace cuda
+}  // namespace lightseq
@@ -16,12 +16,9 @@ QuantBert::QuantBert(const std::string weight_path, const int max_batch_size)
 
   // saved in custom proto file
   std::string model_weights_path = weight_path;
-  std::string res = tw_.initializing(model_weights_path);
-  if (!res.empty()) {
-    throw std::runtime_error(res);
-  }
+  acquire_weight(model_weights_path, &tw_);
 
-  tw_.print_model_config();
+  tw_->print_model_config();
 
   /*
     step3. instantiate encoder and decoder, init the gpu memory buffer.
@@ -30,18 +27,18 @@ QuantBert::QuantBert(const std::string weight_path, const int max_batch_size)
 
   // register device memory for inputs and outputs
   CHECK_GPU_ERROR(
-      cudaMalloc(&d_input_, _max_batch_size * tw_._max_step * sizeof(int)));
+      cudaMalloc(&d_input_, _max_batch_size * tw_->_max_step * sizeof(int)));
   CHECK_GPU_ERROR(cudaMalloc(&d_padding_mask_,
-                             _max_batch_size * tw_._max_step * sizeof(int)));
+                             _max_batch_size * tw_->_max_step * sizeof(int)));
 
   CHECK_GPU_ERROR(cudaMalloc(
-      &d_encoder_output_, _max_batch_size * tw_._max_step * tw_._hidden_size *
+      &d_encoder_output_, _max_batch_size * tw_->_max_step * tw_->_hidden_size *
                               sizeof(optraits::DataType)));
 
   encoder_ = std::make_shared<QuantBertEncoder<bert_optype>>(
-      max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, tw_,
+      max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, *tw_,
       stream_, hd_);
-  res = encoder_->check();
+  std::string res = encoder_->check();
   if (!res.empty()) {
     throw std::runtime_error(res);
   }
@@ -62,7 +59,7 @@ void QuantBert::Infer() {
   int batch_size = input_shapes_[0][0], seq_len = input_shapes_[0][1];
   encoder_->run_one_infer(batch_size, seq_len);
   CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
-  set_output_shape(0, {batch_size, seq_len, tw_._hidden_size});
+  set_output_shape(0, {batch_size, seq_len, tw_->_hidden_size});
 }
 
 void QuantBert::set_input_ptr(int index, void *input_ptr) {
@@ -103,7 +100,7 @@ const void *QuantBert::get_output_ptr(int index) {
 std::vector<int> QuantBert::get_input_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._max_step};
+      return {_max_batch_size, tw_->_max_step};
 
     default:
       throw std::runtime_error("invalid input index");
@@ -113,7 +110,7 @@ std::vector<int> QuantBert::get_input_max_shape(int index) {
 std::vector<int> QuantBert::get_output_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._max_step, tw_._hidden_size};
+      return {_max_batch_size, tw_->_max_step, tw_->_hidden_size};
 
     default:
       throw std::runtime_error("invalid output index");
@@ -2,6 +2,7 @@
 #include "model_base.h"
 #include "../model/quant_bert_encoder.h"
 #include "../proto/quant_bert_weight.h"
+#include "../proto/weight_registry.h"
 #include "../tools/util.h"
 
 #ifdef FP16_MODE
@@ -25,7 +26,8 @@ class QuantBert : public LSModel {
   int _max_batch_size;
   cudaStream_t stream_;
   cublasHandle_t hd_;
-  QuantBertWeight<bert_optype> tw_;
+  // shared with the models of the same checkpoint, see acquire_weight.
+  std::shared_ptr<QuantBertWeight<bert_optype>> tw_;
 
  public:
   QuantBert(const std::string weight_path, const int max_batch_size);
@@ -39,6 +41,9 @@ class QuantBert : public LSModel {
   std::vector<int> get_input_max_shape(int index) override;
   std::vector<int> get_output_max_shape(int index) override;
   DataType get_input_dtype(int index) override;
+  int get_input_vocab_size(int index) override {
+    return index == 0 ? tw_->_src_vocab_size : 0;
+  }
   DataType get_output_dtype(int index) override;
   void benchmark_mode(bool is_benchmark) override{};
 };
@@ -20,10 +20,7 @@ QuantGpt::QuantGpt(const std::string weight_path, const int max_batch_size)
 
   // saved in custom proto file
   std::string model_weights_path = weight_path;
-  std::string res = tw_.initializing(model_weights_path);
-  if (!res.empty()) {
-    throw std::runtime_error(res);
-  }
+  acquire_weight(model_weights_path, &tw_);
 
   /*
     step3. instantiate gpt encoder, init the gpu memory buffer.
@@ -32,15 +29,15 @@ QuantGpt::QuantGpt(const std::string weight_path, const int max_batch_size)
 
   // register device memory for inputs and outputs
   CHECK_GPU_ERROR(
-      cudaMalloc(&d_input_, _max_batch_size * tw_._max_step * sizeof(int)));
+      cudaMalloc(&d_input_, _max_batch_size * tw_->_max_step * sizeof(int)));
   CHECK_GPU_ERROR(
-      cudaMalloc(&d_sample_id, _max_batch_size * tw_._max_step * sizeof(int)));
+      cudaMalloc(&d_sample_id, _max_batch_size * tw_->_max_step * sizeof(int)));
   CHECK_GPU_ERROR(cudaMalloc(&d_ppl, _max_batch_size * sizeof(float)));
 
   encoder_ = std::make_shared<QuantGptEncoder<gpt_optype>>(
-      max_batch_size, d_input_, d_ppl, d_sample_id, tw_, stream_, cache_stream_,
-      hd_);
-  res = encoder_->check();
+      max_batch_size, d_input_, d_ppl, d_sample_id, *tw_, stream_,
+      cache_stream_, hd_);
+  std::string res = encoder_->check();
   if (!res.empty()) {
     throw std::runtime_error(res);
   }
@@ -64,11 +61,12 @@ const float* QuantGpt::get_score_ptr() { return d_ppl; }
 void QuantGpt::Infer() {
   int batch_size = input_shapes_[0][0], seq_len = input_shapes_[0][1];
 
-  if (tw_._sampling_method == "ppl") {
+  if (tw_->_sampling_method == "ppl") {
     encoder_->run_one_infer(batch_size, seq_len);
     CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
     set_output_shape(0, {batch_size});
-  } else if (tw_._sampling_method == "topk" || tw_._sampling_method == "topp") {
+  } else if (tw_->_sampling_method == "topk" ||
+             tw_->_sampling_method == "topp") {
     int sampled_seq_len = encoder_->run_one_sample(batch_size, seq_len);
     CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
     set_output_shape(0, {batch_size, sampled_seq_len});
@@ -92,11 +90,11 @@ void QuantGpt::set_input_ptr(int index, void* input_ptr) {
 void QuantGpt::set_output_ptr(int index, void* output_ptr) {
   switch (index) {
     case 0:
-      if (tw_._sampling_method == "ppl") {
+      if (tw_->_sampling_method == "ppl") {
         encoder_->_p_d_ppl = static_cast<float*>(output_ptr);
         break;
-      } else if (tw_._sampling_method == "topk" ||
-                 tw_._sampling_method == "topp") {
+      } else if (tw_->_sampling_method == "topk" ||
+                 tw_->_sampling_method == "topp") {
         encoder_->_p_d_sample_id = static_cast<int*>(output_ptr);
         break;
 
@@ -114,11 +112,11 @@ void QuantGpt::set_output_ptr(int index, void* output_ptr) {
 const void* QuantGpt::get_output_ptr(int index) {
   switch (index) {
     case 0:
-      if (tw_._sampling_method == "ppl") {
+      if (tw_->_sampling_method == "ppl") {
         return static_cast<void*>(encoder_->_p_d_ppl);
         break;
-      } else if (tw_._sampling_method == "topk" ||
-                 tw_._sampling_method == "topp") {
+      } else if (tw_->_sampling_method == "topk" ||
+                 tw_->_sampling_method == "topp") {
         return static_cast<void*>(encoder_->_p_d_sample_id);
         break;
       } else {
@@ -135,7 +133,7 @@ const void* QuantGpt::get_output_ptr(int index) {
 std::vector<int> QuantGpt::get_input_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._max_step};
+      return {_max_batch_size, tw_->_max_step};
 
     default:
       throw std::runtime_error("invalid input index");
@@ -147,12 +145,12 @@ std::vector<int> QuantGpt::get_output_max_shape(int index) {
   switch (index) {
     case 0:
 
-      if (tw_._sampling_method == "ppl") {
+      if (tw_->_sampling_method == "ppl") {
         return {_max_batch_size};
         break;
-      } else if (tw_._sampling_method == "topk" ||
-                 tw_._sampling_method == "topp") {
-        return {_max_batch_size, tw_._max_step};
+      } else if (tw_->_sampling_method == "topk" ||
+                 tw_->_sampling_method == "topp") {
+        return {_max_batch_size, tw_->_max_step};
         break;
       } else {
         throw std::runtime_error("Unsupported sampling_method");
@@ -180,11 +178,11 @@ DataType QuantGpt::get_input_dtype(int index) {
 DataType QuantGpt::get_output_dtype(int index) {
   switch (index) {
     case 0:
-      if (tw_._sampling_method == "ppl") {
+      if (tw_->_sampling_method == "ppl") {
         return DataType::kFloat32;
         break;
-      } else if (tw_._sampling_method == "topk" ||
-                 tw_._sampling_method == "topp") {
+      } else if (tw_->_sampling_method == "topk" ||
+                 tw_->_sampling_method == "topp") {
         return DataType::kInt32;
         break;
       } else {
@@ -2,6 +2,7 @@
 #include "model_base.h"
 #include "../model/quant_gpt_encoder.h"
 #include "../proto/quant_gpt_weight.h"
+#include "../proto/weight_registry.h"
 #include "../tools/util.h"
 
 #ifdef FP16_MODE
@@ -27,7 +28,8 @@ class QuantGpt : public LSModel {
   cudaStream_t stream_;
   cudaStream_t cache_stream_;
   cublasHandle_t hd_;
-  lightseq::cuda::QuantGptWeight<gpt_optype> tw_;
+  // shared with the models of the same checkpoint, see acquire_weight.
+  std::shared_ptr<lightseq::cuda::QuantGptWeight<gpt_optype>> tw_;
   std::set<std::string> available_sampling_methods = {"topk", "topp"};
 
  public:
@@ -46,6 +48,9 @@ class QuantGpt : public LSModel {
   std::vector<int> get_input_max_shape(int index) override;
   std::vector<int> get_output_max_shape(int index) override;
   DataType get_input_dtype(int index) override;
+  int get_input_vocab_size(int index) override {
+    return index == 0 ? tw_->_src_vocab_size : 0;
+  }
   DataType get_output_dtype(int index) override;
   void benchmark_mode(bool is_benchmark) override{};
 };
@@ -21,28 +21,25 @@ QuantTransformer::QuantTransformer(const std::string weight_path,
 
   // saved in custom proto file
   std::string model_weights_path = weight_path;
-  std::string res = tw_.initializing(model_weights_path);
-  if (!res.empty()) {
-    throw std::runtime_error(res);
-  }
+  acquire_weight(model_weights_path, &tw_);
 
-  if (tw_._sampling_method == "topk" || tw_._sampling_method == "topp") {
-    tw_._beam_size = 1;
+  if (tw_->_sampling_method == "topk" || tw_->_sampling_method == "topp") {
+    tw_->_beam_size = 1;
   }
-  tw_.print_model_config();
+  tw_->print_model_config();
 
   /*
     step3. instantiate encoder and decoder, init the gpu memory buffer.
       using thrust vector to avoid manage gpu memory by hand
   */
 
-  CHECK_GPU_ERROR(
-      cudaMalloc(&d_input_, _max_batch_size * tw_._max_step * sizeof(int32_t)));
   CHECK_GPU_ERROR(cudaMalloc(
-      &d_padding_mask_, _max_batch_size * tw_._max_step * sizeof(int32_t)));
+      &d_input_, _max_batch_size * tw_->_max_step * sizeof(int32_t)));
+  CHECK_GPU_ERROR(cudaMalloc(
+      &d_padding_mask_, _max_batch_size * tw_->_max_step * sizeof(int32_t)));
 
   CHECK_GPU_ERROR(cudaMalloc(
-      &d_encoder_output_, _max_batch_size * tw_._max_step * tw_._hidden_size *
+      &d_encoder_output_, _max_batch_size * tw_->_max_step * tw_->_hidden_size *
                               sizeof(optraits::DataType)));
   CHECK_GPU_ERROR(
       cudaMalloc(&d_src_lang_id_, _max_batch_size * sizeof(int32_t)));
@@ -50,15 +47,15 @@ QuantTransformer::QuantTransformer(const std::string weight_path,
       cudaMalloc(&d_trg_lang_id_, _max_batch_size * sizeof(int32_t)));
 
   encoder_ = std::make_shared<QuantEncoder<qtransformer_optytpe>>(
-      _max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, tw_,
+      _max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, *tw_,
       stream_, hd_, d_src_lang_id_);
-  res = encoder_->check();
+  std::string res = encoder_->check();
   if (!res.empty()) {
     throw std::runtime_error(res);
   }
 
   decoder_ = std::make_shared<QuantDecoder<qtransformer_optytpe>>(
-      _max_batch_size, d_padding_mask_, d_encoder_output_, d_output_, tw_,
+      _max_batch_size, d_padding_mask_, d_encoder_output_, d_output_, *tw_,
       stream_, hd_, true, d_trg_lang_id_);
   res = decoder_->check();
   if (!res.empty()) {
@@ -91,7 +88,7 @@ void QuantTransformer::Infer() {
   int batch_size = input_shapes_[0][0], seq_len = input_shapes_[0][1];
 
   // for multilg
-  if (tw_._multilg_type != 0) {
+  if (tw_->_multilg_type != 0) {
     throw std::runtime_error("multilingle not supported");
   }
 
@@ -101,7 +98,7 @@ void QuantTransformer::Infer() {
   CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
 
   int output_seq_len = get_output_seq_len();
-  int beam_size = tw_._beam_size;
+  int beam_size = tw_->_beam_size;
   int output_k = decoder_->_output_topk ? beam_size : 1;
 
   set_output_shape(0, {batch_size, output_k, output_seq_len});
@@ -154,7 +151,7 @@ const void *QuantTransformer::get_output_ptr(int index) {
 std::vector<int> QuantTransformer::get_input_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._max_step};
+      return {_max_batch_size, tw_->_max_step};
       break;
 
     default:
@@ -166,11 +163,11 @@ std::vector<int> QuantTransformer::get_input_max_shape(int index) {
 std::vector<int> QuantTransformer::get_output_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._beam_size, tw_._max_step};
+      return {_max_batch_size, tw_->_beam_size, tw_->_max_step};
       break;
 
     case 1:
-      return {_max_batch_size, tw_._beam_size};
+      return {_max_batch_size, tw_->_beam_size};
       break;
 
     default:
@@ -4,6 +4,7 @@
 #include "../model/quant_decoder.h"
 #include "../model/quant_encoder.h"
 #include "../proto/quant_transformer_weight.h"
+#include "../proto/weight_registry.h"
 #include "../tools/util.h"
 
 #ifdef FP16_MODE
@@ -31,7 +32,8 @@ class QuantTransformer : public LSModel {
   int _max_batch_size;
   cudaStream_t stream_;
   cublasHandle_t hd_;
-  QuantTransformerWeight<qtransformer_optytpe> tw_;
+  // shared with the models of the same checkpoint, see acquire_weight.
+  std::shared_ptr<QuantTransformerWeight<qtransformer_optytpe>> tw_;
 
   int get_output_seq_len();
 
@@ -51,6 +53,9 @@ class QuantTransformer : public LSModel {
   std::vector<int> get_input_max_shape(int index);
   std::vector<int> get_output_max_shape(int index);
   DataType get_input_dtype(int index);
+  int get_input_vocab_size(int index) override {
+    return index == 0 ? tw_->_src_vocab_size : 0;
+  }
   DataType get_output_dtype(int index);
   void benchmark_mode(bool is_benchmark) override;
 };
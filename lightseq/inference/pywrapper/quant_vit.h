@@ -2,6 +2,7 @@
 #include "model_base.h"
 #include "../model/quant_vit_encoder.h"
 #include "../proto/quant_vit_weight.h"
+#include "../proto/weight_registry.h"
 #include "../tools/util.h"
 
 #ifdef FP16_MODE
@@ -25,7 +26,8 @@ class QuantVit : public LSModel {
   int _max_batch_size;
   cudaStream_t stream_;
   cublasHandle_t hd_;
-  QuantVitWeight<vit_optype> tw_;
+  // shared with the models of the same checkpoint, see acquire_weight.
+  std::shared_ptr<QuantVitWeight<vit_optype>> tw_;
 
  public:
   QuantVit(const std::string weight_path, const int max_batch_size);
@@ -19,28 +19,25 @@ T5::T5(const std::string weight_path, const int max_batch_size)
 
   // saved in custom proto file
   std::string model_weights_path = weight_path;
-  std::string res = tw_.initializing(model_weights_path);
-  if (!res.empty()) {
-    throw std::runtime_error(res);
-  }
+  acquire_weight(model_weights_path, &tw_);
 
-  if (tw_._sampling_method == "topk" || tw_._sampling_method == "topp") {
-    tw_._beam_size = 1;
+  if (tw_->_sampling_method == "topk" || tw_->_sampling_method == "topp") {
+    tw_->_beam_size = 1;
   }
-  tw_.print_model_config();
+  tw_->print_model_config();
 
   /*
     step3. instantiate encoder and decoder, init the gpu memory buffer.
       using thrust vector to avoid manage gpu memory by hand
   */
 
-  CHECK_GPU_ERROR(
-      cudaMalloc(&d_input_, _max_batch_size * tw_._max_step * sizeof(int32_t)));
   CHECK_GPU_ERROR(cudaMalloc(
-      &d_padding_mask_, _max_batch_size * tw_._max_step * sizeof(int32_t)));
+      &d_input_, _max_batch_size * tw_->_max_step * sizeof(int32_t)));
+  CHECK_GPU_ERROR(cudaMalloc(
+      &d_padding_mask_, _max_batch_size * tw_->_max_step * sizeof(int32_t)));
 
   CHECK_GPU_ERROR(cudaMalloc(
-      &d_encoder_output_, _max_batch_size * tw_._max_step * tw_._hidden_size *
+      &d_encoder_output_, _max_batch_size * tw_->_max_step * tw_->_hidden_size *
                               sizeof(optraits::DataType)));
   CHECK_GPU_ERROR(
       cudaMalloc(&d_src_lang_id_, _max_batch_size * sizeof(int32_t)));
@@ -48,15 +45,15 @@ T5::T5(const std::string weight_path, const int max_batch_size)
       cudaMalloc(&d_trg_lang_id_, _max_batch_size * sizeof(int32_t)));
 
   encoder_ = std::make_shared<T5Encoder<t5_optype>>(
-      _max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, tw_,
+      _max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, *tw_,
       stream_, hd_, d_src_lang_id_);
-  res = encoder_->check();
+  std::string res = encoder_->check();
   if (!res.empty()) {
     throw std::runtime_error(res);
   }
 
   decoder_ = std::make_shared<T5Decoder<t5_optype>>(
-      _max_batch_size, d_padding_mask_, d_encoder_output_, d_output_, tw_,
+      _max_batch_size, d_padding_mask_, d_encoder_output_, d_output_, *tw_,
       stream_, hd_, true, d_trg_lang_id_);
   res = decoder_->check();
   if (!res.empty()) {
@@ -95,16 +92,16 @@ void T5::Infer() {
   int batch_size = input_shapes_[0][0], seq_len = input_shapes_[0][1];
 
   // for multilg
-  if (tw_._multilg_type != 0) {
+  if (tw_->_multilg_type != 0) {
     // multilg request: src_lang_id, trg_lang_id, src_token0, src_token1...
     launch_split_multilg_request(encoder_->_p_d_token_id, d_src_lang_id_,
                                  d_trg_lang_id_, d_input_, batch_size, seq_len,
                                  stream_);
     encoder_->_p_d_token_id = d_input_;
-    if (tw_._multilg_type == 1) {
+    if (tw_->_multilg_type == 1) {
       seq_len -= 2;
     }
-    if (tw_._multilg_type == 2) {
+    if (tw_->_multilg_type == 2) {
       seq_len -= 1;
     }
   }
@@ -115,7 +112,7 @@ void T5::Infer() {
   CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
 
   int output_seq_len = get_output_seq_len();
-  int beam_size = tw_._beam_size;
+  int beam_size = tw_->_beam_size;
   int output_k = decoder_->_output_topk ? beam_size : 1;
 
   set_output_shape(0, {batch_size, output_k, output_seq_len});
@@ -168,7 +165,7 @@ const void *T5::get_output_ptr(int index) {
 std::vector<int> T5::get_input_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._max_step};
+      return {_max_batch_size, tw_->_max_step};
       break;
 
     default:
@@ -180,11 +177,11 @@ std::vector<int> T5::get_input_max_shape(int index) {
 std::vector<int> T5::get_output_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._beam_size, tw_._max_step};
+      return {_max_batch_size, tw_->_beam_size, tw_->_max_step};
       break;
 
     case 1:
-      return {_max_batch_size, tw_._beam_size};
+      return {_max_batch_size, tw_->_beam_size};
       break;
 
     default:
@@ -2,6 +2,7 @@
 #include "../model/t5_decoder.h"
 #include "../model/t5_encoder.h"
 #include "../proto/t5_weight.h"
+#include "../proto/weight_registry.h"
 #include "../tools/util.h"
 
 #ifdef FP16_MODE
@@ -30,7 +31,8 @@ class T5 : public LSModel {
   int _max_batch_size;
   cudaStream_t stream_;
   cublasHandle_t hd_;
-  T5Weight<t5_optype> tw_;
+  // shared with the models of the same checkpoint, see acquire_weight.
+  std::shared_ptr<T5Weight<t5_optype>> tw_;
 
   int get_output_seq_len();
 
@@ -50,6 +52,9 @@ class T5 : public LSModel {
   std::vector<int> get_input_max_shape(int index) override;
   std::vector<int> get_output_max_shape(int index) override;
   DataType get_input_dtype(int index) override;
+  int get_input_vocab_size(int index) override {
+    return index == 0 ? tw_->_src_vocab_size : 0;
+  }
   DataType get_output_dtype(int index) override;
   void benchmark_mode(bool is_benchmark) override{};
 };
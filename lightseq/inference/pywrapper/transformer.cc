@@ -5,9 +5,30 @@
 namespace lightseq {
 namespace cuda {
 
+namespace {
+
+// the top k tokens of every step and their log probs of topk or topp
+// sampling with LIGHTSEQ_STEP_TOPK=k, eg. for distillation data, see
+// Decoder::output_step_topk.
+int step_topk_from_env() {
+  const char *step_topk_env = std::getenv("LIGHTSEQ_STEP_TOPK");
+  return step_topk_env ? std::max(std::atoi(step_topk_env), 0) : 0;
+}
+
+std::vector<std::string> transformer_output_names() {
+  std::vector<std::string> names = {"target_ids", "target_scores"};
+  if (step_topk_from_env() > 0) {
+    names.push_back("step_topk_ids");
+    names.push_back("step_topk_log_probs");
+  }
+  return names;
+}
+
+}  // namespace
+
 Transformer::Transformer(const std::string weight_path,
                          const int max_batch_size)
-    : LSModel({"source_ids"}, {"target_ids", "target_scores"}),
+    : LSModel({"source_ids"}, transformer_output_names()),
       stream_(nullptr),
       hd_(nullptr),
       decoder_(nullptr),
@@ -21,50 +42,47 @@ Transformer::Transformer(const std::string weight_path,
 
   // saved in custom proto file
   std::string model_weights_path = weight_path;
-  std::string res = tw_.initializing(model_weights_path);
-  if (!res.empty()) {
-    throw std::runtime_error(res);
-  }
+  acquire_weight(model_weights_path, &tw_);
 
-  if (tw_._sampling_method == "topk" || tw_._sampling_method == "topp") {
-    tw_._beam_size = 1;
+  if (tw_->_sampling_method == "topk" || tw_->_sampling_method == "topp") {
+    tw_->_beam_size = 1;
   }
-  tw_.print_model_config();
+  tw_->print_model_config();
 
   /*
     step3. instantiate encoder and decoder, init the gpu memory buffer.
       using thrust vector to avoid manage gpu memory by hand
   */
 
-  CHECK_GPU_ERROR(
-      cudaMalloc(&d_input_, _max_batch_size * tw_._max_step * sizeof(int32_t)));
   CHECK_GPU_ERROR(cudaMalloc(
-      &d_padding_mask_, _max_batch_size * tw_._max_step * sizeof(int32_t)));
+      &d_input_, _max_batch_size * tw_->_max_step * sizeof(int32_t)));
+  CHECK_GPU_ERROR(cudaMalloc(
+      &d_padding_mask_, _max_batch_size * tw_->_max_step * sizeof(int32_t)));
 
   CHECK_GPU_ERROR(cudaMalloc(
-      &d_encoder_output_, _max_batch_size * tw_._max_step * tw_._hidden_size *
+      &d_encoder_output_, _max_batch_size * tw_->_max_step * tw_->_hidden_size *
                               sizeof(optraits::DataType)));
   CHECK_GPU_ERROR(
       cudaMalloc(&d_src_lang_id_, _max_batch_size * sizeof(int32_t)));
   CHECK_GPU_ERROR(
       cudaMalloc(&d_trg_lang_id_, _max_batch_size * sizeof(int32_t)));
 
-  if (tw_._multilg_type < 3) {
+  if (tw_->_multilg_type < 3) {
     encoder_ = std::make_shared<Encoder<transformer_optytpe>>(
-        _max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, tw_,
+        _max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, *tw_,
         stream_, hd_, d_src_lang_id_);
   } else {
     encoder_ = std::make_shared<Encoder<transformer_optytpe>>(
-        _max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, tw_,
+        _max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, *tw_,
         stream_, hd_, d_trg_lang_id_);
   }
-  res = encoder_->check();
+  std::string res = encoder_->check();
   if (!res.empty()) {
     throw std::runtime_error(res);
   }
 
   decoder_ = std::make_shared<Decoder<transformer_optytpe>>(
-      _max_batch_size, d_padding_mask_, d_encoder_output_, d_output_, tw_,
+      _max_batch_size, d_padding_mask_, d_encoder_output_, d_output_, *tw_,
       stream_, hd_, true, d_trg_lang_id_);
   res = decoder_->check();
   if (!res.empty()) {
@@ -80,6 +98,33 @@ Transformer::Transformer(const std::string weight_path,
   CHECK_GPU_ERROR(cudaMalloc(&d_buf_, buf_bytesize));
   encoder_->init_buffer(d_buf_);
   decoder_->init_buffer(d_buf_);
+  // LIGHTSEQ_BEAM_PRUNE_ABS, LIGHTSEQ_BEAM_PRUNE_REL: the absolute and
+  // relative score margins of beam pruning, none by default.
+  const char *prune_abs_env = std::getenv("LIGHTSEQ_BEAM_PRUNE_ABS");
+  const char *prune_rel_env = std::getenv("LIGHTSEQ_BEAM_PRUNE_REL");
+  if (prune_abs_env || prune_rel_env) {
+    decoder_->set_beam_pruning(prune_abs_env ? std::atof(prune_abs_env) : 0.f,
+                               prune_rel_env ? std::atof(prune_rel_env) : 0.f);
+  }
+  step_topk_ = step_topk_from_env();
+  if (step_topk_ > 0) {
+    decoder_->output_step_topk(step_topk_);
+    size_t topk_size = (size_t)_max_batch_size * tw_->_max_step * step_topk_;
+    CHECK_GPU_ERROR(cudaMalloc(&d_step_topk_buf_,
+                               topk_size * (sizeof(int) + sizeof(float))));
+    d_step_topk_ids_ = static_cast<int *>(d_step_topk_buf_);
+    d_step_topk_log_probs_ =
+        reinterpret_cast<float *>(d_step_topk_ids_ + topk_size);
+  }
+
+  // the source of a multilg request also selects the languages
+  int cache_size = EncdecKvCache<transformer_optytpe>::capacity_from_env();
+  if (cache_size > 0 && tw_->_multilg_type == 0) {
+    encdec_cache_ = std::make_shared<EncdecKvCache<transformer_optytpe>>(
+        cache_size, tw_->_max_step, tw_->_hidden_size, tw_->_n_dec_layer,
+        stream_);
+    h_input_.resize(_max_batch_size * tw_->_max_step);
+  }
   CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
 }
 
@@ -90,6 +135,7 @@ Transformer::~Transformer() {
   CHECK_GPU_ERROR(cudaFree(d_buf_));
   CHECK_GPU_ERROR(cudaFree(d_src_lang_id_));
   CHECK_GPU_ERROR(cudaFree(d_trg_lang_id_));
+  CHECK_GPU_ERROR(cudaFree(d_step_topk_buf_));
   CHECK_GPU_ERROR(cudaStreamDestroy(stream_));
 }
 
@@ -105,33 +151,128 @@ void Transformer::Infer() {
   int batch_size = input_shapes_[0][0], seq_len = input_shapes_[0][1];
 
   // for multilg
-  if (tw_._multilg_type != 0) {
+  if (tw_->_multilg_type != 0) {
     // multilg request: src_lang_id, trg_lang_id, src_token0, src_token1...
     launch_split_multilg_request(encoder_->_p_d_token_id, d_src_lang_id_,
                                  d_trg_lang_id_, d_input_, batch_size, seq_len,
                                  stream_);
     encoder_->_p_d_token_id = d_input_;
-    if (tw_._multilg_type == 1) {
+    if (tw_->_multilg_type == 1) {
       seq_len -= 2;
     }
-    if (tw_._multilg_type == 2 || tw_._multilg_type == 3) {
+    if (tw_->_multilg_type == 2 || tw_->_multilg_type == 3) {
       seq_len -= 1;
     }
+    if (!tw_->_trg_lang_vocab_mask.empty()) {
+      update_lang_shortlist(batch_size);
+    }
   }
 
-  encoder_->run_one_infer(batch_size, seq_len);
-  decoder_->run_one_infer(batch_size, seq_len);
+  bool cached = false;
+  if (encdec_cache_) {
+    CHECK_GPU_ERROR(cudaMemcpyAsync(
+        h_input_.data(), encoder_->_p_d_token_id,
+        sizeof(int) * batch_size * seq_len, cudaMemcpyDeviceToHost, stream_));
+    CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
+    cached = encdec_cache_->lookup(h_input_.data(), batch_size, seq_len,
+                                   d_padding_mask_, decoder_->encdec_k(),
+                                   decoder_->encdec_v());
+  }
 
-  CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
+  if (!cached) {
+    encoder_->run_one_infer(batch_size, seq_len);
+    decoder_->project_encoder_output(batch_size, seq_len);
+  }
+  // before decoding, which compacts the encdec K/V of the alive items
+  if (encdec_cache_ && !cached) {
+    encdec_cache_->insert(h_input_.data(), batch_size, seq_len,
+                          d_padding_mask_, decoder_->encdec_k(),
+                          decoder_->encdec_v());
+  }
+  decoder_->run_one_infer(batch_size, seq_len, false);
 
   int output_seq_len = get_output_seq_len();
-  int beam_size = tw_._beam_size;
+  if (step_topk_ > 0) {
+    // the [batch_size, max_step, k] steps of the decoder, packed to the
+    // output length
+    size_t width = (size_t)output_seq_len * step_topk_;
+    size_t pitch = (size_t)tw_->_max_step * step_topk_;
+    CHECK_GPU_ERROR(cudaMemcpy2DAsync(
+        d_step_topk_ids_, width * sizeof(int), decoder_->_p_d_step_topk_ids,
+        pitch * sizeof(int), width * sizeof(int), batch_size,
+        cudaMemcpyDeviceToDevice, stream_));
+    CHECK_GPU_ERROR(cudaMemcpy2DAsync(
+        d_step_topk_log_probs_, width * sizeof(float),
+        decoder_->_p_d_step_topk_log_probs, pitch * sizeof(float),
+        width * sizeof(float), batch_size, cudaMemcpyDeviceToDevice,
+        stream_));
+    set_output_shape(2, {batch_size, output_seq_len, step_topk_});
+    set_output_shape(3, {batch_size, output_seq_len, step_topk_});
+  }
+  CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
+
+  int beam_size = tw_->_beam_size;
   int output_k = decoder_->_output_topk ? beam_size : 1;
 
   set_output_shape(0, {batch_size, output_k, output_seq_len});
   set_output_shape(1, {batch_size, output_k});
 }
 
+long Transformer::get_cache_hits() {
+  return encdec_cache_ ? encdec_cache_->hits() : 0;
+}
+
+long Transformer::get_cache_misses() {
+  return encdec_cache_ ? encdec_cache_->misses() : 0;
+}
+
+void Transformer::set_vocab_shortlist(const std::vector<int> &tokens) {
+  vocab_shortlist_ = tokens;
+  batch_langs_.clear();
+  decoder_->set_vocab_shortlist(tokens);
+}
+
+/**
+Group the batch items by target language: the decoder only scores the union
+of the vocabs of the languages of the batch, within vocab_shortlist_ if set,
+and every item is masked to the vocab of its own language. A batch of one
+language so pays for its vocab only. The shortlist is rebuilt when the
+languages of the batch change.
+*/
+void Transformer::update_lang_shortlist(int batch_size) {
+  std::vector<int> langs(batch_size);
+  CHECK_GPU_ERROR(cudaMemcpyAsync(langs.data(), d_trg_lang_id_,
+                                  sizeof(int) * batch_size,
+                                  cudaMemcpyDeviceToHost, stream_));
+  CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
+  std::sort(langs.begin(), langs.end());
+  langs.erase(std::unique(langs.begin(), langs.end()), langs.end());
+  if (langs == batch_langs_) return;
+
+  int vocab_size = tw_->_trg_vocab_size;
+  int lang_num = tw_->_trg_lang_vocab_mask.size() / vocab_size;
+  std::vector<bool> in_shortlist(vocab_size, vocab_shortlist_.empty());
+  for (int token : vocab_shortlist_) in_shortlist[token] = true;
+  std::vector<int> tokens;
+  for (int token = 0; token < vocab_size; token++) {
+    if (!in_shortlist[token]) continue;
+    for (int lang : langs) {
+      if (lang < 0 || lang >= lang_num) {
+        throw std::runtime_error("target language id " +
+                                 std::to_string(lang) + " out of range");
+      }
+      if (tw_->_trg_lang_vocab_mask[lang * vocab_size + token]) {
+        tokens.push_back(token);
+        break;
+      }
+    }
+  }
+  // too few tokens for the beams, the masks alone keep to the languages
+  if (int(tokens.size()) < tw_->_beam_size) tokens.clear();
+  decoder_->set_vocab_shortlist(tokens);
+  batch_langs_ = langs;
+}
+
 void Transformer::set_input_ptr(int index, void *input_ptr) {
   switch (index) {
     case 0:
@@ -154,6 +295,16 @@ void Transformer::set_output_ptr(int index, void *output_ptr) {
       decoder_->_p_d_alive_seq_score = static_cast<float *>(output_ptr);
       break;
 
+    case 2:
+      if (step_topk_ == 0) throw std::runtime_error("invalid output index");
+      d_step_topk_ids_ = static_cast<int *>(output_ptr);
+      break;
+
+    case 3:
+      if (step_topk_ == 0) throw std::runtime_error("invalid output index");
+      d_step_topk_log_probs_ = static_cast<float *>(output_ptr);
+      break;
+
     default:
       throw std::runtime_error("invalid input index");
       break;
@@ -169,6 +320,16 @@ const void *Transformer::get_output_ptr(int index) {
       return static_cast<void *>(decoder_->_p_d_alive_seq_score);
       break;
 
+    case 2:
+      if (step_topk_ == 0) throw std::runtime_error("invalid output index");
+      return static_cast<void *>(d_step_topk_ids_);
+      break;
+
+    case 3:
+      if (step_topk_ == 0) throw std::runtime_error("invalid output index");
+      return static_cast<void *>(d_step_topk_log_probs_);
+      break;
+
     default:
       throw std::runtime_error("invalid output index");
       break;
@@ -178,7 +339,7 @@ const void *Transformer::get_output_ptr(int index) {
 std::vector<int> Transformer::get_input_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._max_step};
+      return {_max_batch_size, tw_->_max_step};
       break;
 
     default:
@@ -190,11 +351,17 @@ std::vector<int> Transformer::get_input_max_shape(int index) {
 std::vector<int> Transformer::get_output_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._beam_size, tw_._max_step};
+      return {_max_batch_size, tw_->_beam_size, tw_->_max_step};
       break;
 
     case 1:
-      return {_max_batch_size, tw_._beam_size};
+      return {_max_batch_size, tw_->_beam_size};
+      break;
+
+    case 2:
+    case 3:
+      if (step_topk_ == 0) throw std::runtime_error("invalid output index");
+      return {_max_batch_size, tw_->_max_step, step_topk_};
       break;
 
     default:
@@ -225,6 +392,16 @@ DataType Transformer::get_output_dtype(int index) {
       return DataType::kFloat32;
       break;
 
+    case 2:
+      if (step_topk_ == 0) throw std::runtime_error("invalid output index");
+      return DataType::kInt32;
+      break;
+
+    case 3:
+      if (step_topk_ == 0) throw std::runtime_error("invalid output index");
+      return DataType::kFloat32;
+      break;
+
     default:
       throw std::runtime_error("invalid output index");
       break;
@@ -2,8 +2,10 @@
 
 #include "model_base.h"
 #include "../model/decoder.h"
+#include "../model/encdec_kv_cache.h"
 #include "../model/encoder.h"
 #include "../proto/transformer_weight.h"
+#include "../proto/weight_registry.h"
 #include "../tools/util.h"
 
 #ifdef FP16_MODE
@@ -27,14 +29,29 @@ class Transformer : public LSModel {
   int *d_src_lang_id_;
   int *d_trg_lang_id_;
   int *d_output_;
+  // outputs 2 and 3 with LIGHTSEQ_STEP_TOPK, see Decoder::output_step_topk,
+  // in the buffers of the model unless set_output_ptr
+  int step_topk_ = 0;
+  int *d_step_topk_ids_ = nullptr;
+  float *d_step_topk_log_probs_ = nullptr;
+  void *d_step_topk_buf_ = nullptr;
   int *d_padding_mask_;
   void *d_buf_;
   int _max_batch_size;
   cudaStream_t stream_;
   cublasHandle_t hd_;
-  TransformerWeight<transformer_optytpe> tw_;
+  // shared with the models of the same checkpoint, see acquire_weight.
+  std::shared_ptr<TransformerWeight<transformer_optytpe>> tw_;
+  // nullptr unless LIGHTSEQ_ENCDEC_CACHE_SIZE is set
+  std::shared_ptr<EncdecKvCache<transformer_optytpe>> encdec_cache_;
+  std::vector<int> h_input_;
+  // set by set_vocab_shortlist, and the target languages of the last batch of
+  // a model with language vocab masks, see update_lang_shortlist
+  std::vector<int> vocab_shortlist_;
+  std::vector<int> batch_langs_;
 
   int get_output_seq_len();
+  void update_lang_shortlist(int batch_size);
 
   const int *get_result_ptr();
   const float *get_score_ptr();
@@ -52,8 +69,18 @@ class Transformer : public LSModel {
   std::vector<int> get_input_max_shape(int index) override;
   std::vector<int> get_output_max_shape(int index) override;
   DataType get_input_dtype(int index) override;
+  int get_input_vocab_size(int index) override {
+    return index == 0 ? tw_->_src_vocab_size : 0;
+  }
   DataType get_output_dtype(int index) override;
   void benchmark_mode(bool is_benchmark) override;
+
+  // in sentences, see EncdecKvCache
+  long get_cache_hits() override;
+  long get_cache_misses() override;
+
+  void set_vocab_shortlist(const std::vector<int> &tokens) override;
+  void cancel_row(int row) override { decoder_->cancel_item(row); }
 };
 
 LSMODEL_REGISTER(Transformer);
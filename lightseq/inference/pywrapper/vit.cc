@@ -3,8 +3,11 @@
 namespace lightseq {
 namespace cuda {
 
-Vit::Vit(const std::string weight_path, const int max_batch_size)
-    : LSModel({"pixel_values"}, {"encoder_output"}),
+Vit::Vit(const std::string weight_path, const int max_batch_size,
+         bool uint8_input)
+    : LSModel({uint8_input ? "pixel_uint8" : "pixel_values"},
+              {"encoder_output"}),
+      uint8_input_(uint8_input),
       _max_batch_size(max_batch_size) {
   /* ---step1. init environment--- */
   CHECK_GPU_ERROR(cudaSetDevice(0));
@@ -16,33 +19,31 @@ Vit::Vit(const std::string weight_path, const int max_batch_size)
 
   // saved in custom proto file
   std::string model_weights_path = weight_path;
-  std::string res = tw_.initializing(model_weights_path);
-  if (!res.empty()) {
-    throw std::runtime_error(res);
-  }
+  acquire_weight(model_weights_path, &tw_);
 
-  tw_.print_model_config();
+  tw_->print_model_config();
 
   /*
     step3. instantiate encoder and decoder, init the gpu memory buffer.
       using thrust vector to avoid manage gpu memory by hand
   */
 
-  // register device memory for inputs and outputs
-  CHECK_GPU_ERROR(cudaMalloc(&d_input_, _max_batch_size * tw_._channel_input *
-                                            tw_._image_size * tw_._image_size *
-                                            sizeof(float)));
+  // register device memory for inputs and outputs, enough for either dtype
+  CHECK_GPU_ERROR(cudaMalloc(&d_input_,
+                             _max_batch_size * tw_->_channel_input *
+                                 tw_->_image_size * tw_->_image_size *
+                                 sizeof(float)));
   CHECK_GPU_ERROR(cudaMalloc(&d_padding_mask_,
-                             _max_batch_size * tw_._max_step * sizeof(int)));
+                             _max_batch_size * tw_->_max_step * sizeof(int)));
 
   CHECK_GPU_ERROR(cudaMalloc(
-      &d_encoder_output_, _max_batch_size * tw_._max_step * tw_._hidden_size *
+      &d_encoder_output_, _max_batch_size * tw_->_max_step * tw_->_hidden_size *
                               sizeof(optraits::DataType)));
 
   encoder_ = std::make_shared<VitEncoder<vit_optype>>(
-      max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, tw_,
+      max_batch_size, d_input_, d_padding_mask_, d_encoder_output_, *tw_,
       stream_, hd_);
-  res = encoder_->check();
+  std::string res = encoder_->check();
   if (!res.empty()) {
     throw std::runtime_error(res);
   }
@@ -69,13 +70,18 @@ void Vit::Infer() {
   int batch_size = input_shapes_[0][0];
   encoder_->run_one_infer(batch_size);
   CHECK_GPU_ERROR(cudaStreamSynchronize(stream_));
-  set_output_shape(0, {batch_size, tw_._max_step, tw_._hidden_size});
+  set_output_shape(
+      0, {batch_size, encoder_->output_seq_len(), tw_->_hidden_size});
 }
 
 void Vit::set_input_ptr(int index, void *input_ptr) {
   switch (index) {
     case 0:
-      encoder_->_p_d_pixel_input = static_cast<float *>(input_ptr);
+      if (uint8_input_) {
+        encoder_->_p_d_pixel_uint8 = static_cast<uint8_t *>(input_ptr);
+      } else {
+        encoder_->_p_d_pixel_input = static_cast<float *>(input_ptr);
+      }
       break;
 
     default:
@@ -110,8 +116,12 @@ const void *Vit::get_output_ptr(int index) {
 std::vector<int> Vit::get_input_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._channel_input, tw_._image_size,
-              tw_._image_size};
+      if (uint8_input_) {
+        return {_max_batch_size, tw_->_image_size, tw_->_image_size,
+                tw_->_channel_input};
+      }
+      return {_max_batch_size, tw_->_channel_input, tw_->_image_size,
+              tw_->_image_size};
 
     default:
       throw std::runtime_error("invalid input index");
@@ -121,7 +131,8 @@ std::vector<int> Vit::get_input_max_shape(int index) {
 std::vector<int> Vit::get_output_max_shape(int index) {
   switch (index) {
     case 0:
-      return {_max_batch_size, tw_._max_step, tw_._hidden_size};
+      return {_max_batch_size, encoder_->output_seq_len(),
+              tw_->_hidden_size};
 
     default:
       throw std::runtime_error("invalid output index");
@@ -132,7 +143,7 @@ std::vector<int> Vit::get_output_max_shape(int index) {
 DataType Vit::get_input_dtype(int index) {
   switch (index) {
     case 0:
-      return DataType::kFloat32;
+      return uint8_input_ ? DataType::kUInt8 : DataType::kFloat32;
       break;
 
     default:
@@ -2,6 +2,7 @@
 #include "model_base.h"
 #include "../model/vit_encoder.h"
 #include "../proto/vit_weight.h"
+#include "../proto/weight_registry.h"
 #include "../tools/util.h"
 
 #ifdef FP16_MODE
@@ -21,15 +22,19 @@ class Vit : public LSModel {
 
   optraits::DataType *d_encoder_output_;
   float *d_input_;
+  // the input is uint8 NHWC pixels instead of float NCHW, see VitUint8
+  const bool uint8_input_;
   int *d_padding_mask_;
   int _max_batch_size;
   cudaStream_t stream_;
   cublasHandle_t hd_;
   void *d_buf_;
-  VitWeight<vit_optype> tw_;
+  // shared with the models of the same checkpoint, see acquire_weight.
+  std::shared_ptr<VitWeight<vit_optype>> tw_;
 
  public:
-  Vit(const std::string weight_path, const int max_batch_size);
+  Vit(const std::string weight_path, const int max_batch_size,
+      bool uint8_input = false);
 
   ~Vit();
 
@@ -46,5 +51,18 @@ class Vit : public LSModel {
 
 LSMODEL_REGISTER(Vit);
 
+/*
+Vit on "pixel_uint8", uint8 images [batch_size, image_size, image_size,
+channel_input] which are normalized on the GPU by the image_mean and
+image_std of the model, without a float conversion on host.
+*/
+class VitUint8 : public Vit {
+ public:
+  VitUint8(const std::string weight_path, const int max_batch_size)
+      : Vit(weight_path, max_batch_size, true) {}
+};
+
+LSMODEL_REGISTER(VitUint8);
+
 }  // namespace cuda
 }  // namespace lightseq
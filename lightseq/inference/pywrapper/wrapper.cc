@@ -2,18 +2,369 @@
 #include <cuda_fp16.h>
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
 
 #include "model_base.h"
+#include "model_pool.h"
+#include "pinned_buffer_pool.h"
 #include "util.h"
 #include "transformer_decoder.cc.cu"
 
 namespace py = pybind11;
 
+// The copies and Infer of the models do not hold the GIL, infer_mutex_ of a
+// model serializes its infer and infer_async.
+std::unique_lock<std::mutex> lock_without_gil(std::mutex &infer_mutex) {
+  py::gil_scoped_release release;
+  return std::unique_lock<std::mutex>(infer_mutex);
+}
+
+// The host copies of input / output index go through the pinned buffers of
+// the model.
+void copy_to_device(lightseq::cuda::PinnedBufferPool *pinned, int index,
+                    void *dst, const void *src, size_t bytes) {
+  py::gil_scoped_release release;
+  pinned->copy_to_device(index, dst, src, bytes);
+}
+
+void copy_to_host(lightseq::cuda::PinnedBufferPool *pinned, int index,
+                  void *dst, const void *src, size_t bytes) {
+  py::gil_scoped_release release;
+  pinned->copy_to_host(index, dst, src, bytes);
+}
+
+void infer_without_gil(lightseq::cuda::LSModel *model) {
+  py::gil_scoped_release release;
+  model->Infer();
+}
+
+size_t dtype_bytes(lightseq::cuda::DataType dtype) {
+  if (dtype == lightseq::cuda::kFloat16) return sizeof(half);
+  if (dtype == lightseq::cuda::kInt32 || dtype == lightseq::cuda::kFloat32) {
+    return sizeof(int);
+  }
+  if (dtype == lightseq::cuda::kUInt8) return sizeof(uint8_t);
+  throw std::runtime_error("Not supported output type");
+}
+
+// A c contiguous numpy array of input in the input dtype of a model.
+py::array input_of_dtype(py::array input, lightseq::cuda::DataType dtype) {
+  if (dtype == lightseq::cuda::kFloat32) {
+    return py::array_t<float, py::array::c_style | py::array::forcecast>(
+        input);
+  }
+  if (dtype == lightseq::cuda::kUInt8) {
+    return py::array_t<uint8_t, py::array::c_style | py::array::forcecast>(
+        input);
+  }
+  return py::array_t<int, py::array::c_style | py::array::forcecast>(input);
+}
+
+// A numpy array of an output on host, float16 is returned as float32 like
+// the infer of the models.
+py::array host_to_numpy(const void *data, const std::vector<int> &shape,
+                        lightseq::cuda::DataType dtype) {
+  if (dtype == lightseq::cuda::kInt32) {
+    auto output = py::array_t<int>(shape);
+    std::memcpy(output.mutable_data(), data, sizeof(int) * output.size());
+    return output;
+  }
+  auto output = py::array_t<float>(shape);
+  if (dtype == lightseq::cuda::kFloat32) {
+    std::memcpy(output.mutable_data(), data, sizeof(float) * output.size());
+  } else if (dtype == lightseq::cuda::kFloat16) {
+    float *output_data = output.mutable_data();
+    const half *half_data = static_cast<const half *>(data);
+    for (auto i = 0; i < output.size(); i++) {
+      output_data[i] = __half2float(half_data[i]);
+    }
+  } else {
+    throw std::runtime_error("Not supported output type");
+  }
+  return output;
+}
+
+// The device memory of a tensor with __cuda_array_interface__, e.g. a torch
+// cuda tensor or a cupy array, which infer_cuda reads and writes in place.
+struct CudaArray {
+  void *data;
+  std::vector<int> shape;
+  lightseq::cuda::DataType dtype;
+  // the stream the producer wrote on, see synchronize_producer
+  bool has_stream;
+  uintptr_t stream;
+};
+
+CudaArray cuda_array(py::handle obj, const std::string &name) {
+  if (!py::hasattr(obj, "__cuda_array_interface__")) {
+    throw std::invalid_argument(name + " is not a cuda tensor");
+  }
+  py::dict interface = obj.attr("__cuda_array_interface__");
+  CudaArray arr;
+  arr.data = reinterpret_cast<void *>(
+      interface["data"].cast<py::tuple>()[0].cast<uintptr_t>());
+  for (auto dim : interface["shape"].cast<py::tuple>()) {
+    arr.shape.push_back(dim.cast<int>());
+  }
+  std::string typestr = interface["typestr"].cast<std::string>();
+  if (typestr == "<i4") {
+    arr.dtype = lightseq::cuda::kInt32;
+  } else if (typestr == "<f4") {
+    arr.dtype = lightseq::cuda::kFloat32;
+  } else if (typestr == "<f2") {
+    arr.dtype = lightseq::cuda::kFloat16;
+  } else if (typestr == "|u1") {
+    arr.dtype = lightseq::cuda::kUInt8;
+  } else {
+    throw std::invalid_argument(name + " of type " + typestr +
+                                " is not supported");
+  }
+  if (interface.contains("strides") && !interface["strides"].is_none()) {
+    py::tuple strides = interface["strides"];
+    size_t expected = dtype_bytes(arr.dtype);
+    for (int i = arr.shape.size() - 1; i >= 0; i--) {
+      if (arr.shape[i] != 1 && strides[i].cast<size_t>() != expected) {
+        throw std::invalid_argument(name + " is not contiguous");
+      }
+      expected *= arr.shape[i];
+    }
+  }
+  arr.has_stream = interface.contains("stream");
+  arr.stream = arr.has_stream && !interface["stream"].is_none()
+                   ? interface["stream"].cast<uintptr_t>()
+                   : 0;
+  return arr;
+}
+
+// Waits for the producer of a tensor like __cuda_array_interface__ v3 asks,
+// a stream of None needs no wait. Before v3 the stream is unknown, e.g. for
+// torch, so the whole device is synchronized.
+void synchronize_producer(const CudaArray &arr) {
+  py::gil_scoped_release release;
+  if (!arr.has_stream) {
+    lightseq::cuda::CHECK_GPU_ERROR(cudaDeviceSynchronize());
+  } else if (arr.stream != 0) {
+    lightseq::cuda::CHECK_GPU_ERROR(
+        cudaStreamSynchronize(reinterpret_cast<cudaStream_t>(arr.stream)));
+  }
+}
+
+size_t cuda_array_size(const std::vector<int> &shape) {
+  return std::accumulate(shape.begin(), shape.end(), (size_t)1,
+                         std::multiplies<size_t>());
+}
+
+/*
+An output of infer_cuda, a view of device memory which torch.as_tensor or
+cupy.asarray take without a copy. A view of the buffers of the model is
+overwritten by the next infer of the model.
+*/
+class PyCudaOutput {
+ private:
+  void *data_;
+  std::vector<int> shape_;
+  lightseq::cuda::DataType dtype_;
+  // the model or the tensor which owns data_
+  py::object owner_;
+
+ public:
+  PyCudaOutput(void *data, std::vector<int> shape,
+               lightseq::cuda::DataType dtype, py::object owner)
+      : data_(data), shape_(shape), dtype_(dtype), owner_(owner) {}
+
+  py::dict cuda_array_interface() const {
+    const char *typestr = dtype_ == lightseq::cuda::kInt32     ? "<i4"
+                          : dtype_ == lightseq::cuda::kFloat32 ? "<f4"
+                                                               : "<f2";
+    py::dict interface;
+    interface["shape"] = py::tuple(py::cast(shape_));
+    interface["typestr"] = typestr;
+    interface["data"] =
+        py::make_tuple(reinterpret_cast<uintptr_t>(data_), false);
+    interface["strides"] = py::none();
+    interface["version"] = 2;
+    return interface;
+  }
+};
+
+/*
+Infer on a cuda tensor input without copies. The outputs are written to the
+cuda tensors of outputs in place, which must hold the max output shapes of
+the model, or to the buffers of the model when outputs is None. Returns
+views of the outputs, one PyCudaOutput or a tuple of them like infer.
+
+The producer of the input is waited for before Infer, see
+synchronize_producer, and Infer synchronizes its own stream before returning.
+*/
+py::object infer_cuda(lightseq::cuda::LSModel *model, std::mutex &infer_mutex,
+                      void *d_input, const std::vector<void *> &d_outputs,
+                      py::object self, py::handle input, py::object outputs) {
+  CudaArray input_arr = cuda_array(input, "input");
+  if (input_arr.dtype != model->get_input_dtype(0)) {
+    throw std::invalid_argument("input type does not match the model");
+  }
+  int output_size = model->get_output_size();
+  std::vector<CudaArray> output_arrs;
+  py::sequence output_seq;
+  if (!outputs.is_none()) {
+    output_seq = outputs.cast<py::sequence>();
+    if (output_seq.size() != output_size) {
+      throw std::invalid_argument("the model has " +
+                                  std::to_string(output_size) + " outputs");
+    }
+    for (int i = 0; i < output_size; i++) {
+      std::string name = "outputs[" + std::to_string(i) + "]";
+      output_arrs.push_back(cuda_array(output_seq[i], name));
+      if (output_arrs[i].dtype != model->get_output_dtype(i) ||
+          cuda_array_size(output_arrs[i].shape) <
+              cuda_array_size(model->get_output_max_shape(i))) {
+        throw std::invalid_argument(
+            name + " does not match the type or max shape of the output");
+      }
+    }
+  }
+
+  auto lock = lock_without_gil(infer_mutex);
+  synchronize_producer(input_arr);
+  model->set_input_ptr(0, input_arr.data);
+  model->set_input_shape(0, input_arr.shape);
+  for (int i = 0; i < output_arrs.size(); i++) {
+    model->set_output_ptr(i, output_arrs[i].data);
+  }
+  auto restore = [&]() {
+    model->set_input_ptr(0, d_input);
+    for (int i = 0; i < output_arrs.size(); i++) {
+      model->set_output_ptr(i, d_outputs[i]);
+    }
+  };
+  try {
+    infer_without_gil(model);
+  } catch (...) {
+    restore();
+    throw;
+  }
+  restore();
+
+  py::tuple result(output_size);
+  for (int i = 0; i < output_size; i++) {
+    bool in_place = !output_arrs.empty();
+    result[i] = PyCudaOutput(in_place ? output_arrs[i].data : d_outputs[i],
+                             model->get_output_shape(i),
+                             model->get_output_dtype(i),
+                             in_place ? py::object(output_seq[i]) : self);
+  }
+  if (output_size == 1) {
+    return result[0];
+  }
+  return result;
+}
+
+/*
+The result of infer_async of a model. The copy of the input to the device,
+Infer and the copy of the outputs to host run in a thread of their own
+without the GIL, so that python can prepare the next requests meanwhile.
+result() waits for them and returns the outputs like infer, one array or a
+tuple of arrays.
+*/
+class PyInferFuture {
+ private:
+  struct Outputs {
+    std::vector<std::vector<int>> shapes;
+    std::vector<lightseq::cuda::DataType> dtypes;
+    std::vector<std::vector<char>> data;
+    std::exception_ptr error;
+  };
+  std::shared_ptr<Outputs> outputs_;
+  std::future<void> future_;
+
+  void wait() {
+    if (future_.valid()) {
+      py::gil_scoped_release release;
+      future_.get();
+    }
+  }
+
+ public:
+  PyInferFuture(lightseq::cuda::LSModel *model, void *d_input,
+                lightseq::cuda::PinnedBufferPool *pinned,
+                std::mutex *infer_mutex, py::array input)
+      : outputs_(std::make_shared<Outputs>()) {
+    int device;
+    lightseq::cuda::CHECK_GPU_ERROR(cudaGetDevice(&device));
+    py::array input_arr = input_of_dtype(input, model->get_input_dtype(0));
+    std::vector<int> input_shape(input_arr.shape(),
+                                 input_arr.shape() + input_arr.ndim());
+    // the thread can not touch the numpy array without the GIL
+    const char *input_data = static_cast<const char *>(input_arr.data());
+    std::vector<char> h_input(input_data, input_data + input_arr.nbytes());
+
+    std::shared_ptr<Outputs> outputs = outputs_;
+    future_ = std::async(std::launch::async, [=]() {
+      try {
+        std::lock_guard<std::mutex> lock(*infer_mutex);
+        lightseq::cuda::CHECK_GPU_ERROR(cudaSetDevice(device));
+        pinned->copy_to_device(0, d_input, h_input.data(), h_input.size());
+        model->set_input_ptr(0, d_input);
+        model->set_input_shape(0, input_shape);
+        model->Infer();
+        for (int i = 0; i < model->get_output_size(); i++) {
+          outputs->shapes.push_back(model->get_output_shape(i));
+          outputs->dtypes.push_back(model->get_output_dtype(i));
+          size_t bytes = dtype_bytes(outputs->dtypes[i]) *
+                         std::accumulate(outputs->shapes[i].begin(),
+                                         outputs->shapes[i].end(), 1,
+                                         std::multiplies<int>());
+          outputs->data.emplace_back(bytes);
+          pinned->copy_to_host(i, outputs->data[i].data(),
+                               model->get_output_ptr(i), bytes);
+        }
+      } catch (...) {
+        outputs->error = std::current_exception();
+      }
+    });
+  }
+  PyInferFuture(PyInferFuture &&) = default;
+  ~PyInferFuture() { wait(); }
+
+  bool done() {
+    return !future_.valid() || future_.wait_for(std::chrono::seconds(0)) ==
+                                   std::future_status::ready;
+  }
+
+  py::object result() {
+    wait();
+    if (outputs_->error) {
+      std::rethrow_exception(outputs_->error);
+    }
+    if (outputs_->data.size() == 1) {
+      return host_to_numpy(outputs_->data[0].data(), outputs_->shapes[0],
+                           outputs_->dtypes[0]);
+    }
+    py::tuple result(outputs_->data.size());
+    for (int i = 0; i < outputs_->data.size(); i++) {
+      result[i] = host_to_numpy(outputs_->data[i].data(), outputs_->shapes[i],
+                                outputs_->dtypes[i]);
+    }
+    return result;
+  }
+};
+
 class PyTransformer {
  private:
   lightseq::cuda::LSModel *model_;
   int *d_input_;
   std::vector<void *> d_outputs_;
+  std::mutex infer_mutex_;
+  lightseq::cuda::PinnedBufferPool *pinned_;
 
  public:
   PyTransformer(std::string weight_path, int max_batch_size) {
@@ -36,8 +387,10 @@ class PyTransformer {
       model_->set_output_ptr(i, d_output);
       d_outputs_.push_back(d_output);
     }
+    pinned_ = new lightseq::cuda::PinnedBufferPool(model_);
   }
   ~PyTransformer() {
+    delete pinned_;
     delete model_;
     lightseq::cuda::CHECK_GPU_ERROR(cudaFree(d_input_));
     for (auto d_output : d_outputs_) {
@@ -52,22 +405,21 @@ class PyTransformer {
     int batch_size = input_seq_out.shape(0);
     int batch_seq_len = input_seq_out.shape(1);
 
-    lightseq::cuda::CHECK_GPU_ERROR(
-        cudaMemcpy(d_input_, input_seq_data, sizeof(int) * input_seq_out.size(),
-                   cudaMemcpyHostToDevice));
+    auto lock = lock_without_gil(infer_mutex_);
+    copy_to_device(pinned_, 0, d_input_, input_seq_data,
+                   sizeof(int) * input_seq_out.size());
 
     model_->set_input_ptr(0, d_input_);
     model_->set_input_shape(0, {batch_size, batch_seq_len});
 
-    model_->Infer();
+    infer_without_gil(model_);
 
     std::vector<int> output_shape = model_->get_output_shape(0);
     auto tokens = py::array_t<int>(output_shape);
     int *tokens_data = tokens.mutable_data(0, 0);
     const int *d_output = static_cast<const int *>(model_->get_output_ptr(0));
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(tokens_data, d_output,
-                                               sizeof(int) * tokens.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 0, tokens_data, d_output,
+                 sizeof(int) * tokens.size());
 
     std::vector<int> score_shape = model_->get_output_shape(1);
     auto scores = py::array_t<float>(score_shape);
@@ -75,11 +427,50 @@ class PyTransformer {
     const float *d_scores =
         static_cast<const float *>(model_->get_output_ptr(1));
 
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(scores_data, d_scores,
-                                               sizeof(float) * scores.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 1, scores_data, d_scores,
+                 sizeof(float) * scores.size());
     return std::make_tuple(tokens, scores);
   }
+
+  // (ids, log probs) of the top k tokens of every step of the last infer,
+  // [batch_size, seq_len, k] with LIGHTSEQ_STEP_TOPK=k, eg. for distillation
+  std::tuple<py::array_t<int>, py::array_t<float>> step_topk() {
+    if (model_->get_output_size() < 4) {
+      throw std::runtime_error("step topk needs LIGHTSEQ_STEP_TOPK");
+    }
+    auto lock = lock_without_gil(infer_mutex_);
+    auto ids = py::array_t<int>(model_->get_output_shape(2));
+    copy_to_host(pinned_, 2, ids.mutable_data(), model_->get_output_ptr(2),
+                 sizeof(int) * ids.size());
+    auto log_probs = py::array_t<float>(model_->get_output_shape(3));
+    copy_to_host(pinned_, 3, log_probs.mutable_data(),
+                 model_->get_output_ptr(3), sizeof(float) * log_probs.size());
+    return std::make_tuple(ids, log_probs);
+  }
+
+  // (hits, misses) in sentences of the LIGHTSEQ_ENCDEC_CACHE_SIZE cache
+  std::tuple<long, long> encdec_cache_stats() {
+    return std::make_tuple(model_->get_cache_hits(),
+                           model_->get_cache_misses());
+  }
+
+  // the vocab ids of the following infer calls, all of them if empty
+  void set_vocab_shortlist(std::vector<int> tokens) {
+    auto lock = lock_without_gil(infer_mutex_);
+    model_->set_vocab_shortlist(tokens);
+  }
+
+  // returns what infer would, see PyInferFuture
+  PyInferFuture infer_async(py::array input) {
+    return PyInferFuture(model_, d_input_, pinned_, &infer_mutex_, input);
+  }
+
+  // see infer_cuda
+  py::object infer_cuda(py::object input, py::object outputs) {
+    py::object self = py::cast(this, py::return_value_policy::reference);
+    return ::infer_cuda(model_, infer_mutex_, d_input_, d_outputs_, self,
+                        input, outputs);
+  }
 };
 
 class PyQuantTransformer {
@@ -87,6 +478,8 @@ class PyQuantTransformer {
   lightseq::cuda::LSModel *model_;
   int *d_input_;
   std::vector<void *> d_outputs_;
+  std::mutex infer_mutex_;
+  lightseq::cuda::PinnedBufferPool *pinned_;
 
  public:
   PyQuantTransformer(std::string weight_path, int max_batch_size) {
@@ -109,8 +502,10 @@ class PyQuantTransformer {
       model_->set_output_ptr(i, d_output);
       d_outputs_.push_back(d_output);
     }
+    pinned_ = new lightseq::cuda::PinnedBufferPool(model_);
   }
   ~PyQuantTransformer() {
+    delete pinned_;
     delete model_;
     lightseq::cuda::CHECK_GPU_ERROR(cudaFree(d_input_));
     for (auto d_output : d_outputs_) {
@@ -125,22 +520,21 @@ class PyQuantTransformer {
     int batch_size = input_seq_out.shape(0);
     int batch_seq_len = input_seq_out.shape(1);
 
-    lightseq::cuda::CHECK_GPU_ERROR(
-        cudaMemcpy(d_input_, input_seq_data, sizeof(int) * input_seq_out.size(),
-                   cudaMemcpyHostToDevice));
+    auto lock = lock_without_gil(infer_mutex_);
+    copy_to_device(pinned_, 0, d_input_, input_seq_data,
+                   sizeof(int) * input_seq_out.size());
 
     model_->set_input_ptr(0, d_input_);
     model_->set_input_shape(0, {batch_size, batch_seq_len});
 
-    model_->Infer();
+    infer_without_gil(model_);
 
     std::vector<int> output_shape = model_->get_output_shape(0);
     auto tokens = py::array_t<int>(output_shape);
     int *tokens_data = tokens.mutable_data(0, 0);
     const int *d_output = static_cast<const int *>(model_->get_output_ptr(0));
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(tokens_data, d_output,
-                                               sizeof(int) * tokens.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 0, tokens_data, d_output,
+                 sizeof(int) * tokens.size());
 
     std::vector<int> score_shape = model_->get_output_shape(1);
     auto scores = py::array_t<float>(score_shape);
@@ -148,11 +542,22 @@ class PyQuantTransformer {
     const float *d_scores =
         static_cast<const float *>(model_->get_output_ptr(1));
 
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(scores_data, d_scores,
-                                               sizeof(float) * scores.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 1, scores_data, d_scores,
+                 sizeof(float) * scores.size());
     return std::make_tuple(tokens, scores);
   }
+
+  // returns what infer would, see PyInferFuture
+  PyInferFuture infer_async(py::array input) {
+    return PyInferFuture(model_, d_input_, pinned_, &infer_mutex_, input);
+  }
+
+  // see infer_cuda
+  py::object infer_cuda(py::object input, py::object outputs) {
+    py::object self = py::cast(this, py::return_value_policy::reference);
+    return ::infer_cuda(model_, infer_mutex_, d_input_, d_outputs_, self,
+                        input, outputs);
+  }
 };
 
 class PyBert {
@@ -160,6 +565,8 @@ class PyBert {
   lightseq::cuda::LSModel *model_;
   int *d_input_;
   std::vector<void *> d_outputs_;
+  std::mutex infer_mutex_;
+  lightseq::cuda::PinnedBufferPool *pinned_;
 
  public:
   PyBert(std::string weight_path, int max_batch_size) {
@@ -182,8 +589,10 @@ class PyBert {
       model_->set_output_ptr(i, d_output);
       d_outputs_.push_back(d_output);
     }
+    pinned_ = new lightseq::cuda::PinnedBufferPool(model_);
   }
   ~PyBert() {
+    delete pinned_;
     delete model_;
     lightseq::cuda::CHECK_GPU_ERROR(cudaFree(d_input_));
     for (auto d_output : d_outputs_) {
@@ -198,14 +607,14 @@ class PyBert {
     int batch_size = input_seq_out.shape(0);
     int batch_seq_len = input_seq_out.shape(1);
 
-    lightseq::cuda::CHECK_GPU_ERROR(
-        cudaMemcpy(d_input_, input_seq_data, sizeof(int) * input_seq_out.size(),
-                   cudaMemcpyHostToDevice));
+    auto lock = lock_without_gil(infer_mutex_);
+    copy_to_device(pinned_, 0, d_input_, input_seq_data,
+                   sizeof(int) * input_seq_out.size());
 
     model_->set_input_ptr(0, d_input_);
     model_->set_input_shape(0, {batch_size, batch_seq_len});
 
-    model_->Infer();
+    infer_without_gil(model_);
 
     std::vector<int> output_shape = model_->get_output_shape(0);
     auto output = py::array_t<float>(output_shape);
@@ -215,16 +624,14 @@ class PyBert {
       const float *d_output =
           static_cast<const float *>(model_->get_output_ptr(0));
 
-      lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(output_data, d_output,
-                                                 sizeof(float) * output.size(),
-                                                 cudaMemcpyDeviceToHost));
+      copy_to_host(pinned_, 0, output_data, d_output,
+                   sizeof(float) * output.size());
     } else if (output_type == lightseq::cuda::kFloat16) {
       const half *d_output =
           static_cast<const half *>(model_->get_output_ptr(0));
       std::vector<half> h_bert_out(output.size());
-      lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(h_bert_out.data(), d_output,
-                                                 sizeof(half) * output.size(),
-                                                 cudaMemcpyDeviceToHost));
+      copy_to_host(pinned_, 0, h_bert_out.data(), d_output,
+                   sizeof(half) * output.size());
       for (auto i = 0; i < h_bert_out.size(); i++) {
         float f_data = __half2float(h_bert_out[i]);
         output_data[i] = f_data;
@@ -235,6 +642,18 @@ class PyBert {
 
     return output;
   }
+
+  // returns what infer would, see PyInferFuture
+  PyInferFuture infer_async(py::array input) {
+    return PyInferFuture(model_, d_input_, pinned_, &infer_mutex_, input);
+  }
+
+  // see infer_cuda
+  py::object infer_cuda(py::object input, py::object outputs) {
+    py::object self = py::cast(this, py::return_value_policy::reference);
+    return ::infer_cuda(model_, infer_mutex_, d_input_, d_outputs_, self,
+                        input, outputs);
+  }
 };
 
 class PyQuantBert {
@@ -242,6 +661,8 @@ class PyQuantBert {
   lightseq::cuda::LSModel *model_;
   int *d_input_;
   std::vector<void *> d_outputs_;
+  std::mutex infer_mutex_;
+  lightseq::cuda::PinnedBufferPool *pinned_;
 
  public:
   PyQuantBert(std::string weight_path, int max_batch_size) {
@@ -264,8 +685,10 @@ class PyQuantBert {
       model_->set_output_ptr(i, d_output);
       d_outputs_.push_back(d_output);
     }
+    pinned_ = new lightseq::cuda::PinnedBufferPool(model_);
   }
   ~PyQuantBert() {
+    delete pinned_;
     delete model_;
     lightseq::cuda::CHECK_GPU_ERROR(cudaFree(d_input_));
     for (auto d_output : d_outputs_) {
@@ -280,14 +703,14 @@ class PyQuantBert {
     int batch_size = input_seq_out.shape(0);
     int batch_seq_len = input_seq_out.shape(1);
 
-    lightseq::cuda::CHECK_GPU_ERROR(
-        cudaMemcpy(d_input_, input_seq_data, sizeof(int) * input_seq_out.size(),
-                   cudaMemcpyHostToDevice));
+    auto lock = lock_without_gil(infer_mutex_);
+    copy_to_device(pinned_, 0, d_input_, input_seq_data,
+                   sizeof(int) * input_seq_out.size());
 
     model_->set_input_ptr(0, d_input_);
     model_->set_input_shape(0, {batch_size, batch_seq_len});
 
-    model_->Infer();
+    infer_without_gil(model_);
 
     std::vector<int> output_shape = model_->get_output_shape(0);
     auto output = py::array_t<float>(output_shape);
@@ -297,16 +720,14 @@ class PyQuantBert {
       const float *d_output =
           static_cast<const float *>(model_->get_output_ptr(0));
 
-      lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(output_data, d_output,
-                                                 sizeof(float) * output.size(),
-                                                 cudaMemcpyDeviceToHost));
+      copy_to_host(pinned_, 0, output_data, d_output,
+                   sizeof(float) * output.size());
     } else if (output_type == lightseq::cuda::kFloat16) {
       const half *d_output =
           static_cast<const half *>(model_->get_output_ptr(0));
       std::vector<half> h_bert_out(output.size());
-      lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(h_bert_out.data(), d_output,
-                                                 sizeof(half) * output.size(),
-                                                 cudaMemcpyDeviceToHost));
+      copy_to_host(pinned_, 0, h_bert_out.data(), d_output,
+                   sizeof(half) * output.size());
       for (auto i = 0; i < h_bert_out.size(); i++) {
         float f_data = __half2float(h_bert_out[i]);
         output_data[i] = f_data;
@@ -317,6 +738,18 @@ class PyQuantBert {
 
     return output;
   }
+
+  // returns what infer would, see PyInferFuture
+  PyInferFuture infer_async(py::array input) {
+    return PyInferFuture(model_, d_input_, pinned_, &infer_mutex_, input);
+  }
+
+  // see infer_cuda
+  py::object infer_cuda(py::object input, py::object outputs) {
+    py::object self = py::cast(this, py::return_value_policy::reference);
+    return ::infer_cuda(model_, infer_mutex_, d_input_, d_outputs_, self,
+                        input, outputs);
+  }
 };
 
 class PyGpt {
@@ -324,6 +757,8 @@ class PyGpt {
   lightseq::cuda::LSModel *model_;
   int *d_input_;
   std::vector<void *> d_outputs_;
+  std::mutex infer_mutex_;
+  lightseq::cuda::PinnedBufferPool *pinned_;
 
  public:
   PyGpt(std::string weight_path, int max_batch_size) {
@@ -346,8 +781,10 @@ class PyGpt {
       model_->set_output_ptr(i, d_output);
       d_outputs_.push_back(d_output);
     }
+    pinned_ = new lightseq::cuda::PinnedBufferPool(model_);
   }
   ~PyGpt() {
+    delete pinned_;
     delete model_;
     lightseq::cuda::CHECK_GPU_ERROR(cudaFree(d_input_));
     for (auto d_output : d_outputs_) {
@@ -368,22 +805,21 @@ class PyGpt {
           "ppl");
     }
 
-    lightseq::cuda::CHECK_GPU_ERROR(
-        cudaMemcpy(d_input_, input_seq_data, sizeof(int) * input_seq_out.size(),
-                   cudaMemcpyHostToDevice));
+    auto lock = lock_without_gil(infer_mutex_);
+    copy_to_device(pinned_, 0, d_input_, input_seq_data,
+                   sizeof(int) * input_seq_out.size());
 
     model_->set_input_ptr(0, d_input_);
     model_->set_input_shape(0, {batch_size, batch_seq_len});
 
-    model_->Infer();
+    infer_without_gil(model_);
 
     std::vector<int> output_shape = model_->get_output_shape(0);
     auto output = py::array_t<int>(output_shape);
     int *output_data = output.mutable_data(0, 0);
     const int *d_output = static_cast<const int *>(model_->get_output_ptr(0));
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(output_data, d_output,
-                                               sizeof(int) * output.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 0, output_data, d_output,
+                 sizeof(int) * output.size());
 
     return output;
   }
@@ -401,14 +837,14 @@ class PyGpt {
           "topk or topp");
     }
 
-    lightseq::cuda::CHECK_GPU_ERROR(
-        cudaMemcpy(d_input_, input_seq_data, sizeof(int) * input_seq_out.size(),
-                   cudaMemcpyHostToDevice));
+    auto lock = lock_without_gil(infer_mutex_);
+    copy_to_device(pinned_, 0, d_input_, input_seq_data,
+                   sizeof(int) * input_seq_out.size());
 
     model_->set_input_ptr(0, d_input_);
     model_->set_input_shape(0, {batch_size, batch_seq_len});
 
-    model_->Infer();
+    infer_without_gil(model_);
 
     std::vector<int> output_shape = model_->get_output_shape(0);
 
@@ -416,12 +852,64 @@ class PyGpt {
     float *output_data = output.mutable_data();
     const float *d_output =
         static_cast<const float *>(model_->get_output_ptr(0));
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(output_data, d_output,
-                                               sizeof(float) * output.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 0, output_data, d_output,
+                 sizeof(float) * output.size());
 
     return output;
   }
+
+  // see LSModel::score_packed, the sequences are tokens[offsets[i],
+  // offsets[i + 1]). Returns the ppl of every sequence, and the log prob of
+  // every token too if return_token_log_probs.
+  py::object ppl_packed(
+      py::array_t<int, py::array::c_style | py::array::forcecast> tokens,
+      py::array_t<int, py::array::c_style | py::array::forcecast> offsets,
+      bool return_token_log_probs) {
+    auto tokens_out = tokens.unchecked<1>();
+    auto offsets_out = offsets.unchecked<1>();
+    int num_seqs = offsets_out.shape(0) - 1;
+    if (num_seqs < 0 || offsets_out(0) < 0 ||
+        offsets_out(num_seqs) > tokens_out.shape(0)) {
+      throw std::runtime_error(
+          "offsets must be num_seqs + 1 positions of tokens");
+    }
+
+    auto ppl = py::array_t<float>(num_seqs);
+    py::array_t<float> token_log_probs;
+    float *token_log_probs_data = nullptr;
+    if (return_token_log_probs) {
+      token_log_probs = py::array_t<float>(tokens_out.shape(0));
+      token_log_probs_data = token_log_probs.mutable_data();
+      std::fill(token_log_probs_data,
+                token_log_probs_data + token_log_probs.size(), 0.f);
+    }
+    float *ppl_data = ppl.mutable_data();
+    const int *tokens_data = tokens.data();
+    const int *offsets_data = offsets.data();
+    {
+      auto lock = lock_without_gil(infer_mutex_);
+      py::gil_scoped_release release;
+      model_->score_packed(tokens_data, offsets_data, num_seqs, ppl_data,
+                           token_log_probs_data);
+    }
+
+    if (return_token_log_probs) {
+      return py::make_tuple(ppl, token_log_probs);
+    }
+    return ppl;
+  }
+
+  // returns what sample or ppl would, see PyInferFuture
+  PyInferFuture infer_async(py::array input) {
+    return PyInferFuture(model_, d_input_, pinned_, &infer_mutex_, input);
+  }
+
+  // see infer_cuda
+  py::object infer_cuda(py::object input, py::object outputs) {
+    py::object self = py::cast(this, py::return_value_policy::reference);
+    return ::infer_cuda(model_, infer_mutex_, d_input_, d_outputs_, self,
+                        input, outputs);
+  }
 };
 
 class PyQuantGpt {
@@ -429,6 +917,8 @@ class PyQuantGpt {
   lightseq::cuda::LSModel *model_;
   int *d_input_;
   std::vector<void *> d_outputs_;
+  std::mutex infer_mutex_;
+  lightseq::cuda::PinnedBufferPool *pinned_;
 
  public:
   PyQuantGpt(std::string weight_path, int max_batch_size) {
@@ -451,8 +941,10 @@ class PyQuantGpt {
       model_->set_output_ptr(i, d_output);
       d_outputs_.push_back(d_output);
     }
+    pinned_ = new lightseq::cuda::PinnedBufferPool(model_);
   }
   ~PyQuantGpt() {
+    delete pinned_;
     delete model_;
     lightseq::cuda::CHECK_GPU_ERROR(cudaFree(d_input_));
     for (auto d_output : d_outputs_) {
@@ -473,22 +965,21 @@ class PyQuantGpt {
           "ppl");
     }
 
-    lightseq::cuda::CHECK_GPU_ERROR(
-        cudaMemcpy(d_input_, input_seq_data, sizeof(int) * input_seq_out.size(),
-                   cudaMemcpyHostToDevice));
+    auto lock = lock_without_gil(infer_mutex_);
+    copy_to_device(pinned_, 0, d_input_, input_seq_data,
+                   sizeof(int) * input_seq_out.size());
 
     model_->set_input_ptr(0, d_input_);
     model_->set_input_shape(0, {batch_size, batch_seq_len});
 
-    model_->Infer();
+    infer_without_gil(model_);
 
     std::vector<int> output_shape = model_->get_output_shape(0);
     auto output = py::array_t<int>(output_shape);
     int *output_data = output.mutable_data(0, 0);
     const int *d_output = static_cast<const int *>(model_->get_output_ptr(0));
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(output_data, d_output,
-                                               sizeof(int) * output.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 0, output_data, d_output,
+                 sizeof(int) * output.size());
 
     return output;
   }
@@ -506,14 +997,14 @@ class PyQuantGpt {
           "ppl");
     }
 
-    lightseq::cuda::CHECK_GPU_ERROR(
-        cudaMemcpy(d_input_, input_seq_data, sizeof(int) * input_seq_out.size(),
-                   cudaMemcpyHostToDevice));
+    auto lock = lock_without_gil(infer_mutex_);
+    copy_to_device(pinned_, 0, d_input_, input_seq_data,
+                   sizeof(int) * input_seq_out.size());
 
     model_->set_input_ptr(0, d_input_);
     model_->set_input_shape(0, {batch_size, batch_seq_len});
 
-    model_->Infer();
+    infer_without_gil(model_);
 
     std::vector<int> output_shape = model_->get_output_shape(0);
 
@@ -521,12 +1012,23 @@ class PyQuantGpt {
     float *output_data = output.mutable_data();
     const float *d_output =
         static_cast<const float *>(model_->get_output_ptr(0));
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(output_data, d_output,
-                                               sizeof(float) * output.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 0, output_data, d_output,
+                 sizeof(float) * output.size());
 
     return output;
   }
+
+  // returns what sample or ppl would, see PyInferFuture
+  PyInferFuture infer_async(py::array input) {
+    return PyInferFuture(model_, d_input_, pinned_, &infer_mutex_, input);
+  }
+
+  // see infer_cuda
+  py::object infer_cuda(py::object input, py::object outputs) {
+    py::object self = py::cast(this, py::return_value_policy::reference);
+    return ::infer_cuda(model_, infer_mutex_, d_input_, d_outputs_, self,
+                        input, outputs);
+  }
 };
 
 class PyMoe {
@@ -534,6 +1036,8 @@ class PyMoe {
   lightseq::cuda::LSModel *model_;
   int *d_input_;
   std::vector<void *> d_outputs_;
+  std::mutex infer_mutex_;
+  lightseq::cuda::PinnedBufferPool *pinned_;
 
  public:
   PyMoe(std::string weight_path, int max_batch_size) {
@@ -556,8 +1060,10 @@ class PyMoe {
       model_->set_output_ptr(i, d_output);
       d_outputs_.push_back(d_output);
     }
+    pinned_ = new lightseq::cuda::PinnedBufferPool(model_);
   }
   ~PyMoe() {
+    delete pinned_;
     delete model_;
     lightseq::cuda::CHECK_GPU_ERROR(cudaFree(d_input_));
     for (auto d_output : d_outputs_) {
@@ -572,22 +1078,21 @@ class PyMoe {
     int batch_size = input_seq_out.shape(0);
     int batch_seq_len = input_seq_out.shape(1);
 
-    lightseq::cuda::CHECK_GPU_ERROR(
-        cudaMemcpy(d_input_, input_seq_data, sizeof(int) * input_seq_out.size(),
-                   cudaMemcpyHostToDevice));
+    auto lock = lock_without_gil(infer_mutex_);
+    copy_to_device(pinned_, 0, d_input_, input_seq_data,
+                   sizeof(int) * input_seq_out.size());
 
     model_->set_input_ptr(0, d_input_);
     model_->set_input_shape(0, {batch_size, batch_seq_len});
 
-    model_->Infer();
+    infer_without_gil(model_);
 
     std::vector<int> output_shape = model_->get_output_shape(0);
     auto tokens = py::array_t<int>(output_shape);
     int *tokens_data = tokens.mutable_data(0, 0);
     const int *d_output = static_cast<const int *>(model_->get_output_ptr(0));
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(tokens_data, d_output,
-                                               sizeof(int) * tokens.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 0, tokens_data, d_output,
+                 sizeof(int) * tokens.size());
 
     std::vector<int> score_shape = model_->get_output_shape(1);
     auto scores = py::array_t<int>(score_shape);
@@ -595,11 +1100,22 @@ class PyMoe {
     const float *d_scores =
         static_cast<const float *>(model_->get_output_ptr(1));
 
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(scores_data, d_scores,
-                                               sizeof(float) * scores.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 1, scores_data, d_scores,
+                 sizeof(float) * scores.size());
     return std::make_tuple(tokens, scores);
   }
+
+  // returns what infer would, see PyInferFuture
+  PyInferFuture infer_async(py::array input) {
+    return PyInferFuture(model_, d_input_, pinned_, &infer_mutex_, input);
+  }
+
+  // see infer_cuda
+  py::object infer_cuda(py::object input, py::object outputs) {
+    py::object self = py::cast(this, py::return_value_policy::reference);
+    return ::infer_cuda(model_, infer_mutex_, d_input_, d_outputs_, self,
+                        input, outputs);
+  }
 };
 
 class PyT5 {
@@ -607,6 +1123,8 @@ class PyT5 {
   lightseq::cuda::LSModel *model_;
   int *d_input_;
   std::vector<void *> d_outputs_;
+  std::mutex infer_mutex_;
+  lightseq::cuda::PinnedBufferPool *pinned_;
 
  public:
   PyT5(std::string weight_path, int max_batch_size) {
@@ -629,8 +1147,10 @@ class PyT5 {
       model_->set_output_ptr(i, d_output);
       d_outputs_.push_back(d_output);
     }
+    pinned_ = new lightseq::cuda::PinnedBufferPool(model_);
   }
   ~PyT5() {
+    delete pinned_;
     delete model_;
     lightseq::cuda::CHECK_GPU_ERROR(cudaFree(d_input_));
     for (auto d_output : d_outputs_) {
@@ -645,22 +1165,21 @@ class PyT5 {
     int batch_size = input_seq_out.shape(0);
     int batch_seq_len = input_seq_out.shape(1);
 
-    lightseq::cuda::CHECK_GPU_ERROR(
-        cudaMemcpy(d_input_, input_seq_data, sizeof(int) * input_seq_out.size(),
-                   cudaMemcpyHostToDevice));
+    auto lock = lock_without_gil(infer_mutex_);
+    copy_to_device(pinned_, 0, d_input_, input_seq_data,
+                   sizeof(int) * input_seq_out.size());
 
     model_->set_input_ptr(0, d_input_);
     model_->set_input_shape(0, {batch_size, batch_seq_len});
 
-    model_->Infer();
+    infer_without_gil(model_);
 
     std::vector<int> output_shape = model_->get_output_shape(0);
     auto tokens = py::array_t<int>(output_shape);
     int *tokens_data = tokens.mutable_data(0, 0);
     const int *d_output = static_cast<const int *>(model_->get_output_ptr(0));
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(tokens_data, d_output,
-                                               sizeof(int) * tokens.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 0, tokens_data, d_output,
+                 sizeof(int) * tokens.size());
 
     std::vector<int> score_shape = model_->get_output_shape(1);
     auto scores = py::array_t<float>(score_shape);
@@ -668,11 +1187,22 @@ class PyT5 {
     const float *d_scores =
         static_cast<const float *>(model_->get_output_ptr(1));
 
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(scores_data, d_scores,
-                                               sizeof(float) * scores.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 1, scores_data, d_scores,
+                 sizeof(float) * scores.size());
     return std::make_tuple(tokens, scores);
   }
+
+  // returns what infer would, see PyInferFuture
+  PyInferFuture infer_async(py::array input) {
+    return PyInferFuture(model_, d_input_, pinned_, &infer_mutex_, input);
+  }
+
+  // see infer_cuda
+  py::object infer_cuda(py::object input, py::object outputs) {
+    py::object self = py::cast(this, py::return_value_policy::reference);
+    return ::infer_cuda(model_, infer_mutex_, d_input_, d_outputs_, self,
+                        input, outputs);
+  }
 };
 
 class PyMT5 {
@@ -680,6 +1210,8 @@ class PyMT5 {
   lightseq::cuda::LSModel *model_;
   int *d_input_;
   std::vector<void *> d_outputs_;
+  std::mutex infer_mutex_;
+  lightseq::cuda::PinnedBufferPool *pinned_;
 
  public:
   PyMT5(std::string weight_path, int max_batch_size) {
@@ -702,8 +1234,10 @@ class PyMT5 {
       model_->set_output_ptr(i, d_output);
       d_outputs_.push_back(d_output);
     }
+    pinned_ = new lightseq::cuda::PinnedBufferPool(model_);
   }
   ~PyMT5() {
+    delete pinned_;
     delete model_;
     lightseq::cuda::CHECK_GPU_ERROR(cudaFree(d_input_));
     for (auto d_output : d_outputs_) {
@@ -718,22 +1252,21 @@ class PyMT5 {
     int batch_size = input_seq_out.shape(0);
     int batch_seq_len = input_seq_out.shape(1);
 
-    lightseq::cuda::CHECK_GPU_ERROR(
-        cudaMemcpy(d_input_, input_seq_data, sizeof(int) * input_seq_out.size(),
-                   cudaMemcpyHostToDevice));
+    auto lock = lock_without_gil(infer_mutex_);
+    copy_to_device(pinned_, 0, d_input_, input_seq_data,
+                   sizeof(int) * input_seq_out.size());
 
     model_->set_input_ptr(0, d_input_);
     model_->set_input_shape(0, {batch_size, batch_seq_len});
 
-    model_->Infer();
+    infer_without_gil(model_);
 
     std::vector<int> output_shape = model_->get_output_shape(0);
     auto tokens = py::array_t<int>(output_shape);
     int *tokens_data = tokens.mutable_data(0, 0);
     const int *d_output = static_cast<const int *>(model_->get_output_ptr(0));
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(tokens_data, d_output,
-                                               sizeof(int) * tokens.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 0, tokens_data, d_output,
+                 sizeof(int) * tokens.size());
 
     std::vector<int> score_shape = model_->get_output_shape(1);
     auto scores = py::array_t<float>(score_shape);
@@ -741,11 +1274,22 @@ class PyMT5 {
     const float *d_scores =
         static_cast<const float *>(model_->get_output_ptr(1));
 
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(scores_data, d_scores,
-                                               sizeof(float) * scores.size(),
-                                               cudaMemcpyDeviceToHost));
+    copy_to_host(pinned_, 1, scores_data, d_scores,
+                 sizeof(float) * scores.size());
     return std::make_tuple(tokens, scores);
   }
+
+  // returns what infer would, see PyInferFuture
+  PyInferFuture infer_async(py::array input) {
+    return PyInferFuture(model_, d_input_, pinned_, &infer_mutex_, input);
+  }
+
+  // see infer_cuda
+  py::object infer_cuda(py::object input, py::object outputs) {
+    py::object self = py::cast(this, py::return_value_policy::reference);
+    return ::infer_cuda(model_, infer_mutex_, d_input_, d_outputs_, self,
+                        input, outputs);
+  }
 };
 
 class PyVit {
@@ -753,11 +1297,15 @@ class PyVit {
   lightseq::cuda::LSModel *model_;
   float *d_input_;
   std::vector<void *> d_outputs_;
+  std::mutex infer_mutex_;
+  lightseq::cuda::PinnedBufferPool *pinned_;
 
  public:
-  PyVit(std::string weight_path, int max_batch_size) {
+  // With uint8_input, the pixels are uint8 images [batch_size, image_size,
+  // image_size, channel_input] normalized on the GPU, see VitUint8.
+  PyVit(std::string weight_path, int max_batch_size, bool uint8_input) {
     model_ = lightseq::cuda::LSModelFactory::GetInstance().CreateModel(
-        "Vit", weight_path, max_batch_size);
+        uint8_input ? "VitUint8" : "Vit", weight_path, max_batch_size);
     std::vector<int> max_input_shape = model_->get_input_max_shape(0);
     int max_size =
         std::accumulate(max_input_shape.begin(), max_input_shape.end(), 1,
@@ -775,8 +1323,10 @@ class PyVit {
       model_->set_output_ptr(i, d_output);
       d_outputs_.push_back(d_output);
     }
+    pinned_ = new lightseq::cuda::PinnedBufferPool(model_);
   }
   ~PyVit() {
+    delete pinned_;
     delete model_;
     lightseq::cuda::CHECK_GPU_ERROR(cudaFree(d_input_));
     for (auto d_output : d_outputs_) {
@@ -784,23 +1334,21 @@ class PyVit {
     }
   }
 
-  py::array_t<float> infer(
-      py::array_t<float, py::array::c_style | py::array::forcecast> input_seq) {
-    auto input_seq_out = input_seq.mutable_unchecked<4>();
-    const float *input_seq_data = input_seq_out.data(0, 0, 0, 0);
-    int batch_size = input_seq_out.shape(0);
-    int channel_input = input_seq_out.shape(1);
-    int image_size = input_seq_out.shape(2);
+  py::array_t<float> infer(py::array pixel_values) {
+    py::array input_arr =
+        input_of_dtype(pixel_values, model_->get_input_dtype(0));
+    if (input_arr.ndim() != 4) {
+      throw std::invalid_argument("pixel_values must have 4 dims");
+    }
+    std::vector<int> input_shape(input_arr.shape(), input_arr.shape() + 4);
 
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(
-        d_input_, input_seq_data, sizeof(float) * input_seq_out.size(),
-        cudaMemcpyHostToDevice));
+    auto lock = lock_without_gil(infer_mutex_);
+    copy_to_device(pinned_, 0, d_input_, input_arr.data(), input_arr.nbytes());
 
     model_->set_input_ptr(0, d_input_);
-    model_->set_input_shape(
-        0, {batch_size, channel_input, image_size, image_size});
+    model_->set_input_shape(0, input_shape);
 
-    model_->Infer();
+    infer_without_gil(model_);
 
     std::vector<int> output_shape = model_->get_output_shape(0);
     auto output = py::array_t<float>(output_shape);
@@ -810,16 +1358,14 @@ class PyVit {
       const float *d_output =
           static_cast<const float *>(model_->get_output_ptr(0));
 
-      lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(output_data, d_output,
-                                                 sizeof(float) * output.size(),
-                                                 cudaMemcpyDeviceToHost));
+      copy_to_host(pinned_, 0, output_data, d_output,
+                   sizeof(float) * output.size());
     } else if (output_type == lightseq::cuda::kFloat16) {
       const half *d_output =
           static_cast<const half *>(model_->get_output_ptr(0));
       std::vector<half> h_vit_out(output.size());
-      lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(h_vit_out.data(), d_output,
-                                                 sizeof(half) * output.size(),
-                                                 cudaMemcpyDeviceToHost));
+      copy_to_host(pinned_, 0, h_vit_out.data(), d_output,
+                   sizeof(half) * output.size());
       for (auto i = 0; i < h_vit_out.size(); i++) {
         float f_data = __half2float(h_vit_out[i]);
         output_data[i] = f_data;
@@ -830,6 +1376,18 @@ class PyVit {
 
     return output;
   }
+
+  // returns what infer would, see PyInferFuture
+  PyInferFuture infer_async(py::array input) {
+    return PyInferFuture(model_, d_input_, pinned_, &infer_mutex_, input);
+  }
+
+  // see infer_cuda
+  py::object infer_cuda(py::object input, py::object outputs) {
+    py::object self = py::cast(this, py::return_value_policy::reference);
+    return ::infer_cuda(model_, infer_mutex_, d_input_, d_outputs_, self,
+                        input, outputs);
+  }
 };
 
 class PyQuantVit {
@@ -837,6 +1395,8 @@ class PyQuantVit {
   lightseq::cuda::LSModel *model_;
   float *d_input_;
   std::vector<void *> d_outputs_;
+  std::mutex infer_mutex_;
+  lightseq::cuda::PinnedBufferPool *pinned_;
 
  public:
   PyQuantVit(std::string weight_path, int max_batch_size) {
@@ -859,8 +1419,10 @@ class PyQuantVit {
       model_->set_output_ptr(i, d_output);
       d_outputs_.push_back(d_output);
     }
+    pinned_ = new lightseq::cuda::PinnedBufferPool(model_);
   }
   ~PyQuantVit() {
+    delete pinned_;
     delete model_;
     lightseq::cuda::CHECK_GPU_ERROR(cudaFree(d_input_));
     for (auto d_output : d_outputs_) {
@@ -876,15 +1438,15 @@ class PyQuantVit {
     int channel_input = input_seq_out.shape(1);
     int image_size = input_seq_out.shape(2);
 
-    lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(
-        d_input_, input_seq_data, sizeof(float) * input_seq_out.size(),
-        cudaMemcpyHostToDevice));
+    auto lock = lock_without_gil(infer_mutex_);
+    copy_to_device(pinned_, 0, d_input_, input_seq_data,
+                   sizeof(float) * input_seq_out.size());
 
     model_->set_input_ptr(0, d_input_);
     model_->set_input_shape(
         0, {batch_size, channel_input, image_size, image_size});
 
-    model_->Infer();
+    infer_without_gil(model_);
 
     std::vector<int> output_shape = model_->get_output_shape(0);
     auto output = py::array_t<float>(output_shape);
@@ -894,16 +1456,14 @@ class PyQuantVit {
       const float *d_output =
           static_cast<const float *>(model_->get_output_ptr(0));
 
-      lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(output_data, d_output,
-                                                 sizeof(float) * output.size(),
-                                                 cudaMemcpyDeviceToHost));
+      copy_to_host(pinned_, 0, output_data, d_output,
+                   sizeof(float) * output.size());
     } else if (output_type == lightseq::cuda::kFloat16) {
       const half *d_output =
           static_cast<const half *>(model_->get_output_ptr(0));
       std::vector<half> h_vit_out(output.size());
-      lightseq::cuda::CHECK_GPU_ERROR(cudaMemcpy(h_vit_out.data(), d_output,
-                                                 sizeof(half) * output.size(),
-                                                 cudaMemcpyDeviceToHost));
+      copy_to_host(pinned_, 0, h_vit_out.data(), d_output,
+                   sizeof(half) * output.size());
       for (auto i = 0; i < h_vit_out.size(); i++) {
         float f_data = __half2float(h_vit_out[i]);
         output_data[i] = f_data;
@@ -914,10 +1474,63 @@ class PyQuantVit {
 
     return output;
   }
+
+  // returns what infer would, see PyInferFuture
+  PyInferFuture infer_async(py::array input) {
+    return PyInferFuture(model_, d_input_, pinned_, &infer_mutex_, input);
+  }
+
+  // see infer_cuda
+  py::object infer_cuda(py::object input, py::object outputs) {
+    py::object self = py::cast(this, py::return_value_policy::reference);
+    return ::infer_cuda(model_, infer_mutex_, d_input_, d_outputs_, self,
+                        input, outputs);
+  }
+};
+
+class PyModelPool {
+ private:
+  lightseq::cuda::ModelPool *pool_;
+
+ public:
+  PyModelPool(std::string model_name, std::string weight_path,
+              int max_batch_size, std::vector<int> devices) {
+    pool_ = new lightseq::cuda::ModelPool(model_name, weight_path,
+                                          max_batch_size, devices);
+  }
+  ~PyModelPool() { delete pool_; }
+
+  py::tuple infer(py::array input) {
+    py::array input_arr = input_of_dtype(input, pool_->get_input_dtype());
+    std::vector<int> input_shape(input_arr.shape(),
+                                 input_arr.shape() + input_arr.ndim());
+    const void *input_data = input_arr.data();
+    {
+      // the replicas run without the GIL
+      py::gil_scoped_release release;
+      pool_->Infer(input_data, input_shape);
+    }
+
+    py::tuple outputs(pool_->get_output_size());
+    for (int i = 0; i < pool_->get_output_size(); i++) {
+      outputs[i] = host_to_numpy(pool_->get_output_ptr(i),
+                                 pool_->get_output_shape(i),
+                                 pool_->get_output_dtype(i));
+    }
+    return outputs;
+  }
 };
 
 PYBIND11_MODULE(inference, m) {
   m.attr("__name__") = "lightseq.inference";
+  py::class_<PyCudaOutput>(m, "CudaOutput")
+      .def_property_readonly("__cuda_array_interface__",
+                             &PyCudaOutput::cuda_array_interface);
+
+  py::class_<PyInferFuture>(m, "InferFuture")
+      .def("done", &PyInferFuture::done)
+      .def("result", &PyInferFuture::result);
+
   py::class_<lightseq::cuda::TransformerDecoder>(m, "TransformerDecoder")
       .def(py::init<const std::string, const int>(), py::arg("weight_path"),
            py::arg("max_batch_size"))
@@ -927,33 +1540,59 @@ PYBIND11_MODULE(inference, m) {
       .def(py::init<const std::string, const int>(), py::arg("weight_path"),
            py::arg("max_batch_size"))
       .def("infer", &PyTransformer::infer,
-           py::return_value_policy::reference_internal, py::arg("input_seq"));
+           py::return_value_policy::reference_internal, py::arg("input_seq"))
+      .def("encdec_cache_stats", &PyTransformer::encdec_cache_stats)
+      .def("step_topk", &PyTransformer::step_topk)
+      .def("set_vocab_shortlist", &PyTransformer::set_vocab_shortlist,
+           py::arg("tokens"))
+      .def("infer_async", &PyTransformer::infer_async, py::keep_alive<0, 1>(),
+           py::arg("input"))
+      .def("infer_cuda", &PyTransformer::infer_cuda, py::arg("input"),
+           py::arg("outputs") = py::none());
 
   py::class_<PyT5>(m, "T5")
       .def(py::init<const std::string, const int>(), py::arg("weight_path"),
            py::arg("max_batch_size"))
       .def("infer", &PyT5::infer, py::return_value_policy::reference_internal,
-           py::arg("input_seq"));
+           py::arg("input_seq"))
+      .def("infer_async", &PyT5::infer_async, py::keep_alive<0, 1>(),
+           py::arg("input"))
+      .def("infer_cuda", &PyT5::infer_cuda, py::arg("input"),
+           py::arg("outputs") = py::none());
 
   py::class_<PyMT5>(m, "MT5")
       .def(py::init<const std::string, const int>(), py::arg("weight_path"),
            py::arg("max_batch_size"))
       .def("infer", &PyMT5::infer, py::return_value_policy::reference_internal,
-           py::arg("input_seq"));
+           py::arg("input_seq"))
+      .def("infer_async", &PyMT5::infer_async, py::keep_alive<0, 1>(),
+           py::arg("input"))
+      .def("infer_cuda", &PyMT5::infer_cuda, py::arg("input"),
+           py::arg("outputs") = py::none());
 
   py::class_<PyQuantTransformer>(m, "QuantTransformer")
       .def(py::init<const std::string, const int>(), py::arg("weight_path"),
            py::arg("max_batch_size"))
       .def("infer", &PyQuantTransformer::infer,
-           py::return_value_policy::reference_internal, py::arg("input_seq"));
+           py::return_value_policy::reference_internal, py::arg("input_seq"))
+      .def("infer_async", &PyQuantTransformer::infer_async,
+           py::keep_alive<0, 1>(), py::arg("input"))
+      .def("infer_cuda", &PyQuantTransformer::infer_cuda, py::arg("input"),
+           py::arg("outputs") = py::none());
 
   py::class_<PyGpt>(m, "Gpt")
       .def(py::init<const std::string, const int>(), py::arg("weight_path"),
            py::arg("max_batch_size"))
       .def("ppl", &PyGpt::ppl, py::return_value_policy::reference_internal,
            py::arg("input_seq"))
+      .def("ppl_packed", &PyGpt::ppl_packed, py::arg("tokens"),
+           py::arg("offsets"), py::arg("return_token_log_probs") = false)
       .def("sample", &PyGpt::sample,
-           py::return_value_policy::reference_internal, py::arg("input_seq"));
+           py::return_value_policy::reference_internal, py::arg("input_seq"))
+      .def("infer_async", &PyGpt::infer_async, py::keep_alive<0, 1>(),
+           py::arg("input"))
+      .def("infer_cuda", &PyGpt::infer_cuda, py::arg("input"),
+           py::arg("outputs") = py::none());
 
   py::class_<PyQuantGpt>(m, "QuantGpt")
       .def(py::init<const std::string, const int>(), py::arg("weight_path"),
@@ -961,36 +1600,68 @@ PYBIND11_MODULE(inference, m) {
       .def("ppl", &PyQuantGpt::ppl, py::return_value_policy::reference_internal,
            py::arg("input_seq"))
       .def("sample", &PyQuantGpt::sample,
-           py::return_value_policy::reference_internal, py::arg("input_seq"));
+           py::return_value_policy::reference_internal, py::arg("input_seq"))
+      .def("infer_async", &PyQuantGpt::infer_async, py::keep_alive<0, 1>(),
+           py::arg("input"))
+      .def("infer_cuda", &PyQuantGpt::infer_cuda, py::arg("input"),
+           py::arg("outputs") = py::none());
 
   py::class_<PyBert>(m, "Bert")
       .def(py::init<const std::string, const int>(), py::arg("weight_path"),
            py::arg("max_batch_size"))
       .def("infer", &PyBert::infer, py::return_value_policy::reference_internal,
-           py::arg("input_seq"));
+           py::arg("input_seq"))
+      .def("infer_async", &PyBert::infer_async, py::keep_alive<0, 1>(),
+           py::arg("input"))
+      .def("infer_cuda", &PyBert::infer_cuda, py::arg("input"),
+           py::arg("outputs") = py::none());
 
   py::class_<PyQuantBert>(m, "QuantBert")
       .def(py::init<const std::string, const int>(), py::arg("weight_path"),
            py::arg("max_batch_size"))
       .def("infer", &PyQuantBert::infer,
-           py::return_value_policy::reference_internal, py::arg("input_seq"));
+           py::return_value_policy::reference_internal, py::arg("input_seq"))
+      .def("infer_async", &PyQuantBert::infer_async, py::keep_alive<0, 1>(),
+           py::arg("input"))
+      .def("infer_cuda", &PyQuantBert::infer_cuda, py::arg("input"),
+           py::arg("outputs") = py::none());
 
   py::class_<PyMoe>(m, "Moe")
       .def(py::init<const std::string, const int>(), py::arg("weight_path"),
            py::arg("max_batch_size"))
       .def("infer", &PyMoe::infer, py::return_value_policy::reference_internal,
-           py::arg("input_seq"));
+           py::arg("input_seq"))
+      .def("infer_async", &PyMoe::infer_async, py::keep_alive<0, 1>(),
+           py::arg("input"))
+      .def("infer_cuda", &PyMoe::infer_cuda, py::arg("input"),
+           py::arg("outputs") = py::none());
 
   py::class_<PyVit>(m, "Vit")
-      .def(py::init<const std::string, const int>(), py::arg("weight_path"),
-           py::arg("max_batch_size"))
+      .def(py::init<const std::string, const int, bool>(),
+           py::arg("weight_path"), py::arg("max_batch_size"),
+           py::arg("uint8_input") = false)
       .def("infer", &PyVit::infer, py::return_value_policy::reference_internal,
-           py::arg("pixel_values"));
+           py::arg("pixel_values"))
+      .def("infer_async", &PyVit::infer_async, py::keep_alive<0, 1>(),
+           py::arg("input"))
+      .def("infer_cuda", &PyVit::infer_cuda, py::arg("input"),
+           py::arg("outputs") = py::none());
 
   py::class_<PyQuantVit>(m, "QuantVit")
       .def(py::init<const std::string, const int>(), py::arg("weight_path"),
            py::arg("max_batch_size"))
       .def("infer", &PyQuantVit::infer,
            py::return_value_policy::reference_internal,
-           py::arg("pixel_values"));
+           py::arg("pixel_values"))
+      .def("infer_async", &PyQuantVit::infer_async, py::keep_alive<0, 1>(),
+           py::arg("input"))
+      .def("infer_cuda", &PyQuantVit::infer_cuda, py::arg("input"),
+           py::arg("outputs") = py::none());
+
+  py::class_<PyModelPool>(m, "ModelPool")
+      .def(py::init<const std::string, const std::string, const int,
+                    std::vector<int>>(),
+           py::arg("model_name"), py::arg("weight_path"),
+           py::arg("max_batch_size"), py::arg("devices"))
+      .def("infer", &PyModelPool::infer, py::arg("input"));
 }
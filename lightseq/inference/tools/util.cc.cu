@@ -1,3 +1,5 @@
+#include <cstdlib>
+
 #include "util.h"
 
 namespace lightseq {
@@ -343,10 +345,50 @@ int read_hdf5_dataset_scalar(hid_t hdf5_file, std::string dataset_name,
       [](int size) { return size != 1; }, "Expect scalar with shape of 1.");
 }
 
+static void write_hdf5_dataset(hid_t hdf5_file, std::string dataset_name,
+                               hid_t type, const void* buf, hid_t space) {
+  if (H5Lexists(hdf5_file, dataset_name.c_str(), H5P_DEFAULT) > 0) {
+    H5Ldelete(hdf5_file, dataset_name.c_str(), H5P_DEFAULT);
+  }
+  hid_t lcpl = H5Pcreate(H5P_LINK_CREATE);
+  H5Pset_create_intermediate_group(lcpl, 1);
+  hid_t ds = H5Dcreate2(hdf5_file, dataset_name.c_str(), type, space, lcpl,
+                        H5P_DEFAULT, H5P_DEFAULT);
+  H5Pclose(lcpl);
+  H5Sclose(space);
+  if (ds < 0) {
+    throw std::runtime_error("Failed to create HDF5 dataset: " + dataset_name);
+  }
+  herr_t status = H5Dwrite(ds, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, buf);
+  H5Dclose(ds);
+  if (status < 0) {
+    throw std::runtime_error("Failed to write HDF5 dataset: " + dataset_name);
+  }
+}
+
+void write_hdf5_dataset_data(hid_t hdf5_file, std::string dataset_name,
+                             hid_t type, const void* buf, int size) {
+  hsize_t dims[1] = {hsize_t(size)};
+  write_hdf5_dataset(hdf5_file, dataset_name, type, buf,
+                     H5Screate_simple(1, dims, nullptr));
+}
+
+void write_hdf5_dataset_scalar(hid_t hdf5_file, std::string dataset_name,
+                               hid_t type, const void* buf) {
+  write_hdf5_dataset(hdf5_file, dataset_name, type, buf,
+                     H5Screate(H5S_SCALAR));
+}
+
 float dequantize(unsigned char i, float scale, float clip_max) {
   return (float(i) - scale) * clip_max / scale;
 }
 
+unsigned char quantize(float f, float scale, float clip_max) {
+  float i8_f = f * scale / clip_max;
+  i8_f = i8_f < -scale ? -scale : (i8_f > scale ? scale : i8_f);
+  return (unsigned char)floorf(i8_f + scale + 0.5f);
+}
+
 void dequantize_array(std::vector<unsigned char>& i8, std::vector<float>& f,
                       float clip_max, float quant_range, int start, int num) {
   for (int i = start; i < start + num; ++i) {
@@ -369,5 +411,71 @@ std::string getGPUName() {
   return "";
 }
 
+CudaGraphCache::CudaGraphCache(cudaStream_t stream, size_t max_graphs)
+    : _stream(stream), _max_graphs(max_graphs) {}
+
+CudaGraphCache::~CudaGraphCache() { clear(); }
+
+size_t CudaGraphCache::max_graphs_from_env() {
+  const char* graphs_env = std::getenv("LIGHTSEQ_CUDA_GRAPHS");
+  if (graphs_env == nullptr) return 0;
+  int max_graphs = std::atoi(graphs_env);
+  return max_graphs > 0 ? max_graphs : 0;
+}
+
+void CudaGraphCache::destroy(Entry& entry) {
+  if (entry.exec) cudaGraphExecDestroy(entry.exec);
+  if (entry.graph) cudaGraphDestroy(entry.graph);
+}
+
+void CudaGraphCache::clear() {
+  for (auto& iter : _graphs) {
+    destroy(iter.second);
+  }
+  _graphs.clear();
+  _lru.clear();
+  _warm.clear();
+}
+
+void CudaGraphCache::run(const Key& key, const std::function<void()>& launch) {
+  if (_max_graphs == 0) {
+    launch();
+    return;
+  }
+  auto iter = _graphs.find(key);
+  if (iter != _graphs.end()) {
+    _lru.splice(_lru.begin(), _lru, iter->second.lru);
+    CHECK_GPU_ERROR(cudaGraphLaunch(iter->second.exec, _stream));
+    return;
+  }
+  if (_warm.find(key) == _warm.end()) {
+    // the keys seen once only do not take a graph, eg. an odd batch size.
+    if (_warm.size() >= 4 * _max_graphs) _warm.clear();
+    _warm.insert(key);
+    launch();
+    return;
+  }
+
+  Entry entry;
+  CHECK_GPU_ERROR(
+      cudaStreamBeginCapture(_stream, cudaStreamCaptureModeThreadLocal));
+  launch();
+  CHECK_GPU_ERROR(cudaStreamEndCapture(_stream, &entry.graph));
+  CHECK_GPU_ERROR(
+      cudaGraphInstantiate(&entry.exec, entry.graph, nullptr, nullptr, 0));
+  _warm.erase(key);
+
+  if (_graphs.size() >= _max_graphs) {
+    auto evicted = _graphs.find(_lru.back());
+    destroy(evicted->second);
+    _graphs.erase(evicted);
+    _lru.pop_back();
+  }
+  _lru.push_front(key);
+  entry.lru = _lru.begin();
+  _graphs[key] = entry;
+  CHECK_GPU_ERROR(cudaGraphLaunch(entry.exec, _stream));
+}
+
 }  // namespace cuda
 }  // namespace lightseq
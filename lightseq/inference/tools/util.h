@@ -3,7 +3,11 @@
 #include <math_constants.h>
 #include <chrono>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 #include <stdexcept>
@@ -17,6 +21,14 @@
 
 #include "hdf5.h"
 
+#ifdef LIGHTSEQ_nccl
+#include <nccl.h>
+#endif
+
+#ifdef LIGHTSEQ_nvtx
+#include <nvtx3/nvToolsExt.h>
+#endif
+
 /**
 @file
 Util functions
@@ -66,6 +78,12 @@ static std::string _cudaGetErrorString(cublasStatus_t error) {
   return "CUBLAS_UNKNOW";
 }
 
+#ifdef LIGHTSEQ_nccl
+static std::string _cudaGetErrorString(ncclResult_t error) {
+  return std::string("NCCL ") + ncclGetErrorString(error);
+}
+#endif
+
 template <typename T>
 void check_gpu_error(T result, char const* const func, const char* const file,
                      int const line) {
@@ -78,6 +96,28 @@ void check_gpu_error(T result, char const* const func, const char* const file,
 
 #define CHECK_GPU_ERROR(val) check_gpu_error((val), #val, __FILE__, __LINE__)
 
+/*
+NVTX range of the enclosing scope, shown by Nsight Systems. Built with
+-DUSE_NVTX=ON only, otherwise LS_NVTX_RANGE expands to nothing and its name
+is not even evaluated.
+*/
+#ifdef LIGHTSEQ_nvtx
+class NvtxRange {
+ public:
+  explicit NvtxRange(const char* name) { nvtxRangePushA(name); }
+  ~NvtxRange() { nvtxRangePop(); }
+  NvtxRange(const NvtxRange&) = delete;
+  NvtxRange& operator=(const NvtxRange&) = delete;
+};
+
+#define LS_NVTX_CONCAT_(a, b) a##b
+#define LS_NVTX_CONCAT(a, b) LS_NVTX_CONCAT_(a, b)
+#define LS_NVTX_RANGE(name) \
+  ::lightseq::cuda::NvtxRange LS_NVTX_CONCAT(nvtx_range_, __LINE__)(name)
+#else
+#define LS_NVTX_RANGE(name)
+#endif
+
 enum class OperationType { FP32, FP16 };
 
 /* Precision descriptor */
@@ -211,6 +251,18 @@ return: the size of output data.
 int read_hdf5_dataset_scalar(hid_t hdf5_file, std::string dataset_name,
                              hid_t output_type, void* output_buf);
 
+/*
+Helper function of HDF5.
+
+Write the `size` elements of type `type` of `buf` into a 1D dataset, or a
+scalar one with write_hdf5_dataset_scalar, in place of the existing dataset.
+*/
+void write_hdf5_dataset_data(hid_t hdf5_file, std::string dataset_name,
+                             hid_t type, const void* buf, int size);
+
+void write_hdf5_dataset_scalar(hid_t hdf5_file, std::string dataset_name,
+                               hid_t type, const void* buf);
+
 class HDF5DatasetNotFoundError : public std::runtime_error {
  public:
   HDF5DatasetNotFoundError(const char* what) : runtime_error(what) {}
@@ -227,10 +279,54 @@ T* to_gpu(const T* host_pointer, int size, cudaStream_t stream) {
 
 float dequantize(unsigned char i, float scale, float clip_max);
 
+// the inverse of dequantize, as the quantize of export_quant.py
+unsigned char quantize(float f, float scale, float clip_max);
+
 void dequantize_array(std::vector<unsigned char>& i8, std::vector<float>& f,
                       float clip_max, float quant_range, int start, int num);
 
 std::string getGPUName();
 
+/*
+CUDA graphs of a fixed kernel sequence, eg. one encoder forward, by shape.
+
+run(key, launch) issues launch() on the stream eagerly the first time a key
+is seen, so that the lazy initializations (cublas workspaces, gemm algo
+tuning) happen outside of a capture. The second time it captures launch()
+into a graph and replays it, later runs only replay. The key must cover
+everything baked into the graph: the shapes and the device pointers.
+At most max_graphs graphs are kept, the least recently used one is destroyed
+beyond that, 0 runs launch() eagerly always.
+*/
+class CudaGraphCache {
+ public:
+  typedef std::vector<int64_t> Key;
+
+  CudaGraphCache(cudaStream_t stream, size_t max_graphs);
+  ~CudaGraphCache();
+  void run(const Key& key, const std::function<void()>& launch);
+  void clear();
+  size_t size() const { return _graphs.size(); }
+  // the max graphs of LIGHTSEQ_CUDA_GRAPHS, 0 if not set.
+  static size_t max_graphs_from_env();
+
+ private:
+  struct Entry {
+    cudaGraph_t graph = nullptr;
+    cudaGraphExec_t exec = nullptr;
+    std::list<Key>::iterator lru;
+  };
+
+  cudaStream_t _stream;
+  size_t _max_graphs;
+  std::map<Key, Entry> _graphs;
+  // most recently used first
+  std::list<Key> _lru;
+  // the keys run eagerly once, not captured yet
+  std::set<Key> _warm;
+
+  void destroy(Entry& entry);
+};
+
 }  // namespace cuda
 }  // namespace lightseq
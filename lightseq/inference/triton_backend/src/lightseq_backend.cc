@@ -1,5 +1,12 @@
 // Copyright 2022, Bytedance. All rights reserved.
 
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "triton/backend/backend_common.h"
 #include "triton/backend/backend_input_collector.h"
 #include "triton/backend/backend_model.h"
@@ -206,6 +213,347 @@ TRITONSERVER_Error* TRITONBACKEND_ModelInstanceFinalize(
 
 /////////////
 
+namespace {
+
+// An input of a request with its buffers gathered in host memory.
+struct RequestInput {
+  std::vector<int64_t> shape;
+  TRITONSERVER_DataType datatype;
+  std::vector<char> data;
+};
+
+int64_t RowSize(const std::vector<int64_t>& shape) {
+  int64_t size = 1;
+  for (size_t d = 1; d < shape.size(); d++) {
+    size *= shape[d];
+  }
+  return size;
+}
+
+// Reads the inputs of a request in the order of the lightseq inputs.
+TRITONSERVER_Error* ReadRequestInputs(TRITONBACKEND_Request* request,
+                                      ModelInstanceState* instance_state,
+                                      std::vector<RequestInput>* inputs) {
+  std::shared_ptr<::lightseq::cuda::LSModel> lightseq_model_ptr =
+      instance_state->LightseqModel();
+  inputs->resize(lightseq_model_ptr->get_input_size());
+  for (int idx = 0; idx < lightseq_model_ptr->get_input_size(); idx++) {
+    std::string input_name = lightseq_model_ptr->get_input_name(idx);
+    TRITONBACKEND_Input* input = nullptr;
+    RETURN_IF_ERROR(
+        TRITONBACKEND_RequestInput(request, input_name.c_str(), &input));
+
+    const int64_t* shape = nullptr;
+    uint32_t dims_count;
+    uint64_t byte_size;
+    uint32_t buffer_count;
+    RequestInput& request_input = (*inputs)[idx];
+    RETURN_IF_ERROR(TRITONBACKEND_InputProperties(
+        input, nullptr, &request_input.datatype, &shape, &dims_count,
+        &byte_size, &buffer_count));
+    request_input.shape.assign(shape, shape + dims_count);
+    request_input.data.resize(byte_size);
+
+    char* dst = request_input.data.data();
+    for (uint32_t buffer_idx = 0; buffer_idx < buffer_count; buffer_idx++) {
+      const void* partial_buffer = nullptr;
+      uint64_t buffer_byte_size;
+      TRITONSERVER_MemoryType memory_type;
+      int64_t memory_type_id;
+      RETURN_IF_ERROR(TRITONBACKEND_InputBuffer(
+          input, buffer_idx, &partial_buffer, &buffer_byte_size, &memory_type,
+          &memory_type_id));
+      if (memory_type == TRITONSERVER_MEMORY_GPU) {
+        cudaMemcpy(dst, partial_buffer, buffer_byte_size,
+                   cudaMemcpyDeviceToHost);
+      } else {
+        memcpy(dst, partial_buffer, buffer_byte_size);
+      }
+      dst += buffer_byte_size;
+    }
+  }
+  return nullptr;  // success
+}
+
+// Merges the input shapes of a request into the ones of a batch. Returns
+// false when the request can not join the batch: the batch would exceed the
+// max shapes of the model, or the non batch dims differ and are not the seq
+// len of int32 token ids padded with the padding_id of the model config. A
+// request always starts an empty batch.
+bool MergeShapes(::lightseq::cuda::LSModel* lightseq_model, int padding_id,
+                 const std::vector<RequestInput>& inputs,
+                 std::vector<std::vector<int64_t>>* batch_shapes) {
+  if ((*batch_shapes)[0].empty()) {
+    for (size_t idx = 0; idx < inputs.size(); idx++) {
+      (*batch_shapes)[idx] = inputs[idx].shape;
+    }
+    return true;
+  }
+  std::vector<std::vector<int64_t>> merged = *batch_shapes;
+  for (size_t idx = 0; idx < inputs.size(); idx++) {
+    const std::vector<int64_t>& shape = inputs[idx].shape;
+    std::vector<int> max_shape = lightseq_model->get_input_max_shape(idx);
+    if (shape.size() != merged[idx].size() ||
+        shape.size() != max_shape.size()) {
+      return false;
+    }
+    merged[idx][0] += shape[0];
+    for (size_t d = 1; d < shape.size(); d++) {
+      if (shape[d] == merged[idx][d]) {
+        continue;
+      }
+      if (padding_id < 0 || d != 1 || shape.size() != 2 ||
+          inputs[idx].datatype != TRITONSERVER_TYPE_INT32) {
+        return false;
+      }
+      merged[idx][d] = std::max(merged[idx][d], shape[d]);
+    }
+    for (size_t d = 0; d < shape.size(); d++) {
+      if (merged[idx][d] > max_shape[d]) {
+        return false;
+      }
+    }
+  }
+  *batch_shapes = merged;
+  return true;
+}
+
+// Sends the tokens of one decoding step, [batch_size, seqs per row], as
+// partial responses of output_name to the requests of a batch.
+TRITONSERVER_Error* SendStepTokens(
+    const std::string& output_name,
+    const std::vector<std::vector<RequestInput>>& request_inputs,
+    const std::vector<uint32_t>& batch, int64_t batch_size,
+    const std::vector<TRITONBACKEND_ResponseFactory*>& factories,
+    const std::vector<int>& tokens) {
+  int64_t seqs_per_row = tokens.size() / batch_size;
+  const int* row_tokens = tokens.data();
+  for (size_t i = 0; i < batch.size(); i++) {
+    int64_t rows = request_inputs[batch[i]][0].shape[0];
+    size_t byte_size = rows * seqs_per_row * sizeof(int);
+    const int* request_tokens = row_tokens;
+    row_tokens += rows * seqs_per_row;
+    if (factories[i] == nullptr) {
+      continue;
+    }
+
+    TRITONBACKEND_Response* response;
+    RETURN_IF_ERROR(TRITONBACKEND_ResponseNewFromFactory(&response,
+                                                         factories[i]));
+    const std::vector<int64_t> step_shape = {rows, seqs_per_row};
+    TRITONBACKEND_Output* output = nullptr;
+    RETURN_IF_ERROR(TRITONBACKEND_ResponseOutput(
+        response, &output, output_name.c_str(), TRITONSERVER_TYPE_INT32,
+        step_shape.data(), step_shape.size()));
+    void* buffer = nullptr;
+    TRITONSERVER_MemoryType memory_type = TRITONSERVER_MEMORY_CPU;
+    int64_t memory_type_id = 0;
+    RETURN_IF_ERROR(TRITONBACKEND_OutputBuffer(output, &buffer, byte_size,
+                                               &memory_type, &memory_type_id));
+    if (memory_type == TRITONSERVER_MEMORY_GPU) {
+      cudaMemcpy(buffer, request_tokens, byte_size, cudaMemcpyHostToDevice);
+    } else {
+      memcpy(buffer, request_tokens, byte_size);
+    }
+    RETURN_IF_ERROR(TRITONBACKEND_ResponseSend(response, 0, nullptr));
+  }
+  return nullptr;  // success
+}
+
+// Runs the requests of a batch in one Infer and scatters the rows of the
+// outputs, which are batched along the first dim, to their responses. The
+// outputs of padded requests keep the shape of the batch.
+//
+// A decoupled model with streaming output also sends the tokens of every
+// decoding step as partial responses of the first output while Infer runs,
+// the complete outputs follow in the final response.
+TRITONSERVER_Error* RunBatch(
+    ModelState* model_state, ModelInstanceState* instance_state,
+    int padding_id, TRITONBACKEND_Request** requests,
+    const std::vector<std::vector<RequestInput>>& request_inputs,
+    const std::vector<uint32_t>& batch,
+    const std::vector<std::vector<int64_t>>& batch_shapes,
+    std::vector<TRITONBACKEND_Response*>* responses) {
+  LS_NVTX_RANGE("RunBatch");
+  std::shared_ptr<::lightseq::cuda::LSModel> lightseq_model_ptr =
+      instance_state->LightseqModel();
+  ::lightseq::cuda::PinnedBufferPool* pinned = instance_state->PinnedPool();
+
+  for (int idx = 0; idx < lightseq_model_ptr->get_input_size(); idx++) {
+    const std::vector<int64_t>& shape = batch_shapes[idx];
+    size_t row_byte_size =
+        RowSize(shape) *
+        TRITONSERVER_DataTypeByteSize(request_inputs[batch[0]][idx].datatype);
+    size_t byte_size = row_byte_size * shape[0];
+    std::vector<char> staging;
+    char* h_input = static_cast<char*>(pinned->input(idx));
+    if (byte_size > pinned->input_bytes(idx)) {
+      staging.resize(byte_size);
+      h_input = staging.data();
+    }
+
+    char* row = h_input;
+    for (uint32_t r : batch) {
+      const RequestInput& input = request_inputs[r][idx];
+      if (input.shape[0] == 0) {
+        continue;
+      }
+      size_t input_row_byte_size = input.data.size() / input.shape[0];
+      for (int64_t b = 0; b < input.shape[0]; b++) {
+        memcpy(row, input.data.data() + b * input_row_byte_size,
+               input_row_byte_size);
+        // pad the token ids to the seq len of the batch
+        std::fill(reinterpret_cast<int32_t*>(row + input_row_byte_size),
+                  reinterpret_cast<int32_t*>(row + row_byte_size),
+                  padding_id);
+        row += row_byte_size;
+      }
+    }
+
+    void* d_input =
+        instance_state->get_d_input(lightseq_model_ptr->get_input_name(idx));
+    if (staging.empty()) {
+      pinned->input_to_device(idx, d_input, byte_size);
+    } else {
+      cudaMemcpy(d_input, h_input, byte_size, cudaMemcpyHostToDevice);
+    }
+    lightseq_model_ptr->set_input_shape(
+        idx, std::vector<int>(shape.begin(), shape.end()));
+  }
+
+  std::vector<TRITONBACKEND_ResponseFactory*> factories;
+  bool streaming = false;
+  if (model_state->IsDecoupled()) {
+    for (uint32_t r : batch) {
+      TRITONBACKEND_ResponseFactory* factory = nullptr;
+      LOG_IF_ERROR(TRITONBACKEND_ResponseFactoryNew(&factory, requests[r]),
+                   "failed to create a response factory");
+      factories.push_back(factory);
+    }
+    std::string output_name = lightseq_model_ptr->get_output_name(0);
+    int64_t batch_size = batch_shapes[0][0];
+    try {
+      lightseq_model_ptr->set_token_callback(
+          [&](int step, const std::vector<int>& tokens) {
+            LOG_IF_ERROR(SendStepTokens(output_name, request_inputs, batch,
+                                        batch_size, factories, tokens),
+                         "failed to send the tokens of a step");
+          });
+      streaming = true;
+    } catch (const std::exception& ex) {
+      // the model does not stream, only the final responses are sent
+      LOG_MESSAGE(TRITONSERVER_LOG_VERBOSE, ex.what());
+    }
+  }
+
+  TRITONSERVER_Error* infer_err = nullptr;
+  try {
+    lightseq_model_ptr->Infer();
+  } catch (const std::exception& ex) {
+    infer_err = TRITONSERVER_ErrorNew(TRITONSERVER_ERROR_INTERNAL, ex.what());
+  }
+  if (streaming) {
+    lightseq_model_ptr->set_token_callback(nullptr);
+  }
+  if (!factories.empty()) {
+    for (TRITONBACKEND_ResponseFactory* factory : factories) {
+      if (factory != nullptr) {
+        LOG_IF_ERROR(TRITONBACKEND_ResponseFactoryDelete(factory),
+                     "failed to delete a response factory");
+      }
+    }
+  }
+  if (infer_err != nullptr) {
+    return infer_err;
+  }
+
+  for (int output_idx = 0; output_idx < lightseq_model_ptr->get_output_size();
+       output_idx++) {
+    std::string output_name = lightseq_model_ptr->get_output_name(output_idx);
+    TRITONSERVER_DataType triton_datatype_ =
+        model_state->GetOutputDataTypeByName(output_name);
+    const std::vector<int> lightseq_shape =
+        lightseq_model_ptr->get_output_shape(output_idx);
+    std::vector<int64_t> triton_shape(lightseq_shape.begin(),
+                                      lightseq_shape.end());
+    RETURN_ERROR_IF_TRUE(
+        triton_shape.empty() || triton_shape[0] != batch_shapes[0][0],
+        TRITONSERVER_ERROR_INTERNAL,
+        "output " + output_name + " is not batched along the first dim");
+    size_t row_byte_size =
+        RowSize(triton_shape) * TRITONSERVER_DataTypeByteSize(triton_datatype_);
+    size_t byte_size = row_byte_size * triton_shape[0];
+    const char* d_output = static_cast<const char*>(
+        lightseq_model_ptr->get_output_ptr(output_idx));
+
+    // copied to host once for the responses in host memory
+    std::vector<char> staging;
+    const char* h_output = nullptr;
+    size_t offset = 0;
+    for (uint32_t r : batch) {
+      int64_t rows = request_inputs[r][0].shape[0];
+      size_t response_byte_size = rows * row_byte_size;
+      TRITONBACKEND_Response* response = (*responses)[r];
+      if (response == nullptr) {
+        offset += response_byte_size;
+        continue;
+      }
+
+      triton_shape[0] = rows;
+      TRITONBACKEND_Output* output = nullptr;
+      RETURN_IF_ERROR(TRITONBACKEND_ResponseOutput(
+          response, &output, output_name.c_str(), triton_datatype_,
+          triton_shape.data(), triton_shape.size()));
+      void* single_output_buffer = nullptr;
+      TRITONSERVER_MemoryType output_memory_type = TRITONSERVER_MEMORY_GPU;
+      int64_t output_memory_type_id = 0;
+      RETURN_IF_ERROR(TRITONBACKEND_OutputBuffer(
+          output, &single_output_buffer, response_byte_size,
+          &output_memory_type, &output_memory_type_id));
+
+      if (output_memory_type == TRITONSERVER_MEMORY_GPU) {
+        cudaMemcpy(single_output_buffer, d_output + offset,
+                   response_byte_size, cudaMemcpyDeviceToDevice);
+      } else {
+        if (h_output == nullptr) {
+          if (byte_size <= pinned->output_bytes(output_idx)) {
+            pinned->output_to_host(output_idx, d_output, byte_size);
+            h_output = static_cast<const char*>(pinned->output(output_idx));
+          } else {
+            staging.resize(byte_size);
+            cudaMemcpy(staging.data(), d_output, byte_size,
+                       cudaMemcpyDeviceToHost);
+            h_output = staging.data();
+          }
+        }
+        memcpy(single_output_buffer, h_output + offset, response_byte_size);
+      }
+      offset += response_byte_size;
+    }
+  }
+  return nullptr;  // success
+}
+
+// Sends the error to every response of a batch which is not sent yet.
+void RespondBatchError(TRITONSERVER_Error* err,
+                       const std::vector<uint32_t>& batch,
+                       std::vector<TRITONBACKEND_Response*>* responses) {
+  for (uint32_t r : batch) {
+    if ((*responses)[r] == nullptr) {
+      continue;
+    }
+    LOG_IF_ERROR(TRITONBACKEND_ResponseSend(
+                     (*responses)[r], TRITONSERVER_RESPONSE_COMPLETE_FINAL,
+                     TRITONSERVER_ErrorNew(TRITONSERVER_ErrorCode(err),
+                                           TRITONSERVER_ErrorMessage(err))),
+                 "failed to send error response");
+    (*responses)[r] = nullptr;
+  }
+  TRITONSERVER_ErrorDelete(err);
+}
+
+}  // namespace
+
 extern "C" {
 
 // When Triton calls TRITONBACKEND_ModelInstanceExecute it is required
@@ -216,6 +564,7 @@ extern "C" {
 TRITONSERVER_Error* TRITONBACKEND_ModelInstanceExecute(
     TRITONBACKEND_ModelInstance* instance, TRITONBACKEND_Request** requests,
     const uint32_t request_count) {
+  LS_NVTX_RANGE("TRITONBACKEND_ModelInstanceExecute");
   // Collect various timestamps during the execution of this batch or
   // requests. These values are reported below before returning from
   // the function.
@@ -275,114 +624,45 @@ TRITONSERVER_Error* TRITONBACKEND_ModelInstanceExecute(
   uint64_t compute_start_ns = 0;
   SET_TIMESTAMP(compute_start_ns);
 
-  for (uint32_t idx = 0; idx < request_count; idx++) {
-    TRITONBACKEND_Request* request = requests[idx];
-    uint32_t input_count;
-    TRITONBACKEND_RequestInputCount(request, &input_count);
-
-    for (uint32_t input_idx = 0; input_idx < input_count; input_idx++) {
-      TRITONBACKEND_Input* input = nullptr;
-      LOG_IF_ERROR(TRITONBACKEND_RequestInputByIndex(
-                       request, input_idx /* index */, &input),
-                   "failed getting request input");
-
-      const int64_t* shape = nullptr;
-      const char* input_name = nullptr;
-      TRITONSERVER_DataType datatype;
-      uint32_t dims_count;
-      uint64_t byte_size;
-      uint32_t buffer_count;
-      if (input != nullptr) {
-        LOG_IF_ERROR(TRITONBACKEND_InputProperties(
-                         input, &input_name, &datatype, &shape, &dims_count,
-                         &byte_size, &buffer_count),
-                     "failed getting input properties");
-      }
-
-      // malloc GPU memory by triton api;
-      void* d_input = instance_state->get_d_input(input_name);
-      void* moved_d_input = d_input;
-      for (uint32_t buffer_idx = 0; buffer_idx < buffer_count; buffer_idx++) {
-        const void* partial_buffer = nullptr;
-        uint64_t buffer_byte_size;
-        TRITONSERVER_MemoryType memory_type;
-        int64_t memory_type_id;
-        LOG_IF_ERROR(TRITONBACKEND_InputBuffer(
-                         input, buffer_idx, &partial_buffer, &buffer_byte_size,
-                         &memory_type, &memory_type_id),
-                     "failed get input buffer");
-
-        cudaMemcpy(moved_d_input, partial_buffer, buffer_byte_size,
-                   cudaMemcpyHostToDevice);
-        moved_d_input = (void*)(reinterpret_cast<uint64_t>(moved_d_input) +
-                                buffer_byte_size);
-      }
+  // Read the inputs of every request, then run the consecutive requests
+  // which can be batched together in one Infer.
+  int padding_id = model_state->PaddingId();
+  std::vector<std::vector<RequestInput>> request_inputs(request_count);
+  for (uint32_t r = 0; r < request_count; r++) {
+    RESPOND_AND_SET_NULL_IF_ERROR(
+        &responses[r],
+        ReadRequestInputs(requests[r], instance_state, &request_inputs[r]));
+  }
 
-      // match triton client input with lightseq input by input_name.
-      for (int lightseq_input_idx = 0;
-           lightseq_input_idx < lightseq_model_ptr->get_input_size();
-           lightseq_input_idx++) {
-        if (lightseq_model_ptr->get_input_name(lightseq_input_idx) !=
-            input_name) {
-          continue;
-        }
-        lightseq_model_ptr->set_input_shape(
-            lightseq_input_idx, std::vector<int>(shape, shape + dims_count));
-      }
+  std::vector<uint32_t> batch;
+  std::vector<std::vector<int64_t>> batch_shapes(
+      lightseq_model_ptr->get_input_size());
+  auto run_batch = [&]() {
+    if (batch.empty()) {
+      return;
     }
-
-    lightseq_model_ptr->Infer();
-
-    // create response buffer
-    TRITONBACKEND_Response* response = responses[idx];
-    for (int output_idx = 0; output_idx < lightseq_model_ptr->get_output_size();
-         output_idx++) {
-      TRITONBACKEND_Output* output = nullptr;
-      void* single_output_buffer = nullptr;
-      const std::vector<int> lightseq_shape =
-          lightseq_model_ptr->get_output_shape(output_idx);
-      std::string output_name = lightseq_model_ptr->get_output_name(output_idx);
-
-      const std::vector<int64_t> triton_shape(lightseq_shape.begin(),
-                                              lightseq_shape.end());
-
-      TRITONSERVER_DataType triton_datatype_ =
-          model_state->GetOutputDataTypeByName(output_name);
-      LOG_IF_ERROR(TRITONBACKEND_ResponseOutput(
-                       response, &output, output_name.c_str(), triton_datatype_,
-                       triton_shape.data(), triton_shape.size()),
-                   "failed create an TRITONBACKEND_OutputBuffer");
-
-      uint32_t total_size = 1;
-      for (long unsigned int j = 0; j < triton_shape.size(); j++) {
-        total_size *= triton_shape[j];
-      }
-      uint32_t buffer_byte_size =
-          total_size * TRITONSERVER_DataTypeByteSize(triton_datatype_);
-      TRITONSERVER_MemoryType output_memory_type = TRITONSERVER_MEMORY_GPU;
-      int64_t output_memory_type_id = 0;
-      LOG_IF_ERROR(TRITONBACKEND_OutputBuffer(
-                       output, &single_output_buffer, buffer_byte_size,
-                       &output_memory_type, &output_memory_type_id),
-                   "failed get a buffer to use to hold the tensor data for the "
-                   "output.");
-
-      for (int lightseq_output_idx = 0;
-           lightseq_output_idx < lightseq_model_ptr->get_output_size();
-           lightseq_output_idx++) {
-        if (lightseq_model_ptr->get_output_name(lightseq_output_idx) !=
-            output_name) {
-          continue;
-        }
-
-        const void* d_output = static_cast<const void*>(
-            lightseq_model_ptr->get_output_ptr(output_idx));
-
-        cudaMemcpy(single_output_buffer, d_output, buffer_byte_size,
-                   cudaMemcpyDeviceToHost);
-      }
+    TRITONSERVER_Error* err =
+        RunBatch(model_state, instance_state, padding_id, requests,
+                 request_inputs, batch, batch_shapes, &responses);
+    if (err != nullptr) {
+      RespondBatchError(err, batch, &responses);
+    }
+    batch.clear();
+    batch_shapes.assign(batch_shapes.size(), std::vector<int64_t>());
+  };
+  for (uint32_t r = 0; r < request_count; r++) {
+    if (responses[r] == nullptr) {
+      continue;
+    }
+    if (!MergeShapes(lightseq_model_ptr.get(), padding_id, request_inputs[r],
+                     &batch_shapes)) {
+      run_batch();
+      MergeShapes(lightseq_model_ptr.get(), padding_id, request_inputs[r],
+                  &batch_shapes);
     }
+    batch.push_back(r);
   }
+  run_batch();
 
   uint64_t compute_end_ns = 0;
   SET_TIMESTAMP(compute_end_ns);
@@ -6,6 +6,7 @@
 #include "triton/backend/backend_output_responder.h"
 #include "triton/core/tritonbackend.h"
 #include "bert.h"
+#include "pinned_buffer_pool.h"
 
 #ifndef NEW_ARCH
 #include "gpt.h"
@@ -76,6 +77,15 @@ class ModelState : public BackendModel {
 
   std::string GetModelType() { return model_type_; }
 
+  // The token id which pads the seq len of the requests batched in one
+  // Infer, from the optional padding_id parameter. Without it only the
+  // requests of the same seq len are batched.
+  int PaddingId() { return padding_id_; }
+
+  // Whether model_transaction_policy is decoupled, then every decoding step
+  // of a model with streaming output is sent as a partial response.
+  bool IsDecoupled() { return decoupled_; }
+
  private:
   ModelState(TRITONBACKEND_Model* triton_model);
 
@@ -86,10 +96,13 @@ class ModelState : public BackendModel {
   std::vector<int64_t> shape_;
 
   std::string model_type_;
+  int padding_id_;
+  bool decoupled_;
 };
 
 ModelState::ModelState(TRITONBACKEND_Model* triton_model)
-    : BackendModel(triton_model), shape_initialized_(false) {
+    : BackendModel(triton_model), shape_initialized_(false), padding_id_(-1),
+      decoupled_(false) {
   // Validate that the model's configuration matches what is supported
   // by this backend.
   THROW_IF_BACKEND_MODEL_ERROR(ValidateModelConfig());
@@ -203,6 +216,19 @@ TRITONSERVER_Error* ModelState::ValidateModelConfig() {
       "string_value", &model_type_value, &model_type_length));
   model_type_ = std::string(model_type_value);
 
+  common::TritonJson::Value padding_id_obj;
+  if (parameters.Find("padding_id", &padding_id_obj)) {
+    std::string padding_id_value;
+    RETURN_IF_ERROR(
+        padding_id_obj.MemberAsString("string_value", &padding_id_value));
+    padding_id_ = std::stoi(padding_id_value);
+  }
+
+  common::TritonJson::Value policy;
+  if (ModelConfig().Find("model_transaction_policy", &policy)) {
+    RETURN_IF_ERROR(policy.MemberAsBool("decoupled", &decoupled_));
+  }
+
   // Record the file_name of model paramters
   const char* model_file_name;
   size_t file_name_len;
@@ -261,6 +287,9 @@ class ModelInstanceState : public BackendModelInstance {
   void* get_d_output(std::string output_name) {
     return d_outputs_map.find(output_name)->second;
   }
+  ::lightseq::cuda::PinnedBufferPool* PinnedPool() {
+    return pinned_pool_.get();
+  }
 
  private:
   ModelInstanceState(ModelState* model_state,
@@ -273,6 +302,8 @@ class ModelInstanceState : public BackendModelInstance {
 
   std::map<std::string, void*> d_inputs_map;
   std::map<std::string, void*> d_outputs_map;
+  // stages the host inputs and outputs of the requests
+  std::unique_ptr<::lightseq::cuda::PinnedBufferPool> pinned_pool_;
 };
 
 ModelInstanceState::ModelInstanceState(
@@ -341,6 +372,9 @@ ModelInstanceState::ModelInstanceState(
     d_outputs_map.insert(std::make_pair(output_name, d_output));
     lightseq_model_ptr_->set_output_ptr(idx, d_output);
   }
+
+  pinned_pool_.reset(
+      new ::lightseq::cuda::PinnedBufferPool(lightseq_model_ptr_.get()));
 }
 
 }  // namespace lightseq
@@ -17,8 +17,13 @@ from lightseq.training.ops.pytorch.transformer import (
     LSTransformerDecoder,
 )
 
-from lightseq.training.ops.pytorch.cross_entropy_layer import LSCrossEntropyLayer
-from lightseq.training.ops.pytorch.adam import LSAdam
+from lightseq.training.ops.pytorch.cross_entropy_layer import (
+    LSCrossEntropyLayer,
+    LSFusedLinearCrossEntropyLayer,
+)
+from lightseq.training.ops.pytorch.adam import LSAdam, LSAdamW, LSAdamWBF16, LSLamb
+from lightseq.training.ops.pytorch.grad_allreduce import LSGradAllReducer
+from lightseq.training.ops.pytorch.checkpoint import LSAsyncCheckpointer
 from lightseq.training.ops.pytorch.export import (
     export_ls_config,
     export_ls_embedding,
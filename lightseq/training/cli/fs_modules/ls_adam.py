@@ -26,6 +26,14 @@ class LSFSAdamConfig(FairseqDataclass):
     use_old_adam: bool = field(
         default=False, metadata={"help": "Use fairseq.optim.adam.Adam"}
     )
+    ls_shard_optimizer_state: bool = field(
+        default=False,
+        metadata={
+            "help": "Shard the LightSeq Adam states over the data parallel "
+            "ranks, see LSAdam. The fp32 master weights are sharded too with "
+            "--memory-efficient-fp16, --fp16 keeps them full on every rank"
+        },
+    )
     # TODO common vars below in parent
     tpu: bool = II("common.tpu")
     lr: List[float] = II("optimization.lr")
@@ -53,8 +61,22 @@ class LSFSAdam(FairseqOptimizer):
             # automatically casts gradients to FP32
             self._optimizer = Adam(params, **self.optimizer_config)
         elif use_fused_adam:
-            logger.info("using LightSeq Adam")
-            self._optimizer = fused_adam_cls(params, **self.optimizer_config)
+            process_group = None
+            if getattr(args, "ls_shard_optimizer_state", False):
+                if not dist.is_initialized():
+                    raise RuntimeError(
+                        "--ls-shard-optimizer-state needs distributed training"
+                    )
+                process_group = dist.group.WORLD
+                logger.info(
+                    "using LightSeq Adam with the states sharded over "
+                    f"{dist.get_world_size()} ranks"
+                )
+            else:
+                logger.info("using LightSeq Adam")
+            self._optimizer = fused_adam_cls(
+                params, process_group=process_group, **self.optimizer_config
+            )
         else:
             self._optimizer = Adam(params, **self.optimizer_config)
 
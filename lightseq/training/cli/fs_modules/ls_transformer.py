@@ -122,6 +122,11 @@ class LSTransformerModel(FairseqEncoderDecoderModel):
                             help='enable quantization')
         parser.add_argument('--quant-mode', type=str,  default="qat", choices=["qat", "ptq"],
                             help='quantization mode')
+        parser.add_argument('--fp8-training', default=False, action='store_true',
+                            help='fp8 gemms in the encoder layers, of the new arch, '
+                                 'needs a sm_89 or later GPU')
+        parser.add_argument('--fp8-amax-history-len', type=int, default=16,
+                            help='steps of amax history of the fp8 delayed scaling')
         # args for Fully Sharded Data Parallel (FSDP) training
         parser.add_argument(
             '--min-params-to-wrap', type=int, metavar='D', default=DEFAULT_MIN_PARAMS_TO_WRAP,
@@ -272,8 +277,14 @@ class LSTransformerEncoder(FairseqEncoder):
             self.layer_norm = None
 
     def build_encoder_layer(self, args):
+        fp8_training = getattr(args, "fp8_training", False)
         if args.use_torch_layer:
             from lightseq.training.ops.pytorch import TransformerEncoderLayer
+        elif fp8_training:
+            # the fp8 linears are operators of the new arch layers.
+            from lightseq.training.ops.pytorch.transformer_encoder_layer_new import (
+                LSTransformerEncoderLayerNew as TransformerEncoderLayer,
+            )
         else:
             from lightseq.training.ops.pytorch.transformer_encoder_layer import (
                 LSTransformerEncoderLayer as TransformerEncoderLayer,
@@ -292,22 +303,31 @@ class LSTransformerEncoder(FairseqEncoder):
             fp16=args.fp16,
             local_rank=args.device_id,
             activation_fn=args.activation_fn,
+            fp8_training=fp8_training and not args.use_torch_layer,
+            fp8_amax_history_len=getattr(args, "fp8_amax_history_len", 16),
         )
 
         return TransformerEncoderLayer(config)
 
-    def forward_embedding(self, src_tokens):
-        x = self.embed_tokens(src_tokens)
-        return x
+    def forward_embedding(self, src_tokens, src_cu_seqlens=None):
+        if src_cu_seqlens is None:
+            return self.embed_tokens(src_tokens)
+        return self.embed_tokens(src_tokens, cu_seqlens=src_cu_seqlens)
 
-    def forward(self, src_tokens, **kwargs):
-        x = self.forward_embedding(src_tokens)
+    def forward(self, src_tokens, src_cu_seqlens=None, **kwargs):
+        # src_cu_seqlens: [num_seqs + 1] offsets of a packed batch, every row
+        # of src_tokens holds several sentences, see LSTransformerEncoderLayer.
+        # The decoder attends to the whole row, so only pack encoder-only tasks.
+        x = self.forward_embedding(src_tokens, src_cu_seqlens)
 
         encoder_padding_mask = src_tokens.eq(self.padding_idx)
+        layer_kwargs = {}
+        if src_cu_seqlens is not None:
+            layer_kwargs["cu_seqlens"] = src_cu_seqlens
 
         # x: [batch_size, seq_len, hidden_size]
         for layer in self.layers:
-            x = layer(x, encoder_padding_mask)
+            x = layer(x, encoder_padding_mask, **layer_kwargs)
         if self.layer_norm is not None:
             x = self.layer_norm(x)
         self.batch_size = x.shape[0]
@@ -2,17 +2,38 @@ import math
 import torch
 import torch.distributed as dist
 
+from lightseq.training.ops.pytorch.builder import KernelBuilder
+
+cuda_module = None
+
+# torch < 1.13 only has the private name.
+_all_gather_into_tensor = getattr(
+    dist, "all_gather_into_tensor", getattr(dist, "_all_gather_base", None)
+)
+
+
+def _get_cuda_module():
+    global cuda_module
+    if cuda_module is None:
+        cuda_module = KernelBuilder().load()
+    return cuda_module
+
 
 class GCQ(object):
     """
     Gradient Communication Quantization (GCQ) in multi-machine distributed training.
 
-    It quantizes gradients to int8 locally before gradients communicate between machines.
-    When the gradient communication is done, it dequantizes the int8 gradients to original dtype (default: fp16) locally.
-
-    Note: When training on multiple machines, it can accelerate significantly, as multi-machine communication is the bottleneck.
-    However, it is even slower when training on single machine.
-    Please choose if GCQ should be on according to your training environment.
+    It quantizes gradients to int8 locally before gradients communicate between machines,
+    in rows of hidden_size with a per row scale estimated from the quantile_value of |grad|.
+    The all-reduce is a reduce-scatter and an all-gather, both in int8:
+    every rank receives its shard of rows from all the ranks by all_to_all,
+    sums them in fp32, quantizes the mean again and all-gathers it.
+    The quantization error of every rank is kept and added to its next gradients
+    (error feedback), so it is not lost over the steps.
+
+    Quantile estimate, quantization, reduction and dequantization are fused CUDA kernels,
+    see csrc/kernels/cuda/gcq_kernels.cu. The traffic is a quarter of a fp32 ring all-reduce,
+    half of a fp16 one, so it pays off when the multi-machine communication is the bottleneck.
     """
 
     def __init__(
@@ -20,94 +41,116 @@ class GCQ(object):
         world_size,
         hidden_size=1024,
         bucket=None,
-        quantize_bits=8,
         quantile_value=0.99,
+        error=None,
     ):
         self.world_size = world_size
         self.bucket = bucket
-        self.quantize_bits = quantize_bits
         self.device = bucket.buffer().device
         self.hidden_size = hidden_size
         self.quantile_value = quantile_value
-        # Actually, we use topk implementation to estimate quantile,
-        # as the former is faster than the latter.
-        self.topk_value = math.ceil(self.hidden_size * (1.0 - self.quantile_value))
-
-        # We use symmetrical range, i.e., [-127, 127] instead of [-128, 127], when quantize_bits is 8.
-        self.max_bound = (
-            torch.pow(
-                torch.tensor(2.0, dtype=torch.float16, device=self.device),
-                self.quantize_bits - 1,
-            )
-            - 1.0
+        # The scale is the topk-th largest |x| of a row, topk_value = 1 is the max.
+        self.topk_value = max(
+            math.ceil(self.hidden_size * (1.0 - self.quantile_value)), 1
         )
-        self.min_bound = -self.max_bound
-        # The new range after dividing the world_size.
-        self.new_max_bound = self.max_bound.div(self.world_size, rounding_mode="trunc")
-        self.new_min_bound = self.min_bound.div(self.world_size, rounding_mode="trunc")
+        self.error = error
 
         self.original_gradient = self.bucket.buffer()
         self.bucket_size = self.original_gradient.numel()
-        self.scale = None
-        self.encoded_gradient = None
+        rows = (self.bucket_size + self.hidden_size - 1) // self.hidden_size
+        self.rows_per_rank = (rows + self.world_size - 1) // self.world_size
+        padded_rows = self.rows_per_rank * self.world_size
+
+        self.fp16 = self.original_gradient.dtype == torch.half
+        self.encoded_gradient = torch.empty(
+            (padded_rows, self.hidden_size), dtype=torch.int8, device=self.device
+        )
+        self.scale = torch.empty(padded_rows, dtype=torch.float, device=self.device)
 
-    def get_scale(self):
+    def encode_bucket(self):
         """
-        Calculate the scale for quantization.
+        Quantize grad + error to int8 locally, the error becomes the new quantization error.
         """
-        # Pad original gradient if needed.
-        if self.bucket_size % self.hidden_size != 0:
-            rest_size = self.hidden_size - (self.bucket_size % self.hidden_size)
-            self.original_gradient = torch.nn.functional.pad(
-                self.original_gradient, (0, rest_size)
-            )
-        # Reshape original gradient to [-1, self.hidden_size].
-        self.original_gradient = self.original_gradient.view(-1, self.hidden_size)
-        # Calculate the max absolute value of every row in original gradient.
-        max_abs_bucket = (
-            self.original_gradient.abs()
-            .topk(self.topk_value, dim=-1, sorted=False)[0]
-            .min(dim=-1, keepdim=True)[0]
+        func = (
+            _get_cuda_module().torch_launch_gcq_quantize_fp16
+            if self.fp16
+            else _get_cuda_module().torch_launch_gcq_quantize_fp32
         )
-        self.scale = max_abs_bucket.div(self.max_bound)
-        return self.scale
+        error = self.error
+        if error is None:
+            error = torch.empty(0, dtype=torch.float, device=self.device)
+        func(
+            self.encoded_gradient,
+            self.scale,
+            self.original_gradient,
+            error,
+            self.hidden_size,
+            self.topk_value,
+        )
+        return self.encoded_gradient, self.scale
 
-    def encode_bucket(self):
+    def reduce_shard(self, received_gradient, received_scale):
         """
-        Quantize gradients to int8 locally before gradients communicate between machines.
+        Reduce the shards [world_size, rows_per_rank, hidden_size] received from all the ranks,
+        then quantize the mean again.
         """
-        # The original gradient need to divide the world_size to avoid all_reduce overflow.
-        compressed_gradient = self.original_gradient.div(self.scale * self.world_size)
-        self.encoded_gradient = (
-            compressed_gradient.clamp_(min=self.new_min_bound, max=self.new_max_bound)
-            .round_()
-            .to(torch.int8)
+        reduced_gradient = torch.empty(
+            (self.rows_per_rank, self.hidden_size), dtype=torch.int8, device=self.device
         )
-        return self.encoded_gradient
+        reduced_scale = torch.empty(
+            self.rows_per_rank, dtype=torch.float, device=self.device
+        )
+        _get_cuda_module().torch_launch_gcq_reduce_quantize(
+            reduced_gradient,
+            reduced_scale,
+            received_gradient,
+            received_scale,
+            self.world_size,
+            self.hidden_size,
+            self.topk_value,
+        )
+        return reduced_gradient, reduced_scale
 
     def decode_bucket(self):
         """
-        Dequantize the all_reduced int8 gradients to original dtype (default: fp16) locally.
+        Dequantize the all-gathered int8 gradients to original dtype (default: fp16) locally.
         """
-        decompressed_gradient = self.bucket.buffer()
-        # Use original bucket to reduce memory consumption.
-        decompressed_gradient.copy_(
-            (self.encoded_gradient.to(torch.float16) * self.scale).view(-1)[
-                : self.bucket_size
-            ]
+        func = (
+            _get_cuda_module().torch_launch_gcq_dequantize_fp16
+            if self.fp16
+            else _get_cuda_module().torch_launch_gcq_dequantize_fp32
         )
+        # Use original bucket to reduce memory consumption.
+        decompressed_gradient = self.bucket.buffer()
+        func(decompressed_gradient, self.encoded_gradient, self.scale, self.hidden_size)
         return decompressed_gradient
 
 
 class GCQState(object):
     """
     Prepare the state for Gradient Communication Quantization (GCQ).
+    With error_feedback, it keeps the fp32 quantization error of every bucket.
     """
 
-    def __init__(self, process_group, hidden_size=1024, quantile_value=0.99):
+    def __init__(
+        self, process_group, hidden_size=1024, quantile_value=0.99, error_feedback=True
+    ):
         self.process_group = process_group
         self.hidden_size = hidden_size
         self.quantile_value = quantile_value
+        self.error_feedback = error_feedback
+        self.error_dict = {}
+
+    def get_error(self, bucket):
+        if not self.error_feedback:
+            return None
+        buffer = bucket.buffer()
+        error = self.error_dict.get(bucket.index())
+        # Buckets are rebuilt after the first iteration.
+        if error is None or error.numel() != buffer.numel():
+            error = torch.zeros(buffer.numel(), dtype=torch.float, device=buffer.device)
+            self.error_dict[bucket.index()] = error
+        return error
 
 
 def encode_and_decode(state, bucket) -> torch.futures.Future[torch.Tensor]:
@@ -119,36 +162,42 @@ def encode_and_decode(state, bucket) -> torch.futures.Future[torch.Tensor]:
     ), "The process_group should be initialized first!"
     process_group = state.process_group
     world_size = dist.get_world_size(process_group)
-    hidden_size = state.hidden_size
-    quantile_value = state.quantile_value
     quantizer = GCQ(
         world_size=world_size,
-        hidden_size=hidden_size,
+        hidden_size=state.hidden_size,
         bucket=bucket,
-        quantile_value=quantile_value,
+        quantile_value=state.quantile_value,
+        error=state.get_error(bucket),
     )
-    scale = quantizer.get_scale()
-    # All_reduce scales between ranks and
-    # every rank gets the same global scale to encode gradients finally.
-    dist.all_reduce(
-        scale,
-        op=dist.ReduceOp.MAX,
-        group=process_group,
-        async_op=True,
-    ).get_future().wait()
     # Quantize gradients to int8 locally.
-    compressed_gradient = quantizer.encode_bucket()
-    # All_reduce int8 gradients.
-    fut = dist.all_reduce(
-        compressed_gradient, group=process_group, async_op=True
-    ).get_future()
+    compressed_gradient, scale = quantizer.encode_bucket()
 
-    def decompress(fut):
-        """
-        Dequantize the all_reduced int8 gradients to original dtype (default: fp16).
-        """
-        decompressed_gradient = quantizer.decode_bucket()
-        dist.barrier(group=process_group, async_op=True)
-        return decompressed_gradient
+    # Reduce-scatter: every rank receives its shard of rows from all the ranks.
+    received_gradient = torch.empty_like(compressed_gradient)
+    received_scale = torch.empty_like(scale)
+    scale_work = dist.all_to_all_single(
+        received_scale, scale, group=process_group, async_op=True
+    )
+    fut = dist.all_to_all_single(
+        received_gradient, compressed_gradient, group=process_group, async_op=True
+    ).get_future()
 
-    return fut.then(decompress)
+    def reduce_and_gather(fut):
+        scale_work.wait()
+        reduced_gradient, reduced_scale = quantizer.reduce_shard(
+            received_gradient, received_scale
+        )
+        # All-gather the reduced shards into the int8 buffers of the bucket.
+        scale_work_gather = _all_gather_into_tensor(
+            quantizer.scale, reduced_scale, group=process_group, async_op=True
+        )
+        _all_gather_into_tensor(
+            quantizer.encoded_gradient,
+            reduced_gradient,
+            group=process_group,
+            async_op=True,
+        ).wait()
+        scale_work_gather.wait()
+        return quantizer.decode_bucket()
+
+    return fut.then(reduce_and_gather)
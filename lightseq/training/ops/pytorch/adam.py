@@ -1,9 +1,17 @@
+import types
+
 import torch
+import torch.distributed as dist
 
 from lightseq.training.ops.pytorch.builder import AdamBuilder
 
 fused_adam_cuda = None
 
+# torch < 1.13 only has the private name.
+_all_gather_into_tensor = getattr(
+    dist, "all_gather_into_tensor", getattr(dist, "_all_gather_base", None)
+)
+
 
 class LSAdam(torch.optim.Optimizer):
     """
@@ -25,6 +33,13 @@ class LSAdam(torch.optim.Optimizer):
             adds eps to the bias-corrected second moment estimate before
             evaluating square root instead of adding it to the square root of
             second moment estimate as in the original paper. (default: False)
+        process_group (ProcessGroup, optional): shard the optimizer states over
+            the data parallel ranks of the group, as ZeRO stage 1. Every rank
+            keeps the moments, and the fp32 master weights of the fp16 params,
+            of its 1 / world_size slice of every param, updates that slice and
+            all-gathers the updated params, which are the same on all the ranks
+            again. The grads should be reduced already. (default: None, every
+            rank updates all the params)
     .. _Adam: A Method for Stochastic Optimization:
         https://arxiv.org/abs/1412.6980
     .. _On the Convergence of Adam and Beyond:
@@ -42,6 +57,7 @@ class LSAdam(torch.optim.Optimizer):
         weight_decay=0.0,
         max_grad_norm=0.0,
         amsgrad=False,
+        process_group=None,
     ):
         global fused_adam_cuda
 
@@ -60,6 +76,10 @@ class LSAdam(torch.optim.Optimizer):
         }
         super().__init__(params, defaults)
         self.eps_mode = 0 if eps_inside_sqrt else 1
+        self.process_group = process_group
+        if process_group is not None:
+            self.shard_rank = dist.get_rank(process_group)
+            self.shard_world_size = dist.get_world_size(process_group)
 
     @property
     def supports_memory_efficient_fp16(self):
@@ -73,6 +93,113 @@ class LSAdam(torch.optim.Optimizer):
     def supports_step_with_scale(self):
         return True
 
+    def _sharded_update(self, p, grad, group, combined_scale, bias_correction):
+        """Update the slice of p of this rank, then all-gather p."""
+        numel = p.numel()
+        shard_size = (numel + self.shard_world_size - 1) // self.shard_world_size
+        start = min(self.shard_rank * shard_size, numel)
+        end = min(start + shard_size, numel)
+        flat_p = p.data.view(-1)
+
+        state = self.state[p]
+        if len(state) > 0 and state.get("shard_rank") != self.shard_rank:
+            # the checkpoint of another rank or of an unsharded run, e.g.
+            # fairseq saves the optimizer of rank 0 only, the slice of this
+            # rank starts over.
+            state.clear()
+        if len(state) == 0:
+            state["step"] = 0
+            state["shard_rank"] = self.shard_rank
+            state["exp_avg"] = torch.zeros(
+                end - start, dtype=torch.float, device=p.device
+            )
+            state["exp_avg_sq"] = torch.zeros_like(state["exp_avg"])
+            if p.dtype != torch.float:
+                # fp32 master weights of the slice.
+                state["master_param"] = flat_p[start:end].float()
+        state["step"] += 1
+
+        out_p = flat_p[start:end]
+        p_data_fp32 = state.get("master_param", out_p)
+        beta1, beta2 = group["betas"]
+        if end > start:
+            with torch.cuda.device(p.device):
+                fused_adam_cuda.adam(
+                    p_data_fp32,
+                    out_p,
+                    state["exp_avg"],
+                    state["exp_avg_sq"],
+                    grad.contiguous().view(-1)[start:end],
+                    group["lr"],
+                    beta1,
+                    beta2,
+                    group["eps"],
+                    combined_scale,
+                    state["step"],
+                    self.eps_mode,
+                    bias_correction,
+                    group["weight_decay"],
+                )
+
+        # the slices are gathered in place, with a padded buffer when numel is
+        # not a multiple of the world size.
+        if shard_size * self.shard_world_size == numel:
+            gathered = flat_p
+        else:
+            gathered = flat_p.new_empty(shard_size * self.shard_world_size)
+            gathered[start:end].copy_(out_p)
+        local = gathered[
+            self.shard_rank * shard_size : (self.shard_rank + 1) * shard_size
+        ]
+        _all_gather_into_tensor(gathered, local, group=self.process_group)
+        if gathered is not flat_p:
+            flat_p.copy_(gathered[:numel])
+
+    def _sparse_update(self, p, group, combined_scale, bias_correction):
+        """
+        Update the rows of p.ls_sparse_grad only, the sparse grads of
+        LSTransformerEmbeddingLayer of sparse_grad. The moments of a row are
+        decayed for the steps it had no grad when it is updated again.
+        """
+        rows, num_rows, grad_rows = p.ls_sparse_grad
+        p.ls_sparse_grad = None
+        if p.dtype != torch.float:
+            raise RuntimeError("LSAdam needs fp32 params for sparse grads")
+        state = self.state[p]
+        if len(state) == 0:
+            state["step"] = 0
+            state["exp_avg"] = torch.zeros_like(p.data)
+            state["exp_avg_sq"] = torch.zeros_like(p.data)
+        if "last_step" not in state:
+            state["last_step"] = torch.full(
+                (p.numel() // grad_rows.size(1),),
+                state["step"],
+                dtype=torch.int,
+                device=p.device,
+            )
+        state["step"] += 1
+        beta1, beta2 = group["betas"]
+        with torch.cuda.device(p.device):
+            fused_adam_cuda.sparse_adam(
+                p.data,
+                p.data.new_empty(0),
+                state["exp_avg"],
+                state["exp_avg_sq"],
+                rows,
+                num_rows,
+                grad_rows.contiguous(),
+                state["last_step"],
+                group["lr"],
+                beta1,
+                beta2,
+                group["eps"],
+                combined_scale,
+                state["step"],
+                self.eps_mode,
+                bias_correction,
+                group["weight_decay"],
+            )
+
     def step(self, closure=None, grads=None, scale=1.0, grad_norms=None):
         """Performs a single optimization step.
         Arguments:
@@ -126,6 +253,11 @@ class LSAdam(torch.optim.Optimizer):
                 # operation of mixed precision optimizer that sometimes
                 # sends None gradients
                 if p.grad is None and grad is None:
+                    if getattr(p, "ls_sparse_grad", None) is None:
+                        continue
+                    if self.process_group is not None:
+                        raise RuntimeError("LSAdam does not shard sparse grads")
+                    self._sparse_update(p, group, combined_scale, bias_correction)
                     continue
                 if grad is None:
                     grad = p.grad.data
@@ -135,6 +267,12 @@ class LSAdam(torch.optim.Optimizer):
                         "please consider SparseAdam instead"
                     )
 
+                if self.process_group is not None:
+                    self._sharded_update(
+                        p, grad, group, combined_scale, bias_correction
+                    )
+                    continue
+
                 p_data_fp32 = p.data.float()
 
                 state = self.state[p]
@@ -176,3 +314,332 @@ class LSAdam(torch.optim.Optimizer):
                     )
 
         return loss
+
+
+class LSMultiTensorOptimizer(torch.optim.Optimizer):
+    """
+    Base of LSAdamW and LSLamb, which update all the params of a group in a few
+    launches of the LightSeq multi tensor kernels. The norm of the grads of
+    every group is computed first, that pass also checks the grads for inf and
+    nan. Then the params are updated with the loss scale and the grad clipping
+    applied on device, without synchronizing with the host. Nothing is updated
+    when some grad is inf or nan, see overflow.
+
+    The params should be fp32, the grads can be fp16 for mixed precision
+    training. output_params of step() takes the fp16 copies of the params of
+    every group, e.g. the params of the fp16 model, they are written in the
+    same pass as the fp32 params.
+
+    Arguments:
+        params (iterable): iterable of parameters to optimize or dicts defining
+            parameter groups.
+        lr (float, optional): learning rate.
+        bias_correction (bool, optional): bias correct the running averages.
+            (default: True)
+        betas (Tuple[float, float], optional): coefficients used for computing
+            running averages of gradient and its square. (default: (0.9, 0.999))
+        eps (float, optional): term added to the denominator to improve
+            numerical stability.
+        eps_inside_sqrt (boolean, optional): see LSAdam. (default: False)
+        weight_decay (float, optional): weight decay.
+        max_grad_norm (float, optional): clip the norm of the grads of every
+            group to it, no clipping when it is 0. (default: 0)
+    """
+
+    def __init__(
+        self,
+        params,
+        lr,
+        bias_correction=True,
+        betas=(0.9, 0.999),
+        eps=1e-8,
+        eps_inside_sqrt=False,
+        weight_decay=0.0,
+        max_grad_norm=0.0,
+    ):
+        global fused_adam_cuda
+
+        if fused_adam_cuda is None:
+            fused_adam_cuda = AdamBuilder().load()
+
+        defaults = {
+            "lr": lr,
+            "bias_correction": bias_correction,
+            "betas": betas,
+            "eps": eps,
+            "weight_decay": weight_decay,
+            "max_grad_norm": max_grad_norm,
+        }
+        super().__init__(params, defaults)
+        self.eps_mode = 0 if eps_inside_sqrt else 1
+        self.noop_flag = None
+        self.grad_norms = []
+
+    @property
+    def supports_memory_efficient_fp16(self):
+        return True
+
+    @property
+    def supports_step_with_scale(self):
+        return True
+
+    @property
+    def overflow(self):
+        """Whether the last step was skipped for inf or nan grads, it
+        synchronizes with the device."""
+        return self.noop_flag is not None and self.noop_flag.item() != 0
+
+    def multi_tensor_update(self, *args):
+        raise NotImplementedError
+
+    def step(self, closure=None, output_params=None, scale=1.0):
+        """Performs a single optimization step.
+        Arguments:
+            closure (callable, optional): A closure that reevaluates the model
+                and returns the loss.
+            output_params (list of lists of tensors, optional): the fp16
+                copies of the params of every group to write the updated
+                params to. (default: None)
+            scale (float, optional): factor to divide gradient tensor values
+                by before applying to weights, e.g. the loss scale.
+                (default: 1)
+        """
+        loss = None
+        if closure is not None:
+            loss = closure()
+
+        if output_params is None:
+            output_params = [None] * len(self.param_groups)
+
+        group_tensor_lists = []
+        for group, params_copy in zip(self.param_groups, output_params):
+            if params_copy is None:
+                params_copy = [None] * len(group["params"])
+            grads, params, exp_avgs, exp_avg_sqs, copies = [], [], [], [], []
+            for p, p_copy in zip(group["params"], params_copy):
+                if p.grad is None:
+                    continue
+                if p.grad.is_sparse:
+                    raise RuntimeError(
+                        "LightSeq multi tensor optimizers do not support sparse "
+                        "gradients"
+                    )
+                if p.dtype != torch.float:
+                    raise RuntimeError(
+                        "LightSeq multi tensor optimizers expect fp32 params, "
+                        "the fp16 ones can be passed by output_params"
+                    )
+
+                state = self.state[p]
+                if len(state) == 0:
+                    # Exponential moving average of gradient values
+                    state["exp_avg"] = torch.zeros_like(p.data)
+                    # Exponential moving average of squared gradient values
+                    state["exp_avg_sq"] = torch.zeros_like(p.data)
+
+                grads.append(p.grad.data)
+                params.append(p.data)
+                exp_avgs.append(state["exp_avg"])
+                exp_avg_sqs.append(state["exp_avg_sq"])
+                copies.append(p_copy)
+
+            if len(grads) == 0:
+                continue
+            tensor_lists = [grads, params, exp_avgs, exp_avg_sqs]
+            if all(p_copy is not None for p_copy in copies):
+                tensor_lists.append([p_copy.data for p_copy in copies])
+            group_tensor_lists.append((group, tensor_lists))
+
+        if len(group_tensor_lists) == 0:
+            return loss
+
+        # the grads of all the groups are checked before any update.
+        self.noop_flag = torch.zeros(
+            1, dtype=torch.int, device=group_tensor_lists[0][1][0][0].device
+        )
+        self.grad_norms = [
+            fused_adam_cuda.multi_tensor_grad_norm(self.noop_flag, tensor_lists[0])
+            for _, tensor_lists in group_tensor_lists
+        ]
+
+        for (group, tensor_lists), grad_norm in zip(
+            group_tensor_lists, self.grad_norms
+        ):
+            # the step is counted even when it is skipped, as the host does not
+            # know it yet.
+            group["step"] = group.get("step", 0) + 1
+            beta1, beta2 = group["betas"]
+            self.multi_tensor_update(
+                self.noop_flag,
+                tensor_lists,
+                grad_norm,
+                group["lr"],
+                beta1,
+                beta2,
+                group["eps"],
+                scale,
+                group["max_grad_norm"],
+                group["step"],
+                self.eps_mode,
+                1 if group["bias_correction"] else 0,
+                group["weight_decay"],
+            )
+
+        return loss
+
+
+class LSAdamW(LSMultiTensorOptimizer):
+    """
+    Adam with decoupled weight decay, see LSMultiTensorOptimizer.
+    .. _Decoupled Weight Decay Regularization:
+        https://arxiv.org/abs/1711.05101
+    """
+
+    def __init__(self, params, lr=1e-3, eps=1e-8, weight_decay=1e-2, **kwargs):
+        super().__init__(params, lr, eps=eps, weight_decay=weight_decay, **kwargs)
+
+    def multi_tensor_update(self, *args):
+        fused_adam_cuda.multi_tensor_adamw(*args)
+
+
+class LSAdamWBF16(LSMultiTensorOptimizer):
+    """
+    AdamW of bf16 params without fp32 master weights, see
+    LSMultiTensorOptimizer. The params are updated in place with stochastic
+    rounding, so that the updates smaller than their precision still add up
+    in expectation. The grads are bf16 or fp32.
+
+    The moments are fp32, or with quantize_states 8 bit and blockwise
+    quantized with one fp32 scale per 256 elements, about 4 bytes per param
+    in total instead of the 14 of fp32 master weights, fp32 moments and fp16
+    params.
+
+    Arguments:
+        quantize_states (bool, optional): keep 8 bit moments.
+            (default: False)
+        others: see LSMultiTensorOptimizer.
+    """
+
+    def __init__(
+        self,
+        params,
+        lr=1e-3,
+        eps=1e-8,
+        weight_decay=1e-2,
+        quantize_states=False,
+        **kwargs,
+    ):
+        super().__init__(params, lr, eps=eps, weight_decay=weight_decay, **kwargs)
+        self.quantize_states = quantize_states
+
+    def _init_state(self, p, state):
+        if not self.quantize_states:
+            state["exp_avg"] = torch.zeros_like(p.data, dtype=torch.float)
+            state["exp_avg_sq"] = torch.zeros_like(p.data, dtype=torch.float)
+            return
+        num_blocks = (p.numel() + 255) // 256
+        state["exp_avg"] = torch.zeros_like(p.data, dtype=torch.int8)
+        state["exp_avg_sq"] = torch.zeros_like(p.data, dtype=torch.uint8)
+        state["exp_avg_scale"] = torch.zeros(
+            num_blocks, dtype=torch.float, device=p.device
+        )
+        state["exp_avg_sq_scale"] = torch.zeros(
+            num_blocks, dtype=torch.float, device=p.device
+        )
+
+    def step(self, closure=None, scale=1.0):
+        """Performs a single optimization step.
+        Arguments:
+            closure (callable, optional): A closure that reevaluates the model
+                and returns the loss.
+            scale (float, optional): factor to divide gradient tensor values
+                by before applying to weights, e.g. the loss scale.
+                (default: 1)
+        """
+        loss = None
+        if closure is not None:
+            loss = closure()
+
+        group_tensor_lists = []
+        for group in self.param_groups:
+            tensor_lists, scale_lists = [[], [], [], []], []
+            if self.quantize_states:
+                scale_lists = [[], []]
+            for p in group["params"]:
+                if p.grad is None:
+                    continue
+                if p.grad.is_sparse:
+                    raise RuntimeError(
+                        "LightSeq multi tensor optimizers do not support sparse "
+                        "gradients"
+                    )
+                if p.dtype != torch.bfloat16:
+                    raise RuntimeError("LSAdamWBF16 expects bf16 params")
+
+                state = self.state[p]
+                if len(state) == 0:
+                    self._init_state(p, state)
+                tensor_lists[0].append(p.grad.data)
+                tensor_lists[1].append(p.data)
+                tensor_lists[2].append(state["exp_avg"])
+                tensor_lists[3].append(state["exp_avg_sq"])
+                if self.quantize_states:
+                    scale_lists[0].append(state["exp_avg_scale"])
+                    scale_lists[1].append(state["exp_avg_sq_scale"])
+
+            if len(tensor_lists[0]) > 0:
+                group_tensor_lists.append((group, tensor_lists, scale_lists))
+
+        if len(group_tensor_lists) == 0:
+            return loss
+
+        # the grads of all the groups are checked before any update.
+        self.noop_flag = torch.zeros(
+            1, dtype=torch.int, device=group_tensor_lists[0][1][0][0].device
+        )
+        self.grad_norms = [
+            fused_adam_cuda.multi_tensor_grad_norm(self.noop_flag, tensor_lists[0])
+            for _, tensor_lists, _ in group_tensor_lists
+        ]
+
+        for (group, tensor_lists, scale_lists), grad_norm in zip(
+            group_tensor_lists, self.grad_norms
+        ):
+            group["step"] = group.get("step", 0) + 1
+            beta1, beta2 = group["betas"]
+            # the seed of the stochastic rounding, from the host generator.
+            seed = int(torch.randint(2**62, (1,)).item())
+            fused_adam_cuda.multi_tensor_adamw_bf16(
+                self.noop_flag,
+                tensor_lists,
+                scale_lists,
+                grad_norm,
+                group["lr"],
+                beta1,
+                beta2,
+                group["eps"],
+                scale,
+                group["max_grad_norm"],
+                group["step"],
+                self.eps_mode,
+                1 if group["bias_correction"] else 0,
+                group["weight_decay"],
+                seed,
+            )
+
+        return loss
+
+
+class LSLamb(LSMultiTensorOptimizer):
+    """
+    LAMB, Adam scaled by the trust ratio ||param|| / ||update|| of every param
+    tensor, see LSMultiTensorOptimizer.
+    .. _Large Batch Optimization for Deep Learning: Training BERT in 76 minutes:
+        https://arxiv.org/abs/1904.00962
+    """
+
+    def __init__(self, params, lr=1e-3, eps=1e-6, weight_decay=1e-2, **kwargs):
+        super().__init__(params, lr, eps=eps, weight_decay=weight_decay, **kwargs)
+
+    def multi_tensor_update(self, *args):
+        fused_adam_cuda.multi_tensor_lamb(*args)
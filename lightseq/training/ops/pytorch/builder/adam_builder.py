@@ -18,12 +18,16 @@ class AdamBuilder(CUDAOpBuilder):
 
     def sources(self):
         return [
-            "csrc/kernels/fused_adam_kernel.cu",
+            "csrc/kernels/cuda/fused_adam_kernel.cu",
             "csrc/pybind/pybind_adam.cpp",
         ]
 
     def include_paths(self):
-        return ["csrc/kernels/includes", "csrc/ops/includes", "csrc/layers/includes"]
+        return [
+            "csrc/kernels/cuda/includes",
+            "csrc/ops/includes",
+            "csrc/layers/includes",
+        ]
 
     def nvcc_args(self):
         args = [
@@ -31,7 +31,13 @@ class KernelBuilder(CUDAOpBuilder):
             "csrc/kernels/cuda/dropout_kernels.cu",
             "csrc/kernels/cuda/embedding_kernels.cu",
             "csrc/kernels/cuda/quantize_kernels.cu",
+            "csrc/kernels/cuda/gcq_kernels.cu",
             "csrc/kernels/cuda/crf.cu",
+            "csrc/kernels/cuda/flash_attention_kernels.cu",
+            "csrc/kernels/cuda/llama_kernels.cu",
+            "csrc/kernels/cuda/transformerKernels.cc.cu",
+            "csrc/kernels/cuda/speculative_kernels.cu",
+            "csrc/kernels/cuda/moe_kernels.cu",
             "csrc/pybind/pybind_kernel_cuda.cpp",
         ]
 
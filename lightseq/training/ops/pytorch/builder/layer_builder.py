@@ -27,12 +27,19 @@ class LayerBuilder(CUDAOpBuilder):
             "csrc/kernels/cuda/normalize_kernels.cu",
             "csrc/kernels/cuda/softmax_kernels.cu",
             "csrc/kernels/cuda/softmax_kernels_new.cu",
+            "csrc/kernels/cuda/flash_attention_kernels.cu",
             "csrc/kernels/cuda/general_kernels.cu",
             "csrc/kernels/cuda/cuda_util.cu",
             "csrc/kernels/cuda/embedding_kernels.cu",
             "csrc/kernels/cuda/cross_entropy.cu",
             "csrc/kernels/cuda/transformerKernels.cc.cu",
             "csrc/kernels/cuda/crf.cu",
+            "csrc/kernels/cuda/gemm_tuner.cu",
+            "csrc/kernels/cuda/lora_kernels.cu",
+            "csrc/kernels/cuda/llama_kernels.cu",
+            "csrc/kernels/cuda/quantize_kernels.cu",
+            "csrc/kernels/cuda/weight_only_kernels.cu",
+            "csrc/kernels/cuda/swiglu_kernels.cu",
             "csrc/lsflow/allocator.cpp",
             "csrc/lsflow/context.cpp",
             "csrc/lsflow/layer.cpp",
@@ -41,21 +48,34 @@ class LayerBuilder(CUDAOpBuilder):
             "csrc/lsflow/node.cpp",
             "csrc/lsflow/operator.cpp",
             "csrc/lsflow/shape.cpp",
+            "csrc/lsflow/scheduler.cpp",
+            "csrc/lsflow/profiler.cpp",
             "csrc/lsflow/tensor.cpp",
             "csrc/lsflow/variable.cpp",
             # "csrc/ops_new/beam_rough_topk.cpp",
             "csrc/ops_new/bias_act_dropout.cpp",
             "csrc/ops_new/bias_dropout_residual.cpp",
+            "csrc/ops_new/bias_dropout_res_ln.cpp",
             "csrc/ops_new/linear.cpp",
             "csrc/ops_new/layer_normalize.cpp",
             "csrc/ops_new/strided_batch_gemm.cpp",
             "csrc/ops_new/bias_add_transform_20314.cpp",
             "csrc/ops_new/dropout.cpp",
             "csrc/ops_new/softmax.cpp",
+            "csrc/ops_new/flash_attention.cpp",
             "csrc/ops_new/concat3_dim1.cpp",
             "csrc/ops_new/transform_0213.cpp",
             "csrc/ops_new/crf.cpp",
             "csrc/ops_new/split_head_op.cpp",
+            "csrc/ops_new/act_elewise_product.cpp",
+            "csrc/ops_new/all_reduce.cpp",
+            "csrc/ops_new/fp8_linear.cpp",
+            "csrc/ops_new/fuse_add2_op.cpp",
+            "csrc/ops_new/rms_layer_norm.cpp",
+            "csrc/ops_new/fuse_rotary_position_qkv.cpp",
+            "csrc/ops_new/paged_attention.cpp",
+            "csrc/ops_new/weight_only_linear.cpp",
+            "csrc/ops_new/swiglu_linear.cpp",
             "csrc/layers_new/feed_forward_layer.cpp",
             "csrc/layers_new/multihead_attention_layer.cpp",
             "csrc/layers_new/transformer_encoder_layer.cpp",
@@ -66,6 +86,9 @@ class LayerBuilder(CUDAOpBuilder):
             "csrc/layers_new/crf_layer.cpp",
             "csrc/layers_new/gpt_attention_layer.cpp",
             "csrc/layers_new/sdpa_layer.cpp",
+            "csrc/layers_new/llama_attention_layer.cpp",
+            "csrc/layers_new/llama_mlp_layer.cpp",
+            "csrc/layers_new/llama_layer.cpp",
             "csrc/pybind/pybind_layer_new.cpp",
         ]
 
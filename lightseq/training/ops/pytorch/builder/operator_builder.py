@@ -39,6 +39,8 @@ class OperatorBuilder(CUDAOpBuilder):
             "csrc/lsflow/node.cpp",
             "csrc/lsflow/operator.cpp",
             "csrc/lsflow/shape.cpp",
+            "csrc/lsflow/scheduler.cpp",
+            "csrc/lsflow/profiler.cpp",
             "csrc/lsflow/tensor.cpp",
             "csrc/lsflow/variable.cpp",
             "csrc/ops_new/split_head_op.cpp",
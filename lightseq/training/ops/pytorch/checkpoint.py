@@ -0,0 +1,113 @@
+import os
+import threading
+
+import torch
+
+
+class LSAsyncCheckpointer(object):
+    """
+    Asynchronous checkpoint snapshots, so that training does not stall for the
+    device to host copy and the write of a checkpoint.
+
+    snapshot() copies the tensors of a state, eg. the state_dict of a model of
+    LightSeq layers, whose weights are the flat para of every layer, and the
+    state_dict of its optimizer, into pinned host buffers on a side stream,
+    and returns right away. A background thread waits for the copies and
+    torch.save()s the host state to a temporary file renamed to the path once
+    written, so a checkpoint on disk is always complete. The pinned buffers
+    are kept for the next snapshot of tensors of the same shapes.
+
+    The copies read the tensors after the kernels already issued on the
+    current stream, and the current stream waits for them before what is
+    issued after snapshot(), so the parameters are only updated once copied,
+    without the host waiting. With defer_wait=True the current stream only
+    waits at wait_copy(), so that the forward and backward of the next step,
+    which do not update the state, overlap the copies: call wait_copy()
+    before the optimizer step then.
+
+    One snapshot is written at a time, a snapshot waits for the write of the
+    previous one. Errors of a write are raised by the next snapshot() or by
+    wait().
+
+    Arguments:
+        stream (torch.cuda.Stream, optional): the side stream of the copies.
+            (default: None, a new stream)
+    """
+
+    def __init__(self, stream=None):
+        self.stream = stream if stream is not None else torch.cuda.Stream()
+        # the pinned buffers of the last snapshot, by path in the state.
+        self.buffers = {}
+        self.copy_event = None
+        self.copy_waited = True
+        self.thread = None
+        self.error = None
+
+    def _to_host(self, obj, key):
+        if torch.is_tensor(obj):
+            if not obj.is_cuda:
+                return obj.detach().clone()
+            buf = self.buffers.get(key)
+            if buf is None or buf.shape != obj.shape or buf.dtype != obj.dtype:
+                buf = torch.empty(
+                    obj.shape, dtype=obj.dtype, device="cpu", pin_memory=True
+                )
+                self.buffers[key] = buf
+            buf.copy_(obj.detach(), non_blocking=True)
+            # the caching allocator should not reuse obj while it is copied.
+            obj.record_stream(self.stream)
+            return buf
+        if isinstance(obj, dict):
+            return type(obj)(
+                (k, self._to_host(v, key + (k,))) for k, v in obj.items()
+            )
+        if isinstance(obj, (list, tuple)):
+            res = [self._to_host(v, key + (i,)) for i, v in enumerate(obj)]
+            return type(obj)(res) if isinstance(obj, tuple) else res
+        return obj
+
+    def _write(self, state, path):
+        try:
+            self.copy_event.synchronize()
+            tmp_path = path + ".tmp"
+            torch.save(state, tmp_path)
+            os.replace(tmp_path, path)
+        except Exception as e:
+            self.error = e
+
+    def snapshot(self, state, path, defer_wait=False):
+        """Save state, a nested dict or list of tensors, to path in the
+        background, see the class doc."""
+        self.wait()
+        self.wait_copy()
+        current = torch.cuda.current_stream()
+        self.stream.wait_stream(current)
+        with torch.cuda.stream(self.stream):
+            host_state = self._to_host(state, ())
+            self.copy_event = torch.cuda.Event()
+            self.copy_event.record(self.stream)
+        self.copy_waited = False
+        if not defer_wait:
+            self.wait_copy()
+        self.thread = threading.Thread(
+            target=self._write, args=(host_state, path), daemon=True
+        )
+        self.thread.start()
+
+    def wait_copy(self):
+        """Make the current stream wait for the copies of the last snapshot,
+        before the state is updated, the host does not wait."""
+        if self.copy_waited:
+            return
+        torch.cuda.current_stream().wait_event(self.copy_event)
+        self.copy_waited = True
+
+    def wait(self):
+        """Wait for the write of the last snapshot, eg. at the end of
+        training."""
+        if self.thread is not None:
+            self.thread.join()
+            self.thread = None
+        if self.error is not None:
+            error, self.error = self.error, None
+            raise error
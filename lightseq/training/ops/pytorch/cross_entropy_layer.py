@@ -4,9 +4,10 @@ import torch
 from torch import nn
 from torch.autograd import Function
 
-from lightseq.training.ops.pytorch.builder import TransformerBuilder
+from lightseq.training.ops.pytorch.builder import OperatorBuilder, TransformerBuilder
 
 transformer_cuda_module = None
+operator_cuda_module = None
 
 
 class LSCrossEntropyFunc(Function):
@@ -120,3 +121,116 @@ class LSCrossEntropyLayer(nn.Module):
             self.config, inputs, targets, **kwargs
         )
         return loss, nll_loss
+
+
+class LSFusedLinearCrossEntropyFunc(Function):
+    @staticmethod
+    def forward(ctx, config, inputs, weight, targets):
+        cuda_module = operator_cuda_module
+        forward_func = (
+            cuda_module.torch_fused_linear_cross_entropy_fw_fp16
+            if config.fp16
+            else cuda_module.torch_fused_linear_cross_entropy_fw_fp32
+        )
+
+        targets = targets.to(torch.int32).contiguous()
+        inputs = inputs.contiguous()
+        if config.fp16:
+            inputs = inputs.to(torch.half)
+            weight = weight.to(torch.half)
+
+        (reduced_loss, nll_loss, lse) = forward_func(
+            inputs,
+            weight,
+            targets,
+            config.padding_idx,
+            config.epsilon,
+            config.chunk_size,
+        )
+
+        if config.is_grad_enabled and config.training:
+            ctx.save_for_backward(inputs, weight, targets, lse)
+            ctx.config = config
+        return reduced_loss, nll_loss
+
+    @staticmethod
+    def backward(ctx, grad_loss, grad_nll_loss):
+        cuda_module = operator_cuda_module
+        backward_func = (
+            cuda_module.torch_fused_linear_cross_entropy_bw_fp16
+            if ctx.config.fp16
+            else cuda_module.torch_fused_linear_cross_entropy_bw_fp32
+        )
+
+        assert ctx.config.training
+
+        (inputs, weight, targets, lse) = ctx.saved_tensors
+
+        grad_loss = grad_loss.to(torch.float32).contiguous()
+
+        (grad_inputs, grad_weight) = backward_func(
+            grad_loss,
+            inputs,
+            weight,
+            targets,
+            lse,
+            ctx.config.padding_idx,
+            ctx.config.epsilon,
+            ctx.config.chunk_size,
+        )
+
+        return (None, grad_inputs, grad_weight, None)
+
+
+class LSFusedLinearCrossEntropyLayer(nn.Module):
+    """Initialize the Lightseq fused output projection and Cross Entropy Layer.
+
+    The logits of the inputs and the output projection weight, e.g. the shared
+    embedding, are computed chunk_size vocab rows at a time and never stored
+    whole, the backward recomputes them from the logsumexp of every token.
+    Arguments:
+        config: An object of LSFusedLinearCrossEntropyLayer config, see get_config
+    """
+
+    def __init__(
+        self,
+        config,
+    ):
+        super(LSFusedLinearCrossEntropyLayer, self).__init__()
+        self.config = config
+
+        if self.config.local_rank >= 0:
+            torch.cuda.set_device(self.config.local_rank)
+
+        # Load cuda modules if needed
+        global operator_cuda_module
+        if operator_cuda_module is None:
+            operator_cuda_module = OperatorBuilder().load()
+
+    @staticmethod
+    def get_config(**kwargs):
+        @dataclass
+        class Config:
+            max_batch_tokens: int  # max batch token numbers
+            padding_idx: int  # padding token id in vocabulary
+            epsilon: float  # label smoothing factor
+            fp16: bool  # fp16 presion
+            local_rank: int  # rank in local node
+            chunk_size: int = 8192  # vocab rows projected at a time
+
+        return Config(**kwargs)
+
+    def forward(self, inputs, weight, targets, **kwargs):
+        """inputs: [batch_size, seq_len, hidden_size], weight: [vocab_size,
+        hidden_size], targets: [batch_size, seq_len]"""
+        self.config.training = self.training
+        self.config.is_grad_enabled = torch.is_grad_enabled()
+        bs, sl = inputs.size()[:2]
+        if bs * sl > self.config.max_batch_tokens:
+            raise ValueError(
+                f"Batch token numbers {bs * sl} exceeds the limit {self.config.max_batch_tokens}."
+            )
+        loss, nll_loss = LSFusedLinearCrossEntropyFunc.apply(
+            self.config, inputs, weight, targets, **kwargs
+        )
+        return loss, nll_loss
@@ -372,6 +372,36 @@ def export_ls_config(
             exec("file.create_dataset('model_conf/{0}', data={0})".format(v))
 
 
+def export_adaptive_softmax(file, adaptive_softmax):
+    """Export the output head of a GPT hdf5 from a
+    torch.nn.AdaptiveLogSoftmaxWithLoss without head bias, in place of the
+    projection on the token embedding. The weights are row major
+    [out_features, in_features], as torch stores them."""
+    assert not adaptive_softmax.head_bias, "the head bias is not supported"
+    cutoffs = adaptive_softmax.cutoffs[:-1]
+    file.create_dataset(
+        "model_conf/adaptive_cutoffs", data=np.array(cutoffs), dtype="i4"
+    )
+    file.create_dataset(
+        "adaptive_softmax/head_kernel",
+        data=adaptive_softmax.head.weight.detach().cpu().flatten().tolist(),
+        dtype="f4",
+    )
+    for i, tail in enumerate(adaptive_softmax.tail):
+        proj, out = tail[0], tail[1]
+        file.create_dataset(
+            f"adaptive_softmax/tail_{i}_proj_kernel",
+            data=proj.weight.detach().cpu().flatten().tolist(),
+            dtype="f4",
+        )
+        file.create_dataset(
+            f"adaptive_softmax/tail_{i}_out_kernel",
+            data=out.weight.detach().cpu().flatten().tolist(),
+            dtype="f4",
+        )
+    print(f"adaptive softmax of {len(cutoffs)} tail clusters, convert finished!")
+
+
 def export_pb2hdf5(transformer, f):
     """Convert Transformer protobuf to hdf5 format to support larger weight."""
     MODEL_CONF_KEYS = [
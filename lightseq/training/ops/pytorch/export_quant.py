@@ -584,6 +584,58 @@ def export_ls_quant_encoder(
     fill_quant_encdec_weight(file, state_dict, mapping_dict, True, save_pb)
 
 
+def pack_int8_kernel(kernel, layout):
+    """
+    The int8 kernel in the layout which quantize_weight transforms the
+    [rows, cols] uint8 kernel of quantize to on the gpu: "col" is the
+    column-major kernel, "col4_4r2_8c" the CUBLASLT_ORDER_COL4_4R2_8C order
+    of its transpose, used by the gemms of int8 inputs before sm 80.
+    """
+    kernel = (kernel.astype(np.int16) - global_quant_range).astype(np.int8)
+    if layout == "col":
+        return np.ascontiguousarray(kernel.transpose()).flatten()
+    assert layout == "col4_4r2_8c", f"unsupported int8 kernel layout {layout}"
+    # the [m, n] transpose is stored in tiles of 32 columns of all its rows
+    n, m = kernel.shape
+    assert m % 8 == 0 and n % 32 == 0, f"can not pack kernel of {kernel.shape}"
+    r, c = np.meshgrid(np.arange(m), np.arange(n), indexing="ij")
+    tile_row = (((r >> 3) << 3) + ((r & 1) << 2) + ((c & 31) >> 3)) << 5
+    tile_row += ((np.where((c & 7) >= 4, 4, 0) + ((r & 7) >> 1)) << 2) + (c & 3)
+    packed = np.empty(m * n, dtype=np.int8)
+    packed[((c >> 5) * 32 * m + tile_row).flatten()] = kernel.transpose().flatten()
+    return packed
+
+
+def pack_ls_quant_encoder(file, layer_num, pack_sm):
+    """
+    Replace the uint8 kernels of the hdf5 encoder stack of
+    export_ls_quant_encoder by the int8 ones QuantGptEncoder uses on gpus of
+    sm version pack_sm, which it then copies as is instead of quantizing and
+    transforming them at every load. model_conf/int8_weight_layout records
+    the layout, the model refuses to load on gpus of the other one.
+    """
+    layout = "col" if pack_sm >= 80 else "col4_4r2_8c"
+    kernel_layouts = {
+        "multihead_project_kernel_qkv": layout,
+        "multihead_project_kernel_output": "col",
+        "ffn_first_kernel": layout,
+        "ffn_second_kernel": "col",
+    }
+    for layer_id in range(layer_num):
+        for name, kernel_layout in kernel_layouts.items():
+            dataset = f"encoder_stack/{layer_id}/{name}"
+            kernel = file[dataset][()]
+            del file[dataset]
+            file.create_dataset(
+                dataset, data=pack_int8_kernel(kernel, kernel_layout), dtype="i1"
+            )
+    file.create_dataset(
+        "model_conf/int8_weight_layout",
+        data=np.array([ord(c) for c in layout]).astype(np.int8),
+        dtype="i1",
+    )
+
+
 def export_ls_quant_decoder(
     file,
     state_dict,
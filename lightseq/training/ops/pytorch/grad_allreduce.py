@@ -0,0 +1,69 @@
+import torch.distributed as dist
+from torch._utils import _flatten_dense_tensors, _unflatten_dense_tensors
+
+
+class LSGradAllReducer(object):
+    """
+    Data parallel all-reduce of the weight grads of the LightSeq new-arch
+    layers, overlapped with their backward.
+
+    The layers call grad_ready() from the end of their backward, see
+    Layer::set_grad_ready_hook, when the kernels of their grads are issued.
+    The grads are collected into buckets of bucket_cap_mb, in the order of the
+    backward, and a full bucket is all-reduced asynchronously right away. NCCL
+    waits for the grads on its own stream, so the reduction of the last layers
+    runs while the layers before them are still in backward and the step time
+    tends to max(compute, comm) instead of their sum.
+
+    Call wait() after the backward and before the optimizer step, it reduces
+    the last bucket and averages the grads over the ranks. The grads of a layer
+    are written by each backward, so gradient accumulation over several
+    backwards is not supported, and the layers should not be wrapped in
+    DistributedDataParallel as well.
+
+    Arguments:
+        process_group (ProcessGroup, optional): the data parallel group.
+            (default: None, the default group)
+        bucket_cap_mb (float, optional): the size of the buckets, the grads of
+            a layer are never split. (default: 25)
+    """
+
+    def __init__(self, process_group=None, bucket_cap_mb=25):
+        self.process_group = process_group
+        self.world_size = dist.get_world_size(process_group)
+        self.bucket_cap_bytes = int(bucket_cap_mb * 1024 * 1024)
+        self.bucket = []
+        self.bucket_bytes = 0
+        # (work, reduced tensor, grads of the bucket)
+        self.pending = []
+
+    def grad_ready(self, grad):
+        self.bucket.append(grad)
+        self.bucket_bytes += grad.numel() * grad.element_size()
+        if self.bucket_bytes >= self.bucket_cap_bytes:
+            self._reduce_bucket()
+
+    def _reduce_bucket(self):
+        if len(self.bucket) == 0:
+            return
+        # a bucket of several grads is reduced in one call through a flat copy.
+        if len(self.bucket) == 1:
+            flat = self.bucket[0]
+        else:
+            flat = _flatten_dense_tensors(self.bucket)
+        work = dist.all_reduce(flat, group=self.process_group, async_op=True)
+        self.pending.append((work, flat, self.bucket))
+        self.bucket = []
+        self.bucket_bytes = 0
+
+    def wait(self):
+        """Finish the all-reduce of the grads of the last backward."""
+        self._reduce_bucket()
+        for work, flat, grads in self.pending:
+            work.wait()
+            flat.div_(self.world_size)
+            if flat is grads[0]:
+                continue
+            for grad, reduced in zip(grads, _unflatten_dense_tensors(flat, grads)):
+                grad.copy_(reduced)
+        self.pending = []
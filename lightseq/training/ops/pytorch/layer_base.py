@@ -22,6 +22,19 @@ class TransformerEncoderLayerBase(nn.Module):
             fp16: bool  # fp16 presion
             local_rank: int  # rank in local node
             activation_fn: str = "relu"  # relu or gelu
+            recompute: bool = False  # recompute the new arch layer in backward
+            # redraw the new arch dropout masks in backward instead of storing them
+            mask_free_dropout: bool = False
+            # fixed dropout seeds and device offsets, so that a training step
+            # through the new arch layers can be captured by torch.cuda.graph
+            capturable: bool = False
+            # add the weight grads of the micro batches into para.grad in place,
+            # not with DistributedDataParallel, see LSTransformerEncoderLayer
+            accumulate_grads: bool = False
+            # fp8 gemms of the new arch linears, e4m3 forward and e5m2 grads,
+            # scaled by the amax of the last fp8_amax_history_len steps
+            fp8_training: bool = False
+            fp8_amax_history_len: int = 16
 
         if "model" in kwargs:
             if kwargs["model"] not in MODEL_ARCH:
@@ -53,6 +66,9 @@ class TransformerDecoderLayerBase(nn.Module):
             nlayer: int  # number of layers
             activation_fn: str = "relu"  # relu or gelu
             has_cross_attn: bool = True
+            # fp8 gemms of the new arch linears, see TransformerEncoderLayerBase
+            fp8_training: bool = False
+            fp8_amax_history_len: int = 16
 
         if "model" in kwargs:
             if kwargs["model"] not in MODEL_ARCH:
@@ -82,5 +98,7 @@ class TransformerEmbeddingLayerBase(nn.Module):
             no_scale_embedding: bool = False  # scale embedding
             layernorm_embedding: bool = False  # layernorm for embedding
             need_offset: bool = False  # position offset for bart
+            # grads of the touched rows of the embeddings only, see LSAdam
+            sparse_grad: bool = False
 
         return Config(**kwargs)
@@ -132,6 +132,10 @@ class LSTransformerDecoderLayer(TransformerDecoderLayerBase):
 
         # create the layer in cuda kernels.
         cuda_module = layer_cuda_module
+        # read by the linear operators when the layer is created.
+        cuda_module.set_fp8_training(
+            self.config.fp8_training, self.config.fp8_amax_history_len
+        )
         create_layer_func = (
             cuda_module.create_transformer_decoder_layer_new_fp16
             if self.config.fp16
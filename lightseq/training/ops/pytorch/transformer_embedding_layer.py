@@ -10,7 +10,6 @@ from lightseq.training.ops.pytorch.util import (
     copy_para,
     state_dict,
     calc_offset,
-    get_pos_embedding,
 )
 
 transformer_cuda_module = TransformerBuilder().load()
@@ -18,9 +17,30 @@ transformer_cuda_module = TransformerBuilder().load()
 _all_layer_grads = dict()
 
 
+def _accumulate_sparse_grad(param, rows, num_rows, grad_rows):
+    """
+    Keep the sparse grads of the embeddings as param.ls_sparse_grad, which
+    LSAdam updates and clears. The rows of several backward passes, with
+    gradient accumulation, are merged.
+    """
+    prev = getattr(param, "ls_sparse_grad", None)
+    if prev is None:
+        param.ls_sparse_grad = (rows, num_rows, grad_rows)
+        return
+    prev_rows, prev_num_rows, prev_grad_rows = prev
+    n0, n1 = int(prev_num_rows), int(num_rows)
+    all_rows = torch.cat([prev_rows[:n0], rows[:n1]])
+    all_grads = torch.cat([prev_grad_rows[:n0], grad_rows[:n1]])
+    rows, inverse = torch.unique(all_rows, sorted=True, return_inverse=True)
+    grad_rows = all_grads.new_zeros(rows.numel(), all_grads.size(1))
+    grad_rows.index_add_(0, inverse, all_grads)
+    num_rows = torch.tensor([rows.numel()], dtype=torch.int, device=rows.device)
+    param.ls_sparse_grad = (rows.int(), num_rows, grad_rows)
+
+
 class LSTransformerEmbeddingFunc(Function):
     @staticmethod
-    def forward(ctx, config, input, embeddings, step):
+    def forward(ctx, config, input, embeddings, step, cu_seqlens):
         cuda_module = transformer_cuda_module
         forward_func = (
             cuda_module.transformer_embedding_layer_fw_fp16
@@ -29,12 +49,18 @@ class LSTransformerEmbeddingFunc(Function):
         )
 
         (output,) = forward_func(
-            config.layer_id, input, step, config.training, config.quant_mode
+            config.layer_id,
+            input,
+            step,
+            config.training,
+            config.quant_mode,
+            cu_seqlens,
         )
 
         if config.is_grad_enabled and config.training:
             ctx.save_for_backward(input)
             ctx.config = config
+            ctx.embeddings = embeddings
         return output
 
     @staticmethod
@@ -52,11 +78,24 @@ class LSTransformerEmbeddingFunc(Function):
         if ctx.config.fp16:
             grad_output = grad_output.to(torch.half)
 
+        config = ctx.config
+        if config.sparse_grad and not config.trainable_pos and not config.quant_mode:
+            sparse_backward_func = (
+                cuda_module.transformer_embedding_layer_sparse_bw_fp16
+                if config.fp16
+                else cuda_module.transformer_embedding_layer_sparse_bw_fp32
+            )
+            rows, num_rows, grad_rows = sparse_backward_func(
+                config.layer_id, grad_output, input
+            )
+            _accumulate_sparse_grad(ctx.embeddings, rows, num_rows, grad_rows)
+            return (None, None, None, None, None)
+
         backward_func(ctx.config.layer_id, grad_output, input)
 
         grad = _all_layer_grads[ctx.config.layer_id]
 
-        return (None, None, grad, None)
+        return (None, None, grad, None, None)
 
 
 class LSTransformerEmbeddingLayer(TransformerEmbeddingLayerBase):
@@ -96,12 +135,13 @@ class LSTransformerEmbeddingLayer(TransformerEmbeddingLayerBase):
             # only retain the embedding params
             self.para_offset = self.para_offset[:2]
 
-        # if trainable_pos is True, deprecate self.pos_embeddings
-        self.pos_embeddings = get_pos_embedding(
-            self.config.max_seq_len, self.config.embedding_dim
-        ).to(self.config.local_rank)
-        if self.config.fp16:
-            self.pos_embeddings = self.pos_embeddings.to(torch.half)
+        # the sinusoidal positions of util.get_pos_embedding are computed in the
+        # kernels, of any length, an empty self.pos_embeddings selects them.
+        self.pos_embeddings = torch.empty(
+            0,
+            dtype=torch.half if self.config.fp16 else torch.float,
+            device=self.config.local_rank,
+        )
 
         # create the layer in cuda kernels.
         self.create_cpp_layer()
@@ -194,7 +234,9 @@ class LSTransformerEmbeddingLayer(TransformerEmbeddingLayerBase):
         offsets = calc_offset(sizes)
         return offsets
 
-    def forward(self, input, step=0, **kwargs):
+    def forward(self, input, step=0, cu_seqlens=None, **kwargs):
+        # cu_seqlens packs several sequences in every row of the batch, the
+        # positions restart at every sequence, see LSTransformerEncoderLayer
         self.config.training = self.training
         self.config.quant_mode = self.quant_mode
         self.config.is_grad_enabled = torch.is_grad_enabled()
@@ -213,16 +255,23 @@ class LSTransformerEmbeddingLayer(TransformerEmbeddingLayerBase):
                 f"Batch token numbers {bs * sl} exceeds the limit"
                 f" {self.config.max_batch_tokens}."
             )
-        if sl > self.config.max_seq_len:
+        # only the table of the trainable positions bounds the length.
+        if self.config.trainable_pos and sl > self.config.max_seq_len:
             raise ValueError(
                 f"Sequence length {sl} exceeds the limit {self.config.max_seq_len}."
             )
-        if step >= self.config.max_seq_len:
+        if self.config.trainable_pos and step >= self.config.max_seq_len:
             raise ValueError(
                 f"Target sequence length {sl} exceeds the limit"
                 f" {self.config.max_seq_len}."
             )
-        x = LSTransformerEmbeddingFunc.apply(self.config, input, self.para, step)
+        if cu_seqlens is None:
+            cu_seqlens = torch.empty(0, dtype=torch.int, device=input.device)
+        else:
+            cu_seqlens = cu_seqlens.to(device=input.device, dtype=torch.int)
+        x = LSTransformerEmbeddingFunc.apply(
+            self.config, input, self.para, step, cu_seqlens.contiguous()
+        )
         return x.to(self.para)
 
     def disable_quant(self):
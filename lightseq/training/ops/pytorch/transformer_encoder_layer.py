@@ -25,6 +25,13 @@ transformer_cuda_module = TransformerBuilder().load()
 _all_layer_grads = dict()
 
 
+def _packed_cu_seqlens(cu_seqlens, device):
+    # an empty tensor is a padded batch
+    if cu_seqlens is None:
+        return torch.empty(0, dtype=torch.int, device=device)
+    return cu_seqlens.to(device=device, dtype=torch.int).contiguous()
+
+
 class LSTransformerEncoderFunc(Function):
     @staticmethod
     def forward(
@@ -33,6 +40,7 @@ class LSTransformerEncoderFunc(Function):
         input_mask,
         parameters,
         config,
+        cu_seqlens,
     ):
         cuda_module = transformer_cuda_module
         forward_func = (
@@ -51,11 +59,13 @@ class LSTransformerEncoderFunc(Function):
             config.training,
             config.pre_layer_norm,
             config.quant_mode,
+            cu_seqlens,
         )
 
         if config.is_grad_enabled and config.training:
             ctx.save_for_backward(output, input, input_mask)
             ctx.config = config
+            ctx.para = parameters
         return output
 
     @staticmethod
@@ -75,13 +85,27 @@ class LSTransformerEncoderFunc(Function):
             output = output.to(torch.half)
             input = input.to(torch.half)
             input_mask = input_mask.to(torch.half)
+        grad = _all_layer_grads[ctx.config.layer_id]
+        # para.grad is the grad buffer of the layer itself, which the next
+        # micro batches add onto until it is set to None or zeroed
+        in_place = (
+            ctx.config.accumulate_grads
+            and not ctx.config.quant_mode
+            and ctx.para.dtype == grad.dtype
+        )
         (grad_input,) = backward_func(
-            ctx.config.layer_id, grad_output, output, input, input_mask
+            ctx.config.layer_id,
+            grad_output,
+            output,
+            input,
+            input_mask,
+            in_place and ctx.para.grad is grad,
         )
 
-        grad = _all_layer_grads[ctx.config.layer_id]
-
-        return (grad_input, None, grad, None)
+        if in_place:
+            ctx.para.grad = grad
+            return (grad_input, None, None, None, None)
+        return (grad_input, None, grad, None, None)
 
 
 class LSTransformerEncoderLayer(TransformerEncoderLayerBase):
@@ -306,10 +330,13 @@ class LSTransformerEncoderLayer(TransformerEncoderLayerBase):
         )
         return destination
 
-    def forward(self, hidden_states, encoder_padding_mask, **kwargs):
+    def forward(self, hidden_states, encoder_padding_mask, cu_seqlens=None, **kwargs):
         # encoder_padding_mask is a mask for the input sequence
         # sizes are [batch_size, seq_len] or [seq_len] when batch_size = 1
         # masked value should be 1.0, unmasked value should be 0.0
+        # cu_seqlens packs several sequences in every row of the batch,
+        # sequence i is the tokens [cu_seqlens[i], cu_seqlens[i + 1]) of the
+        # flattened batch and attends only to itself, None for a padded batch
 
         self.config.training = self.training
         self.config.is_grad_enabled = torch.is_grad_enabled()
@@ -347,6 +374,7 @@ class LSTransformerEncoderLayer(TransformerEncoderLayerBase):
             encoder_padding_mask,
             self.para,
             self.config,
+            _packed_cu_seqlens(cu_seqlens, hidden_states.device),
         )
 
         return output.to(self.para)
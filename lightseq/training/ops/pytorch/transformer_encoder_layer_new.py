@@ -64,7 +64,12 @@ class LSTransformerEncoderFuncNew(Function):
             ctx.config.layer_id, grad_output, output, input, input_mask
         )
 
-        grad = _all_layer_grads[ctx.config.layer_id]
+        # the grads are all-reduced in place and read from para.grad, see
+        # set_grad_allreducer.
+        if ctx.config.overlap_grad_allreduce:
+            grad = None
+        else:
+            grad = _all_layer_grads[ctx.config.layer_id]
 
         return (grad_input, None, grad, None)
 
@@ -101,6 +106,8 @@ class LSTransformerEncoderLayerNew(TransformerEncoderLayerBase):
 
         self.create_cpp_layer()
         self.assigned_layer_weight_grad = False
+        self.grad_allreducer = None
+        self.config.overlap_grad_allreduce = False
 
         hs = self.config.hidden_size
         ims = self.config.intermediate_size
@@ -160,6 +167,13 @@ class LSTransformerEncoderLayerNew(TransformerEncoderLayerBase):
 
         # create the layer in cuda kernels.
         cuda_module = layer_cuda_module
+        # read by the dropout operators when the layer is created.
+        cuda_module.set_mask_free_dropout(self.config.mask_free_dropout)
+        cuda_module.set_capturable(self.config.capturable)
+        # read by the linear operators when the layer is created.
+        cuda_module.set_fp8_training(
+            self.config.fp8_training, self.config.fp8_amax_history_len
+        )
         create_layer_func = (
             cuda_module.create_transformer_encoder_layer_new_fp16
             if self.config.fp16
@@ -181,6 +195,26 @@ class LSTransformerEncoderLayerNew(TransformerEncoderLayerBase):
             False,  # mask_future_tokens
         )
 
+        if self.config.recompute:
+            # trade compute for the memory of the layer intermediates.
+            set_recompute_func = (
+                cuda_module.set_layer_recompute_fp16
+                if self.config.fp16
+                else cuda_module.set_layer_recompute_fp32
+            )
+            set_recompute_func("TransformerEncoderLayer", self.config.layer_id, True)
+
+    def set_grad_allreducer(self, reducer):
+        """All-reduce the grads of the layer with reducer, a LSGradAllReducer,
+        as soon as its backward is issued. The grads are then kept in
+        para.grad, so the params must be in the dtype of the layer."""
+        if self.config.fp16 and self.para.dtype != torch.half:
+            raise RuntimeError(
+                "The overlapped grad all-reduce needs the fp16 params of the layer"
+            )
+        self.grad_allreducer = reducer
+        self.config.overlap_grad_allreduce = True
+
     def _get_weights(self, i):
         return self.para.data.narrow(
             0, self.para_offset[i], self.para_offset[i + 1] - self.para_offset[i]
@@ -281,6 +315,18 @@ class LSTransformerEncoderLayerNew(TransformerEncoderLayerBase):
         grad = torch.empty_like(param)
         func(param, grad, "TransformerEncoderLayer", self.config.layer_id)
         _all_layer_grads[self.config.layer_id] = grad
+        if self.grad_allreducer is not None:
+            hook_func = (
+                cuda_module.set_layer_grad_ready_hook_fp16
+                if self.config.fp16
+                else cuda_module.set_layer_grad_ready_hook_fp32
+            )
+            reducer = self.grad_allreducer
+            hook_func(
+                "TransformerEncoderLayer",
+                self.config.layer_id,
+                lambda: reducer.grad_ready(grad),
+            )
 
     def state_dict(self, destination=None, prefix="", keep_vars=False):
         destination = state_dict(
@@ -307,6 +353,9 @@ class LSTransformerEncoderLayerNew(TransformerEncoderLayerBase):
                 self.register_buffer("para_16", self.para.clone().detach().half())
 
         self.assign_layer_weight_grad()
+        if self.grad_allreducer is not None:
+            # again every step, zero_grad may set it to None.
+            self.para.grad = _all_layer_grads[self.config.layer_id]
 
         bs, sl, dim = hidden_states.size()
         if bs * sl > self.config.max_batch_tokens:
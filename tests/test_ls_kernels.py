@@ -412,6 +412,210 @@ def test_launch_attn_softmax_bw_new():
     return custom, baseline
 
 
+@kt.case(atol=1e-2, rtol=1e-2)
+def test_launch_flash_attention():
+    nhead = kt.nhead
+    batch_size, kv_len = kt.bs_sl()
+    # a single query takes the split decoding kernel.
+    q_len = random.choice([1, random.randint(1, kv_len)])
+    kv_size = kv_len + random.randint(0, 8)
+    kv_head_num = random.choice([nhead, nhead // 4, 1])
+    head_dim = random.choice(range(8, 129, 8))
+    mask_future = random.choice([True, False])
+    print(
+        "(batch_size, nhead, kv_head_num, q_len, kv_len, kv_size, head_dim, "
+        "mask_future): "
+        f"({batch_size}, {nhead}, {kv_head_num}, {q_len}, {kv_len}, {kv_size}, "
+        f"{head_dim}, {mask_future})"
+    )
+
+    q = kt.rand((batch_size, nhead, q_len, head_dim))
+    k = kt.rand((batch_size, kv_head_num, kv_size, head_dim))
+    v = kt.rand((batch_size, kv_head_num, kv_size, head_dim))
+    mask = kt.attn_mask(batch_size, kv_size) * -1e4
+    # kFlashMaxPartials * (head_dim + 2) floats
+    workspace = torch.zeros(
+        (2048 * (head_dim + 2),), dtype=torch.float, device=kt.device
+    )
+    out = kt.zeros((batch_size, nhead, q_len, head_dim))
+
+    if kt.dtype == torch.float:
+        func = cuda_module.torch_launch_flash_attention_fp32
+    else:
+        func = cuda_module.torch_launch_flash_attention_fp16
+
+    def custom():
+        func(
+            q, k, v, mask, out, workspace, batch_size, nhead, q_len, kv_len,
+            kv_size, head_dim, mask_future, kv_head_num,
+        )
+        return kt.norm_res_list(out)
+
+    def baseline():
+        group = nhead // kv_head_num
+        f_k = k[:, :, :kv_len].float().repeat_interleave(group, dim=1)
+        f_v = v[:, :, :kv_len].float().repeat_interleave(group, dim=1)
+        scores = torch.matmul(q.float(), f_k.transpose(-1, -2)) / head_dim**0.5
+        scores = scores + mask[:, :kv_len].float().unsqueeze(1).unsqueeze(1)
+        if mask_future:
+            # query i attends to the keys [0, i + kv_len - q_len]
+            future = torch.triu(
+                torch.ones(q_len, kv_len, device=kt.device),
+                diagonal=kv_len - q_len + 1,
+            )
+            scores = scores - future * 1e4
+        probs = torch.softmax(scores, dim=-1)
+        return kt.norm_res_list(torch.matmul(probs, f_v))
+
+    return custom, baseline
+
+
+@kt.case(atol=1e-2, rtol=1e-2)
+def test_launch_flash_attention_bw():
+    nhead = kt.nhead
+    batch_size, from_len = kt.bs_sl()
+    mask_future = random.choice([True, False])
+    if mask_future:
+        to_len = from_len
+    else:
+        _, to_len = kt.bs_sl(batch_size)
+    head_dim = random.choice(range(8, 129, 8))
+    print(
+        "(batch_size, nhead, from_len, to_len, head_dim, mask_future): "
+        f"({batch_size}, {nhead}, {from_len}, {to_len}, {head_dim}, {mask_future})"
+    )
+
+    q = kt.rand((batch_size, nhead, from_len, head_dim))
+    k = kt.rand((batch_size, nhead, to_len, head_dim))
+    v = kt.rand((batch_size, nhead, to_len, head_dim))
+    dout = kt.rand((batch_size, nhead, from_len, head_dim))
+    mask = kt.attn_mask(batch_size, to_len) * -1e4
+    scale = 1.0 / head_dim**0.5
+
+    if kt.dtype == torch.float:
+        train_func = cuda_module.torch_launch_flash_attention_train_fp32
+        bw_func = cuda_module.torch_launch_flash_attention_bw_fp32
+        softmax_bw_func = cuda_module.torch_launch_attn_softmax_bw_fp32
+    else:
+        train_func = cuda_module.torch_launch_flash_attention_train_fp16
+        bw_func = cuda_module.torch_launch_flash_attention_bw_fp16
+        softmax_bw_func = cuda_module.torch_launch_attn_softmax_bw_fp16
+
+    out = kt.zeros((batch_size, nhead, from_len, head_dim))
+    lse = torch.zeros(
+        (batch_size, nhead, from_len), dtype=torch.float, device=kt.device
+    )
+    train_func(
+        q, k, v, mask, out, lse, batch_size, nhead, from_len, to_len, head_dim,
+        mask_future,
+    )
+    workspace = torch.zeros_like(lse)
+
+    def custom():
+        dq = torch.empty_like(q)
+        dk = torch.empty_like(k)
+        dv = torch.empty_like(v)
+        bw_func(
+            dq, dk, dv, dout, q, k, v, mask, out, lse, workspace, batch_size,
+            nhead, from_len, to_len, head_dim, mask_future,
+        )
+        return kt.norm_res_list(dq, dk, dv)
+
+    def baseline():
+        # the backward through the attention probs of the unfused attention
+        f_q, f_k, f_v = q.float(), k.float(), v.float()
+        f_dout = dout.float()
+        scores = torch.matmul(f_q, f_k.transpose(-1, -2)) * scale
+        scores = scores + mask.float().unsqueeze(1).unsqueeze(1)
+        if mask_future:
+            future = kt.dec_self_attn_mask(to_len, torch.float) * -1e4
+            scores = scores + future
+        probs = torch.softmax(scores, dim=-1)
+        dprobs = torch.matmul(f_dout, f_v.transpose(-1, -2))
+        dscores = dprobs.to(kt.dtype).contiguous()
+        softmax_bw_func(
+            dscores, probs.to(kt.dtype).contiguous(),
+            batch_size * nhead * from_len, to_len,
+        )
+        dscores = dscores.float() * scale
+        dq = torch.matmul(dscores, f_k)
+        dk = torch.matmul(dscores.transpose(-1, -2), f_q)
+        dv = torch.matmul(probs.transpose(-1, -2), f_dout)
+        return kt.norm_res_list(dq, dk, dv)
+
+    return custom, baseline
+
+
+@kt.case(atol=1e-2, rtol=1e-2)
+def test_launch_paged_attention():
+    nhead = kt.nhead
+    batch_size = random.randint(1, 16)
+    kv_head_num = random.choice([nhead, nhead // 4, 1])
+    head_dim = random.choice(range(8, 129, 8))
+    page_size = random.choice([1, 4, 16])
+    offset_seq_len = random.randint(0, 256)
+    query_len = random.randint(1, 8)
+    kv_len = offset_seq_len + query_len
+    max_step = kv_len + random.randint(0, 16)
+    max_pages = (max_step + page_size - 1) // page_size
+    print(
+        "(batch_size, nhead, kv_head_num, head_dim, page_size, offset_seq_len, "
+        "query_len): "
+        f"({batch_size}, {nhead}, {kv_head_num}, {head_dim}, {page_size}, "
+        f"{offset_seq_len}, {query_len})"
+    )
+
+    q = kt.rand((batch_size, nhead, query_len, head_dim))
+    k = kt.rand((batch_size, kv_head_num, max_pages * page_size, head_dim))
+    v = kt.rand((batch_size, kv_head_num, max_pages * page_size, head_dim))
+    pad_mask = kt.attn_mask(batch_size, max_step) * -1e4
+
+    # scatter the sequences over the pages of a shuffled pool.
+    num_pages = batch_size * max_pages + random.randint(0, 8)
+    page_table = torch.randperm(num_pages, device=kt.device)
+    page_table = page_table[: batch_size * max_pages].view(batch_size, max_pages)
+
+    def to_pages(x):
+        pool = kt.zeros((num_pages, kv_head_num, page_size, head_dim))
+        x = x.view(batch_size, kv_head_num, max_pages, page_size, head_dim)
+        pool[page_table] = x.transpose(1, 2)
+        return pool
+
+    cache_k, cache_v = to_pages(k), to_pages(v)
+    page_table = page_table.to(torch.int32).contiguous()
+    out = kt.zeros((batch_size, nhead, query_len, head_dim))
+
+    if kt.dtype == torch.float:
+        func = cuda_module.torch_launch_paged_attention_fp32
+    else:
+        func = cuda_module.torch_launch_paged_attention_fp16
+
+    def custom():
+        func(
+            q, cache_k, cache_v, pad_mask, page_table, out, batch_size, nhead,
+            head_dim, query_len, offset_seq_len, page_size, max_pages, max_step,
+            kv_head_num,
+        )
+        return kt.norm_res_list(out)
+
+    def baseline():
+        group = nhead // kv_head_num
+        f_k = k[:, :, :kv_len].float().repeat_interleave(group, dim=1)
+        f_v = v[:, :, :kv_len].float().repeat_interleave(group, dim=1)
+        scores = torch.matmul(q.float(), f_k.transpose(-1, -2)) / head_dim**0.5
+        scores = scores + pad_mask[:, :kv_len].float().unsqueeze(1).unsqueeze(1)
+        # query i attends to the positions [0, offset_seq_len + i]
+        future = torch.triu(
+            torch.ones(query_len, kv_len, device=kt.device),
+            diagonal=offset_seq_len + 1,
+        )
+        scores = scores - future * 1e4
+        probs = torch.softmax(scores, dim=-1)
+        return kt.norm_res_list(torch.matmul(probs, f_v))
+
+    return custom, baseline
+
+
 @kt.case()
 def test_launch_fused_add2():
     batch_size, seq_len = kt.bs_sl()
@@ -645,6 +849,163 @@ def test_launch_ln_bw():
     return custom, baseline
 
 
+@kt.case(atol=1e-3, rtol=1e-2)
+def test_launch_ln_bw_fused():
+    batch_size, seq_len = kt.bs_sl()
+    bsz_seq = batch_size * seq_len
+    hidden_dim = kt.hidden_dim
+    with_mean = random.choice([True, False])
+    fuse_add = random.choice([True, False])
+    print(
+        "(batch_token_num, hidden_dim, with_mean, fuse_add): "
+        f"({bsz_seq}, {hidden_dim}, {with_mean}, {fuse_add})"
+    )
+
+    ln_input = kt.rand((bsz_seq, hidden_dim))
+    out_grad = kt.rand((bsz_seq, hidden_dim))
+    residual_grad = kt.rand((bsz_seq, hidden_dim))
+    gamma = kt.rand((hidden_dim))
+    betta = kt.rand((hidden_dim))
+    gamma_grad = kt.rand((hidden_dim))
+    betta_grad = kt.rand((hidden_dim))
+    inp_grad = kt.rand((bsz_seq, hidden_dim))
+    # ln_bw_workspace_size(hidden_dim)
+    workspace = torch.zeros(
+        (512 * 2 * hidden_dim,), dtype=torch.float, device=kt.device
+    )
+
+    ln_output = functional.layer_norm(ln_input, [hidden_dim], gamma, betta, kt.epsilon)
+    vars = ln_input.var(dim=1).contiguous()
+    means = ln_input.mean(dim=1).contiguous()
+
+    if kt.dtype == torch.float:
+        func = cuda_module.torch_launch_ln_bw_fused_fp32
+    else:
+        func = cuda_module.torch_launch_ln_bw_fused_fp16
+
+    inp_or_out = ln_input if with_mean else ln_output
+
+    def custom():
+        func(
+            gamma_grad,
+            betta_grad,
+            inp_grad,
+            out_grad,
+            residual_grad,
+            inp_or_out,
+            gamma,
+            betta,
+            vars,
+            means,
+            workspace,
+            bsz_seq,
+            hidden_dim,
+            with_mean,
+            fuse_add,
+        )
+        return [gamma_grad, betta_grad, inp_grad]
+
+    def baseline():
+        if with_mean:
+            (
+                f_out_grad,
+                f_input,
+                f_vars,
+                f_means,
+                f_betta,
+                f_gamma,
+            ) = kt.cast_fp32_tensor([out_grad, ln_input, vars, means, betta, gamma])
+            xhat = (f_input - f_means.unsqueeze(1)) * f_vars.rsqrt().unsqueeze(1)
+        else:
+            f_out_grad, f_out, f_vars, f_betta, f_gamma = kt.cast_fp32_tensor(
+                [out_grad, ln_output, vars, betta, gamma]
+            )
+            xhat = (f_out - f_betta) / f_gamma
+        dxhat = f_out_grad * f_gamma
+        f_betta_grad = f_out_grad.sum(dim=0)
+        f_gamma_grad = (f_out_grad * xhat).sum(dim=0)
+        dinp = dxhat.sum(dim=1).unsqueeze(1) + xhat * (dxhat * xhat).sum(
+            dim=1
+        ).unsqueeze(1)
+        dinp = dxhat - dinp / hidden_dim
+        dinp = dinp * f_vars.rsqrt().unsqueeze(1)
+        if fuse_add:
+            dinp = dinp + residual_grad
+        return kt.norm_res_list(f_gamma_grad, f_betta_grad, dinp)
+
+    return custom, baseline
+
+
+@kt.case(atol=1e-3, rtol=1e-2)
+def test_launch_rms_ln_bw():
+    batch_size, seq_len = kt.bs_sl()
+    bsz_seq = batch_size * seq_len
+    hidden_dim = kt.hidden_dim
+    inp_is_out = random.choice([True, False])
+    fuse_add = random.choice([True, False])
+    print(
+        "(batch_token_num, hidden_dim, inp_is_out, fuse_add): "
+        f"({bsz_seq}, {hidden_dim}, {inp_is_out}, {fuse_add})"
+    )
+
+    ln_input = kt.rand((bsz_seq, hidden_dim))
+    out_grad = kt.rand((bsz_seq, hidden_dim))
+    residual_grad = kt.rand((bsz_seq, hidden_dim))
+    gamma = kt.rand((hidden_dim))
+    gamma_grad = kt.rand((hidden_dim))
+    inp_grad = kt.rand((bsz_seq, hidden_dim))
+    workspace = torch.zeros(
+        (512 * 2 * hidden_dim,), dtype=torch.float, device=kt.device
+    )
+
+    f_input = ln_input.float()
+    f_rms_vars = (f_input.pow(2).mean(dim=1) + 1e-6).rsqrt()
+    rms_vars = f_rms_vars.to(kt.dtype).contiguous()
+    ln_output = (f_input * f_rms_vars.unsqueeze(1) * gamma.float()).to(kt.dtype)
+
+    if kt.dtype == torch.float:
+        func = cuda_module.torch_launch_rms_ln_bw_fp32
+    else:
+        func = cuda_module.torch_launch_rms_ln_bw_fp16
+
+    inp_or_out = ln_output if inp_is_out else ln_input
+
+    def custom():
+        func(
+            gamma_grad,
+            inp_grad,
+            out_grad,
+            residual_grad,
+            inp_or_out,
+            gamma,
+            rms_vars,
+            workspace,
+            bsz_seq,
+            hidden_dim,
+            inp_is_out,
+            fuse_add,
+        )
+        return [gamma_grad, inp_grad]
+
+    def baseline():
+        f_out_grad, f_gamma, f_vars = kt.cast_fp32_tensor(
+            [out_grad, gamma, rms_vars]
+        )
+        if inp_is_out:
+            xhat = ln_output.float() / f_gamma
+        else:
+            xhat = f_input * f_vars.unsqueeze(1)
+        dxhat = f_out_grad * f_gamma
+        f_gamma_grad = (f_out_grad * xhat).sum(dim=0)
+        dinp = dxhat - xhat * (dxhat * xhat).sum(dim=1).unsqueeze(1) / hidden_dim
+        dinp = dinp * f_vars.unsqueeze(1)
+        if fuse_add:
+            dinp = dinp + residual_grad
+        return kt.norm_res_list(f_gamma_grad, dinp)
+
+    return custom, baseline
+
+
 @kt.case(atol=1e-3, rtol=1e-2)
 def test_launch_ln_i8O_bw():
     batch_size, seq_len = kt.bs_sl()
@@ -866,6 +1227,115 @@ def test_adam():
     return custom, baseline
 
 
+@kt.case(atol=1e-4, rtol=1e-3)
+def test_multi_tensor_optimizer():
+    lamb = random.choice([True, False])
+    num_tensors = random.randint(1, 8)
+    sizes = [random.randint(1, 100000) for _ in range(num_tensors)]
+    step = random.randint(1, 10)
+    grad_scale = random.choice([1.0, 128.0])
+    max_grad_norm = random.choice([0.0, 1.0])
+    with_inf = random.choice([True, False])
+    with_copy = kt.dtype != torch.float
+    lr, beta1, beta2, eps, decay = 1e-3, 0.9, 0.999, 1e-8, 1e-2
+    print(
+        "(lamb, sizes, step, grad_scale, max_grad_norm, with_inf): "
+        f"({lamb}, {sizes}, {step}, {grad_scale}, {max_grad_norm}, {with_inf})"
+    )
+
+    grads = [kt.rand((size,)) * grad_scale for size in sizes]
+    if with_inf:
+        grads[-1][-1] = float("inf")
+    init_params = [kt.rand((size,)).float() for size in sizes]
+    init_exp_avgs = [kt.rand((size,)).float() * 0.1 for size in sizes]
+    init_exp_avg_sqs = [kt.rand((size,)).float().abs() * 0.1 for size in sizes]
+    params = [p.clone() for p in init_params]
+    exp_avgs = [m.clone() for m in init_exp_avgs]
+    exp_avg_sqs = [v.clone() for v in init_exp_avg_sqs]
+    copies = [kt.zeros((size,)) for size in sizes]
+    tensor_lists = [grads, params, exp_avgs, exp_avg_sqs]
+    if with_copy:
+        tensor_lists.append(copies)
+
+    update_func = (
+        adam_module.multi_tensor_lamb if lamb else adam_module.multi_tensor_adamw
+    )
+
+    def custom():
+        for t, init_t in zip(
+            params + exp_avgs + exp_avg_sqs,
+            init_params + init_exp_avgs + init_exp_avg_sqs,
+        ):
+            t.copy_(init_t)
+        noop_flag = torch.zeros(1, dtype=torch.int, device=kt.device)
+        grad_norm = adam_module.multi_tensor_grad_norm(noop_flag, grads)
+        # eps_mode 1, sqrt(v) + eps
+        update_func(
+            noop_flag,
+            tensor_lists,
+            grad_norm,
+            lr,
+            beta1,
+            beta2,
+            eps,
+            grad_scale,
+            max_grad_norm,
+            step,
+            1,
+            1,
+            decay,
+        )
+        res = [grad_norm, noop_flag.float()] + params + exp_avgs + exp_avg_sqs
+        if with_copy and not with_inf:
+            res += [p.float() for p in copies]
+        return res
+
+    def baseline():
+        f_grads = [g.float() for g in grads]
+        grad_norm = torch.stack([g.pow(2).sum() for g in f_grads]).sum().sqrt()
+        if with_inf:
+            # the step is skipped
+            res = [grad_norm.view(1), torch.ones(1, device=kt.device)]
+            return res + init_params + init_exp_avgs + init_exp_avg_sqs
+
+        scale = grad_scale
+        if max_grad_norm > 0:
+            clip = (grad_norm.item() / grad_scale + 1e-6) / max_grad_norm
+            if clip > 1:
+                scale = clip * grad_scale
+        bias_correction1 = 1 - beta1**step
+        bias_correction2 = 1 - beta2**step
+        base_params, base_exp_avgs, base_exp_avg_sqs = [], [], []
+        for g, p, m, v in zip(
+            f_grads, init_params, init_exp_avgs, init_exp_avg_sqs
+        ):
+            g = g / scale
+            m = beta1 * m + (1 - beta1) * g
+            v = beta2 * v + (1 - beta2) * g * g
+            if lamb:
+                update = (m / bias_correction1) / (
+                    (v / bias_correction2).sqrt() + eps
+                ) + decay * p
+                p_norm, u_norm = p.norm(), update.norm()
+                step_size = lr
+                if p_norm > 0 and u_norm > 0:
+                    step_size = lr * p_norm / u_norm
+                p = p - step_size * update
+            else:
+                step_size = lr * bias_correction2**0.5 / bias_correction1
+                p = p * (1 - lr * decay) - step_size * m / (v.sqrt() + eps)
+            base_params.append(p)
+            base_exp_avgs.append(m)
+            base_exp_avg_sqs.append(v)
+        res = [grad_norm.view(1), torch.zeros(1, device=kt.device)]
+        res += base_params + base_exp_avgs + base_exp_avg_sqs
+        if with_copy:
+            res += [p.to(kt.dtype).float() for p in base_params]
+        return res
+
+    return custom, baseline
+
+
 @kt.case(dtypes=[torch.float, torch.half], ntest=5, atol=1e-2, rtol=1e-2)
 def test_launch_dropout_relu_bias():
     batch_size, seq_len = kt.bs_sl()
@@ -1052,54 +1522,486 @@ def test_launch_dropout_gelu_bias_bwd():
 from torch_crf import CRF
 
 
-@kt.case(dtypes=[torch.half], atol=5.0)
-def test_crf():
-    batch_size = 129
-    seq_len = 33
-    num_tags = 41
-    torch_mask = ~kt.attn_mask(batch_size, seq_len, torch.bool)
-    # torch_mask = kt.ones((batch_size, seq_len)).to(torch.bool)
-    ls_mask = torch_mask.clone()
-    ls_mask = (~ls_mask).to(dtype=torch.half) * (-100000000.0)
-
-    emissions = kt.rand((batch_size, seq_len, num_tags))
-    crf = CRF(num_tags, batch_first=True)
-    crf.to(kt.device, torch.float)
-    crf.start_transitions.data.to(torch.half).to(torch.float)
-    crf.end_transitions.data.to(torch.half).to(torch.float)
-    crf.transitions.data.to(torch.half).to(torch.float)
+@kt.case(atol=1e-2, rtol=1e-2)
+def test_launch_dropout_mask_free():
+    batch_size, seq_len = kt.bs_sl()
+    hidden_dim = kt.hidden_dim
+    total_count = batch_size * seq_len * hidden_dim
+    ratio = random.choice([0.1, 0.5])
+    seed = random.randint(0, 10000)
+    print("test shape:", (batch_size, seq_len, hidden_dim), "ratio:", ratio)
 
-    """
-    torch_launch_viterbi(const torch::Tensor &start_transition,
-                          const torch::Tensor &end_transition,
-                          const torch::Tensor &transition,
-                          const torch::Tensor &emission,
-                          const torch::Tensor &mask, torch::Tensor &score,
-                          torch::Tensor &next_score, torch::Tensor &history,
-                          torch::Tensor &best_tags, int num_tags, int seq_len,
-                          int batch_size)
-    """
-    start_transition = (
-        crf.start_transitions.data.clone().detach().to(kt.dtype).contiguous()
-    )
-    end_transition = crf.end_transitions.data.clone().detach().to(kt.dtype).contiguous()
-    transitions = (
-        crf.transitions.data.clone().detach().transpose(0, 1).to(kt.dtype).contiguous()
+    test_input = kt.rand((batch_size, seq_len, hidden_dim))
+    test_out_grad = kt.rand((batch_size, seq_len, hidden_dim))
+    test_out_cus = kt.zeros((batch_size, seq_len, hidden_dim))
+    test_in_grad_cus = kt.zeros((batch_size, seq_len, hidden_dim))
+    test_mask = torch.zeros(
+        (batch_size, seq_len, hidden_dim), dtype=torch.uint8, device=kt.device
     )
 
-    best_score = kt.zeros((batch_size)).to(dtype=torch.float)
-    history = kt.ones((batch_size, seq_len, num_tags)).to(dtype=torch.int32)
-    best_tags = kt.zeros((batch_size, seq_len)).to(dtype=torch.int32)
+    if kt.dtype == torch.float:
+        cus_func = cuda_module.torch_launch_ls_dropout_fp32
+    else:
+        cus_func = cuda_module.torch_launch_ls_dropout_fp16
 
-    cus_func = cuda_module.torch_launch_viterbi_fp16
+    # the stored mask of the seed, which the mask free kernels redraw.
+    cus_func(
+        test_out_cus, test_mask, test_input, total_count, ratio, False, seed, False
+    )
 
     def custom():
         cus_func(
-            start_transition,
-            end_transition,
-            transitions,
-            emissions,
-            ls_mask,
+            test_out_cus, test_mask, test_input, total_count, ratio, False, seed, True
+        )
+        cus_func(
+            test_in_grad_cus,
+            test_mask,
+            test_out_grad,
+            total_count,
+            ratio,
+            True,
+            seed,
+            True,
+        )
+        return [test_out_cus, test_in_grad_cus]
+
+    def baseline():
+        scale = test_mask / (1 - ratio)
+        return kt.norm_res_list(test_input * scale, test_out_grad * scale)
+
+    return custom, baseline
+
+
+@kt.case(atol=1e-2, rtol=1e-2)
+def test_launch_dropout_res_bias_mask_free():
+    batch_size, seq_len = kt.bs_sl()
+    hidden_dim = kt.hidden_dim
+    ratio = random.choice([0.1, 0.5])
+    seed = random.randint(0, 10000)
+    print("test shape:", (batch_size, seq_len, hidden_dim), "ratio:", ratio)
+
+    test_input = kt.rand((batch_size, seq_len, hidden_dim))
+    test_bias = kt.rand((hidden_dim,))
+    test_residual = kt.rand((batch_size, seq_len, hidden_dim))
+    test_out_grad = kt.rand((batch_size, seq_len, hidden_dim))
+    test_out_cus = kt.zeros((batch_size, seq_len, hidden_dim))
+    test_in_grad_cus = kt.zeros((batch_size, seq_len, hidden_dim))
+    test_bias_grad_cus = kt.zeros((hidden_dim,))
+    test_mask = torch.zeros(
+        (batch_size, seq_len, hidden_dim), dtype=torch.uint8, device=kt.device
+    )
+
+    if kt.dtype == torch.float:
+        fw_func = cuda_module.torch_launch_ls_dropout_res_bias_fp32
+        bw_func = cuda_module.torch_launch_ls_dropout_bias_bwd_fp32
+    else:
+        fw_func = cuda_module.torch_launch_ls_dropout_res_bias_fp16
+        bw_func = cuda_module.torch_launch_ls_dropout_bias_bwd_fp16
+
+    def forward(mask_free):
+        fw_func(
+            test_out_cus,
+            test_mask,
+            test_input,
+            test_bias,
+            test_residual,
+            batch_size * seq_len,
+            hidden_dim,
+            ratio,
+            seed,
+            mask_free,
+        )
+
+    # the stored mask of the seed, which the mask free kernels redraw.
+    forward(False)
+
+    def custom():
+        forward(True)
+        bw_func(
+            test_in_grad_cus,
+            test_bias_grad_cus,
+            test_out_grad,
+            test_mask,
+            batch_size * seq_len,
+            hidden_dim,
+            ratio,
+            seed,
+            True,
+        )
+        return [test_out_cus, test_in_grad_cus, test_bias_grad_cus]
+
+    def baseline():
+        scale = test_mask / (1 - ratio)
+        out = (test_input.float() + test_bias.float()) * scale + test_residual
+        in_grad = test_out_grad.float() * scale
+        bias_grad = in_grad.sum(dim=(0, 1))
+        return kt.norm_res_list(out, in_grad, bias_grad)
+
+    return custom, baseline
+
+
+@kt.case(atol=1e-2, rtol=1e-2)
+def test_launch_dropout_act_bias_mask_free():
+    batch_size, seq_len = kt.bs_sl()
+    hidden_dim = kt.hidden_dim
+    act = random.choice(["relu", "gelu"])
+    ratio = random.choice([0.1, 0.5])
+    seed = random.randint(0, 10000)
+    print(
+        "test shape:", (batch_size, seq_len, hidden_dim), "act:", act, "ratio:", ratio
+    )
+
+    test_input = kt.rand((batch_size, seq_len, hidden_dim))
+    test_bias = kt.rand((hidden_dim,))
+    test_out_grad = kt.rand((batch_size, seq_len, hidden_dim))
+    test_out_cus = kt.zeros((batch_size, seq_len, hidden_dim))
+    test_in_grad_cus = kt.zeros((batch_size, seq_len, hidden_dim))
+    test_bias_grad_cus = kt.zeros((hidden_dim,))
+    test_mask = torch.zeros(
+        (batch_size, seq_len, hidden_dim), dtype=torch.uint8, device=kt.device
+    )
+
+    suffix = "fp32" if kt.dtype == torch.float else "fp16"
+    fw_func = getattr(cuda_module, f"torch_launch_ls_dropout_{act}_bias_seed_{suffix}")
+    bw_func = getattr(
+        cuda_module, f"torch_launch_ls_dropout_{act}_bias_bwd_seed_{suffix}"
+    )
+    act_func = getattr(torch.nn.functional, act)
+
+    def forward(mask_free):
+        fw_func(
+            test_out_cus,
+            test_mask,
+            test_input,
+            test_bias,
+            batch_size * seq_len,
+            hidden_dim,
+            ratio,
+            seed,
+            mask_free,
+        )
+
+    # the stored mask of the seed, which the mask free kernels redraw.
+    forward(False)
+
+    def custom():
+        forward(True)
+        bw_func(
+            test_in_grad_cus,
+            test_bias_grad_cus,
+            test_mask,
+            test_input,
+            test_bias,
+            test_out_grad,
+            batch_size * seq_len,
+            hidden_dim,
+            ratio,
+            seed,
+            True,
+        )
+        return [test_out_cus, test_in_grad_cus, test_bias_grad_cus]
+
+    def baseline():
+        f_input = test_input.float().requires_grad_()
+        f_bias = test_bias.float().requires_grad_()
+        out = act_func(f_input + f_bias) * test_mask / (1 - ratio)
+        (out * test_out_grad.float()).sum().backward()
+        return kt.norm_res_list(out.detach(), f_input.grad, f_bias.grad)
+
+    return custom, baseline
+
+
+@kt.case(atol=1e-2, rtol=1e-2)
+def test_launch_dropout_res_bias_ln():
+    batch_size, seq_len = kt.bs_sl()
+    bsz_seq = batch_size * seq_len
+    hidden_dim = kt.hidden_dim
+    ratio = random.choice([0, 0.1, 0.5])
+    seed = random.randint(0, 10000)
+    print(
+        "(batch_token_num, hidden_dim, ratio): "
+        f"({bsz_seq}, {hidden_dim}, {ratio})"
+    )
+
+    inp = kt.rand((bsz_seq, hidden_dim))
+    bias = kt.rand((hidden_dim,))
+    residual = kt.rand((bsz_seq, hidden_dim))
+    gamma = kt.rand((hidden_dim,))
+    betta = kt.rand((hidden_dim,))
+    ln_res = kt.zeros((bsz_seq, hidden_dim))
+    res_out = kt.zeros((bsz_seq, hidden_dim))
+    vars = kt.zeros((bsz_seq,))
+    means = kt.zeros((bsz_seq,))
+    mask = torch.zeros((bsz_seq, hidden_dim), dtype=torch.uint8, device=kt.device)
+
+    if kt.dtype == torch.float:
+        func = cuda_module.torch_launch_ls_dropout_res_bias_ln_fp32
+    else:
+        func = cuda_module.torch_launch_ls_dropout_res_bias_ln_fp16
+
+    def run():
+        func(
+            ln_res,
+            res_out,
+            vars,
+            means,
+            mask,
+            inp,
+            bias,
+            residual,
+            gamma,
+            betta,
+            bsz_seq,
+            hidden_dim,
+            ratio,
+            seed,
+        )
+
+    # the mask of a seed, which the baseline applies.
+    run()
+    base_mask = mask.clone()
+
+    def custom():
+        run()
+        return [ln_res, res_out, vars, means, mask]
+
+    def baseline():
+        f_inp, f_bias, f_residual = kt.cast_fp32_tensor([inp, bias, residual])
+        f_res = (f_inp + f_bias) * base_mask / (1 - ratio) + f_residual
+        # the statistics of the stored sum
+        f_res = f_res.to(kt.dtype).float()
+        f_means = f_res.mean(dim=1)
+        f_vars = f_res.var(dim=1, unbiased=False) + kt.epsilon
+        f_ln = (f_res - f_means.unsqueeze(1)) * f_vars.rsqrt().unsqueeze(1)
+        f_ln = f_ln * gamma.float() + betta.float()
+        res = kt.norm_res_list(f_ln, f_res, f_vars, f_means)
+        return res + [base_mask]
+
+    return custom, baseline
+
+
+@kt.case(atol=1e-2, rtol=1e-2)
+def test_launch_dropout_res_bias_ln_bw():
+    batch_size, seq_len = kt.bs_sl()
+    bsz_seq = batch_size * seq_len
+    hidden_dim = kt.hidden_dim
+    ratio = random.choice([0, 0.1, 0.5])
+    seed = random.randint(0, 10000)
+    with_res_out_grad = random.choice([True, False])
+    residual_cover = random.choice([True, False])
+    redraw_mask = random.choice([True, False])
+    print(
+        "(batch_token_num, hidden_dim, ratio, with_res_out_grad, "
+        "residual_cover, redraw_mask): "
+        f"({bsz_seq}, {hidden_dim}, {ratio}, {with_res_out_grad}, "
+        f"{residual_cover}, {redraw_mask})"
+    )
+
+    inp = kt.rand((bsz_seq, hidden_dim))
+    bias = kt.rand((hidden_dim,))
+    residual = kt.rand((bsz_seq, hidden_dim))
+    gamma = kt.rand((hidden_dim,))
+    betta = kt.rand((hidden_dim,))
+    ln_res = kt.zeros((bsz_seq, hidden_dim))
+    res_out = kt.zeros((bsz_seq, hidden_dim))
+    vars = kt.zeros((bsz_seq,))
+    means = kt.zeros((bsz_seq,))
+    mask = torch.zeros((bsz_seq, hidden_dim), dtype=torch.uint8, device=kt.device)
+
+    out_grad = kt.rand((bsz_seq, hidden_dim))
+    res_out_grad = kt.rand((bsz_seq, hidden_dim))
+    residual_grad_init = kt.rand((bsz_seq, hidden_dim))
+    residual_grad = residual_grad_init.clone()
+    inp_grad = kt.zeros((bsz_seq, hidden_dim))
+    bias_grad = kt.zeros((hidden_dim,))
+    gamma_grad = kt.zeros((hidden_dim,))
+    betta_grad = kt.zeros((hidden_dim,))
+    # ln_dropout_bw_workspace_size(hidden_dim)
+    workspace = torch.zeros(
+        (512 * 3 * hidden_dim,), dtype=torch.float, device=kt.device
+    )
+
+    if kt.dtype == torch.float:
+        fw_func = cuda_module.torch_launch_ls_dropout_res_bias_ln_fp32
+        bw_func = cuda_module.torch_launch_ls_dropout_res_bias_ln_bw_fp32
+    else:
+        fw_func = cuda_module.torch_launch_ls_dropout_res_bias_ln_fp16
+        bw_func = cuda_module.torch_launch_ls_dropout_res_bias_ln_bw_fp16
+
+    fw_func(
+        ln_res,
+        res_out,
+        vars,
+        means,
+        mask,
+        inp,
+        bias,
+        residual,
+        gamma,
+        betta,
+        bsz_seq,
+        hidden_dim,
+        ratio,
+        seed,
+    )
+
+    def custom():
+        residual_grad.copy_(residual_grad_init)
+        bw_func(
+            inp_grad,
+            bias_grad,
+            residual_grad,
+            gamma_grad,
+            betta_grad,
+            out_grad,
+            res_out_grad,
+            res_out,
+            gamma,
+            vars,
+            means,
+            mask,
+            workspace,
+            bsz_seq,
+            hidden_dim,
+            ratio,
+            seed,
+            with_res_out_grad,
+            residual_cover,
+            redraw_mask,
+        )
+        return [inp_grad, bias_grad, residual_grad, gamma_grad, betta_grad]
+
+    def baseline():
+        f_out_grad, f_res, f_vars, f_means, f_gamma = kt.cast_fp32_tensor(
+            [out_grad, res_out, vars, means, gamma]
+        )
+        xhat = (f_res - f_means.unsqueeze(1)) * f_vars.rsqrt().unsqueeze(1)
+        dxhat = f_out_grad * f_gamma
+        f_betta_grad = f_out_grad.sum(dim=0)
+        f_gamma_grad = (f_out_grad * xhat).sum(dim=0)
+        dres = dxhat.sum(dim=1).unsqueeze(1) + xhat * (dxhat * xhat).sum(
+            dim=1
+        ).unsqueeze(1)
+        dres = dxhat - dres / hidden_dim
+        dres = dres * f_vars.rsqrt().unsqueeze(1)
+        if with_res_out_grad:
+            dres = dres + res_out_grad.float()
+        dinp = dres * mask / (1 - ratio)
+        f_bias_grad = dinp.sum(dim=0)
+        if not residual_cover:
+            dres = dres + residual_grad_init.float()
+        return kt.norm_res_list(
+            dinp, f_bias_grad, dres, f_gamma_grad, f_betta_grad
+        )
+
+    return custom, baseline
+
+
+@kt.case(dtypes=[torch.half], atol=5.0)
+def test_crf():
+    batch_size = 129
+    seq_len = 33
+    num_tags = 41
+    torch_mask = ~kt.attn_mask(batch_size, seq_len, torch.bool)
+    # torch_mask = kt.ones((batch_size, seq_len)).to(torch.bool)
+    ls_mask = torch_mask.clone()
+    ls_mask = (~ls_mask).to(dtype=torch.half) * (-100000000.0)
+
+    emissions = kt.rand((batch_size, seq_len, num_tags))
+    crf = CRF(num_tags, batch_first=True)
+    crf.to(kt.device, torch.float)
+    crf.start_transitions.data.to(torch.half).to(torch.float)
+    crf.end_transitions.data.to(torch.half).to(torch.float)
+    crf.transitions.data.to(torch.half).to(torch.float)
+
+    """
+    torch_launch_viterbi(const torch::Tensor &start_transition,
+                          const torch::Tensor &end_transition,
+                          const torch::Tensor &transition,
+                          const torch::Tensor &emission,
+                          const torch::Tensor &mask, torch::Tensor &score,
+                          torch::Tensor &next_score, torch::Tensor &history,
+                          torch::Tensor &best_tags, int num_tags, int seq_len,
+                          int batch_size)
+    """
+    start_transition = (
+        crf.start_transitions.data.clone().detach().to(kt.dtype).contiguous()
+    )
+    end_transition = crf.end_transitions.data.clone().detach().to(kt.dtype).contiguous()
+    transitions = (
+        crf.transitions.data.clone().detach().transpose(0, 1).to(kt.dtype).contiguous()
+    )
+
+    best_score = kt.zeros((batch_size)).to(dtype=torch.float)
+    history = kt.ones((batch_size, seq_len, num_tags)).to(dtype=torch.int32)
+    best_tags = kt.zeros((batch_size, seq_len)).to(dtype=torch.int32)
+
+    cus_func = cuda_module.torch_launch_viterbi_fp16
+
+    def custom():
+        cus_func(
+            start_transition,
+            end_transition,
+            transitions,
+            emissions,
+            ls_mask,
+            best_score,
+            history,
+            best_tags,
+            num_tags,
+            seq_len,
+            batch_size,
+        )
+        return [best_tags, best_score]
+
+    def baseline():
+        res, best_score = crf.decode(emissions, torch_mask, pad_tag=-1)
+        return [
+            res.detach().to(torch.int32),
+            best_score.detach().to(torch.float),
+        ]
+
+    return custom, baseline
+
+
+@kt.case(dtypes=[torch.half], atol=5.0)
+def test_crf_varlen():
+    # more tags than a warp, with the transition tiled in shared memory.
+    batch_size = 17
+    seq_len = 129
+    num_tags = 211
+    torch_mask = ~kt.attn_mask(batch_size, seq_len, torch.bool)
+    seq_lens = torch_mask.sum(dim=1).to(torch.int32)
+    cu_seqlens = torch.cat(
+        [kt.zeros((1,)).to(torch.int32), seq_lens.cumsum(0).to(torch.int32)]
+    ).contiguous()
+
+    emissions = kt.rand((batch_size, seq_len, num_tags))
+    packed_emissions = emissions[torch_mask].contiguous()
+    crf = CRF(num_tags, batch_first=True)
+    crf.to(kt.device, torch.float)
+
+    start_transition = (
+        crf.start_transitions.data.clone().detach().to(kt.dtype).contiguous()
+    )
+    end_transition = crf.end_transitions.data.clone().detach().to(kt.dtype).contiguous()
+    transitions = (
+        crf.transitions.data.clone().detach().transpose(0, 1).to(kt.dtype).contiguous()
+    )
+
+    best_score = kt.zeros((batch_size)).to(dtype=torch.float)
+    history = kt.ones((packed_emissions.shape[0], num_tags)).to(dtype=torch.int32)
+    best_tags = kt.zeros((batch_size, seq_len)).to(dtype=torch.int32)
+
+    cus_func = cuda_module.torch_launch_viterbi_varlen_fp16
+
+    def custom():
+        cus_func(
+            start_transition,
+            end_transition,
+            transitions,
+            packed_emissions,
+            cu_seqlens,
             best_score,
             history,
             best_tags,
@@ -1119,6 +2021,377 @@ def test_crf():
     return custom, baseline
 
 
+@kt.case(atol=1e-2, rtol=1e-2)
+def test_crf_nll():
+    batch_size = random.randint(1, 64)
+    seq_len = random.randint(1, 64)
+    num_tags = random.choice([9, 41, 211])
+    print(
+        "(batch_size, seq_len, num_tags): "
+        f"({batch_size}, {seq_len}, {num_tags})"
+    )
+    torch_mask = ~kt.attn_mask(batch_size, seq_len, torch.bool)
+    ls_mask = (~torch_mask).to(dtype=kt.dtype) * (-100000000.0)
+
+    emissions = kt.rand((batch_size, seq_len, num_tags))
+    tags = torch.randint(0, num_tags, (batch_size, seq_len), device=kt.device)
+    grad_nll = torch.rand((batch_size,), device=kt.device)
+    crf = CRF(num_tags, batch_first=True)
+    crf.to(kt.device, torch.float)
+    # the parameters the kernels see
+    for param in crf.parameters():
+        param.data = param.data.to(kt.dtype).float()
+
+    start_transition = crf.start_transitions.data.to(kt.dtype).contiguous()
+    end_transition = crf.end_transitions.data.to(kt.dtype).contiguous()
+    transitions = crf.transitions.data.transpose(0, 1).to(kt.dtype).contiguous()
+    ls_tags = tags.to(torch.int32).contiguous()
+
+    nll = torch.zeros((batch_size,), dtype=torch.float, device=kt.device)
+    log_z = torch.zeros_like(nll)
+    alpha = torch.zeros(
+        (batch_size * seq_len, num_tags), dtype=torch.float, device=kt.device
+    )
+    grad_start_transition = torch.empty_like(start_transition)
+    grad_end_transition = torch.empty_like(end_transition)
+    grad_transition = torch.empty_like(transitions)
+    grad_emission = torch.empty_like(emissions)
+    # crf_nll_bw_workspace_size(num_tags)
+    workspace = torch.zeros(
+        (num_tags * num_tags + 3 * num_tags,), dtype=torch.float, device=kt.device
+    )
+
+    if kt.dtype == torch.float:
+        fw_func = cuda_module.torch_launch_crf_nll_fp32
+        bw_func = cuda_module.torch_launch_crf_nll_bw_fp32
+    else:
+        fw_func = cuda_module.torch_launch_crf_nll_fp16
+        bw_func = cuda_module.torch_launch_crf_nll_bw_fp16
+
+    def custom():
+        fw_func(
+            start_transition,
+            end_transition,
+            transitions,
+            emissions,
+            ls_mask,
+            ls_tags,
+            nll,
+            log_z,
+            alpha,
+            num_tags,
+            seq_len,
+            batch_size,
+        )
+        bw_func(
+            grad_start_transition,
+            grad_end_transition,
+            grad_transition,
+            grad_emission,
+            grad_nll,
+            start_transition,
+            end_transition,
+            transitions,
+            emissions,
+            ls_mask,
+            ls_tags,
+            log_z,
+            alpha,
+            workspace,
+            num_tags,
+            seq_len,
+            batch_size,
+        )
+        return [
+            nll,
+            grad_start_transition.float(),
+            grad_end_transition.float(),
+            grad_transition.float(),
+            grad_emission.float(),
+        ]
+
+    def baseline():
+        crf.zero_grad()
+        f_emissions = emissions.float().requires_grad_()
+        base_nll = -crf(f_emissions, tags, torch_mask, reduction="none")
+        (base_nll * grad_nll).sum().backward()
+        return [
+            base_nll.detach(),
+            crf.start_transitions.grad,
+            crf.end_transitions.grad,
+            crf.transitions.grad.transpose(0, 1).contiguous(),
+            f_emissions.grad,
+        ]
+
+    return custom, baseline
+
+
+@kt.case(ntest=10, atol=0, rtol=0)
+def test_launch_topp_threshold_sample():
+    batch_size = random.randint(1, 8)
+    seq_len = random.randint(1, 32)
+    max_step = seq_len + 1
+    # several tiles of the 1024 threads
+    vocab_size = random.randint(1, 5000)
+    # p 1e-6 only allows the argmax, which the rounds rarely draw from a flat
+    # row, so it is mostly reached by the fallback.
+    k = random.choice([0, 1, 5, 50])
+    p = random.choice([1e-6, 0.3, 0.9, 1.0])
+    temperature = random.choice([0.7, 1.0, 1.5])
+    repetition_penalty = random.choice([1.0, 1.3])
+    min_p = random.choice([0.0, 0.05])
+    print(
+        "(batch_size, seq_len, vocab_size): "
+        f"({batch_size}, {seq_len}, {vocab_size}), "
+        f"k: {k}, p: {p}, temperature: {temperature}, "
+        f"repetition_penalty: {repetition_penalty}, min_p: {min_p}"
+    )
+
+    logits = kt.rand((batch_size, vocab_size)) * 8
+    logit_bias = kt.rand((vocab_size,))
+    tokens = torch.randint(
+        0, vocab_size, (batch_size, max_step), dtype=torch.int32, device=kt.device
+    )
+    unfinished = torch.zeros((1,), dtype=torch.int32, device=kt.device)
+    # never sampled
+    eos_id = vocab_size
+
+    # the tokens the kernel may sample, by sorting the adjusted vocab
+    seen = torch.zeros((batch_size, vocab_size), dtype=torch.bool, device=kt.device)
+    seen.scatter_(1, tokens[:, :seq_len].long(), True)
+    adjusted = logits.float() + logit_bias.float()
+    penalized = torch.where(
+        adjusted > 0, adjusted / repetition_penalty, adjusted * repetition_penalty
+    )
+    adjusted = torch.where(seen, penalized, adjusted) / temperature
+    logit_exp = torch.exp(adjusted - adjusted.max(dim=1, keepdim=True)[0])
+    ascending = torch.sort(logit_exp, dim=1)[0]
+    suffix_mass = torch.cat(
+        [ascending.flip(1).cumsum(1).flip(1), kt.zeros((batch_size, 1)).float()],
+        dim=1,
+    )
+    # the count and the mass of the clearly larger tokens, the rounding of the
+    # kernel may go either way on the others
+    num_not_larger = torch.searchsorted(
+        ascending, logit_exp * (1 + 1e-4), right=True
+    )
+    larger_count = vocab_size - num_not_larger
+    larger_mass = suffix_mass.gather(1, num_not_larger)
+    allowed = logit_exp >= min_p * (1 - 1e-4)
+    allowed &= larger_mass < p * logit_exp.sum(dim=1, keepdim=True) * (1 + 1e-4)
+    if k > 0:
+        allowed &= larger_count < k
+
+    if kt.dtype == torch.float:
+        cus_func = cuda_module.torch_launch_topp_threshold_sample_fp32
+    else:
+        cus_func = cuda_module.torch_launch_topp_threshold_sample_fp16
+
+    def custom():
+        cus_func(
+            logits,
+            logit_bias,
+            tokens,
+            unfinished,
+            batch_size,
+            seq_len,
+            max_step,
+            vocab_size,
+            k,
+            p,
+            temperature,
+            repetition_penalty,
+            min_p,
+            eos_id,
+        )
+        sampled = tokens[:, seq_len:].long()
+        return [allowed.gather(1, sampled).float(), unfinished]
+
+    def baseline():
+        return [
+            torch.ones((batch_size, 1), device=kt.device),
+            torch.ones((1,), dtype=torch.int32, device=kt.device),
+        ]
+
+    return custom, baseline
+
+
+@kt.case(ntest=10, atol=0, rtol=0)
+def test_launch_speculative_verify():
+    num_draft = random.randint(1, 7)
+    vocab_size = random.randint(2, 5000)
+    # the first rejected draft token, num_draft if all are accepted
+    reject_idx = random.randint(0, num_draft)
+    greedy = random.choice([True, False])
+    seed = random.randint(0, 10000)
+    counter = random.randint(0, 10000)
+    print(
+        f"(num_draft, vocab_size): ({num_draft}, {vocab_size}), "
+        f"reject_idx: {reject_idx}, greedy: {greedy}"
+    )
+
+    target_logits = kt.rand((num_draft + 1, vocab_size))
+    # the tokens before reject_idx are accepted whatever the random draws: the
+    # argmax of the target, with draft rows equal to the target ones, q = p.
+    draft_logits = target_logits[:num_draft].clone()
+    draft_tokens = torch.zeros((num_draft + 1,), dtype=torch.int32, device=kt.device)
+    draft_tokens[:num_draft] = target_logits[:num_draft].argmax(dim=1)
+    if reject_idx < num_draft:
+        if greedy:
+            draft_tokens[reject_idx] = (draft_tokens[reject_idx] + 1) % vocab_size
+        else:
+            # the draft is sure of tokens the target rules out, so its token is
+            # rejected and the residual max(0, p - q) is the rest of the vocab.
+            ruled_out = torch.randperm(vocab_size, device=kt.device)[
+                : max(1, vocab_size // 8)
+            ]
+            draft_logits[reject_idx, ruled_out] += 8
+            target_logits[reject_idx, ruled_out] = -10000
+            draft_tokens[reject_idx] = ruled_out[0]
+
+    # the tokens the replacement or bonus token may be
+    target_row = target_logits[reject_idx].float()
+    if greedy:
+        allowed = torch.zeros_like(target_row, dtype=torch.bool)
+        allowed[target_row.argmax()] = True
+    else:
+        residual = torch.softmax(target_row, dim=0)
+        if reject_idx < num_draft:
+            residual -= torch.softmax(draft_logits[reject_idx].float(), dim=0)
+        allowed = residual > 0
+
+    tokens = torch.empty_like(draft_tokens)
+    num_tokens = torch.zeros((1,), dtype=torch.int32, device=kt.device)
+
+    if kt.dtype == torch.float:
+        cus_func = cuda_module.torch_launch_speculative_verify_fp32
+    else:
+        cus_func = cuda_module.torch_launch_speculative_verify_fp16
+
+    def custom():
+        tokens.copy_(draft_tokens)
+        cus_func(
+            target_logits,
+            draft_logits,
+            tokens,
+            num_tokens,
+            num_draft,
+            vocab_size,
+            greedy,
+            seed,
+            counter,
+        )
+        return [
+            tokens[:reject_idx].clone(),
+            num_tokens.clone(),
+            allowed[tokens[reject_idx].long()].float(),
+        ]
+
+    def baseline():
+        return [
+            draft_tokens[:reject_idx],
+            torch.tensor([reject_idx + 1], dtype=torch.int32, device=kt.device),
+            torch.tensor(1.0, device=kt.device),
+        ]
+
+    return custom, baseline
+
+
+@kt.case(ntest=10, atol=1e-3, rtol=1e-3)
+def test_launch_moe_route_dispatch():
+    # several tiles of 32 tokens
+    batch_tokens = random.randint(1, 300)
+    max_batch_tokens = batch_tokens + random.randint(0, 8)
+    expert_num = random.choice([2, 8, 37, 64, 256])
+    topk = random.choice([1, 2])
+    # small enough for the busy experts to drop tokens
+    capacity = random.randint(1, (batch_tokens * topk + expert_num - 1) // expert_num)
+    hidden_dim = random.choice([8, 100, 1024])
+    print(
+        "(batch_tokens, expert_num, topk, capacity, hidden_dim): "
+        f"({batch_tokens}, {expert_num}, {topk}, {capacity}, {hidden_dim})"
+    )
+
+    # distinct logits, exact in fp16, so that topk has no ties
+    gate_logits = (
+        torch.argsort(torch.rand((batch_tokens, expert_num), device=kt.device), dim=1)
+        / 64
+    ).to(kt.dtype)
+    inputs = kt.rand((batch_tokens, hidden_dim))
+    score = torch.zeros((topk, max_batch_tokens), device=kt.device)
+    expert = torch.zeros((topk, max_batch_tokens), dtype=torch.int32, device=kt.device)
+    slot = torch.zeros_like(expert)
+    expert_rows = torch.zeros((expert_num,), dtype=torch.int32, device=kt.device)
+    # moe_route_workspace_size(max_batch_tokens, expert_num)
+    workspace = torch.zeros(
+        (1 + (max_batch_tokens + 31) // 32 * expert_num,),
+        dtype=torch.int32,
+        device=kt.device,
+    )
+    output = kt.zeros((expert_num, capacity, hidden_dim))
+
+    if kt.dtype == torch.float:
+        cus_func = cuda_module.torch_launch_moe_route_dispatch_fp32
+    else:
+        cus_func = cuda_module.torch_launch_moe_route_dispatch_fp16
+
+    def custom():
+        output.zero_()
+        cus_func(
+            gate_logits,
+            inputs,
+            score,
+            expert,
+            slot,
+            expert_rows,
+            workspace,
+            output,
+            batch_tokens,
+            max_batch_tokens,
+            expert_num,
+            capacity,
+            topk,
+            hidden_dim,
+        )
+        return [
+            score[:, :batch_tokens].clone(),
+            expert[:, :batch_tokens].float(),
+            slot[:, :batch_tokens].float(),
+            expert_rows.float(),
+            output.clone(),
+        ]
+
+    def baseline():
+        probs = torch.softmax(gate_logits.float(), dim=1)
+        base_score, base_expert = probs.topk(topk, dim=1)
+        if topk > 1:
+            base_score /= base_score.sum(dim=1, keepdim=True)
+        # the slots of an expert go to its tokens in token order
+        routed = torch.zeros(
+            (batch_tokens, expert_num), dtype=torch.long, device=kt.device
+        )
+        routed.scatter_(1, base_expert, 1)
+        rank = torch.cumsum(routed, dim=0) - routed
+        base_slot = rank.gather(1, base_expert)
+        base_slot[base_slot >= capacity] = -1
+        base_rows = routed.sum(dim=0).clamp(max=capacity)
+
+        base_output = kt.zeros((expert_num, capacity, hidden_dim))
+        kept = base_slot >= 0
+        token_ids = torch.arange(batch_tokens, device=kt.device)
+        token_ids = token_ids.unsqueeze(1).expand(-1, topk)
+        base_output[base_expert[kept], base_slot[kept]] = inputs[token_ids[kept]]
+        return [
+            base_score.t(),
+            base_expert.t().float(),
+            base_slot.t().float(),
+            base_rows.float(),
+            base_output,
+        ]
+
+    return custom, baseline
+
+
 @kt.case(atol=4, rtol=1e-2)
 def test_launch_dropout_relu_bias_i8I_i8O():
     batch_size, seq_len = kt.bs_sl()
@@ -1644,14 +2917,25 @@ if __name__ == "__main__":
         # "test_launch_attn_softmax_new",
         # "test_launch_attn_softmax_bw",
         # "test_launch_attn_softmax_bw_new",
+        "test_launch_flash_attention",
+        "test_launch_flash_attention_bw",
+        "test_launch_paged_attention",
         # "test_launch_layer_norm",
         # "test_launch_ln_bw",
+        "test_launch_ln_bw_fused",
+        "test_launch_rms_ln_bw",
         # "test_launch_concat3_dim1",
         # "test_adam",
+        "test_multi_tensor_optimizer",
         # "test_launch_dropout_relu_bias",
         # "test_launch_dropout_relu_bias_bwd",
         # "test_launch_dropout_gelu_bias",
         # "test_launch_dropout_gelu_bias_bwd",
+        "test_launch_dropout_mask_free",
+        "test_launch_dropout_res_bias_mask_free",
+        "test_launch_dropout_act_bias_mask_free",
+        "test_launch_dropout_res_bias_ln",
+        "test_launch_dropout_res_bias_ln_bw",
         # "test_launch_layer_norm_i8O",
         # "test_launch_ln_i8O_bw",
         # "test_launch_dropout_relu_bias_i8I_i8O",
@@ -1665,4 +2949,9 @@ if __name__ == "__main__":
         # "test_torch_launch_ls_dequantize",
         # "test_torch_launch_fake_quantize",
         "test_crf",
+        "test_crf_varlen",
+        "test_crf_nll",
+        "test_launch_topp_threshold_sample",
+        "test_launch_speculative_verify",
+        "test_launch_moe_route_dispatch",
     )